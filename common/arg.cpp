@@ -2,6 +2,7 @@
 
 #include "chat.h"
 #include "common.h"
+#include "ggml-cpu.h" // for the CPU profile
 #include "gguf.h" // for reading GGUF splits
 #include "json-schema-to-grammar.h"
 #include "log.h"
@@ -36,7 +37,9 @@
 #if defined(LLAMA_USE_CURL)
 #include <curl/curl.h>
 #include <curl/easy.h>
+#include <atomic>
 #include <future>
+#include <mutex>
 #endif
 
 using json = nlohmann::ordered_json;
@@ -244,8 +247,150 @@ static bool curl_perform_with_retry(const std::string & url, CURL * curl, int ma
     return false;
 }
 
+// the files larger than this are downloaded in chunks of this size, by several connections at the same time
+#define DOWNLOAD_CHUNK_SIZE ((size_t) 32*1024*1024)
+
+// download the bytes of a file with ranged GET requests on n_conn connections, each writing its chunks at their offsets
+// returns false if a chunk cannot be downloaded, or if the server does not answer the ranges with 206 Partial Content
+static bool common_download_file_ranges(const std::string & url, const std::string & path, const std::string & bearer_token, size_t size, int n_conn) {
+    {
+        // create the file, the chunks are written in place
+        FILE * f = fopen(path.c_str(), "wb");
+        if (!f) {
+            LOG_ERR("%s: error opening local file for writing: %s\n", __func__, path.c_str());
+            return false;
+        }
+        fclose(f);
+    }
+
+    const size_t n_chunks = (size + DOWNLOAD_CHUNK_SIZE - 1) / DOWNLOAD_CHUNK_SIZE;
+
+    std::atomic<size_t> i_next     = 0;
+    std::atomic<size_t> downloaded = 0;
+    std::atomic<bool>   failed     = false;
+    std::mutex          progress_mutex;
+
+    auto worker = [&]() {
+        curl_ptr       curl(curl_easy_init(), &curl_easy_cleanup);
+        curl_slist_ptr http_headers;
+        std::unique_ptr<FILE, decltype(&fclose)> file(fopen(path.c_str(), "r+b"), &fclose);
+        if (!curl || !file) {
+            LOG_ERR("%s: error initializing the connection for %s\n", __func__, path.c_str());
+            failed = true;
+            return;
+        }
+
+        curl_easy_setopt(curl.get(), CURLOPT_URL, url.c_str());
+        curl_easy_setopt(curl.get(), CURLOPT_FOLLOWLOCATION, 1L);
+        curl_easy_setopt(curl.get(), CURLOPT_NOPROGRESS, 1L);
+
+        http_headers.ptr = curl_slist_append(http_headers.ptr, "User-Agent: llama-cpp");
+        if (!bearer_token.empty()) {
+            std::string auth_header = "Authorization: Bearer " + bearer_token;
+            http_headers.ptr = curl_slist_append(http_headers.ptr, auth_header.c_str());
+        }
+        curl_easy_setopt(curl.get(), CURLOPT_HTTPHEADER, http_headers.ptr);
+
+#if defined(_WIN32)
+        curl_easy_setopt(curl.get(), CURLOPT_SSL_OPTIONS, CURLSSLOPT_NATIVE_CA);
+#endif
+
+        struct chunk_state {
+            CURL * curl;
+            FILE * file;
+            size_t remaining;
+            bool   partial; // the response is 206 Partial Content
+        };
+
+        typedef size_t(*CURLOPT_WRITEFUNCTION_PTR)(void * data, size_t size, size_t nmemb, void * userdata);
+        auto write_callback = [](void * data, size_t size, size_t nmemb, void * userdata) -> size_t {
+            chunk_state * state = (chunk_state *) userdata;
+            if (!state->partial) {
+                long http_code = 0;
+                curl_easy_getinfo(state->curl, CURLINFO_RESPONSE_CODE, &http_code);
+                if (http_code != 206) {
+                    return 0; // the server ignored the range, abort the transfer
+                }
+                state->partial = true;
+            }
+            const size_t n = size * nmemb;
+            if (n > state->remaining) {
+                return 0;
+            }
+            state->remaining -= n;
+            return fwrite(data, 1, n, state->file);
+        };
+        curl_easy_setopt(curl.get(), CURLOPT_WRITEFUNCTION, static_cast<CURLOPT_WRITEFUNCTION_PTR>(write_callback));
+
+        while (!failed) {
+            const size_t i_chunk = i_next++;
+            if (i_chunk >= n_chunks) {
+                break;
+            }
+            const size_t begin = i_chunk * DOWNLOAD_CHUNK_SIZE;
+            const size_t end   = std::min(size, begin + DOWNLOAD_CHUNK_SIZE); // exclusive
+
+            const std::string range = std::to_string(begin) + "-" + std::to_string(end - 1);
+            curl_easy_setopt(curl.get(), CURLOPT_RANGE, range.c_str());
+
+            bool ok = false;
+            for (int attempt = 0; attempt < CURL_MAX_RETRY && !ok && !failed; attempt++) {
+                if (attempt > 0) {
+                    int exponential_backoff_delay = std::pow(CURL_RETRY_DELAY_SECONDS, attempt - 1) * 1000;
+                    std::this_thread::sleep_for(std::chrono::milliseconds(exponential_backoff_delay));
+                }
+
+                chunk_state state = { curl.get(), file.get(), end - begin, false };
+                curl_easy_setopt(curl.get(), CURLOPT_WRITEDATA, &state);
+#if defined(_WIN32)
+                const bool seek_ok = _fseeki64(file.get(), begin, SEEK_SET) == 0;
+#else
+                const bool seek_ok = fseeko(file.get(), begin, SEEK_SET) == 0;
+#endif
+                if (!seek_ok) {
+                    break;
+                }
+
+                CURLcode res = curl_easy_perform(curl.get());
+                if (res == CURLE_OK && state.partial && state.remaining == 0 && fflush(file.get()) == 0) {
+                    ok = true;
+                } else if (!state.partial && (res == CURLE_OK || res == CURLE_WRITE_ERROR)) {
+                    // the server does not serve ranges, retrying will not help
+                    break;
+                } else {
+                    LOG_WRN("%s: chunk %zu of %s failed: %s\n", __func__, i_chunk, path.c_str(), curl_easy_strerror(res));
+                }
+            }
+
+            if (!ok) {
+                failed = true;
+                break;
+            }
+
+            const size_t n_done = downloaded += end - begin;
+            std::lock_guard<std::mutex> lock(progress_mutex);
+            fprintf(stderr, "\r%s: %s: %.1f / %.1f MiB", __func__, path.c_str(), n_done/1024.0/1024.0, size/1024.0/1024.0);
+            fflush(stderr);
+        }
+    };
+
+    n_conn = (int) std::min<size_t>(std::max(1, n_conn), n_chunks);
+
+    std::vector<std::thread> workers;
+    for (int i = 1; i < n_conn; i++) {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (auto & w : workers) {
+        w.join();
+    }
+    fprintf(stderr, "\n");
+
+    return !failed;
+}
+
 // download one single file from remote URL to local path
-static bool common_download_file_single(const std::string & url, const std::string & path, const std::string & bearer_token, bool offline) {
+static bool common_download_file_single(const std::string & url, const std::string & path, const std::string & bearer_token, bool offline, int n_conn) {
     // Check if the file already exists locally
     auto file_exists = std::filesystem::exists(path);
 
@@ -289,6 +434,8 @@ static bool common_download_file_single(const std::string & url, const std::stri
     struct common_load_model_from_url_headers {
         std::string etag;
         std::string last_modified;
+        size_t      content_length = 0;
+        bool        accept_ranges  = false;
     };
 
     common_load_model_from_url_headers headers;
@@ -328,6 +475,8 @@ static bool common_download_file_single(const std::string & url, const std::stri
         static std::regex header_regex("([^:]+): (.*)\r\n");
         static std::regex etag_regex("ETag", std::regex_constants::icase);
         static std::regex last_modified_regex("Last-Modified", std::regex_constants::icase);
+        static std::regex content_length_regex("Content-Length", std::regex_constants::icase);
+        static std::regex accept_ranges_regex("Accept-Ranges", std::regex_constants::icase);
 
         std::string header(buffer, n_items);
         std::smatch match;
@@ -338,6 +487,10 @@ static bool common_download_file_single(const std::string & url, const std::stri
                 headers->etag = value;
             } else if (std::regex_match(key, match, last_modified_regex)) {
                 headers->last_modified = value;
+            } else if (std::regex_match(key, match, content_length_regex)) {
+                headers->content_length = std::strtoull(value.c_str(), nullptr, 10);
+            } else if (std::regex_match(key, match, accept_ranges_regex)) {
+                headers->accept_ranges = value.find("bytes") != std::string::npos;
             }
         }
         return n_items;
@@ -388,31 +541,6 @@ static bool common_download_file_single(const std::string & url, const std::stri
             }
         }
 
-        // Set the output file
-
-        struct FILE_deleter {
-            void operator()(FILE * f) const {
-                fclose(f);
-            }
-        };
-
-        std::unique_ptr<FILE, FILE_deleter> outfile(fopen(path_temporary.c_str(), "wb"));
-        if (!outfile) {
-            LOG_ERR("%s: error opening local file for writing: %s\n", __func__, path.c_str());
-            return false;
-        }
-
-        typedef size_t(*CURLOPT_WRITEFUNCTION_PTR)(void * data, size_t size, size_t nmemb, void * fd);
-        auto write_callback = [](void * data, size_t size, size_t nmemb, void * fd) -> size_t {
-            return fwrite(data, size, nmemb, (FILE *)fd);
-        };
-        curl_easy_setopt(curl.get(), CURLOPT_NOBODY, 0L);
-        curl_easy_setopt(curl.get(), CURLOPT_WRITEFUNCTION, static_cast<CURLOPT_WRITEFUNCTION_PTR>(write_callback));
-        curl_easy_setopt(curl.get(), CURLOPT_WRITEDATA, outfile.get());
-
-        //  display download progress
-        curl_easy_setopt(curl.get(), CURLOPT_NOPROGRESS, 0L);
-
         // helper function to hide password in URL
         auto llama_download_hide_password_in_url = [](const std::string & url) -> std::string {
             std::size_t protocol_pos = url.find("://");
@@ -428,23 +556,61 @@ static bool common_download_file_single(const std::string & url, const std::stri
             return url.substr(0, protocol_pos + 3) + "********" + url.substr(at_pos);
         };
 
-        // start the download
-        LOG_INF("%s: trying to download model from %s to %s (server_etag:%s, server_last_modified:%s)...\n", __func__,
-            llama_download_hide_password_in_url(url).c_str(), path.c_str(), headers.etag.c_str(), headers.last_modified.c_str());
-        bool was_perform_successful = curl_perform_with_retry(url, curl.get(), CURL_MAX_RETRY, CURL_RETRY_DELAY_SECONDS, "GET");
-        if (!was_perform_successful) {
-            return false;
+        // large files are downloaded with several connections when the server serves byte ranges
+        bool downloaded = false;
+        if (n_conn > 1 && headers.accept_ranges && headers.content_length > DOWNLOAD_CHUNK_SIZE) {
+            LOG_INF("%s: downloading %s to %s with %d connections (server_etag:%s, server_last_modified:%s)...\n", __func__,
+                llama_download_hide_password_in_url(url).c_str(), path.c_str(), n_conn, headers.etag.c_str(), headers.last_modified.c_str());
+            downloaded = common_download_file_ranges(url, path_temporary, bearer_token, headers.content_length, n_conn);
+            if (!downloaded) {
+                LOG_WRN("%s: ranged download failed, downloading with a single connection\n", __func__);
+            }
         }
 
-        long http_code = 0;
-        curl_easy_getinfo (curl.get(), CURLINFO_RESPONSE_CODE, &http_code);
-        if (http_code < 200 || http_code >= 400) {
-            LOG_ERR("%s: invalid http status code received: %ld\n", __func__, http_code);
-            return false;
-        }
+        if (!downloaded) {
+            // Set the output file
 
-        // Causes file to be closed explicitly here before we rename it.
-        outfile.reset();
+            struct FILE_deleter {
+                void operator()(FILE * f) const {
+                    fclose(f);
+                }
+            };
+
+            std::unique_ptr<FILE, FILE_deleter> outfile(fopen(path_temporary.c_str(), "wb"));
+            if (!outfile) {
+                LOG_ERR("%s: error opening local file for writing: %s\n", __func__, path.c_str());
+                return false;
+            }
+
+            typedef size_t(*CURLOPT_WRITEFUNCTION_PTR)(void * data, size_t size, size_t nmemb, void * fd);
+            auto write_callback = [](void * data, size_t size, size_t nmemb, void * fd) -> size_t {
+                return fwrite(data, size, nmemb, (FILE *)fd);
+            };
+            curl_easy_setopt(curl.get(), CURLOPT_NOBODY, 0L);
+            curl_easy_setopt(curl.get(), CURLOPT_WRITEFUNCTION, static_cast<CURLOPT_WRITEFUNCTION_PTR>(write_callback));
+            curl_easy_setopt(curl.get(), CURLOPT_WRITEDATA, outfile.get());
+
+            //  display download progress
+            curl_easy_setopt(curl.get(), CURLOPT_NOPROGRESS, 0L);
+
+            // start the download
+            LOG_INF("%s: trying to download model from %s to %s (server_etag:%s, server_last_modified:%s)...\n", __func__,
+                llama_download_hide_password_in_url(url).c_str(), path.c_str(), headers.etag.c_str(), headers.last_modified.c_str());
+            bool was_perform_successful = curl_perform_with_retry(url, curl.get(), CURL_MAX_RETRY, CURL_RETRY_DELAY_SECONDS, "GET");
+            if (!was_perform_successful) {
+                return false;
+            }
+
+            long http_code = 0;
+            curl_easy_getinfo (curl.get(), CURLINFO_RESPONSE_CODE, &http_code);
+            if (http_code < 200 || http_code >= 400) {
+                LOG_ERR("%s: invalid http status code received: %ld\n", __func__, http_code);
+                return false;
+            }
+
+            // Causes file to be closed explicitly here before we rename it.
+            outfile.reset();
+        }
 
         // Write the updated JSON metadata file.
         metadata.update({
@@ -467,13 +633,15 @@ static bool common_download_file_single(const std::string & url, const std::stri
 }
 
 // download multiple files from remote URLs to local paths
-// the input is a vector of pairs <url, path>
-static bool common_download_file_multiple(const std::vector<std::pair<std::string, std::string>> & urls, const std::string & bearer_token, bool offline) {
+// the input is a vector of pairs <url, path>, the n_conn connections are shared by the files
+static bool common_download_file_multiple(const std::vector<std::pair<std::string, std::string>> & urls, const std::string & bearer_token, bool offline, int n_conn) {
+    const int n_conn_file = std::max(1, n_conn / std::max(1, (int) urls.size()));
+
     // Prepare download in parallel
     std::vector<std::future<bool>> futures_download;
     for (auto const & item : urls) {
-        futures_download.push_back(std::async(std::launch::async, [bearer_token, offline](const std::pair<std::string, std::string> & it) -> bool {
-            return common_download_file_single(it.first, it.second, bearer_token, offline);
+        futures_download.push_back(std::async(std::launch::async, [bearer_token, offline, n_conn_file](const std::pair<std::string, std::string> & it) -> bool {
+            return common_download_file_single(it.first, it.second, bearer_token, offline, n_conn_file);
         }, item));
     }
 
@@ -490,14 +658,15 @@ static bool common_download_file_multiple(const std::vector<std::pair<std::strin
 static bool common_download_model(
         const common_params_model & model,
         const std::string & bearer_token,
-        bool offline) {
+        bool offline,
+        int n_conn) {
     // Basic validation of the model.url
     if (model.url.empty()) {
         LOG_ERR("%s: invalid model url\n", __func__);
         return false;
     }
 
-    if (!common_download_file_single(model.url, model.path, bearer_token, offline)) {
+    if (!common_download_file_single(model.url, model.path, bearer_token, offline, n_conn)) {
         return false;
     }
 
@@ -556,7 +725,7 @@ static bool common_download_model(
         }
 
         // Download in parallel
-        common_download_file_multiple(urls, bearer_token, offline);
+        common_download_file_multiple(urls, bearer_token, offline, n_conn);
     }
 
     return true;
@@ -712,12 +881,12 @@ bool common_has_curl() {
     return false;
 }
 
-static bool common_download_file_single(const std::string &, const std::string &, const std::string &, bool) {
+static bool common_download_file_single(const std::string &, const std::string &, const std::string &, bool, int) {
     LOG_ERR("error: built without CURL, cannot download model from internet\n");
     return false;
 }
 
-static bool common_download_file_multiple(const std::vector<std::pair<std::string, std::string>> &, const std::string &, bool) {
+static bool common_download_file_multiple(const std::vector<std::pair<std::string, std::string>> &, const std::string &, bool, int) {
     LOG_ERR("error: built without CURL, cannot download model from the internet\n");
     return false;
 }
@@ -725,7 +894,8 @@ static bool common_download_file_multiple(const std::vector<std::pair<std::strin
 static bool common_download_model(
         const common_params_model &,
         const std::string &,
-        bool) {
+        bool,
+        int) {
     LOG_ERR("error: built without CURL, cannot download model from the internet\n");
     return false;
 }
@@ -758,7 +928,8 @@ static handle_model_result common_params_handle_model(
         struct common_params_model & model,
         const std::string & bearer_token,
         const std::string & model_path_default,
-        bool offline) {
+        bool offline,
+        int n_conn) {
     handle_model_result result;
     // handle pre-fill default model path and url based on hf_repo and hf_file
     {
@@ -807,7 +978,7 @@ static handle_model_result common_params_handle_model(
 
     // then, download it if needed
     if (!model.url.empty()) {
-        bool ok = common_download_model(model, bearer_token, offline);
+        bool ok = common_download_model(model, bearer_token, offline, n_conn);
         if (!ok) {
             LOG_ERR("error: failed to download model from %s\n", model.url.c_str());
             exit(1);
@@ -822,6 +993,7 @@ const std::vector<ggml_type> kv_cache_types = {
     GGML_TYPE_F16,
     GGML_TYPE_BF16,
     GGML_TYPE_Q8_0,
+    GGML_TYPE_F8_E4M3,
     GGML_TYPE_Q4_0,
     GGML_TYPE_Q4_1,
     GGML_TYPE_IQ4_NL,
@@ -850,6 +1022,21 @@ static std::string get_all_kv_cache_types() {
 // CLI argument parsing functions
 //
 
+// the profile loaded by the CPU backend from GGML_CPU_PROFILE
+static bool get_cpu_profile(ggml_backend_cpu_profile & profile) {
+    ggml_backend_reg_t cpu_reg = ggml_backend_reg_by_name("CPU");
+    if (!cpu_reg || !getenv("GGML_CPU_PROFILE")) {
+        return false;
+    }
+    typedef void (*ggml_backend_cpu_get_profile_t)(ggml_backend_cpu_profile * profile);
+    ggml_backend_cpu_get_profile_t ggml_backend_cpu_get_profile_fn = (ggml_backend_cpu_get_profile_t) ggml_backend_reg_get_proc_address(cpu_reg, "ggml_backend_cpu_get_profile");
+    if (!ggml_backend_cpu_get_profile_fn) {
+        return false;
+    }
+    ggml_backend_cpu_get_profile_fn(&profile);
+    return true;
+}
+
 static bool common_params_parse_ex(int argc, char ** argv, common_params_context & ctx_arg) {
     std::string arg;
     const std::string arg_prefix = "--";
@@ -938,9 +1125,33 @@ static bool common_params_parse_ex(int argc, char ** argv, common_params_context
         }
     }
 
+    const bool n_threads_set       = params.cpuparams.n_threads       > 0;
+    const bool n_threads_batch_set = params.cpuparams_batch.n_threads > 0;
+
     postprocess_cpu_params(params.cpuparams,       nullptr);
     postprocess_cpu_params(params.cpuparams_batch, &params.cpuparams);
 
+    // the thread counts measured by llama-bench --autotune replace the defaults
+    {
+        ggml_backend_cpu_profile profile = {};
+        if (get_cpu_profile(profile)) {
+            if (!n_threads_set && profile.n_threads > 0) {
+                params.cpuparams.n_threads = profile.n_threads;
+                if (!n_threads_batch_set) {
+                    params.cpuparams_batch.n_threads = profile.n_threads;
+                }
+            }
+            if (!n_threads_batch_set && profile.n_threads_batch > 0) {
+                params.cpuparams_batch.n_threads = profile.n_threads_batch;
+            }
+        }
+    }
+
+    // cpu_get_num_math() only counts the performance cores, the efficiency cores still help the prompt processing
+    if (!n_threads_batch_set && params.batch_ecores) {
+        params.cpuparams_batch.n_threads = std::max(params.cpuparams_batch.n_threads, cpu_get_num_physical_cores());
+    }
+
     postprocess_cpu_params(params.speculative.cpuparams,       &params.cpuparams);
     postprocess_cpu_params(params.speculative.cpuparams_batch, &params.cpuparams_batch);
 
@@ -950,7 +1161,7 @@ static bool common_params_parse_ex(int argc, char ** argv, common_params_context
 
     // handle model and download
     {
-        auto res = common_params_handle_model(params.model, params.hf_token, DEFAULT_MODEL_PATH, params.offline);
+        auto res = common_params_handle_model(params.model, params.hf_token, DEFAULT_MODEL_PATH, params.offline, params.download_connections);
         if (params.no_mmproj) {
             params.mmproj = {};
         } else if (res.found_mmproj && params.mmproj.path.empty() && params.mmproj.url.empty()) {
@@ -960,12 +1171,12 @@ static bool common_params_parse_ex(int argc, char ** argv, common_params_context
         // only download mmproj if the current example is using it
         for (auto & ex : mmproj_examples) {
             if (ctx_arg.ex == ex) {
-                common_params_handle_model(params.mmproj,    params.hf_token, "", params.offline);
+                common_params_handle_model(params.mmproj,    params.hf_token, "", params.offline, params.download_connections);
                 break;
             }
         }
-        common_params_handle_model(params.speculative.model, params.hf_token, "", params.offline);
-        common_params_handle_model(params.vocoder.model,     params.hf_token, "", params.offline);
+        common_params_handle_model(params.speculative.model, params.hf_token, "", params.offline, params.download_connections);
+        common_params_handle_model(params.vocoder.model,     params.hf_token, "", params.offline, params.download_connections);
     }
 
     if (params.escape) {
@@ -1171,12 +1382,22 @@ static void add_rpc_devices(std::string servers) {
     if (!ggml_backend_rpc_add_device_fn) {
         throw std::invalid_argument("failed to find RPC device add function");
     }
+    typedef size_t (*ggml_backend_rpc_get_device_count_t)(const char * endpoint);
+    ggml_backend_rpc_get_device_count_t ggml_backend_rpc_get_device_count_fn = (ggml_backend_rpc_get_device_count_t) ggml_backend_reg_get_proc_address(rpc_reg, "ggml_backend_rpc_get_device_count");
     for (const auto & server : rpc_servers) {
-        ggml_backend_dev_t dev = ggml_backend_rpc_add_device_fn(server.c_str());
-        if (dev) {
-            ggml_backend_device_register(dev);
-        } else {
-            throw std::invalid_argument("failed to register RPC device");
+        // a server can expose several devices, the ones after the first are addressed as "host:port/i"
+        size_t n_devices = 1;
+        if (ggml_backend_rpc_get_device_count_fn && server.find('/') == std::string::npos) {
+            n_devices = std::max<size_t>(1, ggml_backend_rpc_get_device_count_fn(server.c_str()));
+        }
+        for (size_t i = 0; i < n_devices; i++) {
+            const std::string endpoint = i == 0 ? server : server + "/" + std::to_string(i);
+            ggml_backend_dev_t dev = ggml_backend_rpc_add_device_fn(endpoint.c_str());
+            if (dev) {
+                ggml_backend_device_register(dev);
+            } else {
+                throw std::invalid_argument("failed to register RPC device");
+            }
         }
     }
 }
@@ -1320,6 +1541,21 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             }
         }
     ));
+    add_opt(common_arg(
+        {"--threads-batch-ecores"},
+        "on hybrid CPUs, use the efficiency cores too during batch and prompt processing when --threads-batch is not set (default: performance cores only)",
+        [](common_params & params) {
+            params.batch_ecores = true;
+        }
+    ).set_env("LLAMA_ARG_THREADS_BATCH_ECORES"));
+    add_opt(common_arg(
+        {"--threadpool-shared"},
+        "compute on process-wide threadpools shared by the contexts (target, draft, embeddings) and the CPU backends without threads of their own (mtmd); "
+        "the graphs are computed one at a time and the idle threadpool sleeps (default: each context has its own threads)",
+        [](common_params & params) {
+            params.threadpool_shared = true;
+        }
+    ).set_env("LLAMA_ARG_THREADPOOL_SHARED"));
     add_opt(common_arg(
         {"-C", "--cpu-mask"}, "M",
         "CPU affinity mask: arbitrarily long hex. Complements cpu-range (default: \"\")",
@@ -1414,14 +1650,14 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
         [](common_params & params, const std::string & value) {
             params.lookup_cache_static = value;
         }
-    ).set_examples({LLAMA_EXAMPLE_LOOKUP}));
+    ).set_examples({LLAMA_EXAMPLE_LOOKUP, LLAMA_EXAMPLE_SERVER}));
     add_opt(common_arg(
         {"-lcd", "--lookup-cache-dynamic"}, "FNAME",
         "path to dynamic lookup cache to use for lookup decoding (updated by generation)",
         [](common_params & params, const std::string & value) {
             params.lookup_cache_dynamic = value;
         }
-    ).set_examples({LLAMA_EXAMPLE_LOOKUP}));
+    ).set_examples({LLAMA_EXAMPLE_LOOKUP, LLAMA_EXAMPLE_SERVER}));
     add_opt(common_arg(
         {"-c", "--ctx-size"}, "N",
         string_format("size of the prompt context (default: %d, 0 = loaded from model)", params.n_ctx),
@@ -1469,6 +1705,14 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.swa_full = true;
         }
     ).set_env("LLAMA_ARG_SWA_FULL"));
+    add_opt(common_arg(
+        {"--reserve-lazy"},
+        string_format("size the compute buffers for one output per sequence, they grow on the first batch that\n"
+            "requests more outputs (e.g. perplexity, embeddings) - saves memory for large vocabularies (default: %s)", params.reserve_lazy ? "true" : "false"),
+        [](common_params & params) {
+            params.reserve_lazy = true;
+        }
+    ).set_env("LLAMA_ARG_RESERVE_LAZY"));
     add_opt(common_arg(
         {"--kv-unified", "-kvu"},
         string_format("use single unified KV buffer for the KV cache of all sequences (default: %s)\n"
@@ -1552,7 +1796,7 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             }
             params.in_files.push_back(value);
         }
-    ).set_examples({LLAMA_EXAMPLE_IMATRIX}));
+    ).set_examples({LLAMA_EXAMPLE_IMATRIX, LLAMA_EXAMPLE_BATCH}));
     add_opt(common_arg(
         {"-bf", "--binary-file"}, "FNAME",
         "binary file containing the prompt (default: none)",
@@ -1964,6 +2208,13 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.sampling.grammar = read_file(value);
         }
     ).set_sparam());
+    add_opt(common_arg(
+        {"--grammar-async"},
+        "compute the grammar masks on a worker thread while the logits are computed (default: disabled)",
+        [](common_params & params) {
+            params.sampling.grammar_async = true;
+        }
+    ).set_sparam().set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_GRAMMAR_ASYNC"));
     add_opt(common_arg(
         {"-j", "--json-schema"}, "SCHEMA",
         "JSON schema to constrain generations (https://json-schema.org/), e.g. `{}` for any JSON object\nFor schemas w/ external $refs, use --grammar + example/json_schema_to_grammar.py instead",
@@ -2129,6 +2380,39 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.cache_type_v = kv_cache_type_from_str(value);
         }
     ).set_env("LLAMA_ARG_CACHE_TYPE_V"));
+    add_opt(common_arg(
+        {"--cache-f16-layers"}, "N",
+        string_format("with a quantized KV cache, keep the K and V of the first and last N layers in F16 (default: %d)", params.cache_n_layer_f16),
+        [](common_params & params, int value) {
+            if (value < 0) {
+                throw std::invalid_argument("invalid value");
+            }
+            params.cache_n_layer_f16 = value;
+        }
+    ).set_env("LLAMA_ARG_CACHE_F16_LAYERS"));
+    add_opt(common_arg(
+        {"--rs-checkpoints"}, "N",
+        string_format(
+            "recurrent and hybrid models: keep N snapshots of the state of each sequence, so that a cached prompt\n"
+            "can be reused up to the last snapshot before the first different token (default: %d)", params.n_rs_ckpt
+        ),
+        [](common_params & params, int value) {
+            if (value < 0) {
+                throw std::invalid_argument("invalid value");
+            }
+            params.n_rs_ckpt = value;
+        }
+    ).set_env("LLAMA_ARG_RS_CHECKPOINTS"));
+    add_opt(common_arg(
+        {"--rs-checkpoint-interval"}, "N",
+        string_format("number of tokens between two snapshots of the recurrent state (default: %d)", params.rs_ckpt_interval),
+        [](common_params & params, int value) {
+            if (value <= 0) {
+                throw std::invalid_argument("invalid value");
+            }
+            params.rs_ckpt_interval = value;
+        }
+    ).set_env("LLAMA_ARG_RS_CHECKPOINT_INTERVAL"));
     add_opt(common_arg(
         {"--hellaswag"},
         "compute HellaSwag score over random tasks from datafile supplied with -f",
@@ -2206,6 +2490,29 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.defrag_thold = std::stof(value);
         }
     ).set_env("LLAMA_ARG_DEFRAG_THOLD"));
+    add_opt(common_arg(
+        {"--logits-top-k"}, "N",
+        string_format("select the top N logits of each output on the device and sample only from them (default: %d, 0 = all)", params.n_logits_top_k),
+        [](common_params & params, int value) {
+            params.n_logits_top_k = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_MAIN, LLAMA_EXAMPLE_SERVER, LLAMA_EXAMPLE_SPECULATIVE}).set_env("LLAMA_ARG_LOGITS_TOP_K"));
+    add_opt(common_arg(
+        {"--logits-type"}, "TYPE",
+        "data type of the logits copied back from the device, f32, f16 or bf16 (default: f32)\n"
+        "f16 and bf16 halve the transfer and the host memory of the logits, ignored with --logits-top-k",
+        [](common_params & params, const std::string & value) {
+            if (value == "f32") {
+                params.logits_type = LLAMA_LOGITS_TYPE_F32;
+            } else if (value == "f16") {
+                params.logits_type = LLAMA_LOGITS_TYPE_F16;
+            } else if (value == "bf16") {
+                params.logits_type = LLAMA_LOGITS_TYPE_BF16;
+            } else {
+                throw std::invalid_argument("invalid value");
+            }
+        }
+    ).set_examples({LLAMA_EXAMPLE_MAIN, LLAMA_EXAMPLE_SERVER, LLAMA_EXAMPLE_SPECULATIVE}).set_env("LLAMA_ARG_LOGITS_TYPE"));
     add_opt(common_arg(
         {"-np", "--parallel"}, "N",
         string_format("number of parallel sequences to decode (default: %d)", params.n_parallel),
@@ -2294,21 +2601,70 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.use_mmap = false;
         }
     ).set_env("LLAMA_ARG_NO_MMAP"));
+    add_opt(common_arg(
+        {"--lazy-load"},
+        "return from the model load without reading the memory-mapped weights, they are paged in on a background thread\n"
+        "(skips the warmup, the first requests wait for the pages they need)",
+        [](common_params & params) {
+            params.lazy_load = true;
+        }
+    ).set_env("LLAMA_ARG_LAZY_LOAD"));
     add_opt(common_arg(
         {"--numa"}, "TYPE",
         "attempt optimizations that help on some NUMA systems\n"
         "- distribute: spread execution evenly over all nodes\n"
         "- isolate: only spawn threads on CPUs on the node that execution started on\n"
         "- numactl: use the CPU map provided by numactl\n"
+        "- mirror: like distribute, and replicate the weights on every node (requires more memory)\n"
         "if run without this previously, it is recommended to drop the system page cache before using this\n"
         "see https://github.com/ggml-org/llama.cpp/issues/1437",
         [](common_params & params, const std::string & value) {
             /**/ if (value == "distribute" || value == "") { params.numa = GGML_NUMA_STRATEGY_DISTRIBUTE; }
             else if (value == "isolate") { params.numa = GGML_NUMA_STRATEGY_ISOLATE; }
             else if (value == "numactl") { params.numa = GGML_NUMA_STRATEGY_NUMACTL; }
+            else if (value == "mirror") { params.numa = GGML_NUMA_STRATEGY_MIRROR; }
             else { throw std::invalid_argument("invalid value"); }
         }
     ).set_env("LLAMA_ARG_NUMA"));
+    add_opt(common_arg(
+        {"--cpu-mem"}, "FLAGS",
+        "comma-separated placement of the large buffers in host memory (default: none)\n"
+        "- thp: transparent hugepages\n"
+        "- hugetlb: hugepages reserved in /proc/sys/vm/nr_hugepages, transparent hugepages when none are left\n"
+        "- numa: bound to the NUMA nodes of the threads (see --numa), interleaved when there are several",
+        [](common_params & params, const std::string & value) {
+            params.cpu_mem = 0;
+            for (const auto & flag : string_split<std::string>(value, ',')) {
+                /**/ if (flag == "thp")     { params.cpu_mem |= GGML_CPU_MEM_THP; }
+                else if (flag == "hugetlb") { params.cpu_mem |= GGML_CPU_MEM_HUGETLB; }
+                else if (flag == "numa")    { params.cpu_mem |= GGML_CPU_MEM_NUMA; }
+                else if (flag != "none")    { throw std::invalid_argument("invalid value"); }
+            }
+        }
+    ).set_env("LLAMA_ARG_CPU_MEM"));
+    add_opt(common_arg(
+        {"--cpu-mem-buffers"}, "LIST",
+        "comma-separated buffers placed with --cpu-mem: kv, compute, repack (default: all)",
+        [](common_params & params, const std::string & value) {
+            params.cpu_mem_kv      = false;
+            params.cpu_mem_compute = false;
+            params.cpu_mem_repack  = false;
+            for (const auto & buf : string_split<std::string>(value, ',')) {
+                /**/ if (buf == "kv")      { params.cpu_mem_kv      = true; }
+                else if (buf == "compute") { params.cpu_mem_compute = true; }
+                else if (buf == "repack")  { params.cpu_mem_repack  = true; }
+                else { throw std::invalid_argument("invalid value"); }
+            }
+        }
+    ).set_env("LLAMA_ARG_CPU_MEM_BUFFERS"));
+    add_opt(common_arg(
+        {"--kv-mem-node"}, "N",
+        "NUMA node of the KV cache in host memory, e.g. the HBM tier (default: none)\n"
+        "the weights are placed in the tiers with --override-tensor and the CPU_NODE<N> buffer types",
+        [](common_params & params, int value) {
+            params.kv_mem_node = value;
+        }
+    ).set_env("LLAMA_ARG_KV_MEM_NODE"));
     add_opt(common_arg(
         {"-dev", "--device"}, "<dev1,dev2,..>",
         "comma-separated list of devices to use for offloading (none = don't offload)\n"
@@ -2359,6 +2715,16 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
                         buft_list[ggml_backend_buft_name(buft)] = buft;
                     }
                 }
+                // the memory tiers of the host, e.g. -ot "attn=CPU_NODE2,exps=CPU_NODE0" for the attention in HBM
+                if (auto * cpu_dev = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU)) {
+                    auto * node_buft_fn = (decltype(ggml_backend_cpu_node_buffer_type) *)
+                        ggml_backend_reg_get_proc_address(ggml_backend_dev_backend_reg(cpu_dev), "ggml_backend_cpu_node_buffer_type");
+                    for (int node = 0; node_buft_fn && node < 64; ++node) {
+                        if (auto * buft = node_buft_fn(node)) {
+                            buft_list[ggml_backend_buft_name(buft)] = buft;
+                        }
+                    }
+                }
             }
 
             for (const auto & override : string_split<std::string>(value, ',')) {
@@ -2405,6 +2771,22 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             }
         }
     ).set_env("LLAMA_ARG_N_CPU_MOE"));
+    add_opt(common_arg(
+        {"--expert-stats"},
+        "count the tokens routed to each Mixture of Experts (MoE) expert and report the share of the hottest experts\n"
+        "with the performance metrics, to guide the placement of the experts (--override-tensor, --n-cpu-moe)",
+        [](common_params & params) {
+            params.expert_stats = true;
+        }
+    ).set_env("LLAMA_ARG_EXPERT_STATS"));
+    add_opt(common_arg(
+        {"--ffn-dense"},
+        "compute all the FFN neurons of the models with activation predictors (default: only the predicted ones)\n"
+        "the number of predicted groups can be changed with --override-kv llama.ffn_sparse.n_active=int:N",
+        [](common_params & params) {
+            params.ffn_dense = true;
+        }
+    ).set_env("LLAMA_ARG_FFN_DENSE"));
     add_opt(common_arg(
         {"-ngl", "--gpu-layers", "--n-gpu-layers"}, "N",
         "number of layers to store in VRAM",
@@ -2516,6 +2898,14 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
         }
         // we define this arg on both COMMON and EXPORT_LORA, so when showing help message of export-lora, it will be categorized as "example-specific" arg
     ).set_examples({LLAMA_EXAMPLE_COMMON, LLAMA_EXAMPLE_EXPORT_LORA}));
+    add_opt(common_arg(
+        {"--lora-merge"},
+        "merge the LoRA adapters into the model weights at load, the model then runs without the LoRA overhead\n"
+        "the adapters cannot be changed afterwards, disables mmap, repacking and lazy loading",
+        [](common_params & params) {
+            params.lora_merge = true;
+        }
+    ).set_env("LLAMA_ARG_LORA_MERGE"));
     add_opt(common_arg(
         {"--control-vector"}, "FNAME",
         "add a control vector\nnote: this argument can be repeated to add multiple control vectors",
@@ -2546,6 +2936,14 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.model_alias = value;
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_ALIAS"));
+    add_opt(common_arg(
+        {"--model-swap"}, "ALIAS", "FNAME",
+        "register the model in FNAME under ALIAS, the requests with this \"model\" swap it in place of the loaded one\n"
+        "the swap waits for the running requests to finish, can be repeated",
+        [](common_params & params, const std::string & alias, const std::string & fname) {
+            params.models_swap[alias] = fname;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}));
     add_opt(common_arg(
         {"-m", "--model"}, "FNAME",
         ex == LLAMA_EXAMPLE_EXPORT_LORA
@@ -2635,6 +3033,34 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.chunk_separator = value;
         }
     ).set_examples({LLAMA_EXAMPLE_RETRIEVAL}));
+    add_opt(common_arg(
+        {"--vector-index"}, "FNAME",
+        "file of the vector index of the embeddings, loaded if it exists (default: none)\n"
+        "llama-retrieval saves the index it builds to it, llama-server saves its index with POST /index/save",
+        [](common_params & params, const std::string & value) {
+            params.vector_index = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_RETRIEVAL, LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_VECTOR_INDEX"));
+    add_opt(common_arg(
+        {"--vector-index-type"}, "TYPE",
+        string_format("type of the vectors of a new vector index, one of f32, f16, q8_0 (default: %s)", ggml_type_name(params.vector_index_type)),
+        [](common_params & params, const std::string & value) {
+            for (ggml_type type : { GGML_TYPE_F32, GGML_TYPE_F16, GGML_TYPE_Q8_0 }) {
+                if (ggml_type_name(type) == value) {
+                    params.vector_index_type = type;
+                    return;
+                }
+            }
+            throw std::invalid_argument("unsupported vector index type: " + value);
+        }
+    ).set_examples({LLAMA_EXAMPLE_RETRIEVAL, LLAMA_EXAMPLE_SERVER}));
+    add_opt(common_arg(
+        {"--vector-index-ef"}, "N",
+        string_format("size of the candidate list of the vector index searches, larger is slower and more accurate (default: %d)", params.vector_index_ef),
+        [](common_params & params, int value) {
+            params.vector_index_ef = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_RETRIEVAL, LLAMA_EXAMPLE_SERVER}));
     add_opt(common_arg(
         {"--junk"}, "N",
         string_format("number of times to repeat the junk text (default: %d)", params.n_junk),
@@ -2655,7 +3081,7 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
         [](common_params & params, const std::string & value) {
             params.out_file = value;
         }
-    ).set_examples({LLAMA_EXAMPLE_IMATRIX, LLAMA_EXAMPLE_CVECTOR_GENERATOR, LLAMA_EXAMPLE_EXPORT_LORA, LLAMA_EXAMPLE_TTS}));
+    ).set_examples({LLAMA_EXAMPLE_IMATRIX, LLAMA_EXAMPLE_CVECTOR_GENERATOR, LLAMA_EXAMPLE_EXPORT_LORA, LLAMA_EXAMPLE_TTS, LLAMA_EXAMPLE_BATCH}));
     add_opt(common_arg(
         {"-ofreq", "--output-frequency"}, "N",
         string_format("output the imatrix every N iterations (default: %d)", params.n_out_freq),
@@ -2752,6 +3178,16 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.embd_normalize = value;
         }
     ).set_examples({LLAMA_EXAMPLE_EMBEDDING}));
+    add_opt(common_arg(
+        {"--embd-dim"}, "N",
+        string_format("truncate the pooled embeddings to their first N dimensions, for Matryoshka models (default: %d, 0 = all)", params.embd_dim),
+        [](common_params & params, int value) {
+            if (value < 0) {
+                throw std::invalid_argument("invalid value");
+            }
+            params.embd_dim = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_EMBEDDING, LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_EMBD_DIM"));
     add_opt(common_arg(
         {"--embd-output-format"}, "FORMAT",
         "empty = default, \"array\" = [[],[]...], \"json\" = openai style, \"json+\" = same \"json\" + cosine similarity matrix",
@@ -2886,6 +3322,14 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.n_threads_http = value;
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_THREADS_HTTP"));
+    add_opt(common_arg(
+        {"--threads-http-max"}, "N",
+        string_format("max number of threads used to process HTTP requests, more threads are started when all of them are busy,\n"
+                      "e.g. with many streaming clients (default: %d, 0 = same as --threads-http)", params.n_threads_http_max),
+        [](common_params & params, int value) {
+            params.n_threads_http_max = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_THREADS_HTTP_MAX"));
     add_opt(common_arg(
         {"--cache-reuse"}, "N",
         string_format(
@@ -2896,6 +3340,134 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.n_cache_reuse = value;
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_CACHE_REUSE"));
+    add_opt(common_arg(
+        {"--prefix-cache"},
+        string_format(
+            "share the KV cache of common prompt prefixes across slots, requires --kv-unified (default: %s)",
+            params.prefix_cache ? "enabled" : "disabled"
+        ),
+        [](common_params & params) {
+            params.prefix_cache = true;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_PREFIX_CACHE"));
+    add_opt(common_arg(
+        {"--kv-pool"},
+        string_format(
+            "each slot can use the whole context, shared by all slots: the tasks are launched as long as their prompt and n_predict fit\n"
+            "in the free KV cells, dropping the caches of idle slots if needed, requires --kv-unified (default: %s)",
+            params.kv_pool ? "enabled" : "disabled"
+        ),
+        [](common_params & params) {
+            params.kv_pool = true;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_KV_POOL"));
+    add_opt(common_arg(
+        {"--kv-queue-max"}, "N",
+        string_format(
+            "with --kv-pool, max number of KV cells (prompt + n_predict) of the requests waiting for free cells,\n"
+            "the requests beyond are rejected with 429 and a Retry-After header (default: %d, 0 = unlimited)",
+            params.kv_queue_max
+        ),
+        [](common_params & params, int value) {
+            params.kv_queue_max = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_KV_QUEUE_MAX"));
+    add_opt(common_arg(
+        {"--cache-chunks"}, "N",
+        string_format(
+            "keep the KV cells of up to N MiB of the prompt chunks listed in the \"cache_chunks\" field of the requests, shared by all slots,\n"
+            "so that a chunk (e.g. a retrieved document) is added at any position of later prompts without being processed again (default: %d, 0 = disabled)",
+            params.cache_chunks
+        ),
+        [](common_params & params, int value) {
+            params.cache_chunks = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_CACHE_CHUNKS"));
+    add_opt(common_arg(
+        {"--cache-chunks-recompute"}, "F",
+        string_format(
+            "fraction of the tokens at the end of each cached chunk that are processed again in the context of the new prompt (default: %.2f)",
+            (double) params.cache_chunks_recompute
+        ),
+        [](common_params & params, const std::string & value) {
+            params.cache_chunks_recompute = std::stof(value);
+            if (params.cache_chunks_recompute < 0.0f || params.cache_chunks_recompute > 1.0f) {
+                throw std::invalid_argument("must be in [0, 1]");
+            }
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_CACHE_CHUNKS_RECOMPUTE"));
+    add_opt(common_arg(
+        {"--batch-budget"}, "N",
+        string_format(
+            "max number of tokens to decode per iteration while any slot is generating; the tokens of the generating slots\n"
+            "are added first and prompts are processed in chunks with the remaining budget (default: %d, 0 = n_batch)",
+            params.n_batch_budget
+        ),
+        [](common_params & params, int value) {
+            params.n_batch_budget = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_BATCH_BUDGET"));
+    add_opt(common_arg(
+        {"--slot-preempt"},
+        string_format(
+            "when all slots are busy, suspend the slot with the lowest priority to launch a task with a higher priority;\n"
+            "the KV state of the suspended slot is saved in host memory and restored when a slot becomes available (default: %s)",
+            params.slot_preempt ? "enabled" : "disabled"
+        ),
+        [](common_params & params) {
+            params.slot_preempt = true;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_SLOT_PREEMPT"));
+    add_opt(common_arg(
+        {"--jump-forward"},
+        string_format(
+            "with a grammar, append the text that the grammar forces after each sampled token without sampling it;\n"
+            "the forced tokens are evaluated together with the next sampled token (default: %s)",
+            params.jump_forward ? "enabled" : "disabled"
+        ),
+        [](common_params & params) {
+            params.jump_forward = true;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_JUMP_FORWARD"));
+    add_opt(common_arg(
+        {"--embd-batch-window"}, "N",
+        string_format(
+            "max time in ms to wait for more embedding or rerank inputs while the batch is not full and slots are free;\n"
+            "the inputs of concurrent requests are then processed in a single batch (default: %d, 0 = disabled)",
+            params.embd_batch_window
+        ),
+        [](common_params & params, int value) {
+            params.embd_batch_window = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_EMBD_BATCH_WINDOW"));
+    add_opt(common_arg(
+        {"--kv-compress"}, "N",
+        string_format(
+            "after processing a prompt, keep only the N prompt tokens that received the most attention in the KV cache,\n"
+            "plus the last 32 tokens; the cache of the slot is then not reused by the next request, not compatible with --flash-attn (default: %d, 0 = disabled)",
+            params.kv_compress
+        ),
+        [](common_params & params, int value) {
+            if (value < 0) {
+                throw std::invalid_argument("invalid value");
+            }
+            params.kv_compress = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_KV_COMPRESS"));
+    add_opt(common_arg(
+        {"--swa-checkpoints"}, "N",
+        string_format(
+            "models with sliding window attention: keep N snapshots of the SWA cache of each slot, taken after the prompts,\n"
+            "so that a cached prompt can be reused without --swa-full (default: %d, 0 = disabled)",
+            params.n_swa_ckpt
+        ),
+        [](common_params & params, int value) {
+            if (value < 0) {
+                throw std::invalid_argument("invalid value");
+            }
+            params.n_swa_ckpt = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_SWA_CHECKPOINTS"));
     add_opt(common_arg(
         {"--metrics"},
         string_format("enable prometheus compatible metrics endpoint (default: %s)", params.endpoint_metrics ? "enabled" : "disabled"),
@@ -2910,6 +3482,73 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.endpoint_slots = true;
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_ENDPOINT_SLOTS"));
+    add_opt(common_arg(
+        {"--cache-digest"},
+        string_format("enable the cache digest endpoint used by --router (default: %s)", params.endpoint_cache_digest ? "enabled" : "disabled"),
+        [](common_params & params) {
+            params.endpoint_cache_digest = true;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_ENDPOINT_CACHE_DIGEST"));
+    add_opt(common_arg(
+        {"--kv-prefill"},
+        string_format("enable the prefill endpoint used by --prefill-url (default: %s)", params.endpoint_prefill ? "enabled" : "disabled"),
+        [](common_params & params) {
+            params.endpoint_prefill = true;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_ENDPOINT_PREFILL"));
+    add_opt(common_arg(
+        {"--token-stream"},
+        string_format("enable the binary token stream endpoint for pre-tokenized completions (default: %s)", params.endpoint_token_stream ? "enabled" : "disabled"),
+        [](common_params & params) {
+            params.endpoint_token_stream = true;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_ENDPOINT_TOKEN_STREAM"));
+    add_opt(common_arg(
+        {"--prefill-url"}, "URL",
+        "evaluate the long prompts on the llama-server at URL, started with --kv-prefill and the same model:\n"
+        "the KV cells are received after each of its batches and the tokens are generated locally",
+        [](common_params & params, const std::string & value) {
+            params.prefill_url = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_PREFILL_URL"));
+    add_opt(common_arg(
+        {"--prefill-min"}, "N",
+        string_format("min number of prompt tokens to evaluate for a prompt to go to --prefill-url (default: %d)", params.prefill_min_tokens),
+        [](common_params & params, int value) {
+            if (value < 1) {
+                throw std::invalid_argument("invalid value");
+            }
+            params.prefill_min_tokens = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_PREFILL_MIN"));
+    add_opt(common_arg(
+        {"--router"}, "URL1,URL2,...",
+        "run as a router for the comma-separated llama-server replicas, without loading a model:\n"
+        "the requests go to the replica that holds the longest prefix of their text in its cache",
+        [](common_params & params, const std::string & value) {
+            params.router_replicas = string_split<std::string>(value, ',');
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_ROUTER"));
+    add_opt(common_arg(
+        {"--router-poll"}, "N",
+        string_format("interval in ms between two polls of the replicas' cache digest (default: %d)", params.router_poll_ms),
+        [](common_params & params, int value) {
+            if (value <= 0) {
+                throw std::invalid_argument("invalid value");
+            }
+            params.router_poll_ms = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_ROUTER_POLL"));
+    add_opt(common_arg(
+        {"--router-max-queue"}, "N",
+        string_format("number of requests that may wait for a busy replica to reuse its cache, instead of going to an idle one (default: %d)", params.router_max_queue),
+        [](common_params & params, int value) {
+            if (value < 0) {
+                throw std::invalid_argument("invalid value");
+            }
+            params.router_max_queue = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_ROUTER_MAX_QUEUE"));
     add_opt(common_arg(
         {"--props"},
         string_format("enable changing global properties via POST /props (default: %s)", params.endpoint_props ? "enabled" : "disabled"),
@@ -2935,6 +3574,49 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             }
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}));
+    add_opt(common_arg(
+        {"--slot-save-append"},
+        "save the slots in an append-only format: repeated saves of a slot to the same file only write the tokens and KV cells added since the previous save, in the background (default: disabled)",
+        [](common_params & params) {
+            params.slot_save_append = true;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_SLOT_SAVE_APPEND"));
+    add_opt(common_arg(
+        {"--slot-offload-ram"}, "N",
+        string_format("keep the KV state of idle slots in N MiB of host memory instead of discarding it when the slot is reused (default: %d, 0 = disabled)", params.slot_offload_ram),
+        [](common_params & params, int value) {
+            params.slot_offload_ram = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_SLOT_OFFLOAD_RAM"));
+    add_opt(common_arg(
+        {"--slot-offload-disk"}, "N",
+        string_format("spill up to N MiB of the offloaded slot KV states to --slot-save-path when the host memory budget is exceeded (default: %d)", params.slot_offload_disk),
+        [](common_params & params, int value) {
+            params.slot_offload_disk = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_SLOT_OFFLOAD_DISK"));
+    add_opt(common_arg(
+        {"--slot-offload-persist"},
+        "keep the offloaded slot KV states in --slot-save-path when the server stops, with the states of the slots, and reuse them\n"
+        "after a restart with the same model (requires --slot-offload-disk)",
+        [](common_params & params) {
+            params.slot_offload_persist = true;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_SLOT_OFFLOAD_PERSIST"));
+    add_opt(common_arg(
+        {"--mmproj-cache"}, "N",
+        string_format("keep the encoded embeddings of up to N MiB of images and audio, shared by all slots, so that repeated media skip the encoder (default: %d, 0 = disabled)", params.mmproj_cache),
+        [](common_params & params, int value) {
+            params.mmproj_cache = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_MMPROJ_CACHE"));
+    add_opt(common_arg(
+        {"--mmproj-async"},
+        string_format("encode images and audio on a worker thread, so that the other slots keep generating meanwhile (default: %s)", params.mmproj_async ? "enabled" : "disabled"),
+        [](common_params & params) {
+            params.mmproj_async = true;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_MMPROJ_ASYNC"));
     add_opt(common_arg(
         {"--jinja"},
         "use jinja template for chat (default: disabled)",
@@ -3052,6 +3734,33 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             else { throw std::invalid_argument("invalid value"); }
         }
     ).set_examples({LLAMA_EXAMPLE_CVECTOR_GENERATOR}));
+    add_opt(common_arg(
+        {"--batch-window"}, "N",
+        string_format("number of requests read ahead and sorted by prompt, so that the requests with a shared prefix run together (default: %d)", params.batch_window),
+        [](common_params & params, int value) {
+            if (value <= 0) {
+                throw std::invalid_argument("invalid value");
+            }
+            params.batch_window = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_BATCH}));
+    add_opt(common_arg(
+        {"--scenarios"}, "s0,s1,...",
+        "batched-bench scenarios (default: static)\n"
+        "static: all the sequences start and end together\n"
+        "stagger: the sequences arrive one after the other while the others generate\n"
+        "mixed: same as stagger, with the prompts evaluated in the ubatches of the generated tokens\n"
+        "replace: the sequences generate random lengths and are replaced as they finish\n"
+        "tree: the prompts share a common prefix, then a prefix per group of sequences",
+        [](common_params & params, const std::string & value) {
+            for (const auto & s : string_split<std::string>(value, ',')) {
+                if (s != "static" && s != "stagger" && s != "mixed" && s != "replace" && s != "tree") {
+                    throw std::invalid_argument("invalid scenario: " + s);
+                }
+                params.batched_bench_scenarios.push_back(s);
+            }
+        }
+    ).set_examples({LLAMA_EXAMPLE_BENCH}));
     add_opt(common_arg(
         {"--output-format"}, "{md,jsonl}",
         "output format for batched-bench results (default: md)",
@@ -3097,6 +3806,16 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.offline = true;
         }
     ).set_env("LLAMA_OFFLINE"));
+    add_opt(common_arg(
+        {"--download-connections"}, "N",
+        string_format("number of connections downloading the model files, with HTTP range requests when the server supports them (default: %d)", params.download_connections),
+        [](common_params & params, int value) {
+            if (value <= 0) {
+                throw std::invalid_argument("the number of connections must be positive");
+            }
+            params.download_connections = value;
+        }
+    ).set_env("LLAMA_ARG_DOWNLOAD_CONNECTIONS"));
     add_opt(common_arg(
         {"-lv", "--verbosity", "--log-verbosity"}, "N",
         "Set the verbosity threshold. Messages with a higher verbosity will be ignored.",
@@ -3257,6 +3976,13 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.speculative.p_min = std::stof(value);
         }
     ).set_examples({LLAMA_EXAMPLE_SPECULATIVE, LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_DRAFT_P_MIN"));
+    add_opt(common_arg(
+        {"--draft-vocab"}, "N",
+        string_format("compute the draft logits only for the first N tokens of the draft vocabulary and its control tokens (default: %d, 0 = all)", params.speculative.n_vocab),
+        [](common_params & params, int value) {
+            params.speculative.n_vocab = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE, LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_DRAFT_VOCAB"));
     add_opt(common_arg(
         {"-cd", "--ctx-size-draft"}, "N",
         string_format("size of the prompt context for the draft model (default: %d, 0 = loaded from model)", params.speculative.n_ctx),
@@ -3264,6 +3990,80 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.speculative.n_ctx = value;
         }
     ).set_examples({LLAMA_EXAMPLE_SPECULATIVE, LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_CTX_SIZE_DRAFT"));
+    add_opt(common_arg(
+        {"--spec-self-exit"}, "N",
+        "self-speculative decoding without a draft model: draft with the first N layers of the model (default: disabled)",
+        [](common_params & params, int value) {
+            if (value <= 0) {
+                throw std::invalid_argument("number of layers must be positive");
+            }
+            params.speculative.n_layer_exit = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_SPEC_SELF_EXIT"));
+    add_opt(common_arg(
+        {"--spec-self-skip"}, "BEGIN,END",
+        "self-speculative decoding without a draft model: draft without the layers in [BEGIN, END) of the model\n"
+        "(default: disabled, only supported by llama, qwen2 and qwen3 models)",
+        [](common_params & params, const std::string & value) {
+            const auto range = string_split<int>(value, ',');
+            if (range.size() != 2 || range[0] < 0 || range[1] <= range[0]) {
+                throw std::invalid_argument("invalid layer range, expected BEGIN,END with BEGIN < END");
+            }
+            params.speculative.layer_skip_begin = range[0];
+            params.speculative.layer_skip_end   = range[1];
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_SPEC_SELF_SKIP"));
+    add_opt(common_arg(
+        {"--spec-ngram"},
+        "speculative decoding without a draft model: draft with n-gram lookups in the context of the slot and in a cache\n"
+        "shared by all slots that learns from the completed requests (saved to --lookup-cache-dynamic, if set)",
+        [](common_params & params) {
+            params.speculative.ngram = true;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_SPEC_NGRAM"));
+    add_opt(common_arg(
+        {"--spec-lookahead"}, "N",
+        "speculative decoding without a draft model: lookahead decoding, draft with the n-grams of size N found by\n"
+        "Jacobi iterations over a window of --draft-max tokens of each slot (default: 0, 0 = disabled)",
+        [](common_params & params, int value) {
+            if (value != 0 && value < 2) {
+                throw std::invalid_argument("the n-gram size must be at least 2");
+            }
+            params.speculative.lookahead = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_SPEC_LOOKAHEAD"));
+    add_opt(common_arg(
+        {"--spec-adaptive"},
+        "adapt the draft length of each slot to its acceptance rate and to the measured cost of the drafts,\n"
+        "speculation is skipped when it does not pay off, e.g. when many slots are generating (default: disabled)",
+        [](common_params & params) {
+            params.speculative.adaptive = true;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_SPEC_ADAPTIVE"));
+    add_opt(common_arg(
+        {"--spec-async"},
+        "run the draft model on its own thread, drafting the next step while the target model verifies the current one,\n"
+        "the draft is used when all of it is accepted - best with the draft model on another device, see --device-draft (default: disabled)",
+        [](common_params & params) {
+            params.speculative.async = true;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_SPEC_ASYNC"));
+    add_opt(common_arg(
+        {"--spec-heads"}, "FNAME",
+        "speculative decoding without a draft model: draft with the Medusa heads in the GGUF file FNAME,\n"
+        "evaluated over the final hidden state of the target model (default: none)",
+        [](common_params & params, const std::string & value) {
+            params.speculative.heads = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_SPEC_HEADS"));
+    add_opt(common_arg(
+        {"--spec-mtp"},
+        string_format("speculative decoding without a draft model: draft with the multi-token prediction (MTP) layer of the target model,\n"
+        "e.g. GLM-4.5 (default: %s)", params.speculative.mtp ? "enabled" : "disabled"),
+        [](common_params & params) {
+            params.speculative.mtp = true;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_SPEC_MTP"));
     add_opt(common_arg(
         {"-devd", "--device-draft"}, "<dev1,dev2,..>",
         "comma-separated list of devices to use for offloading the draft model (none = don't offload)\n"
@@ -3339,6 +4139,16 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.vocoder.use_guide_tokens = true;
         }
     ).set_examples({LLAMA_EXAMPLE_TTS, LLAMA_EXAMPLE_SERVER}));
+    add_opt(common_arg(
+        {"--tts-stream-chunk"}, "N",
+        string_format("vocode the audio codes in chunks of N codes while they are generated and write the audio as it comes (default: %d, 0 = at the end)", params.vocoder.stream_chunk),
+        [](common_params & params, int value) {
+            if (value < 0) {
+                throw std::invalid_argument("invalid value");
+            }
+            params.vocoder.stream_chunk = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_TTS}));
     add_opt(common_arg(
         {"--tts-speaker-file"}, "FNAME",
         "speaker file path for audio generation",
@@ -3531,6 +4341,18 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
         string_format("add gumbel noise to the logits if temp > 0.0 (default: %s)", params.diffusion.add_gumbel_noise ? "true" : "false"),
         [](common_params & params, const std::string & value) { params.diffusion.add_gumbel_noise = std::stof(value); }
     ).set_examples({ LLAMA_EXAMPLE_DIFFUSION }));
+    add_opt(common_arg(
+        { "--diffusion-cache" },
+        string_format("cache the KV of the prompt and of the finalized blocks, each step evaluates only the active block (requires --diffusion-block-length) (default: %s)",
+                      params.diffusion.cache ? "true" : "false"),
+        [](common_params & params) { params.diffusion.cache = true; }
+    ).set_examples({ LLAMA_EXAMPLE_DIFFUSION }));
+    add_opt(common_arg(
+        { "--diffusion-threshold" }, "F",
+        string_format("unmask all the tokens with a confidence above this threshold in a step, on top of the schedule, 0.0 = disabled (default: %.3f)",
+                      (double) params.diffusion.threshold),
+        [](common_params & params, const std::string & value) { params.diffusion.threshold = std::stof(value); }
+    ).set_examples({ LLAMA_EXAMPLE_DIFFUSION }));
 
 
     return ctx_arg;
@@ -0,0 +1,229 @@
+#include "beam-search.h"
+
+#include "log.h"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+struct common_beam {
+    llama_seq_id seq_id;
+    llama_tokens tokens;
+    float        logprob;
+};
+
+// a token that extends a beam
+struct common_beam_cand {
+    int32_t     ib;
+    llama_token id;
+    float       logprob;
+};
+
+static float common_beam_score(float logprob, size_t n_tokens, float length_penalty) {
+    return logprob / std::pow((float) std::max<size_t>(n_tokens, 1), length_penalty);
+}
+
+std::vector<common_beam_hyp> common_beam_search(
+        struct llama_context * ctx,
+          const llama_tokens & prompt,
+        const struct common_beam_search_params & params) {
+    const llama_model * model = llama_get_model(ctx);
+    const llama_vocab * vocab = llama_model_get_vocab(model);
+
+    const int32_t n_vocab = llama_vocab_n_tokens(vocab);
+    const int32_t n_beams = params.n_beams;
+    const int32_t n_batch = llama_n_batch(ctx);
+
+    llama_memory_t mem = llama_get_memory(ctx);
+
+    if (prompt.empty() || n_beams < 1 || params.seq_id_0 < 0 || params.seq_id_0 + n_beams > (int32_t) llama_n_seq_max(ctx)) {
+        LOG_ERR("%s: invalid parameters: n_prompt = %zu, n_beams = %d, seq_id_0 = %d, n_seq_max = %u\n",
+                __func__, prompt.size(), n_beams, params.seq_id_0, llama_n_seq_max(ctx));
+        return {};
+    }
+
+    for (int32_t i = 0; i < n_beams; ++i) {
+        llama_memory_seq_rm(mem, params.seq_id_0 + i, -1, -1);
+    }
+
+    llama_batch batch = llama_batch_init(std::max(n_batch, n_beams), 0, 1);
+
+    // evaluate the prompt in the first sequence
+    for (size_t i0 = 0; i0 < prompt.size(); i0 += n_batch) {
+        common_batch_clear(batch);
+
+        const size_t i1 = std::min(prompt.size(), i0 + n_batch);
+        for (size_t i = i0; i < i1; ++i) {
+            common_batch_add(batch, prompt[i], i, { params.seq_id_0 }, i + 1 == prompt.size());
+        }
+
+        if (llama_decode(ctx, batch) != 0) {
+            LOG_ERR("%s: failed to evaluate the prompt\n", __func__);
+            llama_memory_seq_rm(mem, params.seq_id_0, -1, -1);
+            llama_batch_free(batch);
+            return {};
+        }
+    }
+
+    const llama_pos n_past = prompt.size();
+
+    std::vector<common_beam> beams = { { params.seq_id_0, {}, 0.0f } };
+
+    // the index of the logits of each beam in the batch
+    std::vector<int32_t> i_batch = { batch.n_tokens - 1 };
+
+    // the sequences that hold no beam
+    std::vector<llama_seq_id> seq_free;
+    for (int32_t i = n_beams - 1; i > 0; --i) {
+        seq_free.push_back(params.seq_id_0 + i);
+    }
+
+    std::vector<common_beam_hyp> hyps;
+
+    std::vector<common_beam_cand> cands;
+    std::vector<llama_token> ids(n_vocab);
+
+    for (int32_t n_cur = 0; n_cur < params.n_predict && !beams.empty(); ++n_cur) {
+        // the n_beams best tokens of each beam hold the n_beams best extensions of all the beams
+        cands.clear();
+
+        for (size_t ib = 0; ib < beams.size(); ++ib) {
+            const float * logits = llama_get_logits_ith(ctx, i_batch[ib]);
+
+            const float max_l = *std::max_element(logits, logits + n_vocab);
+
+            double sum = 0.0;
+            for (int32_t id = 0; id < n_vocab; ++id) {
+                sum += std::exp(logits[id] - max_l);
+            }
+            const float log_z = max_l + std::log(sum);
+
+            const int32_t k = std::min(n_beams, n_vocab);
+
+            std::iota(ids.begin(), ids.end(), 0);
+            std::nth_element(ids.begin(), ids.begin() + k - 1, ids.end(), [logits](llama_token a, llama_token b) {
+                return logits[a] > logits[b];
+            });
+
+            for (int32_t i = 0; i < k; ++i) {
+                cands.push_back({ (int32_t) ib, ids[i], beams[ib].logprob + logits[ids[i]] - log_z });
+            }
+        }
+
+        std::sort(cands.begin(), cands.end(), [](const common_beam_cand & a, const common_beam_cand & b) {
+            return a.logprob > b.logprob;
+        });
+
+        // the candidates that end the generation are hypotheses, the best n_beams other ones are the next beams
+        std::vector<common_beam_cand> next;
+
+        for (const auto & cand : cands) {
+            if ((int32_t) next.size() == n_beams) {
+                break;
+            }
+
+            if (llama_vocab_is_eog(vocab, cand.id)) {
+                llama_tokens tokens = beams[cand.ib].tokens;
+                tokens.push_back(cand.id);
+
+                const float score = common_beam_score(cand.logprob, tokens.size(), params.length_penalty);
+                hyps.push_back({ std::move(tokens), cand.logprob, score, true });
+                continue;
+            }
+
+            next.push_back(cand);
+        }
+
+        std::sort(hyps.begin(), hyps.end(), [](const common_beam_hyp & a, const common_beam_hyp & b) {
+            return a.score > b.score;
+        });
+
+        if ((int32_t) hyps.size() > n_beams) {
+            hyps.resize(n_beams);
+        }
+
+        // done when the best beam scores below all the hypotheses
+        bool done = next.empty();
+        if (!done && (int32_t) hyps.size() == n_beams) {
+            const float best = common_beam_score(next[0].logprob, beams[next[0].ib].tokens.size() + 1, params.length_penalty);
+            done = best < hyps.back().score;
+        }
+
+        if (done) {
+            beams.clear();
+            break;
+        }
+
+        // the first child of a beam keeps its sequence, the other ones get a copy of it in a free sequence
+        std::vector<int32_t> n_children(beams.size(), 0);
+        for (const auto & cand : next) {
+            n_children[cand.ib]++;
+        }
+
+        for (size_t ib = 0; ib < beams.size(); ++ib) {
+            if (n_children[ib] == 0) {
+                llama_memory_seq_rm(mem, beams[ib].seq_id, -1, -1);
+                seq_free.push_back(beams[ib].seq_id);
+            }
+        }
+
+        std::vector<bool> is_kept(beams.size(), false);
+        std::vector<common_beam> beams_next;
+
+        for (const auto & cand : next) {
+            const common_beam & parent = beams[cand.ib];
+
+            llama_seq_id seq_id = parent.seq_id;
+            if (is_kept[cand.ib]) {
+                seq_id = seq_free.back();
+                seq_free.pop_back();
+
+                llama_memory_seq_cp(mem, parent.seq_id, seq_id, -1, -1);
+            }
+            is_kept[cand.ib] = true;
+
+            llama_tokens tokens = parent.tokens;
+            tokens.push_back(cand.id);
+
+            beams_next.push_back({ seq_id, std::move(tokens), cand.logprob });
+        }
+
+        beams = std::move(beams_next);
+
+        // evaluate the new token of all the beams in one batch
+        common_batch_clear(batch);
+        i_batch.resize(beams.size());
+
+        for (size_t ib = 0; ib < beams.size(); ++ib) {
+            i_batch[ib] = batch.n_tokens;
+            common_batch_add(batch, beams[ib].tokens.back(), n_past + beams[ib].tokens.size() - 1, { beams[ib].seq_id }, true);
+        }
+
+        if (llama_decode(ctx, batch) != 0) {
+            LOG_ERR("%s: failed to evaluate the beams\n", __func__);
+            break;
+        }
+    }
+
+    // the beams that reached n_predict
+    for (const auto & beam : beams) {
+        const float score = common_beam_score(beam.logprob, beam.tokens.size(), params.length_penalty);
+        hyps.push_back({ beam.tokens, beam.logprob, score, false });
+    }
+
+    std::sort(hyps.begin(), hyps.end(), [](const common_beam_hyp & a, const common_beam_hyp & b) {
+        return a.score > b.score;
+    });
+
+    if ((int32_t) hyps.size() > n_beams) {
+        hyps.resize(n_beams);
+    }
+
+    for (int32_t i = 0; i < n_beams; ++i) {
+        llama_memory_seq_rm(mem, params.seq_id_0 + i, -1, -1);
+    }
+
+    llama_batch_free(batch);
+
+    return hyps;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "llama.h"
+#include "common.h"
+
+#include <vector>
+
+//
+// beam search with the beams as sequences of the KV cache
+//
+// the prompt is evaluated once in the first sequence and a beam that forks is copied with llama_memory_seq_cp,
+// so the beams share the cells of the prompt and of their common prefix. the context needs n_seq_max >= n_beams
+// and should use a unified KV cache (kv_unified), where the copies only update the cells metadata
+//
+
+struct common_beam_search_params {
+    int32_t n_beams   = 4;
+    int32_t n_predict = 128; // max generated tokens
+
+    float length_penalty = 1.0f; // the score of a hypothesis is its log-probability divided by n_tokens^length_penalty
+
+    llama_seq_id seq_id_0 = 0; // the beams use the sequences [seq_id_0, seq_id_0 + n_beams)
+};
+
+struct common_beam_hyp {
+    llama_tokens tokens;  // generated tokens, the end of generation token included
+    float        logprob; // sum of the log-probabilities of the tokens
+    float        score;
+    bool         eog;     // ended with an end of generation token, otherwise stopped at n_predict
+};
+
+// returns up to n_beams hypotheses, best score first, or none if the prompt could not be evaluated
+// the sequences of the beams are cleared before and after the search
+std::vector<common_beam_hyp> common_beam_search(
+        struct llama_context * ctx,
+          const llama_tokens & prompt,
+        const struct common_beam_search_params & params);
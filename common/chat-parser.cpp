@@ -3,6 +3,7 @@
 #include "log.h"
 #include "regex-partial.h"
 
+#include <algorithm>
 #include <optional>
 #include <stdexcept>
 #include <string>
@@ -10,18 +11,56 @@
 
 using json = nlohmann::ordered_json;
 
-common_chat_msg_parser::common_chat_msg_parser(const std::string & input, bool is_partial, const common_chat_syntax & syntax)
-    : input_(input), is_partial_(is_partial), syntax_(syntax)
+common_chat_msg_parser::common_chat_msg_parser(const std::string & input, bool is_partial, const common_chat_syntax & syntax,
+                                               common_chat_msg_parser_state * state)
+    : input_(input), is_partial_(is_partial), syntax_(syntax), state_(state)
 {
     result_.role = "assistant";
 
-    while (true) {
+    if (state_) {
+        if (input.size() < state_->n_input) {
+            state_->reset();
+        }
+        // the marker is kept as long as the appended text does not contain it
+        const auto & marker = state_->healing_marker;
+        const size_t from = state_->n_input >= marker.size() ? state_->n_input - marker.size() + 1 : 0;
+        if (!marker.empty() && input.find(marker, from) == std::string::npos) {
+            healing_marker_ = marker;
+        }
+    }
+
+    while (healing_marker_.empty()) {
         std::string id = std::to_string(std::rand());
         if (input.find(id) == std::string::npos) {
             healing_marker_ = id;
             break;
         }
     }
+
+    if (state_) {
+        state_->n_input        = input.size();
+        state_->healing_marker = healing_marker_;
+    }
+}
+
+size_t common_chat_msg_parser::search_start(const void * key, size_t from) const {
+    if (state_) {
+        auto it = state_->regex_resume.find({key, from});
+        if (it != state_->regex_resume.end()) {
+            return std::max(from, it->second);
+        }
+    }
+    return from;
+}
+
+size_t common_chat_msg_parser::search_start(const std::string & literal, size_t from) const {
+    if (state_) {
+        auto it = state_->literal_resume.find({literal, from});
+        if (it != state_->literal_resume.end()) {
+            return std::max(from, it->second);
+        }
+    }
+    return from;
 }
 
 std::string common_chat_msg_parser::str(const common_string_range & rng) const {
@@ -107,7 +146,12 @@ bool common_chat_msg_parser::try_consume_literal(const std::string & literal) {
 }
 
 std::optional<common_chat_msg_parser::find_regex_result>  common_chat_msg_parser::try_find_literal(const std::string & literal) {
-    auto idx = input_.find(literal, pos_);
+    auto idx = input_.find(literal, search_start(literal, pos_));
+    if (idx == std::string::npos && state_) {
+        // the literal can only be completed by the text appended later
+        const size_t n_tail = std::min(input_.size() - pos_, literal.empty() ? 0 : literal.size() - 1);
+        state_->literal_resume[{literal, pos_}] = input_.size() - n_tail;
+    }
     if (idx != std::string::npos) {
         find_regex_result res;
         res.prelude = input_.substr(pos_, idx - pos_);
@@ -179,9 +223,24 @@ std::string common_chat_msg_parser::consume_rest() {
     return rest;
 }
 
+common_regex_match common_chat_msg_parser::search_regex(const common_regex & regex, size_t from) {
+    if (!state_ || !regex.is_position_independent()) {
+        return regex.search(input_, from);
+    }
+    auto m = regex.search(input_, search_start(&regex, from));
+    if (m.type == COMMON_REGEX_MATCH_TYPE_NONE) {
+        // not even a partial match at the end: a match can only start in the text appended later
+        state_->regex_resume[{&regex, from}] = input_.size();
+    }
+    return m;
+}
+
 // Tries to find the regex, consumes it (pos right after it) and gives the prelude (right before it) and the groups to the callback.
 std::optional<common_chat_msg_parser::find_regex_result> common_chat_msg_parser::try_find_regex(const common_regex & regex, size_t from, bool add_prelude_to_content) {
-    auto m = regex.search(input_, from == std::string::npos ? pos_ : from);
+    if (from == std::string::npos) {
+        from = pos_;
+    }
+    auto m = search_regex(regex, from);
     if (m.type == COMMON_REGEX_MATCH_TYPE_NONE) {
         return std::nullopt;
     }
@@ -208,7 +267,7 @@ common_chat_msg_parser::find_regex_result common_chat_msg_parser::consume_regex(
 }
 
 std::optional<common_chat_msg_parser::find_regex_result> common_chat_msg_parser::try_consume_regex(const common_regex & regex) {
-    auto m = regex.search(input_, pos_);
+    auto m = search_regex(regex, pos_);
     if (m.type == COMMON_REGEX_MATCH_TYPE_NONE) {
         return std::nullopt;
     }
@@ -24,8 +24,17 @@ class common_chat_msg_parser {
     size_t pos_ = 0;
     common_chat_msg result_;
 
+    // optional, the searches resume from the previous parses of a shorter input
+    common_chat_msg_parser_state * state_ = nullptr;
+
+    size_t search_start(const void * key, size_t from) const;
+    size_t search_start(const std::string & literal, size_t from) const;
+
+    common_regex_match search_regex(const common_regex & regex, size_t from);
+
   public:
-    common_chat_msg_parser(const std::string & input, bool is_partial, const common_chat_syntax & syntax);
+    common_chat_msg_parser(const std::string & input, bool is_partial, const common_chat_syntax & syntax,
+                           common_chat_msg_parser_state * state = nullptr);
     const std::string & input() const { return input_; }
     size_t pos() const { return pos_; }
     const std::string & healing_marker() const { return healing_marker_; }
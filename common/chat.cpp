@@ -2128,8 +2128,8 @@ static void common_chat_parse(common_chat_msg_parser & builder) {
     builder.finish();
 }
 
-common_chat_msg common_chat_parse(const std::string & input, bool is_partial, const common_chat_syntax & syntax) {
-    common_chat_msg_parser builder(input, is_partial, syntax);
+static common_chat_msg common_chat_parse_impl(const std::string & input, bool is_partial, const common_chat_syntax & syntax, common_chat_msg_parser_state * state) {
+    common_chat_msg_parser builder(input, is_partial, syntax, state);
     try {
         common_chat_parse(builder);
     } catch (const common_chat_msg_partial_exception & ex) {
@@ -2146,3 +2146,11 @@ common_chat_msg common_chat_parse(const std::string & input, bool is_partial, co
     }
     return msg;
 }
+
+common_chat_msg common_chat_parse(const std::string & input, bool is_partial, const common_chat_syntax & syntax) {
+    return common_chat_parse_impl(input, is_partial, syntax, nullptr);
+}
+
+common_chat_msg common_chat_parse(const std::string & input, bool is_partial, const common_chat_syntax & syntax, common_chat_msg_parser_state & state) {
+    return common_chat_parse_impl(input, is_partial, syntax, &state);
+}
@@ -153,6 +153,25 @@ struct common_chat_syntax {
     bool                     parse_tool_calls      = true;
 };
 
+// State kept between the parses of a message that grows, e.g. while it is streamed.
+// The searches of a parse start where the same searches of the previous parses could not find anything,
+// so that each parse only scans the appended text instead of the whole message.
+struct common_chat_msg_parser_state {
+    size_t      n_input = 0; // size of the previously parsed input, the next input must start with it
+    std::string healing_marker;
+
+    // (regex or literal, search start) -> no match can start before this position, whatever text is appended
+    std::map<std::pair<const void *, size_t>, size_t> regex_resume;
+    std::map<std::pair<std::string,  size_t>, size_t> literal_resume;
+
+    void reset() {
+        n_input = 0;
+        healing_marker.clear();
+        regex_resume.clear();
+        literal_resume.clear();
+    }
+};
+
 // Check if the template supplied via "--chat-template" is supported or not. Returns true if it's valid
 bool common_chat_verify_template(const std::string & tmpl, bool use_jinja);
 
@@ -193,6 +212,8 @@ const char*               common_chat_format_name(common_chat_format format);
 const char*               common_reasoning_format_name(common_reasoning_format format);
 common_reasoning_format   common_reasoning_format_from_name(const std::string & format);
 common_chat_msg           common_chat_parse(const std::string & input, bool is_partial, const common_chat_syntax & syntax);
+// input must extend the input of the previous parse with the same state (it is reset when the input is shorter)
+common_chat_msg           common_chat_parse(const std::string & input, bool is_partial, const common_chat_syntax & syntax, common_chat_msg_parser_state & state);
 
 common_chat_tool_choice common_chat_tool_choice_parse_oaicompat(const std::string & tool_choice);
 
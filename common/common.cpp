@@ -3,6 +3,7 @@
 #endif
 
 #include "ggml.h"
+#include "ggml-cpu.h"
 #include "gguf.h"
 
 #include "common.h"
@@ -10,17 +11,22 @@
 #include "llama.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cinttypes>
 #include <climits>
 #include <cmath>
 #include <codecvt>
+#include <condition_variable>
 #include <cstdarg>
 #include <cstring>
 #include <ctime>
+#include <deque>
+#include <exception>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
 #include <iterator>
+#include <mutex>
 #include <regex>
 #include <sstream>
 #include <string>
@@ -192,6 +198,138 @@ int32_t cpu_get_num_math() {
     return cpu_get_num_physical_cores();
 }
 
+//
+// thread pool
+//
+
+namespace {
+
+struct common_thread_pool {
+    std::vector<std::thread> threads;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::function<void()>> jobs;
+
+    bool stop = false;
+
+    ~common_thread_pool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        cv.notify_all();
+        for (auto & t : threads) {
+            t.join();
+        }
+    }
+
+    void worker() {
+        while (true) {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [this]() { return stop || !jobs.empty(); });
+                if (jobs.empty()) {
+                    return;
+                }
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+            job();
+        }
+    }
+
+    // queues the jobs, with at least n_threads threads in the pool
+    void push(std::vector<std::function<void()>> fns, int n_threads) {
+        n_threads = std::min(n_threads, std::max(1, (int) std::thread::hardware_concurrency()));
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            while ((int) threads.size() < n_threads) {
+                threads.emplace_back([this]() { worker(); });
+            }
+            for (auto & fn : fns) {
+                jobs.emplace_back(std::move(fn));
+            }
+        }
+        cv.notify_all();
+    }
+
+    static common_thread_pool & get() {
+        static common_thread_pool pool;
+        return pool;
+    }
+};
+
+}
+
+std::future<void> common_thread_pool_async(std::function<void()> fn) {
+    auto task = std::make_shared<std::packaged_task<void()>>(std::move(fn));
+    auto res  = task->get_future();
+
+    // the jobs of the background threads (e.g. the grammar masks) only need a few of them
+    common_thread_pool::get().push({ [task]() { (*task)(); } }, std::clamp((int) std::thread::hardware_concurrency()/4, 1, 4));
+
+    return res;
+}
+
+void common_thread_pool_for(int n, int n_threads, const std::function<void(int)> & fn) {
+    n_threads = std::max(1, std::min(n_threads, n));
+
+    if (n_threads == 1) {
+        for (int i = 0; i < n; ++i) {
+            fn(i);
+        }
+        return;
+    }
+
+    // the state outlives the call: a job that starts after all the indices are taken returns without calling fn
+    struct state_t {
+        std::atomic<int> i_next = 0;
+        int n_done = 0;
+        std::exception_ptr error;
+        std::mutex mutex;
+        std::condition_variable cv;
+    };
+    auto state = std::make_shared<state_t>();
+
+    auto run = [n, state, &fn]() {
+        int n_run = 0;
+        std::exception_ptr error;
+        for (int i = state->i_next++; i < n; i = state->i_next++) {
+            try {
+                fn(i);
+            } catch (...) {
+                error = std::current_exception();
+            }
+            n_run++;
+        }
+        if (n_run > 0) {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            if (error && !state->error) {
+                state->error = error;
+            }
+            state->n_done += n_run;
+            if (state->n_done == n) {
+                state->cv.notify_all();
+            }
+        }
+    };
+
+    std::vector<std::function<void()>> jobs(n_threads - 1, run);
+    common_thread_pool::get().push(std::move(jobs), n_threads - 1);
+
+    run();
+
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->cv.wait(lock, [&]() { return state->n_done == n; });
+
+    // the first exception of fn is thrown on the calling thread, once no call is running
+    if (state->error) {
+        std::rethrow_exception(state->error);
+    }
+}
+
 // Helper for setting process priority
 
 #if defined(_WIN32)
@@ -473,6 +611,135 @@ size_t string_find_partial_stop(const std::string_view & str, const std::string_
     return std::string::npos;
 }
 
+common_stop_matcher::common_stop_matcher(const std::vector<std::string> & stops) {
+    for (const auto & stop : stops) {
+        for (const char c : stop) {
+            uint16_t & cls = byte_class[(uint8_t) c];
+            if (cls == 0) {
+                cls = n_class++;
+            }
+        }
+    }
+
+    const auto add_node = [&](int32_t d) {
+        next.resize(next.size() + n_class, -1);
+        fail.push_back(0);
+        depth.push_back(d);
+        out.push_back(-1);
+        return (int32_t) depth.size() - 1;
+    };
+
+    add_node(0);
+
+    // trie of the stop strings
+    for (size_t i = 0; i < stops.size(); ++i) {
+        const std::string & stop = stops[i];
+        if (stop.empty()) {
+            continue;
+        }
+
+        int32_t cur = 0;
+        for (const char c : stop) {
+            const uint16_t cls = byte_class[(uint8_t) c];
+            if (next[cur*n_class + cls] < 0) {
+                const int32_t id = add_node(depth[cur] + 1);
+                next[cur*n_class + cls] = id;
+            }
+            cur = next[cur*n_class + cls];
+        }
+
+        // the first of the duplicated stop strings
+        if (out[cur] < 0) {
+            out[cur] = i;
+        }
+        n_stops++;
+    }
+
+    stop_len.resize(stops.size());
+    for (size_t i = 0; i < stops.size(); ++i) {
+        stop_len[i] = stops[i].size();
+    }
+
+    // failure links, breadth first - the missing transitions are replaced by those of the failure link
+    std::vector<int32_t> queue;
+    for (size_t cls = 0; cls < n_class; ++cls) {
+        int32_t & nxt = next[cls];
+        if (nxt < 0) {
+            nxt = 0;
+        } else {
+            queue.push_back(nxt);
+        }
+    }
+    for (size_t q = 0; q < queue.size(); ++q) {
+        const int32_t cur = queue[q];
+
+        // a node that ends a stop string outputs it, it is longer than the one of its failure link
+        if (out[cur] < 0) {
+            out[cur] = out[fail[cur]];
+        }
+
+        for (size_t cls = 0; cls < n_class; ++cls) {
+            int32_t & nxt = next[cur*n_class + cls];
+            if (nxt < 0) {
+                nxt = next[fail[cur]*n_class + cls];
+            } else {
+                fail[nxt] = next[fail[cur]*n_class + cls];
+                queue.push_back(nxt);
+            }
+        }
+    }
+}
+
+size_t common_stop_matcher::feed(const std::string_view & text, size_t * i_stop) {
+    size_t pos = std::string::npos;
+
+    if (n_stops == 0) {
+        n_text += text.size();
+        return pos;
+    }
+
+    size_t i_best = 0;
+
+    for (const char c : text) {
+        state = next[state*n_class + byte_class[(uint8_t) c]];
+        n_text++;
+
+        // the longest stop string ending here starts first
+        const int32_t i = out[state];
+        if (i >= 0) {
+            const size_t start = n_text - stop_len[i];
+            if (pos == std::string::npos || start < pos || (start == pos && (size_t) i < i_best)) {
+                pos    = start;
+                i_best = i;
+            }
+        }
+    }
+
+    if (i_stop && pos != std::string::npos) {
+        *i_stop = i_best;
+    }
+
+    return pos;
+}
+
+size_t common_stop_matcher::partial_len(size_t n_max) const {
+    if (n_stops == 0) {
+        return 0;
+    }
+
+    int32_t cur = state;
+    while (cur != 0 && (size_t) depth[cur] > n_max) {
+        cur = fail[cur];
+    }
+
+    return depth[cur];
+}
+
+void common_stop_matcher::reset() {
+    n_text = 0;
+    state  = 0;
+}
+
 std::string regex_escape(const std::string & s) {
     static const std::regex special_chars("[.^$|()*+?\\[\\]{}\\\\]");
     return std::regex_replace(s, special_chars, "\\$&");
@@ -929,6 +1196,10 @@ struct common_init_result common_init_from_params(common_params & params) {
         return iparams;
     }
 
+    if (params.threadpool_shared) {
+        common_attach_shared_threadpools(lctx, params.cpuparams, params.cpuparams_batch);
+    }
+
     if (params.ctx_shift && !llama_memory_can_shift(llama_get_memory(lctx))) {
         LOG_WRN("%s: KV cache shifting is not supported for this context, disabling KV cache shifting\n", __func__);
         params.ctx_shift = false;
@@ -1005,6 +1276,21 @@ struct common_init_result common_init_from_params(common_params & params) {
         iparams.lora.emplace_back(std::move(lora)); // copy to list of loaded adapters
     }
 
+    if (params.lora_merge && !params.lora_adapters.empty()) {
+        for (auto & la : params.lora_adapters) {
+            if (llama_adapter_lora_merge(model, la.ptr, la.scale, params.cpuparams.n_threads) != 0) {
+                LOG_ERR("%s: failed to merge lora adapter '%s'\n", __func__, la.path.c_str());
+                llama_free(lctx);
+                llama_model_free(model);
+                return iparams;
+            }
+        }
+
+        // the merged adapters are part of the weights and cannot be applied or changed anymore
+        params.lora_adapters.clear();
+        iparams.lora.clear();
+    }
+
     if (!params.lora_init_without_apply) {
         common_set_adapter_lora(lctx, params.lora_adapters);
     }
@@ -1039,7 +1325,9 @@ struct common_init_result common_init_from_params(common_params & params) {
         params.sampling.dry_penalty_last_n = llama_n_ctx(lctx);
     }
 
-    if (params.warmup) {
+    if (params.warmup && params.lazy_load) {
+        LOG_INF("%s: skipping warmup with --lazy-load\n", __func__);
+    } else if (params.warmup) {
         LOG_WRN("%s: warming up the model with an empty run - please wait ... (--no-warmup to disable)\n", __func__);
 
         llama_set_warmup(lctx, true);
@@ -1105,6 +1393,15 @@ void common_set_adapter_lora(struct llama_context * ctx, std::vector<common_adap
     }
 }
 
+void common_set_adapter_lora_seq(struct llama_context * ctx, llama_seq_id seq_id, std::vector<common_adapter_lora_info> & lora) {
+    llama_clear_adapter_lora_seq(ctx, seq_id);
+    for (auto & la : lora) {
+        if (la.scale != 0.0f) {
+            llama_set_adapter_lora_seq(ctx, la.ptr, seq_id, la.scale);
+        }
+    }
+}
+
 struct llama_model_params common_model_params_to_llama(common_params & params) {
     auto mparams = llama_model_default_params();
 
@@ -1123,6 +1420,16 @@ struct llama_model_params common_model_params_to_llama(common_params & params) {
     mparams.use_mlock       = params.use_mlock;
     mparams.check_tensors   = params.check_tensors;
     mparams.use_extra_bufts = !params.no_extra_bufts;
+    mparams.use_lazy        = params.lazy_load;
+    mparams.use_mtp         = params.speculative.mtp;
+    mparams.cpu_mem_repack  = params.cpu_mem_repack ? params.cpu_mem : 0;
+
+    // the merged weights are modified in place
+    if (params.lora_merge && !params.lora_adapters.empty()) {
+        mparams.use_mmap        = false;
+        mparams.use_extra_bufts = false;
+        mparams.use_lazy        = false;
+    }
 
     if (params.kv_overrides.empty()) {
         mparams.kv_overrides = NULL;
@@ -1166,6 +1473,9 @@ struct llama_context_params common_context_params_to_llama(const common_params &
     cparams.pooling_type      = params.pooling_type;
     cparams.attention_type    = params.attention_type;
     cparams.defrag_thold      = params.defrag_thold;
+    cparams.n_logits_top_k    = params.n_logits_top_k;
+    cparams.logits_type       = params.logits_type;
+    cparams.n_embd_out        = params.embd_dim;
     cparams.cb_eval           = params.cb_eval;
     cparams.cb_eval_user_data = params.cb_eval_user_data;
     cparams.offload_kqv       = !params.no_kv_offload;
@@ -1174,9 +1484,21 @@ struct llama_context_params common_context_params_to_llama(const common_params &
     cparams.op_offload        = !params.no_op_offload;
     cparams.swa_full          = params.swa_full;
     cparams.kv_unified        = params.kv_unified;
+    cparams.expert_stats      = params.expert_stats;
+    cparams.reserve_lazy      = params.reserve_lazy;
+    cparams.ffn_sparse        = !params.ffn_dense;
+    cparams.kv_scores         = params.kv_compress > 0;
+
+    cparams.type_k         = params.cache_type_k;
+    cparams.type_v         = params.cache_type_v;
+    cparams.n_layer_kv_f16 = params.cache_n_layer_f16;
+
+    cparams.n_rs_ckpt        = params.n_rs_ckpt;
+    cparams.rs_ckpt_interval = params.rs_ckpt_interval;
 
-    cparams.type_k = params.cache_type_k;
-    cparams.type_v = params.cache_type_v;
+    cparams.cpu_mem_kv      = params.cpu_mem_kv      ? params.cpu_mem : 0;
+    cparams.cpu_mem_compute = params.cpu_mem_compute ? params.cpu_mem : 0;
+    cparams.kv_mem_node     = params.kv_mem_node;
 
     return cparams;
 }
@@ -1197,6 +1519,33 @@ struct ggml_threadpool_params ggml_threadpool_params_from_cpu_params(const cpu_p
     return tpp;
 }
 
+bool common_attach_shared_threadpools(llama_context * ctx, const cpu_params & cpuparams, const cpu_params & cpuparams_batch) {
+    auto * cpu_dev = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
+    if (!cpu_dev) {
+        return false;
+    }
+    auto * reg = ggml_backend_dev_backend_reg(cpu_dev);
+    auto * ggml_threadpool_get_shared_fn = (decltype(ggml_threadpool_get_shared) *) ggml_backend_reg_get_proc_address(reg, "ggml_threadpool_get_shared");
+    if (!ggml_threadpool_get_shared_fn) {
+        return false;
+    }
+
+    // the same params give the same threadpool, so that e.g. the target and draft contexts take turns on the same threads
+    struct ggml_threadpool_params tpp       = ggml_threadpool_params_from_cpu_params(cpuparams);
+    struct ggml_threadpool_params tpp_batch = ggml_threadpool_params_from_cpu_params(cpuparams_batch);
+
+    struct ggml_threadpool * threadpool       = ggml_threadpool_get_shared_fn(&tpp);
+    struct ggml_threadpool * threadpool_batch = ggml_threadpool_get_shared_fn(&tpp_batch);
+    if (!threadpool || !threadpool_batch) {
+        LOG_WRN("%s: too many shared threadpools, the context uses its own threads\n", __func__);
+        return false;
+    }
+
+    llama_attach_threadpool(ctx, threadpool, threadpool_batch);
+
+    return true;
+}
+
 //
 // Batch utils
 //
@@ -1364,6 +1713,24 @@ std::string common_detokenize(const struct llama_vocab * vocab, const std::vecto
     return text;
 }
 
+size_t common_detokenize_append(const struct llama_vocab * vocab, const llama_token * tokens, size_t n_tokens, std::string & text, bool special) {
+    const size_t n_prev = text.size();
+
+    // most pieces are short, so that the first try is usually enough
+    text.resize(n_prev + std::max<size_t>(16, 8*n_tokens));
+    int32_t n_valid = 0;
+    int32_t n_chars = llama_detokenize_into(vocab, tokens, (int32_t) n_tokens, &text[n_prev], (int32_t) (text.size() - n_prev), special, &n_valid);
+    if (n_chars < 0) {
+        text.resize(n_prev - n_chars);
+        n_chars = llama_detokenize_into(vocab, tokens, (int32_t) n_tokens, &text[n_prev], (int32_t) (text.size() - n_prev), special, &n_valid);
+        GGML_ASSERT(n_chars >= 0);
+    }
+
+    text.resize(n_prev + n_chars);
+
+    return n_prev + n_valid;
+}
+
 //
 // Embedding utils
 //
@@ -1565,3 +1932,11 @@ ggml_opt_dataset_t common_opt_dataset_init(struct llama_context * ctx, const std
 
     return result;
 }
+
+ggml_opt_dataset_t common_opt_dataset_init_mmap(struct llama_context * ctx, const std::string & fname, int64_t stride) {
+    const int64_t ne_datapoint = llama_n_ctx(ctx);
+
+    // the labels are the tokens shifted by one
+    return ggml_opt_dataset_init_mmap(fname.c_str(),
+        GGML_TYPE_I32, GGML_TYPE_I32, ne_datapoint, ne_datapoint, stride*sizeof(llama_token), sizeof(llama_token));
+}
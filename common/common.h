@@ -4,6 +4,8 @@
 
 #include "llama-cpp.h"
 
+#include <functional>
+#include <future>
 #include <set>
 #include <string>
 #include <string_view>
@@ -60,6 +62,16 @@ struct cpu_params {
 int32_t cpu_get_num_physical_cores();
 int32_t cpu_get_num_math();
 
+// the worker threads of the process for the CPU work outside of ggml (tokenization, sampling, grammar masks, ...)
+// they are created on first use and kept until the exit
+
+// runs fn on a worker thread
+std::future<void> common_thread_pool_async(std::function<void()> fn);
+
+// runs fn(i) for i in [0, n) on the calling thread and up to n_threads - 1 worker threads
+// returns when all the calls are done - the calls of the workers that are busy with other jobs are made by the others
+void common_thread_pool_for(int n, int n_threads, const std::function<void(int)> & fn);
+
 //
 // Common params
 //
@@ -82,6 +94,7 @@ enum llama_example {
     LLAMA_EXAMPLE_PARALLEL,
     LLAMA_EXAMPLE_TTS,
     LLAMA_EXAMPLE_DIFFUSION,
+    LLAMA_EXAMPLE_BATCH,
 
     LLAMA_EXAMPLE_COUNT,
 };
@@ -175,6 +188,7 @@ struct common_params_sampling {
 
     std::string                         grammar; // optional BNF-like grammar to constrain sampling
     bool                                grammar_lazy = false;
+    bool                                grammar_async = false; // compute the grammar masks on a worker thread, see common_sampler_prepare
     std::vector<common_grammar_trigger> grammar_triggers; // optional triggers (for lazy grammars)
     std::set<llama_token>               preserved_tokens;
 
@@ -201,6 +215,20 @@ struct common_params_speculative {
     int32_t n_gpu_layers =    -1; // number of layers to store in VRAM for the draft model (-1 - use default)
     float   p_split      =  0.1f; // speculative decoding split probability
     float   p_min        = 0.75f; // minimum speculative decoding probability (greedy)
+    int32_t n_vocab      =     0; // compute the draft logits only for the first n_vocab tokens and the control tokens (0 = all)
+
+    // self-speculative decoding: draft with the target model and a subset of its layers
+    int32_t n_layer_exit     = 0; // draft with the first n_layer_exit layers (0 = disabled)
+    int32_t layer_skip_begin = 0; // draft without the layers in [layer_skip_begin, layer_skip_end)
+    int32_t layer_skip_end   = 0;
+
+    bool    ngram     = false; // draft with n-gram lookups when there is no draft model
+    int32_t lookahead = 0;     // draft with lookahead decoding n-grams of this size when there is no draft model (0 = disabled)
+    bool    adaptive  = false; // adapt the draft length to the acceptance rate and to the measured decode costs
+    bool    async     = false; // draft the next step with the draft model while the target model verifies the current one
+
+    std::string heads = ""; // path of draft heads (Medusa) over the hidden state of the target model, used when there is no draft model // NOLINT
+    bool        mtp   = false; // draft with the multi-token prediction (MTP) layer of the target model when there is no draft model
     std::vector<std::pair<std::string, std::string>> replacements; // main to speculative model replacements
 
     ggml_type cache_type_k = GGML_TYPE_F16; // KV cache data type for the K
@@ -218,6 +246,8 @@ struct common_params_vocoder {
     std::string speaker_file = ""; // speaker file path                                      // NOLINT
 
     bool use_guide_tokens = false; // enable guide tokens to improve TTS accuracy            // NOLINT
+
+    int32_t stream_chunk = 0; // vocode the audio codes in chunks of this size while generating (0 = at the end)
 };
 
 struct common_params_diffusion {
@@ -232,6 +262,9 @@ struct common_params_diffusion {
 
     float   cfg_scale     = 0;        // classifier-free guidance scale
     bool    add_gumbel_noise = false; // add gumbel noise to the logits if temp > 0.0
+
+    bool    cache         = false;    // cache the KV of the finalized blocks (block scheduling)
+    float   threshold     = 0.0f;     // unmask all the tokens with a higher confidence in a step, 0.0 = disabled
 };
 
 enum common_reasoning_format {
@@ -262,6 +295,9 @@ struct common_params {
     float   yarn_beta_slow        =  1.0f; // YaRN high correction dim
     int32_t yarn_orig_ctx         =     0; // YaRN original context length
     float   defrag_thold          =  0.1f; // KV cache defragmentation threshold
+    int32_t n_logits_top_k        =     0; // number of logits per output selected on the device (0 = all)
+
+    enum llama_logits_type logits_type = LLAMA_LOGITS_TYPE_F32; // data type of the logits copied back from the device
 
     // offload params
     std::vector<ggml_backend_dev_t> devices; // devices to use for offloading
@@ -275,11 +311,20 @@ struct common_params {
     struct cpu_params cpuparams;
     struct cpu_params cpuparams_batch;
 
+    bool batch_ecores      = false; // default the batch threads to all the physical cores, efficiency cores of hybrid CPUs included
+    bool threadpool_shared = false; // use the process-wide threadpools shared by the contexts and CPU backends of the process
+
     ggml_backend_sched_eval_callback cb_eval = nullptr;
     void * cb_eval_user_data                 = nullptr;
 
     ggml_numa_strategy numa = GGML_NUMA_STRATEGY_DISABLED;
 
+    int32_t cpu_mem         = 0;     // placement of the host buffers (enum ggml_cpu_mem_flags)
+    bool    cpu_mem_kv      = true;  // apply cpu_mem to the KV cache
+    bool    cpu_mem_compute = true;  // apply cpu_mem to the compute buffers
+    bool    cpu_mem_repack  = true;  // apply cpu_mem to the repacked weights
+    int32_t kv_mem_node     = -1;    // NUMA node of the KV cache in host memory (memory tier)
+
     enum llama_rope_scaling_type rope_scaling_type = LLAMA_ROPE_SCALING_TYPE_UNSPECIFIED;
     enum llama_pooling_type      pooling_type      = LLAMA_POOLING_TYPE_UNSPECIFIED; // pooling type for embeddings
     enum llama_attention_type    attention_type    = LLAMA_ATTENTION_TYPE_UNSPECIFIED; // attention type for embeddings
@@ -309,6 +354,7 @@ struct common_params {
     std::vector<llama_model_tensor_buft_override> tensor_buft_overrides;
 
     bool lora_init_without_apply = false; // only load lora to memory, but do not apply it to ctx (user can manually apply lora later using llama_adapter_lora_apply)
+    bool lora_merge              = false; // merge the lora adapters into the model weights at load (disables mmap, repacking and lazy loading)
     std::vector<common_adapter_lora_info> lora_adapters; // lora adapter path with user defined scale
 
     std::vector<common_control_vector_load_info> control_vectors; // control vector with user defined scale
@@ -317,6 +363,7 @@ struct common_params {
     int32_t control_vector_layer_start = -1; // layer range for control vector
     int32_t control_vector_layer_end   = -1; // layer range for control vector
     bool    offline                    = false;
+    int32_t download_connections       = 4;     // number of connections downloading the model files
 
     int32_t ppl_stride      = 0;     // stride for perplexity calculations. If left at 0, the pre-existing approach will be used.
     int32_t ppl_output_type = 0;     // = 0 -> ppl output is as usual, = 1 -> ppl output is num_tokens, ppl, one per line
@@ -351,6 +398,9 @@ struct common_params {
     bool ctx_shift         = true;  // context shift on inifinite text generation
     bool swa_full          = false; // use full-size SWA cache (https://github.com/ggml-org/llama.cpp/pull/13194#issuecomment-2868343055)
     bool kv_unified        = false; // enable unified KV cache
+    bool expert_stats      = false; // count the tokens routed to each MoE expert
+    bool reserve_lazy      = false; // size the compute buffers for one output per sequence
+    bool ffn_dense         = false; // ignore the FFN activation predictors of the model
 
     bool input_prefix_bos  = false; // prefix BOS to user inputs, preceding input_prefix
     bool use_mmap          = true;  // use mmap for faster loads
@@ -362,11 +412,16 @@ struct common_params {
     bool check_tensors     = false; // validate tensor data
     bool no_op_offload     = false; // globally disable offload host tensor operations to device
     bool no_extra_bufts    = false; // disable extra buffer types (used for weight repacking)
+    bool lazy_load         = false; // page the weights in on a background thread after the model is loaded
 
     bool single_turn       = false; // single turn chat conversation
 
-    ggml_type cache_type_k = GGML_TYPE_F16; // KV cache data type for the K
-    ggml_type cache_type_v = GGML_TYPE_F16; // KV cache data type for the V
+    ggml_type cache_type_k      = GGML_TYPE_F16; // KV cache data type for the K
+    ggml_type cache_type_v      = GGML_TYPE_F16; // KV cache data type for the V
+    int32_t   cache_n_layer_f16 = 0;             // keep the KV cache of the first and last N layers in F16 when quantized
+
+    int32_t n_rs_ckpt        = 0;   // recurrent state checkpoints per sequence (recurrent and hybrid models)
+    int32_t rs_ckpt_interval = 512; // tokens between two recurrent state checkpoints
 
     common_conversation_mode conversation_mode = COMMON_CONVERSATION_MODE_AUTO;
 
@@ -374,11 +429,14 @@ struct common_params {
     struct common_params_model mmproj;
     bool mmproj_use_gpu = true;     // use GPU for multimodal model
     bool no_mmproj = false;         // explicitly disable multimodal model
+    int32_t mmproj_cache = 0;       // size in MiB of the server cache of encoded image/audio embeddings (0 = disabled)
+    bool mmproj_async = false;      // encode the images/audio of the server slots on a worker thread
     std::vector<std::string> image; // path to image file(s)
 
     // embedding
     bool embedding         = false; // get only sentence embedding
     int32_t embd_normalize = 2;     // normalisation for embeddings (-1=none, 0=max absolute int16, 1=taxicab, 2=euclidean, >2=p-norm)
+    int32_t embd_dim       = 0;     // truncate the pooled embeddings to their first embd_dim dimensions on the device (0 = all)
     std::string embd_out   = "";    // empty = default, "array" = [[],[]...], "json" = openai style, "json+" = same "json" + cosine similarity matrix
     std::string embd_sep   = "\n";  // separator of embeddings
     std::string cls_sep    = "\t";  // separator of classification sequences
@@ -388,7 +446,19 @@ struct common_params {
     int32_t timeout_read   = 600;          // http read timeout in seconds
     int32_t timeout_write  = timeout_read; // http write timeout in seconds
     int32_t n_threads_http = -1;           // number of threads to process HTTP requests (TODO: support threadpool)
+    int32_t n_threads_http_max = 0;        // max number of HTTP threads started when all of them are busy (0 = n_threads_http)
     int32_t n_cache_reuse  = 0;            // min chunk size to reuse from the cache via KV shifting
+    bool    prefix_cache   = false;        // share cached prompt prefixes across slots (requires kv_unified)
+    bool    kv_pool        = false;        // the slots share the whole context instead of n_ctx/n_parallel each (requires kv_unified)
+    int32_t kv_queue_max   = 0;            // max KV cells forecast for the tasks waiting for the kv_pool, the others are rejected (0 = unlimited)
+    int32_t cache_chunks   = 0;            // size in MiB of the cache of prompt chunks that can be added at any position (0 = disabled)
+    float   cache_chunks_recompute = 0.1f; // fraction of the tokens at the end of each cached chunk that are processed again
+    int32_t n_batch_budget = 0;            // max tokens per server iteration while slots are generating (0 = n_batch)
+    bool    slot_preempt   = false;        // suspend lower priority slots to launch higher priority tasks
+    bool    jump_forward   = false;        // append the tokens forced by the grammar without sampling them
+    int32_t embd_batch_window = 0;         // max time in ms to wait for more embedding inputs to fill a batch (0 = disabled)
+    int32_t kv_compress    = 0;            // after the prompt, keep only the N prompt tokens with the most attention (0 = disabled)
+    int32_t n_swa_ckpt     = 0;            // snapshots of the SWA cache per slot, for prompt reuse with SWA models (0 = disabled)
 
     std::string hostname      = "127.0.0.1";
     std::string public_path   = "";                                                                         // NOLINT
@@ -407,18 +477,38 @@ struct common_params {
 
     std::map<std::string, std::string> default_template_kwargs;
 
+    // alias = path of the models that the requests can swap in with their "model" field
+    std::map<std::string, std::string> models_swap;
+
     // "advanced" endpoints are disabled by default for better security
     bool webui            = true;
     bool endpoint_slots   = false;
     bool endpoint_props   = false; // only control POST requests, not GET
     bool endpoint_metrics = false;
+    bool endpoint_cache_digest = false;
+    bool endpoint_prefill = false;
+    bool endpoint_token_stream = false;
 
     bool log_json = false;
 
     std::string slot_save_path;
+    bool slot_save_append = false; // only append the new tokens and KV cells to the slot save files
+
+    int32_t slot_offload_ram  = 0; // host memory budget in MiB for the KV state of idle slots (0 = disabled)
+    int32_t slot_offload_disk = 0; // disk budget in MiB in slot_save_path for the KV states evicted from host memory
+    bool    slot_offload_persist = false; // keep the offloaded states on disk when the server stops and restore them on the next start
 
     float slot_prompt_similarity = 0.5f;
 
+    // router mode: no model is loaded and the requests are forwarded to the replica with the longest cached prefix
+    std::vector<std::string> router_replicas; // base URLs of the replicas, started with --cache-digest
+    int32_t router_poll_ms   = 500; // interval between two polls of the replicas' /cache-digest
+    int32_t router_max_queue = 0;   // requests that may wait for a slot of a replica to reuse its cache
+
+    // prefill/decode disaggregation: the long prompts are evaluated by another server, started with --kv-prefill
+    std::string prefill_url;             // base URL of the prefill server
+    int32_t     prefill_min_tokens = 256; // prompt tokens to evaluate below which the prompt is evaluated locally
+
     // batched-bench params
     bool is_pp_shared = false;
 
@@ -433,6 +523,10 @@ struct common_params {
 
     std::string chunk_separator = "\n"; // chunk separator for context embedding
 
+    std::string vector_index      = "";             // file of the vector index of the embeddings (retrieval, server /search)
+    ggml_type   vector_index_type = GGML_TYPE_F32;  // type of the vectors in a new index
+    int32_t     vector_index_ef   = 64;             // size of the candidate list of the vector index searches
+
     // passkey params
     int32_t n_junk = 250; // number of times to repeat the junk text
     int32_t i_pos  = -1;  // position of the passkey in the junk text
@@ -459,6 +553,10 @@ struct common_params {
 
     // batched-bench params
     bool batched_bench_output_jsonl = false;
+    std::vector<std::string> batched_bench_scenarios; // empty = static
+
+    // batch params
+    int32_t batch_window = 4096; // number of requests read ahead and sorted by prompt
 
     // common params
     std::string out_file; // output filename for all example programs
@@ -549,6 +647,46 @@ bool string_ends_with(const std::string_view & str, const std::string_view & suf
 bool string_remove_suffix(std::string & str, const std::string_view & suffix);
 size_t string_find_partial_stop(const std::string_view & str, const std::string_view & stop);
 
+// finds a set of stop strings in a text that is fed incrementally (Aho-Corasick automaton)
+// each byte of the text is processed once, regardless of the number of stop strings
+struct common_stop_matcher {
+    common_stop_matcher() = default;
+    explicit common_stop_matcher(const std::vector<std::string> & stops);
+
+    bool empty() const { return n_stops == 0; }
+
+    // processes the next bytes of the text
+    // returns the position in the text of the first stop string that ends in these bytes, or npos
+    // the index of that stop string is returned in i_stop
+    size_t feed(const std::string_view & text, size_t * i_stop = nullptr);
+
+    // length of the longest suffix of the text, of at most n_max bytes, that is a prefix of a stop string (0 if none)
+    // same as the stop found with string_find_partial_stop() for all the stop strings
+    size_t partial_len(size_t n_max = SIZE_MAX) const;
+
+    // number of bytes processed
+    size_t n_fed() const { return n_text; }
+
+    void reset();
+
+private:
+    // the bytes that do not appear in the stop strings share the class 0
+    uint16_t byte_class[256] = {};
+    size_t   n_class = 1;
+
+    // per node of the trie of the stop strings
+    std::vector<int32_t> next;  // [n_nodes][n_class] transitions
+    std::vector<int32_t> fail;  // longest proper suffix that is also a node
+    std::vector<int32_t> depth;
+    std::vector<int32_t> out;   // the longest stop string that is a suffix of the node, -1 if none
+
+    std::vector<size_t> stop_len;
+
+    size_t  n_stops = 0;
+    size_t  n_text  = 0;
+    int32_t state   = 0;
+};
+
 bool string_parse_kv_override(const char * data, std::vector<llama_model_kv_override> & overrides);
 void string_process_escapes(std::string & input);
 
@@ -585,9 +723,16 @@ struct llama_model_params     common_model_params_to_llama  (      common_params
 struct llama_context_params   common_context_params_to_llama(const common_params & params);
 struct ggml_threadpool_params ggml_threadpool_params_from_cpu_params(const cpu_params & params);
 
+// attach the process-wide threadpools of cpuparams and cpuparams_batch to ctx, see ggml_threadpool_get_shared()
+bool common_attach_shared_threadpools(llama_context * ctx, const cpu_params & cpuparams, const cpu_params & cpuparams_batch);
+
 // clear LoRA adapters from context, then apply new list of adapters
 void common_set_adapter_lora(struct llama_context * ctx, std::vector<common_adapter_lora_info> & lora);
 
+// clear LoRA adapters from a sequence, then apply new list of adapters to it
+// sequences with different adapters can be decoded in the same batch
+void common_set_adapter_lora_seq(struct llama_context * ctx, llama_seq_id seq_id, std::vector<common_adapter_lora_info> & lora);
+
 std::string                   get_model_endpoint();
 
 //
@@ -656,6 +801,15 @@ std::string common_detokenize(
         const std::vector<llama_token> & tokens,
                                   bool   special = true);
 
+// appends the pieces of the tokens to text, as common_token_to_piece() for each of them
+// returns the size of text without an incomplete UTF-8 sequence at the end of the pieces
+size_t common_detokenize_append(
+          const struct llama_vocab * vocab,
+                 const llama_token * tokens,
+                            size_t   n_tokens,
+                       std::string & text,
+                              bool   special = true);
+
 //
 // Embedding utils
 //
@@ -696,6 +850,10 @@ const char * const LLM_KV_SPLIT_NO            = "split.no";
 const char * const LLM_KV_SPLIT_COUNT         = "split.count";
 const char * const LLM_KV_SPLIT_TENSORS_COUNT = "split.tensors.count";
 
+const char * const LLM_KV_DELTA_BASE          = "delta.base";
+const char * const LLM_KV_DELTA_TENSORS       = "delta.tensors";
+const char * const LLM_KV_DELTA_TENSOR_HASHES = "delta.tensor_hashes";
+
 }
 
 //
@@ -703,3 +861,6 @@ const char * const LLM_KV_SPLIT_TENSORS_COUNT = "split.tensors.count";
 //
 
 ggml_opt_dataset_t common_opt_dataset_init(struct llama_context * ctx, const std::vector<llama_token> & tokens, int64_t stride);
+
+// same datapoints from a file of raw llama_token values that is mapped instead of copied into the dataset, returns nullptr on failure
+ggml_opt_dataset_t common_opt_dataset_init_mmap(struct llama_context * ctx, const std::string & fname, int64_t stride);
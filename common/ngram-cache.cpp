@@ -5,12 +5,23 @@
 #include <cinttypes>
 #include <cstdint>
 #include <cstdio>
+#include <cstring>
 #include <fstream>
 #include <thread>
 #include <algorithm>
 
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define COMMON_NGRAM_CACHE_SORTED_MAGIC   0x43474e4c // "LNGC"
+#define COMMON_NGRAM_CACHE_SORTED_VERSION 1
+
 void common_ngram_cache_update(common_ngram_cache & ngram_cache, int ngram_min, int ngram_max,
-                              std::vector<llama_token> & inp, int nnew, bool print_progress) {
+                              const std::vector<llama_token> & inp, int nnew, bool print_progress) {
     const int64_t t_start_ms = ggml_time_ms();
     const int64_t inp_size = inp.size();
 
@@ -51,6 +62,20 @@ void common_ngram_cache_update(common_ngram_cache & ngram_cache, int ngram_min,
     }
 }
 
+// Lookup in a common_ngram_cache:
+static common_ngram_cache_lookup ngram_cache_lookup(common_ngram_cache & ngram_cache) {
+    return [&ngram_cache](const common_ngram & ngram, common_ngram_cache_part & part) {
+        common_ngram_cache::const_iterator part_it = ngram_cache.find(ngram);
+        if (part_it == ngram_cache.end()) {
+            return false;
+        }
+        for (const std::pair<const llama_token, int32_t> & token_count : part_it->second) {
+            part[token_count.first] += token_count.second;
+        }
+        return true;
+    };
+}
+
 // Helper function to get a token from the combined, speculative sequence of inp and draft.
 static llama_token get_token(const std::vector<llama_token> & inp, const std::vector<llama_token> & draft, const size_t i) {
     return i < inp.size() ? inp[i] : draft[1 + i - inp.size()];
@@ -63,12 +88,11 @@ constexpr int draft_min_sample_size_strict[LLAMA_NGRAM_MAX] = { 4,  3,  2,  2};
 constexpr int     draft_min_percent_strict[LLAMA_NGRAM_MAX] = {75, 66, 66, 66};
 
 // Helper function that tries to draft a token from only the static ngram cache:
-static llama_token try_draft(common_ngram_cache & nc_static, const common_ngram ngram_static) {
-    common_ngram_cache::iterator part_static_it = nc_static.find(ngram_static);
-    if (part_static_it == nc_static.end()) {
+static llama_token try_draft(const common_ngram_cache_lookup & nc_static, const common_ngram ngram_static) {
+    common_ngram_cache_part part_static;
+    if (!nc_static(ngram_static, part_static)) {
         return LLAMA_TOKEN_NULL;
     }
-    const common_ngram_cache_part part_static = part_static_it->second;
 
     int max_count_static  = 0;
     int sum_count_static  = 0;
@@ -96,7 +120,7 @@ static llama_token try_draft(common_ngram_cache & nc_static, const common_ngram
 
 // Try to draft a token from primary cache (context/dynamic), validate with static cache:
 static llama_token try_draft(
-    common_ngram_cache & nc_primary, const std::vector<common_ngram> & ngrams_primary, common_ngram_cache_part & part_static,
+    const common_ngram_cache_lookup & nc_primary, const std::vector<common_ngram> & ngrams_primary, common_ngram_cache_part & part_static,
     const int * min_sample_size, const int * min_percent) {
 
     llama_token drafted_token = LLAMA_TOKEN_NULL;
@@ -104,11 +128,10 @@ static llama_token try_draft(
     for (int i = ngrams_primary.size()-1; i >= 0 && drafted_token == LLAMA_TOKEN_NULL; --i) {
         const common_ngram ngram_primary = ngrams_primary[i];
 
-        common_ngram_cache::iterator part_primary_it = nc_primary.find(ngram_primary);
-        if (part_primary_it == nc_primary.end()) {
+        common_ngram_cache_part part_primary;
+        if (!nc_primary(ngram_primary, part_primary)) {
             continue;
         }
-        const common_ngram_cache_part part_primary = part_primary_it->second;
 
         int max_count_primary = 0;
         int max_count_static  = 0;
@@ -144,8 +167,16 @@ static llama_token try_draft(
 }
 
 void common_ngram_cache_draft(
-    std::vector<llama_token> & inp, std::vector<llama_token> & draft, int n_draft, int ngram_min, int ngram_max,
+    const std::vector<llama_token> & inp, std::vector<llama_token> & draft, int n_draft, int ngram_min, int ngram_max,
     common_ngram_cache & nc_context, common_ngram_cache & nc_dynamic, common_ngram_cache & nc_static
+) {
+    common_ngram_cache_draft(inp, draft, n_draft, ngram_min, ngram_max,
+        ngram_cache_lookup(nc_context), ngram_cache_lookup(nc_dynamic), ngram_cache_lookup(nc_static));
+}
+
+void common_ngram_cache_draft(
+    const std::vector<llama_token> & inp, std::vector<llama_token> & draft, int n_draft, int ngram_min, int ngram_max,
+    const common_ngram_cache_lookup & nc_context, const common_ngram_cache_lookup & nc_dynamic, const common_ngram_cache_lookup & nc_static
 ) {
     GGML_ASSERT(draft.size() == 1);
     const int inp_size = inp.size();
@@ -162,11 +193,8 @@ void common_ngram_cache_draft(
         for (int j = ngram_start_static; j < ngram_start_static + LLAMA_NGRAM_STATIC; ++j) {
             ngram_static.tokens[j-ngram_start_static] = get_token(inp, draft, j);
         }
-        common_ngram_cache::iterator part_static_it = nc_static.find(ngram_static);
         common_ngram_cache_part part_static;
-        if (part_static_it != nc_static.end()) {
-            part_static = part_static_it->second;
-        }
+        nc_static(ngram_static, part_static);
 
         // cd = context + dynamic
         std::vector<common_ngram> ngrams_cd;
@@ -227,6 +255,22 @@ common_ngram_cache common_ngram_cache_load(std::string & filename) {
     }
     common_ngram_cache ngram_cache;
 
+    uint32_t magic = 0;
+    if (hashmap_file.read(reinterpret_cast<char *>(&magic), sizeof(magic)) && magic == COMMON_NGRAM_CACHE_SORTED_MAGIC) {
+        const common_ngram_cache_sorted ngram_cache_sorted = common_ngram_cache_sorted_load(filename);
+
+        for (size_t i = 0; i < ngram_cache_sorted.n_ngram; ++i) {
+            common_ngram_cache_part & part = ngram_cache[ngram_cache_sorted.ngrams[i]];
+            for (uint64_t j = ngram_cache_sorted.offsets[i]; j < ngram_cache_sorted.offsets[i + 1]; ++j) {
+                part.emplace(ngram_cache_sorted.tokens[j], ngram_cache_sorted.counts[j]);
+            }
+        }
+
+        return ngram_cache;
+    }
+    hashmap_file.clear();
+    hashmap_file.seekg(0);
+
     common_ngram ngram;
     int32_t     ntokens;
     llama_token token;
@@ -284,3 +328,262 @@ void common_ngram_cache_merge(common_ngram_cache & ngram_cache_target, common_ng
         }
     }
 }
+
+//
+// common_ngram_cache_sorted
+//
+
+static bool ngram_less(const common_ngram & a, const common_ngram & b) {
+    for (int i = 0; i < LLAMA_NGRAM_MAX; ++i) {
+        if (a.tokens[i] != b.tokens[i]) {
+            return a.tokens[i] < b.tokens[i];
+        }
+    }
+    return false;
+}
+
+struct ngram_cache_sorted_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t n_ngrams;
+    uint64_t n_tokens;
+};
+
+static size_t ngram_cache_sorted_size(uint64_t n_ngrams, uint64_t n_tokens) {
+    return sizeof(ngram_cache_sorted_header) + n_ngrams*sizeof(common_ngram) + (n_ngrams + 1)*sizeof(uint64_t) + 2*n_tokens*sizeof(int32_t);
+}
+
+// set up the array pointers from the serialized data, returns false if the data is not a valid sorted cache
+static bool ngram_cache_sorted_init(common_ngram_cache_sorted & nc) {
+    if (nc.size < sizeof(ngram_cache_sorted_header)) {
+        return false;
+    }
+
+    ngram_cache_sorted_header header;
+    memcpy(&header, nc.data, sizeof(header));
+
+    if (header.magic != COMMON_NGRAM_CACHE_SORTED_MAGIC || header.version != COMMON_NGRAM_CACHE_SORTED_VERSION) {
+        return false;
+    }
+    if (ngram_cache_sorted_size(header.n_ngrams, header.n_tokens) != nc.size) {
+        return false;
+    }
+
+    nc.n_ngram = header.n_ngrams;
+    nc.n_token = header.n_tokens;
+
+    const uint8_t * ptr = nc.data + sizeof(header);
+
+    nc.ngrams  = reinterpret_cast<const common_ngram *>(ptr); ptr += nc.n_ngram*sizeof(common_ngram);
+    nc.offsets = reinterpret_cast<const uint64_t     *>(ptr); ptr += (nc.n_ngram + 1)*sizeof(uint64_t);
+    nc.tokens  = reinterpret_cast<const llama_token  *>(ptr); ptr += nc.n_token*sizeof(llama_token);
+    nc.counts  = reinterpret_cast<const int32_t      *>(ptr);
+
+    return nc.offsets[nc.n_ngram] == nc.n_token;
+}
+
+common_ngram_cache_sorted::~common_ngram_cache_sorted() {
+#if !defined(_WIN32)
+    if (mapping) {
+        munmap(mapping, size);
+    }
+#endif
+}
+
+common_ngram_cache_sorted::common_ngram_cache_sorted(common_ngram_cache_sorted && other) noexcept {
+    *this = std::move(other);
+}
+
+common_ngram_cache_sorted & common_ngram_cache_sorted::operator=(common_ngram_cache_sorted && other) noexcept {
+    if (this != &other) {
+#if !defined(_WIN32)
+        if (mapping) {
+            munmap(mapping, size);
+        }
+#endif
+
+        data    = other.data;
+        size    = other.size;
+        buf     = std::move(other.buf);
+        mapping = other.mapping;
+        n_ngram = other.n_ngram;
+        n_token = other.n_token;
+        ngrams  = other.ngrams;
+        offsets = other.offsets;
+        tokens  = other.tokens;
+        counts  = other.counts;
+
+        other.data    = nullptr;
+        other.size    = 0;
+        other.mapping = nullptr;
+        other.n_ngram = 0;
+        other.n_token = 0;
+        other.ngrams  = nullptr;
+        other.offsets = nullptr;
+        other.tokens  = nullptr;
+        other.counts  = nullptr;
+    }
+    return *this;
+}
+
+bool common_ngram_cache_sorted::find(const common_ngram & ngram, common_ngram_cache_part & part) const {
+    const common_ngram * it = std::lower_bound(ngrams, ngrams + n_ngram, ngram, ngram_less);
+    if (it == ngrams + n_ngram || !(*it == ngram)) {
+        return false;
+    }
+
+    const size_t i = it - ngrams;
+    for (uint64_t j = offsets[i]; j < offsets[i + 1]; ++j) {
+        part[tokens[j]] += counts[j];
+    }
+    return true;
+}
+
+common_ngram_cache_sorted common_ngram_cache_sorted_merge(const common_ngram_cache_sorted * base, const common_ngram_cache & add) {
+    // sort the n-grams to add, the n-grams of base are already sorted
+    std::vector<const std::pair<const common_ngram, common_ngram_cache_part> *> items;
+    items.reserve(add.size());
+    for (const auto & item : add) {
+        items.push_back(&item);
+    }
+    std::sort(items.begin(), items.end(), [](const auto * a, const auto * b) {
+        return ngram_less(a->first, b->first);
+    });
+
+    const size_t n_base = base ? base->n_ngram : 0;
+
+    std::vector<common_ngram>       ngrams;
+    std::vector<uint64_t>           offsets;
+    std::vector<llama_token>        tokens;
+    std::vector<int32_t>            counts;
+    std::vector<std::pair<llama_token, int32_t>> token_counts;
+
+    ngrams.reserve(n_base + items.size());
+    offsets.reserve(n_base + items.size() + 1);
+    tokens.reserve((base ? base->n_token : 0) + items.size());
+    counts.reserve((base ? base->n_token : 0) + items.size());
+
+    size_t ib = 0;
+    size_t ia = 0;
+    while (ib < n_base || ia < items.size()) {
+        const bool take_base = ia == items.size() || (ib < n_base && !ngram_less(items[ia]->first, base->ngrams[ib]));
+        const bool take_add  = ib == n_base       || (ia < items.size() && !ngram_less(base->ngrams[ib], items[ia]->first));
+
+        common_ngram_cache_part part;
+        if (take_base) {
+            for (uint64_t j = base->offsets[ib]; j < base->offsets[ib + 1]; ++j) {
+                part[base->tokens[j]] += base->counts[j];
+            }
+        }
+        if (take_add) {
+            for (const auto & token_count : items[ia]->second) {
+                part[token_count.first] += token_count.second;
+            }
+        }
+
+        ngrams.push_back(take_base ? base->ngrams[ib] : items[ia]->first);
+        offsets.push_back(tokens.size());
+
+        // store the following tokens in a deterministic order
+        token_counts.assign(part.begin(), part.end());
+        std::sort(token_counts.begin(), token_counts.end());
+        for (const auto & token_count : token_counts) {
+            tokens.push_back(token_count.first);
+            counts.push_back(token_count.second);
+        }
+
+        ib += take_base;
+        ia += take_add;
+    }
+    offsets.push_back(tokens.size());
+
+    common_ngram_cache_sorted res;
+
+    const ngram_cache_sorted_header header = {
+        COMMON_NGRAM_CACHE_SORTED_MAGIC,
+        COMMON_NGRAM_CACHE_SORTED_VERSION,
+        ngrams.size(),
+        tokens.size(),
+    };
+
+    res.buf.resize(ngram_cache_sorted_size(header.n_ngrams, header.n_tokens));
+
+    uint8_t * ptr = res.buf.data();
+    memcpy(ptr, &header,        sizeof(header));                       ptr += sizeof(header);
+    memcpy(ptr, ngrams.data(),  ngrams.size()*sizeof(common_ngram));   ptr += ngrams.size()*sizeof(common_ngram);
+    memcpy(ptr, offsets.data(), offsets.size()*sizeof(uint64_t));      ptr += offsets.size()*sizeof(uint64_t);
+    memcpy(ptr, tokens.data(),  tokens.size()*sizeof(llama_token));    ptr += tokens.size()*sizeof(llama_token);
+    memcpy(ptr, counts.data(),  counts.size()*sizeof(int32_t));
+
+    res.data = res.buf.data();
+    res.size = res.buf.size();
+
+    GGML_ASSERT(ngram_cache_sorted_init(res));
+
+    return res;
+}
+
+bool common_ngram_cache_sorted_save(const common_ngram_cache_sorted & ngram_cache, const std::string & filename) {
+    if (ngram_cache.data == nullptr) {
+        // an empty cache is saved with a valid header
+        common_ngram_cache_sorted empty = common_ngram_cache_sorted_merge(nullptr, {});
+        return common_ngram_cache_sorted_save(empty, filename);
+    }
+
+    std::ofstream file_out(filename, std::ios::binary);
+    file_out.write(reinterpret_cast<const char *>(ngram_cache.data), ngram_cache.size);
+
+    return file_out.good();
+}
+
+common_ngram_cache_sorted common_ngram_cache_sorted_load(const std::string & filename) {
+    common_ngram_cache_sorted res;
+
+    uint32_t magic = 0;
+    {
+        std::ifstream file_in(filename, std::ios::binary);
+        if (!file_in) {
+            throw std::ifstream::failure("Unable to open file " + filename);
+        }
+        file_in.read(reinterpret_cast<char *>(&magic), sizeof(magic));
+    }
+
+    if (magic != COMMON_NGRAM_CACHE_SORTED_MAGIC) {
+        // convert a cache saved with common_ngram_cache_save
+        std::string fname = filename;
+        return common_ngram_cache_sorted_merge(nullptr, common_ngram_cache_load(fname));
+    }
+
+#if !defined(_WIN32)
+    const int fd = open(filename.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void * addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (addr != MAP_FAILED) {
+                res.mapping = addr;
+                res.data    = static_cast<const uint8_t *>(addr);
+                res.size    = st.st_size;
+            }
+        }
+        close(fd);
+    }
+#endif
+
+    if (res.data == nullptr) {
+        // memory mapping is not available - read the file
+        std::ifstream file_in(filename, std::ios::binary | std::ios::ate);
+        res.buf.resize(file_in.tellg());
+        file_in.seekg(0);
+        file_in.read(reinterpret_cast<char *>(res.buf.data()), res.buf.size());
+
+        res.data = res.buf.data();
+        res.size = res.buf.size();
+    }
+
+    if (!ngram_cache_sorted_init(res)) {
+        throw std::ifstream::failure("Invalid sorted ngram cache file " + filename);
+    }
+
+    return res;
+}
@@ -2,6 +2,7 @@
 
 #include "llama.h"
 
+#include <functional>
 #include <unordered_map>
 #include <string>
 #include <vector>
@@ -60,6 +61,53 @@ typedef std::unordered_map<llama_token, int32_t> common_ngram_cache_part;
 // n-gram -> empirical distribution of following tokens
 typedef std::unordered_map<common_ngram, common_ngram_cache_part, common_ngram_hash_function> common_ngram_cache;
 
+// Read-only n-gram cache stored as arrays sorted by n-gram, looked up with a binary search.
+// The file format is the memory layout, so large caches are memory-mapped instead of being parsed:
+//
+//   header: magic, version, n_ngrams, n_tokens
+//   ngrams[n_ngrams]       - sorted n-grams
+//   offsets[n_ngrams + 1]  - range of each n-gram in tokens and counts
+//   tokens[n_tokens]       - following tokens
+//   counts[n_tokens]       - number of times each token has been seen
+struct common_ngram_cache_sorted {
+    common_ngram_cache_sorted() = default;
+    ~common_ngram_cache_sorted();
+
+    common_ngram_cache_sorted(const common_ngram_cache_sorted &) = delete;
+    common_ngram_cache_sorted & operator=(const common_ngram_cache_sorted &) = delete;
+
+    common_ngram_cache_sorted(common_ngram_cache_sorted && other) noexcept;
+    common_ngram_cache_sorted & operator=(common_ngram_cache_sorted && other) noexcept;
+
+    // add the token counts of ngram to part, returns false if the n-gram is not in the cache
+    bool find(const common_ngram & ngram, common_ngram_cache_part & part) const;
+
+    size_t n_ngrams() const { return n_ngram; }
+    size_t n_bytes()  const { return size; }
+
+    bool empty() const { return n_ngram == 0; }
+
+    // serialized data, either memory-mapped or owned
+    const uint8_t * data = nullptr;
+    size_t          size = 0;
+
+    std::vector<uint8_t> buf;
+
+    void * mapping = nullptr;
+
+    size_t n_ngram = 0;
+    size_t n_token = 0;
+
+    const common_ngram * ngrams  = nullptr;
+    const uint64_t     * offsets = nullptr;
+    const llama_token  * tokens  = nullptr;
+    const int32_t      * counts  = nullptr;
+};
+
+// Lookup of the empirical distribution of the tokens following an n-gram.
+// Adds the token counts of ngram to part, returns false if the n-gram is unknown.
+typedef std::function<bool(const common_ngram & ngram, common_ngram_cache_part & part)> common_ngram_cache_lookup;
+
 
 // Update an ngram cache with tokens.
 // ngram_cache:         the cache to modify.
@@ -71,7 +119,7 @@ typedef std::unordered_map<common_ngram, common_ngram_cache_part, common_ngram_h
 // In order to get correct results inp_data can ONLY BE APPENDED TO.
 // Changes in the middle need a complete rebuild.
 void common_ngram_cache_update(
-    common_ngram_cache & ngram_cache, int ngram_min, int ngram_max, std::vector<llama_token> & inp_data, int nnew, bool print_progress);
+    common_ngram_cache & ngram_cache, int ngram_min, int ngram_max, const std::vector<llama_token> & inp_data, int nnew, bool print_progress);
 
 // Try to draft tokens from ngram caches.
 // inp:                the tokens generated so far.
@@ -82,19 +130,39 @@ void common_ngram_cache_update(
 // nc_dynamic:         ngram cache based on previous user generations.
 // nc_static:          ngram cache generated from a large text corpus, used for validation.
 void common_ngram_cache_draft(
-    std::vector<llama_token> & inp, std::vector<llama_token> & draft, int n_draft, int ngram_min, int ngram_max,
+    const std::vector<llama_token> & inp, std::vector<llama_token> & draft, int n_draft, int ngram_min, int ngram_max,
     common_ngram_cache & nc_context, common_ngram_cache & nc_dynamic, common_ngram_cache & nc_static);
 
+// Same as above, with the caches accessed through lookup functions, e.g. to combine several caches or to
+// use a common_ngram_cache_sorted.
+void common_ngram_cache_draft(
+    const std::vector<llama_token> & inp, std::vector<llama_token> & draft, int n_draft, int ngram_min, int ngram_max,
+    const common_ngram_cache_lookup & nc_context, const common_ngram_cache_lookup & nc_dynamic, const common_ngram_cache_lookup & nc_static);
+
 // Save an ngram cache to a file.
 // ngram_cache: the ngram cache to save.
 // filename:    the path under which to save the ngram cache.
 void common_ngram_cache_save(common_ngram_cache & ngram_cache, std::string & filename);
 
-// Load an ngram cache saved with common_ngram_cache_save.
+// Load an ngram cache saved with common_ngram_cache_save or common_ngram_cache_sorted_save.
 // filename: the path from which to load the ngram cache.
 // returns:  an ngram cache containing the information saved to filename.
 common_ngram_cache common_ngram_cache_load(std::string & filename);
 
+// Create a sorted ngram cache with the information of two caches.
+// base: the sorted ngram cache to start from, can be nullptr.
+// add:  the ngram cache to add to base.
+common_ngram_cache_sorted common_ngram_cache_sorted_merge(const common_ngram_cache_sorted * base, const common_ngram_cache & add);
+
+// Save a sorted ngram cache to a file.
+// returns: false if the file could not be written.
+bool common_ngram_cache_sorted_save(const common_ngram_cache_sorted & ngram_cache, const std::string & filename);
+
+// Load a sorted ngram cache from a file, memory-mapped if supported by the platform.
+// Files saved with common_ngram_cache_save are converted.
+// throws: std::ifstream::failure if the file could not be opened.
+common_ngram_cache_sorted common_ngram_cache_sorted_load(const std::string & filename);
+
 // Merge two ngram caches.
 // ngram_cache_target: the ngram cache to which to add the information from ngram_cache_add.
 // ngram_cache_add:    the ngram cache to add to ngram_cache_target.
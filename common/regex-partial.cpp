@@ -3,10 +3,30 @@
 #include <functional>
 #include <optional>
 
+// anchors and lookaheads are not supported by regex_to_reversed_partial_regex, but word boundaries are
+static bool regex_is_position_independent(const std::string & pattern) {
+    bool in_class = false;
+    for (size_t i = 0; i < pattern.size(); ++i) {
+        const char c = pattern[i];
+        if (c == '\\') {
+            if (i + 1 < pattern.size() && !in_class && (pattern[i + 1] == 'b' || pattern[i + 1] == 'B')) {
+                return false;
+            }
+            ++i;
+        } else if (in_class) {
+            in_class = c != ']';
+        } else if (c == '[') {
+            in_class = true;
+        }
+    }
+    return true;
+}
+
 common_regex::common_regex(const std::string & pattern) :
     pattern(pattern),
     rx(pattern),
-    rx_reversed_partial(regex_to_reversed_partial_regex(pattern)) {}
+    rx_reversed_partial(regex_to_reversed_partial_regex(pattern)),
+    position_independent(regex_is_position_independent(pattern)) {}
 
 common_regex_match common_regex::search(const std::string & input, size_t pos, bool as_match) const {
     std::smatch match;
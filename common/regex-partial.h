@@ -43,6 +43,7 @@ class common_regex {
     std::string pattern;
     std::regex rx;
     std::regex rx_reversed_partial;
+    bool position_independent;
 
   public:
     explicit common_regex(const std::string & pattern);
@@ -50,6 +51,10 @@ class common_regex {
     common_regex_match search(const std::string & input, size_t pos, bool as_match = false) const;
 
     const std::string & str() const { return pattern; }
+
+    // No word boundaries: a match does not depend on where the search started,
+    // so a search can skip the positions where a previous search of the same input found nothing.
+    bool is_position_independent() const { return position_independent; }
 };
 
 // For testing only (pretty print of failures).
@@ -4,6 +4,9 @@
 #include "log.h"
 
 #include <cmath>
+#include <deque>
+#include <future>
+#include <mutex>
 #include <unordered_map>
 #include <algorithm>
 
@@ -100,6 +103,33 @@ struct ring_buffer {
     std::vector<T> data;
 };
 
+// the logits of one output of the last evaluation
+// ids is null when the logits cover the full vocabulary
+struct common_sampler_logits {
+    const llama_token * ids    = nullptr;
+    const float       * logits = nullptr;
+    int32_t             n      = 0;
+};
+
+static common_sampler_logits common_sampler_get_logits(struct llama_context * ctx, int idx) {
+    common_sampler_logits res;
+
+    // the context selected the top-k logits on the device - sample only from these candidates
+    res.n = llama_get_logits_top_k_ith(ctx, idx, &res.ids, &res.logits);
+    if (res.n > 0) {
+        return res;
+    }
+
+    const llama_model * model = llama_get_model(ctx);
+    const llama_vocab * vocab = llama_model_get_vocab(model);
+
+    res.ids    = nullptr;
+    res.logits = llama_get_logits_ith(ctx, idx);
+    res.n      = llama_vocab_n_tokens(vocab);
+
+    return res;
+}
+
 struct common_sampler {
     common_params_sampling params;
 
@@ -112,18 +142,26 @@ struct common_sampler {
 
     llama_token_data_array cur_p;
 
-    void set_logits(struct llama_context * ctx, int idx) {
-        const auto * logits = llama_get_logits_ith(ctx, idx);
+    // the pending preparation of the grammar mask, see common_sampler_prepare
+    std::future<void> prepared;
 
-        const llama_model * model = llama_get_model(ctx);
-        const llama_vocab * vocab = llama_model_get_vocab(model);
-
-        const int n_vocab = llama_vocab_n_tokens(vocab);
+    void wait() {
+        if (prepared.valid()) {
+            prepared.get();
+        }
+    }
 
-        cur.resize(n_vocab);
+    void set_logits(const common_sampler_logits & src) {
+        cur.resize(src.n);
 
-        for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
-            cur[token_id] = llama_token_data{token_id, logits[token_id], 0.0f};
+        if (src.ids) {
+            for (int32_t i = 0; i < src.n; i++) {
+                cur[i] = llama_token_data{src.ids[i], src.logits[i], 0.0f};
+            }
+        } else {
+            for (llama_token token_id = 0; token_id < src.n; token_id++) {
+                cur[token_id] = llama_token_data{token_id, src.logits[token_id], 0.0f};
+            }
         }
 
         cur_p = { cur.data(), cur.size(), -1, false };
@@ -146,13 +184,7 @@ std::string common_params_sampling::print() const {
     return std::string(result);
 }
 
-struct common_sampler * common_sampler_init(const struct llama_model * model, const struct common_params_sampling & params) {
-    const llama_vocab * vocab = llama_model_get_vocab(model);
-
-    llama_sampler_chain_params lparams = llama_sampler_chain_default_params();
-
-    lparams.no_perf = params.no_perf;
-
+static struct llama_sampler * common_grammar_init(const llama_vocab * vocab, const struct common_params_sampling & params) {
     struct llama_sampler * grmr;
     if (params.grammar.compare(0, 11, "%llguidance") == 0) {
 #ifdef LLAMA_USE_LLGUIDANCE
@@ -208,9 +240,96 @@ struct common_sampler * common_sampler_init(const struct llama_model * model, co
                                                         trigger_patterns_c.data(), trigger_patterns_c.size(),
                                                         trigger_tokens.data(), trigger_tokens.size())
              :      llama_sampler_init_grammar(vocab, params.grammar.c_str(), "root");
+    }
+
+    return grmr;
+}
+
+struct common_grammar_cache {
+    struct entry {
+        std::string key;
+
+        struct llama_sampler * grmr;
+    };
+
+    size_t n_max;
+
+    std::mutex mutex;
+    std::deque<entry> entries; // most recent first
+
+    ~common_grammar_cache() {
+        for (auto & e : entries) {
+            llama_sampler_free(e.grmr);
+        }
+    }
+
+    static std::string make_key(const struct common_params_sampling & params) {
+        std::string key = params.grammar;
+        key += params.grammar_lazy ? '\1' : '\0';
+        for (const auto & trigger : params.grammar_triggers) {
+            key += '\0';
+            key += std::to_string(trigger.type) + ":" + std::to_string(trigger.token) + ":" + trigger.value;
+        }
+
+        return key;
+    }
+
+    // a new grammar sampler for the params, nullptr if the grammar is invalid
+    struct llama_sampler * get(const llama_vocab * vocab, const struct common_params_sampling & params) {
+        const std::string key = make_key(params);
+
+        std::lock_guard<std::mutex> lock(mutex);
+
+        for (auto it = entries.begin(); it != entries.end(); ++it) {
+            if (it->key == key) {
+                entry e = std::move(*it);
+                entries.erase(it);
+                entries.push_front(std::move(e));
+
+                return llama_sampler_clone(entries.front().grmr);
+            }
+        }
+
+        struct llama_sampler * grmr = common_grammar_init(vocab, params);
         if (!grmr) {
             return nullptr;
         }
+
+        // the clones start with the mask of the initial state
+        llama_sampler_grammar_prepare(grmr);
+
+        if (entries.size() >= n_max) {
+            llama_sampler_free(entries.back().grmr);
+            entries.pop_back();
+        }
+        entries.push_front({ key, grmr });
+
+        return llama_sampler_clone(grmr);
+    }
+};
+
+struct common_grammar_cache * common_grammar_cache_init(size_t n_max) {
+    auto * result = new common_grammar_cache;
+
+    result->n_max = std::max<size_t>(1, n_max);
+
+    return result;
+}
+
+void common_grammar_cache_free(struct common_grammar_cache * cache) {
+    delete cache;
+}
+
+struct common_sampler * common_sampler_init(const struct llama_model * model, const struct common_params_sampling & params, struct common_grammar_cache * cache) {
+    const llama_vocab * vocab = llama_model_get_vocab(model);
+
+    llama_sampler_chain_params lparams = llama_sampler_chain_default_params();
+
+    lparams.no_perf = params.no_perf;
+
+    struct llama_sampler * grmr = cache && !params.grammar.empty() ? cache->get(vocab, params) : common_grammar_init(vocab, params);
+    if (!grmr) {
+        return nullptr;
     }
 
     auto * result = new common_sampler {
@@ -220,6 +339,7 @@ struct common_sampler * common_sampler_init(const struct llama_model * model, co
         /* .prev   = */ ring_buffer<llama_token>(std::max(32, params.n_prev)),
         /* .cur    = */ {},
         /* .cur_p  = */ {},
+        /* .prepared = */ {},
     };
 
     llama_sampler_chain_add(result->chain,
@@ -289,6 +409,8 @@ struct common_sampler * common_sampler_init(const struct llama_model * model, co
 
 void common_sampler_free(struct common_sampler * gsmpl) {
     if (gsmpl) {
+        gsmpl->wait();
+
         llama_sampler_free(gsmpl->grmr);
 
         llama_sampler_free(gsmpl->chain);
@@ -298,6 +420,8 @@ void common_sampler_free(struct common_sampler * gsmpl) {
 }
 
 void common_sampler_accept(struct common_sampler * gsmpl, llama_token token, bool accept_grammar) {
+    gsmpl->wait();
+
     if (accept_grammar) {
         llama_sampler_accept(gsmpl->grmr, token);
     }
@@ -308,12 +432,30 @@ void common_sampler_accept(struct common_sampler * gsmpl, llama_token token, boo
 }
 
 void common_sampler_reset(struct common_sampler * gsmpl) {
+    gsmpl->wait();
+
     llama_sampler_reset(gsmpl->grmr);
 
     llama_sampler_reset(gsmpl->chain);
 }
 
+void common_sampler_prepare(struct common_sampler * gsmpl) {
+    if (!gsmpl->params.grammar_async || gsmpl->params.grammar.empty()) {
+        return;
+    }
+
+    gsmpl->wait();
+
+    const llama_sampler * grmr = gsmpl->grmr;
+
+    gsmpl->prepared = common_thread_pool_async([grmr]() {
+        llama_sampler_grammar_prepare(grmr);
+    });
+}
+
 struct common_sampler * common_sampler_clone(common_sampler * gsmpl) {
+    gsmpl->wait();
+
     return new common_sampler {
         /* .params = */ gsmpl->params,
         /* .grmr   = */ llama_sampler_clone(gsmpl->grmr),
@@ -321,6 +463,7 @@ struct common_sampler * common_sampler_clone(common_sampler * gsmpl) {
         /* .prev   = */ gsmpl->prev,
         /* .cur    = */ gsmpl->cur,
         /* .cur_p  = */ gsmpl->cur_p,
+        /* .prepared = */ {},
     };
 }
 
@@ -335,8 +478,10 @@ void common_perf_print(const struct llama_context * ctx, const struct common_sam
     }
 }
 
-llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_context * ctx, int idx, bool grammar_first) {
-    gsmpl->set_logits(ctx, idx);
+static llama_token common_sampler_sample_impl(struct common_sampler * gsmpl, const common_sampler_logits & src, bool grammar_first) {
+    gsmpl->wait();
+
+    gsmpl->set_logits(src);
 
     auto & grmr  = gsmpl->grmr;
     auto & chain = gsmpl->chain;
@@ -371,7 +516,7 @@ llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_co
 
     // resampling:
     // if the token is not valid, sample again, but first apply the grammar sampler and then the sampling chain
-    gsmpl->set_logits(ctx, idx);
+    gsmpl->set_logits(src);
 
     llama_sampler_apply(grmr,  &cur_p);
     llama_sampler_apply(chain, &cur_p);
@@ -381,6 +526,40 @@ llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_co
     return cur_p.data[cur_p.selected].id;
 }
 
+llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_context * ctx, int idx, bool grammar_first) {
+    return common_sampler_sample_impl(gsmpl, common_sampler_get_logits(ctx, idx), grammar_first);
+}
+
+std::vector<llama_token> common_sampler_sample_batch(const std::vector<struct common_sampler *> & gsmpls, struct llama_context * ctx, const std::vector<int> & idxs, int n_threads, bool grammar_first) {
+    GGML_ASSERT(gsmpls.size() == idxs.size() && "gsmpls.size() must be idxs.size()");
+
+    const int n_seqs = gsmpls.size();
+
+    std::vector<llama_token> result(n_seqs);
+
+    n_threads = std::max(1, std::min(n_threads, n_seqs));
+
+    if (n_threads == 1) {
+        for (int i = 0; i < n_seqs; ++i) {
+            result[i] = common_sampler_sample(gsmpls[i], ctx, idxs[i], grammar_first);
+        }
+
+        return result;
+    }
+
+    // fetch the logits on this thread, so that the workers do not call into the context
+    std::vector<common_sampler_logits> srcs(n_seqs);
+    for (int i = 0; i < n_seqs; ++i) {
+        srcs[i] = common_sampler_get_logits(ctx, idxs[i]);
+    }
+
+    common_thread_pool_for(n_seqs, n_threads, [&](int i) {
+        result[i] = common_sampler_sample_impl(gsmpls[i], srcs[i], grammar_first);
+    });
+
+    return result;
+}
+
 std::vector<llama_token> common_sampler_sample_and_accept_n(struct common_sampler * gsmpl, struct llama_context * ctx, const std::vector<int> & idxs, const llama_tokens & draft, bool grammar_first) {
     GGML_ASSERT(idxs.size() == draft.size() + 1 && "idxs.size() must be draft.size() + 1");
 
@@ -434,6 +613,14 @@ llama_token common_sampler_last(const struct common_sampler * gsmpl) {
     return gsmpl->prev.rat(0);
 }
 
+std::string common_sampler_forced_text(const struct common_sampler * gsmpl, int n_max) {
+    std::string result(n_max, '\0');
+
+    result.resize(llama_sampler_grammar_forced_text(gsmpl->grmr, result.data(), n_max));
+
+    return result;
+}
+
 std::string common_sampler_print(const struct common_sampler * gsmpl) {
     std::string result = "logits ";
 
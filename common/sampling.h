@@ -34,9 +34,18 @@
 
 struct common_sampler;
 
+// LRU cache of the grammar samplers by grammar and triggers, so that a repeated grammar is parsed only once
+// the cached samplers are cloned, which shares their parsed rules and copies the mask of their initial state
+struct common_grammar_cache;
+
+struct common_grammar_cache * common_grammar_cache_init(size_t n_max);
+
+void common_grammar_cache_free(struct common_grammar_cache * cache);
+
 // llama_sampler API overloads
 
-struct common_sampler * common_sampler_init(const struct llama_model * model, const struct common_params_sampling & params);
+// if cache is not nullptr, the grammar sampler is cloned from it
+struct common_sampler * common_sampler_init(const struct llama_model * model, const struct common_params_sampling & params, struct common_grammar_cache * cache = nullptr);
 
 void common_sampler_free(struct common_sampler * gsmpl);
 
@@ -81,8 +90,22 @@ std::vector<llama_token> common_sampler_sample_and_accept_n(struct common_sample
 // assume idxs == [ 0, 1, 2, ..., draft.size() ]
 std::vector<llama_token> common_sampler_sample_and_accept_n(struct common_sampler * gsmpl, struct llama_context * ctx, const llama_tokens & draft, bool grammar_first = false);
 
+// batched version of common_sampler_sample
+//
+// samples one token for each pair (gsmpls[i], idxs[i]) of the last evaluation, using up to n_threads threads
+// the samplers must be distinct, since they are applied concurrently
+//
+// returns the sampled tokens in the order of gsmpls, they are not accepted
+//
+std::vector<llama_token> common_sampler_sample_batch(const std::vector<struct common_sampler *> & gsmpls, struct llama_context * ctx, const std::vector<int> & idxs, int n_threads, bool grammar_first = false);
+
 uint32_t common_sampler_get_seed(const struct common_sampler * gsmpl);
 
+// with params.grammar_async, start computing the grammar mask of the current state on a worker thread,
+// e.g. right before llama_decode so that it overlaps with the computation of the logits
+// the next call on gsmpl waits for it to finish, so the mask is only looked up when the logits are sampled
+void common_sampler_prepare(struct common_sampler * gsmpl);
+
 // helpers
 
 // access the internal list of current candidate tokens
@@ -91,6 +114,9 @@ llama_token_data_array * common_sampler_get_candidates(struct common_sampler * g
 // get the last accepted token
 llama_token common_sampler_last(const struct common_sampler * gsmpl);
 
+// get the text forced next by the grammar, up to n_max bytes - empty without a grammar
+std::string common_sampler_forced_text(const struct common_sampler * gsmpl, int n_max);
+
 // print the sampler chain into a string
 std::string common_sampler_print(const struct common_sampler * gsmpl);
 
@@ -1,11 +1,15 @@
 #include "speculative.h"
 
 #include "ggml.h"
+#include "ggml-cpu.h"
+#include "gguf.h"
 #include "llama.h"
 #include "log.h"
 #include "common.h"
 #include "sampling.h"
 
+#include <cinttypes>
+#include <cmath>
 #include <cstring>
 #include <algorithm>
 #include <map>
@@ -153,6 +157,31 @@ void common_speculative_add_replacement_tgt_dft(
     spec->tgt_dft_replacements[source] = dest;
 }
 
+bool common_speculative_set_draft_vocab(
+        struct llama_context * ctx_dft,
+                     int32_t   n_vocab) {
+    const struct llama_vocab * vocab = llama_model_get_vocab(llama_get_model(ctx_dft));
+
+    const int32_t n_tokens = llama_vocab_n_tokens(vocab);
+
+    if (n_vocab <= 0 || n_vocab >= n_tokens) {
+        return llama_set_logits_vocab(ctx_dft, nullptr, 0) == 0;
+    }
+
+    std::vector<llama_token> ids;
+    ids.reserve(n_vocab);
+
+    for (llama_token id = 0; id < n_tokens; ++id) {
+        if (id < n_vocab || llama_vocab_is_control(vocab, id) || llama_vocab_is_eog(vocab, id)) {
+            ids.push_back(id);
+        }
+    }
+
+    LOG_INF("%s: drafting with the logits of %zu of %d tokens\n", __func__, ids.size(), n_tokens);
+
+    return llama_set_logits_vocab(ctx_dft, ids.data(), ids.size()) == 0;
+}
+
 static std::string replace_to_dft(
         struct common_speculative * spec,
         const std::string& input) {
@@ -254,7 +283,7 @@ llama_tokens common_speculative_gen_draft(
     } else {
         // this happens when a previous draft has been discarded (for example, due to being too small), but the
         // target model agreed with it. in this case, we simply pass back the previous results to save compute
-        if (reuse_i + reuse_n < (int) prompt_dft.size() && prompt_dft[reuse_i + reuse_n] == id_last) {
+        if (reuse_i + reuse_n + 1 < (int) prompt_dft.size() && prompt_dft[reuse_i + reuse_n] == id_last) {
             for (int i = reuse_i + reuse_n + 1; i < (int) prompt_dft.size(); ++i) {
                 result.push_back(prompt_dft[i]);
 
@@ -263,6 +292,18 @@ llama_tokens common_speculative_gen_draft(
                 }
             }
 
+            // the previous draft was shorter than this one - continue drafting after it
+            if ((int) result.size() < params.n_draft && spec->vocab_dft_compatible) {
+                llama_tokens prompt_ext = prompt_tgt;
+                prompt_ext.push_back(id_last);
+                prompt_ext.insert(prompt_ext.end(), result.begin(), result.end() - 1);
+
+                params.n_draft -= result.size();
+
+                const llama_tokens ext = common_speculative_gen_draft(spec, params, prompt_ext, result.back());
+                result.insert(result.end(), ext.begin(), ext.end());
+            }
+
             return result;
         }
 
@@ -279,7 +320,10 @@ llama_tokens common_speculative_gen_draft(
         }
     }
 
-    // prepare a batch to evaluate any new tokens in the prompt
+    // evaluate any new tokens in the prompt, in chunks of n_batch
+    // we should rarely end-up here during normal decoding
+    const int n_batch = llama_n_batch(ctx_dft);
+
     common_batch_clear(batch);
 
     for (size_t i = i_start + reuse_n; i < prompt_tgt.size(); ++i) {
@@ -287,13 +331,13 @@ llama_tokens common_speculative_gen_draft(
         common_batch_add(batch, prompt_tgt[i], i - i_start, { 0 }, false);
 
         prompt_dft.push_back(prompt_tgt[i]);
-    }
 
-    // we should rarely end-up here during normal decoding
-    if (batch.n_tokens > 0) {
-        //LOG_DBG("%s: draft prompt batch: %s\n", __func__, string_from(ctx, batch).c_str());
+        if (batch.n_tokens == n_batch || i + 1 == prompt_tgt.size()) {
+            //LOG_DBG("%s: draft prompt batch: %s\n", __func__, string_from(ctx, batch).c_str());
 
-        llama_decode(ctx_dft, batch);
+            llama_decode(ctx_dft, batch);
+            common_batch_clear(batch);
+        }
     }
 
     const llama_pos n_past = prompt_dft.size();
@@ -359,3 +403,168 @@ llama_tokens common_speculative_gen_draft(
     }
     return result;
 }
+
+//
+// draft heads (Medusa)
+//
+
+struct common_speculative_heads {
+    struct ggml_context * ctx_w    = nullptr; // the weights of the heads
+    struct gguf_context * ctx_gguf = nullptr;
+
+    int n_embd  = 0;
+    int n_vocab = 0;
+
+    int n_threads = 1;
+
+    std::vector<ggml_tensor *> ffn_w;
+    std::vector<ggml_tensor *> ffn_b;
+    std::vector<ggml_tensor *> out_w;
+
+    std::vector<uint8_t> buf_compute;
+};
+
+struct common_speculative_heads * common_speculative_heads_init(
+        const char * path,
+        const struct llama_model * model,
+        int n_threads) {
+    auto * heads = new common_speculative_heads;
+
+    heads->n_embd    = llama_model_n_embd(model);
+    heads->n_vocab   = llama_vocab_n_tokens(llama_model_get_vocab(model));
+    heads->n_threads = std::max(1, n_threads);
+
+    struct gguf_init_params params = {
+        /* .no_alloc = */ false,
+        /* .ctx      = */ &heads->ctx_w,
+    };
+
+    heads->ctx_gguf = gguf_init_from_file(path, params);
+    if (heads->ctx_gguf == nullptr) {
+        LOG_ERR("%s: failed to load draft heads from '%s'\n", __func__, path);
+        common_speculative_heads_free(heads);
+        return nullptr;
+    }
+
+    const int64_t key = gguf_find_key(heads->ctx_gguf, "medusa.head_count");
+    if (key < 0) {
+        LOG_ERR("%s: '%s' is not a draft heads file, missing medusa.head_count\n", __func__, path);
+        common_speculative_heads_free(heads);
+        return nullptr;
+    }
+
+    const int n_heads = gguf_get_val_u32(heads->ctx_gguf, key);
+
+    for (int k = 0; k < n_heads; ++k) {
+        const auto get = [&](const char * name, int64_t ne0, int64_t ne1) -> ggml_tensor * {
+            const std::string tname = string_format("medusa.%d.%s", k, name);
+
+            ggml_tensor * t = ggml_get_tensor(heads->ctx_w, tname.c_str());
+            if (t == nullptr) {
+                LOG_ERR("%s: missing tensor '%s'\n", __func__, tname.c_str());
+                return nullptr;
+            }
+            if (t->ne[0] != ne0 || t->ne[1] != ne1) {
+                LOG_ERR("%s: tensor '%s' has shape [%" PRId64 ", %" PRId64 "], expected [%" PRId64 ", %" PRId64 "]\n",
+                        __func__, tname.c_str(), t->ne[0], t->ne[1], ne0, ne1);
+                return nullptr;
+            }
+            return t;
+        };
+
+        heads->ffn_w.push_back(get("ffn.weight",    heads->n_embd, heads->n_embd));
+        heads->ffn_b.push_back(get("ffn.bias",      heads->n_embd, 1));
+        heads->out_w.push_back(get("output.weight", heads->n_embd, heads->n_vocab));
+
+        if (!heads->ffn_w.back() || !heads->ffn_b.back() || !heads->out_w.back()) {
+            common_speculative_heads_free(heads);
+            return nullptr;
+        }
+    }
+
+    LOG_INF("%s: loaded %d draft heads from '%s'\n", __func__, n_heads, path);
+
+    return heads;
+}
+
+void common_speculative_heads_free(struct common_speculative_heads * heads) {
+    if (heads == nullptr) {
+        return;
+    }
+
+    gguf_free(heads->ctx_gguf);
+    ggml_free(heads->ctx_w);
+
+    delete heads;
+}
+
+int common_speculative_heads_n_heads(const struct common_speculative_heads * heads) {
+    return heads->out_w.size();
+}
+
+llama_tokens common_speculative_heads_draft(
+        struct common_speculative_heads * heads,
+                            const float * hidden,
+                                    int   n_draft,
+                                  float   p_min) {
+    const int n_heads = std::min<int>(n_draft, heads->out_w.size());
+    if (n_heads <= 0) {
+        return {};
+    }
+
+    const size_t n_nodes = 8*n_heads + 1;
+    const size_t size    = ggml_tensor_overhead()*n_nodes + ggml_graph_overhead() +
+                           sizeof(float)*(heads->n_embd*(4*n_heads + 1) + heads->n_vocab*n_heads) + 1024*1024;
+
+    heads->buf_compute.resize(size);
+
+    struct ggml_init_params params = {
+        /* .mem_size   = */ heads->buf_compute.size(),
+        /* .mem_buffer = */ heads->buf_compute.data(),
+        /* .no_alloc   = */ false,
+    };
+
+    struct ggml_context * ctx = ggml_init(params);
+
+    ggml_tensor * inp = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, heads->n_embd);
+    memcpy(inp->data, hidden, ggml_nbytes(inp));
+
+    struct ggml_cgraph * gf = ggml_new_graph(ctx);
+
+    std::vector<ggml_tensor *> logits(n_heads);
+    for (int k = 0; k < n_heads; ++k) {
+        ggml_tensor * cur = ggml_mul_mat(ctx, heads->ffn_w[k], inp);
+        cur = ggml_add (ctx, cur, heads->ffn_b[k]);
+        cur = ggml_silu(ctx, cur);
+        cur = ggml_add (ctx, cur, inp);
+
+        logits[k] = ggml_mul_mat(ctx, heads->out_w[k], cur);
+
+        ggml_build_forward_expand(gf, logits[k]);
+    }
+
+    ggml_graph_compute_with_ctx(ctx, gf, heads->n_threads);
+
+    llama_tokens result;
+    for (int k = 0; k < n_heads; ++k) {
+        const float * data = (const float *) logits[k]->data;
+
+        const int id = std::max_element(data, data + heads->n_vocab) - data;
+
+        // probability of the top token
+        double sum = 0.0;
+        for (int i = 0; i < heads->n_vocab; ++i) {
+            sum += std::exp(data[i] - data[id]);
+        }
+
+        result.push_back(id);
+
+        if (1.0/sum < p_min) {
+            break;
+        }
+    }
+
+    ggml_free(ctx);
+
+    return result;
+}
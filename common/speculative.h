@@ -27,9 +27,48 @@ void common_speculative_add_replacement_tgt_dft(
         struct common_speculative * spec,
         const char *source, const char *dest);
 
+// compute the logits of the draft model only for its first n_vocab tokens and its control tokens
+// the lowest token ids are usually the most frequent ones (BPE merges are learned in order of frequency)
+// returns false if the draft model does not support it, see llama_set_logits_vocab()
+bool common_speculative_set_draft_vocab(
+        struct llama_context * ctx_dft,
+                     int32_t   n_vocab);
+
 // sample up to n_draft tokens and add them to the batch using the draft model
 llama_tokens common_speculative_gen_draft(
                struct common_speculative * spec,
         struct common_speculative_params   params,
                       const llama_tokens & prompt,
                              llama_token   id_last);
+
+//
+// draft heads (Medusa)
+//
+// small heads over the final hidden state of the target model, head k predicts the token k+1 positions after the
+// token sampled from that hidden state. the heads are stored in a GGUF file with the tensors:
+//
+//   medusa.{k}.ffn.weight    [n_embd, n_embd]  - residual block: h + SiLU(W*h + b)
+//   medusa.{k}.ffn.bias      [n_embd]
+//   medusa.{k}.output.weight [n_embd, n_vocab] - the logits of the head
+//
+// and the number of heads in the "medusa.head_count" key
+//
+
+struct common_speculative_heads;
+
+struct common_speculative_heads * common_speculative_heads_init(
+        const char * path,
+        const struct llama_model * model,
+        int n_threads);
+
+void common_speculative_heads_free(struct common_speculative_heads * heads);
+
+int common_speculative_heads_n_heads(const struct common_speculative_heads * heads);
+
+// draft up to n_draft tokens from the hidden state of the target model, see llama_set_output_hidden()
+// the draft stops after the first token with a probability below p_min
+llama_tokens common_speculative_heads_draft(
+        struct common_speculative_heads * heads,
+                            const float * hidden,
+                                    int   n_draft,
+                                  float   p_min);
@@ -0,0 +1,590 @@
+#include "vector-index.h"
+#include "common.h"
+
+#include "ggml-cpu.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <queue>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define COMMON_VECTOR_INDEX_MAGIC   0x58444956 // "VIDX"
+#define COMMON_VECTOR_INDEX_VERSION 1
+
+// the levels of the vectors are drawn from an exponential distribution, a level above this is practically unreachable
+#define COMMON_VECTOR_INDEX_MAX_LEVEL 16
+
+struct vector_index_header {
+    uint32_t magic;
+    uint32_t version;
+    int32_t  type;
+    int32_t  n_embd;
+    int32_t  M;
+    int32_t  ef_construction;
+    uint32_t seed;
+    uint32_t entry;
+    int32_t  max_level;
+    uint32_t padding;
+    uint64_t n_vectors;
+    uint64_t n_links;
+};
+
+// offsets of the arrays in the serialized data
+struct vector_index_layout {
+    size_t levels;
+    size_t offsets;
+    size_t links;
+    size_t rows;
+    size_t size;
+};
+
+static vector_index_layout vector_index_get_layout(uint64_t n_vectors, uint64_t n_links, size_t row_size) {
+    vector_index_layout res;
+    res.levels  = sizeof(vector_index_header);
+    res.offsets = GGML_PAD(res.levels + n_vectors*sizeof(int32_t), sizeof(uint64_t));
+    res.links   = res.offsets + (n_vectors + 1)*sizeof(uint64_t);
+    res.rows    = GGML_PAD(res.links + n_links*sizeof(uint32_t), 32);
+    res.size    = res.rows + n_vectors*row_size;
+    return res;
+}
+
+static bool vector_index_type_supported(ggml_type type) {
+    // the rows are both operands of vec_dot, so the type must be its own vec_dot_type
+    return type == GGML_TYPE_F32 || type == GGML_TYPE_F16 || type == GGML_TYPE_Q8_0;
+}
+
+// number of neighbor slots of a vector on a level
+static int vector_index_n_slots(const common_vector_index & vi, int level) {
+    return level == 0 ? 2*vi.params.M : vi.params.M;
+}
+
+// position of the links of a level in the links of a vector
+static size_t vector_index_link_offset(const common_vector_index & vi, int level) {
+    return level == 0 ? 0 : (1 + 2*vi.params.M) + (level - 1)*(1 + vi.params.M);
+}
+
+static const uint8_t * vector_index_row(const common_vector_index & vi, uint32_t i) {
+    return vi.rows + i*vi.row_size;
+}
+
+// number of neighbors followed by the neighbors of vector i on a level
+static const uint32_t * vector_index_links(const common_vector_index & vi, uint32_t i, int level) {
+    return vi.links + vi.offsets[i] + vector_index_link_offset(vi, level);
+}
+
+static float vector_index_dot(const common_vector_index & vi, const void * a, const void * b) {
+    float res;
+    ggml_get_type_traits_cpu(vi.params.type)->vec_dot(vi.params.n_embd, &res, 0, a, 0, b, 0, 1);
+    return res;
+}
+
+// normalize an embedding and convert it to the type of the rows
+static std::vector<uint8_t> vector_index_convert(const common_vector_index & vi, const float * embd) {
+    std::vector<float> tmp(vi.params.n_embd);
+    common_embd_normalize(embd, tmp.data(), vi.params.n_embd, 2);
+
+    std::vector<uint8_t> res(vi.row_size);
+    ggml_get_type_traits_cpu(vi.params.type)->from_float(tmp.data(), res.data(), vi.params.n_embd);
+    return res;
+}
+
+static void vector_index_set_pointers(common_vector_index & vi) {
+    vi.levels  = vi.levels_buf.data();
+    vi.offsets = vi.offsets_buf.data();
+    vi.links   = vi.links_buf.data();
+    vi.rows    = vi.rows_buf.data();
+}
+
+// copy the arrays of a memory-mapped or loaded index to the owned data
+static void vector_index_copy_to_memory(common_vector_index & vi) {
+    vi.levels_buf .assign(vi.levels,  vi.levels  + vi.n_vectors);
+    vi.offsets_buf.assign(vi.offsets, vi.offsets + vi.n_vectors + 1);
+    vi.links_buf  .assign(vi.links,   vi.links   + vi.n_links);
+    vi.rows_buf   .assign(vi.rows,    vi.rows    + vi.n_vectors*vi.row_size);
+
+#if !defined(_WIN32)
+    if (vi.mapping) {
+        munmap(vi.mapping, vi.mapping_size);
+    }
+#endif
+    vi.mapping      = nullptr;
+    vi.mapping_size = 0;
+
+    vector_index_set_pointers(vi);
+}
+
+// marks the vectors visited by a search, reused by the searches of a thread
+struct vector_index_visited {
+    std::vector<uint32_t> tags;
+    uint32_t              tag = 0;
+
+    void reset(size_t n) {
+        if (tags.size() < n) {
+            tags.resize(n, 0);
+        }
+        if (++tag == 0) {
+            std::fill(tags.begin(), tags.end(), 0);
+            tag = 1;
+        }
+    }
+
+    // returns false if i was already visited
+    bool visit(uint32_t i) {
+        if (tags[i] == tag) {
+            return false;
+        }
+        tags[i] = tag;
+        return true;
+    }
+};
+
+// score, vector
+typedef std::pair<float, uint32_t> vector_index_candidate;
+
+// move ep to the neighbor most similar to q until there is no better neighbor on the level
+static void vector_index_search_greedy(const common_vector_index & vi, const uint8_t * q, vector_index_candidate & ep, int level) {
+    bool changed = true;
+    while (changed) {
+        changed = false;
+
+        const uint32_t * nb = vector_index_links(vi, ep.second, level);
+        for (uint32_t j = 1; j <= nb[0]; ++j) {
+            const float score = vector_index_dot(vi, q, vector_index_row(vi, nb[j]));
+            if (score > ep.first) {
+                ep      = { score, nb[j] };
+                changed = true;
+            }
+        }
+    }
+}
+
+// the ef vectors most similar to q reachable from the entry points on a level, most similar first
+static std::vector<vector_index_candidate> vector_index_search_level(
+        const common_vector_index & vi, const uint8_t * q, const std::vector<vector_index_candidate> & eps, size_t ef, int level) {
+    static thread_local vector_index_visited visited;
+    visited.reset(vi.n_vectors);
+
+    // candidates to expand, most similar first
+    std::priority_queue<vector_index_candidate> cand;
+    // results, least similar first
+    std::priority_queue<vector_index_candidate, std::vector<vector_index_candidate>, std::greater<vector_index_candidate>> res;
+
+    for (const auto & ep : eps) {
+        if (visited.visit(ep.second)) {
+            cand.push(ep);
+            res.push(ep);
+            if (res.size() > ef) {
+                res.pop();
+            }
+        }
+    }
+
+    while (!cand.empty()) {
+        const vector_index_candidate c = cand.top();
+        if (res.size() >= ef && c.first < res.top().first) {
+            break;
+        }
+        cand.pop();
+
+        const uint32_t * nb = vector_index_links(vi, c.second, level);
+        for (uint32_t j = 1; j <= nb[0]; ++j) {
+            if (!visited.visit(nb[j])) {
+                continue;
+            }
+
+            const float score = vector_index_dot(vi, q, vector_index_row(vi, nb[j]));
+            if (res.size() < ef || score > res.top().first) {
+                cand.push({ score, nb[j] });
+                res.push({ score, nb[j] });
+                if (res.size() > ef) {
+                    res.pop();
+                }
+            }
+        }
+    }
+
+    std::vector<vector_index_candidate> out(res.size());
+    for (size_t i = out.size(); i > 0; --i) {
+        out[i - 1] = res.top();
+        res.pop();
+    }
+    return out;
+}
+
+// select at most m neighbors from the candidates sorted by similarity, skipping the candidates that are more
+// similar to an already selected neighbor than to the vector, so that the neighbors cover all directions
+static std::vector<vector_index_candidate> vector_index_select_neighbors(
+        const common_vector_index & vi, const std::vector<vector_index_candidate> & cands, size_t m) {
+    std::vector<vector_index_candidate> res;
+    res.reserve(m);
+
+    for (const auto & c : cands) {
+        if (res.size() >= m) {
+            break;
+        }
+
+        bool keep = true;
+        for (const auto & r : res) {
+            if (vector_index_dot(vi, vector_index_row(vi, c.second), vector_index_row(vi, r.second)) > c.first) {
+                keep = false;
+                break;
+            }
+        }
+        if (keep) {
+            res.push_back(c);
+        }
+    }
+
+    return res;
+}
+
+static void vector_index_set_links(common_vector_index & vi, uint32_t i, int level, const std::vector<vector_index_candidate> & nb) {
+    uint32_t * dst = vi.links_buf.data() + vi.offsets[i] + vector_index_link_offset(vi, level);
+    dst[0] = nb.size();
+    for (size_t j = 0; j < nb.size(); ++j) {
+        dst[1 + j] = nb[j].second;
+    }
+}
+
+// add the link e -> i with the given score, pruning the neighbors of e if it has no free slot
+static void vector_index_connect(common_vector_index & vi, uint32_t e, uint32_t i, float score, int level) {
+    uint32_t * dst = vi.links_buf.data() + vi.offsets[e] + vector_index_link_offset(vi, level);
+
+    const uint32_t n_slots = vector_index_n_slots(vi, level);
+    if (dst[0] < n_slots) {
+        dst[1 + dst[0]] = i;
+        dst[0]++;
+        return;
+    }
+
+    std::vector<vector_index_candidate> cands;
+    cands.reserve(n_slots + 1);
+    cands.push_back({ score, i });
+    for (uint32_t j = 1; j <= dst[0]; ++j) {
+        cands.push_back({ vector_index_dot(vi, vector_index_row(vi, e), vector_index_row(vi, dst[j])), dst[j] });
+    }
+    std::sort(cands.begin(), cands.end(), std::greater<vector_index_candidate>());
+
+    vector_index_set_links(vi, e, level, vector_index_select_neighbors(vi, cands, n_slots));
+}
+
+//
+// common_vector_index
+//
+
+common_vector_index::common_vector_index(const common_vector_index_params & params) : params(params) {
+    GGML_ASSERT(vector_index_type_supported(params.type));
+    GGML_ASSERT(params.n_embd > 0 && params.n_embd % ggml_blck_size(params.type) == 0);
+    GGML_ASSERT(params.M >= 2);
+
+    // initializes the f16 tables
+    ggml_cpu_init();
+
+    row_size = ggml_row_size(params.type, params.n_embd);
+    rng.seed(params.seed);
+
+    vector_index_set_pointers(*this);
+}
+
+common_vector_index::~common_vector_index() {
+#if !defined(_WIN32)
+    if (mapping) {
+        munmap(mapping, mapping_size);
+    }
+#endif
+}
+
+common_vector_index::common_vector_index(common_vector_index && other) noexcept {
+    *this = std::move(other);
+}
+
+common_vector_index & common_vector_index::operator=(common_vector_index && other) noexcept {
+    if (this != &other) {
+#if !defined(_WIN32)
+        if (mapping) {
+            munmap(mapping, mapping_size);
+        }
+#endif
+
+        params       = other.params;
+        row_size     = other.row_size;
+        n_vectors    = other.n_vectors;
+        n_links      = other.n_links;
+        entry        = other.entry;
+        max_level    = other.max_level;
+        rng          = other.rng;
+        levels_buf   = std::move(other.levels_buf);
+        offsets_buf  = std::move(other.offsets_buf);
+        links_buf    = std::move(other.links_buf);
+        rows_buf     = std::move(other.rows_buf);
+        mapping      = other.mapping;
+        mapping_size = other.mapping_size;
+        levels       = other.levels;
+        offsets      = other.offsets;
+        links        = other.links;
+        rows         = other.rows;
+
+        other.n_vectors    = 0;
+        other.n_links      = 0;
+        other.max_level    = -1;
+        other.offsets_buf  = { 0 };
+        other.mapping      = nullptr;
+        other.mapping_size = 0;
+        vector_index_set_pointers(other);
+    }
+    return *this;
+}
+
+int64_t common_vector_index::add(const float * embd) {
+    GGML_ASSERT(row_size > 0 && "the index was not initialized with its parameters");
+
+    if (mapping) {
+        vector_index_copy_to_memory(*this);
+    }
+
+    const std::vector<uint8_t> q = vector_index_convert(*this, embd);
+
+    const uint32_t id = n_vectors;
+
+    // level with probability exp(-level*ln(M))
+    std::uniform_real_distribution<double> dist(0.0, 1.0);
+    const int level = std::min((int) (-std::log(1.0 - dist(rng)) / std::log((double) params.M)), COMMON_VECTOR_INDEX_MAX_LEVEL);
+
+    levels_buf.push_back(level);
+    rows_buf.insert(rows_buf.end(), q.begin(), q.end());
+    links_buf.resize(links_buf.size() + vector_index_link_offset(*this, level + 1), 0);
+    offsets_buf.push_back(links_buf.size());
+
+    n_vectors++;
+    n_links = links_buf.size();
+
+    vector_index_set_pointers(*this);
+
+    if (id == 0) {
+        entry     = id;
+        max_level = level;
+        return id;
+    }
+
+    vector_index_candidate ep = { vector_index_dot(*this, q.data(), vector_index_row(*this, entry)), entry };
+    for (int l = max_level; l > level; --l) {
+        vector_index_search_greedy(*this, q.data(), ep, l);
+    }
+
+    std::vector<vector_index_candidate> eps = { ep };
+    for (int l = std::min(level, max_level); l >= 0; --l) {
+        eps = vector_index_search_level(*this, q.data(), eps, std::max(params.ef_construction, params.M), l);
+
+        const std::vector<vector_index_candidate> nb = vector_index_select_neighbors(*this, eps, params.M);
+        vector_index_set_links(*this, id, l, nb);
+        for (const auto & n : nb) {
+            vector_index_connect(*this, n.second, id, n.first, l);
+        }
+    }
+
+    if (level > max_level) {
+        entry     = id;
+        max_level = level;
+    }
+
+    return id;
+}
+
+std::vector<common_vector_index_result> common_vector_index::search(const float * query, int k, int ef) const {
+    std::vector<common_vector_index_result> res;
+    if (n_vectors == 0 || k <= 0) {
+        return res;
+    }
+
+    const std::vector<uint8_t> q = vector_index_convert(*this, query);
+
+    vector_index_candidate ep = { vector_index_dot(*this, q.data(), vector_index_row(*this, entry)), entry };
+    for (int l = max_level; l > 0; --l) {
+        vector_index_search_greedy(*this, q.data(), ep, l);
+    }
+
+    const std::vector<vector_index_candidate> cands = vector_index_search_level(*this, q.data(), { ep }, std::max(ef, k), 0);
+
+    res.reserve(std::min<size_t>(k, cands.size()));
+    for (size_t i = 0; i < cands.size() && (int) i < k; ++i) {
+        res.push_back({ cands[i].second, cands[i].first });
+    }
+    return res;
+}
+
+std::vector<common_vector_index_result> common_vector_index::search_exact(const float * query, int k) const {
+    std::vector<common_vector_index_result> res;
+    if (n_vectors == 0 || k <= 0) {
+        return res;
+    }
+
+    const std::vector<uint8_t> q = vector_index_convert(*this, query);
+
+    std::vector<vector_index_candidate> cands(n_vectors);
+    for (uint32_t i = 0; i < n_vectors; ++i) {
+        cands[i] = { vector_index_dot(*this, q.data(), vector_index_row(*this, i)), i };
+    }
+
+    const size_t n = std::min<size_t>(k, cands.size());
+    std::partial_sort(cands.begin(), cands.begin() + n, cands.end(), std::greater<vector_index_candidate>());
+
+    res.reserve(n);
+    for (size_t i = 0; i < n; ++i) {
+        res.push_back({ cands[i].second, cands[i].first });
+    }
+    return res;
+}
+
+//
+// serialization
+//
+
+// set up the parameters and the array pointers from the serialized data, returns false if the data is not a valid index
+static bool vector_index_init(common_vector_index & vi, const uint8_t * data, size_t size) {
+    if (size < sizeof(vector_index_header)) {
+        return false;
+    }
+
+    vector_index_header header;
+    memcpy(&header, data, sizeof(header));
+
+    if (header.magic != COMMON_VECTOR_INDEX_MAGIC || header.version != COMMON_VECTOR_INDEX_VERSION) {
+        return false;
+    }
+    if (header.type < 0 || header.type >= GGML_TYPE_COUNT || !vector_index_type_supported((ggml_type) header.type)) {
+        return false;
+    }
+    if (header.n_embd <= 0 || header.n_embd % ggml_blck_size((ggml_type) header.type) != 0 || header.M < 2) {
+        return false;
+    }
+
+    common_vector_index_params params;
+    params.n_embd          = header.n_embd;
+    params.type            = (ggml_type) header.type;
+    params.M               = header.M;
+    params.ef_construction = header.ef_construction;
+    params.seed            = header.seed;
+
+    // an index loaded from a file continues with different levels than the index that was saved
+    common_vector_index res(params);
+    res.rng.seed(params.seed + header.n_vectors);
+
+    const vector_index_layout layout = vector_index_get_layout(header.n_vectors, header.n_links, res.row_size);
+    if (layout.size != size) {
+        return false;
+    }
+
+    res.n_vectors = header.n_vectors;
+    res.n_links   = header.n_links;
+    res.entry     = header.entry;
+    res.max_level = header.max_level;
+
+    res.levels  = reinterpret_cast<const int32_t  *>(data + layout.levels);
+    res.offsets = reinterpret_cast<const uint64_t *>(data + layout.offsets);
+    res.links   = reinterpret_cast<const uint32_t *>(data + layout.links);
+    res.rows    = data + layout.rows;
+
+    if (res.n_vectors > 0 && (res.entry >= res.n_vectors || res.levels[res.entry] != res.max_level)) {
+        return false;
+    }
+    if (res.offsets[0] != 0 || res.offsets[res.n_vectors] != res.n_links) {
+        return false;
+    }
+    for (size_t i = 0; i < res.n_vectors; ++i) {
+        if (res.levels[i] < 0 || res.levels[i] > res.max_level ||
+            res.offsets[i + 1] - res.offsets[i] != vector_index_link_offset(res, res.levels[i] + 1)) {
+            return false;
+        }
+    }
+
+    vi = std::move(res);
+
+    return true;
+}
+
+bool common_vector_index_save(const common_vector_index & index, const std::string & filename) {
+    const vector_index_header header = {
+        COMMON_VECTOR_INDEX_MAGIC,
+        COMMON_VECTOR_INDEX_VERSION,
+        index.params.type,
+        index.params.n_embd,
+        index.params.M,
+        index.params.ef_construction,
+        index.params.seed,
+        index.entry,
+        index.max_level,
+        0,
+        index.n_vectors,
+        index.n_links,
+    };
+
+    const vector_index_layout layout = vector_index_get_layout(index.n_vectors, index.n_links, index.row_size);
+
+    std::vector<uint8_t> buf(layout.size, 0);
+
+    memcpy(buf.data(),                  &header,       sizeof(header));
+    memcpy(buf.data() + layout.levels,  index.levels,  index.n_vectors*sizeof(int32_t));
+    memcpy(buf.data() + layout.offsets, index.offsets, (index.n_vectors + 1)*sizeof(uint64_t));
+    memcpy(buf.data() + layout.links,   index.links,   index.n_links*sizeof(uint32_t));
+    memcpy(buf.data() + layout.rows,    index.rows,    index.n_vectors*index.row_size);
+
+    std::ofstream file_out(filename, std::ios::binary);
+    file_out.write(reinterpret_cast<const char *>(buf.data()), buf.size());
+
+    return file_out.good();
+}
+
+common_vector_index common_vector_index_load(const std::string & filename) {
+    common_vector_index res;
+
+    {
+        std::ifstream file_in(filename, std::ios::binary);
+        if (!file_in) {
+            throw std::ifstream::failure("Unable to open file " + filename);
+        }
+    }
+
+#if !defined(_WIN32)
+    const int fd = open(filename.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void * addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (addr != MAP_FAILED) {
+                if (!vector_index_init(res, static_cast<const uint8_t *>(addr), st.st_size)) {
+                    munmap(addr, st.st_size);
+                    close(fd);
+                    throw std::ifstream::failure("Invalid vector index file " + filename);
+                }
+                res.mapping      = addr;
+                res.mapping_size = st.st_size;
+            }
+        }
+        close(fd);
+    }
+#endif
+
+    if (res.mapping == nullptr) {
+        // memory mapping is not available - read the file
+        std::ifstream file_in(filename, std::ios::binary | std::ios::ate);
+        std::vector<uint8_t> buf(file_in.tellg());
+        file_in.seekg(0);
+        file_in.read(reinterpret_cast<char *>(buf.data()), buf.size());
+
+        if (!vector_index_init(res, buf.data(), buf.size())) {
+            throw std::ifstream::failure("Invalid vector index file " + filename);
+        }
+        vector_index_copy_to_memory(res);
+    }
+
+    return res;
+}
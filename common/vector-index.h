@@ -0,0 +1,94 @@
+#pragma once
+
+#include "ggml.h"
+
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+
+// Approximate nearest neighbor search over embeddings with a HNSW graph (https://arxiv.org/abs/1603.09320).
+// The embeddings are L2-normalized when they are added and the score of a result is the cosine similarity.
+// The vectors are stored as F32, F16 or Q8_0 rows and compared with the vec_dot kernels of the CPU backend.
+
+struct common_vector_index_params {
+    int32_t   n_embd          = 0;
+    ggml_type type            = GGML_TYPE_F32; // F32, F16 or Q8_0 (n_embd must be a multiple of 32)
+    int32_t   M               = 16;            // max neighbors of a vector on the upper levels, 2*M on level 0
+    int32_t   ef_construction = 100;           // size of the candidate list when adding vectors
+    uint32_t  seed            = 42;            // for the random levels of the vectors
+};
+
+struct common_vector_index_result {
+    int64_t id;    // position of the vector in the order in which the vectors were added
+    float   score; // cosine similarity with the query
+};
+
+// The file format is the memory layout, so large indexes are memory-mapped instead of being parsed:
+//
+//   header: magic, version, type, n_embd, M, ef_construction, seed, entry, max_level, n_vectors, n_links
+//   levels[n_vectors]       - top level of each vector
+//   offsets[n_vectors + 1]  - range of the links of each vector in links
+//   links[n_links]          - per vector and level 0..level: number of neighbors followed by 2*M (level 0) or M slots
+//   rows[n_vectors]         - vectors, ggml_row_size(type, n_embd) bytes each
+//
+// A memory-mapped index is copied to memory by the first call to add().
+struct common_vector_index {
+    common_vector_index() = default;
+    explicit common_vector_index(const common_vector_index_params & params);
+    ~common_vector_index();
+
+    common_vector_index(const common_vector_index &) = delete;
+    common_vector_index & operator=(const common_vector_index &) = delete;
+
+    common_vector_index(common_vector_index && other) noexcept;
+    common_vector_index & operator=(common_vector_index && other) noexcept;
+
+    // add an embedding of n_embd floats, returns its id
+    int64_t add(const float * embd);
+
+    // the k vectors most similar to query, most similar first
+    // ef: size of the candidate list, larger values are slower and more accurate (at least k is used)
+    // thread-safe with respect to other searches
+    std::vector<common_vector_index_result> search(const float * query, int k, int ef = 64) const;
+
+    // same as search() by comparison with every vector
+    std::vector<common_vector_index_result> search_exact(const float * query, int k) const;
+
+    size_t size() const { return n_vectors; }
+    bool  empty() const { return n_vectors == 0; }
+
+    common_vector_index_params params;
+
+    size_t row_size  = 0;
+    size_t n_vectors = 0;
+    size_t n_links   = 0;
+
+    uint32_t entry     = 0;
+    int32_t  max_level = -1;
+
+    std::mt19937 rng;
+
+    // owned data, in the order of the file format
+    std::vector<int32_t>  levels_buf;
+    std::vector<uint64_t> offsets_buf = { 0 };
+    std::vector<uint32_t> links_buf;
+    std::vector<uint8_t>  rows_buf;
+
+    // memory-mapped file
+    void        * mapping      = nullptr;
+    size_t        mapping_size = 0;
+
+    const int32_t  * levels  = nullptr;
+    const uint64_t * offsets = nullptr;
+    const uint32_t * links   = nullptr;
+    const uint8_t  * rows    = nullptr;
+};
+
+// Save an index to a file.
+// returns: false if the file could not be written.
+bool common_vector_index_save(const common_vector_index & index, const std::string & filename);
+
+// Load an index from a file, memory-mapped if supported by the platform.
+// throws: std::ifstream::failure if the file could not be opened or is not a valid index.
+common_vector_index common_vector_index_load(const std::string & filename);
@@ -50,6 +50,9 @@ struct diffusion_params {
     float   alg_temp         = 0;      // algorithm temperature (0.0 = deterministic)
     bool    add_gumbel_noise = false;  // Add gumbel noise to the logits if temp > 0.0
 
+    bool    use_cache        = false;  // Cache the KV of the finalized blocks, each step evaluates only the active block
+    float   threshold        = 0.;     // Unmask all the tokens with a higher confidence in a step (0.0 = disabled)
+
     int32_t max_length = 0;            // Maximum sequence length
 };
 
@@ -224,6 +227,16 @@ static void diffusion_generate(llama_context *          ctx,
 
     llama_set_causal_attn(ctx, false);
 
+    llama_memory_t mem = llama_get_memory(ctx);
+
+    // block diffusion with caching: the KV of the prompt and of the finalized blocks [0, n_cached) stays in the cache,
+    // each step evaluates the active block only - the masked tokens after it are not part of the step
+    const bool use_cache = params.use_cache && params.schedule == BLOCK_BASED && params.cfg_scale == 0.0f;
+    int32_t    n_cached  = 0;
+    int32_t    n_steps   = 0;
+
+    llama_memory_clear(mem, true);
+
     int32_t n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
 
     std::vector<llama_token_data> candidates(n_vocab);
@@ -248,7 +261,6 @@ static void diffusion_generate(llama_context *          ctx,
     struct llama_sampler * dist_sampler = llama_sampler_init_dist(params.seed);
 
     llama_batch batch = llama_batch_init(params.max_length, 0, 1);
-    batch.n_tokens    = params.max_length;
 
     // Pre-allocate buffers for CFG if needed
     int32_t                  logits_size = n_vocab * params.max_length;
@@ -304,15 +316,36 @@ static void diffusion_generate(llama_context *          ctx,
                 }
             }
 
+            // the block is done when all its tokens are unmasked, possibly before its last step with a threshold
+            if (params.schedule == BLOCK_BASED &&
+                std::find(output_tokens + block_start, output_tokens + block_end, params.mask_token_id) == output_tokens + block_end) {
+                break;
+            }
+
+            // the logits of the positions [out_start, out_end) are computed, the logits of pos are those of pos - 1 if shifted
+            const int32_t out_start = use_cache ? (params.shift_logits ? block_start - 1 : block_start) : 0;
+            const int32_t out_end   = use_cache ? block_end : params.max_length;
+
             // Setup batch
-            for (int32_t i = 0; i < params.max_length; i++) {
-                batch.token[i]     = output_tokens[i];
-                batch.pos[i]       = i;
-                batch.n_seq_id[i]  = 1;
-                batch.seq_id[i][0] = 0;
-                batch.logits[i]    = 1;
+            const int32_t batch_start = use_cache ? n_cached : 0;
+
+            batch.n_tokens = out_end - batch_start;
+            for (int32_t i = batch_start; i < out_end; i++) {
+                const int32_t j = i - batch_start;
+
+                batch.token[j]     = output_tokens[i];
+                batch.pos[j]       = i;
+                batch.n_seq_id[j]  = 1;
+                batch.seq_id[j][0] = 0;
+                batch.logits[j]    = i >= out_start;
             }
 
+            if (!use_cache) {
+                llama_memory_clear(mem, true);
+            }
+
+            n_steps++;
+
             float * logits = nullptr;
 
             if (params.cfg_scale > 0.0f) {
@@ -333,6 +366,7 @@ static void diffusion_generate(llama_context *          ctx,
                 for (int32_t i = 0; i < params.max_length; i++) {
                     batch.token[i] = un_x_buffer[i];
                 }
+                llama_memory_clear(mem, true);
                 ret = llama_decode(ctx, batch);
                 if (ret != 0) {
                     LOG_ERR("Failed to generate unconditional");
@@ -360,11 +394,17 @@ static void diffusion_generate(llama_context *          ctx,
                 break;
             }
 
+            if (use_cache) {
+                // the tokens before out_start are final, the rest is evaluated again in the next step
+                llama_memory_seq_rm(mem, 0, out_start, -1);
+                n_cached = out_start;
+            }
+
             auto get_logits_for_pos = [&](int32_t pos) -> const float * {
                 if (params.shift_logits) {
-                    return pos == 0 ? logits : logits + (pos - 1) * n_vocab;
+                    return pos == 0 ? logits : logits + (pos - 1 - out_start) * n_vocab;
                 }
-                return logits + (pos) *n_vocab;
+                return logits + (pos - out_start) * n_vocab;
             };
 
             int64_t time_start_sampling = ggml_time_us();
@@ -445,6 +485,15 @@ static void diffusion_generate(llama_context *          ctx,
                 int32_t transfer_count = calculate_transfer_count(
                     step, steps_per_block, mask_positions.size(), params.schedule, params.eps, num_transfer_tokens);
 
+                if (params.threshold > 0.0f) {
+                    // the confident tokens are unmasked in parallel, the block can finish in fewer steps
+                    int32_t n_confident = 0;
+                    for (const auto & conf : confidences) {
+                        n_confident += conf.first >= params.threshold;
+                    }
+                    transfer_count = std::max(transfer_count, n_confident);
+                }
+
                 if (transfer_count > 0) {
                     if (params.alg_temp == 0.0f) {
                         std::partial_sort(confidences.begin(),
@@ -498,10 +547,11 @@ static void diffusion_generate(llama_context *          ctx,
     int64_t time_end = ggml_time_us();
     total_time += time_end - time_start;
 
-    LOG_INF("\ntotal time: %0.2fms, time per step: %0.2fms, sampling time per step: %0.2fms\n",
+    LOG_INF("\ntotal time: %0.2fms, steps: %d, time per step: %0.2fms, sampling time per step: %0.2fms\n",
             total_time / 1000.0,
-            total_time / 1000.0 / params.steps,
-            total_sampling_time / 1000.0 / params.steps);
+            n_steps,
+            total_time / 1000.0 / std::max(n_steps, 1),
+            total_sampling_time / 1000.0 / std::max(n_steps, 1));
 
     llama_batch_free(batch);
     llama_sampler_free(sampler);
@@ -633,6 +683,12 @@ int main(int argc, char ** argv) {
     diff_params.top_k            = params.sampling.top_k;
     diff_params.visual_mode      = params.diffusion.visual_mode;
     diff_params.add_gumbel_noise = params.diffusion.add_gumbel_noise;
+    diff_params.use_cache        = params.diffusion.cache;
+    diff_params.threshold        = params.diffusion.threshold;
+
+    if (diff_params.use_cache && diff_params.schedule != BLOCK_BASED) {
+        LOG_WRN("%s: --diffusion-cache requires --diffusion-block-length, not using the cache\n", __func__);
+    }
 
     diff_params.step_callback           = diffusion_step_callback;
     callback_data cb_data               = { &diff_params, vocab, n_input };
@@ -658,6 +714,10 @@ int main(int argc, char ** argv) {
     if (diff_params.schedule == BLOCK_BASED) {
         LOG_INF("diffusion_params: - %-25s u32              = %d\n", "block_length", diff_params.block_length);
         LOG_INF("diffusion_params: - %-25s f32              = %.3f\n", "cfg_scale", diff_params.cfg_scale);
+        LOG_INF("diffusion_params: - %-25s bool             = %s\n", "use_cache", diff_params.use_cache ? "true" : "false");
+    }
+    if (diff_params.threshold > 0.0f) {
+        LOG_INF("diffusion_params: - %-25s f32              = %.3f\n", "threshold", diff_params.threshold);
     }
 
     diffusion_generate(ctx, input_tokens.data(), output_tokens.data(), n_input, diff_params, n_generated);
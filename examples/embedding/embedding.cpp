@@ -215,7 +215,9 @@ int main(int argc, char ** argv) {
     }
 
     // allocate output
-    const int n_embd = llama_model_n_embd(model);
+    // the pooled embeddings can be truncated with --embd-dim
+    const bool pooled = pooling_type != LLAMA_POOLING_TYPE_NONE && pooling_type != LLAMA_POOLING_TYPE_RANK;
+    const int n_embd = pooled ? llama_n_embd_out(ctx) : llama_model_n_embd(model);
     std::vector<float> embeddings(n_embd_count * n_embd, 0);
     float * emb = embeddings.data();
 
@@ -2,6 +2,7 @@
 #include "common.h"
 #include "log.h"
 #include "llama.h"
+#include "vector-index.h"
 
 #include <algorithm>
 #include <fstream>
@@ -22,8 +23,6 @@ struct chunk {
     std::string textdata;
     // tokenized text data
     std::vector<llama_token> tokens;
-    // embedding
-    std::vector<float> embedding;
 };
 
 // chunk file data to chunks of size >= chunk_size
@@ -111,6 +110,49 @@ static void batch_process(llama_context * ctx, llama_batch & batch, float * outp
     }
 }
 
+// embed the chunks in batches of up to n_batch tokens, returns the normalized embeddings
+static std::vector<float> embed_chunks(llama_context * ctx, const std::vector<chunk> & chunks, uint64_t n_batch, int n_embd) {
+    const int n_chunks = chunks.size();
+
+    // initialize batch
+    struct llama_batch batch = llama_batch_init(n_batch, 0, 1);
+
+    // allocate output
+    std::vector<float> embeddings(n_chunks * n_embd, 0);
+    float * emb = embeddings.data();
+
+    // break into batches
+    int p = 0; // number of prompts processed already
+    int s = 0; // number of prompts in current batch
+    for (int k = 0; k < n_chunks; k++) {
+        // clamp to n_batch tokens
+        const auto & inp = chunks[k].tokens;
+
+        const uint64_t n_toks = inp.size();
+
+        // encode if at capacity
+        if (batch.n_tokens + n_toks > n_batch) {
+            float * out = emb + p * n_embd;
+            batch_process(ctx, batch, out, s, n_embd);
+            common_batch_clear(batch);
+            p += s;
+            s = 0;
+        }
+
+        // add to batch
+        batch_add_seq(batch, inp, s);
+        s += 1;
+    }
+
+    // final batch
+    float * out = emb + p * n_embd;
+    batch_process(ctx, batch, out, s, n_embd);
+
+    llama_batch_free(batch);
+
+    return embeddings;
+}
+
 int main(int argc, char ** argv) {
     common_params params;
 
@@ -212,46 +254,49 @@ int main(int argc, char ** argv) {
         }
     }
 
-    // initialize batch
     const int n_chunks = chunks.size();
-    struct llama_batch batch = llama_batch_init(n_batch, 0, 1);
-
-    // allocate output
     const int n_embd = llama_model_n_embd(model);
-    std::vector<float> embeddings(n_chunks * n_embd, 0);
-    float * emb = embeddings.data();
 
-    // break into batches
-    int p = 0; // number of prompts processed already
-    int s = 0; // number of prompts in current batch
-    for (int k = 0; k < n_chunks; k++) {
-        // clamp to n_batch tokens
-        auto & inp = chunks[k].tokens;
+    // the index of a previous run with the same chunks
+    common_vector_index index;
+    if (!params.vector_index.empty() && std::ifstream(params.vector_index).good()) {
+        try {
+            index = common_vector_index_load(params.vector_index);
+        } catch (const std::exception & e) {
+            LOG_WRN("%s: %s\n", __func__, e.what());
+        }
+        if (index.size() != (size_t) n_chunks || index.params.n_embd != n_embd) {
+            LOG_WRN("%s: the vector index %s does not match the chunks, rebuilding it\n", __func__, params.vector_index.c_str());
+            index = common_vector_index();
+        } else {
+            LOG_INF("%s: loaded the vector index of %d chunks from %s\n", __func__, n_chunks, params.vector_index.c_str());
+        }
+    }
 
-        const uint64_t n_toks = inp.size();
+    if (index.empty()) {
+        const std::vector<float> embeddings = embed_chunks(ctx, chunks, n_batch, n_embd);
 
-        // encode if at capacity
-        if (batch.n_tokens + n_toks > n_batch) {
-            float * out = emb + p * n_embd;
-            batch_process(ctx, batch, out, s, n_embd);
-            common_batch_clear(batch);
-            p += s;
-            s = 0;
+        // add the embeddings to the index
+        common_vector_index_params iparams;
+        iparams.n_embd = n_embd;
+        iparams.type   = n_embd % ggml_blck_size(params.vector_index_type) == 0 ? params.vector_index_type : GGML_TYPE_F32;
+
+        index = common_vector_index(iparams);
+        for (int i = 0; i < n_chunks; i++) {
+            index.add(embeddings.data() + i * n_embd);
         }
 
-        // add to batch
-        batch_add_seq(batch, inp, s);
-        s += 1;
+        if (!params.vector_index.empty()) {
+            if (common_vector_index_save(index, params.vector_index)) {
+                LOG_INF("%s: saved the vector index to %s\n", __func__, params.vector_index.c_str());
+            } else {
+                LOG_WRN("%s: failed to save the vector index to %s\n", __func__, params.vector_index.c_str());
+            }
+        }
     }
 
-    // final batch
-    float * out = emb + p * n_embd;
-    batch_process(ctx, batch, out, s, n_embd);
-
-    // save embeddings to chunks
+    // clear tokens as they are no longer needed
     for (int i = 0; i < n_chunks; i++) {
-        chunks[i].embedding = std::vector<float>(emb + i * n_embd, emb + (i + 1) * n_embd);
-        // clear tokens as they are no longer needed
         chunks[i].tokens.clear();
     }
 
@@ -271,25 +316,16 @@ int main(int argc, char ** argv) {
 
         common_batch_clear(query_batch);
 
-        // compute cosine similarities
+        // find the most similar chunks by cosine similarity
         {
-            std::vector<std::pair<int, float>> similarities;
-            for (int i = 0; i < n_chunks; i++) {
-                float sim = common_embd_similarity_cos(chunks[i].embedding.data(), query_emb.data(), n_embd);
-                similarities.push_back(std::make_pair(i, sim));
-            }
-
-            // sort similarities
-            std::sort(similarities.begin(), similarities.end(), [](const std::pair<int, float> & a, const std::pair<int, float> & b) {
-                return a.second > b.second;
-            });
+            const std::vector<common_vector_index_result> similarities = index.search(query_emb.data(), params.sampling.top_k, params.vector_index_ef);
 
             LOG("Top %d similar chunks:\n", params.sampling.top_k);
-            for (int i = 0; i < std::min(params.sampling.top_k, (int) chunks.size()); i++) {
-                LOG("filename: %s\n", chunks[similarities[i].first].filename.c_str());
-                LOG("filepos: %lld\n", (long long int) chunks[similarities[i].first].filepos);
-                LOG("similarity: %f\n", similarities[i].second);
-                LOG("textdata:\n%s\n", chunks[similarities[i].first].textdata.c_str());
+            for (const auto & sim : similarities) {
+                LOG("filename: %s\n", chunks[sim.id].filename.c_str());
+                LOG("filepos: %lld\n", (long long int) chunks[sim.id].filepos);
+                LOG("similarity: %f\n", sim.score);
+                LOG("textdata:\n%s\n", chunks[sim.id].textdata.c_str());
                 LOG("--------------------\n");
             }
         }
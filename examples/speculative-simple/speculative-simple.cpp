@@ -64,6 +64,10 @@ int main(int argc, char ** argv) {
     //model_dft = llama_init_dft.model.get();
     ctx_dft   = llama_init_dft.context.get();
 
+    if (params.speculative.n_vocab > 0) {
+        common_speculative_set_draft_vocab(ctx_dft, params.speculative.n_vocab);
+    }
+
     if (!common_speculative_are_compatible(ctx_tgt, ctx_dft)) {
         LOG_INF("the draft model '%s' is not compatible with the target model '%s'. tokens will be translated between the draft and target models.\n", params.speculative.model.path.c_str(), params.model.path.c_str());
     }
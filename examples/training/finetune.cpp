@@ -26,6 +26,10 @@ int main(int argc, char ** argv) {
         LOG_INF("%s: force disabling memory mapping because it would result in-read-only pointers to the weights\n", __func__);
         params.use_mmap = false;
     }
+    if (!params.no_extra_bufts) {
+        LOG_INF("%s: force disabling extra buffer types because OUT_PROD does not support repacked weights\n", __func__);
+        params.no_extra_bufts = true;
+    }
     if (params.cache_type_k != GGML_TYPE_F32) {
         LOG_INF("%s: force changing k cache type to f32 due to a lack of f16 support for OUT_PROD\n", __func__);
         params.cache_type_k = GGML_TYPE_F32;
@@ -57,18 +61,63 @@ int main(int argc, char ** argv) {
 
     constexpr float val_split = 0.05f;
 
-    std::vector<llama_token> tokens = common_tokenize(ctx.get(), params.prompt, true);
-    ggml_opt_dataset_t dataset = common_opt_dataset_init(ctx.get(), tokens, llama_n_ctx(ctx.get())/2);
+    // set to a file name to keep the tokenized dataset in a file that is mapped instead of in memory, for large corpora
+    // the file is written from --file if it does not exist and reused as is otherwise
+    const char * fname_tokens = nullptr;
+
+    ggml_opt_dataset_t dataset = nullptr;
+    if (fname_tokens) {
+        FILE * f = fopen(fname_tokens, "rb");
+        if (f) {
+            fclose(f);
+        } else {
+            std::vector<llama_token> tokens = common_tokenize(ctx.get(), params.prompt, true);
+            f = fopen(fname_tokens, "wb");
+            const bool ok = f && fwrite(tokens.data(), sizeof(llama_token), tokens.size(), f) == tokens.size();
+            if (f) {
+                fclose(f);
+            }
+            if (!ok) {
+                LOG_ERR("%s: failed to write %s\n", __func__, fname_tokens);
+                return 1;
+            }
+        }
+        dataset = common_opt_dataset_init_mmap(ctx.get(), fname_tokens, llama_n_ctx(ctx.get())/2);
+        if (dataset == nullptr) {
+            LOG_ERR("%s: failed to map %s\n", __func__, fname_tokens);
+            return 1;
+        }
+    } else {
+        std::vector<llama_token> tokens = common_tokenize(ctx.get(), params.prompt, true);
+        dataset = common_opt_dataset_init(ctx.get(), tokens, llama_n_ctx(ctx.get())/2);
+    }
 
     struct ggml_opt_optimizer_params optimizer_params = ggml_opt_get_default_optimizer_params(nullptr);
     optimizer_params.adamw.alpha = 1e-7f; // learning rate
 
+    // set to > 0 to train a LoRA adapter of this rank instead of the full model, the model weights can then be quantized
+    constexpr int32_t lora_rank = 0;
+
+    llama_adapter_lora * adapter = nullptr;
+    if (lora_rank > 0) {
+        adapter = llama_adapter_lora_init_trainable(model.get(), lora_rank, (float) lora_rank, llama_opt_param_filter_all, nullptr);
+        if (adapter == nullptr) {
+            LOG_ERR("%s: failed to create the LoRA adapter\n", __func__);
+            return 1;
+        }
+        optimizer_params.adamw.alpha = 1e-4f; // the adapter needs a higher learning rate
+    }
+
     struct llama_opt_params lopt_params {
         /*n_ctx_train     =*/ 0,
         /*param_filter    =*/ llama_opt_param_filter_all,
         /*param_filter_ud =*/ nullptr,
         /*get_opt_pars    =*/ ggml_opt_get_constant_optimizer_params,
         /*get_opt_pars_ud =*/ &optimizer_params,
+        /*recompute       =*/ false, // set to true to recompute the activations in the backward pass and save memory
+        /*adapter         =*/ adapter,
+        /*type_compute    =*/ GGML_TYPE_F32, // set to GGML_TYPE_BF16 for mixed precision training
+        /*loss_scale      =*/ 0.0f,          // set to e.g. 65536.0f for dynamic loss scaling, needed with GGML_TYPE_F16
     };
     llama_opt_init(ctx.get(), model.get(), lopt_params);
 
@@ -88,7 +137,11 @@ int main(int argc, char ** argv) {
     ggml_opt_result_free(result_train);
     ggml_opt_result_free(result_eval);
 
-    llama_model_save_to_file(model.get(), "finetuned-model.gguf");
+    if (adapter) {
+        llama_adapter_lora_save(adapter, model.get(), "finetuned-lora.gguf");
+    } else {
+        llama_model_save_to_file(model.get(), "finetuned-model.gguf");
+    }
 
     llama_backend_free();
 
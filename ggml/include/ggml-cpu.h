@@ -58,6 +58,13 @@ extern "C" {
     GGML_BACKEND_API void                          ggml_threadpool_pause         (struct ggml_threadpool * threadpool);
     GGML_BACKEND_API void                          ggml_threadpool_resume        (struct ggml_threadpool * threadpool);
 
+    // process-wide threadpools, shared by all the contexts and CPU backends of the process
+    // returns the shared threadpool with these params, created on first use - it is owned by the process, free them all with ggml_threadpool_free_shared()
+    // the graphs of the shared threadpools are computed one at a time, and the threadpool of the previous graph is paused when another one takes over
+    // the CPU backends without a threadpool use the shared threadpool with the highest priority (then the most threads)
+    GGML_BACKEND_API struct ggml_threadpool *      ggml_threadpool_get_shared    (struct ggml_threadpool_params  * params);
+    GGML_BACKEND_API void                          ggml_threadpool_free_shared   (void);
+
     // ggml_graph_plan() has to be called before ggml_graph_compute()
     // when plan.work_size > 0, caller must allocate memory for plan.work_data
     GGML_BACKEND_API struct ggml_cplan ggml_graph_plan(
@@ -132,6 +139,50 @@ extern "C" {
     GGML_BACKEND_API void ggml_backend_cpu_set_threadpool    (ggml_backend_t backend_cpu, ggml_threadpool_t threadpool);
     GGML_BACKEND_API void ggml_backend_cpu_set_abort_callback(ggml_backend_t backend_cpu, ggml_abort_callback abort_callback, void * abort_callback_data);
 
+    // per-op performance counters, accumulated over the graphs computed by the CPU backend while enabled
+    struct ggml_backend_cpu_perf_stats {
+        uint64_t n_nodes[GGML_OP_COUNT];
+        int64_t  t_us   [GGML_OP_COUNT]; // wall time, from the start of the node to the barrier after it
+        uint64_t flops  [GGML_OP_COUNT]; // floating point operations, estimated from the shapes
+        uint64_t bytes  [GGML_OP_COUNT]; // bytes of the sources read and of the result written
+    };
+
+    // enabling the counters also resets them
+    GGML_BACKEND_API void ggml_backend_cpu_set_perf_stats(bool enable);
+    GGML_BACKEND_API void ggml_backend_cpu_get_perf_stats(struct ggml_backend_cpu_perf_stats * stats);
+
+    // per-host tuning of the CPU backend, measured with llama-bench --autotune
+    // ggml_cpu_init() loads it from the file named by the GGML_CPU_PROFILE environment variable
+    struct ggml_backend_cpu_profile {
+        int  n_threads;              // threads for generation, 0 = not set
+        int  n_threads_batch;        // threads for prompt processing, 0 = not set
+        int  mul_mat_chunk_size;     // rows per chunk of mul_mat (default: 16)
+        int  mul_mat_chunk_size_vec; // rows per chunk when src1 or the result is a vector (default: 64)
+        bool mul_mat_chunk_numa;     // chunk also on NUMA systems instead of one chunk per thread (default: false)
+    };
+
+    GGML_BACKEND_API void ggml_backend_cpu_get_profile (struct ggml_backend_cpu_profile * profile);
+    GGML_BACKEND_API void ggml_backend_cpu_set_profile (const struct ggml_backend_cpu_profile * profile);
+    // "key = value" lines, returns false if the file cannot be opened
+    GGML_BACKEND_API bool ggml_backend_cpu_load_profile(const char * fname, struct ggml_backend_cpu_profile * profile);
+    GGML_BACKEND_API bool ggml_backend_cpu_save_profile(const char * fname, const struct ggml_backend_cpu_profile * profile);
+
+    // placement of the memory of the CPU buffers
+    enum ggml_cpu_mem_flags {
+        GGML_CPU_MEM_THP     = 1, // transparent hugepages (madvise)
+        GGML_CPU_MEM_HUGETLB = 2, // hugepages reserved by the system (MAP_HUGETLB), transparent hugepages when none are left
+        GGML_CPU_MEM_NUMA    = 4, // bound to the NUMA nodes of the compute threads, interleaved when there are several
+    };
+
+    // host buffer type with the placement given by flags (ggml_cpu_mem_flags), e.g. for the KV cache and the compute buffers
+    // the plain CPU buffer type when flags is 0
+    GGML_BACKEND_API ggml_backend_buffer_type_t ggml_backend_cpu_mem_buffer_type(int flags);
+    // placement of the buffers of the repacked weights allocated afterwards
+    GGML_BACKEND_API void ggml_backend_cpu_set_repack_mem(int flags);
+    // host buffer type "CPU_NODE<node>" placed on a NUMA node, e.g. the HBM or CXL memory tier, NULL if there is no such node
+    // the memory comes from the other nodes when the node is full
+    GGML_BACKEND_API ggml_backend_buffer_type_t ggml_backend_cpu_node_buffer_type(int node);
+
     GGML_BACKEND_API ggml_backend_reg_t ggml_backend_cpu_reg(void);
 
     GGML_BACKEND_API void ggml_cpu_fp32_to_fp32(const float *,       float *, int64_t);
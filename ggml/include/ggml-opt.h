@@ -43,6 +43,19 @@ extern "C" {
             int64_t        ne_label,     // number of elements per label
             int64_t        ndata,        // total number of datapoints/labels
             int64_t        ndata_shard); // number of datapoints/labels per shard (unit at which the dataset is shuffled/copied)
+
+    // dataset stored in a file that is mapped read-only instead of loaded, for datasets larger than the memory
+    // datapoint i is at offset i*nb_stride of the file and its label at offset i*nb_stride + offs_labels, the datapoints may overlap,
+    //   e.g. the windows of a tokenized text: nb_stride = stride*sizeof(token), offs_labels = sizeof(token)
+    // the number of datapoints follows from the file size, each datapoint is a shard, returns NULL if the file cannot be mapped
+    GGML_API ggml_opt_dataset_t ggml_opt_dataset_init_mmap(
+            const char   * fname,
+            enum ggml_type type_data,
+            enum ggml_type type_label,
+            int64_t        ne_datapoint,
+            int64_t        ne_label,
+            size_t         nb_stride,
+            size_t         offs_labels);
     GGML_API void ggml_opt_dataset_free(ggml_opt_dataset_t dataset);
 
     // get underlying tensors that store the data
@@ -114,6 +127,12 @@ extern "C" {
 
         ggml_opt_get_optimizer_params get_opt_pars; // callback for calculating optimizer parameters
         void * get_opt_pars_ud;                     // userdata for calculating optimizer parameters
+
+        // dynamic loss scaling for models that compute in reduced precision, e.g. with F16/BF16 casts of F32 parameters:
+        // the gradients are computed for the loss times loss_scale and divided by it again before the optimizer step,
+        // a step with inf/NaN gradients is skipped and halves the scale, loss_scale_window steps without double it
+        float   loss_scale;        // initial scale, 0.0f to disable
+        int32_t loss_scale_window;
     };
 
     // get parameters for an optimization context with defaults set where possible
@@ -142,6 +161,9 @@ extern "C" {
     // get the gradient accumulator for a node from the forward graph
     GGML_API struct ggml_tensor * ggml_opt_grad_acc(ggml_opt_context_t opt_ctx, struct ggml_tensor * node);
 
+    // current loss scale, 0.0f if loss scaling is disabled
+    GGML_API float ggml_opt_loss_scale(ggml_opt_context_t opt_ctx);
+
     // ====== Optimization Result ======
 
     GGML_API ggml_opt_result_t ggml_opt_result_init(void);
@@ -8,7 +8,7 @@ extern "C" {
 #endif
 
 #define RPC_PROTO_MAJOR_VERSION    2
-#define RPC_PROTO_MINOR_VERSION    0
+#define RPC_PROTO_MINOR_VERSION    5
 #define RPC_PROTO_PATCH_VERSION    0
 #define GGML_RPC_MAX_SERVERS       16
 
@@ -20,10 +20,23 @@ GGML_BACKEND_API ggml_backend_buffer_type_t ggml_backend_rpc_buffer_type(const c
 
 GGML_BACKEND_API void ggml_backend_rpc_get_device_memory(const char * endpoint, size_t * free, size_t * total);
 
+// number of devices exposed by the server, the device i > 0 is addressed with the endpoint "host:port/i"
+GGML_BACKEND_API size_t ggml_backend_rpc_get_device_count(const char * endpoint);
+
+// make the tensors of a local GGUF file available to the clients, which then do not send their data
+// a tensor is loaded from the file when the client has a tensor with the same name, type, shape and data
+// call before starting the server
+GGML_BACKEND_API bool ggml_backend_rpc_server_add_gguf(const char * fname);
+
 GGML_BACKEND_API void ggml_backend_rpc_start_server(ggml_backend_t backend, const char * endpoint,
                                                     const char * cache_dir,
                                                     size_t free_mem, size_t total_mem);
 
+// serve several devices from one endpoint, the clients can use them concurrently
+GGML_BACKEND_API void ggml_backend_rpc_start_server_multi(const char * endpoint, const char * cache_dir,
+                                                          size_t n_devices, ggml_backend_t * backends,
+                                                          const size_t * free_mem, const size_t * total_mem);
+
 GGML_BACKEND_API ggml_backend_reg_t ggml_backend_rpc_reg(void);
 
 GGML_BACKEND_API ggml_backend_dev_t ggml_backend_rpc_add_device(const char * endpoint);
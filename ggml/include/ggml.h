@@ -406,7 +406,8 @@ extern "C" {
         // GGML_TYPE_IQ4_NL_4_8 = 37,
         // GGML_TYPE_IQ4_NL_8_8 = 38,
         GGML_TYPE_MXFP4   = 39, // MXFP4 (1 block)
-        GGML_TYPE_COUNT   = 40,
+        GGML_TYPE_F8_E4M3 = 40, // FP8 E4M3 with a scale per block of 32
+        GGML_TYPE_COUNT   = 41,
     };
 
     // precision
@@ -442,6 +443,7 @@ extern "C" {
         GGML_FTYPE_MOSTLY_IQ1_M   = 23, // except 1d tensors
         GGML_FTYPE_MOSTLY_BF16    = 24, // except 1d tensors
         GGML_FTYPE_MOSTLY_MXFP4   = 25, // except 1d tensors
+        GGML_FTYPE_MOSTLY_F8_E4M3 = 26, // except 1d tensors
     };
 
     // available tensor operations:
@@ -598,6 +600,7 @@ extern "C" {
         GGML_TENSOR_FLAG_OUTPUT =  2, // ...is an output for the GGML compute graph
         GGML_TENSOR_FLAG_PARAM  =  4, // ...contains trainable parameters
         GGML_TENSOR_FLAG_LOSS   =  8, // ...defines loss for numerical optimization (multiple loss tensors add up)
+        GGML_TENSOR_FLAG_CHECKPOINT = 16, // ...is kept from the forward pass, the other activations are recomputed by the backward pass
     };
 
     struct ggml_init_params {
@@ -815,6 +818,7 @@ extern "C" {
     GGML_API void ggml_set_output(struct ggml_tensor * tensor);
     GGML_API void ggml_set_param(struct ggml_tensor * tensor);
     GGML_API void ggml_set_loss(struct ggml_tensor * tensor);
+    GGML_API void ggml_set_checkpoint(struct ggml_tensor * tensor); // see ggml_build_backward_expand()
 
     //
     // operations on tensors with backpropagation
@@ -2300,6 +2304,8 @@ extern "C" {
     //
 
     GGML_API void ggml_build_forward_expand(struct ggml_cgraph * cgraph, struct ggml_tensor * tensor);
+    // with checkpoints in the forward pass (ggml_set_checkpoint), the backward pass uses copies of the other activations
+    // that are recomputed from the checkpoints, so that only the checkpoints are kept alive until the backward pass
     GGML_API void ggml_build_backward_expand(
         struct ggml_context *  ctx,        // context for gradient computation
         struct ggml_cgraph  *  cgraph,
@@ -189,6 +189,7 @@ extern "C" {
     //
 
     // write the entire context to a binary file
+    // the tensor data is written directly from the tensors (in chunks from device buffers), the file is not buffered in memory
     GGML_API bool gguf_write_to_file(const struct gguf_context * ctx, const char * fname, bool only_meta);
 
     // get the size in bytes of the meta data (header, kv pairs, tensor info) including padding
@@ -209,6 +209,12 @@ extern "C" {
     // Internal backend registry API
     GGML_API void ggml_backend_register(ggml_backend_reg_t reg);
 
+    // Graph execution trace in the Chrome trace event format (chrome://tracing, ui.perfetto.dev)
+    // enabled with GGML_SCHED_TRACE=<file>, the file is written at exit
+    GGML_API bool ggml_backend_trace_enabled(void);
+    // record a complete event on the named track, the times are from ggml_time_us()
+    GGML_API void ggml_backend_trace_event(const char * track, const char * name, const char * cat, int64_t t_start_us, int64_t t_end_us);
+
     // Add backend dynamic loading support to the backend
 
     // Initialize the backend
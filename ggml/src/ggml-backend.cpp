@@ -14,6 +14,7 @@
 #include "ggml-impl.h"
 
 #include <assert.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -22,6 +23,7 @@
 #include <string>
 #include <vector>
 #include <algorithm>
+#include <mutex>
 
 #ifdef __APPLE__
 #include <sys/types.h>
@@ -591,6 +593,109 @@ static bool ggml_is_view_op(enum ggml_op op) {
     return op == GGML_OP_VIEW || op == GGML_OP_RESHAPE || op == GGML_OP_PERMUTE || op == GGML_OP_TRANSPOSE;
 }
 
+// graph execution trace
+
+struct ggml_backend_trace {
+    struct event {
+        int         tid;
+        std::string name;
+        const char * cat;
+        int64_t     t_start_us;
+        int64_t     t_end_us;
+    };
+
+    std::string path;
+
+    std::mutex               mutex;
+    std::vector<event>       events;
+    std::vector<std::string> tracks; // the index is the tid of the track
+
+    ggml_backend_trace() {
+        const char * GGML_SCHED_TRACE = getenv("GGML_SCHED_TRACE");
+        if (GGML_SCHED_TRACE) {
+            path = GGML_SCHED_TRACE;
+        }
+    }
+
+    ~ggml_backend_trace() {
+        if (!path.empty()) {
+            write();
+        }
+    }
+
+    static void write_str(FILE * f, const char * str) {
+        fputc('"', f);
+        for (const char * c = str; *c; ++c) {
+            if (*c == '"' || *c == '\\') {
+                fputc('\\', f);
+            }
+            if ((unsigned char) *c >= 0x20) {
+                fputc(*c, f);
+            }
+        }
+        fputc('"', f);
+    }
+
+    // Chrome trace event format, one thread per track
+    void write() {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        FILE * f = ggml_fopen(path.c_str(), "wb");
+        if (!f) {
+            GGML_LOG_ERROR("ggml_backend_trace: failed to open %s\n", path.c_str());
+            return;
+        }
+
+        fprintf(f, "{\"traceEvents\":[\n");
+        for (size_t i = 0; i < tracks.size(); ++i) {
+            fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%zu,\"args\":{\"name\":", i);
+            write_str(f, tracks[i].c_str());
+            fprintf(f, "}},\n");
+        }
+        for (size_t i = 0; i < events.size(); ++i) {
+            const event & ev = events[i];
+            fprintf(f, "{\"name\":");
+            write_str(f, ev.name.c_str());
+            fprintf(f, ",\"cat\":");
+            write_str(f, ev.cat);
+            fprintf(f, ",\"ph\":\"X\",\"pid\":0,\"tid\":%d,\"ts\":%" PRId64 ",\"dur\":%" PRId64 "}%s\n",
+                    ev.tid, ev.t_start_us, ev.t_end_us - ev.t_start_us, i + 1 < events.size() ? "," : "");
+        }
+        fprintf(f, "]}\n");
+        fclose(f);
+
+        GGML_LOG_INFO("ggml_backend_trace: wrote %zu events to %s\n", events.size(), path.c_str());
+    }
+
+    void add(const char * track, const char * name, const char * cat, int64_t t_start_us, int64_t t_end_us) {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        int tid = 0;
+        while (tid < (int) tracks.size() && tracks[tid] != track) {
+            tid++;
+        }
+        if (tid == (int) tracks.size()) {
+            tracks.emplace_back(track);
+        }
+
+        events.push_back({ tid, name, cat, t_start_us, t_end_us });
+    }
+};
+
+static ggml_backend_trace & ggml_backend_trace_get() {
+    static ggml_backend_trace trace;
+    return trace;
+}
+
+bool ggml_backend_trace_enabled(void) {
+    static const bool enabled = !ggml_backend_trace_get().path.empty();
+    return enabled;
+}
+
+void ggml_backend_trace_event(const char * track, const char * name, const char * cat, int64_t t_start_us, int64_t t_end_us) {
+    ggml_backend_trace_get().add(track, name, cat, t_start_us, t_end_us);
+}
+
 // scheduler
 
 #ifndef GGML_SCHED_MAX_BACKENDS
@@ -605,6 +710,14 @@ static bool ggml_is_view_op(enum ggml_op op) {
 #define GGML_SCHED_MAX_COPIES 4
 #endif
 
+#ifndef GGML_SCHED_COST_CACHE_SIZE
+#define GGML_SCHED_COST_CACHE_SIZE 1024
+#endif
+
+#ifndef GGML_SCHED_COST_N_MEASURE
+#define GGML_SCHED_COST_N_MEASURE 8
+#endif
+
 struct ggml_backend_sched_split {
     int backend_id;
     int i_start;
@@ -613,6 +726,10 @@ struct ggml_backend_sched_split {
     int n_inputs;
     // graph view of this split
     struct ggml_cgraph graph;
+    // plan of the graph, created on the first compute and reused until the graph is split again
+    ggml_backend_graph_plan_t plan;
+    // weight streaming: staging buffer of the weights of this split, -1 if they are copied on demand
+    int stream_slot;
 };
 
 struct ggml_backend_sched {
@@ -661,6 +778,38 @@ struct ggml_backend_sched {
     size_t context_buffer_size;
 
     bool op_offload;
+    bool graph_plan; // GGML_SCHED_GRAPH_PLAN=1: reuse the plans of the split graphs for backends that support them
+
+    // weight streaming (GGML_SCHED_WEIGHT_STREAMING=1): the weights in host buffers used by the offloaded splits are
+    // uploaded by a second instance of the backend to two staging buffers in turn, while the previous split is computed
+    ggml_backend_t        stream_backends[GGML_SCHED_MAX_BACKENDS];
+    ggml_backend_buffer_t stream_bufs[GGML_SCHED_MAX_BACKENDS][2];
+    ggml_backend_event_t  stream_ready[GGML_SCHED_MAX_BACKENDS][2]; // upload done, recorded on the stream backend
+    ggml_backend_event_t  stream_free[GGML_SCHED_MAX_BACKENDS][2];  // compute done, recorded on the split backend
+    bool                  stream_free_recorded[GGML_SCHED_MAX_BACKENDS][2];
+
+    // cost-model placement (GGML_SCHED_COST_PLACEMENT=1): ops with weights in host memory are offloaded when the estimated
+    // compute time plus the transfer time is lower than on the CPU, using rates measured during the first graph computes
+    bool     cost_placement;
+    int      cost_n_measure;                                // remaining graph computes to measure
+    double   cost_work[GGML_SCHED_MAX_BACKENDS];            // measured work of the splits, see ggml_backend_sched_op_work
+    double   cost_work_us[GGML_SCHED_MAX_BACKENDS];
+    double   cost_copy_bytes[GGML_SCHED_MAX_BACKENDS];      // measured copies of weights to the backend
+    double   cost_copy_us[GGML_SCHED_MAX_BACKENDS];
+    double   cost_work_rate[GGML_SCHED_MAX_BACKENDS];       // work per us, 0 if unknown
+    double   cost_copy_rate[GGML_SCHED_MAX_BACKENDS];       // bytes per us, 0 if unknown
+    uint64_t cost_cache_keys[GGML_SCHED_COST_CACHE_SIZE];   // placement decisions by op shape
+    int      cost_cache_backend_ids[GGML_SCHED_COST_CACHE_SIZE];
+
+    // concurrent splits (GGML_SCHED_CONCURRENT=1): the splits of the asynchronous backends (GPUs) that do not
+    // depend on a split of a synchronous backend (CPU) are launched before it, so that both compute at the same time
+    bool  concurrent;
+    bool  backend_async[GGML_SCHED_MAX_BACKENDS];
+    int * split_steps;           // 2*i: copy the inputs of split i, 2*i + 1: compute split i
+    int   n_split_steps;         // 0 if the splits are computed in order
+    int   split_steps_capacity;
+
+    bool trace;      // see ggml_backend_trace_enabled()
 
     int debug;
 };
@@ -702,6 +851,97 @@ static int ggml_backend_sched_backend_from_buffer(ggml_backend_sched_t sched, co
     return -1;
 }
 
+// cost-model placement
+
+// estimated work of an op: flops of the matrix multiplications plus the memory traffic of the op
+static double ggml_backend_sched_op_work(const struct ggml_tensor * op) {
+    double work = (double) ggml_nbytes(op);
+    for (int i = 0; i < GGML_MAX_SRC; i++) {
+        if (op->src[i] != NULL) {
+            work += (double) ggml_nbytes(op->src[i]);
+        }
+    }
+    if (op->op == GGML_OP_MUL_MAT || op->op == GGML_OP_MUL_MAT_ID) {
+        work += 2.0*op->src[0]->ne[0]*ggml_nelements(op);
+    }
+    return work;
+}
+
+static uint64_t ggml_backend_sched_op_shape_key(const struct ggml_tensor * op, int backend_id) {
+    // FNV-1a
+    uint64_t h = 0xcbf29ce484222325ULL;
+    auto mix = [&h](uint64_t v) {
+        h ^= v;
+        h *= 0x100000001b3ULL;
+    };
+    mix(op->op);
+    mix(backend_id);
+    for (int i = 0; i < GGML_MAX_SRC; i++) {
+        const struct ggml_tensor * t = op->src[i];
+        if (t == NULL) {
+            continue;
+        }
+        mix(i);
+        mix(t->type);
+        for (int d = 0; d < GGML_MAX_DIMS; d++) {
+            mix(t->ne[d]);
+        }
+    }
+    return h | 1; // 0 is an empty slot
+}
+
+// returns true if backend_id should run the op that uses the weight in host memory instead of the CPU backend
+static bool ggml_backend_sched_offload_op(ggml_backend_sched_t sched, int backend_id, const struct ggml_tensor * op, const struct ggml_tensor * weight) {
+    const int cpu_id = sched->n_backends - 1;
+
+    if (!sched->cost_placement || sched->cost_work_rate[backend_id] == 0.0 || sched->cost_copy_rate[backend_id] == 0.0 ||
+        sched->cost_work_rate[cpu_id] == 0.0) {
+        return ggml_backend_offload_op(sched->backends[backend_id], op);
+    }
+
+    const uint64_t key = ggml_backend_sched_op_shape_key(op, backend_id);
+    const size_t   idx = key % GGML_SCHED_COST_CACHE_SIZE;
+    if (sched->cost_cache_keys[idx] == key) {
+        return sched->cost_cache_backend_ids[idx] == backend_id;
+    }
+
+    // the weight and the other sources are copied to the backend, and the result back
+    double copy_bytes = (double) ggml_nbytes(weight) + (double) ggml_nbytes(op);
+    for (int i = 0; i < GGML_MAX_SRC; i++) {
+        if (op->src[i] != NULL && op->src[i] != weight) {
+            copy_bytes += (double) ggml_nbytes(op->src[i]);
+        }
+    }
+
+    const double work   = ggml_backend_sched_op_work(op);
+    const double t_cpu  = work/sched->cost_work_rate[cpu_id];
+    const double t_back = work/sched->cost_work_rate[backend_id] + copy_bytes/sched->cost_copy_rate[backend_id];
+
+    const bool offload = t_back < t_cpu;
+
+    sched->cost_cache_keys[idx]        = key;
+    sched->cost_cache_backend_ids[idx] = offload ? backend_id : cpu_id;
+
+    return offload;
+}
+
+// called after each graph compute, updates the rates at the end of the measurement
+static void ggml_backend_sched_cost_update(ggml_backend_sched_t sched) {
+    if (!sched->cost_placement || sched->cost_n_measure == 0 || --sched->cost_n_measure > 0) {
+        return;
+    }
+
+    for (int b = 0; b < sched->n_backends; b++) {
+        sched->cost_work_rate[b] = sched->cost_work_us[b] > 0.0 ? sched->cost_work[b]/sched->cost_work_us[b] : 0.0;
+        sched->cost_copy_rate[b] = sched->cost_copy_us[b] > 0.0 ? sched->cost_copy_bytes[b]/sched->cost_copy_us[b] : 0.0;
+
+        GGML_LOG_DEBUG("%s: %s: work rate = %.3e/us, weight copy rate = %.3e B/us\n", __func__,
+            ggml_backend_name(sched->backends[b]), sched->cost_work_rate[b], sched->cost_copy_rate[b]);
+    }
+
+    memset(sched->cost_cache_keys, 0, sizeof(sched->cost_cache_keys));
+}
+
 #if 0
 #define GGML_SCHED_MAX_SPLITS_DEBUG 4096
 static char causes[GGML_DEFAULT_GRAPH_SIZE*16 + GGML_SCHED_MAX_SPLITS_DEBUG*GGML_SCHED_MAX_SPLIT_INPUTS][128]; // debug only
@@ -756,7 +996,7 @@ static int ggml_backend_sched_backend_id_from_cur(ggml_backend_sched_t sched, st
             // check if a backend with higher prio wants to offload the op
             if (sched->op_offload && src_backend_id == sched->n_backends - 1 && ggml_backend_buffer_is_host(src->buffer)) {
                 for (int b = 0; b < src_backend_id; b++) {
-                    if (ggml_backend_supports_op(sched->backends[b], tensor) && ggml_backend_offload_op(sched->backends[b], tensor)) {
+                    if (ggml_backend_supports_op(sched->backends[b], tensor) && ggml_backend_sched_offload_op(sched, b, tensor, src)) {
                         SET_CAUSE(tensor, "1.off");
                         return b;
                     }
@@ -849,7 +1089,186 @@ static void ggml_backend_sched_set_if_supported(ggml_backend_sched_t sched, stru
 }
 
 // assigns backends to ops and splits the graph into subgraphs that can be computed on the same backend
+static void ggml_backend_sched_free_plans(ggml_backend_sched_t sched) {
+    for (int i = 0; i < sched->n_splits; i++) {
+        struct ggml_backend_sched_split * split = &sched->splits[i];
+        if (split->plan != NULL) {
+            ggml_backend_graph_plan_free(sched->backends[split->backend_id], split->plan);
+            split->plan = NULL;
+        }
+    }
+}
+
+// Orders the computation of the splits from their dependencies, so that the independent splits of different backends overlap.
+// The asynchronous backends only queue their work, a synchronous backend computes its split on the calling thread:
+// before a split of a synchronous backend, the ready splits of the asynchronous backends are launched.
+// A split depends on:
+//  - the splits that produce its inputs
+//  - the previous split with the same buffer type, since ggml-alloc reuses the memory of the buffer in the graph order
+//  - the copy of the inputs of the previous splits that read its buffer type, for the same reason
+//  - all the splits, in both directions, if it reads a tensor of a split of another buffer type without a copy or
+//    uses memory that is not allocated for the graph, e.g. a view of the KV cache
+static void ggml_backend_sched_order_splits(ggml_backend_sched_t sched) {
+    sched->n_split_steps = 0;
+
+    const int n_splits = sched->n_splits;
+
+    bool any_async = false;
+    bool any_sync  = false;
+    for (int i = 0; i < n_splits; i++) {
+        any_async = any_async ||  sched->backend_async[sched->splits[i].backend_id];
+        any_sync  = any_sync  || !sched->backend_async[sched->splits[i].backend_id];
+    }
+    if (!sched->concurrent || n_splits < 3 || !any_async || !any_sync) {
+        return;
+    }
+
+    if (sched->split_steps_capacity < 2*n_splits) {
+        sched->split_steps_capacity = 2*n_splits;
+        sched->split_steps = (int *) realloc(sched->split_steps, sched->split_steps_capacity * sizeof(int));
+        GGML_ASSERT(sched->split_steps != NULL);
+    }
+
+    // split of each node
+    std::vector<int> node_split(sched->hash_set.size, -1);
+    for (int i = 0; i < n_splits; i++) {
+        const struct ggml_cgraph * g = &sched->splits[i].graph;
+        for (int j = 0; j < g->n_nodes; j++) {
+            node_split[ggml_hash_find(&sched->hash_set, g->nodes[j])] = i;
+        }
+    }
+    auto producer = [&](const struct ggml_tensor * t) -> int {
+        const size_t id = ggml_hash_find(&sched->hash_set, t);
+        if (id == GGML_HASHSET_FULL || !ggml_bitset_get(sched->hash_set.used, id)) {
+            return -1;
+        }
+        return node_split[id];
+    };
+    auto is_weights = [](const struct ggml_tensor * t) {
+        return t->buffer != NULL && ggml_backend_buffer_get_usage(t->buffer) == GGML_BACKEND_BUFFER_USAGE_WEIGHTS;
+    };
+
+    std::vector<std::vector<int>> deps(n_splits);
+    std::vector<std::vector<int>> copy_deps(n_splits);
+    int last_barrier = -1;
+    int last_buft_split[GGML_SCHED_MAX_BACKENDS];
+    for (int b = 0; b < sched->n_backends; b++) {
+        last_buft_split[b] = -1;
+    }
+
+    for (int i = 0; i < n_splits; i++) {
+        const struct ggml_backend_sched_split * split = &sched->splits[i];
+        const int b = split->backend_id;
+
+        bool barrier = false;
+        for (int j = 0; j < split->graph.n_nodes && !barrier; j++) {
+            const struct ggml_tensor * node = split->graph.nodes[j];
+            if (node->view_src != NULL && producer(node->view_src) < 0 && !is_weights(node->view_src)) {
+                barrier = true;
+            }
+            for (int k = 0; k < GGML_MAX_SRC && !barrier; k++) {
+                const struct ggml_tensor * src = node->src[k];
+                const int p = src != NULL ? producer(src) : -1;
+                if (p >= 0 && p != i && sched->bufts[sched->splits[p].backend_id] != sched->bufts[b]) {
+                    barrier = true;
+                }
+            }
+        }
+
+        if (barrier) {
+            for (int p = last_barrier + 1; p < i; p++) {
+                deps[i].push_back(p);
+            }
+        }
+        if (last_barrier >= 0) {
+            deps[i].push_back(last_barrier);
+        }
+        for (int j = 0; j < split->n_inputs; j++) {
+            const int p = producer(split->inputs[j]);
+            if (p >= 0) {
+                deps[i].push_back(p);
+
+                // the input can be overwritten by the next splits with the buffer type of the producer
+                for (int k = i + 1; k < n_splits; k++) {
+                    if (sched->bufts[sched->splits[k].backend_id] == sched->bufts[sched->splits[p].backend_id]) {
+                        copy_deps[k].push_back(i);
+                    }
+                }
+            }
+        }
+        for (int c = 0; c < sched->n_backends; c++) {
+            if (sched->bufts[c] == sched->bufts[b] && last_buft_split[c] >= 0) {
+                deps[i].push_back(last_buft_split[c]);
+            }
+        }
+
+        last_buft_split[b] = i;
+        if (barrier) {
+            last_barrier = i;
+        }
+    }
+
+    std::vector<bool> copied(n_splits, false);
+    std::vector<bool> issued(n_splits, false);
+    auto ready = [&](int i) {
+        if (issued[i]) {
+            return false;
+        }
+        for (int p : deps[i]) {
+            if (!issued[p]) {
+                return false;
+            }
+        }
+        for (int p : copy_deps[i]) {
+            if (!copied[p]) {
+                return false;
+            }
+        }
+        return true;
+    };
+    auto next_ready = [&](bool async_only) {
+        for (int i = 0; i < n_splits; i++) {
+            if ((!async_only || sched->backend_async[sched->splits[i].backend_id]) && ready(i)) {
+                return i;
+            }
+        }
+        return -1;
+    };
+
+    int * steps = sched->split_steps;
+    int n_steps = 0;
+    for (int n_issued = 0; n_issued < n_splits; ) {
+        int i = next_ready(true);
+        if (i < 0) {
+            i = next_ready(false);
+        }
+        GGML_ASSERT(i >= 0);
+
+        steps[n_steps++] = 2*i;
+        copied[i] = true;
+        if (!sched->backend_async[sched->splits[i].backend_id]) {
+            // the inputs of the synchronous split are copied before the asynchronous splits queue more work
+            for (int k = next_ready(true); k >= 0; k = next_ready(true)) {
+                steps[n_steps++] = 2*k;
+                steps[n_steps++] = 2*k + 1;
+                copied[k] = true;
+                issued[k] = true;
+                n_issued++;
+            }
+        }
+        steps[n_steps++] = 2*i + 1;
+        issued[i] = true;
+        n_issued++;
+    }
+    GGML_ASSERT(n_steps == 2*n_splits);
+
+    sched->n_split_steps = n_steps;
+}
+
 static void ggml_backend_sched_split_graph(ggml_backend_sched_t sched, struct ggml_cgraph * graph) {
+    // the plans refer to the previous split graphs
+    ggml_backend_sched_free_plans(sched);
+
     // reset splits
     sched->n_splits = 0;
     sched->n_graph_inputs = 0;
@@ -1093,6 +1512,8 @@ static void ggml_backend_sched_split_graph(ggml_backend_sched_t sched, struct gg
         }
         split->i_start = 0;
         split->n_inputs = 0;
+        split->plan = NULL;
+        split->stream_slot = -1;
         int cur_backend_id = split->backend_id;
         for (; i < graph->n_nodes; i++) {
             struct ggml_tensor * node = graph->nodes[i];
@@ -1149,6 +1570,8 @@ static void ggml_backend_sched_split_graph(ggml_backend_sched_t sched, struct gg
                 split->backend_id = node_backend_id;
                 split->i_start = i;
                 split->n_inputs = 0;
+                split->plan = NULL;
+                split->stream_slot = -1;
                 cur_backend_id = node_backend_id;
             }
 
@@ -1308,6 +1731,126 @@ static void ggml_backend_sched_split_graph(ggml_backend_sched_t sched, struct gg
         assert(graph_copy->size > graph_copy->n_leafs);
         graph_copy->leafs[graph_copy->n_leafs++] = leaf;
     }
+
+    ggml_backend_sched_order_splits(sched);
+}
+
+// weight streaming
+
+static bool ggml_backend_sched_input_is_streamed(ggml_backend_sched_t sched, const struct ggml_backend_sched_split * split, const struct ggml_tensor * input) {
+    return sched->stream_backends[split->backend_id] != NULL &&
+        !(input->flags & GGML_TENSOR_FLAG_INPUT) &&
+        input->buffer != NULL &&
+        ggml_backend_buffer_get_usage(input->buffer) == GGML_BACKEND_BUFFER_USAGE_WEIGHTS &&
+        ggml_backend_buffer_is_host(input->buffer);
+}
+
+// place the copies of the streamed weights of each split in a staging buffer of the split backend, alternating between the two buffers
+static void ggml_backend_sched_alloc_streamed_inputs(ggml_backend_sched_t sched) {
+    size_t size_max[GGML_SCHED_MAX_BACKENDS] = { 0 };
+    int    n_streamed[GGML_SCHED_MAX_BACKENDS] = { 0 };
+
+    for (int i = 0; i < sched->n_splits; i++) {
+        struct ggml_backend_sched_split * split = &sched->splits[i];
+        const int b = split->backend_id;
+
+        size_t size = 0;
+        for (int j = 0; j < split->n_inputs; j++) {
+            if (ggml_backend_sched_input_is_streamed(sched, split, split->inputs[j])) {
+                struct ggml_tensor * input_cpy = tensor_copy(split->inputs[j], b, sched->cur_copy);
+                size = GGML_PAD(size, ggml_backend_buft_get_alignment(sched->bufts[b]));
+                size += ggml_backend_buft_get_alloc_size(sched->bufts[b], input_cpy);
+            }
+        }
+
+        split->stream_slot = size > 0 ? n_streamed[b]++ % 2 : -1;
+        size_max[b] = std::max(size_max[b], size);
+    }
+
+    for (int b = 0; b < sched->n_backends; b++) {
+        if (size_max[b] == 0 || (sched->stream_bufs[b][0] && ggml_backend_buffer_get_size(sched->stream_bufs[b][0]) >= size_max[b])) {
+            continue;
+        }
+
+        // the previous stage buffers may still be in use
+        ggml_backend_synchronize(sched->stream_backends[b]);
+        ggml_backend_synchronize(sched->backends[b]);
+
+        bool ok = true;
+        for (int k = 0; k < 2; k++) {
+            ggml_backend_buffer_free(sched->stream_bufs[b][k]);
+            sched->stream_bufs[b][k] = ok ? ggml_backend_buft_alloc_buffer(sched->bufts[b], size_max[b]) : NULL;
+            ok = ok && sched->stream_bufs[b][k] != NULL;
+            sched->stream_free_recorded[b][k] = false;
+        }
+
+        if (!ok) {
+            GGML_LOG_WARN("%s: failed to allocate %.2f MiB for the weight streaming buffers of %s, copying the weights on demand\n",
+                __func__, 2*size_max[b]/1024.0/1024.0, ggml_backend_name(sched->backends[b]));
+            for (int k = 0; k < 2; k++) {
+                ggml_backend_buffer_free(sched->stream_bufs[b][k]);
+                sched->stream_bufs[b][k] = NULL;
+            }
+        }
+    }
+
+    for (int i = 0; i < sched->n_splits; i++) {
+        struct ggml_backend_sched_split * split = &sched->splits[i];
+        const int b = split->backend_id;
+
+        if (split->stream_slot < 0) {
+            continue;
+        }
+
+        ggml_backend_buffer_t buf = sched->stream_bufs[b][split->stream_slot];
+        if (buf == NULL) {
+            split->stream_slot = -1;
+            continue;
+        }
+
+        char * base = (char *) ggml_backend_buffer_get_base(buf);
+        size_t offs = 0;
+        for (int j = 0; j < split->n_inputs; j++) {
+            if (ggml_backend_sched_input_is_streamed(sched, split, split->inputs[j])) {
+                struct ggml_tensor * input_cpy = tensor_copy(split->inputs[j], b, sched->cur_copy);
+                offs = GGML_PAD(offs, ggml_backend_buft_get_alignment(sched->bufts[b]));
+                ggml_backend_tensor_alloc(buf, input_cpy, base + offs);
+                offs += ggml_backend_buft_get_alloc_size(sched->bufts[b], input_cpy);
+            }
+        }
+    }
+}
+
+// queue the upload of the streamed weights of split i on the stream backend, after the compute of the previous user of the staging buffer
+static void ggml_backend_sched_upload_streamed_inputs(ggml_backend_sched_t sched, int i) {
+    struct ggml_backend_sched_split * split = &sched->splits[i];
+    const int b    = split->backend_id;
+    const int slot = split->stream_slot;
+
+    ggml_backend_t stream_backend = sched->stream_backends[b];
+
+    if (sched->stream_free_recorded[b][slot]) {
+        ggml_backend_event_wait(stream_backend, sched->stream_free[b][slot]);
+    }
+
+    for (int j = 0; j < split->n_inputs; j++) {
+        struct ggml_tensor * input = split->inputs[j];
+        if (ggml_backend_sched_input_is_streamed(sched, split, input)) {
+            struct ggml_tensor * input_cpy = tensor_copy(input, b, sched->cur_copy);
+            ggml_backend_tensor_set_async(stream_backend, input_cpy, input->data, 0, ggml_nbytes(input));
+        }
+    }
+
+    ggml_backend_event_record(sched->stream_ready[b][slot], stream_backend);
+}
+
+static int ggml_backend_sched_next_streamed_split(ggml_backend_sched_t sched, int i) {
+    for (; i < sched->n_splits; i++) {
+        if (sched->splits[i].stream_slot >= 0) {
+            return i;
+        }
+    }
+    return -1;
 }
 
 static bool ggml_backend_sched_alloc_splits(ggml_backend_sched_t sched) {
@@ -1349,92 +1892,190 @@ static bool ggml_backend_sched_alloc_splits(ggml_backend_sched_t sched) {
     return true;
 }
 
-static enum ggml_status ggml_backend_sched_compute_splits(ggml_backend_sched_t sched) {
-    struct ggml_backend_sched_split * splits = sched->splits;
+static void ggml_backend_sched_copy_split_inputs(ggml_backend_sched_t sched, int i, bool cost_measure) {
+    struct ggml_backend_sched_split * split = &sched->splits[i];
+    int split_backend_id = split->backend_id;
+    ggml_backend_t split_backend = sched->backends[split_backend_id];
 
-    for (int i = 0; i < sched->n_splits; i++) {
-        struct ggml_backend_sched_split * split = &splits[i];
-        int split_backend_id = split->backend_id;
-        ggml_backend_t split_backend = sched->backends[split_backend_id];
+    // copy the input tensors to the split backend
+    for (int j = 0; j < split->n_inputs; j++) {
+        ggml_backend_t input_backend = ggml_backend_sched_get_tensor_backend(sched, split->inputs[j]);
+        struct ggml_tensor * input = split->inputs[j];
+        struct ggml_tensor * input_cpy = tensor_copy(input, split_backend_id, sched->cur_copy);
 
-        // copy the input tensors to the split backend
-        for (int j = 0; j < split->n_inputs; j++) {
-            ggml_backend_t input_backend = ggml_backend_sched_get_tensor_backend(sched, split->inputs[j]);
-            struct ggml_tensor * input = split->inputs[j];
-            struct ggml_tensor * input_cpy = tensor_copy(input, split_backend_id, sched->cur_copy);
+        if (split->stream_slot >= 0 && ggml_backend_sched_input_is_streamed(sched, split, input)) {
+            continue;
+        }
+
+        const bool cost_measure_copy = cost_measure && input->buffer != NULL &&
+            ggml_backend_buffer_get_usage(input->buffer) == GGML_BACKEND_BUFFER_USAGE_WEIGHTS;
+        if (cost_measure_copy) {
+            ggml_backend_synchronize(split_backend);
+        }
 
-            if (input->flags & GGML_TENSOR_FLAG_INPUT) {
-                // inputs from the user must be copied immediately to prevent the user overwriting the data before the copy is done
+        const int64_t t_copy_start = sched->trace || cost_measure_copy ? ggml_time_us() : 0;
+
+        if (input->flags & GGML_TENSOR_FLAG_INPUT) {
+            // inputs from the user must be copied immediately to prevent the user overwriting the data before the copy is done
+            if (sched->events[split_backend_id][sched->cur_copy] != NULL) {
+                ggml_backend_event_synchronize(sched->events[split_backend_id][sched->cur_copy]);
+            } else {
+                ggml_backend_synchronize(split_backend);
+            }
+            ggml_backend_tensor_copy(input, input_cpy);
+        } else {
+            // wait for the split backend to finish using the input before overwriting it
+            if (sched->events[split_backend_id][sched->cur_copy] != NULL) {
+                ggml_backend_event_wait(split_backend, sched->events[split_backend_id][sched->cur_copy]);
+            } else {
+                ggml_backend_synchronize(split_backend);
+            }
+            // try async copy, but if not possible, we can still use a sync copy without synchronizing the dst backend, since we handle the synchronization here with multiple copies and events
+            // TODO: add public function to facilitate this, since applications do not have direct access to the backend interface
+            if (!split_backend->iface.cpy_tensor_async || !split_backend->iface.cpy_tensor_async(input_backend, split_backend, input, input_cpy)) {
+                ggml_backend_synchronize(input_backend);
                 if (sched->events[split_backend_id][sched->cur_copy] != NULL) {
                     ggml_backend_event_synchronize(sched->events[split_backend_id][sched->cur_copy]);
                 } else {
                     ggml_backend_synchronize(split_backend);
                 }
                 ggml_backend_tensor_copy(input, input_cpy);
-            } else {
-                // wait for the split backend to finish using the input before overwriting it
-                if (sched->events[split_backend_id][sched->cur_copy] != NULL) {
-                    ggml_backend_event_wait(split_backend, sched->events[split_backend_id][sched->cur_copy]);
-                } else {
-                    ggml_backend_synchronize(split_backend);
-                }
-                // try async copy, but if not possible, we can still use a sync copy without synchronizing the dst backend, since we handle the synchronization here with multiple copies and events
-                // TODO: add public function to facilitate this, since applications do not have direct access to the backend interface
-                if (!split_backend->iface.cpy_tensor_async || !split_backend->iface.cpy_tensor_async(input_backend, split_backend, input, input_cpy)) {
-                    ggml_backend_synchronize(input_backend);
-                    if (sched->events[split_backend_id][sched->cur_copy] != NULL) {
-                        ggml_backend_event_synchronize(sched->events[split_backend_id][sched->cur_copy]);
-                    } else {
-                        ggml_backend_synchronize(split_backend);
-                    }
-                    ggml_backend_tensor_copy(input, input_cpy);
-                }
             }
         }
 
-        if (!sched->callback_eval) {
-            enum ggml_status ec = ggml_backend_graph_compute_async(split_backend, &split->graph);
+        if (sched->trace) {
+            // the async copies are waited for, so that the event covers the transfer
+            ggml_backend_synchronize(split_backend);
+            ggml_backend_trace_event(ggml_backend_name(split_backend), input->name, "copy", t_copy_start, ggml_time_us());
+        }
+
+        if (cost_measure_copy) {
+            ggml_backend_synchronize(split_backend);
+            sched->cost_copy_bytes[split_backend_id] += (double) ggml_nbytes(input);
+            sched->cost_copy_us[split_backend_id]    += (double) (ggml_time_us() - t_copy_start);
+        }
+    }
+}
+
+static enum ggml_status ggml_backend_sched_compute_split(ggml_backend_sched_t sched, int i, bool cost_measure) {
+    struct ggml_backend_sched_split * split = &sched->splits[i];
+    int split_backend_id = split->backend_id;
+    ggml_backend_t split_backend = sched->backends[split_backend_id];
+
+    if (split->stream_slot >= 0) {
+        ggml_backend_event_wait(split_backend, sched->stream_ready[split_backend_id][split->stream_slot]);
+    }
+
+    if (cost_measure) {
+        ggml_backend_synchronize(split_backend);
+    }
+
+    const int64_t t_compute_start = sched->trace || cost_measure ? ggml_time_us() : 0;
+
+    if (!sched->callback_eval) {
+        // when the graph is computed again without being split (e.g. graph reuse), replay the plan of the split
+        if (sched->graph_plan && split->plan == NULL &&
+            split_backend->iface.graph_plan_create != NULL && split_backend->iface.graph_plan_compute != NULL) {
+            split->plan = split_backend->iface.graph_plan_create(split_backend, &split->graph);
+        }
+
+        enum ggml_status ec = split->plan != NULL ?
+            ggml_backend_graph_plan_compute(split_backend, split->plan) :
+            ggml_backend_graph_compute_async(split_backend, &split->graph);
+        if (ec != GGML_STATUS_SUCCESS) {
+            return ec;
+        }
+    } else {
+        // similar to ggml_backend_compare_graph_backend
+        for (int j0 = 0; j0 < split->graph.n_nodes; j0++) {
+            struct ggml_tensor * t = split->graph.nodes[j0];
+
+            // check if the user needs data from this node
+            bool need = sched->callback_eval(t, true, sched->callback_eval_user_data);
+
+            int j1 = j0;
+
+            // determine the range [j0, j1] of nodes that can be computed together
+            while (!need && j1 < split->graph.n_nodes - 1) {
+                t = split->graph.nodes[++j1];
+                need = sched->callback_eval(t, true, sched->callback_eval_user_data);
+            }
+
+            struct ggml_cgraph gv = ggml_graph_view(&split->graph, j0, j1 + 1);
+
+            enum ggml_status ec = ggml_backend_graph_compute_async(split_backend, &gv);
             if (ec != GGML_STATUS_SUCCESS) {
                 return ec;
             }
-        } else {
-            // similar to ggml_backend_compare_graph_backend
-            for (int j0 = 0; j0 < split->graph.n_nodes; j0++) {
-                struct ggml_tensor * t = split->graph.nodes[j0];
 
-                // check if the user needs data from this node
-                bool need = sched->callback_eval(t, true, sched->callback_eval_user_data);
+            // TODO: pass backend to the callback, then the user can decide if they want to synchronize
+            ggml_backend_synchronize(split_backend);
 
-                int j1 = j0;
+            if (need && !sched->callback_eval(t, false, sched->callback_eval_user_data)) {
+                break;
+            }
 
-                // determine the range [j0, j1] of nodes that can be computed together
-                while (!need && j1 < split->graph.n_nodes - 1) {
-                    t = split->graph.nodes[++j1];
-                    need = sched->callback_eval(t, true, sched->callback_eval_user_data);
-                }
+            j0 = j1;
+        }
+    }
 
-                struct ggml_cgraph gv = ggml_graph_view(&split->graph, j0, j1 + 1);
+    if (sched->trace) {
+        ggml_backend_synchronize(split_backend);
 
-                enum ggml_status ec = ggml_backend_graph_compute_async(split_backend, &gv);
-                if (ec != GGML_STATUS_SUCCESS) {
-                    return ec;
-                }
+        char name[64];
+        snprintf(name, sizeof(name), "split %d (%d nodes)", i, split->graph.n_nodes);
+        ggml_backend_trace_event(ggml_backend_name(split_backend), name, "compute", t_compute_start, ggml_time_us());
+    }
 
-                // TODO: pass backend to the callback, then the user can decide if they want to synchronize
-                ggml_backend_synchronize(split_backend);
+    if (cost_measure) {
+        ggml_backend_synchronize(split_backend);
+        for (int j = 0; j < split->graph.n_nodes; j++) {
+            sched->cost_work[split_backend_id] += ggml_backend_sched_op_work(split->graph.nodes[j]);
+        }
+        sched->cost_work_us[split_backend_id] += (double) (ggml_time_us() - t_compute_start);
+    }
 
-                if (need && !sched->callback_eval(t, false, sched->callback_eval_user_data)) {
-                    break;
-                }
+    // record the event of this copy
+    if (split->n_inputs > 0) {
+        if (sched->events[split_backend_id][sched->cur_copy] != NULL) {
+            ggml_backend_event_record(sched->events[split_backend_id][sched->cur_copy], split_backend);
+        }
+    }
 
-                j0 = j1;
-            }
+    if (split->stream_slot >= 0) {
+        ggml_backend_event_record(sched->stream_free[split_backend_id][split->stream_slot], split_backend);
+        sched->stream_free_recorded[split_backend_id][split->stream_slot] = true;
+
+        const int i_next = ggml_backend_sched_next_streamed_split(sched, i + 1);
+        if (i_next >= 0) {
+            ggml_backend_sched_upload_streamed_inputs(sched, i_next);
         }
+    }
 
-        // record the event of this copy
-        if (split->n_inputs > 0) {
-            if (sched->events[split_backend_id][sched->cur_copy] != NULL) {
-                ggml_backend_event_record(sched->events[split_backend_id][sched->cur_copy], split_backend);
+    return GGML_STATUS_SUCCESS;
+}
+
+static enum ggml_status ggml_backend_sched_compute_splits(ggml_backend_sched_t sched) {
+    // the measurement of the cost model waits for each copy and compute
+    const bool cost_measure = sched->cost_placement && sched->cost_n_measure > 0;
+
+    // weight streaming: the weights of a split are uploaded while the previous streamed split is computed
+    const int i_streamed = ggml_backend_sched_next_streamed_split(sched, 0);
+    if (i_streamed >= 0) {
+        ggml_backend_sched_upload_streamed_inputs(sched, i_streamed);
+    }
+
+    // the splits are computed in order when they are observed or when the weights are streamed in the order of the splits
+    const bool reorder = sched->n_split_steps == 2*sched->n_splits && !sched->callback_eval && !cost_measure && i_streamed < 0;
+
+    for (int s = 0; s < 2*sched->n_splits; s++) {
+        const int step = reorder ? sched->split_steps[s] : s;
+        if (step % 2 == 0) {
+            ggml_backend_sched_copy_split_inputs(sched, step / 2, cost_measure);
+        } else {
+            enum ggml_status ec = ggml_backend_sched_compute_split(sched, step / 2, cost_measure);
+            if (ec != GGML_STATUS_SUCCESS) {
+                return ec;
             }
         }
     }
@@ -1457,6 +2098,10 @@ ggml_backend_sched_t ggml_backend_sched_new(
 
     const char * GGML_SCHED_DEBUG = getenv("GGML_SCHED_DEBUG");
     sched->debug = GGML_SCHED_DEBUG ? atoi(GGML_SCHED_DEBUG) : 0;
+
+    const char * GGML_SCHED_GRAPH_PLAN = getenv("GGML_SCHED_GRAPH_PLAN");
+    sched->graph_plan = GGML_SCHED_GRAPH_PLAN ? atoi(GGML_SCHED_GRAPH_PLAN) != 0 : false;
+    sched->trace = ggml_backend_trace_enabled();
     sched->n_backends = n_backends;
     sched->n_copies = parallel ? GGML_SCHED_MAX_COPIES : 1;
 
@@ -1495,6 +2140,43 @@ ggml_backend_sched_t ggml_backend_sched_new(
     sched->galloc = ggml_gallocr_new_n(sched->bufts, n_backends);
     sched->op_offload = op_offload;
 
+    const char * GGML_SCHED_CONCURRENT = getenv("GGML_SCHED_CONCURRENT");
+    sched->concurrent = GGML_SCHED_CONCURRENT ? atoi(GGML_SCHED_CONCURRENT) != 0 : false;
+    for (int b = 0; b < n_backends; b++) {
+        // the GPU backends queue the graphs, the others compute them on the calling thread
+        sched->backend_async[b] = ggml_backend_dev_type(ggml_backend_get_device(backends[b])) == GGML_BACKEND_DEVICE_TYPE_GPU;
+    }
+
+    const char * GGML_SCHED_COST_PLACEMENT = getenv("GGML_SCHED_COST_PLACEMENT");
+    sched->cost_placement = op_offload && n_backends > 1 && GGML_SCHED_COST_PLACEMENT && atoi(GGML_SCHED_COST_PLACEMENT) != 0;
+    sched->cost_n_measure = sched->cost_placement ? GGML_SCHED_COST_N_MEASURE : 0;
+
+    // weight streaming needs a device that can copy asynchronously and synchronize with events
+    const char * GGML_SCHED_WEIGHT_STREAMING = getenv("GGML_SCHED_WEIGHT_STREAMING");
+    if (op_offload && sched->n_copies == 1 && GGML_SCHED_WEIGHT_STREAMING && atoi(GGML_SCHED_WEIGHT_STREAMING) != 0) {
+        for (int b = 0; b < n_backends - 1; b++) {
+            ggml_backend_dev_t dev = ggml_backend_get_device(backends[b]);
+
+            struct ggml_backend_dev_props props;
+            ggml_backend_dev_get_props(dev, &props);
+
+            if (ggml_backend_dev_type(dev) != GGML_BACKEND_DEVICE_TYPE_GPU || !props.caps.async || !props.caps.events ||
+                sched->bufts[b] != ggml_backend_dev_buffer_type(dev)) {
+                continue;
+            }
+
+            sched->stream_backends[b] = ggml_backend_dev_init(dev, NULL);
+            if (sched->stream_backends[b] == NULL) {
+                continue;
+            }
+
+            for (int k = 0; k < 2; k++) {
+                sched->stream_ready[b][k] = ggml_backend_event_new(dev);
+                sched->stream_free[b][k]  = ggml_backend_event_new(dev);
+            }
+        }
+    }
+
     ggml_backend_sched_reset(sched);
 
     return sched;
@@ -1504,15 +2186,26 @@ void ggml_backend_sched_free(ggml_backend_sched_t sched) {
     if (sched == NULL) {
         return;
     }
+    ggml_backend_sched_free_plans(sched);
     for (int b = 0; b < sched->n_backends; b++) {
         for (int c = 0; c < sched->n_copies; c++) {
             ggml_backend_event_free(sched->events[b][c]);
         }
+        if (sched->stream_backends[b] != NULL) {
+            ggml_backend_synchronize(sched->stream_backends[b]);
+            for (int k = 0; k < 2; k++) {
+                ggml_backend_buffer_free(sched->stream_bufs[b][k]);
+                ggml_backend_event_free(sched->stream_ready[b][k]);
+                ggml_backend_event_free(sched->stream_free[b][k]);
+            }
+            ggml_backend_free(sched->stream_backends[b]);
+        }
     }
     ggml_gallocr_free(sched->galloc);
     ggml_free(sched->ctx);
     ggml_hash_set_free(&sched->hash_set);
     free(sched->splits);
+    free(sched->split_steps);
     free(sched->hv_tensor_backend_ids);
     free(sched->hv_tensor_copies);
     free(sched->node_backend_ids);
@@ -1542,6 +2235,7 @@ bool ggml_backend_sched_reserve(ggml_backend_sched_t sched, struct ggml_cgraph *
     ggml_backend_sched_synchronize(sched);
 
     ggml_backend_sched_split_graph(sched, measure_graph);
+    ggml_backend_sched_alloc_streamed_inputs(sched);
 
     if (!ggml_gallocr_reserve_n(sched->galloc, &sched->graph, sched->node_backend_ids, sched->leaf_backend_ids)) {
         return false;
@@ -1560,6 +2254,7 @@ bool ggml_backend_sched_alloc_graph(ggml_backend_sched_t sched, struct ggml_cgra
     sched->next_copy = (sched->next_copy + 1) % sched->n_copies;
 
     ggml_backend_sched_split_graph(sched, graph);
+    ggml_backend_sched_alloc_streamed_inputs(sched);
 
     if (!ggml_backend_sched_alloc_splits(sched)) {
         return false;
@@ -1587,7 +2282,12 @@ enum ggml_status ggml_backend_sched_graph_compute_async(ggml_backend_sched_t sch
         }
     }
 
-    return ggml_backend_sched_compute_splits(sched);
+    enum ggml_status status = ggml_backend_sched_compute_splits(sched);
+    if (status == GGML_STATUS_SUCCESS) {
+        ggml_backend_sched_cost_update(sched);
+    }
+
+    return status;
 }
 
 void ggml_backend_sched_synchronize(ggml_backend_sched_t sched) {
@@ -1628,7 +2328,14 @@ size_t ggml_backend_sched_get_buffer_size(ggml_backend_sched_t sched, ggml_backe
     int backend_index = ggml_backend_sched_backend_id(sched, backend);
     GGML_ASSERT(backend_index >= 0 && backend_index < sched->n_backends);
 
-    return ggml_gallocr_get_buffer_size(sched->galloc, backend_index);
+    size_t size = ggml_gallocr_get_buffer_size(sched->galloc, backend_index);
+    for (int k = 0; k < 2; k++) {
+        if (sched->stream_bufs[backend_index][k] != NULL) {
+            size += ggml_backend_buffer_get_size(sched->stream_bufs[backend_index][k]);
+        }
+    }
+
+    return size;
 }
 
 void ggml_backend_sched_set_tensor_backend(ggml_backend_sched_t sched, struct ggml_tensor * node, ggml_backend_t backend) {
@@ -102,6 +102,9 @@ typedef sycl::half2 ggml_half2;
 #define QI_MXFP4 (QK_MXFP4 / (4 * QR_MXFP4))
 #define QR_MXFP4 2
 
+#define QI_F8_E4M3 (QK_F8_E4M3 / (4 * QR_F8_E4M3))
+#define QR_F8_E4M3 1
+
 #define QI5_0 (QK5_0 / (4 * QR5_0))
 #define QR5_0 2
 
@@ -236,6 +239,13 @@ typedef struct {
 } block_q8_1;
 static_assert(sizeof(block_q8_1) == 2*sizeof(ggml_half) + QK8_1, "wrong q8_1 block size/padding");
 
+#define QK_F8_E4M3 32
+typedef struct {
+    ggml_half d;             // delta
+    uint8_t qs[QK_F8_E4M3]; // FP8 E4M3 quants
+} block_f8_e4m3;
+static_assert(sizeof(block_f8_e4m3) == sizeof(ggml_half) + QK_F8_E4M3, "wrong f8_e4m3 block size/padding");
+
 //
 // Ternary quantization
 //
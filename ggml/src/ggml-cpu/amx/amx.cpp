@@ -6,6 +6,7 @@
 #include "ggml-impl.h"
 #include "ggml-cpu.h"
 #include "traits.h"
+#include "mem.h"
 
 #if defined(__gnu_linux__)
 #include <sys/syscall.h>
@@ -123,6 +124,17 @@ static const char * ggml_backend_amx_buffer_type_get_name(ggml_backend_buffer_ty
 }
 
 static ggml_backend_buffer_t ggml_backend_amx_buffer_type_alloc_buffer(ggml_backend_buffer_type_t buft, size_t size) {
+    if (ggml_cpu_repack_mem() != 0) {
+        ggml_backend_buffer_t buffer = ggml_cpu_mem_buffer_alloc(buft, size, ggml_cpu_repack_mem());
+        if (buffer == NULL) {
+            return NULL;
+        }
+        const auto free_buffer = buffer->iface.free_buffer;
+        buffer->iface = ggml_backend_amx_buffer_interface;
+        buffer->iface.free_buffer = free_buffer;
+        return buffer;
+    }
+
     void * data = ggml_aligned_malloc(size);
     if (data == NULL) {
         fprintf(stderr, "%s: failed to allocate buffer of size %zu\n", __func__, size);
@@ -133,6 +133,36 @@ static inline __m256 mul_sum_i8_pairs_float(const __m256i x, const __m256i y) {
 #endif
 }
 
+#if defined(__AVX512BW__) && defined(__AVX512VNNI__)
+// the 512-bit IQ4 kernels apply the signs of the quants to the q8 values with a mask instead of _mm256_sign_epi8
+
+// negate the bytes of x whose bit is set in signs
+static inline __m512i sign_bits_epi8_512(const __m512i x, const __mmask64 signs) {
+    return _mm512_mask_sub_epi8(x, signs, _mm512_setzero_si512(), x);
+}
+
+// multiply int8_t, add results pairwise into int16_t
+static inline __m512i mul_add_epi8_512(const __m512i x, const __m512i y) {
+    return _mm512_maddubs_epi16(_mm512_abs_epi8(x), sign_bits_epi8_512(y, _mm512_movepi8_mask(x)));
+}
+
+// multiply int8_t, add results in groups of 4 into int32_t
+static inline __m512i mul_sum_i8_quads_512(const __m512i x, const __m512i y) {
+    return _mm512_dpbusd_epi32(_mm512_setzero_si512(), _mm512_abs_epi8(x), sign_bits_epi8_512(y, _mm512_movepi8_mask(x)));
+}
+
+static inline __m512i set_m256i_512(const __m256i hi, const __m256i lo) {
+    return _mm512_inserti64x4(_mm512_castsi256_si512(lo), hi, 1);
+}
+
+// the nibbles of 32 bytes spread to the 128-bit lanes as lo(q[0..15]), hi(q[0..15]), lo(q[16..31]), hi(q[16..31])
+static inline __m512i nibbles_from_bytes_32_512(const __m256i q) {
+    const __m512i q2  = _mm512_permutexvar_epi64(_mm512_set_epi64(3, 2, 3, 2, 1, 0, 1, 0), _mm512_castsi256_si512(q));
+    const __m512i m4b = _mm512_set1_epi8(0xf);
+    return _mm512_and_si512(_mm512_mask_srli_epi16(q2, 0xff00ff00, q2, 4), m4b);
+}
+#endif
+
 static inline __m128i packNibbles( __m256i bytes )
 {
     // Move bits within 16-bit lanes from 0000_abcd_0000_efgh into 0000_0000_abcd_efgh
@@ -3645,7 +3675,25 @@ void ggml_vec_dot_iq4_nl_q8_0(int n, float * GGML_RESTRICT s, size_t bs, const v
     int ib = 0;
     float sumf = 0;
 
-#if defined __AVX2__
+#if defined(__AVX512BW__) && defined(__AVX512VNNI__)
+
+    const __m512i values = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)kvalues_iq4nl));
+
+    __m512 accum = _mm512_setzero_ps();
+    for (; ib + 1 < nb; ib += 2) {
+        const __m256i q4bits = MM256_SET_M128I(_mm_loadu_si128((const __m128i *)x[ib + 1].qs), _mm_loadu_si128((const __m128i *)x[ib + 0].qs));
+        const __m512i q4b = _mm512_shuffle_epi8(values, nibbles_from_bytes_32_512(q4bits));
+        const __m512i q8b = set_m256i_512(_mm256_loadu_si256((const __m256i *)y[ib + 1].qs), _mm256_loadu_si256((const __m256i *)y[ib + 0].qs));
+        const __m512i dot = mul_sum_i8_quads_512(q4b, q8b);
+        const __m512 d = _mm512_mask_blend_ps(0xff00,
+                _mm512_set1_ps(GGML_CPU_FP16_TO_FP32(y[ib + 0].d)*GGML_CPU_FP16_TO_FP32(x[ib + 0].d)),
+                _mm512_set1_ps(GGML_CPU_FP16_TO_FP32(y[ib + 1].d)*GGML_CPU_FP16_TO_FP32(x[ib + 1].d)));
+        accum = _mm512_fmadd_ps(d, _mm512_cvtepi32_ps(dot), accum);
+    }
+
+    sumf = _mm512_reduce_add_ps(accum);
+
+#elif defined __AVX2__
 
     const __m128i values128 = _mm_loadu_si128((const __m128i*)kvalues_iq4nl);
     const __m128i m4b  = _mm_set1_epi8(0x0f);
@@ -3725,7 +3773,31 @@ void ggml_vec_dot_iq4_xs_q8_K(int n, float * GGML_RESTRICT s, size_t bs, const v
 
     const int nb = n / QK_K;
 
-#if defined __AVX2__
+#if defined(__AVX512BW__) && defined(__AVX512VNNI__)
+
+    const __m512i values = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)kvalues_iq4nl));
+
+    __m512 accum = _mm512_setzero_ps();
+    for (int ibl = 0; ibl < nb; ++ibl) {
+        const uint8_t * qs = x[ibl].qs;
+        const int8_t  * q8 = y[ibl].qs;
+        uint16_t sh = x[ibl].scales_h;
+        __m512i sumi = _mm512_setzero_si512();
+        for (int ib = 0; ib < QK_K/32; ib += 2) {
+            const __m512i q4b = _mm512_shuffle_epi8(values, nibbles_from_bytes_32_512(_mm256_loadu_si256((const __m256i *)qs))); qs += 32;
+            const __m512i q8b = _mm512_loadu_si512((const __m512i *)q8); q8 += 64;
+            const __m512i dot = mul_add_epi8_512(q4b, q8b);
+            const int16_t ls1 = ((x[ibl].scales_l[ib/2] & 0xf) | ((sh << 4) & 0x30)) - 32;
+            const int16_t ls2 = ((x[ibl].scales_l[ib/2] >>  4) | ((sh << 2) & 0x30)) - 32;
+            sh >>= 4;
+            sumi = _mm512_dpwssd_epi32(sumi, dot, set_m256i_512(_mm256_set1_epi16(ls2), _mm256_set1_epi16(ls1)));
+        }
+        accum = _mm512_fmadd_ps(_mm512_set1_ps(GGML_CPU_FP16_TO_FP32(x[ibl].d)*y[ibl].d), _mm512_cvtepi32_ps(sumi), accum);
+    }
+
+    *s = _mm512_reduce_add_ps(accum);
+
+#elif defined __AVX2__
 
     const __m128i values128 = _mm_loadu_si128((const __m128i*)kvalues_iq4nl);
     const __m128i m4b  = _mm_set1_epi8(0x0f);
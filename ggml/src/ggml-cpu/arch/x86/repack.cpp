@@ -175,6 +175,41 @@ static inline __m256i mul_sum_i8_pairs_acc_int32x8(const __m256i acc, const __m2
 }
 #endif
 
+#if defined(__AVX2__)
+// Unpack quants 64 * g + 8 * k .. 64 * g + 8 * k + 7 of the eight rows of a block_q6_Kx8 into unsigned 6-bit values,
+// rows 0-3 in q_0 and rows 4-7 in q_1
+static inline void ggml_q6_K_8x8_unpack(const block_q6_Kx8 * GGML_RESTRICT b, int g, int k, __m256i & q_0, __m256i & q_1) {
+    const __m256i m4 = _mm256_set1_epi8(0x0F);
+    const __m256i m3 = _mm256_set1_epi8(0x03);
+    const __m128i shift_l = _mm_cvtsi32_si128((g >> 1) * 4);
+    const __m128i shift_h = _mm_cvtsi32_si128(g * 2);
+
+    const uint8_t * ql = b->ql + ((g & 1) * 8 + k) * 64;
+    const uint8_t * qh = b->qh + k * 64;
+
+    const __m256i ql_0 = _mm256_and_si256(_mm256_srl_epi16(_mm256_loadu_si256((const __m256i *) ql), shift_l), m4);
+    const __m256i ql_1 = _mm256_and_si256(_mm256_srl_epi16(_mm256_loadu_si256((const __m256i *) (ql + 32)), shift_l), m4);
+    const __m256i qh_0 = _mm256_and_si256(_mm256_srl_epi16(_mm256_loadu_si256((const __m256i *) qh), shift_h), m3);
+    const __m256i qh_1 = _mm256_and_si256(_mm256_srl_epi16(_mm256_loadu_si256((const __m256i *) (qh + 32)), shift_h), m3);
+
+    q_0 = _mm256_or_si256(ql_0, _mm256_slli_epi16(qh_0, 4));
+    q_1 = _mm256_or_si256(ql_1, _mm256_slli_epi16(qh_1, 4));
+}
+
+// Scales of rows 4 * half .. 4 * half + 3, each repeated twice to match the int32 lanes of the dot products
+static inline __m256i ggml_q6_K_8x8_scales(const int8_t * GGML_RESTRICT scales, int half) {
+    int32_t sc;
+    memcpy(&sc, scales + half * 4, sizeof(sc));
+    const __m256i sc_32 = _mm256_castsi128_si256(_mm_cvtepi8_epi32(_mm_cvtsi32_si128(sc)));
+    return _mm256_permutevar8x32_epi32(sc_32, _mm256_set_epi32(3, 3, 2, 2, 1, 1, 0, 0));
+}
+
+// Reduce the per-row dot products of rows 0-3 and 4-7 into one int32 per row
+static inline __m256i ggml_q6_K_8x8_reduce(const __m256i sumi_0, const __m256i sumi_1) {
+    return _mm256_permute4x64_epi64(_mm256_hadd_epi32(sumi_0, sumi_1), 0xD8);
+}
+#endif
+
 void ggml_quantize_mat_q8_0_4x8(const float * GGML_RESTRICT x, void * GGML_RESTRICT vy, int64_t k) {
     assert(QK8_0 == 32);
     assert(k % QK8_0 == 0);
@@ -1162,6 +1197,78 @@ void ggml_gemv_q2_K_8x8_q8_K(int n, float * GGML_RESTRICT s, size_t bs, const vo
 #endif
 }
 
+void ggml_gemv_q6_K_8x8_q8_K(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
+    const int qk = QK_K;
+    const int nb = n / qk;
+    const int ncols_interleaved = 8;
+    const int blocklen = 8;
+
+    assert (n % qk == 0);
+    assert (nc % ncols_interleaved == 0);
+
+    UNUSED(s);
+    UNUSED(bs);
+    UNUSED(vx);
+    UNUSED(vy);
+    UNUSED(nr);
+    UNUSED(nc);
+    UNUSED(nb);
+    UNUSED(ncols_interleaved);
+    UNUSED(blocklen);
+
+#if defined(__AVX2__)
+    const block_q8_K * a_ptr = (const block_q8_K *) vy;
+
+    for (int x = 0; x < nc / ncols_interleaved; x++) {
+        const block_q6_Kx8 * b_ptr = (const block_q6_Kx8 *) vx + (x * nb);
+
+        __m256 acc_row = _mm256_setzero_ps();
+
+        for (int l = 0; l < nb; l++) {
+            __m256i sumi_0 = _mm256_setzero_si256();
+            __m256i sumi_1 = _mm256_setzero_si256();
+            // The quants are stored with an offset of 32, which is removed at the end through the block sums
+            __m256i bias = _mm256_setzero_si256();
+
+            for (int sb = 0; sb < QK_K / 16; sb++) {
+                const int g = sb >> 2;
+                __m256i dot_0 = _mm256_setzero_si256();
+                __m256i dot_1 = _mm256_setzero_si256();
+
+                for (int h = 0; h < 2; h++) {
+                    const int k = (sb & 3) * 2 + h;
+                    __m256i q_0;
+                    __m256i q_1;
+                    ggml_q6_K_8x8_unpack(b_ptr + l, g, k, q_0, q_1);
+
+                    int64_t a;
+                    memcpy(&a, a_ptr[l].qs + g * 64 + k * 8, sizeof(a));
+                    const __m256i a_8 = _mm256_set1_epi64x(a);
+
+                    dot_0 = mul_sum_us8_pairs_acc_int32x8(dot_0, q_0, a_8);
+                    dot_1 = mul_sum_us8_pairs_acc_int32x8(dot_1, q_1, a_8);
+                }
+
+                const int8_t * scales = b_ptr[l].scales + sb * 8;
+                sumi_0 = _mm256_add_epi32(sumi_0, _mm256_mullo_epi32(dot_0, ggml_q6_K_8x8_scales(scales, 0)));
+                sumi_1 = _mm256_add_epi32(sumi_1, _mm256_mullo_epi32(dot_1, ggml_q6_K_8x8_scales(scales, 1)));
+
+                const __m256i sc = _mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i *) scales));
+                bias = _mm256_add_epi32(bias, _mm256_mullo_epi32(sc, _mm256_set1_epi32(a_ptr[l].bsums[sb])));
+            }
+
+            const __m256i sumi = _mm256_sub_epi32(ggml_q6_K_8x8_reduce(sumi_0, sumi_1), _mm256_slli_epi32(bias, 5));
+            const __m256 d = _mm256_mul_ps(GGML_F32Cx8_LOAD(b_ptr[l].d), _mm256_set1_ps(a_ptr[l].d));
+            acc_row = _mm256_fmadd_ps(_mm256_cvtepi32_ps(sumi), d, acc_row);
+        }
+
+        _mm256_storeu_ps(s + x * 8, acc_row);
+    }
+#else
+    ggml_gemv_q6_K_8x8_q8_K_generic(n, s, bs, vx, vy, nr, nc);
+#endif
+}
+
 void ggml_gemm_q4_0_8x8_q8_0(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
     const int qk = QK8_0;
     const int nb = n / qk;
@@ -6246,3 +6353,105 @@ void ggml_gemm_q2_K_8x8_q8_K(int n, float * GGML_RESTRICT s, size_t bs, const vo
 
 #endif
 }
+
+void ggml_gemm_q6_K_8x8_q8_K(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
+    const int qk = QK_K;
+    const int nb = n / qk;
+    const int ncols_interleaved = 8;
+    const int blocklen = 8;
+
+    assert (n % qk == 0);
+    assert (nr % 4 == 0);
+    assert (nc % ncols_interleaved == 0);
+
+    UNUSED(s);
+    UNUSED(bs);
+    UNUSED(vx);
+    UNUSED(vy);
+    UNUSED(nr);
+    UNUSED(nc);
+    UNUSED(nb);
+    UNUSED(ncols_interleaved);
+    UNUSED(blocklen);
+
+#if defined(__AVX2__)
+    for (int y = 0; y < nr / 4; y++) {
+        const block_q8_Kx4 * a_ptr = (const block_q8_Kx4 *) vy + (y * nb);
+
+        for (int x = 0; x < nc / ncols_interleaved; x++) {
+            const block_q6_Kx8 * b_ptr = (const block_q6_Kx8 *) vx + (x * nb);
+
+            __m256 acc_rows[4];
+            for (int m = 0; m < 4; m++) {
+                acc_rows[m] = _mm256_setzero_ps();
+            }
+
+            for (int l = 0; l < nb; l++) {
+                __m256i sumi_0[4];
+                __m256i sumi_1[4];
+                for (int m = 0; m < 4; m++) {
+                    sumi_0[m] = _mm256_setzero_si256();
+                    sumi_1[m] = _mm256_setzero_si256();
+                }
+
+                for (int sb = 0; sb < QK_K / 16; sb++) {
+                    const int g = sb >> 2;
+                    __m256i dot_0[4];
+                    __m256i dot_1[4];
+                    for (int m = 0; m < 4; m++) {
+                        dot_0[m] = _mm256_setzero_si256();
+                        dot_1[m] = _mm256_setzero_si256();
+                    }
+
+                    for (int h = 0; h < 2; h++) {
+                        const int k = (sb & 3) * 2 + h;
+                        __m256i q_0;
+                        __m256i q_1;
+                        ggml_q6_K_8x8_unpack(b_ptr + l, g, k, q_0, q_1);
+
+                        // The quants of the four rows are interleaved 8 bytes at a time
+                        const int8_t * a_qs = a_ptr[l].qs + (g * 8 + k) * 32;
+                        for (int m = 0; m < 4; m++) {
+                            int64_t a;
+                            memcpy(&a, a_qs + m * 8, sizeof(a));
+                            const __m256i a_8 = _mm256_set1_epi64x(a);
+
+                            dot_0[m] = mul_sum_us8_pairs_acc_int32x8(dot_0[m], q_0, a_8);
+                            dot_1[m] = mul_sum_us8_pairs_acc_int32x8(dot_1[m], q_1, a_8);
+                        }
+                    }
+
+                    const int8_t * scales = b_ptr[l].scales + sb * 8;
+                    const __m256i scale_0 = ggml_q6_K_8x8_scales(scales, 0);
+                    const __m256i scale_1 = ggml_q6_K_8x8_scales(scales, 1);
+                    for (int m = 0; m < 4; m++) {
+                        sumi_0[m] = _mm256_add_epi32(sumi_0[m], _mm256_mullo_epi32(dot_0[m], scale_0));
+                        sumi_1[m] = _mm256_add_epi32(sumi_1[m], _mm256_mullo_epi32(dot_1[m], scale_1));
+                    }
+                }
+
+                // The quants are stored with an offset of 32, which is removed through the block sums
+                // The block sums are interleaved in groups of four sub blocks per row
+                const __m256 d = GGML_F32Cx8_LOAD(b_ptr[l].d);
+                for (int m = 0; m < 4; m++) {
+                    __m256i bias = _mm256_setzero_si256();
+                    for (int sb = 0; sb < QK_K / 16; sb++) {
+                        const __m256i sc = _mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i *) (b_ptr[l].scales + sb * 8)));
+                        const int16_t bsum = a_ptr[l].bsums[(sb >> 2) * 16 + m * 4 + (sb & 3)];
+                        bias = _mm256_add_epi32(bias, _mm256_mullo_epi32(sc, _mm256_set1_epi32(bsum)));
+                    }
+
+                    const __m256i sumi = _mm256_sub_epi32(ggml_q6_K_8x8_reduce(sumi_0[m], sumi_1[m]), _mm256_slli_epi32(bias, 5));
+                    acc_rows[m] = _mm256_fmadd_ps(_mm256_cvtepi32_ps(sumi), _mm256_mul_ps(d, _mm256_set1_ps(a_ptr[l].d[m])), acc_rows[m]);
+                }
+            }
+
+            for (int m = 0; m < 4; m++) {
+                _mm256_storeu_ps(s + (y * 4 + m) * bs + x * 8, acc_rows[m]);
+            }
+        }
+    }
+#else
+    ggml_gemm_q6_K_8x8_q8_K_generic(n, s, bs, vx, vy, nr, nc);
+#endif
+}
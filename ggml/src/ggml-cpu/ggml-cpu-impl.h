@@ -15,6 +15,14 @@
 extern "C" {
 #endif
 
+// vec_dot_type conversion of the src1 of a MUL_MAT, kept at the end of the work buffer
+// the next MUL_MAT with the same src1 (e.g. the Q, K and V projections) skips the conversion
+struct ggml_compute_src1_cache {
+    const struct ggml_tensor * src1; // NULL if the work buffer does not hold a conversion
+    enum ggml_type             type;
+    size_t                     offs; // offset of the conversion in wdata
+};
+
 struct ggml_compute_params {
     // ith = thread index, nth = number of threads
     int ith, nth;
@@ -24,6 +32,9 @@ struct ggml_compute_params {
     void * wdata;
 
     struct ggml_threadpool * threadpool;
+
+    // per thread, the same on all threads, NULL if not used
+    struct ggml_compute_src1_cache * src1_cache;
 };
 
 
@@ -512,6 +523,17 @@ void ggml_barrier(struct ggml_threadpool * tp);
 void ggml_threadpool_chunk_set(struct ggml_threadpool * tp, int value);
 int  ggml_threadpool_chunk_add(struct ggml_threadpool * tp, int value);
 
+// implemented in ggml-cpu.c, used by the ops and the extra buffer types
+void ggml_compute_forward_mul_mat(const struct ggml_compute_params * params, struct ggml_tensor * dst);
+void ggml_compute_forward_mul_mat_id(const struct ggml_compute_params * params, struct ggml_tensor * dst);
+
+// number of NUMA nodes the weights are replicated on (GGML_NUMA_STRATEGY_MIRROR), 0 if disabled
+int ggml_cpu_numa_mirror_n_nodes(void);
+// NUMA node the compute thread ith is bound to
+int ggml_cpu_numa_thread_node(int ith);
+// mask of the NUMA nodes the compute threads are bound to, 0 if they are not bound
+uint32_t ggml_cpu_numa_thread_nodes(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -190,6 +190,7 @@ typedef pthread_t ggml_thread_t;
 #if defined(__APPLE__)
 #include <unistd.h>
 #include <mach/mach.h>
+#include <sys/sysctl.h>
 #include <TargetConditionals.h>
 #endif
 
@@ -259,6 +260,12 @@ static const struct ggml_type_traits_cpu type_traits_cpu[GGML_TYPE_COUNT] = {
         .vec_dot_type             = GGML_TYPE_Q8_0,
         .nrows                    = 1,
     },
+    [GGML_TYPE_F8_E4M3] = {
+        .from_float               = quantize_row_f8_e4m3,
+        .vec_dot                  = ggml_vec_dot_f8_e4m3_q8_0,
+        .vec_dot_type             = GGML_TYPE_Q8_0,
+        .nrows                    = 1,
+    },
     [GGML_TYPE_Q2_K] = {
         .from_float               = quantize_row_q2_K,
         .vec_dot                  = ggml_vec_dot_q2_K_q8_K,
@@ -463,9 +470,22 @@ struct ggml_threadpool {
     int32_t      prio;        // Scheduling priority
     uint32_t     poll;        // Polling level (0 - no polling)
 
+    bool         shared;      // owned by the process-wide registry, see ggml_threadpool_get_shared()
+
     enum ggml_status ec;
 };
 
+// process-wide threadpools shared by the contexts and the CPU backends of the process
+#define GGML_MAX_SHARED_THREADPOOLS 16
+
+static struct {
+    struct ggml_threadpool      * pools [GGML_MAX_SHARED_THREADPOOLS];
+    struct ggml_threadpool_params params[GGML_MAX_SHARED_THREADPOOLS];
+    int                           n;
+    struct ggml_threadpool      * last;  // threadpool of the last graph, paused when another one takes over the cores
+    ggml_mutex_t                  mutex; // the graphs of the shared threadpools are computed one at a time
+} g_shared_threadpools;
+
 // Per-thread state
 struct ggml_compute_state {
 #ifndef GGML_USE_OPENMP
@@ -526,6 +546,26 @@ struct ggml_state {
 
 static struct ggml_state g_state = {0};
 
+// fuse the gate and up projections of the MoE FFNs (GGML_CPU_DISABLE_FUSION to disable)
+static bool ggml_cpu_fusion = true;
+
+// the cores do not have the same capacity (P-cores/E-cores, big.LITTLE), detected by ggml_cpu_init() (GGML_CPU_HYBRID to override)
+static bool ggml_cpu_hybrid = false;
+
+// per-host tuning, loaded by ggml_cpu_init() (GGML_CPU_PROFILE) or set with ggml_backend_cpu_set_profile()
+static struct ggml_backend_cpu_profile ggml_cpu_profile = {
+    /*.n_threads              =*/ 0,
+    /*.n_threads_batch        =*/ 0,
+    /*.mul_mat_chunk_size     =*/ 16,
+    /*.mul_mat_chunk_size_vec =*/ 64,
+    /*.mul_mat_chunk_numa     =*/ false,
+};
+
+static int ggml_cpu_mul_mat_chunk_size(int64_t nr0, int64_t nr1) {
+    // We need to step up the size if it's small
+    return nr0 == 1 || nr1 == 1 ? ggml_cpu_profile.mul_mat_chunk_size_vec : ggml_cpu_profile.mul_mat_chunk_size;
+}
+
 void ggml_barrier(struct ggml_threadpool * tp) {
     int n_threads = atomic_load_explicit(&tp->n_threads_cur, memory_order_relaxed);
     if (n_threads == 1) {
@@ -679,6 +719,47 @@ bool ggml_is_numa(void) {
     return g_state.numa.n_nodes > 1;
 }
 
+int ggml_cpu_numa_mirror_n_nodes(void) {
+    return ggml_is_numa() && g_state.numa.numa_strategy == GGML_NUMA_STRATEGY_MIRROR ? (int) g_state.numa.n_nodes : 0;
+}
+
+int ggml_cpu_numa_thread_node(int ith) {
+    // same placement as set_numa_thread_affinity()
+    return ggml_is_numa() ? ith % (int) g_state.numa.n_nodes : 0;
+}
+
+uint32_t ggml_cpu_numa_thread_nodes(void) {
+    if (!ggml_is_numa()) {
+        return 0;
+    }
+
+    switch (g_state.numa.numa_strategy) {
+        case GGML_NUMA_STRATEGY_DISTRIBUTE:
+        case GGML_NUMA_STRATEGY_MIRROR:
+            return (1u << g_state.numa.n_nodes) - 1;
+        case GGML_NUMA_STRATEGY_ISOLATE:
+            return 1u << g_state.numa.current_node;
+        case GGML_NUMA_STRATEGY_NUMACTL:
+            {
+                uint32_t mask = 0;
+#if defined(__gnu_linux__)
+                for (uint32_t n = 0; n < g_state.numa.n_nodes; ++n) {
+                    const struct ggml_numa_node * node = &g_state.numa.nodes[n];
+                    for (uint32_t i = 0; i < node->n_cpus; ++i) {
+                        if (CPU_ISSET(node->cpus[i], &g_state.numa.cpuset)) {
+                            mask |= 1u << n;
+                            break;
+                        }
+                    }
+                }
+#endif
+                return mask;
+            }
+        default:
+            return 0;
+    }
+}
+
 #if defined(__ARM_ARCH)
 
 #if defined(__linux__) && defined(__aarch64__)
@@ -1110,8 +1191,8 @@ void ggml_set_f32_nd(const struct ggml_tensor * tensor, int i0, int i1, int i2,
 // ggml_compute_forward_mul_mat
 
 static void ggml_compute_forward_mul_mat_one_chunk(
-    const struct ggml_compute_params * params,
     struct ggml_tensor * dst,
+    const void * wdata_src1,
     const enum ggml_type type,
     const int64_t num_rows_per_vec_dot,
     const int64_t ir0_start,
@@ -1140,7 +1221,7 @@ static void ggml_compute_forward_mul_mat_one_chunk(
         return;
     }
 
-    const void * wdata = (src1->type == vec_dot_type) ? src1->data : params->wdata;
+    const void * wdata = (src1->type == vec_dot_type) ? src1->data : wdata_src1;
     const size_t row_size = ggml_row_size(vec_dot_type, ne10);
 
     assert(ne12 % ne02 == 0);
@@ -1261,17 +1342,34 @@ void ggml_compute_forward_mul_mat(
 UseGgmlGemm1:;
 #endif
 
-    if (src1->type != vec_dot_type) {
-        char * wdata = params->wdata;
+    // the conversion of src1 is at the end of the work buffer, where the ops between sibling matmuls do not reach
+    const void * wdata_src1 = params->wdata;
 
+    if (src1->type != vec_dot_type) {
         const size_t nbw0 = ggml_type_size(vec_dot_type);
         const size_t nbw1 = ggml_row_size(vec_dot_type, ne10);
         const size_t nbw2 = nbw1*ne11;
         const size_t nbw3 = nbw2*ne12;
 
-        assert(params->wsize >= ne13*nbw3);
+        GGML_ASSERT(params->wsize >= ne13*nbw3);
         GGML_ASSERT(src1->type == GGML_TYPE_F32);
 
+        const size_t offs = (params->wsize - ne13*nbw3) & ~((size_t) CACHE_LINE_SIZE - 1);
+
+        char * wdata = (char *) params->wdata + offs;
+        wdata_src1 = wdata;
+
+        // converted by the previous MUL_MAT with the same src1
+        struct ggml_compute_src1_cache * cache = params->src1_cache;
+        if (cache && cache->src1 == src1 && cache->type == vec_dot_type && cache->offs == offs) {
+            goto UseCachedSrc1;
+        }
+        if (cache) {
+            cache->src1 = src1;
+            cache->type = vec_dot_type;
+            cache->offs = offs;
+        }
+
     #if 0
         for (int64_t i13 = 0; i13 < ne13; ++i13) {
             for (int64_t i12 = 0; i12 < ne12; ++i12) {
@@ -1297,6 +1395,7 @@ UseGgmlGemm1:;
         }
     #endif
     }
+UseCachedSrc1:;
 
     if (ith == 0) {
         // Every thread starts at ith, so the first unprocessed chunk is nth.  This save a bit of coordination right at the start.
@@ -1307,7 +1406,7 @@ UseGgmlGemm1:;
 
 #if GGML_USE_LLAMAFILE
     if (src1->type != vec_dot_type) {
-        const void* wdata = (src1->type == vec_dot_type) ? src1->data : params->wdata;
+        const void* wdata = wdata_src1;
         const size_t row_size = ggml_row_size(vec_dot_type, ne10);
 
         for (int64_t i13 = 0; i13 < ne13; i13++)
@@ -1336,12 +1435,7 @@ UseGgmlGemm2:;
     const int64_t nr1 = ne1 * ne2 * ne3;
 
     // Now select a reasonable chunk size.
-    int chunk_size = 16;
-
-    // We need to step up the size if it's small
-    if (nr0 == 1 || nr1 == 1) {
-        chunk_size = 64;
-    }
+    const int chunk_size = ggml_cpu_mul_mat_chunk_size(nr0, nr1);
 
     // distribute the work across the inner or outer loop based on which one is larger
     // The number of chunks in the 0/1 dim.
@@ -1352,10 +1446,17 @@ UseGgmlGemm2:;
     // If the chunking is poor for the number of threads on this setup, scrap the whole plan.  Re-chunk it by thread.
     //   Also, chunking by thread was measured to have perform better on NUMA systems.  See https://github.com/ggml-org/llama.cpp/pull/6915
     //   In theory, chunking should be just as useful on NUMA and non NUMA systems, but testing disagreed with that.
-    if (nchunk0 * nchunk1 < nth * 4 || ggml_is_numa()) {
+    if (nchunk0 * nchunk1 < nth * 4 || (ggml_is_numa() && !ggml_cpu_profile.mul_mat_chunk_numa)) {
         // distribute the thread work across the inner or outer loop based on which one is larger
         nchunk0 = nr0 > nr1 ? nth : 1; // parallelize by src0 rows
         nchunk1 = nr0 > nr1 ? 1 : nth; // parallelize by src1 rows
+
+        // with cores of different capacity, equal shares make the fast cores wait for the slow ones at the barrier
+        //   keep several chunks per thread instead, so that the fast cores take more of them
+        if (ggml_cpu_hybrid && !ggml_is_numa()) {
+            nchunk0 = nr0 > nr1 ? MIN(nr0, nth * 4) : 1;
+            nchunk1 = nr0 > nr1 ? 1 : MIN(nr1, nth * 4);
+        }
     }
 
     // The number of elements in each chunk
@@ -1383,7 +1484,7 @@ UseGgmlGemm2:;
         if ((nr0 % 2 != 0) || (ne11 % 2 != 0) || ((ir0_end - ir0_start) % 2 != 0) || ((ir1_end - ir1_start) % 2 != 0)) {
             num_rows_per_vec_dot = 1;
         }
-        ggml_compute_forward_mul_mat_one_chunk(params, dst, src0->type, num_rows_per_vec_dot, ir0_start, ir0_end, ir1_start, ir1_end);
+        ggml_compute_forward_mul_mat_one_chunk(dst, wdata_src1, src0->type, num_rows_per_vec_dot, ir0_start, ir0_end, ir1_start, ir1_end);
 
         if (nth >= nchunk0 * nchunk1) {
             break;
@@ -1413,6 +1514,8 @@ static void ggml_compute_forward_mul_mat_id_one_chunk(
     const int64_t ir1_start,
     const int64_t ir1_end,
     const char * src0_cur,
+    const char * src0_up_cur,
+    const enum ggml_glu_op glu_op,
     const struct mmid_row_mapping * matrix_rows,
     const size_t row_size,
     const bool src1_cont,
@@ -1429,6 +1532,7 @@ static void ggml_compute_forward_mul_mat_id_one_chunk(
     const int64_t blck_1 = 16;
 
     float tmp[16];
+    float tmp_up[16];
 
     for (int64_t iir1 = ir1_start; iir1 < ir1_end; iir1 += blck_1) {
         for (int64_t iir0 = ir0_start; iir0 < ir0_end; iir0 += blck_0) {
@@ -1455,11 +1559,28 @@ static void ggml_compute_forward_mul_mat_id_one_chunk(
 
                 float * dst_col = (float *) ((char *) dst->data + (i1*nb1 + i2*nb2));
 
-                for (int64_t ir0 = iir0; ir0 < iir0 + blck_0 && ir0 < ir0_end; ++ir0) {
+                const int64_t n = MIN(iir0 + blck_0, ir0_end) - iir0;
+
+                for (int64_t ir0 = iir0; ir0 < iir0 + n; ++ir0) {
                     vec_dot(ne00, &tmp[ir0 - iir0], 0, src0_cur + ir0*nb01, 0, src1_col, 0, 1);
                 }
 
-                memcpy(&dst_col[iir0], tmp, (MIN(iir0 + blck_0, ir0_end) - iir0)*sizeof(float));
+                if (src0_up_cur == NULL) {
+                    memcpy(&dst_col[iir0], tmp, n*sizeof(float));
+                    continue;
+                }
+
+                // fused gate and up projections: the GLU is applied while the products are still in the cache
+                for (int64_t ir0 = iir0; ir0 < iir0 + n; ++ir0) {
+                    vec_dot(ne00, &tmp_up[ir0 - iir0], 0, src0_up_cur + ir0*nb01, 0, src1_col, 0, 1);
+                }
+
+                switch (glu_op) {
+                    case GGML_GLU_OP_SWIGLU: ggml_vec_swiglu_f32(n, &dst_col[iir0], tmp, tmp_up); break;
+                    case GGML_GLU_OP_GEGLU:  ggml_vec_geglu_f32 (n, &dst_col[iir0], tmp, tmp_up); break;
+                    case GGML_GLU_OP_REGLU:  ggml_vec_reglu_f32 (n, &dst_col[iir0], tmp, tmp_up); break;
+                    default: GGML_ABORT("fatal error");
+                }
             }
         }
     }
@@ -1473,13 +1594,36 @@ static void * incr_ptr_aligned(void ** p, size_t size, size_t align) {
     return ptr;
 }
 
-static void ggml_compute_forward_mul_mat_id(
-        const struct ggml_compute_params * params,
-              struct ggml_tensor * dst) {
+// number of chunks of the rows of one expert
+static void ggml_mul_mat_id_nchunk(int64_t nr0, int64_t nr1, int nth, bool disable_chunking, int64_t * nchunk0, int64_t * nchunk1) {
+    if (nr1 == 0) {
+        *nchunk0 = 0;
+        *nchunk1 = 0;
+        return;
+    }
 
-    const struct ggml_tensor * src0 = dst->src[0];
-    const struct ggml_tensor * src1 = dst->src[1];
-    const struct ggml_tensor * ids = dst->src[2];
+    if (disable_chunking) {
+        *nchunk0 = nr0 > nr1 ? nth : 1;
+        *nchunk1 = nr0 > nr1 ? 1 : nth;
+        return;
+    }
+
+    const int chunk_size = ggml_cpu_mul_mat_chunk_size(nr0, nr1);
+
+    *nchunk0 = (nr0 + chunk_size - 1) / chunk_size;
+    *nchunk1 = (nr1 + chunk_size - 1) / chunk_size;
+}
+
+// src0:    the expert weights
+// src0_up: optional, the up weights of a MoE FFN - dst = glu_op(src0*src1) * (src0_up*src1)
+static void ggml_compute_forward_mul_mat_id_impl(
+        const struct ggml_compute_params * params,
+              struct ggml_tensor * dst,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src0_up,
+        const struct ggml_tensor * src1,
+        const struct ggml_tensor * ids,
+        const enum ggml_glu_op glu_op) {
 
     GGML_TENSOR_BINARY_OP_LOCALS
 
@@ -1519,9 +1663,6 @@ static void ggml_compute_forward_mul_mat_id(
     struct mmid_row_mapping * matrix_rows = // [n_as][ids->ne[0]*ids->ne[1]]
         incr_ptr_aligned(&wdata_cur, n_as*ids->ne[0]*ids->ne[1]*sizeof(struct mmid_row_mapping), sizeof(int64_t));
 
-    char (*atomic_current_chunk)[CACHE_LINE_SIZE] = // [n_as]
-        incr_ptr_aligned(&wdata_cur, CACHE_LINE_SIZE * n_as, CACHE_LINE_SIZE);
-
     GGML_ASSERT(params->wsize >= (size_t)((char *) wdata_cur - (char *) params->wdata));
 
     if (src1->type != vec_dot_type) {
@@ -1576,81 +1717,212 @@ static void ggml_compute_forward_mul_mat_id(
                 matrix_row_counts[i02] += 1;
             }
         }
-    }
 
-    // reset current_chunk
-    for (int cur_a = ith; cur_a < n_as; cur_a += nth) {
-        atomic_int * current_chunk_ctr = (atomic_int *)(atomic_current_chunk + cur_a);
-        *current_chunk_ctr = nth;
+        // reset current_chunk
+        ggml_threadpool_chunk_set(params->threadpool, nth);
     }
 
     ggml_barrier(params->threadpool);
 
-    for (int cur_a = 0; cur_a < n_as; ++cur_a) {
-        const int64_t cne1 = matrix_row_counts[cur_a];
+    const void * wdata = (src1->type == vec_dot_type) ? src1->data : params->wdata;
+    const size_t row_size = ggml_row_size(vec_dot_type, ne10);
 
-        if (cne1 == 0) {
-            continue;
-        }
+#if defined(__aarch64__)
+    // disable for ARM, except with cores of different capacity (big.LITTLE)
+    const bool disable_chunking = !ggml_cpu_hybrid;
+#else
+    // disable for NUMA
+    const bool disable_chunking = ggml_is_numa() && !ggml_cpu_profile.mul_mat_chunk_numa;
+#endif // defined(__aarch64__)
 
-        const char * src0_cur = (const char *) src0->data + cur_a * nb02;
-        const void * wdata = (src1->type == vec_dot_type) ? src1->data : params->wdata;
-        const size_t row_size = ggml_row_size(vec_dot_type, ne10);
+    // the chunks of all the experts are taken from a single queue, so that the threads stay busy
+    // when the tokens are unevenly routed - the chunks are numbered expert by expert
+    const int64_t nr0 = ne01;
 
-        const int64_t nr0 = ne01;
-        const int64_t nr1 = cne1;
+    int64_t cur_a       = 0; // expert of current_chunk
+    int64_t chunk_first = 0; // first chunk of cur_a
+    int64_t nchunk0     = 0;
+    int64_t nchunk1     = 0;
 
-        int chunk_size = 16;
-        if (nr0 == 1 || nr1 == 1) {
-            chunk_size = 64;
-        }
+    ggml_mul_mat_id_nchunk(nr0, matrix_row_counts[0], nth, disable_chunking, &nchunk0, &nchunk1);
 
-#if defined(__aarch64__)
-        // disable for ARM
-        const bool disable_chunking = true;
-#else
-        // disable for NUMA
-        const bool disable_chunking = ggml_is_numa();
-#endif // defined(__aarch64__)
+    int current_chunk = ith;
 
-        int64_t nchunk0 = (nr0 + chunk_size - 1) / chunk_size;
-        int64_t nchunk1 = (nr1 + chunk_size - 1) / chunk_size;
+    while (true) {
+        while (cur_a < n_as && current_chunk >= chunk_first + nchunk0*nchunk1) {
+            chunk_first += nchunk0*nchunk1;
+            if (++cur_a < n_as) {
+                ggml_mul_mat_id_nchunk(nr0, matrix_row_counts[cur_a], nth, disable_chunking, &nchunk0, &nchunk1);
+            }
+        }
 
-        if (nchunk0 * nchunk1 < nth * 4 || disable_chunking) {
-            nchunk0 = nr0 > nr1 ? nth : 1;
-            nchunk1 = nr0 > nr1 ? 1 : nth;
+        if (cur_a >= n_as) {
+            break;
         }
 
+        const int64_t nr1 = matrix_row_counts[cur_a];
+
         const int64_t dr0 = (nr0 + nchunk0 - 1) / nchunk0;
         const int64_t dr1 = (nr1 + nchunk1 - 1) / nchunk1;
 
-        int current_chunk = ith;
+        const int64_t ith0 = (current_chunk - chunk_first) % nchunk0;
+        const int64_t ith1 = (current_chunk - chunk_first) / nchunk0;
 
-        atomic_int * current_chunk_ctr = (atomic_int *)(atomic_current_chunk + cur_a);
+        const int64_t ir0_start = dr0 * ith0;
+        const int64_t ir0_end = MIN(ir0_start + dr0, nr0);
 
-        while (current_chunk < nchunk0 * nchunk1) {
-            const int64_t ith0 = current_chunk % nchunk0;
-            const int64_t ith1 = current_chunk / nchunk0;
+        const int64_t ir1_start = dr1 * ith1;
+        const int64_t ir1_end = MIN(ir1_start + dr1, nr1);
 
-            const int64_t ir0_start = dr0 * ith0;
-            const int64_t ir0_end = MIN(ir0_start + dr0, nr0);
+        const char * src0_cur    = (const char *) src0->data + cur_a * nb02;
+        const char * src0_up_cur = src0_up ? (const char *) src0_up->data + cur_a * nb02 : NULL;
 
-            const int64_t ir1_start = dr1 * ith1;
-            const int64_t ir1_end = MIN(ir1_start + dr1, nr1);
+        ggml_compute_forward_mul_mat_id_one_chunk(
+            dst, src0, src1, ids, cur_a,
+            ir0_start, ir0_end, ir1_start, ir1_end,
+            src0_cur, src0_up_cur, glu_op, matrix_rows, row_size, src1_cont, wdata
+        );
 
-            ggml_compute_forward_mul_mat_id_one_chunk(
-                dst, src0, src1, ids, cur_a,
-                ir0_start, ir0_end, ir1_start, ir1_end,
-                src0_cur, matrix_rows, row_size, src1_cont, wdata
-            );
+        if (disable_chunking) {
+            // keep the static assignment of the chunks of each expert to the threads
+            current_chunk += nth;
+        } else {
+            current_chunk = ggml_threadpool_chunk_add(params->threadpool, 1);
+        }
+    }
+}
 
-            if (nth >= nchunk0 * nchunk1) {
-                break;
-            }
+void ggml_compute_forward_mul_mat_id(
+        const struct ggml_compute_params * params,
+              struct ggml_tensor * dst) {
+    ggml_compute_forward_mul_mat_id_impl(params, dst, dst->src[0], NULL, dst->src[1], dst->src[2], GGML_GLU_OP_COUNT);
+}
+
+//
+// fusion of node sequences
+//
+
+// MUL_MAT_ID + MUL_MAT_ID + GLU of the gate and up projections of a MoE FFN
+static bool ggml_cpu_can_fuse_mul_mat_id_glu(const struct ggml_cgraph * cgraph, int node_n) {
+    if (node_n + 2 >= cgraph->n_nodes) {
+        return false;
+    }
+
+    const struct ggml_tensor * a   = cgraph->nodes[node_n];
+    const struct ggml_tensor * b   = cgraph->nodes[node_n + 1];
+    const struct ggml_tensor * glu = cgraph->nodes[node_n + 2];
+
+    if (a->op != GGML_OP_MUL_MAT_ID || b->op != GGML_OP_MUL_MAT_ID || glu->op != GGML_OP_GLU) {
+        return false;
+    }
+
+    const enum ggml_glu_op glu_op = ggml_get_glu_op(glu);
+    if (glu_op != GGML_GLU_OP_SWIGLU && glu_op != GGML_GLU_OP_GEGLU && glu_op != GGML_GLU_OP_REGLU) {
+        return false;
+    }
+
+    // the activation is applied to src[0], or to src[1] if swapped
+    const bool swapped = ggml_get_op_params_i32(glu, 1) != 0;
+    const struct ggml_tensor * gate = swapped ? glu->src[1] : glu->src[0];
+    const struct ggml_tensor * up   = swapped ? glu->src[0] : glu->src[1];
+
+    if (!((gate == a && up == b) || (gate == b && up == a))) {
+        return false;
+    }
+
+    if (!ggml_node_has_n_uses(cgraph, node_n, 1) || !ggml_node_has_n_uses(cgraph, node_n + 1, 1)) {
+        return false;
+    }
+
+    // same input and routing, same weight layout
+    if (a->src[1] != b->src[1] || a->src[2] != b->src[2]) {
+        return false;
+    }
+
+    const struct ggml_tensor * w0 = a->src[0];
+    const struct ggml_tensor * w1 = b->src[0];
+
+    if (w0->type != w1->type || !ggml_are_same_shape(w0, w1) || !ggml_are_same_stride(w0, w1)) {
+        return false;
+    }
+
+    // weights in the extra buffer types (repack, AMX, ...) have their own kernels
+    if (!w0->buffer || !ggml_backend_buffer_is_host(w0->buffer) ||
+        !w1->buffer || !ggml_backend_buffer_is_host(w1->buffer)) {
+        return false;
+    }
+
+    if (!ggml_is_contiguous(glu) || !ggml_are_same_shape(glu, a) || glu->type != GGML_TYPE_F32) {
+        return false;
+    }
+
+    return true;
+}
+
+// RMS_NORM + MUL with the norm weight
+static bool ggml_cpu_can_fuse_rms_norm_mul(const struct ggml_cgraph * cgraph, int node_n) {
+    static const enum ggml_op ops[] = { GGML_OP_RMS_NORM, GGML_OP_MUL };
+
+    if (!ggml_can_fuse(cgraph, node_n, ops, 2)) {
+        return false;
+    }
 
-            current_chunk = atomic_fetch_add_explicit(current_chunk_ctr, 1, memory_order_relaxed);
+    const struct ggml_tensor * rms_norm = cgraph->nodes[node_n];
+    const struct ggml_tensor * mul      = cgraph->nodes[node_n + 1];
+    const struct ggml_tensor * w        = mul->src[0] == rms_norm ? mul->src[1] : mul->src[0];
+
+    if (rms_norm->src[0]->type != GGML_TYPE_F32 || w->type != GGML_TYPE_F32 || mul->type != GGML_TYPE_F32) {
+        return false;
+    }
+
+    if (!ggml_can_repeat(w, mul)) {
+        return false;
+    }
+
+    return rms_norm->src[0]->nb[0] == sizeof(float) && w->nb[0] == sizeof(float) && mul->nb[0] == sizeof(float);
+}
+
+static void ggml_compute_forward_mul_mat_id_glu(
+        const struct ggml_compute_params * params,
+        const struct ggml_cgraph * cgraph,
+        int node_n) {
+    struct ggml_tensor * glu = cgraph->nodes[node_n + 2];
+
+    const bool swapped = ggml_get_op_params_i32(glu, 1) != 0;
+    const struct ggml_tensor * gate = swapped ? glu->src[1] : glu->src[0];
+    const struct ggml_tensor * up   = swapped ? glu->src[0] : glu->src[1];
+
+    ggml_compute_forward_mul_mat_id_impl(params, glu, gate->src[0], up->src[0], gate->src[1], gate->src[2], ggml_get_glu_op(glu));
+}
+
+static void ggml_compute_forward_rms_norm_mul_fused(
+        const struct ggml_compute_params * params,
+        const struct ggml_cgraph * cgraph,
+        int node_n) {
+    ggml_compute_forward_rms_norm_mul(params, cgraph->nodes[node_n], cgraph->nodes[node_n + 1]);
+}
+
+// a sequence of n_nodes graph nodes that is computed as a single op
+// can_fuse checks the nodes starting at node_n, compute writes only the result of the last node
+struct ggml_cpu_fused_op {
+    int    n_nodes;
+    bool (*can_fuse)(const struct ggml_cgraph * cgraph, int node_n);
+    void (*compute) (const struct ggml_compute_params * params, const struct ggml_cgraph * cgraph, int node_n);
+};
+
+// tried in order, the first match is used
+static const struct ggml_cpu_fused_op ggml_cpu_fused_ops[] = {
+    { 3, ggml_cpu_can_fuse_mul_mat_id_glu, ggml_compute_forward_mul_mat_id_glu     },
+    { 2, ggml_cpu_can_fuse_rms_norm_mul,   ggml_compute_forward_rms_norm_mul_fused },
+};
+
+static const struct ggml_cpu_fused_op * ggml_cpu_find_fused_op(const struct ggml_cgraph * cgraph, int node_n) {
+    for (size_t i = 0; i < sizeof(ggml_cpu_fused_ops)/sizeof(ggml_cpu_fused_ops[0]); ++i) {
+        if (ggml_cpu_fused_ops[i].can_fuse(cgraph, node_n)) {
+            return &ggml_cpu_fused_ops[i];
         }
     }
+    return NULL;
 }
 
 /////////////////////////////////
@@ -2046,6 +2318,7 @@ static void set_numa_thread_affinity(int thread_n) {
 
     switch(g_state.numa.numa_strategy) {
         case GGML_NUMA_STRATEGY_DISTRIBUTE:
+        case GGML_NUMA_STRATEGY_MIRROR:
             // run thread on node_num thread_n / (threads per node)
             node_num = thread_n % g_state.numa.n_nodes;
             break;
@@ -2643,6 +2916,167 @@ void ggml_threadpool_resume(struct ggml_threadpool * threadpool) {
 #endif
 }
 
+// size of the work buffer used by the regular implementation of node, with n_threads threads
+static size_t ggml_graph_node_work_size(struct ggml_tensor * node, int n_threads) {
+    const int n_tasks = ggml_get_n_tasks(node, n_threads);
+
+    size_t cur = 0;
+
+    switch (node->op) {
+        case GGML_OP_CPY:
+        case GGML_OP_DUP:
+            {
+                if (ggml_is_quantized(node->type) ||
+                    // F16 -> BF16 and BF16 -> F16 copies go through intermediate F32
+                    (node->src[0]->type == GGML_TYPE_F16  && node->src[1] && node->src[1]->type == GGML_TYPE_BF16) ||
+                    (node->src[0]->type == GGML_TYPE_BF16 && node->src[1] && node->src[1]->type == GGML_TYPE_F16)) {
+                    cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
+                }
+            } break;
+        case GGML_OP_ADD:
+        case GGML_OP_ADD_ID:
+        case GGML_OP_ADD1:
+            {
+                if (ggml_is_quantized(node->src[0]->type) || node->src[0]->type == GGML_TYPE_F16 || node->src[0]->type == GGML_TYPE_BF16) {
+                    cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
+                }
+            } break;
+        case GGML_OP_ACC:
+            {
+                if (ggml_is_quantized(node->src[0]->type)) {
+                    cur = ggml_type_size(GGML_TYPE_F32) * node->src[1]->ne[0] * n_tasks;
+                }
+            } break;
+        case GGML_OP_COUNT_EQUAL:
+            {
+                cur = ggml_type_size(node->type)*n_tasks;
+            } break;
+        case GGML_OP_MUL_MAT:
+            {
+                const enum ggml_type vec_dot_type = type_traits_cpu[node->src[0]->type].vec_dot_type;
+
+                if (node->src[1]->type != vec_dot_type) {
+                    cur = ggml_row_size(vec_dot_type, ggml_nelements(node->src[1]));
+                }
+            } break;
+        case GGML_OP_MUL_MAT_ID:
+            {
+                cur = 0;
+                const struct ggml_tensor * src0 = node->src[0];
+                const struct ggml_tensor * src1 = node->src[1];
+                const struct ggml_tensor * ids = node->src[2];
+                const enum ggml_type vec_dot_type = type_traits_cpu[src0->type].vec_dot_type;
+                const int n_as = src0->ne[2];
+                // src1
+                if (src1->type != vec_dot_type) {
+                    cur += ggml_row_size(vec_dot_type, ggml_nelements(src1)) + sizeof(int64_t);
+                }
+                // matrix_row_counts
+                cur += n_as * sizeof(int64_t) + sizeof(int64_t);
+                // matrix_rows
+                cur += n_as*ids->ne[0]*ids->ne[1]*sizeof(struct mmid_row_mapping) + sizeof(int64_t);
+            } break;
+        case GGML_OP_OUT_PROD:
+            {
+                if (ggml_is_quantized(node->src[0]->type) || node->src[0]->type == GGML_TYPE_F16 || node->src[0]->type == GGML_TYPE_BF16) {
+                    cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
+                }
+            } break;
+        case GGML_OP_SOFT_MAX:
+        case GGML_OP_ROPE:
+        case GGML_OP_ROPE_BACK:
+            {
+                cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
+            } break;
+        case GGML_OP_CONV_TRANSPOSE_1D:
+            {
+                GGML_ASSERT(node->src[0]->ne[3] == 1);
+                GGML_ASSERT(node->src[1]->ne[2] == 1);
+                GGML_ASSERT(node->src[1]->ne[3] == 1);
+
+                const int64_t ne00 = node->src[0]->ne[0];  // K
+                const int64_t ne01 = node->src[0]->ne[1];  // Cout
+                const int64_t ne02 = node->src[0]->ne[2];  // Cin
+                const int64_t ne10 = node->src[1]->ne[0];  // L
+                const int64_t ne11 = node->src[1]->ne[1];  // Cin
+
+                if ((node->src[0]->type == GGML_TYPE_F16 ||
+                     node->src[0]->type == GGML_TYPE_BF16) &&
+                    node->src[1]->type == GGML_TYPE_F32) {
+                    cur += sizeof(ggml_fp16_t)*ne00*ne01*ne02;
+                    cur += sizeof(ggml_fp16_t)*ne10*ne11;
+                } else if (node->src[0]->type == GGML_TYPE_F32 &&
+                           node->src[1]->type == GGML_TYPE_F32) {
+                    cur += sizeof(float)*ne00*ne01*ne02;
+                    cur += sizeof(float)*ne10*ne11;
+                } else {
+                    GGML_ABORT("fatal error");
+                }
+            } break;
+        case GGML_OP_CONV_2D:
+            {
+                cur = GGML_IM2COL_WORK_SIZE;
+            } break;
+        case GGML_OP_CONV_TRANSPOSE_2D:
+            {
+                const int64_t ne00 = node->src[0]->ne[0]; // W
+                const int64_t ne01 = node->src[0]->ne[1]; // H
+                const int64_t ne02 = node->src[0]->ne[2]; // Channels Out
+                const int64_t ne03 = node->src[0]->ne[3]; // Channels In
+
+                const int64_t ne10 = node->src[1]->ne[0]; // W
+                const int64_t ne11 = node->src[1]->ne[1]; // H
+                const int64_t ne12 = node->src[1]->ne[2]; // Channels In
+
+                cur += sizeof(ggml_fp16_t)*ne00*ne01*ne02*ne03;
+                cur += sizeof(ggml_fp16_t)*ne10*ne11*ne12;
+            } break;
+        case GGML_OP_FLASH_ATTN_EXT:
+            {
+                const int64_t ne10 = node->src[1]->ne[0]; // DK
+                const int64_t ne20 = node->src[2]->ne[0]; // DV
+
+                cur = sizeof(float)*(1*ne10 + 2*ne20)*n_tasks; // 1x head size K + 2x head size V (per thread)
+
+                // partial results of the KV chunks
+                const int64_t nr      = ggml_nrows(node->src[0]);
+                const int64_t n_split = ggml_flash_attn_ext_n_split(nr, node->src[1]->ne[1], n_tasks);
+                if (n_split > 1) {
+                    cur += sizeof(float)*(2 + ne20)*nr*n_split;
+                }
+            } break;
+        case GGML_OP_FLASH_ATTN_BACK:
+            {
+                const int64_t    D = node->src[0]->ne[0];
+                const int64_t ne11 = ggml_up(node->src[1]->ne[1], GGML_SOFT_MAX_UNROLL);
+                const int64_t mxDn = MAX(D, ne11) * 2; // *2 because of S and SM in ggml_compute_forward_flash_attn_back
+                if (node->src[1]->type == GGML_TYPE_F32) {
+                    cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
+                } else if (node->src[1]->type == GGML_TYPE_F16) {
+                    cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
+                } else if (node->src[1]->type == GGML_TYPE_BF16) {
+                    cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
+                }
+            } break;
+
+        case GGML_OP_CROSS_ENTROPY_LOSS:
+            {
+                cur = ggml_type_size(node->type)*(n_tasks + node->src[0]->ne[0]*n_tasks);
+            } break;
+        case GGML_OP_COUNT:
+            {
+                GGML_ABORT("fatal error");
+            }
+        default:
+            break;
+    }
+
+    return cur;
+}
+
 struct ggml_cplan ggml_graph_plan(
           const struct ggml_cgraph * cgraph,
                                int   n_threads,
@@ -2673,152 +3107,7 @@ struct ggml_cplan ggml_graph_plan(
         size_t cur = 0;
 
         if (!ggml_cpu_extra_work_size(n_threads, node, &cur)) {
-            switch (node->op) {
-                case GGML_OP_CPY:
-                case GGML_OP_DUP:
-                    {
-                        if (ggml_is_quantized(node->type) ||
-                            // F16 -> BF16 and BF16 -> F16 copies go through intermediate F32
-                            (node->src[0]->type == GGML_TYPE_F16  && node->src[1] && node->src[1]->type == GGML_TYPE_BF16) ||
-                            (node->src[0]->type == GGML_TYPE_BF16 && node->src[1] && node->src[1]->type == GGML_TYPE_F16)) {
-                            cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
-                        }
-                    } break;
-                case GGML_OP_ADD:
-                case GGML_OP_ADD_ID:
-                case GGML_OP_ADD1:
-                    {
-                        if (ggml_is_quantized(node->src[0]->type)) {
-                            cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
-                        }
-                    } break;
-                case GGML_OP_ACC:
-                    {
-                        if (ggml_is_quantized(node->src[0]->type)) {
-                            cur = ggml_type_size(GGML_TYPE_F32) * node->src[1]->ne[0] * n_tasks;
-                        }
-                    } break;
-                case GGML_OP_COUNT_EQUAL:
-                    {
-                        cur = ggml_type_size(node->type)*n_tasks;
-                    } break;
-                case GGML_OP_MUL_MAT:
-                    {
-                        const enum ggml_type vec_dot_type = type_traits_cpu[node->src[0]->type].vec_dot_type;
-
-                        if (node->src[1]->type != vec_dot_type) {
-                            cur = ggml_row_size(vec_dot_type, ggml_nelements(node->src[1]));
-                        }
-                    } break;
-                case GGML_OP_MUL_MAT_ID:
-                    {
-                        cur = 0;
-                        const struct ggml_tensor * src0 = node->src[0];
-                        const struct ggml_tensor * src1 = node->src[1];
-                        const struct ggml_tensor * ids = node->src[2];
-                        const enum ggml_type vec_dot_type = type_traits_cpu[src0->type].vec_dot_type;
-                        const int n_as = src0->ne[2];
-                        // src1
-                        if (src1->type != vec_dot_type) {
-                            cur += ggml_row_size(vec_dot_type, ggml_nelements(src1)) + sizeof(int64_t);
-                        }
-                        // matrix_row_counts
-                        cur += n_as * sizeof(int64_t) + sizeof(int64_t);
-                        // matrix_rows
-                        cur += n_as*ids->ne[0]*ids->ne[1]*sizeof(struct mmid_row_mapping) + sizeof(int64_t);
-                        // atomic_current_chunk
-                        cur += CACHE_LINE_SIZE*n_as + CACHE_LINE_SIZE;
-                    } break;
-                case GGML_OP_OUT_PROD:
-                    {
-                        if (ggml_is_quantized(node->src[0]->type)) {
-                            cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
-                        }
-                    } break;
-                case GGML_OP_SOFT_MAX:
-                case GGML_OP_ROPE:
-                case GGML_OP_ROPE_BACK:
-                    {
-                        cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
-                    } break;
-                case GGML_OP_CONV_TRANSPOSE_1D:
-                    {
-                        GGML_ASSERT(node->src[0]->ne[3] == 1);
-                        GGML_ASSERT(node->src[1]->ne[2] == 1);
-                        GGML_ASSERT(node->src[1]->ne[3] == 1);
-
-                        const int64_t ne00 = node->src[0]->ne[0];  // K
-                        const int64_t ne01 = node->src[0]->ne[1];  // Cout
-                        const int64_t ne02 = node->src[0]->ne[2];  // Cin
-                        const int64_t ne10 = node->src[1]->ne[0];  // L
-                        const int64_t ne11 = node->src[1]->ne[1];  // Cin
-
-                        if ((node->src[0]->type == GGML_TYPE_F16 ||
-                             node->src[0]->type == GGML_TYPE_BF16) &&
-                            node->src[1]->type == GGML_TYPE_F32) {
-                            cur += sizeof(ggml_fp16_t)*ne00*ne01*ne02;
-                            cur += sizeof(ggml_fp16_t)*ne10*ne11;
-                        } else if (node->src[0]->type == GGML_TYPE_F32 &&
-                                   node->src[1]->type == GGML_TYPE_F32) {
-                            cur += sizeof(float)*ne00*ne01*ne02;
-                            cur += sizeof(float)*ne10*ne11;
-                        } else {
-                            GGML_ABORT("fatal error");
-                        }
-                    } break;
-                case GGML_OP_CONV_2D:
-                    {
-                        cur = GGML_IM2COL_WORK_SIZE;
-                    } break;
-                case GGML_OP_CONV_TRANSPOSE_2D:
-                    {
-                        const int64_t ne00 = node->src[0]->ne[0]; // W
-                        const int64_t ne01 = node->src[0]->ne[1]; // H
-                        const int64_t ne02 = node->src[0]->ne[2]; // Channels Out
-                        const int64_t ne03 = node->src[0]->ne[3]; // Channels In
-
-                        const int64_t ne10 = node->src[1]->ne[0]; // W
-                        const int64_t ne11 = node->src[1]->ne[1]; // H
-                        const int64_t ne12 = node->src[1]->ne[2]; // Channels In
-
-                        cur += sizeof(ggml_fp16_t)*ne00*ne01*ne02*ne03;
-                        cur += sizeof(ggml_fp16_t)*ne10*ne11*ne12;
-                    } break;
-                case GGML_OP_FLASH_ATTN_EXT:
-                    {
-                        const int64_t ne10 = node->src[1]->ne[0]; // DK
-                        const int64_t ne20 = node->src[2]->ne[0]; // DV
-
-                        cur = sizeof(float)*(1*ne10 + 2*ne20)*n_tasks; // 1x head size K + 2x head size V (per thread)
-                    } break;
-                case GGML_OP_FLASH_ATTN_BACK:
-                    {
-                        const int64_t    D = node->src[0]->ne[0];
-                        const int64_t ne11 = ggml_up(node->src[1]->ne[1], GGML_SOFT_MAX_UNROLL);
-                        const int64_t mxDn = MAX(D, ne11) * 2; // *2 because of S and SM in ggml_compute_forward_flash_attn_back
-                        if (node->src[1]->type == GGML_TYPE_F32) {
-                            cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
-                        } else if (node->src[1]->type == GGML_TYPE_F16) {
-                            cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
-                        } else if (node->src[1]->type == GGML_TYPE_BF16) {
-                            cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
-                        }
-                    } break;
-
-                case GGML_OP_CROSS_ENTROPY_LOSS:
-                    {
-                        cur = ggml_type_size(node->type)*(n_tasks + node->src[0]->ne[0]*n_tasks);
-                    } break;
-                case GGML_OP_COUNT:
-                    {
-                        GGML_ABORT("fatal error");
-                    }
-                default:
-                    break;
-            }
+            cur = ggml_graph_node_work_size(node, n_threads);
         }
 
         work_size = MAX(work_size, cur);
@@ -2836,6 +3125,87 @@ struct ggml_cplan ggml_graph_plan(
     return cplan;
 }
 
+// nodes that do not write any data - no barrier is needed after them
+static bool ggml_graph_node_is_noop(const struct ggml_tensor * node) {
+    switch (node->op) {
+        case GGML_OP_NONE:
+        case GGML_OP_RESHAPE:
+        case GGML_OP_VIEW:
+        case GGML_OP_PERMUTE:
+        case GGML_OP_TRANSPOSE:
+            return true;
+        default:
+            return ggml_is_empty(node);
+    }
+}
+
+// whether computing node leaves the src1 conversion of a previous MUL_MAT intact
+// the ops use the work buffer from its start, the conversion is at its end
+static bool ggml_graph_node_keeps_src1_cache(struct ggml_tensor * node, const struct ggml_compute_src1_cache * cache, int n_threads) {
+    size_t cur = 0;
+
+    if (!ggml_cpu_extra_work_size(n_threads, node, &cur)) {
+        if (node->op == GGML_OP_MUL_MAT) {
+            // checked by ggml_compute_forward_mul_mat
+            return true;
+        }
+        cur = ggml_graph_node_work_size(node, n_threads);
+    }
+
+    return cur == 0 || cur + CACHE_LINE_SIZE*n_threads <= cache->offs;
+}
+
+// per-op performance counters, updated by the first thread of the pool
+static struct ggml_backend_cpu_perf_stats ggml_cpu_perf_stats;
+static atomic_bool                        ggml_cpu_perf_enabled = false;
+
+void ggml_backend_cpu_set_perf_stats(bool enable) {
+    memset(&ggml_cpu_perf_stats, 0, sizeof(ggml_cpu_perf_stats));
+    atomic_store(&ggml_cpu_perf_enabled, enable);
+}
+
+void ggml_backend_cpu_get_perf_stats(struct ggml_backend_cpu_perf_stats * stats) {
+    *stats = ggml_cpu_perf_stats;
+}
+
+// estimated number of floating point operations of a node, one per element of the result for the element-wise ops
+static uint64_t ggml_cpu_node_flops(const struct ggml_tensor * node) {
+    const struct ggml_tensor * src0 = node->src[0];
+    const struct ggml_tensor * src1 = node->src[1];
+
+    switch (node->op) {
+        case GGML_OP_MUL_MAT:
+        case GGML_OP_MUL_MAT_ID:
+            return 2ull * src0->ne[0] * ggml_nelements(node);
+        case GGML_OP_OUT_PROD:
+            return 2ull * src0->ne[1] * ggml_nelements(node);
+        case GGML_OP_FLASH_ATTN_EXT:
+            {
+                const struct ggml_tensor * v = node->src[2];
+                // Q*K^T and softmax(Q*K^T)*V
+                return 2ull * src0->ne[1] * src0->ne[2] * src0->ne[3] * src1->ne[1] * (src0->ne[0] + v->ne[0]);
+            }
+        default:
+            return ggml_nelements(node);
+    }
+}
+
+// bytes read and written by a node
+static uint64_t ggml_cpu_node_bytes(const struct ggml_tensor * node) {
+    uint64_t bytes = ggml_nbytes(node);
+
+    if (node->op == GGML_OP_GET_ROWS) {
+        // only the gathered rows are read
+        return 2*bytes + ggml_nbytes(node->src[1]);
+    }
+
+    for (int i = 0; i < GGML_MAX_SRC && node->src[i]; ++i) {
+        bytes += ggml_nbytes(node->src[i]);
+    }
+
+    return bytes;
+}
+
 static thread_ret_t ggml_graph_compute_thread(void * data) {
     struct ggml_compute_state * state = (struct ggml_compute_state *) data;
     struct ggml_threadpool    * tp    = state->threadpool;
@@ -2851,12 +3221,55 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
         /*.wsize     =*/ cplan->work_size,
         /*.wdata     =*/ cplan->work_data,
         /*.threadpool=*/ tp,
+        /*.src1_cache=*/ NULL,
     };
 
+    struct ggml_compute_src1_cache src1_cache = { NULL, GGML_TYPE_COUNT, 0 };
+    params.src1_cache = &src1_cache;
+
+    // record the nodes computed by this thread, see ggml_backend_trace_enabled()
+    const bool trace = ggml_backend_trace_enabled();
+    char trace_track[32];
+    if (trace) {
+        snprintf(trace_track, sizeof(trace_track), "CPU thread %d", state->ith);
+    }
+
+    const bool perf = state->ith == 0 && atomic_load(&ggml_cpu_perf_enabled);
+
     for (int node_n = 0; node_n < cgraph->n_nodes && atomic_load_explicit(&tp->abort, memory_order_relaxed) != node_n; node_n++) {
         struct ggml_tensor * node = cgraph->nodes[node_n];
 
-        ggml_compute_forward(&params, node);
+        const int64_t t_node_start = trace || perf ? ggml_time_us() : 0;
+
+        const struct ggml_cpu_fused_op * fused = ggml_cpu_fusion ? ggml_cpu_find_fused_op(cgraph, node_n) : NULL;
+
+        if (fused) {
+            for (int i = 0; i < fused->n_nodes && src1_cache.src1; ++i) {
+                if (!ggml_graph_node_keeps_src1_cache(cgraph->nodes[node_n + i], &src1_cache, params.nth)) {
+                    src1_cache.src1 = NULL;
+                }
+            }
+
+            fused->compute(&params, cgraph, node_n);
+
+            node_n += fused->n_nodes - 1;
+            node = cgraph->nodes[node_n];
+        } else {
+            if (src1_cache.src1 && !ggml_graph_node_keeps_src1_cache(node, &src1_cache, params.nth)) {
+                src1_cache.src1 = NULL;
+            }
+
+            ggml_compute_forward(&params, node);
+        }
+
+        if (trace && !ggml_graph_node_is_noop(node)) {
+            ggml_backend_trace_event(trace_track, node->name[0] ? node->name : ggml_op_desc(node), ggml_op_desc(node), t_node_start, ggml_time_us());
+        }
+
+        if (node_n + 1 < cgraph->n_nodes && ggml_graph_node_is_noop(node)) {
+            // nothing was written - skip the barrier, and the abort check that relies on it
+            continue;
+        }
 
         if (state->ith == 0 && cplan->abort_callback &&
                 cplan->abort_callback(cplan->abort_callback_data)) {
@@ -2867,6 +3280,19 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
         if (node_n + 1 < cgraph->n_nodes) {
             ggml_barrier(state->threadpool);
         }
+
+        if (perf) {
+            // the fused nodes are counted as the first one
+            const int node_first = fused ? node_n - fused->n_nodes + 1 : node_n;
+            const enum ggml_op op = cgraph->nodes[node_first]->op;
+
+            ggml_cpu_perf_stats.n_nodes[op] += 1;
+            ggml_cpu_perf_stats.t_us   [op] += ggml_time_us() - t_node_start;
+            for (int i = node_first; i <= node_n; ++i) {
+                ggml_cpu_perf_stats.flops[op] += ggml_cpu_node_flops(cgraph->nodes[i]);
+                ggml_cpu_perf_stats.bytes[op] += ggml_cpu_node_bytes(cgraph->nodes[i]);
+            }
+        }
     }
 
     ggml_barrier(state->threadpool);
@@ -3043,6 +3469,7 @@ static struct ggml_threadpool * ggml_threadpool_new_impl(
         threadpool->n_threads_cur    = tpp->n_threads;
         threadpool->poll             = tpp->poll;
         threadpool->prio             = tpp->prio;
+        threadpool->shared           = false;
         threadpool->ec               = GGML_STATUS_SUCCESS;
     }
 
@@ -3092,6 +3519,72 @@ struct ggml_threadpool * ggml_threadpool_new(struct ggml_threadpool_params * tpp
     return ggml_threadpool_new_impl(tpp, NULL, NULL);
 }
 
+struct ggml_threadpool * ggml_threadpool_get_shared(struct ggml_threadpool_params * tpp) {
+    ggml_cpu_init();
+
+    struct ggml_threadpool * threadpool = NULL;
+
+    ggml_critical_section_start();
+
+    for (int i = 0; i < g_shared_threadpools.n; i++) {
+        if (ggml_threadpool_params_match(&g_shared_threadpools.params[i], tpp)) {
+            threadpool = g_shared_threadpools.pools[i];
+            break;
+        }
+    }
+
+    if (threadpool == NULL && g_shared_threadpools.n < GGML_MAX_SHARED_THREADPOOLS) {
+        // created paused, the first graph resumes it
+        struct ggml_threadpool_params params = *tpp;
+        params.paused = true;
+
+        threadpool = ggml_threadpool_new_impl(&params, NULL, NULL);
+        threadpool->shared = true;
+
+        g_shared_threadpools.pools [g_shared_threadpools.n] = threadpool;
+        g_shared_threadpools.params[g_shared_threadpools.n] = *tpp;
+        g_shared_threadpools.n++;
+    }
+
+    ggml_critical_section_end();
+
+    return threadpool;
+}
+
+// the shared threadpool with the highest priority, then the most threads
+static struct ggml_threadpool * ggml_threadpool_get_shared_default(void) {
+    struct ggml_threadpool * threadpool = NULL;
+
+    ggml_critical_section_start();
+
+    for (int i = 0; i < g_shared_threadpools.n; i++) {
+        struct ggml_threadpool * cur = g_shared_threadpools.pools[i];
+        if (threadpool == NULL || cur->prio > threadpool->prio ||
+           (cur->prio == threadpool->prio && cur->n_threads_max > threadpool->n_threads_max)) {
+            threadpool = cur;
+        }
+    }
+
+    ggml_critical_section_end();
+
+    return threadpool;
+}
+
+void ggml_threadpool_free_shared(void) {
+    ggml_critical_section_start();
+    ggml_mutex_lock(&g_shared_threadpools.mutex);
+
+    for (int i = 0; i < g_shared_threadpools.n; i++) {
+        g_shared_threadpools.pools[i]->shared = false;
+        ggml_threadpool_free(g_shared_threadpools.pools[i]);
+    }
+    g_shared_threadpools.n    = 0;
+    g_shared_threadpools.last = NULL;
+
+    ggml_mutex_unlock(&g_shared_threadpools.mutex);
+    ggml_critical_section_end();
+}
+
 enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan) {
     ggml_cpu_init();
 
@@ -3104,6 +3597,10 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
 
     bool disposable_threadpool = false;
 
+    if (threadpool == NULL) {
+        threadpool = ggml_threadpool_get_shared_default();
+    }
+
     if (threadpool == NULL) {
         //GGML_PRINT_DEBUG("Threadpool is not specified. Will create a disposable threadpool : n_threads %d\n", n_threads);
         disposable_threadpool = true;
@@ -3111,6 +3608,17 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
         struct ggml_threadpool_params ttp = ggml_threadpool_params_default(n_threads);
         threadpool = ggml_threadpool_new_impl(&ttp, cgraph, cplan);
     } else {
+        if (threadpool->shared) {
+            ggml_mutex_lock(&g_shared_threadpools.mutex);
+            // hand-off: the threadpool of the previous graph sleeps instead of competing for the cores
+            if (g_shared_threadpools.last != threadpool) {
+                if (g_shared_threadpools.last != NULL) {
+                    ggml_threadpool_pause(g_shared_threadpools.last);
+                }
+                g_shared_threadpools.last = threadpool;
+            }
+        }
+
         // Reset some of the parameters that need resetting
         // No worker threads should be accessing the parameters below at this stage
         threadpool->cgraph           = cgraph;
@@ -3120,6 +3628,11 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
         threadpool->ec               = GGML_STATUS_SUCCESS;
     }
 
+    if (n_threads > threadpool->n_threads_max) {
+        GGML_LOG_WARN("cplan requested more threads (%d) than available (%d)\n", n_threads, threadpool->n_threads_max);
+        n_threads = threadpool->n_threads_max;
+    }
+
 #ifdef GGML_USE_OPENMP
     if (n_threads > 1) {
         #pragma omp parallel num_threads(n_threads)
@@ -3138,11 +3651,6 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
         ggml_graph_compute_thread(&threadpool->workers[0]);
     }
 #else
-    if (n_threads > threadpool->n_threads_max) {
-        GGML_LOG_WARN("cplan requested more threads (%d) than available (%d)\n", n_threads, threadpool->n_threads_max);
-        n_threads = threadpool->n_threads_max;
-    }
-
     // Kick all threads to start the new graph
     ggml_graph_compute_kickoff(threadpool, n_threads);
 
@@ -3157,6 +3665,8 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
 
     if (disposable_threadpool) {
         ggml_threadpool_free(threadpool);
+    } else if (threadpool->shared) {
+        ggml_mutex_unlock(&g_shared_threadpools.mutex);
     }
 
     return ret;
@@ -3509,6 +4019,109 @@ int ggml_cpu_has_sme(void) {
 #endif
 }
 
+// cores of different types (Intel hybrid) or of different capacities (ARM big.LITTLE, Apple)
+static bool ggml_cpu_detect_hybrid(void) {
+#if defined(__linux__)
+    // Intel hybrid: the E-cores are in a separate PMU
+    FILE * f = fopen("/sys/devices/cpu_atom/cpus", "r");
+    if (f) {
+        char buf[256] = {0};
+        const bool has_atom = fgets(buf, sizeof(buf), f) != NULL && buf[0] != '\n' && buf[0] != '\0';
+        fclose(f);
+        if (has_atom) {
+            return true;
+        }
+    }
+
+    // ARM: a relative capacity per core
+    long capacity_first = -1;
+    for (int cpu = 0; cpu < GGML_MAX_N_THREADS; ++cpu) {
+        char path[128];
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cpu_capacity", cpu);
+        f = fopen(path, "r");
+        if (!f) {
+            break;
+        }
+        long capacity = -1;
+        const int n = fscanf(f, "%ld", &capacity);
+        fclose(f);
+        if (n != 1) {
+            break;
+        }
+        if (capacity_first < 0) {
+            capacity_first = capacity;
+        } else if (capacity != capacity_first) {
+            return true;
+        }
+    }
+    return false;
+#elif defined(__APPLE__)
+    int    nperflevels = 0;
+    size_t len         = sizeof(nperflevels);
+    return sysctlbyname("hw.nperflevels", &nperflevels, &len, NULL, 0) == 0 && nperflevels > 1;
+#else
+    return false;
+#endif
+}
+
+void ggml_backend_cpu_get_profile(struct ggml_backend_cpu_profile * profile) {
+    *profile = ggml_cpu_profile;
+}
+
+void ggml_backend_cpu_set_profile(const struct ggml_backend_cpu_profile * profile) {
+    GGML_ASSERT(profile->mul_mat_chunk_size > 0 && profile->mul_mat_chunk_size_vec > 0);
+    ggml_cpu_profile = *profile;
+}
+
+bool ggml_backend_cpu_load_profile(const char * fname, struct ggml_backend_cpu_profile * profile) {
+    FILE * f = ggml_fopen(fname, "r");
+    if (!f) {
+        return false;
+    }
+
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        char key[64];
+        int  value;
+        if (line[0] == '#' || sscanf(line, " %63[a-z_] = %d", key, &value) != 2) {
+            continue;
+        }
+        if (strcmp(key, "n_threads") == 0) {
+            profile->n_threads = value;
+        } else if (strcmp(key, "n_threads_batch") == 0) {
+            profile->n_threads_batch = value;
+        } else if (strcmp(key, "mul_mat_chunk_size") == 0 && value > 0) {
+            profile->mul_mat_chunk_size = value;
+        } else if (strcmp(key, "mul_mat_chunk_size_vec") == 0 && value > 0) {
+            profile->mul_mat_chunk_size_vec = value;
+        } else if (strcmp(key, "mul_mat_chunk_numa") == 0) {
+            profile->mul_mat_chunk_numa = value != 0;
+        } else {
+            GGML_LOG_WARN("%s: %s: unknown key '%s'\n", __func__, fname, key);
+        }
+    }
+
+    fclose(f);
+    return true;
+}
+
+bool ggml_backend_cpu_save_profile(const char * fname, const struct ggml_backend_cpu_profile * profile) {
+    FILE * f = ggml_fopen(fname, "w");
+    if (!f) {
+        return false;
+    }
+
+    fprintf(f, "# ggml CPU backend profile\n");
+    fprintf(f, "n_threads = %d\n",              profile->n_threads);
+    fprintf(f, "n_threads_batch = %d\n",        profile->n_threads_batch);
+    fprintf(f, "mul_mat_chunk_size = %d\n",     profile->mul_mat_chunk_size);
+    fprintf(f, "mul_mat_chunk_size_vec = %d\n", profile->mul_mat_chunk_size_vec);
+    fprintf(f, "mul_mat_chunk_numa = %d\n",     profile->mul_mat_chunk_numa ? 1 : 0);
+
+    fclose(f);
+    return true;
+}
+
 void ggml_cpu_init(void) {
     // needed to initialize ggml_time
     {
@@ -3559,6 +4172,22 @@ void ggml_cpu_init(void) {
         ggml_init_arm_arch_features();
 #endif
 
+        ggml_cpu_fusion = getenv("GGML_CPU_DISABLE_FUSION") == NULL;
+
+        ggml_mutex_init(&g_shared_threadpools.mutex);
+
+        {
+            const char * hybrid = getenv("GGML_CPU_HYBRID");
+            ggml_cpu_hybrid = hybrid ? atoi(hybrid) != 0 : ggml_cpu_detect_hybrid();
+        }
+
+        {
+            const char * fname = getenv("GGML_CPU_PROFILE");
+            if (fname && !ggml_backend_cpu_load_profile(fname, &ggml_cpu_profile)) {
+                GGML_LOG_WARN("%s: failed to open CPU profile '%s'\n", __func__, fname);
+            }
+        }
+
         is_first_call = false;
     }
 
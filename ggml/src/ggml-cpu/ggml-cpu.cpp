@@ -2,6 +2,7 @@
 #include "ggml-backend-impl.h"
 #include "ggml-cpu.h"
 #include "repack.h"
+#include "numa.h"
 #include "traits.h"
 #include "ggml-impl.h"
 #include "amx/amx.h"
@@ -39,6 +40,11 @@ std::vector<ggml_backend_buffer_type_t> & ggml_backend_cpu_get_extra_buffer_type
     static std::vector<ggml_backend_buffer_type_t> bufts = []() {
         std::vector<ggml_backend_buffer_type_t> bufts;
 
+        // first, so that it takes precedence over the repacking when enabled with GGML_NUMA_STRATEGY_MIRROR
+        if (ggml_backend_cpu_numa_buffer_type()) {
+            bufts.push_back(ggml_backend_cpu_numa_buffer_type());
+        }
+
 #if defined(__AMX_INT8__) && defined(__AVX512VNNI__)
         if (ggml_backend_amx_buffer_type()) {
             bufts.push_back(ggml_backend_amx_buffer_type());
@@ -113,8 +119,26 @@ static void ggml_backend_cpu_free(ggml_backend_t backend) {
 struct ggml_backend_plan_cpu {
     struct ggml_cplan cplan;
     struct ggml_cgraph cgraph;
+
+    // thread settings of the backend when the plan was computed
+    int               n_threads;
+    ggml_threadpool_t threadpool;
 };
 
+// the plans and the graphs computed directly share the work buffer of the backend, since they cannot run at the same time
+static bool ggml_backend_cpu_reserve_work(struct ggml_backend_cpu_context * cpu_ctx, size_t work_size) {
+    if (cpu_ctx->work_size < work_size) {
+        delete[] cpu_ctx->work_data;
+        cpu_ctx->work_data = new uint8_t[work_size];
+        if (cpu_ctx->work_data == NULL) {
+            cpu_ctx->work_size = 0;
+            return false;
+        }
+        cpu_ctx->work_size = work_size;
+    }
+    return true;
+}
+
 static ggml_backend_graph_plan_t ggml_backend_cpu_graph_plan_create(ggml_backend_t backend, const struct ggml_cgraph * cgraph) {
     struct ggml_backend_cpu_context * cpu_ctx = (struct ggml_backend_cpu_context *)backend->context;
 
@@ -122,13 +146,12 @@ static ggml_backend_graph_plan_t ggml_backend_cpu_graph_plan_create(ggml_backend
 
     cpu_plan->cplan = ggml_graph_plan(cgraph, cpu_ctx->n_threads, cpu_ctx->threadpool);
     cpu_plan->cgraph = *cgraph; // FIXME: deep copy
+    cpu_plan->n_threads  = cpu_ctx->n_threads;
+    cpu_plan->threadpool = cpu_ctx->threadpool;
 
-    if (cpu_plan->cplan.work_size > 0) {
-        cpu_plan->cplan.work_data = new uint8_t[cpu_plan->cplan.work_size];
-        if (cpu_plan->cplan.work_data == NULL) {
-            delete cpu_plan;
-            return NULL;
-        }
+    if (!ggml_backend_cpu_reserve_work(cpu_ctx, cpu_plan->cplan.work_size)) {
+        delete cpu_plan;
+        return NULL;
     }
 
     cpu_plan->cplan.abort_callback      = cpu_ctx->abort_callback;
@@ -140,18 +163,32 @@ static ggml_backend_graph_plan_t ggml_backend_cpu_graph_plan_create(ggml_backend
 static void ggml_backend_cpu_graph_plan_free(ggml_backend_t backend, ggml_backend_graph_plan_t plan) {
     struct ggml_backend_plan_cpu * cpu_plan = (struct ggml_backend_plan_cpu *)plan;
 
-    delete[] cpu_plan->cplan.work_data;
     delete cpu_plan;
 
     GGML_UNUSED(backend);
 }
 
 static enum ggml_status ggml_backend_cpu_graph_plan_compute(ggml_backend_t backend, ggml_backend_graph_plan_t plan) {
+    struct ggml_backend_cpu_context * cpu_ctx = (struct ggml_backend_cpu_context *)backend->context;
     struct ggml_backend_plan_cpu * cpu_plan = (struct ggml_backend_plan_cpu *)plan;
 
-    return ggml_graph_compute(&cpu_plan->cgraph, &cpu_plan->cplan);
+    // plans can be reused by the scheduler, so the thread settings may have changed since the plan was created
+    if (cpu_plan->n_threads != cpu_ctx->n_threads || cpu_plan->threadpool != cpu_ctx->threadpool) {
+        cpu_plan->cplan      = ggml_graph_plan(&cpu_plan->cgraph, cpu_ctx->n_threads, cpu_ctx->threadpool);
+        cpu_plan->n_threads  = cpu_ctx->n_threads;
+        cpu_plan->threadpool = cpu_ctx->threadpool;
+    }
 
-    GGML_UNUSED(backend);
+    // the buffer may have been reallocated by another plan or graph since the plan was created
+    if (!ggml_backend_cpu_reserve_work(cpu_ctx, cpu_plan->cplan.work_size)) {
+        return GGML_STATUS_ALLOC_FAILED;
+    }
+    cpu_plan->cplan.work_data = cpu_ctx->work_data;
+
+    cpu_plan->cplan.abort_callback      = cpu_ctx->abort_callback;
+    cpu_plan->cplan.abort_callback_data = cpu_ctx->abort_callback_data;
+
+    return ggml_graph_compute(&cpu_plan->cgraph, &cpu_plan->cplan);
 }
 
 static enum ggml_status ggml_backend_cpu_graph_compute(ggml_backend_t backend, struct ggml_cgraph * cgraph) {
@@ -159,14 +196,8 @@ static enum ggml_status ggml_backend_cpu_graph_compute(ggml_backend_t backend, s
 
     struct ggml_cplan cplan = ggml_graph_plan(cgraph, cpu_ctx->n_threads, cpu_ctx->threadpool);
 
-    if (cpu_ctx->work_size < cplan.work_size) {
-        delete[] cpu_ctx->work_data;
-        cpu_ctx->work_data = new uint8_t[cplan.work_size];
-        if (cpu_ctx->work_data == NULL) {
-            cpu_ctx->work_size = 0;
-            return GGML_STATUS_ALLOC_FAILED;
-        }
-        cpu_ctx->work_size = cplan.work_size;
+    if (!ggml_backend_cpu_reserve_work(cpu_ctx, cplan.work_size)) {
+        return GGML_STATUS_ALLOC_FAILED;
     }
     cplan.work_data = (uint8_t *)cpu_ctx->work_data;
 
@@ -439,7 +470,7 @@ static bool ggml_backend_cpu_device_supports_op(ggml_backend_dev_t dev, const st
         case GGML_OP_GET_ROWS_BACK:
             return src0->type == GGML_TYPE_F32 || src0->type == GGML_TYPE_F16;
         case GGML_OP_OUT_PROD:
-            return (src0->type == GGML_TYPE_F32 || (ggml_is_quantized(src0->type) && src0->ne[2] == src1->ne[2] && src0->ne[3] == src1->ne[3])) &&
+            return (src0->type == GGML_TYPE_F32 || ((ggml_is_quantized(src0->type) || src0->type == GGML_TYPE_F16 || src0->type == GGML_TYPE_BF16) && src0->ne[2] == src1->ne[2] && src0->ne[3] == src1->ne[3])) &&
                 src1->type == GGML_TYPE_F32 && op->type == GGML_TYPE_F32;
         default:
             return true;
@@ -632,6 +663,36 @@ static void * ggml_backend_cpu_get_proc_address(ggml_backend_reg_t reg, const ch
     if (strcmp(name, "ggml_backend_cpu_is_numa") == 0) {
         return (void *)ggml_is_numa;
     }
+    if (strcmp(name, "ggml_backend_cpu_mem_buffer_type") == 0) {
+        return (void *)ggml_backend_cpu_mem_buffer_type;
+    }
+    if (strcmp(name, "ggml_backend_cpu_set_repack_mem") == 0) {
+        return (void *)ggml_backend_cpu_set_repack_mem;
+    }
+    if (strcmp(name, "ggml_backend_cpu_node_buffer_type") == 0) {
+        return (void *)ggml_backend_cpu_node_buffer_type;
+    }
+    if (strcmp(name, "ggml_backend_cpu_set_perf_stats") == 0) {
+        return (void *)ggml_backend_cpu_set_perf_stats;
+    }
+    if (strcmp(name, "ggml_backend_cpu_get_perf_stats") == 0) {
+        return (void *)ggml_backend_cpu_get_perf_stats;
+    }
+    if (strcmp(name, "ggml_threadpool_get_shared") == 0) {
+        return (void *)ggml_threadpool_get_shared;
+    }
+    if (strcmp(name, "ggml_threadpool_free_shared") == 0) {
+        return (void *)ggml_threadpool_free_shared;
+    }
+    if (strcmp(name, "ggml_backend_cpu_get_profile") == 0) {
+        return (void *)ggml_backend_cpu_get_profile;
+    }
+    if (strcmp(name, "ggml_backend_cpu_set_profile") == 0) {
+        return (void *)ggml_backend_cpu_set_profile;
+    }
+    if (strcmp(name, "ggml_backend_cpu_save_profile") == 0) {
+        return (void *)ggml_backend_cpu_save_profile;
+    }
 
     // threadpool - TODO:  move to ggml-base
     if (strcmp(name, "ggml_threadpool_new") == 0) {
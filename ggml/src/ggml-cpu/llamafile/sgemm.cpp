@@ -1075,6 +1075,335 @@ class tinyBLAS_Q0_AVX {
 };
 #endif // __AVX__
 
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// K-QUANT SUPER-BLOCKS
+//
+// The K-quants pack their 6-bit sub-block scales and the high bits of their quants
+// in ways that are expensive to decode. The dot product kernels decode them again
+// for every column of B, which is why prompt processing is slower than with Q4_0.
+// This kernel decodes a few rows of A once into 8-bit quants with 16-bit scales,
+// and then multiplies them with all the columns of B quantized to Q8_K.
+
+#if defined(__AVX2__) || defined(__ARM_FEATURE_DOTPROD)
+struct block_kq {
+    float   d;               // scale of the quants
+    float   m;               // scale of the mins
+    int16_t scales[QK_K/2];  // scales of the 16 sub-blocks of 16, each repeated 8 times
+    int16_t mins[QK_K/16];   // mins of the 16 sub-blocks
+    int8_t  qs[QK_K];        // quants, unsigned unless the type is signed
+};
+
+template <typename TA>
+class tinyBLAS_K {
+  public:
+    tinyBLAS_K(int64_t k,
+               const TA *A, int64_t lda,
+               const block_q8_K *B, int64_t ldb,
+               float *C, int64_t ldc,
+               int ith, int nth)
+        : A(A), B(B), C(C), k(k), lda(lda), ldb(ldb), ldc(ldc), ith(ith), nth(nth) {
+    }
+
+    void matmul(int64_t m, int64_t n) {
+        // the rows of A are divided between the threads, each thread decodes its rows
+        // KC super-blocks at a time and multiplies them with all the columns
+        int64_t ytiles = (m + BM - 1) / BM;
+        int64_t duty = (ytiles + nth - 1) / nth;
+        int64_t start = duty * ith;
+        int64_t end = start + duty;
+        if (end > ytiles)
+            end = ytiles;
+        for (int64_t job = start; job < end; ++job) {
+            int64_t ii = job * BM;
+            switch (MIN(m - ii, BM)) {
+            case 4: gemm<4>(ii, n); break;
+            case 3: gemm<3>(ii, n); break;
+            case 2: gemm<2>(ii, n); break;
+            case 1: gemm<1>(ii, n); break;
+            }
+        }
+    }
+
+  private:
+    static constexpr int BM = 4;
+    static constexpr int BN = VECTOR_REGISTERS == 32 ? 4 : 2;
+    static constexpr int64_t KC = 8;
+
+    static constexpr bool is_signed = std::is_same<TA, block_iq4_xs>::value;
+    static constexpr bool has_mins  = !is_signed;
+
+    template <int RM>
+    NOINLINE void gemm(int64_t ii, int64_t n) {
+        block_kq Au[RM][KC];
+        for (int64_t l0 = 0; l0 < k; l0 += KC) {
+            const int64_t kc = MIN(k - l0, KC);
+            for (int64_t i = 0; i < RM; ++i)
+                for (int64_t l = 0; l < kc; ++l)
+                    unpack(A + lda * (ii + i) + l0 + l, &Au[i][l]);
+            int64_t jj = 0;
+            for (; jj + BN <= n; jj += BN)
+                gemm<RM, BN>(Au, kc, ii, jj, l0);
+            switch (n - jj) {
+            case 3: gemm<RM, 3>(Au, kc, ii, jj, l0); break;
+            case 2: gemm<RM, 2>(Au, kc, ii, jj, l0); break;
+            case 1: gemm<RM, 1>(Au, kc, ii, jj, l0); break;
+            }
+        }
+    }
+
+    // the quants of a chunk of the RM rows and RN columns are loaded once for the RM x RN dot products,
+    // which are accumulated in 32-bit integers over a super-block
+    template <int RM, int RN>
+    inline void gemm(const block_kq (*Au)[KC], int64_t kc, int64_t ii, int64_t jj, int64_t l0) {
+#if defined(__AVX512BW__)
+        __m512 Cv[RN][RM] = {};
+        __m256 Cm[RN][RM] = {};
+        for (int64_t l = 0; l < kc; ++l) {
+            const block_q8_K * b[RN];
+            for (int64_t j = 0; j < RN; ++j)
+                b[j] = B + ldb * (jj + j) + l0 + l;
+            __m512i sumi[RN][RM] = {};
+            for (int c = 0; c < QK_K/64; ++c) {
+                __m512i q[RM];
+                __mmask64 neg[RM];
+                for (int64_t i = 0; i < RM; ++i) {
+                    q[i] = _mm512_loadu_si512((const __m512i *)(Au[i][l].qs + 64*c));
+                    if constexpr (is_signed) {
+                        neg[i] = _mm512_movepi8_mask(q[i]);
+                        q[i] = _mm512_abs_epi8(q[i]);
+                    }
+                }
+                for (int64_t j = 0; j < RN; ++j) {
+                    const __m512i y = _mm512_loadu_si512((const __m512i *)(b[j]->qs + 64*c));
+                    for (int64_t i = 0; i < RM; ++i) {
+                        const __m512i s = _mm512_loadu_si512((const __m512i *)(Au[i][l].scales + 32*c));
+                        __m512i p;
+                        if constexpr (is_signed) {
+                            p = _mm512_maddubs_epi16(q[i], _mm512_mask_sub_epi8(y, neg[i], _mm512_setzero_si512(), y));
+                        } else {
+                            p = _mm512_maddubs_epi16(q[i], y);
+                        }
+#if defined(__AVX512VNNI__)
+                        sumi[j][i] = _mm512_dpwssd_epi32(sumi[j][i], p, s);
+#else
+                        sumi[j][i] = _mm512_add_epi32(sumi[j][i], _mm512_madd_epi16(p, s));
+#endif
+                    }
+                }
+            }
+            for (int64_t j = 0; j < RN; ++j)
+                for (int64_t i = 0; i < RM; ++i) {
+                    const block_kq * a = &Au[i][l];
+                    Cv[j][i] = madd(_mm512_set1_ps(a->d * b[j]->d), _mm512_cvtepi32_ps(sumi[j][i]), Cv[j][i]);
+                    if constexpr (has_mins) {
+                        const __m256i mins = _mm256_madd_epi16(_mm256_loadu_si256((const __m256i *)b[j]->bsums),
+                                                               _mm256_loadu_si256((const __m256i *)a->mins));
+                        Cm[j][i] = madd(_mm256_set1_ps(a->m * b[j]->d), _mm256_cvtepi32_ps(mins), Cm[j][i]);
+                    }
+                }
+        }
+        for (int64_t j = 0; j < RN; ++j)
+            for (int64_t i = 0; i < RM; ++i)
+                store(ii + i, jj + j, l0, hsum(Cv[j][i]) - hsum(Cm[j][i]));
+#elif defined(__AVX2__)
+        __m256 Cv[RN][RM] = {};
+        for (int64_t l = 0; l < kc; ++l) {
+            const block_q8_K * b[RN];
+            for (int64_t j = 0; j < RN; ++j)
+                b[j] = B + ldb * (jj + j) + l0 + l;
+            __m256i sumi[RN][RM] = {};
+            for (int c = 0; c < QK_K/32; ++c) {
+                __m256i q[RM];
+                __m256i u[RM];
+                for (int64_t i = 0; i < RM; ++i) {
+                    q[i] = _mm256_loadu_si256((const __m256i *)(Au[i][l].qs + 32*c));
+                    u[i] = is_signed ? _mm256_sign_epi8(q[i], q[i]) : q[i];
+                }
+                for (int64_t j = 0; j < RN; ++j) {
+                    const __m256i y = _mm256_loadu_si256((const __m256i *)(b[j]->qs + 32*c));
+                    for (int64_t i = 0; i < RM; ++i) {
+                        const __m256i s = _mm256_loadu_si256((const __m256i *)(Au[i][l].scales + 16*c));
+                        const __m256i p = _mm256_maddubs_epi16(u[i], is_signed ? _mm256_sign_epi8(y, q[i]) : y);
+#if defined(__AVX512VNNI__) && defined(__AVX512VL__)
+                        sumi[j][i] = _mm256_dpwssd_epi32(sumi[j][i], p, s);
+#elif defined(__AVXVNNI__)
+                        sumi[j][i] = _mm256_dpwssd_avx_epi32(sumi[j][i], p, s);
+#else
+                        sumi[j][i] = _mm256_add_epi32(sumi[j][i], _mm256_madd_epi16(p, s));
+#endif
+                    }
+                }
+            }
+            for (int64_t j = 0; j < RN; ++j)
+                for (int64_t i = 0; i < RM; ++i) {
+                    const block_kq * a = &Au[i][l];
+                    Cv[j][i] = madd(_mm256_set1_ps(a->d * b[j]->d), _mm256_cvtepi32_ps(sumi[j][i]), Cv[j][i]);
+                    if constexpr (has_mins) {
+                        const __m256i mins = _mm256_madd_epi16(_mm256_loadu_si256((const __m256i *)b[j]->bsums),
+                                                               _mm256_loadu_si256((const __m256i *)a->mins));
+                        Cv[j][i] = madd(_mm256_set1_ps(-a->m * b[j]->d), _mm256_cvtepi32_ps(mins), Cv[j][i]);
+                    }
+                }
+        }
+        for (int64_t j = 0; j < RN; ++j)
+            for (int64_t i = 0; i < RM; ++i)
+                store(ii + i, jj + j, l0, hsum(Cv[j][i]));
+#else
+        float32x4_t Cv[RN][RM] = {};
+        for (int64_t l = 0; l < kc; ++l) {
+            const block_q8_K * b[RN];
+            for (int64_t j = 0; j < RN; ++j)
+                b[j] = B + ldb * (jj + j) + l0 + l;
+            int32x4_t sumi[RN][RM] = {};
+            for (int s = 0; s < QK_K/16; ++s) {
+                int8x16_t q[RM];
+                for (int64_t i = 0; i < RM; ++i)
+                    q[i] = vld1q_s8(Au[i][l].qs + 16*s);
+                for (int64_t j = 0; j < RN; ++j) {
+                    const int8x16_t y = vld1q_s8(b[j]->qs + 16*s);
+                    for (int64_t i = 0; i < RM; ++i)
+                        sumi[j][i] = vmlaq_n_s32(sumi[j][i], vdotq_s32(vdupq_n_s32(0), q[i], y), Au[i][l].scales[8*s]);
+                }
+            }
+            for (int64_t j = 0; j < RN; ++j)
+                for (int64_t i = 0; i < RM; ++i) {
+                    const block_kq * a = &Au[i][l];
+                    Cv[j][i] = vmlaq_n_f32(Cv[j][i], vcvtq_f32_s32(sumi[j][i]), a->d * b[j]->d);
+                    if constexpr (has_mins) {
+                        const int16x8_t bs0 = vld1q_s16(b[j]->bsums);
+                        const int16x8_t bs1 = vld1q_s16(b[j]->bsums + 8);
+                        const int16x8_t mn0 = vld1q_s16(a->mins);
+                        const int16x8_t mn1 = vld1q_s16(a->mins + 8);
+                        int32x4_t mins = vmull_s16(vget_low_s16(bs0), vget_low_s16(mn0));
+                        mins = vmlal_high_s16(mins, bs0, mn0);
+                        mins = vmlal_s16(mins, vget_low_s16(bs1), vget_low_s16(mn1));
+                        mins = vmlal_high_s16(mins, bs1, mn1);
+                        Cv[j][i] = vmlaq_n_f32(Cv[j][i], vcvtq_f32_s32(mins), -a->m * b[j]->d);
+                    }
+                }
+        }
+        for (int64_t j = 0; j < RN; ++j)
+            for (int64_t i = 0; i < RM; ++i)
+                store(ii + i, jj + j, l0, hsum(Cv[j][i]));
+#endif
+    }
+
+    // the first chunk of super-blocks stores the sums, the next ones add to them
+    inline void store(int64_t i, int64_t j, int64_t l0, float sum) {
+        float & c = C[ldc * j + i];
+        c = l0 == 0 ? sum : c + sum;
+    }
+
+    static inline void unpack_scale_min(int j, const uint8_t * q, int & d, int & m) {
+        if (j < 4) {
+            d = q[j] & 63;
+            m = q[j + 4] & 63;
+        } else {
+            d = (q[j + 4] & 0xF) | ((q[j - 4] >> 6) << 4);
+            m = (q[j + 4] >>  4) | ((q[j - 0] >> 6) << 4);
+        }
+    }
+
+    static inline void set_scales(block_kq * y, int s, int sc, int mn) {
+        for (int t = 0; t < 8; ++t)
+            y->scales[8*s + t] = sc;
+        y->mins[s] = mn;
+    }
+
+    static inline void unpack(const block_q4_K * x, block_kq * y) {
+        y->d = unhalf(x->d);
+        y->m = unhalf(x->dmin);
+        for (int j = 0; j < QK_K/64; ++j) {
+            int sc, mn;
+            unpack_scale_min(2*j + 0, x->scales, sc, mn);
+            set_scales(y, 4*j + 0, sc, mn);
+            set_scales(y, 4*j + 1, sc, mn);
+            unpack_scale_min(2*j + 1, x->scales, sc, mn);
+            set_scales(y, 4*j + 2, sc, mn);
+            set_scales(y, 4*j + 3, sc, mn);
+            for (int l = 0; l < 32; ++l) {
+                y->qs[64*j + l +  0] = x->qs[32*j + l] & 0xF;
+                y->qs[64*j + l + 32] = x->qs[32*j + l] >> 4;
+            }
+        }
+    }
+
+    static inline void unpack(const block_q5_K * x, block_kq * y) {
+        y->d = unhalf(x->d);
+        y->m = unhalf(x->dmin);
+        for (int j = 0; j < QK_K/64; ++j) {
+            int sc, mn;
+            unpack_scale_min(2*j + 0, x->scales, sc, mn);
+            set_scales(y, 4*j + 0, sc, mn);
+            set_scales(y, 4*j + 1, sc, mn);
+            unpack_scale_min(2*j + 1, x->scales, sc, mn);
+            set_scales(y, 4*j + 2, sc, mn);
+            set_scales(y, 4*j + 3, sc, mn);
+            for (int l = 0; l < 32; ++l) {
+                y->qs[64*j + l +  0] = (x->qs[32*j + l] & 0xF) | (((x->qh[l] >> (2*j + 0)) & 1) << 4);
+                y->qs[64*j + l + 32] = (x->qs[32*j + l] >>  4) | (((x->qh[l] >> (2*j + 1)) & 1) << 4);
+            }
+        }
+    }
+
+    static inline void unpack(const block_q6_K * x, block_kq * y) {
+        // the quants are stored as q + 32, the offset is subtracted with the mins
+        y->d = unhalf(x->d);
+        y->m = y->d;
+        for (int s = 0; s < QK_K/16; ++s)
+            set_scales(y, s, x->scales[s], 32*x->scales[s]);
+        for (int h = 0; h < QK_K/128; ++h) {
+            const uint8_t * ql = x->ql + 64*h;
+            const uint8_t * qh = x->qh + 32*h;
+            int8_t * q = y->qs + 128*h;
+            for (int l = 0; l < 32; ++l) {
+                q[l +  0] = (ql[l +  0] & 0xF) | (((qh[l] >> 0) & 3) << 4);
+                q[l + 32] = (ql[l + 32] & 0xF) | (((qh[l] >> 2) & 3) << 4);
+                q[l + 64] = (ql[l +  0] >>  4) | (((qh[l] >> 4) & 3) << 4);
+                q[l + 96] = (ql[l + 32] >>  4) | (((qh[l] >> 6) & 3) << 4);
+            }
+        }
+    }
+
+    static inline void unpack(const block_iq4_xs * x, block_kq * y) {
+        static const int8_t kvalues_iq4nl[16] = {
+            -127, -104, -83, -65,
+            -49,  -35,  -22, -10,
+              1,   13,   25,  38,
+             53,   69,   89, 113
+        };
+        y->d = unhalf(x->d);
+        y->m = 0.0f;
+        for (int j = 0; j < QK_K/32; ++j) {
+            const int ls = ((x->scales_l[j/2] >> 4*(j%2)) & 0xF) | (((x->scales_h >> 2*j) & 3) << 4);
+            set_scales(y, 2*j + 0, ls - 32, 0);
+            set_scales(y, 2*j + 1, ls - 32, 0);
+#if defined(__AVX2__)
+            const __m128i values = _mm_loadu_si128((const __m128i *)kvalues_iq4nl);
+            const __m128i q = _mm_loadu_si128((const __m128i *)(x->qs + 16*j));
+            _mm_storeu_si128((__m128i *)(y->qs + 32*j +  0), _mm_shuffle_epi8(values, _mm_and_si128(q, _mm_set1_epi8(0xF))));
+            _mm_storeu_si128((__m128i *)(y->qs + 32*j + 16), _mm_shuffle_epi8(values, _mm_and_si128(_mm_srli_epi16(q, 4), _mm_set1_epi8(0xF))));
+#else
+            const int8x16_t values = vld1q_s8(kvalues_iq4nl);
+            const uint8x16_t q = vld1q_u8(x->qs + 16*j);
+            vst1q_s8(y->qs + 32*j +  0, vqtbl1q_s8(values, vandq_u8(q, vdupq_n_u8(0xF))));
+            vst1q_s8(y->qs + 32*j + 16, vqtbl1q_s8(values, vshrq_n_u8(q, 4)));
+#endif
+        }
+    }
+
+    const TA *const A;
+    const block_q8_K *const B;
+    float *const C;
+    const int64_t k;
+    const int64_t lda;
+    const int64_t ldb;
+    const int64_t ldc;
+    const int ith;
+    const int nth;
+};
+#endif // __AVX2__ || __ARM_FEATURE_DOTPROD
+
 //PPC Implementation
 #if defined(__MMA__)
 
@@ -2823,6 +3152,59 @@ bool llamafile_sgemm(const struct ggml_compute_params * params, int64_t m, int64
 #endif
     }
 
+    case GGML_TYPE_Q4_K:
+    case GGML_TYPE_Q5_K:
+    case GGML_TYPE_Q6_K:
+    case GGML_TYPE_IQ4_XS: {
+        if (Btype != GGML_TYPE_Q8_K)
+            return false;
+        // decoding the rows of A is only repaid with a few columns of B
+        if (n < 4)
+            return false;
+#if defined(__AVX2__) || defined(__ARM_FEATURE_DOTPROD)
+        switch (Atype) {
+        case GGML_TYPE_Q4_K: {
+            tinyBLAS_K<block_q4_K> tb{
+                k, (const block_q4_K *)A, lda,
+                (const block_q8_K *)B, ldb,
+                (float *)C, ldc,
+                params->ith, params->nth};
+            tb.matmul(m, n);
+            return true;
+        }
+        case GGML_TYPE_Q5_K: {
+            tinyBLAS_K<block_q5_K> tb{
+                k, (const block_q5_K *)A, lda,
+                (const block_q8_K *)B, ldb,
+                (float *)C, ldc,
+                params->ith, params->nth};
+            tb.matmul(m, n);
+            return true;
+        }
+        case GGML_TYPE_Q6_K: {
+            tinyBLAS_K<block_q6_K> tb{
+                k, (const block_q6_K *)A, lda,
+                (const block_q8_K *)B, ldb,
+                (float *)C, ldc,
+                params->ith, params->nth};
+            tb.matmul(m, n);
+            return true;
+        }
+        default: {
+            tinyBLAS_K<block_iq4_xs> tb{
+                k, (const block_iq4_xs *)A, lda,
+                (const block_q8_K *)B, ldb,
+                (float *)C, ldc,
+                params->ith, params->nth};
+            tb.matmul(m, n);
+            return true;
+        }
+        }
+#else
+        return false;
+#endif
+    }
+
     default:
         return false;
     }
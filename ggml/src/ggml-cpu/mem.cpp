@@ -0,0 +1,273 @@
+#include "ggml-backend.h"
+#include "ggml-backend-impl.h"
+#include "ggml-cpu.h"
+#include "ggml-impl.h"
+#include "ggml-cpu-impl.h"
+
+#include "mem.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+
+#if defined(__gnu_linux__)
+#    include <sys/mman.h>
+#    include <sys/syscall.h>
+#    include <unistd.h>
+#endif
+
+// buffer type MEM
+//
+// the large buffers that all the compute threads read (KV cache, compute buffers, repacked weights)
+// are mapped with hugepages to reduce the TLB misses, and bound to the NUMA nodes of the threads
+// instead of the node of the first thread that touches them
+//
+// buffer type NODE
+//
+// the memory tiers of a host (HBM, DDR, CXL) are NUMA nodes, the tiers without cores are nodes without CPUs
+// a buffer type per node lets the tensors be placed in a tier with --override-tensor
+
+#define GGML_CPU_HUGEPAGE_SIZE (2*1024*1024)
+#define GGML_CPU_MEM_MAX_NODES 64
+
+static std::atomic<int> ggml_cpu_repack_mem_flags { 0 };
+
+#if defined(__gnu_linux__)
+// anonymous mapping aligned to align, which must be a multiple of the page size
+static void * ggml_cpu_mem_map_aligned(size_t size, size_t align) {
+    char * ptr = (char *) mmap(nullptr, size + align, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        return nullptr;
+    }
+
+    // trim the mapping to the aligned range
+    char * aligned = (char *) (((uintptr_t) ptr + align - 1) & ~(uintptr_t) (align - 1));
+    if (aligned > ptr) {
+        munmap(ptr, aligned - ptr);
+    }
+    if (aligned + size < ptr + size + align) {
+        munmap(aligned + size, ptr + size + align - (aligned + size));
+    }
+
+    return aligned;
+}
+#endif
+
+void * ggml_cpu_mem_alloc(size_t & size, int flags, int node) {
+#if defined(__gnu_linux__)
+    const bool huge = flags & (GGML_CPU_MEM_THP | GGML_CPU_MEM_HUGETLB);
+    const size_t page = huge ? GGML_CPU_HUGEPAGE_SIZE : (size_t) sysconf(_SC_PAGESIZE);
+
+    size = GGML_PAD(std::max<size_t>(size, TENSOR_ALIGNMENT), page);
+
+    void * ptr = nullptr;
+
+    if (flags & GGML_CPU_MEM_HUGETLB) {
+#if defined(MAP_HUGETLB) && defined(MAP_HUGE_SHIFT)
+        ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (21 << MAP_HUGE_SHIFT), -1, 0);
+        if (ptr == MAP_FAILED) {
+            static std::atomic<bool> warned { false };
+            if (!warned.exchange(true)) {
+                GGML_LOG_WARN("%s: no hugepages left for a buffer of %zu MiB (%s), using transparent hugepages - see /proc/sys/vm/nr_hugepages\n",
+                              __func__, size/(1024*1024), strerror(errno));
+            }
+            ptr = nullptr;
+        }
+#endif
+    }
+
+    if (ptr == nullptr) {
+        ptr = ggml_cpu_mem_map_aligned(size, page);
+        if (ptr == nullptr) {
+            return nullptr;
+        }
+#if defined(MADV_HUGEPAGE)
+        if (huge && madvise(ptr, size, MADV_HUGEPAGE) != 0) {
+            GGML_LOG_WARN("%s: madvise(MADV_HUGEPAGE) failed: %s\n", __func__, strerror(errno));
+        }
+#endif
+    }
+
+    if (node >= 0) {
+        // MPOL_PREFERRED: the pages go to the other nodes when the node is full, instead of failing
+        unsigned long nodemask = 1UL << node;
+        if (syscall(SYS_mbind, ptr, size, 1 /* MPOL_PREFERRED */, &nodemask, 8*sizeof(nodemask), 0) != 0) {
+            GGML_LOG_WARN("%s: mbind to node %d failed: %s\n", __func__, node, strerror(errno));
+        }
+    } else if (flags & GGML_CPU_MEM_NUMA) {
+        // bound before the first touch, so that no page is placed on another node
+        const uint32_t nodes = ggml_cpu_numa_thread_nodes();
+        if (nodes == 0) {
+            static std::atomic<bool> warned { false };
+            if (!warned.exchange(true)) {
+                GGML_LOG_WARN("%s: the compute threads are not bound to NUMA nodes, the buffers are not bound either\n", __func__);
+            }
+        } else {
+            // MPOL_BIND for a single node, MPOL_INTERLEAVE over the nodes otherwise, without depending on libnuma
+            const int mode = (nodes & (nodes - 1)) == 0 ? 2 /* MPOL_BIND */ : 3 /* MPOL_INTERLEAVE */;
+            unsigned long nodemask = nodes;
+            if (syscall(SYS_mbind, ptr, size, mode, &nodemask, 8*sizeof(nodemask), 0) != 0) {
+                GGML_LOG_WARN("%s: mbind failed: %s\n", __func__, strerror(errno));
+            }
+        }
+    }
+
+    return ptr;
+#else
+    GGML_UNUSED(flags);
+    GGML_UNUSED(node);
+    size = std::max<size_t>(size, TENSOR_ALIGNMENT);
+    return ggml_aligned_malloc(size);
+#endif
+}
+
+void ggml_cpu_mem_free(void * ptr, size_t size) {
+#if defined(__gnu_linux__)
+    munmap(ptr, size);
+#else
+    ggml_aligned_free(ptr, size);
+#endif
+}
+
+int ggml_cpu_repack_mem(void) {
+    return ggml_cpu_repack_mem_flags.load();
+}
+
+void ggml_backend_cpu_set_repack_mem(int flags) {
+    ggml_cpu_repack_mem_flags.store(flags);
+}
+
+static void ggml_backend_cpu_mem_buffer_free_buffer(ggml_backend_buffer_t buffer) {
+    ggml_cpu_mem_free(buffer->context, buffer->size);
+}
+
+ggml_backend_buffer_t ggml_cpu_mem_buffer_alloc(ggml_backend_buffer_type_t buft, size_t size, int flags, int node) {
+    void * ptr = ggml_cpu_mem_alloc(size, flags, node);
+    if (ptr == nullptr) {
+        GGML_LOG_ERROR("%s: failed to allocate buffer of size %zu\n", __func__, size);
+        return nullptr;
+    }
+
+    ggml_backend_buffer_t buffer = ggml_backend_cpu_buffer_from_ptr(ptr, size);
+    buffer->buft              = buft;
+    buffer->iface.free_buffer = ggml_backend_cpu_mem_buffer_free_buffer;
+
+    return buffer;
+}
+
+#define GGML_CPU_MEM_FLAGS_ALL (GGML_CPU_MEM_THP | GGML_CPU_MEM_HUGETLB | GGML_CPU_MEM_NUMA)
+
+static const char * ggml_backend_cpu_mem_buffer_type_get_name(ggml_backend_buffer_type_t buft) {
+    // indexed by the flags, GGML_CPU_MEM_HUGETLB takes precedence over GGML_CPU_MEM_THP
+    static const char * names[GGML_CPU_MEM_FLAGS_ALL + 1] = {
+        "CPU",           "CPU_THP",           "CPU_HUGETLB",           "CPU_HUGETLB",
+        "CPU_NUMA_BIND", "CPU_THP_NUMA_BIND", "CPU_HUGETLB_NUMA_BIND", "CPU_HUGETLB_NUMA_BIND",
+    };
+
+    return names[(intptr_t) buft->context];
+}
+
+static ggml_backend_buffer_t ggml_backend_cpu_mem_buffer_type_alloc_buffer(ggml_backend_buffer_type_t buft, size_t size) {
+    return ggml_cpu_mem_buffer_alloc(buft, size, (int) (intptr_t) buft->context);
+}
+
+static size_t ggml_backend_cpu_mem_buffer_type_get_alignment(ggml_backend_buffer_type_t buft) {
+    return TENSOR_ALIGNMENT;
+
+    GGML_UNUSED(buft);
+}
+
+static bool ggml_backend_cpu_mem_buffer_type_is_host(ggml_backend_buffer_type_t buft) {
+    return true;
+
+    GGML_UNUSED(buft);
+}
+
+ggml_backend_buffer_type_t ggml_backend_cpu_mem_buffer_type(int flags) {
+    flags &= GGML_CPU_MEM_FLAGS_ALL;
+    if (flags == 0) {
+        return ggml_backend_cpu_buffer_type();
+    }
+
+    static struct ggml_backend_buffer_type bufts[GGML_CPU_MEM_FLAGS_ALL + 1];
+    static std::once_flag once;
+    std::call_once(once, [] {
+        for (int i = 0; i <= GGML_CPU_MEM_FLAGS_ALL; ++i) {
+            bufts[i] = {
+                /* .iface    = */ {
+                                   /* .get_name         = */ ggml_backend_cpu_mem_buffer_type_get_name,
+                                   /* .alloc_buffer     = */ ggml_backend_cpu_mem_buffer_type_alloc_buffer,
+                                   /* .get_alignment    = */ ggml_backend_cpu_mem_buffer_type_get_alignment,
+                                   /* .get_max_size     = */ nullptr,  // defaults to SIZE_MAX
+                                   /* .get_alloc_size   = */ nullptr,  // defaults to ggml_nbytes
+                                   /* .is_host          = */ ggml_backend_cpu_mem_buffer_type_is_host,
+                                   },
+                /* .device  = */ ggml_backend_reg_dev_get(ggml_backend_cpu_reg(), 0),
+                /* .context = */ (void *) (intptr_t) i,
+            };
+        }
+    });
+
+    return &bufts[flags];
+}
+
+static const char * ggml_backend_cpu_node_buffer_type_get_name(ggml_backend_buffer_type_t buft) {
+    static const std::array<std::string, GGML_CPU_MEM_MAX_NODES> names = [] {
+        std::array<std::string, GGML_CPU_MEM_MAX_NODES> res;
+        for (int node = 0; node < GGML_CPU_MEM_MAX_NODES; ++node) {
+            res[node] = "CPU_NODE" + std::to_string(node);
+        }
+        return res;
+    }();
+
+    return names[(intptr_t) buft->context].c_str();
+}
+
+static ggml_backend_buffer_t ggml_backend_cpu_node_buffer_type_alloc_buffer(ggml_backend_buffer_type_t buft, size_t size) {
+    return ggml_cpu_mem_buffer_alloc(buft, size, 0, (int) (intptr_t) buft->context);
+}
+
+static bool ggml_backend_cpu_node_exists(int node) {
+#if defined(__gnu_linux__)
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d", node);
+    return access(path, F_OK) == 0;
+#else
+    GGML_UNUSED(node);
+    return false;
+#endif
+}
+
+ggml_backend_buffer_type_t ggml_backend_cpu_node_buffer_type(int node) {
+    static struct ggml_backend_buffer_type bufts[GGML_CPU_MEM_MAX_NODES];
+    static bool exists[GGML_CPU_MEM_MAX_NODES];
+    static std::once_flag once;
+    std::call_once(once, [] {
+        for (int i = 0; i < GGML_CPU_MEM_MAX_NODES; ++i) {
+            exists[i] = ggml_backend_cpu_node_exists(i);
+            bufts[i] = {
+                /* .iface    = */ {
+                                   /* .get_name         = */ ggml_backend_cpu_node_buffer_type_get_name,
+                                   /* .alloc_buffer     = */ ggml_backend_cpu_node_buffer_type_alloc_buffer,
+                                   /* .get_alignment    = */ ggml_backend_cpu_mem_buffer_type_get_alignment,
+                                   /* .get_max_size     = */ nullptr,  // defaults to SIZE_MAX
+                                   /* .get_alloc_size   = */ nullptr,  // defaults to ggml_nbytes
+                                   /* .is_host          = */ ggml_backend_cpu_mem_buffer_type_is_host,
+                                   },
+                /* .device  = */ ggml_backend_reg_dev_get(ggml_backend_cpu_reg(), 0),
+                /* .context = */ (void *) (intptr_t) i,
+            };
+        }
+    });
+
+    if (node < 0 || node >= GGML_CPU_MEM_MAX_NODES || !exists[node]) {
+        return nullptr;
+    }
+
+    return &bufts[node];
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "ggml-backend.h"
+#include "ggml.h"
+
+#include <cstddef>
+
+// GGML CPU internal header
+
+// memory placed according to ggml_cpu_mem_flags, nullptr on failure
+// the size is rounded up to a multiple of the page size and must be given the same to ggml_cpu_mem_free
+// with node >= 0, the memory is placed on that NUMA node instead of following GGML_CPU_MEM_NUMA
+void * ggml_cpu_mem_alloc(size_t & size, int flags, int node = -1);
+void   ggml_cpu_mem_free(void * ptr, size_t size);
+
+// placement of the repacked weights, set with ggml_backend_cpu_set_repack_mem()
+int ggml_cpu_repack_mem(void);
+
+// CPU buffer of memory allocated with ggml_cpu_mem_alloc
+ggml_backend_buffer_t ggml_cpu_mem_buffer_alloc(ggml_backend_buffer_type_t buft, size_t size, int flags, int node = -1);
@@ -0,0 +1,230 @@
+#include "ggml-backend.h"
+#include "ggml-backend-impl.h"
+#include "ggml-cpu.h"
+#include "ggml-impl.h"
+#include "ggml-cpu-impl.h"
+
+#include "numa.h"
+#include "traits.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <vector>
+
+#if defined(__gnu_linux__)
+#    include <sys/mman.h>
+#    include <sys/syscall.h>
+#    include <unistd.h>
+#endif
+
+// buffer type NUMA
+//
+// the buffer holds one replica of its data per NUMA node, with the same layout
+// the tensors point to the replica of node 0 and the matrix multiplications use the replica at the same offset
+// in the memory of the node their thread is bound to
+
+struct ggml_backend_cpu_numa_buffer_context {
+    std::vector<void *> replicas; // [n_nodes]
+    size_t size;
+
+    ~ggml_backend_cpu_numa_buffer_context() {
+        for (void * ptr : replicas) {
+#if defined(__gnu_linux__)
+            munmap(ptr, size);
+#else
+            ggml_aligned_free(ptr, size);
+#endif
+        }
+    }
+
+    void * get_replica(const void * data, int node) const {
+        return (char *) replicas[node] + ((const char *) data - (const char *) replicas[0]);
+    }
+};
+
+static void * ggml_backend_cpu_numa_alloc(size_t size, int node) {
+#if defined(__gnu_linux__)
+    void * ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        return nullptr;
+    }
+
+    // bind the pages to the memory of the node (MPOL_BIND), without depending on libnuma
+    unsigned long nodemask[1024/(8*sizeof(unsigned long))] = {};
+    nodemask[node/(8*sizeof(unsigned long))] |= 1UL << (node % (8*sizeof(unsigned long)));
+
+    if (syscall(SYS_mbind, ptr, size, 2 /* MPOL_BIND */, nodemask, 8*sizeof(nodemask), 0) != 0) {
+        GGML_LOG_WARN("%s: mbind to node %d failed: %s\n", __func__, node, strerror(errno));
+    }
+
+    return ptr;
+#else
+    GGML_UNUSED(node);
+    return ggml_aligned_malloc(size);
+#endif
+}
+
+static void ggml_backend_cpu_numa_buffer_free_buffer(ggml_backend_buffer_t buffer) {
+    delete (ggml_backend_cpu_numa_buffer_context *) buffer->context;
+}
+
+static void * ggml_backend_cpu_numa_buffer_get_base(ggml_backend_buffer_t buffer) {
+    return ((ggml_backend_cpu_numa_buffer_context *) buffer->context)->replicas[0];
+}
+
+static enum ggml_status ggml_backend_cpu_numa_buffer_init_tensor(ggml_backend_buffer_t buffer, struct ggml_tensor * tensor) {
+    if (tensor->view_src == nullptr) {
+        tensor->extra = buffer->context;
+    }
+
+    return GGML_STATUS_SUCCESS;
+}
+
+static void ggml_backend_cpu_numa_buffer_memset_tensor(ggml_backend_buffer_t buffer, struct ggml_tensor * tensor, uint8_t value, size_t offset, size_t size) {
+    auto * ctx = (ggml_backend_cpu_numa_buffer_context *) buffer->context;
+
+    for (size_t i = 0; i < ctx->replicas.size(); ++i) {
+        memset((char *) ctx->get_replica(tensor->data, i) + offset, value, size);
+    }
+}
+
+static void ggml_backend_cpu_numa_buffer_set_tensor(ggml_backend_buffer_t buffer, struct ggml_tensor * tensor, const void * data, size_t offset, size_t size) {
+    auto * ctx = (ggml_backend_cpu_numa_buffer_context *) buffer->context;
+
+    for (size_t i = 0; i < ctx->replicas.size(); ++i) {
+        memcpy((char *) ctx->get_replica(tensor->data, i) + offset, data, size);
+    }
+}
+
+static void ggml_backend_cpu_numa_buffer_get_tensor(ggml_backend_buffer_t buffer, const struct ggml_tensor * tensor, void * data, size_t offset, size_t size) {
+    memcpy(data, (const char *) tensor->data + offset, size);
+
+    GGML_UNUSED(buffer);
+}
+
+static void ggml_backend_cpu_numa_buffer_clear(ggml_backend_buffer_t buffer, uint8_t value) {
+    auto * ctx = (ggml_backend_cpu_numa_buffer_context *) buffer->context;
+
+    for (void * ptr : ctx->replicas) {
+        memset(ptr, value, ctx->size);
+    }
+}
+
+static const struct ggml_backend_buffer_i ggml_backend_cpu_numa_buffer_i = {
+    /* .free_buffer     = */ ggml_backend_cpu_numa_buffer_free_buffer,
+    /* .get_base        = */ ggml_backend_cpu_numa_buffer_get_base,
+    /* .init_tensor     = */ ggml_backend_cpu_numa_buffer_init_tensor,
+    /* .memset_tensor   = */ ggml_backend_cpu_numa_buffer_memset_tensor,
+    /* .set_tensor      = */ ggml_backend_cpu_numa_buffer_set_tensor,
+    /* .get_tensor      = */ ggml_backend_cpu_numa_buffer_get_tensor,
+    /* .cpy_tensor      = */ nullptr,
+    /* .clear           = */ ggml_backend_cpu_numa_buffer_clear,
+    /* .reset           = */ nullptr,
+};
+
+static const char * ggml_backend_cpu_numa_buffer_type_get_name(ggml_backend_buffer_type_t buft) {
+    return "CPU_NUMA";
+
+    GGML_UNUSED(buft);
+}
+
+static ggml_backend_buffer_t ggml_backend_cpu_numa_buffer_type_alloc_buffer(ggml_backend_buffer_type_t buft, size_t size) {
+    const int n_nodes = std::max(1, ggml_cpu_numa_mirror_n_nodes());
+
+    auto * ctx = new ggml_backend_cpu_numa_buffer_context;
+    ctx->size = std::max<size_t>(size, TENSOR_ALIGNMENT);
+
+    for (int i = 0; i < n_nodes; ++i) {
+        void * ptr = ggml_backend_cpu_numa_alloc(ctx->size, i);
+        if (ptr == nullptr) {
+            GGML_LOG_ERROR("%s: failed to allocate a buffer of size %zu on node %d\n", __func__, ctx->size, i);
+            delete ctx;
+            return nullptr;
+        }
+        ctx->replicas.push_back(ptr);
+    }
+
+    return ggml_backend_buffer_init(buft, ggml_backend_cpu_numa_buffer_i, ctx, size);
+}
+
+static size_t ggml_backend_cpu_numa_buffer_type_get_alignment(ggml_backend_buffer_type_t buft) {
+    return TENSOR_ALIGNMENT;
+
+    GGML_UNUSED(buft);
+}
+
+namespace ggml::cpu::numa {
+class tensor_traits : public ggml::cpu::tensor_traits {
+    bool work_size(int /* n_threads */, const struct ggml_tensor * /* op */, size_t & /* size */) override {
+        // same as the regular matrix multiplication
+        return false;
+    }
+
+    bool compute_forward(struct ggml_compute_params * params, struct ggml_tensor * op) override {
+        const auto * ctx = (const ggml_backend_cpu_numa_buffer_context *) op->src[0]->extra;
+
+        // thread-local copies of the op, pointing to the replica of the thread node
+        ggml_tensor src0 = *op->src[0];
+        src0.data = ctx->get_replica(op->src[0]->data, ggml_cpu_numa_thread_node(params->ith) % ctx->replicas.size());
+
+        ggml_tensor dst = *op;
+        dst.src[0] = &src0;
+
+        if (op->op == GGML_OP_MUL_MAT) {
+            ggml_compute_forward_mul_mat(params, &dst);
+        } else {
+            ggml_compute_forward_mul_mat_id(params, &dst);
+        }
+
+        return true;
+    }
+};
+
+static tensor_traits traits;
+
+class extra_buffer_type : ggml::cpu::extra_buffer_type {
+    bool supports_op(ggml_backend_dev_t, const struct ggml_tensor * op) override {
+        if (ggml_cpu_numa_mirror_n_nodes() == 0) {
+            return false;
+        }
+
+        if ((op->op == GGML_OP_MUL_MAT || op->op == GGML_OP_MUL_MAT_ID) &&
+                op->src[0]->buffer &&
+                op->src[0]->buffer->buft == ggml_backend_cpu_numa_buffer_type() &&
+                ggml_is_contiguous(op->src[0])) {
+            if (op->src[1]->buffer && !ggml_backend_buft_is_host(op->src[1]->buffer->buft)) {
+                return false;
+            }
+            return true;
+        }
+        return false;
+    }
+
+    ggml::cpu::tensor_traits * get_tensor_traits(const struct ggml_tensor * op) override {
+        if (op->op == GGML_OP_MUL_MAT || op->op == GGML_OP_MUL_MAT_ID) {
+            if (op->src[0]->buffer && op->src[0]->buffer->buft == ggml_backend_cpu_numa_buffer_type() && op->src[0]->extra) {
+                return &traits;
+            }
+        }
+        return nullptr;
+    }
+};
+}  // namespace ggml::cpu::numa
+
+ggml_backend_buffer_type_t ggml_backend_cpu_numa_buffer_type(void) {
+    static struct ggml_backend_buffer_type ggml_backend_cpu_buffer_type_numa = {
+        /* .iface    = */ {
+                           /* .get_name         = */ ggml_backend_cpu_numa_buffer_type_get_name,
+                           /* .alloc_buffer     = */ ggml_backend_cpu_numa_buffer_type_alloc_buffer,
+                           /* .get_alignment    = */ ggml_backend_cpu_numa_buffer_type_get_alignment,
+                           /* .get_max_size     = */ nullptr,  // defaults to SIZE_MAX
+                           /* .get_alloc_size   = */ nullptr,  // defaults to ggml_nbytes
+                           /* .is_host          = */ nullptr,
+                           },
+        /* .device  = */ ggml_backend_reg_dev_get(ggml_backend_cpu_reg(), 0),
+        /* .context = */ new ggml::cpu::numa::extra_buffer_type(),
+    };
+
+    return &ggml_backend_cpu_buffer_type_numa;
+}
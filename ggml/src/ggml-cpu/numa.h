@@ -0,0 +1,10 @@
+#pragma once
+
+#include "ggml-backend.h"
+#include "ggml.h"
+
+// GGML CPU internal header
+
+// buffer type that replicates the weights on every NUMA node (GGML_NUMA_STRATEGY_MIRROR)
+// the matrix multiplications then read the replica of the node of each thread
+ggml_backend_buffer_type_t ggml_backend_cpu_numa_buffer_type(void);
@@ -1285,6 +1285,7 @@ void ggml_compute_forward_add(
         case GGML_TYPE_Q5_1:
         case GGML_TYPE_Q8_0:
         case GGML_TYPE_MXFP4:
+        case GGML_TYPE_F8_E4M3:
         case GGML_TYPE_Q2_K:
         case GGML_TYPE_Q3_K:
         case GGML_TYPE_Q4_K:
@@ -1734,6 +1735,7 @@ void ggml_compute_forward_add1(
         case GGML_TYPE_Q8_0:
         case GGML_TYPE_Q8_1:
         case GGML_TYPE_MXFP4:
+        case GGML_TYPE_F8_E4M3:
         case GGML_TYPE_Q2_K:
         case GGML_TYPE_Q3_K:
         case GGML_TYPE_Q4_K:
@@ -1862,6 +1864,7 @@ void ggml_compute_forward_acc(
         case GGML_TYPE_Q8_0:
         case GGML_TYPE_Q8_1:
         case GGML_TYPE_MXFP4:
+        case GGML_TYPE_F8_E4M3:
         case GGML_TYPE_Q2_K:
         case GGML_TYPE_Q3_K:
         case GGML_TYPE_Q4_K:
@@ -4204,6 +4207,75 @@ void ggml_compute_forward_rms_norm(
     }
 }
 
+// RMS_NORM + MUL with the norm weight, fused
+
+void ggml_compute_forward_rms_norm_mul(
+        const ggml_compute_params * params,
+        const ggml_tensor * rms_norm,
+        ggml_tensor * dst) {
+
+    const ggml_tensor * src0 = rms_norm->src[0];
+    const ggml_tensor * src1 = dst->src[0] == rms_norm ? dst->src[1] : dst->src[0]; // the weight
+
+    GGML_ASSERT(src0->type == GGML_TYPE_F32 && src1->type == GGML_TYPE_F32 && dst->type == GGML_TYPE_F32);
+    GGML_ASSERT(ggml_are_same_shape(src0, dst));
+    GGML_ASSERT(ggml_can_repeat(src1, dst));
+
+    GGML_ASSERT(src0->nb[0] == sizeof(float));
+    GGML_ASSERT(src1->nb[0] == sizeof(float));
+    GGML_ASSERT( dst->nb[0] == sizeof(float));
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    GGML_TENSOR_BINARY_OP_LOCALS
+
+    float eps;
+    memcpy(&eps, rms_norm->op_params, sizeof(float));
+
+    GGML_ASSERT(eps >= 0.0f);
+
+    // parallelize over all rows, a single token has only a few
+    const int64_t nr  = ggml_nrows(src0);
+    const int64_t dr  = (nr + nth - 1)/nth;
+    const int64_t ir0 = dr*ith;
+    const int64_t ir1 = MIN(ir0 + dr, nr);
+
+    for (int64_t ir = ir0; ir < ir1; ++ir) {
+        const int64_t i03 = ir/(ne02*ne01);
+        const int64_t i02 = (ir - i03*ne02*ne01)/ne01;
+        const int64_t i01 = (ir - i03*ne02*ne01 - i02*ne01);
+
+        const int64_t i13 = i03 % ne13;
+        const int64_t i12 = i02 % ne12;
+        const int64_t i11 = i01 % ne11;
+
+        const float * x = (float *) ((char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03);
+        const float * w = (float *) ((char *) src1->data + i11*nb11 + i12*nb12 + i13*nb13);
+              float * y = (float *) ((char *)  dst->data + i01*nb1  + i02*nb2  + i03*nb3);
+
+        ggml_float sum = 0.0;
+        for (int64_t i00 = 0; i00 < ne00; i00++) {
+            sum += (ggml_float)(x[i00] * x[i00]);
+        }
+
+        const float mean  = sum/ne00;
+        const float scale = 1.0f/sqrtf(mean + eps);
+
+        // if you hit this, likely you got an inf somewhere earlier
+        assert(scale > 0.0f);
+
+        if (ne10 == ne00) {
+            ggml_vec_mul_f32(ne00, y, x, w);
+        } else {
+            for (int64_t i00 = 0; i00 < ne00; i00++) {
+                y[i00] = x[i00]*w[i00 % ne10];
+            }
+        }
+        ggml_vec_scale_f32(ne00, y, scale);
+    }
+}
+
 static void ggml_compute_forward_rms_norm_back_f32(
         const ggml_compute_params * params,
         ggml_tensor * dst) {
@@ -4762,6 +4834,7 @@ void ggml_compute_forward_out_prod(
         case GGML_TYPE_Q5_1:
         case GGML_TYPE_Q8_0:
         case GGML_TYPE_MXFP4:
+        case GGML_TYPE_F8_E4M3:
         case GGML_TYPE_Q2_K:
         case GGML_TYPE_Q3_K:
         case GGML_TYPE_Q4_K:
@@ -4778,14 +4851,11 @@ void ggml_compute_forward_out_prod(
         case GGML_TYPE_IQ4_XS:
         case GGML_TYPE_IQ3_S:
         case GGML_TYPE_IQ2_S:
+        case GGML_TYPE_F16:
+        case GGML_TYPE_BF16:
             {
                 ggml_compute_forward_out_prod_q_f32(params, dst);
             } break;
-        case GGML_TYPE_F16:
-            {
-                GGML_ABORT("fatal error"); // todo
-                // ggml_compute_forward_out_prod_f16_f32(params, dst);
-            }
         case GGML_TYPE_F32:
             {
                 ggml_compute_forward_out_prod_f32(params, dst);
@@ -5037,6 +5107,7 @@ void ggml_compute_forward_set(
         case GGML_TYPE_Q8_0:
         case GGML_TYPE_Q8_1:
         case GGML_TYPE_MXFP4:
+        case GGML_TYPE_F8_E4M3:
         case GGML_TYPE_Q2_K:
         case GGML_TYPE_Q3_K:
         case GGML_TYPE_Q4_K:
@@ -5299,6 +5370,7 @@ void ggml_compute_forward_get_rows(
         case GGML_TYPE_Q8_0:
         case GGML_TYPE_Q8_1:
         case GGML_TYPE_MXFP4:
+        case GGML_TYPE_F8_E4M3:
         case GGML_TYPE_Q2_K:
         case GGML_TYPE_Q3_K:
         case GGML_TYPE_Q4_K:
@@ -6015,6 +6087,7 @@ void ggml_compute_forward_clamp(
         case GGML_TYPE_Q8_0:
         case GGML_TYPE_Q8_1:
         case GGML_TYPE_MXFP4:
+        case GGML_TYPE_F8_E4M3:
         case GGML_TYPE_Q2_K:
         case GGML_TYPE_Q3_K:
         case GGML_TYPE_Q4_K:
@@ -8132,16 +8205,15 @@ static void ggml_compute_forward_argsort_f32(
             dst_data[j] = j;
         }
 
-        // C doesn't have a functional sort, so we do a bubble sort instead
-        for (int64_t j = 0; j < ne0; j++) {
-            for (int64_t k = j + 1; k < ne0; k++) {
-                if ((order == GGML_SORT_ORDER_ASC  && src_data[dst_data[j]] > src_data[dst_data[k]]) ||
-                    (order == GGML_SORT_ORDER_DESC && src_data[dst_data[j]] < src_data[dst_data[k]])) {
-                    int32_t tmp = dst_data[j];
-                    dst_data[j] = dst_data[k];
-                    dst_data[k] = tmp;
-                }
-            }
+        // stable, so that equal values keep the order of their indices
+        if (order == GGML_SORT_ORDER_ASC) {
+            std::stable_sort(dst_data, dst_data + ne0, [src_data](int32_t a, int32_t b) {
+                return src_data[a] < src_data[b];
+            });
+        } else {
+            std::stable_sort(dst_data, dst_data + ne0, [src_data](int32_t a, int32_t b) {
+                return src_data[a] > src_data[b];
+            });
         }
     }
 }
@@ -8224,12 +8296,23 @@ static void ggml_compute_forward_flash_attn_ext_f16(
     // total rows in q
     const int nr = neq1*neq2*neq3;
 
-    // rows per thread
-    const int dr = (nr + nth - 1)/nth;
+    // with fewer rows than threads (e.g. decode), the KV positions of each row are split into n_split chunks
+    // that are processed by different threads, and the partial results are combined at the end
+    const int64_t n_split = ggml_flash_attn_ext_n_split(nr, nek1, nth);
+    const int64_t n_items = nr*n_split;
 
-    // row range for this thread
-    const int ir0 = dr*ith;
-    const int ir1 = MIN(ir0 + dr, nr);
+    // KV positions per chunk
+    const int64_t nc = (nek1 + n_split - 1)/n_split;
+
+    // items per thread
+    const int64_t di = (n_items + nth - 1)/nth;
+
+    // item range for this thread
+    const int64_t ii0 = di*ith;
+    const int64_t ii1 = MIN(ii0 + di, n_items);
+
+    // partial results of the chunks: [n_items][M, S, VKQ[DV]]
+    float * part = (float *) params->wdata + nth*(1*DK + 2*DV + CACHE_LINE_SIZE_F32);
 
     float scale         = 1.0f;
     float max_bias      = 0.0f;
@@ -8257,8 +8340,60 @@ static void ggml_compute_forward_flash_attn_ext_f16(
     GGML_ASSERT((                            q_to_vec_dot) && "fattn: unsupported K-type");
     GGML_ASSERT((v->type == GGML_TYPE_F32 || v_to_float  ) && "fattn: unsupported V-type");
 
-    // loop over n_batch and n_head
-    for (int ir = ir0; ir < ir1; ++ir) {
+    // apply the sinks, normalize and store the result of the row ir
+    auto store_row = [&](int ir, float * VKQ32, float M, float S) {
+        const int iq3 = ir/(neq2*neq1);
+        const int iq2 = (ir - iq3*neq2*neq1)/neq1;
+        const int iq1 = (ir - iq3*neq2*neq1 - iq2*neq1);
+
+        const uint32_t h = iq2; // head index
+
+        // sinks
+        if (sinks) {
+            const float s = ((float *)((char *) sinks->data))[h];
+
+            float ms = 1.0f;
+            float vs = 1.0f;
+
+            if (s > M) {
+                ms = expf(M - s);
+                ggml_vec_scale_f32(DV, VKQ32, ms);
+            } else {
+                vs = expf(s - M);
+            }
+
+            S = S*ms + vs;
+        }
+
+        // V /= S
+        const float S_inv = 1.0f/S;
+        ggml_vec_scale_f32(DV, VKQ32, S_inv);
+
+        // dst indices
+        const int i1 = iq1;
+        const int i2 = iq2;
+        const int i3 = iq3;
+
+        // original
+        //memcpy((char *) dst->data + (i1*nb1 + i2*nb2 + i3*nb3), V, nev0*sizeof(float));
+
+        // permute(0, 2, 1, 3)
+        memcpy((char *) dst->data + (i3*ne2*ne1 + i2 + i1*ne1)*nb1, VKQ32, nb1);
+    };
+
+    float       * VKQ32 = (float       *) params->wdata + ith*(1*DK + 2*DV + CACHE_LINE_SIZE_F32); // FP32 VKQ accumulator
+    float       * V32   =                 (VKQ32 + 1*DV); // (temporary) FP32 V buffer
+    ggml_fp16_t * VKQ16 = (ggml_fp16_t *) (VKQ32 + 1*DV); // (temporary) FP16 VKQ accumulator
+    ggml_fp16_t * Q_q   = (ggml_fp16_t *) (VKQ32 + 2*DV); // (temporary) buffer for Q converted to quantized/FP16
+
+    // loop over n_batch and n_head (and the KV chunks)
+    for (int64_t ii = ii0; ii < ii1; ++ii) {
+        const int ir = ii/n_split;
+
+        // KV range of the chunk
+        const int64_t ic0 = (ii%n_split)*nc;
+        const int64_t ic1 = MIN(ic0 + nc, nek1);
+
         // q indices
         const int iq3 = ir/(neq2*neq1);
         const int iq2 = (ir - iq3*neq2*neq1)/neq1;
@@ -8270,11 +8405,6 @@ static void ggml_compute_forward_flash_attn_ext_f16(
         float S = 0.0f;      // sum
         float M = -INFINITY; // maximum KQ value
 
-        float       * VKQ32 = (float       *) params->wdata + ith*(1*DK + 2*DV + CACHE_LINE_SIZE_F32); // FP32 VKQ accumulator
-        float       * V32   =                 (VKQ32 + 1*DV); // (temporary) FP32 V buffer
-        ggml_fp16_t * VKQ16 = (ggml_fp16_t *) (VKQ32 + 1*DV); // (temporary) FP16 VKQ accumulator
-        ggml_fp16_t * Q_q   = (ggml_fp16_t *) (VKQ32 + 2*DV); // (temporary) buffer for Q converted to quantized/FP16
-
         if (v->type == GGML_TYPE_F16) {
             memset(VKQ16, 0, DV*sizeof(ggml_fp16_t));
         } else {
@@ -8297,7 +8427,7 @@ static void ggml_compute_forward_flash_attn_ext_f16(
         // online softmax / attention
         // loop over n_kv and n_head_kv
         // ref: https://arxiv.org/pdf/2112.05682.pdf
-        for (int64_t ic = 0; ic < nek1; ++ic) {
+        for (int64_t ic = ic0; ic < ic1; ++ic) {
             const float mv = mp ? slope*GGML_CPU_FP16_TO_FP32(mp[ic]) : 0.0f;
             if (mv == -INFINITY) {
                 continue;
@@ -8370,38 +8500,64 @@ static void ggml_compute_forward_flash_attn_ext_f16(
             }
         }
 
-        // sinks
-        if (sinks) {
-            const float s = ((float *)((char *) sinks->data))[h];
+        if (n_split > 1) {
+            // partial result, combined below
+            float * p = part + ii*(2 + DV);
 
-            float ms = 1.0f;
-            float vs = 1.0f;
+            p[0] = M;
+            p[1] = S;
+            memcpy(p + 2, VKQ32, DV*sizeof(float));
 
-            if (s > M) {
-                ms = expf(M - s);
-                ggml_vec_scale_f32(DV, VKQ32, ms);
-            } else {
-                vs = expf(s - M);
-            }
+            continue;
+        }
 
-            S = S*ms + vs;
+        store_row(ir, VKQ32, M, S);
+    }
+
+    if (n_split == 1) {
+        return;
+    }
+
+    ggml_barrier(params->threadpool);
+
+    // combine the partial results of the chunks of each row
+    for (int ir = ith; ir < nr; ir += nth) {
+        const float * p0 = part + (int64_t) ir*n_split*(2 + DV);
+
+        float M = -INFINITY;
+        for (int64_t is = 0; is < n_split; ++is) {
+            M = MAX(M, p0[is*(2 + DV)]);
         }
 
-        // V /= S
-        const float S_inv = 1.0f/S;
-        ggml_vec_scale_f32(DV, VKQ32, S_inv);
+        float S = 0.0f;
+        memset(VKQ32, 0, DV*sizeof(float));
 
-        // dst indices
-        const int i1 = iq1;
-        const int i2 = iq2;
-        const int i3 = iq3;
+        for (int64_t is = 0; is < n_split; ++is) {
+            const float * p = p0 + is*(2 + DV);
+            if (p[0] == -INFINITY) {
+                // all KV positions of the chunk are masked
+                continue;
+            }
 
-        // original
-        //memcpy((char *) dst->data + (i1*nb1 + i2*nb2 + i3*nb3), V, nev0*sizeof(float));
+            const float ms = expf(p[0] - M);
 
-        // permute(0, 2, 1, 3)
-        memcpy((char *) dst->data + (i3*ne2*ne1 + i2 + i1*ne1)*nb1, VKQ32, nb1);
+            S += p[1]*ms;
+            ggml_vec_mad_f32(DV, VKQ32, p + 2, ms);
+        }
+
+        store_row(ir, VKQ32, M, S);
+    }
+}
+
+int64_t ggml_flash_attn_ext_n_split(int64_t nr, int64_t n_kv, int n_threads) {
+    // minimum number of KV positions per chunk, to amortize the combination of the partial results
+    const int64_t n_kv_min = 256;
+
+    if (nr >= n_threads) {
+        return 1;
     }
+
+    return MAX(1, MIN((n_threads + nr - 1)/nr, n_kv/n_kv_min));
 }
 
 void ggml_compute_forward_flash_attn_ext(
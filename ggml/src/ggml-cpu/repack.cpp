@@ -11,12 +11,25 @@
 
 #include "arch-fallback.h"
 
+#include <algorithm>
+#include <cerrno>
 #include <cmath>
 #include <cstring>
 #include <cassert>
 #include <cstdio>  // for GGML_ASSERT
+#include <cstdlib>
+#include <string>
+#include <typeinfo>
+
+#if !defined(_WIN32)
+#    include <fcntl.h>
+#    include <sys/mman.h>
+#    include <sys/stat.h>
+#    include <unistd.h>
+#endif
 
 #include "repack.h"
+#include "mem.h"
 
 #if defined(__GNUC__)
 #pragma GCC diagnostic ignored "-Woverlength-strings"
@@ -488,6 +501,63 @@ void ggml_gemv_q2_K_8x8_q8_K_generic(int n, float * GGML_RESTRICT s, size_t bs,
     }
 }
 
+void ggml_gemv_q6_K_8x8_q8_K_generic(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
+    const int qk = QK_K;
+    const int nb = n / qk;
+    const int ncols_interleaved = 8;
+    const int blocklen = 8;
+
+    assert (n % qk == 0);
+    assert (nc % ncols_interleaved == 0);
+
+    UNUSED(s);
+    UNUSED(bs);
+    UNUSED(vx);
+    UNUSED(vy);
+    UNUSED(nr);
+    UNUSED(nc);
+    UNUSED(nb);
+    UNUSED(ncols_interleaved);
+    UNUSED(blocklen);
+
+    float sumf[8];
+    int sumi;
+    int sumi_sb;
+
+    const block_q8_K * a_ptr = (const block_q8_K *) vy;
+    for (int x = 0; x < nc / ncols_interleaved; x++) {
+        const block_q6_Kx8 * b_ptr = (const block_q6_Kx8 *) vx + (x * nb);
+
+        for (int j = 0; j < ncols_interleaved; j++) {
+            sumf[j] = 0.0;
+        }
+        for (int l = 0; l < nb; l++) {
+            for (int j = 0; j < ncols_interleaved; j++) {
+                sumi = 0;
+                for (int sb = 0; sb < QK_K / 16; sb++) {
+                    sumi_sb = 0;
+                    for (int i = 0; i < 16; i++) {
+                        // quant v: low nibble in ql chunk v/8 (upper half of the block in the high nibble),
+                        // upper 2 bits in qh chunk (v/8)%8 at bit 2*(v/64)
+                        const int v  = sb * 16 + i;
+                        const int kl = (v % 128) / blocklen;
+                        const int kh = (v % 64) / blocklen;
+                        const uint8_t ql = b_ptr[l].ql[kl * ncols_interleaved * blocklen + j * blocklen + v % blocklen];
+                        const uint8_t qh = b_ptr[l].qh[kh * ncols_interleaved * blocklen + j * blocklen + v % blocklen];
+                        const int q = (((v < 128) ? (ql & 0xF) : (ql >> 4)) | (((qh >> (2 * (v / 64))) & 3) << 4)) - 32;
+                        sumi_sb += q * a_ptr[l].qs[v];
+                    }
+                    sumi += sumi_sb * b_ptr[l].scales[sb * ncols_interleaved + j];
+                }
+                sumf[j] += sumi * GGML_CPU_FP16_TO_FP32(b_ptr[l].d[j]) * a_ptr[l].d;
+            }
+        }
+        for (int j = 0; j < ncols_interleaved; j++) {
+            s[x * ncols_interleaved + j] = sumf[j];
+        }
+    }
+}
+
 void ggml_gemv_iq4_nl_4x4_q8_0_generic(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
     const int qk = QK8_0;
     const int nb = n / qk;
@@ -878,6 +948,77 @@ void ggml_gemm_q2_K_8x8_q8_K_generic(int n, float * GGML_RESTRICT s, size_t bs,
 }
 
 
+void ggml_gemm_q6_K_8x8_q8_K_generic(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
+    const int qk = QK_K;
+    const int nb = n / qk;
+    const int ncols_interleaved = 8;
+    const int blocklen = 8;
+
+    assert (n % qk == 0);
+    assert (nr % 4 == 0);
+    assert (nc % ncols_interleaved == 0);
+
+    UNUSED(s);
+    UNUSED(bs);
+    UNUSED(vx);
+    UNUSED(vy);
+    UNUSED(nr);
+    UNUSED(nc);
+    UNUSED(nb);
+    UNUSED(ncols_interleaved);
+    UNUSED(blocklen);
+
+    float sumf[4][8];
+    int sumi[4];
+    int sumi_sb[4];
+
+    for (int y = 0; y < nr / 4; y++) {
+        const block_q8_Kx4 * a_ptr = (const block_q8_Kx4 *) vy + (y * nb);
+        for (int x = 0; x < nc / ncols_interleaved; x++) {
+            const block_q6_Kx8 * b_ptr = (const block_q6_Kx8 *) vx + (x * nb);
+            for (int m = 0; m < 4; m++) {
+                for (int j = 0; j < ncols_interleaved; j++) {
+                    sumf[m][j] = 0.0;
+                }
+            }
+            for (int l = 0; l < nb; l++) {
+                for (int j = 0; j < ncols_interleaved; j++) {
+                    for (int m = 0; m < 4; m++) {
+                        sumi[m] = 0;
+                    }
+                    for (int sb = 0; sb < QK_K / 16; sb++) {
+                        for (int m = 0; m < 4; m++) {
+                            sumi_sb[m] = 0;
+                        }
+                        for (int i = 0; i < 16; i++) {
+                            const int v  = sb * 16 + i;
+                            const int kl = (v % 128) / blocklen;
+                            const int kh = (v % 64) / blocklen;
+                            const uint8_t ql = b_ptr[l].ql[kl * ncols_interleaved * blocklen + j * blocklen + v % blocklen];
+                            const uint8_t qh = b_ptr[l].qh[kh * ncols_interleaved * blocklen + j * blocklen + v % blocklen];
+                            const int q = (((v < 128) ? (ql & 0xF) : (ql >> 4)) | (((qh >> (2 * (v / 64))) & 3) << 4)) - 32;
+                            for (int m = 0; m < 4; m++) {
+                                sumi_sb[m] += q * a_ptr[l].qs[(v / blocklen) * 4 * blocklen + m * blocklen + v % blocklen];
+                            }
+                        }
+                        for (int m = 0; m < 4; m++) {
+                            sumi[m] += sumi_sb[m] * b_ptr[l].scales[sb * ncols_interleaved + j];
+                        }
+                    }
+                    for (int m = 0; m < 4; m++) {
+                        sumf[m][j] += sumi[m] * GGML_CPU_FP16_TO_FP32(b_ptr[l].d[j]) * a_ptr[l].d[m];
+                    }
+                }
+            }
+            for (int m = 0; m < 4; m++) {
+                for (int j = 0; j < ncols_interleaved; j++) {
+                    s[(y * 4 + m) * bs + x * ncols_interleaved + j] = sumf[m][j];
+                }
+            }
+        }
+    }
+}
+
 void ggml_gemm_iq4_nl_4x4_q8_0_generic(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
     const int qk = QK8_0;
     const int nb = n / qk;
@@ -1125,6 +1266,58 @@ static block_q2_Kx8 make_block_q2_Kx8(block_q2_K * in, unsigned int blck_size_in
 
 }
 
+static block_q6_Kx8 make_block_q6_Kx8(block_q6_K * in, unsigned int blck_size_interleave) {
+    block_q6_Kx8 out;
+
+    // Delta(scale) values of the eight Q6_K structures are copied onto the output interleaved structure
+    for (int i = 0; i < 8; i++) {
+        out.d[i] = in[i].d;
+    }
+
+    // Scales are interleaved per sub block: the 8 scales of the first sub block, then the second, and so on
+    for (int sb = 0; sb < QK_K / 16; sb++) {
+        for (int i = 0; i < 8; i++) {
+            out.scales[sb * 8 + i] = in[i].scales[sb];
+        }
+    }
+
+    // The 6-bit quants are unpacked from the Q6_K layout and stored again so that one row of 8 bytes in
+    // ql/qh holds 8 consecutive quants of a single structure:
+    //  - ql chunk k (k < 16) holds the low 4 bits of quants 8k..8k+7 and, in the high nibble, of quants 128+8k..
+    //  - qh chunk k (k < 8) holds the upper 2 bits of quants 8k, 64+8k, 128+8k and 192+8k in bits 0-1, 2-3, 4-5 and 6-7
+    // The chunks of the eight structures are interleaved, 8 bytes at a time
+    for (int src_id = 0; src_id < 8; src_id++) {
+        uint8_t q[QK_K];
+        const uint8_t * ql = in[src_id].ql;
+        const uint8_t * qh = in[src_id].qh;
+        for (int n = 0; n < QK_K; n += 128) {
+            for (int l = 0; l < 32; ++l) {
+                q[n + l +  0] = (ql[l +  0] & 0xF) | (((qh[l] >> 0) & 3) << 4);
+                q[n + l + 32] = (ql[l + 32] & 0xF) | (((qh[l] >> 2) & 3) << 4);
+                q[n + l + 64] = (ql[l +  0] >>  4) | (((qh[l] >> 4) & 3) << 4);
+                q[n + l + 96] = (ql[l + 32] >>  4) | (((qh[l] >> 6) & 3) << 4);
+            }
+            ql += 64;
+            qh += 32;
+        }
+
+        for (int k = 0; k < QK_K / 2 / (int) blck_size_interleave; k++) {
+            for (unsigned int i = 0; i < blck_size_interleave; i++) {
+                const int v = k * blck_size_interleave + i;
+                out.ql[(k * 8 + src_id) * blck_size_interleave + i] = (q[v] & 0xF) | ((q[v + 128] & 0xF) << 4);
+            }
+        }
+        for (int k = 0; k < QK_K / 4 / (int) blck_size_interleave; k++) {
+            for (unsigned int i = 0; i < blck_size_interleave; i++) {
+                const int v = k * blck_size_interleave + i;
+                out.qh[(k * 8 + src_id) * blck_size_interleave + i] = (q[v] >> 4) | ((q[v + 64] >> 4) << 2) | ((q[v + 128] >> 4) << 4) | ((q[v + 192] >> 4) << 6);
+            }
+        }
+    }
+
+    return out;
+}
+
 static int repack_q4_0_to_q4_0_4_bl(struct ggml_tensor * t, int interleave_block, const void * GGML_RESTRICT data, size_t data_size) {
     GGML_ASSERT(t->type == GGML_TYPE_Q4_0);
     GGML_ASSERT(interleave_block == 4 || interleave_block == 8);
@@ -1217,6 +1410,37 @@ static int repack_q2_K_to_q2_K_8_bl(struct ggml_tensor * t, int interleave_block
     GGML_UNUSED(data_size);
 }
 
+static int repack_q6_K_to_q6_K_8_bl(struct ggml_tensor * t, int interleave_block, const void * GGML_RESTRICT data, size_t data_size) {
+    GGML_ASSERT(t->type == GGML_TYPE_Q6_K);
+    GGML_ASSERT(interleave_block == 8);
+    constexpr int nrows_interleaved = 8;
+
+    block_q6_Kx8 * dst = (block_q6_Kx8*)t->data;
+    const block_q6_K * src = (const block_q6_K*) data;
+    block_q6_K dst_tmp[8];
+    int nrow = ggml_nrows(t);
+    int nblocks = t->ne[0] / QK_K;
+
+    GGML_ASSERT(data_size == nrow * nblocks * sizeof(block_q6_K));
+
+    if (t->ne[1] % nrows_interleaved != 0 || t->ne[0] % 8 != 0) {
+        return -1;
+    }
+
+    for (int b = 0; b < nrow; b += nrows_interleaved) {
+        for (int64_t x = 0; x < nblocks; x++) {
+            for (int i  = 0; i < nrows_interleaved; i++ ) {
+                dst_tmp[i] = src[x + i * nblocks];
+            }
+            *dst++ = make_block_q6_Kx8(dst_tmp, interleave_block);
+        }
+        src += nrows_interleaved * nblocks;
+    }
+    return 0;
+
+    GGML_UNUSED(data_size);
+}
+
 static int repack_q4_0_to_q4_0_8_bl(struct ggml_tensor * t, int interleave_block, const void * GGML_RESTRICT data, size_t data_size) {
     GGML_ASSERT(t->type == GGML_TYPE_Q4_0);
     GGML_ASSERT(interleave_block == 8);
@@ -1341,6 +1565,10 @@ template <> int repack<block_q2_K, 8, 8>(struct ggml_tensor * t, const void * da
     return repack_q2_K_to_q2_K_8_bl(t, 8, data, data_size);
 }
 
+template <> int repack<block_q6_K, 8, 8>(struct ggml_tensor * t, const void * data, size_t data_size) {
+    return repack_q6_K_to_q6_K_8_bl(t, 8, data, data_size);
+}
+
 template <> int repack<block_iq4_nl, 4, 4>(struct ggml_tensor * t, const void * data, size_t data_size) {
     return repack_iq4_nl_to_iq4_nl_4_bl(t, 4, data, data_size);
 }
@@ -1374,6 +1602,10 @@ template <> void gemv<block_q2_K, 8, 8, GGML_TYPE_Q8_K>(int n, float * s, size_t
     ggml_gemv_q2_K_8x8_q8_K(n, s, bs, vx, vy, nr, nc);
 }
 
+template <> void gemv<block_q6_K, 8, 8, GGML_TYPE_Q8_K>(int n, float * s, size_t bs, const void * vx, const void * vy, int nr, int nc) {
+    ggml_gemv_q6_K_8x8_q8_K(n, s, bs, vx, vy, nr, nc);
+}
+
 template <> void gemv<block_iq4_nl, 4, 4, GGML_TYPE_Q8_0>(int n, float * s, size_t bs, const void * vx, const void * vy, int nr, int nc) {
     ggml_gemv_iq4_nl_4x4_q8_0(n, s, bs, vx, vy, nr, nc);
 }
@@ -1402,6 +1634,10 @@ template <> void gemm<block_q2_K, 8, 8, GGML_TYPE_Q8_K>(int n, float * s, size_t
     ggml_gemm_q2_K_8x8_q8_K(n, s, bs, vx, vy, nr, nc);
 }
 
+template <> void gemm<block_q6_K, 8, 8, GGML_TYPE_Q8_K>(int n, float * s, size_t bs, const void * vx, const void * vy, int nr, int nc) {
+    ggml_gemm_q6_K_8x8_q8_K(n, s, bs, vx, vy, nr, nc);
+}
+
 template <> void gemm<block_iq4_nl, 4, 4, GGML_TYPE_Q8_0>(int n, float * s, size_t bs, const void * vx, const void * vy, int nr, int nc) {
     ggml_gemm_iq4_nl_4x4_q8_0(n, s, bs, vx, vy, nr, nc);
 }
@@ -1678,6 +1914,9 @@ static const ggml::cpu::tensor_traits * ggml_repack_get_optimal_repack_type(cons
     // instance for Q2
     static const ggml::cpu::repack::tensor_traits<block_q2_K, 8, 8, GGML_TYPE_Q8_K> q2_K_8x8_q8_K;
 
+    // instance for Q6
+    static const ggml::cpu::repack::tensor_traits<block_q6_K, 8, 8, GGML_TYPE_Q8_K> q6_K_8x8_q8_K;
+
     // instance for IQ4
     static const ggml::cpu::repack::tensor_traits<block_iq4_nl, 4, 4, GGML_TYPE_Q8_0> iq4_nl_4x4_q8_0;
 
@@ -1709,6 +1948,12 @@ static const ggml::cpu::tensor_traits * ggml_repack_get_optimal_repack_type(cons
                 return &q2_K_8x8_q8_K;
             }
         }
+    } else if (cur->type == GGML_TYPE_Q6_K) {
+        if (ggml_cpu_has_avx2()) {
+            if (cur->ne[1] % 8 == 0) {
+                return &q6_K_8x8_q8_K;
+            }
+        }
     } else if (cur->type == GGML_TYPE_IQ4_NL) {
         if (ggml_cpu_has_neon() && ggml_cpu_has_dotprod()) {
             if (cur->ne[1] % 4 == 0) {
@@ -1727,15 +1972,156 @@ static enum ggml_status ggml_backend_cpu_repack_buffer_init_tensor(ggml_backend_
     return GGML_STATUS_SUCCESS;
 }
 
+// persistent cache of the repacked tensors
+//
+// with GGML_CPU_REPACK_CACHE=<dir>, the repacked data of each tensor is stored in <dir> the first time it is loaded
+// and mapped directly from there on later loads. The buffer is then backed by the page cache instead of anonymous
+// memory: loading is zero-copy and processes that load the same model share the pages
+// the file name is a hash of the name, type and shape of the tensor, the repacked layout, the cache format version,
+// the ggml commit and all of the source data
+
+#if !defined(_WIN32)
+static const char * ggml_repack_cache_dir() {
+    static const char * dir = getenv("GGML_CPU_REPACK_CACHE");
+    return dir && dir[0] ? dir : nullptr;
+}
+
+static size_t ggml_repack_cache_page_size() {
+    static const size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+    return page_size;
+}
+
+static uint64_t ggml_repack_cache_hash(uint64_t h, const void * data, size_t size) {
+    // FNV-1a
+    const uint8_t * p = (const uint8_t *) data;
+    for (size_t i = 0; i < size; ++i) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+// bump when the content of the cache files changes without a change of the layout type
+#define GGML_REPACK_CACHE_VERSION 1
+
+// same as above, one 64-bit word at a time: the source data is read at memory speed, which is still cheaper than
+// repacking it and writing the result
+static uint64_t ggml_repack_cache_hash_data(uint64_t h, const void * data, size_t size) {
+    const char * p = (const char *) data;
+    const size_t n = size / sizeof(uint64_t);
+    for (size_t i = 0; i < n; ++i) {
+        uint64_t w;
+        memcpy(&w, p + i*sizeof(uint64_t), sizeof(w));
+        h ^= w;
+        h *= 0x100000001b3ULL;
+        h ^= h >> 32;
+    }
+    return ggml_repack_cache_hash(h, p + n*sizeof(uint64_t), size - n*sizeof(uint64_t));
+}
+
+static std::string ggml_repack_cache_path(const struct ggml_tensor * tensor, const void * data, size_t size) {
+    const char * layout = typeid(*(ggml::cpu::repack::tensor_traits_base *) tensor->extra).name();
+
+    uint64_t h = 0xcbf29ce484222325ULL;
+    h = ggml_repack_cache_hash(h, tensor->name, strlen(tensor->name));
+    h = ggml_repack_cache_hash(h, &tensor->type, sizeof(tensor->type));
+    h = ggml_repack_cache_hash(h, tensor->ne, sizeof(tensor->ne));
+    h = ggml_repack_cache_hash(h, layout, strlen(layout));
+    const int version = GGML_REPACK_CACHE_VERSION;
+    h = ggml_repack_cache_hash(h, &version, sizeof(version));
+    h = ggml_repack_cache_hash(h, ggml_commit(), strlen(ggml_commit()));
+    h = ggml_repack_cache_hash(h, &size, sizeof(size));
+
+    // a sample of the data is not enough: fine-tunes of the same model differ only in some of the blocks
+    h = ggml_repack_cache_hash_data(h, data, size);
+
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.bin", (unsigned long long) h);
+    return std::string(ggml_repack_cache_dir()) + name;
+}
+
+// map the file over the tensor data, replacing the anonymous pages of the buffer
+static bool ggml_repack_cache_map(struct ggml_tensor * tensor, int fd, size_t size) {
+    if ((uintptr_t) tensor->data % ggml_repack_cache_page_size() != 0) {
+        return false;
+    }
+    void * addr = mmap(tensor->data, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0);
+    return addr != MAP_FAILED;
+}
+
+static bool ggml_repack_cache_load(struct ggml_tensor * tensor, const std::string & path, size_t size) {
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0 && (size_t) st.st_size == size;
+    if (ok && !ggml_repack_cache_map(tensor, fd, size)) {
+        ok = pread(fd, tensor->data, size, 0) == (ssize_t) size;
+    }
+    close(fd);
+
+    if (ok) {
+        GGML_LOG_DEBUG("%s: loaded tensor %s from %s\n", __func__, tensor->name, path.c_str());
+    }
+    return ok;
+}
+
+static void ggml_repack_cache_store(struct ggml_tensor * tensor, const std::string & path, size_t size) {
+    const std::string tmp  = path + ".tmp." + std::to_string(getpid());
+
+    const int fd = open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        GGML_LOG_WARN("%s: failed to create %s: %s\n", __func__, tmp.c_str(), strerror(errno));
+        return;
+    }
+
+    size_t written = 0;
+    while (written < size) {
+        const ssize_t n = write(fd, (const char *) tensor->data + written, size - written);
+        if (n <= 0) {
+            break;
+        }
+        written += n;
+    }
+
+    if (written != size || rename(tmp.c_str(), path.c_str()) != 0) {
+        GGML_LOG_WARN("%s: failed to write %s: %s\n", __func__, path.c_str(), strerror(errno));
+        unlink(tmp.c_str());
+    } else {
+        ggml_repack_cache_map(tensor, fd, size);
+    }
+    close(fd);
+}
+
+static void ggml_backend_cpu_repack_cache_free_buffer(ggml_backend_buffer_t buffer) {
+    munmap(buffer->context, buffer->size);
+}
+#endif
+
 static void ggml_backend_cpu_repack_buffer_set_tensor(ggml_backend_buffer_t buffer, struct ggml_tensor * tensor,
                                                        const void * data, size_t offset, size_t size) {
     GGML_ASSERT(offset == 0);
     GGML_ASSERT(size == ggml_nbytes(tensor));
 
+#if !defined(_WIN32)
+    const std::string cache_path = ggml_repack_cache_dir() ? ggml_repack_cache_path(tensor, data, size) : std::string();
+    if (!cache_path.empty() && ggml_repack_cache_load(tensor, cache_path, size)) {
+        return;
+    }
+#endif
+
     auto tensor_traits = (ggml::cpu::repack::tensor_traits_base *) tensor->extra;
     auto OK            = tensor_traits->repack(tensor, data, size);
 
     GGML_ASSERT(OK == 0);
+
+#if !defined(_WIN32)
+    if (!cache_path.empty()) {
+        ggml_repack_cache_store(tensor, cache_path, size);
+    }
+#endif
     GGML_UNUSED(buffer);
 }
 
@@ -1746,7 +2132,29 @@ static const char * ggml_backend_cpu_repack_buffer_type_get_name(ggml_backend_bu
 }
 
 static ggml_backend_buffer_t ggml_backend_cpu_repack_buffer_type_alloc_buffer(ggml_backend_buffer_type_t buft, size_t size) {
-    ggml_backend_buffer_t buffer = ggml_backend_buft_alloc_buffer(ggml_backend_cpu_buffer_type(), size);
+    ggml_backend_buffer_t buffer = nullptr;
+
+#if !defined(_WIN32)
+    if (ggml_repack_cache_dir()) {
+        // page-aligned anonymous memory, so that the cached tensors can be mapped over it
+        size = std::max<size_t>(size, TENSOR_ALIGNMENT);
+        void * ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ptr == MAP_FAILED) {
+            GGML_LOG_ERROR("%s: failed to allocate buffer of size %zu\n", __func__, size);
+            return nullptr;
+        }
+        buffer = ggml_backend_cpu_buffer_from_ptr(ptr, size);
+        buffer->iface.free_buffer = ggml_backend_cpu_repack_cache_free_buffer;
+    }
+#endif
+
+    if (buffer == nullptr && ggml_cpu_repack_mem() != 0) {
+        buffer = ggml_cpu_mem_buffer_alloc(buft, size, ggml_cpu_repack_mem());
+    }
+
+    if (buffer == nullptr) {
+        buffer = ggml_backend_buft_alloc_buffer(ggml_backend_cpu_buffer_type(), size);
+    }
 
     if (buffer == nullptr) {
         return nullptr;
@@ -1761,6 +2169,11 @@ static ggml_backend_buffer_t ggml_backend_cpu_repack_buffer_type_alloc_buffer(gg
 }
 
 static size_t ggml_backend_cpu_repack_buffer_type_get_alignment(ggml_backend_buffer_type_t buft) {
+#if !defined(_WIN32)
+    if (ggml_repack_cache_dir()) {
+        return ggml_repack_cache_page_size();
+    }
+#endif
     return TENSOR_ALIGNMENT;
 
     GGML_UNUSED(buft);
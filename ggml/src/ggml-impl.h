@@ -471,6 +471,62 @@ static inline float ggml_e8m0_to_fp32_half(uint8_t x) {
 #define GGML_E8M0_TO_FP32(x) ggml_e8m0_to_fp32(x)
 #define GGML_E8M0_TO_FP32_HALF(x) ggml_e8m0_to_fp32_half(x)
 
+// FP8 E4M3 (OCP): 1 sign bit, 4 exponent bits with bias 7, 3 mantissa bits
+// there are no infinities, the largest finite value is 448 and 0x7F/0xFF are NaN
+static inline float ggml_fp8_e4m3_to_fp32(uint8_t x) {
+    const uint32_t sign = (uint32_t) (x & 0x80) << 24;
+    const uint32_t exp  = (x >> 3) & 0x0F;
+    const uint32_t mant = x & 0x07;
+
+    float result;
+    if (exp == 0) {
+        // subnormal: mant/8 * 2^(-6)
+        result = (float) mant * (1.0f/512.0f);
+        return sign ? -result : result;
+    }
+    if (exp == 0x0F && mant == 0x07) {
+        const uint32_t bits = sign | 0x7FC00000;
+        memcpy(&result, &bits, sizeof(float));
+        return result;
+    }
+
+    const uint32_t bits = sign | ((exp + 127 - 7) << 23) | (mant << 20);
+    memcpy(&result, &bits, sizeof(float));
+    return result;
+}
+
+// round to nearest even, values beyond the range saturate to +-448
+static inline uint8_t ggml_fp32_to_fp8_e4m3(float f) {
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(float));
+
+    const uint8_t sign = (bits >> 24) & 0x80;
+    bits &= 0x7FFFFFFF;
+
+    if (bits > 0x7F800000) {
+        return sign | 0x7F; // NaN
+    }
+
+    float a;
+    memcpy(&a, &bits, sizeof(float));
+
+    if (a < 1.0f/64.0f) {
+        // subnormal, a multiple of 2^(-9), 8*2^(-9) is the smallest normal value 0x08
+        return sign | (uint8_t) nearbyintf(a * 512.0f);
+    }
+
+    bits += 0x0007FFFF + ((bits >> 20) & 1);
+    const int32_t  exp  = (int32_t) (bits >> 23) - 127 + 7;
+    const uint32_t mant = (bits >> 20) & 0x07;
+    if (exp > 15 || (exp == 15 && mant == 0x07)) {
+        return sign | 0x7E; // 448
+    }
+    return sign | (uint8_t) (exp << 3) | (uint8_t) mant;
+}
+
+#define GGML_FP8_E4M3_TO_FP32(x) ggml_fp8_e4m3_to_fp32(x)
+#define GGML_FP32_TO_FP8_E4M3(x) ggml_fp32_to_fp8_e4m3(x)
+
 /**
  * Converts brain16 to float32.
  *
@@ -619,4 +675,5 @@ inline bool ggml_can_fuse(const struct ggml_cgraph * cgraph, int node_idx, std::
 GGML_API size_t gguf_type_size(enum gguf_type type);
 GGML_API struct gguf_context * gguf_init_from_file_impl(FILE * file, struct gguf_init_params params);
 GGML_API void gguf_write_to_buf(const struct gguf_context * ctx, std::vector<int8_t> & buf, bool only_meta);
+GGML_API bool gguf_write_to_file_impl(const struct gguf_context * ctx, FILE * file, bool only_meta);
 #endif // __cplusplus
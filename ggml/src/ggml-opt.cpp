@@ -13,6 +13,19 @@
 #include <random>
 #include <vector>
 
+#ifdef _WIN32
+#    define WIN32_LEAN_AND_MEAN
+#    ifndef NOMINMAX
+#        define NOMINMAX
+#    endif
+#    include <windows.h>
+#else
+#    include <fcntl.h>
+#    include <sys/mman.h>
+#    include <sys/stat.h>
+#    include <unistd.h>
+#endif
+
 struct ggml_opt_dataset {
     struct ggml_context   * ctx    = nullptr;
     ggml_backend_buffer_t   buf    = nullptr;
@@ -24,6 +37,14 @@ struct ggml_opt_dataset {
     size_t  nbs_data    = -1;
     size_t  nbs_labels  = -1;
 
+    // offsets between the shards, larger than nbs_data/nbs_labels for the strided datasets of ggml_opt_dataset_init_mmap
+    size_t  nb_data_stride   = -1;
+    size_t  nb_labels_stride = -1;
+
+    // read-only mapping of the file that stores the data instead of buf
+    void  * mapping      = nullptr;
+    size_t  mapping_size = 0;
+
     std::vector<int64_t> permutation;
 };
 
@@ -67,6 +88,12 @@ struct ggml_opt_context {
     ggml_opt_get_optimizer_params get_opt_pars = nullptr;
     void * get_opt_pars_ud                     = nullptr;
     struct ggml_tensor * adamw_params          = nullptr;
+
+    // dynamic loss scaling, the optimizer step is a separate graph that only runs if grad_sum is finite
+    float   loss_scale        = 0.0f;
+    int32_t loss_scale_window = 0;
+    int32_t loss_scale_steps  = 0; // optimizer steps since the last change of the scale
+    struct ggml_tensor * grad_sum = nullptr;
 };
 
 struct ggml_opt_result {
@@ -117,6 +144,9 @@ ggml_opt_dataset_t ggml_opt_dataset_init(
         result->nbs_labels = 0;
     }
 
+    result->nb_data_stride   = result->nbs_data;
+    result->nb_labels_stride = result->nbs_labels;
+
     result->buf = ggml_backend_alloc_ctx_tensors_from_buft(result->ctx, ggml_backend_cpu_buffer_type());
 
     const int64_t nshards = ndata/ndata_shard;
@@ -127,8 +157,135 @@ ggml_opt_dataset_t ggml_opt_dataset_init(
     return result;
 }
 
+static void * ggml_opt_map_file(const char * fname, size_t & size) {
+#ifdef _WIN32
+    HANDLE file = CreateFileA(fname, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        return nullptr;
+    }
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+        CloseHandle(file);
+        return nullptr;
+    }
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    CloseHandle(file);
+    if (mapping == nullptr) {
+        return nullptr;
+    }
+    void * addr = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    size = file_size.QuadPart;
+    return addr;
+#else
+    int fd = open(fname, O_RDONLY);
+    if (fd == -1) {
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return nullptr;
+    }
+    void * addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        return nullptr;
+    }
+    // the datapoints are read in a random order
+    posix_madvise(addr, st.st_size, POSIX_MADV_RANDOM);
+    size = st.st_size;
+    return addr;
+#endif
+}
+
+static void ggml_opt_unmap_file(void * addr, size_t size) {
+#ifdef _WIN32
+    GGML_UNUSED(size);
+    UnmapViewOfFile(addr);
+#else
+    munmap(addr, size);
+#endif
+}
+
+ggml_opt_dataset_t ggml_opt_dataset_init_mmap(
+        const char   * fname,
+        enum ggml_type type_data,
+        enum ggml_type type_label,
+        int64_t        ne_datapoint,
+        int64_t        ne_label,
+        size_t         nb_stride,
+        size_t         offs_labels) {
+    GGML_ASSERT(ne_datapoint >  0);
+    GGML_ASSERT(ne_label     >= 0);
+    GGML_ASSERT(nb_stride    >  0);
+
+    size_t size = 0;
+    void * addr = ggml_opt_map_file(fname, size);
+    if (addr == nullptr) {
+        GGML_LOG_ERROR("%s: failed to map %s\n", __func__, fname);
+        return nullptr;
+    }
+
+    const size_t nb_datapoint = ggml_row_size(type_data, ne_datapoint);
+    const size_t nb_label     = ne_label > 0 ? ggml_row_size(type_label, ne_label) : 0;
+    const size_t nb_last      = std::max(nb_datapoint, ne_label > 0 ? offs_labels + nb_label : 0);
+    if (size < nb_last) {
+        GGML_LOG_ERROR("%s: %s is too small for a single datapoint\n", __func__, fname);
+        ggml_opt_unmap_file(addr, size);
+        return nullptr;
+    }
+
+    ggml_opt_dataset_t result = new ggml_opt_dataset;
+    result->ndata        = (size - nb_last)/nb_stride + 1;
+    result->ndata_shard  = 1;
+    result->mapping      = addr;
+    result->mapping_size = size;
+
+    {
+        struct ggml_init_params params = {
+            /*.mem_size   =*/ 2*ggml_tensor_overhead(),
+            /*.mem_buffer =*/ nullptr,
+            /*.no_alloc   =*/ true,
+        };
+        result->ctx = ggml_init(params);
+    }
+
+    // the tensors are views of the mapping with a row stride of nb_stride, the datapoints may overlap
+    result->data = ggml_new_tensor_2d(result->ctx, type_data, ne_datapoint, result->ndata);
+    result->data->nb[1]      = nb_stride;
+    result->data->nb[2]      = nb_stride*result->ndata;
+    result->data->nb[3]      = result->data->nb[2];
+    result->data->data       = addr;
+    result->nbs_data         = nb_datapoint;
+    result->nb_data_stride   = nb_stride;
+
+    if (ne_label > 0) {
+        result->labels = ggml_new_tensor_2d(result->ctx, type_label, ne_label, result->ndata);
+        result->labels->nb[1]    = nb_stride;
+        result->labels->nb[2]    = nb_stride*result->ndata;
+        result->labels->nb[3]    = result->labels->nb[2];
+        result->labels->data     = (char *) addr + offs_labels;
+        result->nbs_labels       = nb_label;
+        result->nb_labels_stride = nb_stride;
+    } else {
+        result->labels = nullptr;
+        result->nbs_labels       = 0;
+        result->nb_labels_stride = 0;
+    }
+
+    result->permutation.resize(result->ndata);
+    for (int64_t i = 0; i < result->ndata; ++i) {
+        result->permutation[i] = i;
+    }
+    return result;
+}
+
 void ggml_opt_dataset_free(ggml_opt_dataset_t dataset) {
     ggml_backend_buffer_free(dataset->buf);
+    if (dataset->mapping) {
+        ggml_opt_unmap_file(dataset->mapping, dataset->mapping_size);
+    }
     ggml_free(dataset->ctx);
     delete dataset;
 }
@@ -179,14 +336,14 @@ void ggml_opt_dataset_get_batch(ggml_opt_dataset_t dataset, struct ggml_tensor *
     for (int64_t ishard_batch = 0; ishard_batch < shards_per_batch; ++ishard_batch) {
         const int64_t ishard = dataset->permutation[ibatch*shards_per_batch + ishard_batch];
 
-        const char * ptr_data = (const char *) dataset->data->data + ishard*dataset->nbs_data;
+        const char * ptr_data = (const char *) dataset->data->data + ishard*dataset->nb_data_stride;
         ggml_backend_tensor_set(data_batch, ptr_data, ishard_batch*dataset->nbs_data, dataset->nbs_data);
 
         if (!labels_batch) {
             continue;
         }
 
-        const char * ptr_labels = (const char *) dataset->labels->data + ishard*dataset->nbs_labels;
+        const char * ptr_labels = (const char *) dataset->labels->data + ishard*dataset->nb_labels_stride;
         ggml_backend_tensor_set(labels_batch, ptr_labels, ishard_batch*dataset->nbs_labels, dataset->nbs_labels);
     }
 }
@@ -202,7 +359,7 @@ void ggml_opt_dataset_get_batch_host(ggml_opt_dataset_t dataset, void * data_bat
     for (int64_t ishard_batch = 0; ishard_batch < shards_per_batch; ++ishard_batch) {
         const int64_t ishard = dataset->permutation[ibatch*shards_per_batch + ishard_batch];
 
-        const char * ptr_data       = (const char *) dataset->data->data + ishard      *dataset->nbs_data;
+        const char * ptr_data       = (const char *) dataset->data->data + ishard      *dataset->nb_data_stride;
         char       * ptr_data_batch = (char       *) data_batch          + ishard_batch*dataset->nbs_data;
         memcpy(ptr_data_batch, ptr_data, dataset->nbs_data);
 
@@ -210,7 +367,7 @@ void ggml_opt_dataset_get_batch_host(ggml_opt_dataset_t dataset, void * data_bat
             continue;
         }
 
-        const char * ptr_labels       = (const char *) dataset->labels->data + ishard      *dataset->nbs_labels;
+        const char * ptr_labels       = (const char *) dataset->labels->data + ishard      *dataset->nb_labels_stride;
         char       * ptr_labels_batch = (char       *) labels_batch          + ishard_batch*dataset->nbs_labels;
         memcpy(ptr_labels_batch, ptr_labels, dataset->nbs_labels);
     }
@@ -249,6 +406,8 @@ struct ggml_opt_params ggml_opt_default_params(
         /*opt_period      =*/ 1,
         /*get_opt_pars    =*/ ggml_opt_get_default_optimizer_params,
         /*get_opt_pars_ud =*/ nullptr,
+        /*loss_scale      =*/ 0.0f,
+        /*loss_scale_win  =*/ 2000,
     };
 }
 
@@ -316,8 +475,9 @@ static void ggml_opt_build(ggml_opt_context_t opt_ctx) {
     GGML_ASSERT(opt_ctx->ctx_compute && "no compute context set, either use static graphs or set one with ggml_opt_prepare_alloc");
     GGML_ASSERT((!opt_ctx->static_graphs || opt_ctx->inputs->data) && "when using static graphs the inputs must be allocated statically");
 
+    // with loss scaling the optimizer step is a separate graph that reads the gradients from the accumulators
     const bool accumulate = opt_ctx->build_type_alloc >= GGML_OPT_BUILD_TYPE_GRAD &&
-        !(opt_ctx->static_graphs && opt_ctx->build_type_alloc == GGML_OPT_BUILD_TYPE_OPT && opt_ctx->opt_period == 1);
+        !(opt_ctx->static_graphs && opt_ctx->build_type_alloc == GGML_OPT_BUILD_TYPE_OPT && opt_ctx->opt_period == 1 && opt_ctx->loss_scale == 0.0f);
 
     ggml_set_input(opt_ctx->inputs);
     ggml_set_output(opt_ctx->outputs);
@@ -339,9 +499,11 @@ static void ggml_opt_build(ggml_opt_context_t opt_ctx) {
         //   - loss (if using static graphs, up to 5 tensors)
         //   - pred (if using static graphs)
         //   - ncorrect (if using static graphs, 2 tensors).
+        //   - grad_sum (if using static graphs and loss scaling, 2 tensors per param).
         constexpr size_t n_loss = 1;
         const size_t tensors_per_param = (accumulate ? 1 : 0) +
-            (opt_ctx->build_type_alloc == GGML_OPT_BUILD_TYPE_OPT ? 2 : 0);
+            (opt_ctx->build_type_alloc == GGML_OPT_BUILD_TYPE_OPT ? 2 : 0) +
+            (opt_ctx->static_graphs && opt_ctx->loss_scale > 0.0f ? 2 : 0);
         const size_t tensors_const = opt_ctx->static_graphs ? 9 : 0;
         const size_t size_meta = (n_loss + tensors_per_param*n_param + tensors_const) * ggml_tensor_overhead();
         struct ggml_init_params params = {
@@ -478,6 +640,24 @@ static void ggml_opt_build(ggml_opt_context_t opt_ctx) {
     opt_ctx->gb_grad = ggml_graph_dup(opt_ctx->ctx_compute, opt_ctx->gf, /*force_grads =*/ true);
     ggml_build_backward_expand(opt_ctx->ctx_compute, opt_ctx->gb_grad, opt_ctx->grad_accs.data());
 
+    if (opt_ctx->loss_scale > 0.0f) {
+        // a single inf/NaN in the gradients makes their sum inf/NaN
+        opt_ctx->grad_sum = nullptr;
+        for (int i = 0; i < opt_ctx->gf->n_nodes; ++i) {
+            struct ggml_tensor * node = opt_ctx->gb_grad->nodes[i];
+            struct ggml_tensor * grad = ggml_graph_get_grad(opt_ctx->gb_grad, node);
+            if (!grad || !(node->flags & GGML_TENSOR_FLAG_PARAM)) {
+                continue;
+            }
+            struct ggml_tensor * sum = ggml_sum(ctx_results, grad);
+            opt_ctx->grad_sum = opt_ctx->grad_sum ? ggml_add(ctx_results, opt_ctx->grad_sum, sum) : sum;
+        }
+        GGML_ASSERT(opt_ctx->grad_sum);
+        ggml_set_name(opt_ctx->grad_sum, "grad_sum");
+        ggml_set_output(opt_ctx->grad_sum);
+        ggml_build_forward_expand(opt_ctx->gb_grad, opt_ctx->grad_sum);
+    }
+
     if (opt_ctx->buf_static) {
         if (opt_ctx->build_type == GGML_OPT_BUILD_TYPE_GRAD) {
             return;
@@ -534,8 +714,12 @@ ggml_opt_context_t ggml_opt_init(struct ggml_opt_params params) {
     result->opt_period       = params.opt_period;
     result->get_opt_pars     = params.get_opt_pars;
     result->get_opt_pars_ud  = params.get_opt_pars_ud;
+    result->loss_scale        = params.loss_scale;
+    result->loss_scale_window = params.loss_scale_window;
 
     GGML_ASSERT(result->opt_period >= 1);
+    GGML_ASSERT(result->loss_scale >= 0.0f);
+    GGML_ASSERT(result->loss_scale == 0.0f || result->loss_scale_window >= 1);
 
     result->static_graphs = result->ctx_compute;
 
@@ -608,6 +792,10 @@ struct ggml_tensor * ggml_opt_grad_acc(ggml_opt_context_t opt_ctx, struct ggml_t
     return ggml_graph_get_grad_acc(opt_ctx->gb_opt, node);
 }
 
+float ggml_opt_loss_scale(ggml_opt_context_t opt_ctx) {
+    return opt_ctx->loss_scale;
+}
+
 // ====== Optimization Result ======
 
 ggml_opt_result_t ggml_opt_result_init() {
@@ -721,7 +909,8 @@ void ggml_opt_alloc(ggml_opt_context_t opt_ctx, bool backward) {
             graph = opt_ctx->gb_grad;
         } break;
         case GGML_OPT_BUILD_TYPE_OPT: {
-            graph = opt_ctx->gb_opt;
+            // with loss scaling the optimizer step is done by ggml_opt_eval after checking the gradients
+            graph = opt_ctx->loss_scale > 0.0f ? opt_ctx->gb_grad : opt_ctx->gb_opt;
         } break;
     }
     GGML_ASSERT(graph);
@@ -753,9 +942,66 @@ void ggml_opt_alloc(ggml_opt_context_t opt_ctx, bool backward) {
     opt_ctx->eval_ready = true;
 }
 
+// optimizer step with the unscaled gradients if they are finite, then adjust the loss scale and clear the gradients
+static void ggml_opt_step_loss_scaled(ggml_opt_context_t opt_ctx) {
+    float grad_sum;
+    ggml_backend_tensor_get(opt_ctx->grad_sum, &grad_sum, 0, sizeof(float));
+
+    const int n_nodes = opt_ctx->gf->n_nodes;
+
+    if (std::isfinite(grad_sum)) {
+        const size_t graph_size = 8*n_nodes;
+        struct ggml_init_params params = {
+            /*.mem_size   =*/ 2*n_nodes*ggml_tensor_overhead() + ggml_graph_overhead_custom(graph_size, false),
+            /*.mem_buffer =*/ nullptr,
+            /*.no_alloc   =*/ true,
+        };
+        struct ggml_context * ctx = ggml_init(params);
+        struct ggml_cgraph  * gb_step = ggml_new_graph_custom(ctx, graph_size, false);
+
+        for (int i = 0; i < n_nodes; ++i) {
+            struct ggml_tensor * node = opt_ctx->gb_grad->nodes[i];
+            struct ggml_tensor * grad = ggml_graph_get_grad_acc(opt_ctx->gb_grad, node);
+            if (!grad || !(node->flags & GGML_TENSOR_FLAG_PARAM)) {
+                continue;
+            }
+            grad = ggml_scale_inplace(ctx, grad, 1.0f/opt_ctx->loss_scale);
+            ggml_build_forward_expand(gb_step, ggml_opt_step_adamw(ctx, node, grad, opt_ctx->grad_m[i], opt_ctx->grad_v[i], opt_ctx->adamw_params));
+        }
+
+        ggml_backend_sched_reset(opt_ctx->backend_sched);
+        ggml_backend_sched_graph_compute(opt_ctx->backend_sched, gb_step);
+        ggml_backend_sched_reset(opt_ctx->backend_sched);
+        ggml_free(ctx);
+
+        // the allocation of the forward/backward graph was replaced
+        opt_ctx->allocated_graph = nullptr;
+
+        opt_ctx->iter++;
+        if (++opt_ctx->loss_scale_steps >= opt_ctx->loss_scale_window) {
+            opt_ctx->loss_scale      *= 2.0f;
+            opt_ctx->loss_scale_steps = 0;
+        }
+    } else {
+        opt_ctx->loss_scale      *= 0.5f;
+        opt_ctx->loss_scale_steps = 0;
+        GGML_LOG_DEBUG("%s: inf/NaN gradients, skipping the step, loss scale = %g\n", __func__, opt_ctx->loss_scale);
+    }
+
+    for (int i = 0; i < n_nodes; ++i) {
+        struct ggml_tensor * node = opt_ctx->gb_grad->nodes[i];
+        if (node->flags & GGML_TENSOR_FLAG_PARAM) {
+            struct ggml_tensor * grad_acc = ggml_graph_get_grad_acc(opt_ctx->gb_grad, node);
+            if (grad_acc) {
+                ggml_set_zero(grad_acc);
+            }
+        }
+    }
+}
+
 void ggml_opt_eval(ggml_opt_context_t opt_ctx, ggml_opt_result_t result) {
     GGML_ASSERT(opt_ctx->eval_ready);
-    if (opt_ctx->allocated_graph == opt_ctx->gb_opt) {
+    if (opt_ctx->build_type == GGML_OPT_BUILD_TYPE_OPT) {
         struct ggml_opt_optimizer_params opt_pars = opt_ctx->get_opt_pars(opt_ctx->get_opt_pars_ud);
 
         GGML_ASSERT(opt_pars.adamw.alpha >  0.0f);
@@ -781,10 +1027,23 @@ void ggml_opt_eval(ggml_opt_context_t opt_ctx, ggml_opt_result_t result) {
         adamw_par_data[6] = beta2h;
     }
 
+    if (opt_ctx->loss_scale > 0.0f && opt_ctx->build_type != GGML_OPT_BUILD_TYPE_FORWARD) {
+        // the gradient of the loss, reset to 1 with the other gradients by ggml_graph_reset
+        const float scale = opt_ctx->loss_scale;
+        ggml_backend_tensor_set(ggml_graph_get_grad_acc(opt_ctx->gb_grad, opt_ctx->loss), &scale, 0, sizeof(float));
+    }
+
     ggml_backend_sched_graph_compute(opt_ctx->backend_sched, opt_ctx->allocated_graph_copy);
-    opt_ctx->iter += opt_ctx->allocated_graph == opt_ctx->gb_opt;
     opt_ctx->opt_i = (opt_ctx->opt_i + 1) % opt_ctx->opt_period;
 
+    if (opt_ctx->build_type == GGML_OPT_BUILD_TYPE_OPT) {
+        if (opt_ctx->loss_scale > 0.0f) {
+            ggml_opt_step_loss_scaled(opt_ctx);
+        } else {
+            opt_ctx->iter++;
+        }
+    }
+
     if (!opt_ctx->static_graphs) {
         opt_ctx->gf                   = nullptr;
         opt_ctx->gb_grad              = nullptr;
@@ -2,12 +2,16 @@
 #include "ggml-impl.h"
 #include "ggml-backend-impl.h"
 #include "ggml-cpp.h"
+#include "gguf.h"
 
 #include <cinttypes>
+#include <cmath>
+#include <cstdlib>
 #include <string>
 #include <vector>
 #include <memory>
 #include <mutex>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 #ifdef _WIN32
@@ -39,9 +43,26 @@ using ssize_t = __int64;
 typedef int sockfd_t;
 #endif
 
+// a response the client is still owed by a command it has already queued
+struct rpc_pending_rsp {
+    void            * data;
+    size_t            size;
+    enum ggml_status * status; // if set, the response is a graph compute result merged into *status
+    bool              conv;   // the response is | wire_type (4 bytes) | data | of RPC_CMD_GET_TENSOR_CONV
+};
+
 // cross-platform socket
 struct socket_t {
     sockfd_t fd;
+
+    // client-side pipelining state, see rpc_queue_cmd()
+    std::vector<uint8_t>         out_buf;          // coalesced commands not yet written to the socket
+    std::vector<rpc_pending_rsp> pending;          // responses owed, in command order
+    size_t                       pending_size = 0; // total bytes of the pending responses
+    size_t                       n_unacked    = 0; // commands queued after the last one with a response
+    uint8_t                      proto_minor  = 0; // minor protocol version of the server
+    bool                         gguf_files   = true; // the server may have local GGUF files, see RPC_CMD_SET_TENSOR_GGUF
+
     socket_t(sockfd_t fd) : fd(fd) {}
     ~socket_t() {
         GGML_PRINT_DEBUG("[%s] closing socket %d\n", __func__, this->fd);
@@ -96,12 +117,37 @@ enum rpc_cmd {
     RPC_CMD_INIT_TENSOR,
     RPC_CMD_GET_ALLOC_SIZE,
     RPC_CMD_HELLO,
+    RPC_CMD_PUSH_TENSOR,
+    RPC_CMD_SET_TENSOR_CONV,
+    RPC_CMD_GET_TENSOR_CONV,
+    RPC_CMD_PUSH_TENSOR_CONV,
+    RPC_CMD_GET_DEVICE_COUNT,
+    RPC_CMD_SET_DEVICE,
+    RPC_CMD_SET_TENSOR_GGUF,
+    RPC_CMD_SET_PEER,
     RPC_CMD_COUNT,
 };
 
-// Try RPC_CMD_SET_TENSOR_HASH first when data size is larger than this threshold
+// Try RPC_CMD_SET_TENSOR_GGUF and RPC_CMD_SET_TENSOR_HASH first when data size is larger than this threshold
 const size_t HASH_THRESHOLD = 10 * 1024 * 1024;
 
+// RPC_CMD_SET_TENSOR_GGUF checks the data of the local file against the hash of their first bytes
+const size_t RPC_GGUF_HASH_SIZE = 64 * 1024;
+
+// The server reads the data of the local GGUF files in chunks of this size
+const size_t RPC_GGUF_CHUNK = 64 * 1024 * 1024;
+
+// F32 activations of at least this size are sent in the reduced-precision wire type, if any
+const size_t RPC_CONV_MIN = 4 * 1024;
+
+// Commands up to this size are coalesced into a single write on the client side
+const size_t RPC_COALESCE_MAX = 64 * 1024;
+
+// Maximum size of the responses the client lets the server queue up before it reads them back.
+// This must stay below the socket buffers, otherwise the server blocks writing a response while
+// the client blocks writing the next command.
+const size_t RPC_INFLIGHT_MAX = 64 * 1024;
+
 struct rpc_msg_hello_rsp {
     uint8_t major;
     uint8_t minor;
@@ -164,6 +210,18 @@ struct rpc_msg_set_tensor_hash_rsp {
     uint8_t result;
 };
 
+struct rpc_msg_set_tensor_gguf_req {
+    rpc_tensor tensor;  // the data are looked up by the name of the tensor
+    uint64_t offset;
+    uint64_t size;
+    uint64_t hash;      // hash of the first RPC_GGUF_HASH_SIZE bytes of the data
+};
+
+struct rpc_msg_set_tensor_gguf_rsp {
+    uint8_t result;     // the data were loaded from a local file
+    uint8_t available;  // the server has local files
+};
+
 struct rpc_msg_get_tensor_req {
     rpc_tensor tensor;
     uint64_t offset;
@@ -179,6 +237,28 @@ struct rpc_msg_copy_tensor_rsp {
     uint8_t result;
 };
 
+struct rpc_msg_push_tensor_req {
+    rpc_tensor src;
+    rpc_tensor dst;     // tensor on the peer server
+    char endpoint[128]; // endpoint of the peer server
+};
+
+struct rpc_msg_push_tensor_rsp {
+    uint8_t result;
+};
+
+struct rpc_msg_get_tensor_conv_req {
+    rpc_tensor tensor;
+    uint64_t offset;
+    uint64_t size;
+    uint32_t wire_type;
+};
+
+struct rpc_msg_push_tensor_conv_req {
+    rpc_msg_push_tensor_req push;
+    uint32_t wire_type;
+};
+
 struct rpc_msg_graph_compute_rsp {
     uint8_t result;
 };
@@ -187,6 +267,18 @@ struct rpc_msg_get_device_memory_rsp {
     uint64_t free_mem;
     uint64_t total_mem;
 };
+
+struct rpc_msg_get_device_count_rsp {
+    uint32_t device_count;
+};
+
+struct rpc_msg_set_device_req {
+    uint32_t device;
+};
+
+struct rpc_msg_set_device_rsp {
+    uint8_t result;
+};
 #pragma pack(pop)
 
 // RPC data structures
@@ -206,6 +298,7 @@ struct ggml_backend_rpc_buffer_type_context {
 struct ggml_backend_rpc_context {
     std::string endpoint;
     std::string name;
+    enum ggml_status graph_status; // first failure of a pipelined graph compute
 };
 
 struct ggml_backend_rpc_buffer_context {
@@ -386,49 +479,251 @@ static bool parse_endpoint(const std::string & endpoint, std::string & host, int
     return true;
 }
 
-// RPC request : | rpc_cmd (1 byte) | request_size (8 bytes) | request_data (request_size bytes) |
-// No response
-static bool send_rpc_cmd(const std::shared_ptr<socket_t> & sock, enum rpc_cmd cmd, const void * input, size_t input_size) {
-    uint8_t cmd_byte = cmd;
-    if (!send_data(sock->fd, &cmd_byte, sizeof(cmd_byte))) {
+// the devices of a server after the first one are addressed as "host:port/device"
+static bool parse_endpoint(const std::string & endpoint, std::string & host, int & port, uint32_t & device) {
+    size_t pos = endpoint.find('/');
+    device = pos == std::string::npos ? 0 : std::stoul(endpoint.substr(pos + 1));
+    return parse_endpoint(endpoint.substr(0, pos), host, port);
+}
+
+// Reduced-precision wire types for F32 activations
+//
+// GGML_RPC_WIRE_TYPE=f16|bf16|q8_0 makes the client send and receive the F32 tensors that are not
+// weights, e.g. the activations passed between layer splits, in that type when the server supports it.
+// This is lossy, and transfers with values that cannot be represented in the type are sent as F32.
+static ggml_type rpc_wire_type() {
+    static const ggml_type type = [] {
+        const char * env = getenv("GGML_RPC_WIRE_TYPE");
+        if (env == nullptr) {
+            return GGML_TYPE_F32;
+        }
+        for (ggml_type t : { GGML_TYPE_F32, GGML_TYPE_F16, GGML_TYPE_BF16, GGML_TYPE_Q8_0 }) {
+            if (strcmp(env, ggml_type_name(t)) == 0) {
+                return t;
+            }
+        }
+        fprintf(stderr, "Unsupported GGML_RPC_WIRE_TYPE '%s', using f32\n", env);
+        return GGML_TYPE_F32;
+    }();
+    return type;
+}
+
+static bool rpc_wire_type_valid(uint32_t type) {
+    return type == GGML_TYPE_F32 || type == GGML_TYPE_F16 || type == GGML_TYPE_BF16 || type == GGML_TYPE_Q8_0;
+}
+
+// check that size bytes of F32 data can be sent as the wire type
+static bool rpc_wire_encodable(ggml_type type, const float * data, size_t size) {
+    if (size % sizeof(float) != 0) {
         return false;
     }
-    if (!send_data(sock->fd, &input_size, sizeof(input_size))) {
+    const size_t n = size / sizeof(float);
+    if (n % ggml_blck_size(type) != 0) {
         return false;
     }
-    if (!send_data(sock->fd, input, input_size)) {
-        return false;
+    for (size_t i = 0; i < n; i++) {
+        const float x = data[i];
+        if (type == GGML_TYPE_F16  && std::isfinite(x) && std::fabs(x) > 65504.0f) {
+            return false;
+        }
+        if (type == GGML_TYPE_Q8_0 && !std::isfinite(x)) {
+            return false;
+        }
     }
     return true;
 }
 
-// RPC request : | rpc_cmd (1 byte) | request_size (8 bytes) | request_data (request_size bytes) |
-// RPC response: | response_size (8 bytes) | response_data (response_size bytes) |
-static bool send_rpc_cmd(const std::shared_ptr<socket_t> & sock, enum rpc_cmd cmd, const void * input, size_t input_size, void * output, size_t output_size) {
-    if (!send_rpc_cmd(sock, cmd, input, input_size)) {
+// | wire_type (4 bytes) | data | where data are the size bytes of F32 data, converted if possible
+static void rpc_wire_encode(ggml_type type, const float * data, size_t size, std::vector<uint8_t> & output) {
+    if (type != GGML_TYPE_F32 && !rpc_wire_encodable(type, data, size)) {
+        type = GGML_TYPE_F32;
+    }
+    const uint32_t wire_type = type;
+    const size_t n = size / sizeof(float);
+    const size_t off = output.size();
+    const size_t wire_size = type == GGML_TYPE_F32 ? size : ggml_row_size(type, n);
+    output.resize(off + sizeof(wire_type) + wire_size);
+    memcpy(output.data() + off, &wire_type, sizeof(wire_type));
+    if (type == GGML_TYPE_F32) {
+        memcpy(output.data() + off + sizeof(wire_type), data, size);
+    } else {
+        ggml_quantize_chunk(type, data, output.data() + off + sizeof(wire_type), 0, n / ggml_blck_size(type), ggml_blck_size(type), nullptr);
+    }
+}
+
+// decode | wire_type (4 bytes) | data | into size bytes of F32 data
+static bool rpc_wire_decode(const uint8_t * input, size_t input_size, void * data, size_t size) {
+    uint32_t wire_type;
+    if (input_size < sizeof(wire_type) || size % sizeof(float) != 0) {
         return false;
     }
-    // TODO: currently the output_size is always known, do we need support for commands with variable output size?
-    // even if we do, we can skip sending output_size from the server for commands with known output size
-    uint64_t out_size;
-    if (!recv_data(sock->fd, &out_size, sizeof(out_size))) {
+    memcpy(&wire_type, input, sizeof(wire_type));
+    if (!rpc_wire_type_valid(wire_type)) {
         return false;
     }
-    if (out_size != output_size) {
+    const ggml_type type = (ggml_type) wire_type;
+    const size_t n = size / sizeof(float);
+    if (n % ggml_blck_size(type) != 0) {
         return false;
     }
-    if (!recv_data(sock->fd, output, output_size)) {
+    const uint8_t * wire_data = input + sizeof(wire_type);
+    const size_t wire_size = input_size - sizeof(wire_type);
+    if (type == GGML_TYPE_F32) {
+        if (wire_size != size) {
+            return false;
+        }
+        memcpy(data, wire_data, size);
+        return true;
+    }
+    if (wire_size != ggml_row_size(type, n)) {
+        return false;
+    }
+    ggml_get_type_traits(type)->to_float(wire_data, (float *) data, n);
+    return true;
+}
+
+static bool rpc_wire_decode(const std::vector<uint8_t> & input, void * data, size_t size) {
+    return rpc_wire_decode(input.data(), input.size(), data, size);
+}
+
+// serialize a RPC_CMD_SET_TENSOR request, or a RPC_CMD_SET_TENSOR_CONV request if the data are sent in a wire type
+static rpc_cmd rpc_serialize_set_tensor(const rpc_tensor & tensor, uint64_t offset, const void * data, size_t size,
+                                        ggml_type wire_type, std::vector<uint8_t> & output) {
+    const bool conv = wire_type != GGML_TYPE_F32 && tensor.type == GGML_TYPE_F32 && size >= RPC_CONV_MIN &&
+                      rpc_wire_encodable(wire_type, (const float *) data, size);
+    // serialization format: | rpc_tensor | offset (8 bytes) | data (size bytes) |
+    // or with conversion:   | rpc_tensor | offset (8 bytes) | wire_type (4 bytes) | data |
+    output.resize(sizeof(rpc_tensor) + sizeof(offset));
+    memcpy(output.data(), &tensor, sizeof(rpc_tensor));
+    memcpy(output.data() + sizeof(rpc_tensor), &offset, sizeof(offset));
+    if (conv) {
+        rpc_wire_encode(wire_type, (const float *) data, size, output);
+        return RPC_CMD_SET_TENSOR_CONV;
+    }
+    output.resize(output.size() + size);
+    memcpy(output.data() + sizeof(rpc_tensor) + sizeof(offset), data, size);
+    return RPC_CMD_SET_TENSOR;
+}
+
+// The client does not wait for the response of a command before sending the next one. The server
+// handles the commands of a connection in order, so the responses come back in the order of the
+// commands and can be read back later, when the client actually needs one of them.
+//
+// GGML_RPC_NO_PIPELINE=1 restores the old behavior of one round-trip per command.
+static bool rpc_pipeline_enabled() {
+    static const bool enabled = [] {
+        const char * env = getenv("GGML_RPC_NO_PIPELINE");
+        return env == nullptr || atoi(env) == 0;
+    }();
+    return enabled;
+}
+
+static bool rpc_flush(const std::shared_ptr<socket_t> & sock) {
+    if (sock->out_buf.empty()) {
+        return true;
+    }
+    bool status = send_data(sock->fd, sock->out_buf.data(), sock->out_buf.size());
+    sock->out_buf.clear();
+    return status;
+}
+
+// read back all pending responses
+static bool rpc_drain(const std::shared_ptr<socket_t> & sock) {
+    if (!rpc_flush(sock)) {
+        return false;
+    }
+    bool status = true;
+    for (const auto & rsp : sock->pending) {
+        if (!status) {
+            break;
+        }
+        if (rsp.status != nullptr) {
+            rpc_msg_graph_compute_rsp response;
+            status = recv_msg(sock->fd, &response, sizeof(response));
+            if (status && response.result != GGML_STATUS_SUCCESS && *rsp.status == GGML_STATUS_SUCCESS) {
+                *rsp.status = (enum ggml_status)response.result;
+            }
+        } else if (rsp.conv) {
+            std::vector<uint8_t> response;
+            status = recv_msg(sock->fd, response) && rpc_wire_decode(response, rsp.data, rsp.size);
+        } else {
+            status = recv_msg(sock->fd, rsp.data, rsp.size);
+        }
+    }
+    sock->pending.clear();
+    sock->pending_size = 0;
+    return status;
+}
+
+// RPC request : | rpc_cmd (1 byte) | request_size (8 bytes) | request_data (request_size bytes) |
+// Small requests are appended to the socket's output buffer, larger ones are written directly.
+static bool rpc_queue_cmd(const std::shared_ptr<socket_t> & sock, enum rpc_cmd cmd, const void * input, size_t input_size) {
+    if (sock->pending_size > RPC_INFLIGHT_MAX) {
+        if (!rpc_drain(sock)) {
+            return false;
+        }
+    }
+    sock->n_unacked++;
+    uint8_t cmd_byte = cmd;
+    uint64_t size = input_size;
+    const size_t msg_size = sizeof(cmd_byte) + sizeof(size) + input_size;
+    if (sock->out_buf.size() + msg_size > RPC_COALESCE_MAX) {
+        if (!rpc_flush(sock)) {
+            return false;
+        }
+    }
+    if (msg_size > RPC_COALESCE_MAX) {
+        return send_data(sock->fd, &cmd_byte, sizeof(cmd_byte)) &&
+               send_data(sock->fd, &size, sizeof(size)) &&
+               send_data(sock->fd, input, input_size);
+    }
+    auto & buf = sock->out_buf;
+    const size_t off = buf.size();
+    buf.resize(off + msg_size);
+    memcpy(buf.data() + off, &cmd_byte, sizeof(cmd_byte));
+    memcpy(buf.data() + off + sizeof(cmd_byte), &size, sizeof(size));
+    if (input_size > 0) {
+        memcpy(buf.data() + off + sizeof(cmd_byte) + sizeof(size), input, input_size);
+    }
+    return true;
+}
+
+// queue a command and the response it is owed, without waiting for it
+static bool rpc_queue_cmd(const std::shared_ptr<socket_t> & sock, enum rpc_cmd cmd, const void * input, size_t input_size,
+                          void * output, size_t output_size, enum ggml_status * status = nullptr) {
+    if (!rpc_queue_cmd(sock, cmd, input, input_size)) {
         return false;
     }
+    sock->pending.push_back({output, output_size, status, false});
+    sock->pending_size += output_size;
+    sock->n_unacked = 0;
     return true;
 }
 
+// No response
+static bool send_rpc_cmd(const std::shared_ptr<socket_t> & sock, enum rpc_cmd cmd, const void * input, size_t input_size) {
+    if (!rpc_queue_cmd(sock, cmd, input, input_size)) {
+        return false;
+    }
+    return rpc_pipeline_enabled() || rpc_flush(sock);
+}
+
+// RPC response: | response_size (8 bytes) | response_data (response_size bytes) |
+// Blocks until the response is received, which also completes all the commands queued before it.
+static bool send_rpc_cmd(const std::shared_ptr<socket_t> & sock, enum rpc_cmd cmd, const void * input, size_t input_size, void * output, size_t output_size) {
+    if (!rpc_queue_cmd(sock, cmd, input, input_size, output, output_size)) {
+        return false;
+    }
+    return rpc_drain(sock);
+}
+
 // RPC client-side implementation
 
 static bool check_server_version(const std::shared_ptr<socket_t> & sock) {
     rpc_msg_hello_rsp response;
     bool status = send_rpc_cmd(sock, RPC_CMD_HELLO, nullptr, 0, &response, sizeof(response));
     RPC_STATUS_ASSERT(status);
+    sock->proto_minor = response.minor;
     if (response.major != RPC_PROTO_MAJOR_VERSION || response.minor > RPC_PROTO_MINOR_VERSION) {
         fprintf(stderr, "RPC server version mismatch: %d.%d.%d\n", response.major, response.minor, response.patch);
         return false;
@@ -439,6 +734,24 @@ static bool check_server_version(const std::shared_ptr<socket_t> & sock) {
     return true;
 }
 
+// bind a connection to a device of the server
+static bool rpc_set_device(const std::shared_ptr<socket_t> & sock, uint32_t device) {
+    if (device == 0) {
+        return true;
+    }
+    if (sock->proto_minor < 3) {
+        fprintf(stderr, "RPC server does not support multiple devices\n");
+        return false;
+    }
+    rpc_msg_set_device_req request = {device};
+    rpc_msg_set_device_rsp response;
+    if (!send_rpc_cmd(sock, RPC_CMD_SET_DEVICE, &request, sizeof(request), &response, sizeof(response)) || !response.result) {
+        fprintf(stderr, "Failed to select RPC device %u\n", device);
+        return false;
+    }
+    return true;
+}
+
 static std::shared_ptr<socket_t> get_socket(const std::string & endpoint) {
     static std::mutex mutex;
     std::lock_guard<std::mutex> lock(mutex);
@@ -453,7 +766,8 @@ static std::shared_ptr<socket_t> get_socket(const std::string & endpoint) {
     }
     std::string host;
     int port;
-    if (!parse_endpoint(endpoint, host, port)) {
+    uint32_t device;
+    if (!parse_endpoint(endpoint, host, port, device)) {
         return nullptr;
     }
 #ifdef _WIN32
@@ -475,6 +789,9 @@ static std::shared_ptr<socket_t> get_socket(const std::string & endpoint) {
     if (!check_server_version(sock)) {
         return nullptr;
     }
+    if (!rpc_set_device(sock, device)) {
+        return nullptr;
+    }
     GGML_PRINT_DEBUG("[%s] connected to %s, sockfd=%d\n", __func__, endpoint.c_str(), sock->fd);
     sockets[endpoint] = sock;
     return sock;
@@ -553,9 +870,33 @@ static enum ggml_status ggml_backend_rpc_buffer_init_tensor(ggml_backend_buffer_
     return GGML_STATUS_SUCCESS;
 }
 
+// wire type for the activations of a buffer
+static ggml_type rpc_buffer_wire_type(ggml_backend_buffer_t buffer) {
+    ggml_backend_rpc_buffer_context * ctx = (ggml_backend_rpc_buffer_context *)buffer->context;
+    if (ctx->sock->proto_minor < 2 || ggml_backend_buffer_get_usage(buffer) == GGML_BACKEND_BUFFER_USAGE_WEIGHTS) {
+        return GGML_TYPE_F32;
+    }
+    return rpc_wire_type();
+}
+
 static void ggml_backend_rpc_buffer_set_tensor(ggml_backend_buffer_t buffer, ggml_tensor * tensor, const void * data, size_t offset, size_t size) {
     ggml_backend_rpc_buffer_context * ctx = (ggml_backend_rpc_buffer_context *)buffer->context;
     rpc_tensor rpc_tensor = serialize_tensor(tensor);
+    if (size > HASH_THRESHOLD && ctx->sock->proto_minor >= 4 && ctx->sock->gguf_files && tensor->name[0] != '\0') {
+        rpc_msg_set_tensor_gguf_req request;
+        request.tensor = rpc_tensor;
+        request.offset = offset;
+        request.size = size;
+        request.hash = fnv_hash((const uint8_t*)data, std::min(size, RPC_GGUF_HASH_SIZE));
+        rpc_msg_set_tensor_gguf_rsp response;
+        bool status = send_rpc_cmd(ctx->sock, RPC_CMD_SET_TENSOR_GGUF, &request, sizeof(request), &response, sizeof(response));
+        RPC_STATUS_ASSERT(status);
+        ctx->sock->gguf_files = response.available;
+        if (response.result) {
+            // the server has loaded the data from its local copy of the model
+            return;
+        }
+    }
     if (size > HASH_THRESHOLD) {
         rpc_msg_set_tensor_hash_req request;
         request.tensor = rpc_tensor;
@@ -569,23 +910,41 @@ static void ggml_backend_rpc_buffer_set_tensor(ggml_backend_buffer_t buffer, ggm
             return;
         }
     }
-    // input serialization format: | rpc_tensor | offset (8 bytes) | data (size bytes)
-    size_t input_size = sizeof(rpc_tensor) + sizeof(uint64_t) + size;
-    std::vector<uint8_t> input(input_size, 0);
-    memcpy(input.data(), &rpc_tensor, sizeof(rpc_tensor));
-    memcpy(input.data() + sizeof(rpc_tensor), &offset, sizeof(offset));
-    memcpy(input.data() + sizeof(rpc_tensor) + sizeof(offset), data, size);
-    bool status = send_rpc_cmd(ctx->sock, RPC_CMD_SET_TENSOR, input.data(), input.size());
+    std::vector<uint8_t> input;
+    rpc_cmd cmd = rpc_serialize_set_tensor(rpc_tensor, offset, data, size, rpc_buffer_wire_type(buffer), input);
+    bool status = send_rpc_cmd(ctx->sock, cmd, input.data(), input.size());
     RPC_STATUS_ASSERT(status);
 }
 
-static void ggml_backend_rpc_buffer_get_tensor(ggml_backend_buffer_t buffer, const ggml_tensor * tensor, void * data, size_t offset, size_t size) {
+// queue a get_tensor request, the data is received on the next drain of the socket
+static bool rpc_queue_get_tensor(ggml_backend_buffer_t buffer, const ggml_tensor * tensor, void * data, size_t offset, size_t size) {
     ggml_backend_rpc_buffer_context * ctx = (ggml_backend_rpc_buffer_context *)buffer->context;
+    const ggml_type wire_type = rpc_buffer_wire_type(buffer);
+    if (wire_type != GGML_TYPE_F32 && tensor->type == GGML_TYPE_F32 && size >= RPC_CONV_MIN &&
+        size % (sizeof(float) * ggml_blck_size(wire_type)) == 0) {
+        rpc_msg_get_tensor_conv_req request;
+        request.tensor = serialize_tensor(tensor);
+        request.offset = offset;
+        request.size = size;
+        request.wire_type = wire_type;
+        if (!rpc_queue_cmd(ctx->sock, RPC_CMD_GET_TENSOR_CONV, &request, sizeof(request))) {
+            return false;
+        }
+        ctx->sock->pending.push_back({data, size, nullptr, true});
+        ctx->sock->pending_size += size;
+        ctx->sock->n_unacked = 0;
+        return true;
+    }
     rpc_msg_get_tensor_req request;
     request.tensor = serialize_tensor(tensor);
     request.offset = offset;
     request.size = size;
-    bool status = send_rpc_cmd(ctx->sock, RPC_CMD_GET_TENSOR, &request, sizeof(request), data, size);
+    return rpc_queue_cmd(ctx->sock, RPC_CMD_GET_TENSOR, &request, sizeof(request), data, size);
+}
+
+static void ggml_backend_rpc_buffer_get_tensor(ggml_backend_buffer_t buffer, const ggml_tensor * tensor, void * data, size_t offset, size_t size) {
+    ggml_backend_rpc_buffer_context * ctx = (ggml_backend_rpc_buffer_context *)buffer->context;
+    bool status = rpc_queue_get_tensor(buffer, tensor, data, offset, size) && rpc_drain(ctx->sock);
     RPC_STATUS_ASSERT(status);
 }
 
@@ -711,13 +1070,93 @@ static const char * ggml_backend_rpc_name(ggml_backend_t backend) {
 
 static void ggml_backend_rpc_free(ggml_backend_t backend) {
     ggml_backend_rpc_context * rpc_ctx = (ggml_backend_rpc_context *)backend->context;
+    // pending graph compute results refer to the context
+    auto sock = get_socket(rpc_ctx->endpoint);
+    if (sock != nullptr) {
+        bool status = rpc_drain(sock);
+        RPC_STATUS_ASSERT(status);
+    }
     delete rpc_ctx;
     delete backend;
 }
 
 static void ggml_backend_rpc_synchronize(ggml_backend_t backend) {
+    ggml_backend_rpc_context * rpc_ctx = (ggml_backend_rpc_context *)backend->context;
+    auto sock = get_socket(rpc_ctx->endpoint);
+    bool status = rpc_drain(sock);
+    RPC_STATUS_ASSERT(status);
+    if (rpc_ctx->graph_status != GGML_STATUS_SUCCESS) {
+        GGML_LOG_ERROR("%s: graph compute failed on %s: %s\n", __func__, rpc_ctx->endpoint.c_str(), ggml_status_to_string(rpc_ctx->graph_status));
+    }
+}
+
+static void ggml_backend_rpc_set_tensor_async(ggml_backend_t backend, ggml_tensor * tensor, const void * data, size_t offset, size_t size) {
+    // set_tensor does not wait for the server already
+    ggml_backend_rpc_buffer_set_tensor(tensor->buffer, tensor, data, offset, size);
+
+    GGML_UNUSED(backend);
+}
+
+static void ggml_backend_rpc_get_tensor_async(ggml_backend_t backend, const ggml_tensor * tensor, void * data, size_t offset, size_t size) {
+    // the data is received on the next synchronize
+    bool status = rpc_queue_get_tensor(tensor->buffer, tensor, data, offset, size);
+    RPC_STATUS_ASSERT(status);
+
     GGML_UNUSED(backend);
-    // this is no-op because we don't have any async operations
+}
+
+static bool ggml_backend_buffer_is_rpc(ggml_backend_buffer_t buffer) {
+    return buffer != nullptr && buffer->buft->iface.get_name == ggml_backend_rpc_buffer_type_name;
+}
+
+// make sure the server has completed all the commands queued so far
+static bool rpc_barrier(const std::shared_ptr<socket_t> & sock) {
+    if (sock->n_unacked == 0) {
+        return rpc_drain(sock);
+    }
+    // any command with a response will do, the server handles the commands in order
+    rpc_msg_get_alignment_rsp response;
+    return send_rpc_cmd(sock, RPC_CMD_GET_ALIGNMENT, nullptr, 0, &response, sizeof(response));
+}
+
+static bool ggml_backend_rpc_cpy_tensor_async(ggml_backend_t backend_src, ggml_backend_t backend_dst, const ggml_tensor * src, ggml_tensor * dst) {
+    // copies between two RPC servers are pushed by the source server directly to the destination,
+    // instead of going through the client
+    if (!ggml_backend_is_rpc(backend_src) || !ggml_backend_buffer_is_rpc(src->buffer) || !ggml_backend_buffer_is_rpc(dst->buffer)) {
+        return false;
+    }
+    ggml_backend_rpc_buffer_context * src_ctx = (ggml_backend_rpc_buffer_context *)src->buffer->context;
+    ggml_backend_rpc_buffer_context * dst_ctx = (ggml_backend_rpc_buffer_context *)dst->buffer->context;
+    // the destination accepts the writes of the peer connections since version 2.5.0
+    if (src_ctx->sock == dst_ctx->sock || src_ctx->sock->proto_minor < 1 || dst_ctx->sock->proto_minor < 5) {
+        return false;
+    }
+    ggml_backend_rpc_buffer_type_context * dst_buft_ctx = (ggml_backend_rpc_buffer_type_context *)dst->buffer->buft->context;
+    rpc_msg_push_tensor_req request;
+    if (dst_buft_ctx->endpoint.size() >= sizeof(request.endpoint)) {
+        return false;
+    }
+    request.src = serialize_tensor(src);
+    request.dst = serialize_tensor(dst);
+    memset(request.endpoint, 0, sizeof(request.endpoint));
+    memcpy(request.endpoint, dst_buft_ctx->endpoint.c_str(), dst_buft_ctx->endpoint.size());
+
+    // the push does not go through the destination connection, the destination must be idle
+    bool status = rpc_barrier(dst_ctx->sock);
+    RPC_STATUS_ASSERT(status);
+    // while the push is ordered after the commands already queued on the source
+    rpc_msg_push_tensor_rsp response;
+    const ggml_type wire_type = rpc_buffer_wire_type(dst->buffer);
+    if (wire_type != GGML_TYPE_F32 && src_ctx->sock->proto_minor >= 2) {
+        rpc_msg_push_tensor_conv_req request_conv = { request, (uint32_t) wire_type };
+        status = send_rpc_cmd(src_ctx->sock, RPC_CMD_PUSH_TENSOR_CONV, &request_conv, sizeof(request_conv), &response, sizeof(response));
+    } else {
+        status = send_rpc_cmd(src_ctx->sock, RPC_CMD_PUSH_TENSOR, &request, sizeof(request), &response, sizeof(response));
+    }
+    RPC_STATUS_ASSERT(status);
+    return response.result;
+
+    GGML_UNUSED(backend_dst);
 }
 
 static void add_tensor(ggml_tensor * tensor, std::vector<rpc_tensor> & tensors, std::unordered_set<ggml_tensor*> & visited) {
@@ -761,19 +1200,31 @@ static enum ggml_status ggml_backend_rpc_graph_compute(ggml_backend_t backend, g
     ggml_backend_rpc_context * rpc_ctx = (ggml_backend_rpc_context *)backend->context;
     std::vector<uint8_t> input;
     serialize_graph(cgraph, input);
-    rpc_msg_graph_compute_rsp response;
     auto sock = get_socket(rpc_ctx->endpoint);
-    bool status = send_rpc_cmd(sock, RPC_CMD_GRAPH_COMPUTE, input.data(), input.size(), &response, sizeof(response));
+    if (!rpc_pipeline_enabled()) {
+        rpc_msg_graph_compute_rsp response;
+        bool status = send_rpc_cmd(sock, RPC_CMD_GRAPH_COMPUTE, input.data(), input.size(), &response, sizeof(response));
+        RPC_STATUS_ASSERT(status);
+        return (enum ggml_status)response.result;
+    }
+    // the result of a pipelined graph compute is only known once it has been read back,
+    // a failure is reported by the next graph compute
+    enum ggml_status prev = rpc_ctx->graph_status;
+    if (prev != GGML_STATUS_SUCCESS) {
+        rpc_ctx->graph_status = GGML_STATUS_SUCCESS;
+        return prev;
+    }
+    bool status = rpc_queue_cmd(sock, RPC_CMD_GRAPH_COMPUTE, input.data(), input.size(), nullptr, sizeof(rpc_msg_graph_compute_rsp), &rpc_ctx->graph_status);
     RPC_STATUS_ASSERT(status);
-    return (enum ggml_status)response.result;
+    return GGML_STATUS_SUCCESS;
 }
 
 static ggml_backend_i ggml_backend_rpc_interface = {
     /* .get_name                = */ ggml_backend_rpc_name,
     /* .free                    = */ ggml_backend_rpc_free,
-    /* .set_tensor_async        = */ NULL,
-    /* .get_tensor_async        = */ NULL,
-    /* .cpy_tensor_async        = */ NULL,
+    /* .set_tensor_async        = */ ggml_backend_rpc_set_tensor_async,
+    /* .get_tensor_async        = */ ggml_backend_rpc_get_tensor_async,
+    /* .cpy_tensor_async        = */ ggml_backend_rpc_cpy_tensor_async,
     /* .synchronize             = */ ggml_backend_rpc_synchronize,
     /* .graph_plan_create       = */ NULL,
     /* .graph_plan_free         = */ NULL,
@@ -818,8 +1269,9 @@ ggml_backend_buffer_type_t ggml_backend_rpc_buffer_type(const char * endpoint) {
 
 ggml_backend_t ggml_backend_rpc_init(const char * endpoint) {
     ggml_backend_rpc_context * ctx = new ggml_backend_rpc_context {
-        /* .endpoint  = */ endpoint,
-        /* .name      = */ "RPC[" + std::string(endpoint) + "]",
+        /* .endpoint     = */ endpoint,
+        /* .name         = */ "RPC[" + std::string(endpoint) + "]",
+        /* .graph_status = */ GGML_STATUS_SUCCESS,
     };
 
     ggml_backend_t backend = new ggml_backend {
@@ -843,6 +1295,20 @@ static void get_device_memory(const std::shared_ptr<socket_t> & sock, size_t * f
     *total = response.total_mem;
 }
 
+size_t ggml_backend_rpc_get_device_count(const char * endpoint) {
+    auto sock = get_socket(endpoint);
+    if (sock == nullptr) {
+        return 0;
+    }
+    if (sock->proto_minor < 3) {
+        return 1;
+    }
+    rpc_msg_get_device_count_rsp response;
+    bool status = send_rpc_cmd(sock, RPC_CMD_GET_DEVICE_COUNT, nullptr, 0, &response, sizeof(response));
+    RPC_STATUS_ASSERT(status);
+    return response.device_count;
+}
+
 void ggml_backend_rpc_get_device_memory(const char * endpoint, size_t * free, size_t * total) {
     auto sock = get_socket(endpoint);
     if (sock == nullptr) {
@@ -855,13 +1321,38 @@ void ggml_backend_rpc_get_device_memory(const char * endpoint, size_t * free, si
 
 // RPC server-side implementation
 
+struct rpc_server_device {
+    ggml_backend_t backend;
+    size_t free_mem;
+    size_t total_mem;
+    std::mutex mutex; // the connections are handled concurrently, their commands are serialized per device
+};
+
+// buffers of all the connections and their device, so that peer servers can push tensors into them
+static std::mutex rpc_server_buffers_mutex;
+static std::unordered_map<ggml_backend_buffer_t, rpc_server_device *> rpc_server_buffers;
+
+// tensors of the GGUF files local to the server, see ggml_backend_rpc_server_add_gguf()
+struct rpc_gguf_tensor {
+    std::string fname;
+    size_t      offs; // offset of the data in the file
+    size_t      size;
+    ggml_type   type;
+    int64_t     ne[GGML_MAX_DIMS];
+};
+
+static std::mutex rpc_gguf_mutex;
+static std::unordered_map<std::string, rpc_gguf_tensor> rpc_gguf_tensors;
+
 class rpc_server {
 public:
-    rpc_server(ggml_backend_t backend, const char * cache_dir)
-        : backend(backend), cache_dir(cache_dir) {
+    rpc_server(const std::vector<rpc_server_device *> & devices, const char * cache_dir)
+        : devices(devices), device(devices[0]), backend(devices[0]->backend), cache_dir(cache_dir) {
     }
     ~rpc_server();
 
+    std::mutex & get_mutex() { return device->mutex; }
+
     void hello(rpc_msg_hello_rsp & response);
     void alloc_buffer(const rpc_msg_alloc_buffer_req & request, rpc_msg_alloc_buffer_rsp & response);
     void get_alignment(rpc_msg_get_alignment_rsp & response);
@@ -871,26 +1362,61 @@ public:
     bool buffer_clear(const rpc_msg_buffer_clear_req & request);
     bool set_tensor(const std::vector<uint8_t> & input);
     bool set_tensor_hash(const rpc_msg_set_tensor_hash_req & request, rpc_msg_set_tensor_hash_rsp & response);
+    bool set_tensor_gguf(const rpc_msg_set_tensor_gguf_req & request, rpc_msg_set_tensor_gguf_rsp & response);
     bool get_tensor(const rpc_msg_get_tensor_req & request, std::vector<uint8_t> & response);
     bool copy_tensor(const rpc_msg_copy_tensor_req & request, rpc_msg_copy_tensor_rsp & response);
     bool graph_compute(const std::vector<uint8_t> & input, rpc_msg_graph_compute_rsp & response);
     bool init_tensor(const rpc_msg_init_tensor_req & request);
     bool get_alloc_size(const rpc_msg_get_alloc_size_req & request, rpc_msg_get_alloc_size_rsp & response);
+    bool get_push_data(const rpc_msg_push_tensor_req & request, std::vector<uint8_t> & data);
+    bool set_tensor_conv(const std::vector<uint8_t> & input);
+    bool get_tensor_conv(const rpc_msg_get_tensor_conv_req & request, std::vector<uint8_t> & response);
+    void get_device_count(rpc_msg_get_device_count_rsp & response);
+    void set_device(const rpc_msg_set_device_req & request, rpc_msg_set_device_rsp & response);
+    void get_device_memory(rpc_msg_get_device_memory_rsp & response);
+    void set_peer();
 
 private:
     bool get_cached_file(uint64_t hash, std::vector<uint8_t> & data);
-    ggml_tensor * deserialize_tensor(struct ggml_context * ctx, const rpc_tensor * tensor);
+    // tensors in the buffers of other connections of the same device are accepted only for the writes of peer connections
+    ggml_tensor * deserialize_tensor(struct ggml_context * ctx, const rpc_tensor * tensor, bool allow_foreign = false);
     ggml_tensor * create_node(uint64_t id,
                               struct ggml_context * ctx,
                               const std::unordered_map<uint64_t, const rpc_tensor*> & tensor_ptrs,
                               std::unordered_map<uint64_t, struct ggml_tensor*> & tensor_map);
 
 
+    const std::vector<rpc_server_device *> & devices;
+    rpc_server_device * device;
     ggml_backend_t backend;
     const char * cache_dir;
     std::unordered_set<ggml_backend_buffer_t> buffers;
+    // the connection is used by a peer server to push tensors, see rpc_push_to_peer()
+    bool peer = false;
 };
 
+void rpc_server::get_device_count(rpc_msg_get_device_count_rsp & response) {
+    response.device_count = devices.size();
+}
+
+void rpc_server::set_device(const rpc_msg_set_device_req & request, rpc_msg_set_device_rsp & response) {
+    // the buffers of a connection belong to its device
+    response.result = request.device < devices.size() && buffers.empty();
+    if (response.result) {
+        device  = devices[request.device];
+        backend = device->backend;
+    }
+}
+
+void rpc_server::get_device_memory(rpc_msg_get_device_memory_rsp & response) {
+    response.free_mem  = device->free_mem;
+    response.total_mem = device->total_mem;
+}
+
+void rpc_server::set_peer() {
+    peer = true;
+}
+
 void rpc_server::hello(rpc_msg_hello_rsp & response) {
     response.major = RPC_PROTO_MAJOR_VERSION;
     response.minor = RPC_PROTO_MINOR_VERSION;
@@ -938,6 +1464,8 @@ void rpc_server::alloc_buffer(const rpc_msg_alloc_buffer_req & request, rpc_msg_
         response.remote_size = buffer->size;
         GGML_PRINT_DEBUG("[%s] size: %" PRIu64 " -> remote_ptr: %" PRIx64 ", remote_size: %" PRIu64 "\n", __func__, request.size, response.remote_ptr, response.remote_size);
         buffers.insert(buffer);
+        std::lock_guard<std::mutex> lock(rpc_server_buffers_mutex);
+        rpc_server_buffers[buffer] = device;
     } else {
         GGML_LOG_ERROR("[%s] size: %" PRIu64 " -> failed\n", __func__, request.size);
     }
@@ -978,6 +1506,8 @@ bool rpc_server::free_buffer(const rpc_msg_free_buffer_req & request) {
     }
     ggml_backend_buffer_free(buffer);
     buffers.erase(buffer);
+    std::lock_guard<std::mutex> lock(rpc_server_buffers_mutex);
+    rpc_server_buffers.erase(buffer);
     return true;
 }
 
@@ -992,7 +1522,7 @@ bool rpc_server::buffer_clear(const rpc_msg_buffer_clear_req & request) {
     return true;
 }
 
-ggml_tensor * rpc_server::deserialize_tensor(struct ggml_context * ctx, const rpc_tensor * tensor) {
+ggml_tensor * rpc_server::deserialize_tensor(struct ggml_context * ctx, const rpc_tensor * tensor, bool allow_foreign) {
     // Validate tensor type before using it
     if (tensor->type >= GGML_TYPE_COUNT) {
         GGML_LOG_ERROR("[%s] invalid tensor type received: %u\n", __func__, tensor->type);
@@ -1013,7 +1543,13 @@ ggml_tensor * rpc_server::deserialize_tensor(struct ggml_context * ctx, const rp
     }
     result->buffer = reinterpret_cast<ggml_backend_buffer_t>(tensor->buffer);
     if (result->buffer && buffers.find(result->buffer) == buffers.end()) {
-        result->buffer = nullptr;
+        // the connection that owns the buffer frees it under the lock of its device, which is held by this
+        // connection while the command is processed, so the buffer cannot be freed before the write is done
+        std::lock_guard<std::mutex> lock(rpc_server_buffers_mutex);
+        auto it = rpc_server_buffers.find(result->buffer);
+        if (!allow_foreign || it == rpc_server_buffers.end() || it->second != device) {
+            result->buffer = nullptr;
+        }
     }
 
     if (result->buffer) {
@@ -1054,7 +1590,7 @@ bool rpc_server::set_tensor(const std::vector<uint8_t> & input) {
     ggml_context_ptr ctx_ptr { ggml_init(params) };
     GGML_ASSERT(ctx_ptr != nullptr);
     ggml_context * ctx = ctx_ptr.get();
-    ggml_tensor * tensor = deserialize_tensor(ctx, in_tensor);
+    ggml_tensor * tensor = deserialize_tensor(ctx, in_tensor, /* allow_foreign =*/ peer);
     if (tensor == nullptr || tensor->buffer == nullptr) {
         GGML_LOG_ERROR("[%s] error deserializing tensor\n", __func__);
         return false;
@@ -1149,6 +1685,78 @@ bool rpc_server::set_tensor_hash(const rpc_msg_set_tensor_hash_req & request, rp
     return true;
 }
 
+bool rpc_server::set_tensor_gguf(const rpc_msg_set_tensor_gguf_req & request, rpc_msg_set_tensor_gguf_rsp & response) {
+    response.result = 0;
+    rpc_gguf_tensor info;
+    {
+        std::lock_guard<std::mutex> lock(rpc_gguf_mutex);
+        response.available = !rpc_gguf_tensors.empty();
+        auto it = rpc_gguf_tensors.find(std::string(request.tensor.name, strnlen(request.tensor.name, GGML_MAX_NAME)));
+        if (it == rpc_gguf_tensors.end()) {
+            return true;
+        }
+        info = it->second;
+    }
+    struct ggml_init_params params {
+        /*.mem_size   =*/ ggml_tensor_overhead(),
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ true,
+    };
+    ggml_context_ptr ctx_ptr { ggml_init(params) };
+    GGML_ASSERT(ctx_ptr != nullptr);
+    ggml_context * ctx = ctx_ptr.get();
+    ggml_tensor * tensor = deserialize_tensor(ctx, &request.tensor);
+    if (tensor == nullptr || tensor->buffer == nullptr) {
+        GGML_LOG_ERROR("[%s] error deserializing tensor\n", __func__);
+        return false;
+    }
+    GGML_PRINT_DEBUG("[%s] buffer: %p, data: %p, offset: %" PRIu64 ", size: %" PRIu64 ", file: %s\n",
+        __func__, (void*)tensor->buffer, tensor->data, request.offset, request.size, info.fname.c_str());
+
+    // sanitize tensor->data
+    {
+        const size_t p0 = (size_t) ggml_backend_buffer_get_base(tensor->buffer);
+        const size_t p1 = p0 + ggml_backend_buffer_get_size(tensor->buffer);
+
+        if (request.tensor.data + request.offset < p0
+         || request.tensor.data + request.offset >= p1
+         || request.size > (p1 - request.tensor.data - request.offset)) {
+            GGML_LOG_ERROR("[%s] tensor data region (data=0x%" PRIx64 ", offset=%" PRIu64 ", size=%" PRIu64 ") out of buffer bounds [0x%zx, 0x%zx)\n",
+                           __func__, request.tensor.data, request.offset, request.size, p0, p1);
+            return false;
+        }
+    }
+
+    // the tensor of the client must be the one of the local file, otherwise the client sends the data
+    bool same = info.type == tensor->type && request.offset <= info.size && request.size <= info.size - request.offset;
+    for (int i = 0; i < GGML_MAX_DIMS; i++) {
+        same = same && info.ne[i] == tensor->ne[i];
+    }
+    if (!same) {
+        return true;
+    }
+
+    std::ifstream ifs(info.fname, std::ios::binary);
+    std::vector<uint8_t> buf(std::min<size_t>(request.size, RPC_GGUF_CHUNK));
+    for (size_t done = 0; done < request.size; ) {
+        const size_t n = std::min<size_t>(buf.size(), request.size - done);
+        ifs.seekg(info.offs + request.offset + done);
+        ifs.read((char *)buf.data(), n);
+        if (!ifs) {
+            GGML_LOG_ERROR("[%s] failed to read '%s'\n", __func__, info.fname.c_str());
+            return true;
+        }
+        if (done == 0 && fnv_hash(buf.data(), std::min(n, RPC_GGUF_HASH_SIZE)) != request.hash) {
+            // same name and shape, but another model
+            return true;
+        }
+        ggml_backend_tensor_set(tensor, buf.data(), request.offset + done, n);
+        done += n;
+    }
+    response.result = 1;
+    return true;
+}
+
 bool rpc_server::init_tensor(const rpc_msg_init_tensor_req & request) {
     struct ggml_init_params params {
         /*.mem_size   =*/ ggml_tensor_overhead(),
@@ -1365,15 +1973,147 @@ bool rpc_server::graph_compute(const std::vector<uint8_t> & input, rpc_msg_graph
     return true;
 }
 
+bool rpc_server::get_push_data(const rpc_msg_push_tensor_req & request, std::vector<uint8_t> & data) {
+    struct ggml_init_params params {
+        /*.mem_size   =*/ ggml_tensor_overhead(),
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ true,
+    };
+    ggml_context_ptr ctx_ptr { ggml_init(params) };
+    GGML_ASSERT(ctx_ptr != nullptr);
+    ggml_context * ctx = ctx_ptr.get();
+    ggml_tensor * src = deserialize_tensor(ctx, &request.src);
+    if (src == nullptr || src->buffer == nullptr) {
+        GGML_LOG_ERROR("[%s] error deserializing tensor\n", __func__);
+        return false;
+    }
+    if (request.dst.type != request.src.type) {
+        GGML_LOG_ERROR("[%s] src and dst types do not match\n", __func__);
+        return false;
+    }
+    for (int i = 0; i < GGML_MAX_DIMS; i++) {
+        if (request.dst.ne[i] != request.src.ne[i] || request.dst.nb[i] != request.src.nb[i]) {
+            GGML_LOG_ERROR("[%s] src and dst layouts do not match\n", __func__);
+            return false;
+        }
+    }
+    data.resize(ggml_nbytes(src));
+    ggml_backend_tensor_get(src, data.data(), 0, data.size());
+    return true;
+}
+
+bool rpc_server::set_tensor_conv(const std::vector<uint8_t> & input) {
+    // serialization format: | rpc_tensor | offset (8 bytes) | wire_type (4 bytes) | data |
+    const size_t header_size = sizeof(rpc_tensor) + sizeof(uint64_t);
+    if (input.size() < header_size + sizeof(uint32_t)) {
+        return false;
+    }
+    const rpc_tensor * in_tensor = (const rpc_tensor *)input.data();
+    if (in_tensor->type != GGML_TYPE_F32) {
+        GGML_LOG_ERROR("[%s] conversion of non-F32 tensor\n", __func__);
+        return false;
+    }
+    uint32_t wire_type;
+    memcpy(&wire_type, input.data() + header_size, sizeof(wire_type));
+    if (!rpc_wire_type_valid(wire_type) || wire_type == GGML_TYPE_F32) {
+        GGML_LOG_ERROR("[%s] invalid wire type: %u\n", __func__, wire_type);
+        return false;
+    }
+    const size_t wire_size = input.size() - header_size - sizeof(wire_type);
+    const size_t blck_bytes = ggml_row_size((ggml_type) wire_type, ggml_blck_size((ggml_type) wire_type));
+    if (wire_size % blck_bytes != 0) {
+        return false;
+    }
+    const size_t size = wire_size / blck_bytes * ggml_blck_size((ggml_type) wire_type) * sizeof(float);
+    // convert to a RPC_CMD_SET_TENSOR request
+    std::vector<uint8_t> converted;
+    try {
+        converted.resize(header_size + size);
+    } catch (const std::bad_alloc & e) {
+        GGML_LOG_ERROR("[%s] failed to allocate %zu bytes\n", __func__, size);
+        return false;
+    }
+    memcpy(converted.data(), input.data(), header_size);
+    if (!rpc_wire_decode(input.data() + header_size, input.size() - header_size, converted.data() + header_size, size)) {
+        return false;
+    }
+    return set_tensor(converted);
+}
+
+bool rpc_server::get_tensor_conv(const rpc_msg_get_tensor_conv_req & request, std::vector<uint8_t> & response) {
+    if (!rpc_wire_type_valid(request.wire_type) || request.tensor.type != GGML_TYPE_F32) {
+        GGML_LOG_ERROR("[%s] invalid conversion\n", __func__);
+        return false;
+    }
+    rpc_msg_get_tensor_req req;
+    req.tensor = request.tensor;
+    req.offset = request.offset;
+    req.size   = request.size;
+    std::vector<uint8_t> data;
+    if (!get_tensor(req, data)) {
+        return false;
+    }
+    response.clear();
+    rpc_wire_encode((ggml_type) request.wire_type, (const float *) data.data(), data.size(), response);
+    return true;
+}
+
 rpc_server::~rpc_server() {
+    std::lock_guard<std::mutex> lock(device->mutex);
+    std::lock_guard<std::mutex> lock_buffers(rpc_server_buffers_mutex);
     for (auto buffer : buffers) {
         ggml_backend_buffer_free(buffer);
+        rpc_server_buffers.erase(buffer);
     }
 }
 
-static void rpc_serve_client(ggml_backend_t backend, const char * cache_dir,
-                             sockfd_t sockfd, size_t free_mem, size_t total_mem) {
-    rpc_server server(backend, cache_dir);
+// set a tensor on a peer server and wait until it has been applied
+static bool rpc_push_to_peer(const std::string & endpoint, const rpc_tensor & tensor, const std::vector<uint8_t> & data, ggml_type wire_type) {
+    static std::mutex mutex;
+    std::lock_guard<std::mutex> lock(mutex);
+    static std::unordered_map<std::string, std::shared_ptr<socket_t>> peers;
+
+    auto & sock = peers[endpoint];
+    if (sock == nullptr) {
+        std::string host;
+        int port;
+        uint32_t device;
+        if (!parse_endpoint(endpoint, host, port, device)) {
+            return false;
+        }
+        sock = socket_connect(host.c_str(), port);
+        rpc_msg_hello_rsp hello;
+        if (sock == nullptr || !send_rpc_cmd(sock, RPC_CMD_HELLO, nullptr, 0, &hello, sizeof(hello)) ||
+            hello.major != RPC_PROTO_MAJOR_VERSION || hello.minor < 5) {
+            fprintf(stderr, "Failed to connect to peer %s\n", endpoint.c_str());
+            sock = nullptr;
+            return false;
+        }
+        sock->proto_minor = hello.minor;
+        // the connection to the peer takes the lock of the device of the pushed tensor
+        if (!rpc_set_device(sock, device) || !send_rpc_cmd(sock, RPC_CMD_SET_PEER, nullptr, 0, nullptr, 0)) {
+            sock = nullptr;
+            return false;
+        }
+    }
+    if (sock->proto_minor < 2) {
+        wire_type = GGML_TYPE_F32;
+    }
+    std::vector<uint8_t> input;
+    rpc_cmd cmd = rpc_serialize_set_tensor(tensor, 0, data.data(), data.size(), wire_type, input);
+    // the response of GET_ALIGNMENT acknowledges the SET_TENSOR queued before it
+    rpc_msg_get_alignment_rsp response;
+    if (!send_rpc_cmd(sock, cmd, input.data(), input.size()) ||
+        !send_rpc_cmd(sock, RPC_CMD_GET_ALIGNMENT, nullptr, 0, &response, sizeof(response))) {
+        fprintf(stderr, "Failed to push tensor to peer %s\n", endpoint.c_str());
+        sock = nullptr;
+        return false;
+    }
+    return true;
+}
+
+static void rpc_serve_client(const std::vector<rpc_server_device *> & devices, const char * cache_dir, sockfd_t sockfd) {
+    rpc_server server(devices, cache_dir);
     uint8_t cmd;
     if (!recv_data(sockfd, &cmd, 1)) {
         return;
@@ -1400,6 +2140,7 @@ static void rpc_serve_client(ggml_backend_t backend, const char * cache_dir,
             fprintf(stderr, "Unknown command: %d\n", cmd);
             break;
         }
+        std::unique_lock<std::mutex> lock(server.get_mutex());
         switch (cmd) {
             case RPC_CMD_HELLO: {
                 // HELLO command is handled above
@@ -1572,18 +2313,111 @@ static void rpc_serve_client(ggml_backend_t backend, const char * cache_dir,
                 }
                 break;
             }
+            case RPC_CMD_PUSH_TENSOR:
+            case RPC_CMD_PUSH_TENSOR_CONV: {
+                rpc_msg_push_tensor_conv_req request;
+                request.wire_type = GGML_TYPE_F32;
+                bool recv_ok = cmd == RPC_CMD_PUSH_TENSOR ? recv_msg(sockfd, &request.push, sizeof(request.push)) :
+                                                            recv_msg(sockfd, &request, sizeof(request));
+                if (!recv_ok || !rpc_wire_type_valid(request.wire_type)) {
+                    return;
+                }
+                std::vector<uint8_t> data;
+                if (!server.get_push_data(request.push, data)) {
+                    return;
+                }
+                // the peer may be pushing to this server at the same time
+                lock.unlock();
+                request.push.endpoint[sizeof(request.push.endpoint) - 1] = 0;
+                rpc_msg_push_tensor_rsp response;
+                response.result = rpc_push_to_peer(request.push.endpoint, request.push.dst, data, (ggml_type) request.wire_type);
+                if (!send_msg(sockfd, &response, sizeof(response))) {
+                    return;
+                }
+                break;
+            }
+            case RPC_CMD_SET_TENSOR_CONV: {
+                std::vector<uint8_t> input;
+                if (!recv_msg(sockfd, input)) {
+                    return;
+                }
+                if (!server.set_tensor_conv(input)) {
+                    return;
+                }
+                break;
+            }
+            case RPC_CMD_GET_TENSOR_CONV: {
+                rpc_msg_get_tensor_conv_req request;
+                if (!recv_msg(sockfd, &request, sizeof(request))) {
+                    return;
+                }
+                std::vector<uint8_t> response;
+                if (!server.get_tensor_conv(request, response)) {
+                    return;
+                }
+                if (!send_msg(sockfd, response.data(), response.size())) {
+                    return;
+                }
+                break;
+            }
             case RPC_CMD_GET_DEVICE_MEMORY: {
                 if (!recv_msg(sockfd, nullptr, 0)) {
                     return;
                 }
                 rpc_msg_get_device_memory_rsp response;
-                response.free_mem = free_mem;
-                response.total_mem = total_mem;
+                server.get_device_memory(response);
                 if (!send_msg(sockfd, &response, sizeof(response))) {
                     return;
                 }
                 break;
             }
+            case RPC_CMD_GET_DEVICE_COUNT: {
+                if (!recv_msg(sockfd, nullptr, 0)) {
+                    return;
+                }
+                rpc_msg_get_device_count_rsp response;
+                server.get_device_count(response);
+                if (!send_msg(sockfd, &response, sizeof(response))) {
+                    return;
+                }
+                break;
+            }
+            case RPC_CMD_SET_DEVICE: {
+                rpc_msg_set_device_req request;
+                if (!recv_msg(sockfd, &request, sizeof(request))) {
+                    return;
+                }
+                rpc_msg_set_device_rsp response;
+                server.set_device(request, response);
+                if (!send_msg(sockfd, &response, sizeof(response))) {
+                    return;
+                }
+                break;
+            }
+            case RPC_CMD_SET_TENSOR_GGUF: {
+                rpc_msg_set_tensor_gguf_req request;
+                if (!recv_msg(sockfd, &request, sizeof(request))) {
+                    return;
+                }
+                rpc_msg_set_tensor_gguf_rsp response;
+                if (!server.set_tensor_gguf(request, response)) {
+                    return;
+                }
+                if (!send_msg(sockfd, &response, sizeof(response))) {
+                    return;
+                }
+                break;
+            }
+            case RPC_CMD_SET_PEER: {
+                if (!recv_msg(sockfd, nullptr, 0)) {
+                    return;
+                }
+                server.set_peer();
+                if (!send_msg(sockfd, nullptr, 0)) {
+                    return;
+                }
+                break;
+            }
             default: {
                 fprintf(stderr, "Unknown command: %d\n", cmd);
                 return;
@@ -1592,16 +2426,65 @@ static void rpc_serve_client(ggml_backend_t backend, const char * cache_dir,
     }
 }
 
+bool ggml_backend_rpc_server_add_gguf(const char * fname) {
+    ggml_context * ctx_meta = nullptr;
+    struct gguf_init_params params = {
+        /*.no_alloc =*/ true,
+        /*.ctx      =*/ &ctx_meta,
+    };
+    gguf_context_ptr ctx_gguf { gguf_init_from_file(fname, params) };
+    if (!ctx_gguf) {
+        fprintf(stderr, "Failed to read GGUF file '%s'\n", fname);
+        return false;
+    }
+    ggml_context_ptr ctx_meta_ptr { ctx_meta };
+
+    std::lock_guard<std::mutex> lock(rpc_gguf_mutex);
+    const size_t data_offs = gguf_get_data_offset(ctx_gguf.get());
+    for (int64_t i = 0; i < gguf_get_n_tensors(ctx_gguf.get()); i++) {
+        const char * name = gguf_get_tensor_name(ctx_gguf.get(), i);
+        const ggml_tensor * t = ggml_get_tensor(ctx_meta, name);
+        rpc_gguf_tensor info;
+        info.fname = fname;
+        info.offs  = data_offs + gguf_get_tensor_offset(ctx_gguf.get(), i);
+        info.size  = ggml_nbytes(t);
+        info.type  = t->type;
+        for (int j = 0; j < GGML_MAX_DIMS; j++) {
+            info.ne[j] = t->ne[j];
+        }
+        // with the splits of a model the names are unique, keep the first file otherwise
+        rpc_gguf_tensors.emplace(name, std::move(info));
+    }
+    return true;
+}
+
 void ggml_backend_rpc_start_server(ggml_backend_t backend, const char * endpoint,
                                    const char * cache_dir,
                                    size_t free_mem, size_t total_mem) {
+    ggml_backend_rpc_start_server_multi(endpoint, cache_dir, 1, &backend, &free_mem, &total_mem);
+}
+
+void ggml_backend_rpc_start_server_multi(const char * endpoint, const char * cache_dir,
+                                         size_t n_devices, ggml_backend_t * backends,
+                                         const size_t * free_mem, const size_t * total_mem) {
     printf("Starting RPC server v%d.%d.%d\n",
         RPC_PROTO_MAJOR_VERSION,
         RPC_PROTO_MINOR_VERSION,
         RPC_PROTO_PATCH_VERSION);
     printf("  endpoint       : %s\n", endpoint);
     printf("  local cache    : %s\n", cache_dir ? cache_dir : "n/a");
-    printf("  backend memory : %zu MB\n", free_mem / (1024 * 1024));
+    {
+        std::lock_guard<std::mutex> lock(rpc_gguf_mutex);
+        printf("  local tensors  : %zu\n", rpc_gguf_tensors.size());
+    }
+    GGML_ASSERT(n_devices > 0);
+    std::vector<std::unique_ptr<rpc_server_device>> devices_storage;
+    std::vector<rpc_server_device *> devices;
+    for (size_t i = 0; i < n_devices; i++) {
+        printf("  device %zu       : %s, %zu MB\n", i, ggml_backend_name(backends[i]), free_mem[i] / (1024 * 1024));
+        devices_storage.emplace_back(new rpc_server_device { backends[i], free_mem[i], total_mem[i], {} });
+        devices.push_back(devices_storage.back().get());
+    }
 
     std::string host;
     int port;
@@ -1629,11 +2512,15 @@ void ggml_backend_rpc_start_server(ggml_backend_t backend, const char * endpoint
             fprintf(stderr, "Failed to accept client connection\n");
             return;
         }
-        printf("Accepted client connection, free_mem=%zu, total_mem=%zu\n", free_mem, total_mem);
-        fflush(stdout);
-        rpc_serve_client(backend, cache_dir, client_socket->fd, free_mem, total_mem);
-        printf("Client connection closed\n");
+        printf("Accepted client connection\n");
         fflush(stdout);
+        // connections are served concurrently: clients can use different devices in parallel,
+        // and peer servers can push tensors while a client is connected
+        std::thread([=, &devices]() {
+            rpc_serve_client(devices, cache_dir, client_socket->fd);
+            printf("Client connection closed\n");
+            fflush(stdout);
+        }).detach();
     }
 #ifdef _WIN32
     WSACleanup();
@@ -1680,7 +2567,7 @@ static void ggml_backend_rpc_device_get_props(ggml_backend_dev_t dev, struct ggm
     props->type        = ggml_backend_rpc_device_get_type(dev);
     ggml_backend_rpc_device_get_memory(dev, &props->memory_free, &props->memory_total);
     props->caps = {
-        /* .async                 = */ false,
+        /* .async                 = */ true,
         /* .host_buffer           = */ false,
         /* .buffer_from_host_ptr  = */ false,
         /* .events                = */ false,
@@ -1765,6 +2652,15 @@ static void * ggml_backend_rpc_get_proc_address(ggml_backend_reg_t reg, const ch
     if (std::strcmp(name, "ggml_backend_rpc_start_server") == 0) {
         return (void *)ggml_backend_rpc_start_server;
     }
+    if (std::strcmp(name, "ggml_backend_rpc_start_server_multi") == 0) {
+        return (void *)ggml_backend_rpc_start_server_multi;
+    }
+    if (std::strcmp(name, "ggml_backend_rpc_get_device_count") == 0) {
+        return (void *)ggml_backend_rpc_get_device_count;
+    }
+    if (std::strcmp(name, "ggml_backend_rpc_server_add_gguf") == 0) {
+        return (void *)ggml_backend_rpc_server_add_gguf;
+    }
     return NULL;
 
     GGML_UNUSED(reg);
@@ -695,6 +695,14 @@ static const struct ggml_type_traits type_traits[GGML_TYPE_COUNT] = {
         .to_float                 = (ggml_to_float_t) dequantize_row_mxfp4,
         .from_float_ref           = (ggml_from_float_t)quantize_row_mxfp4_ref,
     },
+    [GGML_TYPE_F8_E4M3] = {
+        .type_name                = "f8_e4m3",
+        .blck_size                = QK_F8_E4M3,
+        .type_size                = sizeof(block_f8_e4m3),
+        .is_quantized             = true,
+        .to_float                 = (ggml_to_float_t) dequantize_row_f8_e4m3,
+        .from_float_ref           = (ggml_from_float_t) quantize_row_f8_e4m3_ref,
+    },
     [GGML_TYPE_Q2_K] = {
         .type_name                = "q2_K",
         .blck_size                = QK_K,
@@ -1321,6 +1329,7 @@ enum ggml_type ggml_ftype_to_ggml_type(enum ggml_ftype ftype) {
         case GGML_FTYPE_MOSTLY_Q5_1:          wtype = GGML_TYPE_Q5_1;  break;
         case GGML_FTYPE_MOSTLY_Q8_0:          wtype = GGML_TYPE_Q8_0;  break;
         case GGML_FTYPE_MOSTLY_MXFP4:         wtype = GGML_TYPE_MXFP4; break;
+        case GGML_FTYPE_MOSTLY_F8_E4M3:       wtype = GGML_TYPE_F8_E4M3; break;
         case GGML_FTYPE_MOSTLY_Q2_K:          wtype = GGML_TYPE_Q2_K;  break;
         case GGML_FTYPE_MOSTLY_Q3_K:          wtype = GGML_TYPE_Q3_K;  break;
         case GGML_FTYPE_MOSTLY_Q4_K:          wtype = GGML_TYPE_Q4_K;  break;
@@ -6293,6 +6302,138 @@ void ggml_build_forward_expand(struct ggml_cgraph * cgraph, struct ggml_tensor *
     ggml_build_forward_impl(cgraph, tensor, true);
 }
 
+// activation recomputation (gradient checkpointing)
+
+struct ggml_recompute_state {
+    struct ggml_context * ctx;
+    struct ggml_cgraph  * cgraph;
+
+    bool                * forward; // [hash size] the tensor is a node of the forward pass
+    struct ggml_tensor ** clones;  // [hash size] recomputed copy of the forward node
+};
+
+static bool ggml_recompute_can_clone(const struct ggml_recompute_state * st, const struct ggml_tensor * t) {
+    const size_t ihash = ggml_hash_find(&st->cgraph->visited_hash_set, t);
+    if (ihash == GGML_HASHSET_FULL || !ggml_bitset_get(st->cgraph->visited_hash_set.used, ihash) || !st->forward[ihash]) {
+        return false;
+    }
+
+    if (t->op == GGML_OP_NONE) {
+        return false;
+    }
+
+    if (t->flags & (GGML_TENSOR_FLAG_INPUT | GGML_TENSOR_FLAG_OUTPUT | GGML_TENSOR_FLAG_PARAM | GGML_TENSOR_FLAG_LOSS | GGML_TENSOR_FLAG_CHECKPOINT)) {
+        return false;
+    }
+
+    if (t->view_src) {
+        // views only need to be recomputed if their data is recomputed, in-place ops (e.g. writes to a cache) are never repeated
+        switch (t->op) {
+            case GGML_OP_VIEW:
+            case GGML_OP_RESHAPE:
+            case GGML_OP_PERMUTE:
+            case GGML_OP_TRANSPOSE:
+                return ggml_recompute_can_clone(st, t->view_src);
+            default:
+                return false;
+        }
+    }
+
+    return true;
+}
+
+// returns t, or its recomputed copy if it is an activation of the forward pass
+static struct ggml_tensor * ggml_recompute_clone(struct ggml_recompute_state * st, struct ggml_tensor * t) {
+    if (!ggml_recompute_can_clone(st, t)) {
+        return t;
+    }
+
+    const size_t ihash = ggml_hash_find(&st->cgraph->visited_hash_set, t);
+    if (st->clones[ihash]) {
+        return st->clones[ihash];
+    }
+
+    struct ggml_tensor * view_src = t->view_src ? ggml_recompute_clone(st, t->view_src) : NULL;
+
+    struct ggml_tensor * result = ggml_new_tensor_impl(st->ctx, t->type, GGML_MAX_DIMS, t->ne, view_src, view_src ? t->view_offs : 0);
+
+    memcpy(result->nb,        t->nb,        sizeof(t->nb));
+    memcpy(result->op_params, t->op_params, sizeof(t->op_params));
+
+    result->op    = t->op;
+    result->flags = t->flags;
+
+    for (int j = 0; j < GGML_MAX_SRC; ++j) {
+        result->src[j] = t->src[j] ? ggml_recompute_clone(st, t->src[j]) : NULL;
+    }
+
+    ggml_format_name(result, "%s (recomputed)", t->name);
+
+    st->clones[ihash] = result;
+
+    return result;
+}
+
+// make the nodes of the backward pass use recomputed copies of the activations instead of the forward nodes
+// the copies are inserted in the graph right before their first use, so each one is only alive for a part of the backward pass
+static void ggml_build_backward_recompute(struct ggml_context * ctx, struct ggml_cgraph * cgraph, int n_nodes_f) {
+    const size_t hash_size = cgraph->visited_hash_set.size;
+
+    struct ggml_recompute_state st = {
+        /*.ctx     =*/ ctx,
+        /*.cgraph  =*/ cgraph,
+        /*.forward =*/ calloc(hash_size, sizeof(bool)),
+        /*.clones  =*/ calloc(hash_size, sizeof(struct ggml_tensor *)),
+    };
+
+    for (int i = 0; i < n_nodes_f; ++i) {
+        st.forward[ggml_hash_find(&cgraph->visited_hash_set, cgraph->nodes[i])] = true;
+    }
+
+    const int n_nodes_b = cgraph->n_nodes - n_nodes_f;
+
+    struct ggml_tensor ** nodes_b = malloc(n_nodes_b*sizeof(struct ggml_tensor *));
+    memcpy(nodes_b, cgraph->nodes + n_nodes_f, n_nodes_b*sizeof(struct ggml_tensor *));
+
+    cgraph->n_nodes = n_nodes_f;
+
+    for (int i = 0; i < n_nodes_b; ++i) {
+        struct ggml_tensor * node = nodes_b[i];
+
+        for (int j = 0; j < GGML_MAX_SRC; ++j) {
+            struct ggml_tensor * src = node->src[j];
+            if (!src) {
+                continue;
+            }
+
+            struct ggml_tensor * clone = ggml_recompute_clone(&st, src);
+            if (clone == src) {
+                continue;
+            }
+
+            cgraph->use_counts[ggml_hash_find(&cgraph->visited_hash_set, src)]--;
+            cgraph->use_counts[ggml_visit_parents(cgraph, clone)]++;
+
+            node->src[j] = clone;
+        }
+
+        if (node->view_src) {
+            struct ggml_tensor * clone = ggml_recompute_clone(&st, node->view_src);
+            if (clone != node->view_src) {
+                ggml_visit_parents(cgraph, clone);
+                node->view_src = clone;
+            }
+        }
+
+        GGML_ASSERT(cgraph->n_nodes < cgraph->size);
+        cgraph->nodes[cgraph->n_nodes++] = node;
+    }
+
+    free(nodes_b);
+    free(st.clones);
+    free(st.forward);
+}
+
 void ggml_build_backward_expand(
         struct ggml_context *  ctx,
         struct ggml_cgraph  *  cgraph,
@@ -6357,7 +6498,7 @@ void ggml_build_backward_expand(
             if (!node->src[j] || ignore_src[j] || !grads_needed[ggml_hash_find(&cgraph->visited_hash_set, node->src[j])]) {
                 continue;
             }
-            GGML_ASSERT(node->src[j]->type == GGML_TYPE_F32 || node->src[j]->type == GGML_TYPE_F16);
+            GGML_ASSERT(node->src[j]->type == GGML_TYPE_F32 || node->src[j]->type == GGML_TYPE_F16 || node->src[j]->type == GGML_TYPE_BF16);
             node_needs_grad = true;
             break;
         }
@@ -6390,6 +6531,13 @@ void ggml_build_backward_expand(
     }
 
     free(grads_needed);
+
+    for (int i = 0; i < n_nodes_f; ++i) {
+        if (cgraph->nodes[i]->flags & GGML_TENSOR_FLAG_CHECKPOINT) {
+            ggml_build_backward_recompute(ctx, cgraph, n_nodes_f);
+            break;
+        }
+    }
 }
 
 static void * incr_ptr_aligned(void ** p, size_t size, size_t align) {
@@ -6878,6 +7026,10 @@ void ggml_set_loss(struct ggml_tensor * tensor) {
     tensor->flags |= GGML_TENSOR_FLAG_LOSS;
 }
 
+void ggml_set_checkpoint(struct ggml_tensor * tensor) {
+    tensor->flags |= GGML_TENSOR_FLAG_CHECKPOINT;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 void ggml_quantize_init(enum ggml_type type) {
@@ -6948,6 +7100,7 @@ size_t ggml_quantize_chunk(
         case GGML_TYPE_Q5_1:    result = quantize_q5_1(src + start, (char *) dst + start_row * row_size, nrows, n_per_row, imatrix); break;
         case GGML_TYPE_Q8_0:    result = quantize_q8_0(src + start, (char *) dst + start_row * row_size, nrows, n_per_row, imatrix); break;
         case GGML_TYPE_MXFP4:   result = quantize_mxfp4(src + start, (char *) dst + start_row * row_size, nrows, n_per_row, imatrix); break;
+        case GGML_TYPE_F8_E4M3: result = quantize_f8_e4m3(src + start, (char *) dst + start_row * row_size, nrows, n_per_row, imatrix); break;
         case GGML_TYPE_Q2_K:    result = quantize_q2_K(src + start, (char *) dst + start_row * row_size, nrows, n_per_row, imatrix); break;
         case GGML_TYPE_Q3_K:    result = quantize_q3_K(src + start, (char *) dst + start_row * row_size, nrows, n_per_row, imatrix); break;
         case GGML_TYPE_Q4_K:    result = quantize_q4_K(src + start, (char *) dst + start_row * row_size, nrows, n_per_row, imatrix); break;
@@ -3,6 +3,7 @@
 #include "ggml-impl.h"
 #include "gguf.h"
 
+#include <algorithm>
 #include <cinttypes>
 #include <cstddef>
 #include <cstdint>
@@ -219,16 +220,27 @@ struct gguf_context {
 struct gguf_reader {
     FILE * file;
 
+    // the file is read in blocks and the values are copied out of the buffer
+    // a vocab has hundreds of thousands of strings, reading each of them with fread is slow
+    static constexpr size_t buf_size = 1024*1024;
+
+    std::vector<uint8_t> buf;
+    size_t buf_pos = 0;
+    size_t buf_end = 0;
+
     gguf_reader(FILE * file) : file(file) {}
 
     template <typename T>
-    bool read(T & dst) const {
-        return fread(&dst, 1, sizeof(dst), file) == sizeof(dst);
+    bool read(T & dst) {
+        return read(&dst, sizeof(dst));
     }
 
     template <typename T>
-    bool read(std::vector<T> & dst, const size_t n) const {
+    bool read(std::vector<T> & dst, const size_t n) {
         dst.resize(n);
+        if constexpr (std::is_arithmetic<T>::value && !std::is_same<T, bool>::value) {
+            return read(dst.data(), n*sizeof(T));
+        }
         for (size_t i = 0; i < dst.size(); ++i) {
             if constexpr (std::is_same<T, bool>::value) {
                 bool tmp;
@@ -245,7 +257,7 @@ struct gguf_reader {
         return true;
     }
 
-    bool read(bool & dst) const {
+    bool read(bool & dst) {
         int8_t tmp = -1;
         if (!read(tmp)) {
             return false;
@@ -254,7 +266,7 @@ struct gguf_reader {
         return true;
     }
 
-    bool read(enum ggml_type & dst) const {
+    bool read(enum ggml_type & dst) {
         int32_t tmp = -1;
         if (!read(tmp)) {
             return false;
@@ -263,7 +275,7 @@ struct gguf_reader {
         return true;
     }
 
-    bool read(enum gguf_type & dst) const {
+    bool read(enum gguf_type & dst) {
         int32_t tmp = -1;
         if (!read(tmp)) {
             return false;
@@ -272,17 +284,53 @@ struct gguf_reader {
         return true;
     }
 
-    bool read(std::string & dst) const {
+    bool read(std::string & dst) {
         uint64_t size = -1;
         if (!read(size)) {
             return false;
         }
         dst.resize(size);
-        return fread(dst.data(), 1, dst.length(), file) == dst.length();
+        return read(dst.data(), dst.length());
     }
 
-    bool read(void * dst, const size_t size) const {
-        return fread(dst, 1, size, file) == size;
+    bool read(void * dst, const size_t size) {
+        uint8_t * out = (uint8_t *) dst;
+        size_t    n   = size;
+
+        while (n > 0) {
+            if (buf_pos == buf_end) {
+                // large reads, e.g. the tensor data, bypass the buffer
+                if (n >= buf_size) {
+                    return fread(out, 1, n, file) == n;
+                }
+
+                buf.resize(buf_size);
+                buf_pos = 0;
+                buf_end = fread(buf.data(), 1, buf.size(), file);
+                if (buf_end == 0) {
+                    return false;
+                }
+            }
+
+            const size_t n_copy = std::min(n, buf_end - buf_pos);
+            memcpy(out, buf.data() + buf_pos, n_copy);
+            buf_pos += n_copy;
+            out     += n_copy;
+            n       -= n_copy;
+        }
+
+        return true;
+    }
+
+    // position in the file of the next byte to read
+    long tell() const {
+        return ftell(file) - long(buf_end - buf_pos);
+    }
+
+    bool seek(long offset) {
+        buf_pos = 0;
+        buf_end = 0;
+        return fseek(file, offset, SEEK_SET) == 0;
     }
 };
 
@@ -291,7 +339,7 @@ struct gguf_context * gguf_init_empty(void) {
 }
 
 template<typename T>
-bool gguf_read_emplace_helper(const struct gguf_reader & gr, std::vector<struct gguf_kv> & kv, const std::string & key, const bool is_array, const size_t n) {
+bool gguf_read_emplace_helper(struct gguf_reader & gr, std::vector<struct gguf_kv> & kv, const std::string & key, const bool is_array, const size_t n) {
     if (is_array) {
         std::vector<T> value;
         try {
@@ -317,7 +365,7 @@ bool gguf_read_emplace_helper(const struct gguf_reader & gr, std::vector<struct
 }
 
 struct gguf_context * gguf_init_from_file_impl(FILE * file, struct gguf_init_params params) {
-    const struct gguf_reader gr(file);
+    struct gguf_reader gr(file);
     struct gguf_context * ctx = new gguf_context;
 
     bool ok = true;
@@ -610,14 +658,14 @@ struct gguf_context * gguf_init_from_file_impl(FILE * file, struct gguf_init_par
     GGML_ASSERT(int64_t(ctx->info.size()) == n_tensors);
 
     // we require the data section to be aligned, so take into account any padding
-    if (fseek(file, GGML_PAD(ftell(file), ctx->alignment), SEEK_SET) != 0) {
+    if (!gr.seek(GGML_PAD(gr.tell(), ctx->alignment))) {
         GGML_LOG_ERROR("%s: failed to seek to beginning of data section\n", __func__);
         gguf_free(ctx);
         return nullptr;
     }
 
     // store the current file offset - this is where the data section starts
-    ctx->offset = ftell(file);
+    ctx->offset = gr.tell();
 
     // compute the total size of the data section, taking into account the alignment
     {
@@ -1169,7 +1217,37 @@ void gguf_set_tensor_data(struct gguf_context * ctx, const char * name, const vo
 struct gguf_writer {
     std::vector<int8_t> & buf;
 
-    gguf_writer(std::vector<int8_t> & buf) : buf(buf) {}
+    // with a file, the meta data is staged in buf and flushed in blocks, and the tensor data is written
+    //   directly from the memory of the tensors (or in chunks from the device buffers), so that the whole
+    //   file is never held in memory
+    FILE * file      = nullptr;
+    size_t n_flushed = 0; // bytes of buf already written to the file
+    bool   ok        = true;
+
+    static constexpr size_t flush_size = 1024*1024;
+    static constexpr size_t chunk_size = 16*1024*1024;
+
+    gguf_writer(std::vector<int8_t> & buf, FILE * file = nullptr) : buf(buf), file(file) {}
+
+    // bytes written so far
+    size_t size() const {
+        return n_flushed + buf.size();
+    }
+
+    void flush() {
+        if (!file || buf.empty()) {
+            return;
+        }
+        ok = ok && fwrite(buf.data(), 1, buf.size(), file) == buf.size();
+        n_flushed += buf.size();
+        buf.clear();
+    }
+
+    void maybe_flush() {
+        if (buf.size() >= flush_size) {
+            flush();
+        }
+    }
 
     template <typename T>
     void write(const T & val) const {
@@ -1209,7 +1287,7 @@ struct gguf_writer {
         write(int32_t(val));
     }
 
-    void write(const struct gguf_kv & kv) const {
+    void write(const struct gguf_kv & kv) {
         const uint64_t ne = kv.get_ne();
 
         write(kv.get_key());
@@ -1248,9 +1326,11 @@ struct gguf_writer {
             case GGUF_TYPE_ARRAY:
             default: GGML_ABORT("invalid type");
         }
+
+        maybe_flush();
     }
 
-    void write_tensor_meta(const struct gguf_tensor_info & info) const {
+    void write_tensor_meta(const struct gguf_tensor_info & info) {
         write(info.t.name);
 
         const uint32_t n_dims = ggml_n_dims(&info.t);
@@ -1261,36 +1341,54 @@ struct gguf_writer {
         }
         write(info.t.type);
         write(info.offset);
+
+        maybe_flush();
     }
 
     void pad(const size_t alignment) const {
-        while (buf.size() % alignment != 0) {
+        while (size() % alignment != 0) {
             const int8_t zero = 0;
             write(zero);
         }
     }
 
-    void write_tensor_data(const struct gguf_tensor_info & info, const size_t offset_data, const size_t alignment) const {
-        GGML_ASSERT(buf.size() - offset_data == info.offset);
+    void write_tensor_data(const struct gguf_tensor_info & info, const size_t offset_data, const size_t alignment) {
+        GGML_ASSERT(size() - offset_data == info.offset);
 
         GGML_ASSERT(ggml_is_contiguous(&info.t));
-        const size_t offset = buf.size();
         const size_t nbytes = ggml_nbytes(&info.t);
 
-        buf.resize(offset + nbytes);
-        if (info.t.buffer) {
-            ggml_backend_tensor_get(&info.t, buf.data() + offset, 0, nbytes);
+        if (file) {
+            flush();
+            if (!info.t.buffer || ggml_backend_buffer_is_host(info.t.buffer)) {
+                GGML_ASSERT(info.t.data);
+                ok = ok && fwrite(info.t.data, 1, nbytes, file) == nbytes;
+            } else {
+                std::vector<int8_t> chunk(std::min(nbytes, chunk_size));
+                for (size_t offs = 0; offs < nbytes && ok; offs += chunk.size()) {
+                    const size_t n = std::min(chunk.size(), nbytes - offs);
+                    ggml_backend_tensor_get(&info.t, chunk.data(), offs, n);
+                    ok = fwrite(chunk.data(), 1, n, file) == n;
+                }
+            }
+            n_flushed += nbytes;
         } else {
-            GGML_ASSERT(info.t.data);
-            memcpy(buf.data() + offset, info.t.data, nbytes);
+            const size_t offset = buf.size();
+
+            buf.resize(offset + nbytes);
+            if (info.t.buffer) {
+                ggml_backend_tensor_get(&info.t, buf.data() + offset, 0, nbytes);
+            } else {
+                GGML_ASSERT(info.t.data);
+                memcpy(buf.data() + offset, info.t.data, nbytes);
+            }
         }
 
         pad(alignment);
     }
 };
 
-void gguf_write_to_buf(const struct gguf_context * ctx, std::vector<int8_t> & buf, bool only_meta) {
-    const struct gguf_writer gw(buf);
+static void gguf_write(const struct gguf_context * ctx, struct gguf_writer & gw, bool only_meta) {
 
     const int64_t n_kv      = gguf_get_n_kv(ctx);
     const int64_t n_tensors = gguf_get_n_tensors(ctx);
@@ -1321,7 +1419,7 @@ void gguf_write_to_buf(const struct gguf_context * ctx, std::vector<int8_t> & bu
         return;
     }
 
-    const size_t offset_data = gw.buf.size();
+    const size_t offset_data = gw.size();
 
     // write tensor data
     for (int64_t i = 0; i < n_tensors; ++i) {
@@ -1329,6 +1427,19 @@ void gguf_write_to_buf(const struct gguf_context * ctx, std::vector<int8_t> & bu
     }
 }
 
+void gguf_write_to_buf(const struct gguf_context * ctx, std::vector<int8_t> & buf, bool only_meta) {
+    struct gguf_writer gw(buf);
+    gguf_write(ctx, gw, only_meta);
+}
+
+bool gguf_write_to_file_impl(const struct gguf_context * ctx, FILE * file, bool only_meta) {
+    std::vector<int8_t> buf;
+    struct gguf_writer gw(buf, file);
+    gguf_write(ctx, gw, only_meta);
+    gw.flush();
+    return gw.ok;
+}
+
 bool gguf_write_to_file(const struct gguf_context * ctx, const char * fname, bool only_meta) {
     FILE * file = ggml_fopen(fname, "wb");
 
@@ -1337,10 +1448,11 @@ bool gguf_write_to_file(const struct gguf_context * ctx, const char * fname, boo
         return false;
     }
 
-    std::vector<int8_t> buf;
-    gguf_write_to_buf(ctx, buf, only_meta);
-    const bool ok = fwrite(buf.data(), 1, buf.size(), file) == buf.size();
-    fclose(file);
+    bool ok = gguf_write_to_file_impl(ctx, file, only_meta);
+    ok = fclose(file) == 0 && ok;
+    if (!ok) {
+        GGML_LOG_ERROR("%s: failed to write GGUF data to '%s'\n", __func__, fname);
+    }
     return ok;
 }
 
@@ -106,6 +106,9 @@ class Keys:
         EXPERT_GATING_FUNC                = "{arch}.expert_gating_func"
         MOE_EVERY_N_LAYERS                = "{arch}.moe_every_n_layers"
         NEXTN_PREDICT_LAYERS              = "{arch}.nextn_predict_layers"
+        FFN_SPARSE_GROUP_SIZE             = "{arch}.ffn_sparse.group_size"
+        FFN_SPARSE_N_ACTIVE               = "{arch}.ffn_sparse.n_active"
+        FFN_SPARSE_N_HOT                  = "{arch}.ffn_sparse.n_hot"
         POOLING_TYPE                      = "{arch}.pooling_type"
         LOGIT_SCALE                       = "{arch}.logit_scale"
         DECODER_START_TOKEN_ID            = "{arch}.decoder_start_token_id"
@@ -435,6 +438,8 @@ class MODEL_TENSOR(IntEnum):
     FFN_DOWN_SHEXP       = auto()
     FFN_UP_SHEXP         = auto()
     FFN_EXP_PROBS_B      = auto()
+    FFN_PRED_A           = auto()
+    FFN_PRED_B           = auto()
     ATTN_Q_NORM          = auto()
     ATTN_K_NORM          = auto()
     LAYER_OUT_NORM       = auto()
@@ -769,6 +774,8 @@ TENSOR_NAMES: dict[MODEL_TENSOR, str] = {
     MODEL_TENSOR.FFN_DOWN_EXP:              "blk.{bid}.ffn_down_exps",
     MODEL_TENSOR.FFN_UP_EXP:                "blk.{bid}.ffn_up_exps",
     MODEL_TENSOR.FFN_EXP_PROBS_B:           "blk.{bid}.exp_probs_b",
+    MODEL_TENSOR.FFN_PRED_A:                "blk.{bid}.ffn_pred_a",
+    MODEL_TENSOR.FFN_PRED_B:                "blk.{bid}.ffn_pred_b",
     MODEL_TENSOR.LAYER_OUT_NORM:            "blk.{bid}.layer_output_norm",
     MODEL_TENSOR.PER_LAYER_TOKEN_EMBD:      "per_layer_token_embd",           # gemma3n
     MODEL_TENSOR.PER_LAYER_MODEL_PROJ:      "per_layer_model_proj",           # gemma3n
@@ -1038,6 +1045,8 @@ MODEL_TENSORS: dict[MODEL_ARCH, list[MODEL_TENSOR]] = {
         MODEL_TENSOR.FFN_GATE_EXP,
         MODEL_TENSOR.FFN_DOWN_EXP,
         MODEL_TENSOR.FFN_UP_EXP,
+        MODEL_TENSOR.FFN_PRED_A,
+        MODEL_TENSOR.FFN_PRED_B,
     ],
     MODEL_ARCH.LLAMA4: [
         MODEL_TENSOR.TOKEN_EMBD,
@@ -2728,6 +2737,7 @@ class GGMLQuantizationType(IntEnum):
     TQ1_0   = 34
     TQ2_0   = 35
     MXFP4   = 39
+    F8_E4M3 = 40
 
 
 class ExpertGatingFuncType(IntEnum):
@@ -2869,6 +2879,7 @@ GGML_QUANT_SIZES: dict[GGMLQuantizationType, tuple[int, int]] = {
     GGMLQuantizationType.TQ1_0:   (256, 2 + 4 * 13),
     GGMLQuantizationType.TQ2_0:   (256, 2 + 64),
     GGMLQuantizationType.MXFP4:   (32, 1 + 16),
+    GGMLQuantizationType.F8_E4M3: (32, 2 + 32),
 }
 
 
@@ -757,6 +757,15 @@ class GGUFWriter:
     def add_nextn_predict_layers(self, count: int) -> None:
         self.add_uint32(Keys.LLM.NEXTN_PREDICT_LAYERS.format(arch=self.arch), count)
 
+    def add_ffn_sparse_group_size(self, value: int) -> None:
+        self.add_uint32(Keys.LLM.FFN_SPARSE_GROUP_SIZE.format(arch=self.arch), value)
+
+    def add_ffn_sparse_n_active(self, value: int) -> None:
+        self.add_uint32(Keys.LLM.FFN_SPARSE_N_ACTIVE.format(arch=self.arch), value)
+
+    def add_ffn_sparse_n_hot(self, value: int) -> None:
+        self.add_uint32(Keys.LLM.FFN_SPARSE_N_HOT.format(arch=self.arch), value)
+
     def add_swin_norm(self, value: bool) -> None:
         self.add_bool(Keys.LLM.SWIN_NORM.format(arch=self.arch), value)
 
@@ -401,6 +401,23 @@ class Q8_0(__Quant, qtype=GGMLQuantizationType.Q8_0):
         return (x * d)
 
 
+class F8_E4M3(__Quant, qtype=GGMLQuantizationType.F8_E4M3):
+    @classmethod
+    def dequantize_blocks(cls, blocks: np.ndarray) -> np.ndarray:
+        d, x = np.split(blocks, [2], axis=1)
+        d = d.view(np.float16).astype(np.float32)
+
+        sign = np.where(x & 0x80, -1.0, 1.0).astype(np.float32)
+        exp = ((x >> 3) & 0x0F).astype(np.float32)
+        mant = (x & 0x07).astype(np.float32)
+
+        # subnormals for exp == 0, NaN for 0x7F and 0xFF
+        v = np.where(exp == 0, mant * 2.0**-9, (1 + mant / 8) * np.exp2(exp - 7)).astype(np.float32)
+        v = np.where((exp == 0x0F) & (mant == 0x07), np.float32(np.nan), v)
+
+        return (sign * v * d)
+
+
 class Q2_K(__Quant, qtype=GGMLQuantizationType.Q2_K):
     @classmethod
     def dequantize_blocks(cls, blocks: np.ndarray) -> np.ndarray:
@@ -16,6 +16,10 @@ struct llama_context_deleter {
     void operator()(llama_context * context) { llama_free(context); }
 };
 
+struct llama_context_pool_deleter {
+    void operator()(llama_context_pool * pool) { llama_context_pool_free(pool); }
+};
+
 struct llama_sampler_deleter {
     void operator()(llama_sampler * sampler) { llama_sampler_free(sampler); }
 };
@@ -26,5 +30,6 @@ struct llama_adapter_lora_deleter {
 
 typedef std::unique_ptr<llama_model, llama_model_deleter> llama_model_ptr;
 typedef std::unique_ptr<llama_context, llama_context_deleter> llama_context_ptr;
+typedef std::unique_ptr<llama_context_pool, llama_context_pool_deleter> llama_context_pool_ptr;
 typedef std::unique_ptr<llama_sampler, llama_sampler_deleter> llama_sampler_ptr;
 typedef std::unique_ptr<llama_adapter_lora, llama_adapter_lora_deleter> llama_adapter_lora_ptr;
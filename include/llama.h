@@ -42,10 +42,10 @@
 #define LLAMA_FILE_MAGIC_GGSQ 0x67677371u // 'ggsq'
 
 #define LLAMA_SESSION_MAGIC   LLAMA_FILE_MAGIC_GGSN
-#define LLAMA_SESSION_VERSION 9
+#define LLAMA_SESSION_VERSION 10
 
 #define LLAMA_STATE_SEQ_MAGIC   LLAMA_FILE_MAGIC_GGSQ
-#define LLAMA_STATE_SEQ_VERSION 2
+#define LLAMA_STATE_SEQ_VERSION 3
 
 #ifdef __cplusplus
 extern "C" {
@@ -60,6 +60,7 @@ extern "C" {
     struct llama_vocab;
     struct llama_model;
     struct llama_context;
+    struct llama_context_pool;
     struct llama_sampler;
 
     typedef struct llama_memory_i * llama_memory_t;
@@ -153,6 +154,7 @@ extern "C" {
         LLAMA_FTYPE_MOSTLY_TQ1_0         = 36, // except 1d tensors
         LLAMA_FTYPE_MOSTLY_TQ2_0         = 37, // except 1d tensors
         LLAMA_FTYPE_MOSTLY_MXFP4_MOE     = 38, // except 1d tensors
+        LLAMA_FTYPE_MOSTLY_F8_E4M3       = 39, // except 1d tensors
 
         LLAMA_FTYPE_GUESSED = 1024, // not specified in the model file
     };
@@ -175,6 +177,20 @@ extern "C" {
         LLAMA_POOLING_TYPE_RANK = 4, // used by reranking models to attach the classification head to the graph
     };
 
+    // data type of the pooled embeddings, see llama_get_embeddings_seq_data()
+    enum llama_embd_type {
+        LLAMA_EMBD_TYPE_F32    = 0,
+        LLAMA_EMBD_TYPE_Q8_0   = 1, // blocks of 32 int8 values with a f16 scale, as GGML_TYPE_Q8_0
+        LLAMA_EMBD_TYPE_BINARY = 2, // 1 bit per dimension (x > 0), packed most significant bit first in bytes
+    };
+
+    // data type of the logits copied back from the device, see llama_context_params.logits_type
+    enum llama_logits_type {
+        LLAMA_LOGITS_TYPE_F32  = 0,
+        LLAMA_LOGITS_TYPE_F16  = 1,
+        LLAMA_LOGITS_TYPE_BF16 = 2,
+    };
+
     enum llama_attention_type {
         LLAMA_ATTENTION_TYPE_UNSPECIFIED = -1,
         LLAMA_ATTENTION_TYPE_CAUSAL      = 0,
@@ -284,12 +300,17 @@ extern "C" {
         // override key-value pairs of the model meta data
         const struct llama_model_kv_override * kv_overrides;
 
+        // placement of the repacked weights in host memory (use_extra_bufts), see enum ggml_cpu_mem_flags [EXPERIMENTAL]
+        int32_t cpu_mem_repack;
+
         // Keep the booleans together to avoid misalignment during copy-by-value.
         bool vocab_only;      // only load the vocabulary, no weights
         bool use_mmap;        // use mmap if possible
         bool use_mlock;       // force system to keep model in RAM
         bool check_tensors;   // validate model tensor data
         bool use_extra_bufts; // use extra buffer types (used for weight repacking)
+        bool use_lazy;        // return from the load without touching the memory-mapped weights, they are paged in on a background thread
+        bool use_mtp;         // load the multi-token prediction (MTP) layers of the model, see llama_set_mtp_draft()
     };
 
     // NOTE: changing the default values of parameters marked as [EXPERIMENTAL] may cause crashes or incorrect results in certain configurations
@@ -316,12 +337,49 @@ extern "C" {
         uint32_t yarn_orig_ctx;    // YaRN original context size
         float    defrag_thold;     // defragment the KV cache if holes/size > thold, <= 0 disabled (default)
 
+        // layer skipping, e.g. to use the context as a draft for self-speculative decoding [EXPERIMENTAL]
+        int32_t  n_layer_exit;     // evaluate only the first n_layer_exit layers, 0 = all layers
+        int32_t  layer_skip_begin; // skip the layers in [layer_skip_begin, layer_skip_end), only supported by some architectures
+        int32_t  layer_skip_end;
+
+        // if > 0, select the n_logits_top_k largest logits of each output on the device and copy back only those [EXPERIMENTAL]
+        // the full rows returned by llama_get_logits[_ith]() are then reconstructed with -INFINITY for the remaining tokens
+        // the host buffer of the full rows is allocated only if they are requested, see llama_get_logits_top_k_ith()
+        int32_t  n_logits_top_k;
+
+        // data type of the logits copied back from the device when n_logits_top_k == 0 [EXPERIMENTAL]
+        // F16 and BF16 halve the transfer and the host memory of the outputs, the F32 rows are converted on demand
+        enum llama_logits_type logits_type;
+
+        // post-processing of the pooled embeddings (LLAMA_POOLING_TYPE_MEAN/CLS/LAST) on the device [EXPERIMENTAL]
+        // the sequence embeddings are truncated to the first n_embd_out dimensions (Matryoshka), optionally L2-normalized
+        // (embd_normalize) and converted to embd_type - only the result is copied back
+        int32_t              n_embd_out; // 0 = all the dimensions
+        enum llama_embd_type embd_type;
+
         ggml_backend_sched_eval_callback cb_eval;
         void * cb_eval_user_data;
 
         enum ggml_type type_k; // data type for K cache [EXPERIMENTAL]
         enum ggml_type type_v; // data type for V cache [EXPERIMENTAL]
 
+        // with a quantized type_k/type_v, keep the K/V cache of the first and last n_layer_kv_f16 layers in F16 [EXPERIMENTAL]
+        uint32_t n_layer_kv_f16;
+
+        // recurrent and hybrid models: keep up to n_rs_ckpt snapshots of the state of each sequence, taken every
+        // rs_ckpt_interval tokens, so that llama_memory_seq_rm() can roll a sequence back to the last snapshot [EXPERIMENTAL]
+        // the sequence can then end before p0 - check llama_memory_seq_pos_max()
+        uint32_t n_rs_ckpt;
+        uint32_t rs_ckpt_interval;
+
+        // placement of the KV cache and of the compute buffers in host memory, see enum ggml_cpu_mem_flags [EXPERIMENTAL]
+        // e.g. hugepages and binding to the NUMA nodes of the threads - the pinned host buffers of a GPU are kept
+        int32_t  cpu_mem_kv;
+        int32_t  cpu_mem_compute;
+
+        // NUMA node of the KV cache in host memory, e.g. the HBM tier, -1 = none - takes precedence over cpu_mem_kv [EXPERIMENTAL]
+        int32_t  kv_mem_node;
+
         // Abort callback
         // if it returns true, execution of llama_decode() will be aborted
         // currently works only with CPU execution
@@ -340,6 +398,13 @@ extern "C" {
         bool kv_unified;  // use a unified buffer across the input sequences when computing the attention
                           // try to disable when n_seq_max > 1 for improved performance when the sequences do not share a large prefix
                           // ref: https://github.com/ggml-org/llama.cpp/pull/14363
+        bool kv_scores;   // accumulate the attention received by each KV cell, see llama_memory_seq_compress() [EXPERIMENTAL]
+                          // requires flash_attn == false
+        bool expert_stats; // count the tokens routed to each MoE expert, see llama_perf_context_expert_counts() [EXPERIMENTAL]
+        bool reserve_lazy; // size the compute buffers for one output per sequence instead of n_ubatch outputs [EXPERIMENTAL]
+                           // the buffers grow on the first batch that requests more outputs
+        bool embd_normalize; // L2-normalize the pooled embeddings on the device, see n_embd_out [EXPERIMENTAL]
+        bool ffn_sparse;     // compute only the FFN neurons selected by the activation predictors of the model, if any [EXPERIMENTAL]
     };
 
     // model quantization parameters
@@ -357,6 +422,8 @@ extern "C" {
         void * kv_overrides;                  // pointer to vector containing overrides
         void * tensor_types;                  // pointer to vector containing tensor types
         void * prune_layers;                  // pointer to vector containing layer indices to prune
+        const char * device;                  // name of a backend device to offload the quantization to, NULL for the CPU
+        bool tokenizer_index;                 // store the precomputed tokenizer index in the metadata, for faster loading
     } llama_model_quantize_params;
 
     typedef struct llama_logit_bias {
@@ -443,6 +510,23 @@ extern "C" {
     // Frees all allocated memory
     LLAMA_API void llama_free(struct llama_context * ctx);
 
+    // A pool of contexts of a model that share the backends, the scheduler and the compute buffers
+    // The compute buffers are reserved once by llama_context_pool_init() with the given params
+    // The decode/encode calls of the contexts of a pool are serialized, so a pool suits many independent contexts
+    // that are not evaluated at the same time
+    LLAMA_API struct llama_context_pool * llama_context_pool_init(
+                     struct llama_model * model,
+            struct llama_context_params   params);
+
+    // The contexts of the pool can still be used after it is freed
+    LLAMA_API void llama_context_pool_free(struct llama_context_pool * pool);
+
+    // Create a context of the pool, freed with llama_free() - only its KV cache and output buffer are allocated
+    // If the params exceed those of the pool (n_ctx, n_batch, n_ubatch, n_seq_max), the shared compute buffers grow on the first decode
+    LLAMA_API struct llama_context * llama_init_from_pool(
+              struct llama_context_pool * pool,
+            struct llama_context_params   params);
+
     LLAMA_API int64_t llama_time_us(void);
 
     LLAMA_API size_t llama_max_devices(void);
@@ -481,6 +565,10 @@ extern "C" {
     LLAMA_API int32_t llama_model_n_head_kv  (const struct llama_model * model);
     LLAMA_API int32_t llama_model_n_swa      (const struct llama_model * model);
 
+    // Returns the number of loaded multi-token prediction (MTP) layers, 0 if the model has none or
+    // llama_model_params.use_mtp is false
+    LLAMA_API int32_t llama_model_n_mtp(const struct llama_model * model);
+
     // Get the model's RoPE frequency scaling factor
     LLAMA_API float llama_model_rope_freq_scale_train(const struct llama_model * model);
 
@@ -539,6 +627,9 @@ extern "C" {
     // Returns true if the model is recurrent (like Mamba, RWKV, etc.)
     LLAMA_API bool llama_model_is_recurrent(const struct llama_model * model);
 
+    // Returns true if the model is hybrid (mixes attention and recurrent layers, like Jamba, Granite 4, etc.)
+    LLAMA_API bool llama_model_is_hybrid(const struct llama_model * model);
+
     // Returns true if the model is diffusion-based (like LLaDA, Dream, etc.)
     LLAMA_API bool llama_model_is_diffusion(const struct llama_model * model);
 
@@ -561,6 +652,18 @@ extern "C" {
     // Note: loaded adapters will be free when the associated model is deleted
     LLAMA_API void llama_adapter_lora_free(struct llama_adapter_lora * adapter);
 
+    // Merge a loaded LoRA adapter into the weights of the model: W += scale*B*A, converted back to the type of W [EXPERIMENTAL]
+    // The model then runs without the overhead of the adapter, which must not be applied to a context anymore.
+    // Each weight is merged on its device when the device supports the operations, otherwise on the CPU with n_threads.
+    // The weights in host memory must not be memory-mapped or repacked and the model must not be loaded lazily
+    // (llama_model_params.use_mmap = use_extra_bufts = use_lazy = false).
+    // Returns 0 on success, -1 if the adapter cannot be merged - the weights are checked before any of them is modified.
+    LLAMA_API int32_t llama_adapter_lora_merge(
+            struct llama_model * model,
+            struct llama_adapter_lora * adapter,
+            float scale,
+            int32_t n_threads);
+
     // The following functions operate on a llama_context, hence the naming: llama_verb_...
 
     // Add a loaded LoRA adapter to given context
@@ -579,6 +682,21 @@ extern "C" {
     // Remove all LoRA adapters from given context
     LLAMA_API void llama_clear_adapter_lora(struct llama_context * ctx);
 
+    // Add a loaded LoRA adapter to the tokens of a sequence
+    // A sequence with its own adapters does not use the adapters of the context
+    // Sequences with different adapters can be decoded in the same batch
+    // Return -1 if seq_id is invalid
+    LLAMA_API int32_t llama_set_adapter_lora_seq(
+            struct llama_context * ctx,
+            struct llama_adapter_lora * adapter,
+            llama_seq_id seq_id,
+            float scale);
+
+    // Remove the LoRA adapters of a sequence, its tokens use the adapters of the context again
+    LLAMA_API void llama_clear_adapter_lora_seq(
+            struct llama_context * ctx,
+            llama_seq_id seq_id);
+
     // Apply a loaded control vector to a llama_context, or if data is NULL, clear
     // the currently loaded vector.
     // n_embd should be the size of a single layer's control, and data should point
@@ -649,6 +767,20 @@ extern "C" {
                  llama_pos p1,
                        int d);
 
+    // Removes the tokens of the specified sequence with positions in [p0, p1), except for the n_keep tokens that received
+    // the most attention (normalized by the number of tokens that could attend to them), e.g. right after the prompt
+    // The remaining tokens keep their positions, so the range is no longer contiguous
+    // Requires llama_context_params.kv_scores, otherwise nothing is removed [EXPERIMENTAL]
+    // Returns the number of removed tokens
+    // p0 < 0 : [0,  p1]
+    // p1 < 0 : [p0, inf)
+    LLAMA_API int32_t llama_memory_seq_compress(
+            llama_memory_t mem,
+              llama_seq_id seq_id,
+                 llama_pos p0,
+                 llama_pos p1,
+                   int32_t n_keep);
+
     // Returns the smallest position present in the memory for the specified sequence
     // This is typically non-zero only for SWA caches
     // Note that all positions in the range [pos_min, pos_max] are guaranteed to be present in the memory
@@ -667,6 +799,11 @@ extern "C" {
     // Check if the memory supports shifting
     LLAMA_API bool llama_memory_can_shift(llama_memory_t mem);
 
+    // Returns the number of used KV cells and writes their extent, i.e. the number of cells that a ubatch attends to,
+    // including the holes left by the removed sequences - n_used/n_extent measures the fragmentation of the KV cache
+    // Memories without KV cells (recurrent) return 0 [EXPERIMENTAL]
+    LLAMA_API int32_t llama_memory_n_cells(llama_memory_t mem, int32_t * n_extent);
+
     //
     // KV cache for self-attention (TODO: deprecate in favor of llama_memory)
     //
@@ -855,6 +992,83 @@ extern "C" {
                           size_t   size,
                     llama_seq_id   dest_seq_id);
 
+    // for models with sliding window attention, work only on the SWA part of the KV cache
+    #define LLAMA_STATE_SEQ_FLAGS_SWA_ONLY 1
+
+    typedef uint32_t llama_state_seq_flags;
+
+    // Same as the functions above, with LLAMA_STATE_SEQ_FLAGS_* flags
+    LLAMA_API size_t llama_state_seq_get_size_ext(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id,
+           llama_state_seq_flags   flags);
+
+    LLAMA_API size_t llama_state_seq_get_data_ext(
+            struct llama_context * ctx,
+                         uint8_t * dst,
+                          size_t   size,
+                    llama_seq_id   seq_id,
+           llama_state_seq_flags   flags);
+
+    LLAMA_API size_t llama_state_seq_set_data_ext(
+            struct llama_context * ctx,
+                   const uint8_t * src,
+                          size_t   size,
+                    llama_seq_id   dest_seq_id,
+           llama_state_seq_flags   flags);
+
+    // Incremental sequence state, for example to append to a saved session after each turn
+    // Only the cells at positions >= p0 are included - the recurrent state is always included whole
+    LLAMA_API size_t llama_state_seq_get_size_from(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id,
+                       llama_pos   p0);
+
+    LLAMA_API size_t llama_state_seq_get_data_from(
+            struct llama_context * ctx,
+                         uint8_t * dst,
+                          size_t   size,
+                    llama_seq_id   seq_id,
+                       llama_pos   p0);
+
+    // Add the cells of an incremental state (copied with `llama_state_seq_get_data_from`) to the specified sequence
+    // Existing cells at the same or later positions are replaced, the earlier ones are kept
+    // Returns:
+    //  - Positive: Ok
+    //  - Zero: Failed to load
+    LLAMA_API size_t llama_state_seq_set_data_append(
+            struct llama_context * ctx,
+                   const uint8_t * src,
+                          size_t   size,
+                    llama_seq_id   dest_seq_id);
+
+    // State of the cells of a sequence in [p0, p1), for example a document that is added to other prompts
+    // p1 < 0 : [p0, inf)
+    LLAMA_API size_t llama_state_seq_get_size_range(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id,
+                       llama_pos   p0,
+                       llama_pos   p1);
+
+    LLAMA_API size_t llama_state_seq_get_data_range(
+            struct llama_context * ctx,
+                         uint8_t * dst,
+                          size_t   size,
+                    llama_seq_id   seq_id,
+                       llama_pos   p0,
+                       llama_pos   p1);
+
+    // Same as llama_state_seq_set_data_append, with the positions of the added cells moved by delta
+    // The K data is rotated to the new positions on the next update (like llama_memory_seq_add), so a saved range
+    // can be added to any sequence at any position - the cells keep the attention to the context they were computed in
+    // On failure, the cells of the sequence before the first added position are kept
+    LLAMA_API size_t llama_state_seq_set_data_shift(
+            struct llama_context * ctx,
+                   const uint8_t * src,
+                          size_t   size,
+                    llama_seq_id   dest_seq_id,
+                       llama_pos   delta);
+
     LLAMA_API size_t llama_state_seq_save_file(
             struct llama_context * ctx,
                       const char * filepath,
@@ -925,6 +1139,23 @@ extern "C" {
             struct llama_context * ctx,
               struct llama_batch   batch);
 
+    // Asynchronous version of llama_decode()
+    // Returns immediately after queuing the batch - the decode runs on a worker thread, so that the caller can
+    // prepare the next batch (tokenization, sampling of other sequences, etc.) while the current one is computed
+    // The batch data must remain valid and no other calls on the context must be made until llama_decode_wait()
+    // Obtaining the outputs of the context (e.g. llama_get_logits_ith()) and llama_decode() implicitly wait for
+    // the pending decode
+    // llama_decode_wait() returns the result of the pending decode, with the same meaning as for llama_decode()
+    // (0 if there is none)
+    LLAMA_API int32_t llama_decode_async(
+            struct llama_context * ctx,
+              struct llama_batch   batch);
+
+    LLAMA_API int32_t llama_decode_wait(struct llama_context * ctx);
+
+    // Returns true if there is no pending llama_decode_async() call, or if it has finished
+    LLAMA_API bool llama_decode_ready(const struct llama_context * ctx);
+
     // Set the number of threads used for decoding
     // n_threads is the number of threads used for generation (single token)
     // n_threads_batch is the number of threads used for prompt and batch processing (multiple tokens)
@@ -940,6 +1171,19 @@ extern "C" {
     // TODO: rename to avoid confusion with llama_get_embeddings()
     LLAMA_API void llama_set_embeddings(struct llama_context * ctx, bool embeddings);
 
+    // Set whether the context outputs the final hidden states of the output tokens along with their logits
+    // They are read with llama_get_embeddings_ith(), e.g. by speculative draft heads
+    LLAMA_API void llama_set_output_hidden(struct llama_context * ctx, bool output_hidden);
+
+    // Set whether llama_decode() evaluates only the multi-token prediction (MTP) layer of the model [EXPERIMENTAL]
+    // The MTP layer predicts the token after the next one from a token and the hidden state of the previous position,
+    // so the logits of a token at position p are the draft of the token at p + 1, without a separate draft model:
+    //   - the hidden states are saved by the normal decodes, and by the MTP decodes for the chained drafts
+    //   - the MTP decodes store only the cache of the MTP layer - remove their positions with
+    //     llama_memory_seq_rm(mem, seq_id, p0, -1) before the next normal decode
+    // Requires a model loaded with llama_model_params.use_mtp, see llama_model_n_mtp()
+    LLAMA_API void llama_set_mtp_draft(struct llama_context * ctx, bool mtp_draft);
+
     // Set whether to use causal attention or not
     // If set to true, the model will only attend to the past tokens
     LLAMA_API void llama_set_causal_attn(struct llama_context * ctx, bool causal_attn);
@@ -970,6 +1214,28 @@ extern "C" {
     // returns NULL for invalid ids.
     LLAMA_API float * llama_get_logits_ith(struct llama_context * ctx, int32_t i);
 
+    // Top-k candidates for the ith token, selected on the device when llama_context_params.n_logits_top_k > 0
+    // The candidates are sorted by descending logit - with a subset of the vocabulary (llama_set_logits_vocab()),
+    // all the tokens of the subset are returned in its order.
+    // Returns the number of candidates, or 0 if the context does not select the top-k logits or the id is invalid.
+    LLAMA_API int32_t llama_get_logits_top_k_ith(
+            struct llama_context * ctx,
+                         int32_t   i,
+               const llama_token ** ids,
+                     const float ** logits);
+
+    // Compute the output projection only for the n_ids tokens in ids, e.g. the most frequent tokens for a draft model
+    // or the tokens allowed by a grammar [EXPERIMENTAL]
+    // The full rows returned by llama_get_logits[_ith]() then have -INFINITY for the other tokens and
+    // llama_get_logits_top_k_ith() returns the logits of the subset, in the order of ids.
+    // The rows of the output tensor are copied to a new tensor: n_ids = 0 restores the full vocabulary.
+    // LoRA adapters of the output tensor are not applied to the subset.
+    // Returns 0 on success, -1 if the output tensor of the model cannot be subset (output bias, repacked weights).
+    LLAMA_API int32_t llama_set_logits_vocab(
+            struct llama_context * ctx,
+               const llama_token * ids,
+                         int32_t   n_ids);
+
     // Get all output token embeddings.
     // when pooling_type == LLAMA_POOLING_TYPE_NONE or when using a generative model,
     // the embeddings for which llama_batch.logits[i] != 0 are stored contiguously
@@ -987,11 +1253,18 @@ extern "C" {
     LLAMA_API float * llama_get_embeddings_ith(struct llama_context * ctx, int32_t i);
 
     // Get the embeddings for a sequence id
-    // Returns NULL if pooling_type is LLAMA_POOLING_TYPE_NONE
+    // Returns NULL if pooling_type is LLAMA_POOLING_TYPE_NONE, or if embd_type is not LLAMA_EMBD_TYPE_F32
     // when pooling_type == LLAMA_POOLING_TYPE_RANK, returns float[n_cls_out] with the rank(s) of the sequence
-    // otherwise: float[n_embd] (1-dimensional)
+    // otherwise: float[llama_n_embd_out()] (1-dimensional)
     LLAMA_API float * llama_get_embeddings_seq(struct llama_context * ctx, llama_seq_id seq_id);
 
+    // Get the pooled embeddings for a sequence id in the embd_type of the context, size is set to their size in bytes
+    // Returns NULL if pooling_type is not LLAMA_POOLING_TYPE_MEAN/CLS/LAST
+    LLAMA_API const void * llama_get_embeddings_seq_data(struct llama_context * ctx, llama_seq_id seq_id, size_t * size);
+
+    // Number of dimensions of the pooled embeddings, see llama_context_params.n_embd_out
+    LLAMA_API int32_t llama_n_embd_out(const struct llama_context * ctx);
+
     //
     // Vocab
     //
@@ -1089,6 +1362,21 @@ extern "C" {
                                int32_t   lstrip,
                                   bool   special);
 
+    /// @details Appends the pieces of the tokens to text, the same as calling llama_token_to_piece() for each of them with lstrip = 0,
+    ///          without any allocation. Does not write null terminator to the buffer.
+    /// @param special If true, special tokens are rendered in the output.
+    /// @param n_valid If not NULL, set to the number of bytes of text that do not end with an incomplete UTF-8 sequence.
+    /// @return Returns the number of chars/bytes on success, no more than text_len_max.
+    /// @return Returns a negative number on failure - the number of chars/bytes that would have been returned.
+    LLAMA_API int32_t llama_detokenize_into(
+        const struct llama_vocab * vocab,
+               const llama_token * tokens,
+                         int32_t   n_tokens,
+                            char * text,
+                         int32_t   text_len_max,
+                            bool   special,
+                         int32_t * n_valid);
+
     /// @details Convert the provided tokens into text (inverse of llama_tokenize()).
     /// @param text The char pointer must be large enough to hold the resulting text.
     /// @return Returns the number of chars/bytes on success, no more than text_len_max.
@@ -1302,6 +1590,18 @@ extern "C" {
                             size_t num_trigger_tokens);
 
 
+    /// @details The text that the grammar sampler forces next, i.e. that every continuation allowed by the grammar starts with.
+    /// Writes up to len bytes of complete UTF-8 characters to buf and returns their number, 0 if smpl is not a grammar sampler.
+    LLAMA_API int32_t llama_sampler_grammar_forced_text(
+            const struct llama_sampler * smpl,
+                                  char * buf,
+                               int32_t   len);
+
+    /// @details Precompute the grammar mask of the whole vocabulary for the current grammar state, so that the next apply is a lookup.
+    /// Meant to run on another thread while the logits are computed - it must not overlap with any other call on smpl.
+    /// No-op if smpl is not a grammar sampler.
+    LLAMA_API void llama_sampler_grammar_prepare(const struct llama_sampler * smpl);
+
     /// NOTE: Avoid using on the full vocabulary as searching for repeated tokens can become slow. For example, apply top-k or top-p sampling first.
     LLAMA_API struct llama_sampler * llama_sampler_init_penalties(
                              int32_t   penalty_last_n,   // last n tokens to penalize (0 = disable penalty, -1 = context size)
@@ -1402,6 +1702,9 @@ extern "C" {
         int32_t n_p_eval;
         int32_t n_eval;
         int32_t n_reused; // number of times a ggml compute graph had been reused
+
+        double  t_mem_update_ms; // time spent in the memory updates (K-shifts, defragmentation, ...)
+        int32_t n_mem_update;    // number of memory updates
     };
 
     struct llama_perf_sampler_data {
@@ -1410,10 +1713,27 @@ extern "C" {
         int32_t n_sample;
     };
 
+    // time of the phases of llama_model_load_from_file
+    struct llama_perf_model_data {
+        double t_parse_ms;  // gguf metadata, tensor index, architecture and hyperparameters
+        double t_vocab_ms;  // vocabulary
+        double t_alloc_ms;  // tensor creation and buffer allocation
+        double t_read_ms;   // tensor data read from the files (with mmap, the page faults happen in the upload or the first decode)
+        double t_upload_ms; // tensor data copied to the backend buffers, including the repacking
+        double t_load_ms;   // total
+    };
+
+    LLAMA_API struct llama_perf_model_data   llama_perf_model        (const struct llama_model * model);
+
     LLAMA_API struct llama_perf_context_data llama_perf_context      (const struct llama_context * ctx);
     LLAMA_API void                           llama_perf_context_print(const struct llama_context * ctx);
     LLAMA_API void                           llama_perf_context_reset(      struct llama_context * ctx);
 
+    // Number of tokens routed to each expert of the layer il since the context creation or the last llama_perf_context_reset()
+    // Writes up to n_counts values to counts and returns the number of experts (0 if no token was routed in the layer, e.g. a dense layer)
+    // Requires llama_context_params.expert_stats, intended to guide the placement of the experts (e.g. --override-tensor) [EXPERIMENTAL]
+    LLAMA_API int32_t llama_perf_context_expert_counts(const struct llama_context * ctx, int32_t il, uint64_t * counts, int32_t n_counts);
+
     // NOTE: the following work only with samplers constructed via llama_sampler_chain_init
     LLAMA_API struct llama_perf_sampler_data llama_perf_sampler      (const struct llama_sampler * chain);
     LLAMA_API void                           llama_perf_sampler_print(const struct llama_sampler * chain);
@@ -1429,6 +1749,22 @@ extern "C" {
     // always returns true
     LLAMA_API bool llama_opt_param_filter_all(const struct ggml_tensor * tensor, void * userdata);
 
+    // Create a LoRA adapter of rank n_rank for the 2D weights of the model selected by param_filter
+    // A is initialized with random values and B with zeros, so the adapter initially does not change the model
+    // Pass it to llama_opt_init to train only the adapter, the base weights stay frozen and can be quantized
+    LLAMA_API struct llama_adapter_lora * llama_adapter_lora_init_trainable(
+            struct llama_model * model,
+            int32_t n_rank,
+            float alpha,
+            llama_opt_param_filter param_filter,
+            void * param_filter_ud);
+
+    // Save a LoRA adapter in the GGUF format that is read by llama_adapter_lora_init
+    LLAMA_API bool llama_adapter_lora_save(
+            const struct llama_adapter_lora * adapter,
+            const struct llama_model * model,
+            const char * path_lora);
+
     struct llama_opt_params {
         uint32_t n_ctx_train; // assumed context size post training, use context size specified in llama_context if 0
 
@@ -1437,6 +1773,16 @@ extern "C" {
 
         ggml_opt_get_optimizer_params get_opt_pars; // callback for calculating optimizer parameters
         void * get_opt_pars_ud;                     // userdata for calculating optimizer parameters
+
+        bool recompute; // keep only the outputs of the layers from the forward pass, the other activations are recomputed
+                        // in the backward pass - less memory for longer contexts at the cost of a second forward pass
+
+        struct llama_adapter_lora * adapter; // if not NULL, train only this LoRA adapter and keep the model weights frozen
+
+        // mixed precision: the matrix multiplications with the trainable weights use casts of them to type_compute
+        // (GGML_TYPE_BF16 or GGML_TYPE_F16), the weights, gradients and AdamW moments stay F32 - GGML_TYPE_F32 to disable
+        enum ggml_type type_compute;
+        float          loss_scale;   // initial dynamic loss scale, see ggml_opt_params.loss_scale - 0.0f to disable
     };
 
     LLAMA_API void llama_opt_init(struct llama_context * lctx, struct llama_model * model, struct llama_opt_params lopt_params);
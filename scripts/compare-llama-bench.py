@@ -31,6 +31,7 @@ LLAMA_BENCH_DB_FIELDS = [
     "defrag_thold",
     "use_mmap",     "embeddings",   "no_op_offload",  "n_prompt",   "n_gen",        "n_depth",
     "test_time",    "avg_ns",       "stddev_ns",      "avg_ts",     "stddev_ts",
+    "cpu_w",        "gpu_w",        "j_per_tok",      "ts_per_w",
 ]
 
 LLAMA_BENCH_DB_TYPES = [
@@ -41,6 +42,7 @@ LLAMA_BENCH_DB_TYPES = [
     "REAL",
     "INTEGER", "INTEGER", "INTEGER", "INTEGER", "INTEGER", "INTEGER",
     "TEXT",    "INTEGER", "INTEGER", "REAL",    "REAL",
+    "REAL",    "REAL",    "REAL",    "REAL",
 ]
 
 # All test-backend-ops SQL fields
@@ -6,6 +6,8 @@
 
 #include <map>
 #include <cassert>
+#include <cmath>
+#include <random>
 #include <stdexcept>
 
 // vec
@@ -145,6 +147,54 @@ llama_adapter_lora_weight * llama_adapter_lora::get_weight(ggml_tensor * w) {
     return nullptr;
 }
 
+// get extra buffer types of the CPU
+// TODO: a more general solution for non-CPU extra buft should be imlpemented in the future
+//       ref: https://github.com/ggml-org/llama.cpp/pull/12593#pullrequestreview-2718659948
+static std::vector<ggml_backend_buffer_type_t> llama_adapter_lora_extra_bufts() {
+    std::vector<ggml_backend_buffer_type_t> buft_extra;
+
+    auto * cpu_dev = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
+    if (!cpu_dev) {
+        throw std::runtime_error(format("%s: no CPU backend found", __func__));
+    }
+    auto * cpu_reg = ggml_backend_dev_backend_reg(cpu_dev);
+
+    auto ggml_backend_dev_get_extra_bufts_fn = (ggml_backend_dev_get_extra_bufts_t)
+        ggml_backend_reg_get_proc_address(cpu_reg, "ggml_backend_dev_get_extra_bufts");
+
+    if (ggml_backend_dev_get_extra_bufts_fn) {
+        ggml_backend_buffer_type_t * extra_bufts = ggml_backend_dev_get_extra_bufts_fn(cpu_dev);
+        while (extra_bufts && *extra_bufts) {
+            buft_extra.emplace_back(*extra_bufts);
+            ++extra_bufts;
+        }
+    }
+
+    return buft_extra;
+}
+
+// buffer type for the lora of a model tensor
+static ggml_backend_buffer_type_t llama_adapter_lora_buft(const ggml_tensor * model_tensor, const std::vector<ggml_backend_buffer_type_t> & buft_extra) {
+    auto * buft = ggml_backend_buffer_get_type(model_tensor->buffer);
+
+    // do not load loras to extra buffer types (i.e. bufts for repacking) -> use the CPU in that case
+    for (auto & ex : buft_extra) {
+        if (ex == buft) {
+            LLAMA_LOG_WARN("%s: lora for '%s' cannot use buft '%s', fallback to CPU\n", __func__, model_tensor->name, ggml_backend_buft_name(buft));
+
+            auto * cpu_dev = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
+            if (!cpu_dev) {
+                throw std::runtime_error(format("%s: no CPU backend found", __func__));
+            }
+            buft = ggml_backend_dev_buffer_type(cpu_dev);
+
+            break;
+        }
+    }
+
+    return buft;
+}
+
 static void llama_adapter_lora_init_impl(llama_model & model, const char * path_lora, llama_adapter_lora & adapter) {
     LLAMA_LOG_INFO("%s: loading lora adapter from '%s' ...\n", __func__, path_lora);
 
@@ -248,27 +298,7 @@ static void llama_adapter_lora_init_impl(llama_model & model, const char * path_
     }
 
     // get extra buffer types of the CPU
-    // TODO: a more general solution for non-CPU extra buft should be imlpemented in the future
-    //       ref: https://github.com/ggml-org/llama.cpp/pull/12593#pullrequestreview-2718659948
-    std::vector<ggml_backend_buffer_type_t> buft_extra;
-    {
-        auto * cpu_dev = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
-        if (!cpu_dev) {
-            throw std::runtime_error(format("%s: no CPU backend found", __func__));
-        }
-        auto * cpu_reg = ggml_backend_dev_backend_reg(cpu_dev);
-
-        auto ggml_backend_dev_get_extra_bufts_fn = (ggml_backend_dev_get_extra_bufts_t)
-            ggml_backend_reg_get_proc_address(cpu_reg, "ggml_backend_dev_get_extra_bufts");
-
-        if (ggml_backend_dev_get_extra_bufts_fn) {
-            ggml_backend_buffer_type_t * extra_bufts = ggml_backend_dev_get_extra_bufts_fn(cpu_dev);
-            while (extra_bufts && *extra_bufts) {
-                buft_extra.emplace_back(*extra_bufts);
-                ++extra_bufts;
-            }
-        }
-    }
+    const std::vector<ggml_backend_buffer_type_t> buft_extra = llama_adapter_lora_extra_bufts();
 
     // add tensors
     for (auto & it : ab_map) {
@@ -286,22 +316,7 @@ static void llama_adapter_lora_init_impl(llama_model & model, const char * path_
             throw std::runtime_error("LoRA tensor '" + name + "' does not exist in base model (hint: maybe wrong base model?)");
         }
 
-        auto * buft = ggml_backend_buffer_get_type(model_tensor->buffer);
-
-        // do not load loras to extra buffer types (i.e. bufts for repacking) -> use the CPU in that case
-        for (auto & ex : buft_extra) {
-            if (ex == buft) {
-                LLAMA_LOG_WARN("%s: lora for '%s' cannot use buft '%s', fallback to CPU\n", __func__, model_tensor->name, ggml_backend_buft_name(buft));
-
-                auto * cpu_dev = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
-                if (!cpu_dev) {
-                    throw std::runtime_error(format("%s: no CPU backend found", __func__));
-                }
-                buft = ggml_backend_dev_buffer_type(cpu_dev);
-
-                break;
-            }
-        }
+        auto * buft = llama_adapter_lora_buft(model_tensor, buft_extra);
 
         LLAMA_LOG_DEBUG("%s: lora for '%s' -> '%s'\n", __func__, model_tensor->name, ggml_backend_buft_name(buft));
 
@@ -386,3 +401,390 @@ llama_adapter_lora * llama_adapter_lora_init(llama_model * model, const char * p
 void llama_adapter_lora_free(llama_adapter_lora * adapter) {
     delete adapter;
 }
+
+// merge
+
+// F32 bytes of the rows of a weight that are merged at once, bounds the size of the temporary tensors
+static constexpr size_t LLAMA_LORA_MERGE_CHUNK = 64u*1024u*1024u;
+
+// w_rows += scale*mul_mat(x, y_rows), with x [rank, ne0] and y_rows [rank, n_rows] - see build_lora_mm() and build_inp_embd()
+static ggml_cgraph * llama_adapter_lora_merge_graph(
+        ggml_context * ctx,
+         ggml_tensor * w_rows,
+         ggml_tensor * x,
+         ggml_tensor * y_rows,
+               float   scale) {
+    ggml_tensor * delta = ggml_scale_inplace(ctx, ggml_mul_mat(ctx, x, y_rows), scale);
+
+    ggml_tensor * cur;
+    if (w_rows->type == GGML_TYPE_F32) {
+        cur = ggml_add_inplace(ctx, w_rows, delta);
+    } else {
+        cur = ggml_add_inplace(ctx, ggml_cast(ctx, w_rows, GGML_TYPE_F32), delta);
+        cur = ggml_cpy(ctx, cur, w_rows);
+    }
+
+    ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, cur);
+
+    return gf;
+}
+
+static bool llama_adapter_lora_merge_supported(ggml_backend_t backend, ggml_cgraph * gf) {
+    for (int i = 0; i < ggml_graph_n_nodes(gf); ++i) {
+        if (!ggml_backend_supports_op(backend, ggml_graph_node(gf, i))) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// merge the rows [i0, i0 + n_rows) of w on the device of w, returns false if the device does not support it
+static bool llama_adapter_lora_merge_rows_dev(
+        ggml_backend_t backend, ggml_tensor * w, ggml_tensor * a, ggml_tensor * b, bool is_token_embd, float scale, int64_t i0, int64_t n_rows) {
+    ggml_init_params params = {
+        /*.mem_size   =*/ 16*ggml_tensor_overhead() + ggml_graph_overhead(),
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ true,
+    };
+
+    ggml_context_ptr ctx { ggml_init(params) };
+
+    ggml_tensor * x = is_token_embd ? b : ggml_cont(ctx.get(), ggml_transpose(ctx.get(), a));
+    ggml_tensor * y = is_token_embd ? a : b;
+
+    ggml_tensor * w_rows = ggml_view_2d(ctx.get(), w, w->ne[0], n_rows, w->nb[1], i0*w->nb[1]);
+    ggml_tensor * y_rows = ggml_view_2d(ctx.get(), y, y->ne[0], n_rows, y->nb[1], i0*y->nb[1]);
+
+    ggml_cgraph * gf = llama_adapter_lora_merge_graph(ctx.get(), w_rows, x, y_rows, scale);
+
+    if (!llama_adapter_lora_merge_supported(backend, gf)) {
+        return false;
+    }
+
+    ggml_backend_buffer_ptr buf { ggml_backend_alloc_ctx_tensors(ctx.get(), backend) };
+    if (!buf) {
+        throw std::runtime_error(format("failed to allocate the merge buffer of '%s'", w->name));
+    }
+
+    if (ggml_backend_graph_compute(backend, gf) != GGML_STATUS_SUCCESS) {
+        throw std::runtime_error(format("failed to merge '%s'", w->name));
+    }
+
+    return true;
+}
+
+// merge the rows [i0, i0 + n_rows) of w on the CPU, the rows are copied to host memory and back if needed
+static void llama_adapter_lora_merge_rows_cpu(
+        ggml_backend_t backend, ggml_tensor * w, ggml_tensor * a, ggml_tensor * b, bool is_token_embd, float scale, int64_t i0, int64_t n_rows) {
+    ggml_init_params params = {
+        /*.mem_size   =*/ 16*ggml_tensor_overhead() + ggml_graph_overhead(),
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ true,
+    };
+
+    ggml_context_ptr ctx_h { ggml_init(params) };
+    ggml_context_ptr ctx   { ggml_init(params) };
+
+    const bool on_host = ggml_backend_buffer_is_host(w->buffer);
+
+    ggml_tensor * w_h = on_host ? w : ggml_new_tensor_2d(ctx_h.get(), w->type, w->ne[0], n_rows);
+    ggml_tensor * a_h = ggml_backend_buffer_is_host(a->buffer) ? a : ggml_dup_tensor(ctx_h.get(), a);
+    ggml_tensor * b_h = ggml_backend_buffer_is_host(b->buffer) ? b : ggml_dup_tensor(ctx_h.get(), b);
+
+    ggml_backend_buffer_ptr buf_h;
+    if (ggml_get_first_tensor(ctx_h.get())) {
+        buf_h.reset(ggml_backend_alloc_ctx_tensors(ctx_h.get(), backend));
+        if (!buf_h) {
+            throw std::runtime_error(format("failed to allocate the host merge buffer of '%s'", w->name));
+        }
+
+        if (w_h != w) {
+            ggml_backend_tensor_get(w, w_h->data, i0*w->nb[1], ggml_nbytes(w_h));
+        }
+        if (a_h != a) {
+            ggml_backend_tensor_get(a, a_h->data, 0, ggml_nbytes(a));
+        }
+        if (b_h != b) {
+            ggml_backend_tensor_get(b, b_h->data, 0, ggml_nbytes(b));
+        }
+    }
+
+    const int64_t i0_h = on_host ? i0 : 0;
+
+    ggml_tensor * x = is_token_embd ? b_h : ggml_cont(ctx.get(), ggml_transpose(ctx.get(), a_h));
+    ggml_tensor * y = is_token_embd ? a_h : b_h;
+
+    ggml_tensor * w_rows = ggml_view_2d(ctx.get(), w_h, w_h->ne[0], n_rows, w_h->nb[1], i0_h*w_h->nb[1]);
+    ggml_tensor * y_rows = ggml_view_2d(ctx.get(), y,   y->ne[0],   n_rows, y->nb[1],   i0*y->nb[1]);
+
+    ggml_cgraph * gf = llama_adapter_lora_merge_graph(ctx.get(), w_rows, x, y_rows, scale);
+
+    ggml_backend_buffer_ptr buf { ggml_backend_alloc_ctx_tensors(ctx.get(), backend) };
+    if (!buf) {
+        throw std::runtime_error(format("failed to allocate the merge buffer of '%s'", w->name));
+    }
+
+    if (ggml_backend_graph_compute(backend, gf) != GGML_STATUS_SUCCESS) {
+        throw std::runtime_error(format("failed to merge '%s'", w->name));
+    }
+
+    if (w_h != w) {
+        ggml_backend_tensor_set(w, w_h->data, i0*w->nb[1], ggml_nbytes(w_h));
+    }
+}
+
+static void llama_adapter_lora_merge_impl(llama_model & model, llama_adapter_lora & adapter, float scale, int32_t n_threads) {
+    const std::vector<ggml_backend_buffer_type_t> buft_extra = llama_adapter_lora_extra_bufts();
+
+    // the lazily loaded weights would be overwritten by their data in the file
+    if (model.params.use_lazy) {
+        throw std::runtime_error("the weights are loaded lazily, load the model with use_lazy = false");
+    }
+
+    // check all the weights before modifying any of them
+    for (const auto & it : adapter.ab_map) {
+        const ggml_tensor * w = model.get_tensor(it.first.c_str());
+        if (w == nullptr || w->buffer == nullptr) {
+            throw std::runtime_error(format("tensor '%s' of the adapter is not in the model", it.first.c_str()));
+        }
+
+        auto * buft = ggml_backend_buffer_get_type(w->buffer);
+        auto * dev  = ggml_backend_buft_get_device(buft);
+
+        for (auto * ex : buft_extra) {
+            if (ex == buft) {
+                throw std::runtime_error(format("tensor '%s' is repacked in the buffer type %s, load the model with use_extra_bufts = false", w->name, ggml_backend_buft_name(buft)));
+            }
+        }
+
+        if (!ggml_backend_buffer_is_host(w->buffer) && (dev == nullptr || buft != ggml_backend_dev_buffer_type(dev))) {
+            throw std::runtime_error(format("tensor '%s' is in the buffer type %s, only the default buffer types of the devices are supported", w->name, ggml_backend_buft_name(buft)));
+        }
+
+        if (ggml_backend_buffer_is_host(w->buffer) && model.params.use_mmap) {
+            throw std::runtime_error(format("tensor '%s' is memory-mapped, load the model with use_mmap = false", w->name));
+        }
+
+        if (ggml_quantize_requires_imatrix(w->type)) {
+            throw std::runtime_error(format("tensor '%s' has the type %s that cannot be quantized without an importance matrix", w->name, ggml_type_name(w->type)));
+        }
+    }
+
+    ggml_backend_ptr backend_cpu { ggml_backend_init_by_type(GGML_BACKEND_DEVICE_TYPE_CPU, nullptr) };
+    if (!backend_cpu) {
+        throw std::runtime_error("failed to initialize the CPU backend");
+    }
+
+    {
+        auto * reg = ggml_backend_dev_backend_reg(ggml_backend_get_device(backend_cpu.get()));
+        auto * set_n_threads_fn = (ggml_backend_set_n_threads_t) ggml_backend_reg_get_proc_address(reg, "ggml_backend_set_n_threads");
+        if (set_n_threads_fn && n_threads > 0) {
+            set_n_threads_fn(backend_cpu.get(), n_threads);
+        }
+    }
+
+    std::map<ggml_backend_dev_t, ggml_backend_ptr> backends;
+
+    int n_dev = 0;
+    int n_cpu = 0;
+
+    for (const auto & it : adapter.ab_map) {
+        ggml_tensor * w = const_cast<ggml_tensor *>(model.get_tensor(it.first.c_str()));
+
+        ggml_tensor * a = it.second.a;
+        ggml_tensor * b = it.second.b;
+
+        const bool is_token_embd = it.first == "token_embd.weight";
+
+        const float scale_ab = it.second.get_scale(adapter.alpha, scale);
+
+        const int64_t n_rows_chunk = std::max<int64_t>(1, LLAMA_LORA_MERGE_CHUNK/(w->ne[0]*sizeof(float)));
+
+        ggml_backend_t backend = nullptr;
+        if (!ggml_backend_buffer_is_host(w->buffer)) {
+            auto * dev = ggml_backend_buft_get_device(ggml_backend_buffer_get_type(w->buffer));
+
+            auto & be = backends[dev];
+            if (!be) {
+                be.reset(ggml_backend_dev_init(dev, nullptr));
+                if (!be) {
+                    throw std::runtime_error(format("failed to initialize the backend of %s", ggml_backend_dev_name(dev)));
+                }
+            }
+
+            backend = be.get();
+
+            // the A and B matrices must be on the device of the weight too
+            if (a->buffer != nullptr && !ggml_backend_supports_buft(backend, ggml_backend_buffer_get_type(a->buffer))) {
+                backend = nullptr;
+            }
+        }
+
+        bool on_dev = backend != nullptr;
+
+        for (int64_t i0 = 0; i0 < w->ne[1]; i0 += n_rows_chunk) {
+            const int64_t n_rows = std::min(n_rows_chunk, w->ne[1] - i0);
+
+            if (on_dev) {
+                on_dev = llama_adapter_lora_merge_rows_dev(backend, w, a, b, is_token_embd, scale_ab, i0, n_rows);
+                if (on_dev) {
+                    continue;
+                }
+            }
+
+            llama_adapter_lora_merge_rows_cpu(backend_cpu.get(), w, a, b, is_token_embd, scale_ab, i0, n_rows);
+        }
+
+        (on_dev ? n_dev : n_cpu)++;
+
+        LLAMA_LOG_DEBUG("%s: merged '%s' (%s) on the %s\n", __func__, w->name, ggml_type_name(w->type), on_dev ? "device" : "CPU");
+    }
+
+    LLAMA_LOG_INFO("%s: merged %d tensors on the devices and %d on the CPU\n", __func__, n_dev, n_cpu);
+}
+
+int32_t llama_adapter_lora_merge(llama_model * model, llama_adapter_lora * adapter, float scale, int32_t n_threads) {
+    try {
+        llama_adapter_lora_merge_impl(*model, *adapter, scale, n_threads);
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: failed to merge the lora adapter: %s\n", __func__, err.what());
+        return -1;
+    }
+
+    return 0;
+}
+
+static void llama_adapter_lora_init_trainable_impl(
+        llama_model & model, int32_t n_rank, float alpha, llama_opt_param_filter param_filter, void * param_filter_ud, llama_adapter_lora & adapter) {
+    LLAMA_LOG_INFO("%s: creating trainable lora adapter with rank %d ...\n", __func__, n_rank);
+
+    if (n_rank <= 0) {
+        throw std::runtime_error("lora rank must be positive");
+    }
+
+    adapter.alpha = alpha;
+
+    // the embeddings are applied with ggml_get_rows, not with build_lora_mm
+    auto is_lora_target = [&](const ggml_tensor * t) {
+        return ggml_n_dims(t) == 2 &&
+            t != model.tok_embd && t != model.type_embd && t != model.pos_embd &&
+            param_filter(t, param_filter_ud);
+    };
+
+    const std::vector<ggml_backend_buffer_type_t> buft_extra = llama_adapter_lora_extra_bufts();
+
+    // contexts for each buffer type
+    std::map<ggml_backend_buffer_type_t, ggml_context *> ctx_map;
+    auto ctx_for_buft = [&](ggml_backend_buffer_type_t buft) -> ggml_context * {
+        auto it = ctx_map.find(buft);
+        if (it == ctx_map.end()) {
+            ggml_init_params params = {
+                /*.mem_size   =*/ 2*model.tensors_by_name.size()*ggml_tensor_overhead(),
+                /*.mem_buffer =*/ NULL,
+                /*.no_alloc   =*/ true,
+            };
+            ggml_context * buft_ctx = ggml_init(params);
+            if (!buft_ctx) {
+                throw std::runtime_error("failed to create ggml context for lora adapter");
+            }
+            ctx_map[buft] = buft_ctx;
+            adapter.ctxs.emplace_back(buft_ctx);
+            return buft_ctx;
+        }
+        return it->second;
+    };
+
+    for (const auto & it : model.tensors_by_name) {
+        const ggml_tensor * model_tensor = it.second;
+        if (!is_lora_target(model_tensor)) {
+            continue;
+        }
+
+        auto * buft = llama_adapter_lora_buft(model_tensor, buft_extra);
+
+        LLAMA_LOG_DEBUG("%s: lora for '%s' -> '%s'\n", __func__, model_tensor->name, ggml_backend_buft_name(buft));
+
+        ggml_context * dev_ctx = ctx_for_buft(buft);
+
+        // A: [n_in, n_rank], B: [n_rank, n_out], see llm_graph_context::build_lora_mm
+        ggml_tensor * tensor_a = ggml_new_tensor_2d(dev_ctx, GGML_TYPE_F32, model_tensor->ne[0], n_rank);
+        ggml_tensor * tensor_b = ggml_new_tensor_2d(dev_ctx, GGML_TYPE_F32, n_rank, model_tensor->ne[1]);
+        ggml_format_name(tensor_a, "%s.lora_a", model_tensor->name);
+        ggml_format_name(tensor_b, "%s.lora_b", model_tensor->name);
+        adapter.ab_map[it.first] = llama_adapter_lora_weight(tensor_a, tensor_b);
+    }
+
+    if (adapter.ab_map.empty()) {
+        throw std::runtime_error("no model tensor passed the param filter");
+    }
+
+    // allocate tensors / buffers and zero
+    adapter.bufs.reserve(ctx_map.size());
+    for (auto & it : ctx_map) {
+        ggml_backend_buffer_type_t buft = it.first;
+        ggml_context * ctx_dev = it.second;
+        ggml_backend_buffer_ptr buf { ggml_backend_alloc_ctx_tensors_from_buft(ctx_dev, buft) };
+        if (!buf) {
+            throw std::runtime_error("failed to allocate buffer for lora adapter\n");
+        }
+        ggml_backend_buffer_clear(buf.get(), 0);
+        LLAMA_LOG_INFO("%s: %10s LoRA buffer size = %8.2f MiB\n", __func__, ggml_backend_buffer_name(buf.get()), ggml_backend_buffer_get_size(buf.get())/1024.0/1024.0);
+        adapter.bufs.emplace_back(std::move(buf));
+    }
+
+    // B is zero so that the adapter initially leaves the model unchanged, A is random so that B gets a gradient
+    std::mt19937 rng(42);
+    std::vector<float> data;
+    for (auto & it : adapter.ab_map) {
+        ggml_tensor * a = it.second.a;
+        const float bound = 1.0f/sqrtf((float) a->ne[0]);
+        std::uniform_real_distribution<float> dist(-bound, bound);
+
+        data.resize(ggml_nelements(a));
+        for (float & x : data) {
+            x = dist(rng);
+        }
+        ggml_backend_tensor_set(a, data.data(), 0, ggml_nbytes(a));
+    }
+
+    LLAMA_LOG_INFO("%s: created %zu trainable lora tensors\n", __func__, adapter.ab_map.size()*2);
+}
+
+llama_adapter_lora * llama_adapter_lora_init_trainable(
+        llama_model * model, int32_t n_rank, float alpha, llama_opt_param_filter param_filter, void * param_filter_ud) {
+    llama_adapter_lora * adapter = new llama_adapter_lora();
+
+    try {
+        llama_adapter_lora_init_trainable_impl(*model, n_rank, alpha, param_filter, param_filter_ud, *adapter);
+        return adapter;
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: failed to create lora adapter: %s\n", __func__, err.what());
+
+        delete adapter;
+    }
+
+    return nullptr;
+}
+
+bool llama_adapter_lora_save(const llama_adapter_lora * adapter, const llama_model * model, const char * path_lora) {
+    LLAMA_LOG_INFO("%s: saving lora adapter to '%s' ...\n", __func__, path_lora);
+
+    gguf_context_ptr ctx_gguf { gguf_init_empty() };
+    const LLM_KV llm_kv = LLM_KV(LLM_ARCH_UNKNOWN);
+
+    gguf_set_val_str(ctx_gguf.get(), llm_kv(LLM_KV_GENERAL_TYPE).c_str(),         "adapter");
+    gguf_set_val_str(ctx_gguf.get(), llm_kv(LLM_KV_GENERAL_ARCHITECTURE).c_str(), llm_arch_name(model->arch));
+    gguf_set_val_str(ctx_gguf.get(), llm_kv(LLM_KV_ADAPTER_TYPE).c_str(),         "lora");
+    gguf_set_val_f32(ctx_gguf.get(), llm_kv(LLM_KV_ADAPTER_LORA_ALPHA).c_str(),   adapter->alpha);
+
+    // write the tensors in a deterministic order
+    std::map<std::string, llama_adapter_lora_weight> ab_map(adapter->ab_map.begin(), adapter->ab_map.end());
+    for (const auto & it : ab_map) {
+        gguf_add_tensor(ctx_gguf.get(), it.second.a);
+        gguf_add_tensor(ctx_gguf.get(), it.second.b);
+    }
+
+    return gguf_write_to_file(ctx_gguf.get(), path_lora, false);
+}
@@ -134,6 +134,9 @@ enum llm_kv {
     LLM_KV_EXPERT_GATING_FUNC,
     LLM_KV_MOE_EVERY_N_LAYERS,
     LLM_KV_NEXTN_PREDICT_LAYERS,
+    LLM_KV_FFN_SPARSE_GROUP_SIZE,
+    LLM_KV_FFN_SPARSE_N_ACTIVE,
+    LLM_KV_FFN_SPARSE_N_HOT,
     LLM_KV_POOLING_TYPE,
     LLM_KV_LOGIT_SCALE,
     LLM_KV_DECODER_START_TOKEN_ID,
@@ -186,6 +189,10 @@ enum llm_kv {
     LLM_KV_SPLIT_COUNT,
     LLM_KV_SPLIT_TENSORS_COUNT,
 
+    LLM_KV_DELTA_BASE,
+    LLM_KV_DELTA_TENSORS,
+    LLM_KV_DELTA_TENSOR_HASHES,
+
     LLM_KV_SSM_INNER_SIZE,
     LLM_KV_SSM_CONV_KERNEL,
     LLM_KV_SSM_STATE_SIZE,
@@ -226,6 +233,9 @@ enum llm_kv {
     LLM_KV_TOKENIZER_FIM_PAD_ID,
     LLM_KV_TOKENIZER_FIM_REP_ID,
     LLM_KV_TOKENIZER_FIM_SEP_ID,
+    LLM_KV_TOKENIZER_INDEX_VERSION,
+    LLM_KV_TOKENIZER_INDEX_PIECES,
+    LLM_KV_TOKENIZER_INDEX_PIECE_OFFSETS,
 
     LLM_KV_ADAPTER_TYPE,
     LLM_KV_ADAPTER_LORA_ALPHA,
@@ -286,6 +296,8 @@ enum llm_tensor {
     LLM_TENSOR_FFN_GATE_SHEXP,
     LLM_TENSOR_FFN_UP_SHEXP,
     LLM_TENSOR_FFN_EXP_PROBS_B,
+    LLM_TENSOR_FFN_PRED_A,
+    LLM_TENSOR_FFN_PRED_B,
     LLM_TENSOR_ATTN_Q_NORM,
     LLM_TENSOR_ATTN_K_NORM,
     LLM_TENSOR_LAYER_OUT_NORM,
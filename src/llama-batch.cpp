@@ -441,6 +441,14 @@ void llama_batch_allocr::split_reset() {
     used.resize(get_n_tokens(), false);
 }
 
+// the size of the chunks when splitting n tokens in the least number of chunks of at most n_max tokens
+// the chunks have nearly equal sizes, so that there is no tiny trailing chunk
+static uint32_t split_chunk_size(uint32_t n, uint32_t n_max) {
+    const uint32_t n_chunks = (n + n_max - 1)/n_max;
+
+    return (n + n_chunks - 1)/n_chunks;
+}
+
 llama_ubatch llama_batch_allocr::split_simple(uint32_t n_ubatch) {
     // find the first unused token
     uint32_t cur_idx = 0;
@@ -453,6 +461,11 @@ llama_ubatch llama_batch_allocr::split_simple(uint32_t n_ubatch) {
         return {};
     }
 
+    // the remaining tokens are split in balanced ubatches, e.g. 513 tokens with n_ubatch = 512 become 257 + 256
+    // instead of 512 + 1 - the number of ubatches is the same, but there is no ubatch that is too small to use
+    // the matrix multiplication kernels efficiently
+    const uint32_t n_take = split_chunk_size(used.size() - cur_idx, n_ubatch);
+
     std::vector<int32_t> idxs;
 
     while (true) {
@@ -467,7 +480,7 @@ llama_ubatch llama_batch_allocr::split_simple(uint32_t n_ubatch) {
             break;
         }
 
-        if (idxs.size() >= n_ubatch) {
+        if (idxs.size() >= n_take) {
             break;
         }
     }
@@ -482,11 +495,10 @@ llama_ubatch llama_batch_allocr::split_equal(uint32_t n_ubatch, bool sequential)
         return {};
     }
 
-    std::vector<seq_set_t> cur_seq_set;
+    // the non-overlapping sequence sets that can participate in this ubatch
+    std::vector<seq_set_t> cand_seq_set;
 
-    llama_seq_id last_seq_id = -1;
-
-    // determine the non-overlapping sequence sets participating in this ubatch
+    // determine the candidates in the order in which they appear in the batch
     for (int32_t i = 0; i < batch.n_tokens; ++i) {
         if (used[i]) {
             continue;
@@ -494,87 +506,159 @@ llama_ubatch llama_batch_allocr::split_equal(uint32_t n_ubatch, bool sequential)
 
         bool add = true;
 
-        for (uint32_t s = 0; s < cur_seq_set.size(); ++s) {
+        for (uint32_t s = 0; s < cand_seq_set.size(); ++s) {
             // no overlap with existing sequence sets:
-            if (!(cur_seq_set[s] & seq_set[i]).none()) {
+            if (!(cand_seq_set[s] & seq_set[i]).none()) {
                 add = false;
                 break;
             }
         }
 
-        // accept only increasing sequence ids
-        if (sequential) {
-            add = add && (cur_seq_set.empty() || batch.seq_id[i][0] == last_seq_id + 1);
-        }
-
         if (add) {
-            cur_seq_set.push_back(seq_set[i]);
-
-            last_seq_id = batch.seq_id[i][0];
-
-            if (cur_seq_set.size() > n_ubatch) {
-                break;
-            }
+            cand_seq_set.push_back(seq_set[i]);
         }
     }
 
-    const uint32_t n_seqs = cur_seq_set.size();
+    const uint32_t n_cand = cand_seq_set.size();
 
     // we are done
-    if (n_seqs == 0) {
+    if (n_cand == 0) {
         return {};
     }
 
-    // the current batch index of each sequence set
-    std::vector<int32_t> cur_idx(n_seqs, 0);
+    // the current batch index, the number of unused tokens and the KV extent of each candidate
+    std::vector<int32_t>   cand_idx(n_cand, 0);
+    std::vector<uint32_t>  cand_rem(n_cand, 0);
+    std::vector<llama_pos> cand_kv (n_cand, 0);
 
-    for (uint32_t s = 0; s < n_seqs; ++s) {
-        while (used[seq_set_map[cur_seq_set[s]][cur_idx[s]]]) {
-            ++cur_idx[s];
+    for (uint32_t c = 0; c < n_cand; ++c) {
+        const auto & idxs = seq_set_map[cand_seq_set[c]];
+
+        while (used[idxs[cand_idx[c]]]) {
+            ++cand_idx[c];
+        }
+
+        cand_rem[c] = idxs.size() - cand_idx[c];
+
+        // the number of KV cells that the sequence set attends to after this batch
+        for (int32_t s = 0; s < LLAMA_MAX_SEQ; ++s) {
+            if (cand_seq_set[c].test(s)) {
+                cand_kv[c] = std::max(cand_kv[c], seq_pos_max(s) + 1);
+            }
         }
     }
 
-    // the list of batch indices for each sequence set
-    // at the end we will concat these to get the final ubatch
-    std::vector<idx_vec_t> idxs_per_seq(n_seqs);
+    // choose the candidates of the ubatch with a simple cost model:
+    //   - a ubatch of n_seqs sequence sets takes n_seq_tokens = min(remaining tokens, n_ubatch/n_seqs) tokens of each set,
+    //     so the number of tokens in the ubatch is maximized - this is the number of ubatches for the whole batch,
+    //     each of which has to read all the weights. taking all the candidates would limit the ubatch to the
+    //     shortest one, e.g. one decoded token per sequence when decoding is mixed with prompt processing
+    //   - among the equally large ubatches, the one whose sequence sets have the most similar KV extents is chosen,
+    //     as the attention of the ubatch costs n_tokens*n_kv and n_kv is set by the longest sequence set
+    //
+    // order: the candidates in the order in which the prefixes/windows of the ubatch are evaluated
+    std::vector<uint32_t> order(n_cand);
+    for (uint32_t c = 0; c < n_cand; ++c) {
+        order[c] = c;
+    }
 
-    while (true) {
-        // we can only add new n_seq_tokens tokens if all the sequence sets have at least one more unused token and
-        //   if we haven't reached n_ubatch
-        bool can_expand = true;
+    uint32_t best_c0  = 0; // the chosen candidates are order[best_c0, best_c1)
+    uint32_t best_c1  = 0;
+    uint32_t best_n   = 0;
+    llama_pos best_kv = 0;
 
-        for (uint32_t s = 0; s < n_seqs; ++s) {
-            if (cur_idx[s] >= (int32_t) seq_set_map[cur_seq_set[s]].size()) {
-                can_expand = false;
-                break;
-            }
+    const auto eval = [&](uint32_t c0, uint32_t c1, uint32_t rem_min, llama_pos kv_min, llama_pos kv_max) {
+        const uint32_t n_seqs = c1 - c0;
+        const uint32_t n      = n_seqs*std::min(rem_min, n_ubatch/n_seqs);
+
+        if (n > best_n || (n == best_n && kv_max - kv_min < best_kv)) {
+            best_c0 = c0;
+            best_c1 = c1;
+            best_n  = n;
+            best_kv = kv_max - kv_min;
         }
+    };
 
-        if (!can_expand) {
-            break;
+    if (sequential) {
+        // the ubatch must consist of consecutive sequence ids, so evaluate the windows of consecutive ids
+        // without coupled sequences, each sequence set is a single sequence
+        std::vector<llama_seq_id> cand_seq_id(n_cand);
+        for (uint32_t c = 0; c < n_cand; ++c) {
+            cand_seq_id[c] = batch.seq_id[seq_set_map[cand_seq_set[c]][0]][0];
         }
 
-        for (uint32_t s = 0; s < n_seqs; ++s) {
-            const int32_t idx = seq_set_map[cur_seq_set[s]][cur_idx[s]];
+        std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+            return cand_seq_id[a] < cand_seq_id[b];
+        });
 
-            idxs_per_seq[s].push_back(idx);
+        for (uint32_t c0 = 0; c0 < n_cand; ++c0) {
+            uint32_t  rem_min = cand_rem[order[c0]];
+            llama_pos kv_min  = cand_kv [order[c0]];
+            llama_pos kv_max  = cand_kv [order[c0]];
 
-            used[idx] = true;
-            ++n_used;
+            for (uint32_t c1 = c0 + 1; c1 <= n_cand && c1 - c0 <= n_ubatch; ++c1) {
+                const uint32_t c = order[c1 - 1];
+
+                if (c1 - 1 > c0 && cand_seq_id[c] != cand_seq_id[order[c1 - 2]] + 1) {
+                    break;
+                }
 
-            ++cur_idx[s];
+                rem_min = std::min(rem_min, cand_rem[c]);
+                kv_min  = std::min(kv_min,  cand_kv[c]);
+                kv_max  = std::max(kv_max,  cand_kv[c]);
+
+                eval(c0, c1, rem_min, kv_min, kv_max);
+            }
         }
+    } else {
+        // the best ubatch of n_seqs sequence sets consists of the n_seqs sets with the most remaining tokens
+        // ties are ordered by KV extent, so that the sets that are taken together have similar extents
+        std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+            return cand_rem[a] != cand_rem[b] ? cand_rem[a] > cand_rem[b] : cand_kv[a] > cand_kv[b];
+        });
 
-        if  ((idxs_per_seq[0].size() + 1)*n_seqs > n_ubatch) {
-            break;
+        llama_pos kv_min = cand_kv[order[0]];
+        llama_pos kv_max = cand_kv[order[0]];
+
+        for (uint32_t c1 = 1; c1 <= n_cand && c1 <= n_ubatch; ++c1) {
+            kv_min = std::min(kv_min, cand_kv[order[c1 - 1]]);
+            kv_max = std::max(kv_max, cand_kv[order[c1 - 1]]);
+
+            eval(0, c1, cand_rem[order[c1 - 1]], kv_min, kv_max);
         }
     }
 
-    // concat the per-sequence-set lists
+    // keep the chosen sequence sets in the order of the batch
+    // sequential: in the order of the sequence ids, which is the order of the streams of the KV cache
+    std::vector<uint32_t> chosen(order.begin() + best_c0, order.begin() + best_c1);
+    if (!sequential) {
+        std::sort(chosen.begin(), chosen.end());
+    }
+
+    const uint32_t n_seqs = chosen.size();
+
+    uint32_t rem_min = cand_rem[chosen[0]];
+    for (uint32_t c : chosen) {
+        rem_min = std::min(rem_min, cand_rem[c]);
+    }
+
+    // balance the tokens of the sequence sets over the ubatches that they need, to avoid a tiny trailing ubatch
+    const uint32_t n_seq_tokens = split_chunk_size(rem_min, n_ubatch/n_seqs);
+
+    // take n_seq_tokens tokens of each sequence set
     std::vector<int32_t> idxs;
 
-    for (uint32_t s = 0; s < n_seqs; ++s) {
-        idxs.insert(idxs.end(), idxs_per_seq[s].begin(), idxs_per_seq[s].end());
+    for (uint32_t c : chosen) {
+        const auto & idxs_cur = seq_set_map[cand_seq_set[c]];
+
+        for (uint32_t j = 0; j < n_seq_tokens; ++j) {
+            const int32_t idx = idxs_cur[cand_idx[c] + j];
+
+            idxs.push_back(idx);
+
+            used[idx] = true;
+            ++n_used;
+        }
     }
 
     return ubatch_add(idxs, n_seqs, true);
@@ -622,6 +706,51 @@ llama_ubatch llama_batch_allocr::split_seq(uint32_t n_ubatch) {
     return ubatch_add(idxs, 1, true);
 }
 
+llama_ubatch llama_batch_allocr::split_packed(uint32_t n_ubatch) {
+    std::vector<int32_t> idxs;
+
+    // coupled sequences attend to each other, so they are all kept in one ubatch
+    if (has_cpl) {
+        if (n_used == 0 && batch.n_tokens > (int32_t) n_ubatch) {
+            LLAMA_LOG_ERROR("%s: batch of %d tokens with coupled sequences does not fit in n_ubatch = %u\n", __func__, batch.n_tokens, n_ubatch);
+            return {};
+        }
+
+        return split_simple(batch.n_tokens);
+    }
+
+    // first-fit of the remaining sequence sets - a set that does not fit is left for one of the next ubatches
+    for (int32_t i = 0; i < batch.n_tokens; ++i) {
+        if (used[i]) {
+            continue;
+        }
+
+        const auto & set_idxs = seq_set_map[seq_set[i]];
+
+        if (idxs.size() + set_idxs.size() > n_ubatch) {
+            if (idxs.empty()) {
+                LLAMA_LOG_ERROR("%s: sequence set of %zu tokens does not fit in n_ubatch = %u\n", __func__, set_idxs.size(), n_ubatch);
+                return {};
+            }
+
+            continue;
+        }
+
+        for (const int32_t idx : set_idxs) {
+            idxs.push_back(idx);
+
+            used[idx] = true;
+            ++n_used;
+        }
+    }
+
+    if (idxs.empty()) {
+        return {};
+    }
+
+    return ubatch_add(idxs, idxs.size(), false);
+}
+
 void llama_batch_allocr::clear() {
     n_outputs = 0;
 
@@ -800,7 +929,7 @@ void llama_batch_allocr::ubatch_print(const llama_ubatch & ubatch, int debug) {
 
                 if (ubatch.token) {
                     LLAMA_LOG_DEBUG("%s:  %4d: id = %6d (%16s), pos = %4d, n_seq_id = %2d, seq_id = [%s], output = %d\n",
-                            __func__, i, ubatch.token[i], vocab->token_to_piece(ubatch.token[i]).c_str(),
+                            __func__, i, ubatch.token[i], std::string(vocab->token_to_piece(ubatch.token[i])).c_str(),
                             ubatch.pos[i], ubatch.n_seq_id[i], ss.str().c_str(), ubatch.output[i]);
                 } else {
                     LLAMA_LOG_DEBUG("%s:  %4d: [embd], pos = %4d, n_seq_id = %2d, seq_id = [%s], output = %d\n",
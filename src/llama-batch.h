@@ -87,15 +87,21 @@ public:
     void split_reset();
 
     // simple split, unknown number of sequence sets of unequal lengths
+    // the batch is split in ubatches of nearly equal sizes
     llama_ubatch split_simple(uint32_t n_ubatch);
 
     // make ubatches of equal-length sequences sets
+    // the sequence sets of a ubatch are chosen to maximize its number of tokens, preferring sets of similar KV extents
     // if sequential == true, the tokens in the ubatch will have increasing sequential sequence ids
     llama_ubatch split_equal(uint32_t n_ubatch, bool sequential);
 
     // sequence-set-wise split - each ubatch contains a single sequence-set
     llama_ubatch split_seq(uint32_t n_ubatch);
 
+    // packed split for non-causal encoding - each ubatch contains whole sequence sets, in the order of the batch
+    // returns an empty ubatch if the next sequence set does not fit in n_ubatch tokens
+    llama_ubatch split_packed(uint32_t n_ubatch);
+
     // a helper method for creating a well-defined ubatch of tokens
     // TODO: support embeddings if needed in the future
     llama_ubatch ubatch_reserve(uint32_t n_seq_tokens, uint32_t n_seqs);
@@ -3,22 +3,59 @@
 #include "llama-impl.h"
 #include "llama-batch.h"
 #include "llama-io.h"
+#include "llama-kv-cache-unified.h"
 #include "llama-memory.h"
 #include "llama-mmap.h"
 #include "llama-model.h"
 
+#include <algorithm>
+#include <chrono>
 #include <cinttypes>
+#include <cmath>
 #include <cstring>
+#include <future>
 #include <limits>
+#include <numeric>
 #include <stdexcept>
 
 //
 // llama_context
 //
 
+// host buffer type with the placement flags (enum ggml_cpu_mem_flags), nullptr for the CPU buffer type
+static ggml_backend_buffer_type_t llama_cpu_mem_buft(int32_t flags) {
+    if (flags == 0) {
+        return nullptr;
+    }
+
+    auto * cpu_dev = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
+    auto * mem_buft_fn = cpu_dev ? (decltype(ggml_backend_cpu_mem_buffer_type) *)
+        ggml_backend_reg_get_proc_address(ggml_backend_dev_backend_reg(cpu_dev), "ggml_backend_cpu_mem_buffer_type") : nullptr;
+    if (!mem_buft_fn) {
+        LLAMA_LOG_WARN("%s: the CPU backend does not support the placement of the buffers\n", __func__);
+        return nullptr;
+    }
+
+    return mem_buft_fn(flags);
+}
+
+// host buffer type placed on a NUMA node, nullptr for the CPU buffer type
+static ggml_backend_buffer_type_t llama_cpu_node_buft(int32_t node) {
+    auto * cpu_dev = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
+    auto * node_buft_fn = cpu_dev ? (decltype(ggml_backend_cpu_node_buffer_type) *)
+        ggml_backend_reg_get_proc_address(ggml_backend_dev_backend_reg(cpu_dev), "ggml_backend_cpu_node_buffer_type") : nullptr;
+    auto * buft = node_buft_fn ? node_buft_fn(node) : nullptr;
+    if (!buft) {
+        LLAMA_LOG_WARN("%s: NUMA node %d is not available, the KV cache is not placed\n", __func__, node);
+    }
+
+    return buft;
+}
+
 llama_context::llama_context(
         const llama_model & model,
-              llama_context_params params) :
+              llama_context_params params,
+        const llama_context * ctx_shared) :
     model(model),
     balloc(std::make_unique<llama_batch_allocr>(model.hparams.n_pos_per_embd())) {
     LLAMA_LOG_INFO("%s: constructing llama_context\n", __func__);
@@ -41,6 +78,10 @@ llama_context::llama_context(
     cparams.yarn_beta_slow   = params.yarn_beta_slow;
     cparams.defrag_thold     = params.defrag_thold;
     cparams.embeddings       = params.embeddings;
+    cparams.output_hidden    = false;
+    cparams.mtp_draft        = false;
+
+    mtp_hidden.n_embd = model.hparams.n_embd;
     cparams.offload_kqv      = params.offload_kqv;
     cparams.flash_attn       = params.flash_attn;
     cparams.no_perf          = params.no_perf;
@@ -102,6 +143,24 @@ llama_context::llama_context(
 
     cparams.op_offload = params.op_offload;
     cparams.kv_unified = params.kv_unified;
+    cparams.kv_scores  = params.kv_scores;
+    cparams.expert_stats = params.expert_stats;
+    cparams.reserve_lazy = params.reserve_lazy;
+    cparams.ffn_sparse   = params.ffn_sparse;
+
+    if (cparams.kv_scores && cparams.flash_attn) {
+        LLAMA_LOG_WARN("%s: kv_scores requires the attention weights, which are not available with flash_attn - disabling kv_scores\n", __func__);
+        cparams.kv_scores = false;
+    }
+
+    if (cparams.expert_stats) {
+        if (model.hparams.n_expert == 0) {
+            LLAMA_LOG_WARN("%s: expert_stats requires a MoE model - disabling expert_stats\n", __func__);
+            cparams.expert_stats = false;
+        } else {
+            expert_counts.resize(model.hparams.n_layer*model.hparams.n_expert, 0);
+        }
+    }
 
     {
         const char * LLAMA_SET_ROWS = getenv("LLAMA_SET_ROWS");
@@ -113,6 +172,70 @@ llama_context::llama_context(
         }
     }
 
+    {
+        const int32_t n_layer = hparams.n_layer;
+
+        cparams.n_layer_exit     = params.n_layer_exit > 0 && params.n_layer_exit < n_layer ? params.n_layer_exit : 0;
+        cparams.layer_skip_begin = 0;
+        cparams.layer_skip_end   = 0;
+
+        // the last evaluated layer is never skipped
+        const int32_t n_layer_eval = cparams.n_layer_exit > 0 ? cparams.n_layer_exit : n_layer;
+
+        const int32_t skip_begin = std::max(0, params.layer_skip_begin);
+        const int32_t skip_end   = std::min(n_layer_eval - 1, params.layer_skip_end);
+
+        if (skip_begin < skip_end) {
+            if (model.arch == LLM_ARCH_LLAMA || model.arch == LLM_ARCH_QWEN2 || model.arch == LLM_ARCH_QWEN3) {
+                cparams.layer_skip_begin = skip_begin;
+                cparams.layer_skip_end   = skip_end;
+            } else {
+                LLAMA_LOG_WARN("%s: layer skipping is not supported by this architecture - only early exit is used\n", __func__);
+            }
+        }
+
+        if (cparams.n_layer_exit > 0 || cparams.layer_skip_begin < cparams.layer_skip_end) {
+            LLAMA_LOG_INFO("%s: evaluating %d of %d layers (exit = %d, skip = [%d, %d))\n", __func__,
+                    n_layer_eval - (cparams.layer_skip_end - cparams.layer_skip_begin), n_layer,
+                    n_layer_eval, cparams.layer_skip_begin, cparams.layer_skip_end);
+        }
+    }
+
+    cparams.n_logits_top_k = params.n_logits_top_k > 0 ? std::min<uint32_t>(params.n_logits_top_k, model.vocab.n_tokens()) : 0;
+
+    if (cparams.n_logits_top_k > 0) {
+        LLAMA_LOG_INFO("%s: selecting the top %u logits of each output on the device\n", __func__, cparams.n_logits_top_k);
+    }
+
+    // the top-k logits are always copied back as F32
+    cparams.logits_type = cparams.n_logits_top_k > 0 ? LLAMA_LOGITS_TYPE_F32 : params.logits_type;
+
+    if (cparams.logits_type != LLAMA_LOGITS_TYPE_F32) {
+        LLAMA_LOG_INFO("%s: copying the logits back as %s\n", __func__, cparams.logits_type == LLAMA_LOGITS_TYPE_F16 ? "f16" : "bf16");
+    }
+
+    cparams.type_opt = GGML_TYPE_F32;
+
+    cparams.n_embd_out     = params.n_embd_out > 0 ? std::min<uint32_t>(params.n_embd_out, hparams.n_embd) : hparams.n_embd;
+    cparams.embd_normalize = params.embd_normalize;
+    cparams.embd_type      = params.embd_type;
+
+    if (cparams.embd_type == LLAMA_EMBD_TYPE_Q8_0 && cparams.n_embd_out % ggml_blck_size(GGML_TYPE_Q8_0) != 0) {
+        LLAMA_LOG_WARN("%s: n_embd_out = %u is not a multiple of %" PRId64 ", the embeddings are output as F32\n", __func__,
+                cparams.n_embd_out, ggml_blck_size(GGML_TYPE_Q8_0));
+        cparams.embd_type = LLAMA_EMBD_TYPE_F32;
+    }
+    if (cparams.embd_type == LLAMA_EMBD_TYPE_BINARY && cparams.n_embd_out % 8 != 0) {
+        LLAMA_LOG_WARN("%s: n_embd_out = %u is not a multiple of 8, the embeddings are output as F32\n", __func__, cparams.n_embd_out);
+        cparams.embd_type = LLAMA_EMBD_TYPE_F32;
+    }
+
+    if (cparams.n_embd_out < hparams.n_embd || cparams.embd_normalize || cparams.embd_type != LLAMA_EMBD_TYPE_F32) {
+        static const char * embd_type_names[] = { "f32", "q8_0", "binary" };
+        LLAMA_LOG_INFO("%s: pooled embeddings: n_embd_out = %u, normalize = %d, type = %s\n", __func__,
+                cparams.n_embd_out, cparams.embd_normalize, embd_type_names[cparams.embd_type]);
+    }
+
     {
         const char * LLAMA_GRAPH_REUSE_DISABLE = getenv("LLAMA_GRAPH_REUSE_DISABLE");
         graph_reuse_disable = LLAMA_GRAPH_REUSE_DISABLE ? (atoi(LLAMA_GRAPH_REUSE_DISABLE) != 0) : graph_reuse_disable;
@@ -120,6 +243,9 @@ llama_context::llama_context(
         if (graph_reuse_disable) {
             LLAMA_LOG_WARN("%s: graph reuse disabled\n", __func__);
         }
+
+        const char * LLAMA_GRAPH_CACHE_SIZE = getenv("LLAMA_GRAPH_CACHE_SIZE");
+        graph_cache_size = LLAMA_GRAPH_CACHE_SIZE ? std::max(0, atoi(LLAMA_GRAPH_CACHE_SIZE)) : graph_cache_size;
     }
 
     const uint32_t n_ctx_per_seq = cparams.n_ctx / cparams.n_seq_max;
@@ -150,14 +276,19 @@ llama_context::llama_context(
                 __func__, cparams.n_seq_max, "https://github.com/ggml-org/llama.cpp/pull/13845#issuecomment-2924800573");
     }
 
-    if (!hparams.vocab_only) {
+    if (!hparams.vocab_only && ctx_shared) {
+        backends    = ctx_shared->backends;
+        backend_cpu = ctx_shared->backend_cpu;
+
+        set_n_threads_fns = ctx_shared->set_n_threads_fns;
+    } else if (!hparams.vocab_only) {
         // GPU backends
         for (auto * dev : model.devices) {
             ggml_backend_t backend = ggml_backend_dev_init(dev, nullptr);
             if (backend == nullptr) {
                 throw std::runtime_error(format("failed to initialize %s backend", ggml_backend_dev_name(dev)));
             }
-            backends.emplace_back(backend);
+            backends.emplace_back(backend, ggml_backend_free);
         }
 
         // add ACCEL backends (such as BLAS)
@@ -168,7 +299,7 @@ llama_context::llama_context(
                 if (backend == nullptr) {
                     throw std::runtime_error(format("failed to initialize %s backend", ggml_backend_dev_name(dev)));
                 }
-                backends.emplace_back(backend);
+                backends.emplace_back(backend, ggml_backend_free);
             }
         }
 
@@ -177,7 +308,7 @@ llama_context::llama_context(
         if (backend_cpu == nullptr) {
             throw std::runtime_error("failed to initialize CPU backend");
         }
-        backends.emplace_back(backend_cpu);
+        backends.emplace_back(backend_cpu, ggml_backend_free);
 
         // create a list of the set_n_threads functions in the backends
         for (auto & backend : backends) {
@@ -190,7 +321,9 @@ llama_context::llama_context(
                 }
             }
         }
+    }
 
+    if (!hparams.vocab_only) {
         llama_set_abort_callback(this, params.abort_callback, params.abort_callback_data);
 
         // graph outputs buffer
@@ -209,16 +342,37 @@ llama_context::llama_context(
     // init the memory module
     if (!hparams.vocab_only) {
         llama_memory_params params_mem = {
-            /*.type_k   =*/ params.type_k,
-            /*.type_v   =*/ params.type_v,
-            /*.swa_full =*/ params.swa_full,
+            /*.type_k        =*/ params.type_k,
+            /*.type_v        =*/ params.type_v,
+            /*.n_layer_f16   =*/ params.n_layer_kv_f16,
+            /*.buft_cpu      =*/ params.kv_mem_node >= 0 ? llama_cpu_node_buft(params.kv_mem_node) : llama_cpu_mem_buft(params.cpu_mem_kv),
+            /*.n_ckpt        =*/ params.n_rs_ckpt,
+            /*.ckpt_interval =*/ params.rs_ckpt_interval,
+            /*.swa_full      =*/ params.swa_full,
         };
 
         memory.reset(model.create_memory(params_mem, cparams));
     }
 
-    // init backends
-    if (!hparams.vocab_only) {
+    if (!hparams.vocab_only && ctx_shared) {
+        backend_buft = ctx_shared->backend_buft;
+        backend_ptrs = ctx_shared->backend_ptrs;
+
+        sched  = ctx_shared->sched;
+        shared = ctx_shared->shared;
+
+        n_pp_stages     = ctx_shared->n_pp_stages;
+        n_pp_ubatch_min = ctx_shared->n_pp_ubatch_min;
+
+        const size_t max_nodes = this->graph_max_nodes();
+
+        gf_res_prev.reset(new llm_graph_result(max_nodes));
+        gf_res_reserve.reset(new llm_graph_result(max_nodes));
+
+        // the graphs of the other contexts may be allocated in the scheduler
+        sched_stale = true;
+    } else if (!hparams.vocab_only) {
+        // init backends
         LLAMA_LOG_DEBUG("%s: enumerating backends\n", __func__);
 
         backend_buft.clear();
@@ -237,6 +391,12 @@ llama_context::llama_context(
                 }
             }
 
+            if (backend_type == GGML_BACKEND_DEVICE_TYPE_CPU && buft == ggml_backend_cpu_buffer_type() && params.cpu_mem_compute != 0) {
+                if (auto * mem_buft = llama_cpu_mem_buft(params.cpu_mem_compute)) {
+                    buft = mem_buft;
+                }
+            }
+
             backend_buft.push_back(buft);
             backend_ptrs.push_back(backend.get());
         }
@@ -278,19 +438,37 @@ llama_context::llama_context(
             }
         }
 
-        sched.reset(ggml_backend_sched_new(backend_ptrs.data(), backend_buft.data(), backend_ptrs.size(), max_nodes, pipeline_parallel, cparams.op_offload));
+        sched.reset(ggml_backend_sched_new(backend_ptrs.data(), backend_buft.data(), backend_ptrs.size(), max_nodes, pipeline_parallel, cparams.op_offload), ggml_backend_sched_free);
+        shared = std::make_shared<llama_context_shared>();
 
         if (pipeline_parallel) {
             LLAMA_LOG_INFO("%s: pipeline parallelism enabled (n_copies=%d)\n", __func__, ggml_backend_sched_get_n_copies(sched.get()));
+
+            n_pp_stages = std::min<uint32_t>(model.n_devices(), ggml_backend_sched_get_n_copies(sched.get()));
+
+            const char * LLAMA_PP_UBATCH_MIN = getenv("LLAMA_PP_UBATCH_MIN");
+            n_pp_ubatch_min = LLAMA_PP_UBATCH_MIN ? (uint32_t) std::max(0, atoi(LLAMA_PP_UBATCH_MIN)) : n_pp_ubatch_min;
+
+            if (n_pp_ubatch_min > 0) {
+                LLAMA_LOG_INFO("%s: pipeline micro-batches enabled (n_stages = %u, n_ubatch_min = %u)\n", __func__, n_pp_stages, n_pp_ubatch_min);
+            }
         }
     }
 
-    // reserve worst-case graph
-    if (!hparams.vocab_only && memory) {
+    // reserve worst-case graph - the compute buffers of a shared scheduler are already reserved
+    if (!hparams.vocab_only && memory && ctx_shared) {
+        const uint32_t n_tokens_shared = std::min(ctx_shared->cparams.n_ctx, ctx_shared->cparams.n_ubatch);
+        const uint32_t n_tokens        = std::min(cparams.n_ctx, cparams.n_ubatch);
+
+        if (cparams.n_ctx > ctx_shared->cparams.n_ctx || n_tokens > n_tokens_shared || cparams.n_seq_max > ctx_shared->cparams.n_seq_max) {
+            LLAMA_LOG_WARN("%s: the context is larger than the pool - the shared compute buffers will grow on the first decode\n", __func__);
+        }
+    } else if (!hparams.vocab_only && memory) {
         const uint32_t n_seqs = cparams.kv_unified ? 1 : cparams.n_seq_max;
         const uint32_t n_tokens = std::min(cparams.n_ctx, cparams.n_ubatch);
+        const uint32_t n_outputs_pp = n_outputs_reserve(n_tokens, n_seqs);
 
-        LLAMA_LOG_DEBUG("%s: worst-case: n_tokens = %d, n_seqs = %d, n_outputs = %d\n", __func__, n_tokens, n_seqs, n_outputs);
+        LLAMA_LOG_DEBUG("%s: worst-case: n_tokens = %d, n_seqs = %d, n_outputs = %d\n", __func__, n_tokens, n_seqs, n_outputs_pp);
 
         int n_splits_pp = -1;
         int n_nodes_pp  = -1;
@@ -309,7 +487,7 @@ llama_context::llama_context(
 
         // reserve pp (prompt processing) graph first so that buffers are only allocated once
         {
-            auto * gf = graph_reserve(n_tokens, n_seqs, n_tokens, mctx.get());
+            auto * gf = graph_reserve(n_tokens, n_seqs, n_outputs_pp, mctx.get());
             if (!gf) {
                 throw std::runtime_error("failed to allocate compute pp buffers");
             }
@@ -335,7 +513,7 @@ llama_context::llama_context(
             //
             // auto * gf = graph_reserve(n_tokens, 1, n_tokens, mctx.get());
             //
-            auto * gf = graph_reserve(n_tokens, n_seqs, n_tokens, mctx.get());
+            auto * gf = graph_reserve(n_tokens, n_seqs, n_outputs_pp, mctx.get());
             if (!gf) {
                 throw std::runtime_error("failed to allocate compute pp buffers");
             }
@@ -367,10 +545,34 @@ llama_context::llama_context(
 }
 
 llama_context::~llama_context() {
+    decode_wait();
+
+    if (decode_worker.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(decode_mutex);
+            decode_stop = true;
+        }
+        decode_cv.notify_all();
+        decode_worker.join();
+    }
+
+    if (shared) {
+        // another context may be created at the same address
+        std::lock_guard<std::recursive_mutex> lock(shared->mutex);
+        if (shared->owner == this) {
+            shared->owner = nullptr;
+        }
+    }
+
     ggml_opt_free(opt_ctx);
 }
 
 void llama_context::synchronize() {
+    // the worker of decode_async() must not wait for itself
+    if (std::this_thread::get_id() != decode_worker.get_id()) {
+        decode_wait();
+    }
+
     ggml_backend_sched_synchronize(sched.get());
 
     // FIXME: if multiple single tokens are evaluated without a synchronization,
@@ -412,6 +614,17 @@ ggml_backend_sched_t llama_context::get_sched() const {
     return sched.get();
 }
 
+std::unique_lock<std::recursive_mutex> llama_context::sched_lock() {
+    std::unique_lock<std::recursive_mutex> lock(shared->mutex);
+
+    if (shared->owner != this) {
+        shared->owner = this;
+        sched_stale   = true;
+    }
+
+    return lock;
+}
+
 uint32_t llama_context::n_ctx() const {
     return cparams.n_ctx;
 }
@@ -444,6 +657,10 @@ llama_memory_t llama_context::get_memory() const {
     return memory.get();
 }
 
+void llama_context::memory_free() {
+    memory.reset();
+}
+
 // deprecated
 void llama_context::kv_self_defrag_sched() {
     if (!memory) {
@@ -459,6 +676,10 @@ bool llama_context::kv_self_update(bool optimize) {
         return false;
     }
 
+    auto lock = sched_lock();
+
+    const int64_t t_start_us = ggml_time_us();
+
     {
         // TODO: remove in the future
         optimize |= memory_force_optimize;
@@ -487,6 +708,7 @@ bool llama_context::kv_self_update(bool optimize) {
         // TODO: change the mctx->apply() to return information if a graph reserve is needed
         //       reset the graph result only if the memory module did reset the scheduler
         gf_res_prev->reset();
+        gf_res_cache.clear();
 
         if (!mctx->apply()) {
             LLAMA_LOG_ERROR("%s: failed to apply memory update\n", __func__);
@@ -503,12 +725,15 @@ bool llama_context::kv_self_update(bool optimize) {
         const uint32_t n_seqs = cparams.kv_unified ? 1 : cparams.n_seq_max;
         const uint32_t n_tokens = std::min(cparams.n_ctx, cparams.n_ubatch);
 
-        auto * gf = graph_reserve(n_tokens, n_seqs, n_tokens, mctx.get());
+        auto * gf = graph_reserve(n_tokens, n_seqs, n_outputs_reserve(n_tokens, n_seqs), mctx.get());
         if (!gf) {
             LLAMA_LOG_ERROR("%s: failed to reserve graph after the memory update\n", __func__);
         }
     }
 
+    t_mem_update_us += ggml_time_us() - t_start_us;
+    n_mem_update++;
+
     return true;
 }
 
@@ -519,6 +744,14 @@ enum llama_pooling_type llama_context::pooling_type() const {
 float * llama_context::get_logits() {
     output_reorder();
 
+    output_logits();
+
+    if (!logits_filled.empty()) {
+        for (int64_t j = 0; j < n_outputs; ++j) {
+            output_fill_logits(j);
+        }
+    }
+
     return logits;
 }
 
@@ -528,7 +761,7 @@ float * llama_context::get_logits_ith(int32_t i) {
     output_reorder();
 
     try {
-        if (logits == nullptr) {
+        if (output_logits() == nullptr) {
             throw std::runtime_error("no logits");
         }
 
@@ -551,6 +784,8 @@ float * llama_context::get_logits_ith(int32_t i) {
             throw std::runtime_error(format("corrupt output buffer (j=%" PRId64 ", n_outputs=%d)", j, n_outputs));
         }
 
+        output_fill_logits(j);
+
         return logits + j*model.vocab.n_tokens();
     } catch (const std::exception & err) {
         LLAMA_LOG_ERROR("%s: invalid logits id %d, reason: %s\n", __func__, i, err.what());
@@ -562,6 +797,135 @@ float * llama_context::get_logits_ith(int32_t i) {
     }
 }
 
+int32_t llama_context::get_logits_top_k_ith(int32_t i, const llama_token ** ids, const float ** logits) {
+    if ((cparams.n_logits_top_k == 0 || logits_top_k.empty()) && vocab_short.ids.empty()) {
+        return 0;
+    }
+
+    output_reorder();
+
+    int64_t j = -1;
+
+    if (i < 0) {
+        j = n_outputs + i;
+    } else if ((size_t) i < output_ids.size()) {
+        j = output_ids[i];
+    }
+
+    if (j < 0 || j >= n_outputs) {
+        LLAMA_LOG_ERROR("%s: invalid logits id %d\n", __func__, i);
+        return 0;
+    }
+
+    if (!vocab_short.ids.empty()) {
+        const int64_t n_short = vocab_short.ids.size();
+
+        if (ids) {
+            *ids = vocab_short.ids.data();
+        }
+        if (logits) {
+            *logits = logits_short.data() + j*n_short;
+        }
+
+        return n_short;
+    }
+
+    const int64_t k = cparams.n_logits_top_k;
+
+    if (ids) {
+        *ids = logits_top_k_ids.data() + j*k;
+    }
+    if (logits) {
+        *logits = logits_top_k.data() + j*k;
+    }
+
+    return k;
+}
+
+int32_t llama_context::set_logits_vocab(const llama_token * ids, int32_t n_ids) {
+    const int64_t n_vocab = model.vocab.n_tokens();
+
+    const ggml_tensor * output = model.output;
+
+    if (n_ids > 0) {
+        if (output == nullptr || output->ne[1] != n_vocab || model.output_b != nullptr || output->extra != nullptr) {
+            LLAMA_LOG_ERROR("%s: the output tensor of the model cannot be restricted to a subset of the vocabulary\n", __func__);
+            return -1;
+        }
+
+        for (int32_t i = 0; i < n_ids; ++i) {
+            if (ids[i] < 0 || ids[i] >= n_vocab) {
+                LLAMA_LOG_ERROR("%s: invalid token id %d\n", __func__, ids[i]);
+                return -1;
+            }
+        }
+    }
+
+    // the logits of the previous outputs are reconstructed with the previous subset
+    synchronize();
+    output_reorder();
+
+    for (int64_t j = 0; j < n_outputs; ++j) {
+        output_fill_logits(j);
+    }
+
+    vocab_short.output_full = nullptr;
+    vocab_short.output      = nullptr;
+    vocab_short.ids.clear();
+    vocab_short.buf.reset();
+    vocab_short.ctx.reset();
+    vocab_short.version++;
+
+    if (n_ids <= 0 || n_ids >= n_vocab) {
+        return 0;
+    }
+
+    ggml_init_params params = {
+        /*.mem_size   =*/ ggml_tensor_overhead(),
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ true,
+    };
+
+    vocab_short.ctx.reset(ggml_init(params));
+
+    ggml_tensor * cur = ggml_new_tensor_2d(vocab_short.ctx.get(), output->type, output->ne[0], n_ids);
+    ggml_format_name(cur, "%s_short", output->name);
+
+    vocab_short.buf.reset(ggml_backend_alloc_ctx_tensors_from_buft(vocab_short.ctx.get(), ggml_backend_buffer_get_type(output->buffer)));
+    if (!vocab_short.buf) {
+        LLAMA_LOG_ERROR("%s: failed to allocate the output tensor of the vocabulary subset\n", __func__);
+        vocab_short.ctx.reset();
+        return -1;
+    }
+
+    // gather the rows of the tokens
+    const size_t row_size = output->nb[1];
+
+    std::vector<uint8_t> rows(row_size*n_ids);
+    std::vector<uint8_t> data;
+
+    const uint8_t * src = (const uint8_t *) output->data;
+    if (!ggml_backend_buffer_is_host(output->buffer)) {
+        data.resize(ggml_nbytes(output));
+        ggml_backend_tensor_get(output, data.data(), 0, data.size());
+        src = data.data();
+    }
+
+    for (int32_t i = 0; i < n_ids; ++i) {
+        memcpy(rows.data() + i*row_size, src + ids[i]*row_size, row_size);
+    }
+
+    ggml_backend_tensor_set(cur, rows.data(), 0, rows.size());
+
+    vocab_short.output_full = output;
+    vocab_short.output      = cur;
+    vocab_short.ids.assign(ids, ids + n_ids);
+
+    LLAMA_LOG_INFO("%s: computing the logits of %d of %" PRId64 " tokens\n", __func__, n_ids, n_vocab);
+
+    return 0;
+}
+
 float * llama_context::get_embeddings() {
     output_reorder();
 
@@ -617,6 +981,65 @@ float * llama_context::get_embeddings_seq(llama_seq_id seq_id) {
     return it->second.data();
 }
 
+const void * llama_context::get_embeddings_seq_data(llama_seq_id seq_id, size_t * size) {
+    if (cparams.pooling_type != LLAMA_POOLING_TYPE_MEAN &&
+        cparams.pooling_type != LLAMA_POOLING_TYPE_CLS  &&
+        cparams.pooling_type != LLAMA_POOLING_TYPE_LAST) {
+        return nullptr;
+    }
+
+    if (cparams.embd_type == LLAMA_EMBD_TYPE_F32) {
+        float * data = get_embeddings_seq(seq_id);
+        if (data && size) {
+            *size = embd_seq[seq_id].size()*sizeof(float);
+        }
+        return data;
+    }
+
+    auto it = embd_seq_data.find(seq_id);
+    if (it == embd_seq_data.end()) {
+        return nullptr;
+    }
+
+    auto & data = it->second;
+
+    if (cparams.embd_type == LLAMA_EMBD_TYPE_BINARY && data.size() == cparams.n_embd_out/8*sizeof(ggml_fp16_t)) {
+        // the bytes were computed as F16 values
+        const ggml_fp16_t * src = (const ggml_fp16_t *) data.data();
+        for (uint32_t i = 0; i < cparams.n_embd_out/8; ++i) {
+            data[i] = (uint8_t) ggml_fp16_to_fp32(src[i]);
+        }
+        data.resize(cparams.n_embd_out/8);
+    }
+
+    if (size) {
+        *size = data.size();
+    }
+
+    return data.data();
+}
+
+void llama_context::output_embd_seq(ggml_backend_t backend_embd, ggml_tensor * t_embd, const llama_ubatch & ubatch) {
+    // size of the embeddings of one sequence, after the post-processing of build_pooling()
+    const size_t row_size = t_embd->nb[1];
+
+    for (uint32_t s = 0; s < ubatch.n_seqs_unq; ++s) {
+        const llama_seq_id seq_id  = ubatch.seq_id_unq[s];
+        const int32_t      seq_idx = ubatch.seq_idx[seq_id];
+
+        void * dst = nullptr;
+        if (cparams.embd_type == LLAMA_EMBD_TYPE_F32) {
+            embd_seq[seq_id].resize(row_size/sizeof(float));
+            dst = embd_seq[seq_id].data();
+        } else {
+            embd_seq_data[seq_id].resize(row_size);
+            dst = embd_seq_data[seq_id].data();
+        }
+
+        ggml_backend_tensor_get_async(backend_embd, t_embd, dst, row_size*seq_idx, row_size);
+    }
+}
+
 void llama_context::attach_threadpool(
            ggml_threadpool_t threadpool,
            ggml_threadpool_t threadpool_batch) {
@@ -661,6 +1084,23 @@ void llama_context::set_embeddings(bool value) {
     cparams.embeddings = value;
 }
 
+void llama_context::set_output_hidden(bool value) {
+    LLAMA_LOG_DEBUG("%s: value = %d\n", __func__, value);
+
+    cparams.output_hidden = value;
+}
+
+void llama_context::set_mtp_draft(bool value) {
+    LLAMA_LOG_DEBUG("%s: value = %d\n", __func__, value);
+
+    if (value && model.n_mtp == 0) {
+        LLAMA_LOG_ERROR("%s: the model has no MTP layer loaded, see llama_model_params.use_mtp\n", __func__);
+        return;
+    }
+
+    cparams.mtp_draft = value;
+}
+
 void llama_context::set_causal_attn(bool value) {
     LLAMA_LOG_DEBUG("%s: value = %d\n", __func__, value);
 
@@ -700,6 +1140,21 @@ void llama_context::clear_adapter_lora() {
     loras.clear();
 }
 
+void llama_context::set_adapter_lora_seq(
+            llama_adapter_lora * adapter,
+            llama_seq_id seq_id,
+            float scale) {
+    LLAMA_LOG_DEBUG("%s: adapter = %p, seq_id = %d, scale = %f\n", __func__, (void *) adapter, seq_id, scale);
+
+    loras_seq[seq_id][adapter] = scale;
+}
+
+void llama_context::clear_adapter_lora_seq(llama_seq_id seq_id) {
+    LLAMA_LOG_DEBUG("%s: seq_id = %d\n", __func__, seq_id);
+
+    loras_seq.erase(seq_id);
+}
+
 bool llama_context::apply_adapter_cvec(
             const float * data,
                  size_t   len,
@@ -723,13 +1178,36 @@ llm_graph_result * llama_context::process_ubatch(const llama_ubatch & ubatch, ll
 
     // the new graph parameters
     // in order to correctly reuse a graph, it's full topology has to be uniquely determined by these parameters
-    const auto gparams = graph_params(res, ubatch, mctx, gtype);
+    auto gparams = graph_params(res, ubatch, mctx, gtype);
 
-    if (!graph_reuse_disable && res->can_reuse(gparams)) {
+    const bool can_reuse = !graph_reuse_disable && res->can_reuse(gparams);
+
+    if (can_reuse && !sched_stale) {
         //LLAMA_LOG_DEBUG("%s: reusing previous graph\n", __func__);
 
+        n_reused++;
+    } else if (can_reuse || (!graph_reuse_disable && use_cached_graph(gparams))) {
+        // a graph built previously for another shape, or allocated before another context of the pool used the scheduler
+        // only the allocation is redone
+        res = gf_res_prev.get();
+        gf  = res->get_gf();
+
+        ggml_backend_sched_reset(sched.get());
+        ggml_backend_sched_set_eval_callback(sched.get(), cparams.cb_eval, cparams.cb_eval_user_data);
+
+        res->restore_sched(sched.get());
+
+        if (!ggml_backend_sched_alloc_graph(sched.get(), gf)) {
+            LLAMA_LOG_ERROR("%s: failed to allocate graph\n", __func__);
+            ret = GGML_STATUS_ALLOC_FAILED;
+            return nullptr;
+        }
+
         n_reused++;
     } else {
+        res = gf_res_next();
+        gparams.res = res;
+
         res->reset();
 
         ggml_backend_sched_reset(sched.get());
@@ -752,8 +1230,15 @@ llm_graph_result * llama_context::process_ubatch(const llama_ubatch & ubatch, ll
             ret = GGML_STATUS_ALLOC_FAILED;
             return nullptr;
         }
+
+        // the allocation of a shared scheduler is also redone after the other contexts used it
+        if (graph_cache_size > 0 || shared.use_count() > 1) {
+            res->save_sched(sched.get());
+        }
     }
 
+    sched_stale = false;
+
     // set the input data for the input tensors
     {
         //const auto t_start_us = ggml_time_us();
@@ -778,6 +1263,8 @@ llm_graph_result * llama_context::process_ubatch(const llama_ubatch & ubatch, ll
 int llama_context::encode(const llama_batch & batch_inp) {
     GGML_ASSERT((!batch_inp.token && batch_inp.embd) || (batch_inp.token && !batch_inp.embd)); // NOLINT
 
+    auto lock = sched_lock();
+
     if (batch_inp.n_tokens == 0) {
         LLAMA_LOG_ERROR("%s: n_tokens == 0\n", __func__);
         return -1;
@@ -796,12 +1283,12 @@ int llama_context::encode(const llama_batch & batch_inp) {
 
     const uint32_t n_tokens = balloc->get_n_tokens();
 
-    // [TAG_NO_CACHE_PAD]
-    // TODO: add new split mode where we pad the input sequences so that ubatch.equal_seqs == true
-    const llama_ubatch ubatch = balloc->split_simple(n_tokens);
+    // the encoder-only models have no memory, so the batch is packed in ubatches of whole sequences and the compute
+    // buffers are sized by the tokens in flight - the encoder of an encoder-decoder model processes it in a single shot
+    const bool packed = !memory;
 
-    // micro-batching is not possible for non-causal encoding, so we process the batch in a single shot
-    GGML_ASSERT(cparams.n_ubatch >= n_tokens && "encoder requires n_ubatch >= n_tokens");
+    // micro-batching is not possible for non-causal encoding of a sequence
+    GGML_ASSERT((packed || cparams.n_ubatch >= n_tokens) && "encoder requires n_ubatch >= n_tokens");
 
     if (t_compute_start_us == 0) {
         t_compute_start_us = ggml_time_us();
@@ -809,6 +1296,7 @@ int llama_context::encode(const llama_batch & batch_inp) {
 
     // TODO: this clear of the buffer can easily be forgotten - need something better
     embd_seq.clear();
+    embd_seq_data.clear();
 
     n_queued_tokens += n_tokens;
 
@@ -818,12 +1306,6 @@ int llama_context::encode(const llama_batch & batch_inp) {
         return -2;
     };
 
-    for (uint32_t i = 0; i < n_tokens; ++i) {
-        output_ids[i] = i;
-    }
-
-    n_outputs = n_tokens;
-
     const auto causal_attn_org = cparams.causal_attn;
 
     // always use non-causal attention for encoder graphs
@@ -831,80 +1313,112 @@ int llama_context::encode(const llama_batch & batch_inp) {
     //       ref: https://github.com/ggml-org/llama.cpp/pull/12181#issuecomment-2730451223
     cparams.causal_attn = false;
 
-    ggml_status status;
-    const auto * res = process_ubatch(ubatch, LLM_GRAPH_TYPE_ENCODER, nullptr, status);
+    ggml_tensor * t_embd = nullptr;
 
-    cparams.causal_attn = causal_attn_org;
+    uint32_t n_outputs_prev = 0;
 
-    if (!res) {
-        switch (status) {
-            case GGML_STATUS_ABORTED:      return  2;
-            case GGML_STATUS_ALLOC_FAILED: return -2;
-            case GGML_STATUS_FAILED:       return -3;
-            case GGML_STATUS_SUCCESS:      GGML_ABORT("should not happen");
+    while (true) {
+        // [TAG_NO_CACHE_PAD]
+        // TODO: add new split mode where we pad the input sequences so that ubatch.equal_seqs == true
+        const llama_ubatch ubatch = packed ? balloc->split_packed(cparams.n_ubatch) : balloc->split_simple(n_tokens);
+        if (ubatch.n_tokens == 0) {
+            break;
         }
-    }
 
-    auto * t_logits = res->get_logits();
-    auto * t_embd = res->get_embd_pooled() ? res->get_embd_pooled() : res->get_embd();
+        n_outputs = ubatch.n_tokens;
 
-    // extract logits
-   if (logits && t_logits) {
-        ggml_backend_t backend_res = ggml_backend_sched_get_tensor_backend(sched.get(), t_logits);
-        GGML_ASSERT(backend_res != nullptr);
-        GGML_ASSERT(logits != nullptr);
+        ggml_status status;
+        const auto * res = process_ubatch(ubatch, LLM_GRAPH_TYPE_ENCODER, nullptr, status);
 
-        ggml_backend_tensor_get_async(backend_res, t_logits, logits, 0, n_tokens*n_vocab*sizeof(float));
-    }
+        if (!res) {
+            cparams.causal_attn = causal_attn_org;
 
-    // extract embeddings
-    if (embd && t_embd) {
-        ggml_backend_t backend_embd = ggml_backend_sched_get_tensor_backend(sched.get(), t_embd);
-        GGML_ASSERT(backend_embd != nullptr);
+            switch (status) {
+                case GGML_STATUS_ABORTED:      return  2;
+                case GGML_STATUS_ALLOC_FAILED: return -2;
+                case GGML_STATUS_FAILED:       return -3;
+                case GGML_STATUS_SUCCESS:      GGML_ABORT("should not happen");
+            }
+        }
 
-        switch (cparams.pooling_type) {
-            case LLAMA_POOLING_TYPE_NONE:
-                {
-                    // extract token embeddings
-                    GGML_ASSERT(embd != nullptr);
+        auto * t_logits = res->get_logits();
+        t_embd = res->get_embd_pooled() ? res->get_embd_pooled() : res->get_embd();
 
-                    GGML_ASSERT(n_tokens*n_embd <= (int64_t) embd_size);
-                    ggml_backend_tensor_get_async(backend_embd, t_embd, embd, 0, n_tokens*n_embd*sizeof(float));
-                } break;
-            case LLAMA_POOLING_TYPE_MEAN:
-            case LLAMA_POOLING_TYPE_CLS:
-            case LLAMA_POOLING_TYPE_LAST:
-                {
-                    // extract sequence embeddings
-                    auto & embd_seq_out = embd_seq;
+        // extract logits
+        if (t_logits && output_logits()) {
+            ggml_backend_t backend_res = ggml_backend_sched_get_tensor_backend(sched.get(), t_logits);
+            GGML_ASSERT(backend_res != nullptr);
 
-                    for (uint32_t s = 0; s < ubatch.n_seqs_unq; ++s) {
-                        const llama_seq_id seq_id  = ubatch.seq_id_unq[s];
-                        const int32_t      seq_idx = ubatch.seq_idx[seq_id];
+            ggml_backend_tensor_get_async(backend_res, t_logits, logits + n_outputs_prev*n_vocab, 0, ubatch.n_tokens*n_vocab*sizeof(float));
 
-                        embd_seq_out[seq_id].resize(n_embd);
-                        ggml_backend_tensor_get_async(backend_embd, t_embd, embd_seq_out[seq_id].data(), (n_embd*seq_idx)*sizeof(float), n_embd*sizeof(float));
-                    }
-                } break;
-            case LLAMA_POOLING_TYPE_RANK:
-                {
-                    // extract the rerank score - n_cls_out floats per sequence
-                    auto & embd_seq_out = embd_seq;
+            if (!logits_filled.empty()) {
+                std::fill(logits_filled.begin() + n_outputs_prev, logits_filled.begin() + n_outputs_prev + ubatch.n_tokens, true);
+            }
+        }
+
+        // extract embeddings
+        if (embd && t_embd) {
+            ggml_backend_t backend_embd = ggml_backend_sched_get_tensor_backend(sched.get(), t_embd);
+            GGML_ASSERT(backend_embd != nullptr);
 
-                    const uint32_t n_cls_out = hparams.n_cls_out;
+            switch (cparams.pooling_type) {
+                case LLAMA_POOLING_TYPE_NONE:
+                    {
+                        // extract token embeddings
+                        GGML_ASSERT(embd != nullptr);
+
+                        GGML_ASSERT((n_outputs_prev + ubatch.n_tokens)*n_embd <= (int64_t) embd_size);
+                        ggml_backend_tensor_get_async(backend_embd, t_embd, embd + n_outputs_prev*n_embd, 0, ubatch.n_tokens*n_embd*sizeof(float));
+                    } break;
+                case LLAMA_POOLING_TYPE_MEAN:
+                case LLAMA_POOLING_TYPE_CLS:
+                case LLAMA_POOLING_TYPE_LAST:
+                    {
+                        // extract sequence embeddings
+                        output_embd_seq(backend_embd, t_embd, ubatch);
+                    } break;
+                case LLAMA_POOLING_TYPE_RANK:
+                    {
+                        // extract the rerank score - n_cls_out floats per sequence
+                        auto & embd_seq_out = embd_seq;
 
-                    for (uint32_t s = 0; s < ubatch.n_seqs_unq; ++s) {
-                        const llama_seq_id seq_id  = ubatch.seq_id_unq[s];
-                        const int32_t      seq_idx = ubatch.seq_idx[seq_id];
+                        const uint32_t n_cls_out = hparams.n_cls_out;
+
+                        for (uint32_t s = 0; s < ubatch.n_seqs_unq; ++s) {
+                            const llama_seq_id seq_id  = ubatch.seq_id_unq[s];
+                            const int32_t      seq_idx = ubatch.seq_idx[seq_id];
 
-                        embd_seq_out[seq_id].resize(n_cls_out);
-                        ggml_backend_tensor_get_async(backend_embd, t_embd, embd_seq_out[seq_id].data(), (n_cls_out*seq_idx)*sizeof(float), n_cls_out*sizeof(float));
+                            embd_seq_out[seq_id].resize(n_cls_out);
+                            ggml_backend_tensor_get_async(backend_embd, t_embd, embd_seq_out[seq_id].data(), (n_cls_out*seq_idx)*sizeof(float), n_cls_out*sizeof(float));
+                        }
+                    } break;
+                case LLAMA_POOLING_TYPE_UNSPECIFIED:
+                    {
+                        GGML_ABORT("unknown pooling type");
                     }
-                } break;
-            case LLAMA_POOLING_TYPE_UNSPECIFIED:
-                {
-                    GGML_ABORT("unknown pooling type");
-                }
+            }
+        }
+
+        n_outputs_prev += ubatch.n_tokens;
+    }
+
+    cparams.causal_attn = causal_attn_org;
+
+    if (n_outputs_prev < n_tokens) {
+        LLAMA_LOG_ERROR("%s: failed to split the batch in ubatches of at most %u tokens\n", __func__, cparams.n_ubatch);
+        return -1;
+    }
+
+    n_outputs = n_tokens;
+
+    // the packed ubatches can reorder the tokens of interleaved sequences
+    {
+        const auto & out_ids = balloc->get_out_ids();
+
+        GGML_ASSERT(out_ids.size() == (size_t) n_tokens);
+
+        for (uint32_t i = 0; i < n_tokens; ++i) {
+            output_ids[out_ids[i]] = i;
         }
     }
 
@@ -946,6 +1460,8 @@ int llama_context::encode(const llama_batch & batch_inp) {
 int llama_context::decode(const llama_batch & batch_inp) {
     GGML_ASSERT((!batch_inp.token && batch_inp.embd) || (batch_inp.token && !batch_inp.embd)); // NOLINT
 
+    auto lock = sched_lock();
+
     if (!memory) {
         LLAMA_LOG_DEBUG("%s: cannot decode batches with this context (calling encode() instead)\n", __func__);
         return encode(batch_inp);
@@ -993,6 +1509,7 @@ int llama_context::decode(const llama_batch & batch_inp) {
 
     // TODO: this clear of the buffer can easily be forgotten - need something better
     embd_seq.clear();
+    embd_seq_data.clear();
     output_swaps.clear();
 
     bool did_optimize = false;
@@ -1000,10 +1517,19 @@ int llama_context::decode(const llama_batch & batch_inp) {
     // handle any pending defrags/shifts
     kv_self_update(false);
 
+    // with pipeline parallelism, the ubatches are processed by the devices in a wavefront
+    // a batch that fits in fewer ubatches than there are devices is split in smaller micro-batches to keep all devices busy
+    uint32_t n_ubatch = cparams.n_ubatch;
+    if (n_pp_stages > 1 && n_pp_ubatch_min > 0 && cparams.causal_attn && n_tokens_all > n_pp_ubatch_min) {
+        const uint32_t n_ubatch_pp = (n_tokens_all + n_pp_stages - 1)/n_pp_stages;
+
+        n_ubatch = std::min(n_ubatch, std::max(n_ubatch_pp, n_pp_ubatch_min));
+    }
+
     llama_memory_context_ptr mctx;
 
     while (true) {
-        mctx = memory->init_batch(*balloc, cparams.n_ubatch, output_all);
+        mctx = memory->init_batch(*balloc, n_ubatch, output_all);
         if (!mctx) {
             return -2;
         }
@@ -1112,17 +1638,129 @@ int llama_context::decode(const llama_batch & batch_inp) {
         //}
 
         auto * t_logits = res->get_logits();
-        auto * t_embd   = cparams.embeddings ? res->get_embd() : nullptr;
+        auto * t_embd   = cparams.embeddings || cparams.output_hidden ? res->get_embd() : nullptr;
 
-        if (t_embd && res->get_embd_pooled()) {
+        // the hidden states are output per token, regardless of the pooling
+        const enum llama_pooling_type pooling_type = cparams.embeddings ? cparams.pooling_type : LLAMA_POOLING_TYPE_NONE;
+
+        if (t_embd && cparams.embeddings && res->get_embd_pooled()) {
             t_embd = res->get_embd_pooled();
         }
 
+        auto * t_logits_top_k     = res->get_logits_top_k();
+        auto * t_logits_top_k_ids = res->get_logits_top_k_ids();
+
+        // extract the top-k logits - the full rows are filled on demand
+        if (t_logits_top_k && n_outputs > 0) {
+            ggml_backend_t backend_res = ggml_backend_sched_get_tensor_backend(sched.get(), t_logits_top_k);
+            GGML_ASSERT(backend_res != nullptr);
+
+            const int64_t k = cparams.n_logits_top_k;
+
+            GGML_ASSERT(t_logits_top_k->ne[0] == k);
+            GGML_ASSERT((n_outputs_prev + n_outputs)*k <= (int64_t) logits_top_k.size());
+
+            ggml_backend_tensor_get_async(backend_res, t_logits_top_k,     logits_top_k.data()     + n_outputs_prev*k, 0, n_outputs*k*sizeof(float));
+            ggml_backend_tensor_get_async(backend_res, t_logits_top_k_ids, logits_top_k_ids.data() + n_outputs_prev*k, 0, n_outputs*k*sizeof(llama_token));
+
+            std::fill(logits_filled.begin() + n_outputs_prev, logits_filled.begin() + n_outputs_prev + n_outputs, false);
+
+            t_logits = nullptr;
+        }
+
+        // extract the logits of the vocabulary subset - the full rows are filled on demand
+        if (t_logits && res->get_logits_short() && n_outputs > 0) {
+            ggml_backend_t backend_res = ggml_backend_sched_get_tensor_backend(sched.get(), t_logits);
+            GGML_ASSERT(backend_res != nullptr);
+
+            const int64_t n_short = vocab_short.ids.size();
+
+            GGML_ASSERT(t_logits->ne[0] == n_short);
+            GGML_ASSERT((n_outputs_prev + n_outputs)*n_short <= (int64_t) logits_short.size());
+
+            ggml_backend_tensor_get_async(backend_res, t_logits, logits_short.data() + n_outputs_prev*n_short, 0, n_outputs*n_short*sizeof(float));
+
+            std::fill(logits_filled.begin() + n_outputs_prev, logits_filled.begin() + n_outputs_prev + n_outputs, false);
+
+            t_logits = nullptr;
+        }
+
+        auto * t_logits_half = res->get_logits_half();
+
+        // extract the F16/BF16 logits - the F32 rows are converted on demand
+        if (t_logits_half && n_outputs > 0) {
+            ggml_backend_t backend_res = ggml_backend_sched_get_tensor_backend(sched.get(), t_logits_half);
+            GGML_ASSERT(backend_res != nullptr);
+
+            GGML_ASSERT((n_outputs_prev + n_outputs)*n_vocab <= (int64_t) logits_half.size());
+
+            ggml_backend_tensor_get_async(backend_res, t_logits_half, logits_half.data() + n_outputs_prev*n_vocab, 0, n_outputs*n_vocab*sizeof(ggml_fp16_t));
+
+            std::fill(logits_filled.begin() + n_outputs_prev, logits_filled.begin() + n_outputs_prev + n_outputs, false);
+
+            t_logits = nullptr;
+        }
+
+        // accumulate the attention weights of the KV cells
+        if (auto * t_kv_score = res->get_kv_score()) {
+            ggml_backend_t backend_res = ggml_backend_sched_get_tensor_backend(sched.get(), t_kv_score);
+            GGML_ASSERT(backend_res != nullptr);
+
+            const auto * kv_ctx = dynamic_cast<const llama_kv_cache_unified_context *>(mctx.get());
+            if (kv_ctx) {
+                kv_score.resize(ggml_nelements(t_kv_score));
+
+                ggml_backend_tensor_get(t_kv_score, kv_score.data(), 0, ggml_nbytes(t_kv_score));
+
+                kv_ctx->score_add(kv_score.data(), t_kv_score->ne[0]);
+            }
+        }
+
+        // save the hidden states for the MTP layer at the next positions
+        if (auto * t_mtp_hidden = res->get_mtp_hidden()) {
+            mtp_buf.resize(ggml_nelements(t_mtp_hidden));
+
+            ggml_backend_tensor_get(t_mtp_hidden, mtp_buf.data(), 0, ggml_nbytes(t_mtp_hidden));
+
+            if (cparams.mtp_draft) {
+                mtp_ids.resize(ubatch.n_tokens);
+                std::iota(mtp_ids.begin(), mtp_ids.end(), 0);
+            } else {
+                llama_mtp_hidden::rows(ubatch, n_outputs, mtp_ids);
+            }
+
+            GGML_ASSERT((int64_t) mtp_ids.size() == t_mtp_hidden->ne[1]);
+
+            mtp_hidden.save(ubatch, mtp_ids, mtp_buf.data(), cparams.mtp_draft);
+        }
+
+        // count the tokens routed to each expert
+        for (const auto & [il, t_ids] : res->get_expert_ids()) {
+            const ggml_tensor * t_sort = t_ids->view_src; // [n_expert, n_tokens]
+
+            const int64_t n_expert      = t_sort->ne[0];
+            const int64_t n_expert_used = t_ids->ne[0];
+
+            GGML_ASSERT(n_expert == (int64_t) model.hparams.n_expert);
+
+            expert_ids.resize(ggml_nelements(t_sort));
+
+            ggml_backend_tensor_get(t_sort, expert_ids.data(), 0, ggml_nbytes(t_sort));
+
+            uint64_t * counts = expert_counts.data() + il*n_expert;
+
+            for (int64_t i = 0; i < t_sort->ne[1]; ++i) {
+                for (int64_t j = 0; j < n_expert_used; ++j) {
+                    counts[expert_ids[i*n_expert + j]]++;
+                }
+            }
+        }
+
         // extract logits
         if (t_logits && n_outputs > 0) {
             ggml_backend_t backend_res = ggml_backend_sched_get_tensor_backend(sched.get(), t_logits);
             GGML_ASSERT(backend_res != nullptr);
-            GGML_ASSERT(logits != nullptr);
+            GGML_ASSERT(output_logits() != nullptr);
 
             float * logits_out = logits + n_outputs_prev*n_vocab;
 
@@ -1138,7 +1776,7 @@ int llama_context::decode(const llama_batch & batch_inp) {
             ggml_backend_t backend_embd = ggml_backend_sched_get_tensor_backend(sched.get(), t_embd);
             GGML_ASSERT(backend_embd != nullptr);
 
-            switch (cparams.pooling_type) {
+            switch (pooling_type) {
                 case LLAMA_POOLING_TYPE_NONE:
                     {
                         // extract token embeddings
@@ -1156,15 +1794,7 @@ int llama_context::decode(const llama_batch & batch_inp) {
                 case LLAMA_POOLING_TYPE_LAST:
                     {
                         // extract sequence embeddings (cleared before processing each batch)
-                        auto & embd_seq_out = embd_seq;
-
-                        for (uint32_t s = 0; s < ubatch.n_seqs_unq; ++s) {
-                            const llama_seq_id seq_id  = ubatch.seq_id_unq[s];
-                            const int32_t      seq_idx = ubatch.seq_idx[seq_id];
-
-                            embd_seq_out[seq_id].resize(n_embd);
-                            ggml_backend_tensor_get_async(backend_embd, t_embd, embd_seq_out[seq_id].data(), (n_embd*seq_idx)*sizeof(float), n_embd*sizeof(float));
-                        }
+                        output_embd_seq(backend_embd, t_embd, ubatch);
                     } break;
                 case LLAMA_POOLING_TYPE_RANK:
                     {
@@ -1253,6 +1883,74 @@ int llama_context::decode(const llama_batch & batch_inp) {
     return 0;
 }
 
+int llama_context::decode_async(const llama_batch & batch_inp) {
+    // only one decode can be in flight
+    decode_wait();
+
+    if (!decode_worker.joinable()) {
+        decode_worker = std::thread(&llama_context::decode_worker_loop, this);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(decode_mutex);
+        decode_batch   = batch_inp;
+        decode_queued  = true;
+        decode_pending = true;
+    }
+    decode_cv.notify_all();
+
+    return 0;
+}
+
+void llama_context::decode_worker_loop() {
+    std::unique_lock<std::mutex> lock(decode_mutex);
+
+    while (true) {
+        decode_cv.wait(lock, [this] { return decode_queued || decode_stop; });
+        if (decode_stop) {
+            break;
+        }
+
+        const llama_batch batch = decode_batch;
+
+        lock.unlock();
+
+        // the exceptions cannot reach the caller of the C API on this thread
+        int ret;
+        try {
+            ret = decode(batch);
+        } catch (const std::exception & err) {
+            LLAMA_LOG_ERROR("%s: decode failed: %s\n", __func__, err.what());
+            ret = -3;
+        }
+
+        lock.lock();
+
+        decode_result = ret;
+        decode_queued = false;
+        decode_cv.notify_all();
+    }
+}
+
+int llama_context::decode_wait() {
+    std::unique_lock<std::mutex> lock(decode_mutex);
+
+    if (!decode_pending) {
+        return 0;
+    }
+
+    decode_cv.wait(lock, [this] { return !decode_queued; });
+    decode_pending = false;
+
+    return decode_result;
+}
+
+bool llama_context::decode_ready() const {
+    std::lock_guard<std::mutex> lock(decode_mutex);
+
+    return !decode_queued;
+}
+
 //
 // output
 //
@@ -1268,7 +1966,7 @@ uint32_t llama_context::output_reserve(int32_t n_outputs) {
     const auto n_embd  = hparams.n_embd;
 
     bool has_logits = true;
-    bool has_embd   = cparams.embeddings;
+    bool has_embd   = cparams.embeddings || cparams.output_hidden;
 
     // TODO: hacky enc-dec support
     if (model.arch == LLM_ARCH_T5) {
@@ -1279,13 +1977,16 @@ uint32_t llama_context::output_reserve(int32_t n_outputs) {
     logits_size = has_logits ? n_vocab*n_outputs_max : 0;
     embd_size   = has_embd   ?  n_embd*n_outputs_max : 0;
 
+    // the F32 rows are reconstructed on demand from the top-k or the F16/BF16 logits, in a buffer allocated on first use
+    const bool logits_lazy = has_logits && (cparams.n_logits_top_k > 0 || cparams.logits_type != LLAMA_LOGITS_TYPE_F32 || !vocab_short.ids.empty());
+
     if (output_ids.empty()) {
         // init, never resized afterwards
         output_ids.resize(n_batch);
     }
 
     const size_t prev_size = buf_output ? ggml_backend_buffer_get_size(buf_output.get()) : 0;
-    const size_t new_size  = (logits_size + embd_size) * sizeof(float);
+    const size_t new_size  = ((logits_lazy ? 0 : logits_size) + embd_size) * sizeof(float);
 
     // alloc only when more than the current capacity is required
     // TODO: also consider shrinking the buffer
@@ -1316,8 +2017,30 @@ uint32_t llama_context::output_reserve(int32_t n_outputs) {
 
     float * output_base = (float *) ggml_backend_buffer_get_base(buf_output.get());
 
-    logits = has_logits ? output_base               : nullptr;
-    embd   = has_embd   ? output_base + logits_size : nullptr;
+    if (logits_lazy) {
+        logits = logits_host.size() >= logits_size ? logits_host.data() : nullptr;
+        embd   = has_embd ? output_base : nullptr;
+    } else {
+        logits = has_logits ? output_base               : nullptr;
+        embd   = has_embd   ? output_base + logits_size : nullptr;
+    }
+
+    if (has_logits && cparams.n_logits_top_k > 0) {
+        logits_top_k_ids.resize(cparams.n_logits_top_k*n_outputs_max);
+        logits_top_k    .resize(cparams.n_logits_top_k*n_outputs_max);
+    }
+
+    if (has_logits && cparams.logits_type != LLAMA_LOGITS_TYPE_F32) {
+        logits_half.resize(n_vocab*n_outputs_max);
+    }
+
+    if (has_logits && !vocab_short.ids.empty()) {
+        logits_short.resize(vocab_short.ids.size()*n_outputs_max);
+    }
+
+    if (logits_lazy) {
+        logits_filled.assign(n_outputs_max, true);
+    }
 
     // set all ids as invalid (negative)
     std::fill(output_ids.begin(), output_ids.end(), -1);
@@ -1335,22 +2058,98 @@ void llama_context::output_reorder() {
         const uint64_t i0 = output_swaps[s].i0;
         const uint64_t i1 = output_swaps[s].i1;
 
-        if (logits_size > 0) {
+        if (logits != nullptr) {
             for (uint64_t k = 0; k < n_vocab; k++) {
                 std::swap(logits[i0*n_vocab + k], logits[i1*n_vocab + k]);
             }
         }
 
+        if (!logits_half.empty()) {
+            std::swap_ranges(logits_half.begin() + i0*n_vocab, logits_half.begin() + (i0 + 1)*n_vocab, logits_half.begin() + i1*n_vocab);
+        }
+
+        if (!vocab_short.ids.empty()) {
+            const uint64_t n_short = vocab_short.ids.size();
+
+            std::swap_ranges(logits_short.begin() + i0*n_short, logits_short.begin() + (i0 + 1)*n_short, logits_short.begin() + i1*n_short);
+        }
+
         if (embd_size > 0) {
             for (uint64_t k = 0; k < n_embd; k++) {
                 std::swap(embd[i0*n_embd + k], embd[i1*n_embd + k]);
             }
         }
+
+        if (!logits_filled.empty()) {
+            const uint64_t n_top_k = cparams.n_logits_top_k;
+
+            for (uint64_t k = 0; k < n_top_k; k++) {
+                std::swap(logits_top_k    [i0*n_top_k + k], logits_top_k    [i1*n_top_k + k]);
+                std::swap(logits_top_k_ids[i0*n_top_k + k], logits_top_k_ids[i1*n_top_k + k]);
+            }
+
+            std::vector<bool>::swap(logits_filled[i0], logits_filled[i1]);
+        }
     }
 
     output_swaps.clear();
 }
 
+float * llama_context::output_logits() {
+    if (logits == nullptr && logits_size > 0) {
+        logits_host.resize(logits_size);
+        logits = logits_host.data();
+    }
+
+    return logits;
+}
+
+void llama_context::output_fill_logits(int64_t j) {
+    if (logits_filled.empty() || logits_filled[j]) {
+        return;
+    }
+
+    const int64_t n_vocab = model.vocab.n_tokens();
+    const int64_t n_top_k = cparams.n_logits_top_k;
+
+    float * row = output_logits() + j*n_vocab;
+
+    if (!vocab_short.ids.empty()) {
+        const int64_t n_short = vocab_short.ids.size();
+
+        std::fill(row, row + n_vocab, -INFINITY);
+
+        for (int64_t k = 0; k < n_short; ++k) {
+            row[vocab_short.ids[k]] = logits_short[j*n_short + k];
+        }
+
+        logits_filled[j] = true;
+
+        return;
+    }
+
+    switch (cparams.logits_type) {
+        case LLAMA_LOGITS_TYPE_F16:
+            {
+                ggml_fp16_to_fp32_row(logits_half.data() + j*n_vocab, row, n_vocab);
+            } break;
+        case LLAMA_LOGITS_TYPE_BF16:
+            {
+                ggml_bf16_to_fp32_row((const ggml_bf16_t *) logits_half.data() + j*n_vocab, row, n_vocab);
+            } break;
+        case LLAMA_LOGITS_TYPE_F32:
+            {
+                std::fill(row, row + n_vocab, -INFINITY);
+
+                for (int64_t k = 0; k < n_top_k; ++k) {
+                    row[logits_top_k_ids[j*n_top_k + k]] = logits_top_k[j*n_top_k + k];
+                }
+            } break;
+    }
+
+    logits_filled[j] = true;
+}
+
 //
 // graph
 //
@@ -1363,6 +2162,12 @@ llm_graph_result * llama_context::get_gf_res_reserve() const {
     return static_cast<llm_graph_result *>(gf_res_reserve.get());
 }
 
+uint32_t llama_context::n_outputs_reserve(uint32_t n_tokens, uint32_t n_seqs) const {
+    // most batches only output the last token of each sequence - with reserve_lazy, the batches with more outputs
+    // (perplexity, embeddings, speculative decoding, ...) reallocate the compute buffers when they are first evaluated
+    return cparams.reserve_lazy ? std::min(n_tokens, n_seqs) : n_tokens;
+}
+
 ggml_cgraph * llama_context::graph_reserve(uint32_t n_tokens, uint32_t n_seqs, uint32_t n_outputs, const llama_memory_context_i * mctx) {
     LLAMA_LOG_DEBUG("%s: reserving a graph for ubatch with n_tokens = %4u, n_seqs = %2u, n_outputs = %4u\n", __func__, n_tokens, n_seqs, n_outputs);
 
@@ -1377,6 +2182,7 @@ ggml_cgraph * llama_context::graph_reserve(uint32_t n_tokens, uint32_t n_seqs, u
 
     // when the scheduler is reset, we cannnot reuse the old graph, so we reset the previous graph result to prevent that
     gf_res_prev->reset();
+    gf_res_cache.clear();
 
     // store the n_outputs as it is, and restore it afterwards
     // TODO: not sure if needed, might simplify in the future by removing this
@@ -1421,8 +2227,12 @@ llm_graph_params llama_context::graph_params(
         /*.backend_cpu =*/ backend_cpu,
         /*.cvec        =*/ &cvec,
         /*.loras       =*/ &loras,
+        /*.loras_seq   =*/ &loras_seq,
         /*.mctx        =*/ mctx,
         /*.cross       =*/ &cross,
+        /*.vshort      =*/ &vocab_short,
+        /*.mtp         =*/ model.n_mtp ? &mtp_hidden : nullptr,
+        /*.vshort_version =*/ vocab_short.version,
         /*.n_outputs   =*/ n_outputs,
         /*.cb          =*/ graph_get_cb(),
         /*.res         =*/ res,
@@ -1456,6 +2266,47 @@ ggml_status llama_context::graph_compute(
     return status;
 }
 
+bool llama_context::use_cached_graph(const llm_graph_params & gparams) {
+    for (size_t i = 0; i < gf_res_cache.size(); ++i) {
+        auto params = gparams;
+        params.res = gf_res_cache[i].get();
+
+        if (!gf_res_cache[i]->can_reuse(params)) {
+            continue;
+        }
+
+        llm_graph_result_ptr res = std::move(gf_res_cache[i]);
+        gf_res_cache.erase(gf_res_cache.begin() + i);
+
+        gf_res_cache.insert(gf_res_cache.begin(), std::move(gf_res_prev));
+        gf_res_prev = std::move(res);
+
+        return true;
+    }
+
+    return false;
+}
+
+llm_graph_result * llama_context::gf_res_next() {
+    if (graph_reuse_disable || graph_cache_size == 0 || ggml_graph_n_nodes(gf_res_prev->get_gf()) == 0) {
+        return gf_res_prev.get();
+    }
+
+    // reuse the least recently used graph result when the cache is full
+    llm_graph_result_ptr res;
+    if (gf_res_cache.size() >= graph_cache_size) {
+        res = std::move(gf_res_cache.back());
+        gf_res_cache.pop_back();
+    } else {
+        res.reset(new llm_graph_result(gf_res_prev->get_max_nodes()));
+    }
+
+    gf_res_cache.insert(gf_res_cache.begin(), std::move(gf_res_prev));
+    gf_res_prev = std::move(res);
+
+    return gf_res_prev.get();
+}
+
 llm_graph_cb llama_context::graph_get_cb() const {
     return [&](const llama_ubatch & ubatch, ggml_tensor * cur, const char * name, int il) {
         if (il >= 0) {
@@ -1577,41 +2428,179 @@ private:
     size_t size_read = 0;
 };
 
+// host buffer for the transfers between the devices and the state files, pinned if supported by the device
+struct llama_io_staging {
+    llama_io_staging(ggml_backend_buffer_type_t buft, size_t size) {
+        if (buft) {
+            buf.reset(ggml_backend_buft_alloc_buffer(buft, size));
+        }
+        if (buf) {
+            data = (uint8_t *) ggml_backend_buffer_get_base(buf.get());
+        } else {
+            host.resize(size);
+            data = host.data();
+        }
+    }
+
+    ggml_backend_buffer_ptr buf;
+    std::vector<uint8_t>    host;
+
+    uint8_t * data = nullptr;
+};
+
+// the file is written from a background thread, so that the copies from the devices overlap with the disk writes
+// flush() must be called after the last write
 class llama_io_write_file : public llama_io_write_i {
 public:
-    llama_io_write_file(llama_file * f) : file(f) {}
+    llama_io_write_file(llama_file * f, ggml_backend_buffer_type_t buft) : file(f), bufs{{buft, buf_size}, {buft, buf_size}} {}
+
+    ~llama_io_write_file() {
+        if (pending.valid()) {
+            pending.wait();
+        }
+    }
 
     void write(const void * src, size_t size) override {
-        file->write_raw(src, size);
+        const uint8_t * p = (const uint8_t *) src;
+
+        size_written += size;
+
+        while (size > 0) {
+            const size_t n = std::min(size, buf_size - n_cur);
+            memcpy(bufs[cur].data + n_cur, p, n);
+            advance(n);
+
+            p    += n;
+            size -= n;
+        }
+    }
+
+    void write_tensor(const ggml_tensor * tensor, size_t offset, size_t size) override {
         size_written += size;
+
+        while (size > 0) {
+            const size_t n = std::min(size, buf_size - n_cur);
+            ggml_backend_tensor_get(tensor, bufs[cur].data + n_cur, offset, n);
+            advance(n);
+
+            offset += n;
+            size   -= n;
+        }
     }
 
-    void write_tensor(const ggml_tensor * tensor, size_t offset, size_t size) override {
-        temp_buffer.resize(size);
-        ggml_backend_tensor_get(tensor, temp_buffer.data(), offset, size);
-        write(temp_buffer.data(), temp_buffer.size());
+    size_t n_bytes() override {
+        return size_written;
+    }
+
+    // write the remaining data and wait for the writes to complete
+    void flush() {
+        submit();
+        wait();
+    }
+
+private:
+    static constexpr size_t buf_size = 16*1024*1024;
+
+    void advance(size_t n) {
+        n_cur += n;
+        if (n_cur == buf_size) {
+            submit();
+        }
+    }
+
+    // write the current buffer in the background and continue with the other one
+    void submit() {
+        if (n_cur == 0) {
+            return;
+        }
+
+        // the writes must be done in order
+        wait();
+
+        const uint8_t * data = bufs[cur].data;
+        const size_t    n    = n_cur;
+
+        pending = std::async(std::launch::async, [this, data, n]() {
+            file->write_raw(data, n);
+        });
+
+        cur   = 1 - cur;
+        n_cur = 0;
     }
 
-    size_t n_bytes() override {
-        return size_written;
+    void wait() {
+        if (pending.valid()) {
+            pending.get(); // rethrows the write errors
+        }
     }
 
-private:
     llama_file * file;
     size_t size_written = 0;
-    std::vector<uint8_t> temp_buffer;
+
+    llama_io_staging bufs[2];
+
+    int    cur   = 0;
+    size_t n_cur = 0;
+
+    std::future<void> pending;
 };
 
+// the file is read ahead from a background thread, so that the disk reads overlap with the copies to the devices
+// the file position is set after the consumed data on destruction
 class llama_io_read_file : public llama_io_read_i {
 public:
-    llama_io_read_file(llama_file * f) : file(f) {}
+    llama_io_read_file(llama_file * f, ggml_backend_buffer_type_t buft) :
+        file(f), offset(f->tell()), offset_next(f->tell()), size_file(f->size()), bufs{{buft, buf_size}, {buft, buf_size}} {
+        prefetch(0);
+    }
+
+    ~llama_io_read_file() {
+        if (pending.valid()) {
+            pending.wait();
+        }
+        try {
+            file->seek(offset, SEEK_SET);
+        } catch (const std::exception & err) {
+            LLAMA_LOG_ERROR("%s: %s\n", __func__, err.what());
+        }
+    }
 
     void read_to(void * dst, size_t size) override {
-        file->read_raw(dst, size);
+        uint8_t * p = (uint8_t *) dst;
+
         size_read += size;
+
+        while (size > 0) {
+            if (pos == len) {
+                next();
+            }
+
+            const size_t n = std::min(size, len - pos);
+            memcpy(p, bufs[cur].data + pos, n);
+
+            pos    += n;
+            offset += n;
+            p      += n;
+            size   -= n;
+        }
     }
 
     const uint8_t * read(size_t size) override {
+        if (pos == len && size > 0) {
+            next();
+        }
+
+        // avoid the copy if the data is in the current buffer
+        if (size <= len - pos) {
+            const uint8_t * res = bufs[cur].data + pos;
+
+            pos       += size;
+            offset    += size;
+            size_read += size;
+
+            return res;
+        }
+
         temp_buffer.resize(size);
         read_to(temp_buffer.data(), size);
         return temp_buffer.data();
@@ -1622,8 +2611,56 @@ public:
     }
 
 private:
+    static constexpr size_t buf_size = 16*1024*1024;
+
+    // read the next block of the file into buffer i in the background
+    void prefetch(int i) {
+        const size_t n = std::min(buf_size, size_file - offset_next);
+        if (n == 0) {
+            return;
+        }
+
+        uint8_t * data = bufs[i].data;
+        const size_t off = offset_next;
+
+        pending = std::async(std::launch::async, [this, data, n, off]() {
+            file->read_raw_at(data, n, off);
+            return n;
+        });
+
+        offset_next += n;
+    }
+
+    // switch to the prefetched buffer and start reading the following block into the other one
+    void next() {
+        if (!pending.valid()) {
+            throw std::runtime_error("unexpectedly reached end of file");
+        }
+
+        len = pending.get(); // rethrows the read errors
+        pos = 0;
+        cur = n_blocks++ == 0 ? 0 : 1 - cur;
+
+        prefetch(1 - cur);
+    }
+
     llama_file * file;
     size_t size_read = 0;
+
+    size_t offset;      // file offset of the next byte to consume
+    size_t offset_next; // file offset of the next block to prefetch
+    size_t size_file;
+
+    llama_io_staging bufs[2];
+
+    int    cur = 0;
+    size_t pos = 0;
+    size_t len = 0;
+
+    size_t n_blocks = 0;
+
+    std::future<size_t> pending;
+
     std::vector<uint8_t> temp_buffer;
 };
 
@@ -1657,30 +2694,30 @@ size_t llama_context::state_set_data(const uint8_t * src, size_t size) {
     }
 }
 
-size_t llama_context::state_seq_get_size(llama_seq_id seq_id) {
+size_t llama_context::state_seq_get_size(llama_seq_id seq_id, llama_pos p0, llama_pos p1, llama_state_seq_flags flags) {
     llama_io_write_dummy io;
     try {
-        return state_seq_write_data(io, seq_id);
+        return state_seq_write_data(io, seq_id, p0, p1, flags);
     } catch (const std::exception & err) {
         LLAMA_LOG_ERROR("%s: error getting state size: %s\n", __func__, err.what());
         return 0;
     }
 }
 
-size_t llama_context::state_seq_get_data(llama_seq_id seq_id, uint8_t * dst, size_t size) {
+size_t llama_context::state_seq_get_data(llama_seq_id seq_id, uint8_t * dst, size_t size, llama_pos p0, llama_pos p1, llama_state_seq_flags flags) {
     llama_io_write_buffer io(dst, size);
     try {
-        return state_seq_write_data(io, seq_id);
+        return state_seq_write_data(io, seq_id, p0, p1, flags);
     } catch (const std::exception & err) {
         LLAMA_LOG_ERROR("%s: error saving state: %s\n", __func__, err.what());
         return 0;
     }
 }
 
-size_t llama_context::state_seq_set_data(llama_seq_id seq_id, const uint8_t * src, size_t size) {
+size_t llama_context::state_seq_set_data(llama_seq_id seq_id, const uint8_t * src, size_t size, bool append, llama_pos shift, llama_state_seq_flags flags) {
     llama_io_read_buffer io(src, size);
     try {
-        return state_seq_read_data(io, seq_id);
+        return state_seq_read_data(io, seq_id, append, shift, flags);
     } catch (const std::exception & err) {
         LLAMA_LOG_ERROR("%s: error loading state: %s\n", __func__, err.what());
         return 0;
@@ -1718,7 +2755,7 @@ bool llama_context::state_load_file(const char * filepath, llama_token * tokens_
     {
         const size_t n_state_size_cur = file.size() - file.tell();
 
-        llama_io_read_file io( &file);
+        llama_io_read_file io(&file, state_io_buft());
         const size_t n_read = state_read_data(io);
 
         if (n_read != n_state_size_cur) {
@@ -1741,8 +2778,9 @@ bool llama_context::state_save_file(const char * filepath, const llama_token * t
     file.write_raw(tokens, sizeof(llama_token) * n_token_count);
 
     // save the context state using stream saving
-    llama_io_write_file io(&file);
+    llama_io_write_file io(&file, state_io_buft());
     state_write_data(io);
+    io.flush();
 
     return true;
 }
@@ -1777,8 +2815,11 @@ size_t llama_context::state_seq_load_file(llama_seq_id seq_id, const char * file
     // restore the context state
     {
         const size_t state_size = file.size() - file.tell();
-        llama_io_read_file io(&file);
-        const size_t nread = state_seq_read_data(io, seq_id);
+        size_t nread = 0;
+        {
+            llama_io_read_file io(&file, state_io_buft());
+            nread = state_seq_read_data(io, seq_id);
+        }
         if (!nread) {
             LLAMA_LOG_ERROR("%s: failed to restore sequence state\n", __func__);
             return 0;
@@ -1801,8 +2842,9 @@ size_t llama_context::state_seq_save_file(llama_seq_id seq_id, const char * file
     file.write_raw(tokens, sizeof(llama_token) * n_token_count);
 
     // save the context state using stream saving
-    llama_io_write_file io(&file);
+    llama_io_write_file io(&file, state_io_buft());
     state_seq_write_data(io, seq_id);
+    io.flush();
 
     const size_t res = file.tell();
     GGML_ASSERT(res == sizeof(uint32_t) * 3 + sizeof(llama_token) * n_token_count + io.n_bytes());
@@ -1810,6 +2852,11 @@ size_t llama_context::state_seq_save_file(llama_seq_id seq_id, const char * file
     return res;
 }
 
+ggml_backend_buffer_type_t llama_context::state_io_buft() const {
+    // pinned memory of the first device, if supported
+    return model.devices.empty() ? nullptr : ggml_backend_dev_host_buffer_type(model.devices[0]);
+}
+
 size_t llama_context::state_write_data(llama_io_write_i & io) {
     LLAMA_LOG_DEBUG("%s: writing state\n", __func__);
 
@@ -1854,12 +2901,16 @@ size_t llama_context::state_write_data(llama_io_write_i & io) {
     {
         LLAMA_LOG_DEBUG("%s: - writing logits\n", __func__);
 
+        for (int64_t j = 0; j < n_outputs; ++j) {
+            output_fill_logits(j);
+        }
+
         const uint64_t logits_size = std::min((uint64_t) this->logits_size, (uint64_t) n_outputs * model.vocab.n_tokens());
 
         io.write(&logits_size, sizeof(logits_size));
 
         if (logits_size) {
-            io.write(logits, logits_size * sizeof(float));
+            io.write(output_logits(), logits_size * sizeof(float));
         }
     }
 
@@ -1942,7 +2993,11 @@ size_t llama_context::state_read_data(llama_io_read_i & io) {
         }
 
         if (logits_size) {
-            io.read_to(this->logits, logits_size * sizeof(float));
+            io.read_to(output_logits(), logits_size * sizeof(float));
+
+            if (!logits_filled.empty()) {
+                std::fill(logits_filled.begin(), logits_filled.begin() + n_outputs, true);
+            }
         }
     }
 
@@ -1971,21 +3026,21 @@ size_t llama_context::state_read_data(llama_io_read_i & io) {
     return io.n_bytes();
 }
 
-size_t llama_context::state_seq_write_data(llama_io_write_i & io, llama_seq_id seq_id) {
+size_t llama_context::state_seq_write_data(llama_io_write_i & io, llama_seq_id seq_id, llama_pos p0, llama_pos p1, llama_state_seq_flags flags) {
     GGML_UNUSED(seq_id);
 
     if (memory) {
-        memory->state_write(io, seq_id);
+        memory->state_write(io, seq_id, p0, p1, flags);
     }
 
     return io.n_bytes();
 }
 
-size_t llama_context::state_seq_read_data(llama_io_read_i & io, llama_seq_id seq_id) {
+size_t llama_context::state_seq_read_data(llama_io_read_i & io, llama_seq_id seq_id, bool append, llama_pos shift, llama_state_seq_flags flags) {
     GGML_UNUSED(seq_id);
 
     if (memory) {
-        memory->state_read(io, seq_id);
+        memory->state_read(io, seq_id, append, shift, flags);
     }
 
     return io.n_bytes();
@@ -2006,6 +3061,9 @@ llama_perf_context_data llama_context::perf_get_data() const {
     data.n_eval      = std::max(1, n_eval);
     data.n_reused    = std::max(0, n_reused);
 
+    data.t_mem_update_ms = 1e-3 * t_mem_update_us;
+    data.n_mem_update    = n_mem_update;
+
     return data;
 }
 
@@ -2014,6 +3072,28 @@ void llama_context::perf_reset() {
     t_eval_us   = n_eval = 0;
     t_p_eval_us = n_p_eval = 0;
     n_reused    = 0;
+
+    t_mem_update_us = n_mem_update = 0;
+
+    std::fill(expert_counts.begin(), expert_counts.end(), 0);
+}
+
+int32_t llama_context::perf_expert_counts(int32_t il, uint64_t * counts, int32_t n_counts) const {
+    const int32_t n_expert = model.hparams.n_expert;
+
+    if (expert_counts.empty() || il < 0 || il >= (int32_t) model.hparams.n_layer) {
+        return 0;
+    }
+
+    const uint64_t * src = expert_counts.data() + il*n_expert;
+
+    if (std::all_of(src, src + n_expert, [](uint64_t n) { return n == 0; })) {
+        return 0;
+    }
+
+    std::copy(src, src + std::min(n_expert, std::max(0, n_counts)), counts);
+
+    return n_expert;
 }
 
 //
@@ -2048,8 +3128,27 @@ void llama_context::opt_init(struct llama_model * model, struct llama_opt_params
     opt_params.opt_period      = n_batch / n_ubatch;
     opt_params.get_opt_pars    = lopt_params.get_opt_pars;
     opt_params.get_opt_pars_ud = lopt_params.get_opt_pars_ud;
+    opt_params.loss_scale      = lopt_params.loss_scale;
+
+    GGML_ASSERT(lopt_params.type_compute == GGML_TYPE_F32 || lopt_params.type_compute == GGML_TYPE_F16 || lopt_params.type_compute == GGML_TYPE_BF16);
+    cparams.type_opt = lopt_params.type_compute;
+    if (cparams.type_opt != GGML_TYPE_F32) {
+        LLAMA_LOG_INFO("%s: computing the matrix multiplications with the trainable weights in %s, loss scale = %g\n",
+                __func__, ggml_type_name(cparams.type_opt), lopt_params.loss_scale);
+    }
 
     opt_ctx = ggml_opt_init(opt_params);
+    opt_recompute = lopt_params.recompute;
+
+    if (lopt_params.adapter) {
+        // the adapter is applied through build_lora_mm, the gradients flow through the frozen weights
+        set_adapter_lora(lopt_params.adapter, 1.0f);
+        for (auto & it : lopt_params.adapter->ab_map) {
+            ggml_set_param(it.second.a);
+            ggml_set_param(it.second.b);
+        }
+        return;
+    }
 
     llama_opt_param_filter param_filter = lopt_params.param_filter;
     void * param_filter_ud              = lopt_params.param_filter_ud;
@@ -2114,6 +3213,7 @@ void llama_context::opt_epoch_iter(
         n_queued_tokens += n_tokens_all;
 
         embd_seq.clear();
+        embd_seq_data.clear();
 
         uint32_t n_outputs_all = n_tokens_all;
 
@@ -2148,6 +3248,16 @@ void llama_context::opt_epoch_iter(
 
             auto * gf = model.build_graph(gparams);
 
+            // the outputs of the layers are the checkpoints of the activation recomputation
+            if (opt_recompute) {
+                for (int i = 0; i < ggml_graph_n_nodes(gf); ++i) {
+                    ggml_tensor * node = ggml_graph_node(gf, i);
+                    if (strncmp(node->name, "l_out-", 6) == 0) {
+                        ggml_set_checkpoint(node);
+                    }
+                }
+            }
+
             struct ggml_context * ctx_compute_opt;
             {
                 const size_t size_gf = ggml_graph_size(gf);
@@ -2166,12 +3276,19 @@ void llama_context::opt_epoch_iter(
             {
                 struct ggml_tensor * labels = ggml_opt_labels(opt_ctx);
                 GGML_ASSERT(labels->ne[1] == n_ubatch);
-                ggml_set_zero(labels);
-                const float onef = 1.0f;
+                GGML_ASSERT(labels->type == GGML_TYPE_F32 && ggml_is_contiguous(labels));
+
+                // one upload instead of a copy per label, the host buffer is cleared again after the upload
+                opt_labels.resize(ggml_nelements(labels));
                 for (uint32_t pos_ubatch = 0; pos_ubatch < n_ubatch; ++pos_ubatch) {
                     const uint32_t ilabel = pos_ctx + pos_batch + pos_ubatch;
                     GGML_ASSERT(labels_sparse[ilabel] < labels->ne[0]);
-                    ggml_backend_tensor_set(labels, &onef, (pos_ubatch*labels->ne[0] + labels_sparse[ilabel])*sizeof(float), sizeof(float));
+                    opt_labels[pos_ubatch*labels->ne[0] + labels_sparse[ilabel]] = 1.0f;
+                }
+                ggml_backend_tensor_set(labels, opt_labels.data(), 0, ggml_nbytes(labels));
+                for (uint32_t pos_ubatch = 0; pos_ubatch < n_ubatch; ++pos_ubatch) {
+                    const uint32_t ilabel = pos_ctx + pos_batch + pos_ubatch;
+                    opt_labels[pos_ubatch*labels->ne[0] + labels_sparse[ilabel]] = 0.0f;
                 }
             }
             ggml_opt_eval(opt_ctx, result);
@@ -2192,6 +3309,8 @@ void llama_context::opt_epoch(
         int64_t                   idata_split,
         ggml_opt_epoch_callback   callback_train,
         ggml_opt_epoch_callback   callback_eval) {
+    auto lock = sched_lock();
+
     const uint32_t n_ctx    = this->n_ctx();
     const uint32_t n_batch  = std::min(cparams.n_batch,  n_ctx);
     const uint32_t n_ubatch = std::min(cparams.n_ubatch, n_batch);
@@ -2203,31 +3322,40 @@ void llama_context::opt_epoch(
     const uint32_t ubatch_per_ctx = n_ctx / n_ubatch;
 
     struct llama_batch batch = llama_batch_init(n_batch, 0, 1);
-    std::vector<llama_token>        tokens(n_ctx);
-    std::vector<llama_token> labels_sparse(n_ctx);
 
-    int64_t idata = 0;
+    // double-buffered: the next datapoint is read from the dataset by a loader thread while the current one is evaluated,
+    // so that the reads of a mapped dataset (ggml_opt_dataset_init_mmap) do not stall the steps
+    std::vector<llama_token>        tokens[2] = { std::vector<llama_token>(n_ctx), std::vector<llama_token>(n_ctx) };
+    std::vector<llama_token> labels_sparse[2] = { std::vector<llama_token>(n_ctx), std::vector<llama_token>(n_ctx) };
 
-    int64_t t_loop_start = ggml_time_us();
-    int64_t ndata_in_loop = idata_split*ubatch_per_ctx;
-    for (; idata < idata_split; ++idata) {
-        constexpr bool train = true;
-        const int64_t idata_in_loop = idata*ubatch_per_ctx;
+    auto load = [&](int64_t idata, int ibuf) {
+        ggml_opt_dataset_get_batch_host(dataset, tokens[ibuf].data(), n_ctx*sizeof(llama_token), labels_sparse[ibuf].data(), idata);
+    };
 
-        ggml_opt_dataset_get_batch_host(dataset, tokens.data(), n_ctx*sizeof(llama_token), labels_sparse.data(), idata);
-        opt_epoch_iter(dataset, result_train, tokens, labels_sparse, batch,
-            callback_train, train, idata_in_loop, ndata_in_loop, t_loop_start);
+    std::future<void> loading;
+    if (ndata > 0) {
+        loading = std::async(std::launch::async, load, 0, 0);
     }
 
-    t_loop_start = ggml_time_us();
-    ndata_in_loop = (ndata - idata_split)*ubatch_per_ctx;
-    for (; idata < ndata; ++idata) {
-        constexpr bool train = false;
-        const int64_t idata_in_loop = (idata - idata_split)*ubatch_per_ctx;
+    int64_t t_loop_start = ggml_time_us();
+    for (int64_t idata = 0; idata < ndata; ++idata) {
+        const int ibuf = idata % 2;
+
+        loading.get();
+        if (idata + 1 < ndata) {
+            loading = std::async(std::launch::async, load, idata + 1, 1 - ibuf);
+        }
+
+        const bool train = idata < idata_split;
+        if (idata == idata_split) {
+            t_loop_start = ggml_time_us();
+        }
+
+        const int64_t idata_in_loop = (train ? idata : idata - idata_split)*ubatch_per_ctx;
+        const int64_t ndata_in_loop = (train ? idata_split : ndata - idata_split)*ubatch_per_ctx;
 
-        ggml_opt_dataset_get_batch_host(dataset, tokens.data(), n_ctx*sizeof(llama_token), labels_sparse.data(), idata);
-        opt_epoch_iter(dataset, result_eval, tokens, labels_sparse, batch,
-            callback_eval, train, idata_in_loop, ndata_in_loop, t_loop_start);
+        opt_epoch_iter(dataset, train ? result_train : result_eval, tokens[ibuf], labels_sparse[ibuf], batch,
+            train ? callback_train : callback_eval, train, idata_in_loop, ndata_in_loop, t_loop_start);
     }
 
     llama_batch_free(batch);
@@ -2256,10 +3384,23 @@ llama_context_params llama_context_default_params() {
         /*.yarn_beta_slow              =*/ 1.0f,
         /*.yarn_orig_ctx               =*/ 0,
         /*.defrag_thold                =*/ -1.0f,
+        /*.n_layer_exit                =*/ 0,
+        /*.layer_skip_begin            =*/ 0,
+        /*.layer_skip_end              =*/ 0,
+        /*.n_logits_top_k              =*/ 0,
+        /*.logits_type                 =*/ LLAMA_LOGITS_TYPE_F32,
+        /*.n_embd_out                  =*/ 0,
+        /*.embd_type                   =*/ LLAMA_EMBD_TYPE_F32,
         /*.cb_eval                     =*/ nullptr,
         /*.cb_eval_user_data           =*/ nullptr,
         /*.type_k                      =*/ GGML_TYPE_F16,
         /*.type_v                      =*/ GGML_TYPE_F16,
+        /*.n_layer_kv_f16              =*/ 0,
+        /*.n_rs_ckpt                   =*/ 0,
+        /*.rs_ckpt_interval            =*/ 512,
+        /*.cpu_mem_kv                  =*/ 0,
+        /*.cpu_mem_compute             =*/ 0,
+        /*.kv_mem_node                 =*/ -1,
         /*.abort_callback              =*/ nullptr,
         /*.abort_callback_data         =*/ nullptr,
         /*.embeddings                  =*/ false,
@@ -2269,27 +3410,31 @@ llama_context_params llama_context_default_params() {
         /*.op_offload                  =*/ true,
         /*.swa_full                    =*/ true,
         /*.kv_unified                  =*/ false,
+        /*.kv_scores                   =*/ false,
+        /*.expert_stats                =*/ false,
+        /*.reserve_lazy                =*/ false,
+        /*.embd_normalize              =*/ false,
+        /*.ffn_sparse                  =*/ true,
     };
 
     return result;
 }
 
-llama_context * llama_init_from_model(
-                 llama_model * model,
-        llama_context_params   params) {
+// check the params of a new context, some of them may be adjusted
+static bool llama_context_params_check(const llama_model * model, llama_context_params & params) {
     if (!model) {
         LLAMA_LOG_ERROR("%s: model cannot be NULL\n", __func__);
-        return nullptr;
+        return false;
     }
 
     if (params.n_batch == 0 && params.n_ubatch == 0) {
         LLAMA_LOG_ERROR("%s: n_batch and n_ubatch cannot both be zero\n", __func__);
-        return nullptr;
+        return false;
     }
 
     if (params.n_ctx == 0 && model->hparams.n_ctx_train == 0) {
         LLAMA_LOG_ERROR("%s: n_ctx and model->hparams.n_ctx_train cannot both be zero\n", __func__);
-        return nullptr;
+        return false;
     }
 
     if (params.flash_attn && model->arch == LLM_ARCH_GROK) {
@@ -2299,6 +3444,16 @@ llama_context * llama_init_from_model(
 
     if (ggml_is_quantized(params.type_v) && !params.flash_attn) {
         LLAMA_LOG_ERROR("%s: V cache quantization requires flash_attn\n", __func__);
+        return false;
+    }
+
+    return true;
+}
+
+llama_context * llama_init_from_model(
+                 llama_model * model,
+        llama_context_params   params) {
+    if (!llama_context_params_check(model, params)) {
         return nullptr;
     }
 
@@ -2323,6 +3478,66 @@ void llama_free(llama_context * ctx) {
     delete ctx;
 }
 
+//
+// llama_context_pool
+//
+
+llama_context_pool::llama_context_pool(const llama_model & model, llama_context_params params) :
+    ctx(new llama_context(model, params)) {
+    // the worst-case graphs are reserved - the KV cache is not needed anymore
+    ctx->memory_free();
+
+    LLAMA_LOG_INFO("%s: context pool ready, n_ctx = %u, n_ubatch = %u\n", __func__, ctx->n_ctx(), ctx->n_ubatch());
+}
+
+llama_context_pool * llama_context_pool_init(
+                 llama_model * model,
+        llama_context_params   params) {
+    if (!llama_context_params_check(model, params)) {
+        return nullptr;
+    }
+
+    if (model->hparams.vocab_only) {
+        LLAMA_LOG_ERROR("%s: a context pool requires the model weights\n", __func__);
+        return nullptr;
+    }
+
+    try {
+        return new llama_context_pool(*model, params);
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: failed to initialize the context pool: %s\n", __func__, err.what());
+    }
+
+    return nullptr;
+}
+
+void llama_context_pool_free(llama_context_pool * pool) {
+    delete pool;
+}
+
+llama_context * llama_init_from_pool(
+        llama_context_pool   * pool,
+        llama_context_params   params) {
+    if (!pool) {
+        LLAMA_LOG_ERROR("%s: pool cannot be NULL\n", __func__);
+        return nullptr;
+    }
+
+    const llama_model & model = pool->ctx->get_model();
+
+    if (!llama_context_params_check(&model, params)) {
+        return nullptr;
+    }
+
+    try {
+        return new llama_context(model, params, pool->ctx.get());
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: failed to initialize the context: %s\n", __func__, err.what());
+    }
+
+    return nullptr;
+}
+
 uint32_t llama_n_ctx(const llama_context * ctx) {
     return ctx->n_ctx();
 }
@@ -2388,6 +3603,14 @@ void llama_set_embeddings(llama_context * ctx, bool embeddings) {
     ctx->set_embeddings(embeddings);
 }
 
+void llama_set_output_hidden(llama_context * ctx, bool output_hidden) {
+    ctx->set_output_hidden(output_hidden);
+}
+
+void llama_set_mtp_draft(llama_context * ctx, bool mtp_draft) {
+    ctx->set_mtp_draft(mtp_draft);
+}
+
 void llama_set_causal_attn(llama_context * ctx, bool causal_attn) {
     ctx->set_causal_attn(causal_attn);
 }
@@ -2412,6 +3635,16 @@ float * llama_get_logits_ith(llama_context * ctx, int32_t i) {
     return ctx->get_logits_ith(i);
 }
 
+int32_t llama_get_logits_top_k_ith(llama_context * ctx, int32_t i, const llama_token ** ids, const float ** logits) {
+    ctx->synchronize();
+
+    return ctx->get_logits_top_k_ith(i, ids, logits);
+}
+
+int32_t llama_set_logits_vocab(llama_context * ctx, const llama_token * ids, int32_t n_ids) {
+    return ctx->set_logits_vocab(ids, n_ids);
+}
+
 float * llama_get_embeddings(llama_context * ctx) {
     ctx->synchronize();
 
@@ -2430,6 +3663,16 @@ float * llama_get_embeddings_seq(llama_context * ctx, llama_seq_id seq_id) {
     return ctx->get_embeddings_seq(seq_id);
 }
 
+const void * llama_get_embeddings_seq_data(llama_context * ctx, llama_seq_id seq_id, size_t * size) {
+    ctx->synchronize();
+
+    return ctx->get_embeddings_seq_data(seq_id, size);
+}
+
+int32_t llama_n_embd_out(const llama_context * ctx) {
+    return ctx->get_cparams().n_embd_out;
+}
+
 // llama adapter API
 
 int32_t llama_set_adapter_lora(
@@ -2453,6 +3696,25 @@ void llama_clear_adapter_lora(llama_context * ctx) {
     ctx->clear_adapter_lora();
 }
 
+int32_t llama_set_adapter_lora_seq(
+            llama_context * ctx,
+            llama_adapter_lora * adapter,
+            llama_seq_id seq_id,
+            float scale) {
+    if (seq_id < 0 || (uint32_t) seq_id >= llama_n_seq_max(ctx)) {
+        LLAMA_LOG_ERROR("%s: invalid seq_id = %d\n", __func__, seq_id);
+        return -1;
+    }
+
+    ctx->set_adapter_lora_seq(adapter, seq_id, scale);
+
+    return 0;
+}
+
+void llama_clear_adapter_lora_seq(llama_context * ctx, llama_seq_id seq_id) {
+    ctx->clear_adapter_lora_seq(seq_id);
+}
+
 int32_t llama_apply_adapter_cvec(
         llama_context * ctx,
                  const float * data,
@@ -2542,6 +3804,34 @@ void llama_memory_seq_div(
     mem->seq_div(seq_id, p0, p1, d);
 }
 
+int32_t llama_memory_n_cells(llama_memory_t mem, int32_t * n_extent) {
+    uint32_t n_used_cells   = 0;
+    uint32_t n_extent_cells = 0;
+
+    if (mem) {
+        mem->get_n_cells(n_used_cells, n_extent_cells);
+    }
+
+    if (n_extent) {
+        *n_extent = n_extent_cells;
+    }
+
+    return n_used_cells;
+}
+
+int32_t llama_memory_seq_compress(
+        llama_memory_t mem,
+          llama_seq_id seq_id,
+             llama_pos p0,
+             llama_pos p1,
+               int32_t n_keep) {
+    if (!mem) {
+        return 0;
+    }
+
+    return mem->seq_compress(seq_id, p0, p1, n_keep);
+}
+
 llama_pos llama_memory_seq_pos_min(
         llama_memory_t mem,
           llama_seq_id seq_id) {
@@ -2816,6 +4106,54 @@ size_t llama_state_seq_set_data(llama_context * ctx, const uint8_t * src, size_t
     return ctx->state_seq_set_data(seq_id, src, size);
 }
 
+size_t llama_state_seq_get_size_ext(llama_context * ctx, llama_seq_id seq_id, llama_state_seq_flags flags) {
+    return ctx->state_seq_get_size(seq_id, -1, -1, flags);
+}
+
+size_t llama_state_seq_get_data_ext(llama_context * ctx, uint8_t * dst, size_t size, llama_seq_id seq_id, llama_state_seq_flags flags) {
+    ctx->synchronize();
+
+    return ctx->state_seq_get_data(seq_id, dst, size, -1, -1, flags);
+}
+
+size_t llama_state_seq_set_data_ext(llama_context * ctx, const uint8_t * src, size_t size, llama_seq_id dest_seq_id, llama_state_seq_flags flags) {
+    ctx->synchronize();
+
+    return ctx->state_seq_set_data(dest_seq_id, src, size, false, 0, flags);
+}
+
+size_t llama_state_seq_get_size_from(llama_context * ctx, llama_seq_id seq_id, llama_pos p0) {
+    return ctx->state_seq_get_size(seq_id, p0);
+}
+
+size_t llama_state_seq_get_data_from(llama_context * ctx, uint8_t * dst, size_t size, llama_seq_id seq_id, llama_pos p0) {
+    ctx->synchronize();
+
+    return ctx->state_seq_get_data(seq_id, dst, size, p0);
+}
+
+size_t llama_state_seq_set_data_append(llama_context * ctx, const uint8_t * src, size_t size, llama_seq_id dest_seq_id) {
+    ctx->synchronize();
+
+    return ctx->state_seq_set_data(dest_seq_id, src, size, true);
+}
+
+size_t llama_state_seq_get_size_range(llama_context * ctx, llama_seq_id seq_id, llama_pos p0, llama_pos p1) {
+    return ctx->state_seq_get_size(seq_id, p0, p1);
+}
+
+size_t llama_state_seq_get_data_range(llama_context * ctx, uint8_t * dst, size_t size, llama_seq_id seq_id, llama_pos p0, llama_pos p1) {
+    ctx->synchronize();
+
+    return ctx->state_seq_get_data(seq_id, dst, size, p0, p1);
+}
+
+size_t llama_state_seq_set_data_shift(llama_context * ctx, const uint8_t * src, size_t size, llama_seq_id dest_seq_id, llama_pos delta) {
+    ctx->synchronize();
+
+    return ctx->state_seq_set_data(dest_seq_id, src, size, true, delta);
+}
+
 size_t llama_state_seq_save_file(llama_context * ctx, const char * filepath, llama_seq_id seq_id, const llama_token * tokens, size_t n_token_count) {
     ctx->synchronize();
 
@@ -2854,6 +4192,12 @@ int32_t llama_encode(
 int32_t llama_decode(
         llama_context * ctx,
           llama_batch   batch) {
+    // finish the pending llama_decode_async(), if any
+    const int ret_async = ctx->decode_wait();
+    if (ret_async != 0 && ret_async != 1) {
+        LLAMA_LOG_ERROR("%s: failed to decode the pending async batch, ret = %d\n", __func__, ret_async);
+    }
+
     const int ret = ctx->decode(batch);
     if (ret != 0 && ret != 1) {
         LLAMA_LOG_ERROR("%s: failed to decode, ret = %d\n", __func__, ret);
@@ -2862,6 +4206,25 @@ int32_t llama_decode(
     return ret;
 }
 
+int32_t llama_decode_async(
+        llama_context * ctx,
+          llama_batch   batch) {
+    return ctx->decode_async(batch);
+}
+
+int32_t llama_decode_wait(llama_context * ctx) {
+    const int ret = ctx->decode_wait();
+    if (ret != 0 && ret != 1) {
+        LLAMA_LOG_ERROR("%s: failed to decode, ret = %d\n", __func__, ret);
+    }
+
+    return ret;
+}
+
+bool llama_decode_ready(const llama_context * ctx) {
+    return ctx->decode_ready();
+}
+
 //
 // perf
 //
@@ -2890,6 +4253,46 @@ void llama_perf_context_print(const llama_context * ctx) {
             __func__, data.t_eval_ms, data.n_eval, data.t_eval_ms / data.n_eval, 1e3 / data.t_eval_ms * data.n_eval);
     LLAMA_LOG_INFO("%s:       total time = %10.2f ms / %5d tokens\n", __func__, (t_end_ms - data.t_start_ms), (data.n_p_eval + data.n_eval));
     LLAMA_LOG_INFO("%s:    graphs reused = %10d\n", __func__, data.n_reused);
+
+    if (data.n_mem_update > 0) {
+        LLAMA_LOG_INFO("%s:   memory updates = %10.2f ms / %5d runs\n", __func__, data.t_mem_update_ms, data.n_mem_update);
+    }
+
+    // share of the routed tokens received by the hottest experts of each layer, averaged over the MoE layers
+    if (ctx != nullptr) {
+        const auto & hparams = ctx->get_model().hparams;
+
+        const int32_t n_expert = hparams.n_expert;
+
+        std::vector<uint64_t> counts(n_expert);
+
+        int32_t n_layer_moe = 0;
+        double  hot[2] = { 0.0, 0.0 }; // 25%, 50% of the experts
+
+        for (int32_t il = 0; il < (int32_t) hparams.n_layer; ++il) {
+            if (ctx->perf_expert_counts(il, counts.data(), n_expert) == 0) {
+                continue;
+            }
+
+            std::sort(counts.begin(), counts.end(), std::greater<uint64_t>());
+
+            const double total = std::accumulate(counts.begin(), counts.end(), 0.0);
+
+            hot[0] += std::accumulate(counts.begin(), counts.begin() + std::max(1, n_expert/4), 0.0) / total;
+            hot[1] += std::accumulate(counts.begin(), counts.begin() + std::max(1, n_expert/2), 0.0) / total;
+
+            n_layer_moe++;
+        }
+
+        if (n_layer_moe > 0) {
+            LLAMA_LOG_INFO("%s:   expert routing = %6.2f%% / %6.2f%% of the tokens to the hottest 25%% / 50%% of the experts (%d layers)\n",
+                    __func__, 100.0*hot[0]/n_layer_moe, 100.0*hot[1]/n_layer_moe, n_layer_moe);
+        }
+    }
+}
+
+int32_t llama_perf_context_expert_counts(const llama_context * ctx, int32_t il, uint64_t * counts, int32_t n_counts) {
+    return ctx->perf_expert_counts(il, counts, n_counts);
 }
 
 void llama_perf_context_reset(llama_context * ctx) {
@@ -8,7 +8,11 @@
 #include "ggml-cpp.h"
 #include "ggml-opt.h"
 
+#include <condition_variable>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <vector>
 
 struct llama_model;
@@ -20,11 +24,22 @@ class llama_io_write_i;
 struct llama_memory_i;
 struct llama_memory_context_i;
 
+// state shared by the contexts that use the same scheduler, see llama_context_pool
+struct llama_context_shared {
+    // held for the evaluation of a batch, so that the contexts use the scheduler one at a time
+    std::recursive_mutex mutex;
+
+    // the last context that allocated a graph in the scheduler
+    const llama_context * owner = nullptr;
+};
+
 struct llama_context {
     // init scheduler and compute buffers, reserve worst-case graphs
+    // with ctx_shared, the backends, the scheduler and the compute buffers of that context are used instead
     llama_context(
             const llama_model & model,
-                  llama_context_params params);
+                  llama_context_params params,
+            const llama_context * ctx_shared = nullptr);
 
     ~llama_context();
 
@@ -46,6 +61,9 @@ struct llama_context {
 
     llama_memory_t get_memory() const;
 
+    // free the KV cache of a context that only holds the compute buffers of a llama_context_pool
+    void memory_free();
+
     // return true of the KV cache was updated
     // TODO: remove
     bool kv_self_update(bool optimize);
@@ -56,10 +74,16 @@ struct llama_context {
     float * get_logits();
     float * get_logits_ith(int32_t i);
 
+    int32_t get_logits_top_k_ith(int32_t i, const llama_token ** ids, const float ** logits);
+
+    int32_t set_logits_vocab(const llama_token * ids, int32_t n_ids);
+
     float * get_embeddings();
     float * get_embeddings_ith(int32_t i);
     float * get_embeddings_seq(llama_seq_id seq_id);
 
+    const void * get_embeddings_seq_data(llama_seq_id seq_id, size_t * size);
+
     void attach_threadpool(
             ggml_threadpool_t threadpool,
             ggml_threadpool_t threadpool_batch);
@@ -70,8 +94,10 @@ struct llama_context {
 
     void set_abort_callback(bool (*abort_callback)(void * data), void * abort_callback_data);
 
-    void set_embeddings (bool value);
-    void set_causal_attn(bool value);
+    void set_embeddings   (bool value);
+    void set_output_hidden(bool value);
+    void set_mtp_draft    (bool value);
+    void set_causal_attn  (bool value);
     void set_warmup(bool value);
 
     void set_adapter_lora(
@@ -83,6 +109,13 @@ struct llama_context {
 
     void clear_adapter_lora();
 
+    void set_adapter_lora_seq(
+            llama_adapter_lora * adapter,
+            llama_seq_id seq_id,
+            float scale);
+
+    void clear_adapter_lora_seq(llama_seq_id seq_id);
+
     bool apply_adapter_cvec(
             const float * data,
                  size_t   len,
@@ -103,6 +136,16 @@ struct llama_context {
     int encode(const llama_batch & batch_inp);
     int decode(const llama_batch & batch_inp);
 
+    // run decode() on a worker thread - the result is obtained with decode_wait()
+    int  decode_async(const llama_batch & batch_inp);
+    int  decode_wait();
+    bool decode_ready() const;
+
+private:
+    void decode_worker_loop();
+
+public:
+
     //
     // state save/load
     //
@@ -111,9 +154,9 @@ struct llama_context {
     size_t state_get_data(      uint8_t * dst, size_t size);
     size_t state_set_data(const uint8_t * src, size_t size);
 
-    size_t state_seq_get_size(llama_seq_id seq_id);
-    size_t state_seq_get_data(llama_seq_id seq_id,       uint8_t * dst, size_t size);
-    size_t state_seq_set_data(llama_seq_id seq_id, const uint8_t * src, size_t size);
+    size_t state_seq_get_size(llama_seq_id seq_id, llama_pos p0 = -1, llama_pos p1 = -1, llama_state_seq_flags flags = 0);
+    size_t state_seq_get_data(llama_seq_id seq_id,       uint8_t * dst, size_t size, llama_pos p0 = -1, llama_pos p1 = -1, llama_state_seq_flags flags = 0);
+    size_t state_seq_set_data(llama_seq_id seq_id, const uint8_t * src, size_t size, bool append = false, llama_pos shift = 0, llama_state_seq_flags flags = 0);
 
     bool state_load_file(
             const char * filepath,
@@ -146,6 +189,8 @@ struct llama_context {
     llama_perf_context_data perf_get_data() const;
     void perf_reset();
 
+    int32_t perf_expert_counts(int32_t il, uint64_t * counts, int32_t n_counts) const;
+
     //
     // training
     //
@@ -183,6 +228,12 @@ private:
 
     void output_reorder();
 
+    // the F32 logits, allocated on first use when the rows are reconstructed on demand
+    float * output_logits();
+
+    // reconstruct the j-th row of logits from its top-k, F16/BF16 or vocabulary subset logits
+    void output_fill_logits(int64_t j);
+
     //
     // graph
     //
@@ -199,6 +250,9 @@ public:
     // reserve a graph with a dummy ubatch of the specified size
     ggml_cgraph * graph_reserve(uint32_t n_tokens, uint32_t n_seqs, uint32_t n_outputs, const llama_memory_context_i * mctx);
 
+    // number of outputs of the reserved worst-case graph for a ubatch of n_tokens, see llama_context_params.reserve_lazy
+    uint32_t n_outputs_reserve(uint32_t n_tokens, uint32_t n_seqs) const;
+
 private:
     llm_graph_params graph_params(
                         llm_graph_result * res,
@@ -208,12 +262,21 @@ private:
 
     llm_graph_cb graph_get_cb() const;
 
+    // if a graph in gf_res_cache can be reused with the parameters, make it the previous graph and return true
+    bool use_cached_graph(const llm_graph_params & gparams);
+
+    // move the previous graph to gf_res_cache and return the graph result to build the next graph in
+    llm_graph_result * gf_res_next();
+
     // TODO: read/write lora adapters and cvec
+    // host buffer type for staging the state file transfers, nullptr for regular memory
+    ggml_backend_buffer_type_t state_io_buft() const;
+
     size_t state_write_data(llama_io_write_i & io);
     size_t state_read_data (llama_io_read_i  & io);
 
-    size_t state_seq_write_data(llama_io_write_i & io, llama_seq_id seq_id);
-    size_t state_seq_read_data (llama_io_read_i  & io, llama_seq_id seq_id);
+    size_t state_seq_write_data(llama_io_write_i & io, llama_seq_id seq_id, llama_pos p0 = -1, llama_pos p1 = -1, llama_state_seq_flags flags = 0);
+    size_t state_seq_read_data (llama_io_read_i  & io, llama_seq_id seq_id, bool append = false, llama_pos shift = 0, llama_state_seq_flags flags = 0);
 
     //
     // members
@@ -225,8 +288,12 @@ private:
     llama_adapter_cvec  cvec;
     llama_adapter_loras loras;
 
+    llama_adapter_loras_seq loras_seq;
+
     llama_cross cross; // TODO: tmp for handling cross-attention - need something better probably
 
+    llama_vocab_short vocab_short;
+
     std::unique_ptr<llama_memory_i> memory;
 
     // TODO: temporary, until the llama_kv_self_defrag() API is removed
@@ -236,6 +303,33 @@ private:
     size_t  logits_size = 0; // capacity (of floats) for logits
     float * logits      = nullptr;
 
+    // top-k logits output (2-dimensional arrays: [n_outputs][n_logits_top_k])
+    // populated only when cparams.n_logits_top_k > 0, the rows of logits are then filled on demand
+    std::vector<llama_token> logits_top_k_ids;
+    std::vector<float>       logits_top_k;
+    std::vector<bool>        logits_filled;
+
+    // F16/BF16 logits output ([n_outputs][n_vocab]), populated only when cparams.logits_type != LLAMA_LOGITS_TYPE_F32
+    std::vector<ggml_fp16_t> logits_half;
+
+    // logits of the vocabulary subset ([n_outputs][vocab_short.ids.size()]), see set_logits_vocab()
+    std::vector<float> logits_short;
+
+    // F32 logits when they are reconstructed on demand, buf_output holds only the embeddings then
+    std::vector<float> logits_host;
+
+    // host buffer for the attention weights of the KV cells, see llama_context_params.kv_scores
+    std::vector<float> kv_score;
+
+    // hidden states of the sequences for the MTP layer, and the host buffers of their rows, see llama_set_mtp_draft()
+    llama_mtp_hidden     mtp_hidden;
+    std::vector<float>   mtp_buf;
+    std::vector<int32_t> mtp_ids;
+
+    // tokens routed to each expert [n_layer][n_expert] and the host buffer of the router, see llama_context_params.expert_stats
+    std::vector<uint64_t> expert_counts;
+    std::vector<int32_t>  expert_ids;
+
     // embeddings output (2-dimensional array: [n_outputs][n_embd])
     // populated only when pooling_type == LLAMA_POOLING_TYPE_NONE
     size_t  embd_size = 0; // capacity (of floats) for embeddings
@@ -245,6 +339,13 @@ private:
     // populated only when pooling_type != LLAMA_POOLING_TYPE_NONE
     std::map<llama_seq_id, std::vector<float>> embd_seq;
 
+    // sequence embeddings in cparams.embd_type when it is not LLAMA_EMBD_TYPE_F32
+    // the binary embeddings are copied back as F16 values of 8 bits each, and packed on first access
+    std::map<llama_seq_id, std::vector<uint8_t>> embd_seq_data;
+
+    // copy the pooled embeddings of the sequences of the ubatch from t_embd to embd_seq/embd_seq_data
+    void output_embd_seq(ggml_backend_t backend_embd, ggml_tensor * t_embd, const llama_ubatch & ubatch);
+
     // reuse the batch_allocr to avoid unnecessary memory allocations
     std::unique_ptr<llama_batch_allocr> balloc;
 
@@ -259,13 +360,25 @@ private:
 
     std::vector<swap_info> output_swaps;
 
-    ggml_backend_sched_ptr sched;
+    // lock the scheduler for the evaluation of a batch
+    // the graph of the previous batch cannot be reused as it is if another context used the scheduler since
+    std::unique_lock<std::recursive_mutex> sched_lock();
+
+    // shared with the other contexts of a llama_context_pool
+    std::shared_ptr<ggml_backend_sched> sched;
 
     ggml_backend_t backend_cpu = nullptr;
-    std::vector<ggml_backend_ptr> backends;
+    std::vector<std::shared_ptr<ggml_backend>> backends;
+
+    std::shared_ptr<llama_context_shared> shared;
+
+    // the scheduler was used by another context since the last graph of this one was allocated
+    bool sched_stale = false;
 
     // training
     ggml_opt_context_t opt_ctx = nullptr;
+    bool               opt_recompute = false; // see llama_opt_params.recompute
+    std::vector<float> opt_labels;                // one-hot labels of a ubatch, uploaded with a single copy
 
     ggml_threadpool_t threadpool       = nullptr;
     ggml_threadpool_t threadpool_batch = nullptr;
@@ -282,9 +395,23 @@ private:
     llm_graph_result_ptr gf_res_prev;
     llm_graph_result_ptr gf_res_reserve;
 
+    // graphs built previously for other ubatch shapes, most recently used first
+    // when the shape of the ubatches alternates (e.g. parallel sequences), they are allocated again without a rebuild
+    std::vector<llm_graph_result_ptr> gf_res_cache;
+
     // host buffer for the model output (logits and embeddings)
     ggml_backend_buffer_ptr buf_output;
 
+    // worker thread of decode_async(), started on first use and running until the context is freed
+    std::thread                     decode_worker;
+    mutable std::mutex              decode_mutex;
+    std::condition_variable         decode_cv;
+    llama_batch                     decode_batch;
+    bool                            decode_queued  = false; // the batch is queued or being decoded by the worker
+    bool                            decode_pending = false; // the result has not been obtained with decode_wait()
+    bool                            decode_stop    = false;
+    int                             decode_result  = 0;
+
     bool has_evaluated_once = false;
 
     // env: LLAMA_SET_ROWS (temporary)
@@ -294,6 +421,18 @@ private:
     // env: LLAMA_GRAPH_REUSE_DISABLE
     bool graph_reuse_disable = false;
 
+    // env: LLAMA_GRAPH_CACHE_SIZE
+    // max number of graphs in gf_res_cache
+    uint32_t graph_cache_size = 2;
+
+    // number of devices that process the layers of a ubatch in sequence, when pipeline parallelism is enabled
+    uint32_t n_pp_stages = 1;
+
+    // env: LLAMA_PP_UBATCH_MIN
+    // with pipeline parallelism, batches are split in at least n_pp_stages micro-batches of at least this size
+    // so that the devices work on different micro-batches at the same time (0 = disabled)
+    uint32_t n_pp_ubatch_min = 64;
+
     // perf
     mutable int64_t t_start_us  = 0;
     mutable int64_t t_load_us   = 0;
@@ -307,4 +446,14 @@ private:
     mutable int32_t n_eval   = 0; // number of eval calls
 
     mutable int32_t n_reused = 0; // number of times the previous graph was reused
+
+    mutable int64_t t_mem_update_us = 0; // time spent in kv_self_update() when there was an update
+    mutable int32_t n_mem_update    = 0;
+};
+
+struct llama_context_pool {
+    llama_context_pool(const llama_model & model, llama_context_params params);
+
+    // owns the shared backends and scheduler - its KV cache is only used to reserve the compute buffers, then freed
+    std::unique_ptr<llama_context> ctx;
 };
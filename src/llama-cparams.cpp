@@ -3,3 +3,11 @@
 size_t llama_max_parallel_sequences(void) {
     return LLAMA_MAX_SEQ;
 }
+
+bool llama_cparams::is_layer_skipped(int32_t il) const {
+    if (n_layer_exit > 0 && il >= (int32_t) n_layer_exit) {
+        return true;
+    }
+
+    return il >= layer_skip_begin && il < layer_skip_end;
+}
@@ -27,6 +27,8 @@ struct llama_cparams {
     float defrag_thold;
 
     bool embeddings;
+    bool output_hidden; // output the final hidden states of the output tokens along with their logits
+    bool mtp_draft;     // evaluate only the MTP layer, see llama_set_mtp_draft()
     bool causal_attn;
     bool offload_kqv;
     bool flash_attn;
@@ -34,9 +36,29 @@ struct llama_cparams {
     bool warmup;
     bool op_offload;
     bool kv_unified;
+    bool kv_scores;  // accumulate the attention received by the KV cells, see llama_kv_cache_unified::score_add()
+    bool expert_stats; // count the tokens routed to each expert, see llama_context::expert_counts
+    bool reserve_lazy; // reserve the compute graphs with one output per sequence, see llama_context::n_outputs_reserve()
+    bool ffn_sparse;   // use the FFN activation predictors, see llm_graph_context::build_ffn_sparse()
+
+    uint32_t n_layer_exit;     // number of evaluated layers, 0 = all layers
+    int32_t  layer_skip_begin; // the layers in [layer_skip_begin, layer_skip_end) are not evaluated
+    int32_t  layer_skip_end;
+
+    uint32_t n_logits_top_k; // number of logits per output copied back from the device, 0 = all
+
+    enum llama_logits_type logits_type; // data type of the logits copied back from the device
+
+    uint32_t             n_embd_out;     // dimensions of the pooled embeddings, 0 = all
+    bool                 embd_normalize; // L2-normalize the pooled embeddings
+    enum llama_embd_type embd_type;      // data type of the pooled embeddings
+
+    enum ggml_type type_opt; // type of the matrix multiplications with the trainable weights, see llama_opt_params.type_compute
 
     enum llama_pooling_type pooling_type;
 
     ggml_backend_sched_eval_callback cb_eval;
     void * cb_eval_user_data;
+
+    bool is_layer_skipped(int32_t il) const;
 };
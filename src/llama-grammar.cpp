@@ -3,6 +3,7 @@
 #include "llama-impl.h"
 #include "llama-vocab.h"
 #include "llama-sampling.h"
+#include "unicode.h"
 
 #include <cmath>
 #include <algorithm>
@@ -29,10 +30,11 @@ static std::pair<uint32_t, const char *> decode_utf8(const char * src) {
 }
 
 static std::pair<std::vector<uint32_t>, llama_partial_utf8> decode_utf8(
-        const std::string & src,
+        std::string_view src,
         llama_partial_utf8 partial_start) {
     static const int      lookup[] = { 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 2, 2, 3, 4 };
-    const char          * pos      = src.c_str();
+    const char          * pos      = src.data();
+    const char          * end      = src.data() + src.size();
     std::vector<uint32_t> code_points;
 
     // common english strings have the same number of codepoints and bytes. `+ 1` for the terminating 0.
@@ -41,7 +43,7 @@ static std::pair<std::vector<uint32_t>, llama_partial_utf8> decode_utf8(
     int      n_remain = partial_start.n_remain;
 
     // continue previous decode, if applicable
-    while (*pos != 0 && n_remain > 0) {
+    while (pos < end && *pos != 0 && n_remain > 0) {
         uint8_t next_byte = static_cast<uint8_t>(*pos);
         if ((next_byte >> 6) != 2) {
             // invalid sequence, abort
@@ -58,7 +60,7 @@ static std::pair<std::vector<uint32_t>, llama_partial_utf8> decode_utf8(
     }
 
     // decode any subsequent utf-8 sequences, which may end in an incomplete one
-    while (*pos != 0) {
+    while (pos < end && *pos != 0) {
         uint8_t first_byte = static_cast<uint8_t>(*pos);
         uint8_t highbits   = first_byte >> 4;
         n_remain   = lookup[highbits] - 1;
@@ -74,7 +76,7 @@ static std::pair<std::vector<uint32_t>, llama_partial_utf8> decode_utf8(
         value = first_byte & mask;
 
         ++pos;
-        while (*pos != 0 && n_remain > 0) {
+        while (pos < end && *pos != 0 && n_remain > 0) {
             value = (value << 6) + (static_cast<uint8_t>(*pos) & 0x3F);
             ++pos;
             --n_remain;
@@ -816,18 +818,21 @@ static bool llama_grammar_detect_left_recursion(
 }
 
 const llama_grammar_rules & llama_grammar_get_rules(const struct llama_grammar * grammar) {
-    return grammar->rules;
+    return *grammar->rules;
 }
 
 llama_grammar_stacks & llama_grammar_get_stacks(struct llama_grammar * grammar) {
     return grammar->stacks;
 }
 
-void llama_grammar_accept(struct llama_grammar * grammar, uint32_t chr) {
+static llama_grammar_stacks llama_grammar_accept_stacks(
+        const llama_grammar_rules  & rules,
+        const llama_grammar_stacks & stacks,
+                          uint32_t   chr) {
     llama_grammar_stacks stacks_new;
-    stacks_new.reserve(grammar->stacks.size());
+    stacks_new.reserve(stacks.size());
 
-    for (const auto & stack : grammar->stacks) {
+    for (const auto & stack : stacks) {
         if (stack.empty()) {
             continue;
         }
@@ -841,11 +846,15 @@ void llama_grammar_accept(struct llama_grammar * grammar, uint32_t chr) {
             if (!llama_grammar_is_end_of_sequence(pos)) {
                 new_stack.push_back(pos);
             }
-            llama_grammar_advance_stack(grammar->rules, new_stack, stacks_new);
+            llama_grammar_advance_stack(rules, new_stack, stacks_new);
         }
     }
 
-    grammar->stacks = std::move(stacks_new);
+    return stacks_new;
+}
+
+void llama_grammar_accept(struct llama_grammar * grammar, uint32_t chr) {
+    grammar->stacks = llama_grammar_accept_stacks(*grammar->rules, grammar->stacks, chr);
 }
 
 llama_grammar_candidates llama_grammar_reject_candidates_for_stack(
@@ -962,7 +971,7 @@ struct llama_grammar * llama_grammar_init_impl(
     // then the pointers would be invalidated when the local vec_rules goes out of scope.
     return new llama_grammar {
         vocab,
-        std::move(vec_rules),
+        std::make_shared<const llama_grammar_rules>(std::move(vec_rules)),
         std::move(stacks),
         /* .partial_utf8 = */     {},
         /* .lazy =*/              false,
@@ -970,6 +979,7 @@ struct llama_grammar * llama_grammar_init_impl(
         /* .trigger_buffer = */   "",
         /* .trigger_tokens   = */ {},
         /* .trigger_patterns    = */ {},
+        /* .token_cache = */      {},
     };
 }
 
@@ -1067,7 +1077,7 @@ struct llama_grammar * llama_grammar_init_impl(
     // then the pointers would be invalidated when the local vec_rules goes out of scope.
     return new llama_grammar {
         vocab,
-        std::move(vec_rules),
+        std::make_shared<const llama_grammar_rules>(std::move(vec_rules)),
         std::move(stacks),
         /* .partial_utf8 = */     {},
         /* .lazy = */             lazy,
@@ -1075,6 +1085,7 @@ struct llama_grammar * llama_grammar_init_impl(
         /* .trigger_buffer = */   "",
         std::move(vec_trigger_tokens),
         std::move(vec_trigger_patterns),
+        /* .token_cache = */      {},
     };
 }
 
@@ -1087,7 +1098,8 @@ void llama_grammar_free_impl(struct llama_grammar * grammar) {
 }
 
 struct llama_grammar * llama_grammar_clone_impl(const struct llama_grammar & grammar) {
-    auto * result = new llama_grammar {
+    // the rules are shared, so the stacks and the cached states stay valid in the clone
+    return new llama_grammar {
         grammar.vocab,
         grammar.rules,
         grammar.stacks,
@@ -1097,22 +1109,49 @@ struct llama_grammar * llama_grammar_clone_impl(const struct llama_grammar & gra
         grammar.trigger_buffer,
         grammar.trigger_tokens,
         grammar.trigger_patterns,
+        grammar.token_cache,
     };
+}
 
-    // redirect elements in stacks to point to new rules
-    for (size_t is = 0; is < result->stacks.size(); is++) {
-        for (size_t ie = 0; ie < result->stacks[is].size(); ie++) {
-            for (size_t ir0 = 0; ir0 < grammar.rules.size(); ir0++) {
-                for (size_t ir1 = 0; ir1 < grammar.rules[ir0].size(); ir1++) {
-                    if (grammar.stacks[is][ie] == &grammar.rules[ir0][ir1]) {
-                        result->stacks[is][ie] =  &result->rules[ir0][ir1];
-                    }
-                }
-            }
-        }
+static size_t llama_grammar_cache_size() {
+    static const size_t size = [] {
+        const char * LLAMA_GRAMMAR_CACHE = getenv("LLAMA_GRAMMAR_CACHE");
+        return LLAMA_GRAMMAR_CACHE ? (size_t) std::max(0, atoi(LLAMA_GRAMMAR_CACHE)) : (size_t) 32;
+    }();
+
+    return size;
+}
+
+// the token verdicts of the current grammar state, or nullptr if the cache is disabled
+static std::vector<uint8_t> * llama_grammar_cache_get(const struct llama_grammar & grammar) {
+    const size_t size = llama_grammar_cache_size();
+    if (size == 0) {
+        return nullptr;
     }
 
-    return result;
+    // the stack elements point into the rules of this grammar and its clones, so their addresses identify the state
+    std::string key;
+    key.append((const char *) &grammar.partial_utf8.value,    sizeof(grammar.partial_utf8.value));
+    key.append((const char *) &grammar.partial_utf8.n_remain, sizeof(grammar.partial_utf8.n_remain));
+    for (const auto & stack : grammar.stacks) {
+        const size_t n = stack.size();
+        key.append((const char *) &n, sizeof(n));
+        key.append((const char *) stack.data(), n*sizeof(stack[0]));
+    }
+
+    auto it = grammar.token_cache.find(key);
+    if (it != grammar.token_cache.end()) {
+        return &it->second;
+    }
+
+    if (grammar.token_cache.size() >= size) {
+        grammar.token_cache.clear();
+    }
+
+    auto & verdicts = grammar.token_cache[key];
+    verdicts.resize(grammar.vocab->n_tokens(), 0);
+
+    return &verdicts;
 }
 
 void llama_grammar_apply_impl(const struct llama_grammar & grammar, llama_token_data_array * cur_p) {
@@ -1130,6 +1169,8 @@ void llama_grammar_apply_impl(const struct llama_grammar & grammar, llama_token_
         }
     }
 
+    std::vector<uint8_t> * verdicts = llama_grammar_cache_get(grammar);
+
     std::vector<std::pair<std::vector<uint32_t>, llama_partial_utf8>> candidates_decoded;
     candidates_decoded.reserve(cur_p->size);
 
@@ -1138,7 +1179,7 @@ void llama_grammar_apply_impl(const struct llama_grammar & grammar, llama_token_
 
     for (size_t i = 0; i < cur_p->size; ++i) {
         const llama_token id      = cur_p->data[i].id;
-        const std::string & piece = grammar.vocab->token_to_piece(id);
+        const std::string_view piece = grammar.vocab->token_to_piece(id);
 
         if (grammar.vocab->is_eog(id)) {
             if (!allow_eog) {
@@ -1146,22 +1187,83 @@ void llama_grammar_apply_impl(const struct llama_grammar & grammar, llama_token_
             }
         } else if (piece.empty() || piece[0] == 0) {
             cur_p->data[i].logit = -INFINITY;
+        } else if (verdicts && (*verdicts)[id] != 0) {
+            if ((*verdicts)[id] == 2) {
+                cur_p->data[i].logit = -INFINITY;
+            }
         } else {
             candidates_decoded.push_back(decode_utf8(piece, grammar.partial_utf8));
             candidates_grammar.push_back({ i, candidates_decoded.back().first.data(), candidates_decoded.back().second });
         }
     }
 
-    const auto rejects = llama_grammar_reject_candidates(grammar.rules, grammar.stacks, candidates_grammar);
+    const auto rejects = llama_grammar_reject_candidates(*grammar.rules, grammar.stacks, candidates_grammar);
+
+    if (verdicts) {
+        for (const auto & cand : candidates_grammar) {
+            (*verdicts)[cur_p->data[cand.index].id] = 1;
+        }
+        for (const auto & reject : rejects) {
+            (*verdicts)[cur_p->data[reject.index].id] = 2;
+        }
+    }
+
     for (const auto & reject : rejects) {
         cur_p->data[reject.index].logit = -INFINITY;
     }
 }
 
+void llama_grammar_prepare_impl(const struct llama_grammar & grammar) {
+    GGML_ASSERT(grammar.vocab != nullptr);
+
+    if (grammar.awaiting_trigger) {
+        return;
+    }
+
+    std::vector<uint8_t> * verdicts = llama_grammar_cache_get(grammar);
+    if (verdicts == nullptr) {
+        return;
+    }
+
+    const llama_token n_vocab = grammar.vocab->n_tokens();
+
+    std::vector<llama_token> ids;
+    std::vector<std::pair<std::vector<uint32_t>, llama_partial_utf8>> candidates_decoded;
+    candidates_decoded.reserve(n_vocab);
+
+    llama_grammar_candidates candidates_grammar;
+    candidates_grammar.reserve(n_vocab);
+
+    // same candidates as llama_grammar_apply_impl, which then only looks the verdicts up
+    for (llama_token id = 0; id < n_vocab; ++id) {
+        if ((*verdicts)[id] != 0 || grammar.vocab->is_eog(id)) {
+            continue;
+        }
+
+        const std::string_view piece = grammar.vocab->token_to_piece(id);
+        if (piece.empty() || piece[0] == 0) {
+            continue;
+        }
+
+        ids.push_back(id);
+        candidates_decoded.push_back(decode_utf8(piece, grammar.partial_utf8));
+        candidates_grammar.push_back({ ids.size() - 1, candidates_decoded.back().first.data(), candidates_decoded.back().second });
+    }
+
+    const auto rejects = llama_grammar_reject_candidates(*grammar.rules, grammar.stacks, candidates_grammar);
+
+    for (const llama_token id : ids) {
+        (*verdicts)[id] = 1;
+    }
+    for (const auto & reject : rejects) {
+        (*verdicts)[ids[reject.index]] = 2;
+    }
+}
+
 void llama_grammar_accept_impl(struct llama_grammar & grammar, llama_token token) {
     GGML_ASSERT(grammar.vocab != nullptr);
 
-    const auto & piece = grammar.vocab->token_to_piece(token);
+    const std::string piece(grammar.vocab->token_to_piece(token));
 
     if (grammar.awaiting_trigger) {
         if (std::find(grammar.trigger_tokens.begin(), grammar.trigger_tokens.end(), token) != grammar.trigger_tokens.end()) {
@@ -1213,6 +1315,50 @@ void llama_grammar_accept_impl(struct llama_grammar & grammar, llama_token token
     llama_grammar_accept_str(grammar, piece);
 }
 
+std::string llama_grammar_forced_str(const struct llama_grammar & grammar, size_t n_max) {
+    std::string result;
+
+    if (grammar.awaiting_trigger || grammar.partial_utf8.n_remain != 0) {
+        return result;
+    }
+
+    llama_grammar_stacks stacks = grammar.stacks;
+
+    while (!stacks.empty()) {
+        // the next char is forced when all the stacks expect the same single char
+        uint32_t chr = 0;
+
+        for (const auto & stack : stacks) {
+            if (stack.empty()) {
+                // the grammar can end here
+                return result;
+            }
+
+            const llama_grammar_element * pos = stack.back();
+
+            if (pos->type != LLAMA_GRETYPE_CHAR ||
+                pos[1].type == LLAMA_GRETYPE_CHAR_RNG_UPPER ||
+                pos[1].type == LLAMA_GRETYPE_CHAR_ALT ||
+                (chr != 0 && pos->value != chr)) {
+                return result;
+            }
+
+            chr = pos->value;
+        }
+
+        const std::string utf8 = unicode_cpt_to_utf8(chr);
+        if (result.size() + utf8.size() > n_max) {
+            break;
+        }
+
+        result += utf8;
+
+        stacks = llama_grammar_accept_stacks(*grammar.rules, stacks, chr);
+    }
+
+    return result;
+}
+
 void llama_grammar_accept_str(struct llama_grammar & grammar, const std::string & piece) {
     // Note terminating 0 in decoded string
     const auto   decoded     = decode_utf8(piece, grammar.partial_utf8);
@@ -3,8 +3,10 @@
 #include "llama.h"
 
 #include <map>
+#include <memory>
 #include <regex>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 struct llama_vocab;
@@ -115,8 +117,9 @@ struct llama_grammar {
     // note: allow null vocab for testing (not great)
     const llama_vocab * vocab;
 
-    const llama_grammar_rules  rules;  // TODO: shared ptr
-          llama_grammar_stacks stacks;
+    // the parsed rules are immutable and shared by the clones, so the stacks of a clone point into the same elements
+    std::shared_ptr<const llama_grammar_rules> rules;
+                          llama_grammar_stacks stacks;
 
     // buffer for partially generated UTF-8 sequence from accepted tokens
     llama_partial_utf8 partial_utf8;
@@ -132,6 +135,10 @@ struct llama_grammar {
                              trigger_patterns;         // Regular expressions that trigger a lazy grammar. Must be a full match of the entire generated
                                                        // string, and the grammar will be given the string from the first match group onwards.
 
+    // per-token verdicts of the grammar, cached for each visited state (stacks + partial_utf8)
+    // 0 - unknown, 1 - allowed, 2 - rejected
+    // the cache is cleared when it reaches LLAMA_GRAMMAR_CACHE states (default: 32, 0 - disabled)
+    mutable std::unordered_map<std::string, std::vector<uint8_t>> token_cache;
 };
 
 //
@@ -164,6 +171,11 @@ void llama_grammar_apply_impl(
         const struct llama_grammar & grammar,
             llama_token_data_array * cur_p);
 
+// compute the verdicts of the whole vocabulary for the current state, so that the next apply only looks them up
+// no-op when the verdict cache is disabled (LLAMA_GRAMMAR_CACHE=0)
+void llama_grammar_prepare_impl(
+        const struct llama_grammar & grammar);
+
 void llama_grammar_accept_impl(
               struct llama_grammar & grammar,
                        llama_token   token);
@@ -171,3 +183,8 @@ void llama_grammar_accept_impl(
 void llama_grammar_accept_str(
               struct llama_grammar & grammar,
                  const std::string & piece);
+
+// the text that every continuation allowed by the grammar starts with, up to n_max bytes
+std::string llama_grammar_forced_str(
+        const struct llama_grammar & grammar,
+                            size_t   n_max);
@@ -3,15 +3,19 @@
 #include "llama-impl.h"
 #include "llama-batch.h"
 #include "llama-cparams.h"
+#include "llama-mmap.h"
 
 #include "llama-kv-cache-unified.h"
 #include "llama-kv-cache-unified-iswa.h"
 #include "llama-memory-hybrid.h"
 #include "llama-memory-recurrent.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cinttypes>
 #include <cmath>
 #include <cstring>
+#include <limits>
 
 void llm_graph_input_embd::set_input(const llama_ubatch * ubatch) {
     if (ubatch->token) {
@@ -53,6 +57,14 @@ void llm_graph_input_pos::set_input(const llama_ubatch * ubatch) {
                 pos_data[3 * n_tokens + i] = 0; // 4th dim is 0
             }
             ggml_backend_tensor_set(pos, pos_data.data(), 0, pos_data.size()*ggml_element_size(pos));
+        } else if (mctx && mctx->get_has_pos_offset()) {
+            GGML_ASSERT(n_pos_per_embd == 1);
+
+            std::vector<llama_pos> pos_data(ubatch->pos, ubatch->pos + n_tokens);
+            for (int i = 0; i < n_tokens; ++i) {
+                pos_data[i] += mctx->get_pos_offset(ubatch->seq_id[i][0]);
+            }
+            ggml_backend_tensor_set(pos, pos_data.data(), 0, pos_data.size()*ggml_element_size(pos));
         } else {
             ggml_backend_tensor_set(pos, ubatch->pos, 0, n_tokens*n_pos_per_embd*ggml_element_size(pos));
         }
@@ -60,6 +72,8 @@ void llm_graph_input_pos::set_input(const llama_ubatch * ubatch) {
 }
 
 bool llm_graph_input_pos::can_reuse(const llm_graph_params & params) {
+    mctx = dynamic_cast<const llama_kv_cache_unified_context *>(params.mctx);
+
     bool res = true;
 
     res &= pos->ne[0] == params.ubatch.n_tokens;
@@ -143,6 +157,240 @@ bool llm_graph_input_out_ids::can_reuse(const llm_graph_params & params) {
     return res;
 }
 
+const float * llama_mtp_hidden::find(llama_seq_id seq_id, llama_pos pos, bool with_draft) const {
+    if (with_draft) {
+        const auto it = draft.find(seq_id);
+        if (it != draft.end()) {
+            const auto jt = it->second.find(pos);
+            if (jt != it->second.end()) {
+                return jt->second.data();
+            }
+        }
+    }
+
+    const auto it = main.find(seq_id);
+    if (it != main.end()) {
+        const auto jt = it->second.find(pos);
+        if (jt != it->second.end()) {
+            return jt->second.data();
+        }
+    }
+
+    return nullptr;
+}
+
+void llama_mtp_hidden::rows(const llama_ubatch & ubatch, uint32_t n_outputs, std::vector<int32_t> & ids) {
+    ids.clear();
+
+    for (uint32_t i = 0; i < ubatch.n_tokens; ++i) {
+        if (n_outputs == ubatch.n_tokens || ubatch.output[i]) {
+            ids.push_back(i);
+        }
+    }
+
+    for (uint32_t s = 0; s < ubatch.n_seqs_unq; ++s) {
+        const llama_seq_id seq_id = ubatch.seq_id_unq[s];
+
+        int32_t last = -1;
+        for (uint32_t i = 0; i < ubatch.n_tokens; ++i) {
+            for (int32_t k = 0; k < ubatch.n_seq_id[i]; ++k) {
+                if (ubatch.seq_id[i][k] == seq_id && (last < 0 || ubatch.pos[i] > ubatch.pos[last])) {
+                    last = i;
+                }
+            }
+        }
+
+        ids.push_back(last);
+    }
+}
+
+void llama_mtp_hidden::save(const llama_ubatch & ubatch, const std::vector<int32_t> & ids, const float * data, bool is_draft) {
+    if (!is_draft) {
+        // the drafts are superseded by the decode, and the hidden states before the ubatch are not needed anymore
+        for (uint32_t s = 0; s < ubatch.n_seqs_unq; ++s) {
+            const llama_seq_id seq_id = ubatch.seq_id_unq[s];
+
+            llama_pos pos_min = std::numeric_limits<llama_pos>::max();
+            for (uint32_t i = 0; i < ubatch.n_tokens; ++i) {
+                if (ubatch.seq_id[i][0] == seq_id) {
+                    pos_min = std::min(pos_min, ubatch.pos[i]);
+                }
+            }
+
+            draft.erase(seq_id);
+
+            auto & hs = main[seq_id];
+            hs.erase(hs.begin(), hs.lower_bound(pos_min - 1));
+        }
+    }
+
+    auto & dst = is_draft ? draft : main;
+
+    for (size_t k = 0; k < ids.size(); ++k) {
+        const int32_t i = ids[k];
+
+        for (int32_t s = 0; s < ubatch.n_seq_id[i]; ++s) {
+            dst[ubatch.seq_id[i][s]][ubatch.pos[i]].assign(data + k*n_embd, data + (k + 1)*n_embd);
+        }
+    }
+}
+
+void llm_graph_input_mtp::set_input(const llama_ubatch * ubatch) {
+    const int64_t n_tokens = ubatch->n_tokens;
+    const int64_t n_embd   = carry->ne[0];
+
+    // the missing hidden states are zero, e.g. at the start of a sequence
+    std::vector<float> carry_data(ggml_nelements(carry), 0.0f);
+
+    if (draft) {
+        for (int64_t i = 0; i < n_tokens; ++i) {
+            const float * h = mtp->find(ubatch->seq_id[i][0], ubatch->pos[i] - 1, true);
+            if (h) {
+                std::copy(h, h + n_embd, carry_data.begin() + i*n_embd);
+            }
+        }
+
+        ggml_backend_tensor_set(carry, carry_data.data(), 0, ggml_nbytes(carry));
+
+        return;
+    }
+
+    std::map<std::pair<llama_seq_id, llama_pos>, int32_t> idx;
+    for (int64_t i = 0; i < n_tokens; ++i) {
+        for (int32_t s = 0; s < ubatch->n_seq_id[i]; ++s) {
+            idx[{ ubatch->seq_id[i][s], ubatch->pos[i] }] = i;
+        }
+    }
+
+    // the previous positions which are not in the ubatch are before the first token of each sequence
+    std::vector<int32_t> prev_data(n_tokens);
+    for (int64_t i = 0; i < n_tokens; ++i) {
+        const llama_seq_id seq_id = ubatch->seq_id[i][0];
+
+        const auto it = idx.find({ seq_id, ubatch->pos[i] - 1 });
+
+        prev_data[i] = it != idx.end() ? it->second : n_tokens + ubatch->seq_idx[seq_id];
+    }
+
+    for (uint32_t s = 0; s < ubatch->n_seqs_unq; ++s) {
+        const llama_seq_id seq_id = ubatch->seq_id_unq[s];
+
+        llama_pos pos_min = std::numeric_limits<llama_pos>::max();
+        for (int64_t i = 0; i < n_tokens; ++i) {
+            if (ubatch->seq_id[i][0] == seq_id) {
+                pos_min = std::min(pos_min, ubatch->pos[i]);
+            }
+        }
+
+        const float * h = mtp->find(seq_id, pos_min - 1, false);
+        if (h) {
+            std::copy(h, h + n_embd, carry_data.begin() + s*n_embd);
+        }
+    }
+
+    std::vector<int32_t> save_data;
+    llama_mtp_hidden::rows(*ubatch, n_outputs, save_data);
+
+    GGML_ASSERT((int64_t) save_data.size() == ggml_nelements(save_ids));
+
+    ggml_backend_tensor_set(prev_ids, prev_data.data(), 0, ggml_nbytes(prev_ids));
+    ggml_backend_tensor_set(carry,    carry_data.data(), 0, ggml_nbytes(carry));
+    ggml_backend_tensor_set(save_ids, save_data.data(), 0, ggml_nbytes(save_ids));
+}
+
+bool llm_graph_input_mtp::can_reuse(const llm_graph_params & params) {
+    bool res = true;
+
+    res &= draft     == params.cparams.mtp_draft;
+    res &= n_outputs == params.n_outputs;
+
+    return res;
+}
+
+void llm_graph_input_lora::resolve(
+        const llama_ubatch & ubatch,
+        const llama_adapter_loras & loras,
+        const llama_adapter_loras_seq & loras_seq,
+        std::vector<std::pair<llama_adapter_lora *, float>> & adapters,
+        bool & per_token) {
+    adapters.clear();
+    per_token = false;
+
+    // the adapters of each sequence of the ubatch
+    std::vector<const llama_adapter_loras *> cfgs;
+    for (uint32_t s = 0; s < ubatch.n_seqs_unq; ++s) {
+        const auto it = loras_seq.find(ubatch.seq_id_unq[s]);
+        cfgs.push_back(it != loras_seq.end() ? &it->second : &loras);
+    }
+    if (cfgs.empty()) {
+        cfgs.push_back(&loras);
+    }
+
+    for (const auto * cfg : cfgs) {
+        per_token = per_token || *cfg != *cfgs[0];
+    }
+
+    for (const auto * cfg : per_token ? cfgs : std::vector<const llama_adapter_loras *>{ cfgs[0] }) {
+        for (const auto & it : *cfg) {
+            adapters.emplace_back(it.first, per_token ? 0.0f : it.second);
+        }
+    }
+
+    std::sort(adapters.begin(), adapters.end());
+    adapters.erase(std::unique(adapters.begin(), adapters.end()), adapters.end());
+}
+
+void llm_graph_input_lora::set_input(const llama_ubatch * ubatch) {
+    if (!per_token) {
+        return;
+    }
+
+    const int64_t n_tokens = ubatch->n_tokens;
+
+    std::vector<float> data(n_tokens);
+    std::vector<float> data_out;
+
+    for (size_t i = 0; i < adapters.size(); ++i) {
+        llama_adapter_lora * adapter = adapters[i].first;
+
+        // a token that belongs to several sequences uses the adapters of the first one
+        for (int64_t j = 0; j < n_tokens; ++j) {
+            const auto it = loras_seq->find(ubatch->seq_id[j][0]);
+            const llama_adapter_loras & cfg = it != loras_seq->end() ? it->second : *loras;
+
+            const auto it_adapter = cfg.find(adapter);
+            data[j] = it_adapter != cfg.end() ? it_adapter->second : 0.0f;
+        }
+
+        if (scale[i]->buffer) {
+            ggml_backend_tensor_set(scale[i], data.data(), 0, n_tokens*ggml_element_size(scale[i]));
+        }
+
+        if (scale_out[i] && scale_out[i]->buffer) {
+            const int64_t n_outputs = scale_out[i]->ne[1];
+
+            data_out.clear();
+            for (int64_t j = 0; j < n_tokens; ++j) {
+                if (n_outputs == n_tokens || (ubatch->output && ubatch->output[j])) {
+                    data_out.push_back(data[j]);
+                }
+            }
+            GGML_ASSERT((int64_t) data_out.size() == n_outputs);
+
+            ggml_backend_tensor_set(scale_out[i], data_out.data(), 0, n_outputs*ggml_element_size(scale_out[i]));
+        }
+    }
+}
+
+bool llm_graph_input_lora::can_reuse(const llm_graph_params & params) {
+    std::vector<std::pair<llama_adapter_lora *, float>> adapters_new;
+    bool per_token_new;
+
+    resolve(params.ubatch, *params.loras, *params.loras_seq, adapters_new, per_token_new);
+
+    return adapters_new == adapters && per_token_new == per_token;
+}
+
 void llm_graph_input_mean::set_input(const llama_ubatch * ubatch) {
     if (cparams.embeddings && cparams.pooling_type == LLAMA_POOLING_TYPE_MEAN) {
         const int64_t n_tokens     = ubatch->n_tokens;
@@ -204,7 +452,9 @@ void llm_graph_input_cls::set_input(const llama_ubatch * ubatch) {
         std::vector<int> target_pos(n_seqs_unq, -1);
         std::vector<int> target_row(n_seqs_unq, -1);
 
-        bool last = cparams.pooling_type == LLAMA_POOLING_TYPE_LAST;
+        // a classifier on top of a causal model sees the whole sequence only at the last token
+        bool last = cparams.pooling_type == LLAMA_POOLING_TYPE_LAST ||
+                   (cparams.pooling_type == LLAMA_POOLING_TYPE_RANK && cparams.causal_attn);
 
         for (int i = 0; i < n_tokens; ++i) {
             const llama_pos pos = ubatch->pos[i];
@@ -267,6 +517,9 @@ void llm_graph_input_attn_no_cache::set_input(const llama_ubatch * ubatch) {
 
     float * data = (float *) kq_mask->data;
 
+    // the tokens of a packed ubatch attend only to the tokens of their sequence, the padded rows are fully masked
+    std::fill(data, data + ggml_nelements(kq_mask), -INFINITY);
+
     for (int h = 0; h < 1; ++h) {
         for (int i1 = 0; i1 < n_tokens; ++i1) {
             const llama_seq_id s1 = ubatch->seq_id[i1][0];
@@ -275,7 +528,7 @@ void llm_graph_input_attn_no_cache::set_input(const llama_ubatch * ubatch) {
                 float f = -INFINITY;
 
                 for (int s = 0; s < ubatch->n_seq_id[i0]; ++s) {
-                    const llama_seq_id s0 = ubatch->seq_id[i0][0];
+                    const llama_seq_id s0 = ubatch->seq_id[i0][s];
 
                     // TODO: reimplement this like in llama_kv_cache_unified
                     if (s0 == s1 && (!cparams.causal_attn || ubatch->pos[i0] <= ubatch->pos[i1])) {
@@ -298,7 +551,11 @@ void llm_graph_input_attn_kv_unified::set_input(const llama_ubatch * ubatch) {
     mctx->set_input_k_idxs(self_k_idxs, ubatch);
     mctx->set_input_v_idxs(self_v_idxs, ubatch);
 
-    mctx->set_input_kq_mask(self_kq_mask, ubatch, cparams.causal_attn);
+    if (self_kq_mask_inp.pos_cells) {
+        mctx->set_input_kq_mask_inputs(self_kq_mask_inp, ubatch);
+    } else {
+        mctx->set_input_kq_mask(self_kq_mask, ubatch, cparams.causal_attn);
+    }
 }
 
 bool llm_graph_input_attn_kv_unified::can_reuse(const llm_graph_params & params) {
@@ -314,6 +571,14 @@ bool llm_graph_input_attn_kv_unified::can_reuse(const llm_graph_params & params)
     res &= self_kq_mask->ne[0] == mctx->get_n_kv();
     res &= self_kq_mask->ne[1] == GGML_PAD(params.ubatch.n_tokens, GGML_KQ_MASK_PAD);
 
+    res &= n_resize == mctx->get_n_resize();
+
+    if (self_kq_mask_inp.seq_toks) {
+        // the causality and the number of sequences per stream are part of the graph
+        res &= cparams.causal_attn == params.cparams.causal_attn;
+        res &= self_kq_mask_inp.seq_toks->ne[0] == std::max<int64_t>(1, params.ubatch.n_seqs_unq/self_kq_mask->ne[3]);
+    }
+
     res &= mctx->get_supports_set_rows(); // TODO: tmp
 
     return res;
@@ -323,12 +588,20 @@ void llm_graph_input_attn_kv_unified_iswa::set_input(const llama_ubatch * ubatch
     mctx->get_base()->set_input_k_idxs(self_k_idxs, ubatch);
     mctx->get_base()->set_input_v_idxs(self_v_idxs, ubatch);
 
-    mctx->get_base()->set_input_kq_mask(self_kq_mask, ubatch, cparams.causal_attn);
+    if (self_kq_mask_inp.pos_cells) {
+        mctx->get_base()->set_input_kq_mask_inputs(self_kq_mask_inp, ubatch);
+    } else {
+        mctx->get_base()->set_input_kq_mask(self_kq_mask, ubatch, cparams.causal_attn);
+    }
 
     mctx->get_swa()->set_input_k_idxs(self_k_idxs_swa, ubatch);
     mctx->get_swa()->set_input_v_idxs(self_v_idxs_swa, ubatch);
 
-    mctx->get_swa()->set_input_kq_mask(self_kq_mask_swa, ubatch, cparams.causal_attn);
+    if (self_kq_mask_swa_inp.pos_cells) {
+        mctx->get_swa()->set_input_kq_mask_inputs(self_kq_mask_swa_inp, ubatch);
+    } else {
+        mctx->get_swa()->set_input_kq_mask(self_kq_mask_swa, ubatch, cparams.causal_attn);
+    }
 }
 
 bool llm_graph_input_attn_kv_unified_iswa::can_reuse(const llm_graph_params & params) {
@@ -350,6 +623,17 @@ bool llm_graph_input_attn_kv_unified_iswa::can_reuse(const llm_graph_params & pa
     res &= self_kq_mask_swa->ne[0] == mctx->get_swa()->get_n_kv();
     res &= self_kq_mask_swa->ne[1] == GGML_PAD(params.ubatch.n_tokens, GGML_KQ_MASK_PAD);
 
+    res &= n_resize     == mctx->get_base()->get_n_resize();
+    res &= n_resize_swa == mctx->get_swa()->get_n_resize();
+
+    if (self_kq_mask_inp.seq_toks || self_kq_mask_swa_inp.seq_toks) {
+        const int64_t n_seq = std::max<int64_t>(1, params.ubatch.n_seqs_unq/self_kq_mask->ne[3]);
+
+        res &= cparams.causal_attn == params.cparams.causal_attn;
+        res &= !self_kq_mask_inp.seq_toks     || self_kq_mask_inp.seq_toks->ne[0]     == n_seq;
+        res &= !self_kq_mask_swa_inp.seq_toks || self_kq_mask_swa_inp.seq_toks->ne[0] == n_seq;
+    }
+
     res &= mctx->get_base()->get_supports_set_rows(); // TODO: tmp
 
     return res;
@@ -417,6 +701,20 @@ void llm_graph_result::reset() {
     t_embd        = nullptr;
     t_embd_pooled = nullptr;
 
+    t_logits_top_k     = nullptr;
+    t_logits_top_k_ids = nullptr;
+    t_logits_half      = nullptr;
+
+    logits_short = false;
+
+    t_kv_score = nullptr;
+
+    t_mtp_hidden = nullptr;
+
+    t_expert_ids.clear();
+
+    node_backends.clear();
+
     params = {};
 
     inputs.clear();
@@ -481,6 +779,46 @@ void llm_graph_result::set_params(const llm_graph_params & params) {
     this->params = params;
 }
 
+void llm_graph_result::save_sched(ggml_backend_sched_t sched) {
+    const int n_nodes = ggml_graph_n_nodes(gf);
+
+    node_backends.resize(n_nodes);
+    for (int i = 0; i < n_nodes; ++i) {
+        node_backends[i] = ggml_backend_sched_get_tensor_backend(sched, ggml_graph_node(gf, i));
+    }
+}
+
+void llm_graph_result::restore_sched(ggml_backend_sched_t sched) {
+    // the tensors in the compute buffers are allocated again by the scheduler, the others (weights, KV cache) are kept
+    auto release = [](ggml_tensor * t) {
+        if (t->buffer && ggml_backend_buffer_get_usage(t->buffer) == GGML_BACKEND_BUFFER_USAGE_COMPUTE) {
+            t->buffer = nullptr;
+            t->data   = nullptr;
+        }
+    };
+
+    const int n_nodes = ggml_graph_n_nodes(gf);
+
+    for (int i = 0; i < n_nodes; ++i) {
+        ggml_tensor * node = ggml_graph_node(gf, i);
+
+        release(node);
+        for (int j = 0; j < GGML_MAX_SRC; ++j) {
+            if (node->src[j]) {
+                release(node->src[j]);
+            }
+        }
+    }
+
+    // nodes pinned to a backend during the build (e.g. by the graph callback) are pinned again
+    GGML_ASSERT((int) node_backends.size() == n_nodes);
+    for (int i = 0; i < n_nodes; ++i) {
+        if (node_backends[i]) {
+            ggml_backend_sched_set_tensor_backend(sched, ggml_graph_node(gf, i), node_backends[i]);
+        }
+    }
+}
+
 //
 // llm_graph_context
 //
@@ -491,7 +829,7 @@ llm_graph_context::llm_graph_context(const llm_graph_params & params) :
     cparams          (params.cparams),
     ubatch           (params.ubatch),
     n_embd           (hparams.n_embd),
-    n_layer          (hparams.n_layer),
+    n_layer          (cparams.n_layer_exit > 0 ? cparams.n_layer_exit : hparams.n_layer),
     n_rot            (hparams.n_rot),
     n_ctx            (cparams.n_ctx),
     n_head           (hparams.n_head()),
@@ -521,11 +859,33 @@ llm_graph_context::llm_graph_context(const llm_graph_params & params) :
     loras            (params.loras),
     mctx             (params.mctx),
     cross            (params.cross),
+    vshort           (params.vshort && params.vshort->output ? params.vshort : nullptr),
+    mtp              (params.mtp),
     cb_func          (params.cb),
     res              (params.res),
     ctx0             (res->get_ctx()),
     gf               (res->get_gf()) {
         res->set_params(params);
+
+        // the adapters are part of the topology of the graph - the input checks that they have not changed
+        auto inp = std::make_unique<llm_graph_input_lora>(params.loras, params.loras_seq);
+
+        llm_graph_input_lora::resolve(ubatch, *params.loras, *params.loras_seq, inp->adapters, inp->per_token);
+
+        if (inp->per_token) {
+            for (size_t i = 0; i < inp->adapters.size(); ++i) {
+                inp->scale.push_back(ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, 1, n_tokens));
+                ggml_set_input(inp->scale.back());
+
+                inp->scale_out.push_back(nullptr);
+                if (n_outputs > 0) {
+                    inp->scale_out.back() = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, 1, n_outputs);
+                    ggml_set_input(inp->scale_out.back());
+                }
+            }
+        }
+
+        inp_lora = static_cast<llm_graph_input_lora *>(res->add_input(std::move(inp)));
     }
 
 void llm_graph_context::cb(ggml_tensor * cur, const char * name, int il) const {
@@ -540,26 +900,75 @@ ggml_tensor * llm_graph_context::build_cvec(
     return cvec->apply_to(ctx0, cur, il);
 }
 
+ggml_tensor * llm_graph_context::build_lora_scale(
+          ggml_tensor * cur,
+                  int   i,
+                float   scale) const {
+    if (!inp_lora->per_token) {
+        return ggml_scale(ctx0, cur, scale);
+    }
+
+    cur = ggml_scale(ctx0, cur, scale);
+
+    // the per-token scales broadcast over the rows of the tokens or of the outputs
+    ggml_tensor * s = nullptr;
+    for (ggml_tensor * cand : { inp_lora->scale[i], inp_lora->scale_out[i] }) {
+        if (cand == nullptr) {
+            continue;
+        }
+        if (cur->ne[1]*cur->ne[2]*cur->ne[3] == cand->ne[1]) {
+            s = ggml_reshape_4d(ctx0, cand, 1, cur->ne[1], cur->ne[2], cur->ne[3]);
+            break;
+        }
+        if (cur->ne[2]*cur->ne[3] == cand->ne[1]) {
+            s = ggml_reshape_4d(ctx0, cand, 1, 1, cur->ne[2], cur->ne[3]);
+            break;
+        }
+    }
+
+    if (s == nullptr) {
+        GGML_ABORT("%s: cannot apply per-sequence LoRA adapters to a tensor of shape [%" PRId64 ", %" PRId64 ", %" PRId64 ", %" PRId64 "]\n",
+                __func__, cur->ne[0], cur->ne[1], cur->ne[2], cur->ne[3]);
+    }
+
+    return ggml_mul(ctx0, cur, s);
+}
+
 ggml_tensor * llm_graph_context::build_lora_mm(
           ggml_tensor * w,
           ggml_tensor * cur) const {
-    ggml_tensor * res = ggml_mul_mat(ctx0, w, cur);
+    // the output projection of a subset of the vocabulary
+    if (vshort && w == vshort->output_full) {
+        w = vshort->output;
+
+        this->res->logits_short = true;
+    }
+
+    // mixed precision training: the F32 trainable weights are cast for the multiplication, their gradients stay F32
+    const auto cast_param = [this](ggml_tensor * t) {
+        return cparams.type_opt != GGML_TYPE_F32 && (t->flags & GGML_TENSOR_FLAG_PARAM) && t->type == GGML_TYPE_F32 ?
+            ggml_cast(ctx0, t, cparams.type_opt) : t;
+    };
+
+    ggml_tensor * res = ggml_mul_mat(ctx0, cast_param(w), cur);
+
+    for (size_t i = 0; i < inp_lora->adapters.size(); ++i) {
+        const auto & lora = inp_lora->adapters[i];
 
-    for (const auto & lora : *loras) {
         llama_adapter_lora_weight * lw = lora.first->get_weight(w);
         if (lw == nullptr) {
             continue;
         }
 
-        const float adapter_scale = lora.second;
+        const float adapter_scale = inp_lora->per_token ? 1.0f : lora.second;
         const float scale = lw->get_scale(lora.first->alpha, adapter_scale);
 
         ggml_tensor * ab_cur = ggml_mul_mat(
-                ctx0, lw->b,
-                ggml_mul_mat(ctx0, lw->a, cur)
+                ctx0, cast_param(lw->b),
+                ggml_mul_mat(ctx0, cast_param(lw->a), cur)
                 );
 
-        ab_cur = ggml_scale(ctx0, ab_cur, scale);
+        ab_cur = build_lora_scale(ab_cur, i, scale);
         res = ggml_add(ctx0, res, ab_cur);
     }
 
@@ -571,15 +980,19 @@ ggml_tensor * llm_graph_context::build_lora_mm_id(
           ggml_tensor * cur, // ggml_tensor * b
           ggml_tensor * ids) const {
     ggml_tensor * res = ggml_mul_mat_id(ctx0, w, cur, ids);
-    for (const auto & lora : *loras) {
+    for (size_t i = 0; i < inp_lora->adapters.size(); ++i) {
+        const auto & lora = inp_lora->adapters[i];
+
         llama_adapter_lora_weight * lw = lora.first->get_weight(w);
         if (lw == nullptr) {
             continue;
         }
 
+        const float adapter_scale = inp_lora->per_token ? 1.0f : lora.second;
+
         const float alpha = lora.first->alpha;
         const float rank  = (float) lw->b->ne[0];
-        const float scale = alpha ? lora.second * alpha / rank : lora.second;
+        const float scale = alpha ? adapter_scale * alpha / rank : adapter_scale;
 
         ggml_tensor * ab_cur = ggml_mul_mat_id(
                 ctx0, lw->b,
@@ -587,7 +1000,7 @@ ggml_tensor * llm_graph_context::build_lora_mm_id(
                 ids
                 );
 
-        ab_cur = ggml_scale(ctx0, ab_cur, scale);
+        ab_cur = build_lora_scale(ab_cur, i, scale);
         res = ggml_add(ctx0, res, ab_cur);
     }
 
@@ -773,6 +1186,128 @@ ggml_tensor * llm_graph_context::build_ffn(
     return cur;
 }
 
+bool llm_graph_context::can_ffn_sparse(const ggml_tensor * pred_a, const ggml_tensor * up) const {
+    return pred_a && cparams.ffn_sparse && inp_lora->adapters.empty() && !(up->flags & GGML_TENSOR_FLAG_PARAM) &&
+        up->buffer && ggml_backend_buffer_is_host(up->buffer);
+}
+
+ggml_tensor * llm_graph_context::build_ffn_sparse(
+         ggml_tensor * cur,
+         ggml_tensor * up,
+         ggml_tensor * gate,
+         ggml_tensor * down,
+         ggml_tensor * pred_a,
+         ggml_tensor * pred_b,
+     llm_ffn_op_type   type_op,
+                 int   il) const {
+    const int64_t n_embd   = cur->ne[0];
+    const int64_t n_tokens = cur->ne[1];
+
+    const int64_t n_group  = hparams.ffn_sparse_group;
+    const int64_t n_hot    = hparams.ffn_sparse_n_hot*n_group; // neurons
+    const int64_t n_cold   = pred_b->ne[1];                    // groups
+    const int64_t n_active = hparams.ffn_sparse_n_active;      // groups
+
+    // score the cold groups and select the most likely to be active
+    ggml_tensor * scores = ggml_mul_mat(ctx0, pred_a, cur);
+    scores = ggml_relu(ctx0, scores);
+    scores = ggml_mul_mat(ctx0, pred_b, scores); // [n_cold, n_tokens]
+    cb(scores, "ffn_pred", il);
+
+    ggml_tensor * selected = ggml_top_k(ctx0, scores, n_active); // [n_active, n_tokens]
+    cb(selected, "ffn_pred_topk", il);
+
+    // the cold groups as experts: rows of up/gate, columns of down
+    ggml_tensor * up_g   = ggml_view_3d(ctx0, up,   n_embd,  n_group, n_cold,   up->nb[1], n_group*up->nb[1],   n_hot*up->nb[1]);
+    ggml_tensor * gate_g = ggml_view_3d(ctx0, gate, n_embd,  n_group, n_cold, gate->nb[1], n_group*gate->nb[1], n_hot*gate->nb[1]);
+    ggml_tensor * down_g = ggml_view_3d(ctx0, down, n_group, n_embd,  n_cold, down->nb[1],
+            ggml_row_size(down->type, n_group), ggml_row_size(down->type, n_hot));
+
+    ggml_tensor * x = ggml_reshape_3d(ctx0, cur, n_embd, 1, n_tokens);
+
+    ggml_tensor * tmp = ggml_mul_mat_id(ctx0, up_g, x, selected); // [n_group, n_active, n_tokens]
+    cb(tmp, "ffn_up_sparse", il);
+
+    ggml_tensor * act = ggml_mul_mat_id(ctx0, gate_g, x, selected); // [n_group, n_active, n_tokens]
+    cb(act, "ffn_gate_sparse", il);
+
+    switch (type_op) {
+        case LLM_FFN_SILU: act = ggml_swiglu_split(ctx0, act, tmp); break;
+        case LLM_FFN_GELU: act = ggml_geglu_split (ctx0, act, tmp); break;
+        case LLM_FFN_RELU: act = ggml_reglu_split (ctx0, act, tmp); break;
+        default:
+            GGML_ABORT("fatal error");
+    }
+    cb(act, "ffn_act_sparse", il);
+
+    ggml_tensor * out = ggml_mul_mat_id(ctx0, down_g, act, selected); // [n_embd, n_active, n_tokens]
+    cb(out, "ffn_down_sparse", il);
+
+    // sum the groups
+    out = ggml_cont(ctx0, ggml_permute(ctx0, out, 1, 0, 2, 3)); // [n_active, n_embd, n_tokens]
+    out = ggml_sum_rows(ctx0, out);
+    out = ggml_reshape_2d(ctx0, out, n_embd, n_tokens);
+
+    if (n_hot > 0) {
+        ggml_tensor * hot = build_ffn(cur,
+                ggml_view_2d(ctx0, up,   n_embd, n_hot,    up->nb[1], 0), NULL, NULL,
+                ggml_view_2d(ctx0, gate, n_embd, n_hot,  gate->nb[1], 0), NULL, NULL,
+                ggml_view_2d(ctx0, down, n_hot,  n_embd, down->nb[1], 0), NULL, NULL,
+                NULL,
+                type_op, LLM_FFN_PAR, il);
+
+        out = ggml_add(ctx0, out, hot);
+    }
+
+    return out;
+}
+
+// LLAMA_MOE_PREFETCH=1 : read ahead the pages of the selected experts of the host-resident (mmap) weights
+static bool llm_graph_moe_prefetch() {
+    static const bool enabled = []() {
+        const char * LLAMA_MOE_PREFETCH = getenv("LLAMA_MOE_PREFETCH");
+        return LLAMA_MOE_PREFETCH ? atoi(LLAMA_MOE_PREFETCH) != 0 : false;
+    }();
+
+    return enabled;
+}
+
+// src[0] - the selected experts [n_expert_used, n_tokens]
+// src[1..] - the expert weights [*, *, n_expert]
+static void llm_graph_moe_prefetch_op(ggml_tensor * dst, int ith, int nth, void * userdata) {
+    GGML_UNUSED(nth);
+    GGML_UNUSED(userdata);
+
+    if (ith != 0) {
+        return;
+    }
+
+    const ggml_tensor * ids = dst->src[0];
+
+    const int64_t n_expert = dst->src[1]->ne[2];
+
+    std::vector<bool> used(n_expert, false);
+
+    for (int64_t i1 = 0; i1 < ids->ne[1]; ++i1) {
+        for (int64_t i0 = 0; i0 < ids->ne[0]; ++i0) {
+            const int32_t id = *(const int32_t *) ((const char *) ids->data + i1*ids->nb[1] + i0*ids->nb[0]);
+            if (id >= 0 && id < n_expert) {
+                used[id] = true;
+            }
+        }
+    }
+
+    for (int i = 1; i < GGML_MAX_SRC && dst->src[i]; ++i) {
+        const ggml_tensor * w = dst->src[i];
+
+        for (int64_t e = 0; e < n_expert; ++e) {
+            if (used[e]) {
+                llama_mmap::prefetch((const char *) w->data + e*w->nb[2], w->nb[2]);
+            }
+        }
+    }
+}
+
 ggml_tensor * llm_graph_context::build_moe_ffn(
          ggml_tensor * cur,
          ggml_tensor * gate_inp,
@@ -884,6 +1419,21 @@ ggml_tensor * llm_graph_context::build_moe_ffn(
     cb(selected_experts->src[0], "ffn_moe_argsort", il);
     cb(selected_experts, "ffn_moe_topk", il);
 
+    if (cparams.expert_stats) {
+        ggml_set_output(selected_experts->view_src);
+        res->t_expert_ids.emplace_back(il, selected_experts);
+    }
+
+    // prefetch the selected experts, before they are used by the matrix multiplications below
+    if (llm_graph_moe_prefetch() && up_exps->buffer && ggml_backend_buffer_is_host(up_exps->buffer)) {
+        ggml_tensor * args[] = { selected_experts, up_exps, down_exps, gate_exps };
+
+        ggml_tensor * prefetch = ggml_custom_4d(ctx0, GGML_TYPE_I32, 1, 1, 1, 1, args, gate_exps ? 4 : 3, llm_graph_moe_prefetch_op, 1, nullptr);
+        cb(prefetch, "ffn_moe_prefetch", il);
+
+        ggml_build_forward_expand(gf, prefetch);
+    }
+
     ggml_tensor * weights = ggml_get_rows(ctx0,
             ggml_reshape_3d(ctx0, probs, 1, n_expert, n_tokens), selected_experts); // [1, n_expert_used, n_tokens]
     cb(weights, "ffn_moe_weights", il);
@@ -1039,19 +1589,21 @@ ggml_tensor * llm_graph_context::build_inp_embd(ggml_tensor * tok_embd) const {
         cur = ggml_get_rows(ctx0, tok_embd, inp->tokens);
 
         // apply lora for embedding tokens if needed
-        for (const auto & lora : *loras) {
+        for (size_t i = 0; i < inp_lora->adapters.size(); ++i) {
+            const auto & lora = inp_lora->adapters[i];
+
             llama_adapter_lora_weight * lw = lora.first->get_weight(tok_embd);
             if (lw == nullptr) {
                 continue;
             }
 
-            const float adapter_scale = lora.second;
+            const float adapter_scale = inp_lora->per_token ? 1.0f : lora.second;
             const float scale = lw->get_scale(lora.first->alpha, adapter_scale);
 
-            ggml_tensor * inpL_delta = ggml_scale(ctx0, ggml_mul_mat(
+            ggml_tensor * inpL_delta = build_lora_scale(ggml_mul_mat(
                         ctx0, lw->b, // non-transposed lora_b
                         ggml_get_rows(ctx0, lw->a, inp->tokens)
-                        ), scale);
+                        ), i, scale);
 
             cur = ggml_add(ctx0, cur, inpL_delta);
         }
@@ -1075,7 +1627,7 @@ ggml_tensor * llm_graph_context::build_inp_embd(ggml_tensor * tok_embd) const {
 }
 
 ggml_tensor * llm_graph_context::build_inp_pos() const {
-    auto inp = std::make_unique<llm_graph_input_pos>(hparams.n_pos_per_embd());
+    auto inp = std::make_unique<llm_graph_input_pos>(hparams.n_pos_per_embd(), dynamic_cast<const llama_kv_cache_unified_context *>(mctx));
 
     auto & cur = inp->pos;
 
@@ -1122,6 +1674,28 @@ ggml_tensor * llm_graph_context::build_inp_out_ids() const {
     return cur;
 }
 
+llm_graph_input_mtp * llm_graph_context::build_inp_mtp() const {
+    GGML_ASSERT(mtp && "the MTP layers are not loaded");
+
+    auto inp = std::make_unique<llm_graph_input_mtp>(mtp, cparams.mtp_draft, n_outputs);
+
+    if (cparams.mtp_draft) {
+        inp->carry = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, n_tokens);
+        ggml_set_input(inp->carry);
+    } else {
+        inp->prev_ids = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
+        ggml_set_input(inp->prev_ids);
+
+        inp->carry = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, ubatch.n_seqs_unq);
+        ggml_set_input(inp->carry);
+
+        inp->save_ids = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_outputs + ubatch.n_seqs_unq);
+        ggml_set_input(inp->save_ids);
+    }
+
+    return (llm_graph_input_mtp *) res->add_input(std::move(inp));
+}
+
 ggml_tensor * llm_graph_context::build_inp_mean() const {
     auto inp = std::make_unique<llm_graph_input_mean>(cparams);
 
@@ -1225,7 +1799,8 @@ ggml_tensor * llm_graph_context::build_attn_mha(
          ggml_tensor * kq_mask,
          ggml_tensor * v_mla,
          ggml_tensor * sinks,
-             float     kq_scale) const {
+             float     kq_scale,
+              bool     kv_score) const {
     const bool v_trans = v->nb[1] > v->nb[2];
 
     // split the batch into streams if needed
@@ -1312,6 +1887,18 @@ ggml_tensor * llm_graph_context::build_attn_mha(
         kq = ggml_soft_max_ext(ctx0, kq, kq_mask, kq_scale, hparams.f_max_alibi_bias);
         ggml_soft_max_add_sinks(kq, sinks);
 
+        if (kv_score) {
+            // sum the attention weights [n_kv, n_tokens, n_head, n_stream] over the tokens and the heads
+            ggml_tensor * score = ggml_reshape_3d(ctx0, kq, kq->ne[0], kq->ne[1]*kq->ne[2], kq->ne[3]);
+
+            score = ggml_cont(ctx0, ggml_permute(ctx0, score, 1, 0, 2, 3));
+            score = ggml_sum_rows(ctx0, score);
+            score = ggml_reshape_2d(ctx0, score, score->ne[1], score->ne[2]);
+
+            // and over the layers
+            res->t_kv_score = res->t_kv_score ? ggml_add(ctx0, res->t_kv_score, score) : score;
+        }
+
         if (!v_trans) {
             // note: avoid this branch
             v = ggml_cont(ctx0, ggml_transpose(ctx0, v));
@@ -1381,7 +1968,7 @@ ggml_tensor * llm_graph_context::build_attn(
     ggml_tensor * k = k_cur;
     ggml_tensor * v = v_cur;
 
-    ggml_tensor * cur = build_attn_mha(q, k, v, kq_b, kq_mask, v_mla, nullptr, kq_scale);
+    ggml_tensor * cur = build_attn_mha(q, k, v, kq_b, kq_mask, v_mla, nullptr, kq_scale, false);
     cb(cur, "kqv_out", il);
 
     if (wo) {
@@ -1418,10 +2005,15 @@ static std::unique_ptr<llm_graph_input_attn_kv_unified> build_attn_inp_kv_unifie
         inp->self_k_idxs = mctx_cur->build_input_k_idxs(ctx0, ubatch);
         inp->self_v_idxs = mctx_cur->build_input_v_idxs(ctx0, ubatch);
 
-        inp->self_kq_mask = ggml_new_tensor_4d(ctx0, GGML_TYPE_F32, n_kv, GGML_PAD(n_tokens/n_stream, GGML_KQ_MASK_PAD), 1, n_stream);
-        ggml_set_input(inp->self_kq_mask);
+        inp->self_kq_mask = mctx_cur->build_input_kq_mask(ctx0, ubatch, cparams.causal_attn, inp->self_kq_mask_inp);
+        if (!inp->self_kq_mask) {
+            inp->self_kq_mask = ggml_new_tensor_4d(ctx0, GGML_TYPE_F32, n_kv, GGML_PAD(n_tokens/n_stream, GGML_KQ_MASK_PAD), 1, n_stream);
+            ggml_set_input(inp->self_kq_mask);
+        }
 
         inp->self_kq_mask_cnv = cparams.flash_attn ? ggml_cast(ctx0, inp->self_kq_mask, GGML_TYPE_F16) : inp->self_kq_mask;
+
+        inp->n_resize = mctx_cur->get_n_resize();
     }
 
     return inp;
@@ -1469,9 +2061,13 @@ ggml_tensor * llm_graph_context::build_attn(
     ggml_tensor * k = mctx_cur->get_k(ctx0, il);
     ggml_tensor * v = mctx_cur->get_v(ctx0, il);
 
-    ggml_tensor * cur = build_attn_mha(q, k, v, kq_b, kq_mask, v_mla, nullptr, kq_scale);
+    ggml_tensor * cur = build_attn_mha(q, k, v, kq_b, kq_mask, v_mla, nullptr, kq_scale, cparams.kv_scores);
     cb(cur, "kqv_out", il);
 
+    if (res->t_kv_score) {
+        ggml_build_forward_expand(gf, res->t_kv_score);
+    }
+
     if (wo) {
         cur = build_lora_mm(wo, cur);
         if (arch == LLM_ARCH_GLM4 || arch == LLM_ARCH_GLM4_MOE) {
@@ -1561,7 +2157,7 @@ ggml_tensor * llm_graph_context::build_attn_with_sinks(
     ggml_tensor * k = mctx_cur->get_k(ctx0, il);
     ggml_tensor * v = mctx_cur->get_v(ctx0, il);
 
-    ggml_tensor * cur = build_attn_mha(q, k, v, kq_b, kq_mask, v_mla, sinks, kq_scale);
+    ggml_tensor * cur = build_attn_mha(q, k, v, kq_b, kq_mask, v_mla, sinks, kq_scale, false);
     cb(cur, "kqv_out", il);
 
     if (wo) {
@@ -1615,7 +2211,7 @@ ggml_tensor * llm_graph_context::build_attn(
     ggml_tensor * k = k_cur;
     ggml_tensor * v = v_cur;
 
-    ggml_tensor * cur = build_attn_mha(q, k, v, kq_b, kq_mask, v_mla, nullptr, kq_scale);
+    ggml_tensor * cur = build_attn_mha(q, k, v, kq_b, kq_mask, v_mla, nullptr, kq_scale, false);
     cb(cur, "kqv_out", il);
 
     if (wo) {
@@ -1649,10 +2245,15 @@ llm_graph_input_attn_kv_unified_iswa * llm_graph_context::build_attn_inp_kv_unif
         inp->self_k_idxs = mctx_cur->get_base()->build_input_k_idxs(ctx0, ubatch);
         inp->self_v_idxs = mctx_cur->get_base()->build_input_v_idxs(ctx0, ubatch);
 
-        inp->self_kq_mask = ggml_new_tensor_4d(ctx0, GGML_TYPE_F32, n_kv, GGML_PAD(n_tokens/n_stream, GGML_KQ_MASK_PAD), 1, n_stream);
-        ggml_set_input(inp->self_kq_mask);
+        inp->self_kq_mask = mctx_cur->get_base()->build_input_kq_mask(ctx0, ubatch, cparams.causal_attn, inp->self_kq_mask_inp);
+        if (!inp->self_kq_mask) {
+            inp->self_kq_mask = ggml_new_tensor_4d(ctx0, GGML_TYPE_F32, n_kv, GGML_PAD(n_tokens/n_stream, GGML_KQ_MASK_PAD), 1, n_stream);
+            ggml_set_input(inp->self_kq_mask);
+        }
 
         inp->self_kq_mask_cnv = cparams.flash_attn ? ggml_cast(ctx0, inp->self_kq_mask, GGML_TYPE_F16) : inp->self_kq_mask;
+
+        inp->n_resize = mctx_cur->get_base()->get_n_resize();
     }
 
     {
@@ -1663,10 +2264,15 @@ llm_graph_input_attn_kv_unified_iswa * llm_graph_context::build_attn_inp_kv_unif
         inp->self_k_idxs_swa = mctx_cur->get_swa()->build_input_k_idxs(ctx0, ubatch);
         inp->self_v_idxs_swa = mctx_cur->get_swa()->build_input_v_idxs(ctx0, ubatch);
 
-        inp->self_kq_mask_swa = ggml_new_tensor_4d(ctx0, GGML_TYPE_F32, n_kv, GGML_PAD(n_tokens/n_stream, GGML_KQ_MASK_PAD), 1, n_stream);
-        ggml_set_input(inp->self_kq_mask_swa);
+        inp->self_kq_mask_swa = mctx_cur->get_swa()->build_input_kq_mask(ctx0, ubatch, cparams.causal_attn, inp->self_kq_mask_swa_inp);
+        if (!inp->self_kq_mask_swa) {
+            inp->self_kq_mask_swa = ggml_new_tensor_4d(ctx0, GGML_TYPE_F32, n_kv, GGML_PAD(n_tokens/n_stream, GGML_KQ_MASK_PAD), 1, n_stream);
+            ggml_set_input(inp->self_kq_mask_swa);
+        }
 
         inp->self_kq_mask_swa_cnv = cparams.flash_attn ? ggml_cast(ctx0, inp->self_kq_mask_swa, GGML_TYPE_F16) : inp->self_kq_mask_swa;
+
+        inp->n_resize_swa = mctx_cur->get_swa()->get_n_resize();
     }
 
     return (llm_graph_input_attn_kv_unified_iswa *) res->add_input(std::move(inp));
@@ -1879,12 +2485,95 @@ void llm_graph_context::build_pooling(
             }
     }
 
+    // post-processing of the pooled embeddings (see llama_context_params.n_embd_out)
+    if (pooling_type == LLAMA_POOLING_TYPE_MEAN || pooling_type == LLAMA_POOLING_TYPE_CLS || pooling_type == LLAMA_POOLING_TYPE_LAST) {
+        if (cparams.n_embd_out < cur->ne[0]) {
+            // Matryoshka embeddings: the first dimensions are an embedding on their own
+            cur = ggml_cont(ctx0, ggml_view_2d(ctx0, cur, cparams.n_embd_out, cur->ne[1], cur->nb[1], 0));
+        }
+
+        if (cparams.embd_normalize) {
+            cur = ggml_l2_norm(ctx0, cur, 1e-12f);
+        }
+
+        switch (cparams.embd_type) {
+            case LLAMA_EMBD_TYPE_F32:
+                break;
+            case LLAMA_EMBD_TYPE_Q8_0:
+                {
+                    cur = ggml_cast(ctx0, cur, GGML_TYPE_Q8_0);
+                } break;
+            case LLAMA_EMBD_TYPE_BINARY:
+                {
+                    // 1 bit per dimension, the pairs of values are merged 3 times to pack 8 bits in a value
+                    // with the first dimension in the most significant bit
+                    cur = ggml_step(ctx0, cur);
+                    for (int i = 0; i < 3; ++i) {
+                        ggml_tensor * t  = ggml_reshape_3d(ctx0, cur, 2, cur->ne[0]/2, cur->ne[1]);
+                        ggml_tensor * hi = ggml_view_3d(ctx0, t, 1, t->ne[1], t->ne[2], t->nb[1], t->nb[2], 0);
+                        ggml_tensor * lo = ggml_view_3d(ctx0, t, 1, t->ne[1], t->ne[2], t->nb[1], t->nb[2], t->nb[0]);
+
+                        cur = ggml_add(ctx0, ggml_scale(ctx0, ggml_cont(ctx0, hi), (float) (1 << (1 << i))), lo);
+                        cur = ggml_reshape_2d(ctx0, cur, cur->ne[1], cur->ne[2]);
+                    }
+
+                    // the bytes are exact in F16
+                    cur = ggml_cast(ctx0, cur, GGML_TYPE_F16);
+                } break;
+        }
+    }
+
     cb(cur, "result_embd_pooled", -1);
     res->t_embd_pooled = cur;
 
     ggml_build_forward_expand(gf, cur);
 }
 
+void llm_graph_context::build_logits_top_k() const {
+    if (cparams.n_logits_top_k == 0 || res->t_logits == nullptr || res->logits_short) {
+        return;
+    }
+
+    ggml_tensor * logits = res->t_logits;
+
+    if (!ggml_is_contiguous(logits)) {
+        logits = ggml_cont(ctx0, logits);
+    }
+
+    const int64_t n_vocab = logits->ne[0];
+    const int64_t n_rows  = logits->ne[1];
+
+    const int64_t k = std::min<int64_t>(cparams.n_logits_top_k, n_vocab);
+
+    // [k, n_outputs]
+    ggml_tensor * ids = ggml_cont(ctx0, ggml_top_k(ctx0, logits, k));
+    cb(ids, "result_top_k_ids", -1);
+
+    // gather the selected logits from each row
+    ggml_tensor * cur = ggml_get_rows(ctx0, ggml_reshape_3d(ctx0, logits, 1, n_vocab, n_rows), ids);
+    cur = ggml_reshape_2d(ctx0, cur, k, n_rows);
+    cb(cur, "result_top_k", -1);
+
+    res->t_logits_top_k     = cur;
+    res->t_logits_top_k_ids = ids;
+
+    ggml_build_forward_expand(gf, ids);
+    ggml_build_forward_expand(gf, cur);
+}
+
+void llm_graph_context::build_logits_half() const {
+    if (cparams.logits_type == LLAMA_LOGITS_TYPE_F32 || res->t_logits == nullptr || res->logits_short) {
+        return;
+    }
+
+    ggml_tensor * cur = ggml_cast(ctx0, res->t_logits, cparams.logits_type == LLAMA_LOGITS_TYPE_F16 ? GGML_TYPE_F16 : GGML_TYPE_BF16);
+    cb(cur, "result_logits_half", -1);
+
+    res->t_logits_half = cur;
+
+    ggml_build_forward_expand(gf, cur);
+}
+
 int32_t llama_relative_position_bucket(llama_pos x, llama_pos y, uint64_t n_buckets, bool bidirectional) {
     // TODO move to hparams if a T5 variant appears that uses a different value
     const int64_t max_distance = 128;
@@ -6,6 +6,7 @@
 #include "llama-adapter.h"
 
 #include <cstdint>
+#include <map>
 #include <vector>
 #include <memory>
 #include <set>
@@ -70,6 +71,41 @@ struct llama_cross {
     std::vector<std::set<llama_seq_id>> seq_ids_enc;
 };
 
+// subset of the vocabulary for which the output projection is computed, see llama_set_logits_vocab()
+struct llama_vocab_short {
+    const ggml_tensor * output_full = nullptr; // the output tensor of the model
+          ggml_tensor * output      = nullptr; // its rows of the tokens in ids
+
+    std::vector<llama_token> ids;
+
+    // incremented each time the subset changes - the graphs built for another subset are not reused
+    uint32_t version = 0;
+
+    ggml_context_ptr        ctx;
+    ggml_backend_buffer_ptr buf;
+};
+
+// hidden states of the sequences, the input of the multi-token prediction (MTP) layer at the next positions
+// see llama_set_mtp_draft()
+struct llama_mtp_hidden {
+    int64_t n_embd = 0;
+
+    // seq_id -> pos -> final hidden state of the model
+    std::map<llama_seq_id, std::map<llama_pos, std::vector<float>>> main;
+
+    // seq_id -> pos -> output of the MTP layer, saved by the drafts since the last decode of the sequence
+    std::map<llama_seq_id, std::map<llama_pos, std::vector<float>>> draft;
+
+    // the hidden state of a sequence at a position, nullptr if it is not known
+    const float * find(llama_seq_id seq_id, llama_pos pos, bool with_draft) const;
+
+    // the rows of a ubatch saved after the decode: the outputs, then the last token of each sequence
+    static void rows(const llama_ubatch & ubatch, uint32_t n_outputs, std::vector<int32_t> & ids);
+
+    // save the hidden states [n_embd, ids.size()] of the rows of a ubatch
+    void save(const llama_ubatch & ubatch, const std::vector<int32_t> & ids, const float * data, bool is_draft);
+};
+
 struct llm_graph_params;
 
 //
@@ -109,7 +145,8 @@ public:
 
 class llm_graph_input_pos : public llm_graph_input_i {
 public:
-    llm_graph_input_pos(uint32_t n_pos_per_embd) : n_pos_per_embd(n_pos_per_embd) {}
+    llm_graph_input_pos(uint32_t n_pos_per_embd, const llama_kv_cache_unified_context * mctx) :
+        n_pos_per_embd(n_pos_per_embd), mctx(mctx) {}
     virtual ~llm_graph_input_pos() = default;
 
     void set_input(const llama_ubatch * ubatch) override;
@@ -119,6 +156,9 @@ public:
     ggml_tensor * pos = nullptr; // I32 [n_batch]
 
     const uint32_t n_pos_per_embd = 1;
+
+    // the RoPE positions of a sequence are offset after a lazy shift of its cache
+    const llama_kv_cache_unified_context * mctx;
 };
 
 // temperature tuning, used by llama4
@@ -184,6 +224,40 @@ public:
     const uint32_t n_outputs;
 };
 
+// the LoRA adapters applied to the tokens of the ubatch
+// when its sequences use different adapters, the output of every adapter is scaled per token, so that all the
+//   sequences can be evaluated together
+class llm_graph_input_lora : public llm_graph_input_i {
+public:
+    llm_graph_input_lora(
+            const llama_adapter_loras     * loras,
+            const llama_adapter_loras_seq * loras_seq) : loras(loras), loras_seq(loras_seq) {}
+    virtual ~llm_graph_input_lora() = default;
+
+    void set_input(const llama_ubatch * ubatch) override;
+
+    bool can_reuse(const llm_graph_params & params) override;
+
+    // the adapters, sorted, and the scales which are used if all the sequences share the same adapters
+    std::vector<std::pair<llama_adapter_lora *, float>> adapters;
+
+    bool per_token = false;
+
+    std::vector<ggml_tensor *> scale;     // F32 [1, n_batch]   per adapter, if per_token
+    std::vector<ggml_tensor *> scale_out; // F32 [1, n_outputs] per adapter, if per_token
+
+    const llama_adapter_loras     * loras;
+    const llama_adapter_loras_seq * loras_seq;
+
+    // determine the adapters and whether the scales are per token for the sequences of a ubatch
+    static void resolve(
+            const llama_ubatch & ubatch,
+            const llama_adapter_loras & loras,
+            const llama_adapter_loras_seq & loras_seq,
+            std::vector<std::pair<llama_adapter_lora *, float>> & adapters,
+            bool & per_token);
+};
+
 class llm_graph_input_mean : public llm_graph_input_i {
 public:
     llm_graph_input_mean(const llama_cparams & cparams) : cparams(cparams) {}
@@ -257,6 +331,15 @@ public:
     const llama_cparams cparams;
 };
 
+// the inputs of a KQ mask that is computed in the graph instead of filled on the host
+// see llama_kv_cache_unified::build_input_kq_mask()
+struct llm_graph_kq_mask_inputs {
+    ggml_tensor * pos_cells = nullptr; // F32 [n_kv,  1,         1, n_stream]
+    ggml_tensor * seq_cells = nullptr; // F32 [n_seq, n_kv,      1, n_stream]
+    ggml_tensor * pos_toks  = nullptr; // F32 [1,     n_tps_pad, 1, n_stream]
+    ggml_tensor * seq_toks  = nullptr; // F32 [n_seq, n_tps_pad, 1, n_stream]
+};
+
 class llm_graph_input_attn_kv_unified : public llm_graph_input_i {
 public:
     llm_graph_input_attn_kv_unified(
@@ -284,6 +367,12 @@ public:
     ggml_tensor * self_kq_mask     = nullptr; // F32 [n_kv, n_batch/n_stream, 1, n_stream]
     ggml_tensor * self_kq_mask_cnv = nullptr; //     [n_kv, n_batch/n_stream, 1, n_stream]
 
+    // set when self_kq_mask is computed in the graph, see LLAMA_KV_DEVICE_MASK
+    llm_graph_kq_mask_inputs self_kq_mask_inp;
+
+    // the graph views the K/V tensors of the cache as they were allocated when it was built
+    uint32_t n_resize = 0;
+
     // note: these have to be copies because in order to be able to reuse a graph, its inputs
     //       need to carry these parameters with them. otherwise, they can point to freed
     //       llm_graph_params from a previous batch, causing stack-use-after-return
@@ -327,6 +416,12 @@ public:
     ggml_tensor * self_kq_mask_swa     = nullptr; // F32 [n_kv, n_batch/n_stream, 1, n_stream]
     ggml_tensor * self_kq_mask_swa_cnv = nullptr; //     [n_kv, n_batch/n_stream, 1, n_stream]
 
+    llm_graph_kq_mask_inputs self_kq_mask_inp;
+    llm_graph_kq_mask_inputs self_kq_mask_swa_inp;
+
+    uint32_t n_resize     = 0;
+    uint32_t n_resize_swa = 0;
+
     const llama_hparams hparams;
     const llama_cparams cparams;
 
@@ -348,6 +443,29 @@ public:
     const llama_cross * cross = nullptr;
 };
 
+// inputs of the MTP layer, see llm_graph_context::build_inp_mtp()
+class llm_graph_input_mtp : public llm_graph_input_i {
+public:
+    llm_graph_input_mtp(const llama_mtp_hidden * mtp, bool draft, uint32_t n_outputs) :
+        mtp(mtp), draft(draft), n_outputs(n_outputs) {}
+    virtual ~llm_graph_input_mtp() = default;
+
+    void set_input(const llama_ubatch * ubatch) override;
+
+    bool can_reuse(const llm_graph_params & params) override;
+
+    // the hidden state at the previous position of a token is the row prev_ids[i] of concat(h, carry), where h are
+    //   the hidden states of the ubatch - when drafting, there is no h and carry has a row per token
+    ggml_tensor * prev_ids = nullptr; // I32 [n_batch]
+    ggml_tensor * carry    = nullptr; // F32 [n_embd, n_seqs_unq] or [n_embd, n_batch] when drafting
+    ggml_tensor * save_ids = nullptr; // I32 [n_outputs + n_seqs_unq], see llama_mtp_hidden::rows()
+
+    const llama_mtp_hidden * mtp;
+
+    const bool     draft;
+    const uint32_t n_outputs;
+};
+
 class llm_graph_input_mem_hybrid : public llm_graph_input_i {
 public:
     llm_graph_input_mem_hybrid(
@@ -398,10 +516,15 @@ struct llm_graph_params {
     ggml_backend_sched_t sched;
     ggml_backend_t backend_cpu;
 
-    const llama_adapter_cvec     * cvec;
-    const llama_adapter_loras    * loras;
-    const llama_memory_context_i * mctx;
-    const llama_cross            * cross;
+    const llama_adapter_cvec      * cvec;
+    const llama_adapter_loras     * loras;
+    const llama_adapter_loras_seq * loras_seq;
+    const llama_memory_context_i  * mctx;
+    const llama_cross             * cross;
+    const llama_vocab_short       * vshort;
+    const llama_mtp_hidden        * mtp;
+
+    uint32_t vshort_version;
 
     uint32_t n_outputs;
 
@@ -445,11 +568,13 @@ struct llm_graph_params {
         return
             cparams.embeddings  == other.cparams.embeddings  &&
             cparams.causal_attn == other.cparams.causal_attn &&
+            cparams.mtp_draft   == other.cparams.mtp_draft   &&
             arch      == other.arch  &&
             gtype     == other.gtype &&
             cvec      == other.cvec  &&
             loras     == other.loras &&
             cross     == other.cross &&
+            vshort_version == other.vshort_version &&
             n_outputs == other.n_outputs;
     }
 };
@@ -465,6 +590,18 @@ public:
     ggml_tensor * get_embd()        const { return t_embd; }
     ggml_tensor * get_embd_pooled() const { return t_embd_pooled; }
 
+    ggml_tensor * get_logits_top_k()     const { return t_logits_top_k; }
+    ggml_tensor * get_logits_top_k_ids() const { return t_logits_top_k_ids; }
+    ggml_tensor * get_logits_half()      const { return t_logits_half; }
+
+    bool get_logits_short() const { return logits_short; }
+
+    ggml_tensor * get_kv_score() const { return t_kv_score; }
+
+    ggml_tensor * get_mtp_hidden() const { return t_mtp_hidden; }
+
+    const std::vector<std::pair<int, ggml_tensor *>> & get_expert_ids() const { return t_expert_ids; }
+
     ggml_cgraph  * get_gf()  const { return gf; }
     ggml_context * get_ctx() const { return ctx_compute.get(); }
 
@@ -485,12 +622,33 @@ public:
 
     void set_params(const llm_graph_params & params);
 
+    // store the backends assigned by the scheduler to the nodes of the graph after it was allocated
+    void save_sched(ggml_backend_sched_t sched);
+
+    // prepare the graph to be allocated again after the scheduler was used for another graph:
+    // release the compute buffer allocations of the tensors and restore the backends of the nodes
+    void restore_sched(ggml_backend_sched_t sched);
+
     // important graph nodes
     ggml_tensor * t_tokens      = nullptr;
     ggml_tensor * t_logits      = nullptr;
     ggml_tensor * t_embd        = nullptr;
     ggml_tensor * t_embd_pooled = nullptr;
 
+    ggml_tensor * t_logits_top_k     = nullptr; // [n_logits_top_k, n_outputs]
+    ggml_tensor * t_logits_top_k_ids = nullptr; // [n_logits_top_k, n_outputs]
+    ggml_tensor * t_logits_half      = nullptr; // F16 or BF16 [n_vocab, n_outputs]
+
+    // the logits are [n_vocab_short, n_outputs] when the output projection was computed for a subset of the vocabulary
+    bool logits_short = false;
+
+    ggml_tensor * t_kv_score = nullptr; // [n_kv, n_stream]
+
+    ggml_tensor * t_mtp_hidden = nullptr; // [n_embd, n_saved], the hidden states saved in llama_mtp_hidden
+
+    // layer and selected experts of the MoE layers, see llama_context_params.expert_stats
+    std::vector<std::pair<int, ggml_tensor *>> t_expert_ids; // [n_expert_used, n_tokens], view of the router argsort
+
     std::vector<llm_graph_input_ptr> inputs;
 
     ggml_context_ptr ctx_compute;
@@ -500,6 +658,9 @@ public:
 
     ggml_cgraph * gf;
 
+    // backend of each node of gf, see save_sched()
+    std::vector<ggml_backend_t> node_backends;
+
     int64_t max_nodes;
 
 private:
@@ -565,6 +726,10 @@ struct llm_graph_context {
     const llama_adapter_loras    * loras;
     const llama_memory_context_i * mctx;
     const llama_cross            * cross;
+    const llama_vocab_short      * vshort;
+    const llama_mtp_hidden       * mtp;
+
+    llm_graph_input_lora * inp_lora = nullptr;
 
     const llm_graph_cb & cb_func;
 
@@ -586,6 +751,12 @@ struct llm_graph_context {
              ggml_tensor * cur,
                      int   il) const;
 
+    // scale the output of the i-th adapter of inp_lora
+    ggml_tensor * build_lora_scale(
+              ggml_tensor * cur,
+                      int   i,
+                    float   scale) const;
+
     // do mat_mul, while optionally apply lora
     ggml_tensor * build_lora_mm(
               ggml_tensor * w,
@@ -620,6 +791,21 @@ struct llm_graph_context {
        llm_ffn_gate_type   type_gate,
                      int   il) const;
 
+    // FFN that computes the hot neurons and the groups of cold neurons selected by a low-rank activation predictor
+    // (pred_a, pred_b) of the layer, see llama_hparams::ffn_sparse_group - the groups are evaluated as experts
+    // with views of the weights, so they have to be in host buffers without repacking
+    bool can_ffn_sparse(const ggml_tensor * pred_a, const ggml_tensor * up) const;
+
+    ggml_tensor * build_ffn_sparse(
+             ggml_tensor * cur,
+             ggml_tensor * up,
+             ggml_tensor * gate,
+             ggml_tensor * down,
+             ggml_tensor * pred_a,
+             ggml_tensor * pred_b,
+         llm_ffn_op_type   type_op,
+                     int   il) const;
+
     // build MoE FFN without bias tensors
     ggml_tensor * build_moe_ffn(
              ggml_tensor * cur,
@@ -670,6 +856,8 @@ struct llm_graph_context {
     ggml_tensor * build_inp_mean() const;
     ggml_tensor * build_inp_cls() const;
 
+    llm_graph_input_mtp * build_inp_mtp() const;
+
     ggml_tensor * build_inp_cross_embd() const;
     ggml_tensor * build_inp_pos_bucket_enc() const;
     ggml_tensor * build_inp_pos_bucket_dec() const;
@@ -687,7 +875,8 @@ struct llm_graph_context {
              ggml_tensor * kq_mask,
              ggml_tensor * sinks,
              ggml_tensor * v_mla,   // [n_embd_head_v_mla, n_embd_head_v, n_head_v]
-                   float   kq_scale) const;
+                   float   kq_scale,
+                    bool   kv_score) const; // accumulate the attention weights of the KV cells in res->t_kv_score
 
     llm_graph_input_attn_no_cache * build_attn_inp_no_cache() const;
 
@@ -814,6 +1003,14 @@ struct llm_graph_context {
             ggml_tensor * cls_b,
             ggml_tensor * cls_out,
             ggml_tensor * cls_out_b) const;
+
+    //
+    // output
+    //
+
+    // select the top-k logits of each output (see llama_cparams::n_logits_top_k)
+    void build_logits_top_k() const;
+    void build_logits_half() const;
 };
 
 // TODO: better name
@@ -76,6 +76,12 @@ struct llama_hparams {
     uint32_t moe_every_n_layers   = 0;
     uint32_t nextn_predict_layers = 0;
 
+    // activation sparsity: the FFN neurons are in groups of ffn_sparse_group, the first ffn_sparse_n_hot groups
+    // are always computed and ffn_sparse_n_active of the others are selected by the predictors
+    uint32_t ffn_sparse_group    = 0;
+    uint32_t ffn_sparse_n_active = 0;
+    uint32_t ffn_sparse_n_hot    = 0;
+
     float f_norm_eps;
     float f_norm_rms_eps;
     float f_norm_group_eps;
@@ -15,6 +15,8 @@ llama_kv_cache_unified_iswa::llama_kv_cache_unified_iswa(
         const llama_model & model,
                 ggml_type   type_k,
                 ggml_type   type_v,
+                 uint32_t   n_layer_f16,
+ ggml_backend_buffer_type_t   buft_cpu,
                      bool   v_trans,
                      bool   offload,
                      bool   swa_full,
@@ -41,14 +43,14 @@ llama_kv_cache_unified_iswa::llama_kv_cache_unified_iswa(
     LLAMA_LOG_INFO("%s: creating non-SWA KV cache, size = %u cells\n", __func__, size_base);
 
     kv_base = std::make_unique<llama_kv_cache_unified>(
-            model, std::move(filter_base), type_k, type_v,
+            model, std::move(filter_base), type_k, type_v, n_layer_f16, buft_cpu,
             v_trans, offload, unified, size_base, n_seq_max, n_pad,
             0, LLAMA_SWA_TYPE_NONE);
 
     LLAMA_LOG_INFO("%s: creating     SWA KV cache, size = %u cells\n", __func__, size_swa);
 
     kv_swa = std::make_unique<llama_kv_cache_unified>(
-            model, std::move(filter_swa), type_k, type_v,
+            model, std::move(filter_swa), type_k, type_v, n_layer_f16, buft_cpu,
             v_trans, offload, unified, size_swa, n_seq_max, n_pad,
             hparams.n_swa, hparams.swa_type);
 }
@@ -191,17 +193,34 @@ llama_memory_context_ptr llama_kv_cache_unified_iswa::init_update(llama_context
 }
 
 bool llama_kv_cache_unified_iswa::get_can_shift() const {
-    return kv_base->get_size() == kv_swa->get_size();
+    return kv_base->get_size_max() == kv_swa->get_size_max();
 }
 
-void llama_kv_cache_unified_iswa::state_write(llama_io_write_i & io, llama_seq_id seq_id) const {
-    kv_base->state_write(io, seq_id);
-    kv_swa ->state_write(io, seq_id);
+void llama_kv_cache_unified_iswa::get_n_cells(uint32_t & n_used, uint32_t & n_extent) const {
+    uint32_t n_used_swa   = 0;
+    uint32_t n_extent_swa = 0;
+
+    kv_base->get_n_cells(n_used,     n_extent);
+    kv_swa ->get_n_cells(n_used_swa, n_extent_swa);
+
+    n_used   += n_used_swa;
+    n_extent += n_extent_swa;
+}
+
+void llama_kv_cache_unified_iswa::state_write(llama_io_write_i & io, llama_seq_id seq_id, llama_pos p0, llama_pos p1, llama_state_seq_flags flags) const {
+    if ((flags & LLAMA_STATE_SEQ_FLAGS_SWA_ONLY) == 0) {
+        kv_base->state_write(io, seq_id, p0, p1, flags);
+    }
+
+    kv_swa->state_write(io, seq_id, p0, p1, flags);
 }
 
-void llama_kv_cache_unified_iswa::state_read(llama_io_read_i & io, llama_seq_id seq_id) {
-    kv_base->state_read(io, seq_id);
-    kv_swa ->state_read(io, seq_id);
+void llama_kv_cache_unified_iswa::state_read(llama_io_read_i & io, llama_seq_id seq_id, bool append, llama_pos shift, llama_state_seq_flags flags) {
+    if ((flags & LLAMA_STATE_SEQ_FLAGS_SWA_ONLY) == 0) {
+        kv_base->state_read(io, seq_id, append, shift, flags);
+    }
+
+    kv_swa->state_read(io, seq_id, append, shift, flags);
 }
 
 llama_kv_cache_unified * llama_kv_cache_unified_iswa::get_base() const {
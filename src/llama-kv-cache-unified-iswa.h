@@ -17,6 +17,8 @@ public:
             const llama_model & model,
                     ggml_type   type_k,
                     ggml_type   type_v,
+                     uint32_t   n_layer_f16,
+   ggml_backend_buffer_type_t   buft_cpu,
                          bool   v_trans,
                          bool   offload,
                          bool   swa_full,
@@ -43,6 +45,8 @@ public:
 
     bool get_can_shift() const override;
 
+    void get_n_cells(uint32_t & n_used, uint32_t & n_extent) const override;
+
     void clear(bool data) override;
 
     bool seq_rm  (llama_seq_id seq_id,                              llama_pos p0, llama_pos p1) override;
@@ -56,8 +60,8 @@ public:
 
     // state write/load
 
-    void state_write(llama_io_write_i & io, llama_seq_id seq_id = -1) const override;
-    void state_read (llama_io_read_i  & io, llama_seq_id seq_id = -1)       override;
+    void state_write(llama_io_write_i & io, llama_seq_id seq_id = -1, llama_pos p0 = -1, llama_pos p1 = -1, llama_state_seq_flags flags = 0) const override;
+    void state_read (llama_io_read_i  & io, llama_seq_id seq_id = -1, bool append = false, llama_pos shift = 0, llama_state_seq_flags flags = 0)  override;
 
     //
     // llama_kv_cache_unified_iswa specific API
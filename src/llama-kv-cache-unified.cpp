@@ -8,6 +8,7 @@
 #include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <cstring>
 #include <limits>
 #include <map>
 #include <stdexcept>
@@ -21,6 +22,8 @@ llama_kv_cache_unified::llama_kv_cache_unified(
           layer_filter_cb && filter,
                 ggml_type    type_k,
                 ggml_type    type_v,
+                 uint32_t    n_layer_f16,
+   ggml_backend_buffer_type_t buft_cpu,
                      bool    v_trans,
                      bool    offload,
                      bool    unified,
@@ -40,36 +43,22 @@ llama_kv_cache_unified::llama_kv_cache_unified(
         n_layer_cache = 20;
     }
     if (model.arch == LLM_ARCH_GLM4_MOE) {
-        // GLM-4.5: Only process up to last layer, skip final NextN layer
-        n_layer_cache = hparams.n_layer - hparams.nextn_predict_layers;
+        // GLM-4.5: Only process up to last layer, skip final NextN layer - unless it is loaded as the MTP layer
+        n_layer_cache = hparams.n_layer - hparams.nextn_predict_layers + model.n_mtp;
     }
 
-    // create a context for each buffer type
-    std::map<ggml_backend_buffer_type_t, ggml_context *> ctx_map;
-    auto ctx_for_buft = [&](ggml_backend_buffer_type_t buft) -> ggml_context * {
-        auto it = ctx_map.find(buft);
-        if (it == ctx_map.end()) {
-            ggml_init_params params = {
-                /*.mem_size   =*/ size_t(2u*(1 + n_stream)*n_layer_cache*ggml_tensor_overhead()),
-                /*.mem_buffer =*/ NULL,
-                /*.no_alloc   =*/ true,
-            };
-
-            ggml_context * ctx = ggml_init(params);
-            if (!ctx) {
-                return nullptr;
-            }
-
-            ctx_map[buft] = ctx;
-            ctxs.emplace_back(ctx);
+    GGML_ASSERT(n_stream == 1 || n_stream == n_seq_max);
 
-            return ctx;
+    // env: LLAMA_KV_ELASTIC
+    size_min = kv_size;
+    size_max = kv_size;
+    {
+        const char * LLAMA_KV_ELASTIC = getenv("LLAMA_KV_ELASTIC");
+        const int n_elastic = LLAMA_KV_ELASTIC ? atoi(LLAMA_KV_ELASTIC) : 0;
+        if (n_elastic > 0) {
+            size_min = std::min(kv_size, GGML_PAD((uint32_t) n_elastic, n_pad));
         }
-
-        return it->second;
-    };
-
-    GGML_ASSERT(n_stream == 1 || n_stream == n_seq_max);
+    }
 
     v_heads.resize(n_stream);
     for (uint32_t s = 0; s < n_stream; ++s) {
@@ -78,12 +67,14 @@ llama_kv_cache_unified::llama_kv_cache_unified(
 
     v_cells.resize(n_stream);
     for (uint32_t s = 0; s < n_stream; ++s) {
-        v_cells[s].resize(kv_size);
+        v_cells[s].resize(size_min);
     }
 
     // by default, all sequence ids are mapped to the 0th stream
     seq_to_stream.resize(LLAMA_MAX_SEQ, 0);
 
+    seq_pos_off.resize(LLAMA_MAX_SEQ, 0);
+
     if (n_stream > 1) {
         seq_to_stream.resize(n_stream, 0);
         for (uint32_t s = 0; s < n_stream; ++s) {
@@ -103,48 +94,34 @@ llama_kv_cache_unified::llama_kv_cache_unified(
             continue;
         }
 
-        // [TAG_V_CACHE_VARIABLE]
-        const uint32_t n_embd_k_gqa =            hparams.n_embd_k_gqa(il);
-        const uint32_t n_embd_v_gqa = !v_trans ? hparams.n_embd_v_gqa(il) : hparams.n_embd_v_gqa_max();
-
         const char * dev_name = "CPU";
 
-        ggml_backend_buffer_type_t buft = ggml_backend_cpu_buffer_type();
+        ggml_backend_buffer_type_t buft = buft_cpu ? buft_cpu : ggml_backend_cpu_buffer_type();
 
         if (offload) {
             auto * dev = model.dev_layer(il);
-            buft = ggml_backend_dev_buffer_type(dev);
+            if (!buft_cpu || ggml_backend_dev_type(dev) != GGML_BACKEND_DEVICE_TYPE_CPU) {
+                buft = ggml_backend_dev_buffer_type(dev);
+            }
 
             dev_name = ggml_backend_dev_name(dev);
         }
 
         LLAMA_LOG_DEBUG("%s: layer %3d: dev = %s\n", __func__, il, dev_name);
 
-        ggml_context * ctx = ctx_for_buft(buft);
-        if (!ctx) {
-            throw std::runtime_error("failed to create ggml context for kv cache");
-        }
-
-        ggml_tensor * k;
-        ggml_tensor * v;
-
-        k = ggml_new_tensor_3d(ctx, type_k, n_embd_k_gqa, kv_size, n_stream);
-        v = ggml_new_tensor_3d(ctx, type_v, n_embd_v_gqa, kv_size, n_stream);
-
-        ggml_format_name(k, "cache_k_l%d", il);
-        ggml_format_name(v, "cache_v_l%d", il);
+        // the first and last layers are the most sensitive to the quantization of the cache
+        const bool is_edge = il < n_layer_f16 || il + n_layer_f16 >= n_layer_cache;
 
-        std::vector<ggml_tensor *> k_stream;
-        std::vector<ggml_tensor *> v_stream;
+        const ggml_type type_k_l = is_edge && ggml_is_quantized(type_k) ? GGML_TYPE_F16 : type_k;
+        const ggml_type type_v_l = is_edge && ggml_is_quantized(type_v) ? GGML_TYPE_F16 : type_v;
 
-        for (uint32_t s = 0; s < n_stream; ++s) {
-            k_stream.push_back(ggml_view_2d(ctx, k, n_embd_k_gqa, kv_size, k->nb[1], s*k->nb[2]));
-            v_stream.push_back(ggml_view_2d(ctx, v, n_embd_v_gqa, kv_size, v->nb[1], s*v->nb[2]));
+        if (type_k_l != type_k || type_v_l != type_v) {
+            LLAMA_LOG_DEBUG("%s: layer %3d: K (%s), V (%s)\n", __func__, il, ggml_type_name(type_k_l), ggml_type_name(type_v_l));
         }
 
         map_layer_ids[il] = layers.size();
 
-        layers.push_back({ il, k, v, k_stream, v_stream, });
+        layers.push_back({ il, nullptr, nullptr, {}, {}, buft, type_k_l, type_v_l, });
     }
 
     // TODO: this is temporary until we support passing reuse layer filters [KV_REUSE]
@@ -167,20 +144,12 @@ llama_kv_cache_unified::llama_kv_cache_unified(
         }
     }
 
-    // allocate tensors and initialize the buffers to avoid NaNs in the padding
-    for (auto it : ctx_map) {
-        auto * buft = it.first;
-        auto * ctx  = it.second;
-
-        ggml_backend_buffer_t buf = ggml_backend_alloc_ctx_tensors_from_buft(ctx, buft);
-        if (!buf) {
-            throw std::runtime_error("failed to allocate buffer for kv cache");
-        }
-
-        LLAMA_LOG_INFO("%s: %10s KV buffer size = %8.2f MiB\n", __func__, ggml_backend_buffer_name(buf), ggml_backend_buffer_get_size(buf)/1024.0/1024.0);
+    if (!alloc_tensors(size_min, ctxs, bufs, layers)) {
+        throw std::runtime_error("failed to allocate buffer for kv cache");
+    }
 
-        ggml_backend_buffer_clear(buf, 0);
-        bufs.emplace_back(buf);
+    for (const auto & buf : bufs) {
+        LLAMA_LOG_INFO("%s: %10s KV buffer size = %8.2f MiB\n", __func__, ggml_backend_buffer_name(buf.get()), ggml_backend_buffer_get_size(buf.get())/1024.0/1024.0);
     }
 
     {
@@ -188,9 +157,13 @@ llama_kv_cache_unified::llama_kv_cache_unified(
         const size_t memory_size_v = size_v_bytes();
 
         LLAMA_LOG_INFO("%s: size = %7.2f MiB (%6u cells, %3d layers, %2u/%u seqs), K (%s): %7.2f MiB, V (%s): %7.2f MiB\n", __func__,
-                (float)(memory_size_k + memory_size_v) / (1024.0f * 1024.0f), kv_size, (int) layers.size(), n_seq_max, n_stream,
+                (float)(memory_size_k + memory_size_v) / (1024.0f * 1024.0f), size_min, (int) layers.size(), n_seq_max, n_stream,
                 ggml_type_name(type_k), (float)memory_size_k / (1024.0f * 1024.0f),
                 ggml_type_name(type_v), (float)memory_size_v / (1024.0f * 1024.0f));
+
+        if (n_layer_f16 > 0 && (ggml_is_quantized(type_k) || ggml_is_quantized(type_v))) {
+            LLAMA_LOG_INFO("%s: the first and last %u layers use F16 for the quantized K/V\n", __func__, n_layer_f16);
+        }
     }
 
     const char * LLAMA_KV_CACHE_DEBUG = getenv("LLAMA_KV_CACHE_DEBUG");
@@ -199,6 +172,10 @@ llama_kv_cache_unified::llama_kv_cache_unified(
     const char * LLAMA_SET_ROWS = getenv("LLAMA_SET_ROWS");
     supports_set_rows = LLAMA_SET_ROWS ? atoi(LLAMA_SET_ROWS) != 0 : supports_set_rows;
 
+    const char * LLAMA_KV_LAZY_SHIFT = getenv("LLAMA_KV_LAZY_SHIFT");
+    lazy_shift = (LLAMA_KV_LAZY_SHIFT ? atoi(LLAMA_KV_LAZY_SHIFT) != 0 : true) && !filter &&
+        hparams.rope_type != LLAMA_ROPE_TYPE_NONE && hparams.n_pos_per_embd() == 1;
+
     if (!supports_set_rows) {
         // ref: https://github.com/ggml-org/llama.cpp/pull/14363
         GGML_ASSERT(unified && "cannot use non-unified KV cache without ggml_set_rows() support");
@@ -207,6 +184,28 @@ llama_kv_cache_unified::llama_kv_cache_unified(
     if (!supports_set_rows) {
         LLAMA_LOG_WARN("%s: LLAMA_SET_ROWS=0, using old ggml_cpy() method for backwards compatibility\n", __func__);
     }
+
+    const char * LLAMA_KV_N_KV_BUCKETS = getenv("LLAMA_KV_N_KV_BUCKETS");
+    n_kv_buckets = (LLAMA_KV_N_KV_BUCKETS ? atoi(LLAMA_KV_N_KV_BUCKETS) != 0 : true) && supports_set_rows;
+
+    const char * LLAMA_KV_BLOCK_SIZE = getenv("LLAMA_KV_BLOCK_SIZE");
+    n_block = LLAMA_KV_BLOCK_SIZE ? std::max(0, atoi(LLAMA_KV_BLOCK_SIZE)) : 0;
+
+    if (n_block > 0 && !supports_set_rows) {
+        LLAMA_LOG_WARN("%s: LLAMA_KV_BLOCK_SIZE requires ggml_set_rows() support - paged KV cache disabled\n", __func__);
+        n_block = 0;
+    }
+
+    const char * LLAMA_KV_DEVICE_MASK = getenv("LLAMA_KV_DEVICE_MASK");
+    device_mask = (LLAMA_KV_DEVICE_MASK ? atoi(LLAMA_KV_DEVICE_MASK) != 0 : false) && swa_type != LLAMA_SWA_TYPE_CHUNKED;
+
+    if (n_block > 0) {
+        LLAMA_LOG_INFO("%s: paged KV cache, block size = %u cells, %u blocks per stream\n", __func__, n_block, (kv_size + n_block - 1)/n_block);
+    }
+
+    if (size_min < size_max) {
+        LLAMA_LOG_INFO("%s: elastic KV cache, %u cells, grows on demand up to %u cells\n", __func__, size_min, size_max);
+    }
 }
 
 void llama_kv_cache_unified::clear(bool data) {
@@ -215,6 +214,13 @@ void llama_kv_cache_unified::clear(bool data) {
         v_heads[s] = 0;
     }
 
+    std::fill(seq_pos_off.begin(), seq_pos_off.end(), 0);
+
+    // release the cells that were added on demand
+    if (get_size() > size_min) {
+        resize(size_min);
+    }
+
     if (data) {
         for (auto & buf : bufs) {
             ggml_backend_buffer_clear(buf.get(), 0);
@@ -282,6 +288,8 @@ bool llama_kv_cache_unified::seq_rm(llama_seq_id seq_id, llama_pos p0, llama_pos
         }
     }
 
+    seq_pos_off_sync();
+
     return true;
 }
 
@@ -292,6 +300,20 @@ void llama_kv_cache_unified::seq_cp(llama_seq_id seq_id_src, llama_seq_id seq_id
     const auto s0 = seq_to_stream[seq_id_src];
     const auto s1 = seq_to_stream[seq_id_dst];
 
+    // the cells shared by the two sequences must have the same RoPE positions in both
+    if (seq_id_src != seq_id_dst) {
+        seq_pos_off_clear(seq_id_src);
+        seq_pos_off_clear(seq_id_dst);
+    }
+
+    if (p0 < 0) {
+        p0 = 0;
+    }
+
+    if (p1 < 0) {
+        p1 = std::numeric_limits<llama_pos>::max();
+    }
+
     if (s0 == s1) {
         // since both sequences are in the same stream, no data copy is necessary
         // we just have to update the cells meta data
@@ -302,14 +324,6 @@ void llama_kv_cache_unified::seq_cp(llama_seq_id seq_id_src, llama_seq_id seq_id
             return;
         }
 
-        if (p0 < 0) {
-            p0 = 0;
-        }
-
-        if (p1 < 0) {
-            p1 = std::numeric_limits<llama_pos>::max();
-        }
-
         for (uint32_t i = 0; i < cells.size(); ++i) {
             if (!cells.pos_in(i, p0, p1)) {
                 continue;
@@ -324,26 +338,18 @@ void llama_kv_cache_unified::seq_cp(llama_seq_id seq_id_src, llama_seq_id seq_id
     }
 
     // cross-stream sequence copies require to copy the actual buffer data
+    // the destination stream only holds seq_id_dst, so its cells are replaced by the cells of the source in [p0, p1)
+    // and only the range of cells that spans them is copied, not the whole stream
 
-    bool is_full = true;
-
-    if (p0 > 0 && p0 + 1 < (int) get_size()) {
-        is_full = false;
-    }
-
-    if (p1 > 0 && p1 + 1 < (int) get_size()) {
-        is_full = false;
-    }
-
-    GGML_ASSERT(is_full && "seq_cp() is only supported for full KV buffers");
-
-    // enqueue the copy operation - the buffer copy will be performed during the next update
-    sc_info.ssrc.push_back(s0);
-    sc_info.sdst.push_back(s1);
+    uint32_t i0 = v_cells[s0].size();
+    uint32_t i1 = 0;
 
     v_cells[s1].reset();
     for (uint32_t i = 0; i < v_cells[s0].size(); ++i) {
-        if (v_cells[s0].seq_has(i, seq_id_src)) {
+        if (v_cells[s0].seq_has(i, seq_id_src) && v_cells[s0].pos_in(i, p0, p1)) {
+            i0 = std::min(i0, i);
+            i1 = std::max(i1, i + 1);
+
             llama_pos pos   = v_cells[s0].pos_get(i);
             llama_pos shift = v_cells[s0].get_shift(i);
 
@@ -361,6 +367,14 @@ void llama_kv_cache_unified::seq_cp(llama_seq_id seq_id_src, llama_seq_id seq_id
         }
     }
 
+    // enqueue the copy operation - the buffer copy will be performed during the next update
+    if (i0 < i1) {
+        sc_info.ssrc.push_back(s0);
+        sc_info.sdst.push_back(s1);
+        sc_info.i0.push_back(i0);
+        sc_info.i1.push_back(i1);
+    }
+
     v_heads[s1] = v_heads[s0];
 
     //for (uint32_t s = 0; s < n_stream; ++s) {
@@ -388,6 +402,8 @@ void llama_kv_cache_unified::seq_keep(llama_seq_id seq_id) {
     if (new_head != cells.size() && new_head < head) {
         head = new_head;
     }
+
+    seq_pos_off_sync();
 }
 
 void llama_kv_cache_unified::seq_add(llama_seq_id seq_id, llama_pos p0, llama_pos p1, llama_pos shift) {
@@ -415,6 +431,31 @@ void llama_kv_cache_unified::seq_add(llama_seq_id seq_id, llama_pos p0, llama_po
         return;
     }
 
+    // moving the tail of a sequence back (context shift) does not change the relative positions of its cells,
+    // so instead of rotating all of them, rotate only the cells before the tail (e.g. the attention sinks) forward
+    // and remember the difference for the RoPE positions of the next tokens of the sequence
+    if (can_shift_lazy(seq_id, p0, p1, shift)) {
+        for (uint32_t i = 0; i < cells.size(); ++i) {
+            if (cells.is_empty(i) || !cells.seq_has(i, seq_id)) {
+                continue;
+            }
+
+            if (cells.pos_get(i) < p0) {
+                cells.shift_add(i, -shift);
+            } else {
+                cells.pos_add_no_shift(i, shift);
+            }
+        }
+
+        seq_pos_off[seq_id] -= shift;
+
+        head = 0;
+
+        return;
+    }
+
+    seq_pos_off_clear(seq_id);
+
     for (uint32_t i = 0; i < cells.size(); ++i) {
         if (!cells.pos_in(i, p0, p1)) {
             continue;
@@ -456,6 +497,8 @@ void llama_kv_cache_unified::seq_div(llama_seq_id seq_id, llama_pos p0, llama_po
         return;
     }
 
+    seq_pos_off_clear(seq_id);
+
     for (uint32_t i = 0; i < cells.size(); ++i) {
         if (!cells.pos_in(i, p0, p1)) {
             continue;
@@ -467,6 +510,66 @@ void llama_kv_cache_unified::seq_div(llama_seq_id seq_id, llama_pos p0, llama_po
     }
 }
 
+int32_t llama_kv_cache_unified::seq_compress(llama_seq_id seq_id, llama_pos p0, llama_pos p1, int32_t n_keep) {
+    GGML_ASSERT(seq_id >= 0 && (size_t) seq_id < seq_to_stream.size());
+    GGML_ASSERT(n_keep >= 0);
+
+    if (!has_scores) {
+        return 0;
+    }
+
+    if (p0 < 0) {
+        p0 = 0;
+    }
+
+    if (p1 < 0) {
+        p1 = std::numeric_limits<llama_pos>::max();
+    }
+
+    auto & cells = v_cells[seq_to_stream[seq_id]];
+    auto & head  = v_heads[seq_to_stream[seq_id]];
+
+    const llama_pos pos_max = cells.seq_pos_max(seq_id);
+
+    // the later a token, the fewer queries could attend to it - normalize by their number
+    std::vector<std::pair<float, uint32_t>> cands;
+
+    for (uint32_t i = 0; i < cells.size(); ++i) {
+        if (!cells.pos_in(i, p0, p1) || !cells.seq_has(i, seq_id)) {
+            continue;
+        }
+
+        cands.emplace_back(cells.score_get(i)/(pos_max + 1 - cells.pos_get(i)), i);
+    }
+
+    if ((int32_t) cands.size() <= n_keep) {
+        return 0;
+    }
+
+    std::nth_element(cands.begin(), cands.begin() + n_keep, cands.end(),
+            [](const auto & a, const auto & b) { return a.first > b.first; });
+
+    uint32_t new_head = cells.size();
+
+    for (size_t j = n_keep; j < cands.size(); ++j) {
+        const uint32_t i = cands[j].second;
+
+        if (cells.seq_rm(i, seq_id) && i < new_head) {
+            new_head = i;
+        }
+    }
+
+    if (new_head != cells.size() && new_head < head) {
+        head = new_head;
+    }
+
+    seq_pos_off_sync();
+
+    LLAMA_LOG_DEBUG("%s: seq_id = %d, removed %d of %zu cells in [%d, %d)\n", __func__, seq_id, (int32_t) (cands.size() - n_keep), cands.size(), p0, p1);
+
+    return cands.size() - n_keep;
+}
+
 llama_pos llama_kv_cache_unified::seq_pos_min(llama_seq_id seq_id) const {
     GGML_ASSERT(seq_id >= 0 && (size_t) seq_id < seq_to_stream.size());
 
@@ -483,6 +586,121 @@ llama_pos llama_kv_cache_unified::seq_pos_max(llama_seq_id seq_id) const {
     return cells.seq_pos_max(seq_id);
 }
 
+llama_pos llama_kv_cache_unified::seq_pos_offset(llama_seq_id seq_id) const {
+    GGML_ASSERT(seq_id >= 0 && (size_t) seq_id < seq_to_stream.size());
+
+    return seq_pos_off[seq_id];
+}
+
+bool llama_kv_cache_unified::get_has_pos_offset() const {
+    for (uint32_t s = 0; s < n_seq_max; ++s) {
+        if (seq_pos_off[s] != 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void llama_kv_cache_unified::score_add(const float * data, uint32_t n_kv, const slot_info & sinfo) {
+    for (uint32_t s = sinfo.s0; s <= (uint32_t) sinfo.s1; ++s) {
+        auto & cells = v_cells[s];
+
+        const float * data_s = data + (s - sinfo.s0)*n_kv;
+
+        for (uint32_t i = 0; i < n_kv; ++i) {
+            if (!cells.is_empty(i)) {
+                cells.score_add(i, data_s[i]);
+            }
+        }
+    }
+
+    has_scores = true;
+}
+
+bool llama_kv_cache_unified::can_shift_lazy(llama_seq_id seq_id, llama_pos p0, llama_pos p1, llama_pos shift) const {
+    if (!lazy_shift || shift >= 0 || p0 + shift < 0) {
+        return false;
+    }
+
+    const auto & cells = v_cells[seq_to_stream[seq_id]];
+
+    // the range must be the tail of the sequence
+    if (cells.seq_pos_max(seq_id) >= p1) {
+        return false;
+    }
+
+    // keep the RoPE positions in the range of the cache, the offset is folded back with a full shift from time to time
+    if (seq_pos_off[seq_id] - shift > (llama_pos) cells.size()) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < cells.size(); ++i) {
+        if (cells.is_empty(i) || !cells.seq_has(i, seq_id)) {
+            continue;
+        }
+
+        // the rotation of shared cells would also change the other sequences
+        if (cells.seq_count(i) > 1) {
+            return false;
+        }
+
+        // the tail must not be moved over other cells of the sequence
+        if (cells.pos_in(i, p0 + shift, p0)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void llama_kv_cache_unified::seq_pos_off_clear(llama_seq_id seq_id) {
+    const llama_pos off = seq_pos_off[seq_id];
+    if (off == 0) {
+        return;
+    }
+
+    auto & cells = v_cells[seq_to_stream[seq_id]];
+
+    for (uint32_t i = 0; i < cells.size(); ++i) {
+        if (!cells.is_empty(i) && cells.seq_has(i, seq_id)) {
+            cells.shift_add(i, -off);
+        }
+    }
+
+    seq_pos_off[seq_id] = 0;
+}
+
+void llama_kv_cache_unified::seq_pos_off_sync() {
+    for (uint32_t s = 0; s < n_seq_max; ++s) {
+        if (seq_pos_off[s] != 0 && v_cells[seq_to_stream[s]].seq_pos_min(s) < 0) {
+            seq_pos_off[s] = 0;
+        }
+    }
+}
+
+bool llama_kv_cache_unified::get_shift_range(uint32_t & r0, uint32_t & r1) const {
+    r0 = get_size()*n_stream;
+    r1 = 0;
+
+    for (uint32_t s = 0; s < n_stream; ++s) {
+        const auto & cells = v_cells[s];
+
+        if (!cells.get_has_shift()) {
+            continue;
+        }
+
+        for (uint32_t i = 0; i < cells.size(); ++i) {
+            if (!cells.is_empty(i) && cells.get_shift(i) != 0) {
+                r0 = std::min(r0, s*cells.size() + i);
+                r1 = std::max(r1, s*cells.size() + i + 1);
+            }
+        }
+    }
+
+    return r0 < r1;
+}
+
 llama_memory_context_ptr llama_kv_cache_unified::init_batch(
             llama_batch_allocr & balloc,
             uint32_t n_ubatch,
@@ -530,7 +748,8 @@ llama_memory_context_ptr llama_kv_cache_unified::init_update(llama_context * lct
     defrag_info dinfo;
 
     // see if we need to defrag
-    if (n_stream == 1) {
+    // note: the paged cache keeps the cells of each sequence within its own blocks, so moving cells is not necessary
+    if (n_stream == 1 && n_block == 0) {
         // note : for now do not consider defrag for n_stream > 1
         const auto & cells = v_cells[seq_to_stream[0]];
 
@@ -561,6 +780,43 @@ llama_memory_context_ptr llama_kv_cache_unified::init_update(llama_context * lct
 }
 
 llama_kv_cache_unified::slot_info_vec_t llama_kv_cache_unified::prepare(const std::vector<llama_ubatch> & ubatches) {
+    uint32_t n_used = 0;
+    for (const auto & cells : v_cells) {
+        n_used = std::max(n_used, cells.used_max_p1());
+    }
+
+    // give back the cells that were added on demand once at most a quarter of them are used
+    if (get_size() > size_min && 4*n_used <= get_size()) {
+        const uint32_t size = elastic_size(2*n_used);
+        if (size < get_size()) {
+            resize(size);
+        }
+    }
+
+    auto res = try_prepare(ubatches);
+
+    if (res.empty() && get_size() < size_max) {
+        uint32_t n_tokens = 0;
+        for (const auto & ubatch : ubatches) {
+            n_tokens += ubatch.n_tokens;
+        }
+
+        // grow the cache until the ubatches fit, at once to the room for all their tokens after the used cells
+        const uint32_t size_fit = elastic_size(n_used + n_tokens);
+
+        while (res.empty() && get_size() < size_max) {
+            if (!resize(std::max(size_fit, std::min(2*get_size(), size_max)))) {
+                break;
+            }
+
+            res = try_prepare(ubatches);
+        }
+    }
+
+    return res;
+}
+
+llama_kv_cache_unified::slot_info_vec_t llama_kv_cache_unified::try_prepare(const std::vector<llama_ubatch> & ubatches) {
     llama_kv_cache_unified::slot_info_vec_t res;
 
     struct state_t {
@@ -641,22 +897,58 @@ bool llama_kv_cache_unified::update(llama_context * lctx, bool do_shift, const d
 
         const size_t n_copy = sc_info.ssrc.size();
 
+        const uint32_t kv_size = get_size();
+
+        // views of the copied bytes of the K and V tensors
+        ggml_init_params params = {
+            /*.mem_size   =*/ 4*layers.size()*ggml_tensor_overhead(),
+            /*.mem_buffer =*/ NULL,
+            /*.no_alloc   =*/ true,
+        };
+
         for (size_t i = 0; i < n_copy; ++i) {
             const auto ssrc = sc_info.ssrc[i];
             const auto sdst = sc_info.sdst[i];
 
+            const auto i0 = sc_info.i0[i];
+            const auto i1 = sc_info.i1[i];
+
             assert(ssrc < n_stream);
             assert(sdst < n_stream);
 
-            LLAMA_LOG_DEBUG("%s: copying KV buffer: stream %d to stream %d\n", __func__, ssrc, sdst);
+            LLAMA_LOG_DEBUG("%s: copying KV buffer: stream %d to stream %d, cells [%d, %d)\n", __func__, ssrc, sdst, i0, i1);
 
             assert(ssrc != sdst);
 
+            ggml_context_ptr ctx { ggml_init(params) };
+
+            const auto copy_range = [&](ggml_tensor * src, ggml_tensor * dst, size_t offs, size_t size) {
+                const int64_t ne = size/ggml_type_size(src->type)*ggml_blck_size(src->type);
+
+                ggml_tensor * src_view = ggml_view_1d(ctx.get(), src, ne, offs);
+                ggml_tensor * dst_view = ggml_view_1d(ctx.get(), dst, ne, offs);
+
+                ggml_backend_view_init(src_view);
+                ggml_backend_view_init(dst_view);
+
+                ggml_backend_tensor_copy(src_view, dst_view);
+            };
+
             for (uint32_t il = 0; il < layers.size(); ++il) {
                 const auto & layer = layers[il];
 
-                ggml_backend_tensor_copy(layer.k_stream[ssrc], layer.k_stream[sdst]);
-                ggml_backend_tensor_copy(layer.v_stream[ssrc], layer.v_stream[sdst]);
+                const size_t k_size_row = layer.k_stream[ssrc]->nb[1];
+                copy_range(layer.k_stream[ssrc], layer.k_stream[sdst], i0*k_size_row, (i1 - i0)*k_size_row);
+
+                if (!v_trans) {
+                    const size_t v_size_row = layer.v_stream[ssrc]->nb[1];
+                    copy_range(layer.v_stream[ssrc], layer.v_stream[sdst], i0*v_size_row, (i1 - i0)*v_size_row);
+                } else {
+                    // the cells are columns, copy from the first one of the first row to the last one of the last row
+                    const size_t v_size_el = ggml_type_size(layer.v_stream[ssrc]->type);
+                    const uint32_t n_embd_v_gqa = hparams.n_embd_v_gqa(layer.il);
+                    copy_range(layer.v_stream[ssrc], layer.v_stream[sdst], i0*v_size_el, ((n_embd_v_gqa - 1)*kv_size + i1 - i0)*v_size_el);
+                }
             }
         }
     }
@@ -668,8 +960,11 @@ bool llama_kv_cache_unified::update(llama_context * lctx, bool do_shift, const d
 
         LLAMA_LOG_DEBUG("%s: applying K-shift\n", __func__);
 
+        uint32_t r0;
+        uint32_t r1;
+
         // apply K-shift if needed
-        if (hparams.rope_type != LLAMA_ROPE_TYPE_NONE) {
+        if (hparams.rope_type != LLAMA_ROPE_TYPE_NONE && get_shift_range(r0, r1)) {
             ggml_backend_sched_reset(sched);
 
             auto * res = lctx->get_gf_res_reserve();
@@ -813,6 +1108,14 @@ llama_kv_cache_unified::slot_info llama_kv_cache_unified::find_slot(const llama_
                 }
 
                 LLAMA_LOG_DEBUG("%s: stream[%d] min[%d] = %5d, max[%d] = %5d\n", __func__, stream_id, s, cells.seq_pos_min(s), s, cells.seq_pos_max(s));
+
+                if (n_block > 0) {
+                    std::string ss;
+                    for (const auto ib : seq_blocks(s)) {
+                        ss += std::to_string(ib) + " ";
+                    }
+                    LLAMA_LOG_DEBUG("%s: stream[%d] blocks[%d] = %s\n", __func__, stream_id, s, ss.c_str());
+                }
             }
         }
     }
@@ -861,10 +1164,21 @@ llama_kv_cache_unified::slot_info llama_kv_cache_unified::find_slot(const llama_
         }
 
         if (n_tokens > cells.size()) {
-            LLAMA_LOG_ERROR("%s: n_tokens = %d > size = %u\n", __func__, n_tokens, cells.size());
+            // an elastic cache is grown and the slot is searched again
+            if (cells.size() == size_max) {
+                LLAMA_LOG_ERROR("%s: n_tokens = %d > size = %u\n", __func__, n_tokens, cells.size());
+            }
             return { };
         }
 
+        if (n_block > 0 && !cont) {
+            if (!find_slot_paged(ubatch, seq_to_stream[seq_id], s*n_tokens, n_tokens, res.idxs[s])) {
+                return { };
+            }
+
+            continue;
+        }
+
         uint32_t n_tested = 0;
 
         // for continuous slots, we test that all tokens in the ubatch fit, starting from the current head
@@ -887,32 +1201,7 @@ llama_kv_cache_unified::slot_info llama_kv_cache_unified::find_slot(const llama_
                 //const llama_pos    pos    = ubatch.pos[i];
                 //const llama_seq_id seq_id = ubatch.seq_id[i][0];
 
-                // can we use this cell? either:
-                //  - the cell is empty
-                //  - the cell is occupied only by one sequence:
-                //    - (disabled) mask causally, if the sequence is the same as the one we are inserting
-                //    - mask SWA, using current max pos for that sequence in the cache
-                //                always insert in the cell with minimum pos
-                bool can_use = cells.is_empty(idx);
-
-                if (!can_use && cells.seq_count(idx) == 1) {
-                    const llama_pos pos_cell = cells.pos_get(idx);
-
-                    // (disabled) causal mask
-                    // note: it's better to purge any "future" tokens beforehand
-                    //if (cells.seq_has(idx, seq_id)) {
-                    //    can_use = pos_cell >= pos;
-                    //}
-
-                    if (!can_use) {
-                        const llama_seq_id seq_id_cell = cells.seq_get(idx);
-
-                        // SWA mask
-                        if (is_masked_swa(pos_cell, cells.seq_pos_max(seq_id_cell) + 1)) {
-                            can_use = true;
-                        }
-                    }
-                }
+                const bool can_use = is_cell_free(cells, idx);
 
                 if (can_use) {
                     res.idxs[s].push_back(idx);
@@ -927,23 +1216,194 @@ llama_kv_cache_unified::slot_info llama_kv_cache_unified::find_slot(const llama_
                 break;
             }
 
-            if (cont) {
-                res.idxs[s].clear();
-            }
+            if (cont) {
+                res.idxs[s].clear();
+            }
+
+            if (n_tested >= cells.size()) {
+                //LLAMA_LOG_ERROR("%s: failed to find a slot for %d tokens\n", __func__, n_tokens);
+                return { };
+            }
+        }
+
+        // we didn't find a suitable slot - return empty result
+        if (res.idxs[s].size() < n_tokens) {
+            return { };
+        }
+    }
+
+    assert(res.s1 >= res.s0);
+
+    return res;
+}
+
+bool llama_kv_cache_unified::is_cell_free(const llama_kv_cells_unified & cells, uint32_t idx) const {
+    // can we use this cell? either:
+    //  - the cell is empty
+    //  - the cell is occupied only by one sequence:
+    //    - (disabled) mask causally, if the sequence is the same as the one we are inserting
+    //    - mask SWA, using current max pos for that sequence in the cache
+    //                always insert in the cell with minimum pos
+    if (cells.is_empty(idx)) {
+        return true;
+    }
+
+    if (cells.seq_count(idx) == 1) {
+        const llama_pos pos_cell = cells.pos_get(idx);
+
+        // (disabled) causal mask
+        // note: it's better to purge any "future" tokens beforehand
+        //if (cells.seq_has(idx, seq_id)) {
+        //    can_use = pos_cell >= pos;
+        //}
+
+        const llama_seq_id seq_id_cell = cells.seq_get(idx);
+
+        // SWA mask
+        if (is_masked_swa(pos_cell, cells.seq_pos_max(seq_id_cell) + 1)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool llama_kv_cache_unified::find_slot_paged(const llama_ubatch & ubatch, uint32_t strm, uint32_t i0, uint32_t n_tokens, std::vector<uint32_t> & idxs) const {
+    const auto & cells = v_cells[strm];
+
+    const uint32_t n_cells  = cells.size();
+    const uint32_t n_blocks = (n_cells + n_block - 1)/n_block;
+
+    // owner of each block, based on the cells that are in use
+    //   -1 : the block is empty
+    //   -2 : the block contains tokens shared by multiple sequences
+    std::vector<llama_seq_id> owner(n_blocks, -1);
+
+    for (uint32_t i = 0; i < n_cells; ++i) {
+        if (is_cell_free(cells, i)) {
+            continue;
+        }
+
+        const llama_seq_id seq_id = cells.seq_count(i) == 1 ? cells.seq_get(i) : -2;
+
+        auto & cur = owner[i/n_block];
+        if (cur == -1) {
+            cur = seq_id;
+        } else if (cur != seq_id) {
+            cur = -2;
+        }
+    }
+
+    // cells that have been assigned to previous tokens of the ubatch
+    std::vector<bool> taken(n_cells, false);
+
+    // per-sequence search position in the owned blocks
+    std::map<llama_seq_id, uint32_t> seq_next;
+
+    uint32_t next_empty = 0;
+    uint32_t next_any   = 0;
+
+    for (uint32_t i = i0; i < i0 + n_tokens; ++i) {
+        const llama_seq_id seq_id = ubatch.n_seq_id[i] == 1 ? ubatch.seq_id[i][0] : -2;
+
+        uint32_t & c = seq_next[seq_id];
+
+        int32_t idx = -1;
+
+        while (idx < 0) {
+            // look for a free cell in the blocks already owned by the sequence
+            while (c < n_cells) {
+                if (owner[c/n_block] != seq_id) {
+                    c = (c/n_block + 1)*n_block;
+                    continue;
+                }
+
+                if (!taken[c] && is_cell_free(cells, c)) {
+                    idx = c++;
+                    break;
+                }
+
+                c++;
+            }
+
+            if (idx >= 0) {
+                break;
+            }
+
+            // claim a new empty block for the sequence
+            while (next_empty < n_blocks && owner[next_empty] != -1) {
+                next_empty++;
+            }
+
+            if (next_empty == n_blocks) {
+                break;
+            }
+
+            owner[next_empty] = seq_id;
+            c = next_empty*n_block;
+        }
+
+        if (idx < 0) {
+            // no empty blocks left - fallback to any free cell
+            while (next_any < n_cells && (taken[next_any] || !is_cell_free(cells, next_any))) {
+                next_any++;
+            }
+
+            if (next_any == n_cells) {
+                return false;
+            }
+
+            LLAMA_LOG_DEBUG("%s: no empty blocks left, placing token of seq %d in shared block %u\n", __func__, seq_id, next_any/n_block);
+
+            idx = next_any++;
+        }
+
+        taken[idx] = true;
+        idxs.push_back(idx);
+    }
+
+    return true;
+}
+
+std::vector<uint32_t> llama_kv_cache_unified::seq_blocks(llama_seq_id seq_id) const {
+    GGML_ASSERT(seq_id >= 0 && (size_t) seq_id < seq_to_stream.size());
+
+    std::vector<uint32_t> res;
+
+    if (n_block == 0) {
+        return res;
+    }
+
+    const auto & cells = v_cells[seq_to_stream[seq_id]];
+
+    // min position of the sequence in each block
+    std::map<uint32_t, llama_pos> block_pos;
 
-            if (n_tested >= cells.size()) {
-                //LLAMA_LOG_ERROR("%s: failed to find a slot for %d tokens\n", __func__, n_tokens);
-                return { };
-            }
+    for (uint32_t i = 0; i < cells.size(); ++i) {
+        if (cells.is_empty(i) || !cells.seq_has(i, seq_id)) {
+            continue;
         }
 
-        // we didn't find a suitable slot - return empty result
-        if (res.idxs[s].size() < n_tokens) {
-            return { };
+        const uint32_t ib = i/n_block;
+        const llama_pos pos = cells.pos_get(i);
+
+        auto it = block_pos.find(ib);
+        if (it == block_pos.end()) {
+            block_pos[ib] = pos;
+        } else {
+            it->second = std::min(it->second, pos);
         }
     }
 
-    assert(res.s1 >= res.s0);
+    std::vector<std::pair<llama_pos, uint32_t>> tmp;
+    for (const auto & it : block_pos) {
+        tmp.emplace_back(it.second, it.first);
+    }
+    std::sort(tmp.begin(), tmp.end());
+
+    for (const auto & it : tmp) {
+        res.push_back(it.second);
+    }
 
     return res;
 }
@@ -980,6 +1440,9 @@ void llama_kv_cache_unified::apply_ubatch(const slot_info & sinfo, const llama_u
             cells.pos_set(idx, ubatch.pos[i]);
 
             for (int32_t s = 0; s < ubatch.n_seq_id[i]; s++) {
+                // the cell has a single RoPE position for all its sequences
+                GGML_ASSERT(seq_pos_off[ubatch.seq_id[i][s]] == seq_pos_off[ubatch.seq_id[i][0]]);
+
                 cells.seq_add(idx, ubatch.seq_id[i][s]);
             }
         }
@@ -1017,16 +1480,34 @@ bool llama_kv_cache_unified::get_can_shift() const {
     return true;
 }
 
+void llama_kv_cache_unified::get_n_cells(uint32_t & n_used, uint32_t & n_extent) const {
+    n_used   = 0;
+    n_extent = 0;
+
+    for (const auto & cells : v_cells) {
+        n_used   += cells.get_used();
+        n_extent += cells.used_max_p1();
+    }
+}
+
 uint32_t llama_kv_cache_unified::get_size() const {
     const auto & cells = v_cells[seq_to_stream[0]];
 
     return cells.size();
 }
 
+uint32_t llama_kv_cache_unified::get_size_max() const {
+    return size_max;
+}
+
 uint32_t llama_kv_cache_unified::get_n_stream() const {
     return n_stream;
 }
 
+uint32_t llama_kv_cache_unified::get_n_resize() const {
+    return n_resize;
+}
+
 bool llama_kv_cache_unified::get_has_shift() const {
     bool result = false;
 
@@ -1037,13 +1518,32 @@ bool llama_kv_cache_unified::get_has_shift() const {
     return result;
 }
 
-uint32_t llama_kv_cache_unified::get_n_kv() const {
+uint32_t llama_kv_cache_unified::get_n_kv(const llama_ubatch & ubatch, const slot_info & sinfo) const {
+    llama_kv_cells_unified::seq_set_t seqs;
+
+    for (uint32_t s = 0; s < ubatch.n_seqs_unq; ++s) {
+        seqs.set(ubatch.seq_id_unq[s]);
+    }
+
     uint32_t result = 0;
 
-    for (uint32_t s = 0; s < n_stream; ++s) {
-        const auto & cells = v_cells[s];
+    for (uint32_t s = 0; s < sinfo.n_stream(); ++s) {
+        const auto & cells = v_cells[sinfo.strm[s]];
+
+        uint32_t n_kv = std::max(n_pad, GGML_PAD(cells.used_max_p1(seqs), n_pad));
+
+        if (n_kv_buckets) {
+            // round up to a multiple of a quarter of the largest power of 2 below n_kv, so n_kv changes only
+            // ~4 times per doubling of the context and the graph can be reused in between
+            // the extra cells are masked, so at most ~25% of attention work is spent on them
+            uint32_t p2 = 1;
+            while (2*p2 <= n_kv) {
+                p2 *= 2;
+            }
+            n_kv = GGML_PAD(n_kv, std::max(n_pad, p2/4));
+        }
 
-        result = std::max(std::min(cells.size(), std::max(n_pad, GGML_PAD(cells.used_max_p1(), n_pad))), result);
+        result = std::max(std::min(cells.size(), n_kv), result);
     }
 
     return result;
@@ -1358,6 +1858,132 @@ void llama_kv_cache_unified::set_input_kq_mask(ggml_tensor * dst, const llama_ub
     }
 }
 
+ggml_tensor * llama_kv_cache_unified::build_input_kq_mask(ggml_context * ctx, const llama_ubatch & ubatch, uint32_t n_kv, bool causal_attn, llm_graph_kq_mask_inputs & inp) const {
+    if (!device_mask) {
+        return nullptr;
+    }
+
+    const int64_t n_stream_ub = n_stream == 1 ? 1 : ubatch.n_seqs_unq;
+    const int64_t n_seq       = std::max<int64_t>(1, ubatch.n_seqs_unq/n_stream_ub);
+    const int64_t n_tps_pad   = GGML_PAD(ubatch.n_tokens/n_stream_ub, GGML_KQ_MASK_PAD);
+
+    inp.pos_cells = ggml_new_tensor_4d(ctx, GGML_TYPE_F32, n_kv,  1,         1, n_stream_ub);
+    inp.seq_cells = ggml_new_tensor_4d(ctx, GGML_TYPE_F32, n_seq, n_kv,      1, n_stream_ub);
+    inp.pos_toks  = ggml_new_tensor_4d(ctx, GGML_TYPE_F32, 1,     n_tps_pad, 1, n_stream_ub);
+    inp.seq_toks  = ggml_new_tensor_4d(ctx, GGML_TYPE_F32, n_seq, n_tps_pad, 1, n_stream_ub);
+
+    ggml_set_input(inp.pos_cells);
+    ggml_set_input(inp.seq_cells);
+    ggml_set_input(inp.pos_toks);
+    ggml_set_input(inp.seq_toks);
+
+    // 1.0 where the cell and the token share a sequence, 0.0 otherwise (including the empty cells and the padding)
+    ggml_tensor * vis = ggml_mul_mat(ctx, inp.seq_cells, inp.seq_toks); // [n_kv, n_tps_pad, 1, n_stream]
+
+    // p1 - p0: the distance from the cell to the token
+    ggml_tensor * dist = ggml_sub(ctx, ggml_repeat(ctx, inp.pos_toks, vis), inp.pos_cells);
+
+    // mask future tokens: p0 > p1
+    if (causal_attn) {
+        vis = ggml_mul(ctx, vis, ggml_step(ctx, ggml_scale_bias(ctx, dist, 1.0f, 0.5f)));
+    }
+
+    // mask the cells out of the window: p1 - p0 >= n_swa
+    if (swa_type == LLAMA_SWA_TYPE_STANDARD) {
+        vis = ggml_mul(ctx, vis, ggml_step(ctx, ggml_scale_bias(ctx, dist, -1.0f, n_swa - 0.5f)));
+    }
+
+    // log(1) = 0, log(0) = -INF
+    ggml_tensor * mask = ggml_log(ctx, vis);
+
+    if (hparams.use_alibi) {
+        mask = ggml_sub(ctx, mask, ggml_abs(ctx, dist));
+    }
+
+    return mask;
+}
+
+void llama_kv_cache_unified::set_input_kq_mask_inputs(const llm_graph_kq_mask_inputs & inp, const llama_ubatch * ubatch) const {
+    GGML_ASSERT(ggml_backend_buffer_is_host(inp.pos_cells->buffer));
+    GGML_ASSERT(ggml_backend_buffer_is_host(inp.seq_cells->buffer));
+    GGML_ASSERT(ggml_backend_buffer_is_host(inp.pos_toks->buffer));
+    GGML_ASSERT(ggml_backend_buffer_is_host(inp.seq_toks->buffer));
+
+    const int64_t n_kv      = inp.pos_cells->ne[0];
+    const int64_t n_seq     = inp.seq_cells->ne[0];
+    const int64_t n_tps_pad = inp.pos_toks->ne[1];
+    const int64_t n_stream  = inp.pos_cells->ne[3]; // num streams in the current ubatch
+
+    GGML_ASSERT(ubatch->n_tokens%n_stream == 0);
+
+    const int64_t n_tps = ubatch->n_tokens/n_stream;
+
+    float * pos_cells = (float *) inp.pos_cells->data;
+    float * seq_cells = (float *) inp.seq_cells->data;
+    float * pos_toks  = (float *) inp.pos_toks->data;
+    float * seq_toks  = (float *) inp.seq_toks->data;
+
+    std::fill(pos_cells, pos_cells + ggml_nelements(inp.pos_cells), 0.0f);
+    std::fill(seq_cells, seq_cells + ggml_nelements(inp.seq_cells), 0.0f);
+    std::fill(pos_toks,  pos_toks  + ggml_nelements(inp.pos_toks),  0.0f);
+    std::fill(seq_toks,  seq_toks  + ggml_nelements(inp.seq_toks),  0.0f);
+
+    // the index of the sequences of the stream in the rows of seq_cells and seq_toks
+    std::vector<int32_t> seq_idx(LLAMA_MAX_SEQ, -1);
+    std::vector<llama_seq_id> seqs;
+
+    for (int64_t s = 0; s < n_stream; ++s) {
+        seqs.clear();
+
+        // same as set_input_kq_mask(): only the first sequence of a token is used
+        for (int64_t ii = 0; ii < n_tps; ++ii) {
+            const int64_t i = s*n_tps + ii;
+
+            const llama_seq_id seq_id = ubatch->seq_id[i][0];
+
+            if (seq_idx[seq_id] < 0) {
+                GGML_ASSERT((int64_t) seqs.size() < n_seq);
+
+                seq_idx[seq_id] = seqs.size();
+                seqs.push_back(seq_id);
+            }
+
+            pos_toks[s*n_tps_pad + ii] = ubatch->pos[i];
+            seq_toks[(s*n_tps_pad + ii)*n_seq + seq_idx[seq_id]] = 1.0f;
+        }
+
+        const auto & cells = v_cells[seq_to_stream[ubatch->seq_id[s*n_tps][0]]];
+
+        for (int64_t j = 0; j < n_kv; ++j) {
+            if (cells.is_empty(j)) {
+                continue;
+            }
+
+            pos_cells[s*n_kv + j] = cells.pos_get(j);
+
+            float * dst = seq_cells + (s*n_kv + j)*n_seq;
+
+            if (cells.seq_count(j) == 1) {
+                const int32_t k = seq_idx[cells.seq_get(j)];
+                if (k >= 0) {
+                    dst[k] = 1.0f;
+                }
+                continue;
+            }
+
+            for (size_t k = 0; k < seqs.size(); ++k) {
+                if (cells.seq_has(j, seqs[k])) {
+                    dst[k] = 1.0f;
+                }
+            }
+        }
+
+        for (const llama_seq_id seq_id : seqs) {
+            seq_idx[seq_id] = -1;
+        }
+    }
+}
+
 void llama_kv_cache_unified::set_input_pos_bucket(ggml_tensor * dst, const llama_ubatch * ubatch) const {
     const int64_t n_tokens = ubatch->n_tokens;
 
@@ -1383,6 +2009,172 @@ void llama_kv_cache_unified::set_input_pos_bucket(ggml_tensor * dst, const llama
     }
 }
 
+bool llama_kv_cache_unified::alloc_tensors(uint32_t size, std::vector<ggml_context_ptr> & ctxs_new, std::vector<ggml_backend_buffer_ptr> & bufs_new, std::vector<kv_layer> & layers_new) const {
+    // create a context for each buffer type
+    std::map<ggml_backend_buffer_type_t, ggml_context *> ctx_map;
+    auto ctx_for_buft = [&](ggml_backend_buffer_type_t buft) -> ggml_context * {
+        auto it = ctx_map.find(buft);
+        if (it == ctx_map.end()) {
+            ggml_init_params params = {
+                /*.mem_size   =*/ size_t(2u*(1 + n_stream)*layers_new.size()*ggml_tensor_overhead()),
+                /*.mem_buffer =*/ NULL,
+                /*.no_alloc   =*/ true,
+            };
+
+            ggml_context * ctx = ggml_init(params);
+            if (!ctx) {
+                return nullptr;
+            }
+
+            ctx_map[buft] = ctx;
+            ctxs_new.emplace_back(ctx);
+
+            return ctx;
+        }
+
+        return it->second;
+    };
+
+    for (auto & layer : layers_new) {
+        const uint32_t il = layer.il;
+
+        // [TAG_V_CACHE_VARIABLE]
+        const uint32_t n_embd_k_gqa =            hparams.n_embd_k_gqa(il);
+        const uint32_t n_embd_v_gqa = !v_trans ? hparams.n_embd_v_gqa(il) : hparams.n_embd_v_gqa_max();
+
+        ggml_context * ctx = ctx_for_buft(layer.buft);
+        if (!ctx) {
+            LLAMA_LOG_ERROR("%s: failed to create ggml context for kv cache\n", __func__);
+            return false;
+        }
+
+        layer.k = ggml_new_tensor_3d(ctx, layer.type_k, n_embd_k_gqa, size, n_stream);
+        layer.v = ggml_new_tensor_3d(ctx, layer.type_v, n_embd_v_gqa, size, n_stream);
+
+        ggml_format_name(layer.k, "cache_k_l%d", il);
+        ggml_format_name(layer.v, "cache_v_l%d", il);
+
+        layer.k_stream.clear();
+        layer.v_stream.clear();
+
+        for (uint32_t s = 0; s < n_stream; ++s) {
+            layer.k_stream.push_back(ggml_view_2d(ctx, layer.k, n_embd_k_gqa, size, layer.k->nb[1], s*layer.k->nb[2]));
+            layer.v_stream.push_back(ggml_view_2d(ctx, layer.v, n_embd_v_gqa, size, layer.v->nb[1], s*layer.v->nb[2]));
+        }
+    }
+
+    // allocate tensors and initialize the buffers to avoid NaNs in the padding
+    for (auto it : ctx_map) {
+        auto * buft = it.first;
+        auto * ctx  = it.second;
+
+        ggml_backend_buffer_t buf = ggml_backend_alloc_ctx_tensors_from_buft(ctx, buft);
+        if (!buf) {
+            return false;
+        }
+
+        ggml_backend_buffer_clear(buf, 0);
+        bufs_new.emplace_back(buf);
+    }
+
+    return true;
+}
+
+bool llama_kv_cache_unified::resize(uint32_t size) {
+    const uint32_t size_old = get_size();
+
+    if (size == size_old) {
+        return true;
+    }
+
+    uint32_t n_keep = 0;
+    for (const auto & cells : v_cells) {
+        n_keep = std::max(n_keep, cells.used_max_p1());
+    }
+
+    GGML_ASSERT(n_keep <= size);
+
+    std::vector<ggml_context_ptr>        ctxs_new;
+    std::vector<ggml_backend_buffer_ptr> bufs_new;
+    std::vector<kv_layer>                layers_new = layers;
+
+    if (!alloc_tensors(size, ctxs_new, bufs_new, layers_new)) {
+        LLAMA_LOG_WARN("%s: failed to allocate the KV cache for %u cells\n", __func__, size);
+        return false;
+    }
+
+    // copy the cells [0, n_keep) of each stream through host memory
+    if (n_keep > 0) {
+        std::vector<uint8_t> buf_src;
+        std::vector<uint8_t> buf_dst;
+
+        for (size_t il = 0; il < layers.size(); ++il) {
+            const auto & layer     = layers[il];
+            const auto & layer_new = layers_new[il];
+
+            for (uint32_t s = 0; s < n_stream; ++s) {
+                // one row per cell
+                const size_t k_size = n_keep*layer.k->nb[1];
+
+                buf_src.resize(k_size);
+                ggml_backend_tensor_get(layer.k,     buf_src.data(), s*layer.k->nb[2],     k_size);
+                ggml_backend_tensor_set(layer_new.k, buf_src.data(), s*layer_new.k->nb[2], k_size);
+
+                if (!v_trans) {
+                    const size_t v_size = n_keep*layer.v->nb[1];
+
+                    buf_src.resize(v_size);
+                    ggml_backend_tensor_get(layer.v,     buf_src.data(), s*layer.v->nb[2],     v_size);
+                    ggml_backend_tensor_set(layer_new.v, buf_src.data(), s*layer_new.v->nb[2], v_size);
+                } else {
+                    // one row per embedding element, the row stride changes with the number of cells
+                    const size_t v_el = ggml_element_size(layer.v);
+                    const auto   n_embd_v_gqa = layer.v->ne[0];
+
+                    buf_src.resize(layer.v->nb[2]);
+                    buf_dst.assign(layer_new.v->nb[2], 0);
+
+                    ggml_backend_tensor_get(layer.v, buf_src.data(), s*layer.v->nb[2], buf_src.size());
+
+                    for (int64_t j = 0; j < n_embd_v_gqa; ++j) {
+                        memcpy(buf_dst.data() + j*size*v_el, buf_src.data() + j*size_old*v_el, n_keep*v_el);
+                    }
+
+                    ggml_backend_tensor_set(layer_new.v, buf_dst.data(), s*layer_new.v->nb[2], buf_dst.size());
+                }
+            }
+        }
+    }
+
+    ctxs   = std::move(ctxs_new);
+    bufs   = std::move(bufs_new);
+    layers = std::move(layers_new);
+
+    for (uint32_t s = 0; s < n_stream; ++s) {
+        v_cells[s].resize_keep(size);
+
+        if (v_heads[s] >= size) {
+            v_heads[s] = 0;
+        }
+    }
+
+    n_resize++;
+
+    LLAMA_LOG_INFO("%s: %u -> %u cells, %u cells kept, %.2f MiB\n", __func__, size_old, size, n_keep, total_size()/1024.0/1024.0);
+
+    return true;
+}
+
+uint32_t llama_kv_cache_unified::elastic_size(uint32_t n) const {
+    uint32_t size = size_min;
+
+    while (size < n && size < size_max) {
+        size *= 2;
+    }
+
+    return std::min(size, size_max);
+}
+
 size_t llama_kv_cache_unified::total_size() const {
     size_t size = 0;
 
@@ -1497,6 +2289,17 @@ ggml_cgraph * llama_kv_cache_unified::build_graph_shift(llm_graph_result * res,
 
     const auto & cparams = lctx->get_cparams();
 
+    // rotate only the cells in the range of the shifted cells
+    // with a lazy shift these are just the cells before the shifted tail of the sequence
+    uint32_t r0;
+    uint32_t r1;
+    if (!get_shift_range(r0, r1)) {
+        r0 = 0;
+        r1 = get_size()*n_stream;
+    }
+
+    ggml_tensor * k_shift = ggml_view_1d(ctx, inp->k_shift, r1 - r0, r0*ggml_element_size(inp->k_shift));
+
     for (const auto & layer : layers) {
         const uint32_t il = layer.il;
 
@@ -1510,12 +2313,12 @@ ggml_cgraph * llama_kv_cache_unified::build_graph_shift(llm_graph_result * res,
 
         ggml_tensor * k =
             ggml_view_3d(ctx, layer.k,
-                n_embd_head_k, n_head_kv, get_size()*n_stream,
+                n_embd_head_k, n_head_kv, r1 - r0,
                 ggml_row_size(layer.k->type, n_embd_head_k),
                 ggml_row_size(layer.k->type, n_embd_k_gqa),
-                0);
+                ggml_row_size(layer.k->type, n_embd_k_gqa)*r0);
 
-        ggml_tensor * cur = build_rope_shift(cparams, ctx, k, inp->k_shift, rope_factors, freq_base_l, freq_scale_l);
+        ggml_tensor * cur = build_rope_shift(cparams, ctx, k, k_shift, rope_factors, freq_base_l, freq_scale_l);
 
         ggml_build_forward_expand(gf, cur);
     }
@@ -1828,7 +2631,9 @@ bool llama_kv_cache_unified::is_masked_swa(llama_pos p0, llama_pos p1) const {
     return false;
 }
 
-void llama_kv_cache_unified::state_write(llama_io_write_i & io, llama_seq_id seq_id) const {
+void llama_kv_cache_unified::state_write(llama_io_write_i & io, llama_seq_id seq_id, llama_pos p0, llama_pos p1, llama_state_seq_flags flags) const {
+    GGML_UNUSED(flags);
+
     io.write(&n_stream, sizeof(n_stream));
 
     for (uint32_t s = 0; s < n_stream; ++s) {
@@ -1843,7 +2648,7 @@ void llama_kv_cache_unified::state_write(llama_io_write_i & io, llama_seq_id seq
         uint32_t cell_range_begin = cells.size();
 
         for (uint32_t i = 0; i < cells.size(); ++i) {
-            if (!cells.is_empty(i) && (seq_id == -1 || cells.seq_has(i, seq_id))) {
+            if (!cells.is_empty(i) && (seq_id == -1 || cells.seq_has(i, seq_id)) && cells.pos_get(i) >= p0 && (p1 < 0 || cells.pos_get(i) < p1)) {
                 ++cell_count;
                 if (cell_range_begin == cells.size()) {
                     cell_range_begin = i;
@@ -1874,14 +2679,42 @@ void llama_kv_cache_unified::state_write(llama_io_write_i & io, llama_seq_id seq
             continue;
         }
 
+        // the RoPE position offsets of the written sequences
+        {
+            std::vector<std::pair<llama_seq_id, llama_pos>> offs;
+            for (llama_seq_id cur = 0; cur < (int) n_seq_max; ++cur) {
+                if ((seq_id == -1 || cur == seq_id) && seq_to_stream[cur] == s && seq_pos_off[cur] != 0) {
+                    offs.emplace_back(cur, seq_pos_off[cur]);
+                }
+            }
+
+            const uint32_t n_off = offs.size();
+            io.write(&n_off, sizeof(n_off));
+
+            for (const auto & off : offs) {
+                io.write(&off.first,  sizeof(off.first));
+                io.write(&off.second, sizeof(off.second));
+            }
+        }
+
         state_write_meta(io, cr, seq_id);
         state_write_data(io, cr);
     }
 }
 
-void llama_kv_cache_unified::state_read(llama_io_read_i & io, llama_seq_id seq_id) {
+void llama_kv_cache_unified::state_read(llama_io_read_i & io, llama_seq_id seq_id, bool append, llama_pos shift, llama_state_seq_flags flags) {
+    GGML_UNUSED(flags);
+
     GGML_ASSERT(seq_id == -1 || (seq_id >= 0 && (size_t) seq_id < seq_to_stream.size()));
 
+    if (append && seq_id == -1) {
+        throw std::runtime_error("appending requires a destination sequence");
+    }
+
+    if (shift != 0 && !append) {
+        throw std::runtime_error("moving the cells requires appending");
+    }
+
     uint32_t n_stream_cur;
     io.read_to(&n_stream_cur, sizeof(n_stream_cur));
     if (n_stream_cur != n_stream) {
@@ -1898,15 +2731,53 @@ void llama_kv_cache_unified::state_read(llama_io_read_i & io, llama_seq_id seq_i
 
         const uint32_t strm = seq_id == -1 ? s : seq_to_stream[seq_id];
 
+        std::vector<std::pair<llama_seq_id, llama_pos>> offs;
+        {
+            uint32_t n_off;
+            io.read_to(&n_off, sizeof(n_off));
+
+            for (uint32_t i = 0; i < n_off; ++i) {
+                llama_seq_id off_seq_id;
+                llama_pos    off;
+                io.read_to(&off_seq_id, sizeof(off_seq_id));
+                io.read_to(&off,        sizeof(off));
+
+                offs.emplace_back(seq_id == -1 ? off_seq_id : seq_id, off);
+            }
+        }
+
+        // the appended cells are rotated to the RoPE positions of the destination sequence instead
+        llama_pos off_src = 0;
+        if (append) {
+            for (const auto & off : offs) {
+                off_src += off.second;
+            }
+            offs.clear();
+        }
+
+        llama_pos pos_first = -1;
+
         bool res = true;
-        res = res && state_read_meta(io, strm, cell_count, seq_id);
+        res = res && state_read_meta(io, strm, cell_count, seq_id, append, shift, off_src, &pos_first);
         res = res && state_read_data(io, strm, cell_count);
 
+        for (const auto & off : offs) {
+            if (off.first < 0 || (uint32_t) off.first >= n_seq_max) {
+                LLAMA_LOG_ERROR("%s: invalid seq_id, %d is out of range [0, %u)\n", __func__, off.first, n_seq_max);
+                res = false;
+                break;
+            }
+            seq_pos_off[off.first] = off.second;
+        }
+
         if (!res) {
             if (seq_id == -1) {
                 clear(true);
-            } else {
+            } else if (!append) {
                 seq_rm(seq_id, -1, -1);
+            } else if (pos_first >= 0) {
+                // the earlier cells of the sequence are kept
+                seq_rm(seq_id, pos_first, -1);
             }
             throw std::runtime_error("failed to restore kv cache");
         }
@@ -2036,13 +2907,15 @@ void llama_kv_cache_unified::state_write_data(llama_io_write_i & io, const cell_
     }
 }
 
-bool llama_kv_cache_unified::state_read_meta(llama_io_read_i & io, uint32_t strm, uint32_t cell_count, llama_seq_id dest_seq_id) {
+bool llama_kv_cache_unified::state_read_meta(llama_io_read_i & io, uint32_t strm, uint32_t cell_count, llama_seq_id dest_seq_id, bool append, llama_pos shift, llama_pos off_src, llama_pos * pos_first) {
     auto & cells = v_cells[strm];
     auto & head  = v_heads[strm];
 
     if (dest_seq_id != -1) {
         // single sequence
-        seq_rm(dest_seq_id, -1, -1);
+        if (!append) {
+            seq_rm(dest_seq_id, -1, -1);
+        }
 
         llama_batch_allocr balloc(hparams.n_pos_per_embd());
 
@@ -2068,12 +2941,45 @@ bool llama_kv_cache_unified::state_read_meta(llama_io_read_i & io, uint32_t strm
                 io.read_to(&seq_id, sizeof(seq_id));
             }
 
-            ubatch.pos[i]      = pos;
+            if (pos + shift < 0) {
+                LLAMA_LOG_ERROR("%s: invalid shift %d for the cell at position %d\n", __func__, shift, pos);
+                return false;
+            }
+
+            ubatch.pos[i]      = pos + shift;
             ubatch.n_seq_id[i] = n_seq_id;
             ubatch.seq_id[i]   = &dest_seq_id;
         }
 
-        const auto sinfo = find_slot(ubatch, true);
+        llama_pos rot = 0;
+
+        if (append) {
+            // the appended cells replace any existing cells at the same or later positions
+            seq_rm(dest_seq_id, ubatch.pos[0], -1);
+
+            if (pos_first) {
+                *pos_first = ubatch.pos[0];
+            }
+
+            // the K data was computed at the RoPE positions pos + off_src of the saved sequence
+            rot = shift + seq_pos_off[dest_seq_id] - off_src;
+            if (rot != 0 && !get_can_shift()) {
+                LLAMA_LOG_ERROR("%s: the cells cannot be moved to other positions\n", __func__);
+                return false;
+            }
+        }
+
+        auto sinfo = find_slot(ubatch, true);
+
+        // grow the cache until the cells fit
+        while (sinfo.empty() && get_size() < size_max) {
+            if (!resize(std::max(elastic_size(cells.used_max_p1() + cell_count), std::min(2*get_size(), size_max)))) {
+                break;
+            }
+
+            sinfo = find_slot(ubatch, true);
+        }
+
         if (sinfo.empty()) {
             LLAMA_LOG_ERROR("%s: failed to find available cells in kv cache\n", __func__);
             return false;
@@ -2095,16 +3001,28 @@ bool llama_kv_cache_unified::state_read_meta(llama_io_read_i & io, uint32_t strm
         GGML_ASSERT(cells.pos_get(head_cur + cell_count - 1) == ubatch.pos[cell_count - 1]);
         GGML_ASSERT(cells.seq_has(head_cur,                  dest_seq_id));
         GGML_ASSERT(cells.seq_has(head_cur + cell_count - 1, dest_seq_id));
+
+        // the K-shift on the next update rotates the cells to their new positions
+        if (rot != 0) {
+            for (uint32_t i = 0; i < cell_count; ++i) {
+                cells.shift_add(head_cur + i, rot);
+            }
+        }
     } else {
         // whole KV cache restore
 
-        if (cell_count > cells.size()) {
+        if (cell_count > size_max) {
             LLAMA_LOG_ERROR("%s: not enough cells in kv cache\n", __func__);
             return false;
         }
 
         clear(true);
 
+        if (cell_count > cells.size() && !resize(elastic_size(cell_count))) {
+            LLAMA_LOG_ERROR("%s: not enough cells in kv cache\n", __func__);
+            return false;
+        }
+
         for (uint32_t i = 0; i < cell_count; ++i) {
             llama_pos pos;
             uint32_t  n_seq_id;
@@ -2333,7 +3251,7 @@ bool llama_kv_cache_unified_context::apply() {
 
     kv->apply_ubatch(sinfos[i_cur], ubatches[i_cur]);
 
-    n_kv = kv->get_n_kv();
+    n_kv = kv->get_n_kv(ubatches[i_cur], sinfos[i_cur]);
 
     return true;
 }
@@ -2352,10 +3270,28 @@ uint32_t llama_kv_cache_unified_context::get_n_kv() const {
     return n_kv;
 }
 
+uint32_t llama_kv_cache_unified_context::get_n_resize() const {
+    return kv->get_n_resize();
+}
+
 bool llama_kv_cache_unified_context::get_supports_set_rows() const {
     return kv->get_supports_set_rows();
 }
 
+llama_pos llama_kv_cache_unified_context::get_pos_offset(llama_seq_id seq_id) const {
+    return kv->seq_pos_offset(seq_id);
+}
+
+bool llama_kv_cache_unified_context::get_has_pos_offset() const {
+    return kv->get_has_pos_offset();
+}
+
+void llama_kv_cache_unified_context::score_add(const float * data, uint32_t n_kv) const {
+    GGML_ASSERT((int32_t) n_kv == this->n_kv);
+
+    kv->score_add(data, n_kv, sinfos[i_cur]);
+}
+
 ggml_tensor * llama_kv_cache_unified_context::get_k(ggml_context * ctx, int32_t il) const {
     return kv->get_k(ctx, il, n_kv, sinfos[i_cur]);
 }
@@ -2396,6 +3332,14 @@ void llama_kv_cache_unified_context::set_input_kq_mask(ggml_tensor * dst, const
     kv->set_input_kq_mask(dst, ubatch, causal_attn);
 }
 
+ggml_tensor * llama_kv_cache_unified_context::build_input_kq_mask(ggml_context * ctx, const llama_ubatch & ubatch, bool causal_attn, llm_graph_kq_mask_inputs & inp) const {
+    return kv->build_input_kq_mask(ctx, ubatch, n_kv, causal_attn, inp);
+}
+
+void llama_kv_cache_unified_context::set_input_kq_mask_inputs(const llm_graph_kq_mask_inputs & inp, const llama_ubatch * ubatch) const {
+    kv->set_input_kq_mask_inputs(inp, ubatch);
+}
+
 void llama_kv_cache_unified_context::set_input_pos_bucket(ggml_tensor * dst, const llama_ubatch * ubatch) const {
     kv->set_input_pos_bucket(dst, ubatch);
 }
@@ -43,6 +43,10 @@ public:
 
         std::vector<uint32_t> ssrc;
         std::vector<uint32_t> sdst;
+
+        // range of cells to copy
+        std::vector<uint32_t> i0;
+        std::vector<uint32_t> i1;
     };
 
     // for each ubatch, create a slot_info that contains information about where the ubatch should be inserted in the
@@ -97,6 +101,8 @@ public:
               layer_filter_cb && filter,
                     ggml_type    type_k,
                     ggml_type    type_v,
+                     uint32_t    n_layer_f16,
+   ggml_backend_buffer_type_t    buft_cpu, // buffer type of the layers in host memory, nullptr for the CPU buffer type
                          bool    v_trans,
                          bool    offload,
                          bool    unified,
@@ -123,6 +129,8 @@ public:
 
     bool get_can_shift() const override;
 
+    void get_n_cells(uint32_t & n_used, uint32_t & n_extent) const override;
+
     void clear(bool data) override;
 
     bool seq_rm  (llama_seq_id seq_id,                              llama_pos p0, llama_pos p1) override;
@@ -131,28 +139,47 @@ public:
     void seq_add (llama_seq_id seq_id,                              llama_pos p0, llama_pos p1, llama_pos shift) override;
     void seq_div (llama_seq_id seq_id,                              llama_pos p0, llama_pos p1, int d) override;
 
+    int32_t seq_compress(llama_seq_id seq_id, llama_pos p0, llama_pos p1, int32_t n_keep) override;
+
     llama_pos seq_pos_min(llama_seq_id seq_id) const override;
     llama_pos seq_pos_max(llama_seq_id seq_id) const override;
 
     // state write/load
 
-    void state_write(llama_io_write_i & io, llama_seq_id seq_id = -1) const override;
-    void state_read (llama_io_read_i  & io, llama_seq_id seq_id = -1)       override;
+    void state_write(llama_io_write_i & io, llama_seq_id seq_id = -1, llama_pos p0 = -1, llama_pos p1 = -1, llama_state_seq_flags flags = 0) const override;
+    void state_read (llama_io_read_i  & io, llama_seq_id seq_id = -1, bool append = false, llama_pos shift = 0, llama_state_seq_flags flags = 0)  override;
 
     //
     // llama_kv_cache_unified specific API
     //
 
     uint32_t get_size()     const;
+    uint32_t get_size_max() const;
     uint32_t get_n_stream() const;
 
+    // incremented each time the K/V tensors are reallocated, see LLAMA_KV_ELASTIC
+    // the graphs that view the previous tensors cannot be reused
+    uint32_t get_n_resize() const;
+
     bool get_has_shift() const;
 
+    // the RoPE position of the cells of a sequence is their position + seq_pos_offset(seq_id)
+    // non-zero only after a lazy shift, see seq_add()
+    llama_pos seq_pos_offset(llama_seq_id seq_id) const;
+
+    bool get_has_pos_offset() const;
+
+    // add the attention weights of the first n_kv cells of the streams of sinfo to their scores
+    // data is [n_kv, sinfo.n_stream()], see llama_context_params.kv_scores
+    void score_add(const float * data, uint32_t n_kv, const slot_info & sinfo);
+
     //
     // graph_build API
     //
 
-    uint32_t get_n_kv() const;
+    // the size of the KV view of a ubatch: the cells of the streams of sinfo up to the last one that contains one of
+    // the sequences of the ubatch - the cells after it are masked for all the tokens of the ubatch
+    uint32_t get_n_kv(const llama_ubatch & ubatch, const slot_info & sinfo) const;
 
     // TODO: temporary
     bool get_supports_set_rows() const;
@@ -171,6 +198,7 @@ public:
 
     // find places for the provided ubatches in the cache, returns the slot infos
     // return empty vector on failure
+    // an elastic cache (LLAMA_KV_ELASTIC) is grown until the ubatches fit or shrunk when most cells are unused
     slot_info_vec_t prepare(const std::vector<llama_ubatch> & ubatches);
 
     bool update(llama_context * lctx, bool do_shift, const defrag_info & dinfo, const stream_copy_info & sc_info);
@@ -180,6 +208,10 @@ public:
     // return empty slot_info on failure
     slot_info find_slot(const llama_ubatch & ubatch, bool cont) const;
 
+    // the block table of a sequence: the indices of the blocks that contain cells of seq_id, in order of position
+    // only meaningful when the cache is paged (n_block > 0)
+    std::vector<uint32_t> seq_blocks(llama_seq_id seq_id) const;
+
     // emplace the ubatch context into slot: [sinfo.idxs[0...ubatch.n_tokens - 1]]
     void apply_ubatch(const slot_info & sinfo, const llama_ubatch & ubatch);
 
@@ -198,6 +230,13 @@ public:
     void set_input_kq_mask   (ggml_tensor * dst, const llama_ubatch * ubatch, bool causal_attn) const;
     void set_input_pos_bucket(ggml_tensor * dst, const llama_ubatch * ubatch) const;
 
+    // build the KQ mask [n_kv, n_tps_pad, 1, n_stream] in the graph from the positions and the sequences of the cells
+    // and of the tokens, so that only O(n_kv + n_tokens) values are filled on the host instead of O(n_kv*n_tokens)
+    // returns nullptr if the mask has to be filled with set_input_kq_mask(), see LLAMA_KV_DEVICE_MASK
+    ggml_tensor * build_input_kq_mask(ggml_context * ctx, const llama_ubatch & ubatch, uint32_t n_kv, bool causal_attn, llm_graph_kq_mask_inputs & inp) const;
+
+    void set_input_kq_mask_inputs(const llm_graph_kq_mask_inputs & inp, const llama_ubatch * ubatch) const;
+
 private:
     const llama_model & model;
     const llama_hparams & hparams;
@@ -212,6 +251,11 @@ private:
 
         std::vector<ggml_tensor *> k_stream;
         std::vector<ggml_tensor *> v_stream;
+
+        ggml_backend_buffer_type_t buft;
+
+        ggml_type type_k;
+        ggml_type type_v;
     };
 
     bool v_trans = true;  // the value tensor is transposed
@@ -232,8 +276,46 @@ private:
     // ref: https://github.com/ggml-org/llama.cpp/pull/14285
     bool supports_set_rows = true;
 
+    // env: LLAMA_KV_N_KV_BUCKETS
+    // round n_kv up to coarse buckets that grow with the context, so that the graph (and the backend graphs,
+    // e.g. CUDA graphs) can be reused over many decode steps instead of being rebuilt every n_pad tokens
+    // requires ggml_set_rows() support, as graph reuse does
+    bool n_kv_buckets = true;
+
+    // env: LLAMA_KV_BLOCK_SIZE
+    // if > 0, the cells are allocated in blocks of n_block cells and each block is owned by a single sequence
+    // requires ggml_set_rows() support since the ubatch tokens can be placed in non-continuous cells
+    uint32_t n_block = 0;
+
+    // env: LLAMA_KV_LAZY_SHIFT
+    // shift the tail of a sequence by moving the positions of its cells and rotating only the cells before the tail,
+    // the difference is kept in seq_pos_off and added to the RoPE positions of the new tokens of the sequence
+    // only for a cache of all the layers of a RoPE model: the iSWA and hybrid memories build the positions themselves
+    bool lazy_shift = false;
+
+    // env: LLAMA_KV_ELASTIC
+    // if > 0, the K/V tensors are first allocated for this number of cells instead of kv_size (size_max)
+    // they are reallocated with twice the cells when the ubatches do not fit and with fewer cells when
+    // at most a quarter of the cells are used - the cells in use are copied to the new tensors
+    // all streams share the same number of cells
+    uint32_t size_min = 0;
+    uint32_t size_max = 0;
+
+    uint32_t n_resize = 0;
+
+    // env: LLAMA_KV_DEVICE_MASK
+    // compute the KQ mask in the graph, see build_input_kq_mask()
+    // off by default, not supported with chunked SWA
+    bool device_mask = false;
+
     const llama_swa_type swa_type = LLAMA_SWA_TYPE_NONE;
 
+    // set by score_add(), seq_compress() is a no-op until then
+    bool has_scores = false;
+
+    // per sequence offset of the RoPE positions, see seq_pos_offset()
+    std::vector<llama_pos> seq_pos_off;
+
     std::vector<ggml_context_ptr>        ctxs;
     std::vector<ggml_backend_buffer_ptr> bufs;
 
@@ -257,6 +339,32 @@ private:
     // return non-empty vector if cells have been moved
     defrag_info defrag_prepare(int32_t n_max_nodes) const;
 
+    // can seq_add() of [p0, p1) by shift < 0 be applied lazily
+    bool can_shift_lazy(llama_seq_id seq_id, llama_pos p0, llama_pos p1, llama_pos shift) const;
+
+    // rotate the cells of the sequence by its pending offset and reset it to 0
+    void seq_pos_off_clear(llama_seq_id seq_id);
+
+    // reset the offsets of the sequences that have no cells
+    void seq_pos_off_sync();
+
+    // the range [r0, r1) of the cells with a pending shift, indexed by s*get_size() + i
+    // returns false if no cell has to be rotated
+    bool get_shift_range(uint32_t & r0, uint32_t & r1) const;
+
+    // create the K/V tensors of the layers with size cells per stream in new zero-initialized buffers
+    bool alloc_tensors(uint32_t size, std::vector<ggml_context_ptr> & ctxs_new, std::vector<ggml_backend_buffer_ptr> & bufs_new, std::vector<kv_layer> & layers_new) const;
+
+    // reallocate the K/V tensors with size cells per stream, keeping the used cells
+    // returns false if the new tensors cannot be allocated, the cache is unchanged then
+    bool resize(uint32_t size);
+
+    // find the slots of the ubatches in the current cells, see prepare()
+    slot_info_vec_t try_prepare(const std::vector<llama_ubatch> & ubatches);
+
+    // the smallest size_min*2^k >= n, clamped to size_max
+    uint32_t elastic_size(uint32_t n) const;
+
     size_t total_size() const;
 
     size_t size_k_bytes() const;
@@ -264,6 +372,13 @@ private:
 
     bool is_masked_swa(llama_pos p0, llama_pos p1) const;
 
+    // can the cell be overwritten by a new token (empty or masked by the SWA)
+    bool is_cell_free(const llama_kv_cells_unified & cells, uint32_t idx) const;
+
+    // paged version of find_slot() for the tokens [i0, i0 + n_tokens) of the ubatch in stream strm
+    // the tokens of a sequence are placed in the blocks already owned by the sequence first, then in new empty blocks
+    bool find_slot_paged(const llama_ubatch & ubatch, uint32_t strm, uint32_t i0, uint32_t n_tokens, std::vector<uint32_t> & idxs) const;
+
     ggml_tensor * build_rope_shift(
             const llama_cparams & cparams,
                    ggml_context * ctx,
@@ -291,7 +406,7 @@ private:
     void state_write_meta(llama_io_write_i & io, const cell_ranges_t & cr, llama_seq_id seq_id = -1) const;
     void state_write_data(llama_io_write_i & io, const cell_ranges_t & cr) const;
 
-    bool state_read_meta(llama_io_read_i & io, uint32_t strm, uint32_t cell_count, llama_seq_id dest_seq_id = -1);
+    bool state_read_meta(llama_io_read_i & io, uint32_t strm, uint32_t cell_count, llama_seq_id dest_seq_id = -1, bool append = false, llama_pos shift = 0, llama_pos off_src = 0, llama_pos * pos_first = nullptr);
     bool state_read_data(llama_io_read_i & io, uint32_t strm, uint32_t cell_count);
 };
 
@@ -341,9 +456,19 @@ public:
 
     uint32_t get_n_kv() const;
 
+    uint32_t get_n_resize() const;
+
     // TODO: temporary
     bool get_supports_set_rows() const;
 
+    // offset of the RoPE positions of the tokens of a sequence, see llama_kv_cache_unified::seq_pos_offset()
+    llama_pos get_pos_offset(llama_seq_id seq_id) const;
+
+    bool get_has_pos_offset() const;
+
+    // accumulate the attention weights [n_kv, n_stream] of the current ubatch, see llama_kv_cache_unified::score_add()
+    void score_add(const float * data, uint32_t n_kv) const;
+
     // get views of the current state of the cache
     ggml_tensor * get_k(ggml_context * ctx, int32_t il) const;
     ggml_tensor * get_v(ggml_context * ctx, int32_t il) const;
@@ -362,6 +487,10 @@ public:
     void set_input_kq_mask   (ggml_tensor * dst, const llama_ubatch * ubatch, bool causal_attn) const;
     void set_input_pos_bucket(ggml_tensor * dst, const llama_ubatch * ubatch) const;
 
+    ggml_tensor * build_input_kq_mask(ggml_context * ctx, const llama_ubatch & ubatch, bool causal_attn, llm_graph_kq_mask_inputs & inp) const;
+
+    void set_input_kq_mask_inputs(const llm_graph_kq_mask_inputs & inp, const llama_ubatch * ubatch) const;
+
 private:
     llama_memory_status status;
 
@@ -13,10 +13,13 @@
 // TODO: add unit tests
 class llama_kv_cells_unified {
 public:
+    using seq_set_t = std::bitset<LLAMA_MAX_SEQ>;
+
     void reset() {
         for (uint32_t i = 0; i < pos.size(); ++i) {
             pos[i]   = -1;
             shift[i] =  0;
+            score[i] =  0.0f;
             seq[i].reset();
         }
 
@@ -44,11 +47,22 @@ public:
     void resize(uint32_t n) {
         pos.resize(n);
         shift.resize(n);
+        score.resize(n);
         seq.resize(n);
 
         reset();
     }
 
+    // change the number of cells and keep their state - the used cells must be in [0, n)
+    void resize_keep(uint32_t n) {
+        assert(used_max_p1() <= n);
+
+        pos.resize  (n, -1);
+        shift.resize(n,  0);
+        score.resize(n,  0.0f);
+        seq.resize  (n);
+    }
+
     bool is_empty(uint32_t i) const {
         assert(i < pos.size());
         assert((pos[i] < 0 && pos[i] == -1) || pos[i] >= 0);
@@ -72,6 +86,18 @@ public:
         return used.empty() ? 0 : *used.rbegin() + 1;
     }
 
+    // the index of the last cell that contains any of the sequences in seqs + 1
+    // return 0 if there is no such cell
+    uint32_t used_max_p1(const seq_set_t & seqs) const {
+        for (auto it = used.rbegin(); it != used.rend(); ++it) {
+            if ((seq[*it] & seqs).any()) {
+                return *it + 1;
+            }
+        }
+
+        return 0;
+    }
+
     bool get_has_shift() const {
         return has_shift;
     }
@@ -86,10 +112,12 @@ public:
 
         pos  [idst] = pos  [isrc];
         shift[idst] = shift[isrc];
+        score[idst] = score[isrc];
         seq  [idst] = seq  [isrc];
 
         pos  [isrc] = -1;
         shift[isrc] =  0;
+        score[isrc] =  0.0f;
         seq  [isrc].reset();
 
         used.erase (isrc);
@@ -107,8 +135,9 @@ public:
         for (uint32_t j = 0; j < n; ++j) {
             const auto idx = i + j;
 
-            res.pos[j] = pos[idx];
-            res.seq[j] = seq[idx];
+            res.pos  [j] = pos  [idx];
+            res.score[j] = score[idx];
+            res.seq  [j] = seq  [idx];
 
             assert(shift[idx] == 0);
         }
@@ -125,8 +154,9 @@ public:
         for (uint32_t j = 0; j < idxs.size(); ++j) {
             const auto idx = idxs[j];
 
-            res.pos[j] = pos[idx];
-            res.seq[j] = seq[idx];
+            res.pos  [j] = pos  [idx];
+            res.score[j] = score[idx];
+            res.seq  [j] = seq  [idx];
 
             assert(shift[idx] == 0);
         }
@@ -153,8 +183,9 @@ public:
                 seq_pos_rm(i + j);
             }
 
-            pos[idx] = other.pos[j];
-            seq[idx] = other.seq[j];
+            pos  [idx] = other.pos  [j];
+            score[idx] = other.score[j];
+            seq  [idx] = other.seq  [j];
 
             if (pos[idx] != -1) {
                 seq_pos_add(i + j);
@@ -183,8 +214,9 @@ public:
                 seq_pos_rm(idx);
             }
 
-            pos[idx] = other.pos[j];
-            seq[idx] = other.seq[j];
+            pos  [idx] = other.pos  [j];
+            score[idx] = other.score[j];
+            seq  [idx] = other.seq  [j];
 
             if (pos[idx] != -1) {
                 seq_pos_add(idx);
@@ -364,6 +396,7 @@ public:
         assert(seq[i].none());
 
         pos[i] = p;
+        score[i] = 0.0f;
 
         used.insert(i);
     }
@@ -397,6 +430,46 @@ public:
         return false;
     }
 
+    // pos[i] = pos[i] + d, without a shift: the K data keeps its rotation
+    // does not modify "has_shift"
+    // note: call only if the cell is not empty and the new position is non-negative
+    void pos_add_no_shift(uint32_t i, llama_pos d) {
+        assert(i < pos.size());
+        assert(pos[i] != -1);
+        assert(pos[i] + d >= 0);
+
+        seq_pos_rm(i);
+
+        pos[i] += d;
+
+        seq_pos_add(i);
+    }
+
+    // rotate the K data of the cell by d without changing its position
+    // sets "has_shift" to true
+    // note: call only if the cell is not empty
+    void shift_add(uint32_t i, llama_pos d) {
+        assert(i < pos.size());
+        assert(pos[i] != -1);
+
+        shift[i] += d;
+
+        has_shift = true;
+    }
+
+    // accumulate the attention received by the cell, see llama_kv_cache_unified::score_add()
+    void score_add(uint32_t i, float v) {
+        assert(i < pos.size());
+
+        score[i] += v;
+    }
+
+    float score_get(uint32_t i) const {
+        assert(i < pos.size());
+
+        return score[i];
+    }
+
     // pos[i] = pos[i] / d
     // sets "has_shift" to true
     // note: call only if the cell is not empty
@@ -441,7 +514,9 @@ private:
     //
     std::vector<llama_pos> shift;
 
-    using seq_set_t = std::bitset<LLAMA_MAX_SEQ>;
+    // the attention weights received by the cell since it was set, summed over the heads, layers and queries
+    // only accumulated with llama_context_params.kv_scores, not part of the saved state
+    std::vector<float> score;
 
     // the bitset seq[i] tells us which sequences are currently occupying the i-th cell
     std::vector<seq_set_t> seq;
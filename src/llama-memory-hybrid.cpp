@@ -13,6 +13,8 @@ llama_memory_hybrid::llama_memory_hybrid(
                          /* attn */
             ggml_type    type_k,
             ggml_type    type_v,
+             uint32_t    n_layer_f16,
+   ggml_backend_buffer_type_t buft_cpu,
                  bool    v_trans,
              uint32_t    kv_size,
              uint32_t    n_pad,
@@ -22,6 +24,8 @@ llama_memory_hybrid::llama_memory_hybrid(
             ggml_type    type_r,
             ggml_type    type_s,
              uint32_t    rs_size,
+             uint32_t    rs_n_ckpt,
+             uint32_t    rs_ckpt_interval,
                          /* common */
              uint32_t    n_seq_max,
                  bool    offload,
@@ -37,6 +41,8 @@ llama_memory_hybrid::llama_memory_hybrid(
             : filter_attn,
         type_k,
         type_v,
+        n_layer_f16,
+        buft_cpu,
         v_trans,
         offload,
         unified,
@@ -55,7 +61,9 @@ llama_memory_hybrid::llama_memory_hybrid(
         type_s,
         offload,
         rs_size,
-        n_seq_max
+        n_seq_max,
+        rs_n_ckpt,
+        rs_ckpt_interval
     )) {}
 
 llama_memory_context_ptr llama_memory_hybrid::init_batch(llama_batch_allocr & balloc, uint32_t n_ubatch, bool embd_all) {
@@ -121,6 +129,11 @@ bool llama_memory_hybrid::get_can_shift() const {
     return mem_attn->get_can_shift();
 }
 
+void llama_memory_hybrid::get_n_cells(uint32_t & n_used, uint32_t & n_extent) const {
+    // the recurrent states have a single cell per sequence
+    mem_attn->get_n_cells(n_used, n_extent);
+}
+
 void llama_memory_hybrid::clear(bool data) {
     mem_attn->clear(data);
     mem_recr->clear(data);
@@ -132,6 +145,15 @@ bool llama_memory_hybrid::seq_rm(llama_seq_id seq_id, llama_pos p0, llama_pos p1
     if (!mem_recr->seq_rm(seq_id, p0, p1)) {
         return false;
     }
+
+    // the recurrent state may have been rolled back to a checkpoint before p0
+    if (seq_id >= 0 && p0 > 0) {
+        const llama_pos pos_max = mem_recr->seq_pos_max(seq_id);
+        if (pos_max >= 0) {
+            p0 = std::min(p0, pos_max + 1);
+        }
+    }
+
     return mem_attn->seq_rm(seq_id, p0, p1);
 }
 
@@ -165,14 +187,14 @@ llama_pos llama_memory_hybrid::seq_pos_max(llama_seq_id seq_id) const {
     return std::min(mem_attn->seq_pos_max(seq_id), mem_recr->seq_pos_max(seq_id));
 }
 
-void llama_memory_hybrid::state_write(llama_io_write_i & io, llama_seq_id seq_id) const {
-    mem_attn->state_write(io, seq_id);
-    mem_recr->state_write(io, seq_id);
+void llama_memory_hybrid::state_write(llama_io_write_i & io, llama_seq_id seq_id, llama_pos p0, llama_pos p1, llama_state_seq_flags flags) const {
+    mem_attn->state_write(io, seq_id, p0, p1, flags);
+    mem_recr->state_write(io, seq_id, p0, p1, flags);
 }
 
-void llama_memory_hybrid::state_read(llama_io_read_i & io, llama_seq_id seq_id) {
-    mem_attn->state_read(io, seq_id);
-    mem_recr->state_read(io, seq_id);
+void llama_memory_hybrid::state_read(llama_io_read_i & io, llama_seq_id seq_id, bool append, llama_pos shift, llama_state_seq_flags flags) {
+    mem_attn->state_read(io, seq_id, append, shift, flags);
+    mem_recr->state_read(io, seq_id, append, shift, flags);
 }
 
 llama_kv_cache_unified * llama_memory_hybrid::get_mem_attn() const {
@@ -27,6 +27,8 @@ public:
                             /* attn */
                 ggml_type    type_k,
                 ggml_type    type_v,
+                 uint32_t    n_layer_f16,
+   ggml_backend_buffer_type_t    buft_cpu,
                      bool    v_trans,
                  uint32_t    kv_size,
                  uint32_t    n_pad,
@@ -36,6 +38,8 @@ public:
                 ggml_type    type_r,
                 ggml_type    type_s,
                  uint32_t    rs_size,
+                 uint32_t    rs_n_ckpt,
+                 uint32_t    rs_ckpt_interval,
                              /* common */
                  uint32_t    n_seq_max,
                      bool    offload,
@@ -61,6 +65,8 @@ public:
 
     bool get_can_shift() const override;
 
+    void get_n_cells(uint32_t & n_used, uint32_t & n_extent) const override;
+
     void clear(bool data) override;
 
     bool seq_rm  (llama_seq_id seq_id,                              llama_pos p0, llama_pos p1) override;
@@ -74,8 +80,8 @@ public:
 
     // state write/load
 
-    void state_write(llama_io_write_i & io, llama_seq_id seq_id = -1) const override;
-    void state_read (llama_io_read_i  & io, llama_seq_id seq_id = -1)       override;
+    void state_write(llama_io_write_i & io, llama_seq_id seq_id = -1, llama_pos p0 = -1, llama_pos p1 = -1, llama_state_seq_flags flags = 0) const override;
+    void state_read (llama_io_read_i  & io, llama_seq_id seq_id = -1, bool append = false, llama_pos shift = 0, llama_state_seq_flags flags = 0)  override;
 
     //
     // llama_memory_hybrid specific API
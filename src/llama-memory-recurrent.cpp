@@ -22,7 +22,9 @@ llama_memory_recurrent::llama_memory_recurrent(
                 ggml_type    type_s,
                      bool    offload,
                  uint32_t    mem_size,
-                 uint32_t    n_seq_max) : hparams(model.hparams), n_seq_max(n_seq_max) {
+                 uint32_t    n_seq_max,
+                 uint32_t    n_ckpt,
+                 uint32_t    ckpt_interval) : hparams(model.hparams), n_seq_max(n_seq_max), n_ckpt(n_ckpt), ckpt_interval(std::max(1u, ckpt_interval)) {
     const int32_t n_layer = hparams.n_layer;
 
     head = 0;
@@ -115,6 +117,10 @@ llama_memory_recurrent::llama_memory_recurrent(
                 ggml_type_name(type_r), (float)memory_size_r / (1024.0f * 1024.0f),
                 ggml_type_name(type_s), (float)memory_size_s / (1024.0f * 1024.0f));
     }
+
+    if (n_ckpt > 0) {
+        LLAMA_LOG_INFO("%s: keeping up to %u checkpoints per sequence, every %u tokens\n", __func__, n_ckpt, this->ckpt_interval);
+    }
 }
 
 void llama_memory_recurrent::clear(bool data) {
@@ -123,6 +129,7 @@ void llama_memory_recurrent::clear(bool data) {
         cells[i].seq_id.clear();
         cells[i].src = -1;
         cells[i].tail = -1;
+        cells[i].ckpt = -1;
     }
 
     head = 0;
@@ -154,21 +161,52 @@ bool llama_memory_recurrent::seq_rm(llama_seq_id seq_id, llama_pos p0, llama_pos
     if (0 <= seq_id) {
         int32_t & tail_id = cells[seq_id].tail;
         if (tail_id >= 0) {
-            const auto & cell = cells[tail_id];
+            auto & cell = cells[tail_id];
             // partial intersection is invalid
             if ((0 < p0 && p0 <= cell.pos) || (0 < p1 && p1 <= cell.pos)) {
-                return false;
+                // unless the tail can be removed and the state rolled back to a checkpoint before p0
+                const int32_t ckpt_id = p0 > 0 && p1 > cell.pos && cell.seq_id.size() == 1 ? seq_ckpt_find(seq_id, p0) : -1;
+                if (ckpt_id < 0) {
+                    return false;
+                }
+
+                seq_ckpt_rm(seq_id, p0, std::numeric_limits<llama_pos>::max());
+
+                LLAMA_LOG_DEBUG("%s: seq_id = %d, rolled back from pos %d to checkpoint at pos %d\n", __func__, seq_id, cell.pos, cells[ckpt_id].pos);
+
+                // the checkpoint becomes the tail
+                cell.seq_id.clear();
+                cell.pos = -1;
+                cell.src = -1;
+
+                auto & cell_ckpt = cells[ckpt_id];
+                cell_ckpt.ckpt = -1;
+                cell_ckpt.src  = ckpt_id;
+                cell_ckpt.seq_id.insert(seq_id);
+
+                if ((uint32_t) tail_id < head) {
+                    head = tail_id;
+                }
+                tail_id = ckpt_id;
+
+                return true;
             }
             // invalidate tails which will be cleared
             if (p0 <= cell.pos && cell.pos < p1) {
                 tail_id = -1;
             }
         }
+
+        seq_ckpt_rm(seq_id, p0, std::numeric_limits<llama_pos>::max());
     } else {
         // seq_id is negative, then the range should include everything or nothing
         if (p0 != p1 && (p0 != 0 || p1 != std::numeric_limits<llama_pos>::max())) {
             return false;
         }
+
+        if (p0 != p1) {
+            seq_ckpt_rm(-1, 0, std::numeric_limits<llama_pos>::max());
+        }
     }
 
     for (uint32_t i = 0; i < size; ++i) {
@@ -216,6 +254,9 @@ void llama_memory_recurrent::seq_cp(llama_seq_id seq_id_src, llama_seq_id seq_id
     }
 
     if ((uint32_t) seq_id_dst < size && (uint32_t) seq_id_src < size) {
+        // the checkpoints are not shared
+        seq_ckpt_rm(seq_id_dst, 0, std::numeric_limits<llama_pos>::max());
+
         auto & tail_src = cells[seq_id_src];
         auto & tail_dst = cells[seq_id_dst];
         if (tail_dst.tail >= 0) {
@@ -247,6 +288,16 @@ void llama_memory_recurrent::seq_keep(llama_seq_id seq_id) {
             cells[i].tail = -1;
         }
 
+        if (cells[i].ckpt >= 0) {
+            if (cells[i].ckpt != seq_id) {
+                cells[i].ckpt = -1;
+                cells[i].pos  = -1;
+                cells[i].src  = -1;
+            }
+
+            continue;
+        }
+
         if (!cells[i].has_seq_id(seq_id)) {
             if (cells[i].pos >= 0) {
                 used--;
@@ -298,6 +349,18 @@ void llama_memory_recurrent::seq_add(llama_seq_id seq_id, llama_pos p0, llama_po
                 cell.pos += shift;
             }
         }
+
+        for (auto & cell : cells) {
+            if (cell.ckpt == seq_id && p0 <= cell.pos && cell.pos < p1) {
+                cell.pos += shift;
+
+                if (cell.pos < 0) {
+                    cell.ckpt = -1;
+                    cell.pos  = -1;
+                    cell.src  = -1;
+                }
+            }
+        }
     }
 }
 
@@ -328,9 +391,96 @@ void llama_memory_recurrent::seq_div(llama_seq_id seq_id, llama_pos p0, llama_po
                 cell.pos /= d;
             }
         }
+
+        for (auto & cell : cells) {
+            if (cell.ckpt == seq_id && p0 <= cell.pos && cell.pos < p1) {
+                cell.pos /= d;
+            }
+        }
+    }
+}
+
+void llama_memory_recurrent::seq_ckpt_add(llama_seq_id seq_id) {
+    int32_t tail_id = cells[seq_id].tail;
+
+    // drop the oldest checkpoint to make room for the new one
+    {
+        uint32_t n_seq_ckpt = 0;
+        int32_t  oldest_id  = -1;
+
+        for (uint32_t i = 0; i < size; ++i) {
+            if (cells[i].ckpt == seq_id) {
+                n_seq_ckpt++;
+
+                if (oldest_id < 0 || cells[i].pos < cells[oldest_id].pos) {
+                    oldest_id = i;
+                }
+            }
+        }
+
+        if (n_seq_ckpt >= n_ckpt) {
+            cells[oldest_id].ckpt = -1;
+            cells[oldest_id].pos  = -1;
+            cells[oldest_id].src  = -1;
+        }
+    }
+
+    int32_t free_id = -1;
+    for (uint32_t i = 0; i < size; ++i) {
+        if (cells[i].is_free()) {
+            free_id = i;
+            break;
+        }
+    }
+
+    if (free_id < 0) {
+        return;
+    }
+
+    // the sequence continues in the free cell, from a copy of its current state
+    auto & cell_tail = cells[tail_id];
+    auto & cell_free = cells[free_id];
+
+    cell_free.pos = cell_tail.pos;
+    cell_free.src = tail_id;
+    cell_free.seq_id.insert(seq_id);
+
+    cell_tail.seq_id.clear();
+    cell_tail.ckpt = seq_id;
+
+    cells[seq_id].tail = free_id;
+}
+
+void llama_memory_recurrent::seq_ckpt_rm(llama_seq_id seq_id, llama_pos p0, llama_pos p1) {
+    for (uint32_t i = 0; i < size; ++i) {
+        auto & cell = cells[i];
+
+        if (cell.ckpt < 0 || (seq_id >= 0 && cell.ckpt != seq_id)) {
+            continue;
+        }
+
+        if (p0 <= cell.pos && cell.pos < p1) {
+            cell.ckpt = -1;
+            cell.pos  = -1;
+            cell.src  = -1;
+        }
     }
 }
 
+int32_t llama_memory_recurrent::seq_ckpt_find(llama_seq_id seq_id, llama_pos p1) const {
+    int32_t res = -1;
+
+    for (uint32_t i = 0; i < size; ++i) {
+        const auto & cell = cells[i];
+
+        if (cell.ckpt == seq_id && cell.pos < p1 && (res < 0 || cell.pos > cells[res].pos)) {
+            res = i;
+        }
+    }
+
+    return res;
+}
+
 llama_pos llama_memory_recurrent::seq_pos_min(llama_seq_id seq_id) const {
     llama_pos result = std::numeric_limits<llama_pos>::max();
 
@@ -504,13 +654,34 @@ bool llama_memory_recurrent::find_slot(const llama_ubatch & ubatch) {
     }
 #endif
 
+    // snapshot the states that are about to advance past the interval since their last checkpoint
+    if (n_ckpt > 0) {
+        for (uint32_t s = 0; s < n_seqs; ++s) {
+            const uint32_t i = s*n_seq_tokens;
+            const llama_seq_id seq_id = ubatch.seq_id[i][0];
+            const int32_t tail_id = cells[seq_id].tail;
+
+            // only for the states owned by a single sequence
+            if (ubatch.n_seq_id[i] != 1 || tail_id < 0 || cells[tail_id].seq_id.size() != 1) {
+                continue;
+            }
+
+            const int32_t   ckpt_id  = seq_ckpt_find(seq_id, std::numeric_limits<llama_pos>::max());
+            const llama_pos pos_ckpt = ckpt_id >= 0 ? cells[ckpt_id].pos : -1;
+
+            if (cells[tail_id].pos - pos_ckpt >= (llama_pos) ckpt_interval) {
+                seq_ckpt_add(seq_id);
+            }
+        }
+    }
+
     // find next empty cell
     uint32_t next_empty_cell = head;
 
     for (uint32_t i = 0; i < size; ++i) {
         if (next_empty_cell >= size) { next_empty_cell -= size; }
         auto & cell = cells[next_empty_cell];
-        if (cell.is_empty()) { break; }
+        if (cell.is_free()) { break; }
         next_empty_cell += 1;
     }
 
@@ -528,7 +699,7 @@ bool llama_memory_recurrent::find_slot(const llama_ubatch & ubatch) {
         }
         if (!has_cell) {
             auto & empty_cell = cells[next_empty_cell];
-            GGML_ASSERT(empty_cell.is_empty());
+            GGML_ASSERT(empty_cell.is_free());
             // copy old tail into the empty cell
             if (seq_meta.tail >= 0) {
                 auto & orig_cell = cells[seq_meta.tail];
@@ -545,7 +716,7 @@ bool llama_memory_recurrent::find_slot(const llama_ubatch & ubatch) {
                     next_empty_cell += 1;
                     if (next_empty_cell >= size) { next_empty_cell -= size; }
                     auto & cell = cells[next_empty_cell];
-                    if (cell.is_empty()) { break; }
+                    if (cell.is_free()) { break; }
                 }
             }
         }
@@ -562,8 +733,9 @@ bool llama_memory_recurrent::find_slot(const llama_ubatch & ubatch) {
             auto & dst_cell = cells[dst_id];
             auto & src_cell = cells[src_id];
 
-            std::swap(dst_cell.pos, src_cell.pos);
-            std::swap(dst_cell.src, src_cell.src);
+            std::swap(dst_cell.pos,    src_cell.pos);
+            std::swap(dst_cell.src,    src_cell.src);
+            std::swap(dst_cell.ckpt,   src_cell.ckpt);
             std::swap(dst_cell.seq_id, src_cell.seq_id);
 
             // swap tails
@@ -680,7 +852,11 @@ size_t llama_memory_recurrent::size_s_bytes() const {
     return size_s_bytes;
 }
 
-void llama_memory_recurrent::state_write(llama_io_write_i & io, llama_seq_id seq_id) const {
+void llama_memory_recurrent::state_write(llama_io_write_i & io, llama_seq_id seq_id, llama_pos p0, llama_pos p1, llama_state_seq_flags flags) const {
+    GGML_UNUSED(p0); // the recurrent state only exists for the last position
+    GGML_UNUSED(p1);
+    GGML_UNUSED(flags);
+
     std::vector<std::pair<uint32_t, uint32_t>> cell_ranges; // ranges, from inclusive, to exclusive
     uint32_t cell_count = 0;
 
@@ -718,7 +894,14 @@ void llama_memory_recurrent::state_write(llama_io_write_i & io, llama_seq_id seq
     state_write_data(io, cell_ranges);
 }
 
-void llama_memory_recurrent::state_read(llama_io_read_i & io, llama_seq_id seq_id) {
+void llama_memory_recurrent::state_read(llama_io_read_i & io, llama_seq_id seq_id, bool append, llama_pos shift, llama_state_seq_flags flags) {
+    GGML_UNUSED(append); // the recurrent state is always replaced
+    GGML_UNUSED(flags);
+
+    if (shift != 0) {
+        throw std::runtime_error("the recurrent state cannot be moved to other positions");
+    }
+
     uint32_t cell_count;
     io.read_to(&cell_count, sizeof(cell_count));
 
@@ -26,7 +26,9 @@ public:
                     ggml_type    type_s,
                          bool    offload,
                      uint32_t    mem_size,
-                     uint32_t    n_seq_max);
+                     uint32_t    n_seq_max,
+                     uint32_t    n_ckpt,
+                     uint32_t    ckpt_interval);
 
     ~llama_memory_recurrent() = default;
 
@@ -63,8 +65,8 @@ public:
 
     // state write/load
 
-    void state_write(llama_io_write_i & io, llama_seq_id seq_id = -1) const override;
-    void state_read (llama_io_read_i  & io, llama_seq_id seq_id = -1) override;
+    void state_write(llama_io_write_i & io, llama_seq_id seq_id = -1, llama_pos p0 = -1, llama_pos p1 = -1, llama_state_seq_flags flags = 0) const override;
+    void state_read (llama_io_read_i  & io, llama_seq_id seq_id = -1, bool append = false, llama_pos shift = 0, llama_state_seq_flags flags = 0) override;
 
     uint32_t head = 0; // the location where the batch will be placed in the cache (see find_slot())
     uint32_t size = 0; // total number of cells, shared across all sequences
@@ -83,6 +85,9 @@ public:
         int32_t   src0 = -1; // like src, but only used when setting the inputs (allowing to copy once)
         int32_t   tail = -1;
 
+        // the sequence of which the cell holds a checkpoint of the state at pos, see seq_ckpt_add()
+        llama_seq_id ckpt = -1;
+
         std::set<llama_seq_id> seq_id;
 
         bool has_seq_id(const llama_seq_id & id) const {
@@ -93,6 +98,11 @@ public:
             return seq_id.empty();
         }
 
+        // not used by a sequence nor by a checkpoint
+        bool is_free() const {
+            return seq_id.empty() && ckpt < 0;
+        }
+
         bool is_same_seq(const mem_cell & other) const {
             return seq_id == other.seq_id;
         }
@@ -110,9 +120,23 @@ private:
 
     const uint32_t n_seq_max = 1;
 
+    // max number of checkpoints per sequence and min number of tokens between two checkpoints
+    const uint32_t n_ckpt        = 0;
+    const uint32_t ckpt_interval = 0;
+
     std::vector<ggml_context_ptr>        ctxs;
     std::vector<ggml_backend_buffer_ptr> bufs;
 
+    // snapshot the state of the tail cell of seq_id by moving the sequence to a free cell that copies it
+    // the oldest checkpoint of the sequence is dropped when it already has n_ckpt of them
+    void seq_ckpt_add(llama_seq_id seq_id);
+
+    // drop the checkpoints of seq_id (any sequence if seq_id < 0) with pos in [p0, p1)
+    void seq_ckpt_rm(llama_seq_id seq_id, llama_pos p0, llama_pos p1);
+
+    // the cell of the latest checkpoint of seq_id with pos < p1, or -1
+    int32_t seq_ckpt_find(llama_seq_id seq_id, llama_pos p1) const;
+
     size_t total_size() const;
 
     size_t size_r_bytes() const;
@@ -16,6 +16,16 @@ struct llama_memory_params {
     ggml_type type_k;
     ggml_type type_v;
 
+    // keep the first and last n_layer_f16 layers in F16 when type_k/type_v are quantized
+    uint32_t n_layer_f16;
+
+    // buffer type of the layers in host memory, nullptr for the CPU buffer type
+    ggml_backend_buffer_type_t buft_cpu;
+
+    // recurrent state: number of checkpoints per sequence and the number of tokens between them
+    uint32_t n_ckpt;
+    uint32_t ckpt_interval;
+
     // use full-size SWA cache
     bool swa_full;
 };
@@ -84,6 +94,13 @@ struct llama_memory_i {
     // getters
     virtual bool get_can_shift() const = 0;
 
+    // the number of used cells and their extent (the cells that a ubatch attends to, including the holes)
+    // memories without cells report 0
+    virtual void get_n_cells(uint32_t & n_used, uint32_t & n_extent) const {
+        n_used   = 0;
+        n_extent = 0;
+    }
+
     //
     // ops
     //
@@ -97,6 +114,17 @@ struct llama_memory_i {
     virtual void seq_add (llama_seq_id seq_id,                              llama_pos p0, llama_pos p1, llama_pos shift) = 0;
     virtual void seq_div (llama_seq_id seq_id,                              llama_pos p0, llama_pos p1, int d) = 0;
 
+    // remove the cells of seq_id in [p0, p1) except for the n_keep with the highest attention scores
+    // returns the number of removed cells, memories without scores remove nothing
+    virtual int32_t seq_compress(llama_seq_id seq_id, llama_pos p0, llama_pos p1, int32_t n_keep) {
+        GGML_UNUSED(seq_id);
+        GGML_UNUSED(p0);
+        GGML_UNUSED(p1);
+        GGML_UNUSED(n_keep);
+
+        return 0;
+    }
+
     virtual llama_pos seq_pos_min(llama_seq_id seq_id) const = 0;
     virtual llama_pos seq_pos_max(llama_seq_id seq_id) const = 0;
 
@@ -104,8 +132,12 @@ struct llama_memory_i {
     // state write/read
     //
 
-    virtual void state_write(llama_io_write_i & io, llama_seq_id seq_id = -1) const = 0;
-    virtual void state_read (llama_io_read_i  & io, llama_seq_id seq_id = -1) = 0;
+    // p0 >= 0 writes only the cells of seq_id at positions >= p0 (incremental state)
+    // append reads such a state on top of the existing cells of seq_id instead of replacing them
+    // states that only exist for the last position (recurrent) are always written and read whole
+    // flags: see LLAMA_STATE_SEQ_FLAGS_*
+    virtual void state_write(llama_io_write_i & io, llama_seq_id seq_id = -1, llama_pos p0 = -1, llama_pos p1 = -1, llama_state_seq_flags flags = 0) const = 0;
+    virtual void state_read (llama_io_read_i  & io, llama_seq_id seq_id = -1, bool append = false, llama_pos shift = 0, llama_state_seq_flags flags = 0) = 0;
 };
 
 using llama_memory_ptr = std::unique_ptr<llama_memory_i>;
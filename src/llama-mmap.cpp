@@ -4,6 +4,8 @@
 
 #include "ggml.h"
 
+#include <cstdint>
+#include <cstdlib>
 #include <cstring>
 #include <climits>
 #include <stdexcept>
@@ -126,6 +128,26 @@ struct llama_file::impl {
         }
     }
 
+    void read_raw_at(void * ptr, size_t len, size_t offset) const {
+        size_t bytes_read = 0;
+        while (bytes_read < len) {
+            size_t chunk_size = std::min<size_t>(len - bytes_read, 64*1024*1024);
+            OVERLAPPED overlapped = {};
+            overlapped.Offset     = (DWORD) ((offset + bytes_read) & 0xFFFFFFFF);
+            overlapped.OffsetHigh = (DWORD) ((uint64_t) (offset + bytes_read) >> 32);
+            DWORD chunk_read = 0;
+            BOOL result = ReadFile(fp_win32, reinterpret_cast<char*>(ptr) + bytes_read, chunk_size, &chunk_read, &overlapped);
+            if (!result) {
+                throw std::runtime_error(format("read error: %s", GetErrorMessageWin32(GetLastError()).c_str()));
+            }
+            if (chunk_read < chunk_size || chunk_read == 0) {
+                throw std::runtime_error("unexpectedly reached end of file");
+            }
+
+            bytes_read += chunk_read;
+        }
+    }
+
     uint32_t read_u32() const {
         uint32_t val;
         read_raw(&val, sizeof(val));
@@ -209,6 +231,25 @@ struct llama_file::impl {
         }
     }
 
+    void read_raw_at(void * ptr, size_t len, size_t offset) const {
+        const int fd = fileno(fp);
+        size_t bytes_read = 0;
+        while (bytes_read < len) {
+            const ssize_t ret = pread(fd, reinterpret_cast<char*>(ptr) + bytes_read, len - bytes_read, (off_t) (offset + bytes_read));
+            if (ret < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error(format("read error: %s", strerror(errno)));
+            }
+            if (ret == 0) {
+                throw std::runtime_error("unexpectedly reached end of file");
+            }
+
+            bytes_read += ret;
+        }
+    }
+
     uint32_t read_u32() const {
         uint32_t ret;
         read_raw(&ret, sizeof(ret));
@@ -261,6 +302,7 @@ int llama_file::file_id() const {
 
 void llama_file::seek(size_t offset, int whence) const { pimpl->seek(offset, whence); }
 void llama_file::read_raw(void * ptr, size_t len) const { pimpl->read_raw(ptr, len); }
+void llama_file::read_raw_at(void * ptr, size_t len, size_t offset) const { pimpl->read_raw_at(ptr, len, offset); }
 
 uint32_t llama_file::read_u32() const { return pimpl->read_u32(); }
 
@@ -302,6 +344,17 @@ struct llama_mmap::impl {
                         strerror(errno));
             }
         }
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+        // back the mapping with transparent huge pages to reduce the TLB misses with large models
+        // requires a kernel with CONFIG_READ_ONLY_THP_FOR_FS for file-backed mappings
+        const char * LLAMA_MMAP_HUGEPAGE = getenv("LLAMA_MMAP_HUGEPAGE");
+        if (LLAMA_MMAP_HUGEPAGE && atoi(LLAMA_MMAP_HUGEPAGE) != 0) {
+            if (madvise(addr, file->size(), MADV_HUGEPAGE)) {
+                LLAMA_LOG_WARN("warning: madvise(.., MADV_HUGEPAGE) failed: %s\n",
+                        strerror(errno));
+            }
+        }
+#endif
 
         mapped_fragments.emplace_back(0, file->size());
     }
@@ -446,6 +499,35 @@ void * llama_mmap::addr() const { return pimpl->addr; }
 
 void llama_mmap::unmap_fragment(size_t first, size_t last) { pimpl->unmap_fragment(first, last); }
 
+void llama_mmap::prefetch(const void * addr, size_t len) {
+    if (len == 0) {
+        return;
+    }
+#ifdef _POSIX_MAPPED_FILES
+    static const size_t page_size = sysconf(_SC_PAGESIZE);
+
+    // madvise requires a page-aligned address
+    const uintptr_t first = (uintptr_t) addr & ~(page_size - 1);
+    const uintptr_t last  = (uintptr_t) addr + len;
+
+    if (posix_madvise((void *) first, last - first, POSIX_MADV_WILLNEED)) {
+        LLAMA_LOG_DEBUG("%s: posix_madvise(.., POSIX_MADV_WILLNEED) failed: %s\n", __func__, strerror(errno));
+    }
+#elif defined(_WIN32) && _WIN32_WINNT >= 0x602
+    static BOOL (WINAPI *pPrefetchVirtualMemory) (HANDLE, ULONG_PTR, PWIN32_MEMORY_RANGE_ENTRY, ULONG) =
+        (decltype(pPrefetchVirtualMemory))(void *) GetProcAddress(GetModuleHandleW(L"kernel32.dll"), "PrefetchVirtualMemory");
+
+    if (pPrefetchVirtualMemory) {
+        WIN32_MEMORY_RANGE_ENTRY range;
+        range.VirtualAddress = (PVOID) addr;
+        range.NumberOfBytes  = (SIZE_T) len;
+        pPrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+    }
+#else
+    GGML_UNUSED(addr);
+#endif
+}
+
 #if defined(_POSIX_MEMLOCK_RANGE) || defined(_WIN32)
 const bool llama_mmap::SUPPORTED  = true;
 #else
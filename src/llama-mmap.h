@@ -26,6 +26,9 @@ struct llama_file {
     void read_raw(void * ptr, size_t len) const;
     uint32_t read_u32() const;
 
+    // read at an absolute offset without moving the file position, can be called from several threads at once
+    void read_raw_at(void * ptr, size_t len, size_t offset) const;
+
     void write_raw(const void * ptr, size_t len) const;
     void write_u32(uint32_t val) const;
 
@@ -44,6 +47,9 @@ struct llama_mmap {
 
     void unmap_fragment(size_t first, size_t last);
 
+    // hint the OS to read ahead the pages of a range of mapped memory (non-blocking)
+    static void prefetch(const void * addr, size_t len);
+
     static const bool SUPPORTED;
 
 private:
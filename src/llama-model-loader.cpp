@@ -3,9 +3,13 @@
 #include "ggml.h"
 
 #include <array>
+#include <atomic>
 #include <cinttypes>
+#include <cstdlib>
 #include <cstring>
 #include <future>
+#include <mutex>
+#include <thread>
 
 static const size_t kiB = 1024;
 static const size_t MiB = 1024*kiB;
@@ -36,6 +40,7 @@ static std::string llama_model_ftype_name(llama_ftype ftype) {
         case LLAMA_FTYPE_MOSTLY_Q5_1:     return "Q5_1";
         case LLAMA_FTYPE_MOSTLY_Q8_0:     return "Q8_0";
         case LLAMA_FTYPE_MOSTLY_MXFP4_MOE: return "MXFP4 MoE";
+        case LLAMA_FTYPE_MOSTLY_F8_E4M3:  return "F8_E4M3";
         case LLAMA_FTYPE_MOSTLY_Q2_K:     return "Q2_K - Medium";
         case LLAMA_FTYPE_MOSTLY_Q2_K_S:   return "Q2_K - Small";
         case LLAMA_FTYPE_MOSTLY_Q3_K_S:   return "Q3_K - Small";
@@ -65,6 +70,18 @@ static std::string llama_model_ftype_name(llama_ftype ftype) {
     }
 }
 
+// FNV-1a hash of the tensor data, the same as ggml-rpc and gguf-split --delta
+static uint64_t llama_tensor_data_hash(const uint8_t * data, size_t len) {
+    const uint64_t fnv_prime = 0x100000001b3ULL;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= data[i];
+        hash *= fnv_prime;
+    }
+    return hash;
+}
+
 // return a list of splits for a given path
 // for example, given "<name>-00002-of-00004.gguf", returns list of all 4 splits
 static std::vector<std::string> llama_get_list_splits(const std::string & path, const int idx, const int n_split) {
@@ -598,6 +615,70 @@ llama_model_loader::llama_model_loader(
         LLAMA_LOG_INFO("%s: additional %d GGUFs metadata loaded.\n",  __func__, n_split - 1);
     }
 
+    // tensors shared with a base model, see gguf-split --delta
+    std::string delta_base;
+    if (get_key(llm_kv(LLM_KV_DELTA_BASE), delta_base, false)) {
+        // a relative base path is relative to the directory of the model
+        const size_t pos_dir = fname.find_last_of("/\\");
+        if (pos_dir != std::string::npos && !delta_base.empty() && delta_base[0] != '/' && delta_base.find(':') == std::string::npos) {
+            delta_base = fname.substr(0, pos_dir + 1) + delta_base;
+        }
+
+        const int kid_tensors = gguf_find_key(meta.get(), llm_kv(LLM_KV_DELTA_TENSORS).c_str());
+        const int kid_hashes  = gguf_find_key(meta.get(), llm_kv(LLM_KV_DELTA_TENSOR_HASHES).c_str());
+        if (kid_tensors < 0 || gguf_get_arr_type(meta.get(), kid_tensors) != GGUF_TYPE_STRING) {
+            throw std::runtime_error(format("invalid delta model: missing the list of the tensors of the base %s", delta_base.c_str()));
+        }
+        const size_t n_delta = gguf_get_arr_n(meta.get(), kid_tensors);
+        const uint64_t * hashes = nullptr;
+        if (kid_hashes >= 0) {
+            if (gguf_get_arr_type(meta.get(), kid_hashes) != GGUF_TYPE_UINT64 || gguf_get_arr_n(meta.get(), kid_hashes) != n_delta) {
+                throw std::runtime_error("invalid delta model: the tensor hashes do not match the tensors");
+            }
+            hashes = (const uint64_t *) gguf_get_arr_data(meta.get(), kid_hashes);
+        }
+
+        struct gguf_init_params base_params = {
+            /*.no_alloc = */ true,
+            /*.ctx      = */ &ctx,
+        };
+        gguf_context_ptr ctx_gguf { gguf_init_from_file(delta_base.c_str(), base_params) };
+        if (!ctx_gguf) {
+            throw std::runtime_error(format("%s: failed to load the base model %s of the delta model", __func__, delta_base.c_str()));
+        }
+
+        files.emplace_back(new llama_file(delta_base.c_str(), "rb"));
+        contexts.emplace_back(ctx);
+
+        const uint16_t idx = files.size() - 1;
+
+        std::vector<uint8_t> buf;
+        for (size_t i = 0; i < n_delta; i++) {
+            const std::string tensor_name = gguf_get_arr_str(meta.get(), kid_tensors, i);
+            ggml_tensor * cur = ggml_get_tensor(ctx, tensor_name.c_str());
+            if (!cur) {
+                throw std::runtime_error(format("invalid delta model: tensor '%s' not found in the base %s", tensor_name.c_str(), delta_base.c_str()));
+            }
+            if (weights_map.find(tensor_name) != weights_map.end()) {
+                throw std::runtime_error(format("invalid model: tensor '%s' is duplicated", tensor_name.c_str()));
+            }
+            n_elements += ggml_nelements(cur);
+            n_bytes    += ggml_nbytes(cur);
+            auto it = weights_map.emplace(tensor_name, llama_tensor_weight(files.back().get(), idx, ctx_gguf.get(), cur)).first;
+
+            // the base must not have changed since the delta was written - this reads the data, so only with check_tensors
+            if (check_tensors && hashes) {
+                buf.resize(ggml_nbytes(cur));
+                files.back()->read_raw_at(buf.data(), buf.size(), it->second.offs);
+                if (llama_tensor_data_hash(buf.data(), buf.size()) != hashes[i]) {
+                    throw std::runtime_error(format("tensor '%s' of the base %s does not match the delta model", tensor_name.c_str(), delta_base.c_str()));
+                }
+            }
+        }
+
+        LLAMA_LOG_INFO("%s: %zu tensors shared with the base model %s\n", __func__, n_delta, delta_base.c_str());
+    }
+
     n_kv      = gguf_get_n_kv(meta.get());
     n_tensors = weights_map.size();
 
@@ -644,6 +725,7 @@ llama_model_loader::llama_model_loader(
             case GGML_TYPE_Q5_0:    ftype = LLAMA_FTYPE_MOSTLY_Q5_0;    break;
             case GGML_TYPE_Q5_1:    ftype = LLAMA_FTYPE_MOSTLY_Q5_1;    break;
             case GGML_TYPE_Q8_0:    ftype = LLAMA_FTYPE_MOSTLY_Q8_0;    break;
+            case GGML_TYPE_F8_E4M3: ftype = LLAMA_FTYPE_MOSTLY_F8_E4M3; break;
             case GGML_TYPE_Q2_K:    ftype = LLAMA_FTYPE_MOSTLY_Q2_K;    break;
             case GGML_TYPE_Q3_K:    ftype = LLAMA_FTYPE_MOSTLY_Q3_K_M;  break;
             case GGML_TYPE_Q4_K:    ftype = LLAMA_FTYPE_MOSTLY_Q4_K_M;  break;
@@ -928,9 +1010,40 @@ bool llama_model_loader::load_all_data(
     std::vector<std::future<std::pair<ggml_tensor *, bool>>> validation_result;
 
     // 4 staging buffers for async uploads, each sized 1MB seems to be a good default for single NVMe drives.
-    // NVMe raid configurations might require more / larger buffers.
-    constexpr size_t n_buffers = 4;
-    constexpr size_t buffer_size = 1 * 1024 * 1024; // 1MB
+    // NVMe raid configurations might require more / larger buffers: LLAMA_LOAD_N_BUFFERS, LLAMA_LOAD_BUFFER_SIZE (MiB)
+    size_t n_buffers = 4;
+    size_t buffer_size = 1 * 1024 * 1024; // 1MB
+    {
+        const char * LLAMA_LOAD_N_BUFFERS = getenv("LLAMA_LOAD_N_BUFFERS");
+        if (LLAMA_LOAD_N_BUFFERS) {
+            n_buffers = std::max(1, atoi(LLAMA_LOAD_N_BUFFERS));
+        }
+        const char * LLAMA_LOAD_BUFFER_SIZE = getenv("LLAMA_LOAD_BUFFER_SIZE");
+        if (LLAMA_LOAD_BUFFER_SIZE) {
+            buffer_size = (size_t) std::max(1, atoi(LLAMA_LOAD_BUFFER_SIZE)) * 1024 * 1024;
+        }
+    }
+
+    // tensors that are read directly into host memory are loaded after the others by a pool of threads, in chunks,
+    // so that several requests are in flight at the same time across tensors and split files
+    // the number of threads can be set with LLAMA_LOAD_THREADS (default: up to 8)
+    struct read_chunk {
+        const llama_file * file;
+        size_t offs;
+        uint8_t * dst;
+        size_t size;
+    };
+    std::vector<read_chunk> read_chunks;
+    std::vector<ggml_tensor *> read_tensors;
+    constexpr size_t read_chunk_size = 16 * 1024 * 1024;
+
+    int n_read_threads = std::min(8, (int) std::max(1u, std::thread::hardware_concurrency()));
+    {
+        const char * LLAMA_LOAD_THREADS = getenv("LLAMA_LOAD_THREADS");
+        if (LLAMA_LOAD_THREADS) {
+            n_read_threads = std::max(1, atoi(LLAMA_LOAD_THREADS));
+        }
+    }
 
     std::vector<ggml_backend_buffer_t> host_buffers;
     std::vector<ggml_backend_event_t> events;
@@ -1057,18 +1170,17 @@ bool llama_model_loader::load_all_data(
                 mmap_used.first  = std::min(mmap_used.first,  weight->offs);
                 mmap_used.second = std::max(mmap_used.second, weight->offs + n_size);
             } else {
+                time_meas tm(t_upload_us);
                 ggml_backend_tensor_set(cur, data, 0, n_size);
             }
         } else {
             const auto & file = files.at(weight->idx);
             if (ggml_backend_buffer_is_host(cur->buffer)) {
-                file->seek(weight->offs, SEEK_SET);
-                file->read_raw(cur->data, n_size);
-                if (check_tensors) {
-                    validation_result.emplace_back(std::async(std::launch::async, [cur, n_size] {
-                        return std::make_pair(cur, ggml_validate_row_data(cur->type, cur->data, n_size));
-                    }));
+                for (size_t offs = 0; offs < n_size; offs += read_chunk_size) {
+                    read_chunks.push_back({ file.get(), weight->offs + offs, (uint8_t *) cur->data + offs, std::min(read_chunk_size, n_size - offs) });
                 }
+                read_tensors.push_back(cur);
+                continue;
             } else {
                 // If upload_backend is valid load the tensor in chunks to pinned memory and upload the buffers asynchronously to the GPU.
                 if (upload_backend) {
@@ -1079,8 +1191,15 @@ bool llama_model_loader::load_all_data(
                     while (bytes_read < n_size) {
                         size_t read_iteration = std::min<size_t>(buffer_size, n_size - bytes_read);
 
-                        ggml_backend_event_synchronize(events[buffer_idx]);
-                        file->read_raw(host_ptrs[buffer_idx], read_iteration);
+                        {
+                            time_meas tm(t_upload_us);
+                            ggml_backend_event_synchronize(events[buffer_idx]);
+                        }
+                        {
+                            time_meas tm(t_read_us);
+                            file->read_raw(host_ptrs[buffer_idx], read_iteration);
+                        }
+                        time_meas tm(t_upload_us);
                         ggml_backend_tensor_set_async(upload_backend, cur, host_ptrs[buffer_idx], bytes_read, read_iteration);
                         ggml_backend_event_record(events[buffer_idx], upload_backend);
 
@@ -1090,9 +1209,15 @@ bool llama_model_loader::load_all_data(
                     }
                 } else {
                     read_buf.resize(n_size);
-                    file->seek(weight->offs, SEEK_SET);
-                    file->read_raw(read_buf.data(), n_size);
-                    ggml_backend_tensor_set(cur, read_buf.data(), 0, n_size);
+                    {
+                        time_meas tm(t_read_us);
+                        file->seek(weight->offs, SEEK_SET);
+                        file->read_raw(read_buf.data(), n_size);
+                    }
+                    {
+                        time_meas tm(t_upload_us);
+                        ggml_backend_tensor_set(cur, read_buf.data(), 0, n_size);
+                    }
                     if (check_tensors && !ggml_validate_row_data(cur->type, read_buf.data(), n_size)) {
                         throw std::runtime_error(format("tensor '%s' has invalid data", ggml_get_name(cur)));
                     }
@@ -1105,6 +1230,7 @@ bool llama_model_loader::load_all_data(
 
     // free temporary resources used for async uploads
     for (auto * event : events) {
+        time_meas tm(t_upload_us);
         ggml_backend_event_synchronize(event);
         ggml_backend_event_free(event);
     }
@@ -1113,6 +1239,75 @@ bool llama_model_loader::load_all_data(
     }
     ggml_backend_free(upload_backend);
 
+    if (!read_chunks.empty()) {
+        time_meas tm(t_read_us);
+
+        std::atomic<size_t> next_chunk = 0;
+        std::atomic<size_t> size_read  = 0;
+        std::atomic<bool>   stop       = false;
+        std::mutex          error_mutex;
+        std::exception_ptr  error;
+
+        // returns false when there is no chunk left
+        auto read_next = [&]() {
+            const size_t i = next_chunk++;
+            if (i >= read_chunks.size() || stop) {
+                return false;
+            }
+            const auto & chunk = read_chunks[i];
+            try {
+                chunk.file->read_raw_at(chunk.dst, chunk.size, chunk.offs);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (!error) {
+                    error = std::current_exception();
+                }
+                stop = true;
+            }
+            size_read += chunk.size;
+            return true;
+        };
+
+        std::vector<std::thread> workers;
+        for (int i = 1; i < std::min<int>(n_read_threads, read_chunks.size()); ++i) {
+            workers.emplace_back([&]() {
+                while (read_next()) {
+                }
+            });
+        }
+
+        // the calling thread reads too and reports the progress
+        bool cancelled = false;
+        while (read_next()) {
+            if (progress_callback && !cancelled) {
+                if (!progress_callback((float) (size_done + size_read) / size_data, progress_callback_user_data)) {
+                    cancelled = true;
+                    stop = true;
+                }
+            }
+        }
+        for (auto & worker : workers) {
+            worker.join();
+        }
+
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        if (cancelled) {
+            return false;
+        }
+
+        for (auto * cur : read_tensors) {
+            const size_t n_size = ggml_nbytes(cur);
+            if (check_tensors) {
+                validation_result.emplace_back(std::async(std::launch::async, [cur, n_size] {
+                    return std::make_pair(cur, ggml_validate_row_data(cur->type, cur->data, n_size));
+                }));
+            }
+            size_done += n_size;
+        }
+    }
+
     // check validation results
     bool validation_failed = false;
     for (auto & future : validation_result) {
@@ -90,6 +90,11 @@ struct llama_model_loader {
 
     size_t size_done = 0;
     size_t size_data = 0;
+
+    // time spent by load_all_data reading the files and copying to the backend buffers
+    int64_t t_read_us   = 0;
+    int64_t t_upload_us = 0;
+
     std::vector<std::pair<size_t, size_t>> mmaps_used;
 
     llama_model_loader(
@@ -14,6 +14,7 @@
 #include "ggml-cpp.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cmath>
 #include <cfloat>
@@ -24,6 +25,7 @@
 #include <regex>
 #include <sstream>
 #include <stdexcept>
+#include <thread>
 
 const char * llm_type_name(llm_type type) {
     switch (type) {
@@ -396,7 +398,12 @@ static buft_list_t make_gpu_buft_list(ggml_backend_dev_t dev, llama_split_mode s
 
 struct llama_model::impl {
     impl() {}
-    ~impl() {}
+    ~impl() {
+        lazy_stop = true;
+        if (lazy_loader.joinable()) {
+            lazy_loader.join();
+        }
+    }
 
     uint64_t n_elements = 0;
 
@@ -430,6 +437,10 @@ struct llama_model::impl {
     std::vector<layer_dev> dev_layer;
 
     bool has_tensor_overrides;
+
+    // pages in the memory-mapped weights in the background with use_lazy
+    std::thread       lazy_loader;
+    std::atomic<bool> lazy_stop = false;
 };
 
 llama_model::llama_model(const llama_model_params & params) : params(params), pimpl(std::make_unique<impl>()) {
@@ -588,6 +599,9 @@ void llama_model::load_hparams(llama_model_loader & ml) {
         case LLM_ARCH_LLAMA:
             {
                 ml.get_key(LLM_KV_ATTENTION_LAYERNORM_RMS_EPS, hparams.f_norm_rms_eps);
+                ml.get_key(LLM_KV_FFN_SPARSE_GROUP_SIZE,       hparams.ffn_sparse_group,    false);
+                ml.get_key(LLM_KV_FFN_SPARSE_N_ACTIVE,         hparams.ffn_sparse_n_active, false);
+                ml.get_key(LLM_KV_FFN_SPARSE_N_HOT,            hparams.ffn_sparse_n_hot,    false);
 
                 if (hparams.n_expert == 8) {
                     switch (hparams.n_layer) {
@@ -1904,6 +1918,16 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
 
     LLAMA_LOG_INFO("%s: loading model tensors, this can take a while... (mmap = %s)\n", __func__, ml.use_mmap ? "true" : "false");
 
+    // placement of the repacked weights allocated below
+    if (params.use_extra_bufts) {
+        auto * cpu_dev = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
+        auto * set_repack_mem_fn = cpu_dev ? (decltype(ggml_backend_cpu_set_repack_mem) *)
+            ggml_backend_reg_get_proc_address(ggml_backend_dev_backend_reg(cpu_dev), "ggml_backend_cpu_set_repack_mem") : nullptr;
+        if (set_repack_mem_fn) {
+            set_repack_mem_fn(params.cpu_mem_repack);
+        }
+    }
+
     // build a list of buffer types for the CPU and GPU devices
     pimpl->cpu_buft_list = make_cpu_buft_list(devices, params.use_extra_bufts);
     for (auto * dev : devices) {
@@ -2226,6 +2250,29 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
                             layer.ffn_gate_b = create_tensor(tn(LLM_TENSOR_FFN_GATE, "bias", i), {n_ff}, TENSOR_NOT_REQUIRED);
                             layer.ffn_down_b = create_tensor(tn(LLM_TENSOR_FFN_DOWN, "bias", i), {n_embd}, TENSOR_NOT_REQUIRED);
                             layer.ffn_up_b   = create_tensor(tn(LLM_TENSOR_FFN_UP,   "bias", i), {n_ff}, TENSOR_NOT_REQUIRED);
+
+                            // optional activation predictor, scoring the groups of neurons after the hot ones
+                            const ggml_tensor * pred_a_meta = ml.get_tensor_meta(tn(LLM_TENSOR_FFN_PRED_A, "weight", i).str().c_str());
+                            if (pred_a_meta && hparams.ffn_sparse_group > 0) {
+                                const uint32_t n_group = hparams.ffn_sparse_group;
+                                const int64_t  n_cold  = n_ff/n_group - hparams.ffn_sparse_n_hot;
+                                const int64_t  n_rank  = pred_a_meta->ne[1];
+
+                                const ggml_tensor * down_meta = ml.get_tensor_meta(tn(LLM_TENSOR_FFN_DOWN, "weight", i).str().c_str());
+
+                                int pred_flags = 0;
+                                if (n_ff % n_group != 0 || n_cold <= 0 ||
+                                    hparams.ffn_sparse_n_active == 0 || hparams.ffn_sparse_n_active > n_cold ||
+                                    n_group % ggml_blck_size(down_meta->type) != 0 ||
+                                    layer.ffn_gate_b || layer.ffn_down_b || layer.ffn_up_b) {
+                                    LLAMA_LOG_WARN("%s: layer %d: the FFN activation predictor does not match the FFN (group size %u, %u active, %u hot), using the dense FFN\n",
+                                            __func__, i, n_group, hparams.ffn_sparse_n_active, hparams.ffn_sparse_n_hot);
+                                    pred_flags = TENSOR_SKIP;
+                                }
+
+                                layer.ffn_pred_a = create_tensor(tn(LLM_TENSOR_FFN_PRED_A, "weight", i), {n_embd, n_rank}, pred_flags);
+                                layer.ffn_pred_b = create_tensor(tn(LLM_TENSOR_FFN_PRED_B, "weight", i), {n_rank, n_cold}, pred_flags);
+                            }
                         } else {
                             layer.ffn_gate_inp  = create_tensor(tn(LLM_TENSOR_FFN_GATE_INP,  "weight", i), {n_embd, n_expert}, 0);
                             layer.ffn_gate_exps = create_tensor(tn(LLM_TENSOR_FFN_GATE_EXPS, "weight", i), {n_embd,   n_ff, n_expert}, TENSOR_NOT_REQUIRED);
@@ -2990,6 +3037,10 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
                         output = create_tensor(tn(LLM_TENSOR_TOKEN_EMBD, "weight"), {n_embd, n_vocab}, TENSOR_DUPLICATED);
                     }
 
+                    // optional classification head, for rerankers
+                    cls_out   = create_tensor(tn(LLM_TENSOR_CLS_OUT, "weight"), {n_embd, hparams.n_cls_out}, TENSOR_NOT_REQUIRED);
+                    cls_out_b = create_tensor(tn(LLM_TENSOR_CLS_OUT, "bias"),   {hparams.n_cls_out},         TENSOR_NOT_REQUIRED);
+
                     for (int i = 0; i < n_layer; ++i) {
                         auto & layer = layers[i];
 
@@ -4503,11 +4554,16 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
                         output = create_tensor(tn(LLM_TENSOR_TOKEN_EMBD, "weight"), { n_embd, n_vocab }, TENSOR_DUPLICATED);
                     }
 
+                    // the first NextN layer is loaded as the MTP layer with use_mtp
+                    if (params.use_mtp && hparams.nextn_predict_layers > 0) {
+                        n_mtp = 1;
+                    }
+
                     // Load ALL tensors including NextN layer to satisfy total tensor count
                     // but only PROCESS up to last layer (skipping final NextN layer) in forward pass
                     for (int i = 0; i < n_layer; ++i) {
                         int flags = 0;
-                        if (hparams.nextn_predict_layers > 0 && static_cast<uint32_t>(i) >= n_layer - hparams.nextn_predict_layers) {
+                        if (hparams.nextn_predict_layers > 0 && static_cast<uint32_t>(i) >= n_layer - hparams.nextn_predict_layers + n_mtp) {
                             // skip all tensors in the NextN layers
                             flags |= TENSOR_SKIP;
                         }
@@ -4571,14 +4627,15 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
                             layer.ffn_up   = create_tensor(tn(LLM_TENSOR_FFN_UP,   "weight", i), { n_embd, n_ff }, flags);
                         }
 
-                        // NextN/MTP tensors (preserved but unused) - conditionally load for last nextn_predict_layers
+                        // NextN/MTP tensors - conditionally load for last nextn_predict_layers
+                        // the embeddings and the head are shared with the model when they are not in the file
                         if (hparams.nextn_predict_layers > 0 && static_cast<uint32_t>(i) >= n_layer - hparams.nextn_predict_layers) {
                             layer.nextn.eh_proj          = create_tensor(tn(LLM_TENSOR_NEXTN_EH_PROJ, "weight", i), { 2 * n_embd, n_embd }, flags);
-                            layer.nextn.embed_tokens     = create_tensor(tn(LLM_TENSOR_NEXTN_EMBED_TOKENS, "weight", i), { n_embd, n_vocab }, flags);
+                            layer.nextn.embed_tokens     = create_tensor(tn(LLM_TENSOR_NEXTN_EMBED_TOKENS, "weight", i), { n_embd, n_vocab }, TENSOR_NOT_REQUIRED | flags);
                             layer.nextn.enorm            = create_tensor(tn(LLM_TENSOR_NEXTN_ENORM, "weight", i), { n_embd }, flags);
                             layer.nextn.hnorm            = create_tensor(tn(LLM_TENSOR_NEXTN_HNORM, "weight", i), { n_embd }, flags);
-                            layer.nextn.shared_head_head = create_tensor(tn(LLM_TENSOR_NEXTN_SHARED_HEAD_HEAD, "weight", i), { n_embd, n_vocab }, flags);
-                            layer.nextn.shared_head_norm = create_tensor(tn(LLM_TENSOR_NEXTN_SHARED_HEAD_NORM, "weight", i), { n_embd }, flags);
+                            layer.nextn.shared_head_head = create_tensor(tn(LLM_TENSOR_NEXTN_SHARED_HEAD_HEAD, "weight", i), { n_embd, n_vocab }, TENSOR_NOT_REQUIRED | flags);
+                            layer.nextn.shared_head_norm = create_tensor(tn(LLM_TENSOR_NEXTN_SHARED_HEAD_NORM, "weight", i), { n_embd }, TENSOR_NOT_REQUIRED | flags);
                         }
                     }
                 }
@@ -5676,6 +5733,47 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
         }
     }
 
+    if (params.use_lazy && use_mmap_buffer) {
+        // the tensors are in layer order: the pages of the first layers are read first, and a decode that runs
+        // before the end only waits for the page faults of the pages that are not read yet
+        std::vector<std::pair<const uint8_t *, size_t>> ranges;
+        for (const auto & it : tensors_by_name) {
+            const ggml_tensor * t = it.second;
+            if (t->buffer && ggml_backend_buffer_get_usage(t->buffer) == GGML_BACKEND_BUFFER_USAGE_WEIGHTS && ggml_backend_buffer_is_host(t->buffer)) {
+                for (const auto & mapping : pimpl->mappings) {
+                    const uint8_t * addr = (const uint8_t *) mapping->addr();
+                    if ((const uint8_t *) t->data >= addr && (const uint8_t *) t->data < addr + mapping->size()) {
+                        ranges.emplace_back((const uint8_t *) t->data, ggml_nbytes(t));
+                        break;
+                    }
+                }
+            }
+        }
+
+        LLAMA_LOG_INFO("%s: paging in %zu tensors in the background\n", __func__, ranges.size());
+
+        pimpl->lazy_loader = std::thread([this, ranges = std::move(ranges)]() {
+            const int64_t t_start_us = ggml_time_us();
+            const size_t page_size = 4096;
+
+            size_t n_bytes = 0;
+            uint8_t sum = 0;
+            for (const auto & range : ranges) {
+                llama_mmap::prefetch(range.first, range.second);
+                for (size_t i = 0; i < range.second && !pimpl->lazy_stop; i += page_size) {
+                    sum += ((const volatile uint8_t *) range.first)[i];
+                }
+                if (pimpl->lazy_stop) {
+                    return;
+                }
+                n_bytes += range.second;
+            }
+            GGML_UNUSED(sum);
+
+            LLAMA_LOG_INFO("%s: paged in %.2f MiB of weights in %.2f s\n", "load_tensors", n_bytes/1024.0/1024.0, (ggml_time_us() - t_start_us)/1e6);
+        });
+    }
+
     return true;
 }
 
@@ -5987,6 +6085,10 @@ struct llm_build_llama : public llm_graph_context {
         ggml_tensor * inp_out_ids = build_inp_out_ids();
 
         for (int il = 0; il < n_layer; ++il) {
+            if (cparams.is_layer_skipped(il)) {
+                continue;
+            }
+
             ggml_tensor * inpSA = inpL;
 
             // norm
@@ -6064,12 +6166,19 @@ struct llm_build_llama : public llm_graph_context {
                         LLM_NORM_RMS, il);
                 cb(cur, "ffn_norm", il);
 
-                cur = build_ffn(cur,
-                        model.layers[il].ffn_up,   model.layers[il].ffn_up_b,   NULL,
-                        model.layers[il].ffn_gate, model.layers[il].ffn_gate_b, NULL,
-                        model.layers[il].ffn_down, model.layers[il].ffn_down_b, NULL,
-                        NULL,
-                        LLM_FFN_SILU, LLM_FFN_PAR, il);
+                if (can_ffn_sparse(model.layers[il].ffn_pred_a, model.layers[il].ffn_up)) {
+                    cur = build_ffn_sparse(cur,
+                            model.layers[il].ffn_up, model.layers[il].ffn_gate, model.layers[il].ffn_down,
+                            model.layers[il].ffn_pred_a, model.layers[il].ffn_pred_b,
+                            LLM_FFN_SILU, il);
+                } else {
+                    cur = build_ffn(cur,
+                            model.layers[il].ffn_up,   model.layers[il].ffn_up_b,   NULL,
+                            model.layers[il].ffn_gate, model.layers[il].ffn_gate_b, NULL,
+                            model.layers[il].ffn_down, model.layers[il].ffn_down_b, NULL,
+                            NULL,
+                            LLM_FFN_SILU, LLM_FFN_PAR, il);
+                }
                 cb(cur, "ffn_out", il);
             } else {
                 // MoE branch
@@ -8148,6 +8257,10 @@ struct llm_build_qwen2 : public llm_graph_context {
         ggml_tensor * inp_out_ids = build_inp_out_ids();
 
         for (int il = 0; il < n_layer; ++il) {
+            if (cparams.is_layer_skipped(il)) {
+                continue;
+            }
+
             ggml_tensor * inpSA = inpL;
 
             // norm
@@ -8267,7 +8380,7 @@ struct llm_build_dream : public llm_graph_context {
         // inp_pos - contains the positions
         ggml_tensor * inp_pos = build_inp_pos();
 
-        auto * inp_attn = build_attn_inp_no_cache();
+        auto * inp_attn = build_attn_inp_kv_unified();
 
         ggml_tensor * inp_out_ids = build_inp_out_ids();
 
@@ -8371,7 +8484,7 @@ struct llm_build_llada : public llm_graph_context {
         ggml_tensor * inp_pos = build_inp_pos();
 
         // Non-causal attention for diffusion
-        auto * inp_attn = build_attn_inp_no_cache();
+        auto * inp_attn = build_attn_inp_kv_unified();
 
         ggml_tensor * inp_out_ids = build_inp_out_ids();
 
@@ -8753,6 +8866,10 @@ struct llm_build_qwen3 : public llm_graph_context {
         ggml_tensor * inp_out_ids = build_inp_out_ids();
 
         for (int il = 0; il < n_layer; ++il) {
+            if (cparams.is_layer_skipped(il)) {
+                continue;
+            }
+
             ggml_tensor * inpSA = inpL;
 
             // norm
@@ -13771,6 +13888,8 @@ struct llm_build_glm4_moe : public llm_graph_context {
 
         inpL = build_inp_embd(model.tok_embd);
 
+        ggml_tensor * inp_embd = inpL;
+
         // inp_pos - contains the positions
         ggml_tensor * inp_pos = build_inp_pos();
 
@@ -13778,6 +13897,14 @@ struct llm_build_glm4_moe : public llm_graph_context {
 
         ggml_tensor * inp_out_ids = build_inp_out_ids();
 
+        // the MTP layer is the first NextN layer
+        const int il_mtp = hparams.n_layer - hparams.nextn_predict_layers;
+
+        if (cparams.mtp_draft) {
+            build_mtp(model, inp_embd, nullptr, inp_pos, inp_attn, inp_out_ids, il_mtp);
+            return;
+        }
+
         // Only process up to last layer (skip final NextN layer)
         // Final layer tensors are loaded but not processed in forward pass
         const int n_transformer_layers = n_layer - hparams.nextn_predict_layers;
@@ -13788,62 +13915,10 @@ struct llm_build_glm4_moe : public llm_graph_context {
             cur = build_norm(inpL, model.layers[il].attn_norm, NULL, LLM_NORM_RMS, il);
             cb(cur, "attn_norm", il);
 
-            // self-attention
-            {
-                ggml_tensor * Qcur = build_lora_mm(model.layers[il].wq, cur);
-                if (model.layers[il].bq) {
-                    Qcur = ggml_add(ctx0, Qcur, model.layers[il].bq);
-                }
-                cb(Qcur, "Qcur", il);
+            cur = build_attn_layer(model, cur, inp_pos, inp_attn, il);
 
-                ggml_tensor * Kcur = build_lora_mm(model.layers[il].wk, cur);
-                if (model.layers[il].bk) {
-                    Kcur = ggml_add(ctx0, Kcur, model.layers[il].bk);
-                }
-                cb(Kcur, "Kcur", il);
-
-                ggml_tensor * Vcur = build_lora_mm(model.layers[il].wv, cur);
-                if (model.layers[il].bv) {
-                    Vcur = ggml_add(ctx0, Vcur, model.layers[il].bv);
-                }
-                cb(Vcur, "Vcur", il);
-
-                Qcur = ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens);
-                Kcur = ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens);
-                Vcur = ggml_reshape_3d(ctx0, Vcur, n_embd_head, n_head_kv, n_tokens);
-
-                // Apply Q/K norm if available (GLM-4.5 355B variant)
-                if (model.layers[il].attn_q_norm) {
-                    Qcur = build_norm(Qcur, model.layers[il].attn_q_norm, NULL, LLM_NORM_RMS, il);
-                    cb(Qcur, "Qcur_normed", il);
-                }
-                if (model.layers[il].attn_k_norm) {
-                    Kcur = build_norm(Kcur, model.layers[il].attn_k_norm, NULL, LLM_NORM_RMS, il);
-                    cb(Kcur, "Kcur_normed", il);
-                }
-
-                Qcur = ggml_rope_ext(
-                        ctx0, Qcur, inp_pos, nullptr,
-                        n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
-                        ext_factor, attn_factor, beta_fast, beta_slow
-                        );
-
-                Kcur = ggml_rope_ext(
-                        ctx0, Kcur, inp_pos, nullptr,
-                        n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
-                        ext_factor, attn_factor, beta_fast, beta_slow
-                        );
-
-                cb(Qcur, "Qcur", il);
-                cb(Kcur, "Kcur", il);
-                cb(Vcur, "Vcur", il);
-
-                cur = build_attn(inp_attn,
-                        model.layers[il].wo, NULL,
-                        Qcur, Kcur, Vcur, nullptr, nullptr, 1.0f/sqrtf(float(n_embd_head)), il);
-            }
-
-            if (il == n_transformer_layers - 1 && inp_out_ids) {
+            // the MTP layer needs the hidden states of all the tokens
+            if (il == n_transformer_layers - 1 && inp_out_ids && !model.n_mtp) {
                 cur   = ggml_get_rows(ctx0, cur, inp_out_ids);
                 inpSA = ggml_get_rows(ctx0, inpSA, inp_out_ids);
             }
@@ -13855,44 +13930,7 @@ struct llm_build_glm4_moe : public llm_graph_context {
             cur = build_norm(ffn_inp, model.layers[il].attn_post_norm, NULL, LLM_NORM_RMS, il);
             cb(cur, "post_attn_norm", il);
 
-            // Check if this is a dense layer (n_layer_dense_lead=1, so layer 0 is dense)
-            if (static_cast<uint32_t>(il) < hparams.n_layer_dense_lead) {
-                // Dense FFN layer
-                cur = build_ffn(cur,
-                        model.layers[il].ffn_up,   NULL, NULL,
-                        model.layers[il].ffn_gate, NULL, NULL,
-                        model.layers[il].ffn_down, NULL, NULL,
-                        NULL,
-                        LLM_FFN_SILU, LLM_FFN_PAR, il);
-                cb(cur, "ffn_out", il);
-            } else {
-                // Process routed experts using existing MoE infrastructure
-                ggml_tensor * routed_out = build_moe_ffn(cur,
-                        model.layers[il].ffn_gate_inp,
-                        model.layers[il].ffn_up_exps,
-                        model.layers[il].ffn_gate_exps,
-                        model.layers[il].ffn_down_exps,
-                        model.layers[il].ffn_exp_probs_b,
-                        n_expert, n_expert_used,
-                        LLM_FFN_SILU, hparams.expert_weights_norm,
-                        true, hparams.expert_weights_scale,
-                        (llama_expert_gating_func_type) hparams.expert_gating_func,
-                        il);
-                cb(routed_out, "ffn_moe_out", il);
-
-                // Process shared expert on original input
-                ggml_tensor * shared_out = build_ffn(cur,
-                        model.layers[il].ffn_up_shexp,   NULL, NULL,
-                        model.layers[il].ffn_gate_shexp, NULL, NULL,
-                        model.layers[il].ffn_down_shexp, NULL, NULL,
-                        NULL,
-                        LLM_FFN_SILU, LLM_FFN_PAR, il);
-                cb(shared_out, "ffn_shexp_out", il);
-
-                // Final output: routed_output + shared_output
-                cur = ggml_add(ctx0, routed_out, shared_out);
-                cb(cur, "ffn_out", il);
-            }
+            cur = build_ffn_layer(model, cur, il);
 
             cur = ggml_add(ctx0, cur, ffn_inp);
 
@@ -13906,6 +13944,14 @@ struct llm_build_glm4_moe : public llm_graph_context {
         cur = inpL;
         cur = build_norm(cur, model.output_norm, NULL, LLM_NORM_RMS, -1);
 
+        if (model.n_mtp) {
+            build_mtp(model, inp_embd, cur, inp_pos, inp_attn, nullptr, il_mtp);
+
+            if (inp_out_ids) {
+                cur = ggml_get_rows(ctx0, cur, inp_out_ids);
+            }
+        }
+
         cb(cur, "result_norm", -1);
         res->t_embd = cur;
 
@@ -13917,6 +13963,188 @@ struct llm_build_glm4_moe : public llm_graph_context {
 
         ggml_build_forward_expand(gf, cur);
     }
+
+    ggml_tensor * build_attn_layer(
+            const llama_model & model,
+                  ggml_tensor * cur,
+                  ggml_tensor * inp_pos,
+     llm_graph_input_attn_kv_unified * inp_attn,
+                          int   il) {
+        const int64_t n_embd_head = hparams.n_embd_head_v;
+
+        ggml_tensor * Qcur = build_lora_mm(model.layers[il].wq, cur);
+        if (model.layers[il].bq) {
+            Qcur = ggml_add(ctx0, Qcur, model.layers[il].bq);
+        }
+        cb(Qcur, "Qcur", il);
+
+        ggml_tensor * Kcur = build_lora_mm(model.layers[il].wk, cur);
+        if (model.layers[il].bk) {
+            Kcur = ggml_add(ctx0, Kcur, model.layers[il].bk);
+        }
+        cb(Kcur, "Kcur", il);
+
+        ggml_tensor * Vcur = build_lora_mm(model.layers[il].wv, cur);
+        if (model.layers[il].bv) {
+            Vcur = ggml_add(ctx0, Vcur, model.layers[il].bv);
+        }
+        cb(Vcur, "Vcur", il);
+
+        Qcur = ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens);
+        Kcur = ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens);
+        Vcur = ggml_reshape_3d(ctx0, Vcur, n_embd_head, n_head_kv, n_tokens);
+
+        // Apply Q/K norm if available (GLM-4.5 355B variant)
+        if (model.layers[il].attn_q_norm) {
+            Qcur = build_norm(Qcur, model.layers[il].attn_q_norm, NULL, LLM_NORM_RMS, il);
+            cb(Qcur, "Qcur_normed", il);
+        }
+        if (model.layers[il].attn_k_norm) {
+            Kcur = build_norm(Kcur, model.layers[il].attn_k_norm, NULL, LLM_NORM_RMS, il);
+            cb(Kcur, "Kcur_normed", il);
+        }
+
+        Qcur = ggml_rope_ext(
+                ctx0, Qcur, inp_pos, nullptr,
+                n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
+                ext_factor, attn_factor, beta_fast, beta_slow
+                );
+
+        Kcur = ggml_rope_ext(
+                ctx0, Kcur, inp_pos, nullptr,
+                n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
+                ext_factor, attn_factor, beta_fast, beta_slow
+                );
+
+        cb(Qcur, "Qcur", il);
+        cb(Kcur, "Kcur", il);
+        cb(Vcur, "Vcur", il);
+
+        return build_attn(inp_attn,
+                model.layers[il].wo, NULL,
+                Qcur, Kcur, Vcur, nullptr, nullptr, 1.0f/sqrtf(float(n_embd_head)), il);
+    }
+
+    ggml_tensor * build_ffn_layer(const llama_model & model, ggml_tensor * cur, int il) {
+        // Check if this is a dense layer (n_layer_dense_lead=1, so layer 0 is dense)
+        if (static_cast<uint32_t>(il) < hparams.n_layer_dense_lead) {
+            // Dense FFN layer
+            cur = build_ffn(cur,
+                    model.layers[il].ffn_up,   NULL, NULL,
+                    model.layers[il].ffn_gate, NULL, NULL,
+                    model.layers[il].ffn_down, NULL, NULL,
+                    NULL,
+                    LLM_FFN_SILU, LLM_FFN_PAR, il);
+            cb(cur, "ffn_out", il);
+        } else {
+            // Process routed experts using existing MoE infrastructure
+            ggml_tensor * routed_out = build_moe_ffn(cur,
+                    model.layers[il].ffn_gate_inp,
+                    model.layers[il].ffn_up_exps,
+                    model.layers[il].ffn_gate_exps,
+                    model.layers[il].ffn_down_exps,
+                    model.layers[il].ffn_exp_probs_b,
+                    n_expert, n_expert_used,
+                    LLM_FFN_SILU, hparams.expert_weights_norm,
+                    true, hparams.expert_weights_scale,
+                    (llama_expert_gating_func_type) hparams.expert_gating_func,
+                    il);
+            cb(routed_out, "ffn_moe_out", il);
+
+            // Process shared expert on original input
+            ggml_tensor * shared_out = build_ffn(cur,
+                    model.layers[il].ffn_up_shexp,   NULL, NULL,
+                    model.layers[il].ffn_gate_shexp, NULL, NULL,
+                    model.layers[il].ffn_down_shexp, NULL, NULL,
+                    NULL,
+                    LLM_FFN_SILU, LLM_FFN_PAR, il);
+            cb(shared_out, "ffn_shexp_out", il);
+
+            // Final output: routed_output + shared_output
+            cur = ggml_add(ctx0, routed_out, shared_out);
+            cb(cur, "ffn_out", il);
+        }
+
+        return cur;
+    }
+
+    // the MTP layer combines the embedding of a token with the hidden state of the previous position to predict the
+    //   token after the next one
+    // with the final hidden states h of the ubatch, only its KV cache is stored - otherwise (llama_set_mtp_draft) the
+    //   layer is evaluated alone and its logits are the drafts
+    void build_mtp(
+            const llama_model & model,
+                  ggml_tensor * inp_embd,
+                  ggml_tensor * h,
+                  ggml_tensor * inp_pos,
+     llm_graph_input_attn_kv_unified * inp_attn,
+                  ggml_tensor * inp_out_ids,
+                          int   il) {
+        const auto & layer = model.layers[il];
+
+        auto * inp_mtp = build_inp_mtp();
+
+        ggml_tensor * h_prev;
+        if (h) {
+            h_prev = ggml_get_rows(ctx0, ggml_concat(ctx0, h, inp_mtp->carry, 1), inp_mtp->prev_ids);
+
+            res->t_mtp_hidden = ggml_get_rows(ctx0, h, inp_mtp->save_ids);
+            ggml_build_forward_expand(gf, res->t_mtp_hidden);
+        } else {
+            h_prev = inp_mtp->carry;
+        }
+
+        ggml_tensor * embd = inp_embd;
+        if (layer.nextn.embed_tokens && res->t_tokens) {
+            embd = ggml_get_rows(ctx0, layer.nextn.embed_tokens, res->t_tokens);
+        }
+
+        embd   = build_norm(embd,   layer.nextn.enorm, NULL, LLM_NORM_RMS, il);
+        h_prev = build_norm(h_prev, layer.nextn.hnorm, NULL, LLM_NORM_RMS, il);
+
+        ggml_tensor * inpSA = build_lora_mm(layer.nextn.eh_proj, ggml_concat(ctx0, embd, h_prev, 0));
+        cb(inpSA, "mtp_eh_proj", il);
+
+        ggml_tensor * cur = build_norm(inpSA, layer.attn_norm, NULL, LLM_NORM_RMS, il);
+        cb(cur, "attn_norm", il);
+
+        // the K and V of the tokens are stored by build_attn(), the rest of the layer is not part of the graph
+        cur = build_attn_layer(model, cur, inp_pos, inp_attn, il);
+
+        if (h) {
+            return;
+        }
+
+        ggml_tensor * ffn_inp = ggml_add(ctx0, cur, inpSA);
+        cb(ffn_inp, "ffn_inp", il);
+
+        cur = build_norm(ffn_inp, layer.attn_post_norm, NULL, LLM_NORM_RMS, il);
+        cb(cur, "post_attn_norm", il);
+
+        cur = build_ffn_layer(model, cur, il);
+
+        cur = ggml_add(ctx0, cur, ffn_inp);
+        cb(cur, "mtp_out", il);
+
+        // the output of the MTP layer is the hidden state of the next draft
+        res->t_mtp_hidden = cur;
+        ggml_build_forward_expand(gf, res->t_mtp_hidden);
+
+        if (inp_out_ids) {
+            cur = ggml_get_rows(ctx0, cur, inp_out_ids);
+        }
+
+        res->t_embd = cur;
+
+        cur = build_norm(cur, layer.nextn.shared_head_norm ? layer.nextn.shared_head_norm : model.output_norm, NULL, LLM_NORM_RMS, il);
+        cb(cur, "mtp_norm", il);
+
+        cur = build_lora_mm(layer.nextn.shared_head_head ? layer.nextn.shared_head_head : model.output, cur);
+        cb(cur, "result_output", -1);
+        res->t_logits = cur;
+
+        ggml_build_forward_expand(gf, cur);
+    }
 };
 
 struct llm_build_nemotron : public llm_graph_context {
@@ -18046,24 +18274,26 @@ llama_memory_i * llama_model::create_memory(const llama_memory_params & params,
         case LLM_ARCH_NOMIC_BERT_MOE:
         case LLM_ARCH_NEO_BERT:
         case LLM_ARCH_WAVTOKENIZER_DEC:
-        case LLM_ARCH_DREAM:
-        case LLM_ARCH_LLADA:
             {
                 res = nullptr;
             } break;
         // Models that need standard caching should rely on recurrent/hybrid
         // checks
+        // (the diffusion models cache the KV of the finalized blocks of block diffusion, with non-causal attention)
         default:
             {
                 if (llm_arch_is_recurrent(arch)) {
+                    // each sequence can hold a tail state and params.n_ckpt checkpoints
                     res = new llama_memory_recurrent(
                             *this,
                             nullptr,
                             GGML_TYPE_F32,
                             GGML_TYPE_F32,
                             cparams.offload_kqv,
-                            std::max((uint32_t) 1, cparams.n_seq_max),
-                            cparams.n_seq_max);
+                            std::max((uint32_t) 1, cparams.n_seq_max)*(1 + params.n_ckpt),
+                            cparams.n_seq_max,
+                            params.n_ckpt,
+                            params.ckpt_interval);
                 } else if (llm_arch_is_hybrid(arch)) {
                     const auto padding = llama_kv_cache_unified::get_padding(cparams);
 
@@ -18073,6 +18303,8 @@ llama_memory_i * llama_model::create_memory(const llama_memory_params & params,
                         /* model             */ *this,
                         /* attn_type_k       */ params.type_k,
                         /* attn_type_v       */ params.type_v,
+                        /* attn_n_layer_f16  */ params.n_layer_f16,
+                        /* attn_buft_cpu     */ params.buft_cpu,
                         /* attn_v_trans      */ !cparams.flash_attn,
                         /* attn_kv_size      */ cparams.n_ctx,
                         /* attn_n_pad        */ padding,
@@ -18080,7 +18312,9 @@ llama_memory_i * llama_model::create_memory(const llama_memory_params & params,
                         /* attn_swa_type     */ hparams.swa_type,
                         /* recurrent_type_k  */ GGML_TYPE_F32,
                         /* recurrent_type_v  */ GGML_TYPE_F32,
-                        /* recurrent_kv_size */ std::max((uint32_t) 1, cparams.n_seq_max),
+                        /* recurrent_kv_size */ std::max((uint32_t) 1, cparams.n_seq_max)*(1 + params.n_ckpt),
+                        /* recurrent_n_ckpt  */ params.n_ckpt,
+                        /* recurrent_ckpt_interval */ params.ckpt_interval,
                         /* n_seq_max         */ cparams.n_seq_max,
                         /* offload           */ cparams.offload_kqv,
                         /* unified           */ cparams.kv_unified,
@@ -18111,6 +18345,8 @@ llama_memory_i * llama_model::create_memory(const llama_memory_params & params,
                                 *this,
                                 params.type_k,
                                 params.type_v,
+                                params.n_layer_f16,
+                                params.buft_cpu,
                                 !cparams.flash_attn,
                                 cparams.offload_kqv,
                                 params.swa_full,
@@ -18122,11 +18358,19 @@ llama_memory_i * llama_model::create_memory(const llama_memory_params & params,
                     } else {
                         GGML_ASSERT(!hparams.is_swa_any());
 
+                        // do not allocate KV cells for the layers that are never evaluated
+                        llama_kv_cache_unified::layer_filter_cb filter = nullptr;
+                        if (cparams.n_layer_exit > 0 || cparams.layer_skip_begin < cparams.layer_skip_end) {
+                            filter = [cparams](int32_t il) { return !cparams.is_layer_skipped(il); };
+                        }
+
                         res = new llama_kv_cache_unified(
                                 *this,
-                                nullptr,
+                                std::move(filter),
                                 params.type_k,
                                 params.type_v,
+                                params.n_layer_f16,
+                                params.buft_cpu,
                                 !cparams.flash_attn,
                                 cparams.offload_kqv,
                                 cparams.kv_unified,
@@ -18506,6 +18750,12 @@ ggml_cgraph * llama_model::build_graph(const llm_graph_params & params) const {
     // add on pooling layer
     llm->build_pooling(cls, cls_b, cls_out, cls_out_b);
 
+    // the encoder outputs are consumed in full
+    if (params.gtype != LLM_GRAPH_TYPE_ENCODER) {
+        llm->build_logits_top_k();
+        llm->build_logits_half();
+    }
+
     return llm->res->get_gf();
 }
 
@@ -18524,11 +18774,14 @@ llama_model_params llama_model_default_params() {
         /*.progress_callback           =*/ nullptr,
         /*.progress_callback_user_data =*/ nullptr,
         /*.kv_overrides                =*/ nullptr,
+        /*.cpu_mem_repack              =*/ 0,
         /*.vocab_only                  =*/ false,
         /*.use_mmap                    =*/ true,
         /*.use_mlock                   =*/ false,
         /*.check_tensors               =*/ false,
         /*.use_extra_bufts             =*/ true,
+        /*.use_lazy                    =*/ false,
+        /*.use_mtp                     =*/ false,
     };
 
 #ifdef GGML_USE_METAL
@@ -18575,6 +18828,10 @@ int32_t llama_model_n_swa(const llama_model * model) {
     return model->hparams.n_swa;
 }
 
+int32_t llama_model_n_mtp(const llama_model * model) {
+    return model->n_mtp;
+}
+
 uint32_t llama_model_n_cls_out(const struct llama_model * model) {
     return model->hparams.n_cls_out;
 }
@@ -18790,6 +19047,23 @@ uint64_t llama_model_n_params(const llama_model * model) {
     return model->n_elements();
 }
 
+llama_perf_model_data llama_perf_model(const llama_model * model) {
+    llama_perf_model_data data = {};
+
+    if (model == nullptr) {
+        return data;
+    }
+
+    data.t_parse_ms  = 1e-3 * model->t_parse_us;
+    data.t_vocab_ms  = 1e-3 * model->t_vocab_us;
+    data.t_alloc_ms  = 1e-3 * model->t_alloc_us;
+    data.t_read_ms   = 1e-3 * model->t_read_us;
+    data.t_upload_ms = 1e-3 * model->t_upload_us;
+    data.t_load_ms   = 1e-3 * model->t_load_us;
+
+    return data;
+}
+
 bool llama_model_has_encoder(const llama_model * model) {
     switch (model->arch) {
         case LLM_ARCH_T5:        return true;
@@ -18813,6 +19087,10 @@ bool llama_model_is_recurrent(const llama_model * model) {
     return llm_arch_is_recurrent(model->arch);
 }
 
+bool llama_model_is_hybrid(const llama_model * model) {
+    return llm_arch_is_hybrid(model->arch);
+}
+
 bool llama_model_is_diffusion(const llama_model * model) {
     return llm_arch_is_diffusion(model->arch);
 }
@@ -274,6 +274,10 @@ struct llama_layer {
     struct ggml_tensor * ffn_act    = nullptr;
     struct ggml_tensor * ffn_exp_probs_b = nullptr;
 
+    // ff activation predictor (low rank)
+    struct ggml_tensor * ffn_pred_a = nullptr;
+    struct ggml_tensor * ffn_pred_b = nullptr;
+
     // mamba proj
     struct ggml_tensor * ssm_in  = nullptr;
     struct ggml_tensor * ssm_x   = nullptr;
@@ -418,6 +422,10 @@ struct llama_model {
 
     std::vector<llama_layer> layers;
 
+    // number of loaded MTP layers, see llama_model_params.use_mtp
+    // only the first one is evaluated, as the layer after the last transformer layer
+    uint32_t n_mtp = 0;
+
     llama_model_params params;
 
     // gguf metadata
@@ -432,6 +440,13 @@ struct llama_model {
     int64_t t_load_us  = 0;
     int64_t t_start_us = 0;
 
+    // load time of the phases, see llama_perf_model
+    int64_t t_parse_us  = 0;
+    int64_t t_vocab_us  = 0;
+    int64_t t_alloc_us  = 0;
+    int64_t t_read_us   = 0;
+    int64_t t_upload_us = 0;
+
     explicit llama_model(const struct llama_model_params & params);
     ~llama_model();
 
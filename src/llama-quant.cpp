@@ -3,11 +3,18 @@
 #include "llama-model.h"
 #include "llama-model-loader.h"
 
+#include "ggml-cpp.h"
+
 #include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <cstring>
 #include <cinttypes>
+#include <condition_variable>
+#include <deque>
+#include <exception>
 #include <fstream>
+#include <functional>
 #include <mutex>
 #include <regex>
 #include <thread>
@@ -26,6 +33,49 @@ static void zeros(std::ofstream & file, size_t n) {
     }
 }
 
+// bounded FIFO between the stages of the quantization pipeline (reader -> converter -> writer)
+// after close(), push() drops the item and pop() returns the remaining items and then false
+template <typename T>
+struct quantize_queue {
+    explicit quantize_queue(size_t capacity = 0) : capacity(capacity) {}
+
+    void push(T item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return closed || capacity == 0 || items.size() < capacity; });
+        if (closed) {
+            return;
+        }
+        items.push_back(std::move(item));
+        cv.notify_all();
+    }
+
+    bool pop(T & item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return closed || !items.empty(); });
+        if (items.empty()) {
+            return false;
+        }
+        item = std::move(items.front());
+        items.pop_front();
+        cv.notify_all();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        cv.notify_all();
+    }
+
+private:
+    const size_t capacity;
+
+    std::mutex              mutex;
+    std::condition_variable cv;
+    std::deque<T>           items;
+    bool                    closed = false;
+};
+
 static std::string remap_layer(const std::string & orig_name, const std::vector<int> & prune, std::map<int, std::string> & mapped, int & next_id) {
     if (prune.empty()) {
         return orig_name;
@@ -104,31 +154,26 @@ struct quantize_state_impl {
 };
 
 static void llama_tensor_dequantize_impl(
-    ggml_tensor * tensor, std::vector<no_init<float>> & output, std::vector<std::thread> & workers,
+    ggml_type type, const void * src, float * f32_output, std::vector<std::thread> & workers,
     const size_t nelements, const int nthread
 ) {
-    if (output.size() < nelements) {
-        output.resize(nelements);
-    }
-    float * f32_output = (float *) output.data();
-
-    const ggml_type_traits * qtype = ggml_get_type_traits(tensor->type);
-    if (ggml_is_quantized(tensor->type)) {
+    const ggml_type_traits * qtype = ggml_get_type_traits(type);
+    if (ggml_is_quantized(type)) {
         if (qtype->to_float == NULL) {
-            throw std::runtime_error(format("type %s unsupported for integer quantization: no dequantization available", ggml_type_name(tensor->type)));
+            throw std::runtime_error(format("type %s unsupported for integer quantization: no dequantization available", ggml_type_name(type)));
         }
-    } else if (tensor->type != GGML_TYPE_F16 &&
-               tensor->type != GGML_TYPE_BF16) {
-        throw std::runtime_error(format("cannot dequantize/convert tensor type %s", ggml_type_name(tensor->type)));
+    } else if (type != GGML_TYPE_F16 &&
+               type != GGML_TYPE_BF16) {
+        throw std::runtime_error(format("cannot dequantize/convert tensor type %s", ggml_type_name(type)));
     }
 
     if (nthread < 2) {
-        if (tensor->type == GGML_TYPE_F16) {
-            ggml_fp16_to_fp32_row((ggml_fp16_t *)tensor->data, f32_output, nelements);
-        } else if (tensor->type == GGML_TYPE_BF16) {
-            ggml_bf16_to_fp32_row((ggml_bf16_t *)tensor->data, f32_output, nelements);
-        } else if (ggml_is_quantized(tensor->type)) {
-            qtype->to_float(tensor->data, f32_output, nelements);
+        if (type == GGML_TYPE_F16) {
+            ggml_fp16_to_fp32_row((const ggml_fp16_t *)src, f32_output, nelements);
+        } else if (type == GGML_TYPE_BF16) {
+            ggml_bf16_to_fp32_row((const ggml_bf16_t *)src, f32_output, nelements);
+        } else if (ggml_is_quantized(type)) {
+            qtype->to_float(src, f32_output, nelements);
         } else {
             GGML_ABORT("fatal error"); // unreachable
         }
@@ -136,14 +181,14 @@ static void llama_tensor_dequantize_impl(
     }
 
     size_t block_size;
-    if (tensor->type == GGML_TYPE_F16 ||
-        tensor->type == GGML_TYPE_BF16) {
+    if (type == GGML_TYPE_F16 ||
+        type == GGML_TYPE_BF16) {
         block_size = 1;
     } else {
-        block_size = (size_t)ggml_blck_size(tensor->type);
+        block_size = (size_t)ggml_blck_size(type);
     }
 
-    size_t block_size_bytes = ggml_type_size(tensor->type);
+    size_t block_size_bytes = ggml_type_size(type);
 
     GGML_ASSERT(nelements % block_size == 0);
     size_t nblocks = nelements / block_size;
@@ -158,16 +203,16 @@ static void llama_tensor_dequantize_impl(
         size_t thr_elems = thr_blocks * block_size; // number of elements for this thread
         size_t thr_block_bytes = thr_blocks * block_size_bytes; // number of input bytes for this thread
 
-        auto compute = [qtype] (ggml_type typ, uint8_t * inbuf, float * outbuf, int nels) {
+        auto compute = [qtype] (ggml_type typ, const uint8_t * inbuf, float * outbuf, int64_t nels) {
             if (typ == GGML_TYPE_F16) {
-                ggml_fp16_to_fp32_row((ggml_fp16_t *)inbuf, outbuf, nels);
+                ggml_fp16_to_fp32_row((const ggml_fp16_t *)inbuf, outbuf, nels);
             } else if (typ == GGML_TYPE_BF16) {
-                ggml_bf16_to_fp32_row((ggml_bf16_t *)inbuf, outbuf, nels);
+                ggml_bf16_to_fp32_row((const ggml_bf16_t *)inbuf, outbuf, nels);
             } else {
                 qtype->to_float(inbuf, outbuf, nels);
             }
         };
-        workers.emplace_back(compute, tensor->type, (uint8_t *) tensor->data + in_buff_offs, f32_output + out_buff_offs, thr_elems);
+        workers.emplace_back(compute, type, (const uint8_t *) src + in_buff_offs, f32_output + out_buff_offs, thr_elems);
         in_buff_offs += thr_block_bytes;
         out_buff_offs += thr_elems;
     }
@@ -222,7 +267,7 @@ static ggml_type llama_tensor_get_type(quantize_state_impl & qs, ggml_type new_t
                      ftype == LLAMA_FTYPE_MOSTLY_IQ1_M) {
                 new_type = GGML_TYPE_Q5_K;
             }
-            else if (new_type != GGML_TYPE_Q8_0) {
+            else if (new_type != GGML_TYPE_Q8_0 && new_type != GGML_TYPE_F8_E4M3) {
                 new_type = GGML_TYPE_Q6_K;
             }
         }
@@ -476,49 +521,54 @@ static ggml_type llama_tensor_get_type(quantize_state_impl & qs, ggml_type new_t
     return new_type;
 }
 
-static size_t llama_tensor_quantize_impl(enum ggml_type new_type, const float * f32_data, void * new_data, const int64_t chunk_size, int64_t nrows, int64_t n_per_row, const float * imatrix, std::vector<std::thread> & workers, const int nthread) {
-    if (nthread < 2) {
-        // single-thread
-        size_t new_size = ggml_quantize_chunk(new_type, f32_data, new_data, 0, nrows, n_per_row, imatrix);
-        if (!ggml_validate_row_data(new_type, new_data, new_size)) {
-            throw std::runtime_error("quantized data validation failed");
-        }
-        return new_size;
+// quantize the rows [row0, row0 + nrows) of a tensor with n_rows_expert rows per expert
+// the rows are split in work items of up to chunk_size elements that never cross an expert boundary, since
+// each expert has its own importance matrix - all work items are shared by the threads, so that many small
+// experts in the same slice keep all threads busy
+static size_t llama_tensor_quantize_impl(enum ggml_type new_type, const float * f32_data, void * new_data, const int64_t chunk_size,
+        int64_t row0, int64_t nrows, int64_t n_rows_expert, int64_t n_per_row, const float * imatrix, std::vector<std::thread> & workers, const int nthread) {
+    const int64_t nrows_per_chunk = std::max<int64_t>(1, chunk_size / n_per_row);
+    const size_t  row_size        = ggml_row_size(new_type, n_per_row);
+
+    struct work_item {
+        int64_t first_row; // relative to row0
+        int64_t nrow;
+        const float * imatrix;
+    };
+
+    std::vector<work_item> items;
+    for (int64_t ir = row0; ir < row0 + nrows; ) {
+        const int64_t i03  = ir / n_rows_expert;
+        const int64_t iend = std::min({ row0 + nrows, (i03 + 1) * n_rows_expert, ir + nrows_per_chunk });
+        items.push_back({ ir - row0, iend - ir, imatrix ? imatrix + i03 * n_per_row : nullptr });
+        ir = iend;
     }
 
-    std::mutex mutex;
-    int64_t counter = 0;
-    size_t new_size = 0;
-    bool valid = true;
-    auto compute = [&mutex, &counter, &new_size, &valid, new_type, f32_data, new_data, chunk_size,
-            nrows, n_per_row, imatrix]() {
-        const int64_t nrows_per_chunk = chunk_size / n_per_row;
+    std::atomic<size_t> counter  = 0;
+    std::atomic<size_t> new_size = 0;
+    std::atomic<bool>   valid    = true;
+    auto compute = [&]() {
         size_t local_size = 0;
-        while (true) {
-            std::unique_lock<std::mutex> lock(mutex);
-            int64_t first_row = counter; counter += nrows_per_chunk;
-            if (first_row >= nrows) {
-                if (local_size > 0) {
-                    new_size += local_size;
-                }
+        while (valid) {
+            const size_t i = counter++;
+            if (i >= items.size()) {
                 break;
             }
-            lock.unlock();
-            const int64_t this_nrow = std::min(nrows - first_row, nrows_per_chunk);
-            size_t this_size = ggml_quantize_chunk(new_type, f32_data, new_data, first_row * n_per_row, this_nrow, n_per_row, imatrix);
+            const work_item & item = items[i];
+            void * this_data = (char *) new_data + item.first_row * row_size;
+            size_t this_size = ggml_quantize_chunk(new_type, f32_data + item.first_row * n_per_row, this_data, 0, item.nrow, n_per_row, item.imatrix);
             local_size += this_size;
 
             // validate the quantized data
-            const size_t row_size  = ggml_row_size(new_type, n_per_row);
-            void * this_data = (char *) new_data + first_row * row_size;
             if (!ggml_validate_row_data(new_type, this_data, this_size)) {
-                std::unique_lock<std::mutex> lock(mutex);
                 valid = false;
                 break;
             }
         }
+        new_size += local_size;
     };
-    for (int it = 0; it < nthread - 1; ++it) {
+    const int nthread_use = (int) std::max<size_t>(1, std::min<size_t>(nthread, items.size()));
+    for (int it = 0; it < nthread_use - 1; ++it) {
         workers.emplace_back(compute);
     }
     compute();
@@ -530,6 +580,103 @@ static size_t llama_tensor_quantize_impl(enum ggml_type new_type, const float *
     return new_size;
 }
 
+// offloads the quantization to a backend device through GGML_OP_CPY
+// only the types that the device can produce with GGML_OP_CPY are offloaded, without importance matrix, since the
+// cpy kernels implement the reference quantization - the remaining tensors are quantized on the CPU
+struct quantize_device {
+    ggml_backend_dev_t dev;
+    ggml_backend_ptr   backend;
+
+    explicit quantize_device(ggml_backend_dev_t dev) : dev(dev), backend(ggml_backend_dev_init(dev, nullptr)) {
+        if (!backend) {
+            throw std::runtime_error(format("failed to initialize the %s backend", ggml_backend_dev_name(dev)));
+        }
+    }
+
+    const char * name() const {
+        return ggml_backend_dev_name(dev);
+    }
+
+    // converts src_type to new_type in a single GGML_OP_CPY, or through f32 in two of them
+    enum path { PATH_NONE, PATH_DIRECT, PATH_F32 };
+
+    path get_path(ggml_type src_type, ggml_type new_type, int64_t n_per_row) {
+        const auto key = std::make_pair(src_type, new_type);
+        auto it = paths.find(key);
+        if (it != paths.end()) {
+            return it->second;
+        }
+
+        ggml_init_params params = {
+            /*.mem_size   =*/ 4*ggml_tensor_overhead(),
+            /*.mem_buffer =*/ nullptr,
+            /*.no_alloc   =*/ true,
+        };
+        ggml_context_ptr ctx { ggml_init(params) };
+
+        ggml_tensor * src = ggml_new_tensor_2d(ctx.get(), src_type,      n_per_row, 1);
+        ggml_tensor * f32 = ggml_new_tensor_2d(ctx.get(), GGML_TYPE_F32, n_per_row, 1);
+        ggml_tensor * dst = ggml_new_tensor_2d(ctx.get(), new_type,      n_per_row, 1);
+
+        path res = PATH_NONE;
+        if (ggml_backend_dev_supports_op(dev, ggml_cpy(ctx.get(), src, dst))) {
+            res = PATH_DIRECT;
+        } else if (ggml_backend_dev_supports_op(dev, ggml_cpy(ctx.get(), src, f32)) &&
+                   ggml_backend_dev_supports_op(dev, ggml_cpy(ctx.get(), f32, dst))) {
+            res = PATH_F32;
+        }
+
+        return paths[key] = res;
+    }
+
+    // quantize nrows rows of src to new_type into dst, returns the size of the quantized data
+    size_t quantize(ggml_type src_type, const void * src_data, ggml_type new_type, void * dst_data, int64_t n_per_row, int64_t nrows, path p) {
+        GGML_ASSERT(p != PATH_NONE);
+
+        ggml_init_params params = {
+            /*.mem_size   =*/ 4*ggml_tensor_overhead() + ggml_graph_overhead(),
+            /*.mem_buffer =*/ nullptr,
+            /*.no_alloc   =*/ true,
+        };
+        ggml_context_ptr ctx { ggml_init(params) };
+
+        ggml_tensor * src = ggml_new_tensor_2d(ctx.get(), src_type, n_per_row, nrows);
+        ggml_tensor * dst = ggml_new_tensor_2d(ctx.get(), new_type, n_per_row, nrows);
+        ggml_tensor * out;
+        if (p == PATH_DIRECT) {
+            out = ggml_cpy(ctx.get(), src, dst);
+        } else {
+            ggml_tensor * f32 = ggml_new_tensor_2d(ctx.get(), GGML_TYPE_F32, n_per_row, nrows);
+            out = ggml_cpy(ctx.get(), ggml_cpy(ctx.get(), src, f32), dst);
+        }
+
+        ggml_cgraph * gf = ggml_new_graph_custom(ctx.get(), GGML_DEFAULT_GRAPH_SIZE, false);
+        ggml_build_forward_expand(gf, out);
+
+        ggml_backend_buffer_ptr buf { ggml_backend_alloc_ctx_tensors(ctx.get(), backend.get()) };
+        if (!buf) {
+            throw std::runtime_error(format("failed to allocate the quantization buffers on %s", name()));
+        }
+
+        const size_t new_size = ggml_nbytes(dst);
+
+        ggml_backend_tensor_set(src, src_data, 0, ggml_nbytes(src));
+        if (ggml_backend_graph_compute(backend.get(), gf) != GGML_STATUS_SUCCESS) {
+            throw std::runtime_error(format("failed to quantize on %s", name()));
+        }
+        ggml_backend_tensor_get(dst, dst_data, 0, new_size);
+
+        if (!ggml_validate_row_data(new_type, dst_data, new_size)) {
+            throw std::runtime_error("quantized data validation failed");
+        }
+
+        return new_size;
+    }
+
+private:
+    std::map<std::pair<ggml_type, ggml_type>, path> paths;
+};
+
 static void llama_model_quantize_impl(const std::string & fname_inp, const std::string & fname_out, const llama_model_quantize_params * params) {
     ggml_type default_type;
     llama_ftype ftype = params->ftype;
@@ -540,6 +687,7 @@ static void llama_model_quantize_impl(const std::string & fname_inp, const std::
         case LLAMA_FTYPE_MOSTLY_Q5_0: default_type = GGML_TYPE_Q5_0; break;
         case LLAMA_FTYPE_MOSTLY_Q5_1: default_type = GGML_TYPE_Q5_1; break;
         case LLAMA_FTYPE_MOSTLY_Q8_0: default_type = GGML_TYPE_Q8_0; break;
+        case LLAMA_FTYPE_MOSTLY_F8_E4M3: default_type = GGML_TYPE_F8_E4M3; break;
         case LLAMA_FTYPE_MOSTLY_F16:  default_type = GGML_TYPE_F16;  break;
         case LLAMA_FTYPE_MOSTLY_BF16: default_type = GGML_TYPE_BF16; break;
         case LLAMA_FTYPE_ALL_F32:     default_type = GGML_TYPE_F32;  break;
@@ -581,6 +729,16 @@ static void llama_model_quantize_impl(const std::string & fname_inp, const std::
         nthread = std::thread::hardware_concurrency();
     }
 
+    std::unique_ptr<quantize_device> qdev;
+    if (params->device) {
+        ggml_backend_dev_t dev = ggml_backend_dev_by_name(params->device);
+        if (!dev) {
+            throw std::runtime_error(format("invalid device: %s", params->device));
+        }
+        qdev = std::make_unique<quantize_device>(dev);
+        LLAMA_LOG_INFO("%s: offloading the quantization to %s (%s) where supported\n", __func__, qdev->name(), ggml_backend_dev_description(dev));
+    }
+
     // mmap consistently increases speed on Linux, and also increases speed on Windows with
     // hot cache. It may cause a slowdown on macOS, possibly related to free memory.
 #if defined(__linux__) || defined(_WIN32)
@@ -640,11 +798,26 @@ static void llama_model_quantize_impl(const std::string & fname_inp, const std::
     gguf_set_val_u32(ctx_out.get(), "general.quantization_version", GGML_QNT_VERSION); // TODO: use LLM_KV
     gguf_set_val_u32(ctx_out.get(), "general.file_type", ftype); // TODO: use LLM_KV
 
+    if (params->tokenizer_index) {
+        model.load_vocab(ml);
+        model.vocab.write_index(ctx_out.get(), LLM_KV(model.arch));
+    }
+
     // Remove split metadata
     gguf_remove_key(ctx_out.get(), ml.llm_kv(LLM_KV_SPLIT_NO).c_str());
     gguf_remove_key(ctx_out.get(), ml.llm_kv(LLM_KV_SPLIT_COUNT).c_str());
     gguf_remove_key(ctx_out.get(), ml.llm_kv(LLM_KV_SPLIT_TENSORS_COUNT).c_str());
 
+    // the tensors of the base of a delta model are written in the output
+    if (gguf_find_key(ml.meta.get(), ml.llm_kv(LLM_KV_DELTA_BASE).c_str()) >= 0) {
+        if (params->keep_split) {
+            throw std::runtime_error("cannot keep the splits of a delta model");
+        }
+        gguf_remove_key(ctx_out.get(), ml.llm_kv(LLM_KV_DELTA_BASE).c_str());
+        gguf_remove_key(ctx_out.get(), ml.llm_kv(LLM_KV_DELTA_TENSORS).c_str());
+        gguf_remove_key(ctx_out.get(), ml.llm_kv(LLM_KV_DELTA_TENSOR_HASHES).c_str());
+    }
+
     if (params->kv_overrides) {
         const std::vector<llama_model_kv_override> & overrides = *(const std::vector<llama_model_kv_override> *)params->kv_overrides;
         for (const auto & o : overrides) {
@@ -738,8 +911,6 @@ static void llama_model_quantize_impl(const std::string & fname_inp, const std::
 
     int idx = 0;
 
-    std::vector<no_init<uint8_t>> read_data;
-    std::vector<no_init<uint8_t>> work;
     std::vector<no_init<float>> f32_conv_buf;
 
     uint16_t n_split = 1;
@@ -772,55 +943,187 @@ static void llama_model_quantize_impl(const std::string & fname_inp, const std::
         }
     }
 
-    int cur_split = -1;
+    // the output file is only accessed by the writer thread
     std::ofstream fout;
-    auto close_ofstream = [&]() {
+    auto close_ofstream = [&](int index) {
         // Write metadata and close file handler
         if (fout.is_open()) {
             fout.seekp(0);
-            std::vector<uint8_t> data(gguf_get_meta_size(ctx_outs[cur_split].get()));
-            gguf_get_meta_data(ctx_outs[cur_split].get(), data.data());
+            std::vector<uint8_t> data(gguf_get_meta_size(ctx_outs[index].get()));
+            gguf_get_meta_data(ctx_outs[index].get(), data.data());
             fout.write((const char *) data.data(), data.size());
             fout.close();
         }
     };
-    auto new_ofstream = [&](int index) {
-        cur_split = index;
-        GGML_ASSERT(ctx_outs[cur_split] && "Find uninitialized gguf_context");
+    auto new_ofstream = [&](int index, size_t meta_size) {
         std::string fname = fname_out;
         if (params->keep_split) {
             std::vector<char> split_path(llama_path_max(), 0);
-            llama_split_path(split_path.data(), split_path.size(), fname_out.c_str(), cur_split, n_split);
+            llama_split_path(split_path.data(), split_path.size(), fname_out.c_str(), index, n_split);
             fname = std::string(split_path.data());
         }
 
         fout = std::ofstream(fname, std::ios::binary);
         fout.exceptions(std::ofstream::failbit); // fail fast on write errors
-        const size_t meta_size = gguf_get_meta_size(ctx_outs[cur_split].get());
         // placeholder for the meta data
         ::zeros(fout, meta_size);
     };
 
+    // the tensors are streamed in slices of whole rows, so that the memory use does not depend on the size of the tensors:
+    // a reader thread loads slice i+1 while slice i is converted by the worker threads and a writer thread writes slice i-1
+    // LLAMA_QUANTIZE_SLICE_MB sets the size of a slice as f32 data (default: 128)
+    size_t slice_size = 128ull*1024*1024;
+    {
+        const char * LLAMA_QUANTIZE_SLICE_MB = getenv("LLAMA_QUANTIZE_SLICE_MB");
+        if (LLAMA_QUANTIZE_SLICE_MB) {
+            slice_size = std::max<size_t>(1, atoll(LLAMA_QUANTIZE_SLICE_MB))*1024*1024;
+        }
+    }
+
+    using slice_buffer = std::vector<no_init<uint8_t>>;
+
+    struct quantize_slice {
+        size_t          i_tensor = 0;
+        int64_t         row0     = 0;
+        int64_t         nrows    = 0;
+        const uint8_t * data     = nullptr;
+        slice_buffer  * buf      = nullptr; // nullptr when the data is mmap-ed
+        std::exception_ptr error;
+    };
+
+    struct write_task {
+        std::function<void()> fn;
+        slice_buffer                   * buf  = nullptr; // returned to the pool once written
+        quantize_queue<slice_buffer *> * pool = nullptr;
+    };
+
+    // double buffering between the stages
+    std::vector<slice_buffer> slice_bufs(4);
+    quantize_queue<slice_buffer *> free_inp;
+    quantize_queue<slice_buffer *> free_out;
+    free_inp.push(&slice_bufs[0]);
+    free_inp.push(&slice_bufs[1]);
+    free_out.push(&slice_bufs[2]);
+    free_out.push(&slice_bufs[3]);
+
+    quantize_queue<quantize_slice> slices(2);
+    quantize_queue<write_task>     writes;
+
+    std::atomic<bool> stop = false;
+
+    std::thread reader([&]() {
+        try {
+            for (size_t i_tensor = 0; i_tensor < tensors.size() && !stop; ++i_tensor) {
+                const auto & weight = *tensors[i_tensor];
+                const ggml_tensor * tensor = weight.tensor;
+
+                const int64_t nrows       = ggml_nrows(tensor);
+                const size_t  row_size    = ggml_row_size(tensor->type, tensor->ne[0]);
+                const int64_t nrows_slice = std::max<int64_t>(1, slice_size / (sizeof(float) * tensor->ne[0]));
+
+                for (int64_t row0 = 0; row0 < nrows && !stop; row0 += nrows_slice) {
+                    quantize_slice slice;
+                    slice.i_tensor = i_tensor;
+                    slice.row0     = row0;
+                    slice.nrows    = std::min(nrows - row0, nrows_slice);
+
+                    const size_t offs = weight.offs + row0 * row_size;
+                    const size_t size = slice.nrows * row_size;
+
+                    if (ml.use_mmap) {
+                        slice.data = (const uint8_t *) ml.mappings.at(weight.idx)->addr() + offs;
+                        llama_mmap::prefetch(slice.data, size);
+                    } else {
+                        if (!free_inp.pop(slice.buf)) {
+                            return;
+                        }
+                        if (slice.buf->size() < size) {
+                            slice.buf->resize(size);
+                        }
+                        ml.files.at(weight.idx)->read_raw_at(slice.buf->data(), size, offs);
+                        slice.data = (const uint8_t *) slice.buf->data();
+                    }
+
+                    if (ml.check_tensors && !ggml_validate_row_data(tensor->type, slice.data, size)) {
+                        throw std::runtime_error(format("tensor '%s' has invalid data", ggml_get_name(tensor)));
+                    }
+
+                    slices.push(std::move(slice));
+                }
+            }
+        } catch (...) {
+            quantize_slice slice;
+            slice.error = std::current_exception();
+            slices.push(std::move(slice));
+        }
+    });
+
+    std::atomic<bool>  write_failed = false;
+    std::exception_ptr write_error;
+
+    std::thread writer([&]() {
+        write_task task;
+        while (writes.pop(task)) {
+            if (!write_failed) {
+                try {
+                    task.fn();
+                } catch (...) {
+                    write_error  = std::current_exception();
+                    write_failed = true;
+                }
+            }
+            if (task.buf) {
+                task.pool->push(task.buf);
+            }
+        }
+    });
+
+    auto stop_pipeline = [&](bool abort) {
+        stop = true;
+        if (abort) {
+            write_failed = true;
+        }
+        free_inp.close();
+        slices.close();
+        writes.close();
+        reader.join();
+        writer.join();
+    };
+
+    int cur_split = -1;
+    auto switch_ofstream = [&](int index) {
+        GGML_ASSERT(ctx_outs[index] && "Find uninitialized gguf_context");
+        // the size of the meta data does not depend on the tensor types
+        const size_t meta_size = gguf_get_meta_size(ctx_outs[index].get());
+        writes.push({ [&close_ofstream, &new_ofstream, prev = cur_split, index, meta_size]() {
+            close_ofstream(prev);
+            new_ofstream(index, meta_size);
+        } });
+        cur_split = index;
+    };
+
+    // stop the pipeline threads on any exit path, e.g. when a tensor cannot be quantized
+    struct pipeline_guard {
+        std::function<void(bool)> stop;
+        bool stopped = false;
+        ~pipeline_guard() {
+            if (!stopped) {
+                stop(true);
+            }
+        }
+    } guard { stop_pipeline };
+
     const auto tn = LLM_TN(model.arch);
-    new_ofstream(0);
-    for (const auto * it : tensors) {
-        const auto & weight = *it;
+    switch_ofstream(0);
+    for (size_t i_tensor = 0; i_tensor < tensors.size(); ++i_tensor) {
+        const auto & weight = *tensors[i_tensor];
         ggml_tensor * tensor = weight.tensor;
         if (weight.idx != cur_split && params->keep_split) {
-            close_ofstream();
-            new_ofstream(weight.idx);
+            switch_ofstream(weight.idx);
         }
 
         const std::string name = ggml_get_name(tensor);
 
-        if (!ml.use_mmap) {
-            if (read_data.size() < ggml_nbytes(tensor)) {
-                read_data.resize(ggml_nbytes(tensor));
-            }
-            tensor->data = read_data.data();
-        }
-        ml.load_data_for(tensor);
-
         LLAMA_LOG_INFO("[%4d/%4d] %36s - [%s], type = %6s, ",
                ++idx, ml.n_tensors,
                ggml_get_name(tensor),
@@ -880,8 +1183,7 @@ static void llama_model_quantize_impl(const std::string & fname_inp, const std::
         quantize &= name.find("attn_rel_b.weight") == std::string::npos;
 
         ggml_type new_type;
-        void * new_data;
-        size_t new_size;
+        size_t new_size = 0;
 
         if (quantize) {
             new_type = default_type;
@@ -916,14 +1218,14 @@ static void llama_model_quantize_impl(const std::string & fname_inp, const std::
             quantize = tensor->type != new_type;
         }
 
+        const float * imatrix = nullptr;
+
+        quantize_device::path dev_path = quantize_device::PATH_NONE;
+
         if (!quantize) {
             new_type = tensor->type;
-            new_data = tensor->data;
-            new_size = ggml_nbytes(tensor);
             LLAMA_LOG_INFO("size = %8.3f MB\n", ggml_nbytes(tensor)/1024.0/1024.0);
         } else {
-            const int64_t nelements = ggml_nelements(tensor);
-
             const float * imatrix = nullptr;
             if (imatrix_data) {
                 auto it = imatrix_data->find(remap_imatrix(tensor->name, mapped));
@@ -960,67 +1262,95 @@ static void llama_model_quantize_impl(const std::string & fname_inp, const std::
                 throw std::runtime_error(format("Missing importance matrix for tensor %s in a very low-bit quantization", tensor->name));
             }
 
-            float * f32_data;
-
-            if (tensor->type == GGML_TYPE_F32) {
-                f32_data = (float *) tensor->data;
-            } else if (ggml_is_quantized(tensor->type) && !params->allow_requantize) {
+            if (ggml_is_quantized(tensor->type) && !params->allow_requantize) {
                 throw std::runtime_error(format("requantizing from type %s is disabled", ggml_type_name(tensor->type)));
-            } else {
-                llama_tensor_dequantize_impl(tensor, f32_conv_buf, workers, nelements, nthread);
-                f32_data = (float *) f32_conv_buf.data();
             }
 
-            LLAMA_LOG_INFO("converting to %s .. ", ggml_type_name(new_type));
+            if (qdev && !imatrix) {
+                dev_path = qdev->get_path(tensor->type, new_type, tensor->ne[0]);
+            }
+
+            if (dev_path != quantize_device::PATH_NONE) {
+                LLAMA_LOG_INFO("converting to %s on %s .. ", ggml_type_name(new_type), qdev->name());
+            } else {
+                LLAMA_LOG_INFO("converting to %s .. ", ggml_type_name(new_type));
+            }
             fflush(stdout);
+        }
+
+        const int64_t n_per_row = tensor->ne[0];
+        const int64_t nrows     = ggml_nrows(tensor);
 
-            if (work.size() < (size_t)nelements * 4) {
-                work.resize(nelements * 4); // upper bound on size
+        static const int64_t min_chunk_size = 32 * 512;
+        const int64_t chunk_size = (n_per_row >= min_chunk_size ? n_per_row : n_per_row * ((min_chunk_size + n_per_row - 1)/n_per_row));
+
+        for (int64_t nrows_done = 0; nrows_done < nrows; ) {
+            quantize_slice slice;
+            if (!slices.pop(slice)) {
+                throw std::runtime_error("quantization pipeline stopped unexpectedly");
             }
-            new_data = work.data();
-
-            const int64_t n_per_row = tensor->ne[0];
-            const int64_t nrows = tensor->ne[1];
-
-            static const int64_t min_chunk_size = 32 * 512;
-            const int64_t chunk_size = (n_per_row >= min_chunk_size ? n_per_row : n_per_row * ((min_chunk_size + n_per_row - 1)/n_per_row));
-
-            const int64_t nelements_matrix = tensor->ne[0] * tensor->ne[1];
-            const int64_t nchunk = (nelements_matrix + chunk_size - 1)/chunk_size;
-            const int64_t nthread_use = nthread > 1 ? std::max((int64_t)1, std::min((int64_t)nthread, nchunk)) : 1;
-
-            // quantize each expert separately since they have different importance matrices
-            new_size = 0;
-            for (int64_t i03 = 0; i03 < tensor->ne[2]; ++i03) {
-                const float * f32_data_03 = f32_data + i03 * nelements_matrix;
-                void * new_data_03 = (char *)new_data + ggml_row_size(new_type, n_per_row) * i03 * nrows;
-                const float * imatrix_03 = imatrix ? imatrix + i03 * n_per_row : nullptr;
-
-                new_size += llama_tensor_quantize_impl(new_type, f32_data_03, new_data_03, chunk_size, nrows, n_per_row, imatrix_03, workers, nthread_use);
-
-                // TODO: temporary sanity check that the F16 -> MXFP4 is lossless
-#if 0
-                if (new_type == GGML_TYPE_MXFP4) {
-                    auto * x = f32_data_03;
-
-                    //LLAMA_LOG_INFO("nrows = %d, n_per_row = %d\n", nrows, n_per_row);
-                    std::vector<float> deq(nrows*n_per_row);
-                    const ggml_type_traits * qtype = ggml_get_type_traits(new_type);
-                    qtype->to_float(new_data_03, deq.data(), deq.size());
-
-                    double err = 0.0f;
-                    for (int i = 0; i < (int) deq.size(); ++i) {
-                        err += fabsf(deq[i] - x[i]);
-                        //if (fabsf(deq[i] - x[i]) > 0.00001 && i < 256) {
-                        if (deq[i] != x[i]) {
-                            LLAMA_LOG_INFO("deq[%d] = %f, x[%d] = %f\n", i, deq[i], i, x[i]);
-                        }
+            if (slice.error) {
+                std::rethrow_exception(slice.error);
+            }
+            if (write_failed) {
+                std::rethrow_exception(write_error);
+            }
+            GGML_ASSERT(slice.i_tensor == i_tensor && slice.row0 == nrows_done);
+            nrows_done += slice.nrows;
+
+            if (!quantize) {
+                const size_t size = slice.nrows * ggml_row_size(tensor->type, n_per_row);
+                writes.push({ [&fout, data = slice.data, size]() {
+                    fout.write((const char *) data, size);
+                }, slice.buf, &free_inp });
+                new_size += size;
+                continue;
+            }
+
+            slice_buffer * work = nullptr;
+            if (!free_out.pop(work)) {
+                throw std::runtime_error("quantization pipeline stopped unexpectedly");
+            }
+            if (work->size() < ggml_row_size(new_type, n_per_row) * slice.nrows) {
+                work->resize(ggml_row_size(new_type, n_per_row) * slice.nrows);
+            }
+
+            size_t this_size;
+
+            if (dev_path != quantize_device::PATH_NONE) {
+                this_size = qdev->quantize(tensor->type, slice.data, new_type, work->data(), n_per_row, slice.nrows, dev_path);
+            } else {
+                const int64_t nelements = slice.nrows * n_per_row;
+
+                const float * f32_data;
+
+                if (tensor->type == GGML_TYPE_F32) {
+                    f32_data = (const float *) slice.data;
+                } else {
+                    if (f32_conv_buf.size() < (size_t) nelements) {
+                        f32_conv_buf.resize(nelements);
                     }
-                    //LLAMA_LOG_INFO("err = %f\n", err);
-                    GGML_ASSERT(err == 0.00000);
+                    llama_tensor_dequantize_impl(tensor->type, slice.data, (float *) f32_conv_buf.data(), workers, nelements, nthread);
+                    f32_data = (const float *) f32_conv_buf.data();
                 }
-#endif
+
+                // quantize each expert separately since they have different importance matrices
+                this_size = llama_tensor_quantize_impl(new_type, f32_data, work->data(), chunk_size,
+                        slice.row0, slice.nrows, tensor->ne[1], n_per_row, imatrix, workers, nthread);
+            }
+
+            // the source data is no longer needed
+            if (slice.buf) {
+                free_inp.push(slice.buf);
             }
+
+            writes.push({ [&fout, work, this_size]() {
+                fout.write((const char *) work->data(), this_size);
+            }, work, &free_out });
+            new_size += this_size;
+        }
+
+        if (quantize) {
             LLAMA_LOG_INFO("size = %8.2f MiB -> %8.2f MiB\n", ggml_nbytes(tensor)/1024.0/1024.0, new_size/1024.0/1024.0);
         }
         total_size_org += ggml_nbytes(tensor);
@@ -1029,13 +1359,21 @@ static void llama_model_quantize_impl(const std::string & fname_inp, const std::
         // update the gguf meta data as we go
         gguf_set_tensor_type(ctx_outs[cur_split].get(), name.c_str(), new_type);
         GGML_ASSERT(gguf_get_tensor_size(ctx_outs[cur_split].get(), gguf_find_tensor(ctx_outs[cur_split].get(), name.c_str())) == new_size);
-        gguf_set_tensor_data(ctx_outs[cur_split].get(), name.c_str(), new_data);
 
-        // write tensor data + padding
-        fout.write((const char *) new_data, new_size);
-        zeros(fout, GGML_PAD(new_size, align) - new_size);
+        // write padding
+        writes.push({ [&fout, pad = GGML_PAD(new_size, align) - new_size]() {
+            zeros(fout, pad);
+        } });
+    }
+    writes.push({ [&close_ofstream, last = cur_split]() {
+        close_ofstream(last);
+    } });
+
+    guard.stopped = true;
+    stop_pipeline(false);
+    if (write_failed) {
+        std::rethrow_exception(write_error);
     }
-    close_ofstream();
 
     LLAMA_LOG_INFO("%s: model size  = %8.2f MB\n", __func__, total_size_org/1024.0/1024.0);
     LLAMA_LOG_INFO("%s: quant size  = %8.2f MB\n", __func__, total_size_new/1024.0/1024.0);
@@ -1064,7 +1402,9 @@ llama_model_quantize_params llama_model_quantize_default_params() {
         /*.imatrix                     =*/ nullptr,
         /*.kv_overrides                =*/ nullptr,
         /*.tensor_type                 =*/ nullptr,
-        /*.prune_layers                =*/ nullptr
+        /*.prune_layers                =*/ nullptr,
+        /*.device                      =*/ nullptr,
+        /*.tokenizer_index             =*/ false,
     };
 
     return result;
@@ -12,6 +12,7 @@
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
+#include <deque>
 #include <numeric>
 #include <random>
 #include <unordered_map>
@@ -1598,6 +1599,49 @@ struct llama_sampler * llama_sampler_init_grammar_lazy_patterns(
     return llama_sampler_init_grammar_impl(vocab, grammar_str, grammar_root, /* lazy= */ true, nullptr, 0, trigger_tokens, num_trigger_tokens, trigger_patterns, num_trigger_patterns);
 }
 
+int32_t llama_sampler_grammar_forced_text(const struct llama_sampler * smpl, char * buf, int32_t len) {
+    if (smpl == nullptr || smpl->iface != &llama_sampler_grammar_i || len <= 0) {
+        return 0;
+    }
+
+    const auto * ctx = (const llama_sampler_grammar *) smpl->ctx;
+    if (ctx->grammar == nullptr) {
+        return 0;
+    }
+
+    const std::string text = llama_grammar_forced_str(*ctx->grammar, len);
+
+    memcpy(buf, text.data(), text.size());
+
+    return text.size();
+}
+
+void llama_sampler_grammar_prepare(const struct llama_sampler * smpl) {
+    if (smpl == nullptr || smpl->iface != &llama_sampler_grammar_i) {
+        return;
+    }
+
+    const auto * ctx = (const llama_sampler_grammar *) smpl->ctx;
+    if (ctx->grammar == nullptr) {
+        return;
+    }
+
+    llama_grammar_prepare_impl(*ctx->grammar);
+}
+
+// true if each of the tokens is at the index of its id in cur_p, as when cur_p is the whole vocabulary in token order
+// then the samplers that penalize a few tokens can visit them directly instead of scanning all the candidates
+template<typename T>
+static bool llama_sampler_tokens_at_ids(const llama_token_data_array * cur_p, const std::unordered_map<llama_token, T> & tokens) {
+    for (const auto & it : tokens) {
+        if ((size_t) it.first >= cur_p->size || cur_p->data[it.first].id != it.first) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
 // penalties
 
 struct llama_sampler_penalties {
@@ -1655,26 +1699,35 @@ static void llama_sampler_penalties_apply(struct llama_sampler * smpl, llama_tok
         return;
     }
 
-    // Apply frequency and presence penalties to the cur_p
-    for (size_t i = 0; i < cur_p->size; ++i) {
-        const auto token_iter = ctx->token_count.find(cur_p->data[i].id);
-        if (token_iter == ctx->token_count.end()) {
-            continue;
-        }
-
-        const int count = token_iter->second;
-
+    const auto apply = [&](llama_token_data & cur, int count) {
         assert(count > 0 && count <= ctx->penalty_last_n);
 
         // The academic publication that described this technique actually just only divided, but that would cause tokens with negative logits to become more likely, which is obviously wrong.
         // This is common fix for this problem, which is to multiply by the penalty instead of dividing.
-        if (cur_p->data[i].logit <= 0) {
-            cur_p->data[i].logit *= ctx->penalty_repeat;
+        if (cur.logit <= 0) {
+            cur.logit *= ctx->penalty_repeat;
         } else {
-            cur_p->data[i].logit /= ctx->penalty_repeat;
+            cur.logit /= ctx->penalty_repeat;
         }
 
-        cur_p->data[i].logit -= float(count) * ctx->penalty_freq + float(count > 0) * ctx->penalty_present;
+        cur.logit -= float(count) * ctx->penalty_freq + float(count > 0) * ctx->penalty_present;
+    };
+
+    // Apply frequency and presence penalties to the cur_p
+    if (llama_sampler_tokens_at_ids(cur_p, ctx->token_count)) {
+        // only visit the tokens of the window
+        for (const auto & [id, count] : ctx->token_count) {
+            apply(cur_p->data[id], count);
+        }
+    } else {
+        for (size_t i = 0; i < cur_p->size; ++i) {
+            const auto token_iter = ctx->token_count.find(cur_p->data[i].id);
+            if (token_iter == ctx->token_count.end()) {
+                continue;
+            }
+
+            apply(cur_p->data[i], token_iter->second);
+        }
     }
 
     cur_p->sorted = false;
@@ -1698,7 +1751,8 @@ static struct llama_sampler * llama_sampler_penalties_clone(const struct llama_s
     {
         auto * result_ctx = (llama_sampler_penalties *) result->ctx;
 
-        result_ctx->prev = ctx->prev;
+        result_ctx->prev        = ctx->prev;
+        result_ctx->token_count = ctx->token_count;
     }
 
     return result;
@@ -1827,9 +1881,26 @@ struct llama_sampler_dry {
     const int32_t dry_penalty_last_n;
 
     std::unordered_multimap<llama_token, std::vector<llama_token>> dry_processed_breakers;
-    std::vector<int> dry_repeat_count;
     std::unordered_map<llama_token, int> dry_max_token_repeat;
     ring_buffer<llama_token> last_tokens;
+
+    // the state below is updated by each accepted token, so that apply does not rescan the last tokens
+    // positions are counted from the first accepted token
+
+    int     dry_max_tail_len = 0; // max length of the tail of a restart sequence
+    int64_t n_accepted       = 0;
+
+    // the last restart sequence that is more than dry_max_tail_len tokens old: position of its head and length of its tail
+    int64_t restart_pos = -1;
+    int     restart_len = 0;
+
+    // positions of the tokens in the window, by token
+    std::unordered_map<llama_token, std::deque<int64_t>> token_pos;
+
+    // (position, length) of the repeats of the suffix that end before the last token, by position
+    // i.e. the number of tokens before position + 1 that are equal to the tokens before the end
+    std::vector<std::pair<int64_t, int>> repeats;
+    std::vector<std::pair<int64_t, int>> repeats_next;
 };
 
 // Ported from Koboldcpp, original PR: https://github.com/LostRuins/koboldcpp/pull/982 (Original author: pi6am)
@@ -1879,13 +1950,89 @@ static const char * llama_sampler_dry_name(const struct llama_sampler * /*smpl*/
     return "dry";
 }
 
+static int llama_sampler_dry_max_tail_len(const std::unordered_multimap<llama_token, std::vector<llama_token>> & breakers) {
+    int result = 0;
+    for (const auto & it : breakers) {
+        result = std::max(result, (int) it.second.size());
+    }
+
+    return result;
+}
+
+// length of the tail of the longest restart sequence whose head is the token `i` tokens from the end, -1 if none
+static int llama_sampler_dry_restart_len(const llama_sampler_dry * ctx, int i) {
+    auto its = ctx->dry_processed_breakers.equal_range(ctx->last_tokens.rat(i));
+
+    int longest_match = -1;
+    for (auto it = its.first; it != its.second; ++it) {
+        // Note that (*it) does not contain the head character, so seq_len will be
+        // the restart sequence length minus 1.
+        // In the common case of a single-token restart sequence, (*it) will be empty
+        // and we will trivially match.
+        int seq_len = (int)it->second.size();
+        if (seq_len > longest_match && seq_len <= i) {
+            bool match = true;
+            for (int offset = 0; offset < seq_len; ++offset) {
+                // The -1 when indexing `last_tokens` is because we already matched the head.
+                if (it->second[offset] != ctx->last_tokens.rat(i - offset - 1)) {
+                    match = false;
+                    break;
+                }
+            }
+            if (match) {
+                longest_match = seq_len;
+            }
+        }
+    }
+
+    return longest_match;
+}
+
 static void llama_sampler_dry_accept(struct llama_sampler * smpl, llama_token token) {
     auto * ctx = (llama_sampler_dry *) smpl->ctx;
     if (ctx->dry_multiplier == 0.0f || ctx->dry_base < 1.0f || ctx->dry_penalty_last_n == 0) {
         return;
     }
 
+    const int64_t pos = ctx->n_accepted++;
+
+    // positions before pos_min are out of any window
+    const int64_t pos_min = ctx->n_accepted - std::min<int64_t>(ctx->last_tokens.capacity, ctx->total_context_size);
+
+    auto & positions = ctx->token_pos[token];
+    while (!positions.empty() && positions.front() < pos_min) {
+        positions.pop_front();
+    }
+
+    // the suffix now ends with the token, so the repeats are the previous positions of the token
+    // that extend the repeats ending right before them - both lists are sorted by position
+    ctx->repeats_next.clear();
+    {
+        size_t j = 0;
+        for (const int64_t p : positions) {
+            while (j < ctx->repeats.size() && ctx->repeats[j].first < p - 1) {
+                ++j;
+            }
+            const int n = j < ctx->repeats.size() && ctx->repeats[j].first == p - 1 ? ctx->repeats[j].second : 0;
+
+            ctx->repeats_next.emplace_back(p, n + 1);
+        }
+    }
+    std::swap(ctx->repeats, ctx->repeats_next);
+
+    positions.push_back(pos);
+
     ctx->last_tokens.push_back(token);
+
+    // the restart sequences are final once all of their tails fit after the head
+    const int i = ctx->dry_max_tail_len + 1;
+    if (i < (int) ctx->last_tokens.size()) {
+        const int len = llama_sampler_dry_restart_len(ctx, i);
+        if (len >= 0) {
+            ctx->restart_pos = pos - i;
+            ctx->restart_len = len;
+        }
+    }
 }
 
 // Ported from Koboldcpp, original PR: https://github.com/LostRuins/koboldcpp/pull/982 (Original author: pi6am)
@@ -1903,7 +2050,6 @@ static void llama_sampler_dry_apply(struct llama_sampler * smpl, llama_token_dat
         return;
     }
 
-    ctx->dry_repeat_count.assign(last_n_repeat, 0);
     ctx->dry_max_token_repeat.clear();
 
     // Step 1: Look for restart sequences to limit the maximum repetition length.
@@ -1924,58 +2070,37 @@ static void llama_sampler_dry_apply(struct llama_sampler * smpl, llama_token_dat
     // restart sequences, 'ni' will be found first, and since it's shorter it will fail to suppress
     // 'otic'. This is a minor issue since fully contained restart sequences are likely to be rare.
     //
-    // This is theoretically worst-case O(N^2) for arbitrary restart sequences, which is why we
-    // have already clamped the maximum tail sequence length when generating `restart_sequences`.
-    // With clamping, this scan is O(N) in the context length.
+    // Only the heads whose tails can still grow are checked here - the last older restart sequence
+    // is tracked by llama_sampler_dry_accept - so this is O(1) in the context length.
 
     int rep_limit = last_n_repeat;
-    for (int i = 0; i < last_n_repeat; ++i) {
-        llama_token token = ctx->last_tokens.rat(i);
-        auto its = ctx->dry_processed_breakers.equal_range(token);
-        if (its.first == ctx->dry_processed_breakers.end()) {
-            continue;
-        }
-        int longest_match = -1;
-        for (auto it = its.first; it != its.second; ++it) {
-            // Note that (*it) does not contain the head character, so seq_len will be
-            // the restart sequence length minus 1.
-            // In the common case of a single-token restart sequence, (*it) will be empty
-            // and we will trivially match.
-            int seq_len = (int)it->second.size();
-            if (seq_len > longest_match && seq_len <= (int)i) {
-                bool match = true;
-                for (int offset = 0; offset < seq_len; ++offset) {
-                    // The -1 when indexing `last_tokens` is because we already matched the head.
-                    if (it->second[offset] != ctx->last_tokens.rat(i - offset - 1)) {
-                        match = false;
-                        break;
-                    }
-                }
-                if (match) {
-                    longest_match = seq_len;
-                }
+    {
+        bool found = false;
+        for (int i = 0; i < std::min(last_n_repeat, ctx->dry_max_tail_len + 1); ++i) {
+            const int longest_match = llama_sampler_dry_restart_len(ctx, i);
+            if (longest_match >= 0) {
+                // We found a restart sequence starting `i` tokens from the end and continuing for
+                // `longest_match` tokens.
+                rep_limit = i - longest_match;
+                found = true;
+                break;
             }
         }
-        if (longest_match >= 0) {
-            // We found a restart sequence starting `i` tokens from the end and continuing for
-            // `longest_match` tokens.
-            rep_limit = i - longest_match;
-            break;
+        if (!found && ctx->restart_pos >= 0) {
+            const int64_t i = ctx->n_accepted - 1 - ctx->restart_pos;
+            if (i < last_n_repeat) {
+                rep_limit = i - ctx->restart_len;
+            }
         }
     }
     if (rep_limit < ctx->dry_allowed_length) {
         return;
     }
 
-    // Step 2: Iterate in reverse over the last N tokens of the context, using the "Z-algorithm" (in
-    // the reverse direction) to efficiently compute the positions and lengths of suffixes appearing
-    // elsewhere in the context. We limit the suffix length to `rep_limit` to respect restart sequences.
-    //
-    // This algorithm is not currently documented on Wikipedia, but there is a clear description here:
-    // https://ivanyu.me/blog/2014/10/15/z-algorithm/
-    //
-    // The code below is adapted from the public domain implementation by the same author here:
-    // https://github.com/ivanyu/string-algorithms/blob/master/z_algorithm.py
+    // Step 2: Visit the positions where the suffix of the last N tokens also appears elsewhere in the
+    // context. These repeats are maintained by llama_sampler_dry_accept: when a token is accepted, only
+    // its previous positions can end a repeat, which extends the repeat that ended right before them.
+    // We limit the repeat length to the window and to `rep_limit` to respect restart sequences.
     //
     // Example:
     // Last N tokens: a b c c b c y a b c
@@ -1983,71 +2108,26 @@ static void llama_sampler_dry_apply(struct llama_sampler * smpl, llama_token_dat
     //                    ^
     //   This `3` means that the last three tokens of the context (a b c) also appear here.
     //
-    // This step is worst case O(N) since the Z-algorithm is linear, despite the appearance of nested
-    // for/while loops. This can be seen by observing that the `lt` and `rt` bounds are set after each
-    // repeated suffix is detected (i.e. after each while loop when n > 0). These bound variables
-    // ensure that the inner while loops only examine each token in the context once as the outer
-    // for loop iterates over the context.
-
-    {
-        const int last = last_n_repeat - 1;
-        int rt = 0, lt = 0;
-
-        for (int k = 1; k < last_n_repeat; ++k) {
-            if (k > rt) {
-                // If k is outside the current Z-box, do naive computation.
-                int n = 0;
-                while (n + k < last_n_repeat && ctx->last_tokens.rat(n) == ctx->last_tokens.rat(n+k)) {
-                    ++n;
-                }
-                ctx->dry_repeat_count[last - k] = std::min(n, rep_limit);
-                if (n > 0) {
-                    lt = k;
-                    rt = k + n - 1;
-                }
-            } else {
-                // If k is inside the current Z-box, consider two cases.
-
-                int p = k - lt; // Pair index.
-                int right_part_len = rt - k + 1;
-
-                if (ctx->dry_repeat_count[last - p] < right_part_len) {
-                    int n = std::min(ctx->dry_repeat_count[last - p], rep_limit);
-                    ctx->dry_repeat_count[last - k] = n;
-                } else {
-                    int i = rt + 1;
-                    while (i < last_n_repeat && ctx->last_tokens.rat(i) == ctx->last_tokens.rat(i - k)) {
-                        i += 1;
-                    }
-
-                    int n = std::min(i - k, rep_limit);
-                    ctx->dry_repeat_count[last - k] = n;
-                    lt = k;
-                    rt = i - 1;
-                }
-            }
-        }
-    }
-
-    // Step 3: Iterate over dry_repeat_count and last_tokens, examining the maximum repeat length
-    // that would be generated by emitting each new token that would extend a sequence.
-    //
-    // Following the same example as above:
-    // Last N tokens: a b c c b c y a b c
-    // Repeat counts: 0 0 3 1 0 2 0 0 0 0
-    //
-    // For each non-zero, look ahead one token. This token, if emitted, would extend the repetition.
+    // For each repeat, look ahead one token. This token, if emitted, would extend the repetition.
     // c: 3 -> 4 (from `a b c` to `a b c c`)
     // b: 1 -> 2 (from `c` to `c b`)
     // y: 2 -> 3 (from `b c` to `b c y`)
+    //
+    // This step is O(R) in the number of repeats, i.e. the number of previous positions of the last token.
+
+    const int64_t pos_first = ctx->n_accepted - last_n_repeat;
 
-    for (int i = 0; i < last_n_repeat - 1; ++i) {
-        int repeat_len = ctx->dry_repeat_count[i];
+    for (const auto & [pos, n] : ctx->repeats) {
+        if (pos < pos_first) {
+            continue;
+        }
+
+        const int repeat_len = std::min({ n, (int) (pos - pos_first + 1), rep_limit });
         if (repeat_len >= ctx->dry_allowed_length) {
             // This token ends a repeat, so the next token would continue one.
             // By convention, the value of `repeat_len` only includes the tokens currently
             // in the context, not the new token that would be added.
-            llama_token token = ctx->last_tokens.rat(last_n_repeat - 2 - i);
+            llama_token token = ctx->last_tokens.rat(ctx->n_accepted - 2 - pos);
             // Track the maximum sequence ending in this token.
             const auto& it = ctx->dry_max_token_repeat.find(token);
             if (it == ctx->dry_max_token_repeat.end() || it->second < repeat_len) {
@@ -2056,7 +2136,7 @@ static void llama_sampler_dry_apply(struct llama_sampler * smpl, llama_token_dat
         }
     }
 
-    // Step 4: Apply logit penalties based on the maximum repeat length for relevant tokens.
+    // Step 3: Apply logit penalties based on the maximum repeat length for relevant tokens.
 
     // Prevent floating point overflow in `pow(penalty_base, exponent)` by clamping to `max_exponent`.
     // Compute it from `penalty_base` and the approximate log of `std::numeric_limits<float>::max()`
@@ -2066,28 +2146,38 @@ static void llama_sampler_dry_apply(struct llama_sampler * smpl, llama_token_dat
         max_exponent = FLOAT_MAX_LOG / std::log(ctx->dry_base);
     }
 
-    for (size_t i = 0; i < cur_p->size; ++i) {
-        const auto& af_kvp = ctx->dry_max_token_repeat.find(cur_p->data[i].id);
-        if (af_kvp != ctx->dry_max_token_repeat.end()) {
-            // Check all sequence breakers starting with this token
-            auto range = ctx->dry_processed_breakers.equal_range(cur_p->data[i].id);
-            bool is_single_token_breaker = false;
-
-            for (auto it = range.first; it != range.second; ++it) {
-                if (it->second.empty()) {
-                    is_single_token_breaker = true;
-                    break;
-                }
+    const auto apply = [&](llama_token_data & cur, int max_repeat) {
+        // Check all sequence breakers starting with this token
+        auto range = ctx->dry_processed_breakers.equal_range(cur.id);
+        bool is_single_token_breaker = false;
+
+        for (auto it = range.first; it != range.second; ++it) {
+            if (it->second.empty()) {
+                is_single_token_breaker = true;
+                break;
             }
+        }
 
-            // Apply penalty only if it's not a single-token sequence breaker
-            if (!is_single_token_breaker) {
-                int repeat_exp = af_kvp->second - ctx->dry_allowed_length;
-                if (max_exponent > 0 && repeat_exp > max_exponent) {
-                    repeat_exp = max_exponent;
-                }
-                float penalty = ctx->dry_multiplier * std::pow(ctx->dry_base, repeat_exp);
-                cur_p->data[i].logit -= penalty;
+        // Apply penalty only if it's not a single-token sequence breaker
+        if (!is_single_token_breaker) {
+            int repeat_exp = max_repeat - ctx->dry_allowed_length;
+            if (max_exponent > 0 && repeat_exp > max_exponent) {
+                repeat_exp = max_exponent;
+            }
+            float penalty = ctx->dry_multiplier * std::pow(ctx->dry_base, repeat_exp);
+            cur.logit -= penalty;
+        }
+    };
+
+    if (llama_sampler_tokens_at_ids(cur_p, ctx->dry_max_token_repeat)) {
+        for (const auto & [id, max_repeat] : ctx->dry_max_token_repeat) {
+            apply(cur_p->data[id], max_repeat);
+        }
+    } else {
+        for (size_t i = 0; i < cur_p->size; ++i) {
+            const auto& af_kvp = ctx->dry_max_token_repeat.find(cur_p->data[i].id);
+            if (af_kvp != ctx->dry_max_token_repeat.end()) {
+                apply(cur_p->data[i], af_kvp->second);
             }
         }
     }
@@ -2098,8 +2188,12 @@ static void llama_sampler_dry_apply(struct llama_sampler * smpl, llama_token_dat
 static void llama_sampler_dry_reset(struct llama_sampler * smpl) {
     auto * ctx = (llama_sampler_dry *) smpl->ctx;
     ctx->last_tokens.clear();
-    ctx->dry_repeat_count.clear();
     ctx->dry_max_token_repeat.clear();
+    ctx->n_accepted  = 0;
+    ctx->restart_pos = -1;
+    ctx->restart_len = 0;
+    ctx->token_pos.clear();
+    ctx->repeats.clear();
 }
 
 static struct llama_sampler * llama_sampler_dry_clone(const struct llama_sampler * smpl) {
@@ -2114,9 +2208,14 @@ static struct llama_sampler * llama_sampler_dry_clone(const struct llama_sampler
     {
         auto * result_ctx = (llama_sampler_dry *) result->ctx;
         result_ctx->dry_processed_breakers = ctx->dry_processed_breakers;
-        result_ctx->dry_repeat_count = ctx->dry_repeat_count;
         result_ctx->dry_max_token_repeat = ctx->dry_max_token_repeat;
         result_ctx->last_tokens = ctx->last_tokens;
+        result_ctx->dry_max_tail_len = ctx->dry_max_tail_len;
+        result_ctx->n_accepted  = ctx->n_accepted;
+        result_ctx->restart_pos = ctx->restart_pos;
+        result_ctx->restart_len = ctx->restart_len;
+        result_ctx->token_pos   = ctx->token_pos;
+        result_ctx->repeats     = ctx->repeats;
     }
 
     return result;
@@ -2166,6 +2265,8 @@ struct llama_sampler * llama_sampler_init_dry(const struct llama_vocab * vocab,
         }
     }
 
+    const int max_tail_len = llama_sampler_dry_max_tail_len(processed_breakers);
+
     return llama_sampler_init(
         /* .iface = */ &llama_sampler_dry_i,
         /* .ctx   = */ new llama_sampler_dry {
@@ -2175,9 +2276,15 @@ struct llama_sampler * llama_sampler_init_dry(const struct llama_vocab * vocab,
             /* .dry_allowed_length     = */ dry_allowed_length,
             /* .dry_penalty_last_n     = */ dry_penalty_last_n,
             /* .dry_processed_breakers = */ std::move(processed_breakers),
-            /* .dry_repeat_count       = */ dry_enabled ? std::vector<int>(effective_dry_penalty_last_n, 0) : std::vector<int>{},
             /* .dry_max_token_repeat   = */ {},
             /* .last_tokens            = */ dry_enabled ? ring_buffer<llama_token>(effective_dry_penalty_last_n) : ring_buffer<llama_token>(0),
+            /* .dry_max_tail_len       = */ max_tail_len,
+            /* .n_accepted             = */ 0,
+            /* .restart_pos            = */ -1,
+            /* .restart_len            = */ 0,
+            /* .token_pos              = */ {},
+            /* .repeats                = */ {},
+            /* .repeats_next           = */ {},
         }
     );
 }
@@ -2208,6 +2315,8 @@ struct llama_sampler * llama_sampler_init_dry_testing(int32_t context_size, floa
         }
     }
 
+    ctx->dry_max_tail_len = llama_sampler_dry_max_tail_len(ctx->dry_processed_breakers);
+
     return result;
 }
 
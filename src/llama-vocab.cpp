@@ -16,15 +16,21 @@
 #include <cstring>
 #include <forward_list>
 #include <limits>
+#include <list>
 #include <map>
+#include <mutex>
 #include <queue>
 #include <set>
+#include <string_view>
 #include <unordered_map>
 
 //
 // helpers
 //
 
+// version of the tokenizer index written by llama_vocab::write_index - bump it when the pieces change
+static constexpr uint32_t LLAMA_VOCAB_INDEX_VERSION = 1;
+
 struct naive_trie {
     naive_trie() : has_value(false), value(0) {
     }
@@ -95,12 +101,11 @@ static_assert(std::is_trivially_copyable<llm_symbol>::value, "llm_symbol is not
 
 struct llm_bigram_spm {
     struct comparator {
-        bool operator()(llm_bigram_spm & l, llm_bigram_spm & r) {
+        bool operator()(const llm_bigram_spm & l, const llm_bigram_spm & r) const {
             return (l.score < r.score) || (l.score == r.score && l.left > r.left);
         }
     };
     using queue_storage = std::vector<llm_bigram_spm>;
-    using queue = std::priority_queue<llm_bigram_spm, queue_storage, comparator>;
     llm_symbol::index left;
     llm_symbol::index right;
     float score;
@@ -112,9 +117,24 @@ struct llm_tokenizer_spm : llm_tokenizer {
 };
 
 struct llm_tokenizer_spm_session {
-    llm_tokenizer_spm_session(const llama_vocab & vocab) : vocab(vocab) {}
+    // the buffers of the session - reused across the calls to avoid the allocations in steady state
+    struct buffers {
+        std::string text; // the escaped text of the fragment, see llama_vocab::impl::tokenize()
+        std::string word; // the text of the symbol or bigram being looked up
+
+        std::vector<llm_symbol>            symbols;
+        llm_bigram_spm::queue_storage      work_queue; // binary heap, see llm_bigram_spm::comparator
+        // the last merge of each text, the keys point into the text of the fragment
+        std::unordered_map<std::string_view, std::pair<llm_symbol::index, llm_symbol::index>> rev_merge;
+    };
+
+    llm_tokenizer_spm_session(const llama_vocab & vocab, buffers & buf) : vocab(vocab), symbols(buf.symbols), work_queue(buf.work_queue), rev_merge(buf.rev_merge), word(buf.word) {}
 
     void tokenize(const std::string & text, std::vector<llama_token> & output) {
+        symbols.clear();
+        work_queue.clear();
+        rev_merge.clear();
+
         // split string into utf8 chars
         int index = 0;
         size_t offs = 0;
@@ -130,6 +150,10 @@ struct llm_tokenizer_spm_session {
             symbols.emplace_back(sym);
         }
 
+        if (symbols.empty()) {
+            return;
+        }
+
         // seed the work queue with all possible 2-character tokens.
         for (int i = 1; i < (int) symbols.size(); ++i) {
             try_add_bigram(i - 1, i);
@@ -137,8 +161,9 @@ struct llm_tokenizer_spm_session {
 
         // keep substituting the highest frequency pairs for as long as we can.
         while (!work_queue.empty()) {
-            auto bigram = work_queue.top();
-            work_queue.pop();
+            std::pop_heap(work_queue.begin(), work_queue.end(), llm_bigram_spm::comparator());
+            auto bigram = work_queue.back();
+            work_queue.pop_back();
 
             auto & left_sym = symbols[bigram.left];
             auto & right_sym = symbols[bigram.right];
@@ -174,8 +199,8 @@ struct llm_tokenizer_spm_session {
 
 private:
     void resegment(llm_symbol & symbol, std::vector<llama_token> & output) {
-        auto text = std::string(symbol.text, symbol.n);
-        auto token = vocab.text_to_token(text);
+        word.assign(symbol.text, symbol.n);
+        auto token = vocab.text_to_token(word);
 
         // Do we need to support is_unused?
         if (token != LLAMA_TOKEN_NULL) {
@@ -183,7 +208,7 @@ private:
             return;
         }
 
-        const auto p = rev_merge.find(text);
+        auto p = rev_merge.find(std::string_view(symbol.text, symbol.n));
 
         if (p == rev_merge.end()) {
             // output any symbols that did not form tokens as bytes.
@@ -195,16 +220,19 @@ private:
             return;
         }
 
-        resegment(symbols[p->second.first], output);
-        resegment(symbols[p->second.second], output);
+        const auto left  = p->second.first;
+        const auto right = p->second.second;
+
+        resegment(symbols[left],  output);
+        resegment(symbols[right], output);
     }
 
     void try_add_bigram(int left, int right) {
         if (left == -1 || right == -1) {
             return;
         }
-        const std::string text = std::string(symbols[left].text, symbols[left].n + symbols[right].n);
-        auto token = vocab.text_to_token(text);
+        word.assign(symbols[left].text, symbols[left].n + symbols[right].n);
+        auto token = vocab.text_to_token(word);
 
         if (token == LLAMA_TOKEN_NULL) {
             return;
@@ -220,21 +248,23 @@ private:
         bigram.left  = left;
         bigram.right = right;
         bigram.score = tok_data.score;
-        bigram.size  = text.size();
+        bigram.size  = word.size();
 
-        work_queue.push(bigram);
+        work_queue.push_back(bigram);
+        std::push_heap(work_queue.begin(), work_queue.end(), llm_bigram_spm::comparator());
 
         // Do we need to support is_unused?
-        rev_merge[text] = std::make_pair(left, right);
+        rev_merge.insert_or_assign(std::string_view(symbols[left].text, bigram.size), std::make_pair(left, right));
     }
 
     const llama_vocab & vocab;
     // currently unused
     // const llm_tokenizer_spm * spm_tokenizer;
 
-    std::vector<llm_symbol> symbols;
-    llm_bigram_spm::queue work_queue;
-    std::map<std::string, std::pair<int, int>> rev_merge;
+    std::vector<llm_symbol> & symbols;
+    llm_bigram_spm::queue_storage & work_queue;
+    std::unordered_map<std::string_view, std::pair<llm_symbol::index, llm_symbol::index>> & rev_merge;
+    std::string & word;
 };
 
 //
@@ -496,61 +526,18 @@ struct llm_tokenizer_bpe_session {
         symbols_final.clear();
 
         for (const auto & word : word_collection) {
-            work_queue = llm_bigram_bpe::queue();
             symbols.clear();
 
-            int index = 0;
-            size_t offset = 0;
-
-            //if (vocab.tokenizer_ignore_merges && vocab.token_to_id.find(word) != vocab.token_to_id.end()) {
-            if (vocab.get_ignore_merges() && vocab.text_to_token(word) != LLAMA_TOKEN_NULL) {
-                symbols.emplace_back(llm_symbol{-1, -1, word.c_str(), word.size()});
-                offset = word.size();
-            }
-
-            while (offset < word.size()) {
-                llm_symbol sym;
-                size_t char_len = std::min(word.size() - offset, (size_t) unicode_len_utf8(word[offset]));
-                sym.text = word.c_str() + offset;
-                sym.n = char_len;
-                offset += sym.n;
-                sym.prev = index - 1;
-                sym.next = offset == word.size() ? -1 : index + 1;
-                index++;
-                symbols.emplace_back(sym);
-            }
-            for (int i = 1; i < (int) symbols.size(); ++i) {
-                add_new_bigram(i - 1, i);
-            }
-
-            // build token(s)
-            while (!work_queue.empty()) {
-                auto bigram = work_queue.pop_move();
-
-                auto & left_symbol = symbols[bigram.left];
-                auto & right_symbol = symbols[bigram.right];
-
-                if (left_symbol.n == 0 || right_symbol.n == 0) {
-                    continue;
-                }
-                std::string left_token = std::string(left_symbol.text, left_symbol.n);
-                std::string right_token = std::string(right_symbol.text, right_symbol.n);
-                if (left_token + right_token != bigram.text) {
-                    continue;  // Skip this bigram if it's outdated
-                }
-
-                // merge the right sym into the left one
-                left_symbol.n += right_symbol.n;
-                right_symbol.n = 0;
-
-                // remove the right sym from the chain
-                left_symbol.next = right_symbol.next;
-                if (right_symbol.next >= 0) {
-                    symbols[right_symbol.next].prev = bigram.left;
+            // repeated words reuse the result of their merges
+            const auto it = word_merges.find(word);
+            if (it != word_merges.end()) {
+                size_t offset = 0;
+                for (const size_t n : it->second) {
+                    symbols.emplace_back(llm_symbol{-1, -1, word.c_str() + offset, n});
+                    offset += n;
                 }
-
-                add_new_bigram(left_symbol.prev, bigram.left);  // left side of current symbol
-                add_new_bigram(bigram.left, left_symbol.next);  // right side of current symbol
+            } else {
+                merge(word);
             }
 
             // add the finished tokens to the final list keeping correct order for next and prev
@@ -595,6 +582,73 @@ struct llm_tokenizer_bpe_session {
     }
 
 private:
+    // split the word into symbols and apply the BPE merges
+    void merge(const std::string & word) {
+        work_queue = llm_bigram_bpe::queue();
+
+        int index = 0;
+        size_t offset = 0;
+
+        //if (vocab.tokenizer_ignore_merges && vocab.token_to_id.find(word) != vocab.token_to_id.end()) {
+        if (vocab.get_ignore_merges() && vocab.text_to_token(word) != LLAMA_TOKEN_NULL) {
+            symbols.emplace_back(llm_symbol{-1, -1, word.c_str(), word.size()});
+            offset = word.size();
+        }
+
+        while (offset < word.size()) {
+            llm_symbol sym;
+            size_t char_len = std::min(word.size() - offset, (size_t) unicode_len_utf8(word[offset]));
+            sym.text = word.c_str() + offset;
+            sym.n = char_len;
+            offset += sym.n;
+            sym.prev = index - 1;
+            sym.next = offset == word.size() ? -1 : index + 1;
+            index++;
+            symbols.emplace_back(sym);
+        }
+        for (int i = 1; i < (int) symbols.size(); ++i) {
+            add_new_bigram(i - 1, i);
+        }
+
+        // build token(s)
+        while (!work_queue.empty()) {
+            auto bigram = work_queue.pop_move();
+
+            auto & left_symbol = symbols[bigram.left];
+            auto & right_symbol = symbols[bigram.right];
+
+            if (left_symbol.n == 0 || right_symbol.n == 0) {
+                continue;
+            }
+            std::string left_token = std::string(left_symbol.text, left_symbol.n);
+            std::string right_token = std::string(right_symbol.text, right_symbol.n);
+            if (left_token + right_token != bigram.text) {
+                continue;  // Skip this bigram if it's outdated
+            }
+
+            // merge the right sym into the left one
+            left_symbol.n += right_symbol.n;
+            right_symbol.n = 0;
+
+            // remove the right sym from the chain
+            left_symbol.next = right_symbol.next;
+            if (right_symbol.next >= 0) {
+                symbols[right_symbol.next].prev = bigram.left;
+            }
+
+            add_new_bigram(left_symbol.prev, bigram.left);  // left side of current symbol
+            add_new_bigram(bigram.left, left_symbol.next);  // right side of current symbol
+        }
+
+        // remember the merges of this word
+        auto & lens = word_merges[word];
+        for (const auto & sym : symbols) {
+            if (sym.n > 0) {
+                lens.push_back(sym.n);
+            }
+        }
+    }
+
     void add_new_bigram(int left, int right) {
         if (left == -1 || right == -1) {
             return;
@@ -627,6 +681,9 @@ private:
     std::vector<llm_symbol> symbols;
     std::vector<llm_symbol> symbols_final;
     llm_bigram_bpe::queue work_queue;
+
+    // symbol lengths of the already merged words
+    std::unordered_map<std::string, std::vector<size_t>> word_merges;
 };
 
 //
@@ -817,7 +874,23 @@ struct llm_tokenizer_ugm : llm_tokenizer {
 };
 
 struct llm_tokenizer_ugm_session {
-    llm_tokenizer_ugm_session(const llama_vocab & vocab, const llm_tokenizer_ugm & tokenizer) : vocab(vocab), tokenizer(tokenizer) {}
+    // this structure stores the best tokenization so far at input_offset
+    struct best_tokenization {
+        llama_token token_id;
+        size_t input_offset;
+        double score_sum;
+    };
+
+    // the buffers of the session - reused across the calls to avoid the allocations in steady state
+    struct buffers {
+        std::string text;       // the text of the fragment, see llama_vocab::impl::tokenize()
+        std::string normalized; // the normalized text
+
+        std::vector<best_tokenization> tokenization_results;
+    };
+
+    llm_tokenizer_ugm_session(const llama_vocab & vocab, const llm_tokenizer_ugm & tokenizer, buffers & buf) :
+        vocab(vocab), tokenizer(tokenizer), normalized(buf.normalized), tokenization_results(buf.tokenization_results) {}
 
     /* This implementation is based on SentencePiece optimized Viterbi algorithm for
      * unigram language models. The general idea is to:
@@ -837,7 +910,6 @@ struct llm_tokenizer_ugm_session {
         size_t output_size = output.size();
 
         // normalize the input first
-        std::string normalized;
         normalize(text, &normalized);
         size_t input_len = normalized.size();
         if (input_len == 0) {
@@ -845,7 +917,7 @@ struct llm_tokenizer_ugm_session {
         }
 
         // initialize score_sum to -FLT_MAX so it will be always lower than sums of token scores
-        std::vector<struct best_tokenization> tokenization_results(input_len + 1, {vocab.token_unk(), 0, -DBL_MAX});
+        tokenization_results.assign(input_len + 1, {vocab.token_unk(), 0, -DBL_MAX});
         // at the beginning tokenization score is zero
         tokenization_results[0] = { vocab.token_unk(), 0, 0 };
 
@@ -1013,13 +1085,6 @@ private:
         size_t xcda_array_size;
     };
 
-    // this structure stores the best tokenization so far at input_offset
-    struct best_tokenization {
-        llama_token token_id;
-        size_t input_offset;
-        double score_sum;
-    };
-
     struct normalization_result normalize_prefix(const std::string & input, size_t input_offset) {
         if (input_offset == input.size()) {
             return { &input[input_offset], 0, 0 };
@@ -1093,6 +1158,9 @@ private:
 
     const llama_vocab & vocab;
     const llm_tokenizer_ugm & tokenizer;
+
+    std::string & normalized;
+    std::vector<best_tokenization> & tokenization_results;
 };
 
 //
@@ -1568,7 +1636,16 @@ struct llama_vocab::impl {
     std::vector<token_data>                      id_to_token;
 
     std::vector<llama_token> cache_special_tokens;
-    std::vector<std::string> cache_token_to_piece; // llama_token_to_piece(special = true);
+
+    // llama_token_to_piece(special = true) of all the tokens, in one buffer:
+    // the piece of a token is the range [cache_piece_offs[id], cache_piece_offs[id + 1]) of cache_pieces
+    std::string           cache_pieces;
+    std::vector<uint32_t> cache_piece_offs;
+
+    std::string_view cached_piece(llama_token id) const {
+        const uint32_t off = cache_piece_offs.at(id);
+        return std::string_view(cache_pieces.data() + off, cache_piece_offs[id + 1] - off);
+    }
     struct pair_hash {
         size_t operator()(const std::pair<std::string, std::string> & p) const {
             return std::hash<std::string>{}(p.first) ^  //create some hash for pair
@@ -1584,7 +1661,24 @@ struct llama_vocab::impl {
 
     std::vector<char> precompiled_charsmap;
 
+    // LRU cache of tokenization results, keyed by the flags and the text
+    // holds up to LLAMA_TOKENIZER_CACHE entries (default: 0 - disabled)
+    struct tokenize_cache {
+        using entry = std::pair<std::string, std::vector<llama_token>>;
+
+        size_t capacity = 0;
+
+        std::mutex mutex;
+
+        std::list<entry> entries; // most recently used first
+        std::unordered_map<std::string_view, std::list<entry>::iterator> index;
+    };
+
+    mutable tokenize_cache tok_cache;
+
     impl(const llama_vocab & vocab) : vocab(vocab) {
+        const char * LLAMA_TOKENIZER_CACHE = getenv("LLAMA_TOKENIZER_CACHE");
+        tok_cache.capacity = LLAMA_TOKENIZER_CACHE ? std::max(0, atoi(LLAMA_TOKENIZER_CACHE)) : 0;
     }
 
     ~impl() = default;
@@ -1621,6 +1715,11 @@ struct llama_vocab::impl {
                          bool   add_special,
                          bool   parse_special = false) const;
 
+    std::vector<llama_token> tokenize_cached(
+            const std::string & raw_text,
+                         bool   add_special,
+                         bool   parse_special) const;
+
     int32_t tokenize(
                    const char * text,
                       int32_t   text_len,
@@ -1638,7 +1737,15 @@ struct llama_vocab::impl {
                          bool   special) const;
 
     // use cached data
-    const std::string & token_to_piece(llama_token token) const;
+    std::string_view token_to_piece(llama_token token) const;
+
+    int32_t detokenize_into(
+            const llama_token * tokens,
+                      int32_t   n_tokens,
+                         char * text,
+                      int32_t   text_len_max,
+                         bool   special,
+                      int32_t * n_valid) const;
 
     int32_t detokenize(
             const llama_token * tokens,
@@ -1722,8 +1829,9 @@ void llama_vocab::impl::load(llama_model_loader & ml, const LLM_KV & kv) {
             }
 
             const int n_merges = gguf_get_arr_n(ctx, merges_keyidx);
+            bpe_ranks.reserve(n_merges);
             for (int i = 0; i < n_merges; i++) {
-                const std::string word = gguf_get_arr_str(ctx, merges_keyidx, i);
+                const std::string_view word = gguf_get_arr_str(ctx, merges_keyidx, i);
                 //GGML_ASSERT(unicode_cpts_from_utf8(word).size() > 0);
 
                 std::string first;
@@ -1731,12 +1839,12 @@ void llama_vocab::impl::load(llama_model_loader & ml, const LLM_KV & kv) {
 
                 const size_t pos = word.find(' ', 1);
 
-                if (pos != std::string::npos) {
+                if (pos != std::string_view::npos) {
                     first  = word.substr(0, pos);
                     second = word.substr(pos + 1);
                 }
 
-                bpe_ranks.emplace(std::make_pair(first, second), i);
+                bpe_ranks.emplace(std::make_pair(std::move(first), std::move(second)), i);
             }
 
             // default special tokens
@@ -2027,6 +2135,7 @@ void llama_vocab::impl::load(llama_model_loader & ml, const LLM_KV & kv) {
 
     uint32_t n_tokens = gguf_get_arr_n(ctx, token_idx);
     id_to_token.resize(n_tokens);
+    token_to_id.reserve(n_tokens);
 
     for (uint32_t i = 0; i < n_tokens; i++) {
         std::string word = gguf_get_arr_str(ctx, token_idx, i);
@@ -2145,7 +2254,16 @@ void llama_vocab::impl::load(llama_model_loader & ml, const LLM_KV & kv) {
         // TODO: convert scripts should provide these tokens through the KV metadata LLM_KV_TOKENIZER_...
         //       for now, we apply this workaround to find the tokens based on their text
 
+        // all the texts searched below have a '<' in their first 4 bytes - skip the other tokens before comparing with each text
+        const auto maybe_special = [](const std::string & text) {
+            return std::string_view(text).substr(0, 4).find('<') != std::string_view::npos;
+        };
+
         for (const auto & t : token_to_id) {
+            if (!maybe_special(t.first)) {
+                continue;
+            }
+
             // find EOT token: "<|eot_id|>", "<|im_end|>", "<end_of_turn>", etc.
             if (special_eot_id == LLAMA_TOKEN_NULL) {
                 if (false
@@ -2310,7 +2428,7 @@ void llama_vocab::impl::load(llama_model_loader & ml, const LLM_KV & kv) {
         }
 
         for (const auto & t : token_to_id) {
-            if (false
+            if (maybe_special(t.first) && (false
                     || t.first == "<|eot_id|>"
                     || t.first == "<|im_end|>"
                     || t.first == "<|end|>"
@@ -2323,7 +2441,7 @@ void llama_vocab::impl::load(llama_model_loader & ml, const LLM_KV & kv) {
                     || t.first == "_<EOT>"
                     || t.first == "<|end_of_text|>"
                     || t.first == "<end_of_utterance>" // smoldocling
-               ) {
+               )) {
                 special_eog_ids.insert(t.second);
                 if ((id_to_token[t.second].attr & LLAMA_TOKEN_ATTR_CONTROL) == 0) {
                     LLAMA_LOG_WARN("%s: control-looking token: %6d '%s' was not control-type; this is probably a bug in the model. its type will be overridden\n",
@@ -2340,9 +2458,10 @@ void llama_vocab::impl::load(llama_model_loader & ml, const LLM_KV & kv) {
         }
 
         // @ngxson : quick hack for gpt-oss, always render these tokens
-        for (const auto & t : token_to_id) {
-            if (t.first == "<|channel|>" || t.first == "<|message|>" || t.first == "<|start|>") {
-                id_to_token[t.second].attr = LLAMA_TOKEN_ATTR_USER_DEFINED;
+        for (const auto * text : {"<|channel|>", "<|message|>", "<|start|>"}) {
+            const auto it = token_to_id.find(text);
+            if (it != token_to_id.end()) {
+                id_to_token[it->second].attr = LLAMA_TOKEN_ATTR_USER_DEFINED;
             }
         }
 
@@ -2412,19 +2531,58 @@ void llama_vocab::impl::load(llama_model_loader & ml, const LLM_KV & kv) {
 
     // build token to piece cache
     {
-        size_t size_cache = 0;
+        std::string           pieces;
+        std::vector<uint32_t> offs;
 
-        std::vector<std::string> cache(n_tokens);
+        // the pieces precomputed by llama-quantize --tokenizer-index
+        {
+            uint32_t version = 0;
+            ml.get_key(LLM_KV_TOKENIZER_INDEX_VERSION, version, false);
+
+            const int pieces_idx  = gguf_find_key(ctx, kv(LLM_KV_TOKENIZER_INDEX_PIECES).c_str());
+            const int offsets_idx = gguf_find_key(ctx, kv(LLM_KV_TOKENIZER_INDEX_PIECE_OFFSETS).c_str());
+
+            if (pieces_idx != -1 && offsets_idx != -1) {
+                if (version == LLAMA_VOCAB_INDEX_VERSION &&
+                    gguf_get_arr_type(ctx, pieces_idx)  == GGUF_TYPE_UINT8 &&
+                    gguf_get_arr_type(ctx, offsets_idx) == GGUF_TYPE_UINT32 &&
+                    gguf_get_arr_n(ctx, offsets_idx) == n_tokens + 1) {
+                    const char     * index_pieces  = (const char     *) gguf_get_arr_data(ctx, pieces_idx);
+                    const uint32_t * index_offsets = (const uint32_t *) gguf_get_arr_data(ctx, offsets_idx);
+
+                    // offsets must be increasing and within the pieces
+                    bool valid = index_offsets[0] == 0 && index_offsets[n_tokens] <= gguf_get_arr_n(ctx, pieces_idx);
+                    for (uint32_t id = 0; valid && id < n_tokens; ++id) {
+                        valid = index_offsets[id] <= index_offsets[id + 1];
+                    }
+                    if (valid) {
+                        pieces.assign(index_pieces, index_offsets[n_tokens]);
+                        offs.assign(index_offsets, index_offsets + n_tokens + 1);
+                    }
+                }
 
-        for (uint32_t id = 0; id < n_tokens; ++id) {
-            cache[id] = token_to_piece_for_cache(id, true);
+                if (offs.empty()) {
+                    LLAMA_LOG_WARN("%s: ignoring the tokenizer index, it is invalid or from another version (%u, expected %u)\n",
+                            __func__, version, LLAMA_VOCAB_INDEX_VERSION);
+                }
+            }
+        }
 
-            size_cache += cache[id].size();
+        const bool from_index = !offs.empty();
+        if (!from_index) {
+            offs.reserve(n_tokens + 1);
+            offs.push_back(0);
+            for (uint32_t id = 0; id < n_tokens; ++id) {
+                pieces += token_to_piece_for_cache(id, true);
+                offs.push_back(pieces.size());
+            }
         }
 
-        std::swap(cache_token_to_piece, cache);
+        std::swap(cache_pieces, pieces);
+        std::swap(cache_piece_offs, offs);
 
-        LLAMA_LOG_INFO("%s: token to piece cache size = %.4f MB\n", __func__, size_cache / 1024.0 / 1024.0);
+        LLAMA_LOG_INFO("%s: token to piece cache size = %.4f MB%s\n", __func__, cache_pieces.size() / 1024.0 / 1024.0,
+                from_index ? " (from the tokenizer index)" : "");
     }
 
     // Handle per token attributes
@@ -2735,8 +2893,28 @@ std::string llama_vocab::impl::token_to_piece_for_cache(llama_token token, bool
     return piece;
 }
 
+// in place, without a temporary string - the text grows within its capacity from the end
 static void llama_escape_whitespace(std::string & text) {
-    replace_all(text, " ", "\xe2\x96\x81");
+    const size_t n_space = std::count(text.begin(), text.end(), ' ');
+    if (n_space == 0) {
+        return;
+    }
+
+    size_t src = text.size();
+    size_t dst = text.size() + 2*n_space;
+
+    text.resize(dst);
+
+    while (src > 0) {
+        const char c = text[--src];
+        if (c == ' ') {
+            text[--dst] = '\x81';
+            text[--dst] = '\x96';
+            text[--dst] = '\xe2';
+        } else {
+            text[--dst] = c;
+        }
+    }
 }
 
 static void llama_unescape_whitespace(std::string & word) {
@@ -2793,22 +2971,27 @@ std::vector<llama_token> llama_vocab::impl::tokenize(
                     is_prev_special = true;
                 }
 
+                // the buffers are kept by the thread for its next calls
+                static thread_local llm_tokenizer_spm_session::buffers spm_buffers;
+
+                llm_tokenizer_spm_session session(vocab, spm_buffers);
+
                 for (const auto & fragment : fragment_buffer) {
                     if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_RAW_TEXT) {
-                        std::string text;
+                        std::string & text = spm_buffers.text;
+                        text.clear();
 
                         // prefix with space if previous is special
                         if (add_space_prefix && is_prev_special) {
                             text = ' ';
                         }
 
-                        text += fragment.raw_text.substr(fragment.offset, fragment.length);
+                        text.append(fragment.raw_text, fragment.offset, fragment.length);
 
 #ifdef PRETOKENIZERDEBUG
                         LLAMA_LOG_WARN("TT: (%ld %ld %ld) '%s'\n", text.length(), fragment.offset, fragment.length, text.c_str());
 #endif
                         llama_escape_whitespace(text);
-                        llm_tokenizer_spm_session session(vocab);
                         session.tokenize(text, output);
                         is_prev_special = false;
                     } else { // if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_TOKEN)
@@ -2888,11 +3071,16 @@ std::vector<llama_token> llama_vocab::impl::tokenize(
                     GGML_ASSERT(special_bos_id != LLAMA_TOKEN_NULL);
                     output.push_back(special_bos_id);
                 }
-                llm_tokenizer_ugm_session session(vocab, *static_cast<const llm_tokenizer_ugm *>(tokenizer.get()));
+
+                // the buffers are kept by the thread for its next calls
+                static thread_local llm_tokenizer_ugm_session::buffers ugm_buffers;
+
+                llm_tokenizer_ugm_session session(vocab, *static_cast<const llm_tokenizer_ugm *>(tokenizer.get()), ugm_buffers);
 
                 for (const auto & fragment : fragment_buffer) {
                     if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_RAW_TEXT) {
-                        std::string text = fragment.raw_text.substr(fragment.offset, fragment.length);
+                        std::string & text = ugm_buffers.text;
+                        text.assign(fragment.raw_text, fragment.offset, fragment.length);
 #ifdef PRETOKENIZERDEBUG
                         LLAMA_LOG_WARN("TT: (%ld %ld %ld) '%s'\n", text.length(), fragment.offset, fragment.length, text.c_str());
 #endif
@@ -2982,13 +3170,9 @@ int32_t llama_vocab::impl::token_to_piece(llama_token token, char * buf, int32_t
     };
 
     // if we have a cache - use it
-    {
-        const auto & cache = cache_token_to_piece;
-
-        if (!cache.empty()) {
-            const auto & result = cache.at(token);
-            return _try_copy(result.data(), result.size());
-        }
+    if (!cache_piece_offs.empty()) {
+        const std::string_view result = cached_piece(token);
+        return _try_copy(result.data(), result.size());
     }
 
     if (0 <= token && token < (int32_t) id_to_token.size()) {
@@ -3062,8 +3246,105 @@ int32_t llama_vocab::impl::token_to_piece(llama_token token, char * buf, int32_t
     return 0;
 }
 
-const std::string & llama_vocab::impl::token_to_piece(llama_token token) const {
-    return cache_token_to_piece.at(token);
+std::string_view llama_vocab::impl::token_to_piece(llama_token token) const {
+    return cached_piece(token);
+}
+
+int32_t llama_vocab::impl::detokenize_into(
+        const llama_token * tokens,
+                  int32_t   n_tokens,
+                     char * text,
+                  int32_t   text_len_max,
+                     bool   special,
+                  int32_t * n_valid) const {
+    static const int attr_special = LLAMA_TOKEN_ATTR_UNKNOWN | LLAMA_TOKEN_ATTR_CONTROL;
+
+    // the pieces are copied from the cache, the same as token_to_piece()
+    size_t n_total = 0;
+    for (int32_t i = 0; i < n_tokens; ++i) {
+        if (!special && (token_get_attr(tokens[i]) & attr_special)) {
+            continue;
+        }
+        const std::string_view piece = cached_piece(tokens[i]);
+        if (n_total + piece.size() <= (size_t) text_len_max) {
+            memcpy(text + n_total, piece.data(), piece.size());
+        }
+        n_total += piece.size();
+    }
+
+    GGML_ASSERT(n_total <= (size_t) std::numeric_limits<int32_t>::max());
+
+    if (n_total > (size_t) text_len_max) {
+        return -(int32_t) n_total;
+    }
+
+    if (n_valid) {
+        // the text without an incomplete UTF-8 sequence at its end
+        size_t len = n_total;
+        for (size_t i = 1; i <= 4 && i <= n_total; ++i) {
+            const uint8_t c = text[n_total - i];
+            if ((c & 0xC0) != 0x80) {
+                // the first byte of a sequence, or an ASCII byte - the sequence is complete if it has all its bytes
+                const size_t n_seq = (c & 0xE0) == 0xC0 ? 2 : (c & 0xF0) == 0xE0 ? 3 : (c & 0xF8) == 0xF0 ? 4 : 1;
+                if (n_seq > i) {
+                    len = n_total - i;
+                }
+                break;
+            }
+        }
+        *n_valid = (int32_t) len;
+    }
+
+    return (int32_t) n_total;
+}
+
+std::vector<llama_token> llama_vocab::impl::tokenize_cached(
+        const std::string & raw_text,
+        bool add_special,
+        bool parse_special) const {
+    // very long texts are unlikely to repeat and would take up most of the cache
+    static constexpr size_t max_text_size = 1024*1024;
+
+    auto & cache = tok_cache;
+
+    if (cache.capacity == 0 || raw_text.size() > max_text_size) {
+        return tokenize(raw_text, add_special, parse_special);
+    }
+
+    std::string key;
+    key.reserve(raw_text.size() + 2);
+    key += add_special   ? '1' : '0';
+    key += parse_special ? '1' : '0';
+    key += raw_text;
+
+    {
+        std::lock_guard<std::mutex> lock(cache.mutex);
+
+        const auto it = cache.index.find(key);
+        if (it != cache.index.end()) {
+            cache.entries.splice(cache.entries.begin(), cache.entries, it->second);
+            return it->second->second;
+        }
+    }
+
+    auto result = tokenize(raw_text, add_special, parse_special);
+
+    {
+        std::lock_guard<std::mutex> lock(cache.mutex);
+
+        // another thread might have inserted the same text in the meantime
+        if (cache.index.find(key) == cache.index.end()) {
+            cache.entries.emplace_front(std::move(key), result);
+            cache.index.emplace(cache.entries.front().first, cache.entries.begin());
+
+            if (cache.entries.size() > cache.capacity) {
+                cache.index.erase(cache.entries.back().first);
+                cache.entries.pop_back();
+            }
+        }
+    }
+
+    return result;
 }
 
 int32_t llama_vocab::impl::detokenize(
@@ -3219,6 +3500,27 @@ void llama_vocab::load(llama_model_loader & ml, const LLM_KV & kv) {
     pimpl->load(ml, kv);
 }
 
+void llama_vocab::write_index(struct gguf_context * ctx, const LLM_KV & kv) const {
+    const uint32_t n = n_tokens();
+
+    std::vector<uint8_t>  pieces;
+    std::vector<uint32_t> offsets;
+    offsets.reserve(n + 1);
+    offsets.push_back(0);
+
+    for (uint32_t id = 0; id < n; ++id) {
+        const std::string_view piece = pimpl->cached_piece(id);
+        pieces.insert(pieces.end(), piece.begin(), piece.end());
+        offsets.push_back(pieces.size());
+    }
+
+    gguf_set_val_u32 (ctx, kv(LLM_KV_TOKENIZER_INDEX_VERSION).c_str(), LLAMA_VOCAB_INDEX_VERSION);
+    gguf_set_arr_data(ctx, kv(LLM_KV_TOKENIZER_INDEX_PIECES).c_str(),        GGUF_TYPE_UINT8,  pieces.data(),  pieces.size());
+    gguf_set_arr_data(ctx, kv(LLM_KV_TOKENIZER_INDEX_PIECE_OFFSETS).c_str(), GGUF_TYPE_UINT32, offsets.data(), offsets.size());
+
+    LLAMA_LOG_INFO("%s: tokenizer index: %u pieces, %.2f MiB\n", __func__, n, (pieces.size() + offsets.size()*sizeof(uint32_t))/1024.0/1024.0);
+}
+
 std::string llama_vocab::get_tokenizer_model() const {
     return pimpl->tokenizer_model;
 }
@@ -3506,13 +3808,23 @@ std::vector<llama_token> llama_vocab::tokenize(
         const std::string & raw_text,
         bool add_special,
         bool parse_special) const {
-    return pimpl->tokenize(raw_text, add_special, parse_special);
+    return pimpl->tokenize_cached(raw_text, add_special, parse_special);
 }
 
-const std::string & llama_vocab::token_to_piece(llama_token token) const {
+std::string_view llama_vocab::token_to_piece(llama_token token) const {
     return pimpl->token_to_piece(token);
 }
 
+int32_t llama_vocab::detokenize_into(
+        const llama_token * tokens,
+                  int32_t   n_tokens,
+                     char * text,
+                  int32_t   text_len_max,
+                     bool   special,
+                  int32_t * n_valid) const {
+    return pimpl->detokenize_into(tokens, n_tokens, text, text_len_max, special, n_valid);
+}
+
 int32_t llama_vocab::token_to_piece(llama_token token, char * buf, int32_t length, int32_t lstrip, bool special) const {
     return pimpl->token_to_piece(token, buf, length, lstrip, special);
 }
@@ -3779,6 +4091,17 @@ int32_t llama_token_to_piece(
     return vocab->token_to_piece(token, buf, length, lstrip, special);
 }
 
+int32_t llama_detokenize_into(
+    const struct llama_vocab * vocab,
+           const llama_token * tokens,
+                     int32_t   n_tokens,
+                        char * text,
+                     int32_t   text_len_max,
+                        bool   special,
+                     int32_t * n_valid) {
+    return vocab->detokenize_into(tokens, n_tokens, text, text_len_max, special, n_valid);
+}
+
 int32_t llama_detokenize(
     const struct llama_vocab * vocab,
            const llama_token * tokens,
@@ -3,6 +3,7 @@
 #include "llama.h"
 
 #include <string>
+#include <string_view>
 #include <vector>
 #include <memory>
 
@@ -64,6 +65,9 @@ struct llama_vocab {
 
     void load(llama_model_loader & ml, const LLM_KV & kv);
 
+    // stores the data precomputed by load() in the GGUF metadata, so that the next loads do not compute it again
+    void write_index(struct gguf_context * ctx, const LLM_KV & kv) const;
+
     std::string get_tokenizer_model() const;
     std::string get_tokenizer_pre() const;
 
@@ -154,7 +158,16 @@ struct llama_vocab {
                          bool   special) const;
 
     // use cached data
-    const std::string & token_to_piece(llama_token token) const;
+    std::string_view token_to_piece(llama_token token) const;
+
+    // the pieces of the tokens, one after the other - see llama_detokenize_into()
+    int32_t detokenize_into(
+            const llama_token * tokens,
+                      int32_t   n_tokens,
+                         char * text,
+                      int32_t   text_len_max,
+                         bool   special,
+                      int32_t * n_valid) const;
 
     int32_t detokenize(
             const llama_token * tokens,
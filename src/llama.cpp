@@ -109,7 +109,11 @@ static int llama_model_load(const std::string & fname, std::vector<std::string>
         } catch(const std::exception & e) {
             throw std::runtime_error("error loading model hyperparameters: " + std::string(e.what()));
         }
+
+        model.t_parse_us = ggml_time_us() - tm.t_start_us;
+
         try {
+            time_meas tm_vocab(model.t_vocab_us);
             model.load_vocab(ml);
         } catch(const std::exception & e) {
             throw std::runtime_error("error loading model vocabulary: " + std::string(e.what()));
@@ -123,9 +127,15 @@ static int llama_model_load(const std::string & fname, std::vector<std::string>
             return 0;
         }
 
+        const int64_t t_tensors_start_us = ggml_time_us();
+
         if (!model.load_tensors(ml)) {
             return -2;
         }
+
+        model.t_read_us   = ml.t_read_us;
+        model.t_upload_us = ml.t_upload_us;
+        model.t_alloc_us  = ggml_time_us() - t_tensors_start_us - ml.t_read_us - ml.t_upload_us;
     } catch (const std::exception & err) {
         LLAMA_LOG_ERROR("%s: error loading model: %s\n", __func__, err.what());
         return -1;
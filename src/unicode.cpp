@@ -10,6 +10,7 @@
 #include <codecvt>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <locale>
 #include <map>
 #include <regex>
@@ -70,6 +71,45 @@ uint32_t unicode_cpt_from_utf8(const std::string & utf8, size_t & offset) {
     throw std::invalid_argument("failed to convert utf8 to codepoint");
 }
 
+// same as unicode_cpt_from_utf8, but without exceptions: len is set to 0 for an invalid sequence
+static inline uint32_t unicode_cpt_decode_utf8(const uint8_t * src, size_t size, size_t & len) {
+    const uint8_t c = src[0];
+    if (!(c & 0x80)) {
+        len = 1;
+        return c;
+    }
+    if (!(c & 0x40)) {
+        len = 0;
+        return 0;
+    }
+    if (!(c & 0x20)) {
+        if (size < 2 || (src[1] & 0xc0) != 0x80) {
+            len = 0;
+            return 0;
+        }
+        len = 2;
+        return ((c & 0x1f) << 6) | (src[1] & 0x3f);
+    }
+    if (!(c & 0x10)) {
+        if (size < 3 || (src[1] & 0xc0) != 0x80 || (src[2] & 0xc0) != 0x80) {
+            len = 0;
+            return 0;
+        }
+        len = 3;
+        return ((c & 0x0f) << 12) | ((src[1] & 0x3f) << 6) | (src[2] & 0x3f);
+    }
+    if (!(c & 0x08)) {
+        if (size < 4 || (src[1] & 0xc0) != 0x80 || (src[2] & 0xc0) != 0x80 || (src[3] & 0xc0) != 0x80) {
+            len = 0;
+            return 0;
+        }
+        len = 4;
+        return ((c & 0x07) << 18) | ((src[1] & 0x3f) << 12) | ((src[2] & 0x3f) << 6) | (src[3] & 0x3f);
+    }
+    len = 0;
+    return 0;
+}
+
 //static std::vector<uint16_t> unicode_cpt_to_utf16(uint32_t cpt) {
 //    std::vector<uint16_t> result;
 //    if (/* 0x0000 <= cpt && */ cpt <= 0xffff) {
@@ -119,7 +159,40 @@ uint32_t unicode_cpt_from_utf8(const std::string & utf8, size_t & offset) {
 //    return result;
 //}
 
-static std::vector<unicode_cpt_flags> unicode_cpt_flags_array() {
+// two-level lookup table indexed by codepoint: the codepoints are split in blocks of 256,
+// and the blocks with the same values (e.g. unassigned or all zeros) are stored only once
+template <typename T>
+struct unicode_cpt_table {
+    static constexpr uint32_t BLOCK_BITS = 8;
+    static constexpr uint32_t BLOCK_SIZE = 1u << BLOCK_BITS;
+
+    std::vector<uint16_t> index;   // codepoint block -> unique block
+    std::vector<T>        values;  // unique blocks, BLOCK_SIZE values each
+
+    explicit unicode_cpt_table(const std::vector<T> & flat) {
+        assert(flat.size() == MAX_CODEPOINTS && MAX_CODEPOINTS % BLOCK_SIZE == 0);
+
+        std::map<std::vector<T>, uint16_t> unique;
+        index.resize(MAX_CODEPOINTS / BLOCK_SIZE);
+        for (size_t i = 0; i < index.size(); ++i) {
+            std::vector<T> block(flat.begin() + i*BLOCK_SIZE, flat.begin() + (i + 1)*BLOCK_SIZE);
+            auto it = unique.find(block);
+            if (it == unique.end()) {
+                assert(unique.size() < UINT16_MAX);
+                it = unique.emplace(std::move(block), (uint16_t) unique.size()).first;
+                values.insert(values.end(), it->first.begin(), it->first.end());
+            }
+            index[i] = it->second;
+        }
+    }
+
+    // cpt must be < MAX_CODEPOINTS
+    inline T get(uint32_t cpt) const {
+        return values[((size_t) index[cpt >> BLOCK_BITS] << BLOCK_BITS) | (cpt & (BLOCK_SIZE - 1))];
+    }
+};
+
+static unicode_cpt_table<uint16_t> unicode_cpt_flags_table() {
     std::vector<unicode_cpt_flags> cpt_flags(MAX_CODEPOINTS, unicode_cpt_flags::UNDEFINED);
 
     assert (unicode_ranges_flags.begin()[0].first == 0);
@@ -148,7 +221,31 @@ static std::vector<unicode_cpt_flags> unicode_cpt_flags_array() {
         cpt_flags[range.nfd].is_nfd = true;
     }
 
-    return cpt_flags;
+    std::vector<uint16_t> values(MAX_CODEPOINTS);
+    for (size_t cpt = 0; cpt < MAX_CODEPOINTS; ++cpt) {
+        values[cpt] = cpt_flags[cpt].as_uint();
+    }
+
+    return unicode_cpt_table<uint16_t>(values);
+}
+
+// the mappings are stored as offsets from the codepoint, so that the unmapped blocks are all zeros and shared
+static unicode_cpt_table<int32_t> unicode_cpt_lowercase_table() {
+    std::vector<int32_t> delta(MAX_CODEPOINTS, 0);
+    for (auto p : unicode_map_lowercase) {
+        delta[p.first] = (int32_t) p.second - (int32_t) p.first;
+    }
+    return unicode_cpt_table<int32_t>(delta);
+}
+
+static unicode_cpt_table<int32_t> unicode_cpt_nfd_table() {
+    std::vector<int32_t> delta(MAX_CODEPOINTS, 0);
+    for (auto & range : unicode_ranges_nfd) {  // start, last, nfd
+        for (uint32_t cpt = range.first; cpt <= range.last; ++cpt) {
+            delta[cpt] = (int32_t) range.nfd - (int32_t) cpt;
+        }
+    }
+    return unicode_cpt_table<int32_t>(delta);
 }
 
 static std::unordered_map<uint8_t, std::string> unicode_byte_to_utf8_map() {
@@ -357,7 +454,8 @@ static std::vector<size_t> unicode_regex_split_custom_gpt2(const std::string & t
 }
 
 // LLAMA3 system regex: "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\r\n\p{L}\p{N}]?\p{L}+|\p{N}{1,3}| ?[^\s\p{L}\p{N}]+[\r\n]*|\s*[\r\n]+|\s+(?!\S)|\s+"
-static std::vector<size_t> unicode_regex_split_custom_llama3(const std::string & text, const std::vector<size_t> & offsets) {
+// variants: \p{N} instead of \p{N}{1,3} (max_digits = 1) and no [\r\n]* after the punctuation (punct_newlines = false)
+static std::vector<size_t> unicode_regex_split_custom_llama3(const std::string & text, const std::vector<size_t> & offsets, size_t max_digits = 3, bool punct_newlines = true) {
     std::vector<size_t> bpe_offsets; // store the offset of each word
     bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
 
@@ -434,7 +532,7 @@ static std::vector<size_t> unicode_regex_split_custom_llama3(const std::string &
             if (flags.is_number) {
                 size_t ini = pos;
                 while (_get_flags(pos).is_number) {
-                    if (++pos - ini >= 3 ) {
+                    if (++pos - ini >= max_digits) {
                         _add_token(pos);
                         ini = pos;
                     }
@@ -451,7 +549,7 @@ static std::vector<size_t> unicode_regex_split_custom_llama3(const std::string &
                     flags2 = _get_flags(++pos);
                 }
                 uint32_t cpt2 = _get_cpt(pos);
-                while (cpt2 == '\r' || cpt2 == '\n') {
+                while (punct_newlines && (cpt2 == '\r' || cpt2 == '\n')) {
                     cpt2 = _get_cpt(++pos);
                 }
                 _add_token(pos);
@@ -729,6 +827,398 @@ static std::vector<size_t> unicode_regex_split_custom_kimi_k2(const std::string
     return bpe_offsets;
 }
 
+// GPT4O system regex (adapted, see llama-vocab.cpp):
+// [^\r\n\p{L}\p{N}]?((?=[\p{L}])([^a-z]))*((?=[\p{L}])([^A-Z]))+(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])?|[^\r\n\p{L}\p{N}]?((?=[\p{L}])([^a-z]))+((?=[\p{L}])([^A-Z]))*(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])?|\p{N}{1,3}| ?[^\s\p{L}\p{N}]+[\r\n/]*|\s*[\r\n]+|\s+(?!\S)|\s+
+// TEKKEN: the same without the contractions and with \p{N} instead of \p{N}{1,3} (max_digits = 1)
+static std::vector<size_t> unicode_regex_split_custom_gpt4o(const std::string & text, const std::vector<size_t> & offsets, size_t max_digits, bool contractions) {
+    std::vector<size_t> bpe_offsets;
+    bpe_offsets.reserve(offsets.size());
+
+    const auto cpts = unicode_cpts_from_utf8(text);
+
+    size_t start = 0;
+    for (auto offset : offsets) {
+        const size_t offset_ini = start;
+        const size_t offset_end = start + offset;
+        assert(offset_end <= cpts.size());
+        start = offset_end;
+
+        static const uint32_t OUT_OF_RANGE = 0xFFFFFFFF;
+        auto _get_cpt = [&] (const size_t pos) -> uint32_t {
+            return (offset_ini <= pos && pos < offset_end) ? cpts[pos] : OUT_OF_RANGE;
+        };
+
+        auto _get_flags = [&] (const size_t pos) -> unicode_cpt_flags {
+            return (offset_ini <= pos && pos < offset_end) ? unicode_cpt_flags_from_cpt(cpts[pos]) : unicode_cpt_flags{};
+        };
+
+        // regex: (?=[\p{L}])([^a-z]) and (?=[\p{L}])([^A-Z]), letters other than a-z are both
+        auto _is_upper = [&] (const size_t pos) -> bool {
+            const uint32_t cpt = _get_cpt(pos);
+            return _get_flags(pos).is_letter && !('a' <= cpt && cpt <= 'z');
+        };
+
+        auto _is_lower = [&] (const size_t pos) -> bool {
+            const uint32_t cpt = _get_cpt(pos);
+            return _get_flags(pos).is_letter && !('A' <= cpt && cpt <= 'Z');
+        };
+
+        // end of the letters of a word starting at pos, pos if none
+        auto _match_word = [&] (const size_t pos) -> size_t {
+            size_t end = pos;
+            while (_is_upper(end)) {
+                end++;
+            }
+
+            // regex: upper* lower+
+            if (_is_lower(end)) {
+                while (_is_lower(end)) {
+                    end++;
+                }
+                return end;
+            }
+
+            // backtrack to the last letter of the upper sequence that is a lower too
+            for (size_t i = end; i > pos; --i) {
+                if (_is_lower(i - 1)) {
+                    return i;
+                }
+            }
+
+            // regex: upper+ lower*
+            return end;
+        };
+
+        size_t _prev_end = offset_ini;
+        auto _add_token = [&] (const size_t end) -> size_t {
+            assert(_prev_end <= end && end <= offset_end);
+            size_t len = end - _prev_end;
+            if (len > 0) {
+                bpe_offsets.push_back(len);
+            }
+            _prev_end = end;
+            return len;
+        };
+
+        for (size_t pos = offset_ini; pos < offset_end; /*pos++*/ ) {
+            const uint32_t cpt = _get_cpt(pos);
+            const auto flags = _get_flags(pos);
+
+            // regex: [^\r\n\p{L}\p{N}]?(upper* lower+|upper+ lower*)(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])?
+            {
+                const size_t ini = (cpt == '\r' || cpt == '\n' || flags.is_letter || flags.is_number) ? pos : pos + 1;
+                size_t end = _match_word(ini);
+                if (end > ini) {
+                    if (contractions && _get_cpt(end) == '\'' && end + 1 < offset_end) {
+                        uint32_t cpt_next = unicode_tolower(_get_cpt(end + 1));
+                        if (cpt_next == 's' || cpt_next == 't' || cpt_next == 'm' || cpt_next == 'd') {
+                            end += 2;
+                        } else if (end + 2 < offset_end) {
+                            uint32_t cpt_next_next = unicode_tolower(_get_cpt(end + 2));
+                            if ((cpt_next == 'r' && cpt_next_next == 'e') ||
+                                (cpt_next == 'v' && cpt_next_next == 'e') ||
+                                (cpt_next == 'l' && cpt_next_next == 'l')) {
+                                end += 3;
+                            }
+                        }
+                    }
+                    pos = end;
+                    _add_token(pos);
+                    continue;
+                }
+            }
+
+            // regex: \p{N}{1,3}
+            if (flags.is_number) {
+                size_t ini = pos;
+                while (_get_flags(pos).is_number) {
+                    if (++pos - ini >= max_digits) {
+                        _add_token(pos);
+                        ini = pos;
+                    }
+                }
+                _add_token(pos);
+                continue;
+            }
+
+            // regex: <space>?[^\s\p{L}\p{N}]+[\r\n/]*
+            auto flags2 = (cpt == ' ' ? _get_flags(pos+1) : flags);
+            if (!(flags2.is_whitespace | flags2.is_letter | flags2.is_number) && flags2.as_uint()) {
+                pos += (cpt == ' ');
+                while (!(flags2.is_whitespace | flags2.is_letter | flags2.is_number) && flags2.as_uint()) {
+                    flags2 = _get_flags(++pos);
+                }
+                uint32_t cpt2 = _get_cpt(pos);
+                while (cpt2 == '\r' || cpt2 == '\n' || cpt2 == '/') {
+                    cpt2 = _get_cpt(++pos);
+                }
+                _add_token(pos);
+                continue;
+            }
+
+            size_t num_whitespaces = 0;
+            size_t last_end_r_or_n = 0;
+            while (_get_flags(pos+num_whitespaces).is_whitespace) {
+                uint32_t cpt2 = _get_cpt(pos+num_whitespaces);
+                if (cpt2 == '\r' || cpt2 == '\n') {
+                    last_end_r_or_n = pos + num_whitespaces + 1;
+                }
+                num_whitespaces++;
+            }
+
+            // regex: \s*[\r\n]+
+            if (last_end_r_or_n > 0) {
+                pos = last_end_r_or_n;
+                _add_token(pos);
+                continue;
+            }
+
+            // regex: \s+(?!\S)
+            if (num_whitespaces > 1 && _get_cpt(pos+num_whitespaces) != OUT_OF_RANGE) {
+                pos += num_whitespaces - 1;
+                _add_token(pos);
+                continue;
+            }
+
+            // regex: \s+
+            if (num_whitespaces > 0) {
+                pos += num_whitespaces;
+                _add_token(pos);
+                continue;
+            }
+
+            // no matches
+            _add_token(++pos);
+        }
+    }
+
+    return bpe_offsets;
+}
+
+// DEEPSEEK3 system regex (the numbers and the CJK characters are split before with separate regexes):
+// [!"#$%&'()*+,\-./:;<=>?@\[\\\]^_`{|}~][A-Za-z]+|[^\r\n\p{L}\p{P}\p{S}]?[\p{L}\p{M}]+| ?[\p{P}\p{S}]+[\r\n]*|\s*[\r\n]+|\s+(?!\S)|\s+
+static std::vector<size_t> unicode_regex_split_custom_deepseek3(const std::string & text, const std::vector<size_t> & offsets) {
+    std::vector<size_t> bpe_offsets;
+    bpe_offsets.reserve(offsets.size());
+
+    const auto cpts = unicode_cpts_from_utf8(text);
+
+    size_t start = 0;
+    for (auto offset : offsets) {
+        const size_t offset_ini = start;
+        const size_t offset_end = start + offset;
+        assert(offset_end <= cpts.size());
+        start = offset_end;
+
+        static const uint32_t OUT_OF_RANGE = 0xFFFFFFFF;
+        auto _get_cpt = [&] (const size_t pos) -> uint32_t {
+            return (offset_ini <= pos && pos < offset_end) ? cpts[pos] : OUT_OF_RANGE;
+        };
+
+        auto _get_flags = [&] (const size_t pos) -> unicode_cpt_flags {
+            return (offset_ini <= pos && pos < offset_end) ? unicode_cpt_flags_from_cpt(cpts[pos]) : unicode_cpt_flags{};
+        };
+
+        auto _is_ascii_alpha = [&] (const size_t pos) -> bool {
+            const uint32_t cpt = _get_cpt(pos);
+            return ('A' <= cpt && cpt <= 'Z') || ('a' <= cpt && cpt <= 'z');
+        };
+
+        auto _is_letter_or_mark = [&] (const size_t pos) -> bool {
+            const auto flags = _get_flags(pos);
+            return flags.is_letter || flags.is_accent_mark;
+        };
+
+        // the text that does not match is kept as a single token between the matches
+        size_t _prev_end = offset_ini;
+        auto _add_token = [&] (const size_t end) -> size_t {
+            assert(_prev_end <= end && end <= offset_end);
+            size_t len = end - _prev_end;
+            if (len > 0) {
+                bpe_offsets.push_back(len);
+            }
+            _prev_end = end;
+            return len;
+        };
+
+        for (size_t pos = offset_ini; pos < offset_end; /*pos++*/ ) {
+            const uint32_t cpt = _get_cpt(pos);
+            const auto flags = _get_flags(pos);
+
+            // regex: [!"#$%&'()*+,\-./:;<=>?@\[\\\]^_`{|}~][A-Za-z]+
+            if (0x21 <= cpt && cpt <= 0x7E && !flags.is_number && !_is_ascii_alpha(pos) && _is_ascii_alpha(pos+1)) {
+                _add_token(pos);
+                pos++;
+                while (_is_ascii_alpha(pos)) {
+                    pos++;
+                }
+                _add_token(pos);
+                continue;
+            }
+
+            // regex: [^\r\n\p{L}\p{P}\p{S}]?[\p{L}\p{M}]+
+            if (_is_letter_or_mark(pos) ||
+                (!(cpt == '\r' || cpt == '\n' || flags.is_letter || flags.is_punctuation || flags.is_symbol) && _is_letter_or_mark(pos+1))) {
+                _add_token(pos);
+                pos++;
+                while (_is_letter_or_mark(pos)) {
+                    pos++;
+                }
+                _add_token(pos);
+                continue;
+            }
+
+            // regex: <space>?[\p{P}\p{S}]+[\r\n]*
+            auto flags2 = (cpt == ' ' ? _get_flags(pos+1) : flags);
+            if (flags2.is_punctuation || flags2.is_symbol) {
+                _add_token(pos);
+                pos += (cpt == ' ');
+                while (flags2.is_punctuation || flags2.is_symbol) {
+                    flags2 = _get_flags(++pos);
+                }
+                uint32_t cpt2 = _get_cpt(pos);
+                while (cpt2 == '\r' || cpt2 == '\n') {
+                    cpt2 = _get_cpt(++pos);
+                }
+                _add_token(pos);
+                continue;
+            }
+
+            size_t num_whitespaces = 0;
+            size_t last_end_r_or_n = 0;
+            while (_get_flags(pos+num_whitespaces).is_whitespace) {
+                uint32_t cpt2 = _get_cpt(pos+num_whitespaces);
+                if (cpt2 == '\r' || cpt2 == '\n') {
+                    last_end_r_or_n = pos + num_whitespaces + 1;
+                }
+                num_whitespaces++;
+            }
+
+            // regex: \s*[\r\n]+
+            if (last_end_r_or_n > 0) {
+                _add_token(pos);
+                pos = last_end_r_or_n;
+                _add_token(pos);
+                continue;
+            }
+
+            // regex: \s+(?!\S)
+            if (num_whitespaces > 1 && _get_cpt(pos+num_whitespaces) != OUT_OF_RANGE) {
+                _add_token(pos);
+                pos += num_whitespaces - 1;
+                _add_token(pos);
+                continue;
+            }
+
+            // regex: \s+
+            if (num_whitespaces > 0) {
+                _add_token(pos);
+                pos += num_whitespaces;
+                _add_token(pos);
+                continue;
+            }
+
+            // no matches, e.g. the digits
+            pos++;
+        }
+
+        _add_token(offset_end);
+    }
+
+    return bpe_offsets;
+}
+
+static bool unicode_cpt_is_number(uint32_t /*cpt*/, unicode_cpt_flags flags) {
+    return flags.is_number;
+}
+
+static bool unicode_cpt_is_digit(uint32_t cpt, unicode_cpt_flags /*flags*/) {
+    return '0' <= cpt && cpt <= '9';
+}
+
+static bool unicode_cpt_is_newline(uint32_t cpt, unicode_cpt_flags /*flags*/) {
+    return cpt == '\r' || cpt == '\n';
+}
+
+static bool unicode_cpt_is_letter(uint32_t /*cpt*/, unicode_cpt_flags flags) {
+    return flags.is_letter;
+}
+
+static bool unicode_cpt_is_punctuation(uint32_t /*cpt*/, unicode_cpt_flags flags) {
+    return flags.is_punctuation;
+}
+
+// single-class regexes: <prefix>?<class>{min_len,max_len} with an optional whitespace prefix, max_len = 0 for unbounded
+// e.g. \p{N}, \p{N}+, \p{N}{1,3}, [0-9][0-9][0-9], [\r\n], \s?\p{L}+
+// as with std::regex, the text between the matches is kept as a single token
+static std::vector<size_t> unicode_regex_split_custom_class(const std::string & text, const std::vector<size_t> & offsets,
+        bool (*is_class)(uint32_t cpt, unicode_cpt_flags flags), size_t min_len, size_t max_len, bool ws_prefix) {
+    std::vector<size_t> bpe_offsets;
+    bpe_offsets.reserve(offsets.size());
+
+    const auto cpts = unicode_cpts_from_utf8(text);
+
+    size_t start = 0;
+    for (auto offset : offsets) {
+        const size_t offset_ini = start;
+        const size_t offset_end = start + offset;
+        assert(offset_end <= cpts.size());
+        start = offset_end;
+
+        auto _is_class = [&] (const size_t pos) -> bool {
+            return pos < offset_end && is_class(cpts[pos], unicode_cpt_flags_from_cpt(cpts[pos]));
+        };
+
+        size_t _prev_end = offset_ini;
+        auto _add_token = [&] (const size_t end) -> size_t {
+            assert(_prev_end <= end && end <= offset_end);
+            size_t len = end - _prev_end;
+            if (len > 0) {
+                bpe_offsets.push_back(len);
+            }
+            _prev_end = end;
+            return len;
+        };
+
+        for (size_t pos = offset_ini; pos < offset_end; /*pos++*/ ) {
+            const bool prefix = ws_prefix && unicode_cpt_flags_from_cpt(cpts[pos]).is_whitespace && _is_class(pos+1);
+            size_t ini = pos + prefix;
+
+            size_t end = ini;
+            while (_is_class(end)) {
+                end++;
+            }
+
+            if (end - ini < std::max<size_t>(min_len, 1)) {
+                // no match, the run (if any) is part of the text between the matches
+                pos = std::max(end, pos + 1);
+                continue;
+            }
+
+            _add_token(pos);
+
+            if (max_len > 0) {
+                // consecutive matches of max_len, the remainder is not matched if shorter than min_len
+                while (end - ini >= max_len) {
+                    ini += max_len;
+                    _add_token(ini);
+                }
+                if (end - ini >= std::max<size_t>(min_len, 1)) {
+                    _add_token(end);
+                }
+            } else {
+                _add_token(end);
+            }
+
+            pos = end;
+        }
+
+        _add_token(offset_end);
+    }
+
+    return bpe_offsets;
+}
+
 static std::vector<size_t> unicode_regex_split_custom(const std::string & text, const std::string & regex_expr, const std::vector<size_t> & offsets) {
     std::vector<size_t> bpe_offsets;
 
@@ -739,9 +1229,39 @@ static std::vector<size_t> unicode_regex_split_custom(const std::string & text,
             regex_expr == "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+") {
 
         bpe_offsets = unicode_regex_split_custom_llama3(text, offsets);
+    } else if (
+            regex_expr == "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+" ||
+            // \s*[\r\n] ends at the last newline of the whitespace, as \s*[\r\n]+ does
+            regex_expr == "'(?:[sSdDmMtT]|[lL][lL]|[vV][eE]|[rR][eE])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]|\\s+(?!\\S)|\\s+") {
+        // QWEN2, BAILINGMOE
+        bpe_offsets = unicode_regex_split_custom_llama3(text, offsets, 1, true);
+    } else if (regex_expr == "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1}| ?[^\\s\\p{L}\\p{N}\\r\\n]+|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+") {
+        // SEED_CODER
+        bpe_offsets = unicode_regex_split_custom_llama3(text, offsets, 1, false);
+    } else if (regex_expr == "[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))*((?=[\\p{L}])([^A-Z]))+(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])?|[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))+((?=[\\p{L}])([^A-Z]))*(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])?|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n/]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+") {
+        bpe_offsets = unicode_regex_split_custom_gpt4o(text, offsets, 3, true);
+    } else if (regex_expr == "[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))*((?=[\\p{L}])([^A-Z]))+|[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))+((?=[\\p{L}])([^A-Z]))*|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n/]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+") {
+        // TEKKEN
+        bpe_offsets = unicode_regex_split_custom_gpt4o(text, offsets, 1, false);
+    } else if (regex_expr == "[!\"#$%&'()*+,\\-./:;<=>?@\\[\\\\\\]^_`{|}~][A-Za-z]+|[^\r\n\\p{L}\\p{P}\\p{S}]?[\\p{L}\\p{M}]+| ?[\\p{P}\\p{S}]+[\r\n]*|\\s*[\r\n]+|\\s+(?!\\S)|\\s+") {
+        bpe_offsets = unicode_regex_split_custom_deepseek3(text, offsets);
     } else if (regex_expr == "\\p{Han}+") {
         // K2's first pattern - handle all K2 patterns together
         bpe_offsets = unicode_regex_split_custom_kimi_k2(text, offsets);
+    } else if (regex_expr == "\\p{N}") {
+        bpe_offsets = unicode_regex_split_custom_class(text, offsets, unicode_cpt_is_number, 1, 1, false);
+    } else if (regex_expr == "\\p{N}+") {
+        bpe_offsets = unicode_regex_split_custom_class(text, offsets, unicode_cpt_is_number, 1, 0, false);
+    } else if (regex_expr == "\\p{N}{1,3}") {
+        bpe_offsets = unicode_regex_split_custom_class(text, offsets, unicode_cpt_is_number, 1, 3, false);
+    } else if (regex_expr == "[0-9][0-9][0-9]") {
+        bpe_offsets = unicode_regex_split_custom_class(text, offsets, unicode_cpt_is_digit, 3, 3, false);
+    } else if (regex_expr == "[\r\n]") {
+        bpe_offsets = unicode_regex_split_custom_class(text, offsets, unicode_cpt_is_newline, 1, 1, false);
+    } else if (regex_expr == "\\s?\\p{L}+") {
+        bpe_offsets = unicode_regex_split_custom_class(text, offsets, unicode_cpt_is_letter, 1, 0, true);
+    } else if (regex_expr == "\\s?\\p{P}+") {
+        bpe_offsets = unicode_regex_split_custom_class(text, offsets, unicode_cpt_is_punctuation, 1, 0, true);
     }
 
     return bpe_offsets;
@@ -781,39 +1301,59 @@ std::string unicode_cpt_to_utf8(uint32_t cpt) {
 }
 
 std::vector<uint32_t> unicode_cpts_normalize_nfd(const std::vector<uint32_t> & cpts) {
-    auto comp = [] (const uint32_t cpt, const range_nfd & range) {
-        return cpt < range.first;
-    };
+    static const auto nfd = unicode_cpt_nfd_table();
     std::vector<uint32_t> result(cpts.size());
     for (size_t i = 0; i < cpts.size(); ++i) {
         const uint32_t cpt = cpts[i];
-        auto it = std::upper_bound(unicode_ranges_nfd.begin(), unicode_ranges_nfd.end(), cpt, comp) - 1;
-        result[i] = (it->first <= cpt && cpt <= it->last) ? it->nfd : cpt;
+        result[i] = cpt < MAX_CODEPOINTS ? cpt + nfd.get(cpt) : cpt;
     }
     return result;
 }
 
 std::vector<uint32_t> unicode_cpts_from_utf8(const std::string & utf8) {
-    std::vector<uint32_t> result;
-    result.reserve(utf8.size());
+    const uint8_t * src = reinterpret_cast<const uint8_t *>(utf8.data());
+    const size_t    n   = utf8.size();
+
+    // there are at most as many codepoints as bytes
+    std::vector<uint32_t> result(n);
+    uint32_t * dst = result.data();
+
     size_t offset = 0;
-    while (offset < utf8.size()) {
-        try {
-            result.push_back(unicode_cpt_from_utf8(utf8, offset));
+    while (offset < n) {
+        // fast path: 8 ASCII bytes at a time (the copy is vectorized by the compiler)
+        if (offset + 8 <= n) {
+            uint64_t chunk;
+            memcpy(&chunk, src + offset, sizeof(chunk));
+            if (!(chunk & 0x8080808080808080ull)) {
+                for (size_t i = 0; i < 8; ++i) {
+                    dst[i] = src[offset + i];
+                }
+                dst    += 8;
+                offset += 8;
+                continue;
+            }
         }
-        catch (const std::invalid_argument & /*ex*/) {
+
+        size_t len = 0;
+        const uint32_t cpt = unicode_cpt_decode_utf8(src + offset, n - offset, len);
+        if (len == 0) {
             // Silently ignore invalid UTF-8 input to avoid leaking the exception beyond llama_tokenize
-            ++offset;
-            result.emplace_back(0xFFFD); // replacement character
+            *dst++ = 0xFFFD; // replacement character
+            offset += 1;
+        } else {
+            *dst++ = cpt;
+            offset += len;
         }
     }
+
+    result.resize(dst - result.data());
     return result;
 }
 
 unicode_cpt_flags unicode_cpt_flags_from_cpt(const uint32_t cpt) {
     static const unicode_cpt_flags undef(unicode_cpt_flags::UNDEFINED);
-    static const auto cpt_flags = unicode_cpt_flags_array();
-    return cpt < cpt_flags.size() ? cpt_flags[cpt] : undef;
+    static const auto cpt_flags = unicode_cpt_flags_table();
+    return cpt < MAX_CODEPOINTS ? unicode_cpt_flags(cpt_flags.get(cpt)) : undef;
 }
 
 unicode_cpt_flags unicode_cpt_flags_from_utf8(const std::string & utf8) {
@@ -836,15 +1376,9 @@ uint8_t unicode_utf8_to_byte(const std::string & utf8) {
 }
 
 uint32_t unicode_tolower(uint32_t cpt) {
-    // binary search
-    auto it = std::lower_bound(unicode_map_lowercase.begin(), unicode_map_lowercase.end(), cpt,
-        [](const std::pair<uint32_t, uint32_t> & pair, uint32_t value) {
-            return pair.first < value;
-        });
-    if (it != unicode_map_lowercase.end() && it->first == cpt) {
-        return it->second;
-    }
-    return cpt;  // Return the original code point if no lowercase mapping is found
+    static const auto lowercase = unicode_cpt_lowercase_table();
+    // return the original code point if no lowercase mapping is found
+    return cpt < MAX_CODEPOINTS ? cpt + lowercase.get(cpt) : cpt;
 }
 
 bool unicode_cpt_is_han(uint32_t cpt) {
@@ -19,6 +19,7 @@
 #include <ggml-alloc.h>
 #include <ggml-backend.h>
 #include <ggml-cpp.h>
+#include <gguf.h>
 
 #include <algorithm>
 #include <array>
@@ -30,7 +31,9 @@
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
+#include <fstream>
 #include <future>
+#include <map>
 #include <memory>
 #include <random>
 #include <regex>
@@ -915,9 +918,149 @@ struct csv_printer : public printer {
             "test_mode",
             "backend_reg_name",
             "backend_name",
+            "time_us",
+            "flops",
+            "bandwidth_gb_s",
+            "n_runs",
         };
     }
 
+    // inverse of the escaping of print_test_result()
+    static std::vector<std::string> parse_line(const std::string & line) {
+        std::vector<std::string> values;
+        std::string value;
+        bool quoted = false;
+        for (size_t i = 0; i < line.size(); i++) {
+            const char c = line[i];
+            if (quoted) {
+                if (c == '"' && i + 1 < line.size() && line[i + 1] == '"') {
+                    value += '"';
+                    i++;
+                } else if (c == '"') {
+                    quoted = false;
+                } else {
+                    value += c;
+                }
+            } else if (c == '"') {
+                quoted = true;
+            } else if (c == ',') {
+                values.push_back(value);
+                value.clear();
+            } else if (c != '\r') {
+                value += c;
+            }
+        }
+        values.push_back(value);
+        return values;
+    }
+
+};
+
+// perf results of an earlier run, as written by --output csv
+struct perf_baseline {
+    std::map<std::string, double> time_us; // by backend, op and params
+
+    static std::string key(const std::string & backend_name, const std::string & op_name, const std::string & op_params) {
+        return backend_name + "|" + op_name + "(" + op_params + ")";
+    }
+
+    bool load(const char * path) {
+        std::ifstream f(path);
+        if (!f) {
+            fprintf(stderr, "failed to open the baseline file %s\n", path);
+            return false;
+        }
+
+        std::string line;
+        std::getline(f, line);
+        const std::vector<std::string> header = csv_printer::parse_line(line);
+
+        auto column = [&](const char * name) -> size_t {
+            return std::find(header.begin(), header.end(), name) - header.begin();
+        };
+        const size_t i_backend = column("backend_name");
+        const size_t i_op      = column("op_name");
+        const size_t i_params  = column("op_params");
+        const size_t i_mode    = column("test_mode");
+        const size_t i_time    = column("time_us");
+
+        if (i_time >= header.size()) {
+            fprintf(stderr, "the baseline file %s has no time_us column, write it with: perf --output csv\n", path);
+            return false;
+        }
+
+        while (std::getline(f, line)) {
+            const std::vector<std::string> values = csv_printer::parse_line(line);
+            if (values.size() != header.size() || values[i_mode] != "perf") {
+                continue;
+            }
+            const double t = std::atof(values[i_time].c_str());
+            if (t > 0.0) {
+                time_us[key(values[i_backend], values[i_op], values[i_params])] = t;
+            }
+        }
+
+        return true;
+    }
+};
+
+// forwards to the output printer and compares the perf results with a baseline
+struct perf_compare_printer : public printer {
+    std::unique_ptr<printer> out;
+    perf_baseline            baseline;
+    double                   threshold; // slowdown relative to the baseline that is a regression
+
+    size_t n_compared = 0;
+    std::vector<std::string> regressions;
+
+    perf_compare_printer(std::unique_ptr<printer> out, double threshold) : out(std::move(out)), threshold(threshold) {}
+
+    void print_header() override { out->print_header(); }
+
+    void print_test_result(const test_result & result) override {
+        out->print_test_result(result);
+
+        if (result.test_mode != "perf" || !result.supported) {
+            return;
+        }
+
+        const auto it = baseline.time_us.find(perf_baseline::key(result.backend_name, result.op_name, result.op_params));
+        if (it == baseline.time_us.end()) {
+            return;
+        }
+
+        n_compared++;
+
+        const double change = result.time_us / it->second - 1.0;
+        if (change > threshold) {
+            char buf[64];
+            snprintf(buf, sizeof(buf), ": %.2f us/run vs %.2f us/run (%+.1f%%)", result.time_us, it->second, 100.0 * change);
+            regressions.push_back(result.backend_name + " " + result.op_name + "(" + result.op_params + ")" + buf);
+            fprintf(stderr, "REGRESSION %s\n", regressions.back().c_str());
+        }
+    }
+
+    void print_footer() override {
+        out->print_footer();
+
+        fprintf(stderr, "%zu/%zu perf results compared with the baseline, %zu regressions above %.1f%%\n",
+                n_compared, baseline.time_us.size(), regressions.size(), 100.0 * threshold);
+        for (const auto & r : regressions) {
+            fprintf(stderr, "  %s\n", r.c_str());
+        }
+    }
+
+    void print_operation(const test_operation_info & info) override { out->print_operation(info); }
+
+    void print_summary(const test_summary_info & info) override { out->print_summary(info); }
+
+    void print_testing_start(const testing_start_info & info) override { out->print_testing_start(info); }
+
+    void print_backend_init(const backend_init_info & info) override { out->print_backend_init(info); }
+
+    void print_backend_status(const backend_status_info & info) override { out->print_backend_status(info); }
+
+    void print_overall_summary(const overall_summary_info & info) override { out->print_overall_summary(info); }
 };
 
 static std::unique_ptr<printer> create_printer(output_formats format) {
@@ -3266,6 +3409,84 @@ struct test_mul_mat_id : public test_case {
     }
 };
 
+// GGML_OP_MUL_MAT_ID + GGML_OP_MUL_MAT_ID + GGML_OP_GLU (gate and up projections of a MoE FFN)
+struct test_mul_mat_id_glu : public test_case {
+    const ggml_type type_a;
+    const ggml_glu_op op;
+    const int n_mats;
+    const int n_used;
+    const int64_t m;
+    const int64_t n;
+    const int64_t k;
+
+    std::string op_desc(ggml_tensor * t) override {
+        GGML_UNUSED(t);
+        return "MUL_MAT_ID_GLU";
+    }
+
+    bool run_whole_graph() override { return true; }
+
+    std::string vars() override {
+        return VARS_TO_STR7(type_a, op, n_mats, n_used, m, n, k);
+    }
+
+    double max_nmse_err() override {
+        return 5e-4;
+    }
+
+    test_mul_mat_id_glu(ggml_type type_a = GGML_TYPE_F32, ggml_glu_op op = GGML_GLU_OP_SWIGLU,
+            int n_mats = 8, int n_used = 2, int64_t m = 32, int64_t n = 32, int64_t k = 32)
+        : type_a(type_a), op(op), n_mats(n_mats), n_used(n_used), m(m), n(n), k(k) {
+            GGML_ASSERT(n_used <= n_mats);
+        }
+
+    ggml_tensor * build_graph(ggml_context * ctx) override {
+        ggml_tensor * up = ggml_new_tensor_3d(ctx, type_a, k, m, n_mats);
+        ggml_set_name(up, "up");
+
+        ggml_tensor * gate = ggml_new_tensor_3d(ctx, type_a, k, m, n_mats);
+        ggml_set_name(gate, "gate");
+
+        ggml_tensor * ids = ggml_new_tensor_2d(ctx, GGML_TYPE_I32, n_mats, n);
+        ggml_set_name(ids, "ids");
+        if (n_used != n_mats) {
+            ids = ggml_view_2d(ctx, ids, n_used, n, ids->nb[1], 0);
+            ggml_set_name(ids, "view_of_ids");
+        }
+
+        ggml_tensor * b = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, k, 1, n);
+        ggml_set_name(b, "b");
+
+        ggml_tensor * out = ggml_glu_split(ctx,
+                ggml_mul_mat_id(ctx, gate, b, ids),
+                ggml_mul_mat_id(ctx, up,   b, ids), op);
+        ggml_set_name(out, "out");
+
+        return out;
+    }
+
+    void initialize_tensors(ggml_context * ctx) override {
+        for (ggml_tensor * t = ggml_get_first_tensor(ctx); t != NULL; t = ggml_get_next_tensor(ctx, t)) {
+            if (t->type == GGML_TYPE_I32) {
+                if (ggml_is_view_op(t->op)) { continue; }
+                std::random_device rd;
+                std::default_random_engine rng(rd());
+                // ids
+                for (int64_t r = 0; r < ggml_nrows(t); r++) {
+                    std::vector<int32_t> data(t->ne[0]);
+                    for (int i = 0; i < t->ne[0]; i++) {
+                        data[i] = i % n_mats;
+                    }
+                    std::shuffle(data.begin(), data.end(), rng);
+                    ggml_backend_tensor_set(t, data.data(), r * t->nb[1], t->ne[0] * sizeof(int32_t));
+                }
+            } else {
+                init_tensor_uniform(t);
+            }
+        }
+    }
+};
+
 // GGML_OP_OUT_PROD
 struct test_out_prod : public test_case {
     const ggml_type type_a;
@@ -4170,6 +4391,53 @@ struct test_argsort : public test_case {
     }
 };
 
+// GGML_OP_TOP_K (argsort of the full row, then a view of the first k)
+struct test_top_k : public test_case {
+    const ggml_type type;
+    const std::array<int64_t, 4> ne;
+    const int k;
+
+    std::string vars() override {
+        return VARS_TO_STR3(type, ne, k);
+    }
+
+    std::string op_desc(ggml_tensor * t) override {
+        GGML_UNUSED(t);
+        return "TOP_K";
+    }
+
+    test_top_k(ggml_type type = GGML_TYPE_F32,
+            std::array<int64_t, 4> ne = {16, 10, 10, 10},
+            int k = 4)
+        : type(type), ne(ne), k(k) {}
+
+    ggml_tensor * build_graph(ggml_context * ctx) override {
+        ggml_tensor * a = ggml_new_tensor(ctx, type, 4, ne.data());
+        ggml_set_name(a, "a");
+
+        ggml_tensor * out = ggml_cont(ctx, ggml_top_k(ctx, a, k));
+        ggml_set_name(out, "out");
+
+        return out;
+    }
+
+    void initialize_tensors(ggml_context * ctx) override {
+        std::random_device rd;
+        std::default_random_engine rng(rd());
+        for (ggml_tensor * t = ggml_get_first_tensor(ctx); t != NULL; t = ggml_get_next_tensor(ctx, t)) {
+            // initialize with unique values to avoid ties
+            for (int64_t r = 0; r < ggml_nrows(t); r++) {
+                std::vector<float> data(t->ne[0]);
+                for (int i = 0; i < t->ne[0]; i++) {
+                    data[i] = i;
+                }
+                std::shuffle(data.begin(), data.end(), rng);
+                ggml_backend_tensor_set(t, data.data(), r * t->nb[1], t->ne[0] * sizeof(float));
+            }
+        }
+    }
+};
+
 // GGML_OP_SUM
 struct test_sum : public test_case {
     const ggml_type type;
@@ -5190,6 +5458,7 @@ static const ggml_type all_types[] = {
     GGML_TYPE_Q5_0, GGML_TYPE_Q5_1,
     GGML_TYPE_Q8_0,
     GGML_TYPE_MXFP4,
+    GGML_TYPE_F8_E4M3,
     GGML_TYPE_Q2_K, GGML_TYPE_Q3_K,
     GGML_TYPE_Q4_K, GGML_TYPE_Q5_K,
     GGML_TYPE_Q6_K,
@@ -5816,6 +6085,14 @@ static std::vector<std::unique_ptr<test_case>> make_test_cases_eval() {
         }
     }
 
+    for (ggml_type type_a : {GGML_TYPE_F32, GGML_TYPE_F16, GGML_TYPE_Q4_0, GGML_TYPE_Q8_0}) {
+        for (ggml_glu_op op : {GGML_GLU_OP_REGLU, GGML_GLU_OP_GEGLU, GGML_GLU_OP_SWIGLU}) {
+            for (int n : {1, 32, 129}) {
+                test_cases.emplace_back(new test_mul_mat_id_glu(type_a, op, 8, 2, 512, n, 256));
+            }
+        }
+    }
+
     for (ggml_type type_a : base_types) {
         for (ggml_type type_b : {GGML_TYPE_F32, GGML_TYPE_F16}) {
             for (int n : {1, 16}) {
@@ -5834,6 +6111,11 @@ static std::vector<std::unique_ptr<test_case>> make_test_cases_eval() {
         }
     }
 
+    // BF16 weights of mixed precision training, dequantized per row
+    for (int n : {1, 16}) {
+        test_cases.emplace_back(new test_out_prod(GGML_TYPE_BF16, GGML_TYPE_F32, 256, n, 16, {3, 1}, {2, 1}));
+    }
+
     // add_id
     for (ggml_type type_a : {GGML_TYPE_F32}) {
         for (ggml_type type_b : {GGML_TYPE_F32}) {
@@ -5985,8 +6267,12 @@ static std::vector<std::unique_ptr<test_case>> make_test_cases_eval() {
         test_cases.emplace_back(new test_argsort(GGML_TYPE_F32, {8, 1, 1, 1}, order));
         test_cases.emplace_back(new test_argsort(GGML_TYPE_F32, {16, 10, 10, 10}, order));
         test_cases.emplace_back(new test_argsort(GGML_TYPE_F32, {60, 10, 10, 10}, order)); // qwen
+        test_cases.emplace_back(new test_argsort(GGML_TYPE_F32, {32000, 2, 1, 1}, order)); // vocab-sized rows
     }
 
+    test_cases.emplace_back(new test_top_k(GGML_TYPE_F32, {16, 10, 10, 10}, 4));
+    test_cases.emplace_back(new test_top_k(GGML_TYPE_F32, {32000, 3, 1, 1}, 40)); // top-k sampling on the logits
+
     for (ggml_scale_mode mode : {GGML_SCALE_MODE_NEAREST, GGML_SCALE_MODE_BILINEAR}) {
         test_cases.emplace_back(new test_upscale(GGML_TYPE_F32, {512, 512, 3, 2}, 2, mode));
         test_cases.emplace_back(new test_upscale(GGML_TYPE_F32, {512, 512, 3, 2}, 2, mode, true));
@@ -6182,8 +6468,71 @@ static std::vector<std::unique_ptr<test_case>> make_test_cases_perf() {
     return test_cases;
 }
 
+// the matrix multiplications with the weights of a model, for a single token and for a prompt batch
+static std::vector<std::unique_ptr<test_case>> make_test_cases_model(const char * fname) {
+    std::vector<std::unique_ptr<test_case>> test_cases;
+
+    ggml_context * meta = nullptr;
+
+    gguf_init_params params = {
+        /* .no_alloc = */ true,
+        /* .ctx      = */ &meta,
+    };
+    gguf_context * gguf = gguf_init_from_file(fname, params);
+    if (!gguf) {
+        fprintf(stderr, "failed to read the model %s\n", fname);
+        return test_cases;
+    }
+
+    int n_expert_used = 2;
+    {
+        const int64_t i_arch = gguf_find_key(gguf, "general.architecture");
+        if (i_arch >= 0) {
+            const std::string key = std::string(gguf_get_val_str(gguf, i_arch)) + ".expert_used_count";
+            const int64_t i_used = gguf_find_key(gguf, key.c_str());
+            if (i_used >= 0) {
+                n_expert_used = gguf_get_val_u32(gguf, i_used);
+            }
+        }
+    }
+
+    // type, rows, columns and number of experts of the weights
+    std::vector<std::array<int64_t, 4>> shapes;
+
+    for (ggml_tensor * t = ggml_get_first_tensor(meta); t != nullptr; t = ggml_get_next_tensor(meta, t)) {
+        if (strncmp(t->name, "token_embd", 10) == 0 || ggml_n_dims(t) < 2 || t->ne[3] != 1) {
+            continue; // the token embeddings are used with GET_ROWS
+        }
+
+        const std::array<int64_t, 4> shape = { t->type, t->ne[1], t->ne[0], t->ne[2] };
+        if (std::find(shapes.begin(), shapes.end(), shape) == shapes.end()) {
+            shapes.push_back(shape);
+        }
+    }
+
+    for (const auto & shape : shapes) {
+        const ggml_type type = (ggml_type) shape[0];
+        const int64_t   m    = shape[1];
+        const int64_t   k    = shape[2];
+        const int64_t   n_ex = shape[3];
+
+        for (int n : { 1, 512 }) {
+            if (n_ex == 1) {
+                test_cases.emplace_back(new test_mul_mat(type, GGML_TYPE_F32, m, n, k, { 1, 1 }, { 1, 1 }));
+            } else {
+                test_cases.emplace_back(new test_mul_mat_id(type, GGML_TYPE_F32, n_ex, std::min<int>(n_expert_used, n_ex), false, m, n, k));
+            }
+        }
+    }
+
+    gguf_free(gguf);
+    ggml_free(meta);
+
+    return test_cases;
+}
+
 static bool test_backend(ggml_backend_t backend, test_mode mode, const char * op_names_filter, const char * params_filter,
-                         printer * output_printer) {
+                         const char * model_shapes, printer * output_printer) {
     auto filter_test_cases = [](std::vector<std::unique_ptr<test_case>> & test_cases, const char * params_filter) {
         if (params_filter == nullptr) {
             return;
@@ -6240,7 +6589,7 @@ static bool test_backend(ggml_backend_t backend, test_mode mode, const char * op
     }
 
     if (mode == MODE_PERF) {
-        auto test_cases = make_test_cases_perf();
+        auto test_cases = model_shapes ? make_test_cases_model(model_shapes) : make_test_cases_perf();
         filter_test_cases(test_cases, params_filter);
         for (auto & test : test_cases) {
             test->eval_perf(backend, op_names_filter, output_printer);
@@ -6262,6 +6611,7 @@ static bool test_backend(ggml_backend_t backend, test_mode mode, const char * op
 
 static void usage(char ** argv) {
     printf("Usage: %s [mode] [-o <op,..>] [-b <backend>] [-p <params regex>] [--output <console|sql|csv>]\n", argv[0]);
+    printf("           [--model-shapes <model.gguf>] [--baseline <results.csv>] [--threshold <percent>]\n");
     printf("    valid modes:\n");
     printf("      - test (default, compare with CPU backend for correctness)\n");
     printf("      - grad (compare gradients from backpropagation with method of finite differences)\n");
@@ -6270,6 +6620,9 @@ static void usage(char ** argv) {
     printf("    op names for -o are as given by ggml_op_desc() (e.g. ADD, MUL_MAT, etc),\n");
     printf("        optionally including the full test case string (e.g. \"ADD(type=f16,ne=[1,1,8,1],nr=[1,1,1,1],nf=1)\")\n");
     printf("    --output specifies output format (default: console, options: console, sql, csv)\n");
+    printf("    --model-shapes runs the perf mode with the matrix multiplications of the weights of a model instead of the built-in cases\n");
+    printf("    --baseline compares the perf results with the csv output of an earlier run, the slowdowns above\n");
+    printf("        --threshold percent (default: 10) are reported as regressions and make the run fail\n");
 }
 
 int main(int argc, char ** argv) {
@@ -6278,6 +6631,9 @@ int main(int argc, char ** argv) {
     const char * op_names_filter = nullptr;
     const char * backend_filter = nullptr;
     const char * params_filter = nullptr;
+    const char * model_shapes = nullptr;
+    const char * baseline_file = nullptr;
+    double       threshold = 10.0;
 
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "test") == 0) {
@@ -6309,6 +6665,27 @@ int main(int argc, char ** argv) {
                 usage(argv);
                 return 1;
             }
+        } else if (strcmp(argv[i], "--model-shapes") == 0) {
+            if (i + 1 < argc) {
+                model_shapes = argv[++i];
+            } else {
+                usage(argv);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--baseline") == 0) {
+            if (i + 1 < argc) {
+                baseline_file = argv[++i];
+            } else {
+                usage(argv);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--threshold") == 0) {
+            if (i + 1 < argc) {
+                threshold = atof(argv[++i]);
+            } else {
+                usage(argv);
+                return 1;
+            }
         } else if (strcmp(argv[i], "--output") == 0) {
             if (i + 1 < argc) {
                 if (!output_format_from_str(argv[++i], output_format)) {
@@ -6330,6 +6707,17 @@ int main(int argc, char ** argv) {
 
     // Create printer for output format
     std::unique_ptr<printer> output_printer = create_printer(output_format);
+
+    perf_compare_printer * compare_printer = nullptr;
+    if (baseline_file) {
+        auto p = std::make_unique<perf_compare_printer>(std::move(output_printer), threshold / 100.0);
+        if (!p->baseline.load(baseline_file)) {
+            return 1;
+        }
+        compare_printer = p.get();
+        output_printer  = std::move(p);
+    }
+
     if (output_printer) {
         output_printer->print_header();
     }
@@ -6371,7 +6759,7 @@ int main(int argc, char ** argv) {
                                                              false, "", ggml_backend_dev_description(dev),
                                                              total / 1024 / 1024, free / 1024 / 1024, true));
 
-        bool ok = test_backend(backend, mode, op_names_filter, params_filter, output_printer.get());
+        bool ok = test_backend(backend, mode, op_names_filter, params_filter, model_shapes, output_printer.get());
 
         if (ok) {
             n_ok++;
@@ -6395,5 +6783,9 @@ int main(int argc, char ** argv) {
         return 1;
     }
 
+    if (compare_printer && !compare_printer->regressions.empty()) {
+        return 1;
+    }
+
     return 0;
 }
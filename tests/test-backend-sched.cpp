@@ -0,0 +1,326 @@
+// checks that the concurrent split order of ggml_backend_sched (GGML_SCHED_CONCURRENT=1) computes the same result as
+// the sequential order on a graph that mixes an asynchronous (GPU) and a synchronous (CPU) backend
+//
+// the GPU is a CPU backend behind a device of type GPU with its own buffer type, so that the graph is split between
+// the two backends and the tensors are copied between their buffers as with a real GPU
+
+#include "ggml.h"
+#include "ggml-cpu.h"
+#include "ggml-alloc.h"
+#include "ggml-backend.h"
+#include "ggml-backend-impl.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+static ggml_backend_dev_t cpu_dev;
+
+// order of the computed splits: backend and first node
+static std::vector<std::string> compute_log;
+
+//
+// fake GPU device and buffer type
+//
+
+static struct ggml_backend_buffer_type fake_buft;
+static struct ggml_backend_device     fake_dev;
+
+static const char * fake_buft_get_name(ggml_backend_buffer_type_t buft) {
+    return "FAKE_GPU";
+
+    GGML_UNUSED(buft);
+}
+
+static ggml_backend_buffer_t fake_buft_alloc_buffer(ggml_backend_buffer_type_t buft, size_t size) {
+    ggml_backend_buffer_t buffer = ggml_backend_buft_alloc_buffer(ggml_backend_cpu_buffer_type(), size);
+    if (buffer != NULL) {
+        buffer->buft = buft;
+    }
+    return buffer;
+}
+
+static const char * fake_dev_get_name(ggml_backend_dev_t dev) {
+    return "FAKE_GPU";
+
+    GGML_UNUSED(dev);
+}
+
+static void fake_dev_get_memory(ggml_backend_dev_t dev, size_t * free, size_t * total) {
+    *free  = 0;
+    *total = 0;
+
+    GGML_UNUSED(dev);
+}
+
+static enum ggml_backend_dev_type fake_dev_get_type(ggml_backend_dev_t dev) {
+    return GGML_BACKEND_DEVICE_TYPE_GPU;
+
+    GGML_UNUSED(dev);
+}
+
+static void fake_dev_get_props(ggml_backend_dev_t dev, struct ggml_backend_dev_props * props) {
+    memset(props, 0, sizeof(*props));
+    props->name        = fake_dev_get_name(dev);
+    props->description = fake_dev_get_name(dev);
+    props->type        = fake_dev_get_type(dev);
+}
+
+static ggml_backend_buffer_type_t fake_dev_get_buffer_type(ggml_backend_dev_t dev) {
+    return &fake_buft;
+
+    GGML_UNUSED(dev);
+}
+
+static bool fake_dev_supports_op(ggml_backend_dev_t dev, const struct ggml_tensor * op) {
+    // keeps the activations of the CPU branch on the CPU
+    if (op->op == GGML_OP_UNARY && ggml_get_unary_op(op) == GGML_UNARY_OP_TANH) {
+        return false;
+    }
+    return ggml_backend_dev_supports_op(cpu_dev, op);
+
+    GGML_UNUSED(dev);
+}
+
+static bool fake_dev_supports_buft(ggml_backend_dev_t dev, ggml_backend_buffer_type_t buft) {
+    return buft == &fake_buft;
+
+    GGML_UNUSED(dev);
+}
+
+static void fake_init(void) {
+    fake_buft = *ggml_backend_cpu_buffer_type();
+    fake_buft.iface.get_name     = fake_buft_get_name;
+    fake_buft.iface.alloc_buffer = fake_buft_alloc_buffer;
+    fake_buft.iface.is_host      = NULL; // the CPU backend cannot read it directly
+    fake_buft.device             = &fake_dev;
+    fake_buft.context            = NULL;
+
+    memset(&fake_dev, 0, sizeof(fake_dev));
+    fake_dev.iface.get_name        = fake_dev_get_name;
+    fake_dev.iface.get_description = fake_dev_get_name;
+    fake_dev.iface.get_memory      = fake_dev_get_memory;
+    fake_dev.iface.get_type        = fake_dev_get_type;
+    fake_dev.iface.get_props       = fake_dev_get_props;
+    fake_dev.iface.get_buffer_type = fake_dev_get_buffer_type;
+    fake_dev.iface.supports_op     = fake_dev_supports_op;
+    fake_dev.iface.supports_buft   = fake_dev_supports_buft;
+    fake_dev.reg                   = ggml_backend_dev_backend_reg(cpu_dev);
+}
+
+//
+// backends that record the splits they compute
+//
+
+struct logging_backend {
+    ggml_backend_t cpu;
+    std::string    name;
+};
+
+static enum ggml_status logging_graph_compute(ggml_backend_t backend, struct ggml_cgraph * cgraph) {
+    logging_backend * ctx = (logging_backend *) backend->context;
+
+    compute_log.push_back(ctx->name + ":" + ggml_graph_node(cgraph, 0)->name);
+
+    return ggml_backend_graph_compute(ctx->cpu, cgraph);
+}
+
+static const char * logging_get_name(ggml_backend_t backend) {
+    return ((logging_backend *) backend->context)->name.c_str();
+}
+
+static void logging_free(ggml_backend_t backend) {
+    logging_backend * ctx = (logging_backend *) backend->context;
+    ggml_backend_free(ctx->cpu);
+    delete ctx;
+    delete backend;
+}
+
+static ggml_backend_t logging_backend_init(ggml_backend_dev_t dev, const char * name) {
+    ggml_backend_t cpu = ggml_backend_cpu_init();
+    GGML_ASSERT(cpu != NULL);
+
+    ggml_backend_t backend = new ggml_backend;
+    backend->guid = cpu->guid;
+    memset(&backend->iface, 0, sizeof(backend->iface));
+    backend->iface.get_name      = logging_get_name;
+    backend->iface.free          = logging_free;
+    backend->iface.graph_compute = logging_graph_compute;
+    backend->device  = dev;
+    backend->context = new logging_backend { cpu, name };
+    return backend;
+}
+
+//
+// test
+//
+
+static const int n_embd  = 64;
+static const int n_layer = 6;
+
+struct test_model {
+    std::vector<ggml_tensor *> w_cpu;
+    std::vector<ggml_tensor *> w_gpu;
+    ggml_backend_buffer_t buf_cpu = NULL;
+    ggml_backend_buffer_t buf_gpu = NULL;
+};
+
+// two independent branches, one with the weights on the CPU and one with the weights on the GPU, merged at the end
+// the layers of the branches alternate in the graph order, so that the splits alternate between the backends
+static ggml_cgraph * build_graph(ggml_context * ctx, const test_model & model, ggml_tensor * inp) {
+    ggml_cgraph * gf = ggml_new_graph(ctx);
+
+    ggml_tensor * a = inp;
+    ggml_tensor * b = inp;
+    for (int il = 0; il < n_layer; il++) {
+        a = ggml_mul_mat(ctx, model.w_cpu[il], a);
+        ggml_format_name(a, "cpu-%d", il);
+        a = ggml_tanh(ctx, a);
+        ggml_format_name(a, "cpu-act-%d", il);
+        ggml_build_forward_expand(gf, a);
+
+        b = ggml_mul_mat(ctx, model.w_gpu[il], b);
+        ggml_format_name(b, "gpu-%d", il);
+        b = ggml_silu(ctx, b);
+        ggml_format_name(b, "gpu-act-%d", il);
+        ggml_build_forward_expand(gf, b);
+    }
+
+    ggml_tensor * out = ggml_add(ctx, a, b);
+    ggml_set_name(out, "out");
+    ggml_set_output(out);
+    ggml_build_forward_expand(gf, out);
+
+    return gf;
+}
+
+static std::vector<float> run(const test_model & model, const std::vector<float> & inp_data, bool concurrent) {
+    // read by ggml_backend_sched_new
+#ifdef _WIN32
+    _putenv_s("GGML_SCHED_CONCURRENT", concurrent ? "1" : "0");
+#else
+    setenv("GGML_SCHED_CONCURRENT", concurrent ? "1" : "0", 1);
+#endif
+
+    ggml_backend_t backends[2] = {
+        logging_backend_init(&fake_dev, "gpu"),
+        logging_backend_init(cpu_dev,   "cpu"),
+    };
+    ggml_backend_sched_t sched = ggml_backend_sched_new(backends, NULL, 2, GGML_DEFAULT_GRAPH_SIZE, false, false);
+
+    ggml_init_params params = {
+        /*.mem_size   =*/ ggml_tensor_overhead()*GGML_DEFAULT_GRAPH_SIZE + ggml_graph_overhead(),
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ true,
+    };
+    ggml_context * ctx = ggml_init(params);
+
+    ggml_tensor * inp = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_embd);
+    ggml_set_name(inp, "inp");
+    ggml_set_input(inp);
+
+    ggml_cgraph * gf = build_graph(ctx, model, inp);
+    ggml_tensor * out = ggml_graph_node(gf, -1);
+
+    GGML_ASSERT(ggml_backend_sched_alloc_graph(sched, gf));
+    ggml_backend_tensor_set(inp, inp_data.data(), 0, ggml_nbytes(inp));
+
+    compute_log.clear();
+    GGML_ASSERT(ggml_backend_sched_graph_compute(sched, gf) == GGML_STATUS_SUCCESS);
+
+    printf("%s: %-10s %d splits:", __func__, concurrent ? "concurrent" : "sequential", ggml_backend_sched_get_n_splits(sched));
+    for (const auto & s : compute_log) {
+        printf(" %s", s.c_str());
+    }
+    printf("\n");
+
+    std::vector<float> res(ggml_nelements(out));
+    ggml_backend_tensor_get(out, res.data(), 0, ggml_nbytes(out));
+
+    ggml_free(ctx);
+    ggml_backend_sched_free(sched);
+    ggml_backend_free(backends[0]);
+    ggml_backend_free(backends[1]);
+
+    return res;
+}
+
+int main(void) {
+    ggml_backend_load_all();
+
+    cpu_dev = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
+    GGML_ASSERT(cpu_dev != NULL);
+    fake_init();
+
+    // weights
+    ggml_init_params params = {
+        /*.mem_size   =*/ ggml_tensor_overhead()*2*n_layer,
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ true,
+    };
+    ggml_context * ctx_cpu = ggml_init(params);
+    ggml_context * ctx_gpu = ggml_init(params);
+
+    test_model model;
+    for (int il = 0; il < n_layer; il++) {
+        model.w_cpu.push_back(ggml_new_tensor_2d(ctx_cpu, GGML_TYPE_F32, n_embd, n_embd));
+        model.w_gpu.push_back(ggml_new_tensor_2d(ctx_gpu, GGML_TYPE_F32, n_embd, n_embd));
+    }
+    model.buf_cpu = ggml_backend_alloc_ctx_tensors_from_buft(ctx_cpu, ggml_backend_cpu_buffer_type());
+    model.buf_gpu = ggml_backend_alloc_ctx_tensors_from_buft(ctx_gpu, &fake_buft);
+    ggml_backend_buffer_set_usage(model.buf_cpu, GGML_BACKEND_BUFFER_USAGE_WEIGHTS);
+    ggml_backend_buffer_set_usage(model.buf_gpu, GGML_BACKEND_BUFFER_USAGE_WEIGHTS);
+
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> dist(-0.2f, 0.2f);
+
+    std::vector<float> data(n_embd*n_embd);
+    for (int il = 0; il < n_layer; il++) {
+        for (ggml_tensor * w : { model.w_cpu[il], model.w_gpu[il] }) {
+            for (float & v : data) {
+                v = dist(rng);
+            }
+            ggml_backend_tensor_set(w, data.data(), 0, ggml_nbytes(w));
+        }
+    }
+
+    std::vector<float> inp_data(n_embd);
+    for (float & v : inp_data) {
+        v = dist(rng);
+    }
+
+    const std::vector<float> res_seq = run(model, inp_data, false);
+    const std::vector<std::string> log_seq = compute_log;
+
+    const std::vector<float> res_con = run(model, inp_data, true);
+    const std::vector<std::string> log_con = compute_log;
+
+    bool ok = true;
+
+    if (log_seq == log_con) {
+        printf("%s: the concurrent order did not reorder the splits\n", __func__);
+        ok = false;
+    }
+
+    // the same kernels compute the same values in any order
+    for (int i = 0; i < n_embd; i++) {
+        if (res_seq[i] != res_con[i] || std::isnan(res_seq[i])) {
+            printf("%s: mismatch at %d: sequential %f, concurrent %f\n", __func__, i, res_seq[i], res_con[i]);
+            ok = false;
+            break;
+        }
+    }
+
+    ggml_backend_buffer_free(model.buf_cpu);
+    ggml_backend_buffer_free(model.buf_gpu);
+    ggml_free(ctx_cpu);
+    ggml_free(ctx_gpu);
+
+    printf("%s: %s\n", __func__, ok ? "OK" : "FAILED");
+
+    return ok ? 0 : 1;
+}
@@ -298,6 +298,19 @@ static void test_templates(const struct common_chat_templates * tmpls, const std
             assert_msg_equals(test_message, msg);
         }
 
+        if (expect_grammar_triggered) {
+            // parsing the streamed prefixes with a state must give the same messages as parsing them from scratch
+            common_chat_syntax syntax;
+            syntax.format = data.params.format;
+            syntax.reasoning_format = reasoning_format;
+            common_chat_msg_parser_state state;
+            for (size_t n = 1; n <= data.delta.size(); ++n) {
+                const auto prefix = data.delta.substr(0, n);
+                const bool is_partial = n < data.delta.size();
+                assert_msg_equals(common_chat_parse(prefix, is_partial, syntax), common_chat_parse(prefix, is_partial, syntax, state));
+            }
+        }
+
         if (!test_message.tool_calls.empty()) {
             GGML_ASSERT(!data.params.grammar.empty());
         }
@@ -0,0 +1,145 @@
+// checks that llama_decode_async() computes the same logits as llama_decode() when the two are interleaved,
+// and that the errors of an async decode are returned by llama_decode_wait()
+
+#include "llama.h"
+#include "get-model.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+enum decode_mode {
+    DECODE_SYNC,
+    DECODE_ASYNC_WAIT,     // llama_decode_wait() before reading the logits
+    DECODE_ASYNC_IMPLICIT, // the logits are read without llama_decode_wait()
+};
+
+static std::vector<llama_token> tokenize(const llama_vocab * vocab, const std::string & text) {
+    const int n = -llama_tokenize(vocab, text.c_str(), text.size(), NULL, 0, true, true);
+    std::vector<llama_token> res(n);
+    llama_tokenize(vocab, text.c_str(), text.size(), res.data(), res.size(), true, true);
+    return res;
+}
+
+static bool decode(llama_context * ctx, llama_batch batch, decode_mode mode) {
+    if (mode == DECODE_SYNC) {
+        return llama_decode(ctx, batch) == 0;
+    }
+    if (llama_decode_async(ctx, batch) != 0) {
+        return false;
+    }
+    if (mode == DECODE_ASYNC_WAIT) {
+        return llama_decode_wait(ctx) == 0;
+    }
+    return true;
+}
+
+// greedy generation from the prompt, returns the logits of each step
+static std::vector<std::vector<float>> generate(llama_context * ctx, const std::vector<llama_token> & prompt, int n_predict,
+        const std::vector<decode_mode> & modes) {
+    const llama_vocab * vocab = llama_model_get_vocab(llama_get_model(ctx));
+    const int n_vocab = llama_vocab_n_tokens(vocab);
+
+    llama_memory_clear(llama_get_memory(ctx), true);
+
+    std::vector<llama_token> tokens = prompt;
+    std::vector<std::vector<float>> res;
+
+    llama_batch batch = llama_batch_get_one(tokens.data(), tokens.size());
+    for (int i = 0; i < n_predict; i++) {
+        if (!decode(ctx, batch, modes[i % modes.size()])) {
+            fprintf(stderr, "%s: decode failed at step %d\n", __func__, i);
+            return {};
+        }
+
+        const float * logits = llama_get_logits_ith(ctx, -1);
+        res.emplace_back(logits, logits + n_vocab);
+
+        llama_token id = 0;
+        for (int j = 1; j < n_vocab; j++) {
+            if (logits[j] > logits[id]) {
+                id = j;
+            }
+        }
+        tokens.push_back(id);
+
+        batch = llama_batch_get_one(&tokens.back(), 1);
+    }
+
+    // the last batch points into tokens, which is not modified while it is decoded
+    llama_decode_wait(ctx);
+
+    return res;
+}
+
+int main(int argc, char ** argv) {
+    auto * model_path = get_model_or_exit(argc, argv);
+
+    llama_backend_init();
+
+    auto * model = llama_model_load_from_file(model_path, llama_model_default_params());
+    if (model == NULL) {
+        fprintf(stderr, "%s: failed to load the model\n", __func__);
+        return 1;
+    }
+
+    auto cparams = llama_context_default_params();
+    cparams.n_ctx   = 256;
+    cparams.n_batch = 64;
+
+    auto * ctx = llama_init_from_model(model, cparams);
+    const llama_vocab * vocab = llama_model_get_vocab(model);
+
+    const std::vector<llama_token> prompt = tokenize(vocab, "The quick brown fox jumps over the lazy dog");
+    const int n_predict = 12;
+
+    bool ok = true;
+
+    const auto res_sync  = generate(ctx, prompt, n_predict, { DECODE_SYNC });
+    const auto res_mixed = generate(ctx, prompt, n_predict, { DECODE_ASYNC_WAIT, DECODE_SYNC, DECODE_ASYNC_IMPLICIT });
+
+    if (res_sync.size() != (size_t) n_predict || res_mixed.size() != (size_t) n_predict) {
+        ok = false;
+    }
+
+    for (size_t i = 0; ok && i < res_sync.size(); i++) {
+        for (size_t j = 0; j < res_sync[i].size(); j++) {
+            if (std::fabs(res_sync[i][j] - res_mixed[i][j]) > 1e-5f) {
+                fprintf(stderr, "%s: step %zu: logit %zu differs: %f (sync) != %f (async)\n", __func__, i, j, res_sync[i][j], res_mixed[i][j]);
+                ok = false;
+                break;
+            }
+        }
+    }
+
+    // an invalid batch fails in llama_decode_wait() and leaves the context usable
+    {
+        llama_memory_clear(llama_get_memory(ctx), true);
+
+        llama_token bad = llama_vocab_n_tokens(vocab) + 5;
+        if (llama_decode_async(ctx, llama_batch_get_one(&bad, 1)) != 0 || llama_decode_wait(ctx) != -1) {
+            fprintf(stderr, "%s: the invalid async batch did not fail with -1\n", __func__);
+            ok = false;
+        }
+        if (llama_decode_wait(ctx) != 0) {
+            fprintf(stderr, "%s: the result of the async batch was returned twice\n", __func__);
+            ok = false;
+        }
+
+        std::vector<llama_token> tokens = prompt;
+        if (llama_decode(ctx, llama_batch_get_one(tokens.data(), tokens.size())) != 0) {
+            fprintf(stderr, "%s: decode failed after the invalid async batch\n", __func__);
+            ok = false;
+        }
+    }
+
+    llama_free(ctx);
+    llama_model_free(model);
+    llama_backend_free();
+
+    fprintf(stderr, "%s: %s\n", __func__, ok ? "OK" : "FAILED");
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,228 @@
+// checks the CPU flash attention against a reference in double precision, with each row computed by a single thread
+// and with the KV positions of the rows split across the threads (fewer rows than threads)
+
+#include "ggml.h"
+#include "ggml-cpu.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+struct fa_case {
+    ggml_type type_kv;
+    int64_t   d;         // head size
+    int64_t   n_kv;
+    int64_t   n_q;       // number of queries
+    int64_t   n_head;
+    int64_t   n_head_kv;
+    bool      mask;
+    int64_t   n_masked;  // number of masked KV positions at the start, to have chunks without any visible position
+};
+
+static void fill_random(ggml_tensor * t, std::mt19937 & rng) {
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+
+    const int64_t n_per_row = t->ne[0];
+    const int64_t n_rows    = ggml_nrows(t);
+
+    std::vector<float> data(n_per_row*n_rows);
+    for (float & x : data) {
+        x = dist(rng);
+    }
+
+    switch (t->type) {
+        case GGML_TYPE_F32:
+            memcpy(t->data, data.data(), ggml_nbytes(t));
+            break;
+        case GGML_TYPE_F16:
+            ggml_fp32_to_fp16_row(data.data(), (ggml_fp16_t *) t->data, data.size());
+            break;
+        default:
+            ggml_quantize_chunk(t->type, data.data(), t->data, 0, n_rows, n_per_row, nullptr);
+            break;
+    }
+}
+
+static std::vector<float> to_float(const ggml_tensor * t) {
+    std::vector<float> res(ggml_nelements(t));
+
+    if (t->type == GGML_TYPE_F32) {
+        memcpy(res.data(), t->data, ggml_nbytes(t));
+    } else {
+        ggml_get_type_traits(t->type)->to_float(t->data, res.data(), res.size());
+    }
+
+    return res;
+}
+
+// attention in double precision, with the K and V rows dequantized
+// the first n_masked KV positions are masked, out: [d, n_head, n_q]
+static std::vector<float> attn_ref(const ggml_tensor * q, const ggml_tensor * k, const ggml_tensor * v, int64_t n_masked) {
+    const int64_t d         = q->ne[0];
+    const int64_t n_q       = q->ne[1];
+    const int64_t n_head    = q->ne[2];
+    const int64_t n_kv      = k->ne[1];
+    const int64_t n_head_kv = k->ne[2];
+
+    const std::vector<float> qf = to_float(q);
+    const std::vector<float> kf = to_float(k);
+    const std::vector<float> vf = to_float(v);
+
+    const double scale = 1.0/sqrt((double) d);
+
+    std::vector<float> res(d*n_head*n_q);
+    std::vector<double> s(n_kv);
+    std::vector<double> o(d);
+
+    for (int64_t iq = 0; iq < n_q; iq++) {
+        for (int64_t h = 0; h < n_head; h++) {
+            const int64_t hk = h/(n_head/n_head_kv);
+
+            const float * pq = qf.data() + (h*n_q + iq)*d;
+
+            double M = -INFINITY;
+            for (int64_t ikv = n_masked; ikv < n_kv; ikv++) {
+                const float * pk = kf.data() + (hk*n_kv + ikv)*d;
+
+                double dot = 0.0;
+                for (int64_t i = 0; i < d; i++) {
+                    dot += (double) pq[i]*pk[i];
+                }
+                s[ikv] = dot*scale;
+                M = std::max(M, s[ikv]);
+            }
+
+            double S = 0.0;
+            std::fill(o.begin(), o.end(), 0.0);
+            for (int64_t ikv = n_masked; ikv < n_kv; ikv++) {
+                const float * pv = vf.data() + (hk*n_kv + ikv)*d;
+
+                const double e = exp(s[ikv] - M);
+                S += e;
+                for (int64_t i = 0; i < d; i++) {
+                    o[i] += e*pv[i];
+                }
+            }
+
+            for (int64_t i = 0; i < d; i++) {
+                res[(iq*n_head + h)*d + i] = o[i]/S;
+            }
+        }
+    }
+
+    return res;
+}
+
+// normalized mean squared error, NaN if out has NaNs
+static double nmse(const std::vector<float> & ref, const float * out) {
+    double err = 0.0;
+    double sum = 0.0;
+
+    for (size_t i = 0; i < ref.size(); i++) {
+        err += ((double) out[i] - ref[i])*((double) out[i] - ref[i]);
+        sum += (double) ref[i]*ref[i];
+    }
+
+    return err/sum;
+}
+
+static void graph_compute(std::vector<uint8_t> & buf, ggml_cgraph * graph, int n_threads) {
+    ggml_cplan plan = ggml_graph_plan(graph, n_threads, nullptr);
+
+    if (plan.work_size > 0) {
+        buf.resize(plan.work_size);
+        plan.work_data = buf.data();
+    }
+
+    ggml_graph_compute(graph, &plan);
+}
+
+static bool test_case(const fa_case & tc, std::mt19937 & rng) {
+    ggml_init_params params = {
+        /* .mem_size   = */ 64*1024*1024,
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ false,
+    };
+
+    ggml_context * ctx = ggml_init(params);
+
+    ggml_tensor * q = ggml_new_tensor_4d(ctx, GGML_TYPE_F32, tc.d, tc.n_q,  tc.n_head,    1);
+    ggml_tensor * k = ggml_new_tensor_4d(ctx, tc.type_kv,    tc.d, tc.n_kv, tc.n_head_kv, 1);
+    ggml_tensor * v = ggml_new_tensor_4d(ctx, tc.type_kv,    tc.d, tc.n_kv, tc.n_head_kv, 1);
+
+    fill_random(q, rng);
+    fill_random(k, rng);
+    fill_random(v, rng);
+
+    ggml_tensor * m = nullptr;
+    if (tc.mask) {
+        m = ggml_new_tensor_2d(ctx, GGML_TYPE_F16, tc.n_kv, GGML_PAD(tc.n_q, GGML_KQ_MASK_PAD));
+
+        std::vector<float> data(ggml_nelements(m));
+        for (int64_t iq = 0; iq < m->ne[1]; iq++) {
+            for (int64_t ikv = 0; ikv < tc.n_kv; ikv++) {
+                data[iq*tc.n_kv + ikv] = ikv < tc.n_masked ? -INFINITY : 0.0f;
+            }
+        }
+        ggml_fp32_to_fp16_row(data.data(), (ggml_fp16_t *) m->data, data.size());
+    }
+
+    ggml_tensor * out = ggml_flash_attn_ext(ctx, q, k, v, m, 1.0f/sqrtf(tc.d), 0.0f, 0.0f);
+    ggml_flash_attn_ext_set_prec(out, GGML_PREC_F32);
+
+    ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, out);
+
+    std::vector<uint8_t> work_buffer;
+
+    const std::vector<float> ref = attn_ref(q, k, v, tc.n_masked);
+
+    // a single thread computes the whole rows
+    graph_compute(work_buffer, gf, 1);
+    const double err_1 = nmse(ref, (const float *) out->data);
+
+    // with more threads than rows, the KV positions of each row are split into chunks of at least 256 positions
+    graph_compute(work_buffer, gf, 8);
+    const double err_n = nmse(ref, (const float *) out->data);
+
+    // same bound as the flash attention in test-backend-ops, the F16 V rows are accumulated in F16
+    const bool ok = err_1 < 5e-4 && err_n < 5e-4;
+
+    printf("%s: type_kv = %4s, d = %3lld, n_kv = %5lld, n_q = %lld, n_head = %lld/%lld, mask = %d, n_masked = %4lld: nmse = %.2e (1 thread), %.2e (8 threads) %s\n",
+            __func__, ggml_type_name(tc.type_kv), (long long) tc.d, (long long) tc.n_kv, (long long) tc.n_q,
+            (long long) tc.n_head, (long long) tc.n_head_kv, tc.mask, (long long) tc.n_masked, err_1, err_n, ok ? "OK" : "FAILED");
+
+    ggml_free(ctx);
+
+    return ok;
+}
+
+int main(int /*argc*/, const char ** /*argv*/) {
+    std::mt19937 rng(42);
+
+    const fa_case cases[] = {
+        // type_kv,        d,   n_kv, n_q, n_head, n_head_kv, mask, n_masked
+        { GGML_TYPE_F16,   64,   256, 1,   1,      1,         true,  0    },
+        { GGML_TYPE_F16,   64,  2048, 1,   1,      1,         true,  0    },
+        { GGML_TYPE_F16,   64,  2048, 1,   1,      1,         false, 0    },
+        { GGML_TYPE_F16,   128, 4097, 1,   4,      2,         true,  0    },
+        { GGML_TYPE_F16,   128, 4097, 2,   2,      1,         true,  1500 },
+        { GGML_TYPE_F16,   64,  8192, 3,   1,      1,         true,  7000 },
+        { GGML_TYPE_Q8_0,  128, 4096, 1,   2,      2,         true,  0    },
+        { GGML_TYPE_Q8_0,  64,  3000, 1,   1,      1,         true,  1000 },
+        // as many rows as threads, not split
+        { GGML_TYPE_F16,   64,  2048, 1,   8,      8,         true,  0    },
+    };
+
+    bool ok = true;
+    for (const auto & tc : cases) {
+        ok = test_case(tc, rng) && ok;
+    }
+
+    printf("%s: %s\n", __func__, ok ? "OK" : "FAILED");
+
+    return ok ? 0 : 1;
+}
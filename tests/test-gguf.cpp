@@ -1100,11 +1100,27 @@ static std::pair<int, int> test_roundtrip(ggml_backend_dev_t dev, const unsigned
     GGML_ASSERT(file);
 #endif // _WIN32
 
+    {
+        GGML_ASSERT(gguf_write_to_file_impl(gguf_ctx_0, file, only_meta));
+        rewind(file);
+    }
+
+    printf("%s: same_file_as_buf: ", __func__);
     {
         std::vector<int8_t> buf;
         gguf_write_to_buf(gguf_ctx_0, buf, only_meta);
-        GGML_ASSERT(fwrite(buf.data(), 1, buf.size(), file) == buf.size());
+
+        std::vector<int8_t> buf_file(buf.size() + 1);
+        const size_t n_read = fread(buf_file.data(), 1, buf_file.size(), file);
         rewind(file);
+
+        if (n_read == buf.size() && memcmp(buf.data(), buf_file.data(), buf.size()) == 0) {
+            printf("\033[1;32mOK\033[0m\n");
+            npass++;
+        } else {
+            printf("\033[1;31mFAIL\033[0m\n");
+        }
+        ntest++;
     }
 
     struct ggml_context * ctx_1 = nullptr;
@@ -9,6 +9,7 @@
 
 #include <nlohmann/json.hpp>
 
+#include <algorithm>
 #include <cassert>
 #include <string>
 #include <vector>
@@ -1295,6 +1296,79 @@ static void test_json_schema() {
     );
 }
 
+static void test_forced_str() {
+    fprintf(stderr, "⚫ Testing the text forced by a grammar:\n");
+
+    const auto check = [](const std::string & grammar_str, const std::string & prefix, size_t n_max, const std::string & expected) {
+        llama_grammar * grammar = build_grammar(grammar_str);
+        assert(grammar != nullptr);
+
+        // feed the prefix as if it was generated
+        for (const auto & cpt : unicode_cpts_from_utf8(prefix)) {
+            llama_grammar_accept(grammar, cpt);
+        }
+
+        const std::string forced = llama_grammar_forced_str(*grammar, n_max);
+        if (forced != expected) {
+            fprintf(stderr, "  ❌ grammar: %s, prefix: '%s', forced: '%s', expected: '%s'\n", grammar_str.c_str(), prefix.c_str(), forced.c_str(), expected.c_str());
+            assert(false);
+        }
+
+        llama_grammar_free_impl(grammar);
+    };
+
+    const std::string item = R"""(root ::= "{\"name\": \"" [a-z]+ "\", \"age\": " [0-9]+ "}")""";
+
+    check(item, "",           64, "{\"name\": \"");
+    check(item, "{\"name\": \"b", 64, "");
+    check(item, "{\"name\": \"bo", 64, "");
+
+    // the forced text stops at the alternatives, and when the grammar can end
+    check(R"""(root ::= "ab" ("cd" | "ce"))""",      "",   64, "abc");
+    check(R"""(root ::= "ab" | "abc")""",            "",   64, "ab");
+    check(R"""(root ::= "ab" [c] "d" [e-f])""",      "",   64, "abcd");
+    check(R"""(root ::= "ab" [c] "d" [e-f])""",      "a",   2, "bc");
+
+    // complete UTF-8 characters only
+    check(R"""(root ::= "aé" [0-9])""",               "",    2, "a");
+    check(R"""(root ::= "aé" [0-9])""",               "",    3, "aé");
+
+    // a rule referenced from several places
+    check(R"""(root ::= x "," x
+x ::= "k:" [0-9])""", "k:1", 64, ",k:");
+
+    fprintf(stderr, "  ✅︎ Passed\n");
+}
+
+static void test_clone() {
+    fprintf(stderr, "⚫ Testing the clones of a grammar:\n");
+
+    llama_grammar * grammar = build_grammar(R"""(root ::= x "," x
+x ::= "k:" [0-9])""");
+    assert(grammar != nullptr);
+
+    for (const auto & cpt : unicode_cpts_from_utf8("k:1")) {
+        llama_grammar_accept(grammar, cpt);
+    }
+
+    // the clone shares the rules, so it must outlive the grammar it was cloned from
+    llama_grammar * clone = llama_grammar_clone_impl(*grammar);
+    llama_grammar_free_impl(grammar);
+
+    assert(llama_grammar_forced_str(*clone, 64) == ",k:");
+
+    for (const auto & cpt : unicode_cpts_from_utf8(",k:2")) {
+        llama_grammar_accept(clone, cpt);
+    }
+
+    const auto & stacks = llama_grammar_get_stacks(clone);
+    assert(std::any_of(stacks.begin(), stacks.end(), [](const llama_grammar_stack & stack) { return stack.empty(); }));
+
+    llama_grammar_free_impl(clone);
+
+    fprintf(stderr, "  ✅︎ Passed\n");
+}
+
 int main() {
     fprintf(stdout, "Running grammar integration tests...\n");
     test_simple_grammar();
@@ -1305,6 +1379,8 @@ int main() {
     test_failure_missing_reference();
     test_failure_left_recursion();
     test_json_schema();
+    test_forced_str();
+    test_clone();
     fprintf(stdout, "All tests passed.\n");
     return 0;
 }
@@ -0,0 +1,129 @@
+// checks that the lazy context shift of the KV cache (LLAMA_KV_LAZY_SHIFT) gives the same logits as the shift that
+// rotates all the cells, through many context shifts of the sink-plus-window kind done by the server
+
+#include "llama.h"
+#include "get-model.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+static void set_lazy_shift(bool lazy) {
+#ifdef _WIN32
+    _putenv_s("LLAMA_KV_LAZY_SHIFT", lazy ? "1" : "0");
+#else
+    setenv("LLAMA_KV_LAZY_SHIFT", lazy ? "1" : "0", 1);
+#endif
+}
+
+// evaluates the tokens one by one with a context shift when the context is full, returns the logits of each step
+static std::vector<std::vector<float>> generate(llama_context * ctx, const std::vector<llama_token> & tokens, int n_keep) {
+    const llama_vocab * vocab = llama_model_get_vocab(llama_get_model(ctx));
+    const int n_vocab = llama_vocab_n_tokens(vocab);
+    const int n_ctx   = llama_n_ctx(ctx);
+
+    llama_memory_t mem = llama_get_memory(ctx);
+    llama_memory_clear(mem, true);
+
+    std::vector<std::vector<float>> res;
+
+    int n_past = 0;
+    for (size_t i = 0; i < tokens.size(); i++) {
+        if (n_past + 1 > n_ctx) {
+            // as the server: keep the first n_keep tokens and discard half of the others
+            const int n_discard = (n_past - n_keep)/2;
+
+            llama_memory_seq_rm (mem, 0, n_keep,             n_keep + n_discard);
+            llama_memory_seq_add(mem, 0, n_keep + n_discard, n_past, -n_discard);
+
+            n_past -= n_discard;
+        }
+
+        llama_token tok = tokens[i];
+        llama_batch batch = llama_batch_get_one(&tok, 1);
+        if (llama_decode(ctx, batch) != 0) {
+            fprintf(stderr, "%s: decode failed at step %zu\n", __func__, i);
+            return {};
+        }
+        n_past++;
+
+        const float * logits = llama_get_logits_ith(ctx, -1);
+        res.emplace_back(logits, logits + n_vocab);
+    }
+
+    return res;
+}
+
+int main(int argc, char ** argv) {
+    auto * model_path = get_model_or_exit(argc, argv);
+
+    llama_backend_init();
+
+    auto * model = llama_model_load_from_file(model_path, llama_model_default_params());
+    if (model == NULL) {
+        fprintf(stderr, "%s: failed to load the model\n", __func__);
+        return 1;
+    }
+
+    const llama_vocab * vocab = llama_model_get_vocab(model);
+    const int n_vocab = llama_vocab_n_tokens(vocab);
+
+    auto cparams = llama_context_default_params();
+    cparams.n_ctx   = 256;
+    cparams.n_batch = 64;
+
+    // with F32 K rows, the rotations of the shifts do not add F16 rounding errors
+    cparams.type_k = GGML_TYPE_F32;
+    cparams.type_v = GGML_TYPE_F32;
+
+    // the same tokens for both caches, so that the logits can be compared at each step
+    std::vector<llama_token> tokens(1200);
+    tokens[0] = llama_vocab_bos(vocab);
+    for (size_t i = 1; i < tokens.size(); i++) {
+        tokens[i] = (llama_token) ((i*7919) % n_vocab);
+    }
+
+    const int n_keep = 4;
+
+    set_lazy_shift(false);
+    auto * ctx_full = llama_init_from_model(model, cparams);
+    const auto res_full = generate(ctx_full, tokens, n_keep);
+
+    set_lazy_shift(true);
+    auto * ctx_lazy = llama_init_from_model(model, cparams);
+    const auto res_lazy = generate(ctx_lazy, tokens, n_keep);
+
+    bool ok = res_full.size() == tokens.size() && res_lazy.size() == tokens.size();
+
+    // the K rows are rotated by other angles in the two caches, so the logits differ by F32 rounding errors
+    double max_diff = 0.0;
+    for (size_t i = 0; ok && i < res_full.size(); i++) {
+        float max_abs = 0.0f;
+        for (int j = 0; j < n_vocab; j++) {
+            max_abs = std::max(max_abs, std::fabs(res_full[i][j]));
+        }
+
+        for (int j = 0; j < n_vocab; j++) {
+            const double diff = std::fabs(res_full[i][j] - res_lazy[i][j])/std::max(max_abs, 1e-6f);
+            if (!(diff < 1e-4)) {
+                fprintf(stderr, "%s: step %zu: logit %d differs: %f (full) != %f (lazy)\n", __func__, i, j, res_full[i][j], res_lazy[i][j]);
+                ok = false;
+                break;
+            }
+            max_diff = std::max(max_diff, diff);
+        }
+    }
+
+    fprintf(stderr, "%s: %zu steps, max relative diff = %g\n", __func__, res_full.size(), max_diff);
+
+    llama_free(ctx_lazy);
+    llama_free(ctx_full);
+    llama_model_free(model);
+    llama_backend_free();
+
+    fprintf(stderr, "%s: %s\n", __func__, ok ? "OK" : "FAILED");
+
+    return ok ? 0 : 1;
+}
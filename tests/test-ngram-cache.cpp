@@ -0,0 +1,90 @@
+#include "ngram-cache.h"
+
+#undef NDEBUG
+#include <cassert>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+static void check_same(common_ngram_cache & nc, const common_ngram_cache_sorted & ncs) {
+    assert(nc.size() == ncs.n_ngrams());
+
+    for (auto & item : nc) {
+        common_ngram_cache_part part;
+        assert(ncs.find(item.first, part));
+        assert(part == item.second);
+    }
+}
+
+int main() {
+    std::vector<llama_token> inp;
+    for (int i = 0; i < 1000; ++i) {
+        inp.push_back((i*7 + i/13) % 37);
+    }
+
+    common_ngram_cache nc_a;
+    common_ngram_cache nc_b;
+    common_ngram_cache_update(nc_a, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, inp, 600, false);
+
+    std::vector<llama_token> inp_b(inp.begin() + 400, inp.end());
+    common_ngram_cache_update(nc_b, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, inp_b, inp_b.size(), false);
+
+    // sorted cache from a single cache
+    common_ngram_cache_sorted ncs_a = common_ngram_cache_sorted_merge(nullptr, nc_a);
+    check_same(nc_a, ncs_a);
+
+    // unknown n-gram
+    {
+        const llama_token tokens[2] = { 100, 101 };
+        common_ngram_cache_part part;
+        assert(!ncs_a.find(common_ngram(tokens, 2), part));
+        assert(part.empty());
+    }
+
+    // merging sorted + unsorted is the same as merging the unsorted caches
+    common_ngram_cache_sorted ncs_ab = common_ngram_cache_sorted_merge(&ncs_a, nc_b);
+    common_ngram_cache nc_ab = nc_a;
+    common_ngram_cache_merge(nc_ab, nc_b);
+    check_same(nc_ab, ncs_ab);
+
+    // round trip through a file
+    std::string fname = "test-ngram-cache.bin";
+    assert(common_ngram_cache_sorted_save(ncs_ab, fname));
+    {
+        common_ngram_cache_sorted ncs_loaded = common_ngram_cache_sorted_load(fname);
+        check_same(nc_ab, ncs_loaded);
+
+        common_ngram_cache nc_loaded = common_ngram_cache_load(fname);
+        check_same(nc_loaded, ncs_loaded);
+    }
+
+    // files in the unsorted format are converted
+    common_ngram_cache_save(nc_ab, fname);
+    {
+        common_ngram_cache_sorted ncs_loaded = common_ngram_cache_sorted_load(fname);
+        check_same(nc_ab, ncs_loaded);
+    }
+    std::remove(fname.c_str());
+
+    // drafting from the sorted cache matches drafting from the unsorted one
+    {
+        common_ngram_cache nc_empty;
+        common_ngram_cache_sorted ncs_empty;
+
+        std::vector<llama_token> draft_0 = { inp.back() };
+        std::vector<llama_token> draft_1 = { inp.back() };
+
+        common_ngram_cache_draft(inp, draft_0, 8, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, nc_empty, nc_ab, nc_empty);
+        common_ngram_cache_draft(inp, draft_1, 8, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX,
+            [&](const common_ngram & ngram, common_ngram_cache_part & part) { return ncs_empty.find(ngram, part); },
+            [&](const common_ngram & ngram, common_ngram_cache_part & part) { return ncs_ab.find(ngram, part); },
+            [&](const common_ngram & ngram, common_ngram_cache_part & part) { return ncs_empty.find(ngram, part); });
+
+        assert(draft_0.size() > 1);
+        assert(draft_0 == draft_1);
+    }
+
+    printf("OK\n");
+
+    return 0;
+}
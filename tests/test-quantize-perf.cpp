@@ -1,16 +1,20 @@
-// Benchmark quantization specific functions on synthetic data
+// Benchmark quantization specific functions and the CPU matrix multiplication kernels on synthetic data
 
 #include "ggml.h"
+#include "ggml-alloc.h"
+#include "ggml-backend.h"
 #include "ggml-cpu.h"
 
 #undef NDEBUG
 #include <algorithm>
 #include <assert.h>
+#include <cinttypes>
 #include <functional>
 #include <math.h>
 #include <memory>
 #include <stdio.h>
 #include <string>
+#include <thread>
 #include <vector>
 
 #if defined(_MSC_VER)
@@ -28,6 +32,41 @@
 #define L3_SIZE    32*20480
 #define MEM_SIZE 32*2048000
 
+// size of the copy used to measure the memory bandwidth for mul_mat (2 x 256 MB)
+#define MEM_BW_SIZE 64*1024*1024
+
+// weight matrix of a model: M output features, K input features
+struct mul_mat_shape {
+    std::string name;
+    int64_t m;
+    int64_t k;
+};
+
+// the distinct matrices of a layer of some common models
+static const std::vector<std::pair<std::string, std::vector<mul_mat_shape>>> model_shapes = {
+    { "llama-7b", {
+        { "attn_qkvo",  4096,  4096 },
+        { "ffn_up",    11008,  4096 },
+        { "ffn_down",   4096, 11008 },
+    }},
+    { "llama3-8b", {
+        { "attn_qo",    4096,  4096 },
+        { "attn_kv",    1024,  4096 },
+        { "ffn_up",    14336,  4096 },
+        { "ffn_down",   4096, 14336 },
+    }},
+    { "qwen2.5-0.5b", {
+        { "attn_qo",     896,   896 },
+        { "attn_kv",     128,   896 },
+        { "ffn_up",     4864,   896 },
+        { "ffn_down",    896,  4864 },
+    }},
+    { "mixtral-expert", {
+        { "ffn_up",    14336,  4096 },
+        { "ffn_down",   4096, 14336 },
+    }},
+};
+
 struct quantize_perf_params {
     std::vector<std::string> include_types;
     std::vector<size_t> test_sizes;
@@ -37,7 +76,25 @@ struct quantize_perf_params {
     bool op_dequantize_row_q = false;
     bool op_quantize_row_q_dot = false;
     bool op_vec_dot_q = false;
+    bool op_mul_mat = false;
     int64_t iterations = ITERATIONS;
+
+    // mul_mat
+    std::vector<mul_mat_shape> shapes;
+    std::vector<int64_t> n_batch;
+    std::vector<int> n_threads;
+    std::vector<std::string> include_bufts;
+    float mem_bw = 0.0f; // GB/s, 0 = measure
+
+    bool json = false;
+};
+
+// result of the timing of a function
+struct benchmark_result {
+    float min_cycles; // per QK values
+    float avg_cycles; // per QK values
+    float f32_gbps;
+    float q_gbps;
 };
 
 #if defined(__x86_64__) || defined(__i386__)
@@ -76,7 +133,7 @@ static void * align_with_offset(void * ptr, int offset) {
     return (char *) std::align(MAX_ALIGNMENT, MAX_ALIGNMENT, ptr, dummy_size) + offset;
 }
 
-static void benchmark_function(size_t size, size_t q_size, int64_t iterations, const std::function<float(void)> & func) {
+static benchmark_result benchmark_function(size_t size, size_t q_size, int64_t iterations, const std::function<float(void)> & func) {
     int64_t min_time_us = INT64_MAX;
     int64_t total_time_us = 0;
     int64_t min_time_cycles = INT64_MAX;
@@ -101,10 +158,210 @@ static void benchmark_function(size_t size, size_t q_size, int64_t iterations, c
         min_time_us = std::min(min_time_us, end_time - start_time);
     }
 
-    printf("      min cycles/%d vals   : %9.2f\n",  QK, QK * min_time_cycles / (float) size);
-    printf("      avg cycles/%d vals   : %9.2f\n",  QK, QK * total_time_cycles / (float) (size * iterations));
-    printf("      float32 throughput   : %9.2f GB/s\n",  gigabytes_per_second(4 * size * iterations, total_time_us));
-    printf("      quantized throughput : %9.2f GB/s\n",  gigabytes_per_second(q_size * iterations, total_time_us));
+    benchmark_result res;
+    res.min_cycles = QK * min_time_cycles / (float) size;
+    res.avg_cycles = QK * total_time_cycles / (float) (size * iterations);
+    res.f32_gbps   = gigabytes_per_second(4 * size * iterations, total_time_us);
+    res.q_gbps     = gigabytes_per_second(q_size * iterations, total_time_us);
+
+    return res;
+}
+
+static void print_result(const quantize_perf_params & params, ggml_type type, const char * op, size_t size, const benchmark_result & res) {
+    if (params.json) {
+        printf("{\"type\": \"%s\", \"op\": \"%s\", \"size\": %zu, \"min_cycles\": %f, \"avg_cycles\": %f, \"f32_gbps\": %f, \"q_gbps\": %f}\n",
+                ggml_type_name(type), op, size, res.min_cycles, res.avg_cycles, res.f32_gbps, res.q_gbps);
+        return;
+    }
+
+    printf("    %zu values (%.2f MB)\n", size, 4*size/(float)(1024*1024));
+    printf("      min cycles/%d vals   : %9.2f\n",  QK, res.min_cycles);
+    printf("      avg cycles/%d vals   : %9.2f\n",  QK, res.avg_cycles);
+    printf("      float32 throughput   : %9.2f GB/s\n",  res.f32_gbps);
+    printf("      quantized throughput : %9.2f GB/s\n",  res.q_gbps);
+}
+
+// the types with a CPU dot product that can be quantized from F32
+static bool type_supported(ggml_type type) {
+    const auto * qfns     = ggml_get_type_traits(type);
+    const auto * qfns_cpu = ggml_get_type_traits_cpu(type);
+
+    if (ggml_type_name(type) == NULL || qfns_cpu->vec_dot == NULL) {
+        return false;
+    }
+
+    return type == GGML_TYPE_F32 || qfns->to_float != NULL;
+}
+
+// by default, the types without a CPU from_float are skipped - their quantization tables take seconds to initialize
+static bool type_selected(const quantize_perf_params & params, ggml_type type) {
+    if (params.include_types.empty()) {
+        return ggml_get_type_traits_cpu(type)->from_float != NULL;
+    }
+
+    if (std::find(params.include_types.begin(), params.include_types.end(), "all") != params.include_types.end()) {
+        return true;
+    }
+
+    return ggml_type_name(type) && std::find(params.include_types.begin(), params.include_types.end(), ggml_type_name(type)) != params.include_types.end();
+}
+
+// quantize nrows rows of n_per_row values - the types without a CPU from_float (IQ2, IQ3, IQ1) go through
+// ggml_quantize_chunk with a uniform importance matrix
+static void quantize_data(ggml_type type, const float * src, void * dst, int64_t nrows, int64_t n_per_row) {
+    const auto * qfns_cpu = ggml_get_type_traits_cpu(type);
+
+    if (qfns_cpu->from_float) {
+        const size_t row_size = ggml_row_size(type, n_per_row);
+        for (int64_t i = 0; i < nrows; i++) {
+            qfns_cpu->from_float(src + i*n_per_row, (char *) dst + i*row_size, n_per_row);
+        }
+        return;
+    }
+
+    std::vector<float> imatrix(n_per_row, 1.0f);
+    ggml_quantize_chunk(type, src, dst, 0, nrows, n_per_row, imatrix.data());
+}
+
+// measure the memory bandwidth of the CPU backend with a large copy, GB/s
+static float measure_mem_bw(ggml_backend_t backend, int n_threads) {
+    struct ggml_init_params ggml_params = {
+        /* .mem_size   = */ 4*ggml_tensor_overhead() + ggml_graph_overhead(),
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ true,
+    };
+    struct ggml_context * ctx = ggml_init(ggml_params);
+
+    ggml_tensor * a = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, MEM_BW_SIZE);
+    ggml_tensor * b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, MEM_BW_SIZE);
+    ggml_tensor * c = ggml_cpy(ctx, a, b);
+
+    ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, c);
+
+    ggml_backend_buffer_t buf = ggml_backend_alloc_ctx_tensors(ctx, backend);
+    ggml_backend_buffer_clear(buf, 0);
+
+    ggml_backend_cpu_set_n_threads(backend, n_threads);
+
+    int64_t min_time_us = INT64_MAX;
+    for (int i = 0; i < WARMUP; i++) {
+        const int64_t start_time = ggml_time_us();
+        ggml_backend_graph_compute(backend, gf);
+        min_time_us = std::min(min_time_us, ggml_time_us() - start_time);
+    }
+
+    ggml_backend_buffer_free(buf);
+    ggml_free(ctx);
+
+    return gigabytes_per_second(2*ggml_nbytes(a), min_time_us);
+}
+
+// time y = W*x with W of shape [K, M] in a buffer of type buft and x of shape [K, N]
+// returns false if the buffer type does not support the type or the shape of W
+static bool benchmark_mul_mat(const quantize_perf_params & params, ggml_backend_t backend, ggml_backend_dev_t dev, ggml_backend_buffer_type_t buft,
+        ggml_type type, const mul_mat_shape & shape, const std::vector<float> & data, const std::vector<uint8_t> & wdata, float mem_bw) {
+    struct ggml_init_params ggml_params = {
+        /* .mem_size   = */ 4*ggml_tensor_overhead() + ggml_graph_overhead(),
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ true,
+    };
+
+    struct ggml_context * ctx_w = ggml_init(ggml_params);
+    ggml_tensor * w = ggml_new_tensor_2d(ctx_w, type, shape.k, shape.m);
+    ggml_backend_buffer_t buf_w = ggml_backend_alloc_ctx_tensors_from_buft(ctx_w, buft);
+    if (!buf_w) {
+        ggml_free(ctx_w);
+        return false;
+    }
+    ggml_backend_buffer_set_usage(buf_w, GGML_BACKEND_BUFFER_USAGE_WEIGHTS);
+
+    bool supported = false;
+
+    for (int64_t n : params.n_batch) {
+        struct ggml_context * ctx = ggml_init(ggml_params);
+
+        ggml_tensor * x = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, shape.k, n);
+        ggml_tensor * y = ggml_mul_mat(ctx, w, x);
+
+        ggml_cgraph * gf = ggml_new_graph(ctx);
+        ggml_build_forward_expand(gf, y);
+
+        ggml_backend_buffer_t buf = ggml_backend_alloc_ctx_tensors(ctx, backend);
+
+        // the extra buffer types only take the data of the weights they can repack
+        if (!ggml_backend_dev_supports_op(dev, y)) {
+            ggml_backend_buffer_free(buf);
+            ggml_free(ctx);
+            break;
+        }
+
+        if (!supported) {
+            ggml_backend_tensor_set(w, wdata.data(), 0, ggml_nbytes(w));
+            supported = true;
+        }
+
+        for (int64_t i = 0; i < n; i++) {
+            ggml_backend_tensor_set(x, data.data() + (i % shape.m)*shape.k, i*x->nb[1], x->nb[1]);
+        }
+
+        for (int n_threads : params.n_threads) {
+            ggml_backend_cpu_set_n_threads(backend, n_threads);
+
+            for (int i = 0; i < WARMUP; i++) {
+                ggml_backend_graph_compute(backend, gf);
+            }
+
+            int64_t min_time_us = INT64_MAX;
+            int64_t total_time_us = 0;
+
+            for (int i = 0; i < params.iterations; i++) {
+                const int64_t start_time = ggml_time_us();
+                ggml_backend_graph_compute(backend, gf);
+                const int64_t time_us = ggml_time_us() - start_time;
+
+                total_time_us += time_us;
+                min_time_us = std::min(min_time_us, time_us);
+            }
+
+            const float  avg_time_us = total_time_us / (float) std::max<int64_t>(1, params.iterations);
+            const size_t bytes       = ggml_nbytes(w) + ggml_nbytes(x) + ggml_nbytes(y);
+            const float  gbps        = gigabytes_per_second(bytes, std::max<int64_t>(1, (int64_t) avg_time_us));
+            const float  gops        = 2.0f*shape.m*shape.k*n / avg_time_us / 1000.0f;
+            const float  bw_frac     = mem_bw > 0.0f ? gbps / mem_bw : 0.0f;
+
+            if (params.json) {
+                printf("{\"type\": \"%s\", \"op\": \"mul_mat\", \"buft\": \"%s\", \"shape\": \"%s\", \"m\": %" PRId64 ", \"k\": %" PRId64 ", \"n\": %" PRId64 ", "
+                       "\"n_threads\": %d, \"min_us\": %" PRId64 ", \"avg_us\": %f, \"gbps\": %f, \"gops\": %f, \"mem_bw\": %f, \"bw_frac\": %f}\n",
+                        ggml_type_name(type), ggml_backend_buft_name(buft), shape.name.c_str(), shape.m, shape.k, n,
+                        n_threads, min_time_us, avg_time_us, gbps, gops, mem_bw, bw_frac);
+            } else {
+                printf("    %s %" PRId64 " x %" PRId64 " x %" PRId64 ", %d threads\n", shape.name.c_str(), shape.m, shape.k, n, n_threads);
+                printf("      avg time             : %9.2f ms\n", avg_time_us/1000.0f);
+                printf("      throughput           : %9.2f GB/s (%.0f%% of memory bandwidth)\n", gbps, 100.0f*bw_frac);
+                printf("      compute              : %9.2f GOP/s\n", gops);
+            }
+        }
+
+        ggml_backend_buffer_free(buf);
+        ggml_free(ctx);
+    }
+
+    ggml_backend_buffer_free(buf_w);
+    ggml_free(ctx_w);
+
+    return supported;
+}
+
+static std::vector<std::string> split_list(const std::string & str) {
+    std::vector<std::string> res;
+    size_t pos = 0;
+    while (pos <= str.size()) {
+        const size_t end = std::min(str.find(',', pos), str.size());
+        res.push_back(str.substr(pos, end - pos));
+        pos = end + 1;
+    }
+    return res;
 }
 
 static void usage(char * argv[]) {
@@ -118,23 +375,34 @@ static void usage(char * argv[]) {
     printf("  -3                    use size as L1, L2, L3 sizes (L1:%d L2:%d L3:%d)\n", L1_SIZE, L2_SIZE, L3_SIZE);
     printf("  -4                    use size as L1, L2, L3, MEM sizes (L1:%d L2:%d L3:%d MEM:%d)\n", L1_SIZE, L2_SIZE, L3_SIZE, MEM_SIZE);
     printf("  --op OP               set test operation as quantize_row_q_reference, quantize_row_q, dequantize_row_q,\n");
-    printf("                        quantize_row_q_dot, vec_dot_q (all)\n");
+    printf("                        quantize_row_q_dot, vec_dot_q, mul_mat (all but mul_mat)\n");
     printf("  --type TYPE           set test type as");
     for (int i = 0; i < GGML_TYPE_COUNT; i++) {
         ggml_type type = (ggml_type) i;
-        const auto * qfns     = ggml_get_type_traits(type);
-        const auto * qfns_cpu = ggml_get_type_traits_cpu(type);
-        if (ggml_type_name(type) != NULL) {
-            if (qfns_cpu->from_float && qfns->to_float) {
-                printf(" %s", ggml_type_name(type));
-            }
+        if (type_supported(type)) {
+            printf(" %s", ggml_type_name(type));
         }
     }
-    printf(" (all)\n");
+    printf("\n");
+    printf("                        or all (the types with a CPU quantization function)\n");
     printf("  --alignment-offset OFFSET\n");
     printf("                        set alignment offset as OFFSET (0)\n");
     printf("  -i NUM, --iterations NUM\n");
     printf("                        set test iteration number (%d)\n", ITERATIONS);
+    printf("  --json                output one JSON object per result\n");
+    printf("\n");
+    printf("mul_mat options:\n");
+    printf("  --model NAME          use the weight shapes of a model layer:");
+    for (const auto & it : model_shapes) {
+        printf(" %s", it.first.c_str());
+    }
+    printf(" (%s)\n", model_shapes[0].first.c_str());
+    printf("  --shape MxK           add a weight shape of M rows of K values\n");
+    printf("  -n N1,N2,...          set the number of columns of the activations (1,16,128,512)\n");
+    printf("  -t T1,T2,...          set the numbers of threads (1,%u)\n", std::thread::hardware_concurrency());
+    printf("  --buft NAME           set the buffer type of the weights as CPU or one of the extra buffer types\n");
+    printf("                        of the CPU backend, e.g. CPU_REPACK, AMX (all)\n");
+    printf("  --mem-bw GB/s         set the memory bandwidth instead of measuring it\n");
 }
 
 int main(int argc, char * argv[]) {
@@ -186,6 +454,8 @@ int main(int argc, char * argv[]) {
                 params.op_quantize_row_q_dot = true;
             } else if (op == "vec_dot_q") {
                 params.op_vec_dot_q = true;
+            } else if (op == "mul_mat") {
+                params.op_mul_mat = true;
             } else {
                 invalid_param = true;
                 break;
@@ -220,6 +490,61 @@ int main(int argc, char * argv[]) {
                 break;
             }
             params.iterations = number;
+        } else if (arg == "--json") {
+            params.json = true;
+        } else if (arg == "--model") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            auto it = std::find_if(model_shapes.begin(), model_shapes.end(), [&](const auto & m) { return m.first == argv[i]; });
+            if (it == model_shapes.end()) {
+                fprintf(stderr, "error: unknown model: %s\n", argv[i]);
+                invalid_param = true;
+                break;
+            }
+            params.shapes.insert(params.shapes.end(), it->second.begin(), it->second.end());
+        } else if (arg == "--shape") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            int64_t m = 0;
+            int64_t k = 0;
+            if (sscanf(argv[i], "%" SCNd64 "x%" SCNd64, &m, &k) != 2 || m <= 0 || k <= 0 || k % 256 != 0) {
+                fprintf(stderr, "error: shape must be MxK with K divisible by 256\n");
+                invalid_param = true;
+                break;
+            }
+            params.shapes.push_back({ argv[i], m, k });
+        } else if (arg == "-n") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            for (const auto & n : split_list(argv[i])) {
+                params.n_batch.push_back(std::stoll(n));
+            }
+        } else if (arg == "-t") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            for (const auto & t : split_list(argv[i])) {
+                params.n_threads.push_back(std::stoi(t));
+            }
+        } else if (arg == "--buft") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.include_bufts.push_back(argv[i]);
+        } else if (arg == "--mem-bw") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.mem_bw = std::stof(argv[i]);
         } else if ((arg == "-h") || (arg == "--help")) {
             usage(argv);
             return 1;
@@ -236,9 +561,21 @@ int main(int argc, char * argv[]) {
     if (params.test_sizes.empty()) {
         params.test_sizes.push_back(L1_SIZE);
     }
-    if (!(params.op_quantize_row_q_reference || params.op_quantize_row_q || params.op_dequantize_row_q || params.op_quantize_row_q_dot || params.op_vec_dot_q)) {
+    if (!(params.op_quantize_row_q_reference || params.op_quantize_row_q || params.op_dequantize_row_q || params.op_quantize_row_q_dot || params.op_vec_dot_q || params.op_mul_mat)) {
         params.op_quantize_row_q_reference = params.op_quantize_row_q = params.op_dequantize_row_q = params.op_quantize_row_q_dot = params.op_vec_dot_q = true;
     }
+    if (params.shapes.empty()) {
+        params.shapes = model_shapes[0].second;
+    }
+    if (params.n_batch.empty()) {
+        params.n_batch = { 1, 16, 128, 512 };
+    }
+    if (params.n_threads.empty()) {
+        params.n_threads.push_back(1);
+        if (std::thread::hardware_concurrency() > 1) {
+            params.n_threads.push_back(std::thread::hardware_concurrency());
+        }
+    }
 
     std::sort(params.test_sizes.begin(), params.test_sizes.end());
     size_t largest = params.test_sizes.back();
@@ -269,96 +606,192 @@ int main(int argc, char * argv[]) {
     };
     struct ggml_context * ctx = ggml_init(ggml_params);
 
-    for (int i = 0; i < GGML_TYPE_COUNT; i++) {
+    const bool op_rows = params.op_quantize_row_q_reference || params.op_quantize_row_q || params.op_dequantize_row_q || params.op_quantize_row_q_dot || params.op_vec_dot_q;
+
+    for (int i = 0; op_rows && i < GGML_TYPE_COUNT; i++) {
         ggml_type type = (ggml_type) i;
         const auto * qfns = ggml_get_type_traits(type);
         const auto * qfns_cpu = ggml_get_type_traits_cpu(type);
-        if (!params.include_types.empty() && ggml_type_name(type) && std::find(params.include_types.begin(), params.include_types.end(), ggml_type_name(type)) == params.include_types.end()) {
+        if (!type_selected(params, type)) {
             continue;
         }
 
-        if (qfns_cpu->from_float && qfns->to_float) {
-            printf("%s\n", ggml_type_name(type));
+        if (type_supported(type) && largest % ggml_blck_size(type) == 0) {
+            if (!params.json) {
+                printf("%s\n", ggml_type_name(type));
+            }
 
             ggml_quantize_init(type);
 
-            if (params.op_quantize_row_q_reference) {
-                printf("  quantize_row_q_reference\n");
+            if (params.op_quantize_row_q_reference && qfns->from_float_ref) {
+                if (!params.json) {
+                    printf("  quantize_row_q_reference\n");
+                }
                 for (size_t size : params.test_sizes) {
-                    printf("    %zu values (%.2f MB)\n", size, 4*size/(float)(1024*1024));
                     auto quantize_fn = [&](void) -> float {
                         qfns->from_float_ref(test_data1, test_q1, size);
                         return test_q1[0];
                     };
                     size_t quantized_size = ggml_row_size(type, size);
-                    benchmark_function(size, quantized_size, iterations, quantize_fn);
+                    print_result(params, type, "quantize_row_q_reference", size, benchmark_function(size, quantized_size, iterations, quantize_fn));
+                }
+                if (!params.json) {
+                    printf("\n");
                 }
-                printf("\n");
             }
 
-            if (params.op_quantize_row_q) {
-                printf("  quantize_row_q\n");
+            if (params.op_quantize_row_q && qfns_cpu->from_float) {
+                if (!params.json) {
+                    printf("  quantize_row_q\n");
+                }
                 for (size_t size : params.test_sizes) {
-                    printf("    %zu values (%.2f MB)\n", size, 4*size/(float)(1024*1024));
                     auto quantize_fn = [&](void) -> float {
                         qfns_cpu->from_float(test_data1, test_q1, size);
                         return test_q1[0];
                     };
                     size_t quantized_size = ggml_row_size(type, size);
-                    benchmark_function(size, quantized_size, iterations, quantize_fn);
+                    print_result(params, type, "quantize_row_q", size, benchmark_function(size, quantized_size, iterations, quantize_fn));
+                }
+                if (!params.json) {
+                    printf("\n");
                 }
-                printf("\n");
             }
 
-            if (params.op_dequantize_row_q) {
-                printf("  dequantize_row_q\n");
-                qfns_cpu->from_float(test_data1, test_q1, largest);
+            if (params.op_dequantize_row_q && qfns->to_float) {
+                if (!params.json) {
+                    printf("  dequantize_row_q\n");
+                }
+                quantize_data(type, test_data1, test_q1, 1, largest);
                 for (size_t size : params.test_sizes) {
-                    printf("    %zu values (%.2f MB)\n", size, 4*size/(float)(1024*1024));
                     auto quantize_fn = [&](void) -> float {
                         qfns->to_float(test_q1, test_out, size);
                         return test_out[0];
                     };
                     size_t quantized_size = ggml_row_size(type, size);
-                    benchmark_function(size, quantized_size, iterations, quantize_fn);
+                    print_result(params, type, "dequantize_row_q", size, benchmark_function(size, quantized_size, iterations, quantize_fn));
+                }
+                if (!params.json) {
+                    printf("\n");
                 }
-                printf("\n");
             }
 
-            if (params.op_quantize_row_q_dot) {
-                printf("  quantize_row_q_dot\n");
+            const auto * vdot = ggml_get_type_traits_cpu(qfns_cpu->vec_dot_type);
+
+            if (params.op_quantize_row_q_dot && vdot->from_float) {
+                if (!params.json) {
+                    printf("  quantize_row_q_dot\n");
+                }
                 for (size_t size : params.test_sizes) {
-                    printf("    %zu values (%.2f MB)\n", size, 4*size/(float)(1024*1024));
                     auto quantize_fn = [&](void) -> float {
-                        const auto * vdot = ggml_get_type_traits_cpu(qfns_cpu->vec_dot_type);
                         vdot->from_float(test_data1, test_q1, size);
                         return test_q1[0];
                     };
                     size_t quantized_size = ggml_row_size(type, size);
-                    benchmark_function(size, quantized_size, iterations, quantize_fn);
+                    print_result(params, type, "quantize_row_q_dot", size, benchmark_function(size, quantized_size, iterations, quantize_fn));
+                }
+                if (!params.json) {
+                    printf("\n");
                 }
-                printf("\n");
             }
 
             if (params.op_vec_dot_q) {
-                printf("  vec_dot_q\n");
-                qfns_cpu->from_float(test_data1, test_q1, largest);
-                qfns_cpu->from_float(test_data2, test_q2, largest);
+                if (!params.json) {
+                    printf("  vec_dot_q\n");
+                }
+                quantize_data(type, test_data1, test_q1, 1, largest);
+                quantize_data(qfns_cpu->vec_dot_type, test_data2, test_q2, 1, largest);
                 for (size_t size : params.test_sizes) {
-                    printf("    %zu values (%.2f MB)\n", size, 4*size/(float)(1024*1024));
                     auto quantize_fn = [&](void) -> float {
                         float result;
                         qfns_cpu->vec_dot(size, &result, 0, test_q1, 0, test_q2, 0, 1);
                         return result;
                     };
                     size_t quantized_size = ggml_row_size(type, size);
-                    benchmark_function(size, quantized_size, iterations, quantize_fn);
+                    print_result(params, type, "vec_dot_q", size, benchmark_function(size, quantized_size, iterations, quantize_fn));
+                }
+                if (!params.json) {
+                    printf("\n");
                 }
-                printf("\n");
             }
         }
     }
 
+    if (params.op_mul_mat) {
+        ggml_backend_t backend = ggml_backend_cpu_init();
+        ggml_backend_dev_t dev = ggml_backend_get_device(backend);
+
+        // the CPU buffer type and the extra buffer types of the CPU backend (repack, AMX, KleidiAI)
+        std::vector<ggml_backend_buffer_type_t> bufts = { ggml_backend_dev_buffer_type(dev) };
+
+        ggml_backend_reg_t reg = ggml_backend_dev_backend_reg(dev);
+        auto get_extra_bufts_fn = (ggml_backend_dev_get_extra_bufts_t) ggml_backend_reg_get_proc_address(reg, "ggml_backend_dev_get_extra_bufts");
+        if (get_extra_bufts_fn) {
+            for (ggml_backend_buffer_type_t * extra = get_extra_bufts_fn(dev); extra && *extra; ++extra) {
+                bufts.push_back(*extra);
+            }
+        }
+
+        const int max_threads = *std::max_element(params.n_threads.begin(), params.n_threads.end());
+
+        float mem_bw = params.mem_bw;
+        if (mem_bw <= 0.0f) {
+            mem_bw = measure_mem_bw(backend, max_threads);
+        }
+
+        if (params.json) {
+            printf("{\"op\": \"mem_bw\", \"n_threads\": %d, \"gbps\": %f, \"measured\": %s}\n", max_threads, mem_bw, params.mem_bw > 0.0f ? "false" : "true");
+        } else {
+            printf("memory bandwidth: %.2f GB/s (%s, %d threads)\n\n", mem_bw, params.mem_bw > 0.0f ? "set" : "measured", max_threads);
+        }
+
+        int64_t max_elements = 0;
+        for (const auto & shape : params.shapes) {
+            max_elements = std::max(max_elements, shape.m*shape.k);
+        }
+
+        std::vector<float> data(max_elements);
+        generate_data(0, max_elements, data.data());
+
+        for (int i = 0; i < GGML_TYPE_COUNT; i++) {
+            ggml_type type = (ggml_type) i;
+            if (!type_selected(params, type) || !type_supported(type)) {
+                continue;
+            }
+
+            ggml_quantize_init(type);
+
+            for (const auto & shape : params.shapes) {
+                if (shape.k % ggml_blck_size(type) != 0) {
+                    continue;
+                }
+
+                std::vector<uint8_t> wdata(ggml_row_size(type, shape.k)*shape.m);
+                quantize_data(type, data.data(), wdata.data(), shape.m, shape.k);
+
+                for (auto * buft : bufts) {
+                    const char * buft_name = ggml_backend_buft_name(buft);
+                    if (!params.include_bufts.empty() && std::find(params.include_bufts.begin(), params.include_bufts.end(), buft_name) == params.include_bufts.end()) {
+                        continue;
+                    }
+
+                    if (!params.json) {
+                        printf("%s\n  mul_mat (%s)\n", ggml_type_name(type), buft_name);
+                    }
+
+                    if (!benchmark_mul_mat(params, backend, dev, buft, type, shape, data, wdata, mem_bw) && !params.json) {
+                        printf("    %s: not supported\n", shape.name.c_str());
+                    }
+
+                    if (!params.json) {
+                        printf("\n");
+                    }
+                }
+            }
+        }
+
+        ggml_backend_free(backend);
+    }
+
     ggml_free(ctx);
 
     return 0;
@@ -281,8 +281,18 @@ static void test_regex_to_reversed_partial_regex() {
         regex_to_reversed_partial_regex("ab{2,4}c"));
 }
 
+static void test_regex_position_independent() {
+    printf("[%s]\n", __func__);
+
+    assert_equals(true,  common_regex("abc").is_position_independent());
+    assert_equals(true,  common_regex("([^\n]+)\n```json\n").is_position_independent());
+    assert_equals(true,  common_regex("[\\b]").is_position_independent());
+    assert_equals(false, common_regex("\\babc").is_position_independent());
+}
+
 int main() {
     test_regex_to_reversed_partial_regex();
     test_regex();
+    test_regex_position_independent();
     std::cout << "All tests passed.\n";
 }
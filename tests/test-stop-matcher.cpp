@@ -0,0 +1,126 @@
+#include "common.h"
+
+#undef NDEBUG
+#include <cassert>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+// the stop found by searching each stop string in the whole text
+static size_t find_first_stop(const std::string & text, const std::vector<std::string> & stops, size_t & i_stop) {
+    size_t pos = std::string::npos;
+    for (size_t i = 0; i < stops.size(); ++i) {
+        const size_t p = text.find(stops[i]);
+        if (p != std::string::npos && (pos == std::string::npos || p < pos)) {
+            pos    = p;
+            i_stop = i;
+        }
+    }
+    return pos;
+}
+
+static size_t find_partial_stop(const std::string & text, const std::vector<std::string> & stops) {
+    size_t pos = std::string::npos;
+    for (const auto & stop : stops) {
+        const size_t p = string_find_partial_stop(text, stop);
+        if (p != std::string::npos && (pos == std::string::npos || p < pos)) {
+            pos = p;
+        }
+    }
+    return pos;
+}
+
+static void test_basic() {
+    common_stop_matcher matcher({ "</s>", "User:", "Us", "\n\n" });
+
+    assert(matcher.feed("Hello") == std::string::npos);
+    assert(matcher.partial_len() == 0);
+
+    assert(matcher.feed(" <") == std::string::npos);
+    assert(matcher.partial_len() == 1);
+    assert(matcher.partial_len(0) == 0);
+
+    assert(matcher.feed("/") == std::string::npos);
+    assert(matcher.partial_len() == 2);
+
+    size_t i_stop = 0;
+    assert(matcher.feed("s> U", &i_stop) == 6);
+    assert(i_stop == 0);
+    assert(matcher.n_fed() == 12);
+
+    // the first of the stop strings that start at the same position
+    assert(matcher.feed("ser:", &i_stop) == 11);
+    assert(i_stop == 1);
+
+    matcher.reset();
+    assert(matcher.n_fed() == 0);
+    assert(matcher.feed("a\n\nb", &i_stop) == 1);
+    assert(i_stop == 3);
+
+    common_stop_matcher none;
+    assert(none.empty());
+    assert(none.feed("abc") == std::string::npos);
+    assert(none.partial_len() == 0);
+}
+
+static void test_random() {
+    std::mt19937 rng(1234);
+
+    const std::string alphabet = "ab c\n\xc3\xa9";
+
+    const auto random_string = [&](size_t n_max) {
+        std::string s;
+        const size_t n = 1 + rng() % n_max;
+        for (size_t i = 0; i < n; ++i) {
+            s += alphabet[rng() % alphabet.size()];
+        }
+        return s;
+    };
+
+    for (int it = 0; it < 2000; ++it) {
+        std::vector<std::string> stops;
+        const int n_stops = 1 + rng() % 8;
+        for (int i = 0; i < n_stops; ++i) {
+            stops.push_back(random_string(5));
+        }
+
+        common_stop_matcher matcher(stops);
+
+        // the text is fed in pieces, as the tokens are generated
+        std::string text;
+        while (text.size() < 64) {
+            const std::string piece = random_string(4);
+
+            size_t i_stop = 0;
+            const size_t pos = matcher.feed(piece, &i_stop);
+
+            // the first stop in the whole text only ends in the new piece if there was none before
+            size_t i_ref = 0;
+            const size_t pos_ref = find_first_stop(text + piece, stops, i_ref);
+
+            text += piece;
+
+            assert(pos == pos_ref);
+            if (pos != std::string::npos) {
+                assert(i_stop == i_ref);
+                break;
+            }
+
+            const size_t n_max   = rng() % (text.size() + 1);
+            const size_t partial = matcher.partial_len(n_max);
+            const size_t pos_partial = find_partial_stop(text.substr(text.size() - n_max), stops);
+
+            assert(partial == (pos_partial == std::string::npos ? 0 : n_max - pos_partial));
+        }
+    }
+}
+
+int main() {
+    test_basic();
+    test_random();
+
+    printf("OK\n");
+
+    return 0;
+}
@@ -2,6 +2,7 @@
 // - Loads a copy of the same model on each GPU, plus a copy on the CPU
 // - Creates n_parallel (--parallel) contexts per model
 // - Runs inference in parallel on each context
+// - Does it again with the contexts created from a context pool of each model
 
 #include <thread>
 #include <vector>
@@ -50,6 +51,7 @@ int main(int argc, char ** argv) {
     const int num_contexts = std::max(1, params.n_parallel);
 
     std::vector<llama_model_ptr> models;
+    std::vector<llama_context_pool_ptr> pools;
     std::vector<std::thread> threads;
     std::atomic<bool> failed = false;
 
@@ -73,81 +75,93 @@ int main(int argc, char ** argv) {
         }
 
         models.emplace_back(model);
+
+        llama_context_pool * pool = llama_context_pool_init(model, cparams);
+        if (pool == NULL) {
+            LOG_ERR("%s: failed to create context pool\n", __func__);
+            return 1;
+        }
+
+        pools.emplace_back(pool);
     }
 
-    for  (int m = 0; m < num_models; ++m) {
-        auto * model = models[m].get();
-        for (int c = 0; c < num_contexts; ++c) {
-            threads.emplace_back([&, m, c, model]() {
-                LOG_INF("Creating context %d/%d for model %d/%d\n", c + 1, num_contexts, m + 1, num_models);
-
-                llama_context_ptr ctx { llama_init_from_model(model, cparams) };
-                if (ctx == NULL) {
-                    LOG_ERR("failed to create context\n");
-                    failed.store(true);
-                    return;
-                }
-
-                std::unique_ptr<common_sampler, decltype(&common_sampler_free)> sampler { common_sampler_init(model, params.sampling), common_sampler_free };
-                if (sampler == NULL) {
-                    LOG_ERR("failed to create sampler\n");
-                    failed.store(true);
-                    return;
-                }
-
-                llama_batch batch = {};
-                {
-                    auto prompt = common_tokenize(ctx.get(), params.prompt, true);
-                    if (prompt.empty()) {
-                        LOG_ERR("failed to tokenize prompt\n");
+    for (const bool use_pool : { false, true }) {
+        for  (int m = 0; m < num_models; ++m) {
+            auto * model = models[m].get();
+            for (int c = 0; c < num_contexts; ++c) {
+                threads.emplace_back([&, m, c, model, use_pool]() {
+                    LOG_INF("Creating %scontext %d/%d for model %d/%d\n", use_pool ? "pool " : "", c + 1, num_contexts, m + 1, num_models);
+
+                    // the contexts of a pool decode one at a time
+                    llama_context_ptr ctx { use_pool ? llama_init_from_pool(pools[m].get(), cparams) : llama_init_from_model(model, cparams) };
+                    if (ctx == NULL) {
+                        LOG_ERR("failed to create context\n");
                         failed.store(true);
                         return;
                     }
-                    batch = llama_batch_get_one(prompt.data(), prompt.size());
-                    if (llama_decode(ctx.get(), batch)) {
-                        LOG_ERR("failed to decode prompt\n");
+
+                    std::unique_ptr<common_sampler, decltype(&common_sampler_free)> sampler { common_sampler_init(model, params.sampling), common_sampler_free };
+                    if (sampler == NULL) {
+                        LOG_ERR("failed to create sampler\n");
                         failed.store(true);
                         return;
                     }
-                }
 
-                const auto * vocab = llama_model_get_vocab(model);
-                std::string result = params.prompt;
-
-                for (int i = 0; i < params.n_predict; i++) {
-                    llama_token token;
-                    if (batch.n_tokens > 0) {
-                        token = common_sampler_sample(sampler.get(), ctx.get(), batch.n_tokens - 1);
-                    } else {
-                        token = llama_vocab_bos(vocab);
+                    llama_batch batch = {};
+                    {
+                        auto prompt = common_tokenize(ctx.get(), params.prompt, true);
+                        if (prompt.empty()) {
+                            LOG_ERR("failed to tokenize prompt\n");
+                            failed.store(true);
+                            return;
+                        }
+                        batch = llama_batch_get_one(prompt.data(), prompt.size());
+                        if (llama_decode(ctx.get(), batch)) {
+                            LOG_ERR("failed to decode prompt\n");
+                            failed.store(true);
+                            return;
+                        }
                     }
 
-                    result += common_token_to_piece(ctx.get(), token);
-
-                    if (llama_vocab_is_eog(vocab, token)) {
-                        break;
+                    const auto * vocab = llama_model_get_vocab(model);
+                    std::string result = params.prompt;
+
+                    for (int i = 0; i < params.n_predict; i++) {
+                        llama_token token;
+                        if (batch.n_tokens > 0) {
+                            token = common_sampler_sample(sampler.get(), ctx.get(), batch.n_tokens - 1);
+                        } else {
+                            token = llama_vocab_bos(vocab);
+                        }
+
+                        result += common_token_to_piece(ctx.get(), token);
+
+                        if (llama_vocab_is_eog(vocab, token)) {
+                            break;
+                        }
+
+                        batch = llama_batch_get_one(&token, 1);
+                        if (llama_decode(ctx.get(), batch)) {
+                            LOG_ERR("Model %d/%d, Context %d/%d: failed to decode\n", m + 1, num_models, c + 1, num_contexts);
+                            failed.store(true);
+                            return;
+                        }
                     }
 
-                    batch = llama_batch_get_one(&token, 1);
-                    if (llama_decode(ctx.get(), batch)) {
-                        LOG_ERR("Model %d/%d, Context %d/%d: failed to decode\n", m + 1, num_models, c + 1, num_contexts);
-                        failed.store(true);
-                        return;
-                    }
-                }
-
-                LOG_INF("Model %d/%d, Context %d/%d: %s\n\n", m + 1, num_models, c + 1, num_contexts, result.c_str());
-            });
+                    LOG_INF("Model %d/%d, Context %d/%d: %s\n\n", m + 1, num_models, c + 1, num_contexts, result.c_str());
+                });
+            }
         }
-    }
 
-    for (auto & thread : threads) {
-        thread.join();
-    }
+        for (auto & thread : threads) {
+            thread.join();
+        }
+        threads.clear();
 
-    if (failed) {
-        LOG_ERR("One or more threads failed.\n");
-        return 1;
+        if (failed) {
+            LOG_ERR("One or more threads failed.\n");
+            return 1;
+        }
     }
 
     LOG_INF("All threads finished without errors.\n");
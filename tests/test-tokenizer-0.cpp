@@ -244,6 +244,22 @@ int main(int argc, char **argv) {
 
                     success = false;
                 }
+
+                // the batched detokenization must give the same pieces
+                for (const bool special : { true, false }) {
+                    std::string expected;
+                    for (const auto & tok : res) {
+                        expected += common_token_to_piece(ctx, tok, special);
+                    }
+                    std::string text = "prefix:";
+                    const size_t n_valid = common_detokenize_append(llama_model_get_vocab(model), res.data(), res.size(), text, special);
+                    if (text != "prefix:" + expected || n_valid > text.size()) {
+                        fprintf(stderr, "%s : failed test:    '%s'\n", __func__, test_kv.first.c_str());
+                        fprintf(stderr, "%s : common_detokenize_append(special = %d) gave '%s' instead of '%s'\n", __func__,
+                            special, text.c_str() + 7, expected.c_str());
+                        success = false;
+                    }
+                }
             }
         });
     }
@@ -252,6 +268,37 @@ int main(int argc, char **argv) {
         threads[i].join();
     }
 
+    // long input with many characters without a token (byte fallback in SPM) - the tokenization must stay linear
+    if (fname_text.empty()) {
+        const std::string unit = "hello world \xf0\x9d\x94\xb8\xf0\x9d\x94\xb9"; // 'hello world 𝔸𝔹'
+        const int n_rep = 20000;
+
+        std::string text;
+        text.reserve(unit.size()*n_rep);
+        for (int i = 0; i < n_rep; ++i) {
+            text += unit;
+        }
+
+        const auto t_start = ggml_time_us();
+        const std::vector<llama_token> res = common_tokenize(ctx, text, add_special, false);
+        const auto t_end = ggml_time_us();
+
+        fprintf(stderr, "%s : long input: %zu bytes, %zu tokens in %.3f ms\n", __func__, text.size(), res.size(), (t_end - t_start) / 1000.0);
+
+        // the vocabs that normalize the text (e.g. lowercase) do not round-trip
+        const bool round_trip = common_detokenize(ctx, common_tokenize(ctx, unit, add_special, false)) == unit;
+        if (round_trip && common_detokenize(ctx, res) != text) {
+            fprintf(stderr, "%s : failed test: long input does not detokenize to the input\n", __func__);
+            success = false;
+        }
+
+        // about 0.3 s when linear, tens of seconds when quadratic
+        if (t_end - t_start > 10*1000*1000) {
+            fprintf(stderr, "%s : failed test: long input took %.3f s to tokenize\n", __func__, (t_end - t_start) / 1e6);
+            success = false;
+        }
+    }
+
     // single threaded tokenization
     if (!fname_text.empty()) {
         fprintf(stderr, "%s : tokenizing: '%s'\n", __func__, fname_text.c_str());
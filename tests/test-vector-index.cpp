@@ -0,0 +1,146 @@
+#include "vector-index.h"
+
+#undef NDEBUG
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// fraction of the exact top-k found by the approximate search
+static float recall(const common_vector_index & index, const std::vector<std::vector<float>> & queries, int k) {
+    int n_found = 0;
+    for (const auto & q : queries) {
+        const auto exact  = index.search_exact(q.data(), k);
+        const auto approx = index.search(q.data(), k, 64);
+        assert(approx.size() == exact.size());
+
+        for (const auto & e : exact) {
+            for (const auto & a : approx) {
+                if (a.id == e.id) {
+                    n_found++;
+                    break;
+                }
+            }
+        }
+    }
+    return (float) n_found / (queries.size()*k);
+}
+
+static void check_same(const common_vector_index & a, const common_vector_index & b, const std::vector<std::vector<float>> & queries) {
+    assert(a.size() == b.size());
+    for (const auto & q : queries) {
+        const auto ra = a.search(q.data(), 10);
+        const auto rb = b.search(q.data(), 10);
+        assert(ra.size() == rb.size());
+        for (size_t i = 0; i < ra.size(); ++i) {
+            assert(ra[i].id == rb[i].id);
+            assert(ra[i].score == rb[i].score);
+        }
+    }
+}
+
+int main() {
+    const int n_embd    = 64;
+    const int n_vectors = 2000;
+    const int n_queries = 50;
+
+    std::mt19937 rng(1234);
+    std::normal_distribution<float> dist;
+
+    auto random_vector = [&]() {
+        std::vector<float> v(n_embd);
+        for (auto & x : v) {
+            x = dist(rng);
+        }
+        return v;
+    };
+
+    std::vector<std::vector<float>> vectors;
+    for (int i = 0; i < n_vectors; ++i) {
+        vectors.push_back(random_vector());
+    }
+    std::vector<std::vector<float>> queries;
+    for (int i = 0; i < n_queries; ++i) {
+        queries.push_back(random_vector());
+    }
+
+    for (ggml_type type : { GGML_TYPE_F32, GGML_TYPE_F16, GGML_TYPE_Q8_0 }) {
+        common_vector_index_params params;
+        params.n_embd = n_embd;
+        params.type   = type;
+
+        common_vector_index index(params);
+        assert(index.empty());
+        assert(index.search(queries[0].data(), 5).empty());
+
+        for (int i = 0; i < n_vectors/2; ++i) {
+            assert(index.add(vectors[i].data()) == i);
+        }
+
+        // a vector is its own nearest neighbor
+        {
+            const auto res = index.search(vectors[7].data(), 1);
+            assert(res.size() == 1 && res[0].id == 7);
+            assert(std::fabs(res[0].score - 1.0f) < 1e-2f);
+        }
+
+        // results are sorted by score
+        {
+            const auto res = index.search(queries[0].data(), 10);
+            assert(res.size() == 10);
+            for (size_t i = 1; i < res.size(); ++i) {
+                assert(res[i - 1].score >= res[i].score);
+            }
+        }
+
+        // round trip through a file, the loaded index is memory-mapped and copied when a vector is added
+        const std::string fname = "test-vector-index.bin";
+        assert(common_vector_index_save(index, fname));
+
+        common_vector_index loaded = common_vector_index_load(fname);
+        check_same(index, loaded, queries);
+
+        for (int i = n_vectors/2; i < n_vectors; ++i) {
+            assert(index .add(vectors[i].data()) == i);
+            assert(loaded.add(vectors[i].data()) == i);
+        }
+        assert(loaded.size() == (size_t) n_vectors);
+
+        const float r = recall(index, queries, 10);
+        const float r_loaded = recall(loaded, queries, 10);
+        printf("%s: type = %s, recall@10 = %.3f, recall@10 (loaded) = %.3f\n", __func__, ggml_type_name(type), r, r_loaded);
+        assert(r > 0.9f);
+        assert(r_loaded > 0.9f);
+
+        // moved index keeps the data
+        common_vector_index moved = std::move(loaded);
+        assert(moved.size() == (size_t) n_vectors);
+        assert(loaded.empty());
+        assert(moved.search(vectors[n_vectors - 1].data(), 1)[0].id == n_vectors - 1);
+
+        std::remove(fname.c_str());
+    }
+
+    // invalid file
+    {
+        const std::string fname = "test-vector-index-invalid.bin";
+        {
+            FILE * f = fopen(fname.c_str(), "wb");
+            fputs("not a vector index", f);
+            fclose(f);
+        }
+        bool thrown = false;
+        try {
+            common_vector_index_load(fname);
+        } catch (const std::exception &) {
+            thrown = true;
+        }
+        assert(thrown);
+        std::remove(fname.c_str());
+    }
+
+    return 0;
+}
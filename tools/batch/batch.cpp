@@ -0,0 +1,507 @@
+// Offline batch inference: reads requests from JSONL files and writes the completions as JSONL, in the order they finish.
+//
+// The requests are scheduled for the aggregate throughput instead of the latency of each request:
+//  - they are read ahead in windows and sorted by prompt tokens, so that consecutive requests share their prefixes
+//  - a new request copies the longest cached prefix of any sequence, running or finished (unified KV cache)
+//  - new requests start as long as their KV cells fit in the context, up to -np sequences at once
+//  - each batch is filled up to n_batch: the sampled tokens of the running requests first, then the pending prompts
+
+#include "arg.h"
+#include "common.h"
+#include "sampling.h"
+#include "log.h"
+#include "llama.h"
+
+#include <nlohmann/json.hpp>
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using json = nlohmann::ordered_json;
+
+struct batch_request {
+    json id;
+
+    llama_tokens prompt;
+
+    int32_t n_predict = 0;
+};
+
+struct batch_sequence {
+    ~batch_sequence() {
+        if (smpl) {
+            common_sampler_free(smpl);
+        }
+    }
+
+    llama_seq_id id = -1;
+
+    bool active = false;
+
+    batch_request req;
+
+    // the tokens in the KV cache of the sequence, kept after the request finishes so that the next ones can reuse them
+    llama_tokens cache;
+
+    // the first n_shared cells are shared with the sequence src, which holds them
+    llama_seq_id src      = -1;
+    int32_t      n_shared = 0;
+
+    int32_t n_reused  = 0;
+    int32_t n_decoded = 0;
+    int32_t i_batch   = -1;
+
+    llama_token sampled = LLAMA_TOKEN_NULL;
+
+    std::string response;
+
+    int64_t t_last = 0; // last use, to drop the least recently used caches first
+
+    struct common_sampler * smpl = nullptr;
+
+    bool in_prompt() const {
+        return cache.size() < req.prompt.size();
+    }
+
+    // number of KV cells that the request still needs
+    int32_t n_remaining() const {
+        return req.prompt.size() - std::min(cache.size(), req.prompt.size()) + req.n_predict - n_decoded;
+    }
+};
+
+struct batch_reader {
+    std::vector<std::string> files;
+
+    size_t        i_file = 0;
+    std::ifstream file;
+    int64_t       i_line = 0;
+
+    bool eof() {
+        while (!file.is_open() || file.peek() == EOF) {
+            if (i_file >= files.size()) {
+                return true;
+            }
+            file = std::ifstream(files[i_file++]);
+            if (!file) {
+                throw std::runtime_error("failed to open " + files[i_file - 1]);
+            }
+        }
+
+        return false;
+    }
+
+    // the next non-empty line and its index in the input, false at the end of the input
+    bool next(std::string & line, int64_t & idx) {
+        while (!eof()) {
+            std::getline(file, line);
+            idx = i_line++;
+            if (!line.empty()) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+};
+
+static size_t common_prefix(const llama_tokens & a, const llama_tokens & b) {
+    size_t i = 0;
+    while (i < a.size() && i < b.size() && a[i] == b[i]) {
+        ++i;
+    }
+
+    return i;
+}
+
+static void print_usage(int, char ** argv) {
+    LOG("\nexample usage:\n");
+    LOG("\n    %s -m model.gguf --in-file requests.jsonl -o results.jsonl -c 16384 -np 32 -n 256\n", argv[0]);
+    LOG("\neach line of the input is a request {\"id\": ..., \"prompt\": \"...\", \"n_predict\": N}, the id and n_predict are optional\n");
+    LOG("\n");
+}
+
+int main(int argc, char ** argv) {
+    common_params params;
+
+    params.n_predict = 128;
+    params.n_parallel = 16;
+
+    if (!common_params_parse(argc, argv, params, LLAMA_EXAMPLE_BATCH, print_usage)) {
+        return 1;
+    }
+
+    if (params.in_files.empty()) {
+        LOG_ERR("%s: no input, use --in-file\n", __func__);
+        print_usage(argc, argv);
+        return 1;
+    }
+
+    common_init();
+
+    // the sequences share their prefixes and the cells of the context
+    params.kv_unified = true;
+
+    llama_backend_init();
+    llama_numa_init(params.numa);
+
+    common_init_result llama_init = common_init_from_params(params);
+
+    llama_model * model = llama_init.model.get();
+    llama_context * ctx = llama_init.context.get();
+
+    if (model == nullptr || ctx == nullptr) {
+        LOG_ERR("%s: failed to load the model\n", __func__);
+        return 1;
+    }
+
+    auto * mem = llama_get_memory(ctx);
+
+    const llama_vocab * vocab = llama_model_get_vocab(model);
+
+    const int32_t n_ctx   = llama_n_ctx(ctx);
+    const int32_t n_batch = llama_n_batch(ctx);
+    const int32_t n_seq   = std::min(params.n_parallel, n_batch);
+
+    // copying prefixes requires partial sequence copies
+    const bool can_share = llama_memory_can_shift(mem);
+
+    std::ofstream fout;
+    if (!params.out_file.empty()) {
+        fout.open(params.out_file);
+        if (!fout) {
+            LOG_ERR("%s: failed to open %s\n", __func__, params.out_file.c_str());
+            return 1;
+        }
+    }
+    std::ostream & out = params.out_file.empty() ? std::cout : fout;
+
+    const auto write = [&](const json & res) {
+        out << res.dump() << "\n";
+        out.flush();
+    };
+
+    batch_reader reader;
+    reader.files = params.in_files;
+
+    std::deque<batch_request> pending;
+
+    // read and sort the next window of requests, the invalid ones are answered with an error right away
+    const auto read_window = [&]() {
+        std::vector<batch_request> window;
+
+        std::string line;
+        int64_t idx;
+        while ((int) window.size() < params.batch_window && reader.next(line, idx)) {
+            batch_request req;
+            req.id = idx;
+            try {
+                const json data = json::parse(line);
+
+                req.id        = data.contains("id") ? data.at("id") : json(idx);
+                req.prompt    = common_tokenize(vocab, data.at("prompt").get<std::string>(), true, true);
+                req.n_predict = data.contains("n_predict") ? data.at("n_predict").get<int32_t>() : params.n_predict;
+
+                if (req.n_predict < 0) {
+                    req.n_predict = n_ctx - req.prompt.size();
+                }
+                if (req.prompt.empty()) {
+                    throw std::runtime_error("empty prompt");
+                }
+                if ((int32_t) req.prompt.size() + req.n_predict > n_ctx) {
+                    throw std::runtime_error(string_format("the prompt (%zu tokens) and n_predict (%d) exceed the context size (%d)", req.prompt.size(), req.n_predict, n_ctx));
+                }
+            } catch (const std::exception & e) {
+                write({ {"id", req.id}, {"error", e.what()} });
+                continue;
+            }
+
+            window.push_back(std::move(req));
+        }
+
+        std::sort(window.begin(), window.end(), [](const batch_request & a, const batch_request & b) {
+            return a.prompt < b.prompt;
+        });
+
+        for (auto & req : window) {
+            pending.push_back(std::move(req));
+        }
+    };
+
+    std::vector<batch_sequence> seqs(n_seq);
+    for (int i = 0; i < n_seq; ++i) {
+        seqs[i].id   = i;
+        seqs[i].smpl = common_sampler_init(model, params.sampling);
+    }
+
+    // the cells held by the sequences, not counting the prefixes that they share with another one
+    const auto n_cells_used = [&]() {
+        int32_t res = 0;
+        for (const auto & seq : seqs) {
+            res += seq.cache.size() - seq.n_shared;
+        }
+        return res;
+    };
+
+    const auto n_cells_reserved = [&]() {
+        int32_t res = 0;
+        for (const auto & seq : seqs) {
+            if (seq.active) {
+                res += seq.n_remaining();
+            }
+        }
+        return res;
+    };
+
+    // remove the cached tokens of a sequence from position p
+    const auto trim = [&](batch_sequence & seq, int32_t p) {
+        if (p >= (int32_t) seq.cache.size()) {
+            return;
+        }
+
+        llama_memory_seq_rm(mem, seq.id, p, -1);
+        seq.cache.resize(p);
+        seq.n_shared = std::min(seq.n_shared, p);
+        if (seq.n_shared == 0) {
+            seq.src = -1;
+        }
+
+        // the sequences that share these cells now hold them alone
+        for (auto & other : seqs) {
+            if (other.src == seq.id) {
+                other.n_shared = std::min(other.n_shared, p);
+                if (other.n_shared == 0) {
+                    other.src = -1;
+                }
+            }
+        }
+    };
+
+    // start the next request on an idle sequence, false if it does not fit yet
+    const auto launch = [&]() {
+        const auto & req = pending.front();
+
+        batch_sequence * dst = nullptr;
+        batch_sequence * src = nullptr;
+        size_t n_prefix = 0;
+
+        for (auto & seq : seqs) {
+            const size_t n = std::min(common_prefix(seq.cache, req.prompt), req.prompt.size() - 1);
+            if ((can_share || !seq.active) && (src == nullptr || n > n_prefix)) {
+                src      = &seq;
+                n_prefix = n;
+            }
+        }
+
+        // wait for a prompt that is being evaluated if it would give a longer prefix
+        for (const auto & seq : seqs) {
+            if (can_share && seq.active && seq.in_prompt() && std::min(common_prefix(seq.req.prompt, req.prompt), req.prompt.size() - 1) > n_prefix) {
+                return false;
+            }
+        }
+
+        if (n_prefix == 0) {
+            src = nullptr;
+        }
+
+        if (src != nullptr && !src->active) {
+            dst = src;
+        } else {
+            for (auto & seq : seqs) {
+                if (!seq.active && (dst == nullptr || seq.t_last < dst->t_last)) {
+                    dst = &seq;
+                }
+            }
+        }
+
+        if (dst == nullptr) {
+            return false;
+        }
+        if (dst != src && !can_share) {
+            n_prefix = 0;
+        }
+
+        const int32_t n_needed = req.prompt.size() - n_prefix + req.n_predict;
+
+        // drop the caches of the idle sequences, least recently used first, until the request fits
+        while (n_cells_used() + n_cells_reserved() + n_needed > n_ctx) {
+            batch_sequence * victim = nullptr;
+            for (auto & seq : seqs) {
+                if (!seq.active && &seq != src && !seq.cache.empty() && (victim == nullptr || seq.t_last < victim->t_last)) {
+                    victim = &seq;
+                }
+            }
+            if (victim == nullptr) {
+                break;
+            }
+            trim(*victim, 0);
+        }
+
+        if (dst != src) {
+            trim(*dst, 0);
+        }
+        if (n_cells_used() + n_cells_reserved() + n_needed > n_ctx) {
+            return false;
+        }
+
+        if (dst == src) {
+            trim(*dst, n_prefix);
+        } else if (n_prefix > 0) {
+            llama_memory_seq_cp(mem, src->id, dst->id, 0, n_prefix);
+
+            dst->cache.assign(req.prompt.begin(), req.prompt.begin() + n_prefix);
+            dst->src      = src->id;
+            dst->n_shared = n_prefix;
+        }
+
+        dst->req       = std::move(pending.front());
+        dst->active    = true;
+        dst->n_reused  = n_prefix;
+        dst->n_decoded = 0;
+        dst->i_batch   = -1;
+        dst->response.clear();
+
+        pending.pop_front();
+
+        common_sampler_reset(dst->smpl);
+        for (const auto id : dst->req.prompt) {
+            common_sampler_accept(dst->smpl, id, false);
+        }
+
+        return true;
+    };
+
+    llama_batch batch = llama_batch_init(n_batch, 0, 1);
+
+    int64_t n_total_prompt = 0;
+    int64_t n_total_reused = 0;
+    int64_t n_total_gen    = 0;
+    int64_t n_total_req    = 0;
+
+    const auto t_main_start = ggml_time_us();
+
+    LOG_INF("%s: n_ctx = %d, n_batch = %d, n_seq = %d, window = %d, n_predict = %d\n", __func__, n_ctx, n_batch, n_seq, params.batch_window, params.n_predict);
+
+    while (true) {
+        if ((int) pending.size() < n_seq && !reader.eof()) {
+            read_window();
+        }
+
+        common_batch_clear(batch);
+
+        // the new requests, as long as they fit - before the batch is built, so that the caches only hold evaluated tokens
+        while (!pending.empty() && launch()) {
+        }
+
+        // the sampled tokens of the running requests
+        for (auto & seq : seqs) {
+            if (!seq.active || seq.in_prompt()) {
+                continue;
+            }
+
+            seq.i_batch = batch.n_tokens;
+
+            common_batch_add(batch, seq.sampled, seq.cache.size(), { seq.id }, true);
+
+            seq.cache.push_back(seq.sampled);
+        }
+
+        // the pending prompts, up to n_batch tokens
+        for (auto & seq : seqs) {
+            if (!seq.active || !seq.in_prompt()) {
+                continue;
+            }
+
+            while (seq.in_prompt() && batch.n_tokens < n_batch) {
+                const size_t i = seq.cache.size();
+
+                common_batch_add(batch, seq.req.prompt[i], i, { seq.id }, i + 1 == seq.req.prompt.size());
+
+                seq.cache.push_back(seq.req.prompt[i]);
+            }
+
+            if (!seq.in_prompt()) {
+                seq.i_batch = batch.n_tokens - 1;
+            }
+        }
+
+        if (batch.n_tokens == 0) {
+            if (pending.empty() && reader.eof()) {
+                break;
+            }
+
+            LOG_ERR("%s: no request fits in the context, increase the context size\n", __func__);
+            return 1;
+        }
+
+        const int ret = llama_decode(ctx, batch);
+        if (ret != 0) {
+            LOG_ERR("%s: failed to decode the batch of %d tokens, ret = %d\n", __func__, batch.n_tokens, ret);
+            return 1;
+        }
+
+        const int64_t t_now = ggml_time_us();
+
+        for (auto & seq : seqs) {
+            if (seq.i_batch < 0) {
+                continue;
+            }
+
+            const llama_token id = common_sampler_sample(seq.smpl, ctx, seq.i_batch);
+
+            common_sampler_accept(seq.smpl, id, true);
+
+            seq.i_batch = -1;
+            seq.t_last  = t_now;
+
+            seq.n_decoded += 1;
+            seq.sampled    = id;
+
+            const bool is_eog = llama_vocab_is_eog(vocab, id);
+            if (!is_eog) {
+                seq.response += common_token_to_piece(ctx, id, params.special);
+            }
+
+            if (is_eog || seq.n_decoded >= seq.req.n_predict) {
+                write({
+                    {"id",          seq.req.id},
+                    {"content",     seq.response},
+                    {"n_prompt",    seq.req.prompt.size()},
+                    {"n_reused",    seq.n_reused},
+                    {"n_predicted", seq.n_decoded},
+                    {"stop",        is_eog ? "eos" : "limit"},
+                });
+
+                n_total_prompt += seq.req.prompt.size();
+                n_total_reused += seq.n_reused;
+                n_total_gen    += seq.n_decoded;
+                n_total_req    += 1;
+
+                // the cache keeps the prompt and the evaluated tokens for the next requests
+                seq.active = false;
+            }
+        }
+    }
+
+    const double t_main = (ggml_time_us() - t_main_start) / 1e6;
+
+    LOG_INF("\n");
+    LOG_INF("%s: requests:      %8" PRId64 "\n", __func__, n_total_req);
+    LOG_INF("%s: prompt tokens: %8" PRId64 ", reused: %" PRId64 " (%.1f%%)\n", __func__, n_total_prompt, n_total_reused, 100.0*n_total_reused/std::max<int64_t>(1, n_total_prompt));
+    LOG_INF("%s: gen tokens:    %8" PRId64 ", speed: %.2f t/s\n", __func__, n_total_gen, n_total_gen/t_main);
+    LOG_INF("%s: total time:    %8.2f s, speed: %.2f t/s\n", __func__, t_main, (n_total_prompt - n_total_reused + n_total_gen)/t_main);
+    LOG_INF("\n");
+
+    llama_perf_context_print(ctx);
+
+    llama_batch_free(batch);
+
+    llama_backend_free();
+
+    return 0;
+}
@@ -4,7 +4,9 @@
 #include "llama.h"
 
 #include <algorithm>
+#include <cmath>
 #include <cstdio>
+#include <random>
 #include <string>
 #include <vector>
 
@@ -14,6 +16,284 @@ static void print_usage(int, char ** argv) {
     LOG("\n");
 }
 
+// decode in batches of n_batch tokens
+static bool decode_helper(llama_context * ctx, llama_batch & batch, int32_t n_batch) {
+    for (int32_t i = 0; i < (int32_t) batch.n_tokens; i += n_batch) {
+        const int32_t n_tokens = std::min(n_batch, (int32_t) (batch.n_tokens - i));
+
+        llama_batch batch_view = {
+            n_tokens,
+            batch.token    + i,
+            nullptr,
+            batch.pos      + i,
+            batch.n_seq_id + i,
+            batch.seq_id   + i,
+            batch.logits   + i,
+        };
+
+        const int ret = llama_decode(ctx, batch_view);
+        if (ret != 0) {
+            LOG_ERR("failed to decode the batch, n_batch = %d, ret = %d\n", n_batch, ret);
+            return false;
+        }
+
+        llama_synchronize(ctx);
+    }
+
+    return true;
+}
+
+// results of a serving scenario (--scenarios)
+struct bench_result {
+    int32_t n_seq      = 0; // sequences that were served
+    int32_t n_tokens   = 0; // evaluated tokens (prompts and generated)
+    int32_t n_steps    = 0; // decode steps with generated tokens
+    int32_t n_kv_max   = 0; // largest extent of the KV cells
+    double  kv_util    = 0; // average n_used/n_extent of the KV cells after each step
+    double  t          = 0; // total time, s
+    double  t_steps    = 0; // time of the decode steps with generated tokens, s
+    double  t_mem      = 0; // time of the memory updates (K-shift, defrag), s
+};
+
+// a sequence of a serving scenario
+struct bench_seq {
+    llama_seq_id id;
+    llama_pos    pos;      // next position
+    int32_t      n_prompt; // prompt tokens not evaluated yet
+    int32_t      n_gen;    // tokens left to generate
+};
+
+static void bench_kv_sample(llama_context * ctx, bench_result & res, int32_t & n_samples) {
+    int32_t n_extent = 0;
+    const int32_t n_used = llama_memory_n_cells(llama_get_memory(ctx), &n_extent);
+
+    if (n_extent > 0) {
+        res.kv_util += (double) n_used/n_extent;
+        n_samples++;
+    }
+
+    res.n_kv_max = std::max(res.n_kv_max, n_extent);
+}
+
+// stagger, mixed, replace: 2*pl sequences with at most pl at the same time, a new sequence starts when a sequence id
+// is free and the arrival interval has elapsed - a finished sequence is removed, leaving a hole in the KV cells
+static bool bench_serving(llama_context * ctx, llama_batch & batch, int32_t n_batch, const std::string & scenario, int pp, int tg, int pl, bench_result & res) {
+    auto * mem = llama_get_memory(ctx);
+
+    const bool mixed    = scenario == "mixed";
+    const bool replace  = scenario == "replace";
+    const int  interval = replace ? 0 : std::max(1, tg/pl);
+    const int  n_total  = 2*pl;
+
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<int> dist_gen(1, 2*tg);
+
+    std::vector<bench_seq> seqs;
+    std::vector<llama_seq_id> free_ids;
+    for (int j = pl - 1; j >= 0; --j) {
+        free_ids.push_back(j);
+    }
+
+    llama_memory_clear(mem, false);
+
+    int32_t n_samples = 0;
+    int     n_started = 0;
+    int     step_last = -interval;
+
+    const double t_mem_start = llama_perf_context(ctx).t_mem_update_ms;
+    const int64_t t_start = ggml_time_us();
+
+    for (int step = 0; n_started < n_total || !seqs.empty(); ++step) {
+        // arrivals
+        while (n_started < n_total && !free_ids.empty() && step - step_last >= interval) {
+            seqs.push_back({ free_ids.back(), 0, pp, replace ? dist_gen(rng) : tg });
+            free_ids.pop_back();
+            n_started++;
+            step_last = step;
+
+            if (interval > 0) {
+                break;
+            }
+        }
+
+        // the prompts are evaluated alone, unless they are mixed with the generated tokens
+        if (!mixed) {
+            common_batch_clear(batch);
+
+            for (auto & seq : seqs) {
+                for (; seq.n_prompt > 0; --seq.n_prompt) {
+                    common_batch_add(batch, 0, seq.pos++, { seq.id }, seq.n_prompt == 1);
+                }
+            }
+
+            if (batch.n_tokens > 0) {
+                if (!decode_helper(ctx, batch, n_batch)) {
+                    return false;
+                }
+                res.n_tokens += batch.n_tokens;
+            }
+        }
+
+        common_batch_clear(batch);
+
+        for (auto & seq : seqs) {
+            if (seq.n_prompt == 0) {
+                common_batch_add(batch, 0, seq.pos++, { seq.id }, true);
+            }
+        }
+
+        // the prompt chunks fill the rest of the batch
+        for (auto & seq : seqs) {
+            for (; seq.n_prompt > 0 && batch.n_tokens < n_batch; --seq.n_prompt) {
+                common_batch_add(batch, 0, seq.pos++, { seq.id }, seq.n_prompt == 1);
+            }
+        }
+
+        if (batch.n_tokens == 0) {
+            continue;
+        }
+
+        const int64_t t_step_start = ggml_time_us();
+
+        if (!decode_helper(ctx, batch, n_batch)) {
+            return false;
+        }
+
+        res.t_steps  += (ggml_time_us() - t_step_start)/1e6;
+        res.n_tokens += batch.n_tokens;
+        res.n_steps++;
+
+        bench_kv_sample(ctx, res, n_samples);
+
+        // the sequences that generated a token before this step's prompt chunks
+        for (size_t i = 0; i < seqs.size(); ) {
+            auto & seq = seqs[i];
+
+            if (seq.n_prompt == 0 && seq.pos > pp && --seq.n_gen == 0) {
+                llama_memory_seq_rm(mem, seq.id, -1, -1);
+                free_ids.push_back(seq.id);
+                seqs.erase(seqs.begin() + i);
+                res.n_seq++;
+                continue;
+            }
+
+            ++i;
+        }
+    }
+
+    res.t     = (ggml_time_us() - t_start)/1e6;
+    res.t_mem = (llama_perf_context(ctx).t_mem_update_ms - t_mem_start)/1e3;
+
+    if (n_samples > 0) {
+        res.kv_util /= n_samples;
+    }
+
+    return true;
+}
+
+// tree: a root prompt of pp/2 tokens shared by all the sequences, a prefix of pp/4 tokens shared by each group of about
+// sqrt(pl) sequences and pp - pp/2 - pp/4 tokens per sequence, then tg generated tokens
+static bool bench_tree(llama_context * ctx, llama_batch & batch, int32_t n_batch, int pp, int tg, int pl, bench_result & res) {
+    auto * mem = llama_get_memory(ctx);
+
+    const int n_root  = pp/2;
+    const int n_group = pp/4;
+    const int n_leaf  = pp - n_root - n_group;
+
+    const int group_size = std::max(1, (int) std::sqrt((double) pl));
+
+    llama_memory_clear(mem, false);
+
+    int32_t n_samples = 0;
+
+    const double t_mem_start = llama_perf_context(ctx).t_mem_update_ms;
+    const int64_t t_start = ggml_time_us();
+
+    // evaluates the tokens [p0, p0 + n) for each of the sequences
+    const auto prefill = [&](const std::vector<llama_seq_id> & ids, int p0, int n) {
+        common_batch_clear(batch);
+
+        for (const auto id : ids) {
+            for (int i = 0; i < n; ++i) {
+                common_batch_add(batch, 0, p0 + i, { id }, i == n - 1);
+            }
+        }
+
+        if (batch.n_tokens == 0) {
+            return true;
+        }
+
+        res.n_tokens += batch.n_tokens;
+
+        return decode_helper(ctx, batch, n_batch);
+    };
+
+    std::vector<llama_seq_id> leaders;
+    for (int j = 0; j < pl; j += group_size) {
+        leaders.push_back(j);
+    }
+
+    std::vector<llama_seq_id> all(pl);
+    for (int j = 0; j < pl; ++j) {
+        all[j] = j;
+    }
+
+    if (!prefill({ 0 }, 0, n_root)) {
+        return false;
+    }
+    for (const auto id : leaders) {
+        if (id != 0) {
+            llama_memory_seq_cp(mem, 0, id, -1, -1);
+        }
+    }
+
+    if (!prefill(leaders, n_root, n_group)) {
+        return false;
+    }
+    for (int j = 0; j < pl; ++j) {
+        const llama_seq_id leader = (j/group_size)*group_size;
+        if (j != leader) {
+            llama_memory_seq_cp(mem, leader, j, -1, -1);
+        }
+    }
+
+    if (!prefill(all, n_root + n_group, n_leaf)) {
+        return false;
+    }
+
+    bench_kv_sample(ctx, res, n_samples);
+
+    for (int i = 0; i < tg; ++i) {
+        common_batch_clear(batch);
+
+        for (int j = 0; j < pl; ++j) {
+            common_batch_add(batch, 0, pp + i, { j }, true);
+        }
+
+        const int64_t t_step_start = ggml_time_us();
+
+        if (!decode_helper(ctx, batch, n_batch)) {
+            return false;
+        }
+
+        res.t_steps  += (ggml_time_us() - t_step_start)/1e6;
+        res.n_tokens += batch.n_tokens;
+        res.n_steps++;
+
+        bench_kv_sample(ctx, res, n_samples);
+    }
+
+    res.n_seq = pl;
+    res.t     = (ggml_time_us() - t_start)/1e6;
+    res.t_mem = (llama_perf_context(ctx).t_mem_update_ms - t_mem_start)/1e3;
+
+    if (n_samples > 0) {
+        res.kv_util /= n_samples;
+    }
+
+    return true;
+}
+
 int main(int argc, char ** argv) {
     common_params params;
 
@@ -63,33 +343,6 @@ int main(int argc, char ** argv) {
 
     llama_batch batch = llama_batch_init(n_kv_max, 0, 1);
 
-    // decode in batches of ctx_params.n_batch tokens
-    auto decode_helper = [](llama_context * ctx, llama_batch & batch, int32_t n_batch) {
-        for (int32_t i = 0; i < (int32_t) batch.n_tokens; i += n_batch) {
-            const int32_t n_tokens = std::min(n_batch, (int32_t) (batch.n_tokens - i));
-
-            llama_batch batch_view = {
-                n_tokens,
-                batch.token    + i,
-                nullptr,
-                batch.pos      + i,
-                batch.n_seq_id + i,
-                batch.seq_id   + i,
-                batch.logits   + i,
-            };
-
-            const int ret = llama_decode(ctx, batch_view);
-            if (ret != 0) {
-                LOG_ERR("failed to decode the batch, n_batch = %d, ret = %d\n", n_batch, ret);
-                return false;
-            }
-
-            llama_synchronize(ctx);
-        }
-
-        return true;
-    };
-
     // warm up
     {
         for (int i = 0; i < 16; ++i) {
@@ -105,85 +358,162 @@ int main(int argc, char ** argv) {
     if (!params.batched_bench_output_jsonl) {
         LOG("\n");
         LOG("%s: n_kv_max = %d, n_batch = %d, n_ubatch = %d, flash_attn = %d, is_pp_shared = %d, n_gpu_layers = %d, n_threads = %u, n_threads_batch = %u\n", __func__, n_kv_max, params.n_batch, params.n_ubatch, params.flash_attn, params.is_pp_shared, params.n_gpu_layers, ctx_params.n_threads, ctx_params.n_threads_batch);
-        LOG("\n");
-        LOG("|%6s | %6s | %4s | %6s | %8s | %8s | %8s | %8s | %8s | %8s |\n", "PP", "TG", "B", "N_KV", "T_PP s", "S_PP t/s", "T_TG s", "S_TG t/s", "T s", "S t/s");
-        LOG("|%6s-|-%6s-|-%4s-|-%6s-|-%8s-|-%8s-|-%8s-|-%8s-|-%8s-|-%8s-|\n", "------", "------", "----", "------", "--------", "--------", "--------", "--------", "--------", "--------");
     }
 
-    for (        int i_pp = 0; i_pp < (int) n_pp.size(); ++i_pp) {
-        for (    int i_tg = 0; i_tg < (int) n_tg.size(); ++i_tg) {
-            for (int i_pl = 0; i_pl < (int) n_pl.size(); ++i_pl) {
-                const int pp = n_pp[i_pp];
-                const int tg = n_tg[i_tg];
-                const int pl = n_pl[i_pl];
+    std::vector<std::string> scenarios = params.batched_bench_scenarios;
+    if (scenarios.empty()) {
+        scenarios.push_back("static");
+    }
+
+    if (std::find(scenarios.begin(), scenarios.end(), "static") != scenarios.end()) {
+        if (!params.batched_bench_output_jsonl) {
+            LOG("\n");
+            LOG("|%6s | %6s | %4s | %6s | %8s | %8s | %8s | %8s | %8s | %8s |\n", "PP", "TG", "B", "N_KV", "T_PP s", "S_PP t/s", "T_TG s", "S_TG t/s", "T s", "S t/s");
+            LOG("|%6s-|-%6s-|-%4s-|-%6s-|-%8s-|-%8s-|-%8s-|-%8s-|-%8s-|-%8s-|\n", "------", "------", "----", "------", "--------", "--------", "--------", "--------", "--------", "--------");
+        }
 
-                const int n_ctx_req = is_pp_shared ? pp + pl*tg : pl*(pp + tg);
+        for (        int i_pp = 0; i_pp < (int) n_pp.size(); ++i_pp) {
+            for (    int i_tg = 0; i_tg < (int) n_tg.size(); ++i_tg) {
+                for (int i_pl = 0; i_pl < (int) n_pl.size(); ++i_pl) {
+                    const int pp = n_pp[i_pp];
+                    const int tg = n_tg[i_tg];
+                    const int pl = n_pl[i_pl];
 
-                if (n_ctx_req > n_kv_max) {
-                    continue;
-                }
+                    const int n_ctx_req = is_pp_shared ? pp + pl*tg : pl*(pp + tg);
 
-                common_batch_clear(batch);
+                    if (n_ctx_req > n_kv_max) {
+                        continue;
+                    }
 
-                for (int j = 0; j < (is_pp_shared ? 1 : pl); ++j) {
-                    for (int i = 0; i < pp; ++i) {
-                        common_batch_add(batch, 0, i, { j }, i == pp - 1);
+                    common_batch_clear(batch);
+
+                    for (int j = 0; j < (is_pp_shared ? 1 : pl); ++j) {
+                        for (int i = 0; i < pp; ++i) {
+                            common_batch_add(batch, 0, i, { j }, i == pp - 1);
+                        }
                     }
-                }
 
-                const auto t_pp_start = ggml_time_us();
+                    const auto t_pp_start = ggml_time_us();
 
-                llama_memory_clear(mem, false);
+                    llama_memory_clear(mem, false);
 
-                if (!decode_helper(ctx, batch, ctx_params.n_batch)) {
-                    LOG_ERR("%s: llama_decode() failed\n", __func__);
-                    return 1;
-                }
+                    if (!decode_helper(ctx, batch, ctx_params.n_batch)) {
+                        LOG_ERR("%s: llama_decode() failed\n", __func__);
+                        return 1;
+                    }
 
-                if (is_pp_shared) {
-                    for (int32_t i = 1; i < pl; ++i) {
-                        llama_memory_seq_cp(mem, 0, i, -1, -1);
+                    if (is_pp_shared) {
+                        for (int32_t i = 1; i < pl; ++i) {
+                            llama_memory_seq_cp(mem, 0, i, -1, -1);
+                        }
                     }
-                }
 
-                const auto t_pp_end = ggml_time_us();
+                    const auto t_pp_end = ggml_time_us();
 
-                const auto t_tg_start = ggml_time_us();
+                    const auto t_tg_start = ggml_time_us();
 
-                for (int i = 0; i < tg; ++i) {
-                    common_batch_clear(batch);
+                    for (int i = 0; i < tg; ++i) {
+                        common_batch_clear(batch);
 
-                    for (int j = 0; j < pl; ++j) {
-                        common_batch_add(batch, 0, pp + i, { j }, true);
+                        for (int j = 0; j < pl; ++j) {
+                            common_batch_add(batch, 0, pp + i, { j }, true);
+                        }
+
+                        if (!decode_helper(ctx, batch, ctx_params.n_batch)) {
+                            LOG_ERR("%s: llama_decode() failed\n", __func__);
+                            return 1;
+                        }
                     }
 
-                    if (!decode_helper(ctx, batch, ctx_params.n_batch)) {
-                        LOG_ERR("%s: llama_decode() failed\n", __func__);
-                        return 1;
+                    const auto t_tg_end = ggml_time_us();
+
+                    const int32_t n_kv = n_ctx_req;
+
+                    const float t_pp = (t_pp_end - t_pp_start) / 1000000.0f;
+                    const float t_tg = (t_tg_end - t_tg_start) / 1000000.0f;
+                    const float t    = t_pp + t_tg;
+
+                    const float speed_pp = is_pp_shared ? pp / t_pp : pl*pp / t_pp;
+                    const float speed_tg = pl*tg / t_tg;
+                    const float speed    = n_kv / t;
+
+                    if(params.batched_bench_output_jsonl) {
+                        LOG(
+                            "{\"n_kv_max\": %d, \"n_batch\": %d, \"n_ubatch\": %d, \"flash_attn\": %d, \"is_pp_shared\": %d, \"n_gpu_layers\": %d, \"n_threads\": %u, \"n_threads_batch\": %u, "
+                            "\"pp\": %d, \"tg\": %d, \"pl\": %d, \"n_kv\": %d, \"t_pp\": %f, \"speed_pp\": %f, \"t_tg\": %f, \"speed_tg\": %f, \"t\": %f, \"speed\": %f}\n",
+                            n_kv_max, params.n_batch, params.n_ubatch, params.flash_attn, params.is_pp_shared, params.n_gpu_layers, ctx_params.n_threads, ctx_params.n_threads_batch,
+                            pp, tg, pl, n_kv, t_pp, speed_pp, t_tg, speed_tg, t, speed
+                        );
+                    } else {
+                        LOG("|%6d | %6d | %4d | %6d | %8.3f | %8.2f | %8.3f | %8.2f | %8.3f | %8.2f |\n", pp, tg, pl, n_kv, t_pp, speed_pp, t_tg, speed_tg, t, speed);
                     }
                 }
+            }
+        }
+
+    }
+
+    if (!params.batched_bench_output_jsonl && std::any_of(scenarios.begin(), scenarios.end(), [](const std::string & s) { return s != "static"; })) {
+        LOG("\n");
+        LOG("|%8s | %6s | %6s | %4s | %6s | %6s | %8s | %8s | %8s | %8s | %8s | %8s |\n", "SCENARIO", "PP", "TG", "B", "N_SEQ", "N_KV", "T s", "S t/s", "STEP ms", "KV_UTIL", "T_MU ms", "N_TOK");
+        LOG("|%8s-|-%6s-|-%6s-|-%4s-|-%6s-|-%6s-|-%8s-|-%8s-|-%8s-|-%8s-|-%8s-|-%8s-|\n", "--------", "------", "------", "----", "------", "------", "--------", "--------", "--------", "--------", "--------", "--------");
+    }
 
-                const auto t_tg_end = ggml_time_us();
+    for (const auto & scenario : scenarios) {
+        if (scenario == "static") {
+            continue;
+        }
 
-                const int32_t n_kv = n_ctx_req;
+        for (        int i_pp = 0; i_pp < (int) n_pp.size(); ++i_pp) {
+            for (    int i_tg = 0; i_tg < (int) n_tg.size(); ++i_tg) {
+                for (int i_pl = 0; i_pl < (int) n_pl.size(); ++i_pl) {
+                    const int pp = n_pp[i_pp];
+                    const int tg = n_tg[i_tg];
+                    const int pl = n_pl[i_pl];
+
+                    // upper bound of the KV cells in use at the same time
+                    int n_ctx_req = 0;
+                    if (scenario == "tree") {
+                        const int group_size = std::max(1, (int) std::sqrt((double) pl));
+                        const int n_groups   = (pl + group_size - 1)/group_size;
+
+                        n_ctx_req = pp/2 + n_groups*(pp/4) + pl*(pp - pp/2 - pp/4 + tg);
+                    } else {
+                        n_ctx_req = pl*(pp + (scenario == "replace" ? 2*tg : tg));
+                    }
 
-                const float t_pp = (t_pp_end - t_pp_start) / 1000000.0f;
-                const float t_tg = (t_tg_end - t_tg_start) / 1000000.0f;
-                const float t    = t_pp + t_tg;
+                    if (n_ctx_req > n_kv_max) {
+                        continue;
+                    }
 
-                const float speed_pp = is_pp_shared ? pp / t_pp : pl*pp / t_pp;
-                const float speed_tg = pl*tg / t_tg;
-                const float speed    = n_kv / t;
+                    bench_result res;
 
-                if(params.batched_bench_output_jsonl) {
-                    LOG(
-                        "{\"n_kv_max\": %d, \"n_batch\": %d, \"n_ubatch\": %d, \"flash_attn\": %d, \"is_pp_shared\": %d, \"n_gpu_layers\": %d, \"n_threads\": %u, \"n_threads_batch\": %u, "
-                        "\"pp\": %d, \"tg\": %d, \"pl\": %d, \"n_kv\": %d, \"t_pp\": %f, \"speed_pp\": %f, \"t_tg\": %f, \"speed_tg\": %f, \"t\": %f, \"speed\": %f}\n",
-                        n_kv_max, params.n_batch, params.n_ubatch, params.flash_attn, params.is_pp_shared, params.n_gpu_layers, ctx_params.n_threads, ctx_params.n_threads_batch,
-                        pp, tg, pl, n_kv, t_pp, speed_pp, t_tg, speed_tg, t, speed
-                    );
-                } else {
-                    LOG("|%6d | %6d | %4d | %6d | %8.3f | %8.2f | %8.3f | %8.2f | %8.3f | %8.2f |\n", pp, tg, pl, n_kv, t_pp, speed_pp, t_tg, speed_tg, t, speed);
+                    const bool ok = scenario == "tree" ?
+                        bench_tree   (ctx, batch, ctx_params.n_batch,           pp, tg, pl, res) :
+                        bench_serving(ctx, batch, ctx_params.n_batch, scenario, pp, tg, pl, res);
+
+                    if (!ok) {
+                        LOG_ERR("%s: scenario '%s' failed, pp = %d, tg = %d, pl = %d\n", __func__, scenario.c_str(), pp, tg, pl);
+                        continue;
+                    }
+
+                    const float speed   = res.n_tokens / res.t;
+                    const float t_step  = res.n_steps > 0 ? 1e3*res.t_steps/res.n_steps : 0.0;
+                    const float t_mem   = 1e3*res.t_mem;
+
+                    if (params.batched_bench_output_jsonl) {
+                        LOG(
+                            "{\"n_kv_max\": %d, \"n_batch\": %d, \"n_ubatch\": %d, \"flash_attn\": %d, \"n_gpu_layers\": %d, \"n_threads\": %u, \"n_threads_batch\": %u, "
+                            "\"scenario\": \"%s\", \"pp\": %d, \"tg\": %d, \"pl\": %d, \"n_seq\": %d, \"n_kv\": %d, \"n_tokens\": %d, \"t\": %f, \"speed\": %f, "
+                            "\"n_steps\": %d, \"t_step_ms\": %f, \"kv_util\": %f, \"t_mem_update_ms\": %f}\n",
+                            n_kv_max, params.n_batch, params.n_ubatch, params.flash_attn, params.n_gpu_layers, ctx_params.n_threads, ctx_params.n_threads_batch,
+                            scenario.c_str(), pp, tg, pl, res.n_seq, res.n_kv_max, res.n_tokens, res.t, speed,
+                            res.n_steps, t_step, res.kv_util, t_mem
+                        );
+                    } else {
+                        LOG("|%8s | %6d | %6d | %4d | %6d | %6d | %8.3f | %8.2f | %8.2f | %8.3f | %8.2f | %8d |\n",
+                            scenario.c_str(), pp, tg, pl, res.n_seq, res.n_kv_max, res.t, speed, t_step, res.kv_util, t_mem, res.n_tokens);
+                    }
                 }
             }
         }
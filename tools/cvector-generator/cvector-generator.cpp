@@ -17,6 +17,7 @@
 
 #include <algorithm>
 #include <climits>
+#include <cstdlib>
 #include <cstdio>
 #include <cstring>
 #include <fstream>
@@ -44,6 +45,7 @@ static void print_usage(int, char ** argv) {
     printf("\n    CPU only:   %s -m ./llama-3.Q4_K_M.gguf\n", argv[0]);
     printf("\n    with GPU:   %s -m ./llama-3.Q4_K_M.gguf -ngl 99\n", argv[0]);
     printf("\n    advanced:   %s -m ./llama-3.Q4_K_M.gguf -ngl 99 --pca-iter 2000 --pca-batch 100\n", argv[0]);
+    printf("\n    batched:    %s -m ./llama-3.Q4_K_M.gguf -ngl 99 -np 16 -b 4096\n", argv[0]);
     printf("\n    using mean: %s -m ./llama-3.Q4_K_M.gguf --method mean\n", argv[0]);
     printf("\n");
 }
@@ -51,130 +53,22 @@ static void print_usage(int, char ** argv) {
 //////////////////////////////////////////////////
 
 
-// cb_eval is reused for each pair of positive - negative prompt
+// cb_eval accumulates the differences of the hidden states for each batch of positive - negative prompt pairs
 struct callback_data {
-    ggml_context * ctx_ggml = nullptr;   // holds v_pos, v_neg, v_diff_filtered
+    PCA::pca_model * model = nullptr;
 
-    int n_layers = 0;
-    int n_tokens = 0;
-    bool is_eval_pos = true;
+    int n_layers = 0; // number of layers to collect, the final layer is ignored
+    int n_tokens = 0; // number of tokens in the current batch
 
-    // each element of the vector correspond to one layer
-    std::vector<struct ggml_tensor *> v_pos; // vector of matrices of size [n_embd, n_tokens]
-    std::vector<struct ggml_tensor *> v_neg; // vector of matrices of size [n_embd, n_tokens]
-    std::vector<struct ggml_tensor *> v_diff_filtered;   // vector of matrices of size [n_embd, n_nonzero_rows]. NOTE: n_nonzero_rows maybe different for each layer
-
-    // save a tensor into either v_pos or v_neg (decided by is_eval_pos)
-    void save_tensor_for_layer(struct ggml_tensor * t) {
-        GGML_ASSERT(t->type == GGML_TYPE_F32);
-
-        if (ctx_ggml == nullptr) {
-            // alloc a new ctx_ggml if needed
-            struct ggml_init_params params_ggml = {
-                /*.mem_size   =*/ ggml_tensor_overhead() * n_layers * 3u,
-                /*.mem_buffer =*/ NULL,
-                /*.no_alloc   =*/ true,
-            };
-            ctx_ggml = ggml_init(params_ggml);
-        }
-
-        // copy tensor data
-        auto n_bytes = ggml_nbytes(t);
-        struct ggml_tensor * t_layer = ggml_new_tensor_2d(ctx_ggml, t->type, t->ne[0], t->ne[1]);
-        t_layer->data = malloc(n_bytes); // TODO @ngxson : get rid of this malloc somehow
-        ggml_backend_tensor_get(t, t_layer->data, 0, n_bytes);
-        ggml_set_name(t_layer, ggml_get_name(t));
-        //print_debug_tensor(t_layer);
-
-        if (is_eval_pos) {
-            v_pos.push_back(t_layer);
-        } else {
-            v_neg.push_back(t_layer);
-        }
-    }
-
-    // calculate diff (v_pos - v_neg) and place the result back to v_pos
-    // all zero rows in the diff tensor will also be removed
-    // NOTE: final layer is ignored. we only have (n_layers - 1) to process
-    std::vector<struct ggml_tensor *> calc_diff() {
-        for (float il = 0; il < v_pos.size(); il++) {
-            float * a = (float *) v_pos[il]->data;
-            float * b = (float *) v_neg[il]->data;
-            size_t n_elem = ggml_nelements(v_pos[il]);
-            for (size_t j = 0; j < n_elem; j++) {
-                a[j] -= b[j];
-            }
-            //print_debug_tensor(v_pos[i]);
-            auto diff_filtered = filter_nonzero_rows(v_pos[il]);
-            v_diff_filtered.push_back(diff_filtered);
-        }
-        return v_diff_filtered; // for convinient, we return the result std::vector
-    }
-
-    // delete zero rows from a given 2D tensor
-    struct ggml_tensor * filter_nonzero_rows(struct ggml_tensor * a) {
-        //printf("filter_nonzero_rows\n");
-        auto is_row_all_zeros = [](struct ggml_tensor * t, int row, float eps) -> bool {
-            // check if given row containing all zero elements
-            int n_cols = t->ne[0]; // hint: should be equal to n_embd
-            for (int col = 0; col < n_cols; ++col) {
-                if (ggml_get_f32_nd(t, col, row, 0, 0) > eps) {
-                    return false;
-                }
-            }
-            return true;
-        };
-        std::vector<int> rows_to_copy; // the idx of non-zero cols (to be copied to row of diff_filtered)
-        for (int i_row = 0; i_row < a->ne[1]; i_row++) {
-            if (!is_row_all_zeros(a, i_row, 1e-6)) {
-                rows_to_copy.push_back(i_row);
-            }
-        }
-
-        // get "n_nonzero_rows" for the output "diff_filtered"
-        int n_nonzero_rows = rows_to_copy.size();
-        //printf("n_nonzero_rows: %d\n", n_nonzero_rows);
-        int n_embd = a->ne[0];
-        GGML_ASSERT(n_nonzero_rows > 0);
-
-        // diff_filtered: [n_embd, n_nonzero_rows]
-        struct ggml_tensor * diff_filtered = ggml_new_tensor_2d(
-            ctx_ggml, GGML_TYPE_F32, n_embd, n_nonzero_rows);
-        ggml_format_name(diff_filtered, "diff_filtered_%s", a->name);
-        diff_filtered->data = malloc(ggml_nbytes(diff_filtered));
-
-        // copy non-zero rows
-        for (int dest_row = 0; dest_row < n_nonzero_rows; dest_row++) {
-            int src_row = rows_to_copy[dest_row];
-            for (int i = 0; i < n_embd; i++) {
-                float src_elem = ggml_get_f32_nd(a, i, src_row, 0, 0);
-                ggml_set_f32_nd(diff_filtered, i, dest_row, 0, 0, src_elem);
-            }
-        }
-
-        //print_debug_tensor(diff_filtered);
+    // the rows of the positive tokens in the batch and the rows of the negative tokens at the same positions
+    std::vector<int32_t> idx_pos;
+    std::vector<int32_t> idx_neg;
 
-        return diff_filtered;
-    }
-
-    // we don't implement destructor, because we want to reuse callback_data. we just want to free the tensors
-    void reset() {
-        for (auto ptr : v_pos) free(ptr->data);
-        for (auto ptr : v_neg) free(ptr->data);
-        for (auto ptr : v_diff_filtered) free(ptr->data);
-        v_pos.clear();
-        v_neg.clear();
-        v_diff_filtered.clear();
-        if (ctx_ggml) {
-            ggml_free(ctx_ggml);
-        }
-        ctx_ggml = nullptr;
-    }
+    std::vector<bool> collected; // the layers that were accumulated for the current batch
 };
 
 /**
- * process_ctx is used to store the ggml context for pre-post processing the diff vectors
- * in short, input => v_diff and output => v_final
+ * process_ctx is used to store the ggml context for the output vectors
  */
 struct train_context {
     ggml_context * ctx_ggml;
@@ -187,82 +81,26 @@ struct train_context {
 
     // each element of the vector correspond to one layer
     // NOTE: the last layer is discard. therefore, we will have (n_layers - 1) elements here
-    // NOTE (2): v_diff is transposed from v_diff_tmp
-    std::vector<struct ggml_tensor *> v_diff;  // vector of matrices of size [m, n_embd] where m ~ n_tokens * n_completions (v_diff contains no zero-rows)
     std::vector<struct ggml_tensor *> v_final; // vector of vectors of size [n_embd] to be written to file
 
-    // to easily re-alloc when concat v_diff, we temporary store v_diff in a vector instead of a tensor
-    // v_diff_tmp will get converted unto v_diff later on
-    std::vector<std::vector<uint8_t>> v_diff_tmp;
-
     train_context(int n_embd_, int n_layers_) {
         n_embd = n_embd_;
         n_layers = n_layers_;
         struct ggml_init_params params_ggml = {
-            /*.mem_size   =*/ ggml_tensor_overhead() * (n_layers - 1) * 2u,
+            /*.mem_size   =*/ ggml_tensor_overhead() * (n_layers - 1),
             /*.mem_buffer =*/ NULL,
             /*.no_alloc   =*/ true,
         };
         ctx_ggml = ggml_init(params_ggml);
         for (int il = 0; il < n_layers - 1; il++) {
-            std::vector<uint8_t> empty;
-            v_diff_tmp.push_back(empty);
             auto t = ggml_new_tensor_1d(ctx_ggml, GGML_TYPE_F32, n_embd);
             t->data = malloc(ggml_nbytes(t)); // TODO: get rid of malloc if possible
             v_final.push_back(t);
         }
     }
 
-    // add new rows into existing tensor in v_diff_tmp
-    void concat_diff_tmp(const std::vector<struct ggml_tensor *> & diff_filtered) {
-        GGML_ASSERT((int) diff_filtered.size() == n_layers - 1);
-        for (int il = 0; il < n_layers - 1; il++) {
-            auto t = diff_filtered[il];
-            auto & diff_tmp = v_diff_tmp[il];
-            size_t curr_size = diff_tmp.size();
-            diff_tmp.resize(curr_size + ggml_nbytes(t));
-            memcpy(diff_tmp.data() + curr_size, t->data, ggml_nbytes(t));
-        }
-    }
-
-    // build the v_diff tensors from v_diff_tmp (v_diff need to be transposed)
-    // TODO @ngxson : maybe add option NOT to transpose v_diff; will be useful for "mean" method
-    void build_v_diff(bool transpose) {
-        printf("build_v_diff\n");
-        for (int il = 0; il < n_layers - 1; il++) {
-            auto & diff_tmp = v_diff_tmp[il];
-            int n_elem = diff_tmp.size() / sizeof(float);
-            GGML_ASSERT(n_elem % n_embd == 0);
-            int n_rows = n_elem / n_embd;
-            struct ggml_tensor * diff = transpose
-                ? ggml_new_tensor_2d(ctx_ggml, GGML_TYPE_F32, n_rows, n_embd)
-                : ggml_new_tensor_2d(ctx_ggml, GGML_TYPE_F32, n_embd, n_rows);
-            ggml_set_name(diff, (std::string("diff_") + std::to_string(il)).c_str());
-            diff->data = malloc(ggml_nbytes(diff)); // TODO: get rid of this malloc if possible
-            if (transpose) {
-                // copy data & transpose
-                float * arr = (float *) diff_tmp.data();
-                for (int ir = 0; ir < n_rows; ++ir) {
-                    for (int ic = 0; ic < n_embd; ++ic) {
-                        float f = arr[ir*n_embd + ic];
-                        ggml_set_f32_nd(diff, ir, ic, 0, 0, f);
-                    }
-                }
-            } else {
-                // only copy
-                memcpy(diff->data, diff_tmp.data(), ggml_nbytes(diff));
-            }
-            v_diff.push_back(diff);
-            print_debug_tensor(diff);
-            // free memory of diff_tmp
-            diff_tmp.resize(0);
-        }
-    }
-
     ~train_context() {
         for (auto ptr : v_final) free(ptr->data);
-        for (auto ptr : v_diff) free(ptr->data);
-        // no need to free v_diff_tmp, since we didn't use malloc
         ggml_free(ctx_ggml);
     }
 };
@@ -325,7 +163,7 @@ static std::vector<std::string> ctrlvec_load_prompt_file(std::string path, bool
 
 static bool cb_eval(struct ggml_tensor * t, bool ask, void * user_data) {
     auto * cb_data = (callback_data *) user_data;
-    static const char * l_out_name = "l_out";
+    static const char * l_out_name = "l_out-";
     const bool is_l_out = strncmp(t->name, l_out_name, strlen(l_out_name)) == 0;
 
     if (ask) {
@@ -336,17 +174,38 @@ static bool cb_eval(struct ggml_tensor * t, bool ask, void * user_data) {
         return true;
     }
 
-    // save the tensor to current context
-    cb_data->save_tensor_for_layer(t);
+    const int il = std::atoi(t->name + strlen(l_out_name));
+    if (il < 0 || il >= cb_data->n_layers) {
+        return true;
+    }
+
+    // accumulate the differences of the current batch on the device
+    if (!cb_data->model->accumulate(il, t, cb_data->idx_pos, cb_data->idx_neg)) {
+        fprintf(stderr, "%s : failed to accumulate the hidden states of layer %d\n", __func__, il);
+        return false;
+    }
+
+    cb_data->collected[il] = true;
     return true;
 }
 
-static bool get_hidden_layers(llama_context * ctx, std::vector<llama_token> & tokens) {
+static bool get_hidden_layers(llama_context * ctx, llama_batch & batch, callback_data & cb_data) {
     llama_memory_clear(llama_get_memory(ctx), true);
-    if (llama_decode(ctx, llama_batch_get_one(tokens.data(), tokens.size()))) {
+
+    cb_data.n_tokens = batch.n_tokens;
+    cb_data.collected.assign(cb_data.n_layers, false);
+
+    if (llama_decode(ctx, batch)) {
         fprintf(stderr, "%s : failed to eval\n", __func__);
         return false;
     }
+
+    // the batch must be evaluated in a single ubatch for the rows to match the batch
+    if (std::find(cb_data.collected.begin(), cb_data.collected.end(), false) != cb_data.collected.end()) {
+        fprintf(stderr, "%s : the hidden states of some layers were not collected, the batch was split\n", __func__);
+        return false;
+    }
+
     return true;
 }
 
@@ -406,6 +265,13 @@ int main(int argc, char ** argv) {
     }
 
 
+    // each prompt pair uses 2 sequences: positive and negative
+    const int n_pairs = std::max(1, params.n_parallel);
+
+    params.n_parallel = 2*n_pairs;
+    params.kv_unified = true;          // keep the tokens of the batch in order in the ubatch
+    params.n_ubatch   = params.n_batch; // evaluate each batch in a single ubatch
+
     callback_data cb_data;
 
     // pass the callback to the backend scheduler
@@ -424,10 +290,17 @@ int main(int argc, char ** argv) {
     llama_model * model = llama_init.model.get();
     llama_context * ctx = llama_init.context.get();
 
+    if (model == NULL || ctx == NULL) {
+        fprintf(stderr, "%s : failed to init\n", __func__);
+        return 1;
+    }
+
     // int n_ctx = llama_n_ctx(ctx);
     int n_layers = llama_model_n_layer(model);
     int n_embd = llama_model_n_embd(model);
 
+    const int n_tokens_max = std::min(llama_n_batch(ctx), llama_n_ubatch(ctx));
+
     // get model hint param (a.k.a model arch name)
     char model_hint[128];
     llama_model_meta_val_str(model, "general.architecture", model_hint, 128);
@@ -436,9 +309,11 @@ int main(int argc, char ** argv) {
     train_context ctx_train(n_embd, n_layers);
 
     // load and prepare entries for training
-    prepare_entries(params, ctx_train);
+    if (prepare_entries(params, ctx_train) != 0) {
+        return 1;
+    }
 
-    // we have to pretokenize everything because otherwise we don't know how much overhead to allocate ctx_diffs_wrapped
+    // we have to pretokenize everything because otherwise we don't know how to group the pairs in batches
     std::vector<tokenized_prompt> tokenized_prompts;
     size_t n_total_tokens = 0;
     for (size_t i = 0; i < ctx_train.positive_entries.size(); ++i) {
@@ -449,54 +324,88 @@ int main(int argc, char ** argv) {
 
     std::cout << "n_total_tokens: " << n_total_tokens << std::endl;
 
-    for(size_t i = 0; i < ctx_train.positive_entries.size(); ++i) {
-        bool success = false;
-        tokenized_prompt t = tokenized_prompts[i];
-        cb_data.n_layers = n_layers;
-        cb_data.n_tokens = t.max_seq_len;
+    bool use_pca = params.cvector_dimre_method == DIMRE_METHOD_PCA;
+
+    // the differences are accumulated on the device while evaluating the prompts
+    // NOTE: final layer is ignored. we only have (n_layers - 1) to process
+    PCA::pca_model pca_model(n_embd, n_layers - 1, n_tokens_max, use_pca, params.n_pca_batch, params.cpuparams.n_threads);
 
-        printf("Evaluating prompt[%d/%d]: \"%s\" - \"%s\" (%d tokens)\n",
-            (int) i+1, (int) ctx_train.positive_entries.size(),
-            tokens_to_str(ctx, t.tokens_pos.cbegin(), t.tokens_pos.cend()).c_str(),
-            tokens_to_str(ctx, t.tokens_neg.cbegin(), t.tokens_neg.cend()).c_str(),
-            (int) t.max_seq_len);
+    cb_data.model    = &pca_model;
+    cb_data.n_layers = n_layers - 1;
 
-        cb_data.is_eval_pos = true;
-        success = get_hidden_layers(ctx, t.tokens_pos);
-        if (!success) break;
+    llama_batch batch = llama_batch_init(n_tokens_max, 0, 1);
 
-        cb_data.is_eval_pos = false;
-        success = get_hidden_layers(ctx, t.tokens_neg);
-        if (!success) break;
+    const size_t n_prompts = tokenized_prompts.size();
 
-        // calculate diff and remove all zero rows
-        auto v_diff_filtered = cb_data.calc_diff();
+    for (size_t i0 = 0; i0 < n_prompts; ) {
+        common_batch_clear(batch);
+        cb_data.idx_pos.clear();
+        cb_data.idx_neg.clear();
 
-        // save & concat the filtered v_diff to ctx_train
-        ctx_train.concat_diff_tmp(v_diff_filtered);
+        // fill the batch with up to n_pairs prompt pairs
+        size_t i1 = i0;
+        for (; i1 < n_prompts && (int) (i1 - i0) < n_pairs; ++i1) {
+            const tokenized_prompt & t = tokenized_prompts[i1];
+            const int n_seq_tokens = t.max_seq_len;
 
-        // reset for next iteration
-        cb_data.reset();
-    }
+            if (batch.n_tokens + 2*n_seq_tokens > n_tokens_max) {
+                break;
+            }
 
-    // done with the model, we can now free it to make gain some memory
-    printf("Done evaluate prompts, unload model...\n");
+            printf("Evaluating prompt[%d/%d]: \"%s\" - \"%s\" (%d tokens)\n",
+                (int) i1+1, (int) n_prompts,
+                tokens_to_str(ctx, t.tokens_pos.cbegin(), t.tokens_pos.cend()).c_str(),
+                tokens_to_str(ctx, t.tokens_neg.cbegin(), t.tokens_neg.cend()).c_str(),
+                n_seq_tokens);
 
-    bool use_pca = params.cvector_dimre_method == DIMRE_METHOD_PCA;
+            const llama_seq_id seq_pos = 2*(i1 - i0);
+            const llama_seq_id seq_neg = seq_pos + 1;
+
+            for (int k = 0; k < n_seq_tokens; ++k) {
+                cb_data.idx_pos.push_back(batch.n_tokens + k);
+                cb_data.idx_neg.push_back(batch.n_tokens + n_seq_tokens + k);
+            }
+
+            for (int k = 0; k < n_seq_tokens; ++k) {
+                common_batch_add(batch, t.tokens_pos[k], k, { seq_pos }, k == n_seq_tokens - 1);
+            }
+            for (int k = 0; k < n_seq_tokens; ++k) {
+                common_batch_add(batch, t.tokens_neg[k], k, { seq_neg }, k == n_seq_tokens - 1);
+            }
+        }
 
-    // prepare ctx_train for PCA
-    ctx_train.build_v_diff(use_pca);
+        if (i1 == i0) {
+            fprintf(stderr, "%s : prompt pair %d has %d tokens, more than the batch size %d\n",
+                __func__, (int) i0+1, 2*(int) tokenized_prompts[i0].max_seq_len, n_tokens_max);
+            llama_batch_free(batch);
+            return 1;
+        }
+
+        if (!get_hidden_layers(ctx, batch, cb_data)) {
+            llama_batch_free(batch);
+            return 1;
+        }
+
+        i0 = i1;
+    }
+
+    llama_batch_free(batch);
+
+    printf("Done evaluate prompts\n");
 
     if (use_pca) {
         // run PCA
         PCA::pca_params pca_params;
-        pca_params.n_threads    = params.cpuparams.n_threads;
         pca_params.n_batch      = params.n_pca_batch;
         pca_params.n_iterations = params.n_pca_iterations;
-        PCA::run_pca(pca_params, ctx_train.v_diff, ctx_train.v_final);
+        PCA::run_pca(pca_params, pca_model, ctx_train.v_final);
     } else {
         // run mean
-        mean::run(ctx_train.v_diff, ctx_train.v_final);
+        std::vector<std::vector<float>> v_sum;
+        for (int il = 0; il < n_layers - 1; ++il) {
+            v_sum.push_back(pca_model.get_sum(il));
+        }
+        mean::run(v_sum, ctx_train.v_final);
     }
 
     // write output vectors to gguf
@@ -1,15 +1,11 @@
 #include "common.h"
 #include "llama.h"
 #include "ggml.h"
+#include "ggml-alloc.h"
+#include "ggml-backend.h"
+#include "ggml-cpu.h"
 
-#ifdef GGML_USE_CUDA
-#include "ggml-cuda.h"
-#endif
-
-#ifdef GGML_USE_METAL
-#include "ggml-metal.h"
-#endif
-
+#include <algorithm>
 #include <cstdio>
 #include <ctime>
 #include <random>
@@ -18,6 +14,9 @@
 
 #define DEBUG_POS 5
 
+// max number of nodes of a graph of power iterations - the layers are split in several graphs if needed
+#define PCA_MAX_NODES 8192
+
 static void print_debug_tensor(struct ggml_tensor * t, bool with_data = true) {
     printf("%s: %s (%s): [%d, %d]\n", __func__, t->name, ggml_type_name(t->type), (int) t->ne[0], (int) t->ne[1]);
     if (!with_data) return;
@@ -32,284 +31,320 @@ namespace PCA {
 
 // input params for PCA computations
 struct pca_params {
-    int n_threads = 1;
     int n_batch = 20; // number of iterations do to in one batch. larger the batch, more memory is used
     int n_iterations = 1000;
     float tolerance = 1e-7;
-
-    // for debugging
-    int i_layer = 0;
-    int n_layers = 0;
-};
-
-// result from each iteration
-struct pca_result {
-    struct ggml_tensor * calculated_square = NULL;
-    std::vector<struct ggml_tensor *> eigenvectors;
-    std::vector<float> distances;
 };
 
+// statistics of the differences of the hidden states (positive - negative) of each layer, accumulated on the device
+// only the statistics are kept, so the memory does not grow with the number of prompts:
+// - square: sum of d*d^T over all the difference vectors d, the PCA runs on it
+// - sum:    sum of all the difference vectors, used by the "mean" method
+// the rows where the positive and negative prompts agree are zero and do not contribute to either of them
 struct pca_model {
-    ggml_backend_t backend = NULL;
-    ggml_backend_buffer_t buffer;
-    struct ggml_context * ctx;      // context to compute graph on target device
-    struct ggml_context * ctx_host; // host context to store results
-
-    // tensors on target device
-    struct ggml_tensor * dev_input;
-    struct ggml_tensor * dev_square;
-    struct ggml_tensor * dev_eigenvector;
-
-    pca_model(struct ggml_tensor * t_input) {
-#ifdef GGML_USE_CUDA
-        fprintf(stderr, "%s: using CUDA backend\n", __func__);
-        backend = ggml_backend_cuda_init(0); // init device 0
-        if (!backend) {
-            fprintf(stderr, "%s: ggml_backend_cuda_init() failed\n", __func__);
-        }
-#endif
-
-// TODO: enable Metal support when support for GGML_OP_SQRT is added
-// #ifdef GGML_USE_METAL
-//         fprintf(stderr, "%s: using Metal backend\n", __func__);
-//         backend = ggml_backend_metal_init();
-//         if (!backend) {
-//             fprintf(stderr, "%s: ggml_backend_metal_init() failed\n", __func__);
-//         }
-// #endif
-
-        // if there aren't GPU Backends fallback to CPU backend
-        if (!backend) {
-            backend = ggml_backend_cpu_init();
+    ggml_backend_t backend     = NULL; // GPU backend if any, CPU otherwise
+    ggml_backend_t backend_cpu = NULL;
+
+    ggml_backend_sched_t  sched  = NULL;
+    ggml_backend_buffer_t buffer = NULL;
+    struct ggml_context * ctx    = NULL; // persistent tensors on the device
+
+    int n_embd;
+    int n_layers;
+    int n_threads;
+    int n_nodes_max;
+
+    struct ggml_tensor * dev_hidden = NULL; // [n_embd, n_tokens_max] hidden states of a layer for the current batch
+
+    // each element of the vectors correspond to one layer
+    std::vector<struct ggml_tensor *> dev_square;      // [n_embd, n_embd]
+    std::vector<struct ggml_tensor *> dev_sum;         // [n_embd]
+    std::vector<struct ggml_tensor *> dev_eigenvector; // [n_embd]
+    struct ggml_tensor * dev_distance = NULL;          // [n_layers]
+
+    struct ggml_context * ctx_view = NULL; // views of dev_hidden
+
+    std::vector<uint8_t> buf_graph;
+
+    pca_model(int n_embd_, int n_layers_, int n_tokens_max, bool calc_square, int n_pca_batch, int n_threads_)
+            : n_embd(n_embd_), n_layers(n_layers_), n_threads(n_threads_) {
+        n_nodes_max = std::max({ GGML_DEFAULT_GRAPH_SIZE, PCA_MAX_NODES, 5*n_pca_batch + 13 });
+
+        backend_cpu = ggml_backend_cpu_init();
+
+        backend = ggml_backend_init_by_type(GGML_BACKEND_DEVICE_TYPE_GPU, NULL);
+        if (backend) {
+            fprintf(stderr, "%s: using %s backend\n", __func__, ggml_backend_name(backend));
         }
 
-        const int num_tensors = 4;
         struct ggml_init_params params {
-            /*.mem_size   =*/ ggml_tensor_overhead() * num_tensors,
+            /*.mem_size   =*/ ggml_tensor_overhead() * (3*n_layers + 2),
             /*.mem_buffer =*/ NULL,
             /*.no_alloc   =*/ true,
         };
         ctx = ggml_init(params);
 
-        auto n_samples = t_input->ne[0];
-        auto n_embd    = t_input->ne[1];
+        dev_hidden = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd, n_tokens_max);
+        ggml_set_name(dev_hidden, "dev_hidden");
+
+        for (int il = 0; il < n_layers; ++il) {
+            dev_sum.push_back(ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_embd));
+            ggml_format_name(dev_sum.back(), "dev_sum_%d", il);
 
-        dev_input       = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_samples, n_embd);
-        dev_square      = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd,    n_embd);
-        dev_eigenvector = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_embd);
+            if (calc_square) {
+                dev_square.push_back(ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd, n_embd));
+                ggml_format_name(dev_square.back(), "dev_square_%d", il);
 
-        ggml_set_name(dev_input,       "dev_input");
-        ggml_set_name(dev_square,      "dev_square");
-        ggml_set_name(dev_eigenvector, "dev_eigenvector");
-        buffer = ggml_backend_alloc_ctx_tensors(ctx, backend);
-        ggml_backend_tensor_set(dev_input, t_input->data, 0, ggml_nbytes(t_input));
+                dev_eigenvector.push_back(ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_embd));
+                ggml_format_name(dev_eigenvector.back(), "dev_eigenvector_%d", il);
+            }
+        }
+        dev_distance = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_layers);
+        ggml_set_name(dev_distance, "dev_distance");
 
-        // initialize eigenvector to random normalized vector
-        {
-            std::vector<float> random_vec(ggml_nelements(dev_eigenvector), 0.0);
+        struct ggml_init_params params_view {
+            /*.mem_size   =*/ ggml_tensor_overhead(),
+            /*.mem_buffer =*/ NULL,
+            /*.no_alloc   =*/ true,
+        };
+        ctx_view = ggml_init(params_view);
+
+        // the square matrices of all the layers may not fit in the memory of the device
+        if (backend) {
+            buffer = ggml_backend_alloc_ctx_tensors(ctx, backend);
+            if (!buffer) {
+                fprintf(stderr, "%s: not enough device memory for the statistics, using the CPU\n", __func__);
+                ggml_backend_free(backend);
+                backend = NULL;
+            }
+        }
+        if (!backend) {
+            backend = backend_cpu;
+            buffer  = ggml_backend_alloc_ctx_tensors(ctx, backend);
+            GGML_ASSERT(buffer);
+        }
+        ggml_backend_buffer_clear(buffer, 0);
+
+        // the ops missing on the device fall back to the CPU
+        std::vector<ggml_backend_t> backends = { backend };
+        if (backend != backend_cpu) {
+            backends.push_back(backend_cpu);
+        }
+        sched = ggml_backend_sched_new(backends.data(), NULL, backends.size(), n_nodes_max, false, true);
+
+        ggml_backend_cpu_set_n_threads(backend_cpu, n_threads);
+
+        // initialize eigenvectors to random normalized vectors
+        if (calc_square) {
             std::default_random_engine generator(static_cast<unsigned int>(std::time(0)));
             std::uniform_real_distribution<float> distribution(0.0, 1.0);
-            float sum_sqr = 0.0; // for normalizing random_vec
-            for (size_t i = 0; i < random_vec.size(); ++i) {
-                float f = distribution(generator);
-                sum_sqr += f * f;
-                random_vec[i] = f;
-            }
-            // normalize it
-            float random_vec_norm = std::sqrt(sum_sqr);
-            for (size_t i = 0; i < random_vec.size(); ++i) {
-                random_vec[i] /= random_vec_norm;
+            std::vector<float> random_vec(n_embd, 0.0);
+            for (int il = 0; il < n_layers; ++il) {
+                float sum_sqr = 0.0; // for normalizing random_vec
+                for (size_t i = 0; i < random_vec.size(); ++i) {
+                    float f = distribution(generator);
+                    sum_sqr += f * f;
+                    random_vec[i] = f;
+                }
+                // normalize it
+                float random_vec_norm = std::sqrt(sum_sqr);
+                for (size_t i = 0; i < random_vec.size(); ++i) {
+                    random_vec[i] /= random_vec_norm;
+                }
+                ggml_backend_tensor_set(dev_eigenvector[il], random_vec.data(), 0, ggml_nbytes(dev_eigenvector[il]));
             }
-            ggml_backend_tensor_set(dev_eigenvector, random_vec.data(), 0, ggml_nbytes(dev_eigenvector));
         }
     }
 
     ~pca_model() {
+        ggml_backend_sched_free(sched);
+        ggml_free(ctx_view);
         ggml_free(ctx);
         ggml_backend_buffer_free(buffer);
-        ggml_backend_free(backend);
+        if (backend != backend_cpu) {
+            ggml_backend_free(backend);
+        }
+        ggml_backend_free(backend_cpu);
     }
-};
 
-static struct ggml_cgraph * build_graph_piter(
-        const struct pca_params & params,
-        const pca_model & model,
-        bool calc_square = false) {
-    GGML_ASSERT(params.n_batch > 0);
-    // TODO: buf_size must be able to scale with params.n_batch
-    static size_t buf_size = ggml_tensor_overhead()*GGML_DEFAULT_GRAPH_SIZE + ggml_graph_overhead();
-    static std::vector<uint8_t> buf(buf_size);
-
-    struct ggml_init_params params0 = {
-        /*.mem_size   =*/ buf_size,
-        /*.mem_buffer =*/ buf.data(),
-        /*.no_alloc   =*/ true, // the tensors will be allocated later by ggml_allocr_alloc_graph()
-    };
-    // create a temporally context to build the graph
-    struct ggml_context * ctx0 = ggml_init(params0);
-    struct ggml_cgraph * gf = ggml_new_graph(ctx0);
-
-    // turn v_diff_original into square matrix if needed
-    struct ggml_tensor * tmp_square;
-    if (calc_square) {
-        tmp_square = ggml_mul_mat(ctx0, model.dev_input, model.dev_input);
-        ggml_set_name(tmp_square, "tmp_square");
+    // prepare a temporary context to build a graph of n_nodes nodes
+    struct ggml_context * graph_ctx(size_t n_nodes) {
+        const size_t buf_size = ggml_tensor_overhead()*n_nodes + ggml_graph_overhead_custom(n_nodes, false);
+        buf_graph.resize(buf_size);
+
+        struct ggml_init_params params0 = {
+            /*.mem_size   =*/ buf_size,
+            /*.mem_buffer =*/ buf_graph.data(),
+            /*.no_alloc   =*/ true, // the tensors will be allocated later by the scheduler
+        };
+        return ggml_init(params0);
     }
 
-    struct ggml_tensor * b_tensor;
-    struct ggml_tensor * distance;
-    struct ggml_tensor * old_eigen    = model.dev_eigenvector;
-    struct ggml_tensor * input_square = calc_square ? tmp_square : model.dev_square;
+    // accumulate the differences of the rows idx_pos[i] and idx_neg[i] of the hidden states t of layer il
+    // t is copied to the device without going through the host when both are on the same device
+    bool accumulate(int il, struct ggml_tensor * t, const std::vector<int32_t> & idx_pos, const std::vector<int32_t> & idx_neg) {
+        GGML_ASSERT(t->type == GGML_TYPE_F32 && t->ne[0] == n_embd && t->ne[1] <= dev_hidden->ne[1]);
+        GGML_ASSERT(ggml_is_contiguous(t));
+        GGML_ASSERT(idx_pos.size() == idx_neg.size() && !idx_pos.empty());
 
-    for (int i = 0; i < params.n_batch; ++i) {
-        // b_tensor = square * eigenvector^T
-        b_tensor = ggml_mul_mat(ctx0, input_square, old_eigen);
-        ggml_set_name(b_tensor, "b_tensor");
+        ggml_reset(ctx_view);
+        struct ggml_tensor * hidden = ggml_view_2d(ctx_view, dev_hidden, n_embd, t->ne[1], dev_hidden->nb[1], 0);
+        ggml_backend_view_init(hidden);
 
-        // normalize
-        b_tensor = ggml_div_inplace(ctx0,
-            b_tensor,
-            ggml_sqrt_inplace(ctx0, ggml_sum_rows(ctx0, ggml_sqr(ctx0, b_tensor)))
-        );
-        ggml_format_name(b_tensor, "b_tensor_norm_%d", i);
+        ggml_backend_tensor_copy(t, hidden);
 
-        // calculate distance(new eigenvector - old eigenvector)
-        // we don't use ggml_sub because it may not be implemented on GPU backend
-        struct ggml_tensor * new_sub_old = ggml_add(ctx0, old_eigen, ggml_scale(ctx0, b_tensor, -1));
-        distance = ggml_sqrt_inplace(ctx0,
-            ggml_sum_rows(ctx0, ggml_sqr_inplace(ctx0, new_sub_old)));
-        ggml_format_name(distance, "distance_%d", i);
+        const size_t n_nodes = 16;
+        struct ggml_context * ctx0 = graph_ctx(n_nodes);
+        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, n_nodes, false);
 
-        old_eigen = b_tensor;
+        struct ggml_tensor * inp_pos = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, idx_pos.size());
+        struct ggml_tensor * inp_neg = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, idx_neg.size());
+        ggml_set_input(inp_pos);
+        ggml_set_input(inp_neg);
 
-        // build operations nodes
-        ggml_build_forward_expand(gf, distance);
-    }
+        // diff: [n_embd, n_rows]
+        struct ggml_tensor * diff = ggml_sub(ctx0,
+                ggml_get_rows(ctx0, dev_hidden, inp_pos),
+                ggml_get_rows(ctx0, dev_hidden, inp_neg));
 
-    // delete the temporally context used to build the graph
-    ggml_free(ctx0);
-    return gf;
-}
+        // diff_t: [n_rows, n_embd]
+        struct ggml_tensor * diff_t = ggml_cont(ctx0, ggml_transpose(ctx0, diff));
 
-static ggml_status compute_piter(
-        const struct pca_params & params,
-        const pca_model & model,
-        struct ggml_cgraph * gf,
-        ggml_gallocr_t allocr,
-        struct pca_result & result) {
-    // allocate tensors
-    ggml_gallocr_alloc_graph(allocr, gf);
-
-    if (ggml_backend_is_cpu(model.backend)) {
-        ggml_backend_cpu_set_n_threads(model.backend, params.n_threads);
-    }
+        struct ggml_tensor * sum = ggml_reshape_1d(ctx0, ggml_sum_rows(ctx0, diff_t), n_embd);
+        ggml_build_forward_expand(gf, ggml_add_inplace(ctx0, dev_sum[il], sum));
 
-    ggml_status res = ggml_backend_graph_compute(model.backend, gf);
-    if (res == GGML_STATUS_SUCCESS) {
-        auto extract_i = [](std::string prefix, std::string str) -> int {
-            int i = -1;
-            if (str.rfind(prefix, 0) == 0) {
-                sscanf(str.c_str(), (prefix + "%d").c_str(), &i);
-            }
-            return i;
-        };
-        result.calculated_square = NULL;
-        result.eigenvectors.clear();
-        result.distances.clear();
-        result.eigenvectors.resize(params.n_batch);
-        result.distances.resize(params.n_batch);
-        // get output nodes
-        for (int i = 0; i < ggml_graph_n_nodes(gf); ++i) {
-            auto node = ggml_graph_node(gf, i);
-            int iter = -1;
-            // find b_tensor (without copying data from device)
-            if ((iter = extract_i("b_tensor_norm_", node->name)) > -1) {
-                result.eigenvectors[iter] = node;
-            }
-            // find distances, then copy data from device
-            if ((iter = extract_i("distance_", node->name)) > -1) {
-                float d;
-                ggml_backend_tensor_get(node, &d, 0, sizeof(float));
-                result.distances[iter] = d;
-                // std::cout << node->name << " = " << d << "\n";
-            }
-            // find tmp_square if it exists (without copying data from device)
-            if (std::string(node->name) == "tmp_square") {
-                result.calculated_square = node;
-            }
+        if (!dev_square.empty()) {
+            struct ggml_tensor * square = ggml_mul_mat(ctx0, diff_t, diff_t);
+            ggml_build_forward_expand(gf, ggml_add_inplace(ctx0, dev_square[il], square));
+        }
+
+        ggml_backend_sched_reset(sched);
+        if (!ggml_backend_sched_alloc_graph(sched, gf)) {
+            ggml_free(ctx0);
+            return false;
         }
+
+        ggml_backend_tensor_set(inp_pos, idx_pos.data(), 0, ggml_nbytes(inp_pos));
+        ggml_backend_tensor_set(inp_neg, idx_neg.data(), 0, ggml_nbytes(inp_neg));
+
+        const ggml_status res = ggml_backend_sched_graph_compute(sched, gf);
+
+        ggml_free(ctx0);
+        return res == GGML_STATUS_SUCCESS;
     }
-    return res;
-}
 
-static void power_iteration(
+    std::vector<float> get_sum(int il) const {
+        std::vector<float> res(n_embd);
+        ggml_backend_tensor_get(dev_sum[il], res.data(), 0, ggml_nbytes(dev_sum[il]));
+        return res;
+    }
+};
+
+// n_batch power iterations for each of the given layers in one graph
+// the eigenvectors are updated on the device and the distances between the last two iterations are stored in
+// dev_distance, so the host only syncs once per batch of iterations
+static ggml_status compute_piter(
         const struct pca_params & params,
-        struct ggml_tensor * input, // shape of input: [n_samples, n_embd]
-        struct ggml_tensor * output) {
-    //printf("in power iteration\n");
-    struct pca_model model(input);
+        pca_model & model,
+        const std::vector<int> & layers) {
+    GGML_ASSERT(params.n_batch > 0);
 
-    ggml_gallocr_t allocr = ggml_gallocr_new(ggml_backend_get_default_buffer_type(model.backend));
-    struct pca_result result;
-    struct ggml_tensor * last_eigenvector = NULL;
+    const size_t n_nodes = layers.size()*(5u*params.n_batch + 12) + 1;
+    GGML_ASSERT(n_nodes <= (size_t) model.n_nodes_max);
+    struct ggml_context * ctx0 = model.graph_ctx(n_nodes);
+    struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, n_nodes, false);
 
-    int n_iters = params.n_iterations / params.n_batch; // more batch, fewer iterations
-    for (int iter = 0; iter < n_iters; ++iter) {
-        bool calc_square = (iter == 0); // only need to calculate square for first iteration
-        struct ggml_cgraph * gf = build_graph_piter(params, model, calc_square);
-        // ggml_graph_dump_dot(gf, nullptr, "/tmp/_cgraph.dot");
-        compute_piter(params, model, gf, allocr, result);
-
-        for (size_t k = 0; k < result.distances.size(); ++k) {
-            last_eigenvector = result.eigenvectors[k];
-            if (result.distances[k] < params.tolerance) {
-                break; // done
-            }
-        }
+    for (int il : layers) {
+        struct ggml_tensor * square    = model.dev_square[il];
+        struct ggml_tensor * old_eigen = model.dev_eigenvector[il];
+        struct ggml_tensor * b_tensor  = old_eigen;
 
-        if (calc_square) {
-            // copy and store the square matrix if needed
-            GGML_ASSERT(result.calculated_square != NULL);
-            ggml_backend_tensor_copy(result.calculated_square, model.dev_square);
-        }
+        for (int i = 0; i < params.n_batch; ++i) {
+            old_eigen = b_tensor;
 
-        {
-            // copy last eigen vector and store as input for next iteration
-            GGML_ASSERT(last_eigenvector != NULL);
-            ggml_backend_tensor_copy(last_eigenvector, model.dev_eigenvector);
+            // b_tensor = square * eigenvector^T
+            b_tensor = ggml_mul_mat(ctx0, square, old_eigen);
+
+            // normalize
+            b_tensor = ggml_div_inplace(ctx0,
+                b_tensor,
+                ggml_sqrt_inplace(ctx0, ggml_sum_rows(ctx0, ggml_sqr(ctx0, b_tensor)))
+            );
         }
 
-        printf("%s: layer %d/%d, iteration: %d / total: %d (batch = %d) ...\n",
-            __func__, params.i_layer+1, params.n_layers, iter+1, n_iters, params.n_batch);
+        // calculate distance(new eigenvector - old eigenvector)
+        struct ggml_tensor * new_sub_old = ggml_sub(ctx0, old_eigen, b_tensor);
+        struct ggml_tensor * distance = ggml_sqrt_inplace(ctx0,
+            ggml_sum_rows(ctx0, ggml_sqr_inplace(ctx0, new_sub_old)));
+
+        ggml_build_forward_expand(gf, ggml_cpy(ctx0, distance, ggml_view_1d(ctx0, model.dev_distance, 1, il*sizeof(float))));
+        ggml_build_forward_expand(gf, ggml_cpy(ctx0, b_tensor, model.dev_eigenvector[il]));
     }
 
-    // get output tensor
-    GGML_ASSERT(last_eigenvector);
-    ggml_backend_tensor_get(last_eigenvector, output->data, 0, ggml_nbytes(last_eigenvector));
-    //print_debug_tensor(output);
-    ggml_gallocr_free(allocr);
+    ggml_backend_sched_reset(model.sched);
 
-    // TODO @ngxson : The output vector is randomly inverted
-    // Solution: https://github.com/ggerganov/llama.cpp/pull/8069#issuecomment-2185328171
+    ggml_status res = ggml_backend_sched_graph_compute(model.sched, gf);
+
+    ggml_free(ctx0);
+    return res;
 }
 
 static void run_pca(
         struct pca_params & params,
-        const std::vector<struct ggml_tensor *> & v_input, // shape of v_input[0]: [n_samples, n_embd]
+        pca_model & model,
         const std::vector<struct ggml_tensor *> & v_output) {
     printf("%s: Running PCA...\n", __func__);
-    for (size_t il = 0; il < v_input.size(); ++il) {
 
+    const int n_layers = model.n_layers;
+
+    std::vector<int> layers; // the layers that did not converge yet
+    for (int il = 0; il < n_layers; ++il) {
+        layers.push_back(il);
+    }
+
+    std::vector<float> distances(n_layers);
+
+    // number of layers in a graph
+    const size_t n_layers_graph = std::max<size_t>(1, (model.n_nodes_max - 1) / (5u*params.n_batch + 12));
+
+    int n_iters = params.n_iterations / params.n_batch; // more batch, fewer iterations
+    for (int iter = 0; iter < n_iters && !layers.empty(); ++iter) {
+        bool ok = true;
+        for (size_t i0 = 0; ok && i0 < layers.size(); i0 += n_layers_graph) {
+            const std::vector<int> layers_graph(layers.begin() + i0, layers.begin() + std::min(layers.size(), i0 + n_layers_graph));
+            ok = compute_piter(params, model, layers_graph) == GGML_STATUS_SUCCESS;
+        }
+        if (!ok) {
+            fprintf(stderr, "%s: failed to compute the power iterations\n", __func__);
+            break;
+        }
+
+        ggml_backend_tensor_get(model.dev_distance, distances.data(), 0, ggml_nbytes(model.dev_distance));
+
+        std::vector<int> layers_next;
+        for (int il : layers) {
+            if (distances[il] < params.tolerance) {
+                printf("%s: Done layer %d / %d\n", __func__, il+1, n_layers);
+            } else {
+                layers_next.push_back(il);
+            }
+        }
+        layers = std::move(layers_next);
+
+        printf("%s: iteration: %d / total: %d (batch = %d), %zu layers left ...\n",
+            __func__, iter+1, n_iters, params.n_batch, layers.size());
+    }
+
+    for (int il = 0; il < n_layers; ++il) {
         // prepare output vector
         struct ggml_tensor * ctrl_out = v_output[il];
-        ggml_format_name(ctrl_out, "direction.%zu", il+1);
+        ggml_format_name(ctrl_out, "direction.%d", il+1);
 
-        // run power_iteration
-        params.i_layer = il;
-        params.n_layers = v_input.size();
-        power_iteration(params, v_input[il], ctrl_out);
-        printf("%s: Done layer %d / %d\n", __func__, (int) il+1, (int) v_input.size());
+        ggml_backend_tensor_get(model.dev_eigenvector[il], ctrl_out->data, 0, ggml_nbytes(ctrl_out));
     }
+
+    // TODO @ngxson : The output vector is randomly inverted
+    // Solution: https://github.com/ggerganov/llama.cpp/pull/8069#issuecomment-2185328171
 }
 
 }
@@ -4,14 +4,18 @@
 #include "common.h"
 
 #include <algorithm>
+#include <atomic>
+#include <cerrno>
 #include <cinttypes>
 #include <climits>
 #include <cstdio>
 #include <cstdlib>
 #include <stdexcept>
 #include <cstring>
+#include <filesystem>
 #include <fstream>
 #include <string>
+#include <thread>
 #include <vector>
 
 #if defined(_WIN32)
@@ -20,12 +24,15 @@
         #define PATH_MAX MAX_PATH
     #endif
     #include <io.h>
+#else
+    #include <unistd.h>
 #endif
 
 enum split_operation : uint8_t {
     OP_NONE,
     OP_SPLIT,
     OP_MERGE,
+    OP_DELTA,
 };
 
 enum split_mode : uint8_t {
@@ -41,8 +48,10 @@ struct split_params {
     int n_split_tensors = 128;
     std::string input;
     std::string output;
+    std::string delta_base;
     bool no_tensor_first_split = false;
     bool dry_run = false;
+    int n_threads = (int) std::min(8u, std::max(1u, std::thread::hardware_concurrency()));
 };
 
 static void split_print_usage(const char * executable) {
@@ -57,10 +66,13 @@ static void split_print_usage(const char * executable) {
     printf("  --version               show version and build info\n");
     printf("  --split                 split GGUF to multiple GGUF (enabled by default)\n");
     printf("  --merge                 merge multiple GGUF to a single GGUF\n");
+    printf("  --delta BASE            write GGUF_IN to GGUF_OUT without the tensors identical in the BASE GGUF,\n");
+    printf("                          they are loaded from BASE and shared by the models that use it\n");
     printf("  --split-max-tensors     max tensors in each split (default: %d)\n", default_params.n_split_tensors);
     printf("  --split-max-size N(M|G) max size per split\n");
     printf("  --no-tensor-first-split do not add tensors to the first split (disabled by default)\n");
     printf("  --dry-run               only print out a split plan and exit, without writing any new files\n");
+    printf("  --threads N             number of threads copying the tensor data (default: %d)\n", default_params.n_threads);
     printf("\n");
 }
 
@@ -112,13 +124,24 @@ static void split_params_parse_ex(int argc, const char ** argv, split_params & p
         } else if (arg == "--merge") {
             arg_found = true;
             if (params.operation != OP_NONE && params.operation != OP_MERGE) {
-                throw std::invalid_argument("error: either --split or --merge can be specified, but not both");
+                throw std::invalid_argument("error: only one of --split, --merge or --delta can be specified");
             }
             params.operation = OP_MERGE;
+        } else if (arg == "--delta") {
+            if (++arg_idx >= argc) {
+                invalid_param = true;
+                break;
+            }
+            arg_found = true;
+            if (params.operation != OP_NONE && params.operation != OP_DELTA) {
+                throw std::invalid_argument("error: --delta cannot be used with --split or --merge");
+            }
+            params.operation = OP_DELTA;
+            params.delta_base = argv[arg_idx];
         } else if (arg == "--split") {
             arg_found = true;
             if (params.operation != OP_NONE && params.operation != OP_SPLIT) {
-                throw std::invalid_argument("error: either --split or --merge can be specified, but not both");
+                throw std::invalid_argument("error: only one of --split, --merge or --delta can be specified");
             }
             params.operation = OP_SPLIT;
         } else if (arg == "--split-max-tensors") {
@@ -132,6 +155,16 @@ static void split_params_parse_ex(int argc, const char ** argv, split_params & p
             }
             params.mode = MODE_TENSOR;
             params.n_split_tensors = atoi(argv[arg_idx]);
+        } else if (arg == "--threads") {
+            if (++arg_idx >= argc) {
+                invalid_param = true;
+                break;
+            }
+            arg_found = true;
+            params.n_threads = atoi(argv[arg_idx]);
+            if (params.n_threads <= 0) {
+                throw std::invalid_argument("error: the number of threads must be positive");
+            }
         } else if (arg == "--split-max-size") {
             if (++arg_idx >= argc) {
                 invalid_param = true;
@@ -184,16 +217,163 @@ static bool split_params_parse(int argc, const char ** argv, split_params & para
     return result;
 }
 
-static void zeros(std::ofstream & file, size_t n) {
-    char zero = 0;
-    for (size_t i = 0; i < n; ++i) {
-        file.write(&zero, 1);
+#if defined(_WIN32)
+    #define gguf_split_fseek _fseeki64
+#else
+    #define gguf_split_fseek fseeko
+#endif
+
+// a range of tensor data copied from an input file to an output file
+struct copy_job {
+    int    i_in;
+    size_t off_in;
+    int    i_out;
+    size_t off_out;
+    size_t n_bytes;
+};
+
+// the large tensors are copied in several jobs, so that the threads share them
+static constexpr size_t COPY_JOB_MAX_SIZE   = 256ull*1024*1024;
+static constexpr size_t COPY_BUF_MAX_SIZE   =  64ull*1024*1024;
+
+static void add_copy_jobs(std::vector<copy_job> & jobs, int i_in, size_t off_in, int i_out, size_t off_out, size_t n_bytes) {
+    for (size_t off = 0; off < n_bytes; off += COPY_JOB_MAX_SIZE) {
+        jobs.push_back({ i_in, off_in + off, i_out, off_out + off, std::min(COPY_JOB_MAX_SIZE, n_bytes - off) });
+    }
+}
+
+// creates an output file with its metadata, sized for its tensor data - the padding between the tensors reads as zeros
+static void create_output(const char * path, const struct gguf_context * ctx_out, size_t total_size) {
+    FILE * f = ggml_fopen(path, "wb");
+    if (!f) {
+        fprintf(stderr, "%s: failed to create %s\n", __func__, path);
+        exit(EXIT_FAILURE);
+    }
+    std::vector<uint8_t> data(gguf_get_meta_size(ctx_out));
+    gguf_get_meta_data(ctx_out, data.data());
+    bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+    if (ok && total_size > data.size()) {
+        const char zero = 0;
+        ok = gguf_split_fseek(f, total_size - 1, SEEK_SET) == 0 && fwrite(&zero, 1, 1, f) == 1;
+    }
+    if (fclose(f) != 0 || !ok) {
+        fprintf(stderr, "%s: failed to write %s\n", __func__, path);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// copies from the offsets of one file to another, with copy_file_range() when possible:
+// in the kernel, without a round trip through user space, and as a reflink when the filesystem can share the blocks
+static bool copy_range(FILE * f_in, size_t off_in, FILE * f_out, size_t off_out, size_t n_bytes, std::vector<uint8_t> & buf) {
+#if defined(__linux__)
+    static std::atomic<bool> use_copy_file_range = true;
+    if (use_copy_file_range) {
+        loff_t i = off_in;
+        loff_t o = off_out;
+        size_t n = n_bytes;
+        while (n > 0) {
+            const ssize_t res = copy_file_range(fileno(f_in), &i, fileno(f_out), &o, n, 0);
+            if (res <= 0) {
+                if (res < 0 && errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            n -= res;
+        }
+        if (n == 0) {
+            return true;
+        }
+        if (n == n_bytes && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+            // not supported for these files, use the buffered copy from now on
+            use_copy_file_range = false;
+        }
+        off_in  += n_bytes - n;
+        off_out += n_bytes - n;
+        n_bytes  = n;
+    }
+#endif
+    buf.resize(std::min(n_bytes, COPY_BUF_MAX_SIZE));
+    if (gguf_split_fseek(f_in, off_in, SEEK_SET) != 0 || gguf_split_fseek(f_out, off_out, SEEK_SET) != 0) {
+        return false;
+    }
+    while (n_bytes > 0) {
+        const size_t n = std::min(n_bytes, buf.size());
+        if (fread(buf.data(), 1, n, f_in) != n || fwrite(buf.data(), 1, n, f_out) != n) {
+            return false;
+        }
+        n_bytes -= n;
+    }
+    return fflush(f_out) == 0;
+}
+
+// runs the copy jobs on n_threads threads, each with its own handles to the files
+static void copy_jobs_run(const std::vector<std::string> & paths_in, const std::vector<std::string> & paths_out,
+        const std::vector<copy_job> & jobs, int n_threads) {
+    std::atomic<size_t> i_next = 0;
+    std::atomic<bool>   failed = false;
+
+    auto worker = [&]() {
+        std::vector<FILE *> f_ins (paths_in.size(),  nullptr);
+        std::vector<FILE *> f_outs(paths_out.size(), nullptr);
+        std::vector<uint8_t> buf;
+
+        auto get_file = [&](std::vector<FILE *> & files, const std::vector<std::string> & paths, int i, const char * mode) {
+            if (!files[i]) {
+                files[i] = ggml_fopen(paths[i].c_str(), mode);
+                if (!files[i]) {
+                    fprintf(stderr, "%s: failed to open %s\n", __func__, paths[i].c_str());
+                }
+            }
+            return files[i];
+        };
+
+        while (!failed) {
+            const size_t i = i_next++;
+            if (i >= jobs.size()) {
+                break;
+            }
+            const copy_job & job = jobs[i];
+
+            FILE * f_in  = get_file(f_ins,  paths_in,  job.i_in,  "rb");
+            FILE * f_out = get_file(f_outs, paths_out, job.i_out, "r+b");
+            if (!f_in || !f_out || !copy_range(f_in, job.off_in, f_out, job.off_out, job.n_bytes, buf)) {
+                fprintf(stderr, "%s: failed to copy %zu bytes from %s to %s\n", __func__, job.n_bytes,
+                        paths_in[job.i_in].c_str(), paths_out[job.i_out].c_str());
+                failed = true;
+            }
+        }
+
+        for (FILE * f : f_ins) {
+            if (f) {
+                fclose(f);
+            }
+        }
+        for (FILE * f : f_outs) {
+            if (f && fclose(f) != 0) {
+                failed = true;
+            }
+        }
+    };
+
+    n_threads = std::max(1, (int) std::min((size_t) n_threads, jobs.size()));
+
+    std::vector<std::thread> workers;
+    for (int i = 1; i < n_threads; ++i) {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (auto & w : workers) {
+        w.join();
+    }
+
+    if (failed) {
+        exit(EXIT_FAILURE);
     }
 }
 
 struct split_strategy {
     const split_params params;
-    std::ifstream & f_input;
     struct gguf_context * ctx_gguf;
     struct ggml_context * ctx_meta = NULL;
     const int n_tensors;
@@ -201,15 +381,10 @@ struct split_strategy {
     // one ctx_out per one output file
     std::vector<struct gguf_context *> ctx_outs;
 
-    // temporary buffer for reading in tensor data
-    std::vector<uint8_t> read_buf;
-
     split_strategy(const split_params & params,
-            std::ifstream & f_input,
             struct gguf_context * ctx_gguf,
             struct ggml_context * ctx_meta) :
         params(params),
-        f_input(f_input),
         ctx_gguf(ctx_gguf),
         ctx_meta(ctx_meta),
         n_tensors(gguf_get_n_tensors(ctx_gguf)) {
@@ -304,56 +479,45 @@ struct split_strategy {
     }
 
     void write() {
-        int i_split = 0;
         int n_split = ctx_outs.size();
-        for (auto & ctx_out : ctx_outs) {
+
+        std::vector<std::string> paths_out;
+        std::vector<copy_job> jobs;
+
+        for (int i_split = 0; i_split < n_split; ++i_split) {
+            struct gguf_context * ctx_out = ctx_outs[i_split];
+
             // construct file path
             char split_path[PATH_MAX] = {0};
             llama_split_path(split_path, sizeof(split_path), params.output.c_str(), i_split, n_split);
+            paths_out.push_back(split_path);
 
-            // open the output file
-            printf("Writing file %s ... ", split_path);
-            fflush(stdout);
-            std::ofstream fout = std::ofstream(split_path, std::ios::binary);
-            fout.exceptions(std::ofstream::failbit); // fail fast on write errors
-
-            // write metadata
-            std::vector<uint8_t> data(gguf_get_meta_size(ctx_out));
-            gguf_get_meta_data(ctx_out, data.data());
-            fout.write((const char *)data.data(), data.size());
-
-            // write tensors
+            // the tensors of all the splits are copied at once, by several threads
+            const size_t meta_size = gguf_get_meta_size(ctx_out);
+            size_t total_size = meta_size;
             for (int i = 0; i < gguf_get_n_tensors(ctx_out); ++i) {
-                // read tensor meta and prepare buffer
                 const char * t_name = gguf_get_tensor_name(ctx_out, i);
                 struct ggml_tensor * t = ggml_get_tensor(ctx_meta, t_name);
                 auto n_bytes = ggml_nbytes(t);
-                read_buf.resize(n_bytes);
 
                 // calculate offset
                 auto i_tensor_in = gguf_find_tensor(ctx_gguf, t_name); // idx of tensor in the input file
                 auto offset = gguf_get_data_offset(ctx_gguf) + gguf_get_tensor_offset(ctx_gguf, i_tensor_in);
 
-                // copy tensor from input to output file
-                copy_file_to_file(f_input, fout, offset, n_bytes);
-                zeros(fout, GGML_PAD(n_bytes, GGUF_DEFAULT_ALIGNMENT) - n_bytes);
+                add_copy_jobs(jobs, 0, offset, i_split, meta_size + gguf_get_tensor_offset(ctx_out, i), n_bytes);
+                total_size = meta_size + gguf_get_tensor_offset(ctx_out, i) + GGML_PAD(n_bytes, GGUF_DEFAULT_ALIGNMENT);
             }
 
+            printf("Writing file %s ... ", split_path);
+            fflush(stdout);
+            create_output(split_path, ctx_out, total_size);
             printf("done\n");
-            // close the file
-            fout.close();
-            i_split++;
         }
-    }
 
-    void copy_file_to_file(std::ifstream & f_in, std::ofstream & f_out, const size_t in_offset, const size_t len) {
-        // TODO: detect OS and use copy_file_range() here for better performance
-        if (read_buf.size() < len) {
-            read_buf.resize(len);
-        }
-        f_in.seekg(in_offset);
-        f_in.read((char *)read_buf.data(), len);
-        f_out.write((const char *)read_buf.data(), len);
+        printf("Copying the tensor data with %d threads ... ", params.n_threads);
+        fflush(stdout);
+        copy_jobs_run({ params.input }, paths_out, jobs, params.n_threads);
+        printf("done\n");
     }
 };
 
@@ -365,12 +529,6 @@ static void gguf_split(const split_params & split_params) {
         /*.ctx      = */ &ctx_meta,
     };
 
-    std::ifstream f_input(split_params.input.c_str(), std::ios::binary);
-    if (!f_input.is_open()) {
-        fprintf(stderr, "%s:  failed to open input GGUF from %s\n", __func__, split_params.input.c_str());
-        exit(EXIT_FAILURE);
-    }
-
     auto * ctx_gguf = gguf_init_from_file(split_params.input.c_str(), params);
     if (!ctx_gguf) {
         fprintf(stderr, "%s:  failed to load input GGUF from %s\n", __func__, split_params.input.c_str());
@@ -378,7 +536,7 @@ static void gguf_split(const split_params & split_params) {
     }
 
     // prepare the strategy
-    split_strategy strategy(split_params, f_input, ctx_gguf, ctx_meta);
+    split_strategy strategy(split_params, ctx_gguf, ctx_meta);
     int n_split = strategy.ctx_outs.size();
     strategy.print_info();
 
@@ -389,7 +547,6 @@ static void gguf_split(const split_params & split_params) {
 
     // done, clean up
     gguf_free(ctx_gguf);
-    f_input.close();
 
     fprintf(stderr, "%s: %d gguf split written with a total of %d tensors.\n",
             __func__, n_split, strategy.n_tensors);
@@ -411,7 +568,6 @@ static void gguf_merge(const split_params & split_params) {
 
     auto * ctx_out = gguf_init_empty();
 
-    std::vector<uint8_t> read_data;
     std::vector<ggml_context *> ctx_metas;
     std::vector<gguf_context *> ctx_ggufs;
 
@@ -495,70 +651,46 @@ static void gguf_merge(const split_params & split_params) {
 
         fprintf(stderr, "\033[3Ddone\n");
     }
-    std::ofstream fout;
     if (!split_params.dry_run) {
-        fout.open(split_params.output.c_str(), std::ios::binary);
-        fout.exceptions(std::ofstream::failbit); // fail fast on write errors
-        // placeholder for the meta data
-        auto meta_size = gguf_get_meta_size(ctx_out);
-        ::zeros(fout, meta_size);
-    }
+        // the tensors of all the splits are copied at once, by several threads
+        std::vector<std::string> paths_in;
+        std::vector<copy_job> jobs;
 
-    // Write tensors data
-    for (int i_split = 0; i_split < n_split; i_split++) {
-        llama_split_path(split_path, sizeof(split_path), split_prefix, i_split, n_split);
-        std::ifstream f_input(split_path, std::ios::binary);
-        if (!f_input.is_open()) {
-            fprintf(stderr, "%s:  failed to open input GGUF from %s\n", __func__, split_path);
-            for (uint32_t i = 0; i < ctx_ggufs.size(); i++) {
-                gguf_free(ctx_ggufs[i]);
-                ggml_free(ctx_metas[i]);
-            }
-            gguf_free(ctx_out);
-            if (!split_params.dry_run) {
-                fout.close();
-            }
-            exit(EXIT_FAILURE);
-        }
-        fprintf(stderr, "%s: writing tensors %s ...", __func__, split_path);
+        const size_t meta_size = gguf_get_meta_size(ctx_out);
+        size_t total_size = meta_size;
 
-        auto * ctx_gguf = ctx_ggufs[i_split];
-        auto * ctx_meta = ctx_metas[i_split];
+        int i_tensor_out = 0;
+        for (int i_split = 0; i_split < n_split; i_split++) {
+            llama_split_path(split_path, sizeof(split_path), split_prefix, i_split, n_split);
+            paths_in.push_back(split_path);
 
-        auto n_tensors = gguf_get_n_tensors(ctx_gguf);
-        for (int i_tensor = 0; i_tensor < n_tensors; i_tensor++) {
-            const char * t_name = gguf_get_tensor_name(ctx_gguf, i_tensor);
-            struct ggml_tensor * t = ggml_get_tensor(ctx_meta, t_name);
+            auto * ctx_gguf = ctx_ggufs[i_split];
+            auto * ctx_meta = ctx_metas[i_split];
 
-            auto n_bytes = ggml_nbytes(t);
+            auto n_tensors = gguf_get_n_tensors(ctx_gguf);
+            for (int i_tensor = 0; i_tensor < n_tensors; i_tensor++, i_tensor_out++) {
+                const char * t_name = gguf_get_tensor_name(ctx_gguf, i_tensor);
+                struct ggml_tensor * t = ggml_get_tensor(ctx_meta, t_name);
 
-            if (read_data.size() < n_bytes) {
-                read_data.resize(n_bytes);
-            }
+                auto n_bytes = ggml_nbytes(t);
+                auto offset = gguf_get_data_offset(ctx_gguf) + gguf_get_tensor_offset(ctx_gguf, i_tensor);
+                auto offset_out = meta_size + gguf_get_tensor_offset(ctx_out, i_tensor_out);
 
-            auto offset = gguf_get_data_offset(ctx_gguf) + gguf_get_tensor_offset(ctx_gguf, i_tensor);
-            f_input.seekg(offset);
-            f_input.read((char *)read_data.data(), n_bytes);
-            if (!split_params.dry_run) {
-                // write tensor data + padding
-                fout.write((const char *)read_data.data(), n_bytes);
-                zeros(fout, GGML_PAD(n_bytes, GGUF_DEFAULT_ALIGNMENT) - n_bytes);
+                add_copy_jobs(jobs, i_split, offset, 0, offset_out, n_bytes);
+                total_size = offset_out + GGML_PAD(n_bytes, GGUF_DEFAULT_ALIGNMENT);
             }
         }
 
-        gguf_free(ctx_gguf);
-        ggml_free(ctx_meta);
-        f_input.close();
+        create_output(split_params.output.c_str(), ctx_out, total_size);
+
+        fprintf(stderr, "%s: writing tensors with %d threads ...", __func__, split_params.n_threads);
+        copy_jobs_run(paths_in, { split_params.output }, jobs, split_params.n_threads);
         fprintf(stderr, "\033[3Ddone\n");
     }
 
-    if (!split_params.dry_run) {
-        // go back to beginning of file and write the updated metadata
-        fout.seekp(0);
-        std::vector<uint8_t> data(gguf_get_meta_size(ctx_out));
-        gguf_get_meta_data(ctx_out, data.data());
-        fout.write((const char *)data.data(), data.size());
-        fout.close();
+    for (uint32_t i = 0; i < ctx_ggufs.size(); i++) {
+        gguf_free(ctx_ggufs[i]);
+        ggml_free(ctx_metas[i]);
     }
     gguf_free(ctx_out);
 
@@ -566,6 +698,143 @@ static void gguf_merge(const split_params & split_params) {
             __func__, split_params.output.c_str(), n_split, total_tensors);
 }
 
+// FNV-1a hash of the tensor data, the same as ggml-rpc and the model loader
+static uint64_t tensor_data_hash(FILE * f, size_t offset, size_t n_bytes, std::vector<uint8_t> & buf) {
+    const uint64_t fnv_prime = 0x100000001b3ULL;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    buf.resize(std::min(n_bytes, COPY_BUF_MAX_SIZE));
+    if (gguf_split_fseek(f, offset, SEEK_SET) != 0) {
+        fprintf(stderr, "%s: failed to read the tensor data\n", __func__);
+        exit(EXIT_FAILURE);
+    }
+    while (n_bytes > 0) {
+        const size_t n = std::min(n_bytes, buf.size());
+        if (fread(buf.data(), 1, n, f) != n) {
+            fprintf(stderr, "%s: failed to read the tensor data\n", __func__);
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < n; ++i) {
+            hash ^= buf[i];
+            hash *= fnv_prime;
+        }
+        n_bytes -= n;
+    }
+    return hash;
+}
+
+// writes the tensors of the input that differ from the base, and the list of the tensors to load from the base
+static void gguf_delta(const split_params & split_params) {
+    struct ggml_context * ctx_meta      = NULL;
+    struct ggml_context * ctx_meta_base = NULL;
+
+    struct gguf_init_params params      = { /*.no_alloc = */ true, /*.ctx = */ &ctx_meta      };
+    struct gguf_init_params params_base = { /*.no_alloc = */ true, /*.ctx = */ &ctx_meta_base };
+
+    auto * ctx_gguf      = gguf_init_from_file(split_params.input.c_str(),      params);
+    auto * ctx_gguf_base = gguf_init_from_file(split_params.delta_base.c_str(), params_base);
+    if (!ctx_gguf || !ctx_gguf_base) {
+        fprintf(stderr, "%s:  failed to load input GGUF from %s or %s\n", __func__, split_params.input.c_str(), split_params.delta_base.c_str());
+        exit(EXIT_FAILURE);
+    }
+    if (gguf_find_key(ctx_gguf, LLM_KV_SPLIT_COUNT) >= 0 || gguf_find_key(ctx_gguf_base, LLM_KV_SPLIT_COUNT) >= 0 ||
+        gguf_find_key(ctx_gguf, LLM_KV_DELTA_BASE)  >= 0 || gguf_find_key(ctx_gguf_base, LLM_KV_DELTA_BASE)  >= 0) {
+        fprintf(stderr, "%s: the input and the base must be single GGUF files, merge them first\n", __func__);
+        exit(EXIT_FAILURE);
+    }
+
+    FILE * f_input = ggml_fopen(split_params.input.c_str(),      "rb");
+    FILE * f_base  = ggml_fopen(split_params.delta_base.c_str(), "rb");
+    if (!f_input || !f_base) {
+        fprintf(stderr, "%s:  failed to open input GGUF from %s or %s\n", __func__, split_params.input.c_str(), split_params.delta_base.c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    auto * ctx_out = gguf_init_empty();
+    gguf_set_kv(ctx_out, ctx_gguf);
+
+    std::vector<std::string> shared_names;
+    std::vector<uint64_t>    shared_hashes;
+    size_t shared_size = 0;
+
+    // the tensors with the same name, type, shape and data are shared
+    std::vector<uint8_t> buf;
+    const int n_tensors = gguf_get_n_tensors(ctx_gguf);
+    for (int i = 0; i < n_tensors; ++i) {
+        const char * t_name = gguf_get_tensor_name(ctx_gguf, i);
+        struct ggml_tensor * t      = ggml_get_tensor(ctx_meta,      t_name);
+        struct ggml_tensor * t_base = ggml_get_tensor(ctx_meta_base, t_name);
+
+        if (t_base && t->type == t_base->type && ggml_are_same_shape(t, t_base)) {
+            const int i_base = gguf_find_tensor(ctx_gguf_base, t_name);
+            const size_t n_bytes = ggml_nbytes(t);
+            const uint64_t hash = tensor_data_hash(f_input, gguf_get_data_offset(ctx_gguf) + gguf_get_tensor_offset(ctx_gguf, i), n_bytes, buf);
+            if (hash == tensor_data_hash(f_base, gguf_get_data_offset(ctx_gguf_base) + gguf_get_tensor_offset(ctx_gguf_base, i_base), n_bytes, buf)) {
+                shared_names.push_back(t_name);
+                shared_hashes.push_back(hash);
+                shared_size += n_bytes;
+                continue;
+            }
+        }
+        gguf_add_tensor(ctx_out, t);
+    }
+    fclose(f_input);
+    fclose(f_base);
+
+    // the base is found relative to the directory of the delta
+    std::string base_path = split_params.delta_base;
+    {
+        std::error_code ec;
+        const auto dir_out = std::filesystem::absolute(split_params.output).parent_path();
+        const auto rel     = std::filesystem::relative(std::filesystem::absolute(split_params.delta_base), dir_out, ec);
+        if (!ec && !rel.empty()) {
+            base_path = rel.generic_string();
+        }
+    }
+
+    std::vector<const char *> names;
+    for (const auto & name : shared_names) {
+        names.push_back(name.c_str());
+    }
+    gguf_set_val_str (ctx_out, LLM_KV_DELTA_BASE, base_path.c_str());
+    gguf_set_arr_str (ctx_out, LLM_KV_DELTA_TENSORS, names.data(), names.size());
+    gguf_set_arr_data(ctx_out, LLM_KV_DELTA_TENSOR_HASHES, GGUF_TYPE_UINT64, shared_hashes.data(), shared_hashes.size());
+
+    printf("%s: %zu of %d tensors shared with %s (%.2f MiB)\n", __func__, shared_names.size(), n_tensors, base_path.c_str(), shared_size/1024.0/1024.0);
+
+    if (!split_params.dry_run) {
+        if (std::ifstream(split_params.output.c_str())) {
+            fprintf(stderr, "%s: output file %s already exists\n", __func__, split_params.output.c_str());
+            exit(EXIT_FAILURE);
+        }
+
+        std::vector<copy_job> jobs;
+        const size_t meta_size = gguf_get_meta_size(ctx_out);
+        size_t total_size = meta_size;
+        for (int i = 0; i < gguf_get_n_tensors(ctx_out); ++i) {
+            const char * t_name = gguf_get_tensor_name(ctx_out, i);
+            const size_t n_bytes = ggml_nbytes(ggml_get_tensor(ctx_meta, t_name));
+            const size_t offset = gguf_get_data_offset(ctx_gguf) + gguf_get_tensor_offset(ctx_gguf, gguf_find_tensor(ctx_gguf, t_name));
+            const size_t offset_out = meta_size + gguf_get_tensor_offset(ctx_out, i);
+
+            add_copy_jobs(jobs, 0, offset, 0, offset_out, n_bytes);
+            total_size = offset_out + GGML_PAD(n_bytes, GGUF_DEFAULT_ALIGNMENT);
+        }
+
+        printf("Writing file %s with %d threads ... ", split_params.output.c_str(), split_params.n_threads);
+        fflush(stdout);
+        create_output(split_params.output.c_str(), ctx_out, total_size);
+        copy_jobs_run({ split_params.input }, { split_params.output }, jobs, split_params.n_threads);
+        printf("done\n");
+    }
+
+    gguf_free(ctx_out);
+    gguf_free(ctx_gguf);
+    gguf_free(ctx_gguf_base);
+    ggml_free(ctx_meta);
+    ggml_free(ctx_meta_base);
+}
+
 int main(int argc, const char ** argv) {
     split_params params;
     split_params_parse(argc, argv, params);
@@ -575,6 +844,8 @@ int main(int argc, const char ** argv) {
             break;
         case OP_MERGE: gguf_merge(params);
             break;
+        case OP_DELTA: gguf_delta(params);
+            break;
         default: split_print_usage(argv[0]);
             exit(EXIT_FAILURE);
     }
@@ -3,6 +3,9 @@
 #include "log.h"
 #include "llama.h"
 #include "gguf.h"
+#include "ggml-alloc.h"
+#include "ggml-backend.h"
+#include "ggml-cpp.h"
 
 #include <algorithm>
 #include <chrono>
@@ -66,9 +69,30 @@ public:
     void save_imatrix(int32_t n_chunk = -1) const;
     bool load_imatrix_legacy(const char * fname);
     bool load_imatrix(const char * file_name);
+    void sync_device_stats();
+    void free_devices();
     const std::unordered_map<std::string, Stats> & get_mstats() const { return m_stats; }
 private:
+    // the activations that are in device memory are accumulated on the device, with a small graph computed on
+    // a backend of the same device, and only the sums are downloaded when saving - see sync_device_stats()
+    struct device_state {
+        ggml_backend_ptr backend;
+        ggml_gallocr_ptr galloc;
+        bool             supported = true;
+    };
+    struct device_sum {
+        ggml_backend_dev_t      dev = nullptr;
+        ggml_context_ptr        ctx;
+        ggml_backend_buffer_ptr buf;
+        ggml_tensor           * sum = nullptr; // [n_per_row, n_mat]
+    };
+
+    device_state * get_device(const ggml_tensor * src1);
+    bool collect_on_device(const std::string & wname, const ggml_tensor * src1, int64_t n_mat, const std::vector<float> & weights);
+
     std::unordered_map<std::string, Stats> m_stats;
+    std::map<ggml_backend_dev_t, device_state>  m_devices;
+    std::unordered_map<std::string, device_sum> m_device_sums;
     common_params                          m_params;
     std::mutex                             m_mutex;
     std::vector<std::string>               m_datasets;
@@ -216,6 +240,140 @@ static void compute_cossim(std::vector<tensor_statistics> & tstats) {
     }
 }
 
+IMatrixCollector::device_state * IMatrixCollector::get_device(const ggml_tensor * src1) {
+    if (ggml_backend_buffer_is_host(src1->buffer) || src1->type != GGML_TYPE_F32 || !ggml_is_contiguous(src1)) {
+        return nullptr;
+    }
+
+    ggml_backend_dev_t dev = ggml_backend_buft_get_device(ggml_backend_buffer_get_type(src1->buffer));
+    if (dev == nullptr) {
+        return nullptr;
+    }
+
+    auto it = m_devices.find(dev);
+    if (it == m_devices.end()) {
+        device_state state;
+        // the RPC buffers can only be used by the connection that allocated them
+        if (strcmp(ggml_backend_reg_name(ggml_backend_dev_backend_reg(dev)), "RPC") != 0) {
+            state.backend.reset(ggml_backend_dev_init(dev, nullptr));
+        }
+        if (state.backend) {
+            state.galloc.reset(ggml_gallocr_new(ggml_backend_get_default_buffer_type(state.backend.get())));
+            LOG_INF("%s: accumulating the statistics of the activations on %s\n", __func__, ggml_backend_dev_name(dev));
+        } else {
+            state.supported = false;
+        }
+        it = m_devices.emplace(dev, std::move(state)).first;
+    }
+
+    return it->second.supported ? &it->second : nullptr;
+}
+
+// add the squared activations in src1 to the sums of wname on the device, weighted by weights[n_mat, nrows] if not empty
+bool IMatrixCollector::collect_on_device(const std::string & wname, const ggml_tensor * src1, int64_t n_mat, const std::vector<float> & weights) {
+    device_state * state = get_device(src1);
+    if (state == nullptr) {
+        return false;
+    }
+
+    ggml_backend_dev_t dev = ggml_backend_get_device(state->backend.get());
+
+    const int64_t n_per_row = src1->ne[0];
+    const int64_t nrows     = ggml_nrows(src1);
+
+    GGML_ASSERT(weights.empty() ? n_mat == 1 : weights.size() == (size_t)(n_mat*nrows));
+
+    auto it = m_device_sums.find(wname);
+    if (it == m_device_sums.end()) {
+        device_sum ds;
+        ggml_init_params params = {
+            /*.mem_size   =*/ ggml_tensor_overhead(),
+            /*.mem_buffer =*/ nullptr,
+            /*.no_alloc   =*/ true,
+        };
+        ds.ctx.reset(ggml_init(params));
+        ds.sum = ggml_new_tensor_2d(ds.ctx.get(), GGML_TYPE_F32, n_per_row, n_mat);
+        ds.buf.reset(ggml_backend_alloc_ctx_tensors(ds.ctx.get(), state->backend.get()));
+        if (!ds.buf) {
+            return false;
+        }
+        ggml_backend_buffer_clear(ds.buf.get(), 0);
+        ds.dev = dev;
+        it = m_device_sums.emplace(wname, std::move(ds)).first;
+    }
+
+    device_sum & ds = it->second;
+    if (ds.dev != dev || ds.sum->ne[0] != n_per_row || ds.sum->ne[1] != n_mat) {
+        return false;
+    }
+
+    ggml_init_params params = {
+        /*.mem_size   =*/ 16*ggml_tensor_overhead() + ggml_graph_overhead(),
+        /*.mem_buffer =*/ nullptr,
+        /*.no_alloc   =*/ true,
+    };
+    ggml_context_ptr ctx_ptr { ggml_init(params) };
+    ggml_context * ctx = ctx_ptr.get();
+
+    // view of the activations in the device memory
+    ggml_tensor * x = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_per_row, nrows);
+    if (ggml_backend_tensor_alloc(src1->buffer, x, src1->data) != GGML_STATUS_SUCCESS) {
+        return false;
+    }
+
+    // [nrows, n_per_row]
+    ggml_tensor * x2 = ggml_cont(ctx, ggml_transpose(ctx, ggml_sqr(ctx, x)));
+
+    ggml_tensor * w = nullptr;
+    ggml_tensor * cur;
+    if (weights.empty()) {
+        cur = ggml_reshape_2d(ctx, ggml_sum_rows(ctx, x2), n_per_row, 1);
+    } else {
+        w = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, nrows, n_mat);
+        ggml_set_input(w);
+        cur = ggml_mul_mat(ctx, x2, w);
+    }
+    cur = ggml_cpy(ctx, ggml_add(ctx, ds.sum, cur), ds.sum);
+
+    ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, cur);
+
+    if (!ggml_gallocr_alloc_graph(state->galloc.get(), gf)) {
+        return false;
+    }
+    if (w) {
+        ggml_backend_tensor_set(w, weights.data(), 0, ggml_nbytes(w));
+    }
+
+    return ggml_backend_graph_compute(state->backend.get(), gf) == GGML_STATUS_SUCCESS;
+}
+
+// download the sums accumulated on the devices
+void IMatrixCollector::sync_device_stats() {
+    std::vector<float> sums;
+    for (auto & [wname, ds] : m_device_sums) {
+        auto & e = m_stats[wname];
+
+        sums.resize(ggml_nelements(ds.sum));
+        ggml_backend_tensor_get(ds.sum, sums.data(), 0, ggml_nbytes(ds.sum));
+        ggml_backend_buffer_clear(ds.buf.get(), 0);
+
+        GGML_ASSERT(e.values.size() == sums.size());
+        for (size_t j = 0; j < sums.size(); ++j) {
+            e.values[j] += sums[j];
+            if (!std::isfinite((float)e.values[j])) {
+                LOG_ERR("%f detected in %s\n", (float)e.values[j], wname.c_str());
+                exit(1);
+            }
+        }
+    }
+}
+
+void IMatrixCollector::free_devices() {
+    m_device_sums.clear();
+    m_devices.clear();
+}
+
 bool IMatrixCollector::collect_imatrix(struct ggml_tensor * t, bool ask, void * user_data) {
     GGML_UNUSED(user_data);
 
@@ -241,15 +399,34 @@ bool IMatrixCollector::collect_imatrix(struct ggml_tensor * t, bool ask, void *
     // copy the data from the GPU memory if needed
     const bool is_host = ggml_backend_buffer_is_host(src1->buffer);
 
-    if (!is_host) {
+    auto get_data = [&]() -> const char * {
+        if (is_host) {
+            return (const char *) src1->data;
+        }
         const size_t src1_nbytes = ggml_nbytes(src1);
         m_src1_data.resize(src1_nbytes);
         ggml_backend_tensor_get(src1, m_src1_data.data(), 0, src1_nbytes);
-    }
+        return m_src1_data.data();
+    };
 
-    const char * data = is_host ? (const char *) src1->data : m_src1_data.data();
     GGML_ASSERT(src1->nb[0] == ggml_element_size(src1));
 
+    auto maybe_save = [&](int64_t count) {
+        const int32_t n_chunk = count / chunk_size;
+        if (n_chunk > m_last_chunk) {
+            const int32_t chunk_step = n_chunk - m_last_chunk;
+            m_last_chunk = n_chunk;
+            if ((m_last_chunk % m_params.n_out_freq) / chunk_step == 0) {
+                sync_device_stats();
+                save_imatrix();
+            }
+            if (m_params.n_save_freq > 0 && (m_last_chunk % m_params.n_save_freq) / chunk_step == 0) {
+                sync_device_stats();
+                save_imatrix(m_last_chunk);
+            }
+        }
+    };
+
     // this has been adapted to the new format of storing merged experts in a single 3d tensor
     // ref: https://github.com/ggml-org/llama.cpp/pull/6387
     if (t->op == GGML_OP_MUL_MAT_ID) {
@@ -293,44 +470,69 @@ bool IMatrixCollector::collect_imatrix(struct ggml_tensor * t, bool ask, void *
             exit(1); //GGML_ABORT("fatal error");
         }
         LOG_DBGV(2, "%s[%d]: %32s, %s, %5d x %5d, %d\n", __func__, m_last_chunk, wname.c_str(), ggml_op_name(t->op), (int)src1->ne[0], (int)src1->ne[2], (int)src1->type);
-        // loop over all possible experts, regardless if they are used or not in the batch
-        for (int64_t ex = 0; ex < n_as; ++ex) {
-            size_t e_start = ex*src1->ne[0];
 
+        bool done = false;
+
+        if (!is_host) {
+            // weights[ex][i] = number of times that row i of src1 is routed to expert ex
+            const int64_t nrows = ggml_nrows(src1);
+            std::vector<float>   weights(n_as*nrows, 0.0f);
+            std::vector<int64_t> counts(n_as, 0);
             for (int64_t idx = 0; idx < n_ids; ++idx) {
                 for (int64_t row = 0; row < src1->ne[2]; ++row) {
                     const int excur = *(const int32_t *) (m_ids.data() + row*ids->nb[1] + idx*ids->nb[0]);
 
                     GGML_ASSERT(excur >= 0 && excur < n_as); // sanity check
 
-                    if (excur != ex) continue;
-
                     const int64_t i11 = idx % src1->ne[1];
                     const int64_t i12 = row;
-                    const float * x = (const float *)(data + i11*src1->nb[1] + i12*src1->nb[2]);
+                    weights[excur*nrows + i12*src1->ne[1] + i11] += 1.0f;
+                    counts[excur]++;
+                }
+            }
+            if (collect_on_device(wname, src1, n_as, weights)) {
+                for (int64_t ex = 0; ex < n_as; ++ex) {
+                    e.counts[ex] += counts[ex];
+                }
+                done = true;
+            }
+        }
+
+        if (!done) {
+            const char * data = get_data();
+
+            // loop over all possible experts, regardless if they are used or not in the batch
+            for (int64_t ex = 0; ex < n_as; ++ex) {
+                size_t e_start = ex*src1->ne[0];
+
+                for (int64_t idx = 0; idx < n_ids; ++idx) {
+                    for (int64_t row = 0; row < src1->ne[2]; ++row) {
+                        const int excur = *(const int32_t *) (m_ids.data() + row*ids->nb[1] + idx*ids->nb[0]);
+
+                        GGML_ASSERT(excur >= 0 && excur < n_as); // sanity check
+
+                        if (excur != ex) continue;
 
-                    e.counts[ex]++;
+                        const int64_t i11 = idx % src1->ne[1];
+                        const int64_t i12 = row;
+                        const float * x = (const float *)(data + i11*src1->nb[1] + i12*src1->nb[2]);
 
-                    for (int64_t j = 0; j < src1->ne[0]; ++j) {
-                        e.values[e_start + j] += x[j] * x[j];
-                        if (!std::isfinite((float)e.values[e_start + j])) {
-                            LOG_ERR("%f detected in %s\n", (float)e.values[e_start + j], wname.c_str());
-                            exit(1);
+                        e.counts[ex]++;
+
+                        for (int64_t j = 0; j < src1->ne[0]; ++j) {
+                            e.values[e_start + j] += x[j] * x[j];
+                            if (!std::isfinite((float)e.values[e_start + j])) {
+                                LOG_ERR("%f detected in %s\n", (float)e.values[e_start + j], wname.c_str());
+                                exit(1);
+                            }
                         }
                     }
                 }
             }
-            const int32_t n_chunk = e.counts[ex] / chunk_size;
-            if (n_chunk > m_last_chunk) {
-                const int32_t chunk_step = n_chunk - m_last_chunk;
-                m_last_chunk = n_chunk;
-                if ((m_last_chunk % m_params.n_out_freq) / chunk_step == 0) {
-                    save_imatrix();
-                }
-                if (m_params.n_save_freq > 0 && (m_last_chunk % m_params.n_save_freq) / chunk_step == 0) {
-                    save_imatrix(m_last_chunk);
-                }
-            }
+        }
+
+        for (int64_t ex = 0; ex < n_as; ++ex) {
+            maybe_save(e.counts[ex]);
         }
     } else {
         auto & e = m_stats[wname];
@@ -360,19 +562,24 @@ bool IMatrixCollector::collect_imatrix(struct ggml_tensor * t, bool ask, void *
         }
         LOG_DBGV(2, "%s[%d]: %32s, %s, %5d x %5d x %5d, %d\n", __func__, m_last_chunk, wname.c_str(), ggml_op_name(t->op), (int)src1->ne[0], (int)src1->ne[1], (int)src1->ne[2], (int)src1->type);
 
-        for (int64_t i3 = 0; i3 < src1->ne[3]; ++i3) {
-            for (int64_t i2 = 0; i2 < src1->ne[2]; ++i2) {
-                // handle 3D+ tensors, but flatten 3D+ activations when model tensor is 2D
-                const int64_t mat_id = (i3 % src0->ne[3]) * src0->ne[2] + (i2 % src0->ne[2]);
-                const int64_t mat_start = mat_id * src1->ne[0];
-
-                for (int64_t row = 0; row < src1->ne[1]; ++row) {
-                    const float * x = (const float *) (data + row * src1->nb[1] + i2 * src1->nb[2] + i3 * src1->nb[3]);
-                    for (int64_t j = 0; j < src1->ne[0]; ++j) {
-                        e.values[mat_start + j] += x[j] * x[j];
-                        if (!std::isfinite((float)e.values[j])) {
-                            LOG_ERR("%f detected in %s\n", (float)e.values[j], wname.c_str());
-                            exit(1);
+        // the activations of 3D+ tensors are accumulated on the host
+        if (is_host || n_mat != 1 || !collect_on_device(wname, src1, 1, {})) {
+            const char * data = get_data();
+
+            for (int64_t i3 = 0; i3 < src1->ne[3]; ++i3) {
+                for (int64_t i2 = 0; i2 < src1->ne[2]; ++i2) {
+                    // handle 3D+ tensors, but flatten 3D+ activations when model tensor is 2D
+                    const int64_t mat_id = (i3 % src0->ne[3]) * src0->ne[2] + (i2 % src0->ne[2]);
+                    const int64_t mat_start = mat_id * src1->ne[0];
+
+                    for (int64_t row = 0; row < src1->ne[1]; ++row) {
+                        const float * x = (const float *) (data + row * src1->nb[1] + i2 * src1->nb[2] + i3 * src1->nb[3]);
+                        for (int64_t j = 0; j < src1->ne[0]; ++j) {
+                            e.values[mat_start + j] += x[j] * x[j];
+                            if (!std::isfinite((float)e.values[j])) {
+                                LOG_ERR("%f detected in %s\n", (float)e.values[j], wname.c_str());
+                                exit(1);
+                            }
                         }
                     }
                 }
@@ -381,17 +588,7 @@ bool IMatrixCollector::collect_imatrix(struct ggml_tensor * t, bool ask, void *
         // only 1 count in practice, except when a tensor is used for both MUL_MAT_ID and MUL_MAT
         for (size_t i = 0; i < e.counts.size(); ++i) {
             e.counts[i] += ggml_nrows(src1) / n_mat;
-            const int32_t n_chunk = e.counts[i] / chunk_size;
-            if (n_chunk > m_last_chunk) {
-                const int32_t chunk_step = n_chunk - m_last_chunk;
-                m_last_chunk = n_chunk;
-                if ((m_last_chunk % m_params.n_out_freq) / chunk_step == 0) {
-                    save_imatrix();
-                }
-                if (m_params.n_save_freq > 0 && (m_last_chunk % m_params.n_save_freq) / chunk_step == 0) {
-                    save_imatrix(m_last_chunk);
-                }
-            }
+            maybe_save(e.counts[i]);
         }
     }
 
@@ -1291,7 +1488,9 @@ int main(int argc, char ** argv) {
         return 1;
     }
 
+    g_collector.sync_device_stats();
     g_collector.save_imatrix();
+    g_collector.free_devices();
 
     LOG("\n");
     llama_perf_context_print(ctx);
@@ -5,12 +5,17 @@
 #include <cinttypes>
 #include <clocale>
 #include <cmath>
+#include <condition_variable>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <functional>
 #include <iterator>
 #include <map>
+#include <mutex>
 #include <numeric>
 #include <regex>
 #include <sstream>
@@ -28,6 +33,14 @@
 #        define NOMINMAX
 #    endif
 #    include <windows.h>
+#else
+#    include <dlfcn.h>
+#endif
+
+#if defined(__linux__)
+#    include <fcntl.h>
+#    include <limits.h>
+#    include <unistd.h>
 #endif
 
 // utils
@@ -135,6 +148,248 @@ static std::string get_gpu_info() {
     return join(gpu_list, ", ");
 }
 
+// energy
+// a source of the energy consumed by the machine: a cumulative counter in joules or an instantaneous power in watts
+struct energy_source {
+    std::string                   name;
+    bool                          gpu;
+    bool                          counter;
+    double                        range; // wrap-around of the counter in joules, 0 if it does not wrap
+    std::function<bool(double &)> read;
+};
+
+static bool read_file_str(const std::string & path, std::string & value) {
+    std::ifstream f(path);
+    return (bool) std::getline(f, value);
+}
+
+static bool read_file_num(const std::string & path, double & value) {
+    std::ifstream f(path);
+    return (bool) (f >> value);
+}
+
+// CPU package power with RAPL (Intel and AMD), usually readable by root only
+static void energy_add_rapl(std::vector<energy_source> & sources) {
+#if defined(__linux__)
+    namespace fs = std::filesystem;
+    std::error_code ec;
+    for (const auto & entry : fs::directory_iterator("/sys/class/powercap", ec)) {
+        const std::string name = entry.path().filename().string();
+        // the package domains intel-rapl:N already include their subdomains intel-rapl:N:M
+        if (name.rfind("intel-rapl:", 0) != 0 || std::count(name.begin(), name.end(), ':') != 1) {
+            continue;
+        }
+        const std::string path = entry.path().string() + "/energy_uj";
+        double uj;
+        if (!read_file_num(path, uj)) {
+            fprintf(stderr, "llama-bench: warning: cannot read %s, the CPU energy is not measured\n", path.c_str());
+            continue;
+        }
+        std::string label = name;
+        read_file_str(entry.path().string() + "/name", label);
+        double range = 0.0;
+        read_file_num(entry.path().string() + "/max_energy_range_uj", range);
+        sources.push_back({ "RAPL " + label, false, true, range * 1e-6, [path](double & j) {
+            double uj;
+            if (!read_file_num(path, uj)) {
+                return false;
+            }
+            j = uj * 1e-6;
+            return true;
+        } });
+    }
+#else
+    (void) sources;
+#endif
+}
+
+// AMD and Intel GPUs with the hwmon interface of their kernel driver, the same sensors as ROCm SMI and Level Zero
+static void energy_add_hwmon_gpus(std::vector<energy_source> & sources) {
+#if defined(__linux__)
+    namespace fs = std::filesystem;
+    static const std::regex card_re("card[0-9]+");
+    std::error_code ec;
+    for (const auto & card : fs::directory_iterator("/sys/class/drm", ec)) {
+        const std::string name = card.path().filename().string();
+        if (!std::regex_match(name, card_re)) {
+            continue;
+        }
+        std::string vendor;
+        if (!read_file_str(card.path().string() + "/device/vendor", vendor) || vendor == "0x10de") {
+            // NVIDIA GPUs are read with NVML
+            continue;
+        }
+        for (const auto & hwmon : fs::directory_iterator(card.path() / "device" / "hwmon", ec)) {
+            const std::string dir = hwmon.path().string();
+            double v;
+            if (read_file_num(dir + "/energy1_input", v)) {
+                const std::string path = dir + "/energy1_input";
+                sources.push_back({ "hwmon " + name, true, true, 0.0, [path](double & j) {
+                    double uj;
+                    if (!read_file_num(path, uj)) {
+                        return false;
+                    }
+                    j = uj * 1e-6;
+                    return true;
+                } });
+                break;
+            }
+            std::string path = dir + "/power1_input";
+            if (!read_file_num(path, v)) {
+                path = dir + "/power1_average";
+                if (!read_file_num(path, v)) {
+                    continue;
+                }
+            }
+            sources.push_back({ "hwmon " + name, true, false, 0.0, [path](double & w) {
+                double uw;
+                if (!read_file_num(path, uw)) {
+                    return false;
+                }
+                w = uw * 1e-6;
+                return true;
+            } });
+            break;
+        }
+    }
+#else
+    (void) sources;
+#endif
+}
+
+// NVIDIA GPUs with NVML, loaded at runtime so that llama-bench does not depend on it
+static void energy_add_nvml(std::vector<energy_source> & sources) {
+    typedef int (*nvml_init_t)();
+    typedef int (*nvml_get_count_t)(unsigned int *);
+    typedef int (*nvml_get_handle_t)(unsigned int, void **);
+    typedef int (*nvml_get_energy_t)(void *, unsigned long long *);
+    typedef int (*nvml_get_power_t)(void *, unsigned int *);
+
+#ifdef _WIN32
+    HMODULE lib = LoadLibraryA("nvml.dll");
+    auto    sym = [lib](const char * name) { return (void *) GetProcAddress(lib, name); };
+#else
+    void * lib = dlopen("libnvidia-ml.so.1", RTLD_NOW | RTLD_LOCAL);
+    auto   sym = [lib](const char * name) { return dlsym(lib, name); };
+#endif
+    if (!lib) {
+        return;
+    }
+
+    auto nvml_init       = (nvml_init_t)       sym("nvmlInit_v2");
+    auto nvml_get_count  = (nvml_get_count_t)  sym("nvmlDeviceGetCount_v2");
+    auto nvml_get_handle = (nvml_get_handle_t) sym("nvmlDeviceGetHandleByIndex_v2");
+    auto nvml_get_energy = (nvml_get_energy_t) sym("nvmlDeviceGetTotalEnergyConsumption");
+    auto nvml_get_power  = (nvml_get_power_t)  sym("nvmlDeviceGetPowerUsage");
+
+    unsigned int count = 0;
+    if (!nvml_init || !nvml_get_count || !nvml_get_handle || !nvml_get_power || nvml_init() != 0 ||
+        nvml_get_count(&count) != 0) {
+        return;
+    }
+
+    // the library stays loaded until the end of the process
+    for (unsigned int i = 0; i < count; i++) {
+        void * dev = nullptr;
+        if (nvml_get_handle(i, &dev) != 0) {
+            continue;
+        }
+        const std::string name = "NVML GPU " + std::to_string(i);
+        unsigned long long mj;
+        if (nvml_get_energy && nvml_get_energy(dev, &mj) == 0) {
+            // Volta and newer
+            sources.push_back({ name, true, true, 0.0, [nvml_get_energy, dev](double & j) {
+                unsigned long long mj;
+                if (nvml_get_energy(dev, &mj) != 0) {
+                    return false;
+                }
+                j = mj * 1e-3;
+                return true;
+            } });
+            continue;
+        }
+        sources.push_back({ name, true, false, 0.0, [nvml_get_power, dev](double & w) {
+            unsigned int mw;
+            if (nvml_get_power(dev, &mw) != 0) {
+                return false;
+            }
+            w = mw * 1e-3;
+            return true;
+        } });
+    }
+}
+
+// accumulates the energy of all the sources between start() and stop()
+// the power sources are integrated and the counters are checked for wrap-around by a sampling thread
+struct energy_meter {
+    std::vector<energy_source> sources;
+    std::vector<double>        last;
+    double                     cpu_j  = 0.0;
+    double                     gpu_j  = 0.0;
+    uint64_t                   t_last = 0;
+
+    std::thread             worker;
+    std::mutex              mutex;
+    std::condition_variable cv;
+    bool                    running = false;
+
+    energy_meter() {
+        energy_add_rapl(sources);
+        energy_add_nvml(sources);
+        energy_add_hwmon_gpus(sources);
+    }
+
+    void sample() {
+        const uint64_t t_now = get_time_ns();
+        for (size_t i = 0; i < sources.size(); i++) {
+            const energy_source & src = sources[i];
+            double v;
+            if (!src.read(v)) {
+                continue;
+            }
+            if (!std::isnan(last[i])) {
+                double j;
+                if (src.counter) {
+                    j = v - last[i];
+                    if (j < 0.0) {
+                        j += src.range;
+                    }
+                } else {
+                    j = 0.5 * (v + last[i]) * (t_now - t_last) * 1e-9;
+                }
+                (src.gpu ? gpu_j : cpu_j) += j;
+            }
+            last[i] = v;
+        }
+        t_last = t_now;
+    }
+
+    void start() {
+        cpu_j  = 0.0;
+        gpu_j  = 0.0;
+        last.assign(sources.size(), NAN);
+        sample();
+
+        running = true;
+        worker  = std::thread([this] {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (!cv.wait_for(lock, std::chrono::milliseconds(100), [this] { return !running; })) {
+                sample();
+            }
+        });
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            running = false;
+        }
+        cv.notify_one();
+        worker.join();
+        sample();
+    }
+};
+
 // command line params
 enum output_formats { NONE, CSV, JSON, JSONL, MARKDOWN, SQL };
 
@@ -268,6 +523,13 @@ struct cmd_params {
     bool                             verbose;
     bool                             progress;
     bool                             no_warmup;
+    bool                             perf_ops;
+    bool                             energy;
+    bool                             load;
+    bool                             drop_caches;
+    double                           peak_gflops;
+    double                           peak_gbps;
+    std::string                      autotune;
     output_formats                   output_format;
     output_formats                   output_format_stderr;
 };
@@ -305,6 +567,13 @@ static const cmd_params cmd_params_defaults = {
     /* verbose              */ false,
     /* progress             */ false,
     /* no_warmup            */ false,
+    /* perf_ops             */ false,
+    /* energy               */ false,
+    /* load                 */ false,
+    /* drop_caches          */ false,
+    /* peak_gflops          */ 0.0,
+    /* peak_gbps            */ 0.0,
+    /* autotune             */ "",
     /* output_format        */ MARKDOWN,
     /* output_format_stderr */ NONE,
 };
@@ -328,6 +597,14 @@ static void print_usage(int /* argc */, char ** argv) {
     printf("  -v, --verbose                             verbose output\n");
     printf("  --progress                                print test progress indicators\n");
     printf("  --no-warmup                               skip warmup runs before benchmarking\n");
+    printf("  --perf-ops                                print the time, GFLOP/s and GB/s per op of the CPU backend\n");
+    printf("  --peak-gflops <f>                         peak compute of the machine for --perf-ops (default: unknown)\n");
+    printf("  --peak-gbps <f>                           peak memory bandwidth of the machine for --perf-ops (default: unknown)\n");
+    printf("  --energy                                  measure the CPU and GPU energy of each test and report J/token and t/s/W\n");
+    printf("  --load                                    measure the load of the models by phase, up to the first token of the -p prompts\n");
+    printf("  --drop-caches                             drop the model files from the page cache before each load (cold start)\n");
+    printf("  --autotune <file>                         measure the best thread counts and mul_mat chunk sizes of the CPU backend\n");
+    printf("                                            with the first model and write them to a profile (see GGML_CPU_PROFILE)\n");
     printf("\n");
     printf("test parameters:\n");
     printf("  -m, --model <filename>                    (default: %s)\n", join(cmd_params_defaults.model, ",").c_str());
@@ -429,6 +706,13 @@ static cmd_params parse_cmd_params(int argc, char ** argv) {
     params.delay                = cmd_params_defaults.delay;
     params.progress             = cmd_params_defaults.progress;
     params.no_warmup            = cmd_params_defaults.no_warmup;
+    params.perf_ops             = cmd_params_defaults.perf_ops;
+    params.energy               = cmd_params_defaults.energy;
+    params.load                 = cmd_params_defaults.load;
+    params.drop_caches          = cmd_params_defaults.drop_caches;
+    params.peak_gflops          = cmd_params_defaults.peak_gflops;
+    params.peak_gbps            = cmd_params_defaults.peak_gbps;
+    params.autotune             = cmd_params_defaults.autotune;
 
     for (int i = 1; i < argc; i++) {
         arg = argv[i];
@@ -804,6 +1088,32 @@ static cmd_params parse_cmd_params(int argc, char ** argv) {
                 params.progress = true;
             } else if (arg == "--no-warmup") {
                 params.no_warmup = true;
+            } else if (arg == "--perf-ops") {
+                params.perf_ops = true;
+            } else if (arg == "--energy") {
+                params.energy = true;
+            } else if (arg == "--load") {
+                params.load = true;
+            } else if (arg == "--drop-caches") {
+                params.drop_caches = true;
+            } else if (arg == "--peak-gflops") {
+                if (++i >= argc) {
+                    invalid_param = true;
+                    break;
+                }
+                params.peak_gflops = std::stod(argv[i]);
+            } else if (arg == "--peak-gbps") {
+                if (++i >= argc) {
+                    invalid_param = true;
+                    break;
+                }
+                params.peak_gbps = std::stod(argv[i]);
+            } else if (arg == "--autotune") {
+                if (++i >= argc) {
+                    invalid_param = true;
+                    break;
+                }
+                params.autotune = argv[i];
             } else {
                 invalid_param = true;
                 break;
@@ -1182,6 +1492,8 @@ struct test {
     int                      n_depth;
     std::string              test_time;
     std::vector<uint64_t>    samples_ns;
+    std::vector<double>      samples_cpu_j;
+    std::vector<double>      samples_gpu_j;
 
     test(const cmd_params_instance & inst, const llama_model * lmodel, const llama_context * ctx) :
         cpu_info(get_cpu_info()),
@@ -1239,6 +1551,35 @@ struct test {
 
     double stdev_ts() const { return ::stdev(get_ts()); }
 
+    // average power over all the repetitions, 0 without --energy
+    double avg_w(const std::vector<double> & samples_j) const {
+        const uint64_t t_ns = std::accumulate(samples_ns.begin(), samples_ns.end(), uint64_t(0));
+        if (samples_j.empty() || t_ns == 0) {
+            return 0.0;
+        }
+        return 1e9 * std::accumulate(samples_j.begin(), samples_j.end(), 0.0) / t_ns;
+    }
+
+    double avg_cpu_w() const { return avg_w(samples_cpu_j); }
+
+    double avg_gpu_w() const { return avg_w(samples_gpu_j); }
+
+    std::vector<double> get_j_per_tok() const {
+        int                 n_tokens = n_prompt + n_gen;
+        std::vector<double> jt;
+        for (size_t i = 0; i < samples_cpu_j.size(); i++) {
+            jt.push_back((samples_cpu_j[i] + samples_gpu_j[i]) / n_tokens);
+        }
+        return jt;
+    }
+
+    double avg_j_per_tok() const { return ::avg(get_j_per_tok()); }
+
+    double avg_ts_per_w() const {
+        const double w = avg_cpu_w() + avg_gpu_w();
+        return w > 0.0 ? avg_ts() / w : 0.0;
+    }
+
     static std::string get_backend() {
         std::vector<std::string> backends;
         for (size_t i = 0; i < ggml_backend_reg_count(); i++) {
@@ -1260,6 +1601,7 @@ struct test {
             "defrag_thold",
             "use_mmap",     "embeddings",   "no_op_offload",   "n_prompt",       "n_gen",      "n_depth",      "test_time",
             "avg_ns",       "stddev_ns",    "avg_ts",         "stddev_ts",
+            "cpu_w",        "gpu_w",        "j_per_tok",      "ts_per_w",
         };
         return fields;
     }
@@ -1277,7 +1619,8 @@ struct test {
             field == "use_mmap" || field == "embeddings") {
             return BOOL;
         }
-        if (field == "avg_ts" || field == "stddev_ts" || field == "defrag_thold") {
+        if (field == "avg_ts" || field == "stddev_ts" || field == "defrag_thold" || field == "cpu_w" ||
+            field == "gpu_w" || field == "j_per_tok" || field == "ts_per_w") {
             return FLOAT;
         }
         return STRING;
@@ -1355,7 +1698,11 @@ struct test {
                                             std::to_string(avg_ns()),
                                             std::to_string(stdev_ns()),
                                             std::to_string(avg_ts()),
-                                            std::to_string(stdev_ts()) };
+                                            std::to_string(stdev_ts()),
+                                            std::to_string(avg_cpu_w()),
+                                            std::to_string(avg_gpu_w()),
+                                            std::to_string(avg_j_per_tok()),
+                                            std::to_string(avg_ts_per_w()) };
         return values;
     }
 
@@ -1464,6 +1811,10 @@ struct json_printer : public printer {
         fprintf(fout, "  {\n");
         print_fields(test::get_fields(), t.get_values());
         fprintf(fout, "    \"samples_ns\": [ %s ],\n", join(t.samples_ns, ", ").c_str());
+        if (!t.samples_cpu_j.empty()) {
+            fprintf(fout, "    \"samples_cpu_j\": [ %s ],\n", join(t.samples_cpu_j, ", ").c_str());
+            fprintf(fout, "    \"samples_gpu_j\": [ %s ],\n", join(t.samples_gpu_j, ", ").c_str());
+        }
         fprintf(fout, "    \"samples_ts\": [ %s ]\n", join(t.get_ts(), ", ").c_str());
         fprintf(fout, "  }");
         fflush(fout);
@@ -1484,6 +1835,10 @@ struct jsonl_printer : public printer {
         fprintf(fout, "{");
         print_fields(test::get_fields(), t.get_values());
         fprintf(fout, "\"samples_ns\": [ %s ],", join(t.samples_ns, ", ").c_str());
+        if (!t.samples_cpu_j.empty()) {
+            fprintf(fout, "\"samples_cpu_j\": [ %s ],", join(t.samples_cpu_j, ", ").c_str());
+            fprintf(fout, "\"samples_gpu_j\": [ %s ],", join(t.samples_gpu_j, ", ").c_str());
+        }
         fprintf(fout, "\"samples_ts\": [ %s ]", join(t.get_ts(), ", ").c_str());
         fprintf(fout, "}\n");
         fflush(fout);
@@ -1533,6 +1888,9 @@ struct markdown_printer : public printer {
         if (field == "no_op_offload") {
             return 4;
         }
+        if (field == "W") {
+            return 7;
+        }
 
         int width = std::max((int) field.length(), 10);
 
@@ -1573,6 +1931,12 @@ struct markdown_printer : public printer {
         if (field == "tensor_buft_overrides") {
             return "ot";
         }
+        if (field == "j_per_tok") {
+            return "J/t";
+        }
+        if (field == "ts_per_w") {
+            return "t/s/W";
+        }
         return field;
     }
 
@@ -1643,6 +2007,11 @@ struct markdown_printer : public printer {
         }
         fields.emplace_back("test");
         fields.emplace_back("t/s");
+        if (params.energy) {
+            fields.emplace_back("W");
+            fields.emplace_back("j_per_tok");
+            fields.emplace_back("ts_per_w");
+        }
 
         fprintf(fout, "|");
         for (const auto & field : fields) {
@@ -1698,6 +2067,15 @@ struct markdown_printer : public printer {
             } else if (field == "t/s") {
                 snprintf(buf, sizeof(buf), "%.2f ± %.2f", t.avg_ts(), t.stdev_ts());
                 value = buf;
+            } else if (field == "W") {
+                snprintf(buf, sizeof(buf), "%.1f", t.avg_cpu_w() + t.avg_gpu_w());
+                value = buf;
+            } else if (field == "j_per_tok") {
+                snprintf(buf, sizeof(buf), "%.4f", t.avg_j_per_tok());
+                value = buf;
+            } else if (field == "ts_per_w") {
+                snprintf(buf, sizeof(buf), "%.2f", t.avg_ts_per_w());
+                value = buf;
             } else if (vmap.find(field) != vmap.end()) {
                 value = vmap.at(field);
             } else {
@@ -1809,6 +2187,43 @@ static bool test_gen(llama_context * ctx, int n_gen, int n_threads) {
     return true;
 }
 
+// roofline of the ops of the CPU backend: compute-bound when the arithmetic intensity is above the machine balance
+static void print_perf_ops(const ggml_backend_cpu_perf_stats & stats, const cmd_params & params) {
+    int64_t t_total_us = 0;
+    std::vector<int> ops;
+    for (int op = 0; op < GGML_OP_COUNT; ++op) {
+        if (stats.n_nodes[op] > 0) {
+            t_total_us += stats.t_us[op];
+            ops.push_back(op);
+        }
+    }
+    std::sort(ops.begin(), ops.end(), [&](int a, int b) { return stats.t_us[a] > stats.t_us[b]; });
+
+    const bool has_peaks = params.peak_gflops > 0.0 && params.peak_gbps > 0.0;
+
+    fprintf(stderr, "%-16s %8s %10s %7s %10s %9s %8s", "op", "nodes", "time (ms)", "time %", "GFLOP/s", "GB/s", "FLOP/B");
+    if (has_peaks) {
+        fprintf(stderr, " %7s %8s", "peak %", "bound");
+    }
+    fprintf(stderr, "\n");
+
+    for (int op : ops) {
+        const double t_s       = std::max<int64_t>(stats.t_us[op], 1) / 1e6;
+        const double gflops    = stats.flops[op] / t_s / 1e9;
+        const double gbps      = stats.bytes[op] / t_s / 1e9;
+        const double intensity = (double) stats.flops[op] / std::max<uint64_t>(stats.bytes[op], 1);
+
+        fprintf(stderr, "%-16s %8" PRIu64 " %10.2f %7.2f %10.2f %9.2f %8.2f", ggml_op_name((ggml_op) op), stats.n_nodes[op],
+                stats.t_us[op] / 1e3, 100.0 * stats.t_us[op] / std::max<int64_t>(t_total_us, 1), gflops, gbps, intensity);
+        if (has_peaks) {
+            const bool compute_bound = intensity > params.peak_gflops / params.peak_gbps;
+            const double peak = compute_bound ? gflops / params.peak_gflops : gbps / params.peak_gbps;
+            fprintf(stderr, " %7.2f %8s", 100.0 * peak, compute_bound ? "compute" : "memory");
+        }
+        fprintf(stderr, "\n");
+    }
+}
+
 static void llama_null_log_callback(enum ggml_log_level level, const char * text, void * user_data) {
     (void) level;
     (void) text;
@@ -1833,6 +2248,417 @@ static std::unique_ptr<printer> create_printer(output_formats format) {
     GGML_ABORT("fatal error");
 }
 
+// functions of the CPU backend used by the auto-tuning
+struct autotune_cpu_fns {
+    decltype(ggml_threadpool_new)           * threadpool_new;
+    decltype(ggml_threadpool_free)          * threadpool_free;
+    decltype(ggml_backend_cpu_get_profile)  * get_profile;
+    decltype(ggml_backend_cpu_set_profile)  * set_profile;
+    decltype(ggml_backend_cpu_save_profile) * save_profile;
+};
+
+// median tokens per second of the prompt (n_prompt tokens) or generation (n_gen tokens) runs
+static double autotune_measure(llama_context * ctx, const cmd_params_instance & inst, const cmd_params & params,
+                               const autotune_cpu_fns & fns, bool prompt, int n_threads) {
+    struct ggml_threadpool_params tpp = ggml_threadpool_params_default(n_threads);
+    if (!parse_cpu_mask(inst.cpu_mask, tpp.cpumask)) {
+        fprintf(stderr, "%s: failed to parse cpu-mask: %s\n", __func__, inst.cpu_mask.c_str());
+        exit(1);
+    }
+    tpp.strict_cpu = inst.cpu_strict;
+    tpp.poll       = inst.poll;
+    tpp.prio       = params.prio;
+
+    struct ggml_threadpool * threadpool = fns.threadpool_new(&tpp);
+    if (!threadpool) {
+        fprintf(stderr, "%s: threadpool create failed : n_threads %d\n", __func__, tpp.n_threads);
+        exit(1);
+    }
+    llama_attach_threadpool(ctx, threadpool, NULL);
+
+    const int n_tokens = prompt ? inst.n_prompt : inst.n_gen;
+
+    std::vector<double> ts;
+    for (int i = params.no_warmup ? 0 : -1; i < params.reps; i++) {
+        llama_memory_clear(llama_get_memory(ctx), false);
+
+        const uint64_t t_start = get_time_ns();
+        const bool res = prompt ? test_prompt(ctx, n_tokens, inst.n_batch, n_threads) : test_gen(ctx, n_tokens, n_threads);
+        if (!res) {
+            fprintf(stderr, "%s: error: failed to run the %s test\n", __func__, prompt ? "prompt" : "generation");
+            exit(1);
+        }
+        if (i >= 0) {
+            ts.push_back(1e9 * n_tokens / (get_time_ns() - t_start));
+        }
+    }
+
+    llama_detach_threadpool(ctx);
+    fns.threadpool_free(threadpool);
+
+    std::sort(ts.begin(), ts.end());
+    return ts[ts.size() / 2];
+}
+
+// the value of candidates with the highest throughput
+template <typename T, typename F>
+static T autotune_best(const char * name, const std::vector<T> & candidates, F measure) {
+    T      best    = candidates[0];
+    double best_ts = 0.0;
+    for (const T & c : candidates) {
+        const double ts = measure(c);
+        fprintf(stderr, "llama-bench: autotune: %-26s = %4d: %10.2f t/s\n", name, (int) c, ts);
+        if (ts > best_ts) {
+            best    = c;
+            best_ts = ts;
+        }
+    }
+    return best;
+}
+
+// measure the thread counts for prompt processing and generation, then the mul_mat chunk sizes with these
+// thread counts, with the first model and the first values of the other parameters
+static int autotune(const cmd_params & params, const autotune_cpu_fns & fns) {
+    if (!fns.get_profile || !fns.set_profile || !fns.save_profile) {
+        fprintf(stderr, "%s: error: the CPU backend does not support profiles\n", __func__);
+        return 1;
+    }
+
+    cmd_params_instance inst = get_cmd_params_instances(params)[0];
+    inst.n_prompt = params.n_prompt[0] > 0 ? params.n_prompt[0] : 512;
+    inst.n_gen    = params.n_gen[0]    > 0 ? params.n_gen[0]    : 128;
+    inst.n_depth  = 0;
+
+    std::vector<int> threads = params.n_threads;
+    if (threads.size() == 1) {
+        const int n_max = std::max<int>(threads[0], std::thread::hardware_concurrency());
+        threads.clear();
+        for (int n = 1; n < n_max; n *= 2) {
+            threads.push_back(n);
+        }
+        threads.push_back(cpu_get_num_math());
+        threads.push_back(n_max);
+        std::sort(threads.begin(), threads.end());
+        threads.erase(std::unique(threads.begin(), threads.end()), threads.end());
+    }
+
+    llama_model * lmodel = llama_model_load_from_file(inst.model.c_str(), inst.to_llama_mparams());
+    if (lmodel == NULL) {
+        fprintf(stderr, "%s: error: failed to load model '%s'\n", __func__, inst.model.c_str());
+        return 1;
+    }
+    llama_context * ctx = llama_init_from_model(lmodel, inst.to_llama_cparams());
+    if (ctx == NULL) {
+        fprintf(stderr, "%s: error: failed to create context with model '%s'\n", __func__, inst.model.c_str());
+        llama_model_free(lmodel);
+        return 1;
+    }
+
+    ggml_backend_cpu_profile profile;
+    fns.get_profile(&profile);
+
+    const std::string pp = "pp" + std::to_string(inst.n_prompt);
+    const std::string tg = "tg" + std::to_string(inst.n_gen);
+
+    profile.n_threads_batch = autotune_best((pp + " n_threads").c_str(), threads, [&](int n) {
+        return autotune_measure(ctx, inst, params, fns, true, n);
+    });
+    profile.n_threads = autotune_best((tg + " n_threads").c_str(), threads, [&](int n) {
+        return autotune_measure(ctx, inst, params, fns, false, n);
+    });
+
+    // larger chunks have less scheduling overhead, smaller chunks balance better the work of the threads
+    profile.mul_mat_chunk_size = autotune_best((pp + " mul_mat_chunk_size").c_str(), std::vector<int>{ 8, 16, 32, 64, 128 }, [&](int c) {
+        profile.mul_mat_chunk_size = c;
+        fns.set_profile(&profile);
+        return autotune_measure(ctx, inst, params, fns, true, profile.n_threads_batch);
+    });
+    profile.mul_mat_chunk_size_vec = autotune_best((tg + " mul_mat_chunk_size_vec").c_str(), std::vector<int>{ 16, 32, 64, 128, 256 }, [&](int c) {
+        profile.mul_mat_chunk_size_vec = c;
+        fns.set_profile(&profile);
+        return autotune_measure(ctx, inst, params, fns, false, profile.n_threads);
+    });
+    if (params.numa != GGML_NUMA_STRATEGY_DISABLED) {
+        profile.mul_mat_chunk_numa = autotune_best((pp + " mul_mat_chunk_numa").c_str(), std::vector<int>{ 0, 1 }, [&](int c) {
+            profile.mul_mat_chunk_numa = c != 0;
+            fns.set_profile(&profile);
+            return autotune_measure(ctx, inst, params, fns, true, profile.n_threads_batch);
+        }) != 0;
+    }
+    fns.set_profile(&profile);
+
+    llama_free(ctx);
+    llama_model_free(lmodel);
+
+    if (!fns.save_profile(params.autotune.c_str(), &profile)) {
+        fprintf(stderr, "%s: error: failed to write the profile to '%s'\n", __func__, params.autotune.c_str());
+        return 1;
+    }
+    fprintf(stderr, "llama-bench: autotune: wrote the profile to '%s', use it with GGML_CPU_PROFILE=%s\n",
+            params.autotune.c_str(), params.autotune.c_str());
+
+    return 0;
+}
+
+// load benchmark
+// drops the pages of the files of the model from the page cache, so that the next load reads them from the disk
+static bool drop_file_cache(const std::string & path) {
+#if defined(__linux__)
+    std::vector<std::string> files = { path };
+    std::smatch m;
+    static const std::regex split_re("(.*)-[0-9]{5}-of-([0-9]{5})\\.gguf");
+    if (std::regex_match(path, m, split_re)) {
+        files.clear();
+        const int n_split = std::stoi(m[2].str());
+        for (int i = 0; i < n_split; i++) {
+            char buf[PATH_MAX];
+            llama_split_path(buf, sizeof(buf), m[1].str().c_str(), i, n_split);
+            files.push_back(buf);
+        }
+    }
+    for (const auto & file : files) {
+        const int fd = open(file.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        const int ret = posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+        if (ret != 0) {
+            return false;
+        }
+    }
+    return true;
+#else
+    (void) path;
+    return false;
+#endif
+}
+
+struct load_test {
+    enum phase { PARSE, VOCAB, ALLOC, READ, UPLOAD, CTX, FIRST_TOKEN, TOTAL, N_PHASES };
+
+    static const char * phase_name(int i) {
+        static const char * names[N_PHASES] = { "parse", "vocab", "alloc", "read", "upload", "ctx", "first_token", "total" };
+        return names[i];
+    }
+
+    static int phase_width(int i) {
+        return i == TOTAL ? 20 : std::max<int>(11, strlen(phase_name(i)) + 3);
+    }
+
+    cmd_params_instance inst;
+    std::string         model_type;
+    uint64_t            model_size = 0;
+    bool                cold       = false;
+
+    std::vector<std::array<double, N_PHASES>> samples_ms;
+
+    double avg_ms(int i) const {
+        std::vector<double> v;
+        for (const auto & s : samples_ms) {
+            v.push_back(s[i]);
+        }
+        return ::avg(v);
+    }
+
+    double stdev_ms(int i) const {
+        std::vector<double> v;
+        for (const auto & s : samples_ms) {
+            v.push_back(s[i]);
+        }
+        return ::stdev(v);
+    }
+};
+
+// loads the model and creates a context from scratch, and evaluates the prompt until the first token
+static bool load_measure(load_test & t, std::array<double, load_test::N_PHASES> & ms) {
+    const cmd_params_instance & inst = t.inst;
+
+    const uint64_t t_start = get_time_ns();
+
+    llama_model * lmodel = llama_model_load_from_file(inst.model.c_str(), inst.to_llama_mparams());
+    if (lmodel == NULL) {
+        fprintf(stderr, "%s: error: failed to load model '%s'\n", __func__, inst.model.c_str());
+        return false;
+    }
+    const uint64_t t_model = get_time_ns();
+
+    llama_context * ctx = llama_init_from_model(lmodel, inst.to_llama_cparams());
+    if (ctx == NULL) {
+        fprintf(stderr, "%s: error: failed to create context with model '%s'\n", __func__, inst.model.c_str());
+        llama_model_free(lmodel);
+        return false;
+    }
+    const uint64_t t_ctx = get_time_ns();
+
+    const bool res = inst.n_prompt > 0 ? test_prompt(ctx, inst.n_prompt, inst.n_batch, inst.n_threads)
+                                       : test_gen(ctx, 1, inst.n_threads);
+    const uint64_t t_first = get_time_ns();
+
+    const llama_perf_model_data perf = llama_perf_model(lmodel);
+
+    char buf[128];
+    llama_model_desc(lmodel, buf, sizeof(buf));
+    t.model_type = buf;
+    t.model_size = llama_model_size(lmodel);
+
+    llama_free(ctx);
+    llama_model_free(lmodel);
+
+    if (!res) {
+        fprintf(stderr, "%s: error: failed to evaluate the first token\n", __func__);
+        return false;
+    }
+
+    // the model time that is not in a phase (e.g. the backend initialization) is counted in the parse
+    const double t_model_ms = (t_model - t_start) / 1e6;
+
+    ms[load_test::VOCAB]       = perf.t_vocab_ms;
+    ms[load_test::ALLOC]       = perf.t_alloc_ms;
+    ms[load_test::READ]        = perf.t_read_ms;
+    ms[load_test::UPLOAD]      = perf.t_upload_ms;
+    ms[load_test::PARSE]       = t_model_ms - perf.t_vocab_ms - perf.t_alloc_ms - perf.t_read_ms - perf.t_upload_ms;
+    ms[load_test::CTX]         = (t_ctx - t_model) / 1e6;
+    ms[load_test::FIRST_TOKEN] = (t_first - t_ctx) / 1e6;
+    ms[load_test::TOTAL]       = (t_first - t_start) / 1e6;
+
+    return true;
+}
+
+static void load_print_header(FILE * fout, output_formats format) {
+    if (format == MARKDOWN) {
+        fprintf(fout, "| %-30s | %10s | %4s | %3s | %5s | %-10s |", "model", "size", "mmap", "ngl", "cache", "test");
+        for (int i = 0; i < load_test::N_PHASES; i++) {
+            fprintf(fout, " %*s |", load_test::phase_width(i), (std::string(load_test::phase_name(i)) + " ms").c_str());
+        }
+        fprintf(fout, "\n| %s | %s | %s | %s | %s | %s |", std::string(30, '-').c_str(), "---------:", "---:", "--:", "-----",
+                "----------");
+        for (int i = 0; i < load_test::N_PHASES; i++) {
+            fprintf(fout, " %s: |", std::string(load_test::phase_width(i) - 1, '-').c_str());
+        }
+        fprintf(fout, "\n");
+    } else if (format == JSON) {
+        fprintf(fout, "[\n");
+    }
+}
+
+static void load_print_test(FILE * fout, output_formats format, const load_test & t, bool first) {
+    const auto & inst = t.inst;
+    char         test_name[64];
+    snprintf(test_name, sizeof(test_name), inst.n_prompt > 0 ? "pp%d" : "tg1", inst.n_prompt);
+
+    if (format == MARKDOWN) {
+        char size[32];
+        if (t.model_size < 1024 * 1024 * 1024) {
+            snprintf(size, sizeof(size), "%.2f MiB", t.model_size / 1024.0 / 1024.0);
+        } else {
+            snprintf(size, sizeof(size), "%.2f GiB", t.model_size / 1024.0 / 1024.0 / 1024.0);
+        }
+        fprintf(fout, "| %-30s | %10s | %4d | %3d | %5s | %-10s |", t.model_type.c_str(), size, inst.use_mmap,
+                inst.n_gpu_layers, t.cold ? "cold" : "warm", test_name);
+        for (int i = 0; i < load_test::N_PHASES; i++) {
+            char buf[64];
+            if (i == load_test::TOTAL) {
+                snprintf(buf, sizeof(buf), "%.2f ± %.2f", t.avg_ms(i), t.stdev_ms(i));
+                // HACK: the utf-8 character is 2 bytes
+                fprintf(fout, " %*s |", load_test::phase_width(i) + 1, buf);
+            } else {
+                snprintf(buf, sizeof(buf), "%.2f", t.avg_ms(i));
+                fprintf(fout, " %*s |", load_test::phase_width(i), buf);
+            }
+        }
+        fprintf(fout, "\n");
+        return;
+    }
+
+    std::string json = "{\"build_commit\": \"" + escape_json(test::build_commit) + "\", ";
+    json += "\"build_number\": " + std::to_string(test::build_number) + ", ";
+    json += "\"model_filename\": \"" + escape_json(inst.model) + "\", ";
+    json += "\"model_type\": \"" + escape_json(t.model_type) + "\", ";
+    json += "\"model_size\": " + std::to_string(t.model_size) + ", ";
+    json += "\"use_mmap\": " + std::string(inst.use_mmap ? "true" : "false") + ", ";
+    json += "\"n_gpu_layers\": " + std::to_string(inst.n_gpu_layers) + ", ";
+    json += "\"cold\": " + std::string(t.cold ? "true" : "false") + ", ";
+    json += "\"n_prompt\": " + std::to_string(inst.n_prompt) + ", ";
+    for (int i = 0; i < load_test::N_PHASES; i++) {
+        json += "\"avg_" + std::string(load_test::phase_name(i)) + "_ms\": " + std::to_string(t.avg_ms(i)) + ", ";
+    }
+    json += "\"stddev_total_ms\": " + std::to_string(t.stdev_ms(load_test::TOTAL)) + ", ";
+    std::vector<double> total;
+    for (const auto & s : t.samples_ms) {
+        total.push_back(s[load_test::TOTAL]);
+    }
+    json += "\"samples_total_ms\": [ " + join(total, ", ") + " ]}";
+
+    if (format == JSON) {
+        fprintf(fout, "%s  %s", first ? "" : ",\n", json.c_str());
+    } else {
+        fprintf(fout, "%s\n", json.c_str());
+    }
+}
+
+static void load_print_footer(FILE * fout, output_formats format) {
+    if (format == MARKDOWN) {
+        fprintf(fout, "\nbuild: %s (%d)\n", test::build_commit.c_str(), test::build_number);
+    } else if (format == JSON) {
+        fprintf(fout, "\n]\n");
+    }
+}
+
+static int load_bench(const cmd_params & params) {
+    if (params.output_format != MARKDOWN && params.output_format != JSON && params.output_format != JSONL) {
+        fprintf(stderr, "%s: error: --load supports the md, json and jsonl outputs only\n", __func__);
+        return 1;
+    }
+
+    // the time to the first token is measured with the prompt sizes of -p, the other tests are not run
+    cmd_params lparams = params;
+    lparams.n_gen      = { 0 };
+    lparams.n_pg       = {};
+    if (std::all_of(lparams.n_prompt.begin(), lparams.n_prompt.end(), [](int n) { return n == 0; })) {
+        lparams.n_prompt = { 1 };
+    }
+
+    load_print_header(stdout, params.output_format);
+
+    bool first = true;
+    for (const auto & inst : get_cmd_params_instances(lparams)) {
+        load_test t;
+        t.inst = inst;
+        t.cold = params.drop_caches;
+
+        std::array<double, load_test::N_PHASES> ms;
+
+        // load once to fill the page cache
+        if (!params.drop_caches && !params.no_warmup && !load_measure(t, ms)) {
+            return 1;
+        }
+
+        for (int i = 0; i < params.reps; i++) {
+            if (params.drop_caches && !drop_file_cache(inst.model)) {
+                fprintf(stderr, "%s: warning: failed to drop the page cache of '%s', the load is not cold\n", __func__,
+                        inst.model.c_str());
+                t.cold = false;
+            }
+            if (params.progress) {
+                fprintf(stderr, "llama-bench: load %s: run %d/%d\n", inst.model.c_str(), i + 1, params.reps);
+            }
+            if (!load_measure(t, ms)) {
+                return 1;
+            }
+            t.samples_ms.push_back(ms);
+        }
+
+        load_print_test(stdout, params.output_format, t, first);
+        fflush(stdout);
+        first = false;
+    }
+
+    load_print_footer(stdout, params.output_format);
+
+    return 0;
+}
+
 int main(int argc, char ** argv) {
     // try to set locale for unicode characters in markdown
     setlocale(LC_CTYPE, ".UTF-8");
@@ -1862,6 +2688,8 @@ int main(int argc, char ** argv) {
     auto * cpu_reg = ggml_backend_dev_backend_reg(cpu_dev);
     auto * ggml_threadpool_new_fn = (decltype(ggml_threadpool_new) *) ggml_backend_reg_get_proc_address(cpu_reg, "ggml_threadpool_new");
     auto * ggml_threadpool_free_fn = (decltype(ggml_threadpool_free) *) ggml_backend_reg_get_proc_address(cpu_reg, "ggml_threadpool_free");
+    auto * ggml_backend_cpu_set_perf_stats_fn = (decltype(ggml_backend_cpu_set_perf_stats) *) ggml_backend_reg_get_proc_address(cpu_reg, "ggml_backend_cpu_set_perf_stats");
+    auto * ggml_backend_cpu_get_perf_stats_fn = (decltype(ggml_backend_cpu_get_perf_stats) *) ggml_backend_reg_get_proc_address(cpu_reg, "ggml_backend_cpu_get_perf_stats");
 
     // initialize llama.cpp
     if (!params.verbose) {
@@ -1872,6 +2700,39 @@ int main(int argc, char ** argv) {
 
     set_process_priority(params.prio);
 
+    if (!params.autotune.empty()) {
+        autotune_cpu_fns fns = {
+            /* .threadpool_new  = */ ggml_threadpool_new_fn,
+            /* .threadpool_free = */ ggml_threadpool_free_fn,
+            /* .get_profile     = */ (decltype(ggml_backend_cpu_get_profile) *) ggml_backend_reg_get_proc_address(cpu_reg, "ggml_backend_cpu_get_profile"),
+            /* .set_profile     = */ (decltype(ggml_backend_cpu_set_profile) *) ggml_backend_reg_get_proc_address(cpu_reg, "ggml_backend_cpu_set_profile"),
+            /* .save_profile    = */ (decltype(ggml_backend_cpu_save_profile) *) ggml_backend_reg_get_proc_address(cpu_reg, "ggml_backend_cpu_save_profile"),
+        };
+        const int ret = autotune(params, fns);
+        llama_backend_free();
+        return ret;
+    }
+
+    if (params.load) {
+        const int ret = load_bench(params);
+        llama_backend_free();
+        return ret;
+    }
+
+    std::unique_ptr<energy_meter> meter;
+    if (params.energy) {
+        meter.reset(new energy_meter());
+        if (meter->sources.empty()) {
+            fprintf(stderr, "llama-bench: warning: no CPU or GPU energy source found, the energy is reported as 0\n");
+        } else {
+            std::vector<std::string> names;
+            for (const auto & src : meter->sources) {
+                names.push_back(src.name);
+            }
+            fprintf(stderr, "llama-bench: energy sources: %s\n", join(names, ", ").c_str());
+        }
+    }
+
     // initialize printer
     std::unique_ptr<printer> p     = create_printer(params.output_format);
     std::unique_ptr<printer> p_err = create_printer(params.output_format_stderr);
@@ -1970,6 +2831,11 @@ int main(int argc, char ** argv) {
             }
         }
 
+        // count the ops of the repetitions only
+        if (params.perf_ops) {
+            ggml_backend_cpu_set_perf_stats_fn(true);
+        }
+
         for (int i = 0; i < params.reps; i++) {
             llama_memory_clear(llama_get_memory(ctx), false);
 
@@ -1985,6 +2851,10 @@ int main(int argc, char ** argv) {
                 }
             }
 
+            if (meter) {
+                meter->start();
+            }
+
             uint64_t t_start = get_time_ns();
 
             if (t.n_prompt > 0) {
@@ -2012,6 +2882,12 @@ int main(int argc, char ** argv) {
 
             uint64_t t_ns = get_time_ns() - t_start;
             t.samples_ns.push_back(t_ns);
+
+            if (meter) {
+                meter->stop();
+                t.samples_cpu_j.push_back(meter->cpu_j);
+                t.samples_gpu_j.push_back(meter->gpu_j);
+            }
         }
 
         if (p) {
@@ -2026,6 +2902,13 @@ int main(int argc, char ** argv) {
 
         llama_perf_context_print(ctx);
 
+        if (params.perf_ops) {
+            ggml_backend_cpu_perf_stats stats;
+            ggml_backend_cpu_get_perf_stats_fn(&stats);
+            ggml_backend_cpu_set_perf_stats_fn(false);
+            print_perf_ops(stats, params);
+        }
+
         llama_free(ctx);
 
         ggml_threadpool_free_fn(threadpool);
@@ -171,25 +171,30 @@ int main(int argc, char ** argv) {
     set_process_priority(params.cpuparams.priority);
 
     struct ggml_threadpool * threadpool_batch = NULL;
-    if (!ggml_threadpool_params_match(&tpp, &tpp_batch)) {
-        threadpool_batch = ggml_threadpool_new_fn(&tpp_batch);
-        if (!threadpool_batch) {
-            LOG_ERR("%s: batch threadpool create failed : n_threads %d\n", __func__, tpp_batch.n_threads);
-            return 1;
+    struct ggml_threadpool * threadpool       = NULL;
+
+    // with --threadpool-shared, the context already computes on the shared threadpools
+    if (!params.threadpool_shared) {
+        if (!ggml_threadpool_params_match(&tpp, &tpp_batch)) {
+            threadpool_batch = ggml_threadpool_new_fn(&tpp_batch);
+            if (!threadpool_batch) {
+                LOG_ERR("%s: batch threadpool create failed : n_threads %d\n", __func__, tpp_batch.n_threads);
+                return 1;
+            }
+
+            // Start the non-batch threadpool in the paused state
+            tpp.paused = true;
         }
 
-        // Start the non-batch threadpool in the paused state
-        tpp.paused = true;
-    }
+        threadpool = ggml_threadpool_new_fn(&tpp);
+        if (!threadpool) {
+            LOG_ERR("%s: threadpool create failed : n_threads %d\n", __func__, tpp.n_threads);
+            return 1;
+        }
 
-    struct ggml_threadpool * threadpool = ggml_threadpool_new_fn(&tpp);
-    if (!threadpool) {
-        LOG_ERR("%s: threadpool create failed : n_threads %d\n", __func__, tpp.n_threads);
-        return 1;
+        llama_attach_threadpool(ctx, threadpool, threadpool_batch);
     }
 
-    llama_attach_threadpool(ctx, threadpool, threadpool_batch);
-
     const int n_ctx_train = llama_model_n_ctx_train(model);
     const int n_ctx = llama_n_ctx(ctx);
 
@@ -27,6 +27,7 @@
 #include <array>
 #include <numeric>
 #include <functional>
+#include <thread>
 
 struct clip_logger_state g_logger_state = {GGML_LOG_LEVEL_CONT, clip_log_callback_default, NULL};
 
@@ -385,12 +386,20 @@ struct clip_ctx {
     int max_nodes = 8192;
     ggml_backend_sched_ptr sched;
 
+    bool flash_attn = false;
+
+    // the graph of the last image, reused as long as the images have the same size
+    ggml_cgraph * gf_last = nullptr;
+    int gf_last_nx = 0;
+    int gf_last_ny = 0;
+
     // for debugging
     bool debug_graph = false;
     std::vector<ggml_tensor *> debug_print_tensors;
 
     clip_ctx(clip_context_params & ctx_params) {
         debug_graph = std::getenv("MTMD_DEBUG_GRAPH") != nullptr;
+        flash_attn  = ctx_params.flash_attn;
         backend_cpu = ggml_backend_init_by_type(GGML_BACKEND_DEVICE_TYPE_CPU, nullptr);
         if (!backend_cpu) {
             throw std::runtime_error("failed to initialize CPU backend");
@@ -1848,17 +1857,36 @@ private:
         ggml_tensor * k = ggml_permute(ctx0, k_cur, 0, 2, 1, 3);
         //cb(k, "k", il);
 
-        ggml_tensor * v = ggml_permute(ctx0, v_cur, 1, 2, 0, 3);
-        v = ggml_cont(ctx0, v);
-        //cb(k, "v", il);
-
         ggml_tensor * cur;
 
-        // TODO @ngxson : support flash attention
-        {
+        if (ctx->flash_attn) {
             const auto n_tokens = q->ne[1];
             const auto n_head   = q->ne[2];
-            // const auto n_kv     = k->ne[1]; // for flash attention
+
+            ggml_tensor * v = ggml_permute(ctx0, v_cur, 0, 2, 1, 3);
+            //cb(v, "v", il);
+
+            k = ggml_cast(ctx0, k, GGML_TYPE_F16);
+            v = ggml_cast(ctx0, v, GGML_TYPE_F16);
+
+            // the kernel needs a F16 mask with the rows padded to GGML_KQ_MASK_PAD
+            ggml_tensor * kq_mask_fa = nullptr;
+            if (kq_mask) {
+                kq_mask_fa = ggml_pad(ctx0, kq_mask, 0, GGML_PAD(n_tokens, GGML_KQ_MASK_PAD) - n_tokens, 0, 0);
+                kq_mask_fa = ggml_cast(ctx0, kq_mask_fa, GGML_TYPE_F16);
+            }
+
+            cur = ggml_flash_attn_ext(ctx0, q, k, v, kq_mask_fa, kq_scale, 0.0f, 0.0f);
+            ggml_flash_attn_ext_set_prec(cur, GGML_PREC_F32);
+
+            cur = ggml_reshape_2d(ctx0, cur, cur->ne[0]*n_head, n_tokens);
+        } else {
+            const auto n_tokens = q->ne[1];
+            const auto n_head   = q->ne[2];
+
+            ggml_tensor * v = ggml_permute(ctx0, v_cur, 1, 2, 0, 3);
+            v = ggml_cont(ctx0, v);
+            //cb(v, "v", il);
 
             ggml_tensor * kq = ggml_mul_mat(ctx0, k, q);
             // F32 may not needed for vision encoders?
@@ -2004,6 +2032,22 @@ static ggml_cgraph * clip_image_build_graph(clip_ctx * ctx, const clip_image_f32
     return res;
 }
 
+// a quantized tensor is kept quantized if it is the weight of a matrix multiplication
+// the conv kernels, the embeddings and the norms are also used by ops without quantized support on most backends
+static bool clip_keep_quantized(const ggml_tensor * t) {
+    if (!ggml_is_quantized(t->type)) {
+        return true;
+    }
+    if (ggml_n_dims(t) != 2) {
+        return false;
+    }
+    const std::string name = t->name;
+    return name.find("embd")             == std::string::npos &&
+           name.find("pos_embed")        == std::string::npos &&
+           name.find("query")            == std::string::npos &&
+           name.find("input_projection") == std::string::npos; // gemma3, transposed before the matmul
+}
+
 struct clip_model_loader {
     ggml_context_ptr ctx_meta;
     gguf_context_ptr ctx_gguf;
@@ -2354,7 +2398,10 @@ struct clip_model_loader {
             if (cur) {
                 tensors_to_load.push_back(cur);
                 // add tensors to context
-                ggml_tensor * data_tensor = ggml_dup_tensor(ctx_clip.ctx_data.get(), cur);
+                // the quantized weights are only used by the matrix multiplications, the other tensors are dequantized on load
+                ggml_tensor * data_tensor = clip_keep_quantized(cur)
+                    ? ggml_dup_tensor(ctx_clip.ctx_data.get(), cur)
+                    : ggml_new_tensor(ctx_clip.ctx_data.get(), GGML_TYPE_F32, GGML_MAX_DIMS, cur->ne);
                 ggml_set_name(data_tensor, cur->name);
                 cur = data_tensor;
             }
@@ -2614,7 +2661,13 @@ struct clip_model_loader {
                     throw std::runtime_error(string_format("%s: failed to seek for tensor %s\n", __func__, t->name));
                 }
                 size_t num_bytes = ggml_nbytes(cur);
-                if (ggml_backend_buft_is_host(buft)) {
+                if (cur->type != t->type) {
+                    read_buf.resize(ggml_nbytes(t));
+                    fin.read(reinterpret_cast<char *>(read_buf.data()), read_buf.size());
+                    std::vector<float> data_f32(ggml_nelements(t));
+                    ggml_get_type_traits(t->type)->to_float(read_buf.data(), data_f32.data(), data_f32.size());
+                    ggml_backend_tensor_set(cur, data_f32.data(), 0, num_bytes);
+                } else if (ggml_backend_buft_is_host(buft)) {
                     // for the CPU and Metal backend, we can read directly into the tensor
                     fin.read(reinterpret_cast<char *>(cur->data), num_bytes);
                 } else {
@@ -2647,6 +2700,20 @@ struct clip_model_loader {
         batch.entries.push_back(std::move(img));
 
         ggml_cgraph * gf = clip_image_build_graph(&ctx_clip, batch);
+
+        if (ctx_clip.flash_attn) {
+            // the flash attention of a backend without it would run on the CPU, the explicit attention is faster then
+            for (int i = 0; i < ggml_graph_n_nodes(gf); ++i) {
+                ggml_tensor * node = ggml_graph_node(gf, i);
+                if (node->op == GGML_OP_FLASH_ATTN_EXT && !ggml_backend_supports_op(ctx_clip.backend, node)) {
+                    LOG_WRN("%s: flash attention is not supported by %s, it will be disabled\n", __func__, ggml_backend_name(ctx_clip.backend));
+                    ctx_clip.flash_attn = false;
+                    gf = clip_image_build_graph(&ctx_clip, batch);
+                    break;
+                }
+            }
+        }
+
         ggml_backend_sched_reserve(ctx_clip.sched.get(), gf);
 
         for (size_t i = 0; i < ctx_clip.backend_ptrs.size(); ++i) {
@@ -2843,17 +2910,58 @@ void clip_build_img_from_pixels(const unsigned char * rgb_pixels, int nx, int ny
     memcpy(img->buf.data(), rgb_pixels, img->buf.size());
 }
 
+// run fn(y0, y1) over the rows [0, n_rows) of an image, split across threads when the image is large enough
+// the rows are independent, the result does not depend on the number of threads
+static void clip_image_parallel_rows(int n_rows, int64_t n_pixels, const std::function<void(int, int)> & fn) {
+    // below this, the threads cost more than they save
+    constexpr int64_t min_pixels_per_thread = 128*1024;
+
+    int n_threads = std::min<int64_t>(std::max(1u, std::thread::hardware_concurrency()), n_pixels / min_pixels_per_thread);
+    n_threads = std::min(std::min(n_threads, n_rows), 16);
+    if (n_threads <= 1) {
+        fn(0, n_rows);
+        return;
+    }
+
+    const int rows_per_thread = (n_rows + n_threads - 1) / n_threads;
+
+    std::vector<std::thread> workers;
+    workers.reserve(n_threads - 1);
+    for (int i = 1; i < n_threads; i++) {
+        const int y0 = std::min(n_rows, i * rows_per_thread);
+        const int y1 = std::min(n_rows, y0 + rows_per_thread);
+        workers.emplace_back(fn, y0, y1);
+    }
+    fn(0, std::min(n_rows, rows_per_thread));
+    for (auto & w : workers) {
+        w.join();
+    }
+}
+
 // Normalize image to float32 - careful with pytorch .to(model.device, dtype=torch.float16) - this sometimes reduces precision (32>16>32), sometimes not
 static void normalize_image_u8_to_f32(const clip_image_u8 & src, clip_image_f32 & dst, const float mean[3], const float std[3]) {
     dst.nx = src.nx;
     dst.ny = src.ny;
     dst.buf.resize(src.buf.size());
 
-    // TODO @ngxson : seems like this could be done more efficiently on cgraph
-    for (size_t i = 0; i < src.buf.size(); ++i) {
-        int c = i % 3; // rgb
-        dst.buf[i] = (static_cast<float>(src.buf[i]) / 255.0f - mean[c]) / std[c];
+    // only 256 values per channel, look them up instead of computing them for every pixel
+    float lut[3][256];
+    for (int c = 0; c < 3; ++c) {
+        for (int v = 0; v < 256; ++v) {
+            lut[c][v] = (static_cast<float>(v) / 255.0f - mean[c]) / std[c];
+        }
     }
+
+    const size_t row_size = 3 * (size_t) src.nx;
+    clip_image_parallel_rows(src.ny, (int64_t) src.nx * src.ny, [&](int y0, int y1) {
+        const uint8_t * s = src.buf.data() + y0 * row_size;
+        float         * d = dst.buf.data() + y0 * row_size;
+        for (size_t i = 0; i < (y1 - y0) * row_size; i += 3) {
+            d[i + 0] = lut[0][s[i + 0]];
+            d[i + 1] = lut[1][s[i + 1]];
+            d[i + 2] = lut[2][s[i + 2]];
+        }
+    });
 }
 
 // set of tools to manupulate images
@@ -2868,30 +2976,36 @@ struct image_manipulation {
         float x_ratio = static_cast<float>(src.nx - 1) / target_width;
         float y_ratio = static_cast<float>(src.ny - 1) / target_height;
 
-        for (int y = 0; y < target_height; y++) {
-            for (int x = 0; x < target_width; x++) {
-                float px = x_ratio * x;
+        // the source columns and weights are the same for every row
+        std::vector<int>   xs(target_width);
+        std::vector<float> xl(target_width);
+        for (int x = 0; x < target_width; x++) {
+            float px = x_ratio * x;
+            xs[x] = static_cast<int>(px);
+            xl[x] = px - xs[x];
+        }
+
+        clip_image_parallel_rows(target_height, (int64_t) target_width * target_height, [&](int y0, int y1) {
+            for (int y = y0; y < y1; y++) {
                 float py = y_ratio * y;
-                int x_floor = static_cast<int>(px);
                 int y_floor = static_cast<int>(py);
-                float x_lerp = px - x_floor;
                 float y_lerp = py - y_floor;
 
-                for (int c = 0; c < 3; c++) {
-                    float top = lerp(
-                        static_cast<float>(src.buf[3 * (y_floor * src.nx + x_floor) + c]),
-                        static_cast<float>(src.buf[3 * (y_floor * src.nx + (x_floor + 1)) + c]),
-                        x_lerp
-                    );
-                    float bottom = lerp(
-                        static_cast<float>(src.buf[3 * ((y_floor + 1) * src.nx + x_floor) + c]),
-                        static_cast<float>(src.buf[3 * ((y_floor + 1) * src.nx + (x_floor + 1)) + c]),
-                        x_lerp
-                    );
-                    dst.buf[3 * (y * target_width + x) + c] = static_cast<uint8_t>(lerp(top, bottom, y_lerp));
+                const uint8_t * row0 = src.buf.data() + 3 * (y_floor * src.nx);
+                const uint8_t * row1 = src.buf.data() + 3 * ((y_floor + 1) * src.nx);
+                uint8_t       * out  = dst.buf.data() + 3 * (y * target_width);
+
+                for (int x = 0; x < target_width; x++) {
+                    const int   x0     = 3 * xs[x];
+                    const float x_lerp = xl[x];
+                    for (int c = 0; c < 3; c++) {
+                        float top    = lerp(row0[x0 + c], row0[x0 + 3 + c], x_lerp);
+                        float bottom = lerp(row1[x0 + c], row1[x0 + 3 + c], x_lerp);
+                        out[3 * x + c] = static_cast<uint8_t>(lerp(top, bottom, y_lerp));
+                    }
                 }
             }
-        }
+        });
     }
 
     // Bicubic resize function
@@ -2904,41 +3018,56 @@ struct image_manipulation {
         dst.ny = target_height;
         dst.buf.resize(3 * target_width * target_height);
 
-        float Cc;
-        float C[5];
-        float d0, d2, d3, a0, a1, a2, a3;
-        int i, j, k, jj;
-        int x, y;
-        float dx, dy;
-        float tx, ty;
-
-        tx = (float)nx / (float)target_width;
-        ty = (float)ny / (float)target_height;
+        const float tx = (float)nx / (float)target_width;
+        const float ty = (float)ny / (float)target_height;
 
         // Bicubic interpolation; adapted from ViT.cpp, inspired from :
         //    -> https://github.com/yglukhov/bicubic-interpolation-image-processing/blob/master/libimage.c#L36
         //    -> https://en.wikipedia.org/wiki/Bicubic_interpolation
 
-        for (i = 0; i < target_height; i++) {
-            for (j = 0; j < target_width; j++) {
-                x = (int)(tx * j);
-                y = (int)(ty * i);
+        // the 4 clamped source columns (as offsets in a row) and the fraction of every destination column
+        std::vector<std::array<int, 4>> xs(target_width);
+        std::vector<float>              dxs(target_width);
+        for (int j = 0; j < target_width; j++) {
+            const int x = (int)(tx * j);
+            dxs[j] = tx * j - x;
+            for (int jj = 0; jj <= 3; jj++) {
+                xs[j][jj] = clip(x - 1 + jj, 0, nx - 1) * 3;
+            }
+        }
+
+        clip_image_parallel_rows(target_height, (int64_t) target_width * target_height, [&](int i0, int i1) {
+            float C[4];
+            float d0, d2, d3, a0, a1, a2, a3;
 
-                dx = tx * j - x;
-                dy = ty * i - y;
+            for (int i = i0; i < i1; i++) {
+                const int   y  = (int)(ty * i);
+                const float dy = ty * i - y;
 
-                for (k = 0; k < 3; k++) {
-                    for (jj = 0; jj <= 3; jj++) {
-                        d0 = img.buf[(clip(y - 1 + jj, 0, ny - 1) * nx + clip(x - 1, 0, nx - 1)) * 3 + k] - img.buf[(clip(y - 1 + jj, 0, ny - 1) * nx + clip(x, 0, nx - 1)) * 3 + k];
-                        d2 = img.buf[(clip(y - 1 + jj, 0, ny - 1) * nx + clip(x + 1, 0, nx - 1)) * 3 + k] - img.buf[(clip(y - 1 + jj, 0, ny - 1) * nx + clip(x, 0, nx - 1)) * 3 + k];
-                        d3 = img.buf[(clip(y - 1 + jj, 0, ny - 1) * nx + clip(x + 2, 0, nx - 1)) * 3 + k] - img.buf[(clip(y - 1 + jj, 0, ny - 1) * nx + clip(x, 0, nx - 1)) * 3 + k];
-                        a0 = img.buf[(clip(y - 1 + jj, 0, ny - 1) * nx + clip(x, 0, nx - 1)) * 3 + k];
+                const uint8_t * rows[4];
+                for (int jj = 0; jj <= 3; jj++) {
+                    rows[jj] = img.buf.data() + clip(y - 1 + jj, 0, ny - 1) * nx * 3;
+                }
 
-                        a1 = -1.0 / 3 * d0 + d2 - 1.0 / 6 * d3;
-                        a2 =  1.0 / 2 * d0 +      1.0 / 2 * d2;
-                        a3 = -1.0 / 6 * d0 -      1.0 / 2 * d2 + 1.0 / 6 * d3;
+                for (int j = 0; j < target_width; j++) {
+                    const std::array<int, 4> & x = xs[j];
+                    const float dx = dxs[j];
 
-                        C[jj] = a0 + a1 * dx + a2 * dx * dx + a3 * dx * dx * dx;
+                    for (int k = 0; k < 3; k++) {
+                        // interpolate the 4 rows horizontally, then the results vertically
+                        for (int jj = 0; jj <= 3; jj++) {
+                            const uint8_t * row = rows[jj];
+                            d0 = row[x[0] + k] - row[x[1] + k];
+                            d2 = row[x[2] + k] - row[x[1] + k];
+                            d3 = row[x[3] + k] - row[x[1] + k];
+                            a0 = row[x[1] + k];
+
+                            a1 = -1.0 / 3 * d0 + d2 - 1.0 / 6 * d3;
+                            a2 =  1.0 / 2 * d0 +      1.0 / 2 * d2;
+                            a3 = -1.0 / 6 * d0 -      1.0 / 2 * d2 + 1.0 / 6 * d3;
+
+                            C[jj] = a0 + a1 * dx + a2 * dx * dx + a3 * dx * dx * dx;
+                        }
 
                         d0 = C[0] - C[1];
                         d2 = C[2] - C[1];
@@ -2947,14 +3076,14 @@ struct image_manipulation {
                         a1 = -1.0 / 3 * d0 + d2 - 1.0 / 6 * d3;
                         a2 =  1.0 / 2 * d0 +      1.0 / 2 * d2;
                         a3 = -1.0 / 6 * d0 -      1.0 / 2 * d2 + 1.0 / 6 * d3;
-                        Cc = a0 + a1 * dy + a2 * dy * dy + a3 * dy * dy * dy;
+                        const float Cc = a0 + a1 * dy + a2 * dy * dy + a3 * dy * dy * dy;
 
                         const uint8_t Cc2 = std::min(std::max(std::round(Cc), 0.0f), 255.0f);
-                        dst.buf[(i * target_width + j) * 3 + k] = float(Cc2);
+                        dst.buf[(i * target_width + j) * 3 + k] = Cc2;
                     }
                 }
             }
-        }
+        });
 
         return true;
     }
@@ -3000,11 +3129,8 @@ struct image_manipulation {
 
         // Copy the resized image into the center of the padded buffer
         for (int y = 0; y < new_height; ++y) {
-            for (int x = 0; x < new_width; ++x) {
-                for (int c = 0; c < 3; ++c) {
-                    padded_image.buf[3 * ((y + pad_y) * target_width + (x + pad_x)) + c] = resized_image.buf[3 * (y * new_width + x) + c];
-                }
-            }
+            memcpy(padded_image.buf.data()  + 3 * ((y + pad_y) * target_width + pad_x),
+                   resized_image.buf.data() + 3 * (y * new_width), 3 * new_width);
         }
         dst = std::move(padded_image);
     }
@@ -3015,13 +3141,7 @@ struct image_manipulation {
         dst.buf.resize(3 * w * h);
 
         for (int i = 0; i < h; ++i) {
-            for (int j = 0; j < w; ++j) {
-                int src_idx = 3 * ((y + i)*image.nx + (x + j));
-                int dst_idx = 3 * (i*w + j);
-                dst.buf[dst_idx]     = image.buf[src_idx];
-                dst.buf[dst_idx + 1] = image.buf[src_idx + 1];
-                dst.buf[dst_idx + 2] = image.buf[src_idx + 2];
-            }
+            memcpy(dst.buf.data() + 3 * (i*w), image.buf.data() + 3 * ((y + i)*image.nx + x), 3 * w);
         }
     }
 
@@ -3742,11 +3862,22 @@ bool clip_image_batch_encode(clip_ctx * ctx, const int n_threads, const clip_ima
         return false; // only support batch size of 1
     }
 
-    // build the inference graph
-    ctx->debug_print_tensors.clear();
-    ggml_backend_sched_reset(ctx->sched.get());
-    ggml_cgraph * gf = clip_image_build_graph(ctx, imgs);
-    ggml_backend_sched_alloc_graph(ctx->sched.get(), gf);
+    // build the inference graph, unless the previous image had the same size
+    // the graph and its allocation are kept, so the images of a fixed size or the slices of an image are not planned again
+    ggml_cgraph * gf = ctx->gf_last;
+    if (gf == nullptr || imgs.entries[0]->nx != ctx->gf_last_nx || imgs.entries[0]->ny != ctx->gf_last_ny) {
+        ctx->debug_print_tensors.clear();
+        ggml_backend_sched_reset(ctx->sched.get());
+        gf = clip_image_build_graph(ctx, imgs);
+        if (!ggml_backend_sched_alloc_graph(ctx->sched.get(), gf)) {
+            ctx->gf_last = nullptr;
+            LOG_ERR("%s: failed to allocate the graph\n", __func__);
+            return false;
+        }
+        ctx->gf_last    = gf;
+        ctx->gf_last_nx = imgs.entries[0]->nx;
+        ctx->gf_last_ny = imgs.entries[0]->ny;
+    }
 
     // set inputs
     const auto & model   = ctx->model;
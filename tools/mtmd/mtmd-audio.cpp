@@ -8,6 +8,7 @@
 #include <vector>
 #include <fstream>
 #include <algorithm>
+#include <utility>
 
 // most of the code here is copied from whisper.cpp
 
@@ -54,80 +55,140 @@ struct whisper_global_cache {
 } global_cache;
 }
 
-// naive Discrete Fourier Transform
-// input is real-valued
-// output is complex-valued
-static void dft(const float* in, int N, float* out) {
-    const int sin_cos_step = SIN_COS_N_COUNT / N;
+// complex values of the FFT
+struct fft_cpx {
+    float r;
+    float i;
+};
 
-    for (int k = 0; k < N; k++) {
-        float re = 0;
-        float im = 0;
+// exp(-2*pi*i*idx/SIN_COS_N_COUNT)
+static inline fft_cpx fft_twiddle(int idx) {
+    return { global_cache.cos_vals[idx], -global_cache.sin_vals[idx] };
+}
 
-        for (int n = 0; n < N; n++) {
-            int idx = (k * n * sin_cos_step) % (SIN_COS_N_COUNT); // t = 2*M_PI*k*n/N
-            re += in[n]*global_cache.cos_vals[idx]; // cos(t)
-            im -= in[n]*global_cache.sin_vals[idx]; // sin(t)
-        }
+static inline fft_cpx fft_mul(fft_cpx a, fft_cpx b) {
+    return { a.r*b.r - a.i*b.i, a.r*b.i + a.i*b.r };
+}
 
-        out[k*2 + 0] = re;
-        out[k*2 + 1] = im;
+// factors of the FFT size, as { p0, m0, p1, m1, ... } with n = p0*m0, m0 = p1*m1, ..., and the last m = 1
+// the radix 4 is used first, then 2, 3, 5 - the FFT sizes are products of these (400 for whisper)
+static std::vector<int> fft_factors(int n) {
+    std::vector<int> factors;
+    for (const int p : { 4, 2, 3, 5 }) {
+        while (n % p == 0) {
+            n /= p;
+            factors.push_back(p);
+            factors.push_back(n);
+        }
     }
+    WHISPER_ASSERT(n == 1 && "Unsupported FFT size");
+    return factors;
 }
 
-// Cooley-Tukey FFT
-// poor man's implementation - use something better
-// input is real-valued
-// output is complex-valued
-static void fft(float* in, int N, float* out) {
-    if (N == 1) {
-        out[0] = in[0];
-        out[1] = 0;
-        return;
-    }
+// mixed-radix decimation-in-time FFT, in the style of kissfft: out[k] = sum(in[j*stride] * exp(-2*pi*i*j*k/n))
+// the twiddles exp(-2*pi*i*k/n) are every tw_step values of the sin/cos table
+static void fft_work(fft_cpx * out, const fft_cpx * in, int stride, int tw_step, const int * factors) {
+    const int p = factors[0];
+    const int m = factors[1];
 
-    const int half_N = N / 2;
-    if (N - half_N*2 == 1) {
-        dft(in, N, out);
-        return;
+    if (m == 1) {
+        for (int q = 0; q < p; q++) {
+            out[q] = in[q*stride];
+        }
+    } else {
+        // the p sub-FFTs of the samples with the same index modulo p
+        for (int q = 0; q < p; q++) {
+            fft_work(out + q*m, in + q*stride, stride*p, tw_step*p, factors + 2);
+        }
     }
 
-    float* even = in + N;
-    for (int i = 0; i < half_N; ++i) {
-        even[i]= in[2*i];
+    switch (p) {
+        case 2:
+            {
+                for (int k = 0; k < m; k++) {
+                    const fft_cpx t = fft_mul(out[m + k], fft_twiddle(k*tw_step));
+                    out[m + k] = { out[k].r - t.r, out[k].i - t.i };
+                    out[k]     = { out[k].r + t.r, out[k].i + t.i };
+                }
+            } break;
+        case 4:
+            {
+                for (int k = 0; k < m; k++) {
+                    const fft_cpx s0 = fft_mul(out[k + 1*m], fft_twiddle(1*k*tw_step));
+                    const fft_cpx s1 = fft_mul(out[k + 2*m], fft_twiddle(2*k*tw_step));
+                    const fft_cpx s2 = fft_mul(out[k + 3*m], fft_twiddle(3*k*tw_step));
+
+                    const fft_cpx s3 = { s0.r + s2.r, s0.i + s2.i };
+                    const fft_cpx s4 = { s0.r - s2.r, s0.i - s2.i };
+                    const fft_cpx s5 = { out[k].r - s1.r, out[k].i - s1.i };
+                    const fft_cpx a  = { out[k].r + s1.r, out[k].i + s1.i };
+
+                    out[k]       = { a.r + s3.r, a.i + s3.i };
+                    out[k + 2*m] = { a.r - s3.r, a.i - s3.i };
+                    out[k + 1*m] = { s5.r + s4.i, s5.i - s4.r };
+                    out[k + 3*m] = { s5.r - s4.i, s5.i + s4.r };
+                }
+            } break;
+        default:
+            {
+                // radix 3 and 5: the p-point DFTs of the sub-FFTs
+                fft_cpx scratch[5];
+                for (int k = 0; k < m; k++) {
+                    for (int q = 0; q < p; q++) {
+                        scratch[q] = out[k + q*m];
+                    }
+                    for (int q = 0; q < p; q++) {
+                        const int kq = k + q*m;
+                        fft_cpx acc = scratch[0];
+                        int idx = 0;
+                        for (int j = 1; j < p; j++) {
+                            idx = (idx + tw_step*kq) % SIN_COS_N_COUNT;
+                            const fft_cpx t = fft_mul(scratch[j], fft_twiddle(idx));
+                            acc.r += t.r;
+                            acc.i += t.i;
+                        }
+                        out[kq] = acc;
+                    }
+                }
+            } break;
     }
-    float* even_fft = out + 2 * N;
-    fft(even, half_N, even_fft);
+}
 
-    float* odd = even;
-    for (int i = 0; i < half_N; ++i) {
-        odd[i] = in[2*i + 1];
-    }
-    float* odd_fft = even_fft + N;
-    fft(odd, half_N, odd_fft);
+// power spectrum |X[k]|^2, k = 0 .. n/2, of n real samples (n even)
+// the even and odd samples are the real and imaginary parts of an FFT of n/2 points, which is then split in the two spectra
+static void fft_power(const float * in, int n, const std::vector<int> & factors, std::vector<fft_cpx> & buf, float * power) {
+    const int m = n / 2;
+    buf.resize(2*m);
+
+    fft_cpx * z_in = buf.data();
+    fft_cpx * z    = buf.data() + m;
+    memcpy(z_in, in, n*sizeof(float));
 
-    const int sin_cos_step = SIN_COS_N_COUNT / N;
-    for (int k = 0; k < half_N; k++) {
-        int idx = k * sin_cos_step; // t = 2*M_PI*k/N
-        float re = global_cache.cos_vals[idx]; // cos(t)
-        float im = -global_cache.sin_vals[idx]; // sin(t)
+    fft_work(z, z_in, 1, SIN_COS_N_COUNT / m, factors.data());
 
-        float re_odd = odd_fft[2*k + 0];
-        float im_odd = odd_fft[2*k + 1];
+    const int tw_step = SIN_COS_N_COUNT / n;
+    for (int k = 0; k <= m; k++) {
+        const fft_cpx a = z[k % m];
+        const fft_cpx b = { z[(m - k) % m].r, -z[(m - k) % m].i };
 
-        out[2*k + 0] = even_fft[2*k + 0] + re*re_odd - im*im_odd;
-        out[2*k + 1] = even_fft[2*k + 1] + re*im_odd + im*re_odd;
+        // spectra of the even and odd samples
+        const fft_cpx e = { 0.5f*(a.r + b.r), 0.5f*(a.i + b.i) };
+        const fft_cpx o = { 0.5f*(a.i - b.i), -0.5f*(a.r - b.r) };
 
-        out[2*(k + half_N) + 0] = even_fft[2*k + 0] - re*re_odd + im*im_odd;
-        out[2*(k + half_N) + 1] = even_fft[2*k + 1] - re*im_odd - im*re_odd;
+        const fft_cpx t = fft_mul(o, fft_twiddle(k*tw_step));
+        const float re = e.r + t.r;
+        const float im = e.i + t.i;
+        power[k] = re*re + im*im;
     }
 }
 
 static void log_mel_spectrogram_worker_thread(int ith, const float * hann, const std::vector<float> & samples,
                                               int n_samples, int frame_size, int frame_step, int n_threads,
-                                              const whisper_filters & filters, whisper_mel & mel) {
-    std::vector<float> fft_in(frame_size * 2, 0.0);
-    std::vector<float> fft_out(frame_size * 2 * 2 * 2);
+                                              const whisper_filters & filters, const std::vector<int> & factors,
+                                              const std::vector<std::pair<int, int>> & mel_ranges, whisper_mel & mel) {
+    std::vector<float> fft_in(frame_size, 0.0);
+    std::vector<float> fft_out(frame_size / 2 + 1);
+    std::vector<fft_cpx> fft_buf;
 
     int n_fft = filters.n_fft;
     int i = ith;
@@ -149,30 +210,15 @@ static void log_mel_spectrogram_worker_thread(int ith, const float * hann, const
             std::fill(fft_in.begin() + (n_samples - offset), fft_in.end(), 0.0);
         }
 
-        // FFT
-        fft(fft_in.data(), frame_size, fft_out.data());
-
-        // Calculate modulus^2 of complex numbers
-        // Use pow(fft_out[2 * j + 0], 2) + pow(fft_out[2 * j + 1], 2) causes inference quality problem? Interesting.
-        for (int j = 0; j < n_fft; j++) {
-            fft_out[j] = (fft_out[2 * j + 0] * fft_out[2 * j + 0] + fft_out[2 * j + 1] * fft_out[2 * j + 1]);
-        }
+        // modulus^2 of the FFT
+        fft_power(fft_in.data(), frame_size, factors, fft_buf, fft_out.data());
 
-        // mel spectrogram
+        // mel spectrogram, only over the non-zero weights of each filter
         for (int j = 0; j < mel.n_mel; j++) {
+            const float * w = filters.data.data() + j * n_fft;
             double sum = 0.0;
-            // unroll loop (suggested by GH user @lunixbochs)
-            int k = 0;
-            for (k = 0; k < n_fft - 3; k += 4) {
-                sum +=
-                        fft_out[k + 0] * filters.data[j * n_fft + k + 0] +
-                        fft_out[k + 1] * filters.data[j * n_fft + k + 1] +
-                        fft_out[k + 2] * filters.data[j * n_fft + k + 2] +
-                        fft_out[k + 3] * filters.data[j * n_fft + k + 3];
-            }
-            // handle n_fft remainder
-            for (; k < n_fft; k++) {
-                sum += fft_out[k] * filters.data[j * n_fft + k];
+            for (int k = mel_ranges[j].first; k < mel_ranges[j].second; k++) {
+                sum += fft_out[k] * w[k];
             }
             sum = log10(std::max(sum, 1e-10));
             mel.data[j * mel.n_len + i] = sum;
@@ -229,17 +275,31 @@ static bool log_mel_spectrogram(
     mel.n_len_org = 1 + (n_samples + stage_2_pad - frame_size) / frame_step;
     mel.data.resize(mel.n_mel * mel.n_len);
 
+    // the frame is real, its FFT is a complex FFT of half the size
+    const std::vector<int> factors = fft_factors(frame_size / 2);
+
+    // the mel filters are triangular, most of their weights are zero
+    std::vector<std::pair<int, int>> mel_ranges(n_mel, { 0, 0 });
+    for (int j = 0; j < n_mel; j++) {
+        const float * w = filters.data.data() + j * filters.n_fft;
+        int k0 = 0;
+        int k1 = filters.n_fft;
+        while (k0 < k1 && w[k0]     == 0.0f) { k0++; }
+        while (k1 > k0 && w[k1 - 1] == 0.0f) { k1--; }
+        mel_ranges[j] = { k0, k1 };
+    }
+
     {
         std::vector<std::thread> workers(n_threads - 1);
         for (int iw = 0; iw < n_threads - 1; ++iw) {
             workers[iw] = std::thread(
                     log_mel_spectrogram_worker_thread, iw + 1, hann, std::cref(samples_padded),
                     n_samples + stage_2_pad, frame_size, frame_step, n_threads,
-                    std::cref(filters), std::ref(mel));
+                    std::cref(filters), std::cref(factors), std::cref(mel_ranges), std::ref(mel));
         }
 
         // main thread
-        log_mel_spectrogram_worker_thread(0, hann, samples_padded, n_samples + stage_2_pad, frame_size, frame_step, n_threads, filters, mel);
+        log_mel_spectrogram_worker_thread(0, hann, samples_padded, n_samples + stage_2_pad, frame_size, frame_step, n_threads, filters, factors, mel_ranges, mel);
 
         for (int iw = 0; iw < n_threads - 1; ++iw) {
             workers[iw].join();
@@ -130,6 +130,7 @@ struct mtmd_cli_context {
         mtmd_context_params mparams = mtmd_context_params_default();
         mparams.use_gpu = params.mmproj_use_gpu;
         mparams.print_timings = true;
+        mparams.flash_attn = params.flash_attn;
         mparams.n_threads = params.cpuparams.n_threads;
         mparams.verbosity = params.verbosity > 0 ? GGML_LOG_LEVEL_DEBUG : GGML_LOG_LEVEL_INFO;
         ctx_vision.reset(mtmd_init_from_file(clip_path, model, mparams));
@@ -87,6 +87,7 @@ mtmd_context_params mtmd_context_params_default() {
     mtmd_context_params params;
     params.use_gpu = true;
     params.print_timings = true;
+    params.flash_attn = false;
     params.n_threads = 4;
     params.verbosity = GGML_LOG_LEVEL_INFO;
     params.image_marker = MTMD_DEFAULT_IMAGE_MARKER;
@@ -150,8 +151,9 @@ struct mtmd_context {
         }
 
         clip_context_params ctx_clip_params;
-        ctx_clip_params.use_gpu   = ctx_params.use_gpu;
-        ctx_clip_params.verbosity = ctx_params.verbosity;
+        ctx_clip_params.use_gpu    = ctx_params.use_gpu;
+        ctx_clip_params.flash_attn = ctx_params.flash_attn;
+        ctx_clip_params.verbosity  = ctx_params.verbosity;
         auto res = clip_init(mmproj_fname, ctx_clip_params);
         ctx_v = res.ctx_v;
         ctx_a = res.ctx_a;
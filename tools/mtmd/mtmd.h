@@ -78,6 +78,7 @@ typedef struct mtmd_input_text   mtmd_input_text;
 struct mtmd_context_params {
     bool use_gpu;
     bool print_timings;
+    bool flash_attn; // use flash attention in the encoder
     int n_threads;
     enum ggml_log_level verbosity;
     const char * image_marker; // deprecated, use media_marker instead
@@ -135,8 +135,9 @@ struct rpc_server_params {
     int         port        = 50052;
     size_t      backend_mem = 0;
     bool        use_cache   = false;
+    std::vector<std::string> gguf_files;
     int         n_threads   = std::max(1U, std::thread::hardware_concurrency()/2);
-    std::string device;
+    std::vector<std::string> devices;
 };
 
 static void print_usage(int /*argc*/, char ** argv, rpc_server_params params) {
@@ -144,11 +145,12 @@ static void print_usage(int /*argc*/, char ** argv, rpc_server_params params) {
     fprintf(stderr, "options:\n");
     fprintf(stderr, "  -h, --help                show this help message and exit\n");
     fprintf(stderr, "  -t,      --threads        number of threads for the CPU backend (default: %d)\n", params.n_threads);
-    fprintf(stderr, "  -d DEV,  --device         device to use\n");
+    fprintf(stderr, "  -d DEV,  --device         comma-separated list of devices to use (default: all GPUs)\n");
     fprintf(stderr, "  -H HOST, --host HOST      host to bind to (default: %s)\n", params.host.c_str());
     fprintf(stderr, "  -p PORT, --port PORT      port to bind to (default: %d)\n", params.port);
-    fprintf(stderr, "  -m MEM,  --mem MEM        backend memory size (in MB)\n");
+    fprintf(stderr, "  -m MEM,  --mem MEM        backend memory size of each device (in MB)\n");
     fprintf(stderr, "  -c,      --cache          enable local file cache\n");
+    fprintf(stderr, "  --gguf FNAME              local copy of a model file (or of a split) to load the weights from, can be repeated\n");
     fprintf(stderr, "\n");
 }
 
@@ -174,17 +176,28 @@ static bool rpc_server_params_parse(int argc, char ** argv, rpc_server_params &
             if (++i >= argc) {
                 return false;
             }
-            params.device = argv[i];
-            if (ggml_backend_dev_by_name(params.device.c_str()) == nullptr) {
-                fprintf(stderr, "error: unknown device: %s\n", params.device.c_str());
-                fprintf(stderr, "available devices:\n");
-                for (size_t i = 0; i < ggml_backend_dev_count(); i++) {
-                    auto * dev = ggml_backend_dev_get(i);
-                    size_t free, total;
-                    ggml_backend_dev_memory(dev, &free, &total);
-                    printf("  %s: %s (%zu MiB, %zu MiB free)\n", ggml_backend_dev_name(dev), ggml_backend_dev_description(dev), total / 1024 / 1024, free / 1024 / 1024);
+            std::string devices = argv[i];
+            size_t pos = 0;
+            while (pos <= devices.size()) {
+                size_t end = devices.find(',', pos);
+                if (end == std::string::npos) {
+                    end = devices.size();
+                }
+                params.devices.push_back(devices.substr(pos, end - pos));
+                pos = end + 1;
+            }
+            for (const auto & device : params.devices) {
+                if (ggml_backend_dev_by_name(device.c_str()) == nullptr) {
+                    fprintf(stderr, "error: unknown device: %s\n", device.c_str());
+                    fprintf(stderr, "available devices:\n");
+                    for (size_t i = 0; i < ggml_backend_dev_count(); i++) {
+                        auto * dev = ggml_backend_dev_get(i);
+                        size_t free, total;
+                        ggml_backend_dev_memory(dev, &free, &total);
+                        printf("  %s: %s (%zu MiB, %zu MiB free)\n", ggml_backend_dev_name(dev), ggml_backend_dev_description(dev), total / 1024 / 1024, free / 1024 / 1024);
+                    }
+                    return false;
                 }
-                return false;
             }
         } else if (arg == "-p" || arg == "--port") {
             if (++i >= argc) {
@@ -196,6 +209,11 @@ static bool rpc_server_params_parse(int argc, char ** argv, rpc_server_params &
             }
         } else if (arg == "-c" || arg == "--cache") {
             params.use_cache = true;
+        } else if (arg == "--gguf") {
+            if (++i >= argc) {
+                return false;
+            }
+            params.gguf_files.push_back(argv[i]);
         } else if (arg == "-m" || arg == "--mem") {
             if (++i >= argc) {
                 return false;
@@ -213,45 +231,63 @@ static bool rpc_server_params_parse(int argc, char ** argv, rpc_server_params &
     return true;
 }
 
-static ggml_backend_t create_backend(const rpc_server_params & params) {
-    ggml_backend_t backend = nullptr;
+static ggml_backend_t create_backend(const rpc_server_params & params, ggml_backend_dev_t dev) {
+    ggml_backend_t backend = ggml_backend_dev_init(dev, nullptr);
+    if (!backend) {
+        fprintf(stderr, "Failed to create backend for device %s\n", ggml_backend_dev_name(dev));
+        return nullptr;
+    }
 
-    if (!params.device.empty()) {
-        ggml_backend_dev_t dev = ggml_backend_dev_by_name(params.device.c_str());
-        if (dev) {
-            backend = ggml_backend_dev_init(dev, nullptr);
-            if (!backend) {
-                fprintf(stderr, "Failed to create backend for device %s\n", params.device.c_str());
-                return nullptr;
-            }
+    fprintf(stderr, "%s: using %s backend\n", __func__, ggml_backend_name(backend));
+
+    // set the number of threads
+    ggml_backend_reg_t reg = ggml_backend_dev_backend_reg(dev);
+    if (reg) {
+        auto ggml_backend_set_n_threads_fn = (ggml_backend_set_n_threads_t) ggml_backend_reg_get_proc_address(reg, "ggml_backend_set_n_threads");
+        if (ggml_backend_set_n_threads_fn) {
+            ggml_backend_set_n_threads_fn(backend, params.n_threads);
         }
     }
 
-    // try to initialize a GPU backend first
-    if (!backend) {
-        backend = ggml_backend_init_by_type(GGML_BACKEND_DEVICE_TYPE_GPU, nullptr);
+    return backend;
+}
+
+static std::vector<ggml_backend_t> create_backends(const rpc_server_params & params) {
+    std::vector<ggml_backend_dev_t> devs;
+    for (const auto & device : params.devices) {
+        devs.push_back(ggml_backend_dev_by_name(device.c_str()));
     }
 
-    // if there aren't GPU backends fallback to CPU backend
-    if (!backend) {
-        backend = ggml_backend_init_by_type(GGML_BACKEND_DEVICE_TYPE_CPU, nullptr);
+    // use all the GPUs by default
+    if (devs.empty()) {
+        for (size_t i = 0; i < ggml_backend_dev_count(); i++) {
+            ggml_backend_dev_t dev = ggml_backend_dev_get(i);
+            if (ggml_backend_dev_type(dev) == GGML_BACKEND_DEVICE_TYPE_GPU) {
+                devs.push_back(dev);
+            }
+        }
     }
 
-    if (backend) {
-        fprintf(stderr, "%s: using %s backend\n", __func__, ggml_backend_name(backend));
+    // if there aren't GPU backends fallback to CPU backend
+    if (devs.empty()) {
+        ggml_backend_dev_t dev = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
+        if (dev) {
+            devs.push_back(dev);
+        }
+    }
 
-        // set the number of threads
-        ggml_backend_dev_t dev = ggml_backend_get_device(backend);
-        ggml_backend_reg_t reg = dev ? ggml_backend_dev_backend_reg(dev) : nullptr;
-        if (reg) {
-            auto ggml_backend_set_n_threads_fn = (ggml_backend_set_n_threads_t) ggml_backend_reg_get_proc_address(reg, "ggml_backend_set_n_threads");
-            if (ggml_backend_set_n_threads_fn) {
-                ggml_backend_set_n_threads_fn(backend, params.n_threads);
+    std::vector<ggml_backend_t> backends;
+    for (auto * dev : devs) {
+        ggml_backend_t backend = create_backend(params, dev);
+        if (!backend) {
+            for (auto * b : backends) {
+                ggml_backend_free(b);
             }
+            return {};
         }
+        backends.push_back(backend);
     }
-
-    return backend;
+    return backends;
 }
 
 static void get_backend_memory(ggml_backend_t backend, size_t * free_mem, size_t * total_mem) {
@@ -279,18 +315,21 @@ int main(int argc, char * argv[]) {
         fprintf(stderr, "\n");
     }
 
-    ggml_backend_t backend = create_backend(params);
-    if (!backend) {
+    std::vector<ggml_backend_t> backends = create_backends(params);
+    if (backends.empty()) {
         fprintf(stderr, "Failed to create backend\n");
         return 1;
     }
     std::string endpoint = params.host + ":" + std::to_string(params.port);
-    size_t free_mem, total_mem;
-    if (params.backend_mem > 0) {
-        free_mem = params.backend_mem;
-        total_mem = params.backend_mem;
-    } else {
-        get_backend_memory(backend, &free_mem, &total_mem);
+    std::vector<size_t> free_mem(backends.size());
+    std::vector<size_t> total_mem(backends.size());
+    for (size_t i = 0; i < backends.size(); i++) {
+        if (params.backend_mem > 0) {
+            free_mem[i] = params.backend_mem;
+            total_mem[i] = params.backend_mem;
+        } else {
+            get_backend_memory(backends[i], &free_mem[i], &total_mem[i]);
+        }
     }
     const char * cache_dir = nullptr;
     std::string cache_dir_str;
@@ -309,14 +348,29 @@ int main(int argc, char * argv[]) {
         return 1;
     }
 
-    auto start_server_fn = (decltype(ggml_backend_rpc_start_server)*) ggml_backend_reg_get_proc_address(reg, "ggml_backend_rpc_start_server");
+    if (!params.gguf_files.empty()) {
+        auto add_gguf_fn = (decltype(ggml_backend_rpc_server_add_gguf)*) ggml_backend_reg_get_proc_address(reg, "ggml_backend_rpc_server_add_gguf");
+        if (!add_gguf_fn) {
+            fprintf(stderr, "Failed to obtain RPC backend add GGUF function\n");
+            return 1;
+        }
+        for (const auto & fname : params.gguf_files) {
+            if (!add_gguf_fn(fname.c_str())) {
+                return 1;
+            }
+        }
+    }
+
+    auto start_server_fn = (decltype(ggml_backend_rpc_start_server_multi)*) ggml_backend_reg_get_proc_address(reg, "ggml_backend_rpc_start_server_multi");
     if (!start_server_fn) {
         fprintf(stderr, "Failed to obtain RPC backend start server function\n");
         return 1;
     }
 
-    start_server_fn(backend, endpoint.c_str(), cache_dir, free_mem, total_mem);
+    start_server_fn(endpoint.c_str(), cache_dir, backends.size(), backends.data(), free_mem.data(), total_mem.data());
 
-    ggml_backend_free(backend);
+    for (auto * backend : backends) {
+        ggml_backend_free(backend);
+    }
     return 0;
 }
@@ -0,0 +1,1077 @@
+// load-testing driver for llama-server
+//
+// replays a stream of /completion requests against a running server, either generated (Poisson arrivals, uniform
+// prompt/output lengths, optional shared prefix) or read from a trace file, and reports the serving latencies:
+//   TTFT - time to first token, from the scheduled arrival of the request
+//   TPOT - time per output token, after the first one
+//   E2E  - end-to-end latency of the request, from the scheduled arrival
+//
+// the output formats are the ones of llama-bench
+
+#include "common.h"
+
+#define CPPHTTPLIB_TCP_NODELAY true
+#include <cpp-httplib/httplib.h>
+
+#include <nlohmann/json.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using json = nlohmann::ordered_json;
+
+// utils
+static uint64_t get_time_ns() {
+    using clock = std::chrono::steady_clock;
+    return std::chrono::nanoseconds(clock::now().time_since_epoch()).count();
+}
+
+template <class T> static std::string join(const std::vector<T> & values, const std::string & delim) {
+    std::ostringstream str;
+    for (size_t i = 0; i < values.size(); i++) {
+        str << values[i];
+        if (i < values.size() - 1) {
+            str << delim;
+        }
+    }
+    return str.str();
+}
+
+// linear interpolation between the closest ranks, v must be sorted
+static double percentile(const std::vector<double> & v, double p) {
+    if (v.empty()) {
+        return 0.0;
+    }
+    const double pos  = p / 100.0 * (v.size() - 1);
+    const size_t lo   = (size_t) pos;
+    const size_t hi   = std::min(lo + 1, v.size() - 1);
+    const double frac = pos - lo;
+    return v[lo] + (v[hi] - v[lo]) * frac;
+}
+
+static double mean(const std::vector<double> & v) {
+    if (v.empty()) {
+        return 0.0;
+    }
+    double sum = 0.0;
+    for (double x : v) {
+        sum += x;
+    }
+    return sum / v.size();
+}
+
+// parse "N" or "MIN-MAX"
+static std::pair<int, int> parse_range(const std::string & s) {
+    const size_t dash = s.find('-', 1);
+    if (dash == std::string::npos) {
+        const int v = std::stoi(s);
+        return { v, v };
+    }
+    const int lo = std::stoi(s.substr(0, dash));
+    const int hi = std::stoi(s.substr(dash + 1));
+    if (lo > hi) {
+        throw std::invalid_argument("invalid range: " + s);
+    }
+    return { lo, hi };
+}
+
+enum output_formats { NONE, CSV, JSON, JSONL, MARKDOWN, SQL };
+
+static bool output_format_from_str(const std::string & s, output_formats & format) {
+    if (s == "none") {
+        format = NONE;
+    } else if (s == "csv") {
+        format = CSV;
+    } else if (s == "json") {
+        format = JSON;
+    } else if (s == "jsonl") {
+        format = JSONL;
+    } else if (s == "md") {
+        format = MARKDOWN;
+    } else if (s == "sql") {
+        format = SQL;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+struct cmd_params {
+    std::string         url;
+    std::string         api_key;
+    int                 n_requests;
+    std::vector<double> rate;
+    std::vector<int>    concurrency;
+    std::pair<int, int> n_prompt;
+    std::pair<int, int> n_gen;
+    int                 n_prefix;
+    uint32_t            seed;
+    std::string         trace;
+    std::string         dump_trace;
+    double              slo_ttft_ms;
+    double              slo_tpot_ms;
+    int                 metrics_interval_ms;
+    int                 timeout_s;
+    output_formats      output_format;
+    bool                verbose;
+};
+
+static const cmd_params cmd_params_defaults = {
+    /* url                 */ "http://127.0.0.1:8080",
+    /* api_key             */ "",
+    /* n_requests          */ 64,
+    /* rate                */ { 0.0 },
+    /* concurrency         */ { 16 },
+    /* n_prompt            */ { 128, 512 },
+    /* n_gen               */ { 32, 128 },
+    /* n_prefix            */ 0,
+    /* seed                */ 42,
+    /* trace               */ "",
+    /* dump_trace          */ "",
+    /* slo_ttft_ms         */ 0.0,
+    /* slo_tpot_ms         */ 0.0,
+    /* metrics_interval_ms */ 250,
+    /* timeout_s           */ 600,
+    /* output_format       */ MARKDOWN,
+    /* verbose             */ false,
+};
+
+static const char * output_format_str(output_formats format) {
+    switch (format) {
+        case NONE:
+            return "none";
+        case CSV:
+            return "csv";
+        case JSON:
+            return "json";
+        case JSONL:
+            return "jsonl";
+        case MARKDOWN:
+            return "md";
+        case SQL:
+            return "sql";
+    }
+    GGML_ABORT("invalid output format");
+}
+
+static void print_usage(int /* argc */, char ** argv) {
+    printf("usage: %s [options]\n", argv[0]);
+    printf("\n");
+    printf("options:\n");
+    printf("  -h, --help\n");
+    printf("  --url <url>                               server url (default: %s)\n", cmd_params_defaults.url.c_str());
+    printf("  --api-key <key>                           API key sent as a bearer token (default: none)\n");
+    printf("  -n, --n-requests <n>                      number of requests per test (default: %d)\n", cmd_params_defaults.n_requests);
+    printf("  -r, --rate <r>                            mean arrival rate in requests/s, Poisson arrivals, 0 = all at once (default: %s)\n",
+           join(cmd_params_defaults.rate, ",").c_str());
+    printf("  -c, --concurrency <n>                     maximum number of requests in flight (default: %s)\n",
+           join(cmd_params_defaults.concurrency, ",").c_str());
+    printf("  -p, --n-prompt <n|min-max>                prompt length in tokens, uniform in the range (default: %d-%d)\n",
+           cmd_params_defaults.n_prompt.first, cmd_params_defaults.n_prompt.second);
+    printf("  -g, --n-gen <n|min-max>                   output length in tokens, uniform in the range (default: %d-%d)\n",
+           cmd_params_defaults.n_gen.first, cmd_params_defaults.n_gen.second);
+    printf("  --prefix <n>                              tokens of prompt prefix shared by all requests (default: %d)\n", cmd_params_defaults.n_prefix);
+    printf("  -s, --seed <n>                            seed of the generated workload (default: %u)\n", cmd_params_defaults.seed);
+    printf("  --trace <file>                            replay the requests of a JSONL trace instead of generating them\n");
+    printf("  --dump-trace <file>                       write the requests of the first test to a JSONL trace\n");
+    printf("  --slo-ttft <ms>                           TTFT objective of the goodput, 0 = none (default: %.0f)\n", cmd_params_defaults.slo_ttft_ms);
+    printf("  --slo-tpot <ms>                           TPOT objective of the goodput, 0 = none (default: %.0f)\n", cmd_params_defaults.slo_tpot_ms);
+    printf("  --metrics-interval <ms>                   period of the /metrics sampling, 0 = disabled (default: %d)\n",
+           cmd_params_defaults.metrics_interval_ms);
+    printf("  --timeout <s>                             read timeout of a request (default: %d)\n", cmd_params_defaults.timeout_s);
+    printf("  -o, --output <csv|json|jsonl|md|sql>      output format printed to stdout (default: %s)\n",
+           output_format_str(cmd_params_defaults.output_format));
+    printf("  -v, --verbose                             print a line per request to stderr\n");
+    printf("\n");
+    printf("Multiple values can be given for the rate and the concurrency, separated by commas; a test is run for each combination.\n");
+}
+
+static cmd_params parse_cmd_params(int argc, char ** argv) {
+    cmd_params        params = cmd_params_defaults;
+    std::string       arg;
+    bool              invalid_param = false;
+    const std::string arg_prefix    = "--";
+    const char        split_delim   = ',';
+
+    // lists are replaced, not appended to the defaults
+    bool rate_set        = false;
+    bool concurrency_set = false;
+
+    for (int i = 1; i < argc; i++) {
+        arg = argv[i];
+        if (arg.compare(0, arg_prefix.size(), arg_prefix) == 0) {
+            std::replace(arg.begin(), arg.end(), '_', '-');
+        }
+
+        try {
+            if (arg == "-h" || arg == "--help") {
+                print_usage(argc, argv);
+                exit(0);
+            } else if (arg == "--url") {
+                if (++i >= argc) {
+                    invalid_param = true;
+                    break;
+                }
+                params.url = argv[i];
+                while (!params.url.empty() && params.url.back() == '/') {
+                    params.url.pop_back();
+                }
+            } else if (arg == "--api-key") {
+                if (++i >= argc) {
+                    invalid_param = true;
+                    break;
+                }
+                params.api_key = argv[i];
+            } else if (arg == "-n" || arg == "--n-requests") {
+                if (++i >= argc) {
+                    invalid_param = true;
+                    break;
+                }
+                params.n_requests = std::stoi(argv[i]);
+            } else if (arg == "-r" || arg == "--rate") {
+                if (++i >= argc) {
+                    invalid_param = true;
+                    break;
+                }
+                if (!rate_set) {
+                    params.rate.clear();
+                    rate_set = true;
+                }
+                auto p = string_split<double>(argv[i], split_delim);
+                params.rate.insert(params.rate.end(), p.begin(), p.end());
+            } else if (arg == "-c" || arg == "--concurrency") {
+                if (++i >= argc) {
+                    invalid_param = true;
+                    break;
+                }
+                if (!concurrency_set) {
+                    params.concurrency.clear();
+                    concurrency_set = true;
+                }
+                auto p = string_split<int>(argv[i], split_delim);
+                params.concurrency.insert(params.concurrency.end(), p.begin(), p.end());
+            } else if (arg == "-p" || arg == "--n-prompt") {
+                if (++i >= argc) {
+                    invalid_param = true;
+                    break;
+                }
+                params.n_prompt = parse_range(argv[i]);
+            } else if (arg == "-g" || arg == "--n-gen") {
+                if (++i >= argc) {
+                    invalid_param = true;
+                    break;
+                }
+                params.n_gen = parse_range(argv[i]);
+            } else if (arg == "--prefix") {
+                if (++i >= argc) {
+                    invalid_param = true;
+                    break;
+                }
+                params.n_prefix = std::stoi(argv[i]);
+            } else if (arg == "-s" || arg == "--seed") {
+                if (++i >= argc) {
+                    invalid_param = true;
+                    break;
+                }
+                params.seed = std::stoul(argv[i]);
+            } else if (arg == "--trace") {
+                if (++i >= argc) {
+                    invalid_param = true;
+                    break;
+                }
+                params.trace = argv[i];
+            } else if (arg == "--dump-trace") {
+                if (++i >= argc) {
+                    invalid_param = true;
+                    break;
+                }
+                params.dump_trace = argv[i];
+            } else if (arg == "--slo-ttft") {
+                if (++i >= argc) {
+                    invalid_param = true;
+                    break;
+                }
+                params.slo_ttft_ms = std::stod(argv[i]);
+            } else if (arg == "--slo-tpot") {
+                if (++i >= argc) {
+                    invalid_param = true;
+                    break;
+                }
+                params.slo_tpot_ms = std::stod(argv[i]);
+            } else if (arg == "--metrics-interval") {
+                if (++i >= argc) {
+                    invalid_param = true;
+                    break;
+                }
+                params.metrics_interval_ms = std::stoi(argv[i]);
+            } else if (arg == "--timeout") {
+                if (++i >= argc) {
+                    invalid_param = true;
+                    break;
+                }
+                params.timeout_s = std::stoi(argv[i]);
+            } else if (arg == "-o" || arg == "--output") {
+                if (++i >= argc) {
+                    invalid_param = true;
+                    break;
+                }
+                invalid_param = !output_format_from_str(argv[i], params.output_format);
+            } else if (arg == "-v" || arg == "--verbose") {
+                params.verbose = true;
+            } else {
+                invalid_param = true;
+                break;
+            }
+        } catch (const std::exception & e) {
+            fprintf(stderr, "error: %s\n", e.what());
+            invalid_param = true;
+            break;
+        }
+    }
+
+    if (!invalid_param) {
+        invalid_param = params.n_requests <= 0 || params.rate.empty() || params.concurrency.empty() ||
+                        params.n_prompt.first < 1 || params.n_gen.first < 1 || params.n_prefix < 0;
+        for (double r : params.rate) {
+            invalid_param |= r < 0.0;
+        }
+        for (int c : params.concurrency) {
+            invalid_param |= c < 1;
+        }
+    }
+
+    if (invalid_param) {
+        fprintf(stderr, "error: invalid parameter for argument: %s\n", arg.c_str());
+        print_usage(argc, argv);
+        exit(1);
+    }
+
+    return params;
+}
+
+//
+// workload
+//
+
+struct bench_request {
+    double t_arrival; // seconds since the start of the test
+    json   prompt;    // string or array of token ids
+    int    n_predict;
+};
+
+static std::vector<bench_request> read_trace(const std::string & fname) {
+    std::ifstream f(fname);
+    if (!f) {
+        throw std::runtime_error("failed to open trace file: " + fname);
+    }
+
+    std::vector<bench_request> reqs;
+    std::string line;
+    while (std::getline(f, line)) {
+        if (line.empty()) {
+            continue;
+        }
+        const json j = json::parse(line);
+
+        bench_request req;
+        req.t_arrival = j.value("t", 0.0);
+        req.prompt    = j.at("prompt");
+        req.n_predict = j.value("n_predict", cmd_params_defaults.n_gen.second);
+        reqs.push_back(std::move(req));
+    }
+
+    std::stable_sort(reqs.begin(), reqs.end(), [](const bench_request & a, const bench_request & b) {
+        return a.t_arrival < b.t_arrival;
+    });
+
+    return reqs;
+}
+
+static void write_trace(const std::string & fname, const std::vector<bench_request> & reqs) {
+    std::ofstream f(fname);
+    if (!f) {
+        throw std::runtime_error("failed to open trace file: " + fname);
+    }
+    for (const auto & req : reqs) {
+        f << json{ { "t", req.t_arrival }, { "prompt", req.prompt }, { "n_predict", req.n_predict } }.dump() << "\n";
+    }
+}
+
+// random token ids, avoiding the low ids where the special tokens usually are
+static std::vector<bench_request> generate_requests(const cmd_params & params, double rate, int n_vocab) {
+    std::mt19937 rng(params.seed);
+
+    const int tok_min = std::min(100, n_vocab / 2);
+    std::uniform_int_distribution<int> dist_tok(tok_min, n_vocab - 1);
+    std::uniform_int_distribution<int> dist_prompt(params.n_prompt.first, params.n_prompt.second);
+    std::uniform_int_distribution<int> dist_gen(params.n_gen.first, params.n_gen.second);
+    std::exponential_distribution<double> dist_gap(rate > 0.0 ? rate : 1.0);
+
+    std::vector<int> prefix(params.n_prefix);
+    for (auto & t : prefix) {
+        t = dist_tok(rng);
+    }
+
+    std::vector<bench_request> reqs(params.n_requests);
+
+    double t = 0.0;
+    for (auto & req : reqs) {
+        std::vector<int> tokens = prefix;
+        const int n_prompt = dist_prompt(rng);
+        while ((int) tokens.size() < params.n_prefix + n_prompt) {
+            tokens.push_back(dist_tok(rng));
+        }
+
+        req.t_arrival = t;
+        req.prompt    = tokens;
+        req.n_predict = dist_gen(rng);
+
+        if (rate > 0.0) {
+            t += dist_gap(rng);
+        }
+    }
+
+    return reqs;
+}
+
+//
+// client
+//
+
+struct bench_client {
+    std::string    url;
+    httplib::Headers headers;
+    int            timeout_s;
+
+    std::unique_ptr<httplib::Client> connect() const {
+        auto cli = std::make_unique<httplib::Client>(url);
+        cli->set_default_headers(headers);
+        cli->set_read_timeout(timeout_s, 0);
+        cli->set_write_timeout(timeout_s, 0);
+        return cli;
+    }
+
+    json get_json(const std::string & path) const {
+        auto res = connect()->Get(path);
+        if (!res || res->status != 200) {
+            throw std::runtime_error("GET " + path + " failed");
+        }
+        return json::parse(res->body);
+    }
+};
+
+struct request_result {
+    bool   ok        = false;
+    int    n_prompt  = 0; // tokens in the prompt
+    int    n_eval    = 0; // prompt tokens evaluated, i.e. not taken from the cache
+    int    n_gen     = 0;
+    double ttft_ms   = 0.0;
+    double tpot_ms   = 0.0;
+    double e2e_ms    = 0.0;
+};
+
+// send one streamed completion, the latencies are measured from t_arrival_ns
+static request_result run_request(httplib::Client & cli, const bench_request & req, uint64_t t_arrival_ns) {
+    request_result r;
+
+    const json body = {
+        { "prompt",       req.prompt },
+        { "n_predict",    req.n_predict },
+        { "ignore_eos",   true },
+        { "cache_prompt", true },
+        { "stream",       true },
+    };
+
+    uint64_t t_first_ns = 0;
+    std::string pending;
+    json final_chunk;
+
+    httplib::Request hreq;
+    hreq.method = "POST";
+    hreq.path   = "/completion";
+    hreq.body   = body.dump();
+    hreq.set_header("Content-Type", "application/json");
+    hreq.content_receiver = [&](const char * data, size_t len, uint64_t, uint64_t) {
+        pending.append(data, len);
+
+        // server-sent events, one JSON object per "data: " line
+        size_t pos;
+        while ((pos = pending.find('\n')) != std::string::npos) {
+            std::string line = pending.substr(0, pos);
+            pending.erase(0, pos + 1);
+
+            if (line.rfind("data: ", 0) != 0) {
+                continue;
+            }
+            const json chunk = json::parse(line.substr(6), nullptr, false);
+            if (chunk.is_discarded()) {
+                continue;
+            }
+            if (t_first_ns == 0) {
+                t_first_ns = get_time_ns();
+            }
+            if (chunk.value("stop", false)) {
+                final_chunk = chunk;
+            }
+        }
+        return true;
+    };
+
+    auto res = cli.send(hreq);
+    const uint64_t t_end_ns = get_time_ns();
+
+    if (!res || res->status != 200 || final_chunk.is_null() || t_first_ns == 0) {
+        return r;
+    }
+
+    r.ok       = true;
+    r.n_gen    = final_chunk.value("tokens_predicted", 0);
+    r.n_prompt = final_chunk.value("tokens_evaluated", 0);
+    r.n_eval   = final_chunk.contains("timings") ? final_chunk.at("timings").value("prompt_n", r.n_prompt) : r.n_prompt;
+    r.ttft_ms  = (t_first_ns - t_arrival_ns) / 1e6;
+    r.e2e_ms   = (t_end_ns   - t_arrival_ns) / 1e6;
+    r.tpot_ms  = r.n_gen > 1 ? (r.e2e_ms - r.ttft_ms) / (r.n_gen - 1) : 0.0;
+
+    return r;
+}
+
+// samples the KV cache usage exported by the server on /metrics (requires --metrics)
+struct kv_sampler {
+    std::thread         worker;
+    std::atomic<bool>   stop { false };
+    std::vector<double> samples;
+    bool                available = true;
+
+    void start(const bench_client & client, int interval_ms) {
+        if (interval_ms <= 0) {
+            available = false;
+            return;
+        }
+        worker = std::thread([this, &client, interval_ms]() {
+            auto cli = client.connect();
+            while (!stop) {
+                auto res = cli->Get("/metrics");
+                if (!res || res->status != 200) {
+                    available = false;
+                    return;
+                }
+                const std::string key = "llamacpp:kv_cache_usage_ratio ";
+                const size_t pos = res->body.find("\n" + key);
+                if (pos == std::string::npos) {
+                    available = false;
+                    return;
+                }
+                samples.push_back(std::strtod(res->body.c_str() + pos + 1 + key.size(), nullptr));
+                std::this_thread::sleep_for(std::chrono::milliseconds(interval_ms));
+            }
+        });
+    }
+
+    void finish() {
+        stop = true;
+        if (worker.joinable()) {
+            worker.join();
+        }
+        available = available && !samples.empty();
+    }
+};
+
+//
+// results
+//
+
+struct test {
+    static const std::string build_commit;
+    static const int         build_number;
+    std::string              url;
+    std::string              model;
+    std::string              workload;
+    int                      n_requests;
+    double                   rate;
+    int                      concurrency;
+    int                      n_prefix;
+    double                   slo_ttft_ms;
+    double                   slo_tpot_ms;
+    int                      n_ok        = 0;
+    int                      n_failed    = 0;
+    double                   duration_s  = 0.0;
+    double                   avg_prompt  = 0.0;
+    double                   avg_gen     = 0.0;
+    double                   cache_ratio = 0.0;
+    double                   kv_avg      = -1.0;
+    double                   kv_max      = -1.0;
+    std::vector<double>      ttft_ms;
+    std::vector<double>      tpot_ms;
+    std::vector<double>      e2e_ms;
+    int                      n_gen_total = 0;
+    int                      n_good      = 0;
+    std::string              test_time;
+
+    double req_s()     const { return duration_s > 0.0 ? n_ok        / duration_s : 0.0; }
+    double gen_ts()    const { return duration_s > 0.0 ? n_gen_total / duration_s : 0.0; }
+    double goodput()   const { return duration_s > 0.0 ? n_good      / duration_s : 0.0; }
+
+    static const std::vector<std::string> & get_fields() {
+        static const std::vector<std::string> fields = {
+            "build_commit", "build_number", "url",         "model",       "workload",    "n_requests",
+            "rate",         "concurrency",  "n_prefix",    "slo_ttft_ms", "slo_tpot_ms", "n_ok",
+            "n_failed",     "duration_s",   "avg_prompt",  "avg_gen",     "cache_ratio", "req_s",
+            "gen_ts",       "goodput",      "ttft_p50_ms", "ttft_p95_ms", "ttft_p99_ms", "tpot_p50_ms",
+            "tpot_p95_ms",  "tpot_p99_ms",  "e2e_p50_ms",  "e2e_p95_ms",  "e2e_p99_ms",  "kv_avg",
+            "kv_max",       "test_time",
+        };
+        return fields;
+    }
+
+    enum field_type { STRING, INT, FLOAT };
+
+    static field_type get_field_type(const std::string & field) {
+        if (field == "build_number" || field == "n_requests" || field == "concurrency" || field == "n_prefix" ||
+            field == "n_ok" || field == "n_failed") {
+            return INT;
+        }
+        if (field == "build_commit" || field == "url" || field == "model" || field == "workload" || field == "test_time") {
+            return STRING;
+        }
+        return FLOAT;
+    }
+
+    std::vector<std::string> get_values() const {
+        auto f = [](double v) {
+            char buf[64];
+            snprintf(buf, sizeof(buf), "%.6f", v);
+            return std::string(buf);
+        };
+        std::vector<std::string> values = {
+            build_commit,
+            std::to_string(build_number),
+            url,
+            model,
+            workload,
+            std::to_string(n_requests),
+            f(rate),
+            std::to_string(concurrency),
+            std::to_string(n_prefix),
+            f(slo_ttft_ms),
+            f(slo_tpot_ms),
+            std::to_string(n_ok),
+            std::to_string(n_failed),
+            f(duration_s),
+            f(avg_prompt),
+            f(avg_gen),
+            f(cache_ratio),
+            f(req_s()),
+            f(gen_ts()),
+            f(goodput()),
+            f(percentile(ttft_ms, 50)),
+            f(percentile(ttft_ms, 95)),
+            f(percentile(ttft_ms, 99)),
+            f(percentile(tpot_ms, 50)),
+            f(percentile(tpot_ms, 95)),
+            f(percentile(tpot_ms, 99)),
+            f(percentile(e2e_ms, 50)),
+            f(percentile(e2e_ms, 95)),
+            f(percentile(e2e_ms, 99)),
+            f(kv_avg),
+            f(kv_max),
+            test_time,
+        };
+        return values;
+    }
+};
+
+const std::string test::build_commit = LLAMA_COMMIT;
+const int         test::build_number = LLAMA_BUILD_NUMBER;
+
+struct printer {
+    virtual ~printer() {}
+
+    FILE * fout;
+
+    virtual void print_header() {}
+
+    virtual void print_test(const test & t) = 0;
+
+    virtual void print_footer() {}
+};
+
+struct csv_printer : public printer {
+    static std::string escape_csv(const std::string & field) {
+        std::string escaped = "\"";
+        for (auto c : field) {
+            if (c == '"') {
+                escaped += "\"";
+            }
+            escaped += c;
+        }
+        escaped += "\"";
+        return escaped;
+    }
+
+    void print_header() override {
+        fprintf(fout, "%s\n", join(test::get_fields(), ",").c_str());
+    }
+
+    void print_test(const test & t) override {
+        std::vector<std::string> values = t.get_values();
+        std::transform(values.begin(), values.end(), values.begin(), escape_csv);
+        fprintf(fout, "%s\n", join(values, ",").c_str());
+    }
+};
+
+static std::string escape_json(const std::string & value) {
+    std::string escaped;
+    for (auto c : value) {
+        if (c == '"') {
+            escaped += "\\\"";
+        } else if (c == '\\') {
+            escaped += "\\\\";
+        } else if (c <= 0x1f) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            escaped += buf;
+        } else {
+            escaped += c;
+        }
+    }
+    return escaped;
+}
+
+static std::string format_json_value(const std::string & field, const std::string & value) {
+    switch (test::get_field_type(field)) {
+        case test::STRING:
+            return "\"" + escape_json(value) + "\"";
+        default:
+            return value;
+    }
+}
+
+struct json_printer : public printer {
+    bool first = true;
+
+    void print_header() override { fprintf(fout, "[\n"); }
+
+    void print_test(const test & t) override {
+        if (first) {
+            first = false;
+        } else {
+            fprintf(fout, ",\n");
+        }
+        fprintf(fout, "  {\n");
+        const auto & fields = test::get_fields();
+        const auto   values = t.get_values();
+        for (size_t i = 0; i < fields.size(); i++) {
+            fprintf(fout, "    \"%s\": %s,\n", fields.at(i).c_str(), format_json_value(fields.at(i), values.at(i)).c_str());
+        }
+        fprintf(fout, "    \"samples_ttft_ms\": [ %s ],\n", join(t.ttft_ms, ", ").c_str());
+        fprintf(fout, "    \"samples_tpot_ms\": [ %s ],\n", join(t.tpot_ms, ", ").c_str());
+        fprintf(fout, "    \"samples_e2e_ms\": [ %s ]\n",   join(t.e2e_ms,  ", ").c_str());
+        fprintf(fout, "  }");
+        fflush(fout);
+    }
+
+    void print_footer() override { fprintf(fout, "\n]\n"); }
+};
+
+struct jsonl_printer : public printer {
+    void print_test(const test & t) override {
+        fprintf(fout, "{");
+        const auto & fields = test::get_fields();
+        const auto   values = t.get_values();
+        for (size_t i = 0; i < fields.size(); i++) {
+            fprintf(fout, "\"%s\": %s, ", fields.at(i).c_str(), format_json_value(fields.at(i), values.at(i)).c_str());
+        }
+        fprintf(fout, "\"samples_ttft_ms\": [ %s ], ", join(t.ttft_ms, ", ").c_str());
+        fprintf(fout, "\"samples_tpot_ms\": [ %s ], ", join(t.tpot_ms, ", ").c_str());
+        fprintf(fout, "\"samples_e2e_ms\": [ %s ]",    join(t.e2e_ms,  ", ").c_str());
+        fprintf(fout, "}\n");
+        fflush(fout);
+    }
+};
+
+struct markdown_printer : public printer {
+    void print_header() override {
+        fprintf(fout, "| %8s | %6s | %4s | %9s | %8s | %8s | %7s | %-21s | %-21s | %-21s | %-11s |\n",
+                "requests", "rate", "conc", "prompt", "gen", "req/s", "goodput", "TTFT p50/p95/p99 ms",
+                "TPOT p50/p95/p99 ms", "E2E p50/p95/p99 ms", "KV avg/max");
+        fprintf(fout, "| %s: | %s: | %s: | %s: | %s: | %s: | %s: | %s: | %s: | %s: | %s: |\n",
+                std::string(7, '-').c_str(), std::string(5, '-').c_str(), std::string(3, '-').c_str(),
+                std::string(8, '-').c_str(), std::string(7, '-').c_str(), std::string(7, '-').c_str(),
+                std::string(6, '-').c_str(), std::string(20, '-').c_str(), std::string(20, '-').c_str(),
+                std::string(20, '-').c_str(), std::string(10, '-').c_str());
+    }
+
+    void print_test(const test & t) override {
+        char ttft[64], tpot[64], e2e[64], kv[32], reqs[32];
+        snprintf(reqs, sizeof(reqs), "%d/%d", t.n_ok, t.n_requests);
+        snprintf(ttft, sizeof(ttft), "%.1f/%.1f/%.1f", percentile(t.ttft_ms, 50), percentile(t.ttft_ms, 95), percentile(t.ttft_ms, 99));
+        snprintf(tpot, sizeof(tpot), "%.2f/%.2f/%.2f", percentile(t.tpot_ms, 50), percentile(t.tpot_ms, 95), percentile(t.tpot_ms, 99));
+        snprintf(e2e,  sizeof(e2e),  "%.1f/%.1f/%.1f", percentile(t.e2e_ms,  50), percentile(t.e2e_ms,  95), percentile(t.e2e_ms,  99));
+        if (t.kv_avg >= 0.0) {
+            snprintf(kv, sizeof(kv), "%.3f/%.3f", t.kv_avg, t.kv_max);
+        } else {
+            snprintf(kv, sizeof(kv), "n/a");
+        }
+        fprintf(fout, "| %8s | %6.2f | %4d | %9.1f | %8.1f | %8.2f | %7.2f | %21s | %21s | %21s | %11s |\n",
+                reqs, t.rate, t.concurrency, t.avg_prompt, t.avg_gen, t.req_s(), t.goodput(), ttft, tpot, e2e, kv);
+    }
+
+    void print_footer() override {
+        fprintf(fout, "\nbuild: %s (%d)\n", test::build_commit.c_str(), test::build_number);
+    }
+};
+
+struct sql_printer : public printer {
+    static std::string get_sql_field_type(const std::string & field) {
+        switch (test::get_field_type(field)) {
+            case test::STRING:
+                return "TEXT";
+            case test::INT:
+                return "INTEGER";
+            case test::FLOAT:
+                return "REAL";
+        }
+        GGML_ABORT("invalid field type");
+    }
+
+    void print_header() override {
+        const auto & fields = test::get_fields();
+        fprintf(fout, "CREATE TABLE IF NOT EXISTS llama_server_bench (\n");
+        for (size_t i = 0; i < fields.size(); i++) {
+            fprintf(fout, "  %s %s%s\n", fields.at(i).c_str(), get_sql_field_type(fields.at(i)).c_str(),
+                    i < fields.size() - 1 ? "," : "");
+        }
+        fprintf(fout, ");\n");
+        fprintf(fout, "\n");
+    }
+
+    void print_test(const test & t) override {
+        fprintf(fout, "INSERT INTO llama_server_bench (%s) ", join(test::get_fields(), ", ").c_str());
+        fprintf(fout, "VALUES (");
+        std::vector<std::string> values = t.get_values();
+        for (size_t i = 0; i < values.size(); i++) {
+            std::string v = values.at(i);
+            string_replace_all(v, "'", "''");
+            fprintf(fout, "'%s'%s", v.c_str(), i < values.size() - 1 ? ", " : "");
+        }
+        fprintf(fout, ");\n");
+    }
+};
+
+static std::unique_ptr<printer> create_printer(output_formats format) {
+    switch (format) {
+        case NONE:
+            return nullptr;
+        case CSV:
+            return std::unique_ptr<printer>(new csv_printer());
+        case JSON:
+            return std::unique_ptr<printer>(new json_printer());
+        case JSONL:
+            return std::unique_ptr<printer>(new jsonl_printer());
+        case MARKDOWN:
+            return std::unique_ptr<printer>(new markdown_printer());
+        case SQL:
+            return std::unique_ptr<printer>(new sql_printer());
+    }
+    GGML_ABORT("fatal error");
+}
+
+//
+// test driver
+//
+
+// open loop: the requests are released at their arrival time by a pool of `concurrency` clients; when all the
+// clients are busy the request waits, and the wait is part of its latencies
+static test run_test(const cmd_params & params, const bench_client & client, const std::vector<bench_request> & reqs,
+                     double rate, int concurrency) {
+    test t;
+    t.url         = params.url;
+    t.workload    = params.trace.empty() ? "synthetic" : params.trace;
+    t.n_requests  = (int) reqs.size();
+    t.rate        = rate;
+    t.concurrency = concurrency;
+    t.n_prefix    = params.trace.empty() ? params.n_prefix : 0;
+    t.slo_ttft_ms = params.slo_ttft_ms;
+    t.slo_tpot_ms = params.slo_tpot_ms;
+
+    std::vector<request_result> results(reqs.size());
+    std::atomic<size_t> next { 0 };
+
+    kv_sampler kv;
+    kv.start(client, params.metrics_interval_ms);
+
+    const uint64_t t_start_ns = get_time_ns();
+
+    std::vector<std::thread> workers;
+    for (int w = 0; w < std::min<int>(concurrency, reqs.size()); w++) {
+        workers.emplace_back([&]() {
+            auto cli = client.connect();
+            for (size_t i = next++; i < reqs.size(); i = next++) {
+                const uint64_t t_arrival_ns = t_start_ns + (uint64_t) (reqs[i].t_arrival * 1e9);
+                const uint64_t t_now_ns     = get_time_ns();
+                if (t_arrival_ns > t_now_ns) {
+                    std::this_thread::sleep_for(std::chrono::nanoseconds(t_arrival_ns - t_now_ns));
+                }
+                results[i] = run_request(*cli, reqs[i], t_arrival_ns);
+                if (params.verbose) {
+                    const auto & r = results[i];
+                    fprintf(stderr, "request %5zu: %s, prompt = %5d (%5d evaluated), gen = %5d, ttft = %8.1f ms, tpot = %7.2f ms, e2e = %8.1f ms\n",
+                            i, r.ok ? "ok    " : "failed", r.n_prompt, r.n_eval, r.n_gen, r.ttft_ms, r.tpot_ms, r.e2e_ms);
+                }
+            }
+        });
+    }
+    for (auto & w : workers) {
+        w.join();
+    }
+
+    t.duration_s = (get_time_ns() - t_start_ns) / 1e9;
+
+    kv.finish();
+    if (kv.available) {
+        t.kv_avg = mean(kv.samples);
+        t.kv_max = *std::max_element(kv.samples.begin(), kv.samples.end());
+    }
+
+    int64_t n_prompt_total = 0;
+    int64_t n_eval_total   = 0;
+    for (const auto & r : results) {
+        if (!r.ok) {
+            t.n_failed++;
+            continue;
+        }
+        t.n_ok++;
+        t.ttft_ms.push_back(r.ttft_ms);
+        t.e2e_ms.push_back(r.e2e_ms);
+        if (r.n_gen > 1) {
+            t.tpot_ms.push_back(r.tpot_ms);
+        }
+        t.n_gen_total  += r.n_gen;
+        n_prompt_total += r.n_prompt;
+        n_eval_total   += r.n_eval;
+
+        const bool good = (params.slo_ttft_ms <= 0.0 || r.ttft_ms <= params.slo_ttft_ms) &&
+                          (params.slo_tpot_ms <= 0.0 || r.tpot_ms <= params.slo_tpot_ms);
+        t.n_good += good;
+    }
+    if (t.n_ok > 0) {
+        t.avg_prompt  = (double) n_prompt_total / t.n_ok;
+        t.avg_gen     = (double) t.n_gen_total  / t.n_ok;
+        t.cache_ratio = n_prompt_total > 0 ? 1.0 - (double) n_eval_total / n_prompt_total : 0.0;
+    }
+
+    std::sort(t.ttft_ms.begin(), t.ttft_ms.end());
+    std::sort(t.tpot_ms.begin(), t.tpot_ms.end());
+    std::sort(t.e2e_ms.begin(),  t.e2e_ms.end());
+
+    time_t now = time(nullptr);
+    char   buf[sizeof("2011-10-08T07:07:09Z")];
+    strftime(buf, sizeof(buf), "%FT%TZ", gmtime(&now));
+    t.test_time = buf;
+
+    return t;
+}
+
+int main(int argc, char ** argv) {
+    cmd_params params = parse_cmd_params(argc, argv);
+
+    bench_client client;
+    client.url       = params.url;
+    client.timeout_s = params.timeout_s;
+    if (!params.api_key.empty()) {
+        client.headers.emplace("Authorization", "Bearer " + params.api_key);
+    }
+
+    std::string model;
+    int n_vocab = 0;
+    try {
+        const json models = client.get_json("/v1/models");
+        const json & m = models.at("data").at(0);
+        model   = m.value("id", "");
+        n_vocab = m.at("meta").value("n_vocab", 0);
+    } catch (const std::exception & e) {
+        fprintf(stderr, "%s: failed to query the server at %s: %s\n", __func__, params.url.c_str(), e.what());
+        return 1;
+    }
+
+    std::vector<bench_request> trace;
+    if (!params.trace.empty()) {
+        try {
+            trace = read_trace(params.trace);
+        } catch (const std::exception & e) {
+            fprintf(stderr, "%s: %s\n", __func__, e.what());
+            return 1;
+        }
+        if (trace.empty()) {
+            fprintf(stderr, "%s: the trace %s has no requests\n", __func__, params.trace.c_str());
+            return 1;
+        }
+    } else if (n_vocab <= 1) {
+        fprintf(stderr, "%s: the server did not report the vocabulary size\n", __func__);
+        return 1;
+    }
+
+    std::unique_ptr<printer> p = create_printer(params.output_format);
+    if (p) {
+        p->fout = stdout;
+        p->print_header();
+    }
+
+    bool first = true;
+    for (double rate : params.rate) {
+        std::vector<bench_request> reqs = trace;
+        if (params.trace.empty()) {
+            reqs = generate_requests(params, rate, n_vocab);
+        } else if (rate > 0.0) {
+            // re-time the trace with Poisson arrivals at the given rate
+            std::mt19937 rng(params.seed);
+            std::exponential_distribution<double> dist_gap(rate);
+            double t = 0.0;
+            for (auto & req : reqs) {
+                req.t_arrival = t;
+                t += dist_gap(rng);
+            }
+        }
+
+        if (first && !params.dump_trace.empty()) {
+            try {
+                write_trace(params.dump_trace, reqs);
+            } catch (const std::exception & e) {
+                fprintf(stderr, "%s: %s\n", __func__, e.what());
+                return 1;
+            }
+        }
+        first = false;
+
+        for (int concurrency : params.concurrency) {
+            test t = run_test(params, client, reqs, rate, concurrency);
+            t.model = model;
+            if (t.n_failed > 0) {
+                fprintf(stderr, "%s: %d of %d requests failed\n", __func__, t.n_failed, t.n_requests);
+            }
+            if (p) {
+                p->print_test(t);
+                fflush(p->fout);
+            }
+        }
+    }
+
+    if (p) {
+        p->print_footer();
+    }
+
+    return 0;
+}
@@ -1,6 +1,8 @@
 #include "chat.h"
 #include "utils.hpp"
 
+#include "ggml-cpp.h"
+
 #include "arg.h"
 #include "common.h"
 #include "json-schema-to-grammar.h"
@@ -8,32 +10,55 @@
 #include "log.h"
 #include "sampling.h"
 #include "speculative.h"
+#include "ngram-cache.h"
+#include "vector-index.h"
 #include "mtmd.h"
 #include "mtmd-helper.h"
 
 // mime type for sending response
 #define MIMETYPE_JSON "application/json; charset=utf-8"
+#define MIMETYPE_BINARY "application/octet-stream"
 
 // auto generated files (see README.md for details)
 #include "index.html.gz.hpp"
 #include "loading.html.hpp"
 
+#include <algorithm>
+#include <array>
 #include <atomic>
 #include <chrono>
 #include <condition_variable>
 #include <cstddef>
 #include <cinttypes>
+#include <cstdio>
+#include <cstring>
 #include <deque>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <list>
 #include <memory>
 #include <mutex>
+#include <random>
+#include <shared_mutex>
 #include <signal.h>
 #include <thread>
 #include <unordered_map>
 #include <unordered_set>
 
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 using json = nlohmann::ordered_json;
 
 constexpr int HTTP_POLLING_SECONDS = 1;
+constexpr int SPEC_N_PROBE         = 32; // adaptive speculative decoding: draft after this many skipped steps to track the acceptance
+constexpr int JUMP_FORWARD_MAX     = 32; // max number of tokens forced by the grammar that are appended at once
+constexpr int GRAMMAR_CACHE_SIZE   = 64; // max number of parsed grammars kept for the next requests
 
 enum stop_type {
     STOP_TYPE_NONE,
@@ -68,8 +93,43 @@ enum server_task_type {
     SERVER_TASK_TYPE_SLOT_RESTORE,
     SERVER_TASK_TYPE_SLOT_ERASE,
     SERVER_TASK_TYPE_SET_LORA,
+    SERVER_TASK_TYPE_MODEL_SWAP,
+    SERVER_TASK_TYPE_PREFILL, // prompt evaluated for another server, see server_remote_prefill
+};
+
+// scheduling class of a task - tasks with a higher priority are launched first
+enum server_task_priority {
+    SERVER_TASK_PRIORITY_BATCH,
+    SERVER_TASK_PRIORITY_NORMAL,
+    SERVER_TASK_PRIORITY_INTERACTIVE,
+    SERVER_TASK_PRIORITY_COUNT,
 };
 
+static const char * server_task_priority_name(server_task_priority priority) {
+    switch (priority) {
+        case SERVER_TASK_PRIORITY_BATCH:       return "batch";
+        case SERVER_TASK_PRIORITY_NORMAL:      return "normal";
+        case SERVER_TASK_PRIORITY_INTERACTIVE: return "interactive";
+        default:                               return "unknown";
+    }
+}
+
+static server_task_priority server_task_priority_from_json(const json & value) {
+    if (value.is_string()) {
+        for (int i = 0; i < SERVER_TASK_PRIORITY_COUNT; ++i) {
+            if (value.get<std::string>() == server_task_priority_name((server_task_priority) i)) {
+                return (server_task_priority) i;
+            }
+        }
+    } else if (value.is_number_integer()) {
+        const int i = value.get<int>();
+        if (i >= 0 && i < SERVER_TASK_PRIORITY_COUNT) {
+            return (server_task_priority) i;
+        }
+    }
+    throw std::runtime_error("Error: \"priority\" must be one of \"batch\", \"normal\", \"interactive\" or an integer in [0, 2]");
+}
+
 enum oaicompat_type {
     OAICOMPAT_TYPE_NONE,
     OAICOMPAT_TYPE_CHAT,
@@ -86,6 +146,7 @@ enum error_type {
     ERROR_TYPE_PERMISSION,
     ERROR_TYPE_UNAVAILABLE, // custom error
     ERROR_TYPE_NOT_SUPPORTED, // custom error
+    ERROR_TYPE_OVERLOADED, // custom error
 };
 
 static bool server_task_type_need_embd(server_task_type task_type) {
@@ -112,6 +173,7 @@ struct slot_params {
     bool stream        = true;
     bool cache_prompt  = true; // remember the prompt to avoid reprocessing all prompt
     bool return_tokens = false;
+    bool return_text   = true; // if false, the generated tokens are not detokenized and only the token ids are returned
 
     int32_t n_keep    =  0; // number of tokens to keep from initial prompt
     int32_t n_discard =  0; // number of tokens after n_keep that may be discarded when shifting context, 0 defaults to half
@@ -121,13 +183,24 @@ struct slot_params {
     int64_t t_max_prompt_ms  = -1; // TODO: implement
     int64_t t_max_predict_ms = -1; // if positive, limit the generation phase to this time limit
 
+    server_task_priority priority = SERVER_TASK_PRIORITY_NORMAL;
+
+    int64_t deadline_ms = -1; // if positive, the task is rejected if it cannot be launched within this time after it was received
+
+    int32_t prefill_n_past = 0; // SERVER_TASK_TYPE_PREFILL: the tokens already in the KV cache of the other server
+
     std::vector<common_adapter_lora_info> lora;
 
     std::vector<std::string> antiprompt;
+    std::vector<llama_tokens> stop_tokens; // stop sequences matched on the generated token ids
+    std::vector<llama_tokens> cache_chunks; // parts of the prompt whose KV cells are cached for any position (params_base.cache_chunks)
+    std::string prefix_text; // server_prefix_text of the request, hashed for the cache digest
     std::vector<std::string> response_fields;
     bool timings_per_token = false;
     bool post_sampling_probs = false;
 
+    int32_t stream_coalesce_ms = -1; // if >= 0, the streamed tokens of a decoding step are sent as one event, at most every this many ms
+
     struct common_params_sampling sampling;
     struct common_params_speculative speculative;
 
@@ -185,6 +258,8 @@ struct slot_params {
             {"mirostat_tau",              sampling.mirostat_tau},
             {"mirostat_eta",              sampling.mirostat_eta},
             {"stop",                      antiprompt},
+            {"stop_tokens",               stop_tokens},
+            {"return_text",               return_text},
             {"max_tokens",                n_predict}, // User configured n_predict
             {"n_keep",                    n_keep},
             {"n_discard",                 n_discard},
@@ -208,6 +283,9 @@ struct slot_params {
             {"timings_per_token",         timings_per_token},
             {"post_sampling_probs",       post_sampling_probs},
             {"lora",                      lora},
+            {"priority",                  server_task_priority_name(priority)},
+            {"deadline_ms",               deadline_ms},
+            {"stream_coalesce_ms",        stream_coalesce_ms},
         };
     }
 };
@@ -218,6 +296,9 @@ struct server_task {
 
     server_task_type type;
 
+    // time at which the task was posted to the queue
+    int64_t t_queued = -1;
+
     // used by SERVER_TASK_TYPE_CANCEL
     int id_target = -1;
 
@@ -240,6 +321,12 @@ struct server_task {
     // used by SERVER_TASK_TYPE_SET_LORA
     std::vector<common_adapter_lora_info> set_lora;
 
+    // used by SERVER_TASK_TYPE_MODEL_SWAP
+    std::string model_swap;
+
+    // KV cells forecast by the admission control of --kv-pool: prompt + n_predict
+    int32_t n_kv_needed = 0;
+
     server_task(server_task_type type) : type(type) {}
 
     static slot_params params_from_json_cmpl(
@@ -265,6 +352,7 @@ struct server_task {
         params.stream           = json_value(data, "stream",             false);
         params.cache_prompt     = json_value(data, "cache_prompt",       true);
         params.return_tokens    = json_value(data, "return_tokens",      false);
+        params.return_text      = json_value(data, "return_text",        true);
         params.n_predict        = json_value(data, "n_predict",          json_value(data, "max_tokens", defaults.n_predict));
         params.n_indent         = json_value(data, "n_indent",           defaults.n_indent);
         params.n_keep           = json_value(data, "n_keep",             defaults.n_keep);
@@ -272,6 +360,12 @@ struct server_task {
       //params.t_max_prompt_ms  = json_value(data, "t_max_prompt_ms",    defaults.t_max_prompt_ms); // TODO: implement
         params.t_max_predict_ms = json_value(data, "t_max_predict_ms",   defaults.t_max_predict_ms);
         params.response_fields  = json_value(data, "response_fields",   std::vector<std::string>());
+        params.deadline_ms      = json_value(data, "deadline_ms",        defaults.deadline_ms);
+        params.stream_coalesce_ms = json_value(data, "stream_coalesce_ms", defaults.stream_coalesce_ms);
+
+        if (data.contains("priority")) {
+            params.priority = server_task_priority_from_json(data.at("priority"));
+        }
 
         params.sampling.top_k              = json_value(data, "top_k",              defaults.sampling.top_k);
         params.sampling.top_p              = json_value(data, "top_p",              defaults.sampling.top_p);
@@ -363,7 +457,7 @@ struct server_task {
             try {
                 auto schema                  = json_value(data, "json_schema", json::object());
                 SRV_DBG("JSON schema: %s\n", schema.dump(2).c_str());
-                params.sampling.grammar      = json_schema_to_grammar(schema);
+                params.sampling.grammar      = json_schema_to_grammar_cached(schema);
                 SRV_DBG("Converted grammar: %s\n", params.sampling.grammar.c_str());
             } catch (const std::exception & e) {
                 throw std::runtime_error(std::string("\"json_schema\": ") + e.what());
@@ -375,6 +469,8 @@ struct server_task {
             SRV_DBG("Grammar lazy: %s\n", params.sampling.grammar_lazy ? "true" : "false");
         }
 
+        params.sampling.grammar_async = defaults.sampling.grammar_async;
+
         {
             auto it = data.find("chat_format");
             if (it != data.end()) {
@@ -531,6 +627,68 @@ struct server_task {
             }
         }
 
+        {
+            params.stop_tokens.clear();
+
+            const int n_vocab = llama_vocab_n_tokens(vocab);
+
+            const auto add_stop_tokens = [&](const llama_tokens & seq) {
+                if (seq.empty() || std::find(params.stop_tokens.begin(), params.stop_tokens.end(), seq) != params.stop_tokens.end()) {
+                    return;
+                }
+                for (const llama_token tok : seq) {
+                    if (tok < 0 || tok >= n_vocab) {
+                        throw std::runtime_error("Invalid token id in \"stop_tokens\": " + std::to_string(tok));
+                    }
+                }
+                params.stop_tokens.push_back(seq);
+            };
+
+            const auto & stop_tokens = data.find("stop_tokens");
+            if (stop_tokens != data.end() && stop_tokens->is_array()) {
+                for (const auto & seq : *stop_tokens) {
+                    if (seq.is_number_integer()) {
+                        add_stop_tokens({ seq.get<llama_token>() });
+                    } else if (json_is_array_of_numbers(seq)) {
+                        add_stop_tokens(seq.get<llama_tokens>());
+                    } else if (seq.is_string()) {
+                        // the tokenizations of the string at the start of a text and after a space
+                        const auto str = seq.get<std::string>();
+                        add_stop_tokens(common_tokenize(vocab, str,       false, true));
+                        add_stop_tokens(common_tokenize(vocab, " " + str, false, true));
+                    } else {
+                        throw std::runtime_error("Elements of \"stop_tokens\" must be token ids, arrays of token ids or strings");
+                    }
+                }
+            }
+        }
+
+        {
+            params.cache_chunks.clear();
+
+            const auto & cache_chunks = data.find("cache_chunks");
+            if (cache_chunks != data.end() && cache_chunks->is_array()) {
+                for (const auto & chunk : *cache_chunks) {
+                    if (json_is_array_of_numbers(chunk)) {
+                        params.cache_chunks.push_back(chunk.get<llama_tokens>());
+                    } else if (chunk.is_string()) {
+                        // the tokenizations of the string at the start of a text, after a space and after a new line
+                        const auto str = chunk.get<std::string>();
+                        params.cache_chunks.push_back(common_tokenize(vocab, str,       false, true));
+                        params.cache_chunks.push_back(common_tokenize(vocab, " " + str, false, true));
+
+                        const auto nl   = common_tokenize(vocab, "\n",       false, true);
+                        const auto nl_s = common_tokenize(vocab, "\n" + str, false, true);
+                        if (nl_s.size() > nl.size() && std::equal(nl.begin(), nl.end(), nl_s.begin())) {
+                            params.cache_chunks.emplace_back(nl_s.begin() + nl.size(), nl_s.end());
+                        }
+                    } else {
+                        throw std::runtime_error("Elements of \"cache_chunks\" must be strings or arrays of token ids");
+                    }
+                }
+            }
+        }
+
         {
             const auto samplers = data.find("samplers");
             if (samplers != data.end()) {
@@ -550,6 +708,27 @@ struct server_task {
         return params;
     }
 
+    // the deadline in us, or -1 if the task does not have one
+    int64_t t_deadline() const {
+        return params.deadline_ms > 0 && t_queued >= 0 ? t_queued + 1000*params.deadline_ms : -1;
+    }
+
+    // should this task be scheduled before the other one
+    bool before(const server_task & other) const {
+        if (params.priority != other.params.priority) {
+            return params.priority > other.params.priority;
+        }
+
+        // among tasks of the same class, the ones with the earliest deadline go first
+        const int64_t d0 = t_deadline();
+        const int64_t d1 = other.t_deadline();
+        if (d0 != d1) {
+            return d1 < 0 || (d0 >= 0 && d0 < d1);
+        }
+
+        return false;
+    }
+
     // utility function
     static std::unordered_set<int> get_list_id(const std::vector<server_task> & tasks) {
         std::unordered_set<int> ids(tasks.size());
@@ -612,6 +791,11 @@ struct server_task_result {
         return -1;
     }
     virtual json to_json() = 0;
+    // append the "data" events of the result to out without building a json tree
+    // returns false if the result has no such fast path and to_json() must be used
+    virtual bool to_sse_data(std::string & /*out*/) {
+        return false;
+    }
     virtual ~server_task_result() = default;
 };
 
@@ -829,7 +1013,7 @@ struct server_task_result_cmpl_final : server_task_result {
 
         json choice {
             {"finish_reason", finish_reason},
-            {"index", 0},
+            {"index", index},
             {"message", msg.to_json_oaicompat<json>()},
         };
 
@@ -879,7 +1063,7 @@ struct server_task_result_cmpl_final : server_task_result {
                 {"choices", json::array({
                     json {
                         {"finish_reason", nullptr},
-                        {"index", 0},
+                        {"index", index},
                         {"delta", common_chat_msg_diff_to_json_oaicompat<json>(diff)},
                     },
                 })},
@@ -895,7 +1079,7 @@ struct server_task_result_cmpl_final : server_task_result {
             {"choices", json::array({
                 json {
                     {"finish_reason", finish_reason},
-                    {"index", 0},
+                    {"index", index},
                     {"delta", json::object()},
                 },
             })},
@@ -1032,7 +1216,7 @@ struct server_task_result_cmpl_partial : server_task_result {
                 {"choices", json::array({
                     json {
                         {"finish_reason", nullptr},
-                        {"index", 0},
+                        {"index", index},
                         {"delta", delta},
                     },
                 })},
@@ -1071,6 +1255,147 @@ struct server_task_result_cmpl_partial : server_task_result {
 
         return deltas;
     }
+
+    // the streamed tokens without probs and timings, the same output as to_json() followed by server_sent_event()
+    virtual bool to_sse_data(std::string & out) override {
+        if (!prob_output.probs.empty()) {
+            return false;
+        }
+
+        const size_t n_out = out.size();
+
+        bool ok = false;
+        switch (oaicompat) {
+            case OAICOMPAT_TYPE_NONE:
+                ok = timings.prompt_n <= 0 && to_sse_data_non_oaicompat(out);
+                break;
+            case OAICOMPAT_TYPE_COMPLETION:
+                ok = timings.prompt_n < 0 && !verbose && to_sse_data_oaicompat(out);
+                break;
+            case OAICOMPAT_TYPE_CHAT:
+                ok = timings.prompt_n < 0 && to_sse_data_oaicompat_chat(out);
+                break;
+            default:
+                break;
+        }
+
+        if (!ok) {
+            out.resize(n_out);
+        }
+
+        return ok;
+    }
+
+    bool to_sse_data_non_oaicompat(std::string & out) {
+        out += "data: {\"index\":";
+        out += std::to_string(index);
+        out += ",\"content\":";
+        if (!json_append_str(out, content)) {
+            return false;
+        }
+        out += ",\"tokens\":[";
+        for (size_t i = 0; i < tokens.size(); ++i) {
+            if (i > 0) {
+                out += ',';
+            }
+            out += std::to_string(tokens[i]);
+        }
+        out += "],\"stop\":false,\"id_slot\":";
+        out += std::to_string(id_slot);
+        out += ",\"tokens_predicted\":";
+        out += std::to_string(n_decoded);
+        out += ",\"tokens_evaluated\":";
+        out += std::to_string(n_prompt_tokens);
+        out += "}\n\n";
+
+        return true;
+    }
+
+    bool to_sse_data_oaicompat(std::string & out) {
+        out += "data: {\"choices\":[{\"text\":";
+        if (!json_append_str(out, content)) {
+            return false;
+        }
+        out += ",\"index\":";
+        out += std::to_string(index);
+        out += ",\"logprobs\":null,\"finish_reason\":null}],\"created\":";
+        out += std::to_string(std::time(0));
+        out += ",\"model\":";
+        if (!json_append_str(out, oaicompat_model)) {
+            return false;
+        }
+        out += ",\"system_fingerprint\":";
+        json_append_str(out, build_info);
+        out += ",\"object\":\"text_completion\",\"id\":";
+        if (!json_append_str(out, oaicompat_cmpl_id)) {
+            return false;
+        }
+        out += "}\n\n";
+
+        return true;
+    }
+
+    bool to_sse_data_oaicompat_chat(std::string & out) {
+        const std::string t = std::to_string(std::time(0));
+
+        // everything but the delta, see to_json_oaicompat_chat()
+        auto add_delta = [&](const common_chat_msg_diff * diff) {
+            out += "data: {\"choices\":[{\"finish_reason\":null,\"index\":";
+            out += std::to_string(index);
+            out += ",\"delta\":{";
+            if (!diff) {
+                out += "\"role\":\"assistant\",\"content\":null";
+            } else {
+                bool first = true;
+                if (!diff->reasoning_content_delta.empty()) {
+                    out += "\"reasoning_content\":";
+                    if (!json_append_str(out, diff->reasoning_content_delta)) {
+                        return false;
+                    }
+                    first = false;
+                }
+                if (!diff->content_delta.empty()) {
+                    out += first ? "\"content\":" : ",\"content\":";
+                    if (!json_append_str(out, diff->content_delta)) {
+                        return false;
+                    }
+                }
+            }
+            out += "}}],\"created\":";
+            out += t;
+            out += ",\"id\":";
+            if (!json_append_str(out, oaicompat_cmpl_id)) {
+                return false;
+            }
+            out += ",\"model\":";
+            if (!json_append_str(out, oaicompat_model)) {
+                return false;
+            }
+            out += ",\"system_fingerprint\":";
+            json_append_str(out, build_info);
+            out += ",\"object\":\"chat.completion.chunk\"}\n\n";
+            return true;
+        };
+
+        for (const auto & diff : oaicompat_msg_diffs) {
+            if (diff.tool_call_index != std::string::npos) {
+                return false;
+            }
+        }
+
+        // initial update with the role, as in to_json_oaicompat_chat()
+        if (n_decoded == 1 && !add_delta(nullptr)) {
+            return false;
+        }
+
+        for (const auto & diff : oaicompat_msg_diffs) {
+            if (!add_delta(&diff)) {
+                return false;
+            }
+        }
+
+        return true;
+    }
 };
 
 struct server_task_result_embd : server_task_result {
@@ -1108,6 +1433,40 @@ struct server_task_result_embd : server_task_result {
     }
 };
 
+// write the pooled embeddings of the results as a row-major [n_inputs][n_embd] array of native (little-endian) f32 or f16 values
+// the shape and the number of evaluated tokens are returned in the X-Embedding-Count, X-Embedding-Dim, X-Embedding-Type
+// and X-Prompt-Tokens headers
+static void format_embeddings_binary(httplib::Response & res, const std::vector<server_task_result_ptr> & results, bool use_f16) {
+    const size_t n_embd = results.empty() ? 0 : static_cast<const server_task_result_embd *>(results[0].get())->embedding[0].size();
+    const size_t n_size = use_f16 ? sizeof(ggml_fp16_t) : sizeof(float);
+
+    std::string data(results.size()*n_embd*n_size, '\0');
+
+    int32_t n_tokens = 0;
+
+    for (size_t i = 0; i < results.size(); ++i) {
+        const auto * embd = dynamic_cast<const server_task_result_embd *>(results[i].get());
+        GGML_ASSERT(embd != nullptr && embd->embedding.size() == 1 && embd->embedding[0].size() == n_embd);
+
+        char * dst = data.data() + i*n_embd*n_size;
+
+        if (use_f16) {
+            ggml_fp32_to_fp16_row(embd->embedding[0].data(), (ggml_fp16_t *) dst, n_embd);
+        } else {
+            memcpy(dst, embd->embedding[0].data(), n_embd*n_size);
+        }
+
+        n_tokens += embd->n_tokens;
+    }
+
+    res.set_header("X-Embedding-Count", std::to_string(results.size()));
+    res.set_header("X-Embedding-Dim",   std::to_string(n_embd));
+    res.set_header("X-Embedding-Type",  use_f16 ? "f16" : "f32");
+    res.set_header("X-Prompt-Tokens",   std::to_string(n_tokens));
+    res.set_content(std::move(data), MIMETYPE_BINARY);
+    res.status = 200;
+}
+
 struct server_task_result_rerank : server_task_result {
     int index = 0;
     float score = -1e6;
@@ -1127,6 +1486,37 @@ struct server_task_result_rerank : server_task_result {
     }
 };
 
+// the results of the n completions of an OAI-compat request, as a single response with n choices
+static json merge_oaicompat_choices(std::vector<server_task_result_ptr> & results, int n_cmpl) {
+    json res = results[0]->to_json();
+
+    json choices = json::array();
+    int32_t n_prompt_tokens = 0;
+    int32_t n_decoded       = 0;
+    for (size_t i = 0; i < results.size(); ++i) {
+        const json cur = i == 0 ? res : results[i]->to_json();
+        for (const auto & choice : cur.at("choices")) {
+            choices.push_back(choice);
+        }
+
+        // the prompt is shared by its n completions
+        const json & usage = cur.at("usage");
+        if (i % n_cmpl == 0) {
+            n_prompt_tokens += usage.at("prompt_tokens").get<int32_t>();
+        }
+        n_decoded += usage.at("completion_tokens").get<int32_t>();
+    }
+
+    res["choices"] = choices;
+    res["usage"]   = json {
+        {"completion_tokens", n_decoded},
+        {"prompt_tokens",     n_prompt_tokens},
+        {"total_tokens",      n_decoded + n_prompt_tokens},
+    };
+
+    return res;
+}
+
 // this function maybe used outside of server_task_result_error
 static json format_error_response(const std::string & message, const enum error_type type) {
     std::string type_str;
@@ -1160,6 +1550,10 @@ static json format_error_response(const std::string & message, const enum error_
             type_str = "unavailable_error";
             code = 503;
             break;
+        case ERROR_TYPE_OVERLOADED:
+            type_str = "overloaded_error";
+            code = 429;
+            break;
     }
     return json {
         {"code", code},
@@ -1173,12 +1567,60 @@ struct server_task_result_error : server_task_result {
     error_type err_type = ERROR_TYPE_SERVER;
     std::string err_msg;
 
+    // if positive, the seconds after which the request may be retried (Retry-After header)
+    int32_t retry_after = 0;
+
     virtual bool is_error() override {
         return true;
     }
 
     virtual json to_json() override {
-        return format_error_response(err_msg, err_type);
+        json res = format_error_response(err_msg, err_type);
+        if (retry_after > 0) {
+            res["retry_after"] = retry_after;
+        }
+        return res;
+    }
+};
+
+// latency distribution exported as a Prometheus histogram, the values are in seconds
+struct server_histogram {
+    std::vector<double>   bounds; // upper bounds of the buckets, sorted
+    std::vector<uint64_t> counts; // per bucket, not cumulative, the last one is +Inf
+
+    double   sum   = 0.0;
+    uint64_t count = 0;
+
+    server_histogram(std::vector<double> bounds = {}) : bounds(std::move(bounds)), counts(this->bounds.size() + 1, 0) {}
+
+    // buckets for the request-level latencies, e.g. queue wait and time to first token
+    static std::vector<double> bounds_request() {
+        return { 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0, 30.0, 60.0 };
+    }
+
+    // buckets for the per-token and per-step latencies
+    static std::vector<double> bounds_step() {
+        return { 1e-5, 2.5e-5, 5e-5, 1e-4, 2.5e-4, 5e-4, 1e-3, 2.5e-3, 5e-3, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0 };
+    }
+
+    void observe(double value) {
+        counts[std::lower_bound(bounds.begin(), bounds.end(), value) - bounds.begin()]++;
+        sum   += value;
+        count += 1;
+    }
+
+    void to_prometheus(std::stringstream & out, const std::string & name, const std::string & help) const {
+        out << "# HELP llamacpp:" << name << " " << help << "\n"
+            << "# TYPE llamacpp:" << name << " histogram\n";
+
+        uint64_t n = 0;
+        for (size_t i = 0; i < bounds.size(); ++i) {
+            n += counts[i];
+            out << "llamacpp:" << name << "_bucket{le=\"" << bounds[i] << "\"} " << n << "\n";
+        }
+        out << "llamacpp:" << name << "_bucket{le=\"+Inf\"} " << count << "\n"
+            << "llamacpp:" << name << "_sum "   << sum   << "\n"
+            << "llamacpp:" << name << "_count " << count << "\n";
     }
 };
 
@@ -1186,8 +1628,14 @@ struct server_task_result_metrics : server_task_result {
     int n_idle_slots;
     int n_processing_slots;
     int n_tasks_deferred;
+    int n_slots_suspended;
     int64_t t_start;
 
+    // per server_task_priority
+    std::array<int,      SERVER_TASK_PRIORITY_COUNT> n_tasks_deferred_prio  = {};
+    std::array<uint64_t, SERVER_TASK_PRIORITY_COUNT> n_tasks_started_prio   = {};
+    std::array<uint64_t, SERVER_TASK_PRIORITY_COUNT> t_tasks_wait_prio      = {}; // us
+
     // TODO: somehow reuse server_metrics in the future, instead of duplicating the fields
     uint64_t n_prompt_tokens_processed_total = 0;
     uint64_t t_prompt_processing_total       = 0;
@@ -1203,6 +1651,26 @@ struct server_task_result_metrics : server_task_result {
     uint64_t n_decode_total     = 0;
     uint64_t n_busy_slots_total = 0;
 
+    uint64_t n_rejected_kv = 0; // tasks rejected by the admission control of --kv-pool
+
+    server_histogram h_queue_wait;
+    server_histogram h_ttft;
+    server_histogram h_token;
+    server_histogram h_sampling;
+    server_histogram h_detokenize;
+
+    // update_slots() breakdown, us
+    uint64_t n_update_slots_total  = 0;
+    uint64_t t_update_slots_batch  = 0;
+    uint64_t t_update_slots_decode = 0;
+    uint64_t t_update_slots_sample = 0;
+    uint64_t t_update_slots_send   = 0;
+
+    int32_t n_kv_cache_tokens = 0; // positions held by the slots' sequences
+    int32_t n_ctx             = 0;
+
+    std::vector<uint64_t> prefix_hashes; // of all the slots, for /cache-digest
+
     // while we can also use std::vector<server_slot> this requires copying the slot object which can be quite messy
     // therefore, we use json to temporarily store the slot.to_json() result
     json slots_data = json::array();
@@ -1212,6 +1680,7 @@ struct server_task_result_metrics : server_task_result {
             { "idle",                            n_idle_slots },
             { "processing",                      n_processing_slots },
             { "deferred",                        n_tasks_deferred },
+            { "suspended",                       n_slots_suspended },
             { "t_start",                         t_start },
 
             { "n_prompt_tokens_processed_total", n_prompt_tokens_processed_total },
@@ -1226,6 +1695,7 @@ struct server_task_result_metrics : server_task_result {
 
             { "n_decode_total",                  n_decode_total },
             { "n_busy_slots_total",              n_busy_slots_total },
+            { "n_rejected_kv",                   n_rejected_kv },
 
             { "slots",                           slots_data },
         };
@@ -1282,1010 +1752,4452 @@ struct server_task_result_apply_lora : server_task_result {
     }
 };
 
-struct server_slot {
-    int id;
-    int id_task = -1;
+struct server_task_result_model_swap : server_task_result {
+    float t_ms = 0.0f;
 
-    // only used for completion/embedding/infill/rerank
-    server_task_type task_type = SERVER_TASK_TYPE_COMPLETION;
+    virtual json to_json() override {
+        return json {
+            { "success", true },
+            { "t_ms",    t_ms },
+        };
+    }
+};
 
-    llama_batch batch_spec = {};
+// KV cells of a prompt evaluated for another server (SERVER_TASK_TYPE_PREFILL), a chunk of the slot save file format
+struct server_task_result_kv_chunk : server_task_result {
+    std::vector<uint8_t> data;
+    bool is_final = false;
 
-    llama_context * ctx = nullptr;
-    llama_context * ctx_dft = nullptr;
+    virtual bool is_stop() override {
+        return is_final;
+    }
 
-    // multimodal
-    mtmd_context * mctx = nullptr;
+    virtual json to_json() override {
+        return json {
+            { "n_bytes",  data.size() },
+            { "is_final", is_final },
+        };
+    }
+};
 
-    common_speculative * spec = nullptr;
+// n-gram lookup cache shared by all slots, used as a draft source when there is no draft model
+// the n-grams of the finished requests are learned in a background thread and periodically merged into a sorted
+// cache, which is saved to and memory-mapped from params.lookup_cache_dynamic
+struct server_ngram_cache {
+    // time between the merges of the learned n-grams into the sorted cache
+    static constexpr int64_t t_merge_interval_ms = 60*1000;
 
-    std::vector<common_adapter_lora_info> lora;
+    common_ngram_cache_sorted nc_static; // from a large corpus, not updated
+    common_ngram_cache_sorted nc_base;   // learned n-grams, merged
+    common_ngram_cache        nc_delta;  // learned n-grams since the last merge
 
-    // the index relative to completion multi-task request
-    size_t index = 0;
+    std::string path_dynamic;
 
-    struct slot_params params;
+    std::mutex mutex; // nc_base, nc_delta
 
-    slot_state state = SLOT_STATE_IDLE;
+    std::mutex              mutex_pending;
+    std::condition_variable condition_pending;
+    std::vector<llama_tokens> pending;
+    bool running = false;
 
-    // used to determine the slot that has been used the longest
-    int64_t t_last_used = -1;
+    std::thread worker;
 
-    // generation props
-    int32_t n_ctx       = 0;  // context size per slot
-    int32_t n_past      = 0;
-    int32_t n_decoded   = 0;
-    int32_t n_remaining = -1;
-    int32_t i_batch     = -1;
-    int32_t n_predict   = -1; // TODO: disambiguate from params.n_predict
+    void init(const common_params & params) {
+        std::string path_static = params.lookup_cache_static;
+        path_dynamic = params.lookup_cache_dynamic;
 
-    // n_prompt_tokens may not be equal to prompt_tokens.size(), because prompt maybe truncated
-    int32_t n_prompt_tokens           = 0;
-    int32_t n_prompt_tokens_processed = 0;
+        if (!path_static.empty()) {
+            try {
+                nc_static = common_ngram_cache_sorted_load(path_static);
+                SRV_INF("loaded static n-gram cache '%s', n_ngrams = %zu\n", path_static.c_str(), nc_static.n_ngrams());
+            } catch (const std::exception & e) {
+                SRV_ERR("failed to load static n-gram cache '%s': %s\n", path_static.c_str(), e.what());
+            }
+        }
 
-    // input prompt tokens
-    server_tokens prompt_tokens;
+        if (!path_dynamic.empty()) {
+            try {
+                nc_base = common_ngram_cache_sorted_load(path_dynamic);
+                SRV_INF("loaded dynamic n-gram cache '%s', n_ngrams = %zu\n", path_dynamic.c_str(), nc_base.n_ngrams());
+            } catch (const std::exception & e) {
+                // the file is created by the first merge
+                SRV_WRN("dynamic n-gram cache '%s' not loaded: %s\n", path_dynamic.c_str(), e.what());
+            }
+        }
 
-    size_t last_nl_pos = 0;
+        running = true;
+        worker  = std::thread(&server_ngram_cache::worker_loop, this);
+    }
 
-    std::string  generated_text;
-    llama_tokens generated_tokens;
-    common_chat_msg chat_msg;
+    ~server_ngram_cache() {
+        if (worker.joinable()) {
+            {
+                std::unique_lock<std::mutex> lock(mutex_pending);
+                running = false;
+            }
+            condition_pending.notify_one();
+            worker.join();
+        }
+    }
 
-    server_tokens cache_tokens;
+    // queue the tokens of a finished request to be learned
+    void learn(const llama_tokens & tokens) {
+        if (tokens.size() < 2) {
+            return;
+        }
 
-    std::vector<completion_token_output> generated_token_probs;
+        {
+            std::unique_lock<std::mutex> lock(mutex_pending);
+            pending.push_back(tokens);
+        }
+        condition_pending.notify_one();
+    }
 
-    bool has_next_token = true;
-    bool has_new_line   = false;
-    bool truncated      = false;
-    stop_type stop;
+    // draft up to n_draft tokens, draft[0] is the last token of inp
+    void draft(const llama_tokens & inp, llama_tokens & draft, int n_draft, common_ngram_cache & nc_context) {
+        std::unique_lock<std::mutex> lock(mutex);
 
-    std::string stopping_word;
+        common_ngram_cache_draft(inp, draft, n_draft, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX,
+            [&](const common_ngram & ngram, common_ngram_cache_part & part) {
+                auto it = nc_context.find(ngram);
+                if (it == nc_context.end()) {
+                    return false;
+                }
+                part = it->second;
+                return true;
+            },
+            [&](const common_ngram & ngram, common_ngram_cache_part & part) {
+                bool found = nc_base.find(ngram, part);
 
-    // sampling
-    json json_schema;
+                auto it = nc_delta.find(ngram);
+                if (it != nc_delta.end()) {
+                    for (const auto & token_count : it->second) {
+                        part[token_count.first] += token_count.second;
+                    }
+                    found = true;
+                }
 
-    struct common_sampler * smpl = nullptr;
+                return found;
+            },
+            [&](const common_ngram & ngram, common_ngram_cache_part & part) {
+                return nc_static.find(ngram, part);
+            });
+    }
 
-    llama_token sampled;
+private:
+    void worker_loop() {
+        int64_t t_last_merge = ggml_time_ms();
 
-    common_chat_format chat_format = COMMON_CHAT_FORMAT_CONTENT_ONLY;
-    std::vector<std::string> generated_tool_call_ids;
+        while (true) {
+            std::vector<llama_tokens> cur;
+            bool stop = false;
 
-    // stats
-    size_t n_sent_text        = 0; // number of sent text character
+            {
+                std::unique_lock<std::mutex> lock(mutex_pending);
+                condition_pending.wait_for(lock, std::chrono::milliseconds(t_merge_interval_ms), [&] {
+                    return !pending.empty() || !running;
+                });
 
-    int64_t t_start_process_prompt;
-    int64_t t_start_generation;
+                cur.swap(pending);
+                stop = !running;
+            }
 
-    double t_prompt_processing; // ms
-    double t_token_generation;  // ms
+            for (const auto & tokens : cur) {
+                common_ngram_cache nc;
+                common_ngram_cache_update(nc, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, tokens, tokens.size(), false);
 
-    std::function<void(int)> callback_on_release;
+                std::unique_lock<std::mutex> lock(mutex);
+                common_ngram_cache_merge(nc_delta, nc);
+            }
 
-    // Speculative decoding stats
-    int32_t n_draft_total = 0;      // Total draft tokens generated
-    int32_t n_draft_accepted = 0;   // Draft tokens actually accepted
+            if (stop || ggml_time_ms() - t_last_merge >= t_merge_interval_ms) {
+                merge();
+                t_last_merge = ggml_time_ms();
+            }
 
-    void reset() {
-        SLT_DBG(*this, "%s", "\n");
+            if (stop) {
+                break;
+            }
+        }
+    }
 
-        n_prompt_tokens    = 0;
-        last_nl_pos        = 0;
-        generated_text     = "";
-        has_new_line       = false;
-        truncated          = false;
-        stop               = STOP_TYPE_NONE;
-        stopping_word      = "";
-        n_past             = 0;
-        n_sent_text        = 0;
-        task_type          = SERVER_TASK_TYPE_COMPLETION;
-        chat_format        = COMMON_CHAT_FORMAT_CONTENT_ONLY;
+    // merge the learned n-grams into the sorted cache and save it
+    void merge() {
+        common_ngram_cache delta;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            delta = nc_delta;
+        }
 
-        generated_tokens.clear();
-        generated_token_probs.clear();
-        chat_msg = {};
-        json_schema = json();
-        generated_tool_call_ids.clear();
+        if (delta.empty()) {
+            return;
+        }
 
-        // clear speculative decoding stats
-        n_draft_total = 0;
-        n_draft_accepted = 0;
-    }
+        const int64_t t_start = ggml_time_ms();
 
-    bool need_embd() const {
-        return server_task_type_need_embd(task_type);
+        // nc_base is only replaced by this thread, so it can be read without the lock
+        common_ngram_cache_sorted merged = common_ngram_cache_sorted_merge(&nc_base, delta);
+
+        if (!path_dynamic.empty()) {
+            const std::string path_tmp = path_dynamic + ".tmp";
+
+            if (common_ngram_cache_sorted_save(merged, path_tmp) && std::rename(path_tmp.c_str(), path_dynamic.c_str()) == 0) {
+                try {
+                    merged = common_ngram_cache_sorted_load(path_dynamic);
+                } catch (const std::exception & e) {
+                    SRV_WRN("failed to map dynamic n-gram cache '%s': %s\n", path_dynamic.c_str(), e.what());
+                }
+            } else {
+                SRV_WRN("failed to save dynamic n-gram cache '%s'\n", path_dynamic.c_str());
+            }
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+
+            nc_base = std::move(merged);
+
+            // keep the n-grams that were learned during the merge
+            for (const auto & ngram_part : delta) {
+                auto it = nc_delta.find(ngram_part.first);
+                for (const auto & token_count : ngram_part.second) {
+                    auto it_count = it->second.find(token_count.first);
+                    it_count->second -= token_count.second;
+                    if (it_count->second <= 0) {
+                        it->second.erase(it_count);
+                    }
+                }
+                if (it->second.empty()) {
+                    nc_delta.erase(it);
+                }
+            }
+        }
+
+        SRV_INF("merged n-gram cache, n_ngrams = %zu, size = %.2f MiB, time = %.1f ms\n",
+                nc_base.n_ngrams(), nc_base.n_bytes()/1024.0/1024.0, (double) (ggml_time_ms() - t_start));
     }
+};
 
-    bool need_logits() const {
-        return server_task_type_need_logits(task_type);
+// online estimates for the adaptive draft length of speculative decoding (params_base.speculative.adaptive)
+struct server_spec_stats {
+    // the acceptance of the draft tokens is modeled as independent with probability alpha
+    // decayed counts of the accepted tokens and of the rejections that ended a draft
+    static constexpr double DECAY = 0.9;
+
+    double n_acc = 1.0;
+    double n_rej = 1.0;
+
+    void update(int n_accepted, int n_draft) {
+        n_acc = DECAY*n_acc + n_accepted;
+        n_rej = DECAY*n_rej + (n_accepted < n_draft ? 1.0 : 0.0);
     }
 
-    // if the context does not have a memory module then all embeddings have to be computed within a single ubatch
-    // also we cannot split if the pooling would require any past tokens
-    bool can_split() const {
-        return
-            !need_embd() ||
-            (llama_get_memory(ctx) && llama_pooling_type(ctx) == LLAMA_POOLING_TYPE_LAST);
+    double alpha() const {
+        return std::min(0.99, n_acc / (n_acc + n_rej));
     }
+};
 
-    bool can_batch_with(server_slot & other_slot) const {
-        return task_type == other_slot.task_type && are_lora_equal(lora, other_slot.lora);
+// the time of a decode of the target model is fit as t0 + t_tok*n_tokens, with exponentially decaying least squares
+// the time of drafting is measured per drafted token
+struct server_spec_cost {
+    static constexpr double DECAY = 0.98;
+
+    double s_w  = 0.0;
+    double s_x  = 0.0;
+    double s_y  = 0.0;
+    double s_xx = 0.0;
+    double s_xy = 0.0;
+
+    double t_draft_tok = 0.0; // us
+
+    void add_decode(int n_tokens, double t_us) {
+        s_w  = DECAY*s_w  + 1.0;
+        s_x  = DECAY*s_x  + n_tokens;
+        s_y  = DECAY*s_y  + t_us;
+        s_xx = DECAY*s_xx + (double) n_tokens*n_tokens;
+        s_xy = DECAY*s_xy + n_tokens*t_us;
     }
 
-    bool has_budget(const common_params & global_params) {
-        if (params.n_predict == -1 && global_params.n_predict == -1) {
-            return true; // limitless
+    void add_draft(int n_draft, double t_us) {
+        if (n_draft > 0) {
+            t_draft_tok = t_draft_tok == 0.0 ? t_us/n_draft : 0.9*t_draft_tok + 0.1*t_us/n_draft;
         }
+    }
 
-        n_remaining = -1;
+    // false until decodes of different sizes have been measured
+    bool fit(double & t0, double & t_tok) const {
+        if (s_w < 4.0) {
+            return false;
+        }
 
-        if (params.n_predict != -1) {
-            n_remaining = params.n_predict - n_decoded;
-        } else if (global_params.n_predict != -1) {
-            n_remaining = global_params.n_predict - n_decoded;
+        const double var = s_w*s_xx - s_x*s_x;
+        if (var <= 1e-6*s_w*s_xx) {
+            return false;
         }
 
-        return n_remaining > 0; // no budget
+        t_tok = std::max(0.0, (s_w*s_xy - s_x*s_y) / var);
+        t0    = std::max(0.0, (s_y - t_tok*s_x) / s_w);
+
+        return true;
     }
+};
 
-    bool is_processing() const {
-        return state != SLOT_STATE_IDLE;
+// runs the draft model on its own thread, concurrently with the decode of the target model (params_base.speculative.async)
+// each slot has at most one job in flight, the slot does not touch its draft context until wait() returns
+struct server_draft_worker {
+    std::thread worker;
+
+    std::mutex              mutex;
+    std::condition_variable cv;
+    std::condition_variable cv_done;
+
+    std::deque<std::function<void()>> jobs;
+
+    bool busy    = false;
+    bool running = false;
+
+    void start() {
+        running = true;
+        worker  = std::thread([this]() {
+            loop();
+        });
     }
 
-    bool can_speculate() const {
-        return ctx_dft && params.speculative.n_max > 0 && params.cache_prompt;
+    ~server_draft_worker() {
+        if (worker.joinable()) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                running = false;
+            }
+            cv.notify_one();
+            worker.join();
+        }
     }
 
-    void add_token(const completion_token_output & token) {
-        if (!is_processing()) {
-            SLT_WRN(*this, "%s", "slot is not processing\n");
-            return;
+    void push(std::function<void()> && job) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            jobs.push_back(std::move(job));
         }
-        generated_token_probs.push_back(token);
+        cv.notify_one();
     }
 
-    void release() {
-        if (is_processing()) {
-            SLT_INF(*this, "stop processing: n_past = %d, truncated = %d\n", n_past, truncated);
+    // wait until all the queued drafts are done
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv_done.wait(lock, [this]() {
+            return jobs.empty() && !busy;
+        });
+    }
 
-            t_last_used = ggml_time_us();
-            t_token_generation = (ggml_time_us() - t_start_generation) / 1e3;
-            state = SLOT_STATE_IDLE;
-            callback_on_release(id);
+private:
+    void loop() {
+        while (true) {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [this]() {
+                    return !jobs.empty() || !running;
+                });
+                if (jobs.empty()) {
+                    return;
+                }
+                job = std::move(jobs.front());
+                jobs.pop_front();
+                busy = true;
+            }
+
+            job();
+
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                busy = false;
+            }
+            cv_done.notify_all();
         }
     }
+};
 
-    result_timings get_timings() const {
-        result_timings timings;
-        timings.prompt_n = n_prompt_tokens_processed;
-        timings.prompt_ms = t_prompt_processing;
-        timings.prompt_per_token_ms = t_prompt_processing / n_prompt_tokens_processed;
-        timings.prompt_per_second = 1e3 / t_prompt_processing * n_prompt_tokens_processed;
+// lookahead (Jacobi) decoding of a slot, used as a draft source when there is no draft model
+// the draft of a step is the most recent n-gram of the pool that starts with the sampled token, completed with the
+// Jacobi guess: the predictions of the target model at the rejected draft positions of the previous step
+// the n-grams are collected along the Jacobi iterations: a drafted token, its prediction, the prediction that followed
+// this token when it was drafted at the next step, and so on for n_gram tokens
+struct server_lookahead {
+    // max number of n-grams in the pool with the same first token
+    static constexpr int N_CAND = 8;
+
+    int32_t n_gram = 0; // 0 = disabled
+
+    // the drafted tokens of a step and the predictions that followed them
+    struct level {
+        llama_pos    pos; // position of drafted[0]
+        llama_tokens drafted;
+        llama_tokens predicted;
+    };
 
-        timings.predicted_n = n_decoded;
-        timings.predicted_ms = t_token_generation;
-        timings.predicted_per_token_ms = t_token_generation / n_decoded;
-        timings.predicted_per_second = 1e3 / t_token_generation * n_decoded;
+    std::deque<level> levels; // the last n_gram - 1 steps
 
-        // Add speculative metrics
-        if (n_draft_total > 0) {
-            timings.draft_n = n_draft_total;
-            timings.draft_n_accepted = n_draft_accepted;
-        }
+    llama_pos    guess_pos = -1; // position of guess[0]
+    llama_tokens guess;
 
-        return timings;
+    std::unordered_map<llama_token, std::deque<llama_tokens>> pool; // first token -> the next n_gram - 1 tokens
+
+    std::mt19937 rng;
+
+    void init(int32_t n) {
+        n_gram = n;
+        clear();
     }
 
-    const common_chat_msg & update_chat_msg(std::vector<common_chat_msg_diff> & diffs) {
-        auto previous_msg = chat_msg;
-        SRV_DBG("Parsing chat message: %s\n", generated_text.c_str());
-        auto new_msg = common_chat_parse(
-            generated_text,
-            /* is_partial= */ stop != STOP_TYPE_EOS,
-            params.oaicompat_chat_syntax);
-        if (!new_msg.empty()) {
-            new_msg.ensure_tool_call_ids_set(generated_tool_call_ids, gen_tool_call_id);
-            chat_msg = new_msg;
-            diffs = common_chat_msg_diff::compute_diffs(previous_msg, new_msg.empty() ? previous_msg : new_msg);
-        }
-        return chat_msg;
+    void clear() {
+        levels.clear();
+        guess.clear();
+        guess_pos = -1;
+        pool.clear();
     }
 
-    size_t find_stopping_strings(const std::string & text, const size_t last_token_size, bool is_full_stop) {
-        size_t stop_pos = std::string::npos;
+    // draft the tokens following id_last, which is at position pos_last
+    llama_tokens draft(llama_token id_last, llama_pos pos_last, int n_draft, const llama_tokens & inp) {
+        llama_tokens res;
 
-        for (const std::string & word : params.antiprompt) {
-            size_t pos;
+        const auto it = pool.find(id_last);
+        if (it != pool.end()) {
+            res = it->second.front();
+        }
 
-            if (is_full_stop) {
-                const size_t tmp      = word.size() + last_token_size;
-                const size_t from_pos = text.size() > tmp ? text.size() - tmp : 0;
+        if (guess_pos != pos_last + 1) {
+            guess.clear();
+        }
+        guess_pos = pos_last + 1;
 
-                pos = text.find(word, from_pos);
-            } else {
-                // otherwise, partial stop
-                pos = string_find_partial_stop(text, word);
-            }
+        // the window is initialized with random tokens of the input, as in examples/lookahead
+        while ((int) guess.size() < n_draft && !inp.empty()) {
+            guess.push_back(inp[rng() % inp.size()]);
+        }
 
-            if (pos != std::string::npos && (stop_pos == std::string::npos || pos < stop_pos)) {
-                if (is_full_stop) {
-                    stop           = STOP_TYPE_WORD;
-                    stopping_word  = word;
-                    has_next_token = false;
-                }
-                stop_pos = pos;
-            }
+        for (size_t i = res.size(); i < guess.size(); ++i) {
+            res.push_back(guess[i]);
+        }
+        if ((int) res.size() > n_draft) {
+            res.resize(n_draft);
         }
 
-        return stop_pos;
+        return res;
     }
 
-    void print_timings() const {
-        const double t_prompt        =       t_prompt_processing / n_prompt_tokens_processed;
-        const double n_prompt_second = 1e3 / t_prompt_processing * n_prompt_tokens_processed;
+    // the draft starting at position pos has been verified, predicted[i] is the greedy prediction following drafted[i]
+    void update(llama_pos pos, const llama_tokens & drafted, const llama_tokens & predicted, size_t n_accepted) {
+        GGML_ASSERT(drafted.size() == predicted.size() && n_accepted <= drafted.size());
 
-        const double t_gen        =       t_token_generation / n_decoded;
-        const double n_gen_second = 1e3 / t_token_generation * n_decoded;
+        levels.push_back({ pos, drafted, predicted });
 
-        SLT_INF(*this,
-                "\n"
-                "prompt eval time = %10.2f ms / %5d tokens (%8.2f ms per token, %8.2f tokens per second)\n"
-                "       eval time = %10.2f ms / %5d tokens (%8.2f ms per token, %8.2f tokens per second)\n"
-                "      total time = %10.2f ms / %5d tokens\n",
-                t_prompt_processing, n_prompt_tokens_processed, t_prompt, n_prompt_second,
-                t_token_generation, n_decoded, t_gen, n_gen_second,
-                t_prompt_processing + t_token_generation, n_prompt_tokens_processed + n_decoded);
+        // the next guess: the rejected positions are improved by one Jacobi iteration
+        guess_pos = pos + n_accepted + 1;
+        guess.assign(predicted.begin() + n_accepted, predicted.end());
 
-        if (n_draft_total > 0) {
-            const float draft_ratio = (float) n_draft_accepted / n_draft_total;
-            SLT_INF(*this,
-                    "\n"
-                    "draft acceptance rate = %0.5f (%5d accepted / %5d generated)\n",
-                    draft_ratio, n_draft_accepted, n_draft_total
-            );
+        if ((int) levels.size() < n_gram - 1) {
+            return;
         }
-    }
 
-    json to_json() const {
-        return json {
-            {"id",            id},
-            {"id_task",       id_task},
-            {"n_ctx",         n_ctx},
-            {"speculative",   can_speculate()},
-            {"is_processing", is_processing()},
-            {"params",        params.to_json()},
-            {"prompt",        prompt_tokens.detokenize(ctx, true)},
-            {"next_token",
-                {
-                    {"has_next_token", has_next_token},
-                    {"has_new_line",   has_new_line},
-                    {"n_remain",       n_remaining},
-                    {"n_decoded",      n_decoded},
-                    {"stopping_word",  stopping_word},
+        // the n-grams starting in the oldest level, following the predictions through the next levels
+        const level & first = levels.front();
+        for (size_t i = 0; i < first.drafted.size(); ++i) {
+            llama_tokens ngram = { first.drafted[i], first.predicted[i] };
+            llama_pos    cur   = first.pos + i + 1;
+
+            for (size_t l = 1; l < levels.size() && (int) ngram.size() < n_gram; ++l, ++cur) {
+                const level & lvl = levels[l];
+                const llama_pos j = cur - lvl.pos;
+                if (j < 0 || j >= (llama_pos) lvl.drafted.size() || lvl.drafted[j] != ngram.back()) {
+                    break;
                 }
-            },
-        };
+                ngram.push_back(lvl.predicted[j]);
+            }
+
+            if ((int) ngram.size() == n_gram) {
+                add(ngram);
+            }
+        }
+
+        levels.pop_front();
+    }
+
+    void add(const llama_tokens & ngram) {
+        auto & cands = pool[ngram[0]];
+        const llama_tokens cont(ngram.begin() + 1, ngram.end());
+
+        const auto it = std::find(cands.begin(), cands.end(), cont);
+        if (it != cands.end()) {
+            cands.erase(it);
+        }
+        cands.push_front(cont);
+        if ((int) cands.size() > N_CAND) {
+            cands.pop_back();
+        }
     }
 };
 
-struct server_metrics {
-    int64_t t_start = 0;
+// vector index of the embeddings added with POST /index and searched with POST /search
+// loaded from params.vector_index at startup, saved to it with POST /index/save
+struct server_vector_index {
+    common_vector_index index;
 
-    uint64_t n_prompt_tokens_processed_total = 0;
-    uint64_t t_prompt_processing_total       = 0;
-    uint64_t n_tokens_predicted_total        = 0;
-    uint64_t t_tokens_generation_total       = 0;
+    std::string path;
 
-    uint64_t n_prompt_tokens_processed = 0;
-    uint64_t t_prompt_processing       = 0;
+    std::shared_mutex mutex; // searches share the index, additions are exclusive
 
-    uint64_t n_tokens_predicted  = 0;
-    uint64_t t_tokens_generation = 0;
+    bool initialized = false;
 
-    uint64_t n_decode_total     = 0;
-    uint64_t n_busy_slots_total = 0;
+    void init(const common_params & params, int n_embd) {
+        if (initialized) {
+            return;
+        }
+        initialized = true;
 
-    void init() {
-        t_start = ggml_time_us();
+        path = params.vector_index;
+
+        if (!path.empty() && std::ifstream(path).good()) {
+            try {
+                index = common_vector_index_load(path);
+                SRV_INF("loaded vector index '%s', n_vectors = %zu, type = %s\n", path.c_str(), index.size(), ggml_type_name(index.params.type));
+            } catch (const std::exception & e) {
+                SRV_ERR("failed to load vector index '%s': %s\n", path.c_str(), e.what());
+            }
+            if (index.row_size > 0 && index.params.n_embd != n_embd) {
+                SRV_ERR("vector index '%s' has n_embd = %d, but the model has n_embd = %d, starting with an empty index\n",
+                        path.c_str(), index.params.n_embd, n_embd);
+                index = common_vector_index();
+            }
+        }
+
+        if (index.row_size == 0) {
+            common_vector_index_params iparams;
+            iparams.n_embd = n_embd;
+            iparams.type   = params.vector_index_type;
+            if (n_embd % ggml_blck_size(iparams.type) != 0) {
+                SRV_WRN("n_embd = %d is not a multiple of the block size of %s, using f32 vectors\n", n_embd, ggml_type_name(iparams.type));
+                iparams.type = GGML_TYPE_F32;
+            }
+            index = common_vector_index(iparams);
+        }
     }
 
-    void on_prompt_eval(const server_slot & slot) {
-        n_prompt_tokens_processed_total += slot.n_prompt_tokens_processed;
-        n_prompt_tokens_processed       += slot.n_prompt_tokens_processed;
-        t_prompt_processing             += slot.t_prompt_processing;
-        t_prompt_processing_total       += slot.t_prompt_processing;
+    int32_t n_embd() const {
+        return index.params.n_embd;
     }
 
-    void on_prediction(const server_slot & slot) {
-        n_tokens_predicted_total   += slot.n_decoded;
-        n_tokens_predicted         += slot.n_decoded;
+    // returns the ids of the embeddings
+    std::vector<int64_t> add(const std::vector<std::vector<float>> & embd) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+
+        std::vector<int64_t> ids;
+        ids.reserve(embd.size());
+        for (const auto & e : embd) {
+            ids.push_back(index.add(e.data()));
+        }
+        return ids;
+    }
+
+    std::vector<common_vector_index_result> search(const float * query, int k, int ef) {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+
+        return index.search(query, k, ef);
+    }
+
+    size_t size() {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+
+        return index.size();
+    }
+
+    // write to a temporary file and rename it, the current file can be memory-mapped by the index
+    bool save() {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+
+        const std::string path_tmp = path + ".tmp";
+
+        return common_vector_index_save(index, path_tmp) && std::rename(path_tmp.c_str(), path.c_str()) == 0;
+    }
+};
+
+// stop sequences of token ids, matched at the end of the generated tokens without detokenizing them
+struct server_stop_tokens {
+    // trie of the reversed sequences
+    struct node {
+        std::map<llama_token, int32_t> next;
+        int32_t i_seq = -1; // the sequence that ends at this node
+    };
+
+    std::vector<node> nodes;
+    size_t n_max = 0; // tokens of the longest sequence
+
+    llama_tokens tail; // the last generated tokens
+
+    void init(const std::vector<llama_tokens> & seqs) {
+        nodes.assign(1, node());
+        n_max = 0;
+        tail.clear();
+
+        for (size_t i = 0; i < seqs.size(); ++i) {
+            int32_t cur = 0;
+            for (auto it = seqs[i].rbegin(); it != seqs[i].rend(); ++it) {
+                const auto nxt = nodes[cur].next.find(*it);
+                if (nxt != nodes[cur].next.end()) {
+                    cur = nxt->second;
+                } else {
+                    nodes[cur].next[*it] = nodes.size();
+                    cur = nodes.size();
+                    nodes.emplace_back();
+                }
+            }
+            if (nodes[cur].i_seq < 0) {
+                nodes[cur].i_seq = i;
+            }
+            n_max = std::max(n_max, seqs[i].size());
+        }
+    }
+
+    bool empty() const {
+        return n_max == 0;
+    }
+
+    // adds a generated token, returns the index of the shortest sequence that ends the generated tokens or -1
+    int32_t add(llama_token tok) {
+        if (n_max == 0) {
+            return -1;
+        }
+
+        tail.push_back(tok);
+        if (tail.size() > 2*n_max) {
+            tail.erase(tail.begin(), tail.end() - n_max);
+        }
+
+        int32_t cur = 0;
+        for (auto it = tail.rbegin(); it != tail.rend(); ++it) {
+            const auto nxt = nodes[cur].next.find(*it);
+            if (nxt == nodes[cur].next.end()) {
+                break;
+            }
+            cur = nxt->second;
+            if (nodes[cur].i_seq >= 0) {
+                return nodes[cur].i_seq;
+            }
+        }
+
+        return -1;
+    }
+};
+
+struct server_remote_prefill;
+
+struct server_slot {
+    int id;
+    int id_task = -1;
+
+    // only used for completion/embedding/infill/rerank
+    server_task_type task_type = SERVER_TASK_TYPE_COMPLETION;
+
+    llama_context * ctx = nullptr;
+    llama_context * ctx_dft = nullptr;
+
+    // multimodal
+    mtmd_context * mctx = nullptr;
+
+    common_speculative * spec = nullptr;
+
+    // draft of the continuation that assumes all the drafted tokens are accepted, made while the target verifies them
+    // draft_next[0] is the expected token sampled after them, it is valid while the cached tokens have n_draft_next tokens
+    llama_tokens draft_next;
+    size_t       n_draft_next = 0;
+
+    // n-gram lookup drafting, used when there is no draft model
+    server_ngram_cache * ngram_cache = nullptr;
+
+    // draft heads shared by all slots, and the hidden state of the last sampled token they draft from
+    common_speculative_heads * spec_heads = nullptr;
+    std::vector<float>         spec_hidden;
+
+    // draft with the MTP layer of the target model
+    bool spec_mtp = false;
+    common_ngram_cache   ngram_ctx;   // n-grams of the tokens of the slot
+    llama_tokens         ngram_inp;   // tokens added to ngram_ctx, append-only
+
+    // lookahead drafting, used when there is no draft model
+    server_lookahead lookahead;
+
+    // acceptance of the drafts of the current task (params_base.speculative.adaptive)
+    server_spec_stats spec_stats;
+    int32_t           spec_n_skipped = 0; // consecutive steps without a draft
+
+    std::vector<common_adapter_lora_info> lora;
+
+    // the index relative to completion multi-task request
+    size_t index = 0;
+
+    struct slot_params params;
+
+    slot_state state = SLOT_STATE_IDLE;
+
+    // used to determine the slot that has been used the longest
+    int64_t t_last_used = -1;
+
+    // time at which the current task was posted to the queue
+    int64_t t_queued = -1;
+
+    // generation props
+    int32_t n_ctx       = 0;  // context size per slot
+    int32_t n_past      = 0;
+    int32_t n_decoded   = 0;
+    int32_t n_remaining = -1;
+    int32_t i_batch     = -1;
+    int32_t n_predict   = -1; // TODO: disambiguate from params.n_predict
+
+    // n_prompt_tokens may not be equal to prompt_tokens.size(), because prompt maybe truncated
+    int32_t n_prompt_tokens           = 0;
+    int32_t n_prompt_tokens_processed = 0;
+
+    // input prompt tokens
+    server_tokens prompt_tokens;
+
+    size_t last_nl_pos = 0;
+
+    std::string  generated_text;
+    llama_tokens generated_tokens;
+    common_chat_msg chat_msg;
+
+    // server_prefix_hashes of the request text of the last task and its reply, reported by /cache-digest
+    std::vector<uint64_t> prefix_hashes;
+    common_chat_msg_parser_state chat_parser_state; // the parse of each streamed token only scans the new text
+
+    server_tokens cache_tokens;
+
+    std::vector<completion_token_output> generated_token_probs;
+
+    bool has_next_token = true;
+    bool has_new_line   = false;
+    bool truncated      = false;
+    bool kv_compressed  = false; // the KV cache does not hold all of cache_tokens anymore (params_base.kv_compress)
+    stop_type stop;
+
+    // snapshots of the SWA cache taken after the prompts (params_base.n_swa_ckpt)
+    struct swa_checkpoint {
+        llama_pos pos_min;
+        llama_pos pos_max;
+
+        llama_tokens tokens; // tokens at positions [0, pos_max]
+
+        std::vector<uint8_t> data;
+    };
+
+    std::deque<swa_checkpoint> swa_ckpts;
+
+    // the positions [p0, p1) of the chunks of params.cache_chunks in the prompt
+    std::vector<std::pair<llama_pos, llama_pos>> kv_chunks;
+
+    // the append-only save file of this slot (params_base.slot_save_append)
+    std::string  session_path;
+    llama_tokens session_tokens; // tokens in the file
+    llama_pos    session_pos = 0; // next KV position to append
+
+    // the prompt evaluated by the prefill server (params_base.prefill_url), dropped when the slot is released
+    std::shared_ptr<server_remote_prefill> remote_prefill;
+    bool remote_prefill_tried = false;
+
+    // SERVER_TASK_TYPE_PREFILL: the KV cells before this position are sent
+    llama_pos kv_sent = 0;
+
+    std::string stopping_word;
+
+    // the stop strings of params.antiprompt, fed with generated_text
+    common_stop_matcher stop_matcher;
+    server_stop_tokens  stop_tokens;
+
+    // sampling
+    json json_schema;
+
+    struct common_sampler * smpl = nullptr;
+
+    llama_token sampled;
+
+    // draft tokens added to the batch after the sampled token, verified in the same decode
+    llama_tokens         drafted;
+    std::vector<int32_t> i_batch_dft;
+
+    // tokens forced by the grammar before the sampled token, evaluated without logits (params_base.jump_forward)
+    llama_tokens forced;
+
+    common_chat_format chat_format = COMMON_CHAT_FORMAT_CONTENT_ONLY;
+    std::vector<std::string> generated_tool_call_ids;
+
+    // stats
+    size_t n_sent_text        = 0; // number of sent text character
+
+    int64_t t_start_process_prompt;
+    int64_t t_start_generation;
+
+    double t_prompt_processing; // ms
+    double t_token_generation;  // ms
+
+    std::function<void(int)> callback_on_release;
+
+    // Speculative decoding stats
+    int32_t n_draft_total = 0;      // Total draft tokens generated
+    int32_t n_draft_accepted = 0;   // Draft tokens actually accepted
+
+    // streamed text and tokens not sent yet, see slot_params::stream_coalesce_ms
+    std::string  stream_pending_text;
+    llama_tokens stream_pending_tokens;
+    int64_t      t_stream_flush = 0; // us
+
+    void reset() {
+        SLT_DBG(*this, "%s", "\n");
+
+        n_prompt_tokens    = 0;
+        last_nl_pos        = 0;
+        generated_text     = "";
+        has_new_line       = false;
+        truncated          = false;
+        stop               = STOP_TYPE_NONE;
+        stopping_word      = "";
+        n_past             = 0;
+        n_sent_text        = 0;
+        task_type          = SERVER_TASK_TYPE_COMPLETION;
+        chat_format        = COMMON_CHAT_FORMAT_CONTENT_ONLY;
+
+        generated_tokens.clear();
+        generated_token_probs.clear();
+        chat_msg = {};
+        chat_parser_state.reset();
+        json_schema = json();
+        generated_tool_call_ids.clear();
+
+        // clear speculative decoding stats
+        n_draft_total = 0;
+        n_draft_accepted = 0;
+
+        stream_pending_text.clear();
+        stream_pending_tokens.clear();
+        t_stream_flush = 0;
+
+        forced.clear();
+        kv_chunks.clear();
+
+        remote_prefill.reset();
+        remote_prefill_tried = false;
+        kv_sent = 0;
+    }
+
+    bool need_embd() const {
+        return server_task_type_need_embd(task_type);
+    }
+
+    bool need_logits() const {
+        return server_task_type_need_logits(task_type);
+    }
+
+    // if the context does not have a memory module then all embeddings have to be computed within a single ubatch
+    // also we cannot split if the pooling would require any past tokens
+    // (the rank pooling of a model with a memory module is causal and uses the last token)
+    bool can_split() const {
+        return
+            !need_embd() ||
+            (llama_get_memory(ctx) && (llama_pooling_type(ctx) == LLAMA_POOLING_TYPE_LAST || llama_pooling_type(ctx) == LLAMA_POOLING_TYPE_RANK));
+    }
+
+    bool can_batch_with(server_slot & other_slot) const {
+        // the LoRA adapters are applied per sequence, so the slots with different adapters can be batched
+        return task_type == other_slot.task_type;
+    }
+
+    bool has_budget(const common_params & global_params) {
+        if (params.n_predict == -1 && global_params.n_predict == -1) {
+            return true; // limitless
+        }
+
+        n_remaining = -1;
+
+        if (params.n_predict != -1) {
+            n_remaining = params.n_predict - n_decoded;
+        } else if (global_params.n_predict != -1) {
+            n_remaining = global_params.n_predict - n_decoded;
+        }
+
+        return n_remaining > 0; // no budget
+    }
+
+    bool is_processing() const {
+        return state != SLOT_STATE_IDLE;
+    }
+
+    bool can_speculate() const {
+        return (ctx_dft || spec_heads || spec_mtp || ngram_cache || lookahead.n_gram > 0) && params.speculative.n_max > 0 && params.cache_prompt;
+    }
+
+    void add_token(const completion_token_output & token) {
+        if (!is_processing()) {
+            SLT_WRN(*this, "%s", "slot is not processing\n");
+            return;
+        }
+        generated_token_probs.push_back(token);
+    }
+
+    void release() {
+        if (is_processing()) {
+            SLT_INF(*this, "stop processing: n_past = %d, truncated = %d\n", n_past, truncated);
+
+            t_last_used = ggml_time_us();
+            t_token_generation = (ggml_time_us() - t_start_generation) / 1e3;
+            state = SLOT_STATE_IDLE;
+
+            // the transfer is cancelled by the server loop
+            remote_prefill.reset();
+
+            // the next request of a conversation starts with this one and its reply
+            if (!params.prefix_text.empty()) {
+                if (params.oaicompat == OAICOMPAT_TYPE_CHAT) {
+                    prefix_hashes = server_prefix_hashes(params.prefix_text + "assistant\n" + generated_text + "\n");
+                } else {
+                    prefix_hashes = server_prefix_hashes(params.prefix_text + generated_text);
+                }
+            }
+
+            callback_on_release(id);
+        }
+    }
+
+    result_timings get_timings() const {
+        result_timings timings;
+        timings.prompt_n = n_prompt_tokens_processed;
+        timings.prompt_ms = t_prompt_processing;
+        timings.prompt_per_token_ms = t_prompt_processing / n_prompt_tokens_processed;
+        timings.prompt_per_second = 1e3 / t_prompt_processing * n_prompt_tokens_processed;
+
+        timings.predicted_n = n_decoded;
+        timings.predicted_ms = t_token_generation;
+        timings.predicted_per_token_ms = t_token_generation / n_decoded;
+        timings.predicted_per_second = 1e3 / t_token_generation * n_decoded;
+
+        // Add speculative metrics
+        if (n_draft_total > 0) {
+            timings.draft_n = n_draft_total;
+            timings.draft_n_accepted = n_draft_accepted;
+        }
+
+        return timings;
+    }
+
+    const common_chat_msg & update_chat_msg(std::vector<common_chat_msg_diff> & diffs) {
+        auto previous_msg = chat_msg;
+        SRV_DBG("Parsing chat message: %s\n", generated_text.c_str());
+        auto new_msg = common_chat_parse(
+            generated_text,
+            /* is_partial= */ stop != STOP_TYPE_EOS,
+            params.oaicompat_chat_syntax,
+            chat_parser_state);
+        if (!new_msg.empty()) {
+            new_msg.ensure_tool_call_ids_set(generated_tool_call_ids, gen_tool_call_id);
+            chat_msg = new_msg;
+            diffs = common_chat_msg_diff::compute_diffs(previous_msg, new_msg.empty() ? previous_msg : new_msg);
+        }
+        return chat_msg;
+    }
+
+    // text is the end of generated_text that was not sent yet
+    size_t find_stopping_strings(const std::string & text, bool is_full_stop) {
+        if (stop_matcher.empty()) {
+            return std::string::npos;
+        }
+
+        // position of text in generated_text
+        const size_t base = generated_text.size() - text.size();
+
+        if (is_full_stop) {
+            // only the bytes generated since the last check are fed
+            size_t i_stop = 0;
+            const size_t pos = stop_matcher.feed(std::string_view(generated_text).substr(stop_matcher.n_fed()), &i_stop);
+            if (pos == std::string::npos) {
+                return std::string::npos;
+            }
+
+            stop           = STOP_TYPE_WORD;
+            stopping_word  = params.antiprompt[i_stop];
+            has_next_token = false;
+
+            return pos > base ? pos - base : 0;
+        }
+
+        // otherwise, partial stop
+        const size_t n_partial = stop_matcher.partial_len(text.size());
+
+        return n_partial > 0 ? text.size() - n_partial : std::string::npos;
+    }
+
+    void print_timings() const {
+        const double t_prompt        =       t_prompt_processing / n_prompt_tokens_processed;
+        const double n_prompt_second = 1e3 / t_prompt_processing * n_prompt_tokens_processed;
+
+        const double t_gen        =       t_token_generation / n_decoded;
+        const double n_gen_second = 1e3 / t_token_generation * n_decoded;
+
+        SLT_INF(*this,
+                "\n"
+                "prompt eval time = %10.2f ms / %5d tokens (%8.2f ms per token, %8.2f tokens per second)\n"
+                "       eval time = %10.2f ms / %5d tokens (%8.2f ms per token, %8.2f tokens per second)\n"
+                "      total time = %10.2f ms / %5d tokens\n",
+                t_prompt_processing, n_prompt_tokens_processed, t_prompt, n_prompt_second,
+                t_token_generation, n_decoded, t_gen, n_gen_second,
+                t_prompt_processing + t_token_generation, n_prompt_tokens_processed + n_decoded);
+
+        if (n_draft_total > 0) {
+            const float draft_ratio = (float) n_draft_accepted / n_draft_total;
+            SLT_INF(*this,
+                    "\n"
+                    "draft acceptance rate = %0.5f (%5d accepted / %5d generated)\n",
+                    draft_ratio, n_draft_accepted, n_draft_total
+            );
+        }
+    }
+
+    json to_json() const {
+        return json {
+            {"id",            id},
+            {"id_task",       id_task},
+            {"n_ctx",         n_ctx},
+            {"speculative",   can_speculate()},
+            {"is_processing", is_processing()},
+            {"params",        params.to_json()},
+            {"prompt",        prompt_tokens.detokenize(ctx, true)},
+            {"next_token",
+                {
+                    {"has_next_token", has_next_token},
+                    {"has_new_line",   has_new_line},
+                    {"n_remain",       n_remaining},
+                    {"n_decoded",      n_decoded},
+                    {"stopping_word",  stopping_word},
+                }
+            },
+        };
+    }
+};
+
+struct server_metrics {
+    int64_t t_start = 0;
+
+    uint64_t n_prompt_tokens_processed_total = 0;
+    uint64_t t_prompt_processing_total       = 0;
+    uint64_t n_tokens_predicted_total        = 0;
+    uint64_t t_tokens_generation_total       = 0;
+
+    uint64_t n_prompt_tokens_processed = 0;
+    uint64_t t_prompt_processing       = 0;
+
+    uint64_t n_tokens_predicted  = 0;
+    uint64_t t_tokens_generation = 0;
+
+    uint64_t n_decode_total     = 0;
+    uint64_t n_busy_slots_total = 0;
+
+    uint64_t n_rejected_kv = 0; // tasks rejected by the admission control of --kv-pool
+
+    // per server_task_priority
+    std::array<uint64_t, SERVER_TASK_PRIORITY_COUNT> n_tasks_started = {};
+    std::array<uint64_t, SERVER_TASK_PRIORITY_COUNT> t_tasks_wait    = {}; // us
+
+    server_histogram h_queue_wait { server_histogram::bounds_request() }; // posted -> started
+    server_histogram h_ttft       { server_histogram::bounds_request() }; // posted -> first token sampled
+    server_histogram h_token      { server_histogram::bounds_step() };    // between two generated tokens of a slot
+    server_histogram h_sampling   { server_histogram::bounds_step() };    // sampling of the slots of a batch view
+    server_histogram h_detokenize { server_histogram::bounds_step() };    // token to piece of a generated token
+
+    // time spent in the stages of update_slots(), us
+    uint64_t n_update_slots_total  = 0;
+    uint64_t t_update_slots_batch  = 0; // building the batch
+    uint64_t t_update_slots_decode = 0; // llama_decode()
+    uint64_t t_update_slots_sample = 0; // sampling
+    uint64_t t_update_slots_send   = 0; // pushing the results to the HTTP threads
+
+    void init() {
+        t_start = ggml_time_us();
+    }
+
+    void on_prompt_eval(const server_slot & slot) {
+        n_prompt_tokens_processed_total += slot.n_prompt_tokens_processed;
+        n_prompt_tokens_processed       += slot.n_prompt_tokens_processed;
+        t_prompt_processing             += slot.t_prompt_processing;
+        t_prompt_processing_total       += slot.t_prompt_processing;
+
+        if (slot.t_queued >= 0) {
+            h_ttft.observe((slot.t_start_generation - slot.t_queued) / 1e6);
+        } else {
+            h_ttft.observe(slot.t_prompt_processing / 1e3);
+        }
+    }
+
+    void on_prediction(const server_slot & slot) {
+        n_tokens_predicted_total   += slot.n_decoded;
+        n_tokens_predicted         += slot.n_decoded;
         t_tokens_generation        += slot.t_token_generation;
         t_tokens_generation_total  += slot.t_token_generation;
     }
 
-    void on_decoded(const std::vector<server_slot> & slots) {
-        n_decode_total++;
-        for (const auto & slot : slots) {
-            if (slot.is_processing()) {
-                n_busy_slots_total++;
+    void on_task_started(const server_task & task) {
+        n_tasks_started[task.params.priority]++;
+        if (task.t_queued >= 0) {
+            const int64_t t_wait = ggml_time_us() - task.t_queued;
+            t_tasks_wait[task.params.priority] += t_wait;
+            h_queue_wait.observe(t_wait / 1e6);
+        }
+    }
+
+    void on_sampled(int64_t t_sample) {
+        t_update_slots_sample += t_sample;
+        h_sampling.observe(t_sample / 1e6);
+    }
+
+    void on_decoded(const std::vector<server_slot> & slots) {
+        n_decode_total++;
+        for (const auto & slot : slots) {
+            if (slot.is_processing()) {
+                n_busy_slots_total++;
+            }
+        }
+    }
+
+    void reset_bucket() {
+        n_prompt_tokens_processed = 0;
+        t_prompt_processing       = 0;
+        n_tokens_predicted        = 0;
+        t_tokens_generation       = 0;
+    }
+};
+
+struct server_queue {
+    int id = 0;
+    bool running;
+
+    // queues
+    std::deque<server_task> queue_tasks;
+    std::deque<server_task> queue_tasks_deferred;
+
+    std::mutex mutex_tasks;
+    std::condition_variable condition_tasks;
+
+    // if >= 0, the time at which the loop wakes up without a new task (see wake_at())
+    int64_t t_wake_us = -1;
+
+    // callback functions
+    std::function<void(server_task &&)> callback_new_task;
+    std::function<void(void)>           callback_update_slots;
+
+    // Add a new task to the end of the queue
+    int post(server_task && task, bool front = false) {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        GGML_ASSERT(task.id != -1);
+        // if this is cancel task make sure to clean up pending tasks
+        if (task.type == SERVER_TASK_TYPE_CANCEL) {
+            cleanup_pending_task(task.id_target);
+        }
+        const int task_id = task.id;
+        if (task.t_queued < 0) {
+            task.t_queued = ggml_time_us();
+        }
+        QUE_DBG("new task, id = %d, front = %d\n", task_id, front);
+        if (front) {
+            queue_tasks.push_front(std::move(task));
+        } else {
+            queue_tasks.push_back(std::move(task));
+        }
+        condition_tasks.notify_one();
+        return task_id;
+    }
+
+    // multi-task version of post()
+    int post(std::vector<server_task> && tasks, bool front = false) {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        for (auto & task : tasks) {
+            if (task.id == -1) {
+                task.id = id++;
+            }
+            // if this is cancel task make sure to clean up pending tasks
+            if (task.type == SERVER_TASK_TYPE_CANCEL) {
+                cleanup_pending_task(task.id_target);
+            }
+            if (task.t_queued < 0) {
+                task.t_queued = ggml_time_us();
+            }
+            QUE_DBG("new task, id = %d/%d, front = %d\n", task.id, (int) tasks.size(), front);
+            if (front) {
+                queue_tasks.push_front(std::move(task));
+            } else {
+                queue_tasks.push_back(std::move(task));
+            }
+        }
+        condition_tasks.notify_one();
+        return 0;
+    }
+
+    // Add a new task, but defer until one slot is available
+    void defer(server_task && task) {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        QUE_DBG("defer task, id = %d\n", task.id);
+        queue_tasks_deferred.push_back(std::move(task));
+        condition_tasks.notify_one();
+    }
+
+    // Get the next id for creating a new task
+    int get_new_id() {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        int new_id = id++;
+        return new_id;
+    }
+
+    // Register function to process a new task
+    void on_new_task(std::function<void(server_task &&)> callback) {
+        callback_new_task = std::move(callback);
+    }
+
+    // Register the function to be called when all slots data is ready to be processed
+    void on_update_slots(std::function<void(void)> callback) {
+        callback_update_slots = std::move(callback);
+    }
+
+    // Call when the state of one slot is changed, it will move one task from deferred to main queue
+    // the task with the highest priority is moved first, then the one with the earliest deadline, then the oldest
+    void pop_deferred_task() {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        if (!queue_tasks_deferred.empty()) {
+            auto best = queue_tasks_deferred.begin();
+            for (auto it = queue_tasks_deferred.begin(); it != queue_tasks_deferred.end(); ++it) {
+                if (it->before(*best)) {
+                    best = it;
+                }
+            }
+            queue_tasks.emplace_back(std::move(*best));
+            queue_tasks_deferred.erase(best);
+        }
+        condition_tasks.notify_one();
+    }
+
+    // the KV cells forecast for the deferred tasks, see server_task::n_kv_needed
+    int64_t n_deferred_kv() {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        int64_t res = 0;
+        for (const auto & task : queue_tasks_deferred) {
+            res += task.n_kv_needed;
+        }
+        return res;
+    }
+
+    // remove the deferred tasks whose deadline has passed at t_us
+    // returns the earliest deadline of the remaining ones in t_next (-1 if none)
+    std::vector<server_task> pop_deferred_expired(int64_t t_us, int64_t & t_next) {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        std::vector<server_task> res;
+        t_next = -1;
+        for (auto it = queue_tasks_deferred.begin(); it != queue_tasks_deferred.end();) {
+            const int64_t t_deadline = it->t_deadline();
+            if (t_deadline >= 0 && t_deadline < t_us) {
+                res.push_back(std::move(*it));
+                it = queue_tasks_deferred.erase(it);
+                continue;
+            }
+            if (t_deadline >= 0) {
+                t_next = t_next < 0 ? t_deadline : std::min(t_next, t_deadline);
+            }
+            ++it;
+        }
+        return res;
+    }
+
+    // number of deferred tasks per priority
+    std::array<int, SERVER_TASK_PRIORITY_COUNT> n_deferred_per_priority() {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        std::array<int, SERVER_TASK_PRIORITY_COUNT> res = {};
+        for (const auto & task : queue_tasks_deferred) {
+            res[task.params.priority]++;
+        }
+        return res;
+    }
+
+    // the highest priority among the deferred tasks, or -1 if there are none
+    int max_deferred_priority() {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        int res = -1;
+        for (const auto & task : queue_tasks_deferred) {
+            res = std::max(res, (int) task.params.priority);
+        }
+        return res;
+    }
+
+    // end the start_loop routine
+    void terminate() {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        running = false;
+        condition_tasks.notify_all();
+    }
+
+    /**
+     * Main loop consists of these steps:
+     * - Wait until a new task arrives
+     * - Process the task (i.e. maybe copy data into slot)
+     * - Check if multitask is finished
+     * - Update all slots
+     */
+    void start_loop() {
+        running = true;
+
+        while (true) {
+            QUE_DBG("%s", "processing new tasks\n");
+
+            while (true) {
+                std::unique_lock<std::mutex> lock(mutex_tasks);
+                if (!running) {
+                    QUE_DBG("%s", "terminate\n");
+                    return;
+                }
+                if (queue_tasks.empty()) {
+                    lock.unlock();
+                    break;
+                }
+                server_task task = std::move(queue_tasks.front());
+                queue_tasks.pop_front();
+                lock.unlock();
+
+                QUE_DBG("processing task, id = %d\n", task.id);
+                callback_new_task(std::move(task));
+            }
+
+            // all tasks in the current loop is processed, slots data is now ready
+            QUE_DBG("%s", "update slots\n");
+
+            callback_update_slots();
+
+            QUE_DBG("%s", "waiting for new tasks\n");
+            {
+                std::unique_lock<std::mutex> lock(mutex_tasks);
+                if (!running) {
+                    QUE_DBG("%s", "terminate\n");
+                    return;
+                }
+                if (queue_tasks.empty()) {
+                    const auto woken = [&]{
+                        return (!queue_tasks.empty() || !running || t_wake_us == 0);
+                    };
+                    if (t_wake_us >= 0) {
+                        // the slots asked to be updated again at a later time
+                        condition_tasks.wait_for(lock, std::chrono::microseconds(std::max<int64_t>(0, t_wake_us - ggml_time_us())), woken);
+                    } else {
+                        condition_tasks.wait(lock, woken);
+                    }
+                }
+                t_wake_us = -1;
+            }
+        }
+    }
+
+    // update the slots again at time t_us (in us), even if no new task arrives in the meantime
+    void wake_at(int64_t t_us) {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        t_wake_us = t_wake_us < 0 ? t_us : std::min(t_wake_us, t_us);
+    }
+
+    // update the slots as soon as possible - can be called from any thread
+    void wake() {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        t_wake_us = 0;
+        condition_tasks.notify_one();
+    }
+
+private:
+    void cleanup_pending_task(int id_target) {
+        // no need lock because this is called exclusively by post()
+        auto rm_func = [id_target](const server_task & task) {
+            return task.id_target == id_target;
+        };
+        queue_tasks.erase(
+            std::remove_if(queue_tasks.begin(),          queue_tasks.end(),          rm_func),
+            queue_tasks.end());
+        queue_tasks_deferred.erase(
+            std::remove_if(queue_tasks_deferred.begin(), queue_tasks_deferred.end(), rm_func),
+            queue_tasks_deferred.end());
+    }
+};
+
+struct server_response {
+    bool running = true;
+
+    // for keeping track of all tasks waiting for the result
+    std::unordered_set<int> waiting_task_ids;
+
+    // the pending results of each waiting task (using ptr for polymorphism)
+    // the sequence number keeps the arrival order across the tasks of a request
+    std::unordered_map<int, std::deque<std::pair<uint64_t, server_task_result_ptr>>> queue_results;
+    uint64_t n_results = 0;
+
+    // the condition variable of the thread blocked on each task, so that a result wakes up only its receiver
+    std::unordered_map<int, std::condition_variable *> waiters;
+
+    std::mutex mutex_results;
+
+    // add the id_task to the list of tasks waiting for response
+    void add_waiting_task_id(int id_task) {
+        SRV_DBG("add task %d to waiting list. current waiting = %d (before add)\n", id_task, (int) waiting_task_ids.size());
+
+        std::unique_lock<std::mutex> lock(mutex_results);
+        waiting_task_ids.insert(id_task);
+    }
+
+    void add_waiting_tasks(const std::vector<server_task> & tasks) {
+        std::unique_lock<std::mutex> lock(mutex_results);
+
+        for (const auto & task : tasks) {
+            SRV_DBG("add task %d to waiting list. current waiting = %d (before add)\n", task.id, (int) waiting_task_ids.size());
+            waiting_task_ids.insert(task.id);
+        }
+    }
+
+    // when the request is finished, we can remove task associated with it
+    void remove_waiting_task_id(int id_task) {
+        SRV_DBG("remove task %d from waiting list. current waiting = %d (before remove)\n", id_task, (int) waiting_task_ids.size());
+
+        std::unique_lock<std::mutex> lock(mutex_results);
+        waiting_task_ids.erase(id_task);
+        // make sure to clean up all pending results
+        queue_results.erase(id_task);
+    }
+
+    void remove_waiting_task_ids(const std::unordered_set<int> & id_tasks) {
+        std::unique_lock<std::mutex> lock(mutex_results);
+
+        for (const auto & id_task : id_tasks) {
+            SRV_DBG("remove task %d from waiting list. current waiting = %d (before remove)\n", id_task, (int) waiting_task_ids.size());
+            waiting_task_ids.erase(id_task);
+            queue_results.erase(id_task);
+        }
+    }
+
+    // This function blocks the thread until there is a response for one of the id_tasks
+    server_task_result_ptr recv(const std::unordered_set<int> & id_tasks) {
+        std::unique_lock<std::mutex> lock(mutex_results);
+
+        server_task_result_ptr res = pop_result(id_tasks);
+        if (res) {
+            return res;
+        }
+
+        std::condition_variable cv;
+        add_waiter(id_tasks, &cv);
+        cv.wait(lock, [&]{
+            if (!running) {
+                SRV_DBG("%s : queue result stop\n", __func__);
+                std::terminate(); // we cannot return here since the caller is HTTP code
+            }
+            res = pop_result(id_tasks);
+            return res != nullptr;
+        });
+        remove_waiter(id_tasks);
+
+        return res;
+    }
+
+    // same as recv(), but have timeout in seconds
+    // if timeout is reached, nullptr is returned
+    server_task_result_ptr recv_with_timeout(const std::unordered_set<int> & id_tasks, int timeout) {
+        std::unique_lock<std::mutex> lock(mutex_results);
+
+        server_task_result_ptr res = pop_result(id_tasks);
+        if (res) {
+            return res;
+        }
+
+        std::condition_variable cv;
+        add_waiter(id_tasks, &cv);
+        cv.wait_for(lock, std::chrono::seconds(timeout), [&]{
+            if (!running) {
+                SRV_DBG("%s : queue result stop\n", __func__);
+                std::terminate(); // we cannot return here since the caller is HTTP code
+            }
+            res = pop_result(id_tasks);
+            return res != nullptr;
+        });
+        remove_waiter(id_tasks);
+
+        return res;
+    }
+
+    // single-task version of recv()
+    server_task_result_ptr recv(int id_task) {
+        std::unordered_set<int> id_tasks = {id_task};
+        return recv(id_tasks);
+    }
+
+    // Send a new result to a waiting id_task
+    void send(server_task_result_ptr && result) {
+        SRV_DBG("sending result for task id = %d\n", result->id);
+
+        std::unique_lock<std::mutex> lock(mutex_results);
+
+        const int id_task = result->id;
+        if (waiting_task_ids.find(id_task) == waiting_task_ids.end()) {
+            return;
+        }
+
+        SRV_DBG("task id = %d pushed to result queue\n", id_task);
+
+        queue_results[id_task].emplace_back(n_results++, std::move(result));
+
+        auto it = waiters.find(id_task);
+        if (it != waiters.end()) {
+            it->second->notify_one();
+        }
+    }
+
+    // terminate the waiting loop
+    void terminate() {
+        std::unique_lock<std::mutex> lock(mutex_results);
+
+        running = false;
+        for (auto & it : waiters) {
+            it.second->notify_all();
+        }
+    }
+
+private:
+    // the oldest pending result of the id_tasks, or nullptr if there is none
+    // must be called with mutex_results held
+    server_task_result_ptr pop_result(const std::unordered_set<int> & id_tasks) {
+        std::deque<std::pair<uint64_t, server_task_result_ptr>> * oldest = nullptr;
+
+        for (const int id_task : id_tasks) {
+            auto it = queue_results.find(id_task);
+            if (it == queue_results.end() || it->second.empty()) {
+                continue;
+            }
+            if (!oldest || it->second.front().first < oldest->front().first) {
+                oldest = &it->second;
+            }
+        }
+
+        if (!oldest) {
+            return nullptr;
+        }
+
+        server_task_result_ptr res = std::move(oldest->front().second);
+        oldest->pop_front();
+
+        return res;
+    }
+
+    void add_waiter(const std::unordered_set<int> & id_tasks, std::condition_variable * cv) {
+        for (const int id_task : id_tasks) {
+            waiters[id_task] = cv;
+        }
+    }
+
+    void remove_waiter(const std::unordered_set<int> & id_tasks) {
+        for (const int id_task : id_tasks) {
+            waiters.erase(id_task);
+        }
+    }
+};
+
+// thread pool for the HTTP requests that starts a new thread when all of them are busy, up to n_threads_max
+// a streaming request holds its thread until the generation is done, so a fixed pool limits the number of streams
+struct server_http_task_queue : public httplib::TaskQueue {
+    server_http_task_queue(size_t n_threads, size_t n_threads_max) : n_threads_max(std::max(n_threads, n_threads_max)) {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (size_t i = 0; i < n_threads; ++i) {
+            threads.emplace_back(&server_http_task_queue::worker, this);
+        }
+    }
+
+    ~server_http_task_queue() override = default;
+
+    bool enqueue(std::function<void()> fn) override {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (stopped) {
+            return false;
+        }
+
+        jobs.push_back(std::move(fn));
+        if (jobs.size() > n_idle && threads.size() < n_threads_max) {
+            threads.emplace_back(&server_http_task_queue::worker, this);
+            SRV_DBG("all HTTP threads are busy, n_threads = %zu\n", threads.size());
+        }
+
+        cond.notify_one();
+        return true;
+    }
+
+    void shutdown() override {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            stopped = true;
+        }
+        cond.notify_all();
+
+        // no new thread is started once stopped is set
+        for (auto & t : threads) {
+            t.join();
+        }
+    }
+
+private:
+    void worker() {
+        while (true) {
+            std::function<void()> fn;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                n_idle++;
+                cond.wait(lock, [&] { return !jobs.empty() || stopped; });
+                n_idle--;
+
+                if (stopped && jobs.empty()) {
+                    break;
+                }
+
+                fn = std::move(jobs.front());
+                jobs.pop_front();
+            }
+
+            fn();
+        }
+    }
+
+    const size_t n_threads_max;
+
+    std::vector<std::thread> threads;
+    std::deque<std::function<void()>> jobs;
+    size_t n_idle  = 0;
+    bool   stopped = false;
+
+    std::mutex mutex;
+    std::condition_variable cond;
+};
+
+// encodes the image/audio chunks of the slots on a worker thread, one chunk at a time,
+// so that the other slots keep decoding while the encoder runs
+struct server_mtmd_encoder {
+    mtmd_context * mctx = nullptr;
+
+    std::function<void()> on_done; // called on the worker thread when the encoding has finished
+
+    int id_slot = -1;
+    int id_task = -1;
+
+    mtmd::input_chunk_ptr chunk;
+    std::vector<float>    embd;
+
+    std::future<int32_t> res;
+
+    ~server_mtmd_encoder() {
+        if (res.valid()) {
+            res.wait();
+        }
+    }
+
+    bool busy() const {
+        return res.valid();
+    }
+
+    bool ready() const {
+        return res.valid() && res.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    }
+
+    // true if the pending encoding is the one of this chunk for this slot task
+    bool is_for(const server_slot & slot, const mtmd_input_chunk * c) const {
+        const char * id0 = mtmd_input_chunk_get_id(chunk.get());
+        const char * id1 = mtmd_input_chunk_get_id(c);
+
+        return busy() && slot.id == id_slot && slot.id_task == id_task && id0 && id1 && strcmp(id0, id1) == 0;
+    }
+
+    void start(const server_slot & slot, const mtmd_input_chunk * c, size_t n_embd) {
+        GGML_ASSERT(!busy());
+
+        id_slot = slot.id;
+        id_task = slot.id_task;
+        chunk.reset(mtmd_input_chunk_copy(c));
+
+        res = std::async(std::launch::async, [this, n_embd]() {
+            const int32_t ret = mtmd_encode_chunk(mctx, chunk.get());
+            if (ret == 0) {
+                const float * out = mtmd_get_output_embd(mctx);
+                embd.assign(out, out + mtmd_input_chunk_get_n_tokens(chunk.get())*n_embd);
+            }
+            on_done();
+
+            return ret;
+        });
+    }
+
+    // wait for the result and reset the encoder
+    int32_t get(std::vector<float> & embd_out) {
+        const int32_t ret = res.get();
+
+        embd_out = std::move(embd);
+        embd.clear();
+        chunk.reset();
+
+        id_slot = -1;
+        id_task = -1;
+
+        return ret;
+    }
+};
+
+// storage for the KV state of idle slots that would otherwise be overwritten when the slot is reused
+// the states are kept in host memory (pinned, if supported by the device) and spilled to disk when the host budget is exceeded
+// with params.slot_offload_persist, the disk entries are kept when the server stops and found again on the next start
+#define SERVER_KV_STORE_MAGIC   0x766b6767 // "ggkv"
+#define SERVER_KV_STORE_VERSION 1
+
+// the disk entries start with the header, the tokens and the scales of the adapters, followed by the state
+struct server_kv_store_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t model_id; // see server_kv_store::model_id
+    uint32_t n_tokens;
+    uint32_t n_lora;
+    uint64_t n_state;
+};
+
+struct server_kv_store {
+    struct entry {
+        llama_tokens tokens;
+
+        std::vector<common_adapter_lora_info> lora;
+
+        ggml_backend_buffer_ptr buf; // host copy, nullptr if the state was spilled to disk
+        std::string path;            // disk copy
+
+        size_t size = 0;
+    };
+
+    size_t n_max_host = 0;
+    size_t n_max_disk = 0;
+
+    size_t n_host = 0;
+    size_t n_disk = 0;
+
+    std::string dir;
+
+    int n_files = 0;
+
+    bool persist = false;
+
+    // hash of the model, the adapters and the KV cache parameters - the persisted states of other models are ignored
+    uint64_t model_id = 0;
+
+    // the loaded adapters, for the scales of the persisted states
+    std::vector<common_adapter_lora_info> lora_base;
+
+    ggml_backend_buffer_type_t buft = nullptr;
+
+    // most recently used first
+    std::list<entry> entries;
+
+    void init(const common_params & params, uint64_t model_id) {
+        n_max_host = size_t(params.slot_offload_ram)*1024*1024;
+        n_max_disk = params.slot_save_path.empty() ? 0 : size_t(params.slot_offload_disk)*1024*1024;
+        dir        = params.slot_save_path;
+        persist    = params.slot_offload_persist && n_max_disk > 0;
+        lora_base  = params.lora_adapters;
+
+        this->model_id = model_id;
+
+        // prefer pinned host memory for faster transfers to and from the device
+        buft = ggml_backend_cpu_buffer_type();
+        for (size_t i = 0; i < ggml_backend_dev_count(); ++i) {
+            ggml_backend_dev_t dev = ggml_backend_dev_get(i);
+            if (ggml_backend_dev_type(dev) == GGML_BACKEND_DEVICE_TYPE_GPU) {
+                auto * buft_host = ggml_backend_dev_host_buffer_type(dev);
+                if (buft_host) {
+                    buft = buft_host;
+                }
+                break;
+            }
+        }
+
+        SRV_INF("slot offload: host budget = %zu MiB (%s), disk budget = %zu MiB%s\n",
+                n_max_host/1024/1024, ggml_backend_buft_name(buft), n_max_disk/1024/1024, persist ? ", persistent" : "");
+
+        if (persist) {
+            load_index();
+        }
+    }
+
+    ~server_kv_store() {
+        clear();
+    }
+
+    // with persist, the host entries are written to disk and the files are kept
+    void clear() {
+        if (persist) {
+            while (n_host > 0) {
+                spill();
+            }
+
+            SRV_INF("slot offload: %zu states kept on disk, %zu MiB\n", entries.size(), n_disk/1024/1024);
+        } else {
+            for (auto & e : entries) {
+                if (!e.path.empty()) {
+                    std::remove(e.path.c_str());
+                }
+            }
+        }
+
+        entries.clear();
+
+        n_host = 0;
+        n_disk = 0;
+    }
+
+    bool enabled() const {
+        return n_max_host > 0;
+    }
+
+    // copy the KV state of seq_id to host memory
+    void demote(llama_context * ctx, llama_seq_id seq_id, const llama_tokens & tokens, const std::vector<common_adapter_lora_info> & lora) {
+        const size_t size = llama_state_seq_get_size(ctx, seq_id);
+        if (size == 0 || size > n_max_host) {
+            return;
+        }
+
+        while (n_host + size > n_max_host) {
+            spill();
+        }
+
+        entry e;
+        e.tokens = tokens;
+        e.lora   = lora;
+        e.size   = size;
+        e.buf.reset(ggml_backend_buft_alloc_buffer(buft, size));
+        if (!e.buf) {
+            SRV_WRN("failed to allocate %zu bytes for the slot offload\n", size);
+            return;
+        }
+
+        llama_state_seq_get_data(ctx, (uint8_t *) ggml_backend_buffer_get_base(e.buf.get()), size, seq_id);
+
+        n_host += size;
+
+        SRV_DBG("demoted seq %d: %zu tokens, %zu bytes, n_host = %zu\n", seq_id, tokens.size(), size, n_host);
+
+        entries.push_front(std::move(e));
+    }
+
+    // restore the stored state that shares the longest prefix with the prompt into seq_id
+    // only states that reuse more than n_min tokens are considered
+    // returns the number of restored tokens, 0 if no suitable state was found
+    // or -1 if the state could not be restored (the sequence is cleared in that case)
+    int32_t promote(llama_context * ctx, llama_seq_id seq_id, const llama_tokens & prompt, const std::vector<common_adapter_lora_info> & lora, size_t n_min, llama_tokens & tokens_out) {
+        auto best = entries.end();
+
+        size_t n_best = n_min;
+
+        for (auto it = entries.begin(); it != entries.end(); ++it) {
+            if (!are_lora_equal(it->lora, lora)) {
+                continue;
+            }
+
+            const size_t n_max = std::min(it->tokens.size(), prompt.size());
+
+            size_t n_common = 0;
+            while (n_common < n_max && it->tokens[n_common] == prompt[n_common]) {
+                n_common++;
+            }
+
+            if (n_common > n_best) {
+                n_best = n_common;
+                best   = it;
+            }
+        }
+
+        if (best == entries.end()) {
+            return 0;
+        }
+
+        size_t nread = 0;
+
+        if (best->buf) {
+            nread = llama_state_seq_set_data(ctx, (const uint8_t *) ggml_backend_buffer_get_base(best->buf.get()), best->size, seq_id);
+        } else {
+            std::vector<uint8_t> data(best->size);
+
+            std::ifstream file(best->path, std::ios::binary);
+
+            server_kv_store_header hdr;
+            if (file.read((char *) &hdr, sizeof(hdr)) && hdr.magic == SERVER_KV_STORE_MAGIC && hdr.n_state == best->size &&
+                file.seekg(hdr.n_tokens*sizeof(llama_token) + hdr.n_lora*sizeof(float), std::ios::cur) &&
+                file.read((char *) data.data(), data.size())) {
+                nread = llama_state_seq_set_data(ctx, data.data(), data.size(), seq_id);
+            }
+        }
+
+        tokens_out = std::move(best->tokens);
+
+        erase(best);
+
+        if (nread == 0) {
+            SRV_WRN("failed to restore the offloaded state of seq %d\n", seq_id);
+            llama_memory_seq_rm(llama_get_memory(ctx), seq_id, -1, -1);
+            tokens_out.clear();
+            return -1;
+        }
+
+        SRV_DBG("promoted seq %d: %zu tokens, %zu reused\n", seq_id, tokens_out.size(), n_best);
+
+        return tokens_out.size();
+    }
+
+private:
+    // find the states persisted by a previous run of the server with the same model
+    // only the headers and the tokens are read, the states are read when they are restored
+    void load_index() {
+        namespace fs = std::filesystem;
+
+        struct found {
+            fs::file_time_type t;
+            entry e;
+        };
+
+        std::vector<found> res;
+
+        std::error_code ec;
+        for (const auto & it : fs::directory_iterator(dir, ec)) {
+            const std::string name = it.path().filename().string();
+            if (!it.is_regular_file(ec) || name.rfind("kv-offload-", 0) != 0) {
+                continue;
+            }
+
+            // the new files are numbered after the existing ones
+            n_files = std::max(n_files, std::atoi(name.c_str() + strlen("kv-offload-")) + 1);
+
+            std::ifstream file(it.path(), std::ios::binary);
+
+            server_kv_store_header hdr;
+            if (!file.read((char *) &hdr, sizeof(hdr)) || hdr.magic != SERVER_KV_STORE_MAGIC || hdr.version != SERVER_KV_STORE_VERSION ||
+                hdr.model_id != model_id || hdr.n_lora != lora_base.size()) {
+                continue;
+            }
+
+            const size_t n_meta = sizeof(hdr) + hdr.n_tokens*sizeof(llama_token) + hdr.n_lora*sizeof(float);
+            if (it.file_size(ec) != n_meta + hdr.n_state) {
+                // incomplete write
+                continue;
+            }
+
+            entry e;
+            e.tokens.resize(hdr.n_tokens);
+            e.lora = lora_base;
+            e.path = it.path().string();
+            e.size = hdr.n_state;
+
+            std::vector<float> scales(hdr.n_lora);
+            if (!file.read((char *) e.tokens.data(), e.tokens.size()*sizeof(llama_token)) ||
+                !file.read((char *) scales.data(), scales.size()*sizeof(float))) {
+                continue;
+            }
+
+            for (size_t i = 0; i < scales.size(); ++i) {
+                e.lora[i].scale = scales[i];
+            }
+
+            res.push_back({ it.last_write_time(ec), std::move(e) });
+        }
+
+        std::sort(res.begin(), res.end(), [](const found & a, const found & b) {
+            return a.t > b.t;
+        });
+
+        for (auto & r : res) {
+            if (n_disk + r.e.size > n_max_disk) {
+                std::remove(r.e.path.c_str());
+                continue;
+            }
+
+            n_disk += r.e.size;
+            entries.push_back(std::move(r.e));
+        }
+
+        SRV_INF("slot offload: found %zu persisted states, %zu MiB\n", entries.size(), n_disk/1024/1024);
+    }
+
+    // move the least recently used host entry to disk, or drop it if the disk budget is exceeded
+    void spill() {
+        auto it = entries.end();
+        for (auto cur = entries.begin(); cur != entries.end(); ++cur) {
+            if (cur->buf) {
+                it = cur;
+            }
+        }
+        GGML_ASSERT(it != entries.end());
+
+        if (it->size <= n_max_disk) {
+            while (n_disk + it->size > n_max_disk) {
+                // drop the least recently used disk entry
+                auto last = entries.end();
+                for (auto cur = entries.begin(); cur != entries.end(); ++cur) {
+                    if (!cur->buf) {
+                        last = cur;
+                    }
+                }
+                GGML_ASSERT(last != entries.end());
+                erase(last);
+            }
+
+            const std::string path = dir + "kv-offload-" + std::to_string(n_files++) + ".bin";
+
+            server_kv_store_header hdr;
+            hdr.magic    = SERVER_KV_STORE_MAGIC;
+            hdr.version  = SERVER_KV_STORE_VERSION;
+            hdr.model_id = model_id;
+            hdr.n_tokens = it->tokens.size();
+            hdr.n_lora   = it->lora.size();
+            hdr.n_state  = it->size;
+
+            std::vector<float> scales;
+            for (const auto & la : it->lora) {
+                scales.push_back(la.scale);
+            }
+
+            std::ofstream file(path, std::ios::binary);
+            if (file.write((const char *) &hdr, sizeof(hdr)) &&
+                file.write((const char *) it->tokens.data(), it->tokens.size()*sizeof(llama_token)) &&
+                file.write((const char *) scales.data(), scales.size()*sizeof(float)) &&
+                file.write((const char *) ggml_backend_buffer_get_base(it->buf.get()), it->size)) {
+                n_host -= it->size;
+                n_disk += it->size;
+
+                it->buf.reset();
+                it->path = path;
+
+                return;
+            }
+
+            SRV_WRN("failed to write slot offload file '%s'\n", path.c_str());
+            std::remove(path.c_str());
+        }
+
+        erase(it);
+    }
+
+    void erase(std::list<entry>::iterator it) {
+        if (it->buf) {
+            n_host -= it->size;
+        } else {
+            n_disk -= it->size;
+            std::remove(it->path.c_str());
+        }
+        entries.erase(it);
+    }
+};
+
+// append-only slot save files (params_base.slot_save_append)
+// each save appends a chunk with the tokens and the KV cells added since the previous save of the same file
+// a chunk that was not completely written (e.g. the server stopped during the write) is ignored on restore
+#define SERVER_SESSION_MAGIC 0x73736767 // "ggss"
+
+#define SERVER_SESSION_CHUNK_FINAL 1 // last chunk of a prompt sent by the prefill server, never set in the files
+
+struct server_session_chunk {
+    uint32_t magic;
+    uint32_t n_past;   // number of tokens in the preceding chunks
+    uint32_t n_tokens; // number of tokens in this chunk
+    uint32_t flags;
+    uint64_t n_state;  // size of the incremental state that follows the tokens
+};
+
+// binary token stream (POST /completion/tokens, --token-stream)
+// the request body is a sequence of frames, each a pre-tokenized completion request followed by its prompt tokens
+// the response is a stream of frames, each with the new token ids of one of the requests (its index in the body)
+// all the fields are in the byte order of the server
+#define SERVER_TOKEN_REQUEST_MAGIC 0x72626767 // "ggbr"
+#define SERVER_TOKEN_RESULT_MAGIC  0x74626767 // "ggbt"
+
+#define SERVER_TOKEN_RESULT_FINAL 1 // the last frame of the request, stop is set
+#define SERVER_TOKEN_RESULT_PROBS 2 // the payload has the log-probabilities of the tokens
+#define SERVER_TOKEN_RESULT_ERROR 4 // the payload is the JSON error, no other frame follows for the response
+
+struct server_token_request {
+    uint32_t magic;
+    uint32_t n_tokens;    // prompt tokens that follow
+    int32_t  n_predict;   // -1 = server default
+    int32_t  n_probs;     // top tokens with their log-probabilities for each generated token
+    uint32_t seed;        // LLAMA_DEFAULT_SEED = server default
+    float    temperature; // < 0 = server default
+    int32_t  top_k;       // < 0 = server default
+    float    top_p;       // < 0 = server default
+};
+
+struct server_token_result {
+    uint32_t magic;
+    uint32_t index;           // index of the request frame
+    uint32_t flags;
+    uint32_t stop;            // stop_type, with SERVER_TOKEN_RESULT_FINAL
+    uint32_t n_tokens;        // token ids in the payload
+    uint32_t n_probs;         // top tokens per token in the payload, with SERVER_TOKEN_RESULT_PROBS
+    uint32_t n_prompt_tokens;
+    uint32_t n_bytes;         // size of the payload that follows
+    // payload: int32 token ids [n_tokens]
+    //          with SERVER_TOKEN_RESULT_PROBS: float logprobs [n_tokens], (int32 id, float logprob) [n_tokens][n_probs]
+};
+
+// writes the slot save files on a background thread, so that the server loop does not wait for the disk
+struct server_session_writer {
+    struct job {
+        std::string path;
+        bool        truncate;
+
+        std::vector<uint8_t> data;
+    };
+
+    std::thread worker;
+
+    std::mutex              mutex;
+    std::condition_variable cv;
+    std::condition_variable cv_done;
+
+    std::deque<job> jobs;
+
+    std::unordered_set<std::string> failed; // files that could not be written completely
+
+    bool busy    = false;
+    bool running = true;
+
+    server_session_writer() {
+        worker = std::thread([this]() {
+            loop();
+        });
+    }
+
+    ~server_session_writer() {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            running = false;
+        }
+        cv.notify_one();
+        worker.join();
+    }
+
+    void push(job && j) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (j.truncate) {
+                failed.erase(j.path);
+            }
+            jobs.push_back(std::move(j));
+        }
+        cv.notify_one();
+    }
+
+    // wait until all the queued writes are on disk
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv_done.wait(lock, [this]() {
+            return jobs.empty() && !busy;
+        });
+    }
+
+    bool has_failed(const std::string & path) {
+        std::unique_lock<std::mutex> lock(mutex);
+        return failed.count(path) > 0;
+    }
+
+private:
+    void loop() {
+        while (true) {
+            job j;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [this]() {
+                    return !jobs.empty() || !running;
+                });
+                if (jobs.empty()) {
+                    // drained and stopped
+                    return;
+                }
+                j = std::move(jobs.front());
+                jobs.pop_front();
+                busy = true;
+            }
+
+            bool ok = false;
+            {
+                std::ofstream file(j.path, std::ios::binary | (j.truncate ? std::ios::trunc : std::ios::app));
+                ok = file && file.write((const char *) j.data.data(), j.data.size()) && file.flush();
+            }
+
+            if (!ok) {
+                SRV_WRN("failed to write slot save file '%s'\n", j.path.c_str());
+            }
+
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                if (!ok) {
+                    failed.insert(j.path);
+                }
+                busy = false;
+            }
+            cv_done.notify_all();
+        }
+    }
+};
+
+// prefill/decode disaggregation (params_base.prefill_url)
+// the prompt of a slot is evaluated by another server, started with --kv-prefill, that sends the new KV cells after each
+// of its batches in the chunks of the slot save files - they are received here on a background thread and added to the
+// slot by the server loop, so the transfer overlaps with the evaluation of the rest of the prompt
+struct server_remote_prefill {
+    httplib::Client cli;
+
+    std::thread worker;
+
+    std::mutex mutex;
+    std::deque<std::vector<uint8_t>> chunks; // complete chunks, not added to the slot yet
+
+    bool done   = false; // the final chunk was received
+    bool failed = false;
+
+    std::atomic<bool> cancelled { false };
+    std::atomic<bool> exited    { false };
+
+    server_remote_prefill(const std::string & url, int timeout_read, int timeout_write) : cli(url) {
+        cli.set_connection_timeout(5);
+        cli.set_read_timeout (timeout_read);
+        cli.set_write_timeout(timeout_write);
+    }
+
+    ~server_remote_prefill() {
+        cancel();
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+
+    // on_chunk is called from the worker thread when chunks are received and when the transfer ends
+    void start(httplib::Request req, std::function<void()> on_chunk) {
+        worker = std::thread([this, req = std::move(req), on_chunk]() mutable {
+            run(req, on_chunk);
+            exited = true;
+            on_chunk();
+        });
+    }
+
+    void cancel() {
+        if (!cancelled.exchange(true)) {
+            cli.stop();
+        }
+    }
+
+private:
+    void run(httplib::Request & req, const std::function<void()> & on_chunk) {
+        int status = 0;
+        bool is_final = false;
+
+        std::string buf;
+        std::string error_body;
+
+        req.response_handler = [&status](const httplib::Response & r) {
+            status = r.status;
+            return true;
+        };
+        req.content_receiver = [&](const char * data, size_t n, uint64_t, uint64_t) {
+            if (cancelled) {
+                return false;
+            }
+            if (status != 200) {
+                error_body.append(data, n);
+                return true;
+            }
+
+            buf.append(data, n);
+
+            size_t off = 0;
+            size_t n_new = 0;
+            while (!is_final && buf.size() - off >= sizeof(server_session_chunk)) {
+                server_session_chunk hdr;
+                memcpy(&hdr, buf.data() + off, sizeof(hdr));
+                if (hdr.magic != SERVER_SESSION_MAGIC) {
+                    return false;
+                }
+
+                const size_t n_chunk = sizeof(hdr) + size_t(hdr.n_tokens)*sizeof(llama_token) + hdr.n_state;
+                if (buf.size() - off < n_chunk) {
+                    break;
+                }
+
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    chunks.emplace_back(buf.begin() + off, buf.begin() + off + n_chunk);
+                }
+
+                is_final = hdr.flags & SERVER_SESSION_CHUNK_FINAL;
+                off += n_chunk;
+                n_new++;
+            }
+            buf.erase(0, off);
+
+            if (n_new > 0) {
+                on_chunk();
+            }
+
+            return true;
+        };
+
+        auto result = cli.send(req);
+
+        if (!cancelled) {
+            if (!result) {
+                SRV_WRN("prefill server failed: %s\n", httplib::to_string(result.error()).c_str());
+            } else if (status != 200) {
+                SRV_WRN("prefill server returned %d: %s\n", status, error_body.c_str());
+            } else if (!is_final) {
+                SRV_WRN("%s", "prefill server closed the stream before the final chunk\n");
+            }
+        }
+
+        std::unique_lock<std::mutex> lock(mutex);
+        done   = is_final;
+        failed = !is_final;
+    }
+};
+
+// read-only view of a slot save file, memory mapped where supported
+struct server_session_file {
+    const uint8_t * data = nullptr;
+    size_t          size = 0;
+
+    std::vector<uint8_t> buf;
+
+    void * mapping = nullptr;
+
+    server_session_file(const std::string & path) {
+#if !defined(_WIN32)
+        const int fd = open(path.c_str(), O_RDONLY);
+        if (fd >= 0) {
+            struct stat st;
+            if (fstat(fd, &st) == 0 && st.st_size > 0) {
+                void * addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+                if (addr != MAP_FAILED) {
+                    mapping = addr;
+                    data    = (const uint8_t *) addr;
+                    size    = st.st_size;
+                }
+            }
+            close(fd);
+        }
+#endif
+
+        if (data == nullptr) {
+            // memory mapping is not available - read the file
+            std::ifstream file(path, std::ios::binary | std::ios::ate);
+            if (file) {
+                buf.resize(file.tellg());
+                file.seekg(0);
+                file.read((char *) buf.data(), buf.size());
+            }
+
+            data = buf.data();
+            size = buf.size();
+        }
+    }
+
+    ~server_session_file() {
+#if !defined(_WIN32)
+        if (mapping) {
+            munmap(mapping, size);
+        }
+#endif
+    }
+
+    server_session_file(const server_session_file &) = delete;
+    server_session_file & operator=(const server_session_file &) = delete;
+
+    // check if the file was saved with params_base.slot_save_append, without mapping it
+    static bool is_chunked(const std::string & path) {
+        uint32_t magic = 0;
+
+        std::ifstream file(path, std::ios::binary);
+        file.read((char *) &magic, sizeof(magic));
+
+        return file && magic == SERVER_SESSION_MAGIC;
+    }
+};
+
+struct server_context {
+    common_params params_base;
+
+    // note: keep these alive - they determine the lifetime of the model, context, etc.
+    common_init_result llama_init;
+    common_init_result llama_init_dft;
+
+    llama_model * model = nullptr;
+    llama_context * ctx = nullptr;
+
+    // multimodal
+    mtmd_context * mctx = nullptr;
+
+    const llama_vocab * vocab = nullptr;
+    bool vocab_dft_compatible = true;
+
+    // tokens of the recent prompts, for the prompts that extend them
+    server_tokenize_cache tokenize_cache;
+
+    // the pieces of the tokens, to append the text forced by a grammar (params_base.jump_forward)
+    server_token_pieces token_pieces;
+
+    // the parsed grammars of the recent requests, cloned by the samplers of the slots
+    common_grammar_cache * grammar_cache = nullptr;
+
+    llama_model * model_dft = nullptr;
+
+    // draft heads over the hidden state of the target model (params_base.speculative.heads)
+    common_speculative_heads * spec_heads = nullptr;
+
+    llama_context_params cparams_dft;
+
+    llama_batch batch {};
+
+    bool clean_kv_cache = true;
+    bool add_bos_token  = true;
+
+    int32_t n_ctx; // total context for all clients / slots
+
+    // slots / clients
+    std::vector<server_slot> slots;
+    json default_generation_settings_for_props;
+
+    server_queue    queue_tasks;
+    server_response queue_results;
+
+    server_metrics metrics;
+
+    // time to write a streamed event to the HTTP connection, observed on the HTTP threads
+    std::mutex       mutex_http_write;
+    server_histogram h_http_write { server_histogram::bounds_step() };
+
+    // Necessary similarity of prompt for slot selection
+    float slot_prompt_similarity = 0.0f;
+
+    // prompt prefixes shared across slots (params_base.prefix_cache)
+    server_prefix_cache prefix_cache;
+
+    // prompt tokens added to the current batch by a slot; the following slots with the same prompt prefix at the same
+    // positions add their sequence to these tokens instead of adding them again, e.g. the query of the documents of a
+    // rerank request is computed once
+    struct batch_prompt_run {
+        const server_slot * slot;
+
+        int32_t n_past;   // position of the first token
+        int32_t i_batch;  // index of the first token in the batch
+        int32_t n_tokens;
+    };
+
+    std::vector<batch_prompt_run> batch_prompt_runs;
+
+    // the tokens of a batch can be shared by the sequences of a unified KV cache with causal attention
+    bool batch_prompt_sharing = false;
+
+    // KV states of idle slots offloaded to host memory and disk (params_base.slot_offload_ram)
+    server_kv_store kv_store;
+
+    // background writes of the slot save files (params_base.slot_save_append)
+    server_session_writer session_writer;
+
+    // n-gram lookup cache shared by all slots (params_base.speculative.ngram)
+    server_ngram_cache ngram_cache;
+
+    // speculative decoding costs, and the acceptance of all the slots as the prior of new tasks
+    server_spec_cost  spec_cost;
+    server_spec_stats spec_stats;
+
+    // drafts with the draft model during the decode of the target model (params_base.speculative.async)
+    server_draft_worker draft_worker;
+
+    // vector index of the /index and /search endpoints (params_base.embedding)
+    server_vector_index vector_index;
+
+    // encoded image/audio embeddings shared by all slots (params_base.mmproj_cache)
+    server_mtmd_cache mtmd_cache;
+
+    server_kv_chunk_cache kv_chunk_cache;
+
+    // prompts evaluated by the prefill server, held by their slot until the transfer is done (params_base.prefill_url)
+    std::vector<std::shared_ptr<server_remote_prefill>> remote_prefills;
+
+    // worker thread for the image/audio encoding (params_base.mmproj_async)
+    server_mtmd_encoder mtmd_encoder;
+
+    // slots that were preempted by a task with a higher priority (params_base.slot_preempt)
+    struct server_slot_suspended {
+        server_slot slot;
+
+        std::vector<uint8_t> state; // KV state of the sequence of the slot
+    };
+
+    std::vector<server_slot_suspended> slots_suspended;
+
+    common_chat_templates_ptr chat_templates;
+    oaicompat_parser_options  oai_parser_opt;
+
+    // the params of the first load, used to load the models registered in params_swap.models_swap
+    common_params params_swap;
+
+    // held shared while a request is served, exclusively while the model is swapped
+    std::shared_mutex mutex_swap;
+
+    ~server_context() {
+        // the transfers call queue_tasks.wake()
+        remote_prefills.clear();
+
+        // the encoder may still be running
+        if (mtmd_encoder.busy()) {
+            std::vector<float> embd;
+            mtmd_encoder.get(embd);
+        }
+
+        if (kv_store.persist) {
+            kv_store_demote_slots();
+        }
+
+        mtmd_free(mctx);
+
+        free_slots();
+
+        common_speculative_heads_free(spec_heads);
+
+        common_grammar_cache_free(grammar_cache);
+
+        llama_batch_free(batch);
+    }
+
+    void free_slots() {
+        // the draft contexts may still be in use
+        draft_worker.wait();
+
+        // Clear any sampling context
+        for (server_slot & slot : slots) {
+            common_sampler_free(slot.smpl);
+            slot.smpl = nullptr;
+
+            llama_free(slot.ctx_dft);
+            slot.ctx_dft = nullptr;
+
+            common_speculative_free(slot.spec);
+            slot.spec = nullptr;
+        }
+
+        for (auto & sus : slots_suspended) {
+            common_sampler_free(sus.slot.smpl);
+            sus.slot.smpl = nullptr;
+        }
+    }
+
+    bool load_model(const common_params & params) {
+        SRV_INF("loading model '%s'\n", params.model.path.c_str());
+
+        params_base = params;
+
+        llama_init = common_init_from_params(params_base);
+
+        model = llama_init.model.get();
+        ctx   = llama_init.context.get();
+
+        if (model == nullptr) {
+            SRV_ERR("failed to load model, '%s'\n", params_base.model.path.c_str());
+            return false;
+        }
+
+        vocab = llama_model_get_vocab(model);
+
+        n_ctx = llama_n_ctx(ctx);
+
+        add_bos_token = llama_vocab_get_add_bos(vocab);
+
+        tokenize_cache.init(vocab, 2*std::max(4, params_base.n_parallel));
+
+        grammar_cache = common_grammar_cache_init(GRAMMAR_CACHE_SIZE);
+
+        if (params_base.jump_forward) {
+            token_pieces.init(vocab);
+        }
+
+        if (!params_base.speculative.model.path.empty() || !params_base.speculative.model.hf_repo.empty()) {
+            SRV_INF("loading draft model '%s'\n", params_base.speculative.model.path.c_str());
+
+            auto params_dft = params_base;
+
+            params_dft.devices      = params_base.speculative.devices;
+            params_dft.model        = params_base.speculative.model;
+            params_dft.n_ctx        = params_base.speculative.n_ctx == 0 ? params_base.n_ctx / params_base.n_parallel : params_base.speculative.n_ctx;
+            params_dft.n_gpu_layers = params_base.speculative.n_gpu_layers;
+            params_dft.n_parallel   = 1;
+            params_dft.cache_type_k = params_base.speculative.cache_type_k;
+            params_dft.cache_type_v = params_base.speculative.cache_type_v;
+
+            llama_init_dft = common_init_from_params(params_dft);
+
+            model_dft = llama_init_dft.model.get();
+
+            if (model_dft == nullptr) {
+                SRV_ERR("failed to load draft model, '%s'\n", params_base.speculative.model.path.c_str());
+                return false;
+            }
+
+            vocab_dft_compatible = common_speculative_are_compatible(ctx, llama_init_dft.context.get());
+            if (!vocab_dft_compatible) {
+                SRV_INF("the draft model '%s' is not compatible with the target model '%s'. tokens will be translated between the draft and target models.\n", params_base.speculative.model.path.c_str(), params_base.model.path.c_str());
+            }
+
+            const int n_ctx_dft = llama_n_ctx(llama_init_dft.context.get());
+
+            cparams_dft = common_context_params_to_llama(params_dft);
+            cparams_dft.n_batch = n_ctx_dft;
+
+            // the context is not needed - we will create one for each slot
+            llama_init_dft.context.reset();
+        } else if (params_base.speculative.n_layer_exit > 0 || params_base.speculative.layer_skip_begin < params_base.speculative.layer_skip_end) {
+            SRV_INF("self-speculative decoding, draft layers: exit = %d, skip = [%d, %d)\n",
+                    params_base.speculative.n_layer_exit, params_base.speculative.layer_skip_begin, params_base.speculative.layer_skip_end);
+
+            auto params_dft = params_base;
+
+            params_dft.n_ctx        = params_base.speculative.n_ctx == 0 ? n_ctx / params_base.n_parallel : params_base.speculative.n_ctx;
+            params_dft.n_parallel   = 1;
+            params_dft.cache_type_k = params_base.speculative.cache_type_k;
+            params_dft.cache_type_v = params_base.speculative.cache_type_v;
+
+            // the draft contexts share the weights of the target model
+            model_dft = model;
+
+            cparams_dft = common_context_params_to_llama(params_dft);
+            cparams_dft.n_batch = params_dft.n_ctx;
+
+            cparams_dft.n_layer_exit     = params_base.speculative.n_layer_exit;
+            cparams_dft.layer_skip_begin = params_base.speculative.layer_skip_begin;
+            cparams_dft.layer_skip_end   = params_base.speculative.layer_skip_end;
+        } else if (!params_base.speculative.heads.empty()) {
+            SRV_INF("loading draft heads '%s'\n", params_base.speculative.heads.c_str());
+
+            spec_heads = common_speculative_heads_init(params_base.speculative.heads.c_str(), model, params_base.cpuparams.n_threads);
+            if (spec_heads == nullptr) {
+                SRV_ERR("failed to load draft heads, '%s'\n", params_base.speculative.heads.c_str());
+                return false;
+            }
+
+            // the heads draft from the hidden state of the last sampled token
+            llama_set_output_hidden(ctx, true);
+        } else if (params_base.speculative.mtp && llama_model_n_mtp(model) == 0) {
+            SRV_ERR("%s", "the model has no MTP layer for --spec-mtp\n");
+            return false;
+        }
+
+        chat_templates = common_chat_templates_init(model, params_base.chat_template);
+        try {
+            common_chat_format_example(chat_templates.get(), params.use_jinja);
+        } catch (const std::exception & e) {
+            SRV_WRN("%s: Chat template parsing error: %s\n", __func__, e.what());
+            SRV_WRN("%s: The chat template that comes with this model is not yet supported, falling back to chatml. This may cause the model to output suboptimal responses\n", __func__);
+            chat_templates = common_chat_templates_init(model, "chatml");
+        }
+
+        std::string & mmproj_path = params_base.mmproj.path;
+        if (!mmproj_path.empty()) {
+            mtmd_context_params mparams = mtmd_context_params_default();
+            mparams.use_gpu       = params_base.mmproj_use_gpu;
+            mparams.print_timings = false;
+            mparams.flash_attn    = params_base.flash_attn;
+            mparams.n_threads     = params_base.cpuparams.n_threads;
+            mparams.verbosity     = params_base.verbosity > 0 ? GGML_LOG_LEVEL_DEBUG : GGML_LOG_LEVEL_INFO;
+            mctx = mtmd_init_from_file(mmproj_path.c_str(), model, mparams);
+            if (mctx == nullptr) {
+                SRV_ERR("failed to load multimodal model, '%s'\n", mmproj_path.c_str());
+                return false;
+            }
+            SRV_INF("loaded multimodal model, '%s'\n", mmproj_path.c_str());
+
+            if (params_base.ctx_shift) {
+                params_base.ctx_shift = false;
+                SRV_WRN("%s\n", "ctx_shift is not supported by multimodal, it will be disabled");
+            }
+
+            // the media chunks can be shifted as a whole, unless their positions are not linear
+            if (params_base.n_cache_reuse && mtmd_decode_use_mrope(mctx)) {
+                params_base.n_cache_reuse = 0;
+                SRV_WRN("%s\n", "cache_reuse is not supported by M-RoPE multimodal models, it will be disabled");
+            }
+
+            if (params_base.speculative.lookahead > 0) {
+                params_base.speculative.lookahead = 0;
+                SRV_WRN("%s\n", "lookahead drafting is not supported by multimodal, it will be disabled");
+            }
+
+            if (params_base.prefix_cache) {
+                params_base.prefix_cache = false;
+                SRV_WRN("%s\n", "prefix_cache is not supported by multimodal, it will be disabled");
+            }
+
+            if (params_base.cache_chunks) {
+                params_base.cache_chunks = 0;
+                SRV_WRN("%s\n", "cache_chunks is not supported by multimodal, it will be disabled");
+            }
+        }
+
+        if (!llama_memory_can_shift(llama_get_memory(ctx))) {
+            if (params_base.ctx_shift) {
+                params_base.ctx_shift = false;
+                SRV_WRN("%s\n", "ctx_shift is not supported by this context, it will be disabled");
+            }
+
+            if (params_base.n_cache_reuse) {
+                params_base.n_cache_reuse = 0;
+                SRV_WRN("%s\n", "cache_reuse is not supported by this context, it will be disabled");
+            }
+
+            if (params_base.prefix_cache) {
+                params_base.prefix_cache = false;
+                SRV_WRN("%s\n", "prefix_cache is not supported by this context, it will be disabled");
+            }
+        }
+
+        // the recurrent state cannot be moved to other positions
+        if (params_base.cache_chunks && (!llama_memory_can_shift(llama_get_memory(ctx)) || llama_model_is_recurrent(model) || llama_model_is_hybrid(model))) {
+            params_base.cache_chunks = 0;
+            SRV_WRN("%s\n", "cache_chunks is not supported by this context, it will be disabled");
+        }
+
+        if (params_base.slot_offload_ram > 0 && mctx) {
+            params_base.slot_offload_ram = 0;
+            SRV_WRN("%s\n", "slot_offload is not supported by multimodal, it will be disabled");
+        }
+
+        if (params_base.slot_preempt && model_dft) {
+            // the state of the draft context would have to be suspended as well
+            params_base.slot_preempt = false;
+            SRV_WRN("%s\n", "slot_preempt is not supported with speculative decoding, it will be disabled");
+        }
+
+        if (params_base.kv_compress > 0) {
+            if (mctx) {
+                params_base.kv_compress = 0;
+                SRV_WRN("%s\n", "kv_compress is not supported by multimodal, it will be disabled");
+            } else if (params_base.flash_attn) {
+                params_base.kv_compress = 0;
+                SRV_WRN("%s\n", "kv_compress requires the attention weights, which are not available with flash_attn, it will be disabled");
+            }
+        }
+
+        if (params_base.n_swa_ckpt > 0) {
+            if (mctx) {
+                params_base.n_swa_ckpt = 0;
+                SRV_WRN("%s\n", "swa_checkpoints is not supported by multimodal, it will be disabled");
+            } else if (llama_model_n_swa(model) == 0 || params_base.swa_full) {
+                // the whole prompt is cached
+                params_base.n_swa_ckpt = 0;
+            }
+        }
+
+        if (params_base.prefix_cache && !params_base.kv_unified && params_base.n_parallel > 1) {
+            // sharing cells between sequences in different streams would require a full copy of the stream
+            params_base.prefix_cache = false;
+            SRV_WRN("%s\n", "prefix_cache requires a unified KV cache (--kv-unified), it will be disabled");
+        }
+
+        if (params_base.kv_pool && !params_base.kv_unified && params_base.n_parallel > 1) {
+            // each stream of a non-unified cache has n_ctx/n_parallel cells
+            params_base.kv_pool = false;
+            SRV_WRN("%s\n", "kv_pool requires a unified KV cache (--kv-unified), it will be disabled");
+        }
+
+        if (params_base.kv_queue_max > 0 && !params_base.kv_pool) {
+            params_base.kv_queue_max = 0;
+            SRV_WRN("%s\n", "kv_queue_max requires --kv-pool, it will be ignored");
+        }
+
+        return true;
+    }
+
+    void init() {
+        // with kv_pool, the slots are limited by the free cells of the context instead, see kv_pool_n_free()
+        // without memory (encoder-only models), nothing is kept between the batches and the prompts are only limited by n_ubatch
+        const int32_t n_ctx_slot = params_base.kv_pool || !llama_get_memory(ctx) ? n_ctx : n_ctx / params_base.n_parallel;
+
+        SRV_INF("initializing slots, n_slots = %d\n", params_base.n_parallel);
+
+        for (int i = 0; i < params_base.n_parallel; i++) {
+            server_slot slot;
+
+            slot.id = i;
+            slot.ctx = ctx;
+            slot.n_ctx = n_ctx_slot;
+            slot.n_predict = params_base.n_predict;
+            slot.mctx = mctx;
+            slot.cache_tokens.has_mtmd = mctx != nullptr;
+
+            if (model_dft) {
+                slot.ctx_dft = llama_init_from_model(model_dft, cparams_dft);
+                if (slot.ctx_dft == nullptr) {
+                    SRV_ERR("%s", "failed to create draft context\n");
+                    return;
+                }
+
+                if (params_base.speculative.n_vocab > 0 && !common_speculative_set_draft_vocab(slot.ctx_dft, params_base.speculative.n_vocab)) {
+                    SRV_WRN("%s", "the draft model does not support --draft-vocab, drafting with the full vocabulary\n");
+                }
+
+                // the draft and target contexts take turns on the same threads, unless they run concurrently
+                if (params_base.threadpool_shared && !params_base.speculative.async) {
+                    common_attach_shared_threadpools(slot.ctx_dft, params_base.cpuparams, params_base.cpuparams_batch);
+                }
+
+                slot.spec = common_speculative_init(slot.ctx, slot.ctx_dft);
+                if (slot.spec == nullptr) {
+                    SRV_ERR("%s", "failed to create speculator\n");
+                    return;
+                }
+                for (auto &pair : params_base.speculative.replacements) {
+                    common_speculative_add_replacement_tgt_dft(slot.spec, pair.first.c_str(), pair.second.c_str());
+                }
+            } else if (spec_heads) {
+                slot.spec_heads = spec_heads;
+            } else if (params_base.speculative.mtp) {
+                slot.spec_mtp = true;
+            } else if (params_base.speculative.lookahead > 0) {
+                slot.lookahead.init(params_base.speculative.lookahead);
+            } else if (params_base.speculative.ngram) {
+                slot.ngram_cache = &ngram_cache;
+            }
+
+            SLT_INF(slot, "new slot n_ctx_slot = %d\n", slot.n_ctx);
+
+            slot.params.sampling = params_base.sampling;
+            slot.params.n_keep = params_base.n_keep;
+
+            slot.callback_on_release = [this](int id_slot) {
+                if (params_base.prefix_cache && !slots[id_slot].kv_compressed) {
+                    // the cached tokens of an idle slot do not change until the next task is launched
+                    const server_slot & slot = slots[id_slot];
+                    prefix_cache.remove(slot.id);
+                    prefix_cache.insert(slot.id, slot.cache_tokens.get_text_tokens(), slot.t_last_used);
+                }
+
+                if (slots[id_slot].ngram_cache && slots[id_slot].task_type == SERVER_TASK_TYPE_COMPLETION) {
+                    ngram_cache.learn(slots[id_slot].cache_tokens.get_text_tokens_after_media());
+                }
+
+                queue_tasks.pop_deferred_task();
+            };
+
+            slot.reset();
+
+            slots.push_back(std::move(slot));
+        }
+
+        default_generation_settings_for_props = slots[0].to_json();
+
+        // the adapters are applied per sequence when the slots are launched
+        llama_clear_adapter_lora(ctx);
+
+        // the update_slots() logic will always submit a maximum of n_batch or n_parallel tokens
+        // note that n_batch can be > n_ctx (e.g. for non-causal attention models such as BERT where the KV cache is not used)
+        {
+            const int32_t n_batch = llama_n_batch(ctx);
+            // the prompt tokens shared by several slots are assigned to all of their sequences
+            batch = llama_batch_init(std::max(n_batch, params_base.n_parallel), 0, params_base.n_parallel);
+        }
+
+        batch_prompt_sharing =
+            params_base.kv_unified && params_base.n_parallel > 1 && llama_get_memory(ctx) && !mctx &&
+            !llama_model_is_recurrent(model) && !llama_model_is_hybrid(model);
+
+        metrics.init();
+
+        if (params_base.slot_offload_ram > 0) {
+            kv_store.init(params_base, kv_store_model_id());
+        }
+
+        if (params_base.speculative.ngram && !model_dft) {
+            ngram_cache.init(params_base);
+        }
+
+        if (params_base.speculative.async && model_dft) {
+            draft_worker.start();
+        }
+
+        if (params_base.embedding) {
+            vector_index.init(params_base, llama_model_n_embd(model));
+        }
+
+        if (params_base.mmproj_cache > 0 && mctx) {
+            mtmd_cache.init(size_t(params_base.mmproj_cache)*1024*1024);
+        }
+
+        if (params_base.cache_chunks > 0) {
+            kv_chunk_cache.init(size_t(params_base.cache_chunks)*1024*1024);
+        }
+
+        if (params_base.mmproj_async && mctx) {
+            mtmd_encoder.mctx    = mctx;
+            mtmd_encoder.on_done = [this]() { queue_tasks.wake(); };
+        }
+
+        oai_parser_opt = {
+            /* use_jinja             */ params_base.use_jinja,
+            /* prefill_assistant     */ params_base.prefill_assistant,
+            /* reasoning_format      */ params_base.reasoning_format,
+            /* chat_template_kwargs  */ params_base.default_template_kwargs,
+            /* common_chat_templates */ chat_templates.get(),
+            /* allow_image           */ mctx ? mtmd_support_vision(mctx) : false,
+            /* allow_audio           */ mctx ? mtmd_support_audio (mctx) : false,
+            /* enable_thinking       */ params_base.reasoning_budget != 0,
+        };
+    }
+
+    // the name under which the loaded model is listed and can be requested
+    std::string model_name() const {
+        return params_base.model_alias.empty() ? params_base.model.path : params_base.model_alias;
+    }
+
+    // free the model and everything that depends on it, the slots must be idle
+    void unload_model() {
+        if (kv_store.persist) {
+            kv_store_demote_slots();
+        }
+
+        free_slots();
+
+        slots.clear();
+        slots_suspended.clear();
+
+        llama_batch_free(batch);
+        batch = {};
+
+        prefix_cache.clear();
+        kv_store.clear();
+
+        chat_templates.reset();
+
+        // the context must be freed before the model
+        llama_init.lora.clear();
+        llama_init.context.reset();
+        llama_init.model.reset();
+
+        model = nullptr;
+        ctx   = nullptr;
+        vocab = nullptr;
+    }
+
+    // replace the loaded model with the one registered under name
+    // the unloaded weights stay in the page cache when they are memory-mapped, which makes swapping them back in cheap
+    bool swap_model(const std::string & name) {
+        const std::string name_prev = model_name();
+
+        const auto params_of = [this](const std::string & name) {
+            common_params params = params_swap;
+            if (name != (params_swap.model_alias.empty() ? params_swap.model.path : params_swap.model_alias)) {
+                params.model       = common_params_model();
+                params.model.path  = params_swap.models_swap.at(name);
+                params.model_alias = name;
+            }
+            return params;
+        };
+
+        SRV_INF("swapping model '%s' for '%s'\n", name_prev.c_str(), name.c_str());
+
+        unload_model();
+
+        if (load_model(params_of(name))) {
+            init();
+            return true;
+        }
+
+        SRV_ERR("failed to swap in model '%s', reloading '%s'\n", name.c_str(), name_prev.c_str());
+
+        unload_model();
+
+        if (!load_model(params_of(name_prev))) {
+            GGML_ABORT("failed to reload model '%s'\n", name_prev.c_str());
+        }
+        init();
+
+        return false;
+    }
+
+    // wait until the model requested by name is loaded and keep it loaded for as long as the returned lock is held
+    // unknown names are served by the loaded model
+    std::shared_ptr<std::shared_lock<std::shared_mutex>> acquire_model(const std::string & name) {
+        while (true) {
+            auto lock = std::make_shared<std::shared_lock<std::shared_mutex>>(mutex_swap);
+            if (name.empty() || name == model_name() || params_swap.models_swap.count(name) == 0) {
+                return lock;
+            }
+            lock.reset();
+
+            // wait for the requests of the loaded model to finish
+            std::unique_lock<std::shared_mutex> lock_swap(mutex_swap);
+            if (name == model_name()) {
+                continue;
+            }
+
+            const int id_task = queue_tasks.get_new_id();
+            {
+                server_task task(SERVER_TASK_TYPE_MODEL_SWAP);
+                task.id         = id_task;
+                task.model_swap = name;
+                queue_results.add_waiting_task_id(id_task);
+                queue_tasks.post(std::move(task));
+            }
+
+            server_task_result_ptr result = queue_results.recv(id_task);
+            queue_results.remove_waiting_task_id(id_task);
+
+            if (result->is_error()) {
+                throw std::runtime_error(json_value(result->to_json(), "message", std::string("failed to swap the model")));
+            }
+
+            SRV_INF("swapped in model '%s', t_ms = %.2f\n", name.c_str(), result->to_json().at("t_ms").get<float>());
+        }
+    }
+
+    server_slot * get_slot_by_id(int id) {
+        for (server_slot & slot : slots) {
+            if (slot.id == id) {
+                return &slot;
+            }
+        }
+
+        return nullptr;
+    }
+
+    server_slot * get_available_slot(const server_task & task) {
+        server_slot * ret = nullptr;
+
+        // find the slot that has at least n% prompt similarity
+        if (ret == nullptr && slot_prompt_similarity != 0.0f) {
+            int lcs_len = 0;
+            float similarity = 0;
+
+            for (server_slot & slot : slots) {
+                // skip the slot if it is not available
+                if (slot.is_processing()) {
+                    continue;
+                }
+
+                // skip the slot if it does not contains cached tokens
+                if (slot.cache_tokens.empty()) {
+                    continue;
+                }
+
+                // length of the Longest Common Subsequence between the current slot's prompt and the input prompt
+                int cur_lcs_len = slot.cache_tokens.get_common_prefix(task.prompt_tokens);
+
+                // fraction of the common subsequence length compared to the current slot's prompt length
+                float cur_similarity = static_cast<float>(cur_lcs_len) / static_cast<int>(slot.cache_tokens.size());
+
+                // select the current slot if the criteria match
+                if (cur_lcs_len > lcs_len && cur_similarity > slot_prompt_similarity) {
+                    lcs_len = cur_lcs_len;
+                    similarity = cur_similarity;
+                    ret = &slot;
+                }
+            }
+
+            if (ret != nullptr) {
+                SLT_DBG(*ret, "selected slot by lcs similarity, lcs_len = %d, similarity = %f\n", lcs_len, similarity);
+            }
+        }
+
+        // find the slot that has been least recently used
+        if (ret == nullptr) {
+            int64_t t_last = -1;
+
+            for (server_slot & slot : slots) {
+                // skip the slot if it is not available
+                if (slot.is_processing()) {
+                    continue;
+                }
+
+                int64_t t_slot = slot.t_last_used;
+
+                // a slot that is the only owner of a recently shared prefix is considered as recently used
+                if (params_base.prefix_cache) {
+                    t_slot = std::max(t_slot, prefix_cache.t_last_used_excl(slot.id));
+                }
+
+                // select the current slot if the criteria match
+                if (!ret || t_slot <= t_last) {
+                    t_last = t_slot;
+                    ret = &slot;
+                }
+            }
+
+            if (ret != nullptr) {
+                SLT_DBG(*ret, "selected slot by lru, t_last = %" PRId64 "\n", t_last);
+            }
+        }
+
+        return ret;
+    }
+
+    // the number of tokens that a slot may still generate, 0 if not limited
+    int32_t n_predict_max(const slot_params & params) const {
+        if (params.n_predict != -1) {
+            return std::max(params.n_predict, 0);
+        }
+
+        return std::max(params_base.n_predict, 0);
+    }
+
+    // kv_pool: the KV cells that are neither held nor reserved by the slots other than slot_skip
+    // a running slot reserves the cells of the rest of its prompt and of its n_predict
+    int32_t kv_pool_n_free(const server_slot * slot_skip) const {
+        int32_t n_free = n_ctx;
+
+        for (const server_slot & slot : slots) {
+            if (&slot == slot_skip) {
+                continue;
+            }
+
+            // note: the prefixes shared with --prefix-cache are counted once per slot
+            n_free -= slot.cache_tokens.size();
+
+            if (slot.is_processing()) {
+                const int32_t n_prompt_left  = std::max(0, (int32_t) slot.prompt_tokens.size() - (int32_t) slot.cache_tokens.size());
+                const int32_t n_predict_left = std::max(0, n_predict_max(slot.params) - slot.n_decoded);
+
+                n_free -= n_prompt_left + n_predict_left;
+            }
+        }
+
+        return n_free;
+    }
+
+    // kv_pool: drop the caches of the idle slots, least recently used first, until n_needed cells are free
+    // returns false if they do not fit even then
+    bool kv_pool_reserve(int32_t n_needed, const server_slot * slot_skip) {
+        while (kv_pool_n_free(slot_skip) < n_needed) {
+            server_slot * lru = nullptr;
+
+            for (server_slot & slot : slots) {
+                if (&slot == slot_skip || slot.is_processing() || slot.cache_tokens.empty()) {
+                    continue;
+                }
+
+                if (!lru || slot.t_last_used < lru->t_last_used) {
+                    lru = &slot;
+                }
+            }
+
+            if (lru == nullptr) {
+                return false;
+            }
+
+            SLT_INF(*lru, "dropping the cache of %zu tokens of the idle slot to free KV cells\n", lru->cache_tokens.size());
+
+            if (kv_store.enabled() && !lru->kv_compressed && !lru->cache_tokens.has_mtmd) {
+                kv_store.demote(ctx, lru->id, lru->cache_tokens.get_text_tokens(), lru->lora);
+            }
+
+            llama_memory_seq_rm(llama_get_memory(ctx), lru->id, -1, -1);
+            lru->cache_tokens.clear();
+
+            if (params_base.prefix_cache) {
+                prefix_cache.remove(lru->id);
+            }
+        }
+
+        return true;
+    }
+
+    // kv_pool: seconds until n_cells more KV cells are expected to be free, from the generation speed of the running slots
+    int32_t kv_pool_retry_after(int32_t n_cells) const {
+        int32_t n_running = 0;
+        for (const server_slot & slot : slots) {
+            n_running += slot.is_processing();
+        }
+
+        // the generation time is summed over the slots, so this is the time of one token of one slot
+        const double t_token = metrics.n_tokens_predicted_total > 0 ? 1e-3*metrics.t_tokens_generation_total/metrics.n_tokens_predicted_total : 0.0;
+
+        const double t = t_token*std::max(n_cells, 1)/std::max(n_running, 1);
+
+        return std::clamp((int32_t) std::ceil(t), 1, 3600);
+    }
+
+    // kv_pool: wait for free KV cells, unless the cells forecast for the waiting tasks exceed kv_queue_max
+    void kv_pool_defer(server_task && task, const server_slot * slot) {
+        if (params_base.kv_queue_max > 0) {
+            const int64_t n_queued = queue_tasks.n_deferred_kv();
+
+            if (n_queued + task.n_kv_needed > params_base.kv_queue_max) {
+                const int32_t n_missing   = n_queued + task.n_kv_needed - std::max(kv_pool_n_free(slot), 0);
+                const int32_t retry_after = kv_pool_retry_after(n_missing);
+
+                SRV_WRN("rejecting task, %d KV cells needed, %" PRId64 " queued, retry after %d s, id_task = %d\n",
+                        task.n_kv_needed, n_queued, retry_after, task.id);
+
+                metrics.n_rejected_kv++;
+
+                send_error(task, "the server is overloaded, not enough free KV cells", ERROR_TYPE_OVERLOADED, retry_after);
+                return;
+            }
+        }
+
+        queue_tasks.defer(std::move(task));
+    }
+
+    bool launch_slot_with_task(server_slot & slot, server_task && task) {
+        slot.reset();
+        slot.id_task       = task.id;
+        slot.index         = task.index;
+        slot.task_type     = task.type;
+        slot.t_queued      = task.t_queued;
+        slot.params        = std::move(task.params);
+        slot.prompt_tokens = std::move(task.prompt_tokens);
+        slot.prefix_hashes = server_prefix_hashes(slot.params.prefix_text);
+        slot.stop_matcher  = common_stop_matcher(slot.params.antiprompt);
+        slot.stop_tokens.init(slot.params.stop_tokens);
+        slot.kv_sent       = slot.params.prefill_n_past;
+
+        // the n-grams of the slot are collected again from the new prompt
+        slot.ngram_ctx.clear();
+        slot.ngram_inp.clear();
+        slot.lookahead.clear();
+
+        slot.spec_stats     = spec_stats;
+        slot.spec_n_skipped = 0;
+        slot.spec_hidden.clear();
+
+        // the draft of the previous task may still be running
+        draft_worker.wait();
+        slot.draft_next.clear();
+
+        if (slot.kv_compressed) {
+            // the cached tokens cannot be reused
+            slot.cache_tokens.clear();
+            slot.kv_compressed = false;
+
+            llama_memory_seq_rm(llama_get_memory(ctx), slot.id, -1, -1);
+        }
+
+        if (kv_store.enabled() && slot.params.cache_prompt) {
+            kv_store_swap(slot);
+        }
+
+        if (!are_lora_equal(slot.params.lora, slot.lora)) {
+            // if lora is changed, we cannot reuse cached tokens
+            slot.cache_tokens.clear();
+            slot.lora = slot.params.lora;
+
+            if (params_base.prefix_cache) {
+                prefix_cache.remove(slot.id);
+            }
+        }
+
+        common_set_adapter_lora_seq(ctx, slot.id, slot.lora);
+
+        if (!slot.prompt_tokens.validate(ctx)) {
+            send_error(task, "Prompt contains invalid tokens", ERROR_TYPE_INVALID_REQUEST);
+            return false;
+        }
+        SLT_DBG(slot, "launching slot : %s\n", safe_json_to_str(slot.to_json()).c_str());
+
+        if (slot.n_predict > 0 && slot.params.n_predict > slot.n_predict) {
+            // Might be better to reject the request with a 400 ?
+            SLT_WRN(slot, "n_predict = %d exceeds server configuration, setting to %d\n", slot.params.n_predict, slot.n_predict);
+            slot.params.n_predict = slot.n_predict;
+        }
+
+        {
+            if (slot.smpl != nullptr) {
+                common_sampler_free(slot.smpl);
+            }
+
+            slot.smpl = common_sampler_init(model, slot.params.sampling, grammar_cache);
+            if (slot.smpl == nullptr) {
+                // for now, the only error that may happen here is invalid grammar
+                send_error(task, "Failed to parse grammar", ERROR_TYPE_INVALID_REQUEST);
+                return false;
+            }
+        }
+
+        slot.state = SLOT_STATE_STARTED;
+
+        SLT_INF(slot, "%s", "processing task\n");
+
+        return true;
+    }
+
+    // draft tokens to continue the sampled token of the slot
+    llama_tokens slot_gen_draft(server_slot & slot) {
+        // determine the max draft that fits the current slot state
+        int n_draft_max = slot.params.speculative.n_max;
+
+        // note: n_past is not yet increased for the sampled token
+        //       also, need to leave space for 1 extra token to allow context shifts
+        n_draft_max = std::min(n_draft_max, slot.n_ctx - slot.n_past - 2);
+
+        if (slot.n_remaining > 0) {
+            n_draft_max = std::min(n_draft_max, slot.n_remaining - 1);
+        }
+
+        SLT_DBG(slot, "max possible draft: %d\n", n_draft_max);
+
+        if (params_base.speculative.adaptive) {
+            n_draft_max = slot_spec_n_draft(slot, n_draft_max);
+        }
+
+        if (n_draft_max < slot.params.speculative.n_min || n_draft_max == 0) {
+            SLT_DBG(slot, "the max possible draft is too small: %d < %d - skipping speculative decoding\n", n_draft_max, slot.params.speculative.n_min);
+
+            return {};
+        }
+
+        const int64_t t_draft = ggml_time_us();
+
+        llama_tokens draft;
+        if (!slot.ctx_dft) {
+            if (slot.spec_heads) {
+                draft = slot_gen_draft_heads(slot, n_draft_max);
+            } else if (slot.spec_mtp) {
+                draft = slot_gen_draft_mtp(slot, n_draft_max);
+            } else if (slot.lookahead.n_gram > 0) {
+                draft = slot_gen_draft_lookahead(slot, n_draft_max);
+            } else {
+                draft = slot_gen_draft_ngram(slot, n_draft_max);
             }
+        } else {
+            draft = slot_gen_draft_model(slot, n_draft_max);
         }
+
+        spec_cost.add_draft(draft.size(), ggml_time_us() - t_draft);
+
+        return draft;
     }
 
-    void reset_bucket() {
-        n_prompt_tokens_processed = 0;
-        t_prompt_processing       = 0;
-        n_tokens_predicted        = 0;
-        t_tokens_generation       = 0;
+    // the draft length with the highest expected generation rate of all the slots, see server_spec_cost
+    // 0 when speculation does not pay off, e.g. with low acceptance or when many slots are generating
+    int slot_spec_n_draft(server_slot & slot, int n_draft_max) {
+        double t0    = 0.0;
+        double t_tok = 0.0;
+        if (!spec_cost.fit(t0, t_tok)) {
+            return n_draft_max;
+        }
+
+        int n_gen = 0;
+        for (const auto & other : slots) {
+            n_gen += other.state == SLOT_STATE_GENERATING;
+        }
+        n_gen = std::max(n_gen, 1);
+
+        const double alpha = slot.spec_stats.alpha();
+
+        // tokens generated by a step of all the slots per unit of time, with k tokens drafted by this slot
+        int    k_best = 0;
+        double r_best = 0.0;
+        for (int k = 0; k <= n_draft_max; ++k) {
+            const double n_exp = (1.0 - std::pow(alpha, k + 1)) / (1.0 - alpha);
+            const double t     = t0 + t_tok*(n_gen + k) + spec_cost.t_draft_tok*k;
+            const double r     = (n_gen - 1 + n_exp) / t;
+            if (r > r_best) {
+                r_best = r;
+                k_best = k;
+            }
+        }
+
+        if (k_best < std::max(1, slot.params.speculative.n_min)) {
+            // without drafts the acceptance is not updated anymore - draft once in a while to track it
+            if (++slot.spec_n_skipped < SPEC_N_PROBE) {
+                return 0;
+            }
+            k_best = std::min(n_draft_max, std::max(1, slot.params.speculative.n_min));
+        }
+        slot.spec_n_skipped = 0;
+
+        SLT_DBG(slot, "adaptive draft: alpha = %.3f, n_gen = %d, t0 = %.1f us, t_tok = %.1f us, t_draft_tok = %.1f us, n_draft = %d\n",
+                alpha, n_gen, t0, t_tok, spec_cost.t_draft_tok, k_best);
+
+        return k_best;
     }
-};
 
-struct server_queue {
-    int id = 0;
-    bool running;
+    llama_tokens slot_gen_draft_model(server_slot & slot, int n_draft_max) {
+        draft_worker.wait();
 
-    // queues
-    std::deque<server_task> queue_tasks;
-    std::deque<server_task> queue_tasks_deferred;
+        llama_tokens draft;
 
-    std::mutex mutex_tasks;
-    std::condition_variable condition_tasks;
+        if (slot.draft_next.size() > 1 && slot.n_draft_next == slot.cache_tokens.size() && slot.draft_next[0] == slot.sampled) {
+            // all the previous draft was accepted and the sampled token was predicted - the draft is ready
+            draft.assign(slot.draft_next.begin() + 1, slot.draft_next.begin() + std::min<size_t>(slot.draft_next.size(), n_draft_max + 1));
 
-    // callback functions
-    std::function<void(server_task &&)> callback_new_task;
-    std::function<void(void)>           callback_update_slots;
+            SLT_DBG(slot, "using the draft made during the previous step, n_draft = %d\n", (int) draft.size());
+        } else {
+            struct common_speculative_params params_spec;
+            params_spec.n_draft   = n_draft_max;
+            params_spec.n_reuse   = llama_n_ctx(slot.ctx_dft) - slot.params.speculative.n_max;
+            params_spec.p_min     = slot.params.speculative.p_min;
 
-    // Add a new task to the end of the queue
-    int post(server_task && task, bool front = false) {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        GGML_ASSERT(task.id != -1);
-        // if this is cancel task make sure to clean up pending tasks
-        if (task.type == SERVER_TASK_TYPE_CANCEL) {
-            cleanup_pending_task(task.id_target);
+            // the draft model does not see the media, the drafting starts after the last media chunk
+            const llama_tokens cached_text_tokens = slot.cache_tokens.get_text_tokens_after_media();
+            draft = common_speculative_gen_draft(slot.spec, params_spec, cached_text_tokens, slot.sampled);
         }
-        const int task_id = task.id;
-        QUE_DBG("new task, id = %d, front = %d\n", task_id, front);
-        if (front) {
-            queue_tasks.push_front(std::move(task));
-        } else {
-            queue_tasks.push_back(std::move(task));
+
+        slot.draft_next.clear();
+
+        // ignore small drafts
+        if (slot.params.speculative.n_min > (int) draft.size()) {
+            SLT_DBG(slot, "ignoring small draft: %d < %d\n", (int) draft.size(), slot.params.speculative.n_min);
+
+            return {};
         }
-        condition_tasks.notify_one();
-        return task_id;
+
+        return draft;
     }
 
-    // multi-task version of post()
-    int post(std::vector<server_task> && tasks, bool front = false) {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        for (auto & task : tasks) {
-            if (task.id == -1) {
-                task.id = id++;
+    llama_tokens slot_gen_draft_heads(server_slot & slot, int n_draft_max) {
+        if (slot.spec_hidden.empty()) {
+            return {};
+        }
+
+        llama_tokens draft = common_speculative_heads_draft(slot.spec_heads, slot.spec_hidden.data(), n_draft_max, slot.params.speculative.p_min);
+
+        // ignore small drafts
+        if (slot.params.speculative.n_min > (int) draft.size()) {
+            SLT_DBG(slot, "ignoring small draft: %d < %d\n", (int) draft.size(), slot.params.speculative.n_min);
+
+            return {};
+        }
+
+        return draft;
+    }
+
+    // greedy draft with the MTP layer of the target model, each token is decoded at the next position of the slot
+    // the decodes store only the cache of the MTP layer, which is removed after the draft
+    llama_tokens slot_gen_draft_mtp(server_slot & slot, int n_draft_max) {
+        llama_tokens draft;
+
+        const int n_vocab = llama_vocab_n_tokens(vocab);
+
+        llama_batch batch_mtp = llama_batch_init(1, 0, 1);
+
+        llama_set_mtp_draft(ctx, true);
+
+        llama_token id = slot.sampled;
+        for (int i = 0; i < n_draft_max; ++i) {
+            common_batch_clear(batch_mtp);
+            common_batch_add(batch_mtp, id, slot.n_past + i, { slot.id }, true);
+
+            if (llama_decode(ctx, batch_mtp) != 0) {
+                break;
             }
-            // if this is cancel task make sure to clean up pending tasks
-            if (task.type == SERVER_TASK_TYPE_CANCEL) {
-                cleanup_pending_task(task.id_target);
+
+            const float * logits = llama_get_logits_ith(ctx, 0);
+
+            id = std::max_element(logits, logits + n_vocab) - logits;
+
+            // the probability of the draft, stop below p_min
+            double sum = 0.0;
+            for (int j = 0; j < n_vocab; ++j) {
+                sum += std::exp(logits[j] - logits[id]);
             }
-            QUE_DBG("new task, id = %d/%d, front = %d\n", task.id, (int) tasks.size(), front);
-            if (front) {
-                queue_tasks.push_front(std::move(task));
-            } else {
-                queue_tasks.push_back(std::move(task));
+
+            if (1.0/sum < slot.params.speculative.p_min) {
+                break;
             }
+
+            draft.push_back(id);
         }
-        condition_tasks.notify_one();
-        return 0;
-    }
 
-    // Add a new task, but defer until one slot is available
-    void defer(server_task && task) {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        QUE_DBG("defer task, id = %d\n", task.id);
-        queue_tasks_deferred.push_back(std::move(task));
-        condition_tasks.notify_one();
+        llama_set_mtp_draft(ctx, false);
+
+        llama_batch_free(batch_mtp);
+
+        llama_memory_seq_rm(llama_get_memory(ctx), slot.id, slot.n_past, -1);
+
+        // ignore small drafts
+        if (slot.params.speculative.n_min > (int) draft.size()) {
+            SLT_DBG(slot, "ignoring small draft: %d < %d\n", (int) draft.size(), slot.params.speculative.n_min);
+
+            return {};
+        }
+
+        return draft;
     }
 
-    // Get the next id for creating a new task
-    int get_new_id() {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        int new_id = id++;
-        return new_id;
+    // append the tokens that the grammar forces after the sampled token, as if they were sampled
+    // they are evaluated with the next batch, before the last of them
+    // returns false if the slot was released because of a stop condition
+    bool slot_jump_forward(server_slot & slot) {
+        const std::string text = common_sampler_forced_text(slot.smpl, 8*JUMP_FORWARD_MAX);
+        if (text.empty()) {
+            return true;
+        }
+
+        llama_tokens tokens = token_pieces.tokenize(text);
+
+        // the last token might be merged with the text that follows it
+        if (!tokens.empty()) {
+            tokens.pop_back();
+        }
+
+        // leave room for the sampled token and a context shift
+        const int n_room = slot.n_ctx - slot.n_past - 4;
+
+        tokens.resize(std::max(0, std::min({ (int) tokens.size(), JUMP_FORWARD_MAX, n_room })));
+
+        if (tokens.empty()) {
+            return true;
+        }
+
+        SLT_DBG(slot, "jump forward %d tokens forced by the grammar: '%s'\n", (int) tokens.size(), text.c_str());
+
+        // the hidden state of the draft heads is the one of the sampled token
+        slot.spec_hidden.clear();
+
+        for (const llama_token tok : tokens) {
+            common_sampler_accept(slot.smpl, tok, true);
+
+            slot.forced.push_back(slot.sampled);
+            slot.n_decoded += 1;
+
+            completion_token_output result;
+            result.tok          = tok;
+            result.text_to_send = slot.params.return_text ? common_token_to_piece(ctx, tok, false) : "";
+            result.prob         = 1.0f;
+
+            if (!process_token(result, slot)) {
+                slot.release();
+                slot.print_timings();
+                send_final_response(slot);
+                metrics.on_prediction(slot);
+                return false;
+            }
+        }
+
+        return true;
     }
 
-    // Register function to process a new task
-    void on_new_task(std::function<void(server_task &&)> callback) {
-        callback_new_task = std::move(callback);
+    // keep the hidden state the sampled token of the slot was sampled from, for the draft heads
+    void slot_save_hidden(server_slot & slot, int idx) {
+        const float * hidden = llama_get_embeddings_ith(ctx, idx);
+        if (hidden == nullptr) {
+            slot.spec_hidden.clear();
+            return;
+        }
+
+        slot.spec_hidden.assign(hidden, hidden + llama_model_n_embd(model));
     }
 
-    // Register the function to be called when all slots data is ready to be processed
-    void on_update_slots(std::function<void(void)> callback) {
-        callback_update_slots = std::move(callback);
+    // draft tokens with the n-grams of the slot and the n-gram cache shared by all slots
+    llama_tokens slot_gen_draft_ngram(server_slot & slot, int n_draft_max) {
+        const llama_tokens cached_text_tokens = slot.cache_tokens.get_text_tokens_after_media();
+
+        // the input of the n-gram lookup is the cached tokens followed by the sampled token
+        const size_t n_inp = cached_text_tokens.size() + 1;
+        const auto inp_at = [&](size_t i) {
+            return i < cached_text_tokens.size() ? cached_text_tokens[i] : slot.sampled;
+        };
+
+        // ngram_ctx can only be appended to - collect the n-grams again if the cached tokens changed
+        if (slot.ngram_inp.size() > n_inp || (!slot.ngram_inp.empty() && slot.ngram_inp.back() != inp_at(slot.ngram_inp.size() - 1))) {
+            slot.ngram_ctx.clear();
+            slot.ngram_inp.clear();
+        }
+
+        const int n_new = n_inp - slot.ngram_inp.size();
+        for (size_t i = slot.ngram_inp.size(); i < n_inp; ++i) {
+            slot.ngram_inp.push_back(inp_at(i));
+        }
+        common_ngram_cache_update(slot.ngram_ctx, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, slot.ngram_inp, n_new, false);
+
+        llama_tokens draft = { slot.sampled };
+        slot.ngram_cache->draft(slot.ngram_inp, draft, n_draft_max, slot.ngram_ctx);
+        draft.erase(draft.begin());
+
+        // ignore small drafts
+        if (slot.params.speculative.n_min > (int) draft.size()) {
+            SLT_DBG(slot, "ignoring small draft: %d < %d\n", (int) draft.size(), slot.params.speculative.n_min);
+
+            return {};
+        }
+
+        return draft;
     }
 
-    // Call when the state of one slot is changed, it will move one task from deferred to main queue
-    void pop_deferred_task() {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        if (!queue_tasks_deferred.empty()) {
-            queue_tasks.emplace_back(std::move(queue_tasks_deferred.front()));
-            queue_tasks_deferred.pop_front();
+    // draft tokens with the lookahead n-gram pool and the Jacobi guess of the slot
+    llama_tokens slot_gen_draft_lookahead(server_slot & slot, int n_draft_max) {
+        // note: n_past is not yet increased for the sampled token
+        llama_tokens draft = slot.lookahead.draft(slot.sampled, slot.n_past, n_draft_max, slot.cache_tokens.get_text_tokens());
+
+        // ignore small drafts
+        if (slot.params.speculative.n_min > (int) draft.size()) {
+            SLT_DBG(slot, "ignoring small draft: %d < %d\n", (int) draft.size(), slot.params.speculative.n_min);
+
+            return {};
         }
-        condition_tasks.notify_one();
+
+        return draft;
     }
 
-    // end the start_loop routine
-    void terminate() {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        running = false;
-        condition_tasks.notify_all();
+    // save the state of a processing slot and free it for a task with a higher priority
+    void slot_suspend(server_slot & slot) {
+        llama_memory_t mem = llama_get_memory(ctx);
+
+        server_slot_suspended sus;
+
+        sus.state.resize(llama_state_seq_get_size(ctx, slot.id));
+        llama_state_seq_get_data(ctx, sus.state.data(), sus.state.size(), slot.id);
+
+        llama_memory_seq_rm(mem, slot.id, -1, -1);
+
+        if (params_base.prefix_cache) {
+            prefix_cache.remove(slot.id);
+        }
+
+        SLT_INF(slot, "suspending slot, priority = %s, n_past = %d, state size = %zu\n",
+                server_task_priority_name(slot.params.priority), slot.n_past, sus.state.size());
+
+        sus.slot = std::move(slot);
+
+        // the new slot only keeps the resources that are bound to the slot id
+        slot = server_slot();
+
+        slot.id                  = sus.slot.id;
+        slot.ctx                 = sus.slot.ctx;
+        slot.mctx                = sus.slot.mctx;
+        slot.n_ctx               = sus.slot.n_ctx;
+        slot.n_predict           = params_base.n_predict;
+        slot.callback_on_release = sus.slot.callback_on_release;
+        slot.ngram_cache         = sus.slot.ngram_cache;
+        slot.spec_heads          = sus.slot.spec_heads;
+        slot.spec_mtp            = sus.slot.spec_mtp;
+        slot.t_last_used         = ggml_time_us();
+
+        slot.lookahead.init(sus.slot.lookahead.n_gram);
+
+        slot.cache_tokens.has_mtmd = mctx != nullptr;
+
+        slot.params.sampling = params_base.sampling;
+        slot.params.n_keep   = params_base.n_keep;
+
+        slot.reset();
+
+        slots_suspended.push_back(std::move(sus));
     }
 
-    /**
-     * Main loop consists of these steps:
-     * - Wait until a new task arrives
-     * - Process the task (i.e. maybe copy data into slot)
-     * - Check if multitask is finished
-     * - Update all slots
-     */
-    void start_loop() {
-        running = true;
+    // continue a suspended slot in the idle slot
+    void slot_resume(server_slot & slot, server_slot_suspended && sus) {
+        GGML_ASSERT(!slot.is_processing());
 
-        while (true) {
-            QUE_DBG("%s", "processing new tasks\n");
+        llama_memory_t mem = llama_get_memory(ctx);
 
-            while (true) {
-                std::unique_lock<std::mutex> lock(mutex_tasks);
-                if (!running) {
-                    QUE_DBG("%s", "terminate\n");
-                    return;
+        const int id = slot.id;
+
+        llama_memory_seq_rm(mem, id, -1, -1);
+
+        if (params_base.prefix_cache) {
+            prefix_cache.remove(id);
+        }
+
+        common_sampler_free(slot.smpl);
+        slot.smpl = nullptr;
+
+        const auto callback_on_release = slot.callback_on_release;
+
+        slot = std::move(sus.slot);
+
+        slot.id                  = id;
+        slot.callback_on_release = callback_on_release;
+
+        // the slot may resume in another sequence
+        common_set_adapter_lora_seq(ctx, id, slot.lora);
+
+        if (llama_state_seq_set_data(ctx, sus.state.data(), sus.state.size(), id) == 0) {
+            // the KV cells could not be restored - process the prompt and the generated tokens again
+            SLT_WRN(slot, "%s", "failed to restore the state of the suspended slot\n");
+            slot.cache_tokens.clear();
+            slot.n_past = 0;
+            send_error(slot, "failed to resume the suspended request", ERROR_TYPE_SERVER);
+            slot.release();
+            return;
+        }
+
+        SLT_INF(slot, "resumed suspended slot, priority = %s, n_past = %d\n", server_task_priority_name(slot.params.priority), slot.n_past);
+    }
+
+    // resume the suspended slots in the idle slots, unless a deferred task has a higher priority
+    void resume_suspended_slots(int min_priority) {
+        while (!slots_suspended.empty()) {
+            auto best = slots_suspended.begin();
+            for (auto it = slots_suspended.begin(); it != slots_suspended.end(); ++it) {
+                if (it->slot.params.priority > best->slot.params.priority) {
+                    best = it;
                 }
-                if (queue_tasks.empty()) {
-                    lock.unlock();
+            }
+
+            if (best->slot.params.priority < min_priority) {
+                break;
+            }
+
+            server_slot * slot = nullptr;
+            for (auto & cur : slots) {
+                if (!cur.is_processing()) {
+                    slot = &cur;
                     break;
                 }
-                server_task task = std::move(queue_tasks.front());
-                queue_tasks.pop_front();
-                lock.unlock();
+            }
 
-                QUE_DBG("processing task, id = %d\n", task.id);
-                callback_new_task(std::move(task));
+            if (slot == nullptr) {
+                break;
             }
 
-            // all tasks in the current loop is processed, slots data is now ready
-            QUE_DBG("%s", "update slots\n");
+            server_slot_suspended sus = std::move(*best);
+            slots_suspended.erase(best);
 
-            callback_update_slots();
+            slot_resume(*slot, std::move(sus));
+        }
+    }
 
-            QUE_DBG("%s", "waiting for new tasks\n");
-            {
-                std::unique_lock<std::mutex> lock(mutex_tasks);
-                if (!running) {
-                    QUE_DBG("%s", "terminate\n");
-                    return;
-                }
-                if (queue_tasks.empty()) {
-                    condition_tasks.wait(lock, [&]{
-                        return (!queue_tasks.empty() || !running);
-                    });
-                }
+    // find a processing slot with a lower priority than the task that can be suspended
+    server_slot * get_preemptible_slot(const server_task & task) {
+        server_slot * ret = nullptr;
+
+        for (server_slot & slot : slots) {
+            if (slot.state != SLOT_STATE_GENERATING && slot.state != SLOT_STATE_PROCESSING_PROMPT) {
+                continue;
+            }
+
+            if (slot.params.priority >= task.params.priority) {
+                continue;
+            }
+
+            // prefer the lowest priority, then the slot with the smallest state to save
+            if (!ret || slot.params.priority < ret->params.priority ||
+                (slot.params.priority == ret->params.priority && slot.n_past < ret->n_past)) {
+                ret = &slot;
+            }
+        }
+
+        return ret;
+    }
+
+    // identifies the model and the context that the persisted states can be restored with (params_base.slot_offload_persist)
+    // note: the model file is identified by its name and its metadata, not by its content
+    uint64_t kv_store_model_id() const {
+        char desc[256];
+        llama_model_desc(model, desc, sizeof(desc));
+
+        char name[256] = "";
+        llama_model_meta_val_str(model, "general.name", name, sizeof(name));
+
+        std::string id = string_format("%s|%s|%s|%" PRIu64 "|%" PRIu64 "|%s|%s|%d",
+                desc, name, std::filesystem::path(params_base.model.path).filename().string().c_str(),
+                llama_model_n_params(model), llama_model_size(model),
+                ggml_type_name(params_base.cache_type_k), ggml_type_name(params_base.cache_type_v), params_base.kv_unified);
+
+        for (const auto & la : params_base.lora_adapters) {
+            id += "|" + la.path;
+        }
+
+        return std::stoull(fnv_hash((const uint8_t *) id.data(), id.size()));
+    }
+
+    // move the cached states of the slots to the store, so that they are persisted with it
+    void kv_store_demote_slots() {
+        for (auto & slot : slots) {
+            if (slot.cache_tokens.size() > 0 && !slot.kv_compressed) {
+                kv_store.demote(ctx, slot.id, slot.cache_tokens.get_text_tokens(), slot.lora);
             }
         }
     }
 
-private:
-    void cleanup_pending_task(int id_target) {
-        // no need lock because this is called exclusively by post()
-        auto rm_func = [id_target](const server_task & task) {
-            return task.id_target == id_target;
-        };
-        queue_tasks.erase(
-            std::remove_if(queue_tasks.begin(),          queue_tasks.end(),          rm_func),
-            queue_tasks.end());
-        queue_tasks_deferred.erase(
-            std::remove_if(queue_tasks_deferred.begin(), queue_tasks_deferred.end(), rm_func),
-            queue_tasks_deferred.end());
-    }
-};
+    // offload the cached state of the slot if the new prompt would discard it
+    // and restore a previously offloaded state that shares a longer prefix with the new prompt
+    void kv_store_swap(server_slot & slot) {
+        const llama_tokens & prompt = slot.prompt_tokens.get_text_tokens();
 
-struct server_response {
-    bool running = true;
+        const size_t n_cached = slot.cache_tokens.size();
+        const size_t n_common = slot.cache_tokens.get_common_prefix(slot.prompt_tokens);
 
-    // for keeping track of all tasks waiting for the result
-    std::unordered_set<int> waiting_task_ids;
+        // the state is demoted with the adapters it was computed with
+        const auto lora_old = slot.lora;
 
-    // the main result queue (using ptr for polymorphism)
-    std::vector<server_task_result_ptr> queue_results;
+        // most of the cached tokens will be reused - keep the cache in place
+        if (n_cached > 0 && 2*n_common >= n_cached) {
+            return;
+        }
 
-    std::mutex mutex_results;
-    std::condition_variable condition_results;
+        const llama_tokens & tokens_old = slot.cache_tokens.get_text_tokens();
 
-    // add the id_task to the list of tasks waiting for response
-    void add_waiting_task_id(int id_task) {
-        SRV_DBG("add task %d to waiting list. current waiting = %d (before add)\n", id_task, (int) waiting_task_ids.size());
+        const size_t n_min = are_lora_equal(slot.params.lora, lora_old) ? n_common : 0;
 
-        std::unique_lock<std::mutex> lock(mutex_results);
-        waiting_task_ids.insert(id_task);
-    }
+        // the stored state is restored into the sequence of the slot, so the cached state must be demoted first
+        if (n_cached > 0) {
+            kv_store.demote(ctx, slot.id, tokens_old, lora_old);
+        }
 
-    void add_waiting_tasks(const std::vector<server_task> & tasks) {
-        std::unique_lock<std::mutex> lock(mutex_results);
+        llama_tokens tokens_new;
+        const int32_t n_restored = kv_store.promote(ctx, slot.id, prompt, slot.params.lora, n_min, tokens_new);
+        if (n_restored == 0) {
+            return;
+        }
 
-        for (const auto & task : tasks) {
-            SRV_DBG("add task %d to waiting list. current waiting = %d (before add)\n", task.id, (int) waiting_task_ids.size());
-            waiting_task_ids.insert(task.id);
+        if (n_restored < 0) {
+            slot.cache_tokens.clear();
+            if (params_base.prefix_cache) {
+                prefix_cache.remove(slot.id);
+            }
+            return;
         }
-    }
 
-    // when the request is finished, we can remove task associated with it
-    void remove_waiting_task_id(int id_task) {
-        SRV_DBG("remove task %d from waiting list. current waiting = %d (before remove)\n", id_task, (int) waiting_task_ids.size());
+        SLT_INF(slot, "restored offloaded KV state with %d tokens (n_common = %zu)\n", n_restored, n_common);
 
-        std::unique_lock<std::mutex> lock(mutex_results);
-        waiting_task_ids.erase(id_task);
-        // make sure to clean up all pending results
-        queue_results.erase(
-            std::remove_if(queue_results.begin(), queue_results.end(), [id_task](const server_task_result_ptr & res) {
-                return res->id == id_task;
-            }),
-            queue_results.end());
-    }
+        slot.cache_tokens.clear();
+        slot.cache_tokens.insert(tokens_new);
 
-    void remove_waiting_task_ids(const std::unordered_set<int> & id_tasks) {
-        std::unique_lock<std::mutex> lock(mutex_results);
+        // the restored state was computed with the adapters requested by the task
+        slot.lora = slot.params.lora;
 
-        for (const auto & id_task : id_tasks) {
-            SRV_DBG("remove task %d from waiting list. current waiting = %d (before remove)\n", id_task, (int) waiting_task_ids.size());
-            waiting_task_ids.erase(id_task);
+        if (params_base.prefix_cache) {
+            prefix_cache.remove(slot.id);
+            prefix_cache.insert(slot.id, tokens_new, ggml_time_us());
         }
     }
 
-    // This function blocks the thread until there is a response for one of the id_tasks
-    server_task_result_ptr recv(const std::unordered_set<int> & id_tasks) {
-        while (true) {
-            std::unique_lock<std::mutex> lock(mutex_results);
-            condition_results.wait(lock, [&]{
-                if (!running) {
-                    SRV_DBG("%s : queue result stop\n", __func__);
-                    std::terminate(); // we cannot return here since the caller is HTTP code
-                }
-                return !queue_results.empty();
-            });
-
-            for (size_t i = 0; i < queue_results.size(); i++) {
-                if (id_tasks.find(queue_results[i]->id) != id_tasks.end()) {
-                    server_task_result_ptr res = std::move(queue_results[i]);
-                    queue_results.erase(queue_results.begin() + i);
-                    return res;
-                }
+    // save the slot to an append-only file (params_base.slot_save_append)
+    // if the file was last saved or restored by this slot, only the tokens and KV cells after the common prefix
+    // of the file and the cached tokens are appended - the chunk replaces the rest of the file content on restore
+    // the write happens in the background, returns the number of bytes queued
+    size_t slot_save_append(server_slot & slot, const std::string & path, const llama_tokens & tokens) {
+        size_t n_common = 0;
+
+        // the positions of the KV cells must match the token indices
+        if (slot.session_path == path && slot.session_pos == (llama_pos) slot.session_tokens.size() && !session_writer.has_failed(path)) {
+            const size_t n_max = std::min(slot.session_tokens.size(), tokens.size());
+            while (n_common < n_max && slot.session_tokens[n_common] == tokens[n_common]) {
+                n_common++;
             }
         }
 
-        // should never reach here
-    }
+        const bool append = n_common > 0;
 
-    // same as recv(), but have timeout in seconds
-    // if timeout is reached, nullptr is returned
-    server_task_result_ptr recv_with_timeout(const std::unordered_set<int> & id_tasks, int timeout) {
-        while (true) {
-            std::unique_lock<std::mutex> lock(mutex_results);
+        const llama_pos p0 = append ? (llama_pos) n_common : -1;
 
-            for (int i = 0; i < (int) queue_results.size(); i++) {
-                if (id_tasks.find(queue_results[i]->id) != id_tasks.end()) {
-                    server_task_result_ptr res = std::move(queue_results[i]);
-                    queue_results.erase(queue_results.begin() + i);
-                    return res;
-                }
-            }
+        const size_t n_state = llama_state_seq_get_size_from(ctx, slot.id, p0);
+        if (n_state == 0) {
+            return 0;
+        }
 
-            std::cv_status cr_res = condition_results.wait_for(lock, std::chrono::seconds(timeout));
-            if (!running) {
-                SRV_DBG("%s : queue result stop\n", __func__);
-                std::terminate(); // we cannot return here since the caller is HTTP code
-            }
-            if (cr_res == std::cv_status::timeout) {
-                return nullptr;
-            }
+        server_session_chunk hdr;
+        hdr.magic    = SERVER_SESSION_MAGIC;
+        hdr.n_past   = n_common;
+        hdr.n_tokens = tokens.size() - n_common;
+        hdr.flags    = 0;
+        hdr.n_state  = n_state;
+
+        const size_t n_tokens_bytes = hdr.n_tokens*sizeof(llama_token);
+
+        server_session_writer::job job;
+        job.path     = path;
+        job.truncate = !append;
+        job.data.resize(sizeof(hdr) + n_tokens_bytes + n_state);
+
+        uint8_t * dst = job.data.data();
+        memcpy(dst, &hdr, sizeof(hdr));
+        memcpy(dst + sizeof(hdr), tokens.data() + hdr.n_past, n_tokens_bytes);
+
+        if (llama_state_seq_get_data_from(ctx, dst + sizeof(hdr) + n_tokens_bytes, n_state, slot.id, p0) != n_state) {
+            SLT_WRN(slot, "failed to copy the state for '%s'\n", path.c_str());
+            slot.session_path.clear();
+            return 0;
         }
 
-        // should never reach here
-    }
+        const size_t n_bytes = job.data.size();
 
-    // single-task version of recv()
-    server_task_result_ptr recv(int id_task) {
-        std::unordered_set<int> id_tasks = {id_task};
-        return recv(id_tasks);
-    }
+        session_writer.push(std::move(job));
 
-    // Send a new result to a waiting id_task
-    void send(server_task_result_ptr && result) {
-        SRV_DBG("sending result for task id = %d\n", result->id);
+        session_release(path);
 
-        std::unique_lock<std::mutex> lock(mutex_results);
-        for (const auto & id_task : waiting_task_ids) {
-            if (result->id == id_task) {
-                SRV_DBG("task id = %d pushed to result queue\n", result->id);
+        SLT_DBG(slot, "%s '%s': %u tokens from %u, %zu bytes\n", append ? "appended to" : "saved", path.c_str(), hdr.n_tokens, hdr.n_past, n_bytes);
 
-                queue_results.emplace_back(std::move(result));
-                condition_results.notify_all();
-                return;
+        slot.session_path   = path;
+        slot.session_tokens = tokens;
+        slot.session_pos    = llama_memory_seq_pos_max(llama_get_memory(ctx), slot.id) + 1;
+
+        return n_bytes;
+    }
+
+    // the other slots cannot append to the file anymore, their content may differ
+    void session_release(const std::string & path) {
+        for (auto & slot : slots) {
+            if (slot.session_path == path) {
+                slot.session_path.clear();
             }
         }
     }
 
-    // terminate the waiting loop
-    void terminate() {
-        running = false;
-        condition_results.notify_all();
-    }
-};
+    // restore the slot from a file saved with params_base.slot_save_append, returns the number of bytes read
+    size_t slot_restore_chunks(server_slot & slot, const std::string & path, llama_tokens & tokens) {
+        server_session_file file(path);
 
-struct server_context {
-    common_params params_base;
+        size_t off = 0;
 
-    // note: keep these alive - they determine the lifetime of the model, context, etc.
-    common_init_result llama_init;
-    common_init_result llama_init_dft;
+        while (off + sizeof(server_session_chunk) <= file.size) {
+            server_session_chunk hdr;
+            memcpy(&hdr, file.data + off, sizeof(hdr));
 
-    llama_model * model = nullptr;
-    llama_context * ctx = nullptr;
+            if (hdr.magic != SERVER_SESSION_MAGIC || hdr.n_past > tokens.size() || (off == 0 && hdr.n_past != 0)) {
+                SLT_WRN(slot, "invalid chunk at offset %zu in '%s'\n", off, path.c_str());
+                break;
+            }
 
-    // multimodal
-    mtmd_context * mctx = nullptr;
+            const size_t n_tokens_bytes = size_t(hdr.n_tokens)*sizeof(llama_token);
+            const size_t n_chunk = sizeof(hdr) + n_tokens_bytes + hdr.n_state;
 
-    const llama_vocab * vocab = nullptr;
-    bool vocab_dft_compatible = true;
+            if (off + n_chunk > file.size) {
+                SLT_WRN(slot, "ignoring incomplete chunk at offset %zu in '%s'\n", off, path.c_str());
+                break;
+            }
 
-    llama_model * model_dft = nullptr;
+            if (size_t(hdr.n_past) + hdr.n_tokens > (size_t) slot.n_ctx) {
+                SLT_WRN(slot, "the tokens in '%s' do not fit in the context\n", path.c_str());
+                tokens.clear();
+                return 0;
+            }
 
-    llama_context_params cparams_dft;
+            const uint8_t * src = file.data + off + sizeof(hdr);
 
-    llama_batch batch {};
+            if (off > 0) {
+                // the chunk replaces the tokens after its common prefix with the previous content
+                // note: this fails for the recurrent state, which is replaced by the chunk anyway
+                llama_memory_seq_rm(llama_get_memory(ctx), slot.id, hdr.n_past, -1);
+            }
 
-    bool clean_kv_cache = true;
-    bool add_bos_token  = true;
+            const size_t nread = off == 0 ?
+                llama_state_seq_set_data       (ctx, src + n_tokens_bytes, hdr.n_state, slot.id) :
+                llama_state_seq_set_data_append(ctx, src + n_tokens_bytes, hdr.n_state, slot.id);
+            if (nread == 0) {
+                llama_memory_seq_rm(llama_get_memory(ctx), slot.id, -1, -1);
+                tokens.clear();
+                return 0;
+            }
 
-    int32_t n_ctx; // total context for all clients / slots
+            // the chunks are not aligned
+            tokens.resize(hdr.n_past + hdr.n_tokens);
+            memcpy(tokens.data() + hdr.n_past, src, n_tokens_bytes);
 
-    // slots / clients
-    std::vector<server_slot> slots;
-    json default_generation_settings_for_props;
+            off += n_chunk;
+        }
 
-    server_queue    queue_tasks;
-    server_response queue_results;
+        if (off > 0 && off == file.size) {
+            // later saves can be appended to the file
+            session_release(path);
 
-    server_metrics metrics;
+            slot.session_path   = path;
+            slot.session_tokens = tokens;
+            slot.session_pos    = llama_memory_seq_pos_max(llama_get_memory(ctx), slot.id) + 1;
+        }
 
-    // Necessary similarity of prompt for slot selection
-    float slot_prompt_similarity = 0.0f;
+        return off;
+    }
 
-    common_chat_templates_ptr chat_templates;
-    oaicompat_parser_options  oai_parser_opt;
+    // find the chunks of params.cache_chunks in the prompt of the slot
+    void kv_chunk_find(server_slot & slot) {
+        slot.kv_chunks.clear();
 
-    ~server_context() {
-        mtmd_free(mctx);
+        const llama_tokens & tokens = slot.prompt_tokens.get_text_tokens();
+        if (tokens.empty()) {
+            return;
+        }
 
-        // Clear any sampling context
-        for (server_slot & slot : slots) {
-            common_sampler_free(slot.smpl);
-            slot.smpl = nullptr;
+        for (const auto & chunk : slot.params.cache_chunks) {
+            if (chunk.size() < 2) {
+                continue;
+            }
 
-            llama_free(slot.ctx_dft);
-            slot.ctx_dft = nullptr;
+            // the last prompt token is always processed
+            const auto it = std::search(tokens.begin(), tokens.end() - 1, chunk.begin(), chunk.end());
+            if (it == tokens.end() - 1) {
+                continue;
+            }
 
-            common_speculative_free(slot.spec);
-            slot.spec = nullptr;
+            const llama_pos p0 = it - tokens.begin();
+            const llama_pos p1 = p0 + chunk.size();
 
-            llama_batch_free(slot.batch_spec);
+            bool overlaps = false;
+            for (const auto & other : slot.kv_chunks) {
+                overlaps = overlaps || (p0 < other.second && other.first < p1);
+            }
+
+            if (!overlaps) {
+                slot.kv_chunks.emplace_back(p0, p1);
+            }
         }
 
-        llama_batch_free(batch);
+        std::sort(slot.kv_chunks.begin(), slot.kv_chunks.end());
     }
 
-    bool load_model(const common_params & params) {
-        SRV_INF("loading model '%s'\n", params.model.path.c_str());
+    const std::pair<llama_pos, llama_pos> * kv_chunk_at(const server_slot & slot, llama_pos pos) const {
+        for (const auto & chunk : slot.kv_chunks) {
+            if (chunk.first == pos) {
+                return &chunk;
+            }
+        }
 
-        params_base = params;
+        return nullptr;
+    }
 
-        llama_init = common_init_from_params(params_base);
+    llama_tokens kv_chunk_tokens(const server_slot & slot, const std::pair<llama_pos, llama_pos> & chunk) const {
+        const llama_tokens & tokens = slot.prompt_tokens.get_text_tokens();
 
-        model = llama_init.model.get();
-        ctx   = llama_init.context.get();
+        return llama_tokens(tokens.begin() + chunk.first, tokens.begin() + chunk.second);
+    }
 
-        if (model == nullptr) {
-            SRV_ERR("failed to load model, '%s'\n", params_base.model.path.c_str());
+    // the cached chunk at n_past is added on the next iteration, after the tokens before it are evaluated
+    bool kv_chunk_pending(const server_slot & slot) const {
+        const auto * chunk = kv_chunk_at(slot, slot.n_past);
+
+        return chunk && kv_chunk_cache.has(kv_chunk_tokens(slot, *chunk));
+    }
+
+    // add the cached KV cells of the chunk at n_past instead of processing its tokens
+    // the cells are rotated to their new positions and keep the attention to the context in which they were computed,
+    // so the last tokens of the chunk are processed again to attend to the new context (params_base.cache_chunks_recompute)
+    bool kv_chunk_splice(server_slot & slot) {
+        const auto * chunk = kv_chunk_at(slot, slot.n_past);
+        if (!chunk) {
             return false;
         }
 
-        vocab = llama_model_get_vocab(model);
+        const llama_tokens tokens = kv_chunk_tokens(slot, *chunk);
 
-        n_ctx = llama_n_ctx(ctx);
+        const auto * entry = kv_chunk_cache.get(tokens);
+        if (!entry) {
+            return false;
+        }
 
-        add_bos_token = llama_vocab_get_add_bos(vocab);
+        const int32_t n_tokens = tokens.size();
+        const int32_t n_keep   = n_tokens - (int32_t) std::ceil(params_base.cache_chunks_recompute*n_tokens);
+        if (n_keep <= 0) {
+            return false;
+        }
 
-        if (!params_base.speculative.model.path.empty() || !params_base.speculative.model.hf_repo.empty()) {
-            SRV_INF("loading draft model '%s'\n", params_base.speculative.model.path.c_str());
+        llama_memory_t mem = llama_get_memory(ctx);
 
-            auto params_dft = params_base;
+        if (llama_state_seq_set_data_shift(ctx, entry->data.data(), entry->data.size(), slot.id, slot.n_past - entry->pos) == 0) {
+            SLT_WRN(slot, "failed to add the cached chunk at %d, processing it\n", slot.n_past);
+            llama_memory_seq_rm(mem, slot.id, slot.n_past, -1);
+            return false;
+        }
 
-            params_dft.devices      = params_base.speculative.devices;
-            params_dft.model        = params_base.speculative.model;
-            params_dft.n_ctx        = params_base.speculative.n_ctx == 0 ? params_base.n_ctx / params_base.n_parallel : params_base.speculative.n_ctx;
-            params_dft.n_gpu_layers = params_base.speculative.n_gpu_layers;
-            params_dft.n_parallel   = 1;
-            params_dft.cache_type_k = params_base.speculative.cache_type_k;
-            params_dft.cache_type_v = params_base.speculative.cache_type_v;
+        llama_memory_seq_rm(mem, slot.id, slot.n_past + n_keep, -1);
 
-            llama_init_dft = common_init_from_params(params_dft);
+        SLT_INF(slot, "added the cached chunk [%d, %d) from position %d, processing the last %d tokens\n",
+                slot.n_past, slot.n_past + n_tokens, entry->pos, n_tokens - n_keep);
 
-            model_dft = llama_init_dft.model.get();
+        for (int32_t i = 0; i < n_keep; ++i) {
+            slot.cache_tokens.push_back(tokens[i]);
+        }
 
-            if (model_dft == nullptr) {
-                SRV_ERR("failed to load draft model, '%s'\n", params_base.speculative.model.path.c_str());
-                return false;
+        slot.n_past += n_keep;
+
+        return true;
+    }
+
+    // save the KV cells of the chunks of the prompt that are not cached yet
+    void kv_chunk_save(server_slot & slot) {
+        for (const auto & chunk : slot.kv_chunks) {
+            llama_tokens tokens = kv_chunk_tokens(slot, chunk);
+            if (kv_chunk_cache.has(tokens)) {
+                continue;
             }
 
-            vocab_dft_compatible = common_speculative_are_compatible(ctx, llama_init_dft.context.get());
-            if (!vocab_dft_compatible) {
-                SRV_INF("the draft model '%s' is not compatible with the target model '%s'. tokens will be translated between the draft and target models.\n", params_base.speculative.model.path.c_str(), params_base.model.path.c_str());
+            const size_t size = llama_state_seq_get_size_range(ctx, slot.id, chunk.first, chunk.second);
+
+            std::vector<uint8_t> data(size);
+            if (size == 0 || llama_state_seq_get_data_range(ctx, data.data(), size, slot.id, chunk.first, chunk.second) != size) {
+                SLT_WRN(slot, "failed to save the chunk [%d, %d)\n", chunk.first, chunk.second);
+                continue;
             }
 
-            const int n_ctx_dft = llama_n_ctx(llama_init_dft.context.get());
+            if (kv_chunk_cache.put(tokens, chunk.first, std::move(data))) {
+                SLT_INF(slot, "cached the chunk [%d, %d), %.3f MiB\n", chunk.first, chunk.second, size/1024.0/1024.0);
+            }
+        }
+    }
 
-            cparams_dft = common_context_params_to_llama(params_dft);
-            cparams_dft.n_batch = n_ctx_dft;
+    // SERVER_TASK_TYPE_PREFILL: send the tokens and the KV cells evaluated since the previous chunk
+    void send_kv_chunk(server_slot & slot, bool is_final) {
+        auto res = std::make_unique<server_task_result_kv_chunk>();
+        res->id       = slot.id_task;
+        res->id_slot  = slot.id;
+        res->is_final = is_final;
 
-            // the context is not needed - we will create one for each slot
-            llama_init_dft.context.reset();
+        const llama_pos p0 = slot.kv_sent > 0 ? slot.kv_sent : -1;
+
+        const size_t n_state = llama_state_seq_get_size_from(ctx, slot.id, p0);
+
+        server_session_chunk hdr;
+        hdr.magic    = SERVER_SESSION_MAGIC;
+        hdr.n_past   = slot.kv_sent;
+        hdr.n_tokens = slot.n_past - slot.kv_sent;
+        hdr.flags    = is_final ? SERVER_SESSION_CHUNK_FINAL : 0;
+        hdr.n_state  = n_state;
+
+        const size_t n_tokens_bytes = hdr.n_tokens*sizeof(llama_token);
+
+        res->data.resize(sizeof(hdr) + n_tokens_bytes + n_state);
+
+        uint8_t * dst = res->data.data();
+        memcpy(dst, &hdr, sizeof(hdr));
+        memcpy(dst + sizeof(hdr), slot.cache_tokens.get_text_tokens().data() + hdr.n_past, n_tokens_bytes);
+
+        if (n_state == 0 || llama_state_seq_get_data_from(ctx, dst + sizeof(hdr) + n_tokens_bytes, n_state, slot.id, p0) != n_state) {
+            slot.release();
+            send_error(slot, "failed to copy the KV cells of the prompt");
+            return;
         }
 
-        chat_templates = common_chat_templates_init(model, params_base.chat_template);
-        try {
-            common_chat_format_example(chat_templates.get(), params.use_jinja);
-        } catch (const std::exception & e) {
-            SRV_WRN("%s: Chat template parsing error: %s\n", __func__, e.what());
-            SRV_WRN("%s: The chat template that comes with this model is not yet supported, falling back to chatml. This may cause the model to output suboptimal responses\n", __func__);
-            chat_templates = common_chat_templates_init(model, "chatml");
+        SLT_DBG(slot, "sending %u tokens from %u, %zu bytes%s\n", hdr.n_tokens, hdr.n_past, res->data.size(), is_final ? " (final)" : "");
+
+        slot.kv_sent = slot.n_past;
+
+        queue_results.send(std::move(res));
+    }
+
+    // the prompt of the slot is evaluated by the prefill server if it has enough tokens to evaluate
+    // the last prompt token is always evaluated here, for the logits
+    bool remote_prefill_eligible(const server_slot & slot) const {
+        if (params_base.prefill_url.empty() || slot.remote_prefill_tried || mctx) {
+            return false;
         }
 
-        std::string & mmproj_path = params_base.mmproj.path;
-        if (!mmproj_path.empty()) {
-            mtmd_context_params mparams = mtmd_context_params_default();
-            mparams.use_gpu       = params_base.mmproj_use_gpu;
-            mparams.print_timings = false;
-            mparams.n_threads     = params_base.cpuparams.n_threads;
-            mparams.verbosity     = params_base.verbosity > 0 ? GGML_LOG_LEVEL_DEBUG : GGML_LOG_LEVEL_INFO;
-            mctx = mtmd_init_from_file(mmproj_path.c_str(), model, mparams);
-            if (mctx == nullptr) {
-                SRV_ERR("failed to load multimodal model, '%s'\n", mmproj_path.c_str());
+        if (slot.task_type != SERVER_TASK_TYPE_COMPLETION && slot.task_type != SERVER_TASK_TYPE_INFILL) {
+            return false;
+        }
+
+        // the adapters of the slot are not known by the prefill server
+        for (const auto & la : slot.lora) {
+            if (la.scale != 0.0f) {
                 return false;
             }
-            SRV_INF("loaded multimodal model, '%s'\n", mmproj_path.c_str());
+        }
+
+        return slot.n_prompt_tokens - 1 - slot.n_past >= params_base.prefill_min_tokens;
+    }
+
+    void remote_prefill_start(server_slot & slot) {
+        slot.remote_prefill_tried = true;
+
+        const llama_tokens & tokens = slot.prompt_tokens.get_text_tokens();
+
+        const json body = {
+            { "tokens", llama_tokens(tokens.begin(), tokens.begin() + slot.n_prompt_tokens - 1) },
+            { "n_past", slot.n_past },
+        };
 
-            if (params_base.ctx_shift) {
-                params_base.ctx_shift = false;
-                SRV_WRN("%s\n", "ctx_shift is not supported by multimodal, it will be disabled");
-            }
+        httplib::Request req;
+        req.method = "POST";
+        req.path   = params_base.api_prefix + "/prefill";
+        req.body   = body.dump();
+        req.set_header("Content-Type", "application/json");
+        if (!params_base.api_keys.empty()) {
+            req.set_header("Authorization", "Bearer " + params_base.api_keys[0]);
+        }
 
-            if (params_base.n_cache_reuse) {
-                params_base.n_cache_reuse = 0;
-                SRV_WRN("%s\n", "cache_reuse is not supported by multimodal, it will be disabled");
-            }
+        auto rp = std::make_shared<server_remote_prefill>(params_base.prefill_url, params_base.timeout_read, params_base.timeout_write);
+        rp->start(std::move(req), [this]() {
+            queue_tasks.wake();
+        });
+
+        remote_prefills.push_back(rp);
+        slot.remote_prefill = std::move(rp);
+
+        SLT_INF(slot, "prompt sent to the prefill server, n_past = %d, n_prompt_tokens = %d\n", slot.n_past, slot.n_prompt_tokens);
+    }
+
+    // add a chunk received from the prefill server at n_past
+    bool remote_prefill_apply(server_slot & slot, const std::vector<uint8_t> & chunk) {
+        server_session_chunk hdr;
+        memcpy(&hdr, chunk.data(), sizeof(hdr));
+
+        const size_t n_tokens_bytes = size_t(hdr.n_tokens)*sizeof(llama_token);
+
+        if (chunk.size() != sizeof(hdr) + n_tokens_bytes + hdr.n_state || (llama_pos) hdr.n_past != slot.n_past ||
+            slot.n_past + (int32_t) hdr.n_tokens > slot.n_prompt_tokens - 1) {
+            SLT_WRN(slot, "unexpected chunk from the prefill server: %u tokens from %u, n_past = %d\n", hdr.n_tokens, hdr.n_past, slot.n_past);
+            return false;
+        }
+
+        llama_tokens tokens(hdr.n_tokens);
+        memcpy(tokens.data(), chunk.data() + sizeof(hdr), n_tokens_bytes);
 
-            if (!params_base.speculative.model.path.empty()) {
-                SRV_ERR("%s\n", "err: speculative decode is not supported by multimodal");
+        for (size_t i = 0; i < tokens.size(); ++i) {
+            if (tokens[i] != slot.prompt_tokens[slot.n_past + i]) {
+                SLT_WRN(slot, "the prefill server evaluated other tokens at %zu\n", slot.n_past + i);
                 return false;
             }
         }
 
-        if (!llama_memory_can_shift(llama_get_memory(ctx))) {
-            if (params_base.ctx_shift) {
-                params_base.ctx_shift = false;
-                SRV_WRN("%s\n", "ctx_shift is not supported by this context, it will be disabled");
-            }
+        const uint8_t * src = chunk.data() + sizeof(hdr) + n_tokens_bytes;
 
-            if (params_base.n_cache_reuse) {
-                params_base.n_cache_reuse = 0;
-                SRV_WRN("%s\n", "cache_reuse is not supported by this context, it will be disabled");
+        const size_t nread = hdr.n_past == 0 ?
+            llama_state_seq_set_data       (ctx, src, hdr.n_state, slot.id) :
+            llama_state_seq_set_data_append(ctx, src, hdr.n_state, slot.id);
+        if (nread == 0) {
+            SLT_WRN(slot, "failed to add the KV cells from the prefill server at %d\n", slot.n_past);
+            if (!llama_memory_seq_rm(llama_get_memory(ctx), slot.id, slot.n_past, -1)) {
+                llama_memory_seq_rm(llama_get_memory(ctx), slot.id, -1, -1);
+                slot.cache_tokens.clear();
+                slot.n_past = 0;
             }
+            return false;
+        }
+
+        for (llama_token tok : tokens) {
+            slot.cache_tokens.push_back(tok);
         }
 
+        slot.n_past                    += hdr.n_tokens;
+        slot.n_prompt_tokens_processed += hdr.n_tokens;
+
         return true;
     }
 
-    void init() {
-        const int32_t n_ctx_slot = n_ctx / params_base.n_parallel;
+    // add the chunks received from the prefill server to the slot
+    // returns false while the transfer is in progress - when it ends or fails, the rest of the prompt is evaluated here
+    bool remote_prefill_update(server_slot & slot) {
+        auto & rp = *slot.remote_prefill;
 
-        SRV_INF("initializing slots, n_slots = %d\n", params_base.n_parallel);
+        std::deque<std::vector<uint8_t>> chunks;
+        bool done;
+        bool failed;
+        {
+            std::unique_lock<std::mutex> lock(rp.mutex);
+            chunks.swap(rp.chunks);
+            done   = rp.done;
+            failed = rp.failed;
+        }
 
-        for (int i = 0; i < params_base.n_parallel; i++) {
-            server_slot slot;
+        for (const auto & chunk : chunks) {
+            if (!remote_prefill_apply(slot, chunk)) {
+                failed = true;
+                break;
+            }
+        }
 
-            slot.id = i;
-            slot.ctx = ctx;
-            slot.n_ctx = n_ctx_slot;
-            slot.n_predict = params_base.n_predict;
-            slot.mctx = mctx;
-            slot.cache_tokens.has_mtmd = mctx != nullptr;
+        if (!done && !failed) {
+            return false;
+        }
 
-            if (model_dft) {
-                slot.batch_spec = llama_batch_init(params_base.speculative.n_max + 1, 0, 1);
+        if (failed) {
+            SLT_WRN(slot, "the prefill server failed, evaluating the prompt from n_past = %d\n", slot.n_past);
+        } else {
+            SLT_INF(slot, "received the KV cells from the prefill server, n_past = %d\n", slot.n_past);
+        }
 
-                slot.ctx_dft = llama_init_from_model(model_dft, cparams_dft);
-                if (slot.ctx_dft == nullptr) {
-                    SRV_ERR("%s", "failed to create draft context\n");
-                    return;
-                }
+        slot.remote_prefill.reset();
 
-                slot.spec = common_speculative_init(slot.ctx, slot.ctx_dft);
-                if (slot.spec == nullptr) {
-                    SRV_ERR("%s", "failed to create speculator\n");
-                    return;
-                }
-                for (auto &pair : params_base.speculative.replacements) {
-                    common_speculative_add_replacement_tgt_dft(slot.spec, pair.first.c_str(), pair.second.c_str());
-                }
-            }
+        return true;
+    }
 
-            SLT_INF(slot, "new slot n_ctx_slot = %d\n", slot.n_ctx);
+    // snapshot the SWA cache of the slot after the prompt
+    void swa_checkpoint(server_slot & slot) {
+        llama_memory_t mem = llama_get_memory(ctx);
 
-            slot.params.sampling = params_base.sampling;
-            slot.params.n_keep = params_base.n_keep;
+        const llama_pos pos_min = llama_memory_seq_pos_min(mem, slot.id);
+        const llama_pos pos_max = llama_memory_seq_pos_max(mem, slot.id);
+        if (pos_max < 0 || slot.kv_compressed) {
+            return;
+        }
 
-            slot.callback_on_release = [this](int) {
-                queue_tasks.pop_deferred_task();
-            };
+        const llama_tokens & tokens = slot.cache_tokens.get_text_tokens();
+        if ((size_t) pos_max >= tokens.size()) {
+            return;
+        }
 
-            slot.reset();
+        // drop the snapshots of a different prompt
+        while (!slot.swa_ckpts.empty()) {
+            const auto & last = slot.swa_ckpts.back();
+            if (std::equal(last.tokens.begin(), last.tokens.end(), tokens.begin()) && last.pos_max <= pos_max) {
+                break;
+            }
+            slot.swa_ckpts.pop_back();
+        }
 
-            slots.push_back(std::move(slot));
+        // skip the snapshots too close to the previous one
+        const llama_pos n_min_gap = 64;
+        if (!slot.swa_ckpts.empty() && pos_max < slot.swa_ckpts.back().pos_max + n_min_gap) {
+            return;
         }
 
-        default_generation_settings_for_props = slots[0].to_json();
+        while (slot.swa_ckpts.size() >= (size_t) params_base.n_swa_ckpt) {
+            slot.swa_ckpts.pop_front();
+        }
 
-        // the update_slots() logic will always submit a maximum of n_batch or n_parallel tokens
-        // note that n_batch can be > n_ctx (e.g. for non-causal attention models such as BERT where the KV cache is not used)
-        {
-            const int32_t n_batch = llama_n_batch(ctx);
-            batch = llama_batch_init(std::max(n_batch, params_base.n_parallel), 0, 1);
+        const size_t size = llama_state_seq_get_size_ext(ctx, slot.id, LLAMA_STATE_SEQ_FLAGS_SWA_ONLY);
+
+        server_slot::swa_checkpoint ckpt;
+        ckpt.pos_min = pos_min;
+        ckpt.pos_max = pos_max;
+        ckpt.tokens.assign(tokens.begin(), tokens.begin() + pos_max + 1);
+        ckpt.data.resize(size);
+
+        if (llama_state_seq_get_data_ext(ctx, ckpt.data.data(), size, slot.id, LLAMA_STATE_SEQ_FLAGS_SWA_ONLY) != size) {
+            SLT_WRN(slot, "%s", "failed to snapshot the SWA cache\n");
+            return;
         }
 
-        metrics.init();
+        SLT_INF(slot, "SWA checkpoint %zu at [%d, %d], %.3f MiB\n", slot.swa_ckpts.size(), pos_min, pos_max, size/1024.0/1024.0);
 
-        oai_parser_opt = {
-            /* use_jinja             */ params_base.use_jinja,
-            /* prefill_assistant     */ params_base.prefill_assistant,
-            /* reasoning_format      */ params_base.reasoning_format,
-            /* chat_template_kwargs  */ params_base.default_template_kwargs,
-            /* common_chat_templates */ chat_templates.get(),
-            /* allow_image           */ mctx ? mtmd_support_vision(mctx) : false,
-            /* allow_audio           */ mctx ? mtmd_support_audio (mctx) : false,
-            /* enable_thinking       */ params_base.reasoning_budget != 0,
-        };
+        slot.swa_ckpts.push_back(std::move(ckpt));
     }
 
-    server_slot * get_slot_by_id(int id) {
-        for (server_slot & slot : slots) {
-            if (slot.id == id) {
-                return &slot;
+    // restore the newest SWA snapshot that covers the window before the common part of the cached and the new prompt
+    // on success, n_past is reduced to the end of the snapshot
+    bool swa_restore(server_slot & slot) {
+        if (slot.swa_ckpts.empty()) {
+            return false;
+        }
+
+        const auto n_swa = llama_model_n_swa(model);
+
+        const llama_tokens & prompt = slot.prompt_tokens.get_text_tokens();
+
+        for (auto it = slot.swa_ckpts.rbegin(); it != slot.swa_ckpts.rend(); ++it) {
+            const int32_t n_past = std::min(slot.n_past, it->pos_max + 1);
+
+            if (it->pos_min > std::max(0, n_past - n_swa)) {
+                continue;
             }
+
+            if (it->tokens.size() > prompt.size() || !std::equal(it->tokens.begin(), it->tokens.end(), prompt.begin())) {
+                continue;
+            }
+
+            if (llama_state_seq_set_data_ext(ctx, it->data.data(), it->data.size(), slot.id, LLAMA_STATE_SEQ_FLAGS_SWA_ONLY) != it->data.size()) {
+                // the SWA cache of the slot is not usable anymore
+                SLT_WRN(slot, "%s", "failed to restore the SWA checkpoint\n");
+                slot.swa_ckpts.clear();
+                return false;
+            }
+
+            SLT_INF(slot, "restored SWA checkpoint at [%d, %d], n_past = %d -> %d\n", it->pos_min, it->pos_max, slot.n_past, n_past);
+
+            slot.n_past = n_past;
+
+            return true;
         }
 
-        return nullptr;
+        return false;
     }
 
-    server_slot * get_available_slot(const server_task & task) {
-        server_slot * ret = nullptr;
+    // keep only the params_base.kv_compress prompt tokens that received the most attention, and the most recent ones
+    void kv_compress(server_slot & slot) {
+        // the last tokens of the prompt are the queries that select the cells to keep
+        const int32_t n_window = 32;
 
-        // find the slot that has at least n% prompt similarity
-        if (ret == nullptr && slot_prompt_similarity != 0.0f) {
-            int lcs_len = 0;
-            float similarity = 0;
+        const llama_pos p1 = slot.n_past - n_window;
+        if (p1 <= params_base.kv_compress) {
+            return;
+        }
 
-            for (server_slot & slot : slots) {
-                // skip the slot if it is not available
-                if (slot.is_processing()) {
-                    continue;
-                }
+        const int32_t n_removed = llama_memory_seq_compress(llama_get_memory(ctx), slot.id, 0, p1, params_base.kv_compress);
+        if (n_removed <= 0) {
+            return;
+        }
 
-                // skip the slot if it does not contains cached tokens
-                if (slot.cache_tokens.empty()) {
-                    continue;
-                }
+        SLT_INF(slot, "kv cache compressed, removed %d of %d tokens in [0, %d)\n", n_removed, p1, p1);
 
-                // length of the Longest Common Subsequence between the current slot's prompt and the input prompt
-                int cur_lcs_len = slot.cache_tokens.get_common_prefix(task.prompt_tokens);
+        slot.kv_compressed = true;
 
-                // fraction of the common subsequence length compared to the current slot's prompt length
-                float cur_similarity = static_cast<float>(cur_lcs_len) / static_cast<int>(slot.cache_tokens.size());
+        if (params_base.prefix_cache) {
+            prefix_cache.remove(slot.id);
+        }
+    }
 
-                // select the current slot if the criteria match
-                if (cur_lcs_len > lcs_len && cur_similarity > slot_prompt_similarity) {
-                    lcs_len = cur_lcs_len;
-                    similarity = cur_similarity;
-                    ret = &slot;
-                }
-            }
+    // the run of prompt tokens in the current batch that the next prompt tokens of the slot can share, or nullptr
+    const batch_prompt_run * find_batch_prompt_run(const server_slot & slot) const {
+        if (!batch_prompt_sharing || !slot.can_split() || slot.n_past >= slot.n_prompt_tokens - 1) {
+            return nullptr;
+        }
 
-            if (ret != nullptr) {
-                SLT_DBG(*ret, "selected slot by lcs similarity, lcs_len = %d, similarity = %f\n", lcs_len, similarity);
+        llama_memory_t mem = llama_get_memory(ctx);
+
+        for (const auto & run : batch_prompt_runs) {
+            const server_slot & other = *run.slot;
+
+            if (run.n_past != slot.n_past || other.prompt_tokens[run.n_past] != slot.prompt_tokens[slot.n_past]) {
+                continue;
             }
-        }
 
-        // find the slot that has been least recently used
-        if (ret == nullptr) {
-            int64_t t_last = -1;
+            // the KV data computed with different adapters cannot be shared
+            if (other.task_type != slot.task_type || !are_lora_equal(other.lora, slot.lora)) {
+                continue;
+            }
 
-            for (server_slot & slot : slots) {
-                // skip the slot if it is not available
-                if (slot.is_processing()) {
-                    continue;
-                }
+            // the sequences of a shared token must have the same cells before it
+            if (llama_memory_seq_pos_min(mem, other.id) != llama_memory_seq_pos_min(mem, slot.id) ||
+                llama_memory_seq_pos_max(mem, other.id) != llama_memory_seq_pos_max(mem, slot.id)) {
+                continue;
+            }
 
-                // select the current slot if the criteria match
-                if (!ret || slot.t_last_used <= t_last) {
-                    t_last = slot.t_last_used;
-                    ret = &slot;
-                }
+            bool same = true;
+            for (int32_t i = 0; i < slot.n_past && same; ++i) {
+                same = other.cache_tokens[i] == slot.cache_tokens[i];
             }
 
-            if (ret != nullptr) {
-                SLT_DBG(*ret, "selected slot by lru, t_last = %" PRId64 "\n", t_last);
+            if (same) {
+                return &run;
             }
         }
 
-        return ret;
+        return nullptr;
     }
 
-    bool launch_slot_with_task(server_slot & slot, server_task && task) {
-        slot.reset();
-        slot.id_task       = task.id;
-        slot.index         = task.index;
-        slot.task_type     = task.type;
-        slot.params        = std::move(task.params);
-        slot.prompt_tokens = std::move(task.prompt_tokens);
+    // share the KV cells of the longest cached prefix of the slot prompt held by another slot
+    void attach_shared_prefix(server_slot & slot) {
+        llama_memory_t mem = llama_get_memory(ctx);
 
-        if (!are_lora_equal(slot.params.lora, slot.lora)) {
-            // if lora is changed, we cannot reuse cached tokens
-            slot.cache_tokens.clear();
-            slot.lora = slot.params.lora;
-        }
+        const llama_tokens & prompt = slot.prompt_tokens.get_text_tokens();
 
-        if (!slot.prompt_tokens.validate(ctx)) {
-            send_error(task, "Prompt contains invalid tokens", ERROR_TYPE_INVALID_REQUEST);
-            return false;
-        }
-        SLT_DBG(slot, "launching slot : %s\n", safe_json_to_str(slot.to_json()).c_str());
+        llama_seq_id seq_src = -1;
 
-        if (slot.n_predict > 0 && slot.params.n_predict > slot.n_predict) {
-            // Might be better to reject the request with a 400 ?
-            SLT_WRN(slot, "n_predict = %d exceeds server configuration, setting to %d\n", slot.params.n_predict, slot.n_predict);
-            slot.params.n_predict = slot.n_predict;
-        }
+        const auto filter = [&](llama_seq_id seq_id) {
+            // the KV data computed with different adapters cannot be shared
+            return seq_id != slot.id && are_lora_equal(slots[seq_id].lora, slot.lora);
+        };
 
-        {
-            if (slot.smpl != nullptr) {
-                common_sampler_free(slot.smpl);
-            }
+        size_t n_shared = prefix_cache.find(prompt, filter, seq_src, ggml_time_us());
 
-            slot.smpl = common_sampler_init(model, slot.params.sampling);
-            if (slot.smpl == nullptr) {
-                // for now, the only error that may happen here is invalid grammar
-                send_error(task, "Failed to parse grammar", ERROR_TYPE_INVALID_REQUEST);
-                return false;
-            }
+        // need to evaluate at least 1 token to get the logits
+        n_shared = std::min(n_shared, prompt.size() - 1);
+
+        if (seq_src < 0 || (int) n_shared <= slot.n_past) {
+            return;
         }
 
-        if (slot.ctx_dft) {
-            llama_batch_free(slot.batch_spec);
+        // the source slot may be processing - only the cells that are already present can be shared
+        if (llama_memory_seq_pos_min(mem, seq_src) != 0) {
+            return;
+        }
+        n_shared = std::min<size_t>(n_shared, llama_memory_seq_pos_max(mem, seq_src) + 1);
 
-            slot.batch_spec = llama_batch_init(slot.params.speculative.n_max + 1, 0, 1);
+        if ((int) n_shared <= slot.n_past) {
+            return;
         }
 
-        slot.state = SLOT_STATE_STARTED;
+        SLT_INF(slot, "sharing prefix of %zu tokens with slot %d (n_past = %d)\n", n_shared, seq_src, slot.n_past);
 
-        SLT_INF(slot, "%s", "processing task\n");
+        llama_memory_seq_rm(mem, slot.id, -1, -1);
+        llama_memory_seq_cp(mem, seq_src, slot.id, 0, n_shared);
 
-        return true;
+        slot.cache_tokens.clear();
+        slot.cache_tokens.insert(llama_tokens(prompt.begin(), prompt.begin() + n_shared));
+
+        slot.n_past = n_shared;
     }
 
     void kv_cache_clear() {
@@ -2294,6 +6206,8 @@ struct server_context {
         // clear the entire KV cache
         llama_memory_clear(llama_get_memory(ctx), true);
         clean_kv_cache = false;
+
+        prefix_cache.clear();
     }
 
     bool process_token(completion_token_output & result, server_slot & slot) {
@@ -2302,7 +6216,7 @@ struct server_context {
         slot.sampled = result.tok;
 
         slot.generated_text += token_str;
-        if (slot.params.return_tokens) {
+        if (slot.params.return_tokens || !slot.params.return_text) {
             slot.generated_tokens.push_back(result.tok);
         }
         slot.has_next_token = true;
@@ -2317,14 +6231,14 @@ struct server_context {
             const std::string str_test = slot.generated_text.substr(pos);
             bool send_text = true;
 
-            size_t stop_pos = slot.find_stopping_strings(str_test, token_str.size(), true);
+            size_t stop_pos = slot.find_stopping_strings(str_test, true);
             if (stop_pos != std::string::npos) {
                 slot.generated_text.erase(
                     slot.generated_text.begin() + pos + stop_pos,
                     slot.generated_text.end());
                 pos = std::min(slot.n_sent_text, slot.generated_text.size());
             } else if (slot.has_next_token) {
-                stop_pos = slot.find_stopping_strings(str_test, token_str.size(), false);
+                stop_pos = slot.find_stopping_strings(str_test, false);
                 send_text = stop_pos == std::string::npos;
             }
 
@@ -2348,6 +6262,15 @@ struct server_context {
             slot.has_next_token = true;
         }
 
+        // the cells of the context are shared by the slots, the ones reserved by the other slots included
+        if (params_base.kv_pool && slot.has_next_token && !kv_pool_reserve(slot.cache_tokens.size() + 1, &slot)) {
+            slot.truncated      = true;
+            slot.stop           = STOP_TYPE_LIMIT;
+            slot.has_next_token = false;
+
+            SLT_DBG(slot, "stopped due to running out of free KV cells, n_past = %d, n_free = %d\n", slot.n_past, kv_pool_n_free(&slot));
+        }
+
         // if context shifting is disabled, make sure that we don't run out of context
         if (!params_base.ctx_shift && slot.n_past + 1 >= slot.n_ctx) {
             slot.stop           = STOP_TYPE_LIMIT;
@@ -2430,6 +6353,16 @@ struct server_context {
             SLT_DBG(slot, "%s", "stopped by EOS\n");
         }
 
+        // the stop token sequences are included in the output, like EOS
+        const int32_t i_seq = slot.stop_tokens.add(result.tok);
+        if (i_seq >= 0 && slot.has_next_token) {
+            slot.stop           = STOP_TYPE_WORD;
+            slot.stopping_word  = common_detokenize(ctx, slot.params.stop_tokens[i_seq], true);
+            slot.has_next_token = false;
+
+            SLT_DBG(slot, "stopped by stop token sequence %d\n", i_seq);
+        }
+
         const auto n_ctx_train = llama_model_n_ctx_train(model);
 
         if (slot.params.n_predict < 1 && slot.n_predict < 1 && slot.n_prompt_tokens + slot.n_decoded >= n_ctx_train) {
@@ -2450,7 +6383,6 @@ struct server_context {
 
     void populate_token_probs(const server_slot & slot, completion_token_output & result, bool post_sampling, bool special, int idx) {
         size_t n_probs = slot.params.sampling.n_probs;
-        size_t n_vocab = llama_vocab_n_tokens(vocab);
         if (post_sampling) {
             const auto * cur_p = common_sampler_get_candidates(slot.smpl);
             const size_t max_probs = cur_p->size;
@@ -2473,21 +6405,11 @@ struct server_context {
                 });
             }
         } else {
-            // TODO: optimize this with min-p optimization
-            std::vector<llama_token_data> cur = get_token_probabilities(ctx, idx);
-
-            // set probability for sampled token
-            for (size_t i = 0; i < n_vocab; i++) {
-                // set probability for sampled token
-                if (cur[i].id == result.tok) {
-                    result.prob = cur[i].p;
-                    break;
-                }
-            }
+            // set probability for sampled token and for top n_probs tokens
+            std::vector<llama_token_data> cur = get_token_probabilities(ctx, idx, n_probs, result.tok, &result.prob);
 
-            // set probability for top n_probs tokens
-            result.probs.reserve(n_probs);
-            for (size_t i = 0; i < std::min(n_vocab, n_probs); i++) {
+            result.probs.reserve(cur.size());
+            for (size_t i = 0; i < cur.size(); i++) {
                 result.probs.push_back({
                     cur[i].id,
                     common_token_to_piece(ctx, cur[i].id, special),
@@ -2497,21 +6419,22 @@ struct server_context {
         }
     }
 
-    void send_error(const server_task & task, const std::string & error, const enum error_type type = ERROR_TYPE_SERVER) {
-        send_error(task.id, error, type);
+    void send_error(const server_task & task, const std::string & error, const enum error_type type = ERROR_TYPE_SERVER, int32_t retry_after = 0) {
+        send_error(task.id, error, type, retry_after);
     }
 
     void send_error(const server_slot & slot, const std::string & error, const enum error_type type = ERROR_TYPE_SERVER) {
         send_error(slot.id_task, error, type);
     }
 
-    void send_error(const int id_task, const std::string & error, const enum error_type type = ERROR_TYPE_SERVER) {
+    void send_error(const int id_task, const std::string & error, const enum error_type type = ERROR_TYPE_SERVER, int32_t retry_after = 0) {
         SRV_ERR("task id = %d, error: %s\n", id_task, error.c_str());
 
         auto res = std::make_unique<server_task_result_error>();
-        res->id       = id_task;
-        res->err_type = type;
-        res->err_msg  = error;
+        res->id          = id_task;
+        res->err_type    = type;
+        res->err_msg     = error;
+        res->retry_after = retry_after;
 
         queue_results.send(std::move(res));
     }
@@ -2526,12 +6449,44 @@ struct server_context {
     }
 
     void send_partial_response(server_slot & slot, const completion_token_output & tkn) {
+        // the token probs are per token, they cannot be coalesced
+        if (slot.params.stream_coalesce_ms >= 0 && slot.params.sampling.n_probs == 0) {
+            slot.stream_pending_text += tkn.text_to_send;
+            slot.stream_pending_tokens.push_back(tkn.tok);
+            return;
+        }
+
+        send_partial_response(slot, tkn.text_to_send, { tkn.tok }, &tkn);
+    }
+
+    // send the coalesced tokens of the slot, unless the flush interval has not elapsed yet
+    void flush_partial_response(server_slot & slot, bool force) {
+        if (slot.stream_pending_tokens.empty()) {
+            return;
+        }
+
+        // the first event is not held, it carries the role in the OAI-compat chat stream
+        const int64_t t_now = ggml_time_us();
+        if (!force && slot.t_stream_flush > 0 && t_now - slot.t_stream_flush < 1000ll*slot.params.stream_coalesce_ms) {
+            return;
+        }
+
+        send_partial_response(slot, slot.stream_pending_text, slot.stream_pending_tokens, nullptr);
+
+        slot.stream_pending_text.clear();
+        slot.stream_pending_tokens.clear();
+        slot.t_stream_flush = t_now;
+    }
+
+    void send_partial_response(server_slot & slot, const std::string & content, const llama_tokens & tokens, const completion_token_output * tkn) {
+        const int64_t t_start = ggml_time_us();
+
         auto res = std::make_unique<server_task_result_cmpl_partial>();
 
         res->id      = slot.id_task;
         res->index   = slot.index;
-        res->content = tkn.text_to_send;
-        res->tokens  = { tkn.tok };
+        res->content = content;
+        res->tokens  = tokens;
 
         res->n_decoded           = slot.n_decoded;
         res->n_prompt_tokens     = slot.n_prompt_tokens;
@@ -2545,8 +6500,8 @@ struct server_context {
         slot.update_chat_msg(res->oaicompat_msg_diffs);
 
         // populate res.probs_output
-        if (slot.params.sampling.n_probs > 0) {
-            res->prob_output = tkn; // copy the token probs
+        if (slot.params.sampling.n_probs > 0 && tkn) {
+            res->prob_output = *tkn; // copy the token probs
         }
 
         // populate timings if this is final response or timings_per_token is enabled
@@ -2555,9 +6510,17 @@ struct server_context {
         }
 
         queue_results.send(std::move(res));
+
+        metrics.t_update_slots_send += ggml_time_us() - t_start;
     }
 
     void send_final_response(server_slot & slot) {
+        if (slot.params.stream) {
+            flush_partial_response(slot, true);
+        }
+
+        const int64_t t_start = ggml_time_us();
+
         auto res = std::make_unique<server_task_result_cmpl_final>();
         res->id              = slot.id_task;
         res->id_slot         = slot.id;
@@ -2604,6 +6567,8 @@ struct server_context {
         res->generation_params = slot.params; // copy the parameters
 
         queue_results.send(std::move(res));
+
+        metrics.t_update_slots_send += ggml_time_us() - t_start;
     }
 
     void send_embedding(const server_slot & slot, const llama_batch & batch) {
@@ -2613,7 +6578,8 @@ struct server_context {
         res->n_tokens  = slot.n_prompt_tokens;
         res->oaicompat = slot.params.oaicompat;
 
-        const int n_embd = llama_model_n_embd(model);
+        // the pooled embeddings can be truncated on the device (--embd-dim)
+        const int n_embd = llama_pooling_type(slot.ctx) == LLAMA_POOLING_TYPE_NONE ? llama_model_n_embd(model) : llama_n_embd_out(ctx);
 
         std::vector<float> embd_res(n_embd, 0.0f);
 
@@ -2767,6 +6733,7 @@ struct server_context {
             GGML_ASSERT(
                 dynamic_cast<server_task_result_cmpl_partial*>(result.get()) != nullptr
                 || dynamic_cast<server_task_result_cmpl_final*>(result.get()) != nullptr
+                || dynamic_cast<server_task_result_kv_chunk*>(result.get()) != nullptr
             );
             if (!result_handler(result)) {
                 cancel_tasks(id_tasks);
@@ -2791,15 +6758,43 @@ struct server_context {
             case SERVER_TASK_TYPE_INFILL:
             case SERVER_TASK_TYPE_EMBEDDING:
             case SERVER_TASK_TYPE_RERANK:
+            case SERVER_TASK_TYPE_PREFILL:
                 {
+                    const int64_t t_deadline = task.t_deadline();
+                    if (t_deadline >= 0 && ggml_time_us() > t_deadline) {
+                        SRV_WRN("task deadline exceeded before launch, id_task = %d, deadline_ms = %d\n", task.id, (int) task.params.deadline_ms);
+                        send_error(task, "the request could not be started before its deadline", ERROR_TYPE_UNAVAILABLE);
+                        break;
+                    }
+
+                    // suspended slots with the same or higher priority go first
+                    if (!slots_suspended.empty()) {
+                        resume_suspended_slots(task.params.priority);
+                    }
+
                     const int id_slot = task.id_selected_slot;
 
+                    if (params_base.kv_pool) {
+                        task.n_kv_needed = task.prompt_tokens.size() + n_predict_max(task.params);
+                    }
+
                     server_slot * slot = id_slot != -1 ? get_slot_by_id(id_slot) : get_available_slot(task);
 
+                    if (slot == nullptr && id_slot == -1 && params_base.slot_preempt) {
+                        slot = get_preemptible_slot(task);
+                        if (slot != nullptr) {
+                            slot_suspend(*slot);
+                        }
+                    }
+
                     if (slot == nullptr) {
                         // if no slot is available, we defer this task for processing later
                         SRV_DBG("no slot is available, defer task, id_task = %d\n", task.id);
-                        queue_tasks.defer(std::move(task));
+                        if (params_base.kv_pool) {
+                            kv_pool_defer(std::move(task), nullptr);
+                        } else {
+                            queue_tasks.defer(std::move(task));
+                        }
                         break;
                     }
 
@@ -2810,6 +6805,19 @@ struct server_context {
                         break;
                     }
 
+                    if (params_base.kv_pool) {
+                        // without running slots, the task is launched anyway and the context limits of the slot apply
+                        const bool any_processing = std::any_of(slots.begin(), slots.end(), [](const server_slot & s) { return s.is_processing(); });
+
+                        if (!kv_pool_reserve(task.n_kv_needed, slot) && any_processing) {
+                            SRV_DBG("not enough free KV cells (%d needed, %d free), defer task, id_task = %d\n", task.n_kv_needed, kv_pool_n_free(slot), task.id);
+                            kv_pool_defer(std::move(task), slot);
+                            break;
+                        }
+                    }
+
+                    metrics.on_task_started(task);
+
                     if (!launch_slot_with_task(*slot, std::move(task))) {
                         SRV_ERR("failed to launch slot with task, id_task = %d\n", task.id);
                         break;
@@ -2824,6 +6832,14 @@ struct server_context {
                             break;
                         }
                     }
+
+                    for (auto it = slots_suspended.begin(); it != slots_suspended.end(); ++it) {
+                        if (it->slot.id_task == task.id_target) {
+                            common_sampler_free(it->slot.smpl);
+                            slots_suspended.erase(it);
+                            break;
+                        }
+                    }
                 } break;
             case SERVER_TASK_TYPE_NEXT_RESPONSE:
                 {
@@ -2836,9 +6852,20 @@ struct server_context {
                     int n_idle_slots       = 0;
                     int n_processing_slots = 0;
 
+                    int32_t n_kv_cache_tokens = 0;
+
+                    std::unordered_set<uint64_t> prefix_hashes;
+
                     for (server_slot & slot : slots) {
                         json slot_data = slot.to_json();
 
+                        prefix_hashes.insert(slot.prefix_hashes.begin(), slot.prefix_hashes.end());
+
+                        const llama_pos pos_min = llama_memory_seq_pos_min(llama_get_memory(ctx), slot.id);
+                        if (pos_min >= 0) {
+                            n_kv_cache_tokens += llama_memory_seq_pos_max(llama_get_memory(ctx), slot.id) - pos_min + 1;
+                        }
+
                         if (slot.is_processing()) {
                             n_processing_slots++;
                         } else {
@@ -2855,7 +6882,13 @@ struct server_context {
                     res->n_idle_slots        = n_idle_slots;
                     res->n_processing_slots  = n_processing_slots;
                     res->n_tasks_deferred    = queue_tasks.queue_tasks_deferred.size();
+                    res->n_slots_suspended   = slots_suspended.size();
                     res->t_start             = metrics.t_start;
+                    res->prefix_hashes.assign(prefix_hashes.begin(), prefix_hashes.end());
+
+                    res->n_tasks_deferred_prio = queue_tasks.n_deferred_per_priority();
+                    res->n_tasks_started_prio  = metrics.n_tasks_started;
+                    res->t_tasks_wait_prio     = metrics.t_tasks_wait;
 
                     res->n_prompt_tokens_processed_total = metrics.n_prompt_tokens_processed_total;
                     res->t_prompt_processing_total       = metrics.t_prompt_processing_total;
@@ -2869,6 +6902,22 @@ struct server_context {
 
                     res->n_decode_total          = metrics.n_decode_total;
                     res->n_busy_slots_total      = metrics.n_busy_slots_total;
+                    res->n_rejected_kv           = metrics.n_rejected_kv;
+
+                    res->h_queue_wait = metrics.h_queue_wait;
+                    res->h_ttft       = metrics.h_ttft;
+                    res->h_token      = metrics.h_token;
+                    res->h_sampling   = metrics.h_sampling;
+                    res->h_detokenize = metrics.h_detokenize;
+
+                    res->n_update_slots_total  = metrics.n_update_slots_total;
+                    res->t_update_slots_batch  = metrics.t_update_slots_batch;
+                    res->t_update_slots_decode = metrics.t_update_slots_decode;
+                    res->t_update_slots_sample = metrics.t_update_slots_sample;
+                    res->t_update_slots_send   = metrics.t_update_slots_send;
+
+                    res->n_kv_cache_tokens = n_kv_cache_tokens;
+                    res->n_ctx             = n_ctx;
 
                     if (task.metrics_reset_bucket) {
                         metrics.reset_bucket();
@@ -2901,7 +6950,9 @@ struct server_context {
                     std::string filepath = task.slot_action.filepath;
 
                     const llama_tokens & tokens = slot->cache_tokens.get_text_tokens();
-                    const size_t nwrite = llama_state_seq_save_file(ctx, filepath.c_str(), slot->id, tokens.data(), token_count);
+                    const size_t nwrite = params_base.slot_save_append ?
+                        slot_save_append(*slot, filepath, tokens) :
+                        llama_state_seq_save_file(ctx, filepath.c_str(), slot->id, tokens.data(), token_count);
 
                     const int64_t t_end = ggml_time_us();
                     const double t_save_ms = (t_end - t_start) / 1000.0;
@@ -2937,10 +6988,25 @@ struct server_context {
                     std::string filename = task.slot_action.filename;
                     std::string filepath = task.slot_action.filepath;
 
+                    // the file may still be written in the background
+                    session_writer.wait();
+
+                    slot->session_path.clear();
+
                     llama_tokens tokens;
-                    tokens.resize(slot->n_ctx);
                     size_t token_count = 0;
-                    size_t nread = llama_state_seq_load_file(ctx, filepath.c_str(), slot->id, tokens.data(), tokens.size(), &token_count);
+                    size_t nread = 0;
+
+                    if (server_session_file::is_chunked(filepath)) {
+                        nread = slot_restore_chunks(*slot, filepath, tokens);
+                        token_count = tokens.size();
+                    } else {
+                        tokens.resize(slot->n_ctx);
+                        nread = llama_state_seq_load_file(ctx, filepath.c_str(), slot->id, tokens.data(), tokens.size(), &token_count);
+                    }
+                    if (params_base.prefix_cache) {
+                        prefix_cache.remove(slot->id);
+                    }
                     if (nread == 0) {
                         slot->cache_tokens.clear(); // KV may already been invalidated?
                         send_error(task, "Unable to restore slot, no available space in KV cache or invalid slot save file", ERROR_TYPE_INVALID_REQUEST);
@@ -2950,6 +7016,10 @@ struct server_context {
                     slot->cache_tokens.clear();
                     slot->cache_tokens.insert(tokens);
 
+                    if (params_base.prefix_cache) {
+                        prefix_cache.insert(slot->id, tokens, slot->t_last_used);
+                    }
+
                     const int64_t t_end = ggml_time_us();
                     const double t_restore_ms = (t_end - t_start) / 1000.0;
 
@@ -2984,6 +7054,10 @@ struct server_context {
                     llama_memory_seq_rm(llama_get_memory(ctx), slot->id, -1, -1);
                     slot->cache_tokens.clear();
 
+                    if (params_base.prefix_cache) {
+                        prefix_cache.remove(slot->id);
+                    }
+
                     auto res = std::make_unique<server_task_result_slot_erase>();
                     res->id       = task.id;
                     res->id_slot  = id_slot;
@@ -2997,11 +7071,99 @@ struct server_context {
                     res->id = task.id;
                     queue_results.send(std::move(res));
                 } break;
+            case SERVER_TASK_TYPE_MODEL_SWAP:
+                {
+                    // the requests have returned, but a cancelled slot may not have been released yet
+                    bool busy = false;
+                    for (const auto & slot : slots) {
+                        busy = busy || slot.is_processing();
+                    }
+                    if (busy) {
+                        SRV_DBG("slots are busy, defer model swap, id_task = %d\n", task.id);
+                        queue_tasks.defer(std::move(task));
+                        break;
+                    }
+
+                    const int64_t t_start = ggml_time_us();
+
+                    if (!swap_model(task.model_swap)) {
+                        send_error(task, "failed to load model '" + task.model_swap + "'", ERROR_TYPE_SERVER);
+                        break;
+                    }
+
+                    auto res = std::make_unique<server_task_result_model_swap>();
+                    res->id   = task.id;
+                    res->t_ms = (ggml_time_us() - t_start) / 1000.0f;
+                    queue_results.send(std::move(res));
+                } break;
+
+        }
+    }
+
+    // the time at which the pending embedding inputs must be processed, or -1 to process them now
+    int64_t embd_batch_flush_time() const {
+        int64_t t_first  = -1;
+        int32_t n_tokens = 0;
+        bool    has_idle = false;
 
+        for (const auto & slot : slots) {
+            if (!slot.is_processing()) {
+                has_idle = true;
+                continue;
+            }
+
+            // only wait while every active slot is an embedding input that has not started processing yet
+            if (slot.state != SLOT_STATE_STARTED ||
+               (slot.task_type != SERVER_TASK_TYPE_EMBEDDING && slot.task_type != SERVER_TASK_TYPE_RERANK)) {
+                return -1;
+            }
+
+            n_tokens += slot.prompt_tokens.size();
+
+            if (slot.t_queued >= 0) {
+                t_first = t_first < 0 ? slot.t_queued : std::min(t_first, slot.t_queued);
+            }
         }
+
+        // no more inputs fit in the batch
+        if (!has_idle || t_first < 0 || n_tokens >= (int32_t) llama_n_ubatch(ctx)) {
+            return -1;
+        }
+
+        return t_first + 1000*params_base.embd_batch_window;
     }
 
     void update_slots() {
+        const int64_t t_start = ggml_time_us();
+
+        // the deferred tasks are rejected as soon as their deadline passes, not when they are retried
+        {
+            int64_t t_next = -1;
+            for (auto & task : queue_tasks.pop_deferred_expired(t_start, t_next)) {
+                SRV_WRN("task deadline exceeded before launch, id_task = %d, deadline_ms = %d\n", task.id, (int) task.params.deadline_ms);
+                send_error(task, "the request could not be started before its deadline", ERROR_TYPE_UNAVAILABLE);
+            }
+            if (t_next >= 0) {
+                queue_tasks.wake_at(t_next);
+            }
+        }
+
+        if (!slots_suspended.empty()) {
+            resume_suspended_slots(queue_tasks.max_deferred_priority());
+        }
+
+        // cancel the transfers of the released slots
+        for (auto it = remote_prefills.begin(); it != remote_prefills.end(); ) {
+            if (it->use_count() == 1) {
+                (*it)->cancel();
+                if ((*it)->exited) {
+                    it = remote_prefills.erase(it);
+                    continue;
+                }
+            }
+            ++it;
+        }
+
         // check if all slots are idle
         {
             bool all_idle = true;
@@ -3023,6 +7185,18 @@ struct server_context {
             }
         }
 
+        // wait a bit for more embedding inputs to share the batch
+        if (params_base.embd_batch_window > 0) {
+            const int64_t t_flush = embd_batch_flush_time();
+
+            if (t_flush > ggml_time_us()) {
+                SRV_DBG("waiting %.3f ms for more embedding inputs\n", (t_flush - ggml_time_us()) / 1e3);
+
+                queue_tasks.wake_at(t_flush);
+                return;
+            }
+        }
+
         {
             SRV_DBG("%s", "posting NEXT_RESPONSE\n");
 
@@ -3074,11 +7248,17 @@ struct server_context {
                 slot.n_past -= n_discard;
 
                 slot.truncated = true;
+
+                if (params_base.prefix_cache) {
+                    // the positions of the shifted cells no longer match the cached tokens
+                    prefix_cache.remove(slot.id);
+                }
             }
         }
 
         // start populating the batch for this iteration
         common_batch_clear(batch);
+        batch_prompt_runs.clear();
 
         // track if given slot can be batched with slots already in the batch
         server_slot * slot_batched = nullptr;
@@ -3100,10 +7280,33 @@ struct server_context {
                 continue;
             }
 
+            if (!slot.forced.empty()) {
+                // the tokens forced by the grammar are not sampled, only the token after them needs logits
+                if (batch.n_tokens + (int) slot.forced.size() + 1 > (int) llama_n_batch(ctx)) {
+                    continue;
+                }
+
+                for (const llama_token tok : slot.forced) {
+                    common_batch_add(batch, tok, slot.n_past, { slot.id }, false);
+
+                    slot.n_past += 1;
+                    slot.cache_tokens.push_back(tok);
+                }
+
+                slot.forced.clear();
+            }
+
             slot.i_batch = batch.n_tokens;
 
             common_batch_add(batch, slot.sampled, slot.n_past, { slot.id }, true);
 
+            slot.drafted.clear();
+            slot.i_batch_dft.clear();
+
+            if (slot.can_speculate()) {
+                slot.drafted = slot_gen_draft(slot);
+            }
+
             slot.n_past += 1;
             slot.cache_tokens.push_back(slot.sampled);
 
@@ -3111,10 +7314,76 @@ struct server_context {
                     slot.n_ctx, slot.n_past, (int) slot.cache_tokens.size(), slot.truncated);
         }
 
+        // add the drafts of the speculating slots, so that they are verified together with the sampled tokens
+        for (auto & slot : slots) {
+            if (slot.drafted.empty()) {
+                continue;
+            }
+
+            // the drafts of all slots must fit in a single batch
+            const int n_draft_room = std::max(0, (int) llama_n_batch(ctx) - batch.n_tokens);
+            if ((int) slot.drafted.size() > n_draft_room) {
+                slot.drafted.resize(n_draft_room);
+            }
+
+            if (slot.drafted.empty() || (int) slot.drafted.size() < slot.params.speculative.n_min) {
+                slot.drafted.clear();
+                continue;
+            }
+
+            // the sampled token of the slot is at n_past - 1
+            for (size_t i = 0; i < slot.drafted.size(); ++i) {
+                slot.i_batch_dft.push_back(batch.n_tokens);
+
+                common_batch_add(batch, slot.drafted[i], slot.n_past + i, { slot.id }, true);
+            }
+
+            // keep track of total number of drafted tokens tested
+            slot.n_draft_total += slot.drafted.size();
+        }
+
+        // draft the next step of the slots with a draft model while the target model verifies this one
+        if (params_base.speculative.async) {
+            for (auto & slot : slots) {
+                if (!slot.spec || slot.state != SLOT_STATE_GENERATING || slot.i_batch < 0 || !slot.can_speculate()) {
+                    continue;
+                }
+
+                // the cached tokens include the sampled token
+                llama_tokens prompt = slot.cache_tokens.get_text_tokens_after_media();
+                prompt.insert(prompt.end(), slot.drafted.begin(), slot.drafted.end());
+
+                // the cached tokens after all the drafted tokens are accepted
+                slot.n_draft_next = slot.cache_tokens.size() + slot.drafted.size();
+
+                const llama_token id_last = prompt.back();
+                prompt.pop_back();
+
+                struct common_speculative_params params_spec;
+                params_spec.n_draft   = slot.params.speculative.n_max + 1;
+                params_spec.n_reuse   = llama_n_ctx(slot.ctx_dft) - slot.params.speculative.n_max;
+                params_spec.p_min     = slot.params.speculative.p_min;
+
+                draft_worker.push([&slot, params_spec, prompt = std::move(prompt), id_last]() {
+                    slot.draft_next = common_speculative_gen_draft(slot.spec, params_spec, prompt, id_last);
+                });
+            }
+        }
+
         // process in chunks of params.n_batch
         int32_t n_batch  = llama_n_batch(ctx);
         int32_t n_ubatch = llama_n_ubatch(ctx);
 
+        // max number of tokens in the batch after adding the prompt tokens
+        // with a budget, large prompts are processed in chunks so they do not stall the generating slots
+        int32_t n_batch_prompt = n_batch;
+        if (params_base.n_batch_budget > 0 && batch.n_tokens > 0) {
+            // always leave some room for the prompts to make progress
+            const int32_t n_prompt_min = std::max(1, params_base.n_batch_budget/4);
+
+            n_batch_prompt = std::min(n_batch, batch.n_tokens + std::max(params_base.n_batch_budget - batch.n_tokens, n_prompt_min));
+        }
+
         // next, batch any pending prompts without exceeding n_batch
         if (params_base.cont_batching || batch.n_tokens == 0) {
             for (auto & slot : slots) {
@@ -3241,23 +7510,13 @@ struct server_context {
                                     size_t head_c = slot.n_past; // cache
                                     size_t head_p = slot.n_past; // current prompt
 
-                                    if (mctx) {
-                                        // we should never reach this
-                                        GGML_ABORT("not supported by multimodal");
-                                    }
-
                                     SLT_DBG(slot, "trying to reuse chunks with size > %d, slot.n_past = %d\n", params_base.n_cache_reuse, slot.n_past);
 
                                     while (head_c < slot.cache_tokens.size() &&
                                            head_p < prompt_tokens.size()) {
 
-                                        size_t n_match = 0;
-                                        while (head_c + n_match < slot.cache_tokens.size() &&
-                                               head_p + n_match < prompt_tokens.size()     &&
-                                               slot.cache_tokens[head_c + n_match] == prompt_tokens[head_p + n_match]) {
-
-                                            n_match++;
-                                        }
+                                        // the media chunks match only as a whole
+                                        const size_t n_match = slot.cache_tokens.get_common_prefix(prompt_tokens, head_c, head_p);
 
                                         if (n_match >= (size_t) params_base.n_cache_reuse) {
                                             SLT_INF(slot, "reusing chunk with size %zu, shifting KV cache [%zu, %zu) -> [%zu, %zu)\n", n_match, head_c, head_c + n_match, head_p, head_p + n_match);
@@ -3270,10 +7529,8 @@ struct server_context {
                                             llama_memory_seq_rm (llama_get_memory(ctx), slot.id, head_p, head_c);
                                             llama_memory_seq_add(llama_get_memory(ctx), slot.id, head_c, head_c + n_match, kv_shift);
 
-                                            for (size_t i = 0; i < n_match; i++) {
-                                                slot.cache_tokens.set_token(head_p + i, slot.cache_tokens[head_c + i]);
-                                                slot.n_past++;
-                                            }
+                                            slot.cache_tokens.move(head_c, head_p, n_match);
+                                            slot.n_past += n_match;
 
                                             head_c += n_match;
                                             head_p += n_match;
@@ -3284,6 +7541,11 @@ struct server_context {
 
                                     SLT_DBG(slot, "after context reuse, new slot.n_past = %d\n", slot.n_past);
                                 }
+
+                                // attach a longer prefix that is already cached by another slot
+                                if (params_base.prefix_cache) {
+                                    attach_shared_prefix(slot);
+                                }
                             } else {
                                 // if we don't cache the prompt, we have to remove the entire KV cache
                                 slot.n_past = 0;
@@ -3296,8 +7558,11 @@ struct server_context {
                                     GGML_ABORT("pos_min == -1, but n_past > 0 - should not happen: https://github.com/ggml-org/llama.cpp/pull/13833#discussion_r2116181237");
                                 }
 
+                                // with checkpoints, the recurrent state can be rolled back past pos_min (see seq_rm below)
+                                const bool rs_ckpt = params_base.n_rs_ckpt > 0 && (llama_model_is_recurrent(model) || llama_model_is_hybrid(model));
+
                                 const auto n_swa = llama_model_n_swa(model);
-                                if (pos_min > std::max(0, slot.n_past - n_swa)) {
+                                if (!rs_ckpt && pos_min > std::max(0, slot.n_past - n_swa) && !swa_restore(slot)) {
                                     SLT_WRN(slot, "n_past = %d, cache_tokens.size() = %d, seq_id = %d, pos_min = %d, n_swa = %d\n", slot.n_past, (int) slot.cache_tokens.size(), slot.id, pos_min, n_swa);
                                     SLT_WRN(slot, "forcing full prompt re-processing due to lack of cache data (likely due to SWA, see %s)\n",
                                             "https://github.com/ggml-org/llama.cpp/pull/13194#issuecomment-2868343055");
@@ -3306,6 +7571,10 @@ struct server_context {
                             }
                         }
 
+                        if (kv_chunk_cache.enabled() && slot.can_split()) {
+                            kv_chunk_find(slot);
+                        }
+
                         if (slot.n_past == slot.n_prompt_tokens && slot.n_past > 0) {
                             SLT_WRN(slot, "need to evaluate at least 1 token for each active slot, n_past = %d, n_prompt_tokens = %d\n", slot.n_past, slot.n_prompt_tokens);
 
@@ -3316,8 +7585,8 @@ struct server_context {
                     }
 
                     if (!slot.can_split()) {
-                        // cannot fit the prompt in the current batch - will try next iter
-                        if (batch.n_tokens + slot.n_prompt_tokens > n_batch) {
+                        // cannot fit the prompt in the current batch (or in its prompt budget) - will try next iter
+                        if (batch.n_tokens + slot.n_prompt_tokens > n_batch_prompt) {
                             continue;
                         }
                     }
@@ -3329,6 +7598,9 @@ struct server_context {
 
                         // there is no common part left
                         slot.n_past = 0;
+                    } else if (params_base.n_rs_ckpt > 0) {
+                        // the recurrent state can be rolled back to a checkpoint before n_past
+                        slot.n_past = std::min(slot.n_past, llama_memory_seq_pos_max(llama_get_memory(ctx), slot.id) + 1);
                     }
 
                     SLT_INF(slot, "kv cache rm [%d, end)\n", slot.n_past);
@@ -3336,11 +7608,66 @@ struct server_context {
                     // remove the non-common part from the cache
                     slot.cache_tokens.keep_first(slot.n_past);
 
+                    if (params_base.prefix_cache && slot.n_prompt_tokens_processed == 0) {
+                        // only the tokens that are already in the KV cache can be shared while the slot is processing
+                        prefix_cache.remove(slot.id);
+                        prefix_cache.insert(slot.id, slot.cache_tokens.get_text_tokens(), ggml_time_us());
+                    }
+
+                    // add the cached chunks at n_past - the cells before them are already evaluated
+                    while (kv_chunk_cache.enabled() && kv_chunk_splice(slot)) {
+                    }
+
+                    if (remote_prefill_eligible(slot)) {
+                        remote_prefill_start(slot);
+                    }
+
+                    if (slot.remote_prefill && !remote_prefill_update(slot)) {
+                        // the other slots continue while the KV cells are received
+                        continue;
+                    }
+
                     // check if we should process the image
                     if (slot.n_past < slot.n_prompt_tokens && slot.prompt_tokens[slot.n_past] == LLAMA_TOKEN_NULL) {
+                        std::vector<float> embd_enc;
+                        bool has_embd_enc = false;
+
+                        if (mtmd_encoder.mctx) {
+                            const auto & chunk = slot.prompt_tokens.find_chunk(slot.n_past);
+                            const char * id = mtmd_input_chunk_get_id(chunk.get());
+
+                            if (!(mtmd_cache.enabled() && id && mtmd_cache.has(id))) {
+                                if (mtmd_encoder.ready()) {
+                                    // drop the result of a slot that is not waiting for it anymore
+                                    const auto & owner = slots[mtmd_encoder.id_slot];
+                                    if (owner.id_task != mtmd_encoder.id_task || owner.state != SLOT_STATE_PROCESSING_PROMPT) {
+                                        mtmd_encoder.get(embd_enc);
+                                    }
+                                }
+
+                                if (!mtmd_encoder.busy()) {
+                                    mtmd_encoder.start(slot, chunk.get(), llama_model_n_embd(model));
+                                }
+
+                                if (!mtmd_encoder.is_for(slot, chunk.get()) || !mtmd_encoder.ready()) {
+                                    // the other slots continue while the chunk is encoded
+                                    continue;
+                                }
+
+                                has_embd_enc = true;
+
+                                if (mtmd_encoder.get(embd_enc) != 0) {
+                                    SLT_ERR(slot, "%s", "failed to encode image\n");
+                                    slot.release();
+                                    send_error(slot, "failed to process image", ERROR_TYPE_SERVER);
+                                    continue;
+                                }
+                            }
+                        }
+
                         // process the image
                         int32_t new_n_past;
-                        int32_t res = slot.prompt_tokens.process_chunk(ctx, mctx, slot.n_past, slot.id, new_n_past);
+                        int32_t res = slot.prompt_tokens.process_chunk(ctx, mctx, slot.n_past, slot.id, new_n_past, &mtmd_cache, has_embd_enc ? &embd_enc : nullptr);
                         int32_t n_pos = new_n_past - slot.n_past;
 
                         if (res != 0) {
@@ -3360,24 +7687,53 @@ struct server_context {
                         slot.n_prompt_tokens_processed += n_pos;
                     }
 
+                    // the prompt prefix that another slot adds to this batch is not computed again
+                    const batch_prompt_run * run_shared = find_batch_prompt_run(slot);
+
+                    const int32_t n_past_first = slot.n_past;
+                    const int32_t i_batch_first = batch.n_tokens;
+
+                    int32_t n_shared = 0;
+
                     // add prompt tokens for processing in the current batch
-                    while (slot.n_past < slot.n_prompt_tokens && batch.n_tokens < n_batch) {
+                    while (slot.n_past < slot.n_prompt_tokens && batch.n_tokens < n_batch_prompt) {
                         // get next token to process
                         llama_token cur_tok = slot.prompt_tokens[slot.n_past];
                         if (cur_tok == LLAMA_TOKEN_NULL) {
                             break; // end of text chunk
                         }
 
-                        // embedding requires all tokens in the batch to be output
-                        const bool need_embd = server_task_type_need_embd(slot.task_type);
+                        if (slot.n_past > n_past_first && kv_chunk_cache.enabled() && kv_chunk_pending(slot)) {
+                            break; // the cached chunk is added on the next iteration
+                        }
+
+                        // the last prompt token is always added, for the logits or the embeddings of the slot
+                        if (run_shared && n_shared < run_shared->n_tokens && slot.n_past < slot.n_prompt_tokens - 1 &&
+                            batch.token[run_shared->i_batch + n_shared] == cur_tok) {
+                            const int32_t i = run_shared->i_batch + n_shared;
+                            batch.seq_id[i][batch.n_seq_id[i]++] = slot.id;
+                            n_shared++;
+                        } else {
+                            run_shared = nullptr;
+
+                            // embedding requires all tokens in the batch to be output
+                            const bool need_embd = server_task_type_need_embd(slot.task_type);
+
+                            common_batch_add(batch, cur_tok, slot.n_past, { slot.id }, need_embd);
+                        }
 
-                        common_batch_add(batch, cur_tok, slot.n_past, { slot.id }, need_embd);
                         slot.cache_tokens.push_back(cur_tok);
 
                         slot.n_prompt_tokens_processed++;
                         slot.n_past++;
                     }
 
+                    if (n_shared > 0) {
+                        SLT_INF(slot, "shared %d prompt tokens with another slot in the batch\n", n_shared);
+                    } else if (batch_prompt_sharing && batch.n_tokens > i_batch_first) {
+                        batch_prompt_runs.push_back({ &slot, n_past_first, i_batch_first, batch.n_tokens - i_batch_first });
+                    }
+
                     // SLT_INF(slot, "new cache_tokens: %s\n", slot.cache_tokens.str().c_str());
 
                     SLT_INF(slot, "prompt processing progress, n_past = %d, n_tokens = %d, progress = %f\n", slot.n_past, batch.n_tokens, (float) slot.n_prompt_tokens_processed / slot.n_prompt_tokens);
@@ -3409,7 +7765,7 @@ struct server_context {
                     }
                 }
 
-                if (batch.n_tokens >= n_batch) {
+                if (batch.n_tokens >= n_batch_prompt) {
                     break;
                 }
             }
@@ -3422,13 +7778,20 @@ struct server_context {
 
         SRV_DBG("decoding batch, n_tokens = %d\n", batch.n_tokens);
 
-        if (slot_batched) {
-            // apply lora, only need to do it once per batch
-            common_set_adapter_lora(ctx, slot_batched->lora);
+        // compute the grammar masks of the slots that sample from this batch while it is evaluated
+        for (auto & slot : slots) {
+            if (slot.smpl && slot.i_batch >= 0) {
+                common_sampler_prepare(slot.smpl);
+            }
+        }
 
+        if (slot_batched) {
             llama_set_embeddings(ctx, slot_batched->need_embd());
         }
 
+        metrics.n_update_slots_total += 1;
+        metrics.t_update_slots_batch += ggml_time_us() - t_start;
+
         int32_t i_next = 0;
 
         // process the created batch of tokens
@@ -3445,8 +7808,17 @@ struct server_context {
                 batch.logits   + i,
             };
 
+            const int64_t t_decode = ggml_time_us();
+
             const int ret = llama_decode(ctx, batch_view);
 
+            if (params_base.speculative.adaptive && ret == 0) {
+                // the logits are needed right after, waiting here only makes the time measurable
+                llama_synchronize(ctx);
+                spec_cost.add_decode(n_tokens, ggml_time_us() - t_decode);
+            }
+
+            metrics.t_update_slots_decode += ggml_time_us() - t_decode;
             metrics.on_decoded(slots);
 
             if (ret != 0) {
@@ -3492,12 +7864,28 @@ struct server_context {
             // on successful decode, restore the original batch size
             n_batch = llama_n_batch(ctx);
 
+            // the slots that sample a single token from this batch view - sampled together after the loop
+            std::vector<server_slot *>    slots_smpl;
+            std::vector<common_sampler *> smpls;
+            std::vector<int>              idxs_smpl;
+
             for (auto & slot : slots) {
                 if (slot.i_batch < (int) i || slot.i_batch >= (int) (i + n_tokens)) {
                     continue; // continue loop of slots
                 }
 
                 if (slot.state == SLOT_STATE_DONE_PROMPT) {
+                    if (!slot.kv_chunks.empty()) {
+                        kv_chunk_save(slot);
+                    }
+
+                    if (slot.task_type == SERVER_TASK_TYPE_PREFILL) {
+                        send_kv_chunk(slot, true);
+                        slot.release();
+                        slot.i_batch = -1;
+                        continue; // continue loop of slots
+                    }
+
                     if (slot.task_type == SERVER_TASK_TYPE_EMBEDDING) {
                         // prompt evaluated for embedding
                         send_embedding(slot, batch_view);
@@ -3513,20 +7901,143 @@ struct server_context {
                         continue; // continue loop of slots
                     }
 
+                    if (params_base.kv_compress > 0) {
+                        kv_compress(slot);
+                    }
+
+                    if (params_base.n_swa_ckpt > 0) {
+                        swa_checkpoint(slot);
+                    }
+
                     // prompt evaluated for next-token prediction
                     slot.state = SLOT_STATE_GENERATING;
                 } else if (slot.state != SLOT_STATE_GENERATING) {
                     continue; // continue loop of slots
                 }
 
-                const int tok_idx = slot.i_batch - i;
+                const int tok_idx = slot.i_batch - i;
+
+                if (!slot.drafted.empty()) {
+                    // verify the draft with the logits of this batch view
+                    // if the view was split, only the drafted tokens within the view can be verified
+                    std::vector<int> idxs = { tok_idx };
+                    llama_tokens     draft;
+
+                    for (size_t k = 0; k < slot.drafted.size(); ++k) {
+                        if (slot.i_batch_dft[k] >= (int) (i + n_tokens)) {
+                            break;
+                        }
+                        idxs.push_back(slot.i_batch_dft[k] - i);
+                        draft.push_back(slot.drafted[k]);
+                    }
+
+                    slot.i_batch = -1;
+
+                    // the accepted tokens from the speculation
+                    const int64_t t_sample = ggml_time_us();
+
+                    const auto ids = common_sampler_sample_and_accept_n(slot.smpl, ctx, idxs, draft);
+
+                    if (slot.spec_heads) {
+                        slot_save_hidden(slot, idxs[ids.size() - 1]);
+                    }
+
+                    slot.spec_stats.update(ids.size() - 1, draft.size());
+                    spec_stats.update(ids.size() - 1, draft.size());
+
+                    if (slot.lookahead.n_gram > 0) {
+                        // the greedy predictions following the drafted tokens are the next Jacobi iteration
+                        const int n_vocab = llama_vocab_n_tokens(vocab);
+
+                        llama_tokens predicted(draft.size());
+                        for (size_t k = 0; k < draft.size(); ++k) {
+                            const float * logits = llama_get_logits_ith(ctx, idxs[k + 1]);
+                            predicted[k] = std::max_element(logits, logits + n_vocab) - logits;
+                        }
+
+                        // the sampled token was at n_past - 1
+                        slot.lookahead.update(slot.n_past, draft, predicted, ids.size() - 1);
+                    }
+
+                    metrics.on_sampled(ggml_time_us() - t_sample);
+
+                    slot.n_past    += ids.size() - 1;
+                    slot.n_decoded += ids.size();
+
+                    // update how many tokens out of those tested were accepted
+                    slot.n_draft_accepted += ids.size() - 1;
+
+                    slot.cache_tokens.insert({ids.begin(), ids.end() - 1});
+
+                    const double t_token_generation_prev = slot.t_token_generation;
+
+                    slot.t_token_generation = (ggml_time_us() - slot.t_start_generation) / 1e3;
+
+                    // the accepted tokens share the time since the previous step
+                    for (size_t k = 0; k < ids.size(); ++k) {
+                        metrics.h_token.observe((slot.t_token_generation - t_token_generation_prev) / 1e3 / ids.size());
+                    }
+
+                    for (size_t k = 0; k < ids.size(); ++k) {
+                        completion_token_output result;
+
+                        const int64_t t_detokenize = ggml_time_us();
+
+                        result.tok          = ids[k];
+                        result.text_to_send = slot.params.return_text ? common_token_to_piece(ctx, result.tok, accept_special_token(slot, result.tok)) : "";
+                        result.prob         = 1.0f; // set later
+
+                        metrics.h_detokenize.observe((ggml_time_us() - t_detokenize) / 1e6);
+
+                        // TODO: set result.probs
+
+                        if (!process_token(result, slot)) {
+                            // release slot because of stop condition
+                            slot.release();
+                            slot.print_timings();
+                            send_final_response(slot);
+                            metrics.on_prediction(slot);
+                            break;
+                        }
+                    }
+
+                    SLT_DBG(slot, "accepted %d/%d draft tokens, new n_past = %d\n", (int) ids.size() - 1, (int) draft.size(), slot.n_past);
+
+                    if (params_base.jump_forward && slot.state == SLOT_STATE_GENERATING) {
+                        slot_jump_forward(slot);
+                    }
+
+                    continue; // continue loop of slots
+                }
+
+                slot.i_batch = -1;
+
+                slots_smpl.push_back(&slot);
+                smpls.push_back(slot.smpl);
+                idxs_smpl.push_back(tok_idx);
+            }
+
+            // sample the slots in parallel, the sampler chains are independent
+            const int64_t t_sample = ggml_time_us();
+
+            const auto ids_smpl = common_sampler_sample_batch(smpls, ctx, idxs_smpl, params_base.cpuparams.n_threads);
+
+            if (!slots_smpl.empty()) {
+                metrics.on_sampled(ggml_time_us() - t_sample);
+            }
 
-                llama_token id = common_sampler_sample(slot.smpl, ctx, tok_idx);
+            for (size_t s = 0; s < slots_smpl.size(); ++s) {
+                auto & slot = *slots_smpl[s];
 
-                slot.i_batch = -1;
+                const llama_token id      = ids_smpl[s];
+                const int         tok_idx = idxs_smpl[s];
 
                 common_sampler_accept(slot.smpl, id, true);
 
+                if (slot.spec_heads) {
+                    slot_save_hidden(slot, tok_idx);
+                }
+
                 slot.n_decoded += 1;
 
                 const int64_t t_current = ggml_time_us();
@@ -3537,13 +8048,21 @@ struct server_context {
                     metrics.on_prompt_eval(slot);
                 }
 
+                if (slot.n_decoded > 1) {
+                    metrics.h_token.observe((t_current - slot.t_start_generation) / 1e6 - slot.t_token_generation / 1e3);
+                }
+
                 slot.t_token_generation = (t_current - slot.t_start_generation) / 1e3;
 
+                const int64_t t_detokenize = ggml_time_us();
+
                 completion_token_output result;
                 result.tok          = id;
-                result.text_to_send = common_token_to_piece(ctx, result.tok, accept_special_token(slot, result.tok));
+                result.text_to_send = slot.params.return_text ? common_token_to_piece(ctx, result.tok, accept_special_token(slot, result.tok)) : "";
                 result.prob         = 1.0f; // TODO: set it here instead of doing inside populate_token_probs
 
+                metrics.h_detokenize.observe((ggml_time_us() - t_detokenize) / 1e6);
+
                 if (slot.params.sampling.n_probs > 0) {
                     populate_token_probs(slot, result, slot.params.post_sampling_probs, params_base.special, tok_idx);
                 }
@@ -3556,123 +8075,250 @@ struct server_context {
                     metrics.on_prediction(slot);
                     continue;
                 }
-            }
 
-            // do speculative decoding
-            for (auto & slot : slots) {
-                if (!slot.is_processing() || !slot.can_speculate()) {
-                    continue;
+                if (params_base.jump_forward) {
+                    slot_jump_forward(slot);
                 }
+            }
 
-                if (slot.state != SLOT_STATE_GENERATING) {
-                    continue;
-                }
+        }
 
-                if (mctx) {
-                    // we should never reach this, as speculative is automatically disabled if mmproj is loaded
-                    GGML_ABORT("not supported by multimodal");
-                }
+        // send the KV cells of the prompts evaluated for another server in this batch
+        for (auto & slot : slots) {
+            if (slot.task_type == SERVER_TASK_TYPE_PREFILL && slot.state == SLOT_STATE_PROCESSING_PROMPT && slot.n_past > slot.kv_sent) {
+                send_kv_chunk(slot, false);
+            }
+        }
+
+        // remove the rejected draft tokens from the KV cache
+        for (auto & slot : slots) {
+            if (!slot.i_batch_dft.empty()) {
+                llama_memory_seq_rm(llama_get_memory(ctx), slot.id, slot.n_past, -1);
 
-                // determine the max draft that fits the current slot state
-                int n_draft_max = slot.params.speculative.n_max;
+                slot.drafted.clear();
+                slot.i_batch_dft.clear();
+            }
+        }
 
-                // note: n_past is not yet increased for the `id` token sampled above
-                //       also, need to leave space for 1 extra token to allow context shifts
-                n_draft_max = std::min(n_draft_max, slot.n_ctx - slot.n_past - 2);
+        // send the streamed tokens of this step that were coalesced
+        for (auto & slot : slots) {
+            if (slot.is_processing() && slot.params.stream) {
+                flush_partial_response(slot, false);
+            }
+        }
 
-                if (slot.n_remaining > 0) {
-                    n_draft_max = std::min(n_draft_max, slot.n_remaining - 1);
-                }
+        SRV_DBG("%s", "run slots completed\n");
+    }
 
-                SLT_DBG(slot, "max possible draft: %d\n", n_draft_max);
+    json model_meta() const {
+        return json {
+            {"vocab_type",  llama_vocab_type       (vocab)},
+            {"n_vocab",     llama_vocab_n_tokens   (vocab)},
+            {"n_ctx_train", llama_model_n_ctx_train(model)},
+            {"n_embd",      llama_model_n_embd     (model)},
+            {"n_params",    llama_model_n_params   (model)},
+            {"size",        llama_model_size       (model)},
+        };
+    }
+};
 
-                if (n_draft_max < slot.params.speculative.n_min) {
-                    SLT_DBG(slot, "the max possible draft is too small: %d < %d - skipping speculative decoding\n", n_draft_max, slot.params.speculative.n_min);
+// cache-aware router (--router): each request is forwarded to the replica that holds the longest prefix of its text in its slots
+// the replicas report the server_prefix_hashes of their slots and their load with GET /cache-digest, polled every router_poll_ms
+struct server_router {
+    struct replica {
+        std::string url;
 
-                    continue;
-                }
+        bool alive = false;
 
-                llama_token id = slot.sampled;
+        // at the last poll
+        int n_slots = 0;
+        int n_busy  = 0; // processing slots and deferred requests
+        std::unordered_set<uint64_t> hashes;
 
-                struct common_speculative_params params_spec;
-                params_spec.n_draft   = n_draft_max;
-                params_spec.n_reuse   = llama_n_ctx(slot.ctx_dft) - slot.params.speculative.n_max;
-                params_spec.p_min     = slot.params.speculative.p_min;
+        int n_routed = 0; // requests sent since the last poll
 
-                const llama_tokens & cached_text_tokens = slot.cache_tokens.get_text_tokens();
-                llama_tokens draft = common_speculative_gen_draft(slot.spec, params_spec, cached_text_tokens, id);
+        int load() const {
+            return n_busy + n_routed;
+        }
+    };
 
-                // ignore small drafts
-                if (slot.params.speculative.n_min > (int) draft.size()) {
-                    SLT_DBG(slot, "ignoring small draft: %d < %d\n", (int) draft.size(), slot.params.speculative.n_min);
+    std::vector<replica> replicas;
 
-                    continue;
-                }
+    std::string api_prefix;
+    std::string api_key; // for the polls, the requests are forwarded with their own Authorization header
 
-                // keep track of total number of drafted tokens tested
-                slot.n_draft_total += draft.size();
+    int32_t poll_ms   = 500;
+    int32_t max_queue = 0;
 
-                // construct the speculation batch
-                common_batch_clear(slot.batch_spec);
-                common_batch_add  (slot.batch_spec, id, slot.n_past, { slot.id }, true);
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool running = false;
+    std::thread t_poll;
 
-                for (size_t i = 0; i < draft.size(); ++i) {
-                    common_batch_add(slot.batch_spec, draft[i], slot.n_past + 1 + i, { slot.id }, true);
-                }
+    size_t i_next = 0; // the replicas are visited from here, so that the ties are spread
+
+    void init(const common_params & params) {
+        for (const auto & url : params.router_replicas) {
+            replica r;
+            r.url = url;
+            replicas.push_back(std::move(r));
+        }
 
-                SLT_DBG(slot, "decoding speculative batch, size = %d\n", slot.batch_spec.n_tokens);
+        api_prefix = params.api_prefix;
+        api_key    = params.api_keys.empty() ? "" : params.api_keys[0];
+        poll_ms    = params.router_poll_ms;
+        max_queue  = params.router_max_queue;
+    }
 
-                llama_decode(ctx, slot.batch_spec);
+    void start() {
+        running = true;
+        t_poll = std::thread([this]() {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (running) {
+                lock.unlock();
+                poll();
+                lock.lock();
+                cv.wait_for(lock, std::chrono::milliseconds(poll_ms), [this]() { return !running; });
+            }
+        });
+    }
 
-                // the accepted tokens from the speculation
-                const auto ids = common_sampler_sample_and_accept_n(slot.smpl, ctx, draft);
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            running = false;
+        }
+        cv.notify_all();
+        if (t_poll.joinable()) {
+            t_poll.join();
+        }
+    }
 
-                slot.n_past    += ids.size();
-                slot.n_decoded += ids.size();
+    httplib::Headers poll_headers() const {
+        httplib::Headers headers;
+        if (!api_key.empty()) {
+            headers.emplace("Authorization", "Bearer " + api_key);
+        }
+        return headers;
+    }
 
-                // update how many tokens out of those tested were accepted
-                slot.n_draft_accepted += ids.size() - 1;
+    void poll() {
+        for (size_t i = 0; i < replicas.size(); i++) {
+            httplib::Client cli(replicas[i].url);
+            cli.set_connection_timeout(1);
+            cli.set_read_timeout(5);
 
-                slot.cache_tokens.push_back(id);
-                slot.cache_tokens.insert({ids.begin(), ids.end() - 1});
+            auto result = cli.Get(api_prefix + "/cache-digest", poll_headers());
 
-                llama_memory_seq_rm(llama_get_memory(ctx), slot.id, slot.n_past, -1);
+            json digest;
+            if (result && result->status == 200) {
+                try {
+                    digest = json::parse(result->body);
+                } catch (const std::exception &) {
+                    // reported below
+                }
+            }
 
-                for (size_t i = 0; i < ids.size(); ++i) {
-                    completion_token_output result;
+            const bool alive = digest.is_object() && json_value(digest, "block_size", 0) == SERVER_PREFIX_BLOCK;
 
-                    result.tok          = ids[i];
-                    result.text_to_send = common_token_to_piece(ctx, result.tok, accept_special_token(slot, result.tok));
-                    result.prob         = 1.0f; // set later
+            std::lock_guard<std::mutex> lock(mutex);
 
-                    // TODO: set result.probs
+            replica & r = replicas[i];
 
-                    if (!process_token(result, slot)) {
-                        // release slot because of stop condition
-                        slot.release();
-                        slot.print_timings();
-                        send_final_response(slot);
-                        metrics.on_prediction(slot);
-                        break;
-                    }
+            if (alive != r.alive) {
+                if (alive) {
+                    SRV_INF("replica %s is up, n_slots = %d\n", r.url.c_str(), json_value(digest, "n_slots", 0));
+                } else if (!result) {
+                    SRV_WRN("replica %s is down: %s\n", r.url.c_str(), httplib::to_string(result.error()).c_str());
+                } else {
+                    SRV_WRN("replica %s is down: status %d, it must be started with --cache-digest and the same version\n", r.url.c_str(), result->status);
                 }
+            }
 
-                SLT_DBG(slot, "accepted %d/%d draft tokens, new n_past = %d\n", (int) ids.size() - 1, (int) draft.size(), slot.n_past);
+            r.alive    = alive;
+            r.n_routed = 0;
+            if (!alive) {
+                r.hashes.clear();
+                continue;
+            }
+
+            r.n_slots = json_value(digest, "n_slots", 0);
+            r.n_busy  = json_value(digest, "requests_processing", 0) + json_value(digest, "requests_deferred", 0);
+            r.hashes.clear();
+            for (const auto & h : digest.at("prefix_hashes")) {
+                r.hashes.insert(h.get<uint64_t>());
             }
         }
+    }
 
-        SRV_DBG("%s", "run slots completed\n");
+    // the replica for a request with the given prefix hashes, -1 if none is alive:
+    // the longest cached prefix among the replicas with a free slot (or a short enough queue, see max_queue), then the least loaded one
+    int pick(const std::vector<uint64_t> & hashes) {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        int    best       = -1;
+        bool   best_fits  = false;
+        size_t best_match = 0;
+        float  best_load  = 0.0f;
+
+        for (size_t k = 0; k < replicas.size(); k++) {
+            const size_t i = (i_next + k) % replicas.size();
+            const replica & r = replicas[i];
+            if (!r.alive) {
+                continue;
+            }
+
+            size_t n_match = 0;
+            while (n_match < hashes.size() && r.hashes.count(hashes[n_match]) > 0) {
+                n_match++;
+            }
+
+            // waiting for a busy replica is only worth it to reuse its cache
+            const bool fits = r.load() < r.n_slots + (n_match > 0 ? max_queue : 0);
+            if (!fits) {
+                n_match = 0;
+            }
+
+            const float load = (float) r.load() / std::max(1, r.n_slots);
+
+            bool better;
+            if (best < 0) {
+                better = true;
+            } else if (fits != best_fits) {
+                better = fits;
+            } else if (n_match != best_match) {
+                better = n_match > best_match;
+            } else {
+                better = load < best_load;
+            }
+
+            if (better) {
+                best       = (int) i;
+                best_fits  = fits;
+                best_match = n_match;
+                best_load  = load;
+            }
+        }
+
+        if (best >= 0) {
+            replica & r = replicas[best];
+
+            SRV_DBG("routing to %s: %zu/%zu blocks cached, load = %d/%d\n", r.url.c_str(), best_match, hashes.size(), r.load(), r.n_slots);
+
+            // until the next poll, the requests that share this prefix go to the same replica
+            r.n_routed++;
+            r.hashes.insert(hashes.begin(), hashes.end());
+
+            i_next = best + 1;
+        }
+
+        return best;
     }
 
-    json model_meta() const {
-        return json {
-            {"vocab_type",  llama_vocab_type       (vocab)},
-            {"n_vocab",     llama_vocab_n_tokens   (vocab)},
-            {"n_ctx_train", llama_model_n_ctx_train(model)},
-            {"n_embd",      llama_model_n_embd     (model)},
-            {"n_params",    llama_model_n_params   (model)},
-            {"size",        llama_model_size       (model)},
-        };
+    void set_down(int i) {
+        std::lock_guard<std::mutex> lock(mutex);
+        replicas[i].alive = false;
+        replicas[i].hashes.clear();
     }
 };
 
@@ -3714,9 +8360,26 @@ int main(int argc, char ** argv) {
 
     common_init();
 
+    if (!params.models_swap.empty()) {
+        const bool has_spec = !params.speculative.model.path.empty() || params.speculative.ngram || params.speculative.lookahead > 0 || params.speculative.mtp ||
+            params.speculative.n_layer_exit > 0 || params.speculative.layer_skip_begin < params.speculative.layer_skip_end;
+        if (!params.mmproj.path.empty() || has_spec || !params.lora_adapters.empty()) {
+            LOG_ERR("%s: --model-swap is not supported with multimodal, speculative decoding or LoRA adapters\n", __func__);
+            return 1;
+        }
+
+        // the model loaded at startup can be swapped back in
+        params.models_swap[params.model_alias.empty() ? params.model.path : params.model_alias] = params.model.path;
+    }
+
     // struct that contains llama context and inference
     server_context ctx_server;
 
+    server_router router;
+    router.init(params);
+
+    ctx_server.params_swap = params;
+
     llama_backend_init();
     llama_numa_init(params.numa);
 
@@ -3753,6 +8416,9 @@ int main(int argc, char ** argv) {
         json final_response {{"error", error_data}};
         res.set_content(safe_json_to_str(final_response), MIMETYPE_JSON);
         res.status = json_value(error_data, "code", 500);
+        if (error_data.contains("retry_after")) {
+            res.set_header("Retry-After", std::to_string(json_value(error_data, "retry_after", 1)));
+        }
     };
 
     auto res_ok = [](httplib::Response & res, const json & data) {
@@ -3909,28 +8575,291 @@ int main(int argc, char ** argv) {
             ctx_server.queue_tasks.post(std::move(task), true); // high-priority task
         }
 
-        // get the result
-        server_task_result_ptr result = ctx_server.queue_results.recv(task_id);
-        ctx_server.queue_results.remove_waiting_task_id(task_id);
+        // get the result
+        server_task_result_ptr result = ctx_server.queue_results.recv(task_id);
+        ctx_server.queue_results.remove_waiting_task_id(task_id);
+
+        if (result->is_error()) {
+            res_error(res, result->to_json());
+            return;
+        }
+
+        // TODO: get rid of this dynamic_cast
+        auto res_metrics = dynamic_cast<server_task_result_metrics*>(result.get());
+        GGML_ASSERT(res_metrics != nullptr);
+
+        // optionally return "fail_on_no_slot" error
+        if (req.has_param("fail_on_no_slot")) {
+            if (res_metrics->n_idle_slots == 0) {
+                res_error(res, format_error_response("no slot available", ERROR_TYPE_UNAVAILABLE));
+                return;
+            }
+        }
+
+        res_ok(res, res_metrics->slots_data);
+    };
+
+    const auto handle_cache_digest = [&](const httplib::Request &, httplib::Response & res) {
+        if (!params.endpoint_cache_digest) {
+            res_error(res, format_error_response("This server does not support cache digest endpoint. Start it with `--cache-digest`", ERROR_TYPE_NOT_SUPPORTED));
+            return;
+        }
+
+        // request slots data using task queue
+        int task_id = ctx_server.queue_tasks.get_new_id();
+        {
+            server_task task(SERVER_TASK_TYPE_METRICS);
+            task.id = task_id;
+            ctx_server.queue_results.add_waiting_task_id(task_id);
+            ctx_server.queue_tasks.post(std::move(task), true); // high-priority task
+        }
+
+        // get the result
+        server_task_result_ptr result = ctx_server.queue_results.recv(task_id);
+        ctx_server.queue_results.remove_waiting_task_id(task_id);
+
+        if (result->is_error()) {
+            res_error(res, result->to_json());
+            return;
+        }
+
+        auto res_metrics = dynamic_cast<server_task_result_metrics*>(result.get());
+        GGML_ASSERT(res_metrics != nullptr);
+
+        res_ok(res, {
+            { "block_size",          SERVER_PREFIX_BLOCK },
+            { "n_slots",             res_metrics->n_idle_slots + res_metrics->n_processing_slots },
+            { "requests_processing", res_metrics->n_processing_slots },
+            { "requests_deferred",   res_metrics->n_tasks_deferred },
+            { "prefix_hashes",       res_metrics->prefix_hashes },
+        });
+    };
+
+    // evaluate a prompt for another server (--prefill-url), the KV cells are streamed as they are evaluated
+    const auto handle_prefill = [&](const httplib::Request & req, httplib::Response & res) {
+        if (!params.endpoint_prefill) {
+            res_error(res, format_error_response("This server does not support prefill endpoint. Start it with `--kv-prefill`", ERROR_TYPE_NOT_SUPPORTED));
+            return;
+        }
+
+        if (ctx_server.mctx) {
+            res_error(res, format_error_response("This server does not support prefill with multimodal", ERROR_TYPE_NOT_SUPPORTED));
+            return;
+        }
+
+        int task_id = -1;
+        try {
+            const json data = json::parse(req.body);
+
+            llama_tokens tokens = data.at("tokens").get<llama_tokens>();
+            const int32_t n_past = json_value(data, "n_past", 0);
+
+            if (tokens.empty() || n_past < 0 || n_past >= (int32_t) tokens.size()) {
+                throw std::runtime_error("\"n_past\" must be less than the number of tokens");
+            }
+
+            server_task task(SERVER_TASK_TYPE_PREFILL);
+            task.id                    = ctx_server.queue_tasks.get_new_id();
+            task.prompt_tokens         = server_tokens(tokens, false);
+            task.params.prefill_n_past = n_past;
+
+            task_id = task.id;
+            ctx_server.queue_results.add_waiting_task_id(task_id);
+            ctx_server.queue_tasks.post(std::move(task));
+        } catch (const std::exception & e) {
+            res_error(res, format_error_response(e.what(), ERROR_TYPE_INVALID_REQUEST));
+            return;
+        }
+
+        // the stream ends without the final chunk on error, the other server then evaluates the rest of the prompt
+        const auto chunked_content_provider = [task_id, &ctx_server](size_t, httplib::DataSink & sink) {
+            ctx_server.receive_cmpl_results_stream({ task_id }, [&](server_task_result_ptr & result) -> bool {
+                auto * chunk = dynamic_cast<server_task_result_kv_chunk*>(result.get());
+                GGML_ASSERT(chunk != nullptr);
+
+                return sink.write((const char *) chunk->data.data(), chunk->data.size());
+            }, [&](const json & error_data) {
+                SRV_WRN("prefill failed: %s\n", safe_json_to_str(error_data).c_str());
+            }, [&sink]() {
+                return !sink.is_writable();
+            });
+            sink.done();
+            return false;
+        };
+
+        auto on_complete = [task_id, &ctx_server] (bool) {
+            ctx_server.queue_results.remove_waiting_task_id(task_id);
+        };
+
+        res.set_chunked_content_provider(MIMETYPE_BINARY, chunked_content_provider, on_complete);
+    };
+
+    // pre-tokenized completions with the generated token ids streamed back in binary frames, see server_token_request
+    // the requests of a body are evaluated in parallel and their frames are interleaved in the response
+    const auto handle_token_stream = [&](const httplib::Request & req, httplib::Response & res) {
+        if (!params.endpoint_token_stream) {
+            res_error(res, format_error_response("This server does not support the token stream endpoint. Start it with `--token-stream`", ERROR_TYPE_NOT_SUPPORTED));
+            return;
+        }
+
+        if (ctx_server.mctx) {
+            res_error(res, format_error_response("This server does not support the token stream with multimodal", ERROR_TYPE_NOT_SUPPORTED));
+            return;
+        }
+
+        std::unordered_set<int> task_ids;
+        try {
+            const int32_t n_vocab = llama_vocab_n_tokens(ctx_server.vocab);
+
+            // the defaults of the server, shared by all the requests of the body
+            const slot_params defaults = server_task::params_from_json_cmpl(ctx_server.ctx, ctx_server.params_base, json::object());
+
+            std::vector<server_task> tasks;
+
+            size_t off = 0;
+            while (off < req.body.size()) {
+                server_token_request hdr;
+                if (req.body.size() - off < sizeof(hdr)) {
+                    throw std::runtime_error("truncated request frame");
+                }
+                memcpy(&hdr, req.body.data() + off, sizeof(hdr));
+                off += sizeof(hdr);
+
+                if (hdr.magic != SERVER_TOKEN_REQUEST_MAGIC) {
+                    throw std::runtime_error("invalid request frame magic");
+                }
+                if (hdr.n_tokens == 0 || (req.body.size() - off)/sizeof(llama_token) < hdr.n_tokens) {
+                    throw std::runtime_error("empty or truncated prompt in request frame");
+                }
+
+                llama_tokens tokens(hdr.n_tokens);
+                memcpy(tokens.data(), req.body.data() + off, hdr.n_tokens*sizeof(llama_token));
+                off += hdr.n_tokens*sizeof(llama_token);
+
+                for (const llama_token tok : tokens) {
+                    if (tok < 0 || tok >= n_vocab) {
+                        throw std::runtime_error(string_format("invalid token id %d in request frame %zu", tok, tasks.size()));
+                    }
+                }
+
+                server_task task(SERVER_TASK_TYPE_COMPLETION);
+                task.id            = ctx_server.queue_tasks.get_new_id();
+                task.index         = tasks.size();
+                task.prompt_tokens = server_tokens(tokens, false);
+                task.params        = defaults;
+
+                task.params.stream              = true;
+                task.params.return_text         = false;
+                task.params.post_sampling_probs = false;
+
+                if (hdr.n_predict >= 0) {
+                    task.params.n_predict = hdr.n_predict;
+                }
+                if (hdr.n_probs > 0) {
+                    task.params.sampling.n_probs = hdr.n_probs;
+                }
+                if (hdr.seed != LLAMA_DEFAULT_SEED) {
+                    task.params.sampling.seed = hdr.seed;
+                }
+                if (hdr.temperature >= 0.0f) {
+                    task.params.sampling.temp = hdr.temperature;
+                }
+                if (hdr.top_k >= 0) {
+                    task.params.sampling.top_k = hdr.top_k;
+                }
+                if (hdr.top_p >= 0.0f) {
+                    task.params.sampling.top_p = hdr.top_p;
+                }
+
+                tasks.push_back(std::move(task));
+            }
+
+            if (tasks.empty()) {
+                throw std::runtime_error("no request frame in the body");
+            }
+
+            task_ids = server_task::get_list_id(tasks);
+            ctx_server.queue_results.add_waiting_tasks(tasks);
+            ctx_server.queue_tasks.post(std::move(tasks));
+        } catch (const std::exception & e) {
+            res_error(res, format_error_response(e.what(), ERROR_TYPE_INVALID_REQUEST));
+            return;
+        }
+
+        const auto chunked_content_provider = [task_ids, &ctx_server](size_t, httplib::DataSink & sink) {
+            // the frame of a result, reused for all the results of the stream
+            std::string frame;
+
+            const auto append = [&frame](const void * data, size_t n) {
+                frame.append((const char *) data, n);
+            };
+
+            ctx_server.receive_cmpl_results_stream(task_ids, [&](server_task_result_ptr & result) -> bool {
+                server_token_result hdr = {};
+                hdr.magic = SERVER_TOKEN_RESULT_MAGIC;
+                hdr.index = result->get_index();
+
+                frame.assign(sizeof(hdr), 0);
+
+                if (auto * partial = dynamic_cast<server_task_result_cmpl_partial *>(result.get())) {
+                    hdr.n_tokens        = partial->tokens.size();
+                    hdr.n_prompt_tokens = partial->n_prompt_tokens;
+
+                    append(partial->tokens.data(), partial->tokens.size()*sizeof(llama_token));
+
+                    // the token probs are never coalesced, so there is one token
+                    const auto & prob_output = partial->prob_output;
+                    if (!prob_output.probs.empty() && hdr.n_tokens == 1) {
+                        hdr.flags  |= SERVER_TOKEN_RESULT_PROBS;
+                        hdr.n_probs = prob_output.probs.size();
+
+                        const float logprob = completion_token_output::logarithm(prob_output.prob);
+                        append(&logprob, sizeof(logprob));
+
+                        for (const auto & p : prob_output.probs) {
+                            const float p_logprob = completion_token_output::logarithm(p.prob);
+                            append(&p.tok,     sizeof(p.tok));
+                            append(&p_logprob, sizeof(p_logprob));
+                        }
+                    }
+                } else if (auto * res_final = dynamic_cast<server_task_result_cmpl_final *>(result.get())) {
+                    // the tokens were streamed by the partial results
+                    hdr.flags          |= SERVER_TOKEN_RESULT_FINAL;
+                    hdr.stop            = res_final->stop;
+                    hdr.n_prompt_tokens = res_final->n_prompt_tokens;
+                } else {
+                    return true;
+                }
+
+                hdr.n_bytes = frame.size() - sizeof(hdr);
+                memcpy(&frame[0], &hdr, sizeof(hdr));
 
-        if (result->is_error()) {
-            res_error(res, result->to_json());
-            return;
-        }
+                // sending fails when the HTTP connection is closed, the generation is then cancelled
+                return sink.write(frame.data(), frame.size());
+            }, [&](const json & error_data) {
+                const std::string err = safe_json_to_str(error_data);
 
-        // TODO: get rid of this dynamic_cast
-        auto res_metrics = dynamic_cast<server_task_result_metrics*>(result.get());
-        GGML_ASSERT(res_metrics != nullptr);
+                server_token_result hdr = {};
+                hdr.magic   = SERVER_TOKEN_RESULT_MAGIC;
+                hdr.flags   = SERVER_TOKEN_RESULT_ERROR;
+                hdr.n_bytes = err.size();
 
-        // optionally return "fail_on_no_slot" error
-        if (req.has_param("fail_on_no_slot")) {
-            if (res_metrics->n_idle_slots == 0) {
-                res_error(res, format_error_response("no slot available", ERROR_TYPE_UNAVAILABLE));
-                return;
-            }
-        }
+                frame.assign((const char *) &hdr, sizeof(hdr));
+                frame += err;
 
-        res_ok(res, res_metrics->slots_data);
+                sink.write(frame.data(), frame.size());
+            }, [&sink]() {
+                return !sink.is_writable();
+            });
+            sink.done();
+            return false;
+        };
+
+        auto on_complete = [task_ids, &ctx_server] (bool) {
+            ctx_server.queue_results.remove_waiting_task_ids(task_ids);
+        };
+
+        res.set_chunked_content_provider(MIMETYPE_BINARY, chunked_content_provider, on_complete);
     };
 
     const auto handle_metrics = [&](const httplib::Request &, httplib::Response & res) {
@@ -3987,6 +8916,14 @@ int main(int argc, char ** argv) {
                     {"name",  "n_busy_slots_per_decode"},
                     {"help",  "Average number of busy slots per llama_decode() call"},
                     {"value",  (float) res_metrics->n_busy_slots_total / std::max((float) res_metrics->n_decode_total, 1.f)}
+            }, {
+                    {"name",  "requests_rejected_kv_total"},
+                    {"help",  "Number of requests rejected because the KV cells of the waiting requests exceed --kv-queue-max."},
+                    {"value",  res_metrics->n_rejected_kv}
+            }, {
+                    {"name",  "update_slots_total"},
+                    {"help",  "Number of server loop iterations that decode a batch."},
+                    {"value",  res_metrics->n_update_slots_total}
             }}},
             {"gauge", {{
                     {"name",  "prompt_tokens_seconds"},
@@ -3996,6 +8933,14 @@ int main(int argc, char ** argv) {
                     {"name",  "predicted_tokens_seconds"},
                     {"help",  "Average generation throughput in tokens/s."},
                     {"value",  res_metrics->n_tokens_predicted ? 1.e3 / res_metrics->t_tokens_generation * res_metrics->n_tokens_predicted : 0.}
+            },{
+                    {"name",  "kv_cache_usage_ratio"},
+                    {"help",  "KV-cache usage. 1 means 100 percent usage."},
+                    {"value",  (double) res_metrics->n_kv_cache_tokens / std::max(res_metrics->n_ctx, 1)}
+            },{
+                    {"name",  "kv_cache_tokens"},
+                    {"help",  "KV-cache tokens."},
+                    {"value",  (uint64_t) res_metrics->n_kv_cache_tokens}
             },{
                     {"name",  "requests_processing"},
                     {"help",  "Number of requests processing."},
@@ -4004,9 +8949,42 @@ int main(int argc, char ** argv) {
                     {"name",  "requests_deferred"},
                     {"help",  "Number of requests deferred."},
                     {"value",  (uint64_t) res_metrics->n_tasks_deferred}
+            },{
+                    {"name",  "requests_suspended"},
+                    {"help",  "Number of requests suspended by a request with a higher priority."},
+                    {"value",  (uint64_t) res_metrics->n_slots_suspended}
             }}}
         };
 
+        // metrics with a value per priority class
+        json labeled_metrics_def = json::array();
+        {
+            json deferred = json::array();
+            json started  = json::array();
+            json wait     = json::array();
+
+            for (int i = 0; i < SERVER_TASK_PRIORITY_COUNT; ++i) {
+                const std::string label = std::string("priority=\"") + server_task_priority_name((server_task_priority) i) + "\"";
+
+                deferred.push_back({{"label", label}, {"value", res_metrics->n_tasks_deferred_prio[i]}});
+                started .push_back({{"label", label}, {"value", res_metrics->n_tasks_started_prio[i]}});
+                wait    .push_back({{"label", label}, {"value", res_metrics->t_tasks_wait_prio[i] / 1.e6}});
+            }
+
+            labeled_metrics_def.push_back({{"type", "gauge"},   {"name", "requests_deferred_by_priority"}, {"help", "Number of requests deferred per priority class."},                       {"values", deferred}});
+            labeled_metrics_def.push_back({{"type", "counter"}, {"name", "requests_started_total"},        {"help", "Number of requests started per priority class."},                        {"values", started}});
+            labeled_metrics_def.push_back({{"type", "counter"}, {"name", "requests_wait_seconds_total"},   {"help", "Total time spent by the requests in the queue before being started."}, {"values", wait}});
+
+            json stages = json::array({
+                {{"label", "stage=\"batch\""},  {"value", res_metrics->t_update_slots_batch  / 1.e6}},
+                {{"label", "stage=\"decode\""}, {"value", res_metrics->t_update_slots_decode / 1.e6}},
+                {{"label", "stage=\"sample\""}, {"value", res_metrics->t_update_slots_sample / 1.e6}},
+                {{"label", "stage=\"send\""},   {"value", res_metrics->t_update_slots_send   / 1.e6}},
+            });
+
+            labeled_metrics_def.push_back({{"type", "counter"}, {"name", "update_slots_seconds_total"}, {"help", "Total time spent in each stage of the server loop iterations that decode a batch."}, {"values", stages}});
+        }
+
         std::stringstream prometheus;
 
         for (const auto & el : all_metrics_def.items()) {
@@ -4024,6 +9002,32 @@ int main(int argc, char ** argv) {
             }
         }
 
+        for (const auto & metric_def : labeled_metrics_def) {
+            const std::string type = metric_def.at("type");
+            const std::string name = metric_def.at("name");
+            const std::string help = metric_def.at("help");
+
+            prometheus << "# HELP llamacpp:" << name << " " << help << "\n"
+                       << "# TYPE llamacpp:" << name << " " << type << "\n";
+
+            for (const auto & v : metric_def.at("values")) {
+                const std::string label = v.at("label");
+                auto value = json_value(v, "value", 0.);
+                prometheus << "llamacpp:" << name << "{" << label << "} " << value << "\n";
+            }
+        }
+
+        res_metrics->h_queue_wait.to_prometheus(prometheus, "request_queue_wait_seconds",     "Time spent by the requests in the queue before being started.");
+        res_metrics->h_ttft      .to_prometheus(prometheus, "time_to_first_token_seconds",    "Time from posting a request to sampling its first token.");
+        res_metrics->h_token     .to_prometheus(prometheus, "time_per_output_token_seconds",  "Time between two generated tokens of a request.");
+        res_metrics->h_sampling  .to_prometheus(prometheus, "sampling_seconds",               "Time to sample the tokens of the slots of a batch.");
+        res_metrics->h_detokenize.to_prometheus(prometheus, "detokenize_seconds",             "Time to convert a generated token to text.");
+
+        {
+            std::lock_guard<std::mutex> lock(ctx_server.mutex_http_write);
+            ctx_server.h_http_write.to_prometheus(prometheus, "http_write_seconds", "Time to write a streamed event to the HTTP connection.");
+        }
+
         res.set_header("Process-Start-Time-Unix", std::to_string(res_metrics->t_start));
 
         res.set_content(prometheus.str(), "text/plain; version=0.0.4");
@@ -4220,11 +9224,13 @@ int main(int argc, char ** argv) {
             const std::vector<raw_buffer> & files,
             const std::function<bool()> & is_connection_closed,
             httplib::Response & res,
-            oaicompat_type oaicompat) -> void {
+            oaicompat_type oaicompat,
+            const std::string & prefix_text) -> void {
         GGML_ASSERT(type == SERVER_TASK_TYPE_COMPLETION || type == SERVER_TASK_TYPE_INFILL);
 
         auto completion_id = gen_chatcmplid();
         std::unordered_set<int> task_ids;
+        const int n_cmpl = json_value(data, "n", 1);
         try {
             std::vector<server_task> tasks;
 
@@ -4277,33 +9283,52 @@ int main(int argc, char ** argv) {
                 inputs.push_back(std::move(tmp));
             } else {
                 // non-multimodal version
-                auto tokenized_prompts = tokenize_input_prompts(ctx_server.vocab, prompt, true, true);
+                auto tokenized_prompts = tokenize_input_prompts(ctx_server.vocab, prompt, true, true, 1, &ctx_server.tokenize_cache);
                 for (auto & p : tokenized_prompts) {
                     auto tmp = server_tokens(p, ctx_server.mctx != nullptr);
                     inputs.push_back(std::move(tmp));
                 }
             }
 
-            tasks.reserve(inputs.size());
-            for (size_t i = 0; i < inputs.size(); i++) {
-                server_task task = server_task(type);
+            // number of completions of each prompt (OAI "n"), each in its own slot
+            // the tasks of a prompt are launched together, so that with a unified KV cache their prompt tokens are
+            // evaluated once and shared by all their sequences (see batch_prompt_run)
+            if (n_cmpl < 1 || n_cmpl > ctx_server.params_base.n_parallel) {
+                throw std::runtime_error(string_format("n must be between 1 and the number of slots (%d)", ctx_server.params_base.n_parallel));
+            }
 
-                task.id    = ctx_server.queue_tasks.get_new_id();
-                task.index = i;
+            tasks.reserve(inputs.size() * n_cmpl);
+            for (size_t i = 0; i < inputs.size(); i++) {
+                for (int j = 0; j < n_cmpl; j++) {
+                    server_task task = server_task(type);
+
+                    task.id    = ctx_server.queue_tasks.get_new_id();
+                    task.index = i*n_cmpl + j;
+
+                    task.prompt_tokens    = j + 1 < n_cmpl ? inputs[i].clone() : std::move(inputs[i]);
+                    task.params           = server_task::params_from_json_cmpl(
+                            ctx_server.ctx,
+                            ctx_server.params_base,
+                            data);
+                    task.id_selected_slot = json_value(data, "id_slot", -1);
+
+                    // a fixed seed would give n identical completions
+                    if (task.params.sampling.seed != LLAMA_DEFAULT_SEED) {
+                        task.params.sampling.seed += j;
+                    }
 
-                task.prompt_tokens    = std::move(inputs[i]);
-                task.params           = server_task::params_from_json_cmpl(
-                        ctx_server.ctx,
-                        ctx_server.params_base,
-                        data);
-                task.id_selected_slot = json_value(data, "id_slot", -1);
+                    // OAI-compat
+                    task.params.oaicompat                 = oaicompat;
+                    task.params.oaicompat_cmpl_id         = completion_id;
+                    // oaicompat_model is already populated by params_from_json_cmpl
 
-                // OAI-compat
-                task.params.oaicompat                 = oaicompat;
-                task.params.oaicompat_cmpl_id         = completion_id;
-                // oaicompat_model is already populated by params_from_json_cmpl
+                    // the text of a request with several prompts is not the prefix of any of them
+                    if (inputs.size() == 1) {
+                        task.params.prefix_text = prefix_text;
+                    }
 
-                tasks.push_back(std::move(task));
+                    tasks.push_back(std::move(task));
+                }
             }
 
             task_ids = server_task::get_list_id(tasks);
@@ -4321,6 +9346,9 @@ int main(int argc, char ** argv) {
                 if (results.size() == 1) {
                     // single result
                     res_ok(res, results[0]->to_json());
+                } else if (oaicompat != OAICOMPAT_TYPE_NONE && n_cmpl > 1) {
+                    // multiple choices, in a single response
+                    res_ok(res, merge_oaicompat_choices(results, n_cmpl));
                 } else {
                     // multiple results (multitask)
                     json arr = json::array();
@@ -4336,19 +9364,39 @@ int main(int argc, char ** argv) {
             ctx_server.queue_results.remove_waiting_task_ids(task_ids);
         } else {
             const auto chunked_content_provider = [task_ids, &ctx_server, oaicompat](size_t, httplib::DataSink & sink) {
+                // the events of a result, reused for all the results of the stream
+                std::string events;
+
                 ctx_server.receive_cmpl_results_stream(task_ids, [&](server_task_result_ptr & result) -> bool {
-                    json res_json = result->to_json();
-                    if (res_json.is_array()) {
-                        for (const auto & res : res_json) {
-                            if (!server_sent_event(sink, "data", res)) {
-                                // sending failed (HTTP connection closed), cancel the generation
-                                return false;
+                    events.clear();
+                    if (!result->to_sse_data(events)) {
+                        json res_json = result->to_json();
+                        if (res_json.is_array()) {
+                            for (const auto & res : res_json) {
+                                server_sent_event_append(events, "data", res);
                             }
+                        } else {
+                            server_sent_event_append(events, "data", res_json);
                         }
+                    }
+
+                    LOG_DBG("data stream, to_send: %s", events.c_str());
+
+                    if (events.empty()) {
                         return true;
-                    } else {
-                        return server_sent_event(sink, "data", res_json);
                     }
+
+                    const int64_t t_write = ggml_time_us();
+
+                    // sending fails when the HTTP connection is closed, the generation is then cancelled
+                    const bool ok = sink.write(events.data(), events.size());
+
+                    {
+                        std::lock_guard<std::mutex> lock(ctx_server.mutex_http_write);
+                        ctx_server.h_http_write.observe((ggml_time_us() - t_write) / 1e6);
+                    }
+
+                    return ok;
                 }, [&](const json & error_data) {
                     server_sent_event(sink, "error", error_data);
                 }, [&sink]() {
@@ -4374,17 +9422,20 @@ int main(int argc, char ** argv) {
     const auto handle_completions = [&handle_completions_impl](const httplib::Request & req, httplib::Response & res) {
         json data = json::parse(req.body);
         std::vector<raw_buffer> files; // dummy
+        const std::string prefix_text = server_prefix_text(data);
         handle_completions_impl(
             SERVER_TASK_TYPE_COMPLETION,
             data,
             files,
             req.is_connection_closed,
             res,
-            OAICOMPAT_TYPE_NONE);
+            OAICOMPAT_TYPE_NONE,
+            prefix_text);
     };
 
     const auto handle_completions_oai = [&handle_completions_impl](const httplib::Request & req, httplib::Response & res) {
-        json data = oaicompat_completion_params_parse(json::parse(req.body));
+        json body = json::parse(req.body);
+        json data = oaicompat_completion_params_parse(body);
         std::vector<raw_buffer> files; // dummy
         handle_completions_impl(
             SERVER_TASK_TYPE_COMPLETION,
@@ -4392,7 +9443,8 @@ int main(int argc, char ** argv) {
             files,
             req.is_connection_closed,
             res,
-            OAICOMPAT_TYPE_COMPLETION);
+            OAICOMPAT_TYPE_COMPLETION,
+            server_prefix_text(body));
     };
 
     const auto handle_infill = [&ctx_server, &res_error, &handle_completions_impl](const httplib::Request & req, httplib::Response & res) {
@@ -4414,6 +9466,8 @@ int main(int argc, char ** argv) {
 
         json data = json::parse(req.body);
 
+        const std::string prefix_text = server_prefix_text(data);
+
         // validate input
         if (data.contains("prompt") && !data.at("prompt").is_string()) {
             // prompt is optional
@@ -4471,13 +9525,15 @@ int main(int argc, char ** argv) {
             files,
             req.is_connection_closed,
             res,
-            OAICOMPAT_TYPE_NONE); // infill is not OAI compatible
+            OAICOMPAT_TYPE_NONE, // infill is not OAI compatible
+            prefix_text);
     };
 
     const auto handle_chat_completions = [&ctx_server, &handle_completions_impl](const httplib::Request & req, httplib::Response & res) {
         LOG_DBG("request: %s\n", req.body.c_str());
 
         auto body = json::parse(req.body);
+        const std::string prefix_text = server_prefix_text(body); // before the parser rewrites the messages
         std::vector<raw_buffer> files;
         json data = oaicompat_chat_params_parse(
             body,
@@ -4490,7 +9546,8 @@ int main(int argc, char ** argv) {
             files,
             req.is_connection_closed,
             res,
-            OAICOMPAT_TYPE_CHAT);
+            OAICOMPAT_TYPE_CHAT,
+            prefix_text);
     };
 
     // same with handle_chat_completions, but without inference part
@@ -4507,43 +9564,56 @@ int main(int argc, char ** argv) {
     const auto handle_models = [&params, &ctx_server, &state, &res_ok](const httplib::Request &, httplib::Response & res) {
         server_state current_state = state.load();
         json model_meta = nullptr;
+        std::string model_name = params.model_alias.empty() ? params.model.path : params.model_alias;
         if (current_state == SERVER_STATE_READY) {
             model_meta = ctx_server.model_meta();
+            model_name = ctx_server.model_name();
+        }
+
+        // the loaded model goes first
+        std::vector<std::string> names = { model_name };
+        for (const auto & it : params.models_swap) {
+            if (it.first != model_name) {
+                names.push_back(it.first);
+            }
+        }
+
+        json models_ollama = json::array();
+        json models_oai    = json::array();
+        for (const auto & name : names) {
+            models_ollama.push_back({
+                {"name", name},
+                {"model", name},
+                {"modified_at", ""},
+                {"size", ""},
+                {"digest", ""}, // dummy value, llama.cpp does not support managing model file's hash
+                {"type", "model"},
+                {"description", ""},
+                {"tags", {""}},
+                {"capabilities", {"completion"}},
+                {"parameters", ""},
+                {"details", {
+                    {"parent_model", ""},
+                    {"format", "gguf"},
+                    {"family", ""},
+                    {"families", {""}},
+                    {"parameter_size", ""},
+                    {"quantization_level", ""}
+                }}
+            });
+            models_oai.push_back({
+                {"id",       name},
+                {"object",   "model"},
+                {"created",  std::time(0)},
+                {"owned_by", "llamacpp"},
+                {"meta",     name == model_name ? model_meta : json(nullptr)},
+            });
         }
 
         json models = {
-            {"models", {
-                {
-                    {"name", params.model_alias.empty() ? params.model.path : params.model_alias},
-                    {"model", params.model_alias.empty() ? params.model.path : params.model_alias},
-                    {"modified_at", ""},
-                    {"size", ""},
-                    {"digest", ""}, // dummy value, llama.cpp does not support managing model file's hash
-                    {"type", "model"},
-                    {"description", ""},
-                    {"tags", {""}},
-                    {"capabilities", {"completion"}},
-                    {"parameters", ""},
-                    {"details", {
-                        {"parent_model", ""},
-                        {"format", "gguf"},
-                        {"family", ""},
-                        {"families", {""}},
-                        {"parameter_size", ""},
-                        {"quantization_level", ""}
-                    }}
-                }
-            }},
+            {"models", models_ollama},
             {"object", "list"},
-            {"data", {
-                {
-                    {"id",       params.model_alias.empty() ? params.model.path : params.model_alias},
-                    {"object",   "model"},
-                    {"created",  std::time(0)},
-                    {"owned_by", "llamacpp"},
-                    {"meta",     model_meta},
-                },
-            }}
+            {"data",   models_oai},
         };
 
         res_ok(res, models);
@@ -4596,7 +9666,7 @@ int main(int argc, char ** argv) {
         std::string content;
         if (body.count("tokens") != 0) {
             const llama_tokens tokens = body.at("tokens");
-            content = tokens_to_str(ctx_server.ctx, tokens.cbegin(), tokens.cend());
+            content = tokens_to_str(ctx_server.ctx, tokens);
         }
 
         const json data = format_detokenized_response(content);
@@ -4628,18 +9698,29 @@ int main(int argc, char ** argv) {
             return;
         }
 
+        // binary responses contain the raw pooled embeddings, see format_embeddings_binary()
+        const bool use_binary = req.get_header_value("Accept").find(MIMETYPE_BINARY) != std::string::npos;
+
         bool use_base64 = false;
+        bool use_f16    = false;
         if (body.count("encoding_format") != 0) {
             const std::string& format = body.at("encoding_format");
             if (format == "base64") {
                 use_base64 = true;
+            } else if (format == "f16" && use_binary) {
+                use_f16 = true;
             } else if (format != "float") {
-                res_error(res, format_error_response("The format to return the embeddings in. Can be either float or base64", ERROR_TYPE_INVALID_REQUEST));
+                res_error(res, format_error_response("The format to return the embeddings in. Can be either float or base64 (or f16 for binary responses)", ERROR_TYPE_INVALID_REQUEST));
                 return;
             }
         }
 
-        auto tokenized_prompts = tokenize_input_prompts(ctx_server.vocab, prompt, true, true);
+        if (use_binary && llama_pooling_type(ctx_server.ctx) == LLAMA_POOLING_TYPE_NONE) {
+            res_error(res, format_error_response("Binary responses require pooled embeddings. Please use a different pooling type", ERROR_TYPE_INVALID_REQUEST));
+            return;
+        }
+
+        auto tokenized_prompts = tokenize_input_prompts(ctx_server.vocab, prompt, true, true, ctx_server.params_base.cpuparams.n_threads);
         for (const auto & tokens : tokenized_prompts) {
             // this check is necessary for models that do not add BOS token to the input
             if (tokens.empty()) {
@@ -4658,6 +9739,7 @@ int main(int argc, char ** argv) {
 
         // create and queue the task
         json responses = json::array();
+        std::vector<server_task_result_ptr> results_binary;
         bool error = false;
         std::unordered_set<int> task_ids;
         {
@@ -4683,6 +9765,11 @@ int main(int argc, char ** argv) {
 
         // get the result
         ctx_server.receive_multi_results(task_ids, [&](std::vector<server_task_result_ptr> & results) {
+            if (use_binary) {
+                // the embeddings are written directly into the response, without JSON nodes
+                results_binary = std::move(results);
+                return;
+            }
             for (auto & res : results) {
                 GGML_ASSERT(dynamic_cast<server_task_result_embd*>(res.get()) != nullptr);
                 responses.push_back(res->to_json());
@@ -4698,6 +9785,11 @@ int main(int argc, char ** argv) {
             return;
         }
 
+        if (use_binary) {
+            format_embeddings_binary(res, results_binary, use_f16);
+            return;
+        }
+
         // write JSON response
         json root = oaicompat == OAICOMPAT_TYPE_EMBEDDING
             ? format_embeddings_response_oaicompat(body, responses, use_base64)
@@ -4713,6 +9805,159 @@ int main(int argc, char ** argv) {
         handle_embeddings_impl(req, res, OAICOMPAT_TYPE_EMBEDDING);
     };
 
+    // the vector index stores the pooled embeddings, returns false and sets the error response if they are not available
+    const auto check_vector_index = [&ctx_server, &res_error](httplib::Response & res) {
+        if (!ctx_server.params_base.embedding) {
+            res_error(res, format_error_response("This server does not support the vector index. Start it with `--embeddings`", ERROR_TYPE_NOT_SUPPORTED));
+            return false;
+        }
+
+        const enum llama_pooling_type pooling_type = llama_pooling_type(ctx_server.ctx);
+        if (pooling_type == LLAMA_POOLING_TYPE_NONE || pooling_type == LLAMA_POOLING_TYPE_RANK) {
+            res_error(res, format_error_response("The vector index requires pooled embeddings. Please use a different pooling type", ERROR_TYPE_NOT_SUPPORTED));
+            return false;
+        }
+
+        if (ctx_server.vector_index.n_embd() != llama_model_n_embd(ctx_server.model)) {
+            res_error(res, format_error_response("The embeddings of the loaded model do not match the vector index", ERROR_TYPE_INVALID_REQUEST));
+            return false;
+        }
+
+        return true;
+    };
+
+    // compute the normalized pooled embeddings of the prompts, returns false and sets the error response on failure
+    const auto compute_embeddings = [&ctx_server, &res_error](const json & prompt, const httplib::Request & req, httplib::Response & res, std::vector<std::vector<float>> & embd) {
+        auto tokenized_prompts = tokenize_input_prompts(ctx_server.vocab, prompt, true, true, ctx_server.params_base.cpuparams.n_threads);
+        for (const auto & tokens : tokenized_prompts) {
+            if (tokens.empty()) {
+                res_error(res, format_error_response("Input content cannot be empty", ERROR_TYPE_INVALID_REQUEST));
+                return false;
+            }
+        }
+
+        bool error = false;
+        std::unordered_set<int> task_ids;
+        {
+            std::vector<server_task> tasks;
+            for (size_t i = 0; i < tokenized_prompts.size(); i++) {
+                server_task task = server_task(SERVER_TASK_TYPE_EMBEDDING);
+
+                task.id            = ctx_server.queue_tasks.get_new_id();
+                task.index         = i;
+                task.prompt_tokens = server_tokens(tokenized_prompts[i], ctx_server.mctx != nullptr);
+
+                task.params.embd_normalize = 2;
+
+                tasks.push_back(std::move(task));
+            }
+
+            task_ids = server_task::get_list_id(tasks);
+            ctx_server.queue_results.add_waiting_tasks(tasks);
+            ctx_server.queue_tasks.post(std::move(tasks));
+        }
+
+        ctx_server.receive_multi_results(task_ids, [&](std::vector<server_task_result_ptr> & results) {
+            for (auto & result : results) {
+                embd.push_back(std::move(static_cast<server_task_result_embd *>(result.get())->embedding[0]));
+            }
+        }, [&](const json & error_data) {
+            res_error(res, error_data);
+            error = true;
+        }, req.is_connection_closed);
+
+        ctx_server.queue_results.remove_waiting_task_ids(task_ids);
+
+        return !error && embd.size() == tokenized_prompts.size();
+    };
+
+    const auto handle_index_add = [&ctx_server, &res_error, &res_ok, &check_vector_index, &compute_embeddings](const httplib::Request & req, httplib::Response & res) {
+        if (!check_vector_index(res)) {
+            return;
+        }
+
+        const json body = json::parse(req.body);
+        if (!body.contains("content")) {
+            res_error(res, format_error_response("\"content\" must be provided", ERROR_TYPE_INVALID_REQUEST));
+            return;
+        }
+
+        std::vector<std::vector<float>> embd;
+        if (!compute_embeddings(body.at("content"), req, res, embd)) {
+            return;
+        }
+
+        const std::vector<int64_t> ids = ctx_server.vector_index.add(embd);
+
+        res_ok(res, {
+            { "ids",       ids },
+            { "n_vectors", ctx_server.vector_index.size() },
+        });
+    };
+
+    const auto handle_index_save = [&ctx_server, &res_error, &res_ok, &check_vector_index](const httplib::Request &, httplib::Response & res) {
+        if (!check_vector_index(res)) {
+            return;
+        }
+
+        if (ctx_server.vector_index.path.empty()) {
+            res_error(res, format_error_response("This server has no vector index file. Start it with `--vector-index`", ERROR_TYPE_NOT_SUPPORTED));
+            return;
+        }
+
+        const int64_t t_start = ggml_time_us();
+
+        if (!ctx_server.vector_index.save()) {
+            res_error(res, format_error_response("failed to save the vector index", ERROR_TYPE_SERVER));
+            return;
+        }
+
+        res_ok(res, {
+            { "filename",  ctx_server.vector_index.path },
+            { "n_vectors", ctx_server.vector_index.size() },
+            { "t_ms",      (ggml_time_us() - t_start) / 1000.0 },
+        });
+    };
+
+    const auto handle_search = [&ctx_server, &params, &res_error, &res_ok, &check_vector_index, &compute_embeddings](const httplib::Request & req, httplib::Response & res) {
+        if (!check_vector_index(res)) {
+            return;
+        }
+
+        const json body = json::parse(req.body);
+
+        std::vector<float> query;
+        if (body.contains("embedding")) {
+            query = body.at("embedding").get<std::vector<float>>();
+            if ((int) query.size() != ctx_server.vector_index.n_embd()) {
+                res_error(res, format_error_response(string_format("\"embedding\" must have %d elements", ctx_server.vector_index.n_embd()), ERROR_TYPE_INVALID_REQUEST));
+                return;
+            }
+        } else if (body.contains("query") && body.at("query").is_string()) {
+            std::vector<std::vector<float>> embd;
+            if (!compute_embeddings(body.at("query"), req, res, embd)) {
+                return;
+            }
+            query = std::move(embd[0]);
+        } else {
+            res_error(res, format_error_response("\"query\" (string) or \"embedding\" must be provided", ERROR_TYPE_INVALID_REQUEST));
+            return;
+        }
+
+        const int top_k = json_value(body, "top_k", 5);
+        const int ef    = json_value(body, "ef",    params.vector_index_ef);
+
+        json results = json::array();
+        for (const auto & r : ctx_server.vector_index.search(query.data(), top_k, ef)) {
+            results.push_back({
+                { "id",    r.id },
+                { "score", r.score },
+            });
+        }
+
+        res_ok(res, { { "results", results } });
+    };
+
     const auto handle_rerank = [&ctx_server, &res_error, &res_ok](const httplib::Request & req, httplib::Response & res) {
         if (!ctx_server.params_base.embedding || ctx_server.params_base.pooling_type != LLAMA_POOLING_TYPE_RANK) {
             res_error(res, format_error_response("This server does not support reranking. Start it with `--reranking`", ERROR_TYPE_NOT_SUPPORTED));
@@ -4762,7 +10007,7 @@ int main(int argc, char ** argv) {
         std::unordered_set<int> task_ids;
         {
             std::vector<server_task> tasks;
-            auto tokenized_docs = tokenize_input_prompts(ctx_server.vocab, documents, /* add_special */ false, true);
+            auto tokenized_docs = tokenize_input_prompts(ctx_server.vocab, documents, /* add_special */ false, true, ctx_server.params_base.cpuparams.n_threads);
             tasks.reserve(tokenized_docs.size());
             for (size_t i = 0; i < tokenized_docs.size(); i++) {
                 auto tmp = format_rerank(ctx_server.vocab, tokenized_query, tokenized_docs[i]);
@@ -4846,6 +10091,141 @@ int main(int argc, char ** argv) {
         res_ok(res, result->to_json());
     };
 
+    // serve the request with the model named in its "model" field (params.models_swap)
+    const auto with_model = [&ctx_server, &params](httplib::Server::Handler handler) -> httplib::Server::Handler {
+        if (params.models_swap.empty()) {
+            return handler;
+        }
+
+        return [&ctx_server, handler](const httplib::Request & req, httplib::Response & res) {
+            std::string name;
+            if (!req.body.empty()) {
+                try {
+                    name = json_value(json::parse(req.body), "model", std::string());
+                } catch (const std::exception &) {
+                    // the handler reports the invalid body
+                }
+            }
+
+            auto lock = ctx_server.acquire_model(name);
+
+            handler(req, res);
+
+            // a streamed response is written after the handler returns, keep the model until it is destroyed
+            if (res.content_provider_) {
+                res.content_provider_resource_releaser_ = [releaser = std::move(res.content_provider_resource_releaser_), lock](bool success) {
+                    if (releaser) {
+                        releaser(success);
+                    }
+                };
+            }
+        };
+    };
+
+    // router mode: forward the request to the replica chosen by server_router::pick
+    const auto handle_router = [&router, &params, &res_error](const httplib::Request & req, httplib::Response & res) {
+        std::vector<uint64_t> hashes;
+        bool stream = false;
+        if (req.method == "POST" && !req.body.empty()) {
+            try {
+                const json body = json::parse(req.body);
+                if (body.is_object()) {
+                    hashes = server_prefix_hashes(server_prefix_text(body));
+                    stream = json_value(body, "stream", false);
+                }
+            } catch (const std::exception &) {
+                // the replica reports the invalid body
+            }
+        }
+
+        httplib::Request fwd;
+        fwd.method = req.method;
+        fwd.path   = req.path;
+        fwd.params = req.params;
+        fwd.body   = req.body;
+        for (const char * name : { "Authorization", "Content-Type" }) {
+            if (req.has_header(name)) {
+                fwd.set_header(name, req.get_header_value(name));
+            }
+        }
+
+        const auto make_client = [&params](const std::string & url) {
+            auto cli = std::make_shared<httplib::Client>(url);
+            cli->set_connection_timeout(5);
+            cli->set_read_timeout (params.timeout_read);
+            cli->set_write_timeout(params.timeout_write);
+            return cli;
+        };
+
+        if (!stream) {
+            // a replica that cannot be reached is skipped until it answers a poll again
+            for (size_t n_try = 0; n_try < router.replicas.size(); n_try++) {
+                const int i = router.pick(hashes);
+                if (i < 0) {
+                    break;
+                }
+
+                auto result = make_client(router.replicas[i].url)->send(fwd);
+                if (!result) {
+                    SRV_WRN("replica %s failed: %s\n", router.replicas[i].url.c_str(), httplib::to_string(result.error()).c_str());
+                    router.set_down(i);
+                    continue;
+                }
+
+                res.status = result->status;
+                res.set_content(result->body, result->get_header_value("Content-Type"));
+                return;
+            }
+
+            res_error(res, format_error_response("no replica available", ERROR_TYPE_UNAVAILABLE));
+            return;
+        }
+
+        const int i = router.pick(hashes);
+        if (i < 0) {
+            res_error(res, format_error_response("no replica available", ERROR_TYPE_UNAVAILABLE));
+            return;
+        }
+
+        // the events are forwarded as they come, a client that disconnects aborts the request to the replica
+        auto cli = make_client(router.replicas[i].url);
+        res.set_chunked_content_provider("text/event-stream", [&router, i, cli, fwd](size_t, httplib::DataSink & sink) mutable {
+            int status = 0;
+            std::string error_body;
+
+            fwd.response_handler = [&status](const httplib::Response & r) {
+                status = r.status;
+                return true;
+            };
+            fwd.content_receiver = [&](const char * data, size_t n, uint64_t, uint64_t) {
+                if (status != 200) {
+                    error_body.append(data, n);
+                    return true;
+                }
+                return sink.write(data, n);
+            };
+
+            auto result = cli->send(fwd);
+            if (!result) {
+                if (sink.is_writable()) {
+                    router.set_down(i);
+                    server_sent_event(sink, "error", format_error_response("replica failed: " + httplib::to_string(result.error()), ERROR_TYPE_UNAVAILABLE));
+                }
+            } else if (status != 200) {
+                json error = format_error_response(error_body, ERROR_TYPE_SERVER);
+                try {
+                    error = json::parse(error_body).at("error");
+                } catch (const std::exception &) {
+                    // not a json error, sent as is
+                }
+                server_sent_event(sink, "error", error);
+            }
+
+            sink.done();
+            return false;
+        });
+    };
+
     //
     // Router
     //
@@ -4878,38 +10258,51 @@ int main(int argc, char ** argv) {
         }
     }
 
+    if (!params.router_replicas.empty()) {
+        // registered first, these routes take over all the API routes below
+        svr->Get (params.api_prefix + "/health",          handle_health);
+        svr->Get (params.api_prefix + "/.*",              handle_router);
+        svr->Post(params.api_prefix + "/.*",              handle_router);
+    }
+
     // register API routes
     svr->Get (params.api_prefix + "/health",              handle_health); // public endpoint (no API key check)
-    svr->Get (params.api_prefix + "/metrics",             handle_metrics);
-    svr->Get (params.api_prefix + "/props",               handle_props);
-    svr->Post(params.api_prefix + "/props",               handle_props_change);
-    svr->Post(params.api_prefix + "/api/show",            handle_api_show);
-    svr->Get (params.api_prefix + "/models",              handle_models); // public endpoint (no API key check)
-    svr->Get (params.api_prefix + "/v1/models",           handle_models); // public endpoint (no API key check)
-    svr->Get (params.api_prefix + "/api/tags",            handle_models); // ollama specific endpoint. public endpoint (no API key check)
-    svr->Post(params.api_prefix + "/completion",          handle_completions); // legacy
-    svr->Post(params.api_prefix + "/completions",         handle_completions);
-    svr->Post(params.api_prefix + "/v1/completions",      handle_completions_oai);
-    svr->Post(params.api_prefix + "/chat/completions",    handle_chat_completions);
-    svr->Post(params.api_prefix + "/v1/chat/completions", handle_chat_completions);
-    svr->Post(params.api_prefix + "/api/chat",            handle_chat_completions); // ollama specific endpoint
-    svr->Post(params.api_prefix + "/infill",              handle_infill);
-    svr->Post(params.api_prefix + "/embedding",           handle_embeddings); // legacy
-    svr->Post(params.api_prefix + "/embeddings",          handle_embeddings);
-    svr->Post(params.api_prefix + "/v1/embeddings",       handle_embeddings_oai);
-    svr->Post(params.api_prefix + "/rerank",              handle_rerank);
-    svr->Post(params.api_prefix + "/reranking",           handle_rerank);
-    svr->Post(params.api_prefix + "/v1/rerank",           handle_rerank);
-    svr->Post(params.api_prefix + "/v1/reranking",        handle_rerank);
-    svr->Post(params.api_prefix + "/tokenize",            handle_tokenize);
-    svr->Post(params.api_prefix + "/detokenize",          handle_detokenize);
-    svr->Post(params.api_prefix + "/apply-template",      handle_apply_template);
+    svr->Get (params.api_prefix + "/metrics",             with_model(handle_metrics));
+    svr->Get (params.api_prefix + "/props",               with_model(handle_props));
+    svr->Post(params.api_prefix + "/props",               with_model(handle_props_change));
+    svr->Post(params.api_prefix + "/api/show",            with_model(handle_api_show));
+    svr->Get (params.api_prefix + "/models",              with_model(handle_models)); // public endpoint (no API key check)
+    svr->Get (params.api_prefix + "/v1/models",           with_model(handle_models)); // public endpoint (no API key check)
+    svr->Get (params.api_prefix + "/api/tags",            with_model(handle_models)); // ollama specific endpoint. public endpoint (no API key check)
+    svr->Post(params.api_prefix + "/completion",          with_model(handle_completions)); // legacy
+    svr->Post(params.api_prefix + "/completions",         with_model(handle_completions));
+    svr->Post(params.api_prefix + "/v1/completions",      with_model(handle_completions_oai));
+    svr->Post(params.api_prefix + "/chat/completions",    with_model(handle_chat_completions));
+    svr->Post(params.api_prefix + "/v1/chat/completions", with_model(handle_chat_completions));
+    svr->Post(params.api_prefix + "/api/chat",            with_model(handle_chat_completions)); // ollama specific endpoint
+    svr->Post(params.api_prefix + "/infill",              with_model(handle_infill));
+    svr->Post(params.api_prefix + "/embedding",           with_model(handle_embeddings)); // legacy
+    svr->Post(params.api_prefix + "/embeddings",          with_model(handle_embeddings));
+    svr->Post(params.api_prefix + "/v1/embeddings",       with_model(handle_embeddings_oai));
+    svr->Post(params.api_prefix + "/rerank",              with_model(handle_rerank));
+    svr->Post(params.api_prefix + "/reranking",           with_model(handle_rerank));
+    svr->Post(params.api_prefix + "/v1/rerank",           with_model(handle_rerank));
+    svr->Post(params.api_prefix + "/v1/reranking",        with_model(handle_rerank));
+    svr->Post(params.api_prefix + "/index",               with_model(handle_index_add));
+    svr->Post(params.api_prefix + "/index/save",          with_model(handle_index_save));
+    svr->Post(params.api_prefix + "/search",              with_model(handle_search));
+    svr->Post(params.api_prefix + "/tokenize",            with_model(handle_tokenize));
+    svr->Post(params.api_prefix + "/detokenize",          with_model(handle_detokenize));
+    svr->Post(params.api_prefix + "/apply-template",      with_model(handle_apply_template));
     // LoRA adapters hotswap
-    svr->Get (params.api_prefix + "/lora-adapters",       handle_lora_adapters_list);
-    svr->Post(params.api_prefix + "/lora-adapters",       handle_lora_adapters_apply);
+    svr->Get (params.api_prefix + "/lora-adapters",       with_model(handle_lora_adapters_list));
+    svr->Post(params.api_prefix + "/lora-adapters",       with_model(handle_lora_adapters_apply));
     // Save & load slots
-    svr->Get (params.api_prefix + "/slots",               handle_slots);
-    svr->Post(params.api_prefix + "/slots/:id_slot",      handle_slots_action);
+    svr->Get (params.api_prefix + "/slots",               with_model(handle_slots));
+    svr->Get (params.api_prefix + "/cache-digest",        with_model(handle_cache_digest));
+    svr->Post(params.api_prefix + "/prefill",             with_model(handle_prefill));
+    svr->Post(params.api_prefix + "/completion/tokens",   with_model(handle_token_stream));
+    svr->Post(params.api_prefix + "/slots/:id_slot",      with_model(handle_slots_action));
 
     //
     // Start the server
@@ -4919,7 +10312,7 @@ int main(int argc, char ** argv) {
         params.n_threads_http = std::max(params.n_parallel + 2, (int32_t) std::thread::hardware_concurrency() - 1);
     }
     log_data["n_threads_http"] =  std::to_string(params.n_threads_http);
-    svr->new_task_queue = [&params] { return new httplib::ThreadPool(params.n_threads_http); };
+    svr->new_task_queue = [&params] { return new server_http_task_queue(params.n_threads_http, params.n_threads_http_max); };
 
     // clean up function, to be called before exit
     auto clean_up = [&svr, &ctx_server]() {
@@ -4963,33 +10356,44 @@ int main(int argc, char ** argv) {
 
     LOG_INF("%s: HTTP server is listening, hostname: %s, port: %d, http threads: %d\n", __func__, params.hostname.c_str(), params.port, params.n_threads_http);
 
-    // load the model
-    LOG_INF("%s: loading model\n", __func__);
+    if (!params.router_replicas.empty()) {
+        // no model, the main loop only waits for the shutdown
+        LOG_INF("%s: routing to %zu replicas\n", __func__, router.replicas.size());
 
-    if (!ctx_server.load_model(params)) {
-        clean_up();
-        t.join();
-        LOG_ERR("%s: exiting due to model loading error\n", __func__);
-        return 1;
-    }
+        router.start();
+        state.store(SERVER_STATE_READY);
+
+        ctx_server.queue_tasks.on_new_task([](server_task &&) {});
+        ctx_server.queue_tasks.on_update_slots([]() {});
+    } else {
+        // load the model
+        LOG_INF("%s: loading model\n", __func__);
 
-    ctx_server.init();
-    state.store(SERVER_STATE_READY);
+        if (!ctx_server.load_model(params)) {
+            clean_up();
+            t.join();
+            LOG_ERR("%s: exiting due to model loading error\n", __func__);
+            return 1;
+        }
 
-    LOG_INF("%s: model loaded\n", __func__);
+        ctx_server.init();
+        state.store(SERVER_STATE_READY);
 
-    // print sample chat example to make it clear which template is used
-    LOG_INF("%s: chat template, chat_template: %s, example_format: '%s'\n", __func__,
-        common_chat_templates_source(ctx_server.chat_templates.get()),
-        common_chat_format_example(ctx_server.chat_templates.get(), ctx_server.params_base.use_jinja).c_str());
+        LOG_INF("%s: model loaded\n", __func__);
 
-    ctx_server.queue_tasks.on_new_task([&ctx_server](server_task && task) {
-        ctx_server.process_single_task(std::move(task));
-    });
+        // print sample chat example to make it clear which template is used
+        LOG_INF("%s: chat template, chat_template: %s, example_format: '%s'\n", __func__,
+            common_chat_templates_source(ctx_server.chat_templates.get()),
+            common_chat_format_example(ctx_server.chat_templates.get(), ctx_server.params_base.use_jinja).c_str());
 
-    ctx_server.queue_tasks.on_update_slots([&ctx_server]() {
-        ctx_server.update_slots();
-    });
+        ctx_server.queue_tasks.on_new_task([&ctx_server](server_task && task) {
+            ctx_server.process_single_task(std::move(task));
+        });
+
+        ctx_server.queue_tasks.on_update_slots([&ctx_server]() {
+            ctx_server.update_slots();
+        });
+    }
 
     shutdown_handler = [&](int) {
         // this will unblock start_loop()
@@ -5017,6 +10421,8 @@ int main(int argc, char ** argv) {
     // this call blocks the main thread until queue_tasks.terminate() is called
     ctx_server.queue_tasks.start_loop();
 
+    router.stop();
+
     clean_up();
     t.join();
 
@@ -79,6 +79,47 @@ def test_load_split_model():
     assert match_regex("(little|girl)+", res.body["content"])
 
 
+def test_lazy_load():
+    global server
+    server.lazy_load = True
+    server.start()
+    res = server.make_request("POST", "/completion", data={
+        "n_predict": 16,
+        "prompt": "Hello",
+        "temperature": 0.0,
+    })
+    assert res.status_code == 200
+    assert match_regex("(little|girl)+", res.body["content"])
+
+
+def test_model_swap():
+    global server
+    server.models_swap = {
+        "stories15m": download_file("https://huggingface.co/ggml-org/models/resolve/main/tinyllamas/stories15M-q4_0.gguf"),
+    }
+    server.start()
+    res = server.make_request("GET", "/v1/models")
+    assert res.status_code == 200
+    assert [m["id"] for m in res.body["data"]] == ["tinyllama-2", "stories15m"]
+    contents = {}
+    for model in ["tinyllama-2", "stories15m", "tinyllama-2"]:
+        res = server.make_request("POST", "/completion", data={
+            "n_predict": 8,
+            "prompt": "Hello",
+            "temperature": 0.0,
+            "model": model,
+        })
+        assert res.status_code == 200
+        assert res.body["model"] == model
+        if model in contents:
+            assert res.body["content"] == contents[model]
+        contents[model] = res.body["content"]
+    assert contents["tinyllama-2"] != contents["stories15m"]
+    res = server.make_request("GET", "/props")
+    assert res.status_code == 200
+    assert res.body["model_path"] != server.models_swap["stories15m"]
+
+
 def test_no_webui():
     global server
     # default: webui enabled
@@ -94,3 +135,60 @@ def test_no_webui():
     server.start()
     res = requests.get(url)
     assert res.status_code == 404
+
+
+def test_threads_http_max():
+    global server
+    server.n_threads_http = 1
+    server.n_threads_http_max = 4
+    server.start()
+    stream = server.make_stream_request("POST", "/completion", data={
+        "prompt": "I believe the meaning of life is",
+        "n_predict": 128,
+        "stream": True,
+    })
+    # the stream holds the only HTTP thread of the pool, the request is served by a new one
+    next(stream)
+    res = server.make_request("GET", "/health", timeout=10)
+    assert res.status_code == 200
+    for _ in stream:
+        pass
+
+
+def test_metrics_histograms():
+    global server
+    server.server_metrics = True
+    server.start()
+    for _ in server.make_stream_request("POST", "/completion", data={
+        "prompt": "I believe the meaning of life is",
+        "n_predict": 8,
+        "stream": True,
+    }):
+        pass
+    url = f"http://{server.server_host}:{server.server_port}/metrics"
+    res = requests.get(url)
+    assert res.status_code == 200
+    assert "# TYPE llamacpp:time_to_first_token_seconds histogram" in res.text
+    assert "llamacpp:time_to_first_token_seconds_count 1\n" in res.text
+    assert "llamacpp:time_per_output_token_seconds_count 7\n" in res.text
+    assert "llamacpp:http_write_seconds_bucket{le=\"+Inf\"}" in res.text
+    assert "llamacpp:update_slots_seconds_total{stage=\"decode\"}" in res.text
+
+
+def test_cache_digest():
+    global server
+    server.server_cache_digest = True
+    server.start()
+    prompt = "I believe the meaning of life is " * 20
+    res = server.make_request("POST", "/completion", data={
+        "prompt": prompt,
+        "n_predict": 4,
+    })
+    assert res.status_code == 200
+    res = server.make_request("GET", "/cache-digest")
+    assert res.status_code == 200
+    assert res.body["block_size"] == 256
+    assert res.body["n_slots"] == server.n_slots
+    assert res.body["requests_processing"] == 0
+    # the prompt and its reply
+    assert len(res.body["prefix_hashes"]) >= len(prompt) // 256
@@ -169,6 +169,25 @@ def test_apply_chat_template():
     assert res.body["prompt"] == "<|START_OF_TURN_TOKEN|><|SYSTEM_TOKEN|>You are a test.<|END_OF_TURN_TOKEN|><|START_OF_TURN_TOKEN|><|USER_TOKEN|>Hi there<|END_OF_TURN_TOKEN|><|START_OF_TURN_TOKEN|><|CHATBOT_TOKEN|>"
 
 
+def test_chat_completion_multi_turn_prompt_tokens():
+    # the tokens of the previous turns are reused, they must match the tokenization of the whole prompt
+    global server
+    server.chat_template = "llama2"
+    server.start()
+    messages = [{"role": "system", "content": "Book"}]
+    for content in ["Hey", " What is\n\nthe best book", "  And the second  best?", "</s> Thanks"]:
+        messages.append({"role": "user", "content": content})
+        res = server.make_request("POST", "/apply-template", data={"messages": messages})
+        assert res.status_code == 200
+        res = server.make_request("POST", "/tokenize", data={"content": res.body["prompt"], "add_special": True})
+        assert res.status_code == 200
+        n_prompt = len(res.body["tokens"])
+        res = server.make_request("POST", "/chat/completions", data={"max_tokens": 4, "messages": messages})
+        assert res.status_code == 200
+        assert res.body["usage"]["prompt_tokens"] == n_prompt
+        messages.append({"role": "assistant", "content": res.body["choices"][0]["message"]["content"]})
+
+
 @pytest.mark.parametrize("response_format,n_predicted,re_content", [
     ({"type": "json_object", "schema": {"const": "42"}}, 6, "\"42\""),
     ({"type": "json_object", "schema": {"items": [{"type": "integer"}]}}, 10, "[ -3000 ]"),
@@ -380,3 +399,37 @@ def test_logit_bias():
     output_text = res.choices[0].message.content
     assert output_text
     assert all(output_text.find(" " + tok + " ") == -1 for tok in exclude)
+
+
+@pytest.mark.parametrize("kv_unified", [False, True])
+def test_chat_completion_n_choices(kv_unified):
+    global server
+    server.n_slots = 4
+    server.kv_unified = kv_unified
+    server.start()
+    res = server.make_request("POST", "/chat/completions", data={
+        "max_tokens": 8,
+        "n": 3,
+        "temperature": 1.0,
+        "seed": 42,
+        "messages": [
+            {"role": "system", "content": "Book"},
+            {"role": "user", "content": "What is the best book"},
+        ],
+    })
+    assert res.status_code == 200
+    choices = res.body["choices"]
+    assert [choice["index"] for choice in choices] == [0, 1, 2]
+    assert all(choice["message"]["content"] for choice in choices)
+    # the prompt is counted once
+    assert res.body["usage"]["completion_tokens"] == 3 * 8
+    assert res.body["usage"]["prompt_tokens"] == 77
+
+    res = server.make_request("POST", "/chat/completions", data={
+        "max_tokens": 8,
+        "n": 5,
+        "messages": [
+            {"role": "user", "content": "What is the best book"},
+        ],
+    })
+    assert res.status_code == 400
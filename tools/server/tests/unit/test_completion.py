@@ -232,6 +232,103 @@ def test_nocache_long_input_prompt():
     assert res.status_code == 200
 
 
+def test_prefix_cache_shared_across_slots():
+    global server
+    server.n_slots = 2
+    server.kv_unified = True
+    server.prefix_cache = True
+    server.temperature = 0.0
+    server.start()
+    prompt = "I believe the meaning of life is"*8
+    res = server.make_request("POST", "/completion", data={
+        "prompt": prompt,
+        "id_slot": 0,
+        "n_predict": 4,
+    })
+    assert res.status_code == 200
+    n_prompt_full = res.body["timings"]["prompt_n"]
+    # the second slot reuses the prefix cached by the first one
+    res = server.make_request("POST", "/completion", data={
+        "prompt": prompt + " to",
+        "id_slot": 1,
+        "n_predict": 4,
+    })
+    assert res.status_code == 200
+    assert res.body["timings"]["prompt_n"] < n_prompt_full
+
+
+def test_kv_pool_slot_uses_whole_context():
+    global server
+    server.n_ctx = 256
+    server.n_slots = 4
+    server.kv_unified = True
+    server.kv_pool = True
+    server.temperature = 0.0
+    server.start()
+    # more than n_ctx/n_slots tokens
+    res = server.make_request("POST", "/completion", data={
+        "prompt": "I believe the meaning of life is"*12,
+        "n_predict": 8,
+    })
+    assert res.status_code == 200
+    assert res.body["timings"]["prompt_n"] > 64
+    assert not res.body["truncated"]
+
+
+def test_cache_chunks_at_other_positions():
+    global server
+    server.cache_chunks = 16
+    server.temperature = 0.0
+    server.start()
+    doc_a = "The quick brown fox jumps over the lazy dog."*4
+    doc_b = "I believe the meaning of life is to be happy."*4
+    res = server.make_request("POST", "/completion", data={
+        "prompt": f"Documents:\n{doc_a}\n{doc_b}\nQuestion:",
+        "cache_chunks": [doc_a, doc_b],
+        "cache_prompt": False,
+        "n_predict": 4,
+    })
+    assert res.status_code == 200
+    # the same documents in another order, after another preamble
+    prompt = f"Read the documents below.\n{doc_b}\n{doc_a}\nQuestion:"
+    res = server.make_request("POST", "/completion", data={
+        "prompt": prompt,
+        "cache_chunks": [doc_a, doc_b],
+        "cache_prompt": False,
+        "n_predict": 4,
+    })
+    assert res.status_code == 200
+    n_prompt_chunks = res.body["timings"]["prompt_n"]
+    res = server.make_request("POST", "/completion", data={
+        "prompt": prompt,
+        "cache_prompt": False,
+        "n_predict": 4,
+    })
+    assert res.status_code == 200
+    assert n_prompt_chunks < res.body["timings"]["prompt_n"] // 2
+
+
+def test_kv_compress_not_reused():
+    global server
+    server.kv_compress = 16
+    server.temperature = 0.0
+    server.start()
+    prompt = "I believe the meaning of life is"*16
+    res = server.make_request("POST", "/completion", data={
+        "prompt": prompt,
+        "n_predict": 4,
+    })
+    assert res.status_code == 200
+    n_prompt_full = res.body["timings"]["prompt_n"]
+    # the compressed cache of the slot does not hold the full prompt anymore
+    res = server.make_request("POST", "/completion", data={
+        "prompt": prompt,
+        "n_predict": 4,
+    })
+    assert res.status_code == 200
+    assert res.body["timings"]["prompt_n"] == n_prompt_full
+
+
 def test_completion_with_tokens_input():
     global server
     server.temperature = 0.0
@@ -330,6 +427,110 @@ def test_completion_parallel_slots(n_slots: int, n_requests: int):
         # assert match_regex(re_content, res.body["content"])
 
 
+def test_completion_batch_budget():
+    global server
+    server.n_slots = 2
+    server.n_batch = 64
+    server.batch_budget = 16
+    server.temperature = 0.0
+    server.start()
+    tasks = [
+        (server.make_request, ("POST", "/completion", {
+            "prompt": "Write a very long book.",
+            "n_predict": 32,
+        })),
+        (server.make_request, ("POST", "/completion", {
+            "prompt": "I believe the meaning of life is"*16,
+            "n_predict": 8,
+        })),
+    ]
+    results = parallel_function_calls(tasks)
+    for res in results:
+        assert res.status_code == 200
+        assert type(res.body["content"]) == str
+    # the long prompt is processed in full, in chunks
+    assert results[1].body["timings"]["prompt_n"] > 64
+
+
+def test_completion_priority_preempt():
+    global server
+    server.n_slots = 1
+    server.slot_preempt = True
+    server.temperature = 0.0
+    server.start()
+    tasks = [
+        (server.make_request, ("POST", "/completion", {
+            "prompt": "Write a very long book.",
+            "n_predict": 64,
+            "priority": "batch",
+        })),
+        (server.make_request, ("POST", "/completion", {
+            "prompt": "I believe the meaning of life is",
+            "n_predict": 8,
+            "priority": "interactive",
+        })),
+    ]
+    results = parallel_function_calls(tasks)
+    for res in results:
+        assert res.status_code == 200
+        assert type(res.body["content"]) == str
+    # the suspended request is resumed and completed
+    assert results[0].body["timings"]["predicted_n"] == 64
+
+
+def test_completion_invalid_priority():
+    global server
+    server.start()
+    res = server.make_request("POST", "/completion", {
+        "prompt": "I believe the meaning of life is",
+        "priority": "urgent",
+    })
+    assert res.status_code == 400
+    assert "error" in res.body
+
+
+@pytest.mark.parametrize("return_text", [True, False])
+def test_completion_stop_tokens(return_text: bool):
+    global server
+    server.start()
+    data = {
+        "prompt": "I believe the meaning of life is",
+        "n_predict": 16,
+        "temperature": 0.0,
+        "return_tokens": True,
+    }
+    res = server.make_request("POST", "/completion", data=data)
+    assert res.status_code == 200
+    tokens = res.body["tokens"]
+    assert len(tokens) == 16
+    # the first occurrence of the stop sequence ends the completion, it is included in the output
+    seq = tokens[4:6]
+    n_stop = next(i for i in range(2, len(tokens) + 1) if tokens[i-2:i] == seq)
+    res = server.make_request("POST", "/completion", data={
+        **data,
+        "stop_tokens": [seq, [tokens[-1], tokens[-1], tokens[-1]]],
+        "return_text": return_text,
+    })
+    assert res.status_code == 200
+    assert res.body["tokens"] == tokens[:n_stop]
+    assert res.body["stop_type"] == "word"
+    if return_text:
+        assert len(res.body["content"]) > 0
+    else:
+        assert res.body["content"] == ""
+
+
+def test_completion_invalid_stop_tokens():
+    global server
+    server.start()
+    res = server.make_request("POST", "/completion", data={
+        "prompt": "I believe the meaning of life is",
+        "stop_tokens": [[1, -5]],
+    })
+    assert res.status_code == 400
+    assert "error" in res.body
+
+
 @pytest.mark.parametrize(
     "prompt,n_predict,response_fields",
     [
@@ -444,6 +645,30 @@ def test_n_probs_post_sampling():
         assert any(prob["prob"] == 1.0 for prob in tok["top_probs"])
 
 
+def test_logits_top_k():
+    global server
+    data = {
+        "prompt": "I believe the meaning of life is",
+        "n_probs": 10,
+        "temperature": 0.0,
+        "n_predict": 16,
+    }
+    server.start()
+    res_ref = server.make_request("POST", "/completion", data=data)
+    assert res_ref.status_code == 200
+    server.stop()
+
+    server.logits_top_k = 40
+    server.start()
+    res = server.make_request("POST", "/completion", data=data)
+    assert res.status_code == 200
+    assert res.body["content"] == res_ref.body["content"]
+    for tok in res.body["completion_probabilities"]:
+        assert len(tok["top_logprobs"]) == 10
+        for prob in tok["top_logprobs"]:
+            assert prob["logprob"] <= 0.0
+
+
 @pytest.mark.parametrize("tokenize,openai_style", [(False, False), (False, True), (True, False), (True, True)])
 def test_logit_bias(tokenize, openai_style):
     global server
@@ -495,3 +720,34 @@ def test_cancel_request():
     time.sleep(1) # wait for HTTP_POLLING_SECONDS
     res = server.make_request("GET", "/slots")
     assert res.body[0]["is_processing"] == False
+
+
+def test_kv_pool_queue_max():
+    global server
+    server.n_ctx = 256
+    server.n_slots = 4
+    server.kv_unified = True
+    server.kv_pool = True
+    server.kv_queue_max = 150
+    server.n_predict = 100
+    server.temperature = 0.0
+    server.start()
+    # the tasks of a request are posted together: two of them fit in the KV cells,
+    # the third one waits for free cells and the fourth one exceeds kv_queue_max
+    res = server.make_request("POST", "/completion", data={
+        "prompt": ["I believe the meaning of life is"]*4,
+        "n_predict": 100,
+        "ignore_eos": True,
+    })
+    assert res.status_code == 429
+    assert res.body["error"]["type"] == "overloaded_error"
+    assert int(res.headers["Retry-After"]) >= 1
+    # the waiting tasks fit in kv_queue_max
+    res = server.make_request("POST", "/completion", data={
+        "prompt": ["I believe the meaning of life is"]*3,
+        "n_predict": 100,
+        "ignore_eos": True,
+    })
+    assert res.status_code == 200
+    assert len(res.body) == 3
+
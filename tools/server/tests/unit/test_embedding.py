@@ -49,6 +49,86 @@ def test_embedding_multiple():
         assert len(d['embedding']) > 1
 
 
+def test_embedding_many_inputs():
+    global server
+    server.pooling = 'last'
+    server.start()
+    inputs = [f"This is test input number {i}" for i in range(64)]
+    res = server.make_request("POST", "/v1/embeddings", data={
+        "input": inputs,
+    })
+    assert res.status_code == 200
+    assert len(res.body['data']) == len(inputs)
+    embd = {d['index']: d['embedding'] for d in res.body['data']}
+    # the inputs are tokenized in parallel, but each result must match its own input
+    for i in [0, 17, 63]:
+        res_one = server.make_request("POST", "/v1/embeddings", data={
+            "input": inputs[i],
+        })
+        assert res_one.status_code == 200
+        assert res_one.body['data'][0]['embedding'] == pytest.approx(embd[i], abs=EPSILON)
+
+
+def test_embedding_batch_window():
+    global server
+    server.pooling = 'last'
+    server.n_slots = 4
+    server.embd_batch_window = 100
+    server.start()
+    inputs = ["I believe the meaning of life is", "This is a test", "This is another test", "Hello world"]
+    tasks = [(server.make_request, ("POST", "/v1/embeddings", {"input": text})) for text in inputs]
+    results = parallel_function_calls(tasks)
+    for res in results:
+        assert res.status_code == 200
+        assert len(res.body['data']) == 1
+        assert len(res.body['data'][0]['embedding']) > 1
+    # a lone request is processed once the window expires
+    res = server.make_request("POST", "/v1/embeddings", data={"input": inputs[0]})
+    assert res.status_code == 200
+    assert res.body['data'][0]['embedding'] == pytest.approx(results[0].body['data'][0]['embedding'], abs=EPSILON)
+
+
+def test_embedding_batch_budget():
+    global server
+    server.pooling = 'last'
+    server.n_slots = 4
+    server.batch_budget = 8
+    server.start()
+    # the prompts cannot be split, each one must still be processed whole in a single batch
+    inputs = ["I believe the meaning of life is " * 4, "This is a test", "This is another test " * 3, "Hello world"]
+    tasks = [(server.make_request, ("POST", "/v1/embeddings", {"input": text})) for text in inputs]
+    results = parallel_function_calls(tasks)
+    for res in results:
+        assert res.status_code == 200
+        assert len(res.body['data']) == 1
+    for text, res in zip(inputs, results):
+        res_one = server.make_request("POST", "/v1/embeddings", data={"input": text})
+        assert res_one.status_code == 200
+        assert res_one.body['data'][0]['embedding'] == pytest.approx(res.body['data'][0]['embedding'], abs=EPSILON)
+
+
+@pytest.mark.parametrize("encoding_format,fmt,eps", [("float", "f", EPSILON), ("f16", "e", 1e-2)])
+def test_embedding_binary(encoding_format, fmt, eps):
+    global server
+    server.start()
+    inputs = ["I believe the meaning of life is", "This is a test"]
+    res_json = server.make_request("POST", "/v1/embeddings", data={"input": inputs})
+    assert res_json.status_code == 200
+
+    res = requests.post(f"http://{server.server_host}:{server.server_port}/v1/embeddings",
+        json={"input": inputs, "encoding_format": encoding_format},
+        headers={"Accept": "application/octet-stream"})
+    assert res.status_code == 200
+    assert res.headers["Content-Type"] == "application/octet-stream"
+    n_embd = int(res.headers["X-Embedding-Dim"])
+    assert int(res.headers["X-Embedding-Count"]) == len(inputs)
+    assert int(res.headers["X-Prompt-Tokens"]) == res_json.body['usage']['prompt_tokens']
+    assert len(res.content) == len(inputs) * n_embd * struct.calcsize(fmt)
+    values = struct.unpack(f"<{len(inputs) * n_embd}{fmt}", res.content)
+    for i, d in enumerate(res_json.body['data']):
+        assert list(values[i*n_embd:(i+1)*n_embd]) == pytest.approx(d['embedding'], abs=eps)
+
+
 def test_embedding_multiple_with_fa():
     server = ServerPreset.bert_bge_small_with_fa()
     server.pooling = 'last'
@@ -255,3 +335,46 @@ def test_embedding_openai_library_base64():
     # make sure the decoded data is the same as the original
     for x, y in zip(floats, vec0):
         assert abs(x - y) < EPSILON
+
+
+def test_vector_index_search():
+    global server
+    server.pooling = 'mean'
+    server.start()
+    documents = [
+        "The giant panda is a bear species endemic to China.",
+        "Paris is the capital of France.",
+        "Python is a programming language.",
+    ]
+    res = server.make_request("POST", "/index", data={
+        "content": documents,
+    })
+    assert res.status_code == 200
+    assert res.body["ids"] == [0, 1, 2]
+    assert res.body["n_vectors"] == 3
+
+    res = server.make_request("POST", "/search", data={
+        "query": documents[1],
+        "top_k": 2,
+    })
+    assert res.status_code == 200
+    assert len(res.body["results"]) == 2
+    assert res.body["results"][0]["id"] == 1
+    assert abs(res.body["results"][0]["score"] - 1) < 1e-2
+    assert res.body["results"][0]["score"] >= res.body["results"][1]["score"]
+
+    # search with an embedding
+    res = server.make_request("POST", "/embeddings", data={
+        "content": documents[2],
+    })
+    assert res.status_code == 200
+    res = server.make_request("POST", "/search", data={
+        "embedding": res.body[0]["embedding"][0],
+        "top_k": 1,
+    })
+    assert res.status_code == 200
+    assert res.body["results"][0]["id"] == 2
+
+    # no file to save the index to
+    res = server.make_request("POST", "/index/save")
+    assert res.status_code != 200
@@ -0,0 +1,69 @@
+import pytest
+from utils import *
+
+server = ServerPreset.tinyllama2()
+
+# most of the text is forced by the grammar
+GRAMMAR = 'root ::= "{\\"name\\": \\"" [a-z]{2,4} "\\", \\"description\\": \\"a person from the city of " [a-z]{2,4} "\\"}"'
+RE_CONTENT = r'^\{"name": "[a-z]{2,4}", "description": "a person from the city of [a-z]{2,4}"\}$'
+
+
+@pytest.fixture(scope="module", autouse=True)
+def create_server():
+    global server
+    server = ServerPreset.tinyllama2()
+    server.jump_forward = True
+    server.temperature = 0.0
+
+
+@pytest.mark.parametrize("n_slots", [1, 2])
+def test_jump_forward_matches_grammar(n_slots: int):
+    global server
+    server.n_slots = n_slots
+    server.start()
+    res = server.make_request("POST", "/completion", data={
+        "prompt": "Write a JSON object:",
+        "grammar": GRAMMAR,
+        "n_predict": 256,
+    })
+    assert res.status_code == 200
+    assert re.match(RE_CONTENT, res.body["content"])
+    assert res.body["stop_type"] == "eos"
+
+
+def test_jump_forward_stream():
+    global server
+    server.start()
+    content = ""
+    for data in server.make_stream_request("POST", "/completion", data={
+        "prompt": "Write a JSON object:",
+        "grammar": GRAMMAR,
+        "n_predict": 256,
+        "stream": True,
+    }):
+        content += data["content"]
+    assert re.match(RE_CONTENT, content)
+
+
+def test_jump_forward_stop_in_forced_text():
+    global server
+    server.start()
+    res = server.make_request("POST", "/completion", data={
+        "prompt": "Write a JSON object:",
+        "grammar": GRAMMAR,
+        "n_predict": 256,
+        "stop": ["description"],
+    })
+    assert res.status_code == 200
+    assert re.match(r'^\{"name": "[a-z]{2,4}", "$', res.body["content"])
+    assert res.body["stop_type"] == "word"
+
+
+def test_jump_forward_invalid_grammar():
+    global server
+    server.start()
+    res = server.make_request("POST", "/completion", data={
+        "prompt": "Write a JSON object:",
+        "grammar": 'root ::= "{" missing_rule',
+    })
+    assert res.status_code == 400
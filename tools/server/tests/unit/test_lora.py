@@ -66,6 +66,34 @@ def test_lora_per_request():
         assert match_regex(re_test, res.body["content"])
 
 
+def test_lora_per_request_batched():
+    global server
+    server.n_slots = 4
+    server.start()
+
+    # the slots with different adapters are decoded in the same batch, the results must match the serial ones
+    scales = [0.0, 0.5, 1.0, 0.0]
+    data = lambda scale: {
+        "prompt": "Look in thy glass",
+        "lora": [{"id": 0, "scale": scale}],
+        "n_predict": 32,
+        "temperature": 0.0,
+        "cache_prompt": False,
+    }
+
+    expected = []
+    for scale in scales:
+        res = server.make_request("POST", "/completion", data=data(scale))
+        assert res.status_code == 200
+        expected.append(res.body["content"])
+
+    tasks = [(server.make_request, ("POST", "/completion", data(scale))) for scale in scales]
+    results = parallel_function_calls(tasks)
+
+    assert all([res.status_code == 200 for res in results])
+    assert [res.body["content"] for res in results] == expected
+
+
 @pytest.mark.skipif(not is_slow_test_allowed(), reason="skipping slow test")
 def test_with_big_model():
     server = ServerProcess()
@@ -0,0 +1,85 @@
+import pytest
+import requests
+from utils import *
+
+server = ServerPreset.tinyllama2()
+prefill_server = ServerPreset.tinyllama2()
+
+LONG_PROMPT = "Once upon a time, there was a little girl named Lily. She loved to play outside in the park with her friends. " * 4
+
+
+@pytest.fixture(scope="module", autouse=True)
+def create_server():
+    global server, prefill_server
+    server = ServerPreset.tinyllama2()
+    server.prefill_min = 16
+    prefill_server = ServerPreset.tinyllama2()
+    prefill_server.kv_prefill = True
+    prefill_server.server_port = server.server_port + 1
+
+
+def complete(srv: ServerProcess, prompt: str) -> dict:
+    res = srv.make_request("POST", "/completion", data={
+        "prompt": prompt,
+        "n_predict": 16,
+        "temperature": 0.0,
+        "cache_prompt": False,
+    })
+    assert res.status_code == 200
+    return res.body
+
+
+def test_prefill_matches_local():
+    global server, prefill_server
+    server.start()
+    ref = complete(server, LONG_PROMPT)
+    server.stop()
+
+    prefill_server.start()
+    server.prefill_url = f"http://{prefill_server.server_host}:{prefill_server.server_port}"
+    server.start()
+
+    res = complete(server, LONG_PROMPT)
+    assert res["content"] == ref["content"]
+    assert res["tokens_evaluated"] == ref["tokens_evaluated"]
+
+
+def test_prefill_unreachable():
+    global server
+    server.prefill_url = None
+    server.start()
+    ref = complete(server, LONG_PROMPT)
+    server.stop()
+
+    # nothing listens on this port, the prompt is evaluated locally
+    server.prefill_url = f"http://{server.server_host}:{server.server_port + 1}"
+    server.start()
+    res = complete(server, LONG_PROMPT)
+    assert res["content"] == ref["content"]
+
+
+def test_prefill_endpoint():
+    global prefill_server
+    prefill_server.start()
+    tokens = prefill_server.make_request("POST", "/tokenize", data={"content": LONG_PROMPT}).body["tokens"]
+    url = f"http://{prefill_server.server_host}:{prefill_server.server_port}/prefill"
+    res = requests.post(url, json={"tokens": tokens, "n_past": 0})
+    assert res.status_code == 200
+    assert res.headers["Content-Type"].startswith("application/octet-stream")
+    assert len(res.content) > 0
+
+
+def test_prefill_endpoint_invalid():
+    global prefill_server
+    prefill_server.start()
+    res = prefill_server.make_request("POST", "/prefill", data={"tokens": [1, 2, 3], "n_past": 3})
+    assert res.status_code == 400
+    res = prefill_server.make_request("POST", "/prefill", data={"tokens": []})
+    assert res.status_code == 400
+
+
+def test_prefill_endpoint_disabled():
+    global server
+    server.start()
+    res = server.make_request("POST", "/prefill", data={"tokens": [1, 2, 3]})
+    assert res.status_code == 501
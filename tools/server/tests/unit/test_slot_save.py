@@ -1,3 +1,5 @@
+import os
+import shutil
 import pytest
 from utils import *
 
@@ -96,3 +98,100 @@ def test_slot_erase():
     assert res.status_code == 200
     assert match_regex("(Whiskers|Flana)+", res.body["content"])
     assert res.body["timings"]["prompt_n"] == 21  # all tokens are processed
+
+
+def test_slot_save_append():
+    global server
+    server.slot_save_append = True
+    server.start()
+
+    res = server.make_request("POST", "/completion", data={
+        "prompt": "What is the capital of France?",
+        "id_slot": 1,
+        "cache_prompt": True,
+    })
+    assert res.status_code == 200
+
+    res = server.make_request("POST", "/slots/1?action=save", data={
+        "filename": "slot1_append.bin",
+    })
+    assert res.status_code == 200
+    n_written_full = res.body["n_written"]
+
+    # the next turn only appends the new tokens
+    res = server.make_request("POST", "/completion", data={
+        "prompt": "What is the capital of France? And of Germany?",
+        "id_slot": 1,
+        "cache_prompt": True,
+    })
+    assert res.status_code == 200
+
+    res = server.make_request("POST", "/slots/1?action=save", data={
+        "filename": "slot1_append.bin",
+    })
+    assert res.status_code == 200
+    n_saved = res.body["n_saved"]
+    assert res.body["n_written"] < n_written_full
+
+    res = server.make_request("POST", "/slots/0?action=restore", data={
+        "filename": "slot1_append.bin",
+    })
+    assert res.status_code == 200
+    assert res.body["n_restored"] == n_saved
+
+    res = server.make_request("POST", "/completion", data={
+        "prompt": "What is the capital of France? And of Germany?",
+        "id_slot": 0,
+        "cache_prompt": True,
+    })
+    assert res.status_code == 200
+    assert res.body["timings"]["prompt_n"] == 1
+
+
+def test_slot_offload_persist():
+    global server
+    offload_path = "./tmp/slot-offload"
+    shutil.rmtree(offload_path, ignore_errors=True)
+    os.makedirs(offload_path)
+    server.slot_save_path = offload_path
+    server.slot_offload_ram = 16
+    server.slot_offload_disk = 16
+    server.slot_offload_persist = True
+    server.start()
+
+    prompt = "What is the capital of France? " * 4
+    res = server.make_request("POST", "/completion", data={
+        "prompt": prompt,
+        "cache_prompt": True,
+    })
+    assert res.status_code == 200
+    n_prompt = res.body["timings"]["prompt_n"]
+    content = res.body["content"]
+
+    # the state of the slot is written to disk at shutdown and found again after the restart
+    server.stop(graceful=True)
+    assert any(name.startswith("kv-offload-") for name in os.listdir(offload_path))
+    server.start()
+
+    res = server.make_request("POST", "/completion", data={
+        "prompt": prompt,
+        "cache_prompt": True,
+    })
+    assert res.status_code == 200
+    assert res.body["timings"]["prompt_n"] < n_prompt
+    assert res.body["content"] == content
+
+    # the incomplete files are ignored
+    server.stop(graceful=True)
+    for name in os.listdir(offload_path):
+        path = os.path.join(offload_path, name)
+        os.truncate(path, os.path.getsize(path) // 2)
+    server.start()
+
+    res = server.make_request("POST", "/completion", data={
+        "prompt": prompt,
+        "cache_prompt": True,
+    })
+    assert res.status_code == 200
+    assert res.body["timings"]["prompt_n"] == n_prompt
+    assert res.body["content"] == content
@@ -48,6 +48,68 @@ def test_with_and_without_draft():
     assert content_no_draft == content_draft
 
 
+@pytest.mark.parametrize("spec_self_exit,spec_self_skip", [
+    (3, None),
+    (None, "1,4"),
+])
+def test_self_speculative(spec_self_exit, spec_self_skip):
+    global server
+    server.model_draft = None  # disable draft model
+    server.start()
+    res = server.make_request("POST", "/completion", data={
+        "prompt": "I believe the meaning of life is",
+        "temperature": 0.0,
+        "top_k": 1,
+    })
+    assert res.status_code == 200
+    content_no_draft = res.body["content"]
+    server.stop()
+
+    # draft with a subset of the layers of the main model
+    create_server()
+    server.model_draft = None
+    server.spec_self_exit = spec_self_exit
+    server.spec_self_skip = spec_self_skip
+    server.start()
+    res = server.make_request("POST", "/completion", data={
+        "prompt": "I believe the meaning of life is",
+        "temperature": 0.0,
+        "top_k": 1,
+    })
+    assert res.status_code == 200
+    assert res.body["content"] == content_no_draft
+    assert res.body["timings"]["draft_n"] > 0
+
+
+def test_ngram_lookup():
+    global server
+    prompt = "The quick brown fox jumps over the lazy dog. " * 8
+    server.model_draft = None  # disable draft model
+    server.start()
+    res = server.make_request("POST", "/completion", data={
+        "prompt": prompt,
+        "temperature": 0.0,
+        "top_k": 1,
+    })
+    assert res.status_code == 200
+    content_no_draft = res.body["content"]
+    server.stop()
+
+    # draft with the n-grams of the prompt and of the previous requests
+    create_server()
+    server.model_draft = None
+    server.spec_ngram = True
+    server.start()
+    for _ in range(2):
+        res = server.make_request("POST", "/completion", data={
+            "prompt": prompt,
+            "temperature": 0.0,
+            "top_k": 1,
+        })
+        assert res.status_code == 200
+        assert res.body["content"] == content_no_draft
+
+
 def test_different_draft_min_draft_max():
     global server
     test_values = [
@@ -124,3 +186,69 @@ def test_multi_requests_parallel(n_slots: int, n_requests: int):
     for res in results:
         assert res.status_code == 200
         assert match_regex("(wise|kind|owl|answer)+", res.body["content"])
+
+
+def test_stream_coalesce():
+    global server
+    server.start()
+    content = {}
+    n_events = {}
+    for coalesce_ms in [-1, 0]:
+        res = server.make_stream_request("POST", "/completion", data={
+            "prompt": "I believe the meaning of life is",
+            "n_predict": 32,
+            "temperature": 0.0,
+            "top_k": 1,
+            "stream": True,
+            "stream_coalesce_ms": coalesce_ms,
+        })
+        content[coalesce_ms] = ""
+        n_events[coalesce_ms] = 0
+        for data in res:
+            if not data["stop"]:
+                assert len(data["tokens"]) > 0
+                content[coalesce_ms] += data["content"]
+                n_events[coalesce_ms] += 1
+    # the accepted draft tokens of a step are sent as one event
+    assert content[0] == content[-1]
+    assert n_events[0] < n_events[-1]
+
+
+@pytest.mark.parametrize("n_slots", [1, 2])
+def test_lookahead(n_slots: int):
+    global server
+    prompt = "The quick brown fox jumps over the lazy dog. " * 4
+    server.model_draft = None  # disable draft model
+    server.start()
+    res = server.make_request("POST", "/completion", data={
+        "prompt": prompt,
+        "temperature": 0.0,
+        "top_k": 1,
+    })
+    assert res.status_code == 200
+    content_no_draft = res.body["content"]
+    server.stop()
+
+    # draft with the n-grams of the Jacobi iterations
+    create_server()
+    server.model_draft = None
+    server.spec_lookahead = 3
+    server.n_slots = n_slots
+    server.start()
+    tasks = [(server.make_request, ("POST", "/completion", {
+        "prompt": prompt,
+        "temperature": 0.0,
+        "top_k": 1,
+    })) for _ in range(n_slots)]
+    for res in parallel_function_calls(tasks):
+        assert res.status_code == 200
+        assert res.body["content"] == content_no_draft
+        assert res.body["timings"]["draft_n"] > 0
+
+
+def test_lookahead_invalid_n_gram():
+    global server
+    server.model_draft = None
+    server.spec_lookahead = 1
+    with pytest.raises(RuntimeError):
+        server.start()
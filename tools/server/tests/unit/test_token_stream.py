@@ -0,0 +1,132 @@
+import struct
+import pytest
+import requests
+from utils import *
+
+server = ServerPreset.tinyllama2()
+
+# native byte order, see server_token_request and server_token_result in server.cpp
+REQUEST_MAGIC = 0x72626767
+RESULT_MAGIC  = 0x74626767
+
+RESULT_FINAL = 1
+RESULT_PROBS = 2
+RESULT_ERROR = 4
+
+
+@pytest.fixture(scope="module", autouse=True)
+def create_server():
+    global server
+    server = ServerPreset.tinyllama2()
+    server.token_stream = True
+
+
+def make_frame(tokens: list[int], n_predict: int = -1, n_probs: int = 0, seed: int = 0xFFFFFFFF,
+               temperature: float = -1.0, top_k: int = -1, top_p: float = -1.0) -> bytes:
+    hdr = struct.pack("=IIiiIfif", REQUEST_MAGIC, len(tokens), n_predict, n_probs, seed, temperature, top_k, top_p)
+    return hdr + struct.pack(f"={len(tokens)}i", *tokens)
+
+
+def post_frames(body: bytes) -> requests.Response:
+    url = f"http://{server.server_host}:{server.server_port}/completion/tokens"
+    return requests.post(url, data=body, headers={"Content-Type": "application/octet-stream"})
+
+
+def parse_results(body: bytes) -> list[dict]:
+    results = []
+    off = 0
+    while off < len(body):
+        magic, index, flags, stop, n_tokens, n_probs, n_prompt_tokens, n_bytes = struct.unpack_from("=8I", body, off)
+        assert magic == RESULT_MAGIC
+        off += 32
+        payload = body[off:off + n_bytes]
+        off += n_bytes
+        results.append({
+            "index": index,
+            "flags": flags,
+            "stop": stop,
+            "n_prompt_tokens": n_prompt_tokens,
+            "tokens": list(struct.unpack_from(f"={n_tokens}i", payload)),
+            "n_probs": n_probs,
+        })
+    return results
+
+
+def tokenize(content: str) -> list[int]:
+    res = server.make_request("POST", "/tokenize", data={"content": content, "add_special": True})
+    assert res.status_code == 200
+    return res.body["tokens"]
+
+
+def test_token_stream_matches_completion():
+    global server
+    server.start()
+    prompts = [
+        tokenize("I believe the meaning of life is"),
+        tokenize("Once upon a time"),
+    ]
+    res = post_frames(b"".join(make_frame(p, n_predict=8, temperature=0.0) for p in prompts))
+    assert res.status_code == 200
+
+    tokens = [[] for _ in prompts]
+    finals = [None for _ in prompts]
+    for result in parse_results(res.content):
+        assert result["flags"] & RESULT_ERROR == 0
+        assert finals[result["index"]] is None, "result after the final frame"
+        if result["flags"] & RESULT_FINAL:
+            finals[result["index"]] = result
+        else:
+            tokens[result["index"]] += result["tokens"]
+
+    for i, prompt in enumerate(prompts):
+        assert finals[i] is not None
+        assert finals[i]["n_prompt_tokens"] == len(prompt)
+        ref = server.make_request("POST", "/completion", data={
+            "prompt": prompt,
+            "n_predict": 8,
+            "temperature": 0.0,
+            "return_tokens": True,
+        })
+        assert ref.status_code == 200
+        assert tokens[i] == ref.body["tokens"]
+
+
+def test_token_stream_probs():
+    global server
+    server.start()
+    res = post_frames(make_frame(tokenize("Once upon a time"), n_predict=4, n_probs=3, temperature=0.0))
+    assert res.status_code == 200
+    partials = [r for r in parse_results(res.content) if not r["flags"] & RESULT_FINAL]
+    assert len(partials) > 0
+    for r in partials:
+        assert r["flags"] & RESULT_PROBS
+        assert r["n_probs"] == 3
+
+
+def test_token_stream_truncated_frame():
+    global server
+    server.start()
+    frame = make_frame(tokenize("Once upon a time"), n_predict=4)
+    res = post_frames(frame[:20])
+    assert res.status_code == 400
+    assert "truncated request frame" in res.json()["error"]["message"]
+
+    # the prompt is shorter than its n_tokens
+    res = post_frames(frame[:-4])
+    assert res.status_code == 400
+
+
+def test_token_stream_invalid_token():
+    global server
+    server.start()
+    res = post_frames(make_frame([1, 1 << 30], n_predict=4))
+    assert res.status_code == 400
+    assert "invalid token id" in res.json()["error"]["message"]
+
+
+def test_token_stream_disabled():
+    global server
+    server.token_stream = False
+    server.start()
+    res = post_frames(make_frame([1, 2, 3], n_predict=4))
+    assert res.status_code == 501
@@ -58,3 +58,53 @@ def test_vision_chat_completion(prompt, image_url, success, re_content):
     else:
         assert res.status_code != 200
 
+
+
+def test_vision_mmproj_cache():
+    global server
+    server.mmproj_cache = 64
+    server.start(timeout_seconds=60)
+    contents = []
+    # the second request is processed by the other slot, with the cached image embeddings
+    for id_slot in [0, 1]:
+        res = server.make_request("POST", "/chat/completions", data={
+            "temperature": 0.0,
+            "top_k": 1,
+            "id_slot": id_slot,
+            "messages": [
+                {"role": "user", "content": [
+                    {"type": "text", "text": "What is this:\n"},
+                    {"type": "image_url", "image_url": {
+                        "url": IMG_URL_0,
+                    }},
+                ]},
+            ],
+        })
+        assert res.status_code == 200
+        contents.append(res.body["choices"][0]["message"]["content"])
+    assert match_regex("(cat)+", contents[0])
+    assert contents[0] == contents[1]
+
+
+def test_vision_mmproj_async():
+    global server
+    server.mmproj_async = True
+    server.start(timeout_seconds=60)
+    tasks = []
+    for image_url in [IMG_URL_0, IMG_URL_1]:
+        tasks.append((server.make_request, ("POST", "/chat/completions", {
+            "temperature": 0.0,
+            "top_k": 1,
+            "messages": [
+                {"role": "user", "content": [
+                    {"type": "text", "text": "What is this:\n"},
+                    {"type": "image_url", "image_url": {
+                        "url": image_url,
+                    }},
+                ]},
+            ],
+        })))
+    results = parallel_function_calls(tasks)
+    for res, re_content in zip(results, ["(cat)+", "(frog)+"]):
+        assert res.status_code == 200
+        assert match_regex(re_content, res.body["choices"][0]["message"]["content"])
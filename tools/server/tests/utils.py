@@ -55,6 +55,8 @@ class ServerProcess:
     model_file: str | None = None
     model_draft: str | None = None
     n_threads: int | None = None
+    n_threads_http: int | None = None
+    n_threads_http_max: int | None = None
     n_gpu_layer: int | None = None
     n_batch: int | None = None
     n_ubatch: int | None = None
@@ -64,6 +66,10 @@ class ServerProcess:
     n_predict: int | None = None
     n_prompts: int | None = 0
     slot_save_path: str | None = None
+    slot_save_append: bool | None = None
+    slot_offload_ram: int | None = None
+    slot_offload_disk: int | None = None
+    slot_offload_persist: bool | None = None
     id_slot: int | None = None
     cache_prompt: bool | None = None
     n_slots: int | None = None
@@ -75,6 +81,7 @@ class ServerProcess:
     server_reranking: bool | None = False
     server_metrics: bool | None = False
     server_slots: bool | None = False
+    server_cache_digest: bool | None = False
     pooling: str | None = None
     draft: int | None = None
     api_key: str | None = None
@@ -90,6 +97,29 @@ class ServerProcess:
     chat_template_file: str | None = None
     server_path: str | None = None
     mmproj_url: str | None = None
+    kv_unified: bool | None = None
+    prefix_cache: bool | None = None
+    kv_pool: bool | None = None
+    kv_queue_max: int | None = None
+    cache_chunks: int | None = None
+    batch_budget: int | None = None
+    slot_preempt: bool | None = None
+    spec_self_exit: int | None = None
+    spec_self_skip: str | None = None
+    spec_ngram: bool | None = None
+    spec_lookahead: int | None = None
+    logits_top_k: int | None = None
+    kv_compress: int | None = None
+    embd_batch_window: int | None = None
+    mmproj_cache: int | None = None
+    mmproj_async: bool | None = None
+    lazy_load: bool | None = None
+    models_swap: dict[str, str] | None = None
+    token_stream: bool | None = None
+    jump_forward: bool | None = None
+    kv_prefill: bool | None = None
+    prefill_url: str | None = None
+    prefill_min: int | None = None
 
     # session variables
     process: subprocess.Popen | None = None
@@ -137,6 +167,10 @@ class ServerProcess:
             server_args.extend(["--ubatch-size", self.n_ubatch])
         if self.n_threads:
             server_args.extend(["--threads", self.n_threads])
+        if self.n_threads_http:
+            server_args.extend(["--threads-http", self.n_threads_http])
+        if self.n_threads_http_max:
+            server_args.extend(["--threads-http-max", self.n_threads_http_max])
         if self.n_gpu_layer:
             server_args.extend(["--n-gpu-layers", self.n_gpu_layer])
         if self.draft is not None:
@@ -151,6 +185,8 @@ class ServerProcess:
             server_args.append("--metrics")
         if self.server_slots:
             server_args.append("--slots")
+        if self.server_cache_digest:
+            server_args.append("--cache-digest")
         if self.pooling:
             server_args.extend(["--pooling", self.pooling])
         if self.model_alias:
@@ -169,6 +205,14 @@ class ServerProcess:
             server_args.extend(["--n-predict", self.n_predict])
         if self.slot_save_path:
             server_args.extend(["--slot-save-path", self.slot_save_path])
+        if self.slot_save_append:
+            server_args.append("--slot-save-append")
+        if self.slot_offload_ram:
+            server_args.extend(["--slot-offload-ram", self.slot_offload_ram])
+        if self.slot_offload_disk:
+            server_args.extend(["--slot-offload-disk", self.slot_offload_disk])
+        if self.slot_offload_persist:
+            server_args.append("--slot-offload-persist")
         if self.n_ga:
             server_args.extend(["--grp-attn-n", self.n_ga])
         if self.n_ga_w:
@@ -200,6 +244,53 @@ class ServerProcess:
             server_args.extend(["--chat-template-file", self.chat_template_file])
         if self.mmproj_url:
             server_args.extend(["--mmproj-url", self.mmproj_url])
+        if self.kv_unified:
+            server_args.append("--kv-unified")
+        if self.prefix_cache:
+            server_args.append("--prefix-cache")
+        if self.kv_pool:
+            server_args.append("--kv-pool")
+        if self.kv_queue_max:
+            server_args.extend(["--kv-queue-max", self.kv_queue_max])
+        if self.cache_chunks:
+            server_args.extend(["--cache-chunks", self.cache_chunks])
+        if self.kv_compress:
+            server_args.extend(["--kv-compress", self.kv_compress])
+        if self.batch_budget:
+            server_args.extend(["--batch-budget", self.batch_budget])
+        if self.slot_preempt:
+            server_args.append("--slot-preempt")
+        if self.spec_self_exit:
+            server_args.extend(["--spec-self-exit", self.spec_self_exit])
+        if self.spec_self_skip:
+            server_args.extend(["--spec-self-skip", self.spec_self_skip])
+        if self.spec_ngram:
+            server_args.append("--spec-ngram")
+        if self.spec_lookahead:
+            server_args.extend(["--spec-lookahead", self.spec_lookahead])
+        if self.logits_top_k:
+            server_args.extend(["--logits-top-k", self.logits_top_k])
+        if self.embd_batch_window:
+            server_args.extend(["--embd-batch-window", self.embd_batch_window])
+        if self.mmproj_cache:
+            server_args.extend(["--mmproj-cache", self.mmproj_cache])
+        if self.mmproj_async:
+            server_args.append("--mmproj-async")
+        if self.lazy_load:
+            server_args.append("--lazy-load")
+        if self.models_swap:
+            for alias, path in self.models_swap.items():
+                server_args.extend(["--model-swap", alias, path])
+        if self.token_stream:
+            server_args.append("--token-stream")
+        if self.jump_forward:
+            server_args.append("--jump-forward")
+        if self.kv_prefill:
+            server_args.append("--kv-prefill")
+        if self.prefill_url:
+            server_args.extend(["--prefill-url", self.prefill_url])
+        if self.prefill_min:
+            server_args.extend(["--prefill-min", self.prefill_min])
 
         args = [str(arg) for arg in [server_path, *server_args]]
         print(f"tests: starting server with: {' '.join(args)}")
@@ -241,12 +332,17 @@ class ServerProcess:
             time.sleep(0.5)
         raise TimeoutError(f"Server did not start within {timeout_seconds} seconds")
 
-    def stop(self) -> None:
+    def stop(self, graceful: bool = False) -> None:
         if self in server_instances:
             server_instances.remove(self)
         if self.process:
             print(f"Stopping server with pid={self.process.pid}")
-            self.process.kill()
+            if graceful:
+                # let the server shut down, e.g. to write its state to disk
+                self.process.terminate()
+                self.process.wait(timeout=DEFAULT_HTTP_TIMEOUT)
+            else:
+                self.process.kill()
             self.process = None
 
     def make_request(
@@ -8,6 +8,7 @@
 #include "mtmd.h"
 #include "mtmd-helper.h"
 #include "chat.h"
+#include "json-schema-to-grammar.h"
 
 // increase max payload length to allow use of larger context size
 #define CPPHTTPLIB_FORM_URL_ENCODED_PAYLOAD_MAX_LENGTH 1048576
@@ -20,9 +21,17 @@
 #define JSON_ASSERT GGML_ASSERT
 #include <nlohmann/json.hpp>
 
+#include <array>
+#include <deque>
+#include <functional>
+#include <list>
+#include <map>
+#include <mutex>
 #include <random>
+#include <set>
 #include <sstream>
 #include <string>
+#include <unordered_map>
 #include <vector>
 #include <memory>
 #include <cinttypes>
@@ -145,12 +154,276 @@ static json json_get_nested_values(const std::vector<std::string> & paths, const
     return result;
 }
 
+/**
+ * tokenizations of the recent prompts, reused by the prompts that extend one of them (e.g. the next turn of a chat)
+ * the tokenizer splits the text on the special tokens and tokenizes the pieces in between independently, so the tokens of
+ * the common prefix up to its last special token are kept and only the rest of the text is tokenized
+ * only for SPM and BPE vocabs that do not add EOS, and for parse_special = true
+ */
+struct server_tokenize_cache {
+    struct entry {
+        std::string  text;
+        llama_tokens tokens;
+        bool         add_special;
+
+        // (text offset, number of tokens) after the special tokens
+        std::vector<std::pair<size_t, size_t>> cuts;
+    };
+
+    const llama_vocab * vocab = nullptr;
+
+    bool   spm   = false;
+    size_t n_max = 0;
+
+    // texts of the special tokens by first byte, to check that a cut point does not split one of them
+    std::array<std::vector<std::string>, 256> special_texts;
+    size_t special_len_max = 0;
+
+    std::vector<llama_token_attr> attrs;
+
+    std::mutex mutex;
+    std::deque<entry> entries; // most recent first
+
+    void init(const llama_vocab * vocab, size_t n_max) {
+        this->vocab = vocab;
+        this->n_max = 0;
+
+        const auto type = llama_vocab_type(vocab);
+        if ((type != LLAMA_VOCAB_TYPE_SPM && type != LLAMA_VOCAB_TYPE_BPE) || llama_vocab_get_add_eos(vocab)) {
+            return;
+        }
+
+        spm = type == LLAMA_VOCAB_TYPE_SPM;
+
+        const int n_vocab = llama_vocab_n_tokens(vocab);
+        attrs.resize(n_vocab);
+        for (llama_token id = 0; id < n_vocab; ++id) {
+            attrs[id] = llama_vocab_get_attr(vocab, id);
+            if (attrs[id] & (LLAMA_TOKEN_ATTR_CONTROL | LLAMA_TOKEN_ATTR_USER_DEFINED | LLAMA_TOKEN_ATTR_UNKNOWN)) {
+                const std::string text = llama_vocab_get_text(vocab, id);
+                if (text.size() > 1) {
+                    special_texts[(uint8_t) text[0]].push_back(text);
+                    special_len_max = std::max(special_len_max, text.size());
+                }
+            }
+        }
+
+        this->n_max = n_max;
+    }
+
+    bool is_special(llama_token id) const {
+        return attrs[id] & (LLAMA_TOKEN_ATTR_CONTROL | LLAMA_TOKEN_ATTR_USER_DEFINED | LLAMA_TOKEN_ATTR_UNKNOWN);
+    }
+
+    // true if a special token of the text starts before pos and ends after it
+    bool splits_special(const std::string & text, size_t pos) const {
+        const size_t start = pos > special_len_max ? pos - special_len_max : 0;
+        for (size_t i = start; i < pos; ++i) {
+            for (const auto & s : special_texts[(uint8_t) text[i]]) {
+                if (i + s.size() > pos && text.compare(i, s.size(), s) == 0) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    // record the cut points of e.tokens[i0:], which start at e.text[off:]
+    void add_cuts(entry & e, size_t i0, size_t off) const {
+        bool prev_special = true;
+        for (size_t i = i0; i < e.tokens.size(); ++i) {
+            const llama_token id    = e.tokens[i];
+            const std::string piece = common_token_to_piece(vocab, id, true);
+
+            if (e.text.compare(off, piece.size(), piece) == 0) {
+                off += piece.size();
+            } else if (spm && prev_special && !piece.empty() && piece[0] == ' ' && e.text.compare(off, piece.size() - 1, piece, 1) == 0) {
+                // the space prefix of the piece of text after a special token
+                off += piece.size() - 1;
+            } else {
+                // the text was modified by the tokenizer (e.g. stripped around a special token) - no more cut points
+                return;
+            }
+
+            prev_special = is_special(id);
+            if (prev_special && !(attrs[id] & LLAMA_TOKEN_ATTR_RSTRIP)) {
+                e.cuts.emplace_back(off, i + 1);
+            }
+        }
+    }
+
+    llama_tokens tokenize(const std::string & text, bool add_special) {
+        if (n_max == 0) {
+            return common_tokenize(vocab, text, add_special, true);
+        }
+
+        entry e;
+        e.text        = text;
+        e.add_special = add_special;
+
+        size_t n_text = 0;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            for (const auto & prev : entries) {
+                if (prev.add_special != add_special) {
+                    continue;
+                }
+
+                const size_t n_cmp = std::min(prev.text.size(), text.size());
+                size_t n_common = 0;
+                while (n_common < n_cmp && prev.text[n_common] == text[n_common]) {
+                    n_common++;
+                }
+
+                // the last cut point of the common prefix
+                for (auto it = prev.cuts.rbegin(); it != prev.cuts.rend(); ++it) {
+                    if (it->first <= n_text) {
+                        break;
+                    }
+                    if (it->first <= n_common && !splits_special(text, it->first)) {
+                        n_text   = it->first;
+                        e.tokens = llama_tokens(prev.tokens.begin(), prev.tokens.begin() + it->second);
+                        e.cuts.clear();
+                        for (const auto & cut : prev.cuts) {
+                            if (cut.first > n_text) {
+                                break;
+                            }
+                            e.cuts.push_back(cut);
+                        }
+                        break;
+                    }
+                }
+            }
+        }
+
+        const size_t n_keep = e.tokens.size();
+
+        if (n_keep == 0) {
+            e.tokens = common_tokenize(vocab, text, add_special, true);
+        } else {
+            const auto rest = common_tokenize(vocab, text.substr(n_text), false, true);
+            e.tokens.insert(e.tokens.end(), rest.begin(), rest.end());
+        }
+
+        // a BOS added by the tokenizer is not a part of the text
+        const size_t i0 = n_keep > 0 ? n_keep : (add_special && llama_vocab_get_add_bos(vocab) ? 1 : 0);
+        add_cuts(e, i0, n_text);
+
+        llama_tokens result = e.tokens;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            entries.push_front(std::move(e));
+            if (entries.size() > n_max) {
+                entries.pop_back();
+            }
+        }
+
+        return result;
+    }
+};
+
+// json_schema_to_grammar with an LRU cache of the recent schemas, since the clients tend to repeat the same few
+static std::string json_schema_to_grammar_cached(const json & schema) {
+    static constexpr size_t n_max = 64;
+
+    static std::mutex mutex;
+    static std::deque<std::pair<std::string, std::string>> entries; // most recent first
+
+    std::string key = schema.dump();
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        for (auto it = entries.begin(); it != entries.end(); ++it) {
+            if (it->first == key) {
+                auto e = std::move(*it);
+                entries.erase(it);
+                entries.push_front(std::move(e));
+
+                return entries.front().second;
+            }
+        }
+    }
+
+    std::string grammar = json_schema_to_grammar(schema);
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if (entries.size() >= n_max) {
+            entries.pop_back();
+        }
+        entries.emplace_front(std::move(key), grammar);
+    }
+
+    return grammar;
+}
+
+// splits a text into the tokens whose pieces are its longest prefixes, e.g. for the text forced by a grammar
+// this does not follow the merges of the tokenizer, but the text of the tokens is exactly the given text
+struct server_token_pieces {
+    std::unordered_map<std::string, llama_token> tokens;
+
+    size_t n_max = 0; // the length of the longest piece
+
+    void init(const llama_vocab * vocab) {
+        const int n_vocab = llama_vocab_n_tokens(vocab);
+        for (llama_token id = 0; id < n_vocab; ++id) {
+            const llama_token_attr attr = llama_vocab_get_attr(vocab, id);
+            if (attr & (LLAMA_TOKEN_ATTR_CONTROL | LLAMA_TOKEN_ATTR_USER_DEFINED | LLAMA_TOKEN_ATTR_UNKNOWN | LLAMA_TOKEN_ATTR_UNUSED)) {
+                continue;
+            }
+
+            const std::string piece = common_token_to_piece(vocab, id, false);
+            if (piece.empty()) {
+                continue;
+            }
+
+            // a normal token is preferred to a byte token with the same piece
+            auto it = tokens.find(piece);
+            if (it == tokens.end()) {
+                tokens.emplace(piece, id);
+            } else if ((llama_vocab_get_attr(vocab, it->second) & LLAMA_TOKEN_ATTR_BYTE) && !(attr & LLAMA_TOKEN_ATTR_BYTE)) {
+                it->second = id;
+            }
+
+            n_max = std::max(n_max, piece.size());
+        }
+    }
+
+    // stops at the first byte that no piece starts with
+    llama_tokens tokenize(const std::string & text) const {
+        llama_tokens result;
+
+        size_t i = 0;
+        while (i < text.size()) {
+            size_t n = std::min(n_max, text.size() - i);
+            for (; n > 0; --n) {
+                auto it = tokens.find(text.substr(i, n));
+                if (it != tokens.end()) {
+                    result.push_back(it->second);
+                    break;
+                }
+            }
+            if (n == 0) {
+                break;
+            }
+            i += n;
+        }
+
+        return result;
+    }
+};
+
 /**
  * this handles 2 cases:
  * - only string, example: "string"
  * - mixed string and tokens, example: [12, 34, "string", 56, 78]
  */
-static llama_tokens tokenize_mixed(const llama_vocab * vocab, const json & json_prompt, bool add_special, bool parse_special) {
+static llama_tokens tokenize_mixed(const llama_vocab * vocab, const json & json_prompt, bool add_special, bool parse_special, server_tokenize_cache * cache = nullptr) {
     // If `add_bos` is true, we only add BOS, when json_prompt is a string,
     // or the first element of the json_prompt array is a string.
     llama_tokens prompt_tokens;
@@ -180,7 +453,11 @@ static llama_tokens tokenize_mixed(const llama_vocab * vocab, const json & json_
         }
     } else {
         auto s = json_prompt.template get<std::string>();
-        prompt_tokens = common_tokenize(vocab, s, add_special, parse_special);
+        if (cache && parse_special) {
+            prompt_tokens = cache->tokenize(s, add_special);
+        } else {
+            prompt_tokens = common_tokenize(vocab, s, add_special, parse_special);
+        }
     }
 
     return prompt_tokens;
@@ -197,28 +474,41 @@ static llama_tokens tokenize_mixed(const llama_vocab * vocab, const json & json_
  * - "prompt": ["string1", [12, 34, 56]]
  * - "prompt": [[12, 34, 56], [78, 90, 12]]
  * - "prompt": [[12, 34, "string", 56, 78], [12, 34, 56]]
+ * multiple prompts are tokenized with up to n_threads threads
+ * a single string prompt goes through the cache of the recent prompts, if any
  */
-static std::vector<llama_tokens> tokenize_input_prompts(const llama_vocab * vocab, const json & json_prompt, bool add_special, bool parse_special) {
+static std::vector<llama_tokens> tokenize_input_prompts(const llama_vocab * vocab, const json & json_prompt, bool add_special, bool parse_special, int n_threads = 1, server_tokenize_cache * cache = nullptr) {
     std::vector<llama_tokens> result;
     if (json_prompt.is_string() || json_is_array_of_mixed_numbers_strings(json_prompt)) {
         // string or mixed
-        result.push_back(tokenize_mixed(vocab, json_prompt, add_special, parse_special));
+        result.push_back(tokenize_mixed(vocab, json_prompt, add_special, parse_special, cache));
     } else if (json_is_array_of_numbers(json_prompt)) {
         // array of tokens
         result.push_back(json_prompt.get<llama_tokens>());
     } else if (json_prompt.is_array()) {
         // array of prompts
-        result.reserve(json_prompt.size());
         for (const auto & p : json_prompt) {
-            if (p.is_string() || json_is_array_of_mixed_numbers_strings(p)) {
-                result.push_back(tokenize_mixed(vocab, p, add_special, parse_special));
-            } else if (json_is_array_of_numbers(p)) {
-                // array of tokens
-                result.push_back(p.get<llama_tokens>());
-            } else {
+            if (!p.is_string() && !json_is_array_of_mixed_numbers_strings(p) && !json_is_array_of_numbers(p)) {
                 throw std::runtime_error("element of \"prompt\" must be a string, an list of tokens, or a list of mixed strings & tokens");
             }
         }
+
+        result.resize(json_prompt.size());
+
+        // only worth using several threads for larger numbers of prompts
+        const int n_min_per_thread = 8;
+
+        n_threads = std::max(1, std::min(n_threads, (int) result.size() / n_min_per_thread));
+
+        common_thread_pool_for(result.size(), n_threads, [&](int i) {
+            const auto & p = json_prompt[i];
+            if (json_is_array_of_numbers(p)) {
+                // array of tokens
+                result[i] = p.get<llama_tokens>();
+            } else {
+                result[i] = tokenize_mixed(vocab, p, add_special, parse_special);
+            }
+        });
     } else {
         throw std::runtime_error("\"prompt\" must be a string, an list of tokens, a list of mixed strings & tokens, or a list of prompts");
     }
@@ -490,13 +780,9 @@ static std::string gen_tool_call_id() {
 // other common utils
 //
 
-// TODO: reuse llama_detokenize
-template <class Iter>
-static std::string tokens_to_str(llama_context * ctx, Iter begin, Iter end) {
+static std::string tokens_to_str(llama_context * ctx, const llama_tokens & tokens) {
     std::string ret;
-    for (; begin != end; ++begin) {
-        ret += common_token_to_piece(ctx, *begin);
-    }
+    common_detokenize_append(llama_model_get_vocab(llama_get_model(ctx)), tokens.data(), tokens.size(), ret);
 
     return ret;
 }
@@ -528,6 +814,84 @@ static bool server_sent_event(httplib::DataSink & sink, const char * event, cons
     return sink.write(str.c_str(), str.size());
 }
 
+// append an event to out, same format as server_sent_event()
+static void server_sent_event_append(std::string & out, const char * event, const json & data) {
+    out += event;
+    out += ": ";
+    out += data.dump(-1, ' ', false, json::error_handler_t::replace);
+    out += "\n\n";
+}
+
+// append str to out as a JSON string, escaped the same way as json::dump()
+// returns false if str is not valid UTF-8, the caller can then fall back to json::dump() that replaces the invalid bytes
+static bool json_append_str(std::string & out, const std::string & str) {
+    static const char * hex = "0123456789abcdef";
+
+    out += '"';
+
+    const size_t n = str.size();
+    for (size_t i = 0; i < n; ) {
+        const uint8_t c = str[i];
+
+        if (c < 0x80) {
+            switch (c) {
+                case '"':  out += "\\\""; break;
+                case '\\': out += "\\\\"; break;
+                case '\b': out += "\\b"; break;
+                case '\f': out += "\\f"; break;
+                case '\n': out += "\\n"; break;
+                case '\r': out += "\\r"; break;
+                case '\t': out += "\\t"; break;
+                default:
+                    if (c < 0x20) {
+                        out += "\\u00";
+                        out += hex[c >> 4];
+                        out += hex[c & 0xf];
+                    } else {
+                        out += (char) c;
+                    }
+            }
+            i++;
+            continue;
+        }
+
+        // well-formed UTF-8 sequences, see table 3-7 of the Unicode standard
+        size_t len = 0;
+        uint8_t lo = 0x80;
+        uint8_t hi = 0xbf;
+        if (c >= 0xc2 && c <= 0xdf) {
+            len = 2;
+        } else if (c >= 0xe0 && c <= 0xef) {
+            len = 3;
+            lo = c == 0xe0 ? 0xa0 : 0x80;
+            hi = c == 0xed ? 0x9f : 0xbf;
+        } else if (c >= 0xf0 && c <= 0xf4) {
+            len = 4;
+            lo = c == 0xf0 ? 0x90 : 0x80;
+            hi = c == 0xf4 ? 0x8f : 0xbf;
+        } else {
+            return false;
+        }
+
+        if (i + len > n) {
+            return false;
+        }
+        for (size_t j = 1; j < len; ++j) {
+            const uint8_t cc = str[i + j];
+            if (cc < (j == 1 ? lo : 0x80) || cc > (j == 1 ? hi : 0xbf)) {
+                return false;
+            }
+        }
+
+        out.append(str, i, len);
+        i += len;
+    }
+
+    out += '"';
+
+    return true;
+}
+
 //
 // OAI utils
 //
@@ -549,8 +913,8 @@ static json oaicompat_completion_params_parse(const json & body) {
 
     // Handle "n" field
     int n_choices = json_value(body, "n", 1);
-    if (n_choices != 1) {
-        throw std::runtime_error("Only one completion choice is allowed");
+    if (n_choices < 1) {
+        throw std::runtime_error("n must be at least 1");
     }
 
     // Handle "echo" field
@@ -823,8 +1187,8 @@ static json oaicompat_chat_params_parse(
 
     // Handle "n" field
     int n_choices = json_value(body, "n", 1);
-    if (n_choices != 1) {
-        throw std::runtime_error("Only one completion choice is allowed");
+    if (n_choices < 1) {
+        throw std::runtime_error("n must be at least 1");
     }
 
     // Handle "logprobs" field
@@ -1001,7 +1365,10 @@ static std::string safe_json_to_str(const json & data) {
     return data.dump(-1, ' ', false, json::error_handler_t::replace);
 }
 
-static std::vector<llama_token_data> get_token_probabilities(llama_context * ctx, int idx) {
+// get the n_probs most probable tokens of the idx-th output, sorted by descending probability
+// the probabilities are normalized over the full vocabulary, but only the selected tokens are sorted
+// if p_tok is not null, it is set to the probability of the token tok
+static std::vector<llama_token_data> get_token_probabilities(llama_context * ctx, int idx, size_t n_probs, llama_token tok = LLAMA_TOKEN_NULL, float * p_tok = nullptr) {
     std::vector<llama_token_data> cur;
     const auto * logits = llama_get_logits_ith(ctx, idx);
 
@@ -1010,26 +1377,35 @@ static std::vector<llama_token_data> get_token_probabilities(llama_context * ctx
 
     const int n_vocab = llama_vocab_n_tokens(vocab);
 
+    float max_l = -INFINITY;
+
     cur.resize(n_vocab);
     for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
         cur[token_id] = llama_token_data{token_id, logits[token_id], 0.0f};
+        max_l = std::max(max_l, logits[token_id]);
     }
 
-    // sort tokens by logits
-    std::sort(cur.begin(), cur.end(), [](const llama_token_data & a, const llama_token_data & b) {
-        return a.logit > b.logit;
-    });
-
-    // apply softmax
-    float max_l = cur[0].logit;
+    // softmax denominator
     float cum_sum = 0.0f;
-    for (size_t i = 0; i < cur.size(); ++i) {
-        float p = expf(cur[i].logit - max_l);
-        cur[i].p = p;
-        cum_sum += p;
+    for (int i = 0; i < n_vocab; ++i) {
+        cum_sum += expf(logits[i] - max_l);
     }
-    for (size_t i = 0; i < cur.size(); ++i) {
-        cur[i].p /= cum_sum;
+
+    if (p_tok && tok >= 0 && tok < n_vocab) {
+        *p_tok = expf(logits[tok] - max_l) / cum_sum;
+    }
+
+    // select the top tokens with the top-k sampler (partial sort) instead of sorting the whole vocabulary
+    llama_token_data_array cur_p = { cur.data(), cur.size(), -1, false };
+
+    llama_sampler * smpl = llama_sampler_init_top_k(std::min<size_t>(n_probs, n_vocab));
+    llama_sampler_apply(smpl, &cur_p);
+    llama_sampler_free(smpl);
+
+    cur.resize(cur_p.size);
+
+    for (auto & td : cur) {
+        td.p = expf(td.logit - max_l) / cum_sum;
     }
 
     return cur;
@@ -1081,6 +1457,73 @@ static std::vector<common_adapter_lora_info> parse_lora_request(
 // (may need to refactor in near future)
 //
 
+/**
+ * server_mtmd_cache is an LRU cache of the encoded embeddings of image and audio chunks, shared by all slots.
+ * the entries are keyed by the chunk id, which is the hash of the media content (see fnv_hash),
+ * so a media that is sent again skips the encoder.
+ */
+struct server_mtmd_cache {
+    struct entry {
+        std::string id;
+        std::vector<float> embd;
+    };
+
+    size_t n_max  = 0; // capacity in bytes, 0 = disabled
+    size_t n_size = 0;
+
+    // most recently used first
+    std::list<entry> entries;
+    std::unordered_map<std::string, std::list<entry>::iterator> map;
+
+    size_t n_hit  = 0;
+    size_t n_miss = 0;
+
+    void init(size_t n_max_bytes) {
+        n_max = n_max_bytes;
+    }
+
+    bool enabled() const {
+        return n_max > 0;
+    }
+
+    bool has(const std::string & id) const {
+        return map.count(id) > 0;
+    }
+
+    std::vector<float> * get(const std::string & id) {
+        auto it = map.find(id);
+        if (it == map.end()) {
+            n_miss++;
+            return nullptr;
+        }
+
+        n_hit++;
+        entries.splice(entries.begin(), entries, it->second);
+
+        return &it->second->embd;
+    }
+
+    // returns nullptr if the embeddings do not fit in the cache
+    std::vector<float> * put(const std::string & id, std::vector<float> && embd) {
+        const size_t size = embd.size()*sizeof(float);
+        if (size > n_max || map.count(id)) {
+            return nullptr;
+        }
+
+        while (n_size + size > n_max) {
+            n_size -= entries.back().embd.size()*sizeof(float);
+            map.erase(entries.back().id);
+            entries.pop_back();
+        }
+
+        entries.push_front({ id, std::move(embd) });
+        map[id] = entries.begin();
+        n_size += size;
+
+        return &entries.front().embd;
+    }
+};
+
 /**
  * server_tokens is a helper to manage the input tokens and image for the server.
  * it is made this way to simplify the logic of KV cache management.
@@ -1116,6 +1559,17 @@ public:
     server_tokens(server_tokens&&) = default;
     server_tokens& operator=(server_tokens&&) = default;
 
+    // explicit deep copy, e.g. for the n completions of a prompt
+    server_tokens clone() const {
+        server_tokens res;
+        res.has_mtmd = has_mtmd;
+        res.tokens   = tokens;
+        for (const auto & it : map_pos_to_media) {
+            res.map_pos_to_media[it.first] = mtmd::input_chunk_ptr(mtmd_input_chunk_copy(it.second.get()));
+        }
+        return res;
+    }
+
     // Allow accessing elements using [] operator
     llama_token operator[](size_t index) { return tokens[index]; }
     const llama_token& operator[](size_t index) const { return tokens[index]; }
@@ -1186,10 +1640,11 @@ public:
         }
     }
 
-    // for compatibility with context shift and prompt truncation
+    // append text tokens, e.g. the accepted draft of speculative decoding
     void insert(const llama_tokens & inp_tokens) {
-        GGML_ASSERT(!has_mtmd); // only allow this if mtmd is disabled
-        tokens.insert(tokens.end(), inp_tokens.begin(), inp_tokens.end());
+        for (const llama_token tok : inp_tokens) {
+            push_back(tok);
+        }
     }
 
     // for compatibility with speculative decoding, ctx shift, slot save/load
@@ -1198,6 +1653,16 @@ public:
         return tokens;
     }
 
+    // the text tokens after the last media chunk, all of them without media
+    // the speculative drafts are made from these, as the draft model or the n-grams cannot see the media
+    llama_tokens get_text_tokens_after_media() const {
+        size_t i0 = 0;
+        for (const auto & it : map_pos_to_media) {
+            i0 = std::max(i0, (size_t) it.first + mtmd_input_chunk_get_n_pos(it.second.get()));
+        }
+        return llama_tokens(tokens.begin() + std::min(i0, tokens.size()), tokens.end());
+    }
+
     // for compatibility with speculative decoding
     void set_token(llama_pos pos, llama_token id) {
         GGML_ASSERT(!has_mtmd); // only allow this if mtmd is disabled
@@ -1228,11 +1693,15 @@ public:
             // n  1   2   3   4   5   6      7      8      9      10
             // allowed to resize      ^                    ^
             // disallowed to resize          ^      ^             ^
-            if (n > 0) {
-                llama_token last_token = tokens[n - 1];
-                // make sure we never remove tokens in the middle of an image
-                if (last_token == LLAMA_TOKEN_NULL) {
-                    find_chunk(n - 1); // will throw an error if the token is not begin-of-chunk
+            // make sure we never remove tokens in the middle of an image
+            // note: the tokens after n may be left over from a cache reuse shift, so only the kept ones are checked
+            if (n > 0 && tokens[n - 1] == LLAMA_TOKEN_NULL) {
+                for (const auto & it : map_pos_to_media) {
+                    const size_t pos   = it.first;
+                    const size_t n_pos = mtmd_input_chunk_get_n_pos(it.second.get());
+                    if (pos < n && n < pos + n_pos) {
+                        throw std::runtime_error("Cannot remove a part of a media chunk");
+                    }
                 }
             }
             // remove all image chunks that are not used anymore
@@ -1260,34 +1729,68 @@ public:
     }
 
     size_t get_common_prefix(const server_tokens & b) const {
-        size_t max_idx = std::min(tokens.size(), b.tokens.size());
-        for (size_t i = 0; i < max_idx; ++i) {
-            auto & ai =   tokens[i];
-            auto & bi = b.tokens[i];
+        return get_common_prefix(b, 0, 0);
+    }
+
+    // the number of equal positions from i0 in this and from j0 in b, e.g. for the chunks of the cache reuse
+    // a media chunk is equal to another one with the same id, and only as a whole
+    size_t get_common_prefix(const server_tokens & b, size_t i0, size_t j0) const {
+        size_t n = 0;
+        while (i0 + n < tokens.size() && j0 + n < b.tokens.size()) {
+            const llama_token ai =   tokens[i0 + n];
+            const llama_token bi = b.tokens[j0 + n];
 
             if (ai == LLAMA_TOKEN_NULL && bi == LLAMA_TOKEN_NULL) {
                 GGML_ASSERT(has_mtmd);
-                const auto & a_chunk =   find_chunk(i);
-                const auto & b_chunk = b.find_chunk(i);
-                GGML_ASSERT(a_chunk && b_chunk);
-                std::string ai_id  = mtmd_input_chunk_get_id(a_chunk.get());
-                std::string bi_id  = mtmd_input_chunk_get_id(b_chunk.get());
-                size_t a_pos       = mtmd_input_chunk_get_n_pos(a_chunk.get());
-                size_t b_pos       = mtmd_input_chunk_get_n_pos(b_chunk.get());
-                if (ai_id == bi_id && a_pos == b_pos) {
-                    GGML_ASSERT(a_pos > 0 && "Invalid media chunk"); // should never happen
-                    i += a_pos - 1; // will be +1 by the for loop
-                    continue;
-                } else {
-                    return i;
+                const auto a_it =   map_pos_to_media.find((llama_pos) (i0 + n));
+                const auto b_it = b.map_pos_to_media.find((llama_pos) (j0 + n));
+                if (a_it == map_pos_to_media.end() || b_it == b.map_pos_to_media.end()) {
+                    return n; // the middle of a chunk
+                }
+                const std::string a_id = mtmd_input_chunk_get_id(a_it->second.get());
+                const std::string b_id = mtmd_input_chunk_get_id(b_it->second.get());
+                const size_t a_pos     = mtmd_input_chunk_get_n_pos(a_it->second.get());
+                const size_t b_pos     = mtmd_input_chunk_get_n_pos(b_it->second.get());
+                if (a_id != b_id || a_pos != b_pos) {
+                    return n;
                 }
+                GGML_ASSERT(a_pos > 0 && "Invalid media chunk"); // should never happen
+                n += a_pos;
             } else if (ai == bi) {
-                continue;
+                n++;
             } else {
-                return i;
+                return n;
             }
         }
-        return max_idx; // all tokens are equal
+        return n;
+    }
+
+    // move the n positions from src to dst <= src, the positions in between are left as they are
+    // for the cache reuse, which shifts the KV cells of the positions in the same way
+    void move(size_t src, size_t dst, size_t n) {
+        GGML_ASSERT(dst <= src && src + n <= tokens.size());
+        if (dst == src || n == 0) {
+            return;
+        }
+        if (has_mtmd) {
+            // the chunks of the source range, then the chunks that are overwritten
+            std::vector<std::pair<llama_pos, mtmd::input_chunk_ptr>> moved;
+            for (auto it = map_pos_to_media.begin(); it != map_pos_to_media.end(); ) {
+                const size_t pos = it->first;
+                if (pos >= src && pos < src + n) {
+                    moved.emplace_back((llama_pos) (pos - (src - dst)), std::move(it->second));
+                    it = map_pos_to_media.erase(it);
+                } else if (pos >= dst && pos < dst + n) {
+                    it = map_pos_to_media.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+            for (auto & it : moved) {
+                map_pos_to_media[it.first] = std::move(it.second);
+            }
+        }
+        std::copy(tokens.begin() + src, tokens.begin() + src + n, tokens.begin() + dst);
     }
 
     // make sure all text tokens are within the vocab range
@@ -1314,12 +1817,16 @@ public:
     }
 
     // encode and decode the image chunk
+    // if a cache is provided, the embeddings of the chunk are looked up first and stored after encoding
+    // embd_enc are the embeddings of the chunk if it was already encoded (e.g. on a worker thread)
     int32_t process_chunk(
                 llama_context * ctx,
                 mtmd_context * mctx,
                 llama_pos n_past,
                 int32_t seq_id,
-                llama_pos & n_pos_out) {
+                llama_pos & n_pos_out,
+                server_mtmd_cache * cache = nullptr,
+                std::vector<float> * embd_enc = nullptr) {
         auto & chunk = find_chunk(n_past);
         const char * name = mtmd_input_chunk_get_type(chunk.get()) == MTMD_INPUT_CHUNK_TYPE_IMAGE
                             ? "image" : "audio";
@@ -1327,13 +1834,51 @@ public:
         int32_t n_batch = llama_n_batch(ctx);
         int64_t t0 = ggml_time_ms();
         llama_pos new_n_past = n_past;
-        int32_t result = mtmd_helper_eval_chunk_single(mctx, ctx,
-            chunk.get(),
-            n_past,
-            seq_id,
-            n_batch,
-            true, // logits last
-            &new_n_past);
+        int32_t result = 0;
+        const char * id = mtmd_input_chunk_get_id(chunk.get());
+        const bool use_cache = cache && cache->enabled() && id;
+        if (use_cache || embd_enc) {
+            std::vector<float> * embd = use_cache ? cache->get(id) : nullptr;
+            std::vector<float> embd_tmp;
+            if (embd) {
+                SRV_INF("%s embeddings found in cache\n", name);
+            } else if (embd_enc) {
+                embd = use_cache ? cache->put(id, std::move(*embd_enc)) : nullptr;
+                if (!embd) {
+                    embd = embd_enc;
+                }
+            } else {
+                result = mtmd_encode_chunk(mctx, chunk.get());
+                if (result != 0) {
+                    LOG_ERR("mtmd_encode_chunk failed with status %d", result);
+                    n_pos_out = n_past;
+                    return result;
+                }
+                const size_t n_embd = mtmd_input_chunk_get_n_tokens(chunk.get()) * llama_model_n_embd(llama_get_model(ctx));
+                const float * out = mtmd_get_output_embd(mctx);
+                embd_tmp.assign(out, out + n_embd);
+                embd = cache->put(id, std::move(embd_tmp));
+                if (!embd) {
+                    // too large for the cache
+                    embd = &embd_tmp;
+                }
+            }
+            result = mtmd_helper_decode_image_chunk(mctx, ctx,
+                chunk.get(),
+                embd->data(),
+                n_past,
+                seq_id,
+                n_batch,
+                &new_n_past);
+        } else {
+            result = mtmd_helper_eval_chunk_single(mctx, ctx,
+                chunk.get(),
+                n_past,
+                seq_id,
+                n_batch,
+                true, // logits last
+                &new_n_past);
+        }
         SRV_INF("%s processed in %" PRId64 " ms\n", name, ggml_time_ms() - t0);
         if (result != 0) {
             LOG_ERR("mtmd_helper_eval failed with status %d", result);
@@ -1345,6 +1890,196 @@ public:
     }
 };
 
+/**
+ * server_prefix_cache is a radix tree of the token prefixes that are currently stored in the KV cache.
+ * each node of the tree keeps the set of sequences (slots) whose cached tokens contain the path from the root to the node.
+ * it is used to find a slot that already holds the prefix of a new prompt, so that the KV cells can be shared with seq_cp
+ * instead of re-processing the prefix.
+ */
+struct server_prefix_cache {
+    struct node {
+        llama_tokens edge; // tokens on the edge from the parent to this node
+
+        std::map<llama_token, std::unique_ptr<node>> children; // keyed by the first token of the child edge
+
+        std::set<llama_seq_id> seqs; // sequences that contain the full path to this node
+
+        int64_t t_last_used = -1; // last time the prefix was shared with another sequence
+    };
+
+    node root;
+
+    size_t n_nodes = 0;
+
+    // add the tokens cached by seq_id to the tree
+    // note: the previous tokens of seq_id must have been removed with remove()
+    void insert(llama_seq_id seq_id, const llama_tokens & tokens, int64_t t_now) {
+        node * cur = &root;
+
+        size_t i = 0;
+        while (i < tokens.size()) {
+            auto it = cur->children.find(tokens[i]);
+            if (it == cur->children.end()) {
+                auto child = std::make_unique<node>();
+                child->edge.assign(tokens.begin() + i, tokens.end());
+                child->seqs.insert(seq_id);
+                child->t_last_used = t_now;
+                cur->children[tokens[i]] = std::move(child);
+                n_nodes++;
+                return;
+            }
+
+            node * child = it->second.get();
+
+            size_t n_match = 0;
+            while (n_match < child->edge.size() && i + n_match < tokens.size() && child->edge[n_match] == tokens[i + n_match]) {
+                n_match++;
+            }
+
+            if (n_match < child->edge.size()) {
+                // split the edge at the first mismatch
+                auto mid = std::make_unique<node>();
+                mid->edge.assign(child->edge.begin(), child->edge.begin() + n_match);
+                mid->seqs        = child->seqs;
+                mid->t_last_used = child->t_last_used;
+
+                child->edge.erase(child->edge.begin(), child->edge.begin() + n_match);
+
+                const llama_token key = child->edge[0];
+                mid->children[key] = std::move(it->second);
+                it->second = std::move(mid);
+                n_nodes++;
+
+                child = it->second.get();
+            }
+
+            child->seqs.insert(seq_id);
+            cur = child;
+            i  += n_match;
+        }
+    }
+
+    // remove seq_id from all nodes and prune the branches that are no longer referenced by any sequence
+    void remove(llama_seq_id seq_id) {
+        remove_impl(root, seq_id);
+    }
+
+    // find the longest prefix of tokens that is held by a sequence accepted by the filter
+    // returns the length of the prefix and sets seq_src to the sequence holding it
+    size_t find(const llama_tokens & tokens, const std::function<bool(llama_seq_id)> & filter, llama_seq_id & seq_src, int64_t t_now) {
+        seq_src = -1;
+
+        size_t n_best = 0;
+
+        std::vector<node *> path;
+
+        node * cur = &root;
+
+        size_t i = 0;
+        while (i < tokens.size()) {
+            auto it = cur->children.find(tokens[i]);
+            if (it == cur->children.end()) {
+                break;
+            }
+
+            node * child = it->second.get();
+
+            llama_seq_id seq_cur = -1;
+            for (const auto s : child->seqs) {
+                if (filter(s)) {
+                    seq_cur = s;
+                    break;
+                }
+            }
+
+            // the sequences of the children are a subset of the sequences of the parent
+            if (seq_cur == -1) {
+                break;
+            }
+
+            size_t n_match = 0;
+            while (n_match < child->edge.size() && i + n_match < tokens.size() && child->edge[n_match] == tokens[i + n_match]) {
+                n_match++;
+            }
+
+            i += n_match;
+
+            n_best  = i;
+            seq_src = seq_cur;
+
+            path.push_back(child);
+
+            if (n_match < child->edge.size()) {
+                break;
+            }
+
+            cur = child;
+        }
+
+        if (n_best > 0) {
+            for (auto * n : path) {
+                n->t_last_used = t_now;
+            }
+        }
+
+        return n_best;
+    }
+
+    // the last time a prefix that is held only by seq_id was shared
+    // used to avoid evicting the slots that are the sole owner of a hot prefix
+    int64_t t_last_used_excl(llama_seq_id seq_id) const {
+        int64_t res = -1;
+        t_last_used_excl_impl(root, seq_id, res);
+        return res;
+    }
+
+    void clear() {
+        root.children.clear();
+        n_nodes = 0;
+    }
+
+private:
+    void remove_impl(node & cur, llama_seq_id seq_id) {
+        for (auto it = cur.children.begin(); it != cur.children.end(); ) {
+            node & child = *it->second;
+            if (child.seqs.erase(seq_id) == 0) {
+                ++it;
+                continue;
+            }
+
+            if (child.seqs.empty()) {
+                n_nodes -= count_nodes(child);
+                it = cur.children.erase(it);
+                continue;
+            }
+
+            remove_impl(child, seq_id);
+            ++it;
+        }
+    }
+
+    void t_last_used_excl_impl(const node & cur, llama_seq_id seq_id, int64_t & res) const {
+        for (const auto & it : cur.children) {
+            const node & child = *it.second;
+            if (child.seqs.count(seq_id) == 0) {
+                continue;
+            }
+            if (child.seqs.size() == 1) {
+                res = std::max(res, child.t_last_used);
+            }
+            t_last_used_excl_impl(child, seq_id, res);
+        }
+    }
+
+    static size_t count_nodes(const node & cur) {
+        size_t res = 1;
+        for (const auto & it : cur.children) {
+            res += count_nodes(*it.second);
+        }
+        return res;
+    }
+};
+
 // Computes FNV-1a hash of the data
 static std::string fnv_hash(const uint8_t * data, size_t len) {
     const uint64_t fnv_prime = 0x100000001b3ULL;
@@ -1356,3 +2091,142 @@ static std::string fnv_hash(const uint8_t * data, size_t len) {
     }
     return std::to_string(hash);
 }
+
+/**
+ * server_kv_chunk_cache is an LRU cache of the KV cells of prompt chunks (e.g. retrieved documents), shared by all slots.
+ * the entries are keyed by the hash of the chunk tokens and hold the state of the cells saved with llama_state_seq_get_data_range,
+ * so the chunk can be added at any position of another prompt with llama_state_seq_set_data_shift instead of being processed again.
+ */
+struct server_kv_chunk_cache {
+    struct entry {
+        std::string  key;
+        llama_tokens tokens;
+        llama_pos    pos; // position of the first token when the cells were saved
+
+        std::vector<uint8_t> data;
+    };
+
+    size_t n_max  = 0; // capacity in bytes, 0 = disabled
+    size_t n_size = 0;
+
+    // most recently used first
+    std::list<entry> entries;
+    std::unordered_map<std::string, std::list<entry>::iterator> map;
+
+    size_t n_hit  = 0;
+    size_t n_miss = 0;
+
+    void init(size_t n_max_bytes) {
+        n_max = n_max_bytes;
+    }
+
+    bool enabled() const {
+        return n_max > 0;
+    }
+
+    static std::string key_of(const llama_tokens & tokens) {
+        return fnv_hash((const uint8_t *) tokens.data(), tokens.size()*sizeof(llama_token));
+    }
+
+    bool has(const llama_tokens & tokens) const {
+        const auto it = map.find(key_of(tokens));
+
+        return it != map.end() && it->second->tokens == tokens;
+    }
+
+    const entry * get(const llama_tokens & tokens) {
+        const auto it = map.find(key_of(tokens));
+        if (it == map.end() || it->second->tokens != tokens) {
+            n_miss++;
+            return nullptr;
+        }
+
+        n_hit++;
+        entries.splice(entries.begin(), entries, it->second);
+
+        return &*it->second;
+    }
+
+    // returns false if the data does not fit in the cache
+    bool put(const llama_tokens & tokens, llama_pos pos, std::vector<uint8_t> && data) {
+        const std::string key = key_of(tokens);
+        if (data.size() > n_max || map.count(key)) {
+            return false;
+        }
+
+        while (n_size + data.size() > n_max) {
+            n_size -= entries.back().data.size();
+            map.erase(entries.back().key);
+            entries.pop_back();
+        }
+
+        n_size += data.size();
+
+        entries.push_front({ key, tokens, pos, std::move(data) });
+        map[key] = entries.begin();
+
+        return true;
+    }
+};
+
+//
+// cache-aware routing (--router)
+//
+
+// size in bytes of the blocks of the request text hashed for the cache digest, same for the router and the replicas
+#define SERVER_PREFIX_BLOCK 256
+
+// the text of a request that the prompt starts with, in a form that does not depend on the chat template:
+// the tools and the role and content of each message for chat requests, the prompt (or the infill extra context and prefix) otherwise
+static std::string server_prefix_text(const json & body) {
+    const auto append = [](std::string & text, const json & value) {
+        text += value.is_string() ? value.get<std::string>() : value.dump();
+    };
+
+    std::string text;
+
+    if (body.contains("tools")) {
+        append(text, body.at("tools"));
+        text += "\n";
+    }
+    if (body.contains("messages") && body.at("messages").is_array()) {
+        for (const auto & msg : body.at("messages")) {
+            text += json_value(msg, "role", std::string());
+            text += "\n";
+            if (msg.contains("content") && !msg.at("content").is_null()) {
+                append(text, msg.at("content"));
+            }
+            text += "\n";
+        }
+    }
+    if (body.contains("prompt")) {
+        append(text, body.at("prompt"));
+    }
+    if (body.contains("input_extra")) {
+        append(text, body.at("input_extra"));
+    }
+    if (body.contains("input_prefix")) {
+        append(text, body.at("input_prefix"));
+    }
+
+    return text;
+}
+
+// FNV-1a hashes of the prefixes of the text that end at a block boundary: two texts that share n full blocks share their first n hashes
+static std::vector<uint64_t> server_prefix_hashes(const std::string & text) {
+    const uint64_t fnv_prime = 0x100000001b3ULL;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    std::vector<uint64_t> hashes;
+    hashes.reserve(text.size() / SERVER_PREFIX_BLOCK);
+
+    for (size_t i = 0; i < text.size(); ++i) {
+        hash ^= (uint8_t) text[i];
+        hash *= fnv_prime;
+        if ((i + 1) % SERVER_PREFIX_BLOCK == 0) {
+            hashes.push_back(hash);
+        }
+    }
+
+    return hashes;
+}
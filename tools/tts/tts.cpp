@@ -10,6 +10,7 @@
 #include <nlohmann/json.hpp>
 
 #include <algorithm>
+#include <cinttypes>
 #include <cmath>
 #include <cstdio>
 #include <fstream>
@@ -89,28 +90,60 @@ struct wav_header {
     uint32_t data_size;
 };
 
-static bool save_wav16(const std::string & fname, const std::vector<float> & data, int sample_rate) {
-    std::ofstream file(fname, std::ios::binary);
-    if (!file) {
-        LOG_ERR("%s: Failed to open file '%s' for writing.\n", __func__, fname.c_str());
-        return false;
+// 16-bit PCM wav file, written as the samples come - the sizes in the header are set when the file is closed
+struct wav_writer {
+    std::ofstream file;
+    wav_header    header;
+
+    bool open(const std::string & fname, int sample_rate) {
+        file.open(fname, std::ios::binary);
+        if (!file) {
+            LOG_ERR("%s: Failed to open file '%s' for writing.\n", __func__, fname.c_str());
+            return false;
+        }
+
+        header.sample_rate = sample_rate;
+        header.byte_rate = header.sample_rate * header.num_channels * (header.bits_per_sample / 8);
+        header.block_align = header.num_channels * (header.bits_per_sample / 8);
+        header.data_size = 0;
+        header.chunk_size = 36 + header.data_size;
+
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+        return file.good();
     }
 
-    wav_header header;
-    header.sample_rate = sample_rate;
-    header.byte_rate = header.sample_rate * header.num_channels * (header.bits_per_sample / 8);
-    header.block_align = header.num_channels * (header.bits_per_sample / 8);
-    header.data_size = data.size() * (header.bits_per_sample / 8);
-    header.chunk_size = 36 + header.data_size;
+    void write(const float * data, size_t n) {
+        std::vector<int16_t> pcm(n);
+        for (size_t i = 0; i < n; ++i) {
+            pcm[i] = static_cast<int16_t>(std::clamp(data[i] * 32767.0, -32768.0, 32767.0));
+        }
+        file.write(reinterpret_cast<const char*>(pcm.data()), n * sizeof(int16_t));
+        file.flush();
+
+        header.data_size += n * (header.bits_per_sample / 8);
+    }
 
-    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    bool close() {
+        header.chunk_size = 36 + header.data_size;
 
-    for (const auto & sample : data) {
-        int16_t pcm_sample = static_cast<int16_t>(std::clamp(sample * 32767.0, -32768.0, 32767.0));
-        file.write(reinterpret_cast<const char*>(&pcm_sample), sizeof(pcm_sample));
+        file.seekp(0);
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.close();
+
+        return !file.fail();
     }
+};
 
-    return file.good();
+static bool save_wav16(const std::string & fname, const std::vector<float> & data, int sample_rate) {
+    wav_writer writer;
+    if (!writer.open(fname, sample_rate)) {
+        return false;
+    }
+
+    writer.write(data.data(), data.size());
+
+    return writer.close();
 }
 
 static void fill_hann_window(int length, bool periodic, float * output) {
@@ -162,119 +195,120 @@ static void irfft(int n, const float * inp_cplx, float * out_real) {
     }
 }
 
+//
+// inverse STFT of the vocoder output, computed incrementally:
 //
 //  y = torch.nn.functional.fold(
 //       data, output_size=(1, output_size), kernel_size=(1, self.win_length), stride=(1, self.hop_length),
 //  )[:, 0, 0, pad:-pad]
 //
-// data.shape =  torch.Size([1, 1280, 261])
-// output_size =  84480
-// win_length =  1280
-// hop_length =  320
-// pad =  480
+// the frames are overlap-added as they come, and the samples that no later frame overlaps are returned
 //
-static void fold(const std::vector<float> & data, int64_t n_out, int64_t n_win, int64_t n_hop, int64_t n_pad, std::vector<float> & output) {
-    int64_t output_height = n_out;
-    int64_t kernel_w = n_win;
-    int64_t stride_w = n_hop;
-    int64_t width    = n_out;
-
-    output.resize(width, 0.0f);
-
-    int64_t col_idx = 0;
-    for (int64_t w_col = 0; w_col < width; ++w_col) {
-        int64_t start = w_col * stride_w - n_pad;
-        int64_t end   = start + kernel_w;
-
-        for (int64_t w_im = start; w_im < end; ++w_im) {
-            if (w_im >= 0 && w_im < output_height && col_idx < (int64_t) data.size()) {
-                output[w_im] += data[col_idx];
-            }
-            col_idx++;
-        }
-    }
+struct audio_stream {
+    static constexpr int n_fft = 1280;
+    static constexpr int n_hop = 320;
+    static constexpr int n_win = 1280;
+    static constexpr int n_pad = (n_win - n_hop)/2;
 
-    output.resize(n_out - 2 * n_pad);
-}
+    std::vector<float> hann;
 
-// TODO: not optimized at all
-static std::vector<float> embd_to_audio(
-        const float * embd,
-        const int n_codes,
-        const int n_embd,
-        const int n_thread) {
-    const int n_fft = 1280;
-    const int n_hop = 320;
-    const int n_win = 1280;
-    const int n_pad = (n_win - n_hop)/2;
-    const int n_out = (n_codes - 1)*n_hop + n_win;
-
-    std::vector<float> hann(n_fft);
-
-    fill_hann_window(hann.size(), true, hann.data());
-
-    int n_spec = n_embd*n_codes;
+    // overlap-add of the windowed frames and of the squared windows, from the sample n_done
+    std::vector<float> ola;
+    std::vector<float> env;
 
-    std::vector<float> E (n_spec);
-    std::vector<float> S (n_spec);
-    std::vector<float> ST(n_spec);
+    int64_t n_frames = 0;
+    int64_t n_done   = 0;
 
-    for (int l = 0; l < n_codes; ++l) {
-        for (int k = 0; k < n_embd; ++k) {
-            E[k*n_codes + l] = embd[l*n_embd + k];
-        }
+    audio_stream() : hann(n_fft) {
+        fill_hann_window(hann.size(), true, hann.data());
     }
 
-    for (int k = 0; k < n_embd/2; ++k) {
+    // add n_codes frames of spectrum and append the completed samples to audio
+    void add(const float * embd, int n_codes, int n_embd, int n_thread, std::vector<float> & audio) {
+        std::vector<float> ST (n_codes*n_embd);
+        std::vector<float> res(n_codes*n_fft);
+
+        // magnitude and phase -> complex spectrum
         for (int l = 0; l < n_codes; ++l) {
-            float mag = E[(k           )*n_codes + l];
-            float phi = E[(k + n_embd/2)*n_codes + l];
+            for (int k = 0; k < n_embd/2; ++k) {
+                float mag = embd[l*n_embd + k];
+                float phi = embd[l*n_embd + k + n_embd/2];
 
-            mag = exp(mag);
+                mag = exp(mag);
 
-            if (mag > 1e2) {
-                mag = 1e2;
+                if (mag > 1e2) {
+                    mag = 1e2;
+                }
+                ST[l*n_embd + 2*k + 0] = mag*cosf(phi);
+                ST[l*n_embd + 2*k + 1] = mag*sinf(phi);
             }
-            S[2*(k*n_codes + l) + 0] = mag*cosf(phi);
-            S[2*(k*n_codes + l) + 1] = mag*sinf(phi);
         }
-    }
 
-    for (int l = 0; l < n_codes; ++l) {
-        for (int k = 0; k < n_embd/2; ++k) {
-            ST[l*n_embd + 2*k + 0] = S[2*(k*n_codes + l) + 0];
-            ST[l*n_embd + 2*k + 1] = S[2*(k*n_codes + l) + 1];
-        }
-    }
+        n_thread = std::max(1, std::min(n_thread, n_codes));
 
-    std::vector<float> res  (n_codes*n_fft);
-    std::vector<float> hann2(n_codes*n_fft);
-
-    std::vector<std::thread> workers(n_thread);
-    for (int i = 0; i < n_thread; ++i) {
-        workers[i] = std::thread([&, i]() {
-            for (int l = i; l < n_codes; l += n_thread) {
-                irfft(n_fft, ST.data() + l*n_embd, res.data() + l*n_fft);
-                for (int j = 0; j < n_fft; ++j) {
-                    res  [l*n_fft + j] *= hann[j];
-                    hann2[l*n_fft + j]  = hann[j] * hann[j];
+        std::vector<std::thread> workers(n_thread);
+        for (int i = 0; i < n_thread; ++i) {
+            workers[i] = std::thread([&, i]() {
+                for (int l = i; l < n_codes; l += n_thread) {
+                    irfft(n_fft, ST.data() + l*n_embd, res.data() + l*n_fft);
+                    for (int j = 0; j < n_fft; ++j) {
+                        res[l*n_fft + j] *= hann[j];
+                    }
                 }
+            });
+        }
+        for (int i = 0; i < n_thread; ++i) {
+            workers[i].join();
+        }
+
+        for (int l = 0; l < n_codes; ++l, ++n_frames) {
+            const int64_t t0 = n_frames*n_hop - n_pad;
+
+            ola.resize(t0 + n_win - n_done, 0.0f);
+            env.resize(t0 + n_win - n_done, 0.0f);
+
+            for (int j = std::max<int64_t>(0, -t0); j < n_win; ++j) {
+                ola[t0 + j - n_done] += res[l*n_fft + j];
+                env[t0 + j - n_done] += hann[j] * hann[j];
             }
-        });
+        }
+
+        // the next frame starts at this sample
+        emit(n_frames*n_hop - n_pad, audio);
     }
-    for (int i = 0; i < n_thread; ++i) {
-        workers[i].join();
+
+    // append the remaining samples to audio, the output has n_hop samples per frame
+    void finish(std::vector<float> & audio) {
+        emit(n_frames*n_hop, audio);
     }
 
-    std::vector<float> audio;
-    std::vector<float> env;
+    void emit(int64_t n_end, std::vector<float> & audio) {
+        const int64_t n = std::min<int64_t>(n_end - n_done, ola.size());
+        if (n <= 0) {
+            return;
+        }
 
-    fold(res,   n_out, n_win, n_hop, n_pad, audio);
-    fold(hann2, n_out, n_win, n_hop, n_pad, env); // TODO: can be done once
+        for (int64_t i = 0; i < n; ++i) {
+            audio.push_back(ola[i] / env[i]);
+        }
+
+        ola.erase(ola.begin(), ola.begin() + n);
+        env.erase(env.begin(), env.begin() + n);
 
-    for (size_t i = 0; i < audio.size(); ++i) {
-        audio[i] /= env[i];
+        n_done += n;
     }
+};
+
+static std::vector<float> embd_to_audio(
+        const float * embd,
+        const int n_codes,
+        const int n_embd,
+        const int n_thread) {
+    std::vector<float> audio;
+
+    audio_stream stream;
+    stream.add(embd, n_codes, n_embd, n_thread, audio);
+    stream.finish(audio);
 
     return audio;
 }
@@ -666,6 +700,77 @@ lovely<|t_0.56|><|code_start|><|634|><|596|><|1766|><|1556|><|1306|><|1285|><|14
         audio_data = audio_data_from_speaker(speaker, tts_version);
     }
 
+    const int n_sr = 24000; // sampling rate
+
+    // streaming: vocode the audio codes in chunks while they are generated, and write the audio as it comes
+    const int n_stream_chunk = n_parallel == 1 ? params.vocoder.stream_chunk : 0;
+    if (params.vocoder.stream_chunk > 0 && n_parallel > 1) {
+        LOG_WRN("%s: streaming is not supported with n_parallel > 1, the audio will be generated at the end\n", __func__);
+    }
+
+    // the codes vocoded together with each chunk on both sides, the vocoder is not causal
+    const int n_stream_overlap = 16;
+
+    std::vector<llama_token> codes_audio; // the audio codes generated so far, minus the first audio token
+    int n_vocoded = 0;                   // the audio codes already turned into audio
+
+    audio_stream stream;
+    wav_writer   stream_wav;
+    int64_t      n_stream_samples = 0;
+    int64_t      t_first_audio_us = 0;
+
+    if (n_stream_chunk > 0 && !stream_wav.open(params.out_file, n_sr)) {
+        return ENOENT;
+    }
+
+    // vocode the codes [n_vocoded, n_end), with up to n_stream_overlap codes of context on each side
+    auto stream_vocode = [&](bool last) -> bool {
+        const int n_avail = codes_audio.size();
+        const int n_end   = last ? n_avail : n_avail - n_stream_overlap;
+        if (n_end <= n_vocoded) {
+            return true;
+        }
+
+        const int i0 = std::max(0, n_vocoded - n_stream_overlap);
+
+        llama_batch batch = llama_batch_init(n_avail - i0, 0, 1);
+        for (int i = i0; i < n_avail; ++i) {
+            common_batch_add(batch, codes_audio[i], i - i0, { 0 }, true);
+        }
+
+        const int ret = llama_encode(ctx_cts, batch);
+        llama_batch_free(batch);
+
+        if (ret != 0) {
+            LOG_ERR("%s: llama_encode() failed\n", __func__);
+            return false;
+        }
+
+        const int     n_embd = llama_model_n_embd(model_cts);
+        const float * embd   = llama_get_embeddings(ctx_cts) + (size_t) (n_vocoded - i0)*n_embd;
+
+        std::vector<float> audio;
+        stream.add(embd, n_end - n_vocoded, n_embd, params.cpuparams.n_threads, audio);
+        if (last) {
+            stream.finish(audio);
+        }
+        n_vocoded = n_end;
+
+        // zero out first 0.25 seconds
+        for (int64_t i = n_stream_samples; i < std::min<int64_t>(n_stream_samples + audio.size(), n_sr/4); ++i) {
+            audio[i - n_stream_samples] = 0.0f;
+        }
+
+        if (!audio.empty() && t_first_audio_us == 0) {
+            t_first_audio_us = ggml_time_us();
+        }
+
+        stream_wav.write(audio.data(), audio.size());
+        n_stream_samples += audio.size();
+
+        return true;
+    };
+
     // process prompt and generate voice codes
     {
         LOG_INF("%s: constructing prompt ..\n", __func__);
@@ -896,6 +1001,14 @@ lovely<|t_0.56|><|code_start|><|634|><|596|><|1766|><|1556|><|1306|><|1285|><|14
 
                 codes.push_back(new_token_id);
 
+                if (n_stream_chunk > 0 && new_token_id >= 151672 && new_token_id <= 155772) {
+                    codes_audio.push_back(new_token_id - 151672);
+
+                    if ((int) codes_audio.size() >= n_vocoded + n_stream_chunk + n_stream_overlap && !stream_vocode(false)) {
+                        return 1;
+                    }
+                }
+
                 const auto * cands = common_sampler_get_candidates(smpl[i]);
 
                 // is it an end of generation? -> mark the stream as finished
@@ -1000,6 +1113,27 @@ lovely<|t_0.56|><|code_start|><|634|><|596|><|1766|><|1556|><|1306|><|1285|><|14
         LOG_INF("%s: codes size: %d\n", __func__, (int) codes.size());
     }
 
+    if (n_stream_chunk > 0) {
+        if (!stream_vocode(true)) {
+            return 1;
+        }
+
+        LOG_INF("%s: time to first audio:   %.3f ms\n", __func__, (t_first_audio_us - t_main_start) / 1000.0f);
+        LOG_INF("%s: total time:            %.3f ms\n", __func__, (ggml_time_us() - t_main_start) / 1000.0f);
+
+        int retval = 0;
+
+        if (stream_wav.close()) {
+            LOG_INF("%s: audio written to file '%s' (%" PRId64 " samples)\n", __func__, params.out_file.c_str(), n_stream_samples);
+        } else {
+            retval = ENOENT;
+        }
+
+        llama_backend_free();
+
+        return retval;
+    }
+
     // remove all non-audio tokens (i.e. < 151672 || > 155772)
     codes.erase(std::remove_if(codes.begin(), codes.end(), [](llama_token t) { return t < 151672 || t > 155772; }), codes.end());
 
@@ -1070,8 +1204,6 @@ lovely<|t_0.56|><|code_start|><|634|><|596|><|1766|><|1556|><|1306|><|1285|><|14
     }
 #endif
 
-    const int n_sr = 24000; // sampling rate
-
     // zero out first 0.25 seconds
     for (int i = 0; i < 24000/4; ++i) {
         audio[i] = 0.0f;